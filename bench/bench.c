@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2023 Free Software Foundation, Inc.
+ *
+ * This file is part of GNU Wget.
+ *
+ * GNU Wget is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GNU Wget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wget.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Micro-benchmarks of the parsers and core data structures of Wget.
+
+   Each benchmark makes passes over its inputs, most of them the files
+   of a fuzz corpus read in the order of their names, until a round of
+   passes has lasted long enough to be timed.  The best of several
+   rounds is reported, as operations and bytes per second, so that the
+   numbers can be compared from one build to the next.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "utils.h"
+#include "init.h"
+#include "ptimer.h"
+#include "exits.h"
+
+#include "bench.h"
+
+#ifndef FUZZDIR
+# define FUZZDIR "../fuzz"
+#endif
+
+extern const char *program_name; /* Needed by lib/error.c. */
+
+static const char *corpora_dir = FUZZDIR;
+static double min_round_time = 0.2;
+static int rounds = 5;
+
+static int
+compare_names (const void *a, const void *b)
+{
+  return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+/* Read the files of the corpus NAME into DATA, sorted by file name.  */
+
+static bool
+read_corpus (const char *name, struct bench_data *data)
+{
+  char *dirname = aprintf ("%s/%s.in", corpora_dir, name);
+  char **names = NULL;
+  size_t count = 0, size = 0, i;
+  struct dirent *dp;
+  DIR *dirp;
+
+  dirp = opendir (dirname);
+  if (!dirp)
+    {
+      fprintf (stderr, "%s: cannot read %s\n", program_name, dirname);
+      xfree (dirname);
+      return false;
+    }
+  while ((dp = readdir (dirp)))
+    {
+      if (*dp->d_name == '.')
+        continue;
+      if (count == size)
+        {
+          size = size ? size * 2 : 256;
+          names = xrealloc (names, size * sizeof (char *));
+        }
+      names[count++] = xstrdup (dp->d_name);
+    }
+  closedir (dirp);
+  if (count)
+    qsort (names, count, sizeof (char *), compare_names);
+
+  data->items = xnew_array (struct bench_item, count ? count : 1);
+  data->count = 0;
+  for (i = 0; i < count; i++)
+    {
+      char *file = aprintf ("%s/%s", dirname, names[i]);
+      struct file_memory *fm = wget_read_file (file);
+
+      if (fm)
+        {
+          struct bench_item *item = &data->items[data->count++];
+
+          item->data = xmalloc (fm->length + 1);
+          memcpy (item->data, fm->content, fm->length);
+          item->data[fm->length] = '\0';
+          item->size = fm->length;
+          data->bytes += fm->length;
+          wget_read_file_free (fm);
+        }
+      xfree (file);
+      xfree (names[i]);
+    }
+  xfree (names);
+  xfree (dirname);
+  data->ops = data->count;
+  return true;
+}
+
+static void
+free_data (struct bench_data *data)
+{
+  size_t i;
+
+  for (i = 0; i < data->count; i++)
+    xfree (data->items[i].data);
+  xfree (data->items);
+}
+
+/* Run benchmark B and print its best round.  */
+
+static void
+run_bench (const struct bench_case *b)
+{
+  struct bench_data data;
+  struct ptimer *timer;
+  double best = 0;
+  long passes = 1;
+  int round;
+
+  xzero (data);
+  if (b->corpus && !read_corpus (b->corpus, &data))
+    return;
+  if (b->setup)
+    b->setup (&data);
+
+  timer = ptimer_new ();
+
+  /* Find how many passes make a round long enough to time, starting
+     with one pass, which also warms the caches up.  */
+  for (;;)
+    {
+      double elapsed, factor;
+      long i;
+
+      ptimer_reset (timer);
+      for (i = 0; i < passes; i++)
+        b->pass (&data);
+      elapsed = ptimer_measure (timer);
+      if (elapsed >= min_round_time)
+        break;
+      /* Aim a little past the mark, growing at most a thousandfold
+         when the round was too short to be timed at all.  */
+      factor = elapsed > 0 ? min_round_time / elapsed * 1.2 : 1000;
+      passes = (long) (passes * MIN (factor, 1000)) + 1;
+    }
+
+  for (round = 0; round < rounds; round++)
+    {
+      double elapsed;
+      long i;
+
+      ptimer_reset (timer);
+      for (i = 0; i < passes; i++)
+        b->pass (&data);
+      elapsed = ptimer_measure (timer) / passes;
+      if (round == 0 || elapsed < best)
+        best = elapsed;
+    }
+  ptimer_destroy (timer);
+
+  if (best <= 0)
+    best = ptimer_resolution ();
+  printf ("%-22s %12.0f ops/s", b->name, data.ops / best);
+  if (data.bytes)
+    printf (" %10.2f MB/s", data.bytes / best / (1024 * 1024));
+  printf ("\n");
+  fflush (stdout);
+
+  if (b->teardown)
+    b->teardown (&data);
+  free_data (&data);
+}
+
+/* Whether benchmark NAME is among the ARGC names of ARGV, all of them
+   being run when none is given.  */
+
+static bool
+selected_p (const char *name, int argc, char **argv)
+{
+  int i;
+
+  if (!argc)
+    return true;
+  for (i = 0; i < argc; i++)
+    if (!strcmp (argv[i], name))
+      return true;
+  return false;
+}
+
+static void
+usage (void)
+{
+  printf ("Usage: %s [-d CORPORA-DIR] [-t SECONDS] [-r ROUNDS] [BENCHMARK...]\n",
+          program_name);
+  exit (WGET_EXIT_GENERIC_ERROR);
+}
+
+int
+main (int argc, char **argv)
+{
+  const struct bench_case *groups[] = { bench_parsers, bench_core };
+  const struct bench_case *b;
+  size_t g;
+  int i;
+
+  program_name = argv[0];
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+      if (!strcmp (argv[i], "-d") && i + 1 < argc)
+        corpora_dir = argv[++i];
+      else if (!strcmp (argv[i], "-t") && i + 1 < argc)
+        min_round_time = strtod (argv[++i], NULL);
+      else if (!strcmp (argv[i], "-r") && i + 1 < argc)
+        rounds = atoi (argv[++i]);
+      else
+        usage ();
+    }
+  if (min_round_time <= 0 || rounds < 1)
+    usage ();
+
+  defaults ();
+  opt.quiet = true;
+  opt.verbose = 0;
+
+  for (g = 0; g < countof (groups); g++)
+    for (b = groups[g]; b->name; b++)
+      if (selected_p (b->name, argc - i, argv + i))
+        run_bench (b);
+
+  return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2023 Free Software Foundation, Inc.
+ *
+ * This file is part of GNU Wget.
+ *
+ * GNU Wget is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GNU Wget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wget.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+
+/* One input of a benchmark, most often a file of a fuzz corpus.  */
+struct bench_item
+{
+  char *data;                   /* NUL-terminated */
+  size_t size;
+};
+
+/* The inputs of a benchmark and what its setup made of them.  */
+struct bench_data
+{
+  struct bench_item *items;
+  size_t count;
+
+  /* The operations and bytes one pass stands for; these default to
+     the number and size of the items.  */
+  size_t ops;
+  size_t bytes;
+
+  void *state;
+};
+
+struct bench_case
+{
+  const char *name;
+  const char *corpus;           /* fuzz corpus to read, or NULL */
+  void (*setup) (struct bench_data *);
+  void (*pass) (struct bench_data *);
+  void (*teardown) (struct bench_data *);
+};
+
+extern const struct bench_case bench_parsers[];
+extern const struct bench_case bench_core[];
+
+#endif /* BENCH_H */
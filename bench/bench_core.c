@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2023 Free Software Foundation, Inc.
+ *
+ * This file is part of GNU Wget.
+ *
+ * GNU Wget is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GNU Wget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wget.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Benchmarks of the core data structures and of reading and digesting
+   data.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "hash.h"
+#include "connect.h"
+#include "retr.h"
+#include "warc.h"
+
+#include "bench.h"
+
+/* The URLs stored in the hash table, as the ones a recursive
+   retrieval keeps track of.  */
+#define HASH_KEYS 100000
+
+static void
+hash_setup (struct bench_data *data)
+{
+  char **keys = xnew_array (char *, HASH_KEYS);
+  size_t i;
+
+  for (i = 0; i < HASH_KEYS; i++)
+    keys[i] = aprintf ("http://host%lu.example.com/dir/%lu.html",
+                       (unsigned long) (i % 97), (unsigned long) i);
+  data->state = keys;
+  data->ops = 2 * HASH_KEYS;
+}
+
+static void
+hash_pass (struct bench_data *data)
+{
+  char **keys = data->state;
+  struct hash_table *ht = make_string_hash_table (0);
+  size_t i;
+
+  for (i = 0; i < HASH_KEYS; i++)
+    hash_table_put (ht, keys[i], keys[i]);
+  for (i = 0; i < HASH_KEYS; i++)
+    if (hash_table_get (ht, keys[i]) != keys[i])
+      abort ();
+  hash_table_destroy (ht);
+}
+
+static void
+hash_teardown (struct bench_data *data)
+{
+  char **keys = data->state;
+  size_t i;
+
+  for (i = 0; i < HASH_KEYS; i++)
+    xfree (keys[i]);
+  xfree (keys);
+}
+
+/* A transport handing the item being read out in segments of
+   HUNK_SEGMENT bytes, as a socket would.  */
+#define HUNK_FD 99
+#define HUNK_SEGMENT 512
+
+struct hunk_source
+{
+  const char *data;
+  size_t size, pos;
+};
+
+static int
+hunk_peek (int fd _GL_UNUSED, char *buf, int bufsize, void *arg,
+           double timeout _GL_UNUSED)
+{
+  struct hunk_source *src = arg;
+  size_t n = MIN (src->size - src->pos, (size_t) MIN (bufsize, HUNK_SEGMENT));
+
+  memcpy (buf, src->data + src->pos, n);
+  return n;
+}
+
+static int
+hunk_read (int fd _GL_UNUSED, char *buf, int bufsize, void *arg,
+           double timeout _GL_UNUSED)
+{
+  struct hunk_source *src = arg;
+  size_t n = MIN (src->size - src->pos, (size_t) MIN (bufsize, HUNK_SEGMENT));
+
+  memcpy (buf, src->data + src->pos, n);
+  src->pos += n;
+  return n;
+}
+
+static int
+hunk_write (int fd _GL_UNUSED, char *buf _GL_UNUSED, int bufsize,
+            void *arg _GL_UNUSED)
+{
+  return bufsize;
+}
+
+static int
+hunk_poll (int fd _GL_UNUSED, double timeout _GL_UNUSED,
+           int wait_for _GL_UNUSED, void *arg _GL_UNUSED)
+{
+  return 1;
+}
+
+static const char *
+hunk_errstr (int fd _GL_UNUSED, void *arg _GL_UNUSED)
+{
+  return "Success";
+}
+
+static void
+hunk_close (int fd _GL_UNUSED, void *arg _GL_UNUSED)
+{
+}
+
+static struct transport_implementation hunk_transport = {
+  hunk_read, hunk_write, hunk_poll, hunk_peek, hunk_errstr, hunk_close,
+  NULL, NULL, NULL
+};
+
+/* A copy of response_head_terminator of http.c, but for telling
+   HTTP/0.9 responses apart, so that the whole corpus is read as
+   heads.  */
+static const char *
+head_terminator (const char *start, const char *peeked, int peeklen)
+{
+  const char *p, *end;
+
+  p = peeked - start < 2 ? start : peeked - 2;
+  end = peeked + peeklen;
+
+  for (; p < end - 2; p++)
+    if (*p == '\n')
+      {
+        if (p[1] == '\r' && p[2] == '\n')
+          return p + 3;
+        else if (p[1] == '\n')
+          return p + 2;
+      }
+  if (peeklen >= 2 && p[0] == '\n' && p[1] == '\n')
+    return p + 2;
+
+  return NULL;
+}
+
+static void
+read_hunk_setup (struct bench_data *data)
+{
+  struct hunk_source *src = xnew0 (struct hunk_source);
+
+  fd_register_transport (HUNK_FD, &hunk_transport, src);
+  data->state = src;
+}
+
+static void
+read_hunk_pass (struct bench_data *data)
+{
+  struct hunk_source *src = data->state;
+  size_t i;
+  char *hunk;
+
+  for (i = 0; i < data->count; i++)
+    {
+      src->data = data->items[i].data;
+      src->size = data->items[i].size;
+      src->pos = 0;
+      while (src->pos < src->size)
+        {
+          size_t pos = src->pos;
+
+          hunk = fd_read_hunk (HUNK_FD, head_terminator, 512, 65536);
+          xfree (hunk);
+          if (src->pos == pos)
+            break;
+        }
+    }
+}
+
+static void
+read_hunk_teardown (struct bench_data *data)
+{
+  connect_cleanup ();
+  xfree (data->state);
+}
+
+/* The record digested, with the offset of its payload.  */
+#define WARC_RECORD_SIZE (4 * 1024 * 1024)
+#define WARC_PAYLOAD_OFFSET 512
+
+static void
+warc_setup (struct bench_data *data)
+{
+  FILE *fp = tmpfile ();
+  unsigned int seed = 1;
+  size_t i;
+
+  if (!fp)
+    abort ();
+  for (i = 0; i < WARC_RECORD_SIZE; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      putc (seed >> 16, fp);
+    }
+  data->state = fp;
+  data->ops = 1;
+  data->bytes = WARC_RECORD_SIZE;
+}
+
+static void
+warc_pass (struct bench_data *data)
+{
+  FILE *fp = data->state;
+  char block[20], payload[20];  /* SHA-1 digests */
+
+  rewind (fp);
+  if (warc_sha1_stream_with_payload (fp, block, payload,
+                                     WARC_PAYLOAD_OFFSET) != 0)
+    abort ();
+}
+
+static void
+warc_teardown (struct bench_data *data)
+{
+  fclose (data->state);
+}
+
+const struct bench_case bench_core[] = {
+  { "hash_table", NULL, hash_setup, hash_pass, hash_teardown },
+  { "fd_read_hunk", "wget_read_hunk_fuzzer",
+    read_hunk_setup, read_hunk_pass, read_hunk_teardown },
+  { "warc_sha1_payload", NULL, warc_setup, warc_pass, warc_teardown },
+  { NULL }
+};
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2023 Free Software Foundation, Inc.
+ *
+ * This file is part of GNU Wget.
+ *
+ * GNU Wget is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GNU Wget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wget.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Benchmarks of the parsers, run on the fuzz corpora.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "url.h"
+#include "html-url.h"
+#include "css-url.h"
+#include "ftp.h"
+#include "cookies.h"
+#include "res.h"
+
+#include "bench.h"
+
+static void
+url_parse_pass (struct bench_data *data)
+{
+  size_t i;
+
+  for (i = 0; i < data->count; i++)
+    {
+      struct url *u = url_new_init ();
+
+      u->ori_url = xstrdup (data->items[i].data);
+      url_parse (u, true, false);
+      url_free (u);
+    }
+}
+
+static void
+url_escape_pass (struct bench_data *data)
+{
+  size_t i;
+
+  for (i = 0; i < data->count; i++)
+    free (url_escape (data->items[i].data));
+}
+
+/* The URL the documents of the HTML and CSS corpora are taken to be
+   retrieved from.  */
+
+static void
+document_setup (struct bench_data *data)
+{
+  struct url *u = url_new_init ();
+
+  u->ori_url = xstrdup ("https://x.y/dir/index.html");
+  u->ori_enc = xstrdup ("iso-8859-1");
+  u->content_enc = xstrdup ("iso-8859-1");
+  url_parse (u, true, true);
+  data->state = u;
+}
+
+static void
+document_teardown (struct bench_data *data)
+{
+  url_free (data->state);
+}
+
+static void
+html_pass (struct bench_data *data)
+{
+  size_t i;
+
+  for (i = 0; i < data->count; i++)
+    {
+      struct file_memory fm;
+
+      fm.content = data->items[i].data;
+      fm.length = data->items[i].size;
+      fm.mmap_p = 0;
+      free_urlpos (get_urls_html_fm ("index.html", &fm, data->state, NULL));
+    }
+}
+
+static void
+css_pass (struct bench_data *data)
+{
+  size_t i;
+
+  for (i = 0; i < data->count; i++)
+    {
+      struct file_memory fm;
+
+      fm.content = data->items[i].data;
+      fm.length = data->items[i].size;
+      fm.mmap_p = 0;
+      free_urlpos (get_urls_css_fm ("style.css", &fm, data->state));
+    }
+}
+
+static void
+ftp_parse_ls_pass (struct bench_data *data)
+{
+  size_t i;
+
+  for (i = 0; i < data->count; i++)
+    freefileinfo (ftp_parse_ls_mem (data->items[i].data,
+                                    data->items[i].size, ST_UNIX));
+}
+
+/* The cookie jar holds the cookies of the corpus, set for a single
+   host; the benchmark is the lookup of those to send.  */
+
+static void
+cookie_setup (struct bench_data *data)
+{
+  struct cookie_jar *jar = cookie_jar_new ();
+  size_t i;
+
+  for (i = 0; i < data->count; i++)
+    cookie_handle_set_cookie (jar, "x", 80, "p/d/", data->items[i].data);
+  data->state = jar;
+  data->bytes = 0;
+}
+
+static void
+cookie_header_pass (struct bench_data *data)
+{
+  size_t i;
+
+  for (i = 0; i < data->ops; i++)
+    free (cookie_header (data->state, "x", 80, "p/d/index.html", false));
+}
+
+static void
+cookie_teardown (struct bench_data *data)
+{
+  cookie_jar_delete (data->state);
+}
+
+/* The paths each robots.txt of the corpus is matched against.  */
+static const char *robots_paths[] = {
+  "index.html", "dir/page.html?q=1", "cgi-bin/search", "a%ff%a"
+};
+
+static void
+robots_setup (struct bench_data *data)
+{
+  struct robot_specs **specs = xnew_array (struct robot_specs *,
+                                           data->count + 1);
+  size_t i;
+
+  for (i = 0; i < data->count; i++)
+    {
+      char host[32];
+
+      specs[i] = res_parse (data->items[i].data, (int) data->items[i].size);
+      /* Let res_cleanup free them.  */
+      snprintf (host, sizeof (host), "h%lu", (unsigned long) i);
+      res_register_specs (host, 80, specs[i]);
+    }
+  data->state = specs;
+  data->ops = data->count * countof (robots_paths);
+  data->bytes = 0;
+}
+
+static void
+res_match_path_pass (struct bench_data *data)
+{
+  struct robot_specs **specs = data->state;
+  size_t i, j;
+
+  for (i = 0; i < data->count; i++)
+    for (j = 0; j < countof (robots_paths); j++)
+      res_match_path (specs[i], robots_paths[j]);
+}
+
+static void
+robots_teardown (struct bench_data *data)
+{
+  res_cleanup ();
+  xfree (data->state);
+}
+
+const struct bench_case bench_parsers[] = {
+  { "url_parse", "wget_url_fuzzer", NULL, url_parse_pass, NULL },
+  { "url_escape", "wget_url_fuzzer", NULL, url_escape_pass, NULL },
+  { "html_tags", "wget_html_fuzzer",
+    document_setup, html_pass, document_teardown },
+  { "get_urls_css", "wget_css_fuzzer",
+    document_setup, css_pass, document_teardown },
+  { "ftp_parse_ls", "wget_ftpls_fuzzer", NULL, ftp_parse_ls_pass, NULL },
+  { "cookie_header", "wget_cookie_fuzzer",
+    cookie_setup, cookie_header_pass, cookie_teardown },
+  { "res_match_path", "wget_robots_fuzzer",
+    robots_setup, res_match_path_pass, robots_teardown },
+  { NULL }
+};
@@ -0,0 +1,598 @@
+/* The cache of the HTTP/3 alternatives servers announce.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "altsvc.h"
+#include "utils.h"
+#include "hash.h"
+#include "init.h"               /* for ajoin_dir_file */
+#include "c-ctype.h"
+#include "c-strcase.h"
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+
+/* A server reachable over HTTP/3 says so in the Alt-Svc header of its
+   HTTP/1.1 and HTTP/2 responses (RFC 7838):
+
+     Alt-Svc: h3=":443"; ma=86400, h3-29=":443"
+
+   The first "h3" alternative is kept for the origin, the host and port
+   the response came from, until the max-age runs out.  A later Alt-Svc
+   header replaces it, and "clear" or a header without an HTTP/3
+   alternative removes it.  An alternative that couldn't be connected
+   to is not tried again for ALTSVC_BROKEN_TIME, even if it is
+   announced again in the meantime.
+
+   Like the HSTS database, the cache is kept across runs, in
+   ~/.wget-altsvc or the file given with --altsvc-file.  It is read on
+   first use and written back at exit if anything changed, with one
+   line per origin:
+
+     <host> TAB <port> TAB <alt-host> TAB <alt-port> TAB <expires> TAB
+     <broken-until>
+
+   where the alternative's host is "-" if it is that of the origin.  */
+
+/* The max-age of an alternative that doesn't give one, and the longest
+   one honored.  */
+#define ALTSVC_DEFAULT_MAX_AGE (24 * 60 * 60)
+#define ALTSVC_MAX_AGE (365 * 24 * 60 * 60)
+
+/* How long an alternative that failed is left alone.  */
+#define ALTSVC_BROKEN_TIME (60 * 60)
+
+struct altsvc_entry {
+  char *host;                   /* the alternative, NULL for the origin */
+  int port;
+  time_t expires;
+  time_t broken_until;          /* 0 unless it failed */
+};
+
+/* The entries by "<host>:<port>" of their origin.  */
+static struct hash_table *entries;
+static bool loaded;
+static bool changed;
+
+static bool
+tchar_p (char c)
+{
+  return c_isalnum (c) || (c && strchr ("!#$%&'*+-.^_`|~", c));
+}
+
+static const char *
+skip_ows (const char *p)
+{
+  while (*p == ' ' || *p == '\t')
+    ++p;
+  return p;
+}
+
+/* Return a copy of the token or quoted string at *PP, unquoted, and
+   advance *PP past it.  Return NULL if there is neither.  */
+
+static char *
+parse_word (const char **pp)
+{
+  const char *p = *pp, *end;
+  char *word, *q;
+
+  if (*p != '"')
+    {
+      for (end = p; tchar_p (*end); end++)
+        ;
+      if (end == p)
+        return NULL;
+      *pp = end;
+      return strdupdelim (p, end);
+    }
+
+  for (end = p + 1; *end && *end != '"'; end++)
+    if (*end == '\\' && end[1])
+      ++end;
+  if (*end != '"')
+    return NULL;
+  word = q = xmalloc (end - p);
+  for (++p; p < end; p++)
+    {
+      if (*p == '\\')
+        ++p;
+      *q++ = *p;
+    }
+  *q = '\0';
+  *pp = end + 1;
+  return word;
+}
+
+/* Parse S, the authority of an alternative: "[<host>]:<port>", with
+   brackets around an IPv6 address.  *HOST is set to NULL if there is
+   no host, which means that of the origin.  */
+
+static bool
+parse_authority (const char *s, char **host, int *port)
+{
+  const char *hbeg = s, *hend, *colon;
+  char *end;
+  long n;
+
+  if (*s == '[')
+    {
+      hend = strchr (s, ']');
+      if (!hend || hend[1] != ':')
+        return false;
+      hbeg = s + 1;
+      colon = hend + 1;
+    }
+  else
+    {
+      colon = strchr (s, ':');
+      if (!colon || strchr (colon + 1, ':'))
+        return false;
+      hend = colon;
+    }
+
+  if (!c_isdigit (colon[1]))
+    return false;
+  errno = 0;
+  n = strtol (colon + 1, &end, 10);
+  if (*end || errno || n <= 0 || n > 65535)
+    return false;
+
+  *host = hend > hbeg ? strdupdelim (hbeg, hend) : NULL;
+  *port = n;
+  return true;
+}
+
+/* Parse VALUE, the value of an Alt-Svc header, and return true if it
+   offers an HTTP/3 alternative, setting *HOST and *PORT to the first
+   one and *MAX_AGE to how long it stays valid.  */
+
+static bool
+altsvc_parse (const char *value, char **host, int *port, long *max_age)
+{
+  const char *p = skip_ows (value);
+  char *proto = NULL, *authority = NULL, *name = NULL, *arg = NULL;
+
+  while (*p)
+    {
+      long ma = ALTSVC_DEFAULT_MAX_AGE;
+
+      proto = parse_word (&p);
+      if (!proto || *p != '=')
+        goto fail;
+      ++p;
+      authority = parse_word (&p);
+      if (!authority)
+        goto fail;
+
+      for (p = skip_ows (p); *p == ';'; p = skip_ows (p))
+        {
+          p = skip_ows (p + 1);
+          name = parse_word (&p);
+          if (!name || *p != '=')
+            goto fail;
+          ++p;
+          arg = parse_word (&p);
+          if (!arg)
+            goto fail;
+          if (0 == c_strcasecmp (name, "ma") && c_isdigit (*arg))
+            {
+              errno = 0;
+              ma = strtol (arg, NULL, 10);
+              if (errno || ma > ALTSVC_MAX_AGE)
+                ma = ALTSVC_MAX_AGE;
+            }
+          xfree (name);
+          xfree (arg);
+        }
+
+      if (0 == strcmp (proto, "h3")
+          && parse_authority (authority, host, port))
+        {
+          *max_age = ma;
+          xfree (proto);
+          xfree (authority);
+          return true;
+        }
+      xfree (proto);
+      xfree (authority);
+
+      if (*p != ',')
+        break;
+      p = skip_ows (p + 1);
+    }
+  return false;
+
+ fail:
+  xfree (proto);
+  xfree (authority);
+  xfree (name);
+  xfree (arg);
+  return false;
+}
+
+static void
+entry_free (struct altsvc_entry *e)
+{
+  xfree (e->host);
+  xfree (e);
+}
+
+/* Return the key of the origin HOST:PORT, to be freed.  */
+
+static char *
+origin_key (const char *host, int port)
+{
+  return aprintf ("%s:%d", host, port);
+}
+
+/* Replace the entry of the origin KEY, or remove it if E is NULL.  */
+
+static void
+entry_put (const char *key, struct altsvc_entry *e)
+{
+  char *old_key;
+  struct altsvc_entry *old;
+
+  if (hash_table_get_pair (entries, key, &old_key, &old))
+    {
+      hash_table_remove (entries, key);
+      xfree (old_key);
+      entry_free (old);
+    }
+  if (e)
+    hash_table_put (entries, xstrdup (key), e);
+  changed = true;
+}
+
+/* Parse LINE, a line of the cache file, and enter it.  */
+
+static bool
+entry_parse (const char *line, time_t now)
+{
+  char host[256], alt_host[256];
+  int port, alt_port;
+  long long expires, broken_until;
+  struct altsvc_entry *e;
+  char *key;
+
+  if (sscanf (line, "%255s\t%d\t%255s\t%d\t%lld\t%lld", host, &port,
+              alt_host, &alt_port, &expires, &broken_until) != 6
+      || port <= 0 || port > 65535 || alt_port <= 0 || alt_port > 65535)
+    return false;
+  if (expires <= now)
+    return true;
+
+  e = xnew0 (struct altsvc_entry);
+  e->host = strcmp (alt_host, "-") ? xstrdup (alt_host) : NULL;
+  e->port = alt_port;
+  e->expires = expires;
+  e->broken_until = broken_until > now ? broken_until : 0;
+  key = origin_key (host, port);
+  entry_put (key, e);
+  xfree (key);
+  return true;
+}
+
+static char *
+altsvc_file (void)
+{
+  if (opt.altsvc_file)
+    return xstrdup (opt.altsvc_file);
+  if (opt.homedir)
+    return ajoin_dir_file (opt.homedir, ".wget-altsvc");
+  return NULL;
+}
+
+/* Read the cache file on first use.  */
+
+static void
+altsvc_load (void)
+{
+  char *file, *line = NULL;
+  size_t bufsize = 0;
+  time_t now = time (NULL);
+  FILE *fp;
+
+  if (loaded)
+    return;
+  loaded = true;
+  entries = make_nocase_string_hash_table (0);
+
+  file = altsvc_file ();
+  if (!file)
+    return;
+  fp = fopen (file, "r");
+  if (fp)
+    {
+      DEBUGP (("Reading Alt-Svc entries from %s\n", file));
+      while (getline (&line, &bufsize, fp) > 0)
+        if (*line != '#' && *line != '\n' && !entry_parse (line, now))
+          DEBUGP (("Ignoring malformed line in %s: %s", file, line));
+      xfree (line);
+      fclose (fp);
+    }
+  xfree (file);
+  changed = false;
+}
+
+/* Record what VALUE, the Alt-Svc header of a response from HOST:PORT,
+   says of the HTTP/3 alternative of that origin.  */
+
+void
+altsvc_store (const char *host, int port, const char *value)
+{
+  struct altsvc_entry *e;
+  char *alt_host = NULL, *key;
+  int alt_port;
+  long max_age;
+  time_t now = time (NULL);
+
+  altsvc_load ();
+  key = origin_key (host, port);
+  e = hash_table_get (entries, key);
+
+  if (!altsvc_parse (value, &alt_host, &alt_port, &max_age)
+      || max_age == 0)
+    {
+      if (e)
+        {
+          DEBUGP (("Removing the HTTP/3 alternative of %s.\n", key));
+          entry_put (key, NULL);
+        }
+      xfree (alt_host);
+      xfree (key);
+      return;
+    }
+
+  if (alt_host && 0 == c_strcasecmp (alt_host, host))
+    xfree (alt_host);
+  if (e && e->port == alt_port
+      && (e->host && alt_host ? !c_strcasecmp (e->host, alt_host)
+          : e->host == alt_host))
+    {
+      /* Refreshed; a broken alternative stays so.  */
+      xfree (alt_host);
+      if (e->expires != now + max_age)
+        {
+          e->expires = now + max_age;
+          changed = true;
+        }
+    }
+  else
+    {
+      DEBUGP (("HTTP/3 alternative of %s: %s:%d\n", key,
+               alt_host ? alt_host : host, alt_port));
+      e = xnew0 (struct altsvc_entry);
+      e->host = alt_host;
+      e->port = alt_port;
+      e->expires = now + max_age;
+      entry_put (key, e);
+    }
+  xfree (key);
+}
+
+/* Return true if HOST:PORT has an HTTP/3 alternative worth trying, in
+   which case *ALT_HOST, to be freed, and *ALT_PORT are set to it.  */
+
+bool
+altsvc_lookup (const char *host, int port, char **alt_host, int *alt_port)
+{
+  struct altsvc_entry *e;
+  time_t now = time (NULL);
+  char *key;
+
+  altsvc_load ();
+  key = origin_key (host, port);
+  e = hash_table_get (entries, key);
+  if (e && e->expires <= now)
+    {
+      entry_put (key, NULL);
+      e = NULL;
+    }
+  xfree (key);
+  if (!e || e->broken_until > now)
+    return false;
+
+  *alt_host = xstrdup (e->host ? e->host : host);
+  *alt_port = e->port;
+  return true;
+}
+
+/* Note that the HTTP/3 alternative of HOST:PORT could not be used.  */
+
+void
+altsvc_broken (const char *host, int port)
+{
+  struct altsvc_entry *e;
+  char *key;
+
+  altsvc_load ();
+  key = origin_key (host, port);
+  e = hash_table_get (entries, key);
+  if (e)
+    {
+      e->broken_until = time (NULL) + ALTSVC_BROKEN_TIME;
+      changed = true;
+    }
+  xfree (key);
+}
+
+/* Write the cache back to its file if it changed.  The file is written
+   under another name and renamed into place, so that a concurrent run
+   reads the old entries or the new ones.  */
+
+void
+altsvc_save (void)
+{
+  hash_table_iterator iter;
+  char *file, *tmp;
+  FILE *fp;
+  bool ok;
+
+  if (!changed)
+    return;
+  file = altsvc_file ();
+  if (!file)
+    return;
+
+  tmp = aprintf ("%s.%ld.tmp", file, (long) getpid ());
+  fp = fopen (tmp, "w");
+  if (!fp)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot write %s: %s\n"), quote (tmp),
+                 strerror (errno));
+      xfree (tmp);
+      xfree (file);
+      return;
+    }
+
+  DEBUGP (("Saving Alt-Svc entries to %s\n", file));
+  fputs ("# HTTP/3 alternative services for GNU Wget.\n", fp);
+  fputs ("# <host>\t<port>\t<alt-host>\t<alt-port>\t<expires>"
+         "\t<broken-until>\n", fp);
+  for (hash_table_iterate (entries, &iter); hash_table_iter_next (&iter); )
+    {
+      const char *key = iter.key;
+      const struct altsvc_entry *e = iter.value;
+      const char *colon = strrchr (key, ':');
+
+      fprintf (fp, "%.*s\t%s\t%s\t%d\t%lld\t%lld\n", (int) (colon - key),
+               key, colon + 1, e->host ? e->host : "-", e->port,
+               (long long) e->expires, (long long) e->broken_until);
+    }
+  ok = !ferror (fp);
+  if (fclose (fp) != 0)
+    ok = false;
+  if (!ok || rename (tmp, file) != 0)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot write %s: %s\n"), quote (file),
+                 strerror (errno));
+      unlink (tmp);
+    }
+  else
+    changed = false;
+  xfree (tmp);
+  xfree (file);
+}
+
+void
+altsvc_cleanup (void)
+{
+  hash_table_iterator iter;
+
+  if (!entries)
+    return;
+  for (hash_table_iterate (entries, &iter); hash_table_iter_next (&iter); )
+    {
+      xfree (iter.key);
+      entry_free (iter.value);
+    }
+  hash_table_destroy (entries);
+  entries = NULL;
+  loaded = changed = false;
+}
+
+#ifdef TESTING
+
+const char *
+test_altsvc_parse (void)
+{
+  char *host = NULL;
+  int port = 0;
+  long ma = 0;
+  time_t now = 1700000000;
+  struct altsvc_entry *e;
+
+  mu_assert ("test_altsvc_parse: same host",
+             altsvc_parse ("h3=\":443\"; ma=3600; persist=1", &host, &port,
+                           &ma)
+             && !host && port == 443 && ma == 3600);
+
+  mu_assert ("test_altsvc_parse: first h3",
+             altsvc_parse ("h2=\"a.example:443\", h3-29=\":8443\", "
+                           "h3=\"alt.example:8443\", h3=\":443\"",
+                           &host, &port, &ma)
+             && host && !strcmp (host, "alt.example") && port == 8443
+             && ma == ALTSVC_DEFAULT_MAX_AGE);
+  xfree (host);
+
+  mu_assert ("test_altsvc_parse: IPv6",
+             altsvc_parse ("h3=\"[2001:db8::1]:443\"", &host, &port, &ma)
+             && host && !strcmp (host, "2001:db8::1") && port == 443);
+  xfree (host);
+
+  mu_assert ("test_altsvc_parse: quoted comma",
+             altsvc_parse ("h2=\":443\"; x=\"a, h3=\\\"b\", h3=\":9\"",
+                           &host, &port, &ma)
+             && !host && port == 9);
+
+  mu_assert ("test_altsvc_parse: huge max-age",
+             altsvc_parse ("h3=\":443\"; ma=99999999999999999999",
+                           &host, &port, &ma)
+             && ma == ALTSVC_MAX_AGE);
+
+  mu_assert ("test_altsvc_parse: clear",
+             !altsvc_parse ("clear", &host, &port, &ma));
+  mu_assert ("test_altsvc_parse: no h3",
+             !altsvc_parse ("h2=\":443\"", &host, &port, &ma));
+  mu_assert ("test_altsvc_parse: bad port",
+             !altsvc_parse ("h3=\":0\"", &host, &port, &ma)
+             && !altsvc_parse ("h3=\":443x\"", &host, &port, &ma)
+             && !altsvc_parse ("h3=\"::1:443\"", &host, &port, &ma));
+  mu_assert ("test_altsvc_parse: unterminated",
+             !altsvc_parse ("h3=\":443", &host, &port, &ma));
+
+  entries = make_nocase_string_hash_table (0);
+  mu_assert ("test_altsvc_parse: line",
+             entry_parse ("example.com\t443\t-\t8443\t1700003600\t0", now));
+  mu_assert ("test_altsvc_parse: expired line",
+             entry_parse ("old.example\t443\t-\t443\t1699999999\t0", now));
+  mu_assert ("test_altsvc_parse: bad line",
+             !entry_parse ("example.com\t443\t-", now));
+  e = hash_table_get (entries, "EXAMPLE.com:443");
+  mu_assert ("test_altsvc_parse: entry",
+             e && !e->host && e->port == 8443 && e->expires == 1700003600
+             && !hash_table_get (entries, "old.example:443"));
+  altsvc_cleanup ();
+
+  return NULL;
+}
+
+#endif /* TESTING */
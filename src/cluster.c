@@ -0,0 +1,925 @@
+/* Sharing a recursive retrieval among several Wget processes.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "cluster.h"
+#include "connect.h"
+#include "host.h"
+#include "url.h"
+#include "utils.h"
+#include "exits.h"
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+
+/* With --cluster, the nodes listed in it share the recursive
+   retrieval of the same start URLs.  Each host belongs to one of them,
+   chosen by a hash of its name, and each node only retrieves the URLs
+   of its own hosts: the links it finds to the hosts of another node
+   are forwarded to that one, which checks them against its own
+   blacklist and robots.txt before queueing them.
+
+   The nodes talk over TCP, every node connecting to each of the others
+   to send it lines of tab-separated fields:
+
+     N node                          the sending node, sent first
+     U tree depth flags url referer  a URL to retrieve
+     P tree wave                     a probe from node 0
+     S tree wave sent received       the answer to a probe
+     D tree                          the retrieval is complete
+     Q tree                          the retrieval was stopped
+     B tree                          the sender is leaving the cluster
+
+   TREE counts the start URLs, which are retrieved one after the other
+   by all the nodes; a line for a later one is kept until it begins.
+   The URLs for a node are sent in batches, after each document
+   retrieved or when enough are waiting.
+
+   A node that runs out of URLs cannot stop yet, as others may still
+   send it some.  Node 0 finds out when all are done by sending waves
+   of probes, which each node answers with the number of URLs it has
+   sent and received so far, once it has nothing left to retrieve or
+   send.  When two waves in a row give the same totals, with as many
+   URLs received as were sent, none can be on its way anymore, and
+   node 0 tells the others the retrieval is complete.  */
+
+/* How many URLs to send a node at most in a single write.  */
+#define CLUSTER_BATCH 64
+
+/* How many seconds to wait between attempts to connect to a node, and
+   how many attempts to make before giving up.  A node may be started
+   a little after the others.  */
+#define CLUSTER_RETRY_SECONDS 2
+#define CLUSTER_CONNECT_TRIES 30
+
+/* How long to wait for lines at once when idle, in seconds.  */
+#define CLUSTER_WAIT_INTERVAL 0.5
+
+struct cluster_node
+{
+  char *host;
+  int port;
+  int fd;                       /* the connection to it, or -1 */
+  int tries;                    /* failed attempts to connect */
+  time_t retry_at;              /* when to attempt it again */
+  int left_after;               /* the last tree it took part in, or -1 */
+  char *out;                    /* the lines yet to be sent to it */
+  int out_len, out_size;
+  int out_urls;                 /* the URLs among them */
+};
+
+/* A connection from another node.  */
+struct cluster_conn
+{
+  int fd;
+  int node;                     /* the node on the other end, or -1 */
+  char *in;                     /* what was read and not handled yet */
+  int in_len, in_size;
+  struct cluster_conn *next;
+};
+
+/* A URL received during fd_dispatch, handed out once it returns.  */
+struct cluster_url
+{
+  char *url, *referer;
+  int depth, flags;
+  struct cluster_url *next;
+};
+
+static struct cluster_node *nodes;
+static int node_count;
+static int self;
+static int listen_fd = -1;
+static struct cluster_conn *conns;
+
+static cluster_receive_fn receive;
+static struct cluster_url *inbox, **inbox_tail = &inbox;
+
+/* The lines for trees that haven't begun yet, and the nodes they came
+   from.  */
+struct cluster_pending
+{
+  char *line;
+  int node;
+};
+static struct cluster_pending *pending;
+static int pending_count;
+
+/* The state of the tree in progress: its number, whether it is
+   complete or was stopped, and how many URLs were sent and received
+   for it.  */
+static int tree;
+static bool done, stopped;
+static wgint sent, received;
+
+/* The last wave of probes whose answer is due, or -1.  */
+static int probe = -1;
+
+/* On node 0, the wave of probes in progress, the answers it got and
+   the totals they add up to, and the totals of the previous wave.  */
+static int wave;
+static bool wave_open;
+static int replies;
+static wgint wave_sent, wave_received;
+static wgint last_sent, last_received;
+
+/* The hash of HOST, the same on every node.  This is FNV-1a, so that
+   the hosts are assigned alike by nodes built differently.  */
+
+static unsigned int
+cluster_hash (const char *host)
+{
+  unsigned int h = 2166136261U;
+  for (; *host; host++)
+    {
+      h ^= c_tolower (*host);
+      h *= 16777619U;
+    }
+  return h & 0xffffffffU;
+}
+
+/* Return the index of the node HOST belongs to.  */
+
+static int
+cluster_owner (const char *host)
+{
+  return cluster_hash (host) % node_count;
+}
+
+/* Return whether the host of U belongs to this node, which is always
+   the case without --cluster.  */
+
+bool
+cluster_local_p (const struct url *u)
+{
+  return !nodes || cluster_owner (u->host) == self;
+}
+
+/* Parse a node given as HOST:PORT, or [ADDRESS]:PORT for an IPv6
+   address, storing a copy of the host to *HOST and the port to *PORT.
+   Return false if the node is malformed.  */
+
+static bool
+cluster_parse_node (const char *s, char **host, int *port)
+{
+  const char *host_end, *colon;
+  char *end;
+  long n;
+
+  if (*s == '[')
+    {
+      ++s;
+      host_end = strchr (s, ']');
+      if (!host_end || host_end == s || host_end[1] != ':')
+        return false;
+      colon = host_end + 1;
+    }
+  else
+    {
+      host_end = colon = strrchr (s, ':');
+      if (!colon || colon == s)
+        return false;
+    }
+
+  errno = 0;
+  n = strtol (colon + 1, &end, 10);
+  if (errno || *end || end == colon + 1 || n <= 0 || n > 65535)
+    return false;
+
+  *host = strdupdelim (s, host_end);
+  *port = n;
+  return true;
+}
+
+/* Split LINE at the tabs into no more than MAX fields, stored to
+   FIELDS.  Return the number of fields.  */
+
+static int
+cluster_split (char *line, char **fields, int max)
+{
+  int count = 0;
+
+  while (count < max)
+    {
+      fields[count++] = line;
+      line = strchr (line, '\t');
+      if (!line)
+        break;
+      *line++ = '\0';
+    }
+  return count;
+}
+
+/* Queue LINE to be sent to node N.  */
+
+static void
+cluster_queue (struct cluster_node *n, const char *line)
+{
+  int len = strlen (line);
+
+  if (n->out_len + len > n->out_size)
+    {
+      n->out_size = MAX (n->out_size * 2, n->out_len + len + 1024);
+      n->out = xrealloc (n->out, n->out_size);
+    }
+  memcpy (n->out + n->out_len, line, len);
+  n->out_len += len;
+}
+
+/* Stop the tree in progress, if it hasn't ended already.  */
+
+static void
+cluster_stop (void)
+{
+  if (!done)
+    stopped = true;
+}
+
+/* Connect to node N, unless it was attempted too recently.  Return
+   false if there is no connection yet.  */
+
+static bool
+cluster_connect (struct cluster_node *n)
+{
+  char hello[32];
+  time_t now = time (NULL);
+
+  if (now < n->retry_at)
+    return false;
+
+  n->fd = connect_to_host (n->host, n->port);
+  if (n->fd < 0)
+    {
+      n->fd = -1;
+      if (++n->tries >= CLUSTER_CONNECT_TRIES)
+        {
+          logprintf (LOG_NOTQUIET,
+                     _("Cannot connect to cluster node %d (%s:%d).\n"),
+                     (int) (n - nodes), n->host, n->port);
+          n->tries = 0;
+          cluster_stop ();
+        }
+      n->retry_at = now + CLUSTER_RETRY_SECONDS;
+      return false;
+    }
+  n->tries = 0;
+
+  snprintf (hello, sizeof hello, "N\t%d\n", self);
+  if (fd_write (n->fd, hello, strlen (hello), -1) < 0)
+    {
+      fd_close (n->fd);
+      n->fd = -1;
+      n->retry_at = now + CLUSTER_RETRY_SECONDS;
+      return false;
+    }
+  return true;
+}
+
+/* Send node N the lines queued for it.  Return false if some are
+   still waiting.  */
+
+static bool
+cluster_flush (struct cluster_node *n)
+{
+  if (!n->out_len)
+    return true;
+  if (n->fd < 0 && !cluster_connect (n))
+    return false;
+
+  if (fd_write (n->fd, n->out, n->out_len, -1) < 0)
+    {
+      logprintf (LOG_NOTQUIET,
+                 _("Cannot send to cluster node %d (%s:%d): %s\n"),
+                 (int) (n - nodes), n->host, n->port, fd_errstr (n->fd));
+      fd_close (n->fd);
+      n->fd = -1;
+      n->out_len = n->out_urls = 0;
+      cluster_stop ();
+      return false;
+    }
+  sent += n->out_urls;
+  n->out_len = n->out_urls = 0;
+  return true;
+}
+
+/* Send every node the lines queued for it.  Return false if some are
+   still waiting.  */
+
+static bool
+cluster_flush_all (void)
+{
+  bool all = true;
+  int i;
+
+  for (i = 0; i < node_count; i++)
+    if (i != self && !cluster_flush (&nodes[i]))
+      all = false;
+  return all;
+}
+
+/* Queue a line of TYPE for the tree in progress to every other node,
+   and send it right away.  */
+
+static void
+cluster_broadcast (char type)
+{
+  char line[32];
+  int i;
+
+  snprintf (line, sizeof line, "%c\t%d\n", type, tree);
+  for (i = 0; i < node_count; i++)
+    if (i != self)
+      {
+        cluster_queue (&nodes[i], line);
+        cluster_flush (&nodes[i]);
+      }
+}
+
+/* End the wave of probes whose answers have all come in, deciding from
+   its totals whether the tree is complete.  */
+
+static void
+cluster_wave_end (void)
+{
+  wave_open = false;
+  DEBUGP (("Cluster wave %d: %s URLs sent, %s received.\n", wave,
+           number_to_static_string (wave_sent),
+           number_to_static_string (wave_received)));
+  if (wave_sent == wave_received
+      && wave_sent == last_sent && wave_received == last_received)
+    {
+      done = true;
+      cluster_broadcast ('D');
+      return;
+    }
+  last_sent = wave_sent;
+  last_received = wave_received;
+}
+
+/* Begin a wave of probes with the answer of node 0 itself.  */
+
+static void
+cluster_wave_start (void)
+{
+  char line[64];
+  int i;
+
+  ++wave;
+  wave_open = true;
+  replies = 1;
+  wave_sent = sent;
+  wave_received = received;
+
+  snprintf (line, sizeof line, "P\t%d\t%d\n", tree, wave);
+  for (i = 1; i < node_count; i++)
+    {
+      cluster_queue (&nodes[i], line);
+      cluster_flush (&nodes[i]);
+    }
+  if (replies == node_count)
+    cluster_wave_end ();
+}
+
+/* Handle LINE, received from NODE (or -1 if it hasn't said yet).  */
+
+static void
+cluster_handle (char *line, int *node)
+{
+  char *f[6];
+  int count = cluster_split (line, f, countof (f));
+  char type = f[0][0];
+  int t;
+
+  if (f[0][0] == '\0' || f[0][1] != '\0' || count < 2)
+    goto bad;
+
+  if (type == 'N')
+    {
+      int n = atoi (f[1]);
+      if (n < 0 || n >= node_count || n == self)
+        goto bad;
+      *node = n;
+      return;
+    }
+
+  t = atoi (f[1]);
+  if (type == 'B')
+    {
+      if (*node >= 0)
+        nodes[*node].left_after = t;
+      return;
+    }
+  if (t < tree)
+    return;
+  if (t > tree)
+    {
+      /* Put the fields back together for when the tree begins.  */
+      int i;
+      for (i = 0; i < count - 1; i++)
+        f[i][strlen (f[i])] = '\t';
+      pending = xrealloc (pending, (pending_count + 1) * sizeof *pending);
+      pending[pending_count].line = xstrdup (line);
+      pending[pending_count++].node = *node;
+      return;
+    }
+
+  switch (type)
+    {
+    case 'U':
+      {
+        struct cluster_url *cu;
+        if (count < 6)
+          goto bad;
+        ++received;
+        cu = xnew0 (struct cluster_url);
+        cu->depth = atoi (f[2]);
+        cu->flags = atoi (f[3]);
+        cu->url = xstrdup (f[4]);
+        if (strcmp (f[5], "-"))
+          cu->referer = xstrdup (f[5]);
+        *inbox_tail = cu;
+        inbox_tail = &cu->next;
+      }
+      break;
+    case 'P':
+      if (count < 3)
+        goto bad;
+      probe = atoi (f[2]);
+      break;
+    case 'S':
+      if (count < 5)
+        goto bad;
+      if (self == 0 && wave_open && atoi (f[2]) == wave)
+        {
+          wave_sent += str_to_wgint (f[3], NULL, 10);
+          wave_received += str_to_wgint (f[4], NULL, 10);
+          if (++replies == node_count)
+            cluster_wave_end ();
+        }
+      break;
+    case 'D':
+      done = true;
+      break;
+    case 'Q':
+      if (!done && !stopped)
+        logprintf (LOG_NOTQUIET,
+                   _("The retrieval was stopped by cluster node %d.\n"),
+                   *node);
+      cluster_stop ();
+      break;
+    default:
+      goto bad;
+    }
+  return;
+
+ bad:
+  DEBUGP (("Ignoring a malformed line from cluster node %d.\n", *node));
+}
+
+/* Close connection C, which has been unwatched.  */
+
+static void
+cluster_conn_close (struct cluster_conn *c)
+{
+  fd_close (c->fd);
+  c->fd = -1;
+  xfree (c->in);
+  c->in_len = c->in_size = 0;
+}
+
+/* Called by fd_dispatch when the connection ARG from another node can
+   be read from.  */
+
+static void
+cluster_readable (int fd, int ready _GL_UNUSED, void *arg)
+{
+  struct cluster_conn *c = arg;
+
+  if (c->fd != fd)
+    return;
+
+  for (;;)
+    {
+      int wait_for, res;
+      char *start, *nl;
+
+      if (c->in_size - c->in_len < 4096)
+        {
+          c->in_size = MAX (c->in_size * 2, c->in_len + 8192);
+          c->in = xrealloc (c->in, c->in_size);
+        }
+      res = fd_read_nb (fd, c->in + c->in_len, c->in_size - c->in_len - 1,
+                        &wait_for);
+      if (res == FD_WOULDBLOCK)
+        return;
+      if (res <= 0)
+        {
+          int node = c->node;
+          fd_unwatch (fd);
+          cluster_conn_close (c);
+          if (node >= 0 && !done && nodes[node].left_after < tree)
+            {
+              logprintf (LOG_NOTQUIET,
+                         _("Lost the connection from cluster node %d.\n"),
+                         node);
+              cluster_stop ();
+            }
+          return;
+        }
+      c->in_len += res;
+      c->in[c->in_len] = '\0';
+
+      for (start = c->in; (nl = strchr (start, '\n')) != NULL; start = nl + 1)
+        {
+          *nl = '\0';
+          cluster_handle (start, &c->node);
+        }
+      c->in_len -= start - c->in;
+      memmove (c->in, start, c->in_len);
+    }
+}
+
+/* Called by fd_dispatch when another node connects.  */
+
+static void
+cluster_accept (int fd, int ready _GL_UNUSED, void *arg _GL_UNUSED)
+{
+  struct cluster_conn *c;
+  int sock = accept_connection (fd);
+
+  if (sock < 0)
+    return;
+  set_socket_nonblocking (sock, true);
+  c = xnew0 (struct cluster_conn);
+  c->fd = sock;
+  c->node = -1;
+  c->next = conns;
+  conns = c;
+}
+
+/* Read what the other nodes sent, waiting for no more than TIMEOUT
+   seconds, and hand out the URLs that came in.  Return whether there
+   were any.  */
+
+static bool
+cluster_dispatch (double timeout)
+{
+  struct cluster_conn *c, **cp;
+  struct cluster_url *cu;
+  bool any = false;
+
+  fd_watch (listen_fd, WAIT_FOR_READ, cluster_accept, NULL);
+  for (c = conns; c; c = c->next)
+    fd_watch (c->fd, WAIT_FOR_READ, cluster_readable, c);
+  fd_dispatch (timeout);
+  fd_unwatch (listen_fd);
+  for (cp = &conns; (c = *cp) != NULL; )
+    if (c->fd < 0)
+      {
+        *cp = c->next;
+        xfree (c);
+      }
+    else
+      {
+        fd_unwatch (c->fd);
+        cp = &c->next;
+      }
+
+  /* The URLs are handed out only now, as checking them may have
+     robots.txt retrieved.  */
+  while ((cu = inbox) != NULL)
+    {
+      inbox = cu->next;
+      if (!stopped)
+        receive (cu->url, cu->referer, cu->depth, cu->flags & 1,
+                 (cu->flags & 2) != 0, (cu->flags & 4) != 0);
+      xfree (cu->url);
+      xfree (cu->referer);
+      xfree (cu);
+      any = true;
+    }
+  inbox_tail = &inbox;
+  return any;
+}
+
+/* Set up the nodes of opt.cluster and listen for the others.  */
+
+static void
+cluster_init (void)
+{
+  struct address_list *al = NULL;
+  ip_address any;
+  int i;
+
+  for (node_count = 0; opt.cluster[node_count]; node_count++)
+    ;
+  nodes = xnew_array (struct cluster_node, node_count);
+  for (i = 0; i < node_count; i++)
+    {
+      xzero (nodes[i]);
+      nodes[i].fd = -1;
+      nodes[i].left_after = -1;
+      if (!cluster_parse_node (opt.cluster[i], &nodes[i].host,
+                               &nodes[i].port))
+        {
+          logprintf (LOG_NOTQUIET, _("Invalid cluster node %s.\n"),
+                     quote (opt.cluster[i]));
+          exit (WGET_EXIT_GENERIC_ERROR);
+        }
+    }
+  self = opt.cluster_node;
+
+  if (opt.bind_address)
+    {
+      al = lookup_host (opt.bind_address, LH_BIND | LH_SILENT);
+      if (!al)
+        {
+          logprintf (LOG_NOTQUIET, _("Cannot resolve %s.\n"),
+                     quote (opt.bind_address));
+          exit (WGET_EXIT_GENERIC_ERROR);
+        }
+      listen_fd = bind_local (address_list_address_at (al, 0),
+                              &nodes[self].port);
+      address_list_release (al);
+    }
+  else
+    {
+      xzero (any);
+#ifdef ENABLE_IPV6
+      if (!opt.ipv4_only)
+        {
+          any.family = AF_INET6;
+          listen_fd = bind_local (&any, &nodes[self].port);
+        }
+      if (listen_fd < 0 && !opt.ipv6_only)
+#endif
+        {
+          any.family = AF_INET;
+          listen_fd = bind_local (&any, &nodes[self].port);
+        }
+    }
+  if (listen_fd < 0)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot listen on port %d: %s\n"),
+                 nodes[self].port, strerror (errno));
+      exit (WGET_EXIT_GENERIC_ERROR);
+    }
+  logprintf (LOG_VERBOSE, _("Cluster node %d of %d, listening on port %d.\n"),
+             self, node_count, nodes[self].port);
+}
+
+/* Begin the retrieval of the next start URL, handing the URLs other
+   nodes forward for it to RECEIVE.  */
+
+void
+cluster_begin (cluster_receive_fn fn)
+{
+  struct cluster_pending *later;
+  int i, count;
+
+  if (!opt.cluster)
+    return;
+  if (!nodes)
+    cluster_init ();
+
+  receive = fn;
+  ++tree;
+  done = stopped = false;
+  sent = received = 0;
+  probe = -1;
+  wave_open = false;
+  last_sent = last_received = -1;
+
+  for (i = 0; i < node_count; i++)
+    if (nodes[i].left_after >= 0 && nodes[i].left_after < tree)
+      {
+        logprintf (LOG_NOTQUIET,
+                   _("Cluster node %d has left; the nodes must be given "
+                     "the same URLs.\n"), i);
+        stopped = true;
+      }
+
+  /* Take up the lines that came in for this tree early.  */
+  later = pending;
+  count = pending_count;
+  pending = NULL;
+  pending_count = 0;
+  for (i = 0; i < count; i++)
+    {
+      cluster_handle (later[i].line, &later[i].node);
+      xfree (later[i].line);
+    }
+  xfree (later);
+}
+
+/* Forward URL U, found on REFERER, to the node its host belongs to.
+   The rest of the arguments are those of cluster_receive_fn.  */
+
+void
+cluster_forward (const struct url *u, const char *referer, int depth,
+                 bool html_allowed, bool css_allowed, bool requisite)
+{
+  struct cluster_node *n = &nodes[cluster_owner (u->host)];
+  char *line = aprintf ("U\t%d\t%d\t%d\t%s\t%s\n", tree, depth,
+                        html_allowed | css_allowed << 1 | requisite << 2,
+                        u->url, referer ? referer : "-");
+
+  DEBUGP (("Forwarding %s to cluster node %d.\n", u->url,
+           (int) (n - nodes)));
+  cluster_queue (n, line);
+  xfree (line);
+  if (++n->out_urls >= CLUSTER_BATCH)
+    cluster_flush (n);
+}
+
+/* Send what was forwarded and hand out what was received, without
+   waiting.  Return false if the retrieval has to stop.  */
+
+bool
+cluster_poll (void)
+{
+  if (!nodes)
+    return true;
+  cluster_dispatch (0);
+  cluster_flush_all ();
+  return !stopped;
+}
+
+/* Wait, once this node has nothing left to retrieve, until either
+   other nodes forward URLs to it, the retrieval is complete, or it is
+   stopped.  Return false only in the second case, and without
+   --cluster.  */
+
+bool
+cluster_wait (void)
+{
+  char line[128];
+
+  if (!nodes)
+    return false;
+
+  while (!done && !stopped)
+    {
+      bool idle = cluster_flush_all ();
+
+      if (idle && self == 0 && !wave_open)
+        cluster_wave_start ();
+      else if (idle && self != 0 && probe >= 0)
+        {
+          snprintf (line, sizeof line, "S\t%d\t%d\t%s\t%s\n", tree, probe,
+                    number_to_static_string (sent),
+                    number_to_static_string (received));
+          cluster_queue (&nodes[0], line);
+          cluster_flush (&nodes[0]);
+          probe = -1;
+        }
+      if (done)
+        break;
+      if (cluster_dispatch (CLUSTER_WAIT_INTERVAL))
+        return true;
+    }
+  return !done;
+}
+
+/* End the tree in progress, which is COMPLETE or was cut short.  In
+   the latter case, the other nodes are stopped too.  */
+
+void
+cluster_end (bool complete)
+{
+  struct cluster_url *cu;
+  int i;
+
+  if (!nodes)
+    return;
+  if (!complete)
+    cluster_broadcast ('Q');
+  stopped = true;
+  while ((cu = inbox) != NULL)
+    {
+      inbox = cu->next;
+      xfree (cu->url);
+      xfree (cu->referer);
+      xfree (cu);
+    }
+  inbox_tail = &inbox;
+  for (i = 0; i < node_count; i++)
+    nodes[i].out_len = nodes[i].out_urls = 0;
+}
+
+/* Tell the other nodes this one is leaving, and close the connections.
+   Called at exit.  */
+
+void
+cluster_close (void)
+{
+  struct cluster_conn *c;
+  int i;
+
+  if (!nodes)
+    return;
+
+  for (i = 0; i < node_count; i++)
+    if (nodes[i].fd >= 0)
+      {
+        char line[32];
+        snprintf (line, sizeof line, "B\t%d\n", tree);
+        fd_write (nodes[i].fd, line, strlen (line), -1);
+        fd_close (nodes[i].fd);
+      }
+  while ((c = conns) != NULL)
+    {
+      conns = c->next;
+      cluster_conn_close (c);
+      xfree (c);
+    }
+  if (listen_fd >= 0)
+    fd_close (listen_fd);
+  listen_fd = -1;
+
+  for (i = 0; i < node_count; i++)
+    {
+      xfree (nodes[i].host);
+      xfree (nodes[i].out);
+    }
+  xfree (nodes);
+  node_count = 0;
+  for (i = 0; i < pending_count; i++)
+    xfree (pending[i].line);
+  xfree (pending);
+  pending_count = 0;
+}
+
+#ifdef TESTING
+
+const char *
+test_cluster_parse_node (void)
+{
+  char *host;
+  int port;
+
+  mu_assert ("test_cluster_parse_node: host:port",
+             cluster_parse_node ("node1.example.com:8505", &host, &port)
+             && !strcmp (host, "node1.example.com") && port == 8505);
+  xfree (host);
+  mu_assert ("test_cluster_parse_node: IPv6",
+             cluster_parse_node ("[::1]:8505", &host, &port)
+             && !strcmp (host, "::1") && port == 8505);
+  xfree (host);
+
+  mu_assert ("test_cluster_parse_node: no port",
+             !cluster_parse_node ("node1", &host, &port));
+  mu_assert ("test_cluster_parse_node: empty port",
+             !cluster_parse_node ("node1:", &host, &port));
+  mu_assert ("test_cluster_parse_node: bad port",
+             !cluster_parse_node ("node1:65536", &host, &port));
+  mu_assert ("test_cluster_parse_node: no host",
+             !cluster_parse_node (":80", &host, &port));
+  mu_assert ("test_cluster_parse_node: bad IPv6",
+             !cluster_parse_node ("[::1:80", &host, &port));
+
+  /* The hosts are assigned alike wherever Wget runs.  */
+  mu_assert ("test_cluster_parse_node: hash",
+             cluster_hash ("") == 2166136261U
+             && cluster_hash ("a") == 0xe40c292cU
+             && cluster_hash ("Example.COM") == cluster_hash ("example.com"));
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -0,0 +1,52 @@
+/* Declarations for cluster.c.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+struct url;
+
+/* Called for each URL another node has forwarded to this one, with
+   the URL, its referer (or NULL), its depth, and whether it may be
+   HTML, CSS, and a requisite of the page linking to it.  */
+typedef void (*cluster_receive_fn) (const char *, const char *, int,
+                                    bool, bool, bool);
+
+bool cluster_local_p (const struct url *);
+void cluster_begin (cluster_receive_fn);
+void cluster_forward (const struct url *, const char *, int,
+                      bool, bool, bool);
+bool cluster_poll (void);
+bool cluster_wait (void);
+void cluster_end (bool);
+void cluster_close (void);
+
+#endif /* CLUSTER_H */
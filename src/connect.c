@@ -46,6 +46,7 @@ as that of the covered work.  */
 #  include <netdb.h>
 # endif /* def __VMS [else] */
 # include <netinet/in.h>
+# include <netinet/tcp.h>
 # ifndef __BEOS__
 #  include <arpa/inet.h>
 # endif
@@ -53,12 +54,30 @@ as that of the covered work.  */
 
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/time.h>
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+#endif
+#if defined HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+# define WATCH_EPOLL
+#elif defined HAVE_POLL_H && !defined WINDOWS
+# include <poll.h>
+# define WATCH_POLL
+#endif
 
 #include "utils.h"
 #include "host.h"
 #include "connect.h"
 #include "hash.h"
+#include "ptimer.h"
+#include "metrics.h"
+#include "stats.h"
 
 #include <stdint.h>
 
@@ -215,94 +234,208 @@ resolve_bind_address (struct sockaddr *sa)
   return true;
 }
 
-struct cwt_context {
-  int fd;
-  const struct sockaddr *addr;
-  socklen_t addrlen;
-  int result;
-};
+/* Switch SOCK between blocking and non-blocking mode.  */
 
-static void
-connect_with_timeout_callback (void *arg)
+void
+set_socket_nonblocking (int sock, bool nonblocking)
 {
-  struct cwt_context *ctx = (struct cwt_context *)arg;
-  ctx->result = connect (ctx->fd, ctx->addr, ctx->addrlen);
+#ifdef WINDOWS
+  if (nonblocking)
+    {
+      const int one = 1;
+      ioctl (sock, FIONBIO, &one);
+    }
+  else
+    set_windows_fd_as_blocking_socket (sock);
+#else
+  int flags = fcntl (sock, F_GETFL, 0);
+  if (flags < 0)
+    return;
+  if (nonblocking)
+    flags |= O_NONBLOCK;
+  else
+    flags &= ~O_NONBLOCK;
+  fcntl (sock, F_SETFL, flags);
+#endif
 }
 
-/* Like connect, but specifies a timeout.  If connecting takes longer
-   than TIMEOUT seconds, -1 is returned and errno is set to
-   ETIMEDOUT.  */
+/* Return the error of the connection being established on FD, as an
+   errno value, or 0 if it has been established.  Returns -1 if the
+   error cannot be retrieved.  */
 
 static int
-connect_with_timeout (int fd, const struct sockaddr *addr, socklen_t addrlen,
-                      double timeout)
+socket_error (int fd)
 {
-  struct cwt_context ctx;
-  ctx.fd = fd;
-  ctx.addr = addr;
-  ctx.addrlen = addrlen;
+  int err = 0;
+  socklen_t errlen = sizeof (err);
 
-  if (run_with_timeout (timeout, connect_with_timeout_callback, &ctx))
+  if (getsockopt (fd, SOL_SOCKET, SO_ERROR, (void *) &err, &errlen) < 0)
+    return -1;
+#ifdef WINDOWS
+  /* SO_ERROR reports Winsock codes, which gnulib doesn't translate.
+     Map the ones the callers care about.  */
+  switch (err)
     {
-      errno = ETIMEDOUT;
-      return -1;
+    case WSAECONNREFUSED: err = ECONNREFUSED; break;
+    case WSAECONNRESET:   err = ECONNRESET;   break;
+    case WSAETIMEDOUT:    err = ETIMEDOUT;    break;
+    case WSAENETUNREACH:  err = ENETUNREACH;  break;
+    case WSAEHOSTUNREACH: err = EHOSTUNREACH; break;
     }
-  if (ctx.result == -1 && errno == EINTR)
-    errno = ETIMEDOUT;
-  return ctx.result;
+#endif
+  return err;
 }
 
-/* Connect via TCP to the specified address and port.
+/* Like connect, but specifies a timeout.  If connecting takes longer
+   than TIMEOUT seconds, -1 is returned and errno is set to ETIMEDOUT.
 
-   If PRINT is non-NULL, it is the host name to print that we're
-   connecting to.  */
+   The socket is put in non-blocking mode for the duration of the
+   connect, and select waits for it to complete.  Unlike going through
+   run_with_timeout, this needs neither a signal nor a helper thread
+   that has to be killed when the time is up.  */
 
-int
-connect_to_ip (const ip_address *ip, int port, const char *print)
+static int
+connect_with_timeout (int fd, const struct sockaddr *addr, socklen_t addrlen,
+                      double timeout)
 {
-  struct sockaddr_storage ss;
-  struct sockaddr *sa = (struct sockaddr *)&ss;
-  int sock;
+  int result, saved_errno;
 
-  /* If PRINT is non-NULL, print the "Connecting to..." line, with
-     PRINT being the host name we're connecting to.  */
-  if (print)
+  if (timeout == 0)
+    return connect (fd, addr, addrlen);
+
+  set_socket_nonblocking (fd, true);
+  result = connect (fd, addr, addrlen);
+  if (result < 0
+      && (errno == EINPROGRESS
+#ifdef EWOULDBLOCK
+          || errno == EWOULDBLOCK
+#endif
+          || errno == EAGAIN))
     {
-      const char *txt_addr = print_address (ip);
-      if (0 != strcmp (print, txt_addr))
+      result = select_fd_nb (fd, timeout, WAIT_FOR_WRITE);
+      if (result == 0)
         {
-          char *str = NULL, *name;
-
-          if (opt.enable_iri && strstr (print, "xn--") &&
-              (name = idn_decode ((char *) print)) != NULL)
+          errno = ETIMEDOUT;
+          result = -1;
+        }
+      else if (result > 0)
+        {
+          int err = socket_error (fd);
+          if (err < 0)
+            result = -1;
+          else if (err != 0)
             {
-              str = aprintf ("%s (%s)", name, print);
-              xfree (name);
+              errno = err;
+              result = -1;
             }
+          else
+            result = 0;
+        }
+    }
+  saved_errno = errno;
+  set_socket_nonblocking (fd, false);
+  errno = saved_errno;
+  return result;
+}
+
+/* Set the integer socket option NAME of SOCK, at LEVEL, to VALUE,
+   and complain if that fails.  */
+
+static void
+set_int_option (int sock, int level, int name, const char *name_str,
+                int value)
+{
+  if (setsockopt (sock, level, name, (void *) &value,
+                  (socklen_t) sizeof (value)))
+    logprintf (LOG_NOTQUIET, _("setsockopt %s failed: %s\n"),
+               name_str, strerror (errno));
+}
+
+/* Apply the --tcp-* options to SOCK.  CLIENT is false for sockets
+   listening for FTP data connections, whose options are passed on to
+   the connections they accept.  */
+
+static void
+tune_socket (int sock, bool client _GL_UNUSED)
+{
+  wgint rcvbuf = opt.tcp_rcvbuf;
+
+  /* For very small rate limits, set the buffer size (and hence,
+     hopefully, the kernel's TCP window size) to the per-second limit.
+     That way we should never have to sleep for more than 1s between
+     network reads.  */
+  if (!rcvbuf && opt.limit_rate && opt.limit_rate < 8192)
+    /* Avoid pathologically small values.  */
+    rcvbuf = MAX (opt.limit_rate, 512);
+
+  /* Buffer sizes have to be set before connecting, or before
+     listening, for the kernel to pick a window scale that makes use
+     of them.  */
+#ifdef SO_RCVBUF
+  if (rcvbuf)
+    set_int_option (sock, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF",
+                    MIN (rcvbuf, INT_MAX));
+#endif
+#ifdef SO_SNDBUF
+  if (opt.tcp_sndbuf)
+    set_int_option (sock, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF",
+                    MIN (opt.tcp_sndbuf, INT_MAX));
+#endif
 
-          logprintf (LOG_VERBOSE, _("Connecting to %s|%s|:%d... "),
-                     str ? str : escnonprint_uri (print), txt_addr, port);
+#ifdef TCP_NODELAY
+  /* A request whose body is written separately from its headers
+     would otherwise wait for the headers to be acknowledged.  */
+  if (opt.tcp_nodelay)
+    set_int_option (sock, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+#endif
 
-          xfree (str);
+  if (opt.tcp_congestion)
+    {
+      static bool warned;
+#ifdef TCP_CONGESTION
+      if (setsockopt (sock, IPPROTO_TCP, TCP_CONGESTION,
+                      opt.tcp_congestion, strlen (opt.tcp_congestion))
+          && !warned)
+        {
+          logprintf (LOG_NOTQUIET,
+                     _("Cannot use congestion control %s: %s\n"),
+                     quote (opt.tcp_congestion), strerror (errno));
+          warned = true;
         }
-      else
+#else
+      if (!warned)
         {
-           if (ip->family == AF_INET)
-               logprintf (LOG_VERBOSE, _("Connecting to %s:%d... "), txt_addr, port);
-#ifdef ENABLE_IPV6
-           else if (ip->family == AF_INET6)
-               logprintf (LOG_VERBOSE, _("Connecting to [%s]:%d... "), txt_addr, port);
-#endif
+          logputs (LOG_NOTQUIET, _("\
+Choosing the congestion control is not supported on this system.\n"));
+          warned = true;
         }
+#endif
     }
 
-  /* Store the sockaddr info to SA.  */
-  sockaddr_set_data (sa, ip, port);
+#ifdef TCP_FASTOPEN_CONNECT
+  /* With a cookie from an earlier connection to the same server, the
+     kernel sends the first data with the SYN.  Without one, it simply
+     connects as usual and asks for a cookie.  */
+  if (client && opt.tcp_fastopen)
+    set_int_option (sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                    "TCP_FASTOPEN_CONNECT", 1);
+#endif
+}
+
+/* Create a socket of the family appropriate for SA and prepare it for
+   connecting: apply the socket options requested by the user and bind
+   it to --bind-address, if specified.  Returns the socket, or -1 with
+   errno set on failure.  */
+
+static int
+make_client_socket (const struct sockaddr *sa)
+{
+  int sock;
 
   /* Create the socket of the family appropriate for the address.  */
   sock = socket (sa->sa_family, SOCK_STREAM, 0);
   if (sock < 0)
-    goto err;
+    return -1;
 
 #if defined(ENABLE_IPV6) && defined(IPV6_V6ONLY)
   if (opt.ipv6_only) {
@@ -315,24 +448,7 @@ connect_to_ip (const ip_address *ip, int port, const char *print)
   }
 #endif
 
-  /* For very small rate limits, set the buffer size (and hence,
-     hopefully, the kernel's TCP window size) to the per-second limit.
-     That way we should never have to sleep for more than 1s between
-     network reads.  */
-  if (opt.limit_rate && opt.limit_rate < 8192)
-    {
-      int bufsize = opt.limit_rate;
-      if (bufsize < 512)
-        bufsize = 512;          /* avoid pathologically small values */
-#ifdef SO_RCVBUF
-      if (setsockopt (sock, SOL_SOCKET, SO_RCVBUF,
-                  (void *) &bufsize, (socklen_t) sizeof (bufsize)))
-        logprintf (LOG_NOTQUIET, _("setsockopt SO_RCVBUF failed: %s\n"),
-                   strerror (errno));
-#endif
-      /* When we add limit_rate support for writing, which is useful
-         for POST, we should also set SO_SNDBUF here.  */
-    }
+  tune_socket (sock, true);
 
   if (opt.bind_address)
     {
@@ -343,9 +459,75 @@ connect_to_ip (const ip_address *ip, int port, const char *print)
       if (resolve_bind_address (bind_sa))
         {
           if (bind (sock, bind_sa, sockaddr_size (bind_sa)) < 0)
-            goto err;
+            {
+              int save_errno = errno;
+              fd_close (sock);
+              errno = save_errno;
+              return -1;
+            }
+        }
+    }
+
+  return sock;
+}
+
+/* Print the "Connecting to..." line for connecting to IP on PORT,
+   with PRINT being the host name we're connecting to.  */
+
+static void
+log_connecting (const ip_address *ip, int port, const char *print)
+{
+  const char *txt_addr = print_address (ip);
+  if (0 != strcmp (print, txt_addr))
+    {
+      char *str = NULL, *name;
+
+      if (opt.enable_iri && strstr (print, "xn--") &&
+          (name = idn_decode ((char *) print)) != NULL)
+        {
+          str = aprintf ("%s (%s)", name, print);
+          xfree (name);
         }
+
+      logprintf (LOG_VERBOSE, _("Connecting to %s|%s|:%d... "),
+                 str ? str : escnonprint_uri (print), txt_addr, port);
+
+      xfree (str);
+    }
+  else
+    {
+       if (ip->family == AF_INET)
+           logprintf (LOG_VERBOSE, _("Connecting to %s:%d... "), txt_addr, port);
+#ifdef ENABLE_IPV6
+       else if (ip->family == AF_INET6)
+           logprintf (LOG_VERBOSE, _("Connecting to [%s]:%d... "), txt_addr, port);
+#endif
     }
+}
+
+/* Connect via TCP to the specified address and port.
+
+   If PRINT is non-NULL, it is the host name to print that we're
+   connecting to.  */
+
+int
+connect_to_ip (const ip_address *ip, int port, const char *print)
+{
+  struct sockaddr_storage ss;
+  struct sockaddr *sa = (struct sockaddr *)&ss;
+  int sock;
+
+  /* If PRINT is non-NULL, print the "Connecting to..." line, with
+     PRINT being the host name we're connecting to.  */
+  if (print)
+    log_connecting (ip, port, print);
+
+  /* Store the sockaddr info to SA.  */
+  sockaddr_set_data (sa, ip, port);
+
+  sock = make_client_socket (sa);
+  if (sock < 0)
+    goto err;
 
   /* Connect the socket to the remote endpoint.  */
   if (connect_with_timeout (sock, sa, sockaddr_size (sa),
@@ -380,109 +562,702 @@ connect_to_ip (const ip_address *ip, int port, const char *print)
   }
 }
 
-/* Connect via TCP to a remote host on the specified port.
-
-   HOST is resolved as an Internet host name.  If HOST resolves to
-   more than one IP address, they are tried in the order returned by
-   DNS until connecting to one of them succeeds.  */
+/* Start connecting via TCP to IP on PORT, without waiting for the
+   connection to be established.  Returns the socket, which is in
+   non-blocking mode until connect_to_ip_finish is called on it once
+   it becomes writable, or -1 with errno set.  */
 
 int
-connect_to_host (const char *host, int port)
+connect_to_ip_start (const ip_address *ip, int port)
 {
-  int i, start, end;
+  struct sockaddr_storage ss;
+  struct sockaddr *sa = (struct sockaddr *)&ss;
   int sock;
 
-  struct address_list *al = lookup_host (host, 0);
+  sockaddr_set_data (sa, ip, port);
+  sock = make_client_socket (sa);
+  if (sock < 0)
+    return -1;
 
- retry:
-  if (!al)
+  set_socket_nonblocking (sock, true);
+  if (connect (sock, sa, sockaddr_size (sa)) < 0
+      && errno != EINPROGRESS
+#ifdef EWOULDBLOCK
+      && errno != EWOULDBLOCK
+#endif
+      && errno != EAGAIN)
     {
-      logprintf (LOG_NOTQUIET,
-                 _("%s: unable to resolve host address %s\n"),
-                 exec_name, quote (host));
-      return E_HOST;
+      int save_errno = errno;
+      fd_close (sock);
+      errno = save_errno;
+      return -1;
     }
+  DEBUGP (("Created socket %d.\n", sock));
+  return sock;
+}
 
-  address_list_get_bounds (al, &start, &end);
-  for (i = start; i < end; i++)
-    {
-      const ip_address *ip = address_list_address_at (al, i);
-      sock = connect_to_ip (ip, port, host);
-      if (sock >= 0)
-        {
-          /* Success. */
-          address_list_set_connected (al);
-          address_list_release (al);
-          return sock;
-        }
+/* Complete the connection started by connect_to_ip_start on SOCK,
+   which has become writable, and put SOCK back in blocking mode.
+   Returns 0 if the connection was established, or -1 with errno
+   set.  */
 
-      /* The attempt to connect has failed.  Continue with the loop
-         and try next address. */
+int
+connect_to_ip_finish (int sock)
+{
+  int err = socket_error (sock);
 
-      address_list_set_faulty (al, i);
+  set_socket_nonblocking (sock, false);
+  if (err != 0)
+    {
+      if (err > 0)
+        errno = err;
+      return -1;
     }
+  return 0;
+}
 
-  /* Failed to connect to any of the addresses in AL. */
+/* Preconnecting.  When the caller knows which hosts it is going to
+   talk to next (e.g. the hosts of the URLs waiting in the recursive
+   retrieval queue), it can ask for connections to them to be started
+   ahead of time with preconnect_to_host.  The TCP handshakes then
+   complete in the background, while the current download is still in
+   progress, and connect_to_host picks up the established connection
+   instead of waiting a round trip for a new one.  */
 
-  if (address_list_connected_p (al))
-    {
-      /* We connected to AL before, but cannot do so now.  That might
-         indicate that our DNS cache entry for HOST has expired.  */
-      address_list_release (al);
-      al = lookup_host (host, LH_REFRESH);
-      goto retry;
-    }
-  address_list_release (al);
+/* Maximum number of connections started ahead of time. */
+#define MAX_PRECONNECTS 16
 
-  return -1;
+/* Preconnected sockets not claimed after this many seconds are
+   closed, since the server is likely to have given up on them.  */
+#define PRECONNECT_MAX_AGE 30
+
+struct preconnect {
+  char *host;
+  int port;
+  int sock;
+  time_t started;
+};
+
+static struct preconnect preconnects[MAX_PRECONNECTS];
+static int preconnect_count;
+
+/* Remove the preconnect entry at position I, closing its socket if
+   CLOSE_SOCKET is true.  */
+
+static void
+preconnect_remove (int i, bool close_socket)
+{
+  if (close_socket)
+    fd_close (preconnects[i].sock);
+  xfree (preconnects[i].host);
+  preconnects[i] = preconnects[--preconnect_count];
+  xzero (preconnects[preconnect_count]);
 }
 
-/* Create a socket, bind it to local interface BIND_ADDRESS on port
-   *PORT, set up a listen backlog, and return the resulting socket, or
-   -1 in case of error.
+/* Close the preconnected sockets nobody claimed in time.  */
 
-   BIND_ADDRESS is the address of the interface to bind to.  If it is
-   NULL, the socket is bound to the default address.  PORT should
-   point to the port number that will be used for the binding.  If
-   that number is 0, the system will choose a suitable port, and the
-   chosen value will be written to *PORT.
+static void
+preconnect_expire (void)
+{
+  time_t now = time (NULL);
+  int i;
 
-   Calling accept() on such a socket waits for and accepts incoming
-   TCP connections.  */
+  for (i = 0; i < preconnect_count; )
+    if (now - preconnects[i].started > PRECONNECT_MAX_AGE)
+      {
+        DEBUGP (("Discarding unused preconnected socket %d to %s:%d.\n",
+                 preconnects[i].sock, preconnects[i].host,
+                 preconnects[i].port));
+        preconnect_remove (i, true);
+      }
+    else
+      ++i;
+}
 
-int
-bind_local (const ip_address *bind_address, int *port)
+/* Start connecting to HOST:PORT without waiting for the connection to
+   be established.  Nothing is printed, and failures are silently
+   ignored -- connect_to_host will simply connect the usual way.  At most
+   MAX connections (capped at MAX_PRECONNECTS) are kept pending.  */
+
+void
+preconnect_to_host (const char *host, int port, int max)
 {
-  int sock;
   struct sockaddr_storage ss;
   struct sockaddr *sa = (struct sockaddr *)&ss;
+  struct address_list *al;
+  int i, start, end, sock;
 
-  /* For setting options with setsockopt. */
-  int setopt_val = 1;
-  void *setopt_ptr = (void *)&setopt_val;
-  socklen_t setopt_size = sizeof (setopt_val);
+  preconnect_expire ();
 
-  sock = socket (bind_address->family, SOCK_STREAM, 0);
+  if (max > MAX_PRECONNECTS)
+    max = MAX_PRECONNECTS;
+  if (preconnect_count >= max)
+    return;
+
+  for (i = 0; i < preconnect_count; i++)
+    if (preconnects[i].port == port
+        && 0 == strcasecmp (preconnects[i].host, host))
+      return;
+
+  al = lookup_host (host, LH_SILENT);
+  if (!al)
+    return;
+  address_list_get_bounds (al, &start, &end);
+  if (start >= end)
+    {
+      address_list_release (al);
+      return;
+    }
+  /* Use the family connect_to_host succeeded with before, if any.  */
+  for (i = start; i < end; i++)
+    if (address_list_address_at (al, i)->family == address_list_family (al))
+      break;
+  if (i == end)
+    i = start;
+  sockaddr_set_data (sa, address_list_address_at (al, i), port);
+  address_list_release (al);
+
+  sock = make_client_socket (sa);
   if (sock < 0)
-    return -1;
+    return;
 
-#ifdef SO_REUSEADDR
-  if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, setopt_ptr, setopt_size))
-    logprintf (LOG_NOTQUIET, _("setsockopt SO_REUSEADDR failed: %s\n"),
-               strerror (errno));
+  set_socket_nonblocking (sock, true);
+  if (connect (sock, sa, sockaddr_size (sa)) < 0
+      && errno != EINPROGRESS
+#ifdef EWOULDBLOCK
+      && errno != EWOULDBLOCK
 #endif
+      && errno != EAGAIN)
+    {
+      DEBUGP (("Preconnecting to %s:%d failed: %s\n",
+               host, port, strerror (errno)));
+      fd_close (sock);
+      return;
+    }
 
-  xzero (ss);
-  sockaddr_set_data (sa, bind_address, *port);
-  if (bind (sock, sa, sockaddr_size (sa)) < 0)
+  DEBUGP (("Preconnecting socket %d to %s:%d.\n", sock, host, port));
+  preconnects[preconnect_count].host = xstrdup (host);
+  preconnects[preconnect_count].port = port;
+  preconnects[preconnect_count].sock = sock;
+  preconnects[preconnect_count].started = time (NULL);
+  ++preconnect_count;
+}
+
+/* If a connection to HOST:PORT was started by preconnect_to_host, wait
+   for it to be established and return its socket, which is then back
+   in blocking mode.  Return -1 if there is no such connection or if it
+   failed; in that case the caller should connect the usual way.  */
+
+static int
+take_preconnected_socket (const char *host, int port)
+{
+  int i, sock, ready;
+  struct address_list *al;
+
+  for (i = 0; i < preconnect_count; i++)
+    if (preconnects[i].port == port
+        && 0 == strcasecmp (preconnects[i].host, host))
+      break;
+  if (i == preconnect_count)
+    return -1;
+
+  sock = preconnects[i].sock;
+  preconnect_remove (i, false);
+
+  ready = select_fd_nb (sock, opt.connect_timeout ? opt.connect_timeout
+                        : PRECONNECT_MAX_AGE, WAIT_FOR_WRITE);
+  if (ready <= 0
+      || socket_error (sock) != 0
+      || !test_socket_open (sock))
     {
+      DEBUGP (("Preconnected socket %d to %s:%d is unusable.\n",
+               sock, host, port));
       fd_close (sock);
       return -1;
     }
-  DEBUGP (("Local socket fd %d bound.\n", sock));
 
-  /* If *PORT is 0, find out which port we've bound to.  */
-  if (*port == 0)
+  set_socket_nonblocking (sock, false);
+
+  /* Keep the bookkeeping of connect_to_host consistent.  */
+  al = lookup_host (host, LH_SILENT);
+  if (al)
+    {
+      address_list_set_connected (al);
+      address_list_release (al);
+    }
+
+  logprintf (LOG_VERBOSE, _("Using preconnected socket to %s:%d.\n"),
+             quotearg_style (escape_quoting_style, host), port);
+  DEBUGP (("Created socket %d.\n", sock));
+  return sock;
+}
+
+/* Close all connections started by preconnect_to_host that haven't
+   been used yet.  */
+
+void
+preconnect_discard_all (void)
+{
+  while (preconnect_count)
+    preconnect_remove (0, true);
+}
+
+#ifdef ENABLE_IPV6
+/* Happy Eyeballs (RFC 8305).  When a host has both IPv4 and IPv6
+   addresses, one of the families may be unreachable without anything
+   telling us so quickly, e.g. when an IPv6 route silently drops the
+   packets.  Rather than waiting the connect timeout on each such
+   address in turn, the connections are attempted in parallel: a new
+   attempt is started every CONNECT_ATTEMPT_DELAY seconds, or as soon
+   as one fails, alternating between the families, and the first
+   attempt to succeed is used.  */
+
+/* Seconds to wait for an attempt before starting the next one; the
+   value recommended by RFC 8305.  */
+#define CONNECT_ATTEMPT_DELAY 0.25
+
+struct connect_attempt {
+  const ip_address *ip;
+  int sock;                     /* -1 unless in progress */
+  double started;
+};
+
+/* Return true if the addresses of AL between START and END are not
+   all of the same family.  */
+
+static bool
+address_list_mixed_p (const struct address_list *al, int start, int end)
+{
+  int i;
+  for (i = start + 1; i < end; i++)
+    if (address_list_address_at (al, i)->family
+        != address_list_address_at (al, start)->family)
+      return true;
+  return false;
+}
+
+/* Close the socket of ATTEMPT, whose connect has FINISHED or not.  */
+
+static void
+connect_attempt_abandon (struct connect_attempt *attempt,
+                         bool finished _GL_UNUSED)
+{
+#ifdef WIN32
+  /* As in connect_to_ip, fd_close would hang on a connection that
+     hasn't completed.  */
+  if (finished)
+#endif
+    fd_close (attempt->sock);
+  attempt->sock = -1;
+}
+
+/* Report the failure of ATTEMPT with ERR and close its socket.  */
+
+static void
+connect_attempt_fail (struct connect_attempt *attempt, int err, int port,
+                      const char *print)
+{
+  log_connecting (attempt->ip, port, print);
+  logprintf (LOG_NOTQUIET, _("failed: %s.\n"), strerror (err));
+  connect_attempt_abandon (attempt, err != ETIMEDOUT);
+}
+
+/* Connect to one of the addresses of AL between START and END, as
+   described above.  The family AL connected to last is tried first,
+   or else that of the first address.  Returns the socket, or -1 with
+   errno set if no address could be connected to.  */
+
+static int
+connect_in_parallel (struct address_list *al, int start, int end, int port,
+                     const char *print)
+{
+  struct connect_attempt *attempts;
+  const ip_address *winner = NULL;
+  struct ptimer *timer;
+  int count = end - start, next = 0, pending = 0, sock = -1;
+  int last_errno = ETIMEDOUT;
+  int family, i, j, k;
+  double next_due = 0;
+
+  /* Order the addresses, alternating between the families.  */
+  attempts = xnew_array (struct connect_attempt, count);
+  family = address_list_family (al);
+  if (!family)
+    family = address_list_address_at (al, start)->family;
+  for (i = j = start, k = 0; k < count; k++)
+    {
+      const ip_address *ip;
+
+      while (i < end && address_list_address_at (al, i)->family != family)
+        i++;
+      while (j < end && address_list_address_at (al, j)->family == family)
+        j++;
+      if (k % 2 == 0 ? i < end : j >= end)
+        ip = address_list_address_at (al, i++);
+      else
+        ip = address_list_address_at (al, j++);
+      attempts[k].ip = ip;
+      attempts[k].sock = -1;
+    }
+
+  timer = ptimer_new ();
+  for (;;)
+    {
+      double now = ptimer_measure (timer), wait = 0;
+      bool bounded = false;
+      fd_set wrset, exset;
+      struct timeval tmout;
+      int maxfd = -1, result;
+
+      /* Start the next attempt when it is due.  */
+      if (next < count && (!pending || now >= next_due))
+        {
+          struct connect_attempt *attempt = &attempts[next++];
+          struct sockaddr_storage ss;
+          struct sockaddr *sa = (struct sockaddr *)&ss;
+
+          sockaddr_set_data (sa, attempt->ip, port);
+          attempt->sock = make_client_socket (sa);
+          if (attempt->sock < 0)
+            {
+              last_errno = errno;
+              log_connecting (attempt->ip, port, print);
+              logprintf (LOG_NOTQUIET, _("failed: %s.\n"),
+                         strerror (last_errno));
+              continue;
+            }
+          if (attempt->sock >= FD_SETSIZE)
+            {
+              logprintf (LOG_NOTQUIET, _("Too many fds open.  Cannot use select on a fd >= %d\n"), FD_SETSIZE);
+              exit (WGET_EXIT_GENERIC_ERROR);
+            }
+          DEBUGP (("Connecting socket %d to %s.\n", attempt->sock,
+                   print_address (attempt->ip)));
+          set_socket_nonblocking (attempt->sock, true);
+          if (connect (attempt->sock, sa, sockaddr_size (sa)) == 0)
+            {
+              sock = attempt->sock;
+              attempt->sock = -1;
+              winner = attempt->ip;
+              break;
+            }
+          if (errno != EINPROGRESS
+#ifdef EWOULDBLOCK
+              && errno != EWOULDBLOCK
+#endif
+              && errno != EAGAIN)
+            {
+              last_errno = errno;
+              connect_attempt_fail (attempt, last_errno, port, print);
+              continue;
+            }
+          attempt->started = now;
+          next_due = now + CONNECT_ATTEMPT_DELAY;
+          ++pending;
+        }
+
+      if (!pending)
+        break;
+
+      /* Wait for an attempt to complete, for the next attempt to be
+         due, or for the oldest attempt to time out.  */
+      if (next < count)
+        {
+          wait = next_due - now;
+          bounded = true;
+        }
+      FD_ZERO (&wrset);
+      FD_ZERO (&exset);
+      for (i = 0; i < next; i++)
+        if (attempts[i].sock >= 0)
+          {
+            if (opt.connect_timeout)
+              {
+                double left = attempts[i].started + opt.connect_timeout - now;
+                if (!bounded || left < wait)
+                  wait = left;
+                bounded = true;
+              }
+            FD_SET (attempts[i].sock, &wrset);
+            FD_SET (attempts[i].sock, &exset);
+            if (attempts[i].sock > maxfd)
+              maxfd = attempts[i].sock;
+          }
+      if (wait < 0)
+        wait = 0;
+      tmout.tv_sec = (long) wait;
+      tmout.tv_usec = 1000000 * (wait - (long) wait);
+
+      do
+        result = select (maxfd + 1, NULL, &wrset, &exset,
+                         bounded ? &tmout : NULL);
+      while (result < 0 && errno == EINTR);
+      if (result < 0)
+        {
+          last_errno = errno;
+          break;
+        }
+
+      now = ptimer_measure (timer);
+      for (i = 0; i < next && sock < 0; i++)
+        {
+          struct connect_attempt *attempt = &attempts[i];
+
+          if (attempt->sock < 0)
+            continue;
+          if (FD_ISSET (attempt->sock, &wrset)
+              || FD_ISSET (attempt->sock, &exset))
+            {
+              int err = socket_error (attempt->sock);
+              if (err == 0)
+                {
+                  sock = attempt->sock;
+                  attempt->sock = -1;
+                  winner = attempt->ip;
+                }
+              else
+                {
+                  last_errno = err < 0 ? errno : err;
+                  connect_attempt_fail (attempt, last_errno, port, print);
+                  --pending;
+                  /* Don't wait to try the next address.  */
+                  next_due = now;
+                }
+            }
+          else if (opt.connect_timeout
+                   && now - attempt->started >= opt.connect_timeout)
+            {
+              last_errno = ETIMEDOUT;
+              connect_attempt_fail (attempt, last_errno, port, print);
+              --pending;
+            }
+        }
+      if (sock >= 0)
+        break;
+    }
+  ptimer_destroy (timer);
+
+  /* Drop the attempts that lost the race.  */
+  for (i = 0; i < next; i++)
+    if (attempts[i].sock >= 0)
+      {
+        DEBUGP (("Closing socket %d to %s.\n", attempts[i].sock,
+                 print_address (attempts[i].ip)));
+        connect_attempt_abandon (&attempts[i], false);
+      }
+  xfree (attempts);
+
+  if (sock < 0)
+    {
+      errno = last_errno;
+      return -1;
+    }
+
+  set_socket_nonblocking (sock, false);
+  address_list_set_family (al, winner->family);
+  log_connecting (winner, port, print);
+  logprintf (LOG_VERBOSE, _("connected.\n"));
+  DEBUGP (("Created socket %d.\n", sock));
+  return sock;
+}
+#endif /* ENABLE_IPV6 */
+
+/* Connect via TCP to a remote host on the specified port.
+
+   HOST is resolved as an Internet host name.  If HOST resolves to
+   more than one IP address, they are tried in the order returned by
+   DNS until connecting to one of them succeeds, or in parallel if
+   they are of both families (see connect_in_parallel).  */
+
+int
+connect_to_host (const char *host, int port)
+{
+  int i, start, end;
+  int sock;
+  struct address_list *al;
+  double phase_start;
+
+  sock = take_preconnected_socket (host, port);
+  if (sock >= 0)
+    return sock;
+
+  phase_start = metrics_now ();
+  al = lookup_host (host, 0);
+  metrics_phase (METRICS_DNS, phase_start);
+  phase_start = metrics_now ();
+
+ retry:
+  if (!al)
+    {
+      logprintf (LOG_NOTQUIET,
+                 _("%s: unable to resolve host address %s\n"),
+                 exec_name, quote (host));
+      return E_HOST;
+    }
+
+  address_list_get_bounds (al, &start, &end);
+#ifdef ENABLE_IPV6
+  if (address_list_mixed_p (al, start, end))
+    {
+      sock = connect_in_parallel (al, start, end, port, host);
+      if (sock >= 0)
+        {
+          /* Success. */
+          address_list_set_connected (al);
+          address_list_release (al);
+          metrics_phase (METRICS_CONNECT, phase_start);
+          return sock;
+        }
+
+      /* None of the addresses worked.  */
+      for (i = start; i < end; i++)
+        address_list_set_faulty (al, i);
+    }
+  else
+#endif /* ENABLE_IPV6 */
+    for (i = start; i < end; i++)
+      {
+        const ip_address *ip = address_list_address_at (al, i);
+        sock = connect_to_ip (ip, port, host);
+        if (sock >= 0)
+          {
+            /* Success. */
+            address_list_set_connected (al);
+            address_list_release (al);
+            metrics_phase (METRICS_CONNECT, phase_start);
+            return sock;
+          }
+
+        /* The attempt to connect has failed.  Continue with the loop
+           and try next address. */
+
+        address_list_set_faulty (al, i);
+      }
+
+  /* Failed to connect to any of the addresses in AL. */
+
+  if (address_list_connected_p (al))
+    {
+      /* We connected to AL before, but cannot do so now.  That might
+         indicate that our DNS cache entry for HOST has expired.  */
+      address_list_release (al);
+      al = lookup_host (host, LH_REFRESH);
+      goto retry;
+    }
+  address_list_release (al);
+
+  return -1;
+}
+
+#ifdef HAVE_HTTP3
+/* The receive buffer asked for the UDP sockets of QUIC connections,
+   which must hold the datagrams of a whole flow control window while
+   they wait to be read.  */
+#define UDP_RCVBUF_SIZE (4 * 1024 * 1024)
+
+/* Create a UDP socket connected to HOST:PORT, for a QUIC connection.
+   Connecting a UDP socket only fixes its peer, so the first address of
+   HOST that a socket can be connected to is used, and whether the
+   server answers is learnt from the handshake.  Returns the socket,
+   E_HOST if HOST cannot be resolved, or -1 with errno set.  */
+
+int
+connect_udp_to_host (const char *host, int port)
+{
+  struct address_list *al;
+  int i, start, end, sock = -1;
+
+  al = lookup_host (host, 0);
+  if (!al)
+    {
+      logprintf (LOG_NOTQUIET,
+                 _("%s: unable to resolve host address %s\n"),
+                 exec_name, quote (host));
+      return E_HOST;
+    }
+
+  address_list_get_bounds (al, &start, &end);
+  for (i = start; i < end && sock < 0; i++)
+    {
+      const ip_address *ip = address_list_address_at (al, i);
+      struct sockaddr_storage ss, bind_ss;
+      struct sockaddr *sa = (struct sockaddr *)&ss;
+      struct sockaddr *bind_sa = (struct sockaddr *)&bind_ss;
+
+      log_connecting (ip, port, host);
+      sockaddr_set_data (sa, ip, port);
+      sock = socket (sa->sa_family, SOCK_DGRAM, 0);
+      if (sock < 0)
+        continue;
+      set_int_option (sock, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF",
+                      UDP_RCVBUF_SIZE);
+      if ((opt.bind_address && resolve_bind_address (bind_sa)
+           && bind (sock, bind_sa, sockaddr_size (bind_sa)) < 0)
+          || connect (sock, sa, sockaddr_size (sa)) < 0)
+        {
+          int save_errno = errno;
+          logprintf (LOG_VERBOSE, _("failed: %s.\n"), strerror (errno));
+          close (sock);
+          sock = -1;
+          errno = save_errno;
+          continue;
+        }
+      logprintf (LOG_VERBOSE, _("connected.\n"));
+      DEBUGP (("Created UDP socket %d.\n", sock));
+    }
+  address_list_release (al);
+  return sock;
+}
+#endif /* HAVE_HTTP3 */
+
+/* Create a socket, bind it to local interface BIND_ADDRESS on port
+   *PORT, set up a listen backlog, and return the resulting socket, or
+   -1 in case of error.
+
+   BIND_ADDRESS is the address of the interface to bind to.  If it is
+   NULL, the socket is bound to the default address.  PORT should
+   point to the port number that will be used for the binding.  If
+   that number is 0, the system will choose a suitable port, and the
+   chosen value will be written to *PORT.
+
+   Calling accept() on such a socket waits for and accepts incoming
+   TCP connections.  */
+
+int
+bind_local (const ip_address *bind_address, int *port)
+{
+  int sock;
+  struct sockaddr_storage ss;
+  struct sockaddr *sa = (struct sockaddr *)&ss;
+
+  /* For setting options with setsockopt. */
+  int setopt_val = 1;
+  void *setopt_ptr = (void *)&setopt_val;
+  socklen_t setopt_size = sizeof (setopt_val);
+
+  sock = socket (bind_address->family, SOCK_STREAM, 0);
+  if (sock < 0)
+    return -1;
+
+#ifdef SO_REUSEADDR
+  if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, setopt_ptr, setopt_size))
+    logprintf (LOG_NOTQUIET, _("setsockopt SO_REUSEADDR failed: %s\n"),
+               strerror (errno));
+#endif
+
+  tune_socket (sock, false);
+
+  xzero (ss);
+  sockaddr_set_data (sa, bind_address, *port);
+  if (bind (sock, sa, sockaddr_size (sa)) < 0)
+    {
+      fd_close (sock);
+      return -1;
+    }
+  DEBUGP (("Local socket fd %d bound.\n", sock));
+
+  /* If *PORT is 0, find out which port we've bound to.  */
+  if (*port == 0)
     {
       socklen_t addrlen = sockaddr_size (sa);
       if (getsockname (sock, sa, &addrlen) < 0)
@@ -537,6 +1312,11 @@ accept_connection (int local_sock)
     }
   sock = accept (local_sock, sa, &addrlen);
   DEBUGP (("Accepted client at socket %d.\n", sock));
+#ifdef TCP_NODELAY
+  /* Not every system passes this on from the listening socket.  */
+  if (sock >= 0 && opt.tcp_nodelay)
+    set_int_option (sock, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+#endif
   return sock;
 }
 
@@ -745,6 +1525,8 @@ select_fd_nb (int fd, double maxtime, int wait_for)
    this function, where such pending data can only be unwanted
    leftover from a previous request.  */
 
+static bool read_ahead_p (int);
+
 bool
 test_socket_open (int sock)
 {
@@ -752,6 +1534,10 @@ test_socket_open (int sock)
   struct timeval to;
   int ret = 0;
 
+  /* Data already read counts as pending.  */
+  if (read_ahead_p (sock))
+    return false;
+
   if (sock >= FD_SETSIZE)
     {
       logprintf (LOG_NOTQUIET, _("Too many fds open.  Cannot use select on a fd >= %d\n"), FD_SETSIZE);
@@ -822,6 +1608,30 @@ sock_peek (int fd, char *buf, int bufsize)
   return res;
 }
 
+/* Like sock_read and sock_write, but return FD_WOULDBLOCK instead of
+   waiting for the socket.  */
+
+static int
+sock_transfer_nb (int fd, char *buf, int bufsize, bool writing)
+{
+  int res;
+#ifdef MSG_DONTWAIT
+  do
+    res = writing ? send (fd, buf, bufsize, MSG_DONTWAIT)
+                  : recv (fd, buf, bufsize, MSG_DONTWAIT);
+  while (res == -1 && errno == EINTR);
+#else
+  set_socket_nonblocking (fd, true);
+  do
+    res = writing ? send (fd, buf, bufsize, 0) : recv (fd, buf, bufsize, 0);
+  while (res == -1 && errno == EINTR);
+  set_socket_nonblocking (fd, false);
+#endif
+  if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return FD_WOULDBLOCK;
+  return res;
+}
+
 static void
 sock_close (int fd)
 {
@@ -848,26 +1658,135 @@ struct transport_info {
   void *ctx;
 };
 
-/* Register the transport layer operations that will be used when
-   reading, writing, and polling FD.
+/* Data read from a descriptor beyond what its reader wanted, and
+   given back with fd_unread.  fd_read, fd_read_nb and fd_peek return
+   it before reading from the descriptor again.  */
 
-   This should be used for transport layers like SSL that piggyback on
-   sockets.  FD should otherwise be a real socket, on which you can
-   call getpeername, etc.  */
+struct read_ahead {
+  char *data;
+  int pos, len;                 /* the part of DATA not read yet */
+};
+
+static struct hash_table *read_ahead_map;
+
+/* The descriptors with data in read_ahead_map, so that the usual case
+   of none costs no lookup.  */
+static int read_ahead_count;
+
+/* Give back the LEN bytes at BUF, read from FD, for the next reads
+   from FD to return before anything else.  */
 
 void
-fd_register_transport (int fd, struct transport_implementation *imp, void *ctx)
+fd_unread (int fd, const char *buf, int len)
 {
-  struct transport_info *info;
+  struct read_ahead *ra;
 
-  /* The file descriptor must be non-negative to be registered.
-     Negative values are ignored by fd_close(), and -1 cannot be used as
-     hash key.  */
-  assert (fd >= 0);
+  if (len <= 0)
+    return;
+  if (!read_ahead_map)
+    read_ahead_map = hash_table_new (0, NULL, NULL);
+  ra = hash_table_get (read_ahead_map, (void *)(intptr_t) fd);
+  if (!ra)
+    {
+      ra = xnew0 (struct read_ahead);
+      hash_table_put (read_ahead_map, (void *)(intptr_t) fd, ra);
+      ++read_ahead_count;
+    }
 
-  info = xnew (struct transport_info);
-  info->imp = imp;
-  info->ctx = ctx;
+  /* What was given back last is read first.  */
+  if (ra->len)
+    {
+      char *data = xmalloc (len + ra->len);
+      memcpy (data, buf, len);
+      memcpy (data + len, ra->data + ra->pos, ra->len);
+      xfree (ra->data);
+      ra->data = data;
+    }
+  else
+    {
+      xfree (ra->data);
+      ra->data = xmemdup (buf, len);
+    }
+  ra->pos = 0;
+  ra->len += len;
+}
+
+static void
+read_ahead_drop (int fd)
+{
+  struct read_ahead *ra;
+
+  if (!read_ahead_count
+      || !(ra = hash_table_get (read_ahead_map, (void *)(intptr_t) fd)))
+    return;
+  hash_table_remove (read_ahead_map, (void *)(intptr_t) fd);
+  --read_ahead_count;
+  xfree (ra->data);
+  xfree (ra);
+}
+
+/* Copy to BUF no more than BUFSIZE bytes given back to FD, and unless
+   PEEKING, consider them read.  Returns the number of bytes copied, 0
+   if there were none.  */
+
+static int
+read_ahead_take (int fd, char *buf, int bufsize, bool peeking)
+{
+  struct read_ahead *ra = hash_table_get (read_ahead_map,
+                                          (void *)(intptr_t) fd);
+  int len;
+
+  if (!ra)
+    return 0;
+  len = MIN (bufsize, ra->len);
+  memcpy (buf, ra->data + ra->pos, len);
+  if (!peeking)
+    {
+      ra->pos += len;
+      ra->len -= len;
+      if (!ra->len)
+        read_ahead_drop (fd);
+    }
+  return len;
+}
+
+/* Whether data was given back to FD.  */
+
+static bool
+read_ahead_p (int fd)
+{
+  return read_ahead_count
+    && hash_table_contains (read_ahead_map, (void *)(intptr_t) fd);
+}
+
+/* Register the transport layer operations that will be used when
+   reading, writing, and polling FD.
+
+   This should be used for transport layers like SSL that piggyback on
+   sockets.  FD should otherwise be a real socket, on which you can
+   call getpeername, etc.  */
+
+void
+fd_register_transport (int fd, struct transport_implementation *imp, void *ctx)
+{
+  struct transport_info *info;
+
+  /* The file descriptor must be non-negative to be registered.
+     Negative values are ignored by fd_close(), and -1 cannot be used as
+     hash key.  */
+  assert (fd >= 0);
+
+  /* What came over FD before the transport layer took over isn't
+     part of what it carries.  */
+  if (read_ahead_p (fd))
+    {
+      DEBUGP (("Discarding data received on %d before the transport.\n", fd));
+      read_ahead_drop (fd);
+    }
+
+  info = xnew (struct transport_info);
+  info->imp = imp;
+  info->ctx = ctx;
   if (!transport_map)
     transport_map = hash_table_new (0, NULL, NULL);
   hash_table_put (transport_map, (void *)(intptr_t) fd, info);
@@ -940,16 +1859,24 @@ int
 fd_read (int fd, char *buf, int bufsize, double timeout)
 {
   struct transport_info *info;
+  int ret;
+  STATS_START (start);
+
+  if (read_ahead_count && (ret = read_ahead_take (fd, buf, bufsize, false)))
+    return ret;
+
   LAZY_RETRIEVE_INFO (info);
 
   /* let imp->reader take care about timeout.
      (or in worst case timeout can be 2*timeout) */
   if (info && info->imp->reader)
-    return info->imp->reader (fd, buf, bufsize, info->ctx, timeout);
-
-  if (!poll_internal (fd, info, WAIT_FOR_READ, timeout))
-    return -1;
-  return sock_read (fd, buf, bufsize);
+    ret = info->imp->reader (fd, buf, bufsize, info->ctx, timeout);
+  else if (!poll_internal (fd, info, WAIT_FOR_READ, timeout))
+    ret = -1;
+  else
+    ret = sock_read (fd, buf, bufsize);
+  STATS_STOP (STATS_FD_READ, start, MAX (ret, 0));
+  return ret;
 }
 
 /* Like fd_read, except it provides a "preview" of the data that will
@@ -968,6 +1895,11 @@ int
 fd_peek (int fd, char *buf, int bufsize, double timeout)
 {
   struct transport_info *info;
+  int ret;
+
+  if (read_ahead_count && (ret = read_ahead_take (fd, buf, bufsize, true)))
+    return ret;
+
   LAZY_RETRIEVE_INFO (info);
 
   if (info && info->imp->peeker)
@@ -978,6 +1910,362 @@ fd_peek (int fd, char *buf, int bufsize, double timeout)
   return sock_peek (fd, buf, bufsize);
 }
 
+/* Read no more than BUFSIZE bytes from FD into BUF, without waiting
+   for data to arrive.  Returns what fd_read would, or FD_WOULDBLOCK if
+   nothing can be read yet.  In that case *WAIT_FOR is set to what FD
+   must become ready for before the read is tried again: usually
+   WAIT_FOR_READ, but a TLS transport may have to write first.  */
+
+int
+fd_read_nb (int fd, char *buf, int bufsize, int *wait_for)
+{
+  struct transport_info *info;
+  int ret;
+
+  *wait_for = WAIT_FOR_READ;
+  if (read_ahead_count && (ret = read_ahead_take (fd, buf, bufsize, false)))
+    return ret;
+
+  LAZY_RETRIEVE_INFO (info);
+
+  if (info && info->imp->nb_reader)
+    ret = info->imp->nb_reader (fd, buf, bufsize, info->ctx, wait_for);
+  else if (info && info->imp->reader)
+    {
+      /* The best that can be done without help from the transport.  */
+      if ((info->imp->poller
+           ? info->imp->poller (fd, 0, WAIT_FOR_READ, info->ctx)
+           : select_fd (fd, 0, WAIT_FOR_READ)) <= 0)
+        return FD_WOULDBLOCK;
+      ret = info->imp->reader (fd, buf, bufsize, info->ctx, 0);
+    }
+  else
+    ret = sock_transfer_nb (fd, buf, bufsize, false);
+  if (ret > 0)
+    STATS_ADD (STATS_FD_READ, ret);
+  return ret;
+}
+
+/* Write no more than BUFSIZE bytes of BUF to FD, without waiting for
+   room in the socket's buffers.  Returns the number of bytes written,
+   which may be fewer than BUFSIZE, -1 on error, or FD_WOULDBLOCK with
+   *WAIT_FOR set as in fd_read_nb.  After FD_WOULDBLOCK the write must
+   be tried again with the same data, which a TLS transport may
+   already have started to send.  */
+
+int
+fd_write_nb (int fd, char *buf, int bufsize, int *wait_for)
+{
+  struct transport_info *info;
+  LAZY_RETRIEVE_INFO (info);
+
+  *wait_for = WAIT_FOR_WRITE;
+  if (info && info->imp->nb_writer)
+    return info->imp->nb_writer (fd, buf, bufsize, info->ctx, wait_for);
+  if (info && info->imp->writer)
+    {
+      if ((info->imp->poller
+           ? info->imp->poller (fd, 0, WAIT_FOR_WRITE, info->ctx)
+           : select_fd (fd, 0, WAIT_FOR_WRITE)) <= 0)
+        return FD_WOULDBLOCK;
+      return info->imp->writer (fd, buf, bufsize, info->ctx);
+    }
+  return sock_transfer_nb (fd, buf, bufsize, true);
+}
+
+/* Watching several descriptors at once.  Code that multiplexes
+   connections registers a callback for each descriptor with fd_watch
+   and calls fd_dispatch in a loop; the callbacks move the data with
+   fd_read_nb and fd_write_nb, so that a connection that has delivered
+   half a TLS record cannot hold up the others.
+
+   Readiness comes from epoll where it exists, poll otherwise, and
+   select as a last resort.  Windows uses select, which gnulib makes
+   work with the C runtime descriptors Wget keeps its sockets in.  */
+
+struct fd_watcher {
+  int wait_for;                 /* WAIT_FOR_READ and/or WAIT_FOR_WRITE */
+  fd_callback_t callback;
+  void *arg;
+};
+
+/* Mapping of watched descriptors to their struct fd_watcher.  */
+static struct hash_table *watcher_map;
+
+/* The most descriptors reported ready by one fd_dispatch.  The others
+   stay ready for the next call.  */
+#define MAX_READY 64
+
+#ifdef WATCH_EPOLL
+static int epoll_fd = -1;
+
+/* Tell epoll what to watch FD for.  */
+
+static bool
+epoll_update (int fd, int wait_for, bool added)
+{
+  struct epoll_event ev;
+
+  if (epoll_fd < 0 && (epoll_fd = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+    return false;
+
+  xzero (ev);
+  ev.events = ((wait_for & WAIT_FOR_READ ? EPOLLIN : 0)
+               | (wait_for & WAIT_FOR_WRITE ? EPOLLOUT : 0));
+  ev.data.fd = fd;
+  if (epoll_ctl (epoll_fd, added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) == 0)
+    return true;
+  /* A descriptor closed behind our back has left the epoll set, and
+     may since have been reused.  */
+  if (errno == ENOENT || errno == EEXIST)
+    return epoll_ctl (epoll_fd, added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                      fd, &ev) == 0;
+  return false;
+}
+#endif /* WATCH_EPOLL */
+
+/* Call CALLBACK with ARG when FD becomes ready for WAIT_FOR, which can
+   be a combination of WAIT_FOR_READ and WAIT_FOR_WRITE.  Calling this
+   for a descriptor already watched replaces its callback.  FD stays
+   watched until fd_unwatch or fd_close is called on it.  */
+
+void
+fd_watch (int fd, int wait_for, fd_callback_t callback, void *arg)
+{
+  struct fd_watcher *w;
+
+  assert (fd >= 0);
+
+  if (!watcher_map)
+    watcher_map = hash_table_new (0, NULL, NULL);
+  w = hash_table_get (watcher_map, (void *)(intptr_t) fd);
+  if (!w)
+    {
+      /* A null callback marks the watcher as new.  */
+      w = xnew0 (struct fd_watcher);
+      hash_table_put (watcher_map, (void *)(intptr_t) fd, w);
+    }
+  else if (w->wait_for == wait_for && w->callback == callback
+           && w->arg == arg)
+    return;
+
+#ifdef WATCH_EPOLL
+  if ((!w->callback || w->wait_for != wait_for)
+      && !epoll_update (fd, wait_for, !w->callback))
+    DEBUGP (("Cannot watch fd %d: %s\n", fd, strerror (errno)));
+#endif
+  w->wait_for = wait_for;
+  w->callback = callback;
+  w->arg = arg;
+}
+
+/* Stop watching FD.  */
+
+void
+fd_unwatch (int fd)
+{
+  struct fd_watcher *w;
+
+  if (!watcher_map
+      || !(w = hash_table_get (watcher_map, (void *)(intptr_t) fd)))
+    return;
+  hash_table_remove (watcher_map, (void *)(intptr_t) fd);
+  xfree (w);
+#ifdef WATCH_EPOLL
+  if (epoll_fd >= 0)
+    {
+      struct epoll_event ev;    /* ignored, but needed before 2.6.9 */
+      xzero (ev);
+      epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+    }
+#endif
+}
+
+/* Store in FDS the watched descriptors whose transport holds data
+   that can be read at once, and return their number.  */
+
+static int
+watch_buffered (int *fds, int *events)
+{
+  hash_table_iterator iter;
+  int count = 0;
+
+  if (!transport_map && !read_ahead_count)
+    return 0;
+  for (hash_table_iterate (watcher_map, &iter);
+       hash_table_iter_next (&iter) && count < MAX_READY;
+       )
+    {
+      int fd = (intptr_t) iter.key;
+      struct fd_watcher *w = iter.value;
+      struct transport_info *info;
+
+      if (!(w->wait_for & WAIT_FOR_READ))
+        continue;
+      info = transport_map ? hash_table_get (transport_map,
+                                             (void *)(intptr_t) fd) : NULL;
+      if (read_ahead_p (fd)
+          || (info && info->imp->pending && info->imp->pending (fd, info->ctx)))
+        {
+          fds[count] = fd;
+          events[count++] = WAIT_FOR_READ;
+        }
+    }
+  return count;
+}
+
+/* Wait up to TIMEOUT seconds for watched descriptors to become ready,
+   and store them in FDS, and what they are ready for in EVENTS.
+   Errors and hangups count as ready for everything.  Returns the
+   number of ready descriptors, 0 for timeout and -1 for error.  */
+
+static int
+watch_wait (int *fds, int *events, double timeout)
+{
+  int count = 0;
+#ifdef WATCH_EPOLL
+  struct epoll_event evs[MAX_READY];
+  int i, res;
+
+  if (epoll_fd < 0)
+    return -1;
+  do
+    res = epoll_wait (epoll_fd, evs, MAX_READY, (int) (timeout * 1000 + 0.5));
+  while (res < 0 && errno == EINTR);
+  for (i = 0; i < res; i++)
+    {
+      int ev = evs[i].events;
+      fds[count] = evs[i].data.fd;
+      events[count++] = ((ev & (EPOLLIN | EPOLLERR | EPOLLHUP) ? WAIT_FOR_READ : 0)
+                         | (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP) ? WAIT_FOR_WRITE : 0));
+    }
+  return res < 0 ? -1 : count;
+#else /* not WATCH_EPOLL */
+  hash_table_iterator iter;
+  int nfds = hash_table_count (watcher_map), i = 0, res;
+# ifdef WATCH_POLL
+  struct pollfd *pfds = xnew_array (struct pollfd, nfds);
+
+  for (hash_table_iterate (watcher_map, &iter); hash_table_iter_next (&iter); )
+    {
+      struct fd_watcher *w = iter.value;
+      pfds[i].fd = (intptr_t) iter.key;
+      pfds[i].events = ((w->wait_for & WAIT_FOR_READ ? POLLIN : 0)
+                        | (w->wait_for & WAIT_FOR_WRITE ? POLLOUT : 0));
+      pfds[i++].revents = 0;
+    }
+  do
+    res = poll (pfds, nfds, (int) (timeout * 1000 + 0.5));
+  while (res < 0 && errno == EINTR);
+  for (i = 0; res > 0 && i < nfds && count < MAX_READY; i++)
+    {
+      int ev = pfds[i].revents;
+      if (!ev)
+        continue;
+      fds[count] = pfds[i].fd;
+      events[count++] = ((ev & (POLLIN | POLLERR | POLLHUP | POLLNVAL) ? WAIT_FOR_READ : 0)
+                         | (ev & (POLLOUT | POLLERR | POLLHUP | POLLNVAL) ? WAIT_FOR_WRITE : 0));
+    }
+  xfree (pfds);
+# else /* not WATCH_POLL */
+  fd_set rdset, wrset;
+  struct timeval tmout;
+  int maxfd = -1;
+  int *all = xnew_array (int, nfds);
+
+  FD_ZERO (&rdset);
+  FD_ZERO (&wrset);
+  for (hash_table_iterate (watcher_map, &iter); hash_table_iter_next (&iter); )
+    {
+      struct fd_watcher *w = iter.value;
+      int fd = (intptr_t) iter.key;
+
+      if (fd >= FD_SETSIZE)
+        {
+          logprintf (LOG_NOTQUIET, _("Too many fds open.  Cannot use select on a fd >= %d\n"), FD_SETSIZE);
+          exit (WGET_EXIT_GENERIC_ERROR);
+        }
+      if (w->wait_for & WAIT_FOR_READ)
+        FD_SET (fd, &rdset);
+      if (w->wait_for & WAIT_FOR_WRITE)
+        FD_SET (fd, &wrset);
+      all[i++] = fd;
+      maxfd = MAX (maxfd, fd);
+    }
+
+  tmout.tv_sec = (long) timeout;
+  tmout.tv_usec = 1000000 * (timeout - (long) timeout);
+  do
+    {
+      res = select (maxfd + 1, &rdset, &wrset, NULL, &tmout);
+#  ifdef WINDOWS
+      /* See select_fd_internal.  */
+      for (i = 0; i < nfds; i++)
+        set_windows_fd_as_blocking_socket (all[i]);
+#  endif
+    }
+  while (res < 0 && errno == EINTR);
+  for (i = 0; res > 0 && i < nfds && count < MAX_READY; i++)
+    {
+      int ev = ((FD_ISSET (all[i], &rdset) ? WAIT_FOR_READ : 0)
+                | (FD_ISSET (all[i], &wrset) ? WAIT_FOR_WRITE : 0));
+      if (!ev)
+        continue;
+      fds[count] = all[i];
+      events[count++] = ev;
+    }
+  xfree (all);
+# endif /* not WATCH_POLL */
+  return res < 0 ? -1 : count;
+#endif /* not WATCH_EPOLL */
+}
+
+/* Wait for watched descriptors to become ready, for no more than
+   TIMEOUT seconds, and run the callbacks of those that are, passing
+   each its descriptor, what it is ready for, and its argument.
+   Descriptors with data buffered in their transport, such as
+   decrypted TLS records, are ready without waiting.
+
+   Callbacks may watch and unwatch descriptors, and close them.  As a
+   descriptor closed by one callback can be reused for a new
+   connection before the next one runs, a callback can be called
+   when nothing is there to be read; fd_read_nb then simply returns
+   FD_WOULDBLOCK.
+
+   Returns the number of callbacks run, 0 for timeout or when nothing
+   is watched, and -1 for error.  Like select_fd, this doesn't
+   implement Wget's 0-timeout-means-no-timeout semantics.  */
+
+int
+fd_dispatch (double timeout)
+{
+  int fds[MAX_READY], events[MAX_READY];
+  int count, i, run = 0;
+
+  if (!watcher_map || !hash_table_count (watcher_map))
+    return 0;
+
+  count = watch_buffered (fds, events);
+  if (!count)
+    count = watch_wait (fds, events, timeout);
+  if (count < 0)
+    return -1;
+
+  for (i = 0; i < count; i++)
+    {
+      struct fd_watcher *w = hash_table_get (watcher_map,
+                                             (void *)(intptr_t) fds[i]);
+      int ready;
+
+      /* Not watched anymore, or not for this.  */
+      if (!w || !(ready = events[i] & w->wait_for))
+        continue;
+      w->callback (fds[i], ready, w->arg);
+      ++run;
+    }
+  return run;
+}
+
 /* Write the entire contents of BUF to FD.  If TIMEOUT is non-zero,
    the operation aborts if no data is received after that many
    seconds.  If TIMEOUT is -1, the value of opt.timeout is used for
@@ -986,8 +2274,9 @@ fd_peek (int fd, char *buf, int bufsize, double timeout)
 int
 fd_write (int fd, char *buf, int bufsize, double timeout)
 {
-  int res;
+  int res, written = 0;
   struct transport_info *info;
+  STATS_START (start);
   LAZY_RETRIEVE_INFO (info);
 
   /* `write' may write less than LEN bytes, thus the loop keeps trying
@@ -996,7 +2285,10 @@ fd_write (int fd, char *buf, int bufsize, double timeout)
   while (bufsize > 0)
     {
       if (!poll_internal (fd, info, WAIT_FOR_WRITE, timeout))
-        return -1;
+        {
+          res = -1;
+          break;
+        }
       if (info && info->imp->writer)
         res = info->imp->writer (fd, buf, bufsize, info->ctx);
       else
@@ -1005,10 +2297,450 @@ fd_write (int fd, char *buf, int bufsize, double timeout)
         break;
       buf += res;
       bufsize -= res;
+      written += res;
     }
+  STATS_STOP (STATS_FD_WRITE, start, written);
   return res;
 }
 
+/* Send up to COUNT bytes of the file open on FILE_FD, starting at its
+   current offset, to FD, and let the kernel do the copying where it
+   can.  Return the number of bytes sent, or -1 on error.  A short
+   count (possibly 0) means that FILE_FD ended, or that FD cannot be
+   written to this way, e.g. because it carries TLS; the caller is
+   expected to send the rest with fd_write.  The file offset is left
+   after the last byte sent.  TIMEOUT is treated as in fd_write.  */
+
+wgint
+fd_send_file (int fd, int file_fd, wgint count, double timeout)
+{
+  wgint sent = 0;
+  struct transport_info *info;
+  LAZY_RETRIEVE_INFO (info);
+
+  if (info && info->imp->writer)
+    return 0;
+
+#if defined HAVE_SENDFILE && defined HAVE_SYS_SENDFILE_H
+  while (sent < count)
+    {
+      ssize_t res;
+      if (!poll_internal (fd, info, WAIT_FOR_WRITE, timeout))
+        return -1;
+      res = sendfile (fd, file_fd, NULL, MIN (count - sent, 1 << 30));
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          /* Not a file sendfile can read from; copy it by hand.  */
+          if (sent == 0 && (errno == EINVAL || errno == ENOSYS))
+            return 0;
+          return -1;
+        }
+      if (res == 0)
+        break;                  /* end of file */
+      sent += res;
+    }
+#elif defined WINDOWS
+  if (poll_internal (fd, info, WAIT_FOR_WRITE, timeout))
+    sent = ws_transmit_file (fd, file_fd, count);
+  else
+    sent = -1;
+#else
+  (void) file_fd;
+  (void) count;
+  (void) timeout;
+#endif
+  return sent;
+}
+
+#ifdef HAVE_SPLICE
+/* The pipe fd_recv_file moves data through, and the size asked of
+   it.  The default 64k would take several splices per read.  */
+static int splice_pipe[2] = { -1, -1 };
+# define SPLICE_PIPE_SIZE (1024 * 1024)
+
+static void
+splice_pipe_close (void)
+{
+  if (splice_pipe[0] >= 0)
+    {
+      close (splice_pipe[0]);
+      close (splice_pipe[1]);
+      splice_pipe[0] = splice_pipe[1] = -1;
+    }
+}
+#endif
+
+#ifdef HAVE_LIBURING
+/* With --io-uring, fd_recv_file receives the data of a plain
+   connection into one of two buffers registered with io_uring, and
+   has the block received before written to the file along with it:
+   a single io_uring_enter per block, where fd_read and write_data
+   take a select(), a read() and a write().  The read timeout is a
+   linked timeout, handled by the kernel as well.
+
+   The receive and the write of the same block cannot be linked, as a
+   short receive, the usual case on a socket, would cancel the write.
+   So the last block received is only written by the next call, or by
+   fd_recv_file_finish.  */
+
+# define URING_BUF_SIZE (1024 * 1024)
+
+enum { URING_READ = 1, URING_TIMEOUT, URING_WRITE };
+
+static struct {
+  struct io_uring ring;
+  bool ready;                   /* the ring is set up */
+  bool failed;                  /* the ring cannot be used */
+  bool fixed;                   /* the buffers are registered */
+  char *buf[2];
+  int next;                     /* the buffer to receive into */
+  int pending_fd;               /* the file the other one goes to */
+  int pending_len;              /* what it holds for it, or 0 */
+} uring;
+
+/* Set up the ring on first use.  Return false if it cannot be.  */
+
+static bool
+uring_setup (void)
+{
+  struct io_uring_params params;
+  struct iovec iov[2];
+  int i, ret;
+
+  if (uring.ready || uring.failed)
+    return uring.ready;
+
+  xzero (params);
+  ret = io_uring_queue_init_params (8, &uring.ring, &params);
+  if (ret < 0)
+    {
+      DEBUGP (("Cannot set up io_uring: %s\n", strerror (-ret)));
+      uring.failed = true;
+      return false;
+    }
+  /* Writing at the current position of the file, like write() does,
+     takes Linux 5.6.  */
+  if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+      DEBUGP (("io_uring cannot write at the file position.\n"));
+      io_uring_queue_exit (&uring.ring);
+      uring.failed = true;
+      return false;
+    }
+
+  for (i = 0; i < 2; i++)
+    {
+      uring.buf[i] = xmalloc (URING_BUF_SIZE);
+      iov[i].iov_base = uring.buf[i];
+      iov[i].iov_len = URING_BUF_SIZE;
+    }
+  /* Registering pins the buffers, which RLIMIT_MEMLOCK may not allow
+     before Linux 5.12.  They are then passed with every request.  */
+  uring.fixed = io_uring_register_buffers (&uring.ring, iov, 2) == 0;
+  uring.ready = true;
+  return true;
+}
+
+/* Return true if FD can be received from through io_uring: it must be
+   in blocking mode, or the receives would fail instead of waiting.  */
+
+static bool
+uring_usable_p (int fd)
+{
+  int flags = fcntl (fd, F_GETFL);
+  return flags >= 0 && !(flags & O_NONBLOCK) && uring_setup ();
+}
+
+/* Prepare to read LEN bytes from FD into buffer INDEX, or to write
+   them from it if OP is URING_WRITE.  */
+
+static struct io_uring_sqe *
+uring_prep (int op, int fd, int index, int len)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe (&uring.ring);
+  char *buf = uring.buf[index];
+
+  if (op == URING_WRITE && uring.fixed)
+    io_uring_prep_write_fixed (sqe, fd, buf, len, -1, index);
+  else if (op == URING_WRITE)
+    io_uring_prep_write (sqe, fd, buf, len, -1);
+  else if (uring.fixed)
+    io_uring_prep_read_fixed (sqe, fd, buf, len, -1, index);
+  else
+    io_uring_prep_read (sqe, fd, buf, len, -1);
+  io_uring_sqe_set_data (sqe, (void *)(intptr_t) op);
+  return sqe;
+}
+
+/* Submit what was prepared and wait for the COUNT completions it
+   makes, storing the results of the read and of the write to
+   *READ_RES and *WRITE_RES.  Return false if io_uring failed, in
+   which case it is not used anymore.  */
+
+static bool
+uring_run (int count, int *read_res, int *write_res)
+{
+  int ret = io_uring_submit_and_wait (&uring.ring, count);
+
+  if (ret < 0 && ret != -EINTR)
+    goto fail;
+  while (count > 0)
+    {
+      struct io_uring_cqe *cqe;
+
+      ret = io_uring_wait_cqe (&uring.ring, &cqe);
+      if (ret == -EINTR)
+        continue;
+      if (ret < 0)
+        goto fail;
+      switch ((intptr_t) io_uring_cqe_get_data (cqe))
+        {
+        case URING_READ:
+          *read_res = cqe->res;
+          break;
+        case URING_WRITE:
+          *write_res = cqe->res;
+          break;
+        }
+      io_uring_cqe_seen (&uring.ring, cqe);
+      --count;
+    }
+  return true;
+
+ fail:
+  logprintf (LOG_NOTQUIET, _("io_uring failed: %s\n"), strerror (-ret));
+  uring.ready = false;
+  uring.failed = true;
+  uring.pending_len = 0;
+  errno = -ret;
+  return false;
+}
+
+/* Finish writing the block received before, of which RES bytes were
+   written already.  Return false with errno set on failure.  */
+
+static bool
+uring_write_done (int res)
+{
+  const char *buf = uring.buf[!uring.next];
+  int len = uring.pending_len;
+
+  uring.pending_len = 0;
+  if (res < 0)
+    {
+      errno = -res;
+      return false;
+    }
+  while (res < len)
+    {
+      ssize_t out = write (uring.pending_fd, buf + res, len - res);
+      if (out < 0 && errno == EINTR)
+        continue;
+      if (out <= 0)
+        {
+          if (out == 0)
+            errno = ENOSPC;
+          return false;
+        }
+      res += out;
+    }
+  return true;
+}
+
+/* The io_uring variant of fd_recv_file, which see.  */
+
+static int
+uring_recv_file (int fd, int file_fd, int count, double timeout)
+{
+  struct io_uring_sqe *sqe;
+  struct __kernel_timespec ts;
+  bool writing = uring.pending_len > 0;
+  int expected = 1, read_res = 0, write_res = 0;
+  STATS_START (start);
+
+  if (timeout == -1)
+    timeout = opt.read_timeout;
+  count = MIN (count, URING_BUF_SIZE);
+
+  if (writing)
+    {
+      uring_prep (URING_WRITE, uring.pending_fd, !uring.next,
+                  uring.pending_len);
+      ++expected;
+    }
+  sqe = uring_prep (URING_READ, fd, uring.next, count);
+  if (timeout)
+    {
+      sqe->flags |= IOSQE_IO_LINK;
+      ts.tv_sec = (long long) timeout;
+      ts.tv_nsec = (long long) ((timeout - ts.tv_sec) * 1e9);
+      sqe = io_uring_get_sqe (&uring.ring);
+      io_uring_prep_link_timeout (sqe, &ts, 0);
+      io_uring_sqe_set_data (sqe, (void *)(intptr_t) URING_TIMEOUT);
+      ++expected;
+    }
+
+  if (!uring_run (expected, &read_res, &write_res))
+    return -1;
+  if (writing && !uring_write_done (write_res))
+    return -1;
+
+  /* The socket was made non-blocking since fd_splice_p; fd_read
+     waits for it.  */
+  if (read_res == -EAGAIN)
+    return -2;
+  if (read_res == -ECANCELED)
+    {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  if (read_res < 0)
+    {
+      errno = -read_res;
+      return -1;
+    }
+  if (read_res > 0)
+    {
+      uring.pending_fd = file_fd;
+      uring.pending_len = read_res;
+      uring.next = !uring.next;
+    }
+  STATS_STOP (STATS_FD_READ, start, read_res);
+  return read_res;
+}
+#endif /* HAVE_LIBURING */
+
+/* Return true if the data of FD can be received with fd_recv_file.
+   This is the case for transports that say so, such as TLS decrypted
+   by the kernel, and with --io-uring for plain connections.  */
+
+bool
+fd_splice_p (int fd)
+{
+#if defined HAVE_SPLICE || defined HAVE_LIBURING
+  struct transport_info *info;
+  LAZY_RETRIEVE_INFO (info);
+
+# ifdef HAVE_SPLICE
+  if (info && info->imp->spliceable && info->imp->spliceable (fd, info->ctx))
+    return true;
+# endif
+# ifdef HAVE_LIBURING
+  if (!info && opt.io_uring && uring_usable_p (fd))
+    return true;
+# endif
+#else
+  (void) fd;
+#endif
+  return false;
+}
+
+/* The counterpart of fd_send_file: receive up to COUNT bytes from FD
+   into the file open on FILE_FD at its current offset, letting the
+   kernel move them through a pipe without copying them to user space,
+   or with --io-uring, through io_uring.  Return the number of bytes
+   received, 0 at the end of the stream, -1 on error, or -2 if what
+   comes next cannot be received this way, in which case the caller is
+   expected to fd_read it.  That happens with data given back by
+   fd_unread, or a TLS record the kernel leaves to the library.
+   TIMEOUT is treated as in fd_read.
+
+   With io_uring, the data may only be written by the next call:
+   fd_recv_file_finish must be called before the file is written to
+   otherwise, or closed.  */
+
+int
+fd_recv_file (int fd, int file_fd, int count, double timeout)
+{
+#if defined HAVE_SPLICE || defined HAVE_LIBURING
+  struct transport_info *info;
+# ifdef HAVE_SPLICE
+  ssize_t in, moved = 0;
+  STATS_START (start);
+# endif
+
+  if (read_ahead_p (fd))
+    return -2;
+  LAZY_RETRIEVE_INFO (info);
+
+# ifdef HAVE_LIBURING
+  /* fd_splice_p has set up the ring.  */
+  if (!info)
+    return opt.io_uring && uring.ready
+      ? uring_recv_file (fd, file_fd, count, timeout) : -2;
+# endif
+# ifdef HAVE_SPLICE
+  if (!info || !info->imp->spliceable
+      || !info->imp->spliceable (fd, info->ctx))
+    return -2;
+
+  if (splice_pipe[0] < 0)
+    {
+      if (pipe (splice_pipe) < 0)
+        return -2;
+#  ifdef F_SETPIPE_SZ
+      fcntl (splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+#  endif
+    }
+
+  if (!poll_internal (fd, info, WAIT_FOR_READ, timeout))
+    return -1;
+
+  do
+    in = splice (fd, NULL, splice_pipe[1], NULL, count, SPLICE_F_MOVE);
+  while (in < 0 && errno == EINTR);
+  if (in < 0)
+    /* With kernel TLS, a record other than application data.  */
+    return errno == EINVAL ? -2 : -1;
+
+  while (moved < in)
+    {
+      ssize_t out = splice (splice_pipe[0], NULL, file_fd, NULL,
+                            in - moved, SPLICE_F_MOVE);
+      if (out < 0 && errno == EINTR)
+        continue;
+      if (out <= 0)
+        {
+          /* What is left in the pipe would end up in the next file.  */
+          int saved_errno = errno;
+          splice_pipe_close ();
+          errno = out < 0 ? saved_errno : ENOSPC;
+          return -1;
+        }
+      moved += out;
+    }
+  STATS_STOP (STATS_FD_READ, start, in);
+  return in;
+# else
+  (void) file_fd;
+  (void) count;
+  (void) timeout;
+  return -2;
+# endif
+#else
+  (void) fd;
+  (void) file_fd;
+  (void) count;
+  (void) timeout;
+  return -2;
+#endif
+}
+
+/* Write out what fd_recv_file has received and not written yet.
+   Return 0, or -1 with errno set if that failed.  */
+
+int
+fd_recv_file_finish (void)
+{
+#ifdef HAVE_LIBURING
+  if (uring.pending_len && !uring_write_done (0))
+    return -1;
+#endif
+  return 0;
+}
+
 /* Report the most recent error(s) on FD.  This should only be called
    after fd_* functions, such as fd_read and fd_write, and only if
    they return a negative result.  For errors coming from other calls
@@ -1048,6 +2780,9 @@ fd_close (int fd)
   if (fd < 0)
     return;
 
+  fd_unwatch (fd);
+  read_ahead_drop (fd);
+
   /* Don't use LAZY_RETRIEVE_INFO because fd_close() is only called once
      per socket, so that particular optimization wouldn't work.  */
   info = NULL;
@@ -1071,6 +2806,8 @@ fd_close (int fd)
 void
 connect_cleanup(void)
 {
+  preconnect_discard_all ();
+
   if (transport_map)
     {
       hash_table_iterator iter;
@@ -1081,5 +2818,45 @@ connect_cleanup(void)
       hash_table_destroy (transport_map);
       transport_map = NULL;
     }
+
+  if (watcher_map)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (watcher_map, &iter); hash_table_iter_next (&iter); )
+        xfree (iter.value);
+      hash_table_destroy (watcher_map);
+      watcher_map = NULL;
+    }
+
+  if (read_ahead_map)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (read_ahead_map, &iter); hash_table_iter_next (&iter); )
+        {
+          struct read_ahead *ra = iter.value;
+          xfree (ra->data);
+          xfree (ra);
+        }
+      hash_table_destroy (read_ahead_map);
+      read_ahead_map = NULL;
+      read_ahead_count = 0;
+    }
+#ifdef WATCH_EPOLL
+  if (epoll_fd >= 0)
+    {
+      close (epoll_fd);
+      epoll_fd = -1;
+    }
+#endif
+#ifdef HAVE_SPLICE
+  splice_pipe_close ();
+#endif
+#ifdef HAVE_LIBURING
+  if (uring.ready)
+    io_uring_queue_exit (&uring.ring);
+  xfree (uring.buf[0]);
+  xfree (uring.buf[1]);
+  uring.ready = false;
+#endif
 }
 #endif
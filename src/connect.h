@@ -40,7 +40,14 @@ enum {
   E_HOST = -100
 };
 int connect_to_host (const char *, int);
+#ifdef HAVE_HTTP3
+int connect_udp_to_host (const char *, int);
+#endif
 int connect_to_ip (const ip_address *, int, const char *);
+int connect_to_ip_start (const ip_address *, int);
+int connect_to_ip_finish (int);
+void preconnect_to_host (const char *, int, int);
+void preconnect_discard_all (void);
 
 int bind_local (const ip_address *, int *);
 int accept_connection (int);
@@ -61,6 +68,7 @@ enum {
 };
 int select_fd (int, double, int);
 bool test_socket_open (int);
+void set_socket_nonblocking (int, bool);
 
 struct transport_implementation {
   int (*reader) (int, char *, int, void *, double);
@@ -69,13 +77,43 @@ struct transport_implementation {
   int (*peeker) (int, char *, int, void *, double);
   const char *(*errstr) (int, void *);
   void (*closer) (int, void *);
+
+  /* Non-blocking variants of reader and writer, as described at
+     fd_read_nb, and a check for data the transport has already
+     received but not handed out.  All three are optional.  */
+  int (*nb_reader) (int, char *, int, void *, int *);
+  int (*nb_writer) (int, char *, int, void *, int *);
+  bool (*pending) (int, void *);
+
+  /* Whether what arrives on the socket itself is the data the reader
+     would return, e.g. because the kernel decrypts TLS, so that
+     fd_recv_file can move it.  Optional.  */
+  bool (*spliceable) (int, void *);
+};
+
+/* Returned by fd_read_nb and fd_write_nb when the transfer cannot
+   proceed without blocking.  */
+enum {
+  FD_WOULDBLOCK = -3
 };
 
+typedef void (*fd_callback_t) (int, int, void *);
+
 void fd_register_transport (int, struct transport_implementation *, void *);
 void *fd_transport_context (int);
 int fd_read (int, char *, int, double);
 int fd_write (int, char *, int, double);
+wgint fd_send_file (int, int, wgint, double);
+bool fd_splice_p (int);
+int fd_recv_file (int, int, int, double);
+int fd_recv_file_finish (void);
 int fd_peek (int, char *, int, double);
+void fd_unread (int, const char *, int);
+int fd_read_nb (int, char *, int, int *);
+int fd_write_nb (int, char *, int, int *);
+void fd_watch (int, int, fd_callback_t, void *);
+void fd_unwatch (int);
+int fd_dispatch (double);
 const char *fd_errstr (int);
 void fd_close (int);
 void connect_cleanup (void);
@@ -36,9 +36,14 @@ as that of the covered work.  */
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <sys/stat.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 #include "convert.h"
 #include "url.h"
 #include "recur.h"
+#include "retr.h"
 #include "utils.h"
 #include "hash.h"
 #include "ptimer.h"
@@ -47,114 +52,499 @@ as that of the covered work.  */
 #include "css-url.h"
 #include "iri.h"
 #include "xstrndup.h"
+#include "stats.h"
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+#ifdef HAVE_PTHREAD
+# include "nproc.h"
+#endif
 
+/* The downloaded files and their URLs.  dl_file_url_map maps each
+   file to the struct download_record of the URL it was downloaded
+   from, and dl_url_file_map maps that URL, and the URLs redirected to
+   it, to the file.  All their strings are interned, see
+   intern_string.  */
 static struct hash_table *dl_file_url_map;
 struct hash_table *dl_url_file_map;
 
+/* What is kept of the URL a file was downloaded from: its string,
+   which is parsed again by download_record_url when the links of the
+   file are converted, and the charsets the parse doesn't give.  */
+struct download_record {
+  const char *url;
+  const char *ori_enc;
+  const char *content_enc;
+  enum url_type enc_type;
+};
+
+static struct url *download_record_url (const struct download_record *);
+
+/* The reverse of dl_url_file_map: the URLs mapped to each file, as a
+   list of struct file_url, so that the URLs of a file can be
+   dissociated from it without going through all of them.  */
+struct file_url {
+  const char *url;
+  struct file_url *next;
+};
+static struct hash_table *dl_file_urls_map;
+
+/* The interned strings are stored once each, one after the other in
+   blocks of at least STRING_POOL_BLOCK bytes, which are only freed by
+   convert_cleanup.  A crawl keeps millions of them, mostly once per
+   file or URL, and a string of its own each would cost as much again
+   in malloc overhead.  */
+#define STRING_POOL_BLOCK 65536
+
+struct string_pool_block {
+  struct string_pool_block *next;
+  size_t used, size;
+  /* The strings follow.  */
+};
+static struct string_pool_block *string_pool;
+
+/* The set of the interned strings.  */
+static struct hash_table *interned_strings;
+
 /* Set of HTML/CSS files downloaded in this Wget run, used for link
    conversion after Wget is done.  */
 struct hash_table *downloaded_html_set;
 struct hash_table *downloaded_css_set;
 
-static void convert_links (const char *, struct urlpos *);
+/* A growing buffer, into which the converted document and the text
+   replacing each link are assembled.  */
+struct conv_buffer
+{
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+/* The state kept across the files of one convert_all_links run, so
+   that converting a file allocates nothing once it is warmed up.  */
+struct conv_state
+{
+  struct conv_buffer doc;       /* the converted document */
+  struct conv_buffer name;      /* the new link, before quoting */
+  struct conv_buffer text;      /* the new link, quoted */
+
+  /* The relative paths from the directory of the file being
+     converted, BASEDIR, to each directory its links point into.  The
+     files are converted in sorted order, so that files in the same
+     directory share this.  */
+  char *basedir;
+  struct hash_table *relative_dirs;
+};
+
+/* The links found in a downloaded file when recursion parsed it, so
+   that converting the file doesn't have to parse it again.  Only what
+   the conversion looks at is kept: a link takes a record and its URL
+   string.  */
+struct link_record
+{
+  int pos, size;                /* the link's position in the file */
+  int refresh_timeout;
+  unsigned int url_offset;      /* the URL, in the strings of the file */
+
+  unsigned int link_base_p  :1;
+  unsigned int link_complete_p  :1;
+  unsigned int link_css_p   :1;
+  unsigned int link_noquote_html_p :1;
+  unsigned int link_refresh_p   :1;
+};
+
+struct link_cache_entry
+{
+  /* What the file was parsed as.  The links are reused only if the
+     conversion would parse the same file the same way.  */
+  char *url;                    /* the URL the links are relative to */
+  char *enc;                    /* the charset the parse started with */
+  bool is_css;
+  wgint size;
+  time_t mtime, ctime;
+
+  int count;
+  struct link_record *links;    /* COUNT records, then the strings */
+  const char *strings;
+};
+
+/* Maps file names to their struct link_cache_entry.  */
+static struct hash_table *link_cache;
 
+static void link_cache_entry_free (void *);
+static void link_cache_free (void);
+
+static void convert_links (struct conv_state *, const char *,
+                           struct urlpos *);
 
 static void
-convert_links_in_hashtable (struct hash_table *downloaded_set,
-                            int is_css,
-                            int *file_count)
+xfree_cb (void *p)
 {
-  int i, cnt = 0;
-  char *arr[1024], **file_array;
+  xfree (p);
+}
 
-  if (!downloaded_set || (cnt = hash_table_count (downloaded_set)) == 0)
-    return;
+static int
+cmp_file_names (const void *a, const void *b)
+{
+  return strcmp (*(const char * const *) a, *(const char * const *) b);
+}
 
-  if (cnt <= (int) countof (arr))
-    file_array = arr;
-  else
-    file_array = xmalloc (cnt * sizeof (arr[0]));
 
-  string_set_to_array (downloaded_set, file_array);
+static void
+conv_state_init (struct conv_state *state)
+{
+  xzero (*state);
+  state->relative_dirs = make_string_hash_table (0);
+}
 
-  for (i = 0; i < cnt; i++)
+static void
+conv_state_free (struct conv_state *state)
+{
+  xfree (state->doc.data);
+  xfree (state->name.data);
+  xfree (state->text.data);
+  xfree (state->basedir);
+  free_keys_and_values (state->relative_dirs, xfree_cb);
+  hash_table_destroy (state->relative_dirs);
+}
+
+/* Rebuild the links of FILE registered by register_links into *LINKS,
+   if they are what parsing FILE as of URL would find.  Returns false
+   if FILE must be parsed.  */
+
+static bool
+cached_links (const char *file, const struct url *url, int is_css,
+              struct urlpos **links)
+{
+  const struct link_cache_entry *entry;
+  struct urlpos *head = NULL, **tail = &head;
+  struct stat st;
+  int i;
+
+  if (!link_cache || !(entry = hash_table_get (link_cache, file)))
+    return false;
+  if (entry->is_css != !!is_css
+      || strcmp (entry->url, url->url) != 0
+      || (entry->enc && url->content_enc
+          ? strcmp (entry->enc, url->content_enc) != 0
+          : entry->enc != url->content_enc))
+    return false;
+  /* The file may also have been downloaded again since.  */
+  if (stat (file, &st) != 0
+      || st.st_size != entry->size
+      || st.st_mtime != entry->mtime
+      || st.st_ctime != entry->ctime)
+    return false;
+
+  for (i = 0; i < entry->count; i++)
     {
-      struct urlpos *urls, *cur_url;
-      struct url *url;
-      char *file = file_array[i];
-
-      /* Determine the URL of the file.  get_urls_{html,css} will need
-         it.  */
-      url = hash_table_get (dl_file_url_map, file);
-      if (!url)
-        {
-          DEBUGP (("Apparently %s has been removed.\n", file));
-          continue;
-        }
+      const struct link_record *rec = &entry->links[i];
+      struct urlpos *link = xnew0 (struct urlpos);
+
+      link->url = xnew0 (struct url);
+      link->url->url = xstrdup (entry->strings + rec->url_offset);
+      link->pos = rec->pos;
+      link->size = rec->size;
+      link->refresh_timeout = rec->refresh_timeout;
+      link->link_base_p = rec->link_base_p;
+      link->link_complete_p = rec->link_complete_p;
+      link->link_css_p = rec->link_css_p;
+      link->link_noquote_html_p = rec->link_noquote_html_p;
+      link->link_refresh_p = rec->link_refresh_p;
+
+      *tail = link;
+      tail = &link->next;
+    }
 
-      DEBUGP (("Scanning %s (from %s)\n", file, url->url));
+  *links = head;
+  return true;
+}
 
-      /* Parse the file...  */
+/* Convert the links in FILE, a downloaded HTML file, or a CSS file if
+   IS_CSS.  Returns false if FILE was not scanned because its URL is
+   no longer known.  */
+
+static bool
+convert_file (struct conv_state *state, const char *file, int is_css)
+{
+  struct urlpos *urls, *cur_url;
+  struct download_record *rec;
+  struct url *url;
+
+  /* Determine the URL of the file.  get_urls_{html,css} will need
+     it.  */
+  rec = hash_table_get (dl_file_url_map, file);
+  if (!rec)
+    {
+      DEBUGP (("Apparently %s has been removed.\n", file));
+      return false;
+    }
+  if (!(url = download_record_url (rec)))
+    {
+      DEBUGP (("Cannot parse %s, the URL of %s.\n", rec->url, file));
+      return false;
+    }
+
+  /* Parse the file, unless recursion left us its links.  */
+  if (cached_links (file, url, is_css, &urls))
+    DEBUGP (("Reusing the links of %s (from %s)\n", file, url->url));
+  else
+    {
+      DEBUGP (("Scanning %s (from %s)\n", file, url->url));
       urls = is_css ? get_urls_css_file (file, url) :
                       get_urls_html (file, url, NULL);
+    }
 
-      /* We don't respect meta_disallow_follow here because, even if
-         the file is not followed, we might still want to convert the
-         links that have been followed from other files.  */
+  /* We don't respect meta_disallow_follow here because, even if
+     the file is not followed, we might still want to convert the
+     links that have been followed from other files.  */
 
-      for (cur_url = urls; cur_url; cur_url = cur_url->next)
-        {
-          char *local_name;
+  for (cur_url = urls; cur_url; cur_url = cur_url->next)
+    {
+      char *local_name;
 
-          if (cur_url->link_base_p)
-            {
-              /* Base references have been resolved by our parser, so
-                 we turn the base URL into an empty string.  (Perhaps
-                 we should remove the tag entirely?)  */
-              cur_url->convert = CO_NULLIFY_BASE;
-              continue;
-            }
+      if (cur_url->link_base_p)
+        {
+          /* Base references have been resolved by our parser, so
+             we turn the base URL into an empty string.  (Perhaps
+             we should remove the tag entirely?)  */
+          cur_url->convert = CO_NULLIFY_BASE;
+          continue;
+        }
 
-          /* We decide the direction of conversion according to whether
-             a URL was downloaded.  Downloaded URLs will be converted
-             ABS2REL, whereas non-downloaded will be converted REL2ABS.  */
+      /* We decide the direction of conversion according to whether
+         a URL was downloaded.  Downloaded URLs will be converted
+         ABS2REL, whereas non-downloaded will be converted REL2ABS.  */
 
-          local_name = hash_table_get (dl_url_file_map, cur_url->url->url);
+      local_name = hash_table_get (dl_url_file_map, cur_url->url->url);
 
-          /* Decide on the conversion type.  */
-          if (local_name)
-            {
-              /* We've downloaded this URL.  Convert it to relative
-                 form.  We do this even if the URL already is in
-                 relative form, because our directory structure may
-                 not be identical to that on the server (think `-nd',
-                 `--cut-dirs', etc.). If --convert-file-only was passed,
-                 we only convert the basename portion of the URL.  */
-              cur_url->convert = (opt.convert_file_only ? CO_CONVERT_BASENAME_ONLY : CO_CONVERT_TO_RELATIVE);
-              cur_url->local_name = xstrdup (local_name);
-              DEBUGP (("will convert url %s to local %s\n", cur_url->url->url, local_name));
-            }
-          else
+      /* The recursion may have downloaded it from where it is known to
+         have moved.  */
+      if (!local_name)
+        {
+          struct url *moved = moved_permanently_lookup (cur_url->url);
+          if (moved)
             {
-              /* We haven't downloaded this URL.  If it's not already
-                 complete (including a full host name), convert it to
-                 that form, so it can be reached while browsing this
-                 HTML locally.  */
-              if (!cur_url->link_complete_p)
-                cur_url->convert = CO_CONVERT_TO_COMPLETE;
-              cur_url->local_name = NULL;
-              DEBUGP (("will convert url %s to complete\n", cur_url->url->url));
+              local_name = hash_table_get (dl_url_file_map, moved->url);
+              url_free (moved);
             }
         }
 
-      /* Convert the links in the file.  */
-      convert_links (file, urls);
-      ++*file_count;
+      /* Decide on the conversion type.  */
+      if (local_name)
+        {
+          /* We've downloaded this URL.  Convert it to relative
+             form.  We do this even if the URL already is in
+             relative form, because our directory structure may
+             not be identical to that on the server (think `-nd',
+             `--cut-dirs', etc.). If --convert-file-only was passed,
+             we only convert the basename portion of the URL.  */
+          cur_url->convert = (opt.convert_file_only ? CO_CONVERT_BASENAME_ONLY : CO_CONVERT_TO_RELATIVE);
+          cur_url->local_name = xstrdup (local_name);
+          DEBUGP (("will convert url %s to local %s\n", cur_url->url->url, local_name));
+        }
+      else
+        {
+          /* We haven't downloaded this URL.  If it's not already
+             complete (including a full host name), convert it to
+             that form, so it can be reached while browsing this
+             HTML locally.  */
+          if (!cur_url->link_complete_p)
+            cur_url->convert = CO_CONVERT_TO_COMPLETE;
+          cur_url->local_name = NULL;
+          DEBUGP (("will convert url %s to complete\n", cur_url->url->url));
+        }
+    }
 
-      /* Free the data.  */
-      free_urlpos (urls);
+  /* Convert the links in the file.  */
+  {
+    STATS_START (start);
+    convert_links (state, file, urls);
+    STATS_STOP (STATS_CONVERT_LINKS, start, 0);
+  }
+
+  /* Free the data.  */
+  free_urlpos (urls);
+  url_free (url);
+  return true;
+}
+
+#ifdef HAVE_PTHREAD
+/* Serializes what the threads converting files share: the set of
+   backed-up files (see write_backup_file), and the buffers quote()
+   formats the messages of convert_links into.  */
+static pthread_mutex_t convert_lock = PTHREAD_MUTEX_INITIALIZER;
+# define CONVERT_LOCK() pthread_mutex_lock (&convert_lock)
+# define CONVERT_UNLOCK() pthread_mutex_unlock (&convert_lock)
+
+/* The files of one set, converted by several threads.  Each thread
+   takes the next file nobody has taken yet, so that a few large files
+   don't hold up the others.  The messages logged while converting a
+   file are captured and logged by the main thread in the order of the
+   files, so the log reads the same as when converting them one at a
+   time.  */
+struct conv_pool
+{
+  char **files;
+  int count;
+  int is_css;
+
+  pthread_mutex_t lock;
+  pthread_cond_t file_done;     /* signalled when a file is done */
+  int next;                     /* the next file to be taken */
+  struct conv_result
+  {
+    bool done;
+    bool scanned;               /* what convert_file returned */
+    struct log_capture *log;
+  } *results;
+};
+
+static void *
+convert_worker (void *arg)
+{
+  struct conv_pool *pool = arg;
+  struct conv_state state;
+
+  conv_state_init (&state);
+  for (;;)
+    {
+      struct log_capture *log;
+      bool scanned;
+      int i;
+
+      pthread_mutex_lock (&pool->lock);
+      i = pool->next < pool->count ? pool->next++ : -1;
+      pthread_mutex_unlock (&pool->lock);
+      if (i < 0)
+        break;
+
+      log = log_capture_begin ();
+      scanned = convert_file (&state, pool->files[i], pool->is_css);
+      log_capture_end ();
+
+      pthread_mutex_lock (&pool->lock);
+      pool->results[i].scanned = scanned;
+      pool->results[i].log = log;
+      pool->results[i].done = true;
+      pthread_cond_broadcast (&pool->file_done);
+      pthread_mutex_unlock (&pool->lock);
     }
+  conv_state_free (&state);
+  return NULL;
+}
+
+/* Convert the COUNT FILES using up to THREADS threads.  Returns false
+   if no thread could be started, leaving the files untouched.  */
+
+static bool
+convert_files_threaded (char **files, int count, int is_css, int threads,
+                        int *file_count)
+{
+  struct conv_pool pool;
+  pthread_t *tids = xnew_array (pthread_t, threads);
+  int started, i;
+
+  pool.files = files;
+  pool.count = count;
+  pool.is_css = is_css;
+  pool.next = 0;
+  pool.results = xnew0_array (struct conv_result, count);
+  pthread_mutex_init (&pool.lock, NULL);
+  pthread_cond_init (&pool.file_done, NULL);
+
+  /* The parser's tables are set up on first use; do that before the
+     threads race for it.  */
+  init_interesting ();
+
+  for (started = 0; started < threads; started++)
+    if (pthread_create (&tids[started], NULL, convert_worker, &pool) != 0)
+      break;
+  DEBUGP (("Converting links in %d threads.\n", started));
+
+  if (started)
+    for (i = 0; i < count; i++)
+      {
+        pthread_mutex_lock (&pool.lock);
+        while (!pool.results[i].done)
+          pthread_cond_wait (&pool.file_done, &pool.lock);
+        pthread_mutex_unlock (&pool.lock);
+
+        log_capture_replay (pool.results[i].log);
+        if (pool.results[i].scanned)
+          ++*file_count;
+      }
+
+  for (i = 0; i < started; i++)
+    pthread_join (tids[i], NULL);
 
+  pthread_cond_destroy (&pool.file_done);
+  pthread_mutex_destroy (&pool.lock);
+  xfree (pool.results);
+  xfree (tids);
+  return started > 0;
+}
+
+/* How many threads to convert COUNT files with.  */
+
+static int
+convert_thread_count (int count)
+{
+  int threads = opt.convert_threads;
+
+  /* Messages logged by the threads are formatted by the threads;
+     the debug messages use shared buffers for that, so keep to one
+     thread for them.  */
+  if (opt.debug)
+    return 1;
+  if (!threads)
+    threads = num_processors (NPROC_CURRENT);
+  return MIN (threads, count);
+}
+#else /* not HAVE_PTHREAD */
+# define CONVERT_LOCK() do { } while (0)
+# define CONVERT_UNLOCK() do { } while (0)
+#endif /* not HAVE_PTHREAD */
+
+static void
+convert_links_in_hashtable (struct hash_table *downloaded_set,
+                            int is_css,
+                            int *file_count)
+{
+  int i, cnt = 0;
+  char *arr[1024], **file_array;
+  struct conv_state state;
+
+  if (!downloaded_set || (cnt = hash_table_count (downloaded_set)) == 0)
+    return;
+
+  if (cnt <= (int) countof (arr))
+    file_array = arr;
+  else
+    file_array = xmalloc (cnt * sizeof (arr[0]));
+
+  string_set_to_array (downloaded_set, file_array);
+  qsort (file_array, cnt, sizeof (file_array[0]), cmp_file_names);
+
+#ifdef HAVE_PTHREAD
+  {
+    int threads = convert_thread_count (cnt);
+    if (threads > 1
+        && convert_files_threaded (file_array, cnt, is_css, threads,
+                                   file_count))
+      goto done;
+  }
+#endif
+
+  conv_state_init (&state);
+  for (i = 0; i < cnt; i++)
+    if (convert_file (&state, file_array[i], is_css))
+      ++*file_count;
+  conv_state_free (&state);
+
+#ifdef HAVE_PTHREAD
+ done:
+#endif
   if (file_array != arr)
     xfree (file_array);
 }
@@ -184,6 +574,7 @@ convert_all_links (void)
 
   convert_links_in_hashtable (downloaded_html_set, 0, &file_count);
   convert_links_in_hashtable (downloaded_css_set, 1, &file_count);
+  link_cache_free ();
 
   secs = ptimer_measure (timer);
   logprintf (LOG_VERBOSE, _("Converted links in %d files in %s seconds.\n"),
@@ -193,24 +584,34 @@ convert_all_links (void)
 }
 
 static void write_backup_file (const char *, downloaded_file_t);
-static const char *replace_plain (const char*, int, FILE*, const char *);
-static const char *replace_attr (const char *, int, FILE *, const char *);
-static const char *replace_attr_refresh_hack (const char *, int, FILE *,
-                                              const char *, int);
-static char *local_quote_string (const char *, bool);
+static void buffer_append (struct conv_buffer *, const char *, size_t);
+static const char *replace_plain (const char *, int, struct conv_buffer *,
+                                  const struct conv_buffer *);
+static const char *replace_attr (const char *, int, struct conv_buffer *,
+                                 const struct conv_buffer *);
+static void local_quote_string (struct conv_buffer *, const char *, bool);
+static void html_quote_into (struct conv_buffer *, const char *);
+static void relative_link (struct conv_state *, const char *, const char *);
 static char *construct_relative (const char *, const char *);
 static char *convert_basename (const char *, const struct urlpos *);
 
 /* Change the links in one file.  LINKS is a list of links in the
    document, along with their positions and the desired direction of
-   the conversion.  */
+   the conversion.
+
+   The converted document is assembled in STATE->doc and written out
+   in one go.  */
 static void
-convert_links (const char *file, struct urlpos *links)
+convert_links (struct conv_state *state, const char *file,
+               struct urlpos *links)
 {
   struct file_memory *fm;
   FILE *fp;
   const char *p;
   downloaded_file_t downloaded_file_return;
+  struct conv_buffer *doc = &state->doc;
+  struct conv_buffer *text = &state->text;
+  bool write_ok;
 
   struct urlpos *link;
   int to_url_count = 0, to_file_count = 0;
@@ -244,27 +645,20 @@ convert_links (const char *file, struct urlpos *links)
 
   downloaded_file_return = downloaded_file (CHECK_FOR_FILE, file);
   if (opt.backup_converted && downloaded_file_return)
-    write_backup_file (file, downloaded_file_return);
-
-  /* Before opening the file for writing, unlink the file.  This is
-     important if the data in FM is mapped.  In such case, nulling the
-     file, which is what fopen() below does, would make us read all
-     zeroes from the mapped region.  */
-  if (unlink (file) < 0 && errno != ENOENT)
     {
-      logprintf (LOG_NOTQUIET, _("Unable to delete %s: %s\n"),
-                 quote (file), strerror (errno));
-      wget_read_file_free (fm);
-      return;
+      CONVERT_LOCK ();
+      write_backup_file (file, downloaded_file_return);
+      CONVERT_UNLOCK ();
     }
-  /* Now open the file for writing.  */
-  fp = fopen (file, "wb");
-  if (!fp)
+
+  /* Converted links are mostly longer than the originals; leave some
+     room for that up front.  */
+  doc->len = 0;
+  if (doc->size < (size_t) fm->length + fm->length / 8)
     {
-      logprintf (LOG_NOTQUIET, _("Cannot convert links in %s: %s\n"),
-                 file, strerror (errno));
-      wget_read_file_free (fm);
-      return;
+      xfree (doc->data);
+      doc->size = fm->length + fm->length / 8;
+      doc->data = xmalloc (doc->size);
     }
 
   /* Here we loop through all the URLs in file, replacing those of
@@ -273,6 +667,7 @@ convert_links (const char *file, struct urlpos *links)
   for (link = links; link; link = link->next)
     {
       char *url_start = fm->content + link->pos;
+      bool plain = link->link_css_p || link->link_noquote_html_p;
 
       if (link->pos >= fm->length)
         {
@@ -288,52 +683,44 @@ convert_links (const char *file, struct urlpos *links)
 
       /* Echo the file contents, up to the offending URL's opening
          quote, to the outfile.  */
-      fwrite (p, 1, url_start - p, fp);
+      buffer_append (doc, p, url_start - p);
       p = url_start;
 
+      /* <meta http-equiv=refresh content="..."> needs the timeout
+         before the new URL.  */
+      text->len = 0;
+      if (link->link_refresh_p && !plain
+          && link->convert != CO_NULLIFY_BASE)
+        {
+          char timeout[MAX_INT_TO_STRING_LEN (int) + 7];
+          int len = snprintf (timeout, sizeof (timeout), "%d; URL=",
+                              link->refresh_timeout);
+          buffer_append (text, timeout, len);
+        }
+
       switch (link->convert)
         {
         case CO_CONVERT_TO_RELATIVE:
           /* Convert absolute URL to relative. */
-          if (link->local_name) {
-            char *newname = construct_relative (file, link->local_name);
-            char *quoted_newname = local_quote_string (newname,
-                                                       link->link_css_p);
-
-            if (link->link_css_p || link->link_noquote_html_p)
-              p = replace_plain (p, link->size, fp, quoted_newname);
-            else if (!link->link_refresh_p)
-              p = replace_attr (p, link->size, fp, quoted_newname);
-            else
-              p = replace_attr_refresh_hack (p, link->size, fp, quoted_newname,
-                                             link->refresh_timeout);
+          if (!link->local_name)
+            continue;
+          relative_link (state, file, link->local_name);
+          local_quote_string (text, state->name.data, link->link_css_p);
 
-            DEBUGP (("TO_RELATIVE: %s to %s at position %d in %s.\n",
-                     link->url->url, newname, link->pos, file));
+          DEBUGP (("TO_RELATIVE: %s to %s at position %d in %s.\n",
+                   link->url->url, state->name.data, link->pos, file));
 
-            xfree (newname);
-            xfree (quoted_newname);
-            ++to_file_count;
-          }
+          ++to_file_count;
           break;
         case CO_CONVERT_BASENAME_ONLY:
           {
             char *newname = convert_basename (p, link);
-            char *quoted_newname = local_quote_string (newname, link->link_css_p);
-
-            if (link->link_css_p || link->link_noquote_html_p)
-              p = replace_plain (p, link->size, fp, quoted_newname);
-            else if (!link->link_refresh_p)
-              p = replace_attr (p, link->size, fp, quoted_newname);
-            else
-              p = replace_attr_refresh_hack (p, link->size, fp, quoted_newname,
-                                             link->refresh_timeout);
+            local_quote_string (text, newname, link->link_css_p);
 
             DEBUGP (("Converted file part only: %s to %s at position %d in %s.\n",
                      link->url->url, newname, link->pos, file));
 
             xfree (newname);
-            xfree (quoted_newname);
             ++to_file_count;
 
             break;
@@ -342,42 +729,118 @@ convert_links (const char *file, struct urlpos *links)
           /* Convert the link to absolute URL. */
           {
             char *newlink = link->url->url;
-            char *quoted_newlink = html_quote_string (newlink);
 
-            if (link->link_css_p || link->link_noquote_html_p)
-              p = replace_plain (p, link->size, fp, newlink);
-            else if (!link->link_refresh_p)
-              p = replace_attr (p, link->size, fp, quoted_newlink);
+            if (plain)
+              buffer_append (text, newlink, strlen (newlink));
             else
-              p = replace_attr_refresh_hack (p, link->size, fp, quoted_newlink,
-                                             link->refresh_timeout);
+              html_quote_into (text, newlink);
 
             DEBUGP (("TO_COMPLETE: <something> to %s at position %d in %s.\n",
                      newlink, link->pos, file));
 
-            xfree (quoted_newlink);
             ++to_url_count;
             break;
           }
         case CO_NULLIFY_BASE:
           /* Change the base href to "". */
-          p = replace_attr (p, link->size, fp, "");
-          break;
+          p = replace_attr (p, link->size, doc, text);
+          continue;
         case CO_NOCONVERT:
           abort ();
           break;
         }
+
+      if (plain)
+        p = replace_plain (p, link->size, doc, text);
+      else
+        p = replace_attr (p, link->size, doc, text);
     }
 
   /* Output the rest of the file. */
   if (p - fm->content < fm->length)
-    fwrite (p, 1, fm->length - (p - fm->content), fp);
-  fclose (fp);
+    buffer_append (doc, p, fm->length - (p - fm->content));
   wget_read_file_free (fm);
 
+  /* Unlink the file before writing it anew, so that it is replaced
+     rather than overwritten in place.  */
+  if (unlink (file) < 0 && errno != ENOENT)
+    {
+      CONVERT_LOCK ();
+      logprintf (LOG_NOTQUIET, _("Unable to delete %s: %s\n"),
+                 quote (file), strerror (errno));
+      CONVERT_UNLOCK ();
+      return;
+    }
+  /* Now open the file for writing.  */
+  fp = fopen (file, "wb");
+  if (!fp)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot convert links in %s: %s\n"),
+                 file, strerror (errno));
+      return;
+    }
+  write_ok = fwrite (doc->data, 1, doc->len, fp) == doc->len;
+  if (fclose (fp) != 0)
+    write_ok = false;
+  if (!write_ok)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot convert links in %s: %s\n"),
+                 file, strerror (errno));
+      return;
+    }
+
   logprintf (LOG_VERBOSE, "%d-%d\n", to_file_count, to_url_count);
 }
 
+/* Make the relative link from BASEFILE to LINKFILE, as
+   construct_relative would, in STATE->name.  The relative path
+   between the two directories is only computed once as long as
+   BASEFILE stays in the same directory.  */
+
+static void
+relative_link (struct conv_state *state, const char *basefile,
+               const char *linkfile)
+{
+  struct conv_buffer *name = &state->name;
+  const char *basename = strrchr (basefile, '/');
+  const char *linkname = strrchr (linkfile, '/');
+  size_t basedir_len = basename ? basename - basefile + 1 : 0;
+  size_t linkdir_len = linkname ? linkname - linkfile + 1 : 0;
+  char *reldir;
+
+  if (!state->basedir || strlen (state->basedir) != basedir_len
+      || memcmp (state->basedir, basefile, basedir_len) != 0)
+    {
+      xfree (state->basedir);
+      state->basedir = strdupdelim (basefile, basefile + basedir_len);
+      free_keys_and_values (state->relative_dirs, xfree_cb);
+      hash_table_clear (state->relative_dirs);
+    }
+
+  /* Look up the directory of LINKFILE.  NAME is free to hold the
+     key until the link is built in it.  */
+  name->len = 0;
+  buffer_append (name, linkfile, linkdir_len);
+  buffer_append (name, "", 1);
+  reldir = hash_table_get (state->relative_dirs, name->data);
+  if (!reldir)
+    {
+      reldir = construct_relative (state->basedir, name->data);
+      hash_table_put (state->relative_dirs, xstrdup (name->data), reldir);
+    }
+
+  linkfile += linkdir_len;
+  name->len = 0;
+  /* Within the same directory, a file name that looks like it has a
+     scheme is taken as relative by prefixing "./", which the directory
+     lookup above can't see.  */
+  if (!*reldir && strchr (linkfile, ':'))
+    buffer_append (name, "./", 2);
+  buffer_append (name, reldir, strlen (reldir));
+  buffer_append (name, linkfile, strlen (linkfile) + 1);
+  --name->len;
+}
+
 /* Construct and return a link that points from BASEFILE to LINKFILE.
    Both files should be local file names, BASEFILE of the referrering
    file, and LINKFILE of the referred file.
@@ -600,11 +1063,28 @@ write_backup_file (const char *file, downloaded_file_t downloaded_file_return)
 
 static bool find_fragment (const char *, int, const char **, const char **);
 
+/* Append the LEN bytes at S to BUF, growing it as needed.  */
+
+static void
+buffer_append (struct conv_buffer *buf, const char *s, size_t len)
+{
+  if (buf->size - buf->len < len)
+    {
+      size_t size = MAX (buf->size * 2, buf->len + len);
+      size = MAX (size, 256);
+      buf->data = xrealloc (buf->data, size);
+      buf->size = size;
+    }
+  memcpy (buf->data + buf->len, s, len);
+  buf->len += len;
+}
+
 /* Replace a string with NEW_TEXT.  Ignore quoting. */
 static const char *
-replace_plain (const char *p, int size, FILE *fp, const char *new_text)
+replace_plain (const char *p, int size, struct conv_buffer *doc,
+               const struct conv_buffer *new_text)
 {
-  fputs (new_text, fp);
+  buffer_append (doc, new_text->data, new_text->len);
   p += size;
   return p;
 }
@@ -612,7 +1092,8 @@ replace_plain (const char *p, int size, FILE *fp, const char *new_text)
 /* Replace an attribute's original text with NEW_TEXT. */
 
 static const char *
-replace_attr (const char *p, int size, FILE *fp, const char *new_text)
+replace_attr (const char *p, int size, struct conv_buffer *doc,
+              const struct conv_buffer *new_text)
 {
   bool quote_flag = false;
   char quote_char = '\"';       /* use "..." for quoting, unless the
@@ -634,45 +1115,20 @@ replace_attr (const char *p, int size, FILE *fp, const char *new_text)
       ++p;
       size -= 2;                /* disregard opening and closing quote */
     }
-  putc (quote_char, fp);
-  fputs (new_text, fp);
+  buffer_append (doc, &quote_char, 1);
+  buffer_append (doc, new_text->data, new_text->len);
 
   /* Look for fragment identifier, if any. */
   if (find_fragment (p, size, &frag_beg, &frag_end))
-    fwrite (frag_beg, 1, frag_end - frag_beg, fp);
+    buffer_append (doc, frag_beg, frag_end - frag_beg);
   p += size;
   if (quote_flag)
     ++p;
-  putc (quote_char, fp);
+  buffer_append (doc, &quote_char, 1);
 
   return p;
 }
 
-/* The same as REPLACE_ATTR, but used when replacing
-   <meta http-equiv=refresh content="new_text"> because we need to
-   append "timeout_value; URL=" before the next_text.  */
-
-static const char *
-replace_attr_refresh_hack (const char *p, int size, FILE *fp,
-                           const char *new_text, int timeout)
-{
-  /* "0; URL=..." */
-  char new_with_timeout[1024];
-
-  if (((unsigned) snprintf (
-       new_with_timeout, sizeof (new_with_timeout),
-       "%d; URL=%s", timeout, new_text)) >= sizeof (new_with_timeout))
-    {
-      // very unlikely fallback using heap memory
-      char *tmp = aprintf("%d; URL=%s", timeout, new_text);
-      const char *res = replace_attr (p, size, fp, tmp);
-      xfree (tmp);
-      return res;
-    }
-
-  return replace_attr (p, size, fp, new_with_timeout);
-}
-
 /* Find the first occurrence of '#' in [BEG, BEG+SIZE) that is not
    preceded by '&'.  If the character is not found, return zero.  If
    the character is found, return true and set BP and EP to point to
@@ -719,69 +1175,105 @@ find_fragment (const char *beg, int size, const char **bp, const char **ep)
    safe for both local and HTTP-served browsing.
 
    We always quote "#" as "%23", "%" as "%25" and ";" as "%3B"
-   because those characters have special meanings in URLs.  */
+   because those characters have special meanings in URLs.
 
-static char *
-local_quote_string (const char *file, bool no_html_quote)
+   The result, further quoted with html_quote_string unless
+   NO_HTML_QUOTE, is appended to BUF.  */
+
+static void
+local_quote_string (struct conv_buffer *buf, const char *file,
+                    bool no_html_quote)
 {
-  const char *from;
-  char *newname, *to, *res;
-  char buf[1024];
-  size_t tolen;
-
-  char *any = strpbrk (file, "?#%;");
-  if (!any)
-    return no_html_quote ? strdup (file) : html_quote_string (file);
-
-  /* Allocate space assuming the worst-case scenario, each character
-     having to be quoted.  */
-  tolen = 3 * strlen (file);
-  if (tolen < sizeof (buf))
-    to = newname = buf;
-  else
-    to = newname = xmalloc (tolen + 1);
+  const char *from, *start;
 
-  for (from = file; *from; from++)
-    switch (*from)
-      {
-      case '%':
-        *to++ = '%';
-        *to++ = '2';
-        *to++ = '5';
-        break;
-      case '#':
-        *to++ = '%';
-        *to++ = '2';
-        *to++ = '3';
-        break;
-      case ';':
-        *to++ = '%';
-        *to++ = '3';
-        *to++ = 'B';
-        break;
-      case '?':
-        if (opt.adjust_extension)
-          {
-            *to++ = '%';
-            *to++ = '3';
-            *to++ = 'F';
-            break;
-          }
-        /* fallthrough */
-      default:
-        *to++ = *from;
-      }
-  *to = '\0';
+  /* Copy the runs of characters that need no quoting in one go.  */
+  for (from = start = file; ; from++)
+    {
+      const char *quoted;
 
-  if (newname == buf)
-    return no_html_quote ? strdup (newname) : html_quote_string (newname);
+      switch (*from)
+        {
+        case '%':
+          quoted = "%25";
+          break;
+        case '#':
+          quoted = "%23";
+          break;
+        case ';':
+          quoted = "%3B";
+          break;
+        case '?':
+          if (!opt.adjust_extension)
+            continue;
+          quoted = "%3F";
+          break;
+        case '&':
+          quoted = no_html_quote ? NULL : "&amp;";
+          break;
+        case '<':
+          quoted = no_html_quote ? NULL : "&lt;";
+          break;
+        case '>':
+          quoted = no_html_quote ? NULL : "&gt;";
+          break;
+        case '\"':
+          quoted = no_html_quote ? NULL : "&quot;";
+          break;
+        case ' ':
+          quoted = no_html_quote ? NULL : "&#32;";
+          break;
+        case '\0':
+          buffer_append (buf, start, from - start);
+          return;
+        default:
+          continue;
+        }
+      if (!quoted)
+        continue;
+      buffer_append (buf, start, from - start);
+      buffer_append (buf, quoted, strlen (quoted));
+      start = from + 1;
+    }
+}
 
-  if (no_html_quote)
-    return strdup (newname);
+/* Append S to BUF quoted like html_quote_string does.  */
 
-  res = html_quote_string (newname);
-  xfree (newname);
-  return res;
+static void
+html_quote_into (struct conv_buffer *buf, const char *s)
+{
+  const char *start;
+
+  for (start = s; ; s++)
+    {
+      const char *quoted;
+
+      switch (*s)
+        {
+        case '&':
+          quoted = "&amp;";
+          break;
+        case '<':
+          quoted = "&lt;";
+          break;
+        case '>':
+          quoted = "&gt;";
+          break;
+        case '\"':
+          quoted = "&quot;";
+          break;
+        case ' ':
+          quoted = "&#32;";
+          break;
+        case '\0':
+          buffer_append (buf, start, s - start);
+          return;
+        default:
+          continue;
+        }
+      buffer_append (buf, start, s - start);
+      buffer_append (buf, quoted, strlen (quoted));
+      start = s + 1;
+    }
 }
 
 /* Book-keeping code for dl_file_url_map, dl_url_file_map,
@@ -793,6 +1285,8 @@ local_quote_string (const char *file, bool no_html_quote)
     dl_file_url_map = make_string_hash_table (0);       \
   if (!dl_url_file_map)                                 \
     dl_url_file_map = make_string_hash_table (0);       \
+  if (!dl_file_urls_map)                                \
+    dl_file_urls_map = make_string_hash_table (0);      \
 } while (0)
 
 /* Return true if S1 and S2 are the same, except for "/index.html".
@@ -849,22 +1343,118 @@ match_except_index (const char *s1, const char *s2)
   return 0 == strcmp (lng, "/index.html");
 }
 
-static int
-dissociate_urls_from_file_mapper (void *key, void *value, void *arg)
+/* Return the interned copy of S, or NULL if S is NULL.  */
+
+static const char *
+intern_string (const char *s)
+{
+  char *copy;
+  size_t len;
+
+  if (!s)
+    return NULL;
+  if (!interned_strings)
+    interned_strings = make_string_hash_table (0);
+  else if (hash_table_get_pair (interned_strings, s, &copy, NULL))
+    return copy;
+
+  len = strlen (s) + 1;
+  if (!string_pool || string_pool->size - string_pool->used < len)
+    {
+      size_t size = MAX (STRING_POOL_BLOCK, len);
+      struct string_pool_block *block =
+        xmalloc (sizeof (struct string_pool_block) + size);
+      block->next = string_pool;
+      block->used = 0;
+      block->size = size;
+      string_pool = block;
+    }
+  copy = (char *) (string_pool + 1) + string_pool->used;
+  string_pool->used += len;
+  memcpy (copy, s, len);
+  hash_table_put (interned_strings, copy, copy);
+  return copy;
+}
+
+/* Make the record of URL for dl_file_url_map.  */
+
+static struct download_record *
+download_record_new (const struct url *url)
+{
+  struct download_record *rec = xnew (struct download_record);
+
+  rec->url = intern_string (url->url);
+  rec->ori_enc = intern_string (url->ori_enc);
+  rec->content_enc = intern_string (url->content_enc);
+  rec->enc_type = url->enc_type;
+  return rec;
+}
+
+/* Return the URL recorded by REC, parsed again, or NULL if that
+   fails.  The caller is to free it.  */
+
+static struct url *
+download_record_url (const struct download_record *rec)
 {
-  char *mapping_url = (char *)key;
-  char *mapping_file = (char *)value;
-  char *file = (char *)arg;
+  struct url *url = url_new_init ();
 
-  if (0 == strcmp (mapping_file, file))
+  url->ori_url = xstrdup (rec->url);
+  if (url_parse (url, false, false) != 0)
     {
-      hash_table_remove (dl_url_file_map, mapping_url);
-      xfree (mapping_url);
-      xfree (mapping_file);
+      url_free (url);
+      return NULL;
     }
+  url->enc_type = rec->enc_type;
+  xfree (url->ori_enc);
+  url->ori_enc = rec->ori_enc ? xstrdup (rec->ori_enc) : NULL;
+  xfree (url->content_enc);
+  url->content_enc = rec->content_enc ? xstrdup (rec->content_enc) : NULL;
+  return url;
+}
+
+/* Map URL to FILE in dl_url_file_map, which must not map it yet.  */
+
+static void
+associate_url_with_file (const char *url, const char *file)
+{
+  struct file_url *fu = xnew (struct file_url);
+
+  url = intern_string (url);
+  file = intern_string (file);
+  hash_table_put (dl_url_file_map, url, file);
 
-  /* Continue mapping. */
-  return 0;
+  fu->url = url;
+  fu->next = hash_table_get (dl_file_urls_map, file);
+  hash_table_put (dl_file_urls_map, file, fu);
+}
+
+/* Remove the mapping of URL from dl_url_file_map, if any.  */
+
+static void
+dissociate_url (const char *url)
+{
+  char *url_key, *file;
+  struct file_url *list, **fu;
+
+  if (!hash_table_get_pair (dl_url_file_map, url, &url_key, &file))
+    return;
+  hash_table_remove (dl_url_file_map, url);
+
+  if ((list = hash_table_get (dl_file_urls_map, file)))
+    {
+      for (fu = &list; *fu; fu = &(*fu)->next)
+        if ((*fu)->url == url_key)
+          {
+            struct file_url *found = *fu;
+            *fu = found->next;
+            xfree (found);
+            break;
+          }
+      if (list)
+        hash_table_put (dl_file_urls_map, file, list);
+      else
+        hash_table_remove (dl_file_urls_map, file);
+    }
 }
 
 /* Remove all associations from various URLs to FILE from dl_url_file_map. */
@@ -872,9 +1462,18 @@ dissociate_urls_from_file_mapper (void *key, void *value, void *arg)
 static void
 dissociate_urls_from_file (const char *file)
 {
-  /* Can't use hash_table_iter_* because the table mutates while mapping.  */
-  hash_table_for_each (dl_url_file_map, dissociate_urls_from_file_mapper,
-                       (char *) file);
+  struct file_url *list = hash_table_get (dl_file_urls_map, file);
+
+  if (!list)
+    return;
+  hash_table_remove (dl_file_urls_map, file);
+  while (list)
+    {
+      struct file_url *next = list->next;
+      hash_table_remove (dl_url_file_map, list->url);
+      xfree (list);
+      list = next;
+    }
 }
 
 /* Register that URL has been successfully downloaded to FILE.  This
@@ -882,15 +1481,10 @@ dissociate_urls_from_file (const char *file)
    to references to local files.  It is also being used to check if a
    URL has already been downloaded.  */
 
-/* Take the struct url as the value of dl_file_url_map,
-   while other key/value by str dups.
-   So we need specific free-function. */
-
 void
 register_download (struct url *url, const char *file)
 {
-  char *old_file, *old_url_str;
-  struct url *old_url;
+  struct download_record *old_rec;
 
   ENSURE_TABLES_EXIST;
 
@@ -899,14 +1493,14 @@ register_download (struct url *url, const char *file)
      download will override the first one.  When that happens,
      dissociate the old file name from the URL.  */
 
-  if (hash_table_get_pair (dl_file_url_map, file, &old_file, &old_url))
+  if ((old_rec = hash_table_get (dl_file_url_map, file)))
     {
-      if (0 == strcmp (url->url, old_url->url))
+      if (0 == strcmp (url->url, old_rec->url))
         /* We have somehow managed to download the same URL twice.
            Nothing to do.  */
         return;
 
-      if (match_except_index (url->url, old_url->url)
+      if (match_except_index (url->url, old_rec->url)
           && !hash_table_contains (dl_url_file_map, url->url))
         /* The two URLs differ only in the "index.html" ending.  For
            example, one is "http://www.server.com/", and the other is
@@ -915,8 +1509,7 @@ register_download (struct url *url, const char *file)
         goto url_only;
 
       hash_table_remove (dl_file_url_map, file);
-      xfree (old_file);
-      url_free (old_url);
+      xfree (old_rec);
 
       /* Remove all the URLs that point to this file.  Yes, there can
          be more than one such URL, because we store redirections as
@@ -926,15 +1519,13 @@ register_download (struct url *url, const char *file)
          only points to URL2.)  When another URL gets loaded to FILE,
          we want both URL1 and URL2 dissociated from it.
 
-         This is a relatively expensive operation because it performs
-         a linear search of the whole hash table, but it should be
-         called very rarely, only when two URLs resolve to the same
-         file name, *and* the "<file>.1" extensions are turned off.
-         In other words, almost never.  */
+         dl_file_urls_map lists them, so that this costs no more than
+         there are such URLs.  */
       dissociate_urls_from_file (file);
     }
 
-  hash_table_put (dl_file_url_map, xstrdup (file), url_dup (url));
+  hash_table_put (dl_file_url_map, intern_string (file),
+                  download_record_new (url));
 
  url_only:
   /* A URL->FILE mapping is not possible without a FILE->URL mapping.
@@ -953,14 +1544,8 @@ register_download (struct url *url, const char *file)
      "FILE.1".  In that case, FILE.1 will not be found in
      dl_file_url_map, but URL will still point to FILE in
      dl_url_file_map.  */
-  if (hash_table_get_pair (dl_url_file_map, url->url, &old_url_str, &old_file))
-    {
-      hash_table_remove (dl_url_file_map, url->url);
-      xfree (old_file);
-      xfree (old_url_str);
-    }
-
-  hash_table_put (dl_url_file_map, xstrdup (url->url), xstrdup (file));
+  dissociate_url (url->url);
+  associate_url_with_file (url->url, file);
 }
 
 /* Register that FROM has been redirected to "TO".  This assumes that TO
@@ -977,7 +1562,7 @@ register_redirection (const char *from, const char *to)
   file = hash_table_get (dl_url_file_map, to);
   assert (file != NULL);
   if (!hash_table_contains (dl_url_file_map, from))
-    hash_table_put (dl_url_file_map, xstrdup (from), xstrdup (file));
+    associate_url_with_file (from, file);
 }
 
 /* Register that the file has been deleted. */
@@ -985,17 +1570,15 @@ register_redirection (const char *from, const char *to)
 void
 register_delete_file (const char *file)
 {
-  struct url *old_url;
-  char *old_file;
+  struct download_record *old_rec;
 
   ENSURE_TABLES_EXIST;
 
-  if (!hash_table_get_pair (dl_file_url_map, file, &old_file, &old_url))
+  if (!(old_rec = hash_table_get (dl_file_url_map, file)))
     return;
 
   hash_table_remove (dl_file_url_map, file);
-  xfree (old_file);
-  url_free (old_url);
+  xfree (old_rec);
   dissociate_urls_from_file (file);
 }
 
@@ -1019,38 +1602,143 @@ register_css (const char *file)
   string_set_add (downloaded_css_set, file);
 }
 
-/* Cleanup the data structures associated with this file.  */
+/* Register LINKS, the links recursion found parsing FILE as of URL,
+   starting in the charset ENC, or as CSS if IS_CSS.  convert_file
+   reuses them, unless FILE has changed since.  */
 
-#if defined DEBUG_MALLOC || defined TESTING
-static void downloaded_files_free (void);
+void
+register_links (const char *file, const struct url *url, const char *enc,
+                bool is_css, const struct urlpos *links)
+{
+  struct link_cache_entry *entry, *old_entry;
+  const struct urlpos *link;
+  struct stat st;
+  char *key, *strings;
+  size_t strings_size = 0;
+  int count = 0, i;
+
+  if (stat (file, &st) != 0)
+    return;
+
+  for (link = links; link; link = link->next)
+    {
+      ++count;
+      strings_size += strlen (link->url->url) + 1;
+    }
+
+  entry = xnew0 (struct link_cache_entry);
+  entry->url = xstrdup (url->url);
+  entry->enc = enc ? xstrdup (enc) : NULL;
+  entry->is_css = is_css;
+  entry->size = st.st_size;
+  entry->mtime = st.st_mtime;
+  entry->ctime = st.st_ctime;
+  entry->count = count;
+  entry->links = xmalloc (count * sizeof (struct link_record)
+                          + strings_size + 1);
+  entry->strings = strings = (char *) (entry->links + count);
+
+  for (link = links, i = 0; link; link = link->next, i++)
+    {
+      struct link_record *rec = &entry->links[i];
+      size_t len = strlen (link->url->url) + 1;
+
+      rec->pos = link->pos;
+      rec->size = link->size;
+      rec->refresh_timeout = link->refresh_timeout;
+      rec->url_offset = strings - entry->strings;
+      rec->link_base_p = link->link_base_p;
+      rec->link_complete_p = link->link_complete_p;
+      rec->link_css_p = link->link_css_p;
+      rec->link_noquote_html_p = link->link_noquote_html_p;
+      rec->link_refresh_p = link->link_refresh_p;
+
+      memcpy (strings, link->url->url, len);
+      strings += len;
+    }
+
+  if (!link_cache)
+    link_cache = make_string_hash_table (0);
+  /* A file parsed again replaces what was found the first time.  */
+  if (hash_table_get_pair (link_cache, file, &key, &old_entry))
+    {
+      hash_table_remove (link_cache, file);
+      xfree (key);
+      link_cache_entry_free (old_entry);
+    }
+  hash_table_put (link_cache, xstrdup (file), entry);
+}
 
 static void
-url_free_cb (void *url)
+link_cache_entry_free (void *p)
 {
-  url_free ((struct url*) url);
+  struct link_cache_entry *entry = p;
+
+  xfree (entry->url);
+  xfree (entry->enc);
+  xfree (entry->links);
+  xfree (entry);
 }
 
 static void
-xfree_cb (void *p)
+link_cache_free (void)
 {
-  xfree (p);
+  if (link_cache)
+    {
+      free_keys_and_values (link_cache, link_cache_entry_free);
+      hash_table_destroy (link_cache);
+      link_cache = NULL;
+    }
 }
 
+#if defined DEBUG_MALLOC || defined TESTING
+static void downloaded_files_free (void);
+
 void
 convert_cleanup (void)
 {
   if (dl_file_url_map)
     {
-      free_keys_and_values (dl_file_url_map, url_free_cb);
+      hash_table_iterator iter;
+      for (hash_table_iterate (dl_file_url_map, &iter);
+           hash_table_iter_next (&iter); )
+        xfree (iter.value);
       hash_table_destroy (dl_file_url_map);
       dl_file_url_map = NULL;
     }
   if (dl_url_file_map)
     {
-      free_keys_and_values (dl_url_file_map, xfree_cb);
       hash_table_destroy (dl_url_file_map);
       dl_url_file_map = NULL;
     }
+  if (dl_file_urls_map)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (dl_file_urls_map, &iter);
+           hash_table_iter_next (&iter); )
+        {
+          struct file_url *fu = iter.value;
+          while (fu)
+            {
+              struct file_url *next = fu->next;
+              xfree (fu);
+              fu = next;
+            }
+        }
+      hash_table_destroy (dl_file_urls_map);
+      dl_file_urls_map = NULL;
+    }
+  while (string_pool)
+    {
+      struct string_pool_block *next = string_pool->next;
+      xfree (string_pool);
+      string_pool = next;
+    }
+  if (interned_strings)
+    {
+      hash_table_destroy (interned_strings);
+      interned_strings = NULL;
+    }
   if (downloaded_html_set)
     string_set_free (downloaded_html_set);
   if (downloaded_css_set)
@@ -1058,6 +1746,7 @@ convert_cleanup (void)
   downloaded_files_free ();
   if (converted_files)
     string_set_free (converted_files);
+  link_cache_free ();
 }
 #endif
 
@@ -1159,6 +1848,165 @@ downloaded_files_free (void)
 }
 #endif
 
+/* Saving the book-keeping above along with the state of the crawl,
+   and restoring it when the crawl is resumed.  Each table is written
+   as the number of its entries followed by the entries.  */
+
+static void
+write_string_set (FILE *fp, struct hash_table *set)
+{
+  hash_table_iterator iter;
+
+  fput_int (fp, set ? hash_table_count (set) : 0);
+  if (set)
+    for (hash_table_iterate (set, &iter); hash_table_iter_next (&iter); )
+      fput_string (fp, iter.key);
+}
+
+static bool
+read_string_set (FILE *fp, struct hash_table **set)
+{
+  int count;
+  char *s;
+
+  if (!fget_int (fp, &count))
+    return false;
+  if (count > 0 && !*set)
+    *set = make_string_hash_table (count);
+  for (; count > 0; count--)
+    {
+      if (!fget_string (fp, &s) || !s)
+        return false;
+      string_set_add (*set, s);
+      xfree (s);
+    }
+  return true;
+}
+
+/* Write the tables of downloaded files to FP.  Errors are to be
+   checked with ferror.  */
+
+void
+convert_write_state (FILE *fp)
+{
+  hash_table_iterator iter;
+
+  fput_int (fp, dl_file_url_map ? hash_table_count (dl_file_url_map) : 0);
+  if (dl_file_url_map)
+    for (hash_table_iterate (dl_file_url_map, &iter);
+         hash_table_iter_next (&iter); )
+      {
+        const struct download_record *rec = iter.value;
+        fput_string (fp, iter.key);
+        fput_string (fp, rec->url);
+        fput_string (fp, rec->ori_enc);
+        fput_string (fp, rec->content_enc);
+        fput_int (fp, rec->enc_type);
+      }
+
+  fput_int (fp, dl_url_file_map ? hash_table_count (dl_url_file_map) : 0);
+  if (dl_url_file_map)
+    for (hash_table_iterate (dl_url_file_map, &iter);
+         hash_table_iter_next (&iter); )
+      {
+        fput_string (fp, iter.key);
+        fput_string (fp, iter.value);
+      }
+
+  write_string_set (fp, downloaded_html_set);
+  write_string_set (fp, downloaded_css_set);
+
+  fput_int (fp, downloaded_files_hash
+            ? hash_table_count (downloaded_files_hash) : 0);
+  if (downloaded_files_hash)
+    for (hash_table_iterate (downloaded_files_hash, &iter);
+         hash_table_iter_next (&iter); )
+      {
+        fput_string (fp, iter.key);
+        fput_int (fp, *(downloaded_file_t *) iter.value);
+      }
+}
+
+/* Read the tables written by convert_write_state from FP, adding
+   their entries to those already known.  Returns false if FP could
+   not be read entirely.  */
+
+bool
+convert_read_state (FILE *fp)
+{
+  int count, mode, enc_type;
+  char *key, *value, *ori_enc, *content_enc;
+
+  if (!fget_int (fp, &count))
+    return false;
+  ENSURE_TABLES_EXIST;
+  for (; count > 0; count--)
+    {
+      bool ok;
+
+      key = value = ori_enc = content_enc = NULL;
+      ok = (fget_string (fp, &key) && key
+            && fget_string (fp, &value) && value
+            && fget_string (fp, &ori_enc)
+            && fget_string (fp, &content_enc)
+            && fget_int (fp, &enc_type));
+      if (ok && !hash_table_contains (dl_file_url_map, key))
+        {
+          struct download_record *rec = xnew (struct download_record);
+          rec->url = intern_string (value);
+          rec->ori_enc = intern_string (ori_enc);
+          rec->content_enc = intern_string (content_enc);
+          rec->enc_type = enc_type;
+          hash_table_put (dl_file_url_map, intern_string (key), rec);
+        }
+      xfree (key);
+      xfree (value);
+      xfree (ori_enc);
+      xfree (content_enc);
+      if (!ok)
+        return false;
+    }
+
+  if (!fget_int (fp, &count))
+    return false;
+  for (; count > 0; count--)
+    {
+      if (!fget_string (fp, &key) || !key)
+        return false;
+      if (!fget_string (fp, &value) || !value)
+        {
+          xfree (key);
+          return false;
+        }
+      if (!hash_table_contains (dl_url_file_map, key))
+        associate_url_with_file (key, value);
+      xfree (key);
+      xfree (value);
+    }
+
+  if (!read_string_set (fp, &downloaded_html_set)
+      || !read_string_set (fp, &downloaded_css_set))
+    return false;
+
+  if (!fget_int (fp, &count))
+    return false;
+  for (; count > 0; count--)
+    {
+      if (!fget_string (fp, &key) || !key)
+        return false;
+      if (!fget_int (fp, &mode)
+          || mode < FILE_DOWNLOADED_NORMALLY
+          || mode > FILE_DOWNLOADED_AND_HTML_EXTENSION_ADDED)
+        {
+          xfree (key);
+          return false;
+        }
+      downloaded_file (mode, key);
+      xfree (key);
+    }
+  return true;
+}
+
 /* The function returns the pointer to the malloc-ed quoted version of
    string s.  It will recognize and quote numeric and special graphic
    entities, as per RFC1866:
@@ -1231,6 +2079,74 @@ html_quote_string (const char *s)
   return res;
 }
 
+#ifdef TESTING
+
+static struct url *
+test_download_url (const char *url)
+{
+  struct url *u = url_new_init ();
+  u->ori_url = xstrdup (url);
+  url_parse (u, true, false);
+  return u;
+}
+
+const char *
+test_register_download (void)
+{
+  struct url *a = test_download_url ("http://example.com/a");
+  struct url *b = test_download_url ("http://example.com/b");
+  const char *locale = opt.locale;
+
+  if (!opt.locale)
+    opt.locale = "UTF-8";
+
+  register_download (a, "file");
+  register_redirection ("http://example.com/old-a", "http://example.com/a");
+  mu_assert ("test_register_download: redirection",
+             !strcmp (hash_table_get (dl_url_file_map,
+                                      "http://example.com/old-a"), "file"));
+  mu_assert ("test_register_download: interned",
+             hash_table_get (dl_url_file_map, "http://example.com/old-a")
+             == hash_table_get (dl_url_file_map, "http://example.com/a"));
+  {
+    struct url *u = download_record_url (hash_table_get (dl_file_url_map,
+                                                         "file"));
+    mu_assert ("test_register_download: reparsed",
+               u && !strcmp (u->url, a->url) && !strcmp (u->host, a->host)
+               && !strcmp (u->path, a->path));
+    url_free (u);
+  }
+
+  /* Another URL saved to the file takes it over, with no alias left
+     of the first.  */
+  register_download (b, "file");
+  mu_assert ("test_register_download: dissociated",
+             !hash_table_contains (dl_url_file_map, "http://example.com/a")
+             && !hash_table_contains (dl_url_file_map,
+                                      "http://example.com/old-a")
+             && !strcmp (hash_table_get (dl_url_file_map,
+                                         "http://example.com/b"), "file"));
+
+  /* A URL saved again elsewhere leaves the list of its old file.  */
+  register_download (b, "other");
+  register_delete_file ("file");
+  mu_assert ("test_register_download: moved",
+             !strcmp (hash_table_get (dl_url_file_map,
+                                      "http://example.com/b"), "other"));
+  register_delete_file ("other");
+  mu_assert ("test_register_download: deleted",
+             hash_table_count (dl_url_file_map) == 0
+             && hash_table_count (dl_file_urls_map) == 0);
+
+  url_free (a);
+  url_free (b);
+  convert_cleanup ();
+  opt.locale = locale;
+  return NULL;
+}
+
+#endif /* TESTING */
+
 /*
  * vim: et ts=2 sw=2
  */
@@ -107,8 +107,12 @@ void register_redirection (const char *, const char *);
 void register_html (const char *);
 void register_css (const char *);
 void register_delete_file (const char *);
+void register_links (const char *, const struct url *, const char *, bool,
+                     const struct urlpos *);
 void convert_all_links (void);
 void convert_cleanup (void);
+void convert_write_state (FILE *);
+bool convert_read_state (FILE *);
 
 char *html_quote_string (const char *);
 
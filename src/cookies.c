@@ -52,6 +52,8 @@ as that of the covered work.  */
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #ifdef HAVE_LIBPSL
 # include <libpsl.h>
 #endif
@@ -61,6 +63,10 @@ as that of the covered work.  */
 #include "http.h"               /* for http_atotm */
 #include "c-strcase.h"
 
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+
 
 /* Declarations of `struct cookie' and the most basic functions. */
 
@@ -74,13 +80,89 @@ as that of the covered work.  */
    course, when sending a cookie to `www.google.com', one must search
    for cookies that belong to either `www.google.com' or `google.com'
    -- but the point is that the code doesn't need to go through *all*
-   the cookies.  */
+   the cookies.
+
+   As the same `Cookie' header is usually sent with many requests,
+   the jar also remembers the headers it generated, in the
+   header_cache table.  See cookie_header for details.  */
 
 struct cookie_jar {
   /* Cookie chains indexed by domain.  */
   struct hash_table *chains;
 
+  /* Cached `Cookie' headers, indexed by "HOST:PORT:SECFLAG".  */
+  struct hash_table *header_cache;
+
   int cookie_count;             /* number of cookies in the jar. */
+
+  /* With --cookies-index, the index of the file the cookies were
+     loaded from, the name of that file, and the domains whose cookies
+     have been parsed from the index and stored to CHAINS.  */
+  struct cookie_index *index;
+  char *index_file;
+  struct hash_table *loaded_domains;
+
+  bool changed;                 /* whether a cookie was stored or
+                                   discarded since loading. */
+};
+
+/* The index of a cookies file, saved as FILE.idx: the lines of the
+   file, each preceded by the domain it is keyed on, as "DOMAIN\0LINE\0"
+   strings, and their offsets sorted by domain.  Lines of the same
+   domain stay in file order, so that later lines replace earlier ones
+   when they are parsed.  */
+struct cookie_index_entry
+{
+  uint64_t offset;
+};
+
+struct cookie_index_header
+{
+  char magic[8];
+  /* The size and modification time of the cookies file it was built
+     from. */
+  uint64_t jar_size;
+  int64_t jar_mtime;
+  uint64_t count;
+  uint64_t strings_size;
+};
+
+#define COOKIE_INDEX_MAGIC "WgetJar1"
+
+struct cookie_index
+{
+  const struct cookie_index_entry *entries;
+  size_t count;
+  const char *strings;
+  size_t strings_size;
+  /* The mapped index file, or NULL if the index was built in memory.  */
+  struct file_memory *fm;
+};
+
+static void cookie_jar_load_domain (struct cookie_jar *, const char *);
+
+/* The headers cached for the requests to one host and port, over
+   either secure or insecure connections.  */
+
+struct cookie_headers {
+  char *host;
+
+  /* The chains found by find_chains_of_host for HOST.  */
+  struct cookie *chains[32];
+  int chain_count;
+
+  /* The distinct paths of the cookies that match HOST, longest
+     first, and the header generated for each, or NULL if it has not
+     been needed yet.  The header for a request is that of the first
+     path that is a prefix of the request's path, because the cookies
+     that match the request are exactly those whose paths are
+     prefixes of that one.  */
+  char **paths;
+  char **headers;
+  int path_count;
+
+  /* The earliest time when one of the cookies expires, or 0.  */
+  time_t expiry;
 };
 
 /* Value set by entry point functions, so that the low-level
@@ -92,7 +174,12 @@ cookie_jar_new (void)
 {
   struct cookie_jar *jar = xnew (struct cookie_jar);
   jar->chains = make_nocase_string_hash_table (0);
+  jar->header_cache = make_nocase_string_hash_table (0);
   jar->cookie_count = 0;
+  jar->index = NULL;
+  jar->index_file = NULL;
+  jar->loaded_domains = make_nocase_string_hash_table (0);
+  jar->changed = false;
   return jar;
 }
 
@@ -161,6 +248,63 @@ delete_cookie (struct cookie *cookie)
   xfree (cookie);
 }
 
+/* Deallocate the cached headers CH.  */
+
+static void
+delete_cookie_headers (struct cookie_headers *ch)
+{
+  int i;
+  for (i = 0; i < ch->path_count; i++)
+    {
+      xfree (ch->paths[i]);
+      xfree (ch->headers[i]);
+    }
+  xfree (ch->paths);
+  xfree (ch->headers);
+  xfree (ch->host);
+  xfree (ch);
+}
+
+static bool numeric_address_p (const char *);
+
+/* hash_table_for_each callback for invalidate_cookie_headers: remove
+   the headers of the hosts whose cookies the chain of DOMAIN can
+   be, as found by find_chains_of_host.  */
+
+static int
+invalidate_matching_headers (void *key, void *value, void *arg)
+{
+  struct cookie_jar *jar = ((void **) arg)[0];
+  const char *domain = ((void **) arg)[1];
+  struct cookie_headers *ch = value;
+  size_t hostlen = strlen (ch->host), domlen = strlen (domain);
+
+  if (0 == strcasecmp (ch->host, domain)
+      || (hostlen > domlen
+          && ch->host[hostlen - domlen - 1] == '.'
+          && 0 == strcasecmp (ch->host + hostlen - domlen, domain)
+          && !numeric_address_p (ch->host)))
+    {
+      hash_table_remove (jar->header_cache, key);
+      xfree (key);
+      delete_cookie_headers (ch);
+    }
+  return 0;
+}
+
+/* Forget the headers generated from the chain of DOMAIN, which is
+   about to change.  */
+
+static void
+invalidate_cookie_headers (struct cookie_jar *jar, const char *domain)
+{
+  void *arg[2];
+
+  arg[0] = jar;
+  arg[1] = (void *) domain;
+  hash_table_for_each (jar->header_cache, invalidate_matching_headers, arg);
+}
+
 /* Functions for storing cookies.
 
    All cookies can be reached beginning with jar->chains.  The key in
@@ -215,6 +359,9 @@ store_cookie (struct cookie_jar *jar, struct cookie *cookie)
   struct cookie *chain_head;
   char *chain_key;
 
+  cookie_jar_load_domain (jar, cookie->domain);
+  invalidate_cookie_headers (jar, cookie->domain);
+
   if (hash_table_get_pair (jar->chains, cookie->domain,
                            &chain_key, &chain_head))
     {
@@ -286,6 +433,7 @@ discard_matching_cookie (struct cookie_jar *jar, struct cookie *cookie)
 {
   struct cookie *prev, *victim;
 
+  cookie_jar_load_domain (jar, cookie->domain);
   if (!hash_table_count (jar->chains))
     /* No elements == nothing to discard. */
     return;
@@ -293,6 +441,7 @@ discard_matching_cookie (struct cookie_jar *jar, struct cookie *cookie)
   victim = find_matching_cookie (jar, cookie, &prev);
   if (victim)
     {
+      invalidate_cookie_headers (jar, victim->domain);
       if (prev)
         /* Simply unchain the victim. */
         prev->next = victim->next;
@@ -742,6 +891,7 @@ cookie_handle_set_cookie (struct cookie_jar *jar,
   cookies_now = time (NULL);
   char buf[1024], *tmp;
   size_t pathlen = strlen(path);
+  MEMACCT_ENTER (memacct_saved, MEMACCT_COOKIES);
 
   /* Wget's paths don't begin with '/' (blame rfc1808), but cookie
      usage assumes /-prefixed paths.  Until the rest of Wget is fixed,
@@ -808,6 +958,7 @@ cookie_handle_set_cookie (struct cookie_jar *jar,
   /* Now store the cookie, or discard an existing cookie, if
      discarding was requested.  */
 
+  jar->changed = true;
   if (cookie->discard_requested)
     {
       discard_matching_cookie (jar, cookie);
@@ -817,6 +968,7 @@ cookie_handle_set_cookie (struct cookie_jar *jar,
   store_cookie (jar, cookie);
   if (tmp != buf)
     xfree (tmp);
+  MEMACCT_LEAVE (memacct_saved);
   return;
 
  out:
@@ -824,6 +976,7 @@ cookie_handle_set_cookie (struct cookie_jar *jar,
     delete_cookie (cookie);
   if (tmp != buf)
     xfree (tmp);
+  MEMACCT_LEAVE (memacct_saved);
 }
 
 /* Support for sending out cookies in HTTP requests, based on
@@ -863,7 +1016,7 @@ find_chains_of_host (struct cookie_jar *jar, const char *host,
   int passes, passcnt;
 
   /* Bail out quickly if there are no cookies in the jar.  */
-  if (!hash_table_count (jar->chains))
+  if (!hash_table_count (jar->chains) && !jar->index)
     return 0;
 
   if (numeric_address_p (host))
@@ -883,7 +1036,10 @@ find_chains_of_host (struct cookie_jar *jar, const char *host,
      srk.fer.hr's, then fer.hr's.  */
   while (1)
     {
-      struct cookie *chain = hash_table_get (jar->chains, host);
+      struct cookie *chain;
+
+      cookie_jar_load_domain (jar, host);
+      chain = hash_table_get (jar->chains, host);
       if (chain)
         dest[dest_count++] = chain;
       if (++passcnt >= passes)
@@ -911,7 +1067,8 @@ path_matches (const char *full_path, const char *prefix)
 }
 
 /* Return true if COOKIE matches the provided parameters of the URL
-   being downloaded: HOST, PORT, PATH, and SECFLAG.
+   being downloaded: HOST, PORT, PATH, and SECFLAG.  If PATH is NULL,
+   any path matches.
 
    If PATH_GOODNESS is non-NULL, store the "path goodness" value
    there.  That value is a measure of how closely COOKIE matches PATH,
@@ -945,6 +1102,9 @@ cookie_matches_url (const struct cookie *cookie,
       && 0 != strcasecmp (host, cookie->domain))
     return false;
 
+  if (!path)
+    return true;
+
   pg = path_matches (path, cookie->path);
   if (pg == 0)
     return false;
@@ -1045,82 +1205,44 @@ goodness_comparator (const void *p1, const void *p2)
   return dgdiff ? dgdiff : pgdiff;
 }
 
-/* Generate a `Cookie' header for a request that goes to HOST:PORT and
-   requests PATH from the server.  The resulting string is allocated
-   with `malloc', and the caller is responsible for freeing it.  If no
-   cookies pertain to this request, i.e. no cookie header should be
-   generated, NULL is returned.  */
+/* Generate the `Cookie' header for the cookies of CH that match a
+   request for PATH over a connection to PORT, secure if SECFLAG.  If
+   no cookies match, NULL is returned.  */
 
-char *
-cookie_header (struct cookie_jar *jar, const char *host,
-               int port, const char *path, bool secflag)
+static char *
+generate_cookie_header (const struct cookie_headers *ch, int port,
+                        const char *path, bool secflag)
 {
-  struct cookie *chains[32];
-  int chain_count;
-
+  const char *host = ch->host;
   struct cookie *cookie;
   struct weighed_cookie *outgoing;
   size_t count, i, ocnt;
-  char *result = NULL;
+  char *result;
   int result_size, pos;
-  char pathbuf[1024];
 
-  /* First, find the cookie chains whose domains match HOST. */
-
-  /* Allocate room for find_chains_of_host to write to.  The number of
-     chains can at most equal the number of subdomains, hence
-     1+<number of dots>.  We ignore cookies with more than 32 labels. */
-  chain_count = 1 + count_char (host, '.');
-  if (chain_count > (int) countof (chains))
-    return NULL;
-  chain_count = find_chains_of_host (jar, host, chains);
-
-  /* No cookies for this host. */
-  if (chain_count <= 0)
-    return NULL;
-
-  /* Wget's paths don't begin with '/' (blame rfc1808), but cookie
-     usage assumes /-prefixed paths.  Until the rest of Wget is fixed,
-     simply prepend slash to PATH.  */
-  {
-    char *tmp;
-    size_t pathlen = strlen(path);
-
-    if (pathlen < sizeof (pathbuf) - 1)
-      tmp = pathbuf;
-    else
-      tmp = xmalloc (pathlen + 2);
-
-    *tmp = '/';
-    memcpy (tmp + 1, path, pathlen + 1);
-    path = tmp;
-  }
-
-  cookies_now = time (NULL);
-
-  /* Now extract from the chains those cookies that match our host
-     (for domain_exact cookies), port (for cookies with port other
-     than PORT_ANY), etc.  See matching_cookie for details.  */
+  /* Extract from the chains those cookies that match our host (for
+     domain_exact cookies), port (for cookies with port other than
+     PORT_ANY), etc.  See matching_cookie for details.  */
 
   /* Count the number of matching cookies. */
   count = 0;
-  for (i = 0; i < (unsigned) chain_count; i++)
-    for (cookie = chains[i]; cookie; cookie = cookie->next)
+  for (i = 0; i < (unsigned) ch->chain_count; i++)
+    for (cookie = ch->chains[i]; cookie; cookie = cookie->next)
       if (cookie_matches_url (cookie, host, port, path, secflag, NULL))
         ++count;
   if (!count)
-    goto out;                /* no cookies matched */
+    return NULL;             /* no cookies matched */
 
   /* Allocate the array. */
   if (count > SIZE_MAX / sizeof (struct weighed_cookie))
-    goto out;                /* unable to process so many cookies */
+    return NULL;             /* unable to process so many cookies */
   outgoing = xmalloc (count * sizeof (struct weighed_cookie));
 
   /* Fill the array with all the matching cookies from the chains that
      match HOST. */
   ocnt = 0;
-  for (i = 0; i < (unsigned) chain_count; i++)
-    for (cookie = chains[i]; cookie; cookie = cookie->next)
+  for (i = 0; i < (unsigned) ch->chain_count; i++)
+    for (cookie = ch->chains[i]; cookie; cookie = cookie->next)
       {
         int pg;
         if (!cookie_matches_url (cookie, host, port, path, secflag, &pg))
@@ -1176,12 +1298,152 @@ cookie_header (struct cookie_jar *jar, const char *host,
   result[pos++] = '\0';
   xfree (outgoing);
   assert (pos == result_size);
+  return result;
+}
+
+/* Comparator used for sorting the paths longest first. */
+
+static int
+path_length_comparator (const void *p1, const void *p2)
+{
+  const char *s1 = *(const char **) p1;
+  const char *s2 = *(const char **) p2;
+  size_t l1 = strlen (s1), l2 = strlen (s2);
+
+  if (l1 != l2)
+    return l1 < l2 ? 1 : -1;
+  return strcmp (s1, s2);
+}
+
+/* Return the cached headers of JAR for HOST, PORT, and SECFLAG,
+   creating them if they weren't, or if one of their cookies has
+   expired since.  Return NULL if HOST has too many labels.  */
+
+static struct cookie_headers *
+get_cookie_headers (struct cookie_jar *jar, const char *host,
+                    int port, bool secflag)
+{
+  struct cookie_headers *ch;
+  struct cookie *cookie;
+  char *key, *old_key;
+  int i, j, count;
+
+  /* We ignore cookies with more than 32 labels. */
+  if (1 + count_char (host, '.') > (int) countof (ch->chains))
+    return NULL;
+
+  key = aprintf ("%s:%d:%d", host, port, secflag);
+  if (hash_table_get_pair (jar->header_cache, key, &old_key, &ch))
+    {
+      if (!ch->expiry || ch->expiry >= cookies_now)
+        {
+          xfree (key);
+          return ch;
+        }
+      hash_table_remove (jar->header_cache, old_key);
+      xfree (old_key);
+      delete_cookie_headers (ch);
+    }
+
+  ch = xnew0 (struct cookie_headers);
+  ch->host = xstrdup (host);
+  ch->chain_count = find_chains_of_host (jar, host, ch->chains);
+
+  count = 0;
+  for (i = 0; i < ch->chain_count; i++)
+    for (cookie = ch->chains[i]; cookie; cookie = cookie->next)
+      if (cookie_matches_url (cookie, host, port, NULL, secflag, NULL))
+        ++count;
+
+  if (count)
+    {
+      ch->paths = xnew_array (char *, count);
+      for (i = 0; i < ch->chain_count; i++)
+        for (cookie = ch->chains[i]; cookie; cookie = cookie->next)
+          if (cookie_matches_url (cookie, host, port, NULL, secflag, NULL))
+            {
+              ch->paths[ch->path_count++] = cookie->path;
+              if (cookie->expiry_time
+                  && (!ch->expiry || cookie->expiry_time < ch->expiry))
+                ch->expiry = cookie->expiry_time;
+            }
+
+      /* Sort the paths and keep one copy of each.  */
+      qsort (ch->paths, count, sizeof (char *), path_length_comparator);
+      for (i = j = 0; i < count; i++)
+        if (!j || strcmp (ch->paths[i], ch->paths[j - 1]))
+          ch->paths[j++] = ch->paths[i];
+      ch->path_count = j;
+      for (i = 0; i < j; i++)
+        ch->paths[i] = xstrdup (ch->paths[i]);
+      ch->headers = xnew0_array (char *, j);
+    }
+
+  hash_table_put (jar->header_cache, key, ch);
+  return ch;
+}
+
+/* Generate a `Cookie' header for a request that goes to HOST:PORT and
+   requests PATH from the server.  The resulting string is allocated
+   with `malloc', and the caller is responsible for freeing it.  If no
+   cookies pertain to this request, i.e. no cookie header should be
+   generated, NULL is returned.
+
+   The headers depend only on the longest cookie path that is a
+   prefix of PATH, so they are generated once for each such path and
+   cached in JAR until the cookie chains they come from change.  */
+
+char *
+cookie_header (struct cookie_jar *jar, const char *host,
+               int port, const char *path, bool secflag)
+{
+  struct cookie_headers *ch;
+  char *result = NULL;
+  char pathbuf[1024];
+  int i;
+
+  /* Bail out quickly if there are no cookies in the jar.  */
+  if (!hash_table_count (jar->chains) && !jar->index)
+    return NULL;
+
+  cookies_now = time (NULL);
+
+  ch = get_cookie_headers (jar, host, port, secflag);
+  if (!ch || !ch->path_count)
+    return NULL;
+
+  /* Wget's paths don't begin with '/' (blame rfc1808), but cookie
+     usage assumes /-prefixed paths.  Until the rest of Wget is fixed,
+     simply prepend slash to PATH.  */
+  {
+    char *tmp;
+    size_t pathlen = strlen(path);
+
+    if (pathlen < sizeof (pathbuf) - 1)
+      tmp = pathbuf;
+    else
+      tmp = xmalloc (pathlen + 2);
+
+    *tmp = '/';
+    memcpy (tmp + 1, path, pathlen + 1);
+    path = tmp;
+  }
+
+  for (i = 0; i < ch->path_count; i++)
+    if (path_matches (path, ch->paths[i]))
+      {
+        if (!ch->headers[i])
+          ch->headers[i] = generate_cookie_header (ch, port, ch->paths[i],
+                                                   secflag);
+        if (ch->headers[i])
+          result = xstrdup (ch->headers[i]);
+        break;
+      }
 
-out:
   if (path != pathbuf)
     xfree (path);
 
-return result;
+  return result;
 }
 
 /* Support for loading and saving cookies.  The format used for
@@ -1245,7 +1507,420 @@ domain_port (const char *domain_b, const char *domain_e,
   ++p;                                          \
 } while (0)
 
-/* Load cookies from FILE.  */
+/* Parse LINE of a cookies file and store its cookie to JAR.  LINE is
+   modified.  */
+
+static void
+cookie_jar_load_line (struct cookie_jar *jar, char *line)
+{
+  struct cookie *cookie;
+  char *p = line;
+
+  double expiry;
+  int port;
+
+  char *domain_b  = NULL, *domain_e  = NULL;
+  char *domflag_b = NULL, *domflag_e = NULL;
+  char *path_b    = NULL, *path_e    = NULL;
+  char *secure_b  = NULL, *secure_e  = NULL;
+  char *expires_b = NULL, *expires_e = NULL;
+  char *name_b    = NULL, *name_e    = NULL;
+  char *value_b   = NULL, *value_e   = NULL;
+
+  /* Skip leading white-space. */
+  while (*p && c_isspace (*p))
+    ++p;
+  /* Ignore empty lines.  */
+  if (!*p || *p == '#')
+    return;
+
+  GET_WORD (p, domain_b,  domain_e);
+  GET_WORD (p, domflag_b, domflag_e);
+  GET_WORD (p, path_b,    path_e);
+  GET_WORD (p, secure_b,  secure_e);
+  GET_WORD (p, expires_b, expires_e);
+  GET_WORD (p, name_b,    name_e);
+
+  /* Don't use GET_WORD for value because it ends with newline,
+     not TAB.  */
+  value_b = p;
+  value_e = p + strlen (p);
+  if (value_e > value_b && value_e[-1] == '\n')
+    --value_e;
+  if (value_e > value_b && value_e[-1] == '\r')
+    --value_e;
+  /* Empty values are legal (I think), so don't bother checking. */
+
+  cookie = cookie_new ();
+
+  cookie->attr    = strdupdelim (name_b, name_e);
+  cookie->value   = strdupdelim (value_b, value_e);
+  cookie->path    = strdupdelim (path_b, path_e);
+  cookie->secure  = BOUNDED_EQUAL (secure_b, secure_e, "TRUE");
+
+  /* Curl source says, quoting Andre Garcia: "flag: A TRUE/FALSE
+     value indicating if all machines within a given domain can
+     access the variable.  This value is set automatically by the
+     browser, depending on the value set for the domain."  */
+  cookie->domain_exact = !BOUNDED_EQUAL (domflag_b, domflag_e, "TRUE");
+
+  /* DOMAIN needs special treatment because we might need to
+     extract the port.  */
+  port = domain_port (domain_b, domain_e, (const char **)&domain_e);
+  if (port)
+    cookie->port = port;
+
+  if (*domain_b == '.')
+    ++domain_b;             /* remove leading dot internally */
+  cookie->domain  = strdupdelim (domain_b, domain_e);
+
+  /* safe default in case EXPIRES field is garbled. */
+  expiry = (double)cookies_now - 1;
+
+  /* I don't like changing the line, but it's safe here.  (line is
+     malloced.)  */
+  *expires_e = '\0';
+  sscanf (expires_b, "%lf", &expiry);
+
+  if (expiry == 0)
+    {
+      /* EXPIRY can be 0 for session cookies saved because the
+         user specified `--keep-session-cookies' in the past.
+         They remain session cookies, and will be saved only if
+         the user has specified `keep-session-cookies' again.  */
+    }
+  else
+    {
+      if (expiry < cookies_now)
+        goto abort_cookie;  /* ignore stale cookie. */
+      cookie->expiry_time = (time_t) expiry;
+      cookie->permanent = 1;
+    }
+
+  store_cookie (jar, cookie);
+  return;
+
+ abort_cookie:
+  delete_cookie (cookie);
+ next:
+  return;
+}
+
+/* Find the domain LINE of a cookies file is keyed on in the index, as
+   cookie_jar_load_line would store it: without the leading dot and
+   the port.  Return false if LINE holds no cookie.  */
+
+static bool
+cookie_line_domain (const char *line, const char **domain_b,
+                    const char **domain_e)
+{
+  const char *p = line;
+
+  while (*p && c_isspace (*p))
+    ++p;
+  if (!*p || *p == '#')
+    return false;
+
+  *domain_b = p;
+  while (*p && *p != '\t')
+    ++p;
+  if (p == *domain_b || !*p)
+    return false;
+  *domain_e = p;
+
+  domain_port (*domain_b, *domain_e, domain_e);
+  if (**domain_b == '.')
+    ++*domain_b;
+  return *domain_b < *domain_e;
+}
+
+/* Whether cookie_jar_save should write LINE, which has not been
+   parsed: the same cookies cookie_jar_load_line would keep and
+   cookie_jar_save would write.  */
+
+static bool
+cookie_line_saved_p (const char *line)
+{
+  const char *p = line;
+  double expiry;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    {
+      p = strchr (p, '\t');
+      if (!p)
+        return false;
+      ++p;
+    }
+  if (sscanf (p, "%lf", &expiry) != 1)
+    return false;
+  if (expiry == 0)
+    return opt.keep_session_cookies;
+  return expiry >= cookies_now;
+}
+
+/* Return the line of entry I of INDEX, and store its domain to
+   DOMAIN.  Return NULL if the entry is corrupt.  */
+
+static const char *
+cookie_index_line (const struct cookie_index *index, size_t i,
+                   const char **domain)
+{
+  uint64_t offset = index->entries[i].offset;
+  const char *end = index->strings + index->strings_size;
+  const char *line;
+
+  if (offset >= index->strings_size)
+    return NULL;
+  *domain = index->strings + offset;
+  line = *domain + strlen (*domain) + 1;
+  return line < end ? line : NULL;
+}
+
+/* Sorting the index, by domain and then by position in the file. */
+
+static const char *cookie_index_sort_strings;
+
+static int
+cookie_index_entry_cmp (const void *p1, const void *p2)
+{
+  const struct cookie_index_entry *e1 = p1, *e2 = p2;
+  int cmp = c_strcasecmp (cookie_index_sort_strings + e1->offset,
+                          cookie_index_sort_strings + e2->offset);
+  if (cmp)
+    return cmp;
+  return e1->offset < e2->offset ? -1 : e1->offset > e2->offset ? 1 : 0;
+}
+
+static void
+cookie_index_free (struct cookie_index *index)
+{
+  if (index->fm)
+    wget_read_file_free (index->fm);
+  else
+    {
+      xfree (index->entries);
+      xfree (index->strings);
+    }
+  xfree (index);
+}
+
+/* Build the index of the cookies file FP.  */
+
+static struct cookie_index *
+cookie_build_index (FILE *fp)
+{
+  struct cookie_index_entry *entries = NULL;
+  size_t count = 0, entries_size = 0;
+  char *strings = NULL;
+  size_t strings_len = 0, strings_size = 0;
+  struct cookie_index *index;
+  char *line = NULL;
+  size_t bufsize = 0;
+  ssize_t len;
+
+  while ((len = getline (&line, &bufsize, fp)) > 0)
+    {
+      const char *domain_b, *domain_e;
+      size_t domain_len, needed;
+
+      if (line[len - 1] == '\n')
+        line[--len] = '\0';
+      if (len > 0 && line[len - 1] == '\r')
+        line[--len] = '\0';
+      if (!cookie_line_domain (line, &domain_b, &domain_e))
+        continue;
+
+      domain_len = domain_e - domain_b;
+      needed = strings_len + domain_len + 1 + len + 1;
+      if (needed > strings_size)
+        {
+          strings_size = MAX (needed, 2 * strings_size);
+          strings = xrealloc (strings, strings_size);
+        }
+      if (count == entries_size)
+        {
+          entries_size = entries_size ? 2 * entries_size : 64;
+          entries = xrealloc (entries, entries_size * sizeof *entries);
+        }
+      entries[count++].offset = strings_len;
+      memcpy (strings + strings_len, domain_b, domain_len);
+      strings[strings_len + domain_len] = '\0';
+      memcpy (strings + strings_len + domain_len + 1, line, len + 1);
+      strings_len = needed;
+    }
+  xfree (line);
+
+  cookie_index_sort_strings = strings;
+  qsort (entries, count, sizeof *entries, cookie_index_entry_cmp);
+
+  index = xnew0 (struct cookie_index);
+  index->entries = entries;
+  index->count = count;
+  index->strings = strings;
+  index->strings_size = strings_len;
+  return index;
+}
+
+/* Map the index saved in PATH, if it was built from the cookies file
+   described by ST.  Return NULL otherwise.  */
+
+static struct cookie_index *
+cookie_map_index (const char *path, const struct stat *st)
+{
+  struct cookie_index_header header;
+  struct cookie_index *index;
+  struct file_memory *fm;
+
+  fm = wget_read_file (path);
+  if (fm == NULL)
+    return NULL;
+
+  if (fm->length < (wgint) sizeof header)
+    goto invalid;
+  memcpy (&header, fm->content, sizeof header);
+  if (memcmp (header.magic, COOKIE_INDEX_MAGIC, sizeof header.magic)
+      || header.jar_size != (uint64_t) st->st_size
+      || header.jar_mtime != (int64_t) st->st_mtime
+      || header.count > (fm->length - sizeof header)
+                        / sizeof (struct cookie_index_entry)
+      || sizeof header + header.count * sizeof (struct cookie_index_entry)
+         + header.strings_size != (uint64_t) fm->length
+      || (header.strings_size
+          && fm->content[fm->length - 1] != '\0'))
+    goto invalid;
+
+  index = xnew0 (struct cookie_index);
+  index->entries = (const void *) (fm->content + sizeof header);
+  index->count = header.count;
+  index->strings = (const char *) (index->entries + header.count);
+  index->strings_size = header.strings_size;
+  index->fm = fm;
+  return index;
+
+ invalid:
+  wget_read_file_free (fm);
+  return NULL;
+}
+
+/* Save INDEX to PATH for the cookies file described by ST.  The index
+   is written to a temporary file first, so that another Wget never
+   maps half of it.  */
+
+static void
+cookie_save_index (const char *path, const struct stat *st,
+                   const struct cookie_index *index)
+{
+  struct cookie_index_header header;
+  char *tmp_path = aprintf ("%s.tmp", path);
+  FILE *fp;
+  bool ok;
+
+  memset (&header, 0, sizeof header);
+  memcpy (header.magic, COOKIE_INDEX_MAGIC, sizeof header.magic);
+  header.jar_size = st->st_size;
+  header.jar_mtime = st->st_mtime;
+  header.count = index->count;
+  header.strings_size = index->strings_size;
+
+  fp = fopen (tmp_path, "wb");
+  if (fp == NULL)
+    {
+      DEBUGP (("Could not save cookies index %s: %s\n", quote (path),
+               strerror (errno)));
+      xfree (tmp_path);
+      return;
+    }
+  ok = fwrite (&header, sizeof header, 1, fp) == 1
+    && fwrite (index->entries, sizeof *index->entries, index->count, fp)
+       == index->count
+    && fwrite (index->strings, 1, index->strings_size, fp)
+       == index->strings_size;
+  if (fclose (fp) != 0)
+    ok = false;
+  if (!ok || rename (tmp_path, path) != 0)
+    {
+      DEBUGP (("Could not save cookies index %s: %s\n", quote (path),
+               strerror (errno)));
+      unlink (tmp_path);
+    }
+  xfree (tmp_path);
+}
+
+/* Return the index of the cookies file FP, named FILE.  The saved
+   index is used if it is up to date and USE_SAVED; otherwise it is
+   built, and saved for the next run.  */
+
+static struct cookie_index *
+cookie_load_index (const char *file, FILE *fp, bool use_saved)
+{
+  struct cookie_index *index = NULL;
+  struct stat st;
+  char *index_path;
+
+  if (fstat (fileno (fp), &st) != 0)
+    return NULL;
+
+  index_path = aprintf ("%s.idx", file);
+  if (use_saved)
+    index = cookie_map_index (index_path, &st);
+  if (index == NULL)
+    {
+      index = cookie_build_index (fp);
+      cookie_save_index (index_path, &st, index);
+    }
+  xfree (index_path);
+  return index;
+}
+
+/* Parse the cookies of DOMAIN from the index of JAR and store them,
+   unless that has been done already.  */
+
+static void
+cookie_jar_load_domain (struct cookie_jar *jar, const char *domain)
+{
+  const struct cookie_index *index = jar->index;
+  size_t lo = 0, hi, i;
+
+  if (!index || hash_table_contains (jar->loaded_domains, domain))
+    return;
+  hash_table_put (jar->loaded_domains, xstrdup (domain), NULL);
+
+  /* Find the first entry of the domain...  */
+  hi = index->count;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      const char *mid_domain;
+
+      if (!cookie_index_line (index, mid, &mid_domain))
+        return;
+      if (c_strcasecmp (mid_domain, domain) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  /* ...and parse all of them.  */
+  for (i = lo; i < index->count; i++)
+    {
+      const char *line_domain;
+      const char *line = cookie_index_line (index, i, &line_domain);
+      char *copy;
+
+      if (!line || c_strcasecmp (line_domain, domain) != 0)
+        break;
+      copy = xstrdup (line);
+      MEMACCT_ENTER (memacct_saved, MEMACCT_COOKIES);
+      cookie_jar_load_line (jar, copy);
+      MEMACCT_LEAVE (memacct_saved);
+      xfree (copy);
+    }
+}
+
+/* Load cookies from FILE.  With --cookies-index, the cookies are only
+   indexed, and the cookies of each domain are parsed when they are
+   first needed.  */
 
 void
 cookie_jar_load (struct cookie_jar *jar, const char *file)
@@ -1263,99 +1938,24 @@ cookie_jar_load (struct cookie_jar *jar, const char *file)
 
   cookies_now = time (NULL);
 
-  while (getline (&line, &bufsize, fp) > 0)
+  if (opt.cookies_index && !jar->index)
     {
-      struct cookie *cookie;
-      char *p = line;
-
-      double expiry;
-      int port;
-
-      char *domain_b  = NULL, *domain_e  = NULL;
-      char *domflag_b = NULL, *domflag_e = NULL;
-      char *path_b    = NULL, *path_e    = NULL;
-      char *secure_b  = NULL, *secure_e  = NULL;
-      char *expires_b = NULL, *expires_e = NULL;
-      char *name_b    = NULL, *name_e    = NULL;
-      char *value_b   = NULL, *value_e   = NULL;
-
-      /* Skip leading white-space. */
-      while (*p && c_isspace (*p))
-        ++p;
-      /* Ignore empty lines.  */
-      if (!*p || *p == '#')
-        continue;
-
-      GET_WORD (p, domain_b,  domain_e);
-      GET_WORD (p, domflag_b, domflag_e);
-      GET_WORD (p, path_b,    path_e);
-      GET_WORD (p, secure_b,  secure_e);
-      GET_WORD (p, expires_b, expires_e);
-      GET_WORD (p, name_b,    name_e);
-
-      /* Don't use GET_WORD for value because it ends with newline,
-         not TAB.  */
-      value_b = p;
-      value_e = p + strlen (p);
-      if (value_e > value_b && value_e[-1] == '\n')
-        --value_e;
-      if (value_e > value_b && value_e[-1] == '\r')
-        --value_e;
-      /* Empty values are legal (I think), so don't bother checking. */
-
-      cookie = cookie_new ();
-
-      cookie->attr    = strdupdelim (name_b, name_e);
-      cookie->value   = strdupdelim (value_b, value_e);
-      cookie->path    = strdupdelim (path_b, path_e);
-      cookie->secure  = BOUNDED_EQUAL (secure_b, secure_e, "TRUE");
-
-      /* Curl source says, quoting Andre Garcia: "flag: A TRUE/FALSE
-         value indicating if all machines within a given domain can
-         access the variable.  This value is set automatically by the
-         browser, depending on the value set for the domain."  */
-      cookie->domain_exact = !BOUNDED_EQUAL (domflag_b, domflag_e, "TRUE");
-
-      /* DOMAIN needs special treatment because we might need to
-         extract the port.  */
-      port = domain_port (domain_b, domain_e, (const char **)&domain_e);
-      if (port)
-        cookie->port = port;
-
-      if (*domain_b == '.')
-        ++domain_b;             /* remove leading dot internally */
-      cookie->domain  = strdupdelim (domain_b, domain_e);
-
-      /* safe default in case EXPIRES field is garbled. */
-      expiry = (double)cookies_now - 1;
-
-      /* I don't like changing the line, but it's safe here.  (line is
-         malloced.)  */
-      *expires_e = '\0';
-      sscanf (expires_b, "%lf", &expiry);
-
-      if (expiry == 0)
+      jar->index = cookie_load_index (file, fp, true);
+      if (jar->index)
         {
-          /* EXPIRY can be 0 for session cookies saved because the
-             user specified `--keep-session-cookies' in the past.
-             They remain session cookies, and will be saved only if
-             the user has specified `keep-session-cookies' again.  */
+          jar->index_file = xstrdup (file);
+          jar->changed = false;
+          fclose (fp);
+          return;
         }
-      else
-        {
-          if (expiry < cookies_now)
-            goto abort_cookie;  /* ignore stale cookie. */
-          cookie->expiry_time = (time_t) expiry;
-          cookie->permanent = 1;
-        }
-
-      store_cookie (jar, cookie);
-
-    next:
-      continue;
+      rewind (fp);
+    }
 
-    abort_cookie:
-      delete_cookie (cookie);
+  while (getline (&line, &bufsize, fp) > 0)
+    {
+      MEMACCT_ENTER (memacct_saved, MEMACCT_COOKIES);
+      cookie_jar_load_line (jar, line);
+      MEMACCT_LEAVE (memacct_saved);
     }
 
   xfree(line);
@@ -1369,6 +1969,15 @@ cookie_jar_save (struct cookie_jar *jar, const char *file)
 {
   FILE *fp;
   hash_table_iterator iter;
+  size_t i;
+
+  /* Nothing to do if the cookies would be written over the same ones
+     they were loaded from.  */
+  if (jar->index && !jar->changed && !strcmp (file, jar->index_file))
+    {
+      DEBUGP (("Cookies in %s unchanged.\n", file));
+      return;
+    }
 
   DEBUGP (("Saving cookies to %s.\n", file));
 
@@ -1412,6 +2021,23 @@ cookie_jar_save (struct cookie_jar *jar, const char *file)
             goto out;
         }
     }
+
+  /* The cookies of the domains that were never needed are written as
+     they were read.  */
+  if (jar->index)
+    for (i = 0; i < jar->index->count; i++)
+      {
+        const char *domain;
+        const char *line = cookie_index_line (jar->index, i, &domain);
+
+        if (!line || hash_table_contains (jar->loaded_domains, domain)
+            || !cookie_line_saved_p (line))
+          continue;
+        fputs (line, fp);
+        fputc ('\n', fp);
+        if (ferror (fp))
+          goto out;
+      }
  out:
   if (ferror (fp))
     logprintf (LOG_NOTQUIET, _("Error writing to %s: %s\n"),
@@ -1420,6 +2046,15 @@ cookie_jar_save (struct cookie_jar *jar, const char *file)
     logprintf (LOG_NOTQUIET, _("Error closing %s: %s\n"),
                quote (file), strerror (errno));
 
+  /* Index the new file for the next run.  */
+  if (opt.cookies_index && (fp = fopen (file, "r")) != NULL)
+    {
+      struct cookie_index *index = cookie_load_index (file, fp, false);
+      if (index)
+        cookie_index_free (index);
+      fclose (fp);
+    }
+
   DEBUGP (("Done saving cookies.\n"));
 }
 
@@ -1443,6 +2078,22 @@ cookie_jar_delete (struct cookie_jar *jar)
         }
     }
   hash_table_destroy (jar->chains);
+
+  for (hash_table_iterate (jar->header_cache, &iter);
+       hash_table_iter_next (&iter); )
+    {
+      xfree (iter.key);
+      delete_cookie_headers (iter.value);
+    }
+  hash_table_destroy (jar->header_cache);
+
+  for (hash_table_iterate (jar->loaded_domains, &iter);
+       hash_table_iter_next (&iter); )
+    xfree (iter.key);
+  hash_table_destroy (jar->loaded_domains);
+  if (jar->index)
+    cookie_index_free (jar->index);
+  xfree (jar->index_file);
   xfree (jar);
 
 #ifdef HAVE_LIBPSL
@@ -1537,3 +2188,117 @@ test_cookies (void)
     }
 }
 #endif /* TEST_COOKIES */
+
+#ifdef TESTING
+
+const char *
+test_cookie_header (void)
+{
+  struct cookie_jar *jar = cookie_jar_new ();
+  char *header;
+  bool ok;
+
+  cookie_handle_set_cookie (jar, "www.example.com", 80, "a/index.html",
+                            "s=1; path=/");
+  cookie_handle_set_cookie (jar, "www.example.com", 80, "a/index.html",
+                            "a=2");
+  cookie_handle_set_cookie (jar, "www.example.com", 80, "a/index.html",
+                            "t=3; path=/; secure");
+
+  header = cookie_header (jar, "www.example.com", 80, "a/b", false);
+  ok = header && !strcmp (header, "a=2; s=1");
+  xfree (header);
+  mu_assert ("test_cookie_header: wrong header for a/b", ok);
+
+  /* The cached header of the prefix must not be used for others.  */
+  header = cookie_header (jar, "www.example.com", 80, "index.html", false);
+  ok = header && !strcmp (header, "s=1");
+  xfree (header);
+  mu_assert ("test_cookie_header: wrong header for index.html", ok);
+
+  header = cookie_header (jar, "www.example.com", 80, "index.html", true);
+  ok = header && (!strcmp (header, "s=1; t=3") || !strcmp (header, "t=3; s=1"));
+  xfree (header);
+  mu_assert ("test_cookie_header: wrong secure header", ok);
+
+  header = cookie_header (jar, "www.example.org", 80, "index.html", false);
+  mu_assert ("test_cookie_header: header for another host", !header);
+
+  /* Replacing and discarding cookies must invalidate the cache.  */
+  cookie_handle_set_cookie (jar, "www.example.com", 80, "index.html",
+                            "s=4; path=/");
+  header = cookie_header (jar, "www.example.com", 80, "a/b", false);
+  ok = header && !strcmp (header, "a=2; s=4");
+  xfree (header);
+  mu_assert ("test_cookie_header: stale header after replacement", ok);
+
+  cookie_handle_set_cookie (jar, "www.example.com", 80, "a/index.html",
+                            "a=2; max-age=0");
+  header = cookie_header (jar, "www.example.com", 80, "a/b", false);
+  ok = header && !strcmp (header, "s=4");
+  xfree (header);
+  mu_assert ("test_cookie_header: stale header after discard", ok);
+
+  cookie_jar_delete (jar);
+  return NULL;
+}
+
+const char *
+test_cookie_jar_index (void)
+{
+  static const char file[] = "test-cookie-jar.txt";
+  struct cookie_jar *jar;
+  char *index_file;
+  char *header;
+  bool ok;
+  FILE *fp;
+
+  fp = fopen (file, "w");
+  mu_assert ("test_cookie_jar_index: cannot create the cookies file", fp);
+  fputs ("# HTTP Cookie File\n", fp);
+  fputs (".example.com\tTRUE\t/\tFALSE\t0\ts\t1\n", fp);
+  fputs ("www.example.org\tFALSE\t/\tFALSE\t2147483647\to\t2\n", fp);
+  fputs (".example.com\tTRUE\t/\tFALSE\t0\ts\t3\n", fp);
+  fclose (fp);
+
+  opt.cookies_index = true;
+  jar = cookie_jar_new ();
+  cookie_jar_load (jar, file);
+  mu_assert ("test_cookie_jar_index: cookies parsed at load",
+             hash_table_count (jar->chains) == 0);
+
+  /* Later lines of a domain replace earlier ones.  */
+  header = cookie_header (jar, "www.example.com", 80, "index.html", false);
+  ok = header && !strcmp (header, "s=3");
+  xfree (header);
+  mu_assert ("test_cookie_jar_index: wrong header for example.com", ok);
+  mu_assert ("test_cookie_jar_index: other domains parsed",
+             hash_table_count (jar->chains) == 1);
+
+  /* The unparsed lines are saved as they are.  */
+  cookie_handle_set_cookie (jar, "www.example.com", 80, "index.html",
+                            "n=4; path=/; max-age=3600");
+  cookie_jar_save (jar, file);
+  cookie_jar_delete (jar);
+
+  jar = cookie_jar_new ();
+  cookie_jar_load (jar, file);
+  header = cookie_header (jar, "www.example.org", 80, "index.html", false);
+  ok = header && !strcmp (header, "o=2");
+  xfree (header);
+  mu_assert ("test_cookie_jar_index: wrong header for example.org", ok);
+  header = cookie_header (jar, "www.example.com", 80, "index.html", false);
+  ok = header && !strcmp (header, "n=4");
+  xfree (header);
+  mu_assert ("test_cookie_jar_index: wrong header after saving", ok);
+  cookie_jar_delete (jar);
+
+  opt.cookies_index = false;
+  index_file = aprintf ("%s.idx", file);
+  unlink (index_file);
+  xfree (index_file);
+  unlink (file);
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -29,13 +29,12 @@ shall include the source code for the parts of OpenSSL used as well
 as that of the covered work.  */
 
 /*
-  Note that this is not an actual CSS parser, but just a lexical
-  scanner with a tiny bit more smarts bolted on top.  A full parser
-  is somewhat overkill for this job.  The only things we're interested
-  in are @import rules and url() tokens, so it's easy enough to
-  grab those without truly understanding the input.  The only downside
-  to this is that we might be coerced into downloading files that
-  a browser would ignore.  That might merit some more investigation.
+  Note that this is not an actual CSS parser, but just a scanner that
+  knows enough of the CSS syntax to find @import rules and url()
+  tokens.  A full parser is somewhat overkill for this job.  The only
+  downside to this is that we might be coerced into downloading files
+  that a browser would ignore.  That might merit some more
+  investigation.
  */
 
 #include "wget.h"
@@ -50,18 +49,13 @@ as that of the covered work.  */
 #include "url.h"
 #include "convert.h"
 #include "html-url.h"
-#include "css-tokens.h"
 #include "css-url.h"
+#include "c-strcase.h"
 #include "xstrndup.h"
 
-/* from lex.yy.c */
-extern char *yytext;
-extern int yyleng;
-typedef struct yy_buffer_state *YY_BUFFER_STATE;
-extern YY_BUFFER_STATE yy_scan_bytes (const char *bytes,int len  );
-extern void yy_delete_buffer (YY_BUFFER_STATE  b);
-extern int yylex (void);
-extern void yylex_destroy(void);
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
 
 /*
   Given a detected URI token, get only the URI specified within.
@@ -111,108 +105,406 @@ get_url_string (const char *at, int *pos, int *length)
   return xstrndup (at + *pos, *length);
 }
 
-void
-get_urls_css (struct map_context *ctx, int offset, int buf_length)
+/* The scanner.  Tokenizing the whole document, as a lexer would, is
+   not needed to find the URLs: it only has to skip what a url() or
+   @import can be hidden in.  That is comments and strings, and the
+   names and numbers a "url(" may be the end of, as in "xurl(" or
+   "#url(".  The characters in between are jumped over, stopping only
+   at those that may start something of interest; names are noticed
+   by looking at the character before a "u".  The token syntax is that
+   of the CSS 2.1 grammar.  */
+
+#define CSS_SPACE_P(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' \
+                        || (c) == '\n' || (c) == '\f')
+#define CSS_NEWLINE_P(c) ((c) == '\r' || (c) == '\n' || (c) == '\f')
+
+/* The characters the scanner stops at.  */
+static const bool css_stop[256] = {
+  ['u'] = true, ['U'] = true, ['@'] = true, ['/'] = true, ['"'] = true,
+  ['\''] = true, ['\\'] = true, ['<'] = true, ['!'] = true,
+};
+
+/* Whether C may be part of a name.  */
+static inline bool
+css_name_char_p (unsigned char c)
 {
-  int token;
-  /*char tmp[2048];*/
-  int buffer_pos = 0;
-  int pos, length;
-  char *uri;
-  YY_BUFFER_STATE b;
+  return c_isalnum (c) || c == '_' || c == '-' || c >= 0240;
+}
 
-  /* tell flex to scan from this buffer */
-  b = yy_scan_bytes (ctx->text + offset, buf_length);
+/* Whether the text at P, before END, starts with the lowercase WORD,
+   in any case.  */
+static inline bool
+css_word_p (const char *p, const char *end, const char *word, int len)
+{
+  return end - p >= len && 0 == c_strncasecmp (p, word, len);
+}
 
-  while((token = yylex()) != CSSEOF)
+static const char *
+css_skip_space (const char *p, const char *end)
+{
+  while (p < end && CSS_SPACE_P (*p))
+    p++;
+  return p;
+}
+
+/* Skip the escape that starts with the backslash at P.  Return NULL if
+   it isn't one.  */
+static const char *
+css_skip_escape (const char *p, const char *end)
+{
+  int i;
+
+  if (++p == end || CSS_NEWLINE_P (*p))
+    return NULL;
+  if (!c_isxdigit (*p))
+    return p + 1;
+  for (i = 0; i < 6 && p < end && c_isxdigit (*p); i++)
+    p++;
+  /* One white space character ends a hex escape, and belongs to it.  */
+  if (end - p >= 2 && p[0] == '\r' && p[1] == '\n')
+    p += 2;
+  else if (p < end && CSS_SPACE_P (*p))
+    p++;
+  return p;
+}
+
+/* Skip the rest of a name, from P.  */
+static const char *
+css_skip_name (const char *p, const char *end)
+{
+  while (p < end)
+    if (css_name_char_p (*p))
+      p++;
+    else if (*p == '\\' && css_skip_escape (p, end))
+      p = css_skip_escape (p, end);
+    else
+      break;
+  return p;
+}
+
+/* Skip the string that starts with the quote at P.  *CLOSED tells
+   whether it ends with the quote, rather than with a newline or the
+   end of the text.  */
+static const char *
+css_skip_string (const char *p, const char *end, bool *closed)
+{
+  char quote = *p++;
+
+  *closed = false;
+  while (p < end)
     {
-      /*DEBUGP (("%s ", token_names[token]));*/
-      /* @import "foo.css"
-         or @import url(foo.css)
-      */
-      if(token == IMPORT_SYM)
+      if (*p == quote)
         {
-          do {
-            buffer_pos += yyleng;
-          } while((token = yylex()) == S);
+          *closed = true;
+          return p + 1;
+        }
+      if (CSS_NEWLINE_P (*p))
+        break;
+      if (*p != '\\')
+        p++;
+      else if (p + 1 == end)
+        p++;
+      else if (p[1] == '\r' && p + 2 < end && p[2] == '\n')
+        p += 3;
+      else if (CSS_NEWLINE_P (p[1]))
+        p += 2;
+      else
+        p = css_skip_escape (p, end);
+    }
+  return p;
+}
 
-          /*DEBUGP (("%s ", token_names[token]));*/
+/* Skip the comment that starts at P.  A comment that isn't closed
+   runs to the end of the text.  */
+static const char *
+css_skip_comment (const char *p, const char *end)
+{
+  for (p += 2; p < end; p++)
+    {
+      p = memchr (p, '*', end - p);
+      if (!p)
+        break;
+      if (p + 1 < end && p[1] == '/')
+        return p + 2;
+    }
+  return end;
+}
+
+/* Add the URL of the url() or @import at [BEG, END) of CTX->text,
+   found in the string or url() token at [POS, POS + LENGTH).  */
+static void
+css_add_url (struct map_context *ctx, const char *beg, const char *end,
+             int pos, int length, bool import)
+{
+  char *uri;
+  struct urlpos *up;
 
-          if (token == STRING || token == URI)
+  if (ctx->text[pos] == '"' || ctx->text[pos] == '\'')
+    {
+      /* cut out quote characters */
+      pos++;
+      length -= 2;
+      uri = xstrndup (ctx->text + pos, length);
+    }
+  else
+    uri = get_url_string (ctx->text, &pos, &length);
+  if (!uri)
+    return;
+
+  up = append_url (uri, pos, length, ctx);
+  DEBUGP (("Found %s: [%.*s] at %d [%s]\n", import ? "@import" : "URI",
+           (int) (end - beg), beg, (int) (beg - ctx->text), uri));
+  if (up)
+    {
+      up->link_inline_p = 1;
+      up->link_css_p = 1;
+      if (import)
+        up->link_expect_css = 1;
+    }
+  xfree (uri);
+}
+
+/* Whether C may be in a url() without quotes.  A backslash may too,
+   but that is left to the caller.  */
+static inline bool
+css_url_char_p (unsigned char c)
+{
+  return c == '!' || (c >= '#' && c <= '&') || (c >= '*' && c <= '~'
+                                                && c != '\\')
+    || c >= 0240;
+}
+
+/* Find the end of the contents of a url() without quotes, which start
+   at P.  A backslash there may start an escape or stand for itself,
+   and a hex escape may be shorter than its digits, so the contents
+   aren't decided a character at a time.  The positions they may reach
+   are followed instead, bit I of REACH standing for P + I, and the
+   longest token wins, as with a lexer.  Return the closing parenthesis
+   of the longest valid url(), or NULL.  Set *BAD_END to where the
+   longest invalid one ends, in which a backslash can't stand for
+   itself.  */
+static const char *
+css_url_contents (const char *p, const char *end, const char **bad_end)
+{
+  unsigned int reach = 1, bad = 1;
+  const char *close = NULL, *bad_last = p;
+
+  for (; reach | bad; p++, reach >>= 1, bad >>= 1)
+    {
+      unsigned int next = 0, escape = 0;
+      const char *q;
+
+      if (reach & 1)
+        {
+          q = css_skip_space (p, end);
+          if (q < end && *q == ')')
+            close = q;
+        }
+      if (bad & 1)
+        bad_last = p;
+      if (p == end)
+        break;
+
+      if (css_url_char_p (*p))
+        next = 2;
+      else if (*p == '\\' && p + 1 < end && !CSS_NEWLINE_P (p[1]))
+        {
+          int i;
+
+          escape = 4;
+          for (i = 1; i < 7 && p + i < end && c_isxdigit (p[i]); i++)
+            escape |= 1 << (i + 1);
+          q = p + i;
+          if (i > 1 && q < end && !c_isxdigit (*q))
             {
-              /*DEBUGP (("Got URI "));*/
-              pos = buffer_pos + offset;
-              length = yyleng;
-
-              if (token == URI)
-                {
-                  uri = get_url_string (ctx->text, &pos, &length);
-                }
-              else if (length >= 2)
-                {
-                  /* cut out quote characters */
-                  pos++;
-                  length -= 2;
-                  uri = xmalloc (length + 1);
-                  memcpy (uri, yytext + 1, length);
-                  uri[length] = '\0';
-                }
-              else
-                uri = NULL;
-
-              if (uri)
-                {
-                  struct urlpos *up = append_url (uri, pos, length, ctx);
-                  DEBUGP (("Found @import: [%s] at %d [%s]\n", yytext, buffer_pos, uri));
-
-                  if (up)
-                    {
-                      up->link_inline_p = 1;
-                      up->link_css_p = 1;
-                      up->link_expect_css = 1;
-                    }
-
-                  xfree(uri);
-                }
+              if (end - q >= 2 && q[0] == '\r' && q[1] == '\n')
+                escape |= 1 << (i + 2);
+              else if (CSS_SPACE_P (*q))
+                escape |= 1 << (i + 1);
             }
         }
-      /* background-image: url(foo.png)
-         note that we don't care what
-         property this is actually on.
-      */
-      else if(token == URI)
-        {
-          pos = buffer_pos + offset;
-          length = yyleng;
-          uri = get_url_string (ctx->text, &pos, &length);
+      if (reach & 1)
+        reach |= next | escape | (*p == '\\' ? 2 : 0);
+      if (bad & 1)
+        bad |= next | escape;
+    }
+
+  *bad_end = css_skip_space (bad_last, end);
+  return close;
+}
+
+/* Scan the "url(" at P: if it starts a url() token, add its URL,
+   that of an @import at IMPORT if that is not NULL.  Return where the
+   token ends, or where the invalid url() that starts at P does.  */
+static const char *
+css_scan_uri (struct map_context *ctx, const char *p, const char *end,
+              const char *import)
+{
+  const char *q = css_skip_space (p + 4, end), *r;
+
+  if (q < end && (*q == '"' || *q == '\''))
+    {
+      bool closed;
+
+      r = css_skip_string (q, end, &closed);
+      if (!closed)
+        return r;
+      r = css_skip_space (r, end);
+      if (r == end || *r != ')')
+        return r;
+    }
+  else
+    {
+      const char *bad_end;
 
-          if (uri)
+      r = css_url_contents (q, end, &bad_end);
+      if (!r || bad_end > r + 1)
+        return bad_end;
+    }
+
+  css_add_url (ctx, import ? import : p, r + 1, p - ctx->text, r + 1 - p,
+               import != NULL);
+  return r + 1;
+}
+
+/* Scan what follows the @import at P: if it is a string or a url(),
+   add its URL.  Return where it ends, or where the scan should go
+   on.  */
+static const char *
+css_scan_import (struct map_context *ctx, const char *p, const char *end)
+{
+  const char *q = css_skip_space (p + 7, end), *r;
+  bool closed;
+
+  if (q < end && (*q == '"' || *q == '\''))
+    {
+      r = css_skip_string (q, end, &closed);
+      if (closed)
+        css_add_url (ctx, p, r, q - ctx->text, r - q, true);
+      return r;
+    }
+  if (css_word_p (q, end, "url(", 4))
+    return css_scan_uri (ctx, q, end, p);
+  /* Anything else is skipped, even another @import.  */
+  if (css_word_p (q, end, "@import", 7))
+    return q + 7;
+  return q;
+}
+
+void
+get_urls_css (struct map_context *ctx, int offset, int buf_length)
+{
+  const char *start = ctx->text + offset;
+  const char *end = start + buf_length;
+  const char *p = start;
+  /* Where the last token that may end with a name character ended.  */
+  const char *fresh = start;
+
+  while (p < end)
+    {
+      while (p < end && !css_stop[(unsigned char) *p])
+        p++;
+      if (p == end)
+        break;
+
+      switch (*p)
+        {
+        case '/':
+          if (p + 1 < end && p[1] == '*')
+            p = css_skip_comment (p, end);
+          else
+            p++;
+          break;
+        case '"':
+        case '\'':
+          {
+            bool closed;
+            p = css_skip_string (p, end, &closed);
+          }
+          break;
+        case '\\':
+          if (css_skip_escape (p, end))
+            p = css_skip_name (css_skip_escape (p, end), end);
+          else
+            p++;
+          break;
+        case '<':
+          p += css_word_p (p, end, "<!--", 4) ? 4 : 1;
+          fresh = p;
+          break;
+        case '!':
+          {
+            const char *q = p + 1;
+
+            /* !important, with spaces or comments in between.  */
+            for (;;)
+              if (q < end && CSS_SPACE_P (*q))
+                q++;
+              else if (css_word_p (q, end, "/*", 2)
+                       && css_skip_comment (q, end) < end)
+                q = css_skip_comment (q, end);
+              else
+                break;
+            p = css_word_p (q, end, "important", 9) ? q + 9 : p + 1;
+            fresh = p;
+          }
+          break;
+        case '@':
+          if (css_word_p (p, end, "@import", 7))
+            p = css_scan_import (ctx, p, end);
+          else if (css_word_p (p, end, "@page", 5))
+            p += 5;
+          else if (css_word_p (p, end, "@media", 6))
+            p += 6;
+          else if (css_word_p (p, end, "@charset ", 9))
+            p += 9;
+          else
+            p++;
+          fresh = p;
+          break;
+        default:                /* 'u' or 'U' */
+          if (p > start && p != fresh
+              && (css_name_char_p (p[-1]) || p[-1] == '#'))
+            p = css_skip_name (p, end);
+          else if (css_word_p (p, end, "url(", 4))
             {
-              struct urlpos *up = append_url (uri, pos, length, ctx);
-              DEBUGP (("Found URI: [%s] at %d [%s]\n", yytext, buffer_pos, uri));
-              if (up)
-                {
-                  up->link_inline_p = 1;
-                  up->link_css_p = 1;
-                }
-
-              xfree (uri);
+              p = css_scan_uri (ctx, p, end, NULL);
+              fresh = p;
             }
+          else
+            p = css_skip_name (p, end);
+          break;
         }
-      buffer_pos += yyleng;
     }
+}
+
+/* Like get_urls_css_file, with the contents of FILE already in FM.  */
+
+struct urlpos *
+get_urls_css_fm (const char *file, const struct file_memory *fm,
+                 struct url *url)
+{
+  struct map_context ctx;
 
-  yy_delete_buffer(b);
-  yylex_destroy();
+  if (!set_map_context_by_url (&ctx, url))
+    return NULL;
 
-  DEBUGP (("\n"));
+  ctx.head = NULL;
+  ctx.base = NULL;
+  ctx.text = fm->content;
+  ctx.document_file = file;
+  ctx.nofollow = false;
+  ctx.meta_charset = NULL;
+
+  get_urls_css (&ctx, 0, fm->length);
+  return ctx.head;
 }
 
 struct urlpos *
 get_urls_css_file (const char *file, struct url *url)
 {
   struct file_memory *fm;
-  struct map_context ctx;
+  struct urlpos *urls;
 
   /* Load the file. */
   fm = wget_read_file (file);
@@ -223,16 +515,71 @@ get_urls_css_file (const char *file, struct url *url)
     }
   DEBUGP (("Loaded %s (size %s).\n", file, number_to_static_string (fm->length)));
 
-  if (!set_map_context_by_url (&ctx, url))
-  return NULL;
+  urls = get_urls_css_fm (file, fm, url);
+  wget_read_file_free (fm);
+  return urls;
+}
 
-  ctx.head = NULL;
-  ctx.base = NULL;
-  ctx.text = fm->content;
-  ctx.document_file = file;
-  ctx.nofollow = false;
+#ifdef TESTING
 
-  get_urls_css (&ctx, 0, fm->length);
-  wget_read_file_free (fm);
-  return ctx.head;
+const char *
+test_css_urls (void)
+{
+  /* The URLs found in each style sheet, those of an @import marked
+     with a '@'.  */
+  static const struct {
+    const char *css;
+    const char *expected;
+  } tests[] = {
+    { "a { background: url(a.png) }", "a.png " },
+    { "/* url(no.png) */ b { background: URL( 'b.png' ) }", "b.png " },
+    { "p:after { content: \"url(no.png)\" } i { x: url(\"c.png\") }",
+      "c.png " },
+    { "xurl(no.png) #url(no.png) 5url(no.png) -url(no.png) u\\72l(no.png)",
+      "" },
+    { "@import 'd.css'; @IMPORT url(e.css) screen;", "@d.css @e.css " },
+    { "a { content: 'unclosed\n} b { x: url(f.png) }", "f.png " },
+    { "@import @import url(g.png)", "g.png " },
+    { "@media print { a { b: url(h.png) } } <!-- url(i.png) -->",
+      "h.png i.png " },
+    { "a { b: url(j.png }", "" },
+  };
+  unsigned i;
+
+  for (i = 0; i < countof (tests); i++)
+    {
+      struct map_context ctx;
+      struct urlpos *up;
+      char got[128] = "";
+
+      ctx.text = (char *) tests[i].css;
+      ctx.text_enc = (char *) "UTF-8";
+      ctx.base = NULL;
+      ctx.parent_base = "http://example.com/";
+      ctx.parent_enc = "UTF-8";
+      ctx.document_file = NULL;
+      ctx.nofollow = false;
+      ctx.meta_charset = NULL;
+      ctx.head = NULL;
+
+      get_urls_css (&ctx, 0, strlen (tests[i].css));
+      for (up = ctx.head; up; up = up->next)
+        {
+          const char *name = up->url->url + strlen (ctx.parent_base);
+
+          mu_assert ("test_css_urls: wrong position",
+                     up->size == (int) strlen (name)
+                     && !memcmp (ctx.text + up->pos, name, up->size));
+          snprintf (got + strlen (got), sizeof got - strlen (got), "%s%s ",
+                    up->link_expect_css ? "@" : "", name);
+        }
+      free_urlpos (ctx.head);
+
+      mu_assert ("test_css_urls: wrong URLs",
+                 !strcmp (got, tests[i].expected));
+    }
+
+  return NULL;
 }
+
+#endif /* TESTING */
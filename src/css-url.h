@@ -32,8 +32,11 @@ as that of the covered work.  */
 #define CSS_URL_H
 
 struct url;
+struct file_memory;
 
 void get_urls_css (struct map_context *, int, int);
+struct urlpos *get_urls_css_fm (const char *, const struct file_memory *,
+                                struct url *);
 struct urlpos *get_urls_css_file (const char *, struct url *);
 
 #endif /* CSS_URL_H */
@@ -0,0 +1,196 @@
+/* Linking identical retrieved files together.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "dedup.h"
+#include "hash.h"
+#include "retr.h"
+#include "utils.h"
+#ifdef HAVE_WINHASHES
+# include "win-hashes.h"
+#else
+# include "sha256.h"
+#endif
+
+/* With --dedup-files, the SHA-256 of every file retrieved is computed
+   by fd_read_body as the body is written.  A file with the contents
+   of one retrieved before in the run is replaced by a hard link to
+   that one, so that a mirror where the same asset is reachable from
+   many URLs holds a single copy of it.
+
+   Since the linked files share their data, one that is retrieved again
+   must be replaced rather than written in place, which --dedup-files
+   has --unlink see to.  */
+
+/* The files retrieved so far, by the hex digest of their contents.  */
+static struct hash_table *dedup_files;
+
+struct dedup_digest
+{
+  struct sha256_ctx ctx;
+  struct body_digest digest;
+};
+
+static void
+dedup_digest_init (void *arg)
+{
+  struct dedup_digest *d = arg;
+  sha256_init_ctx (&d->ctx);
+}
+
+static void
+dedup_digest_update (const char *buf, size_t len, void *arg)
+{
+  struct dedup_digest *d = arg;
+  sha256_process_bytes (buf, len, &d->ctx);
+}
+
+/* Start digesting the file about to be retrieved.  Returns NULL if the
+   files are not to be linked.  */
+
+struct dedup_digest *
+dedup_begin (void)
+{
+  struct dedup_digest *d;
+
+  /* The body isn't all the file holds with these, or the file goes
+     away, or is appended to in place.  */
+  if (!opt.dedup_files || opt.output_document || opt.save_headers
+      || opt.spider || opt.delete_after || opt.always_rest)
+    return NULL;
+
+  d = xnew0 (struct dedup_digest);
+  d->digest.init = dedup_digest_init;
+  d->digest.update = dedup_digest_update;
+  d->digest.ctx = d;
+  body_digest_add (&d->digest);
+  return d;
+}
+
+/* Replace FILE with a hard link to EARLIER.  */
+
+static bool
+dedup_link (const char *earlier, const char *file)
+{
+  char *tmp = aprintf ("%s.%ld.lnk", file, (long) getpid ());
+  bool ok = link (earlier, tmp) == 0;
+
+  /* The file is only replaced once the link is known to be possible,
+     which it isn't across file systems.  */
+  if (ok && rename (tmp, file) != 0)
+    {
+      unlink (tmp);
+      ok = false;
+    }
+  if (!ok)
+    DEBUGP (("Cannot link %s to %s: %s\n", file, earlier, strerror (errno)));
+  xfree (tmp);
+  return ok;
+}
+
+/* Stop digesting, and if FILE, just retrieved, was digested whole,
+   link it to a file retrieved before with the same contents.  FILE is
+   NULL if the retrieval failed.  *D is freed and set to NULL.  */
+
+void
+dedup_end (struct dedup_digest **d, const char *file)
+{
+  char digest[SHA256_DIGEST_SIZE];
+  char hex[2 * SHA256_DIGEST_SIZE + 1];
+  char *key, *earlier;
+  struct stat st, earlier_st;
+  bool digested;
+
+  if (!*d)
+    return;
+  body_digest_remove (&(*d)->digest);
+  sha256_finish_ctx (&(*d)->ctx, digest);
+  digested = ((*d)->digest.valid && !(*d)->digest.unwritten
+              && (*d)->digest.length > 0);
+  if (file && digested)
+    digested = (stat (file, &st) == 0 && S_ISREG (st.st_mode)
+                && st.st_size == (*d)->digest.length);
+  xfree (*d);
+
+  /* Leave out the files recur.c deletes once it has parsed them.  */
+  if (!file || !digested || !acceptable (file))
+    return;
+
+  wg_hex_to_string (hex, digest, sizeof digest);
+  if (!dedup_files)
+    dedup_files = make_string_hash_table (0);
+  if (!hash_table_get_pair (dedup_files, hex, &key, &earlier))
+    {
+      hash_table_put (dedup_files, xstrdup (hex), xstrdup (file));
+      return;
+    }
+
+  /* The earlier file may have changed or gone since.  */
+  if (stat (earlier, &earlier_st) != 0 || earlier_st.st_size != st.st_size)
+    {
+      xfree (earlier);
+      hash_table_put (dedup_files, key, xstrdup (file));
+      return;
+    }
+  if (earlier_st.st_dev == st.st_dev && earlier_st.st_ino == st.st_ino)
+    return;
+
+  if (dedup_link (earlier, file))
+    logprintf (LOG_VERBOSE, _("%s has the same contents as %s; linked.\n"),
+               quote_n (0, file), quote_n (1, earlier));
+}
+
+#if defined DEBUG_MALLOC || defined TESTING
+void
+dedup_cleanup (void)
+{
+  hash_table_iterator iter;
+
+  if (!dedup_files)
+    return;
+  for (hash_table_iterate (dedup_files, &iter); hash_table_iter_next (&iter);)
+    {
+      xfree (iter.key);
+      xfree (iter.value);
+    }
+  hash_table_destroy (dedup_files);
+  dedup_files = NULL;
+}
+#endif
@@ -33,13 +33,16 @@ static int final_exit_status = WGET_EXIT_SUCCESS;
    returned to retrieve_url's caller, but since it's very difficult to
    determine which do and which don't, I grab virtually all of them to
    be safe. */
-static int
+int
 get_status_for_err (uerr_t err)
 {
   switch (err)
     {
     case RETROK:
       return WGET_EXIT_SUCCESS;
+    case RETRYLATER:
+      /* Not an outcome yet: the URL is retrieved again.  */
+      return WGET_EXIT_SUCCESS;
     case FOPENERR: case FOPEN_EXCL_ERR: case FWRITEERR: case WRITEFAILED:
     case UNLINKERR: case CLOSEFAILED: case FILEBADFILE:
       return WGET_EXIT_IO_FAIL;
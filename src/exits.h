@@ -40,6 +40,7 @@ enum
     WGET_EXIT_UNKNOWN
   };
 
+int get_status_for_err (uerr_t err);
 void inform_exit_status (uerr_t err);
 
 int get_exit_status (void);
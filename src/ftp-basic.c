@@ -89,7 +89,7 @@ ftp_response (int fd, char **ret_line)
 /* Returns the malloc-ed FTP request, ending with <CR><LF>, printing
    it if printing is required.  If VALUE is NULL, just use
    command<CR><LF>.  */
-static char *
+char *
 ftp_request (const char *command, const char *value)
 {
   char *res;
@@ -147,6 +147,95 @@ ftp_request (const char *command, const char *value)
   return res;
 }
 
+/* Requests sent ahead by ftp_pipeline, whose replies are yet to be
+   read, and the control connection they were sent over.  */
+#define MAX_PIPELINED 8
+static char *pipelined[MAX_PIPELINED];
+static int pipelined_count, pipelined_next;
+static int pipelined_sock = -1;
+
+static void
+pipeline_reset (void)
+{
+  for (; pipelined_next < pipelined_count; pipelined_next++)
+    xfree (pipelined[pipelined_next]);
+  pipelined_count = pipelined_next = 0;
+  pipelined_sock = -1;
+}
+
+/* Send the COUNT COMMANDS, complete command lines without the
+   terminating <CR><LF>, over CSOCK in a single write.  The functions
+   below that issue them find them already sent, and only read their
+   replies, which the server sends in order.  Only commands that don't
+   depend on each other's outcome may be sent this way.  */
+uerr_t
+ftp_pipeline (int csock, const char **commands, int count)
+{
+  char *requests;
+  int i, nwritten;
+  size_t len = 0;
+
+  assert (count <= MAX_PIPELINED);
+  pipeline_reset ();
+  for (i = 0; i < count; i++)
+    len += strlen (commands[i]) + 2;
+  requests = xmalloc (len + 1);
+  requests[0] = '\0';
+  for (i = 0; i < count; i++)
+    {
+      strcat (strcat (requests, commands[i]), "\r\n");
+      if (opt.server_response)
+        logprintf (LOG_ALWAYS, "--> %s\r\n\n", commands[i]);
+      else
+        DEBUGP (("\n--> %s\r\n\n", commands[i]));
+      pipelined[i] = xstrdup (commands[i]);
+    }
+  pipelined_count = count;
+  pipelined_sock = csock;
+
+  nwritten = fd_write (csock, requests, len, -1);
+  xfree (requests);
+  if (nwritten < 0)
+    {
+      pipeline_reset ();
+      return WRITEFAILED;
+    }
+  return FTPOK;
+}
+
+/* Send COMMAND with VALUE, as ftp_request forms it, over CSOCK, unless
+   ftp_pipeline already did so.  Returns the fd_write result.  */
+static int
+ftp_send (int csock, const char *command, const char *value)
+{
+  char *request;
+  int nwritten;
+
+  if (pipelined_sock == csock && pipelined_next < pipelined_count)
+    {
+      const char *sent = pipelined[pipelined_next];
+      size_t cmdlen = strlen (command);
+
+      if (!strncmp (sent, command, cmdlen)
+          && (value
+              ? sent[cmdlen] == ' ' && !strcmp (sent + cmdlen + 1, value)
+              : sent[cmdlen] == '\0'))
+        {
+          xfree (pipelined[pipelined_next]);
+          if (++pipelined_next == pipelined_count)
+            pipeline_reset ();
+          return 0;
+        }
+      /* Out of step, most likely a new connection: forget them.  */
+      pipeline_reset ();
+    }
+
+  request = ftp_request (command, value);
+  nwritten = fd_write (csock, request, strlen (request), -1);
+  xfree (request);
+  return nwritten;
+}
+
 uerr_t
 ftp_greeting (int csock)
 {
@@ -944,7 +1033,7 @@ ftp_epsv (int csock, ip_address *ip, int *port)
 uerr_t
 ftp_type (int csock, int type)
 {
-  char *request, *respline;
+  char *respline;
   int nwritten;
   uerr_t err;
   char stype[2];
@@ -953,14 +1042,9 @@ ftp_type (int csock, int type)
   stype[0] = type;
   stype[1] = 0;
   /* Send TYPE request.  */
-  request = ftp_request ("TYPE", stype);
-  nwritten = fd_write (csock, request, strlen (request), -1);
+  nwritten = ftp_send (csock, "TYPE", stype);
   if (nwritten < 0)
-    {
-      xfree (request);
-      return WRITEFAILED;
-    }
-  xfree (request);
+    return WRITEFAILED;
   /* Get appropriate response.  */
   err = ftp_response (csock, &respline);
   if (err != FTPOK)
@@ -1079,76 +1163,78 @@ ftp_retr (int csock, const char *file)
 }
 
 /* Sends the LIST command to the server.  If FILE is NULL, send just
-   `LIST' (no space).  */
+   `LIST' (no space).  Unless AVOID_MLSD is set, "MLSD" is tried
+   first, and *MLSD_USED tells whether the server accepted it.  */
 uerr_t
-ftp_list (int csock, const char *file, bool avoid_list_a, bool avoid_list,
-          bool *list_a_used)
+ftp_list (int csock, const char *file, bool avoid_mlsd, bool avoid_list_a,
+          bool avoid_list, bool *mlsd_used, bool *list_a_used)
 {
   char *request, *respline;
   int nwritten;
-  uerr_t err;
+  uerr_t err = FTPRERR;
   bool ok = false;
-  size_t i = 0;
+  size_t i;
 
   /* 2013-10-12 Andrea Urbani (matfanjol)
      For more information about LIST and "LIST -a" please look at ftp.c,
      function getftp, text "__LIST_A_EXPLANATION__".
 
      If somebody changes the following commands, please, checks also the
-     later "i" variable.  */
+     "avoid" array.  */
   static const char *list_commands[] = {
+    "MLSD",
     "LIST -a",
     "LIST"
   };
+  bool avoid[countof (list_commands)];
 
+  avoid[0] = avoid_mlsd;
+  avoid[1] = avoid_list_a;
+  avoid[2] = avoid_list;
+
+  *mlsd_used = false;
   *list_a_used = false;
 
-  if (avoid_list_a)
+  for (i = 0; i < countof (list_commands) && !ok; i++)
     {
-      i = countof (list_commands)- 1;
-      DEBUGP (("(skipping \"LIST -a\")"));
-    }
-
+      if (avoid[i])
+        {
+          DEBUGP (("(skipping \"%s\")", list_commands[i]));
+          continue;
+        }
 
-  do {
-    /* Send request.  */
-    request = ftp_request (list_commands[i], file);
-    nwritten = fd_write (csock, request, strlen (request), -1);
-    if (nwritten < 0)
-      {
-        xfree (request);
-        return WRITEFAILED;
-      }
-    xfree (request);
-    /* Get appropriate response.  */
-    err = ftp_response (csock, &respline);
-    if (err == FTPOK)
-      {
-        if (*respline == '5')
-          {
-            err = FTPNSFOD;
-          }
-        else if (*respline == '1')
-          {
-            err = FTPOK;
-            ok = true;
-            /* Which list command was used? */
-            *list_a_used = (i == 0);
-          }
-        else
-          {
-            err = FTPRERR;
-          }
-        xfree (respline);
-      }
-    ++i;
-    if ((avoid_list) && (i == 1))
-      {
-        /* I skip LIST */
-        ++i;
-        DEBUGP (("(skipping \"LIST\")"));
-      }
-  } while (i < countof (list_commands) && !ok);
+      /* Send request.  */
+      request = ftp_request (list_commands[i], file);
+      nwritten = fd_write (csock, request, strlen (request), -1);
+      if (nwritten < 0)
+        {
+          xfree (request);
+          return WRITEFAILED;
+        }
+      xfree (request);
+      /* Get appropriate response.  */
+      err = ftp_response (csock, &respline);
+      if (err == FTPOK)
+        {
+          if (*respline == '5')
+            {
+              err = FTPNSFOD;
+            }
+          else if (*respline == '1')
+            {
+              err = FTPOK;
+              ok = true;
+              /* Which list command was used? */
+              *mlsd_used = (i == 0);
+              *list_a_used = (i == 1);
+            }
+          else
+            {
+              err = FTPRERR;
+            }
+          xfree (respline);
+        }
+    }
 
   return err;
 }
@@ -1163,14 +1249,9 @@ ftp_syst (int csock, enum stype *server_type, enum ustype *unix_type)
   char *ftp_last_respline;
 
   /* Send SYST request.  */
-  request = ftp_request ("SYST", NULL);
-  nwritten = fd_write (csock, request, strlen (request), -1);
+  nwritten = ftp_send (csock, "SYST", NULL);
   if (nwritten < 0)
-    {
-      xfree (request);
-      return WRITEFAILED;
-    }
-  xfree (request);
+    return WRITEFAILED;
 
   /* Get appropriate response.  */
   err = ftp_response (csock, &respline);
@@ -1233,14 +1314,9 @@ ftp_pwd (int csock, char **pwd)
   uerr_t err;
 
   /* Send PWD request.  */
-  request = ftp_request ("PWD", NULL);
-  nwritten = fd_write (csock, request, strlen (request), -1);
+  nwritten = ftp_send (csock, "PWD", NULL);
   if (nwritten < 0)
-    {
-      xfree (request);
-      return WRITEFAILED;
-    }
-  xfree (request);
+    return WRITEFAILED;
   /* Get appropriate response.  */
   err = ftp_response (csock, &respline);
   if (err != FTPOK)
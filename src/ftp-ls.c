@@ -42,6 +42,7 @@ as that of the covered work.  */
 #include "convert.h"            /* for html_quote_string prototype */
 #include "retr.h"               /* for output_stream */
 #include "c-strcase.h"
+#include "xstrndup.h"
 
 /* Converts symbolic permissions to number-style ones, e.g. string
    rwxr-xr-x to 755.  For now, it knows nothing of
@@ -992,6 +993,151 @@ ftp_parse_vms_ls (FILE *fp)
 }
 
 
+/* Parses the value of the "modify" fact of an MLSD line, which is a
+   UTC time of the form YYYYMMDDHHMMSS, optionally followed by a
+   fraction of a second.  Returns -1 if the value is malformed.  */
+static time_t
+mlsd_time (const char *s, size_t len)
+{
+  struct tm t;
+  int year, month, day, hour, min, sec;
+  char buf[15];
+
+  if (len < 14)
+    return -1;
+  memcpy (buf, s, 14);
+  buf[14] = '\0';
+  if (sscanf (buf, "%4d%2d%2d%2d%2d%2d",
+              &year, &month, &day, &hour, &min, &sec) != 6)
+    return -1;
+
+  xzero (t);
+  t.tm_year = year - 1900;
+  t.tm_mon = month - 1;
+  t.tm_mday = day;
+  t.tm_hour = hour;
+  t.tm_min = min;
+  t.tm_sec = sec;
+  return timegm (&t);
+}
+
+/* Parses the machine-readable listing returned by MLSD (RFC 3659,
+   section 7) from the SIZE bytes at BUF.  Each line is a list of
+   "fact=value;" pairs followed by a space and the file name, which
+   runs to the end of the line.  Unlike "ls" output, the format is
+   the same on every server, so there is nothing to guess.  */
+struct fileinfo *
+ftp_parse_mlsd (const char *buf, size_t size)
+{
+  const char *end = buf + size;
+  struct fileinfo *dir, *l, cur;
+
+  dir = l = NULL;
+
+  while (buf < end)
+    {
+      const char *line = buf, *lend, *name, *fact;
+      bool skip = false, has_mode = false;
+
+      lend = memchr (buf, '\n', end - buf);
+      buf = lend ? lend + 1 : end;
+      if (!lend)
+        lend = end;
+      while (lend > line && (lend[-1] == '\r' || lend[-1] == '\n'))
+        --lend;
+
+      name = memchr (line, ' ', lend - line);
+      if (!name || name + 1 >= lend)
+        {
+          DEBUGP (("Skipping malformed MLSD line.\n"));
+          continue;
+        }
+
+      xzero (cur);
+      cur.type = FT_UNKNOWN;
+      cur.tstamp = -1;
+      cur.ptype = TT_HOUR_MIN;
+
+      for (fact = line; fact < name; )
+        {
+          const char *fend = memchr (fact, ';', name - fact);
+          const char *eq, *val;
+          size_t vlen;
+
+          if (!fend)
+            fend = name;
+          eq = memchr (fact, '=', fend - fact);
+          if (eq)
+            {
+              size_t flen = eq - fact;
+              val = eq + 1;
+              vlen = fend - val;
+
+#define FACT_IS(f) (flen == sizeof (f) - 1 && !c_strncasecmp (fact, f, flen))
+              if (FACT_IS ("type"))
+                {
+#define VALUE_IS(v) (vlen == sizeof (v) - 1 && !c_strncasecmp (val, v, vlen))
+                  if (VALUE_IS ("file"))
+                    cur.type = FT_PLAINFILE;
+                  else if (VALUE_IS ("dir"))
+                    cur.type = FT_DIRECTORY;
+                  else if (VALUE_IS ("cdir") || VALUE_IS ("pdir"))
+                    skip = true;
+                  else if (vlen > 14 && !c_strncasecmp (val, "OS.unix=slink:", 14))
+                    {
+                      cur.type = FT_SYMLINK;
+                      cur.linkto = xstrndup (val + 14, vlen - 14);
+                    }
+#undef VALUE_IS
+                }
+              else if (FACT_IS ("size"))
+                cur.size = str_to_wgint (val, NULL, 10);
+              else if (FACT_IS ("modify"))
+                cur.tstamp = mlsd_time (val, vlen);
+              else if (FACT_IS ("UNIX.mode"))
+                {
+                  cur.perms = strtol (val, NULL, 8);
+                  has_mode = true;
+                }
+#undef FACT_IS
+            }
+          fact = fend + 1;
+        }
+
+      if (skip || cur.type == FT_UNKNOWN)
+        {
+          DEBUGP (("Skipping MLSD entry %.*s.\n",
+                   (int) (lend - name - 1), name + 1));
+          xfree (cur.linkto);
+          continue;
+        }
+
+      cur.name = xstrndup (name + 1, lend - name - 1);
+      if (!has_mode)
+        cur.perms = cur.type == FT_DIRECTORY ? 0755 : 0644;
+      DEBUGP (("MLSD: %s, type %d, size %s, perms %0o.\n", cur.name,
+               cur.type, number_to_static_string (cur.size),
+               (unsigned) cur.perms));
+
+      if (!dir)
+        {
+          l = dir = xnew (struct fileinfo);
+          memcpy (l, &cur, sizeof (cur));
+          l->prev = l->next = NULL;
+        }
+      else
+        {
+          cur.prev = l;
+          l->next = xnew (struct fileinfo);
+          l = l->next;
+          memcpy (l, &cur, sizeof (cur));
+          l->next = NULL;
+        }
+    }
+
+  return dir;
+}
+
 /* This function switches between the correct parsing routine depending on
    the SYSTEM_TYPE. The system type should be based on the result of the
    "SYST" response of the FTP server. According to this response we will
@@ -1048,6 +1194,33 @@ Unsupported listing type, trying Unix listing parser.\n"));
     }
 }
 
+#ifdef HAVE_FMEMOPEN
+/* Like ftp_parse_ls, but parses the SIZE bytes of "ls" output at BUF
+   instead of a file.  */
+struct fileinfo *
+ftp_parse_ls_mem (const char *buf, size_t size, const enum stype system_type)
+{
+  FILE *fp;
+  struct fileinfo *fi;
+
+  /* Older C libraries refuse to open an empty buffer.  */
+  if (!size)
+    return NULL;
+
+  fp = fmemopen ((void *) buf, size, "rb");
+  if (!fp)
+    {
+      logprintf (LOG_NOTQUIET, "fmemopen: %s\n", strerror (errno));
+      return NULL;
+    }
+
+  fi = ftp_parse_ls_fp (fp, system_type);
+  fclose (fp);
+
+  return fi;
+}
+#endif /* HAVE_FMEMOPEN */
+
 /* Stuff for creating FTP index. */
 
 /* The function creates an HTML index containing references to given
@@ -51,6 +51,13 @@ as that of the covered work.  */
 #include "recur.h"              /* for INFINITE_RECURSION */
 #include "warc.h"
 #include "c-strcase.h"
+#include "xmemdup0.h"
+#include "xstrndup.h"
+#include "hash.h"
+#include "ptimer.h"
+#include "progress.h"
+#include "metrics.h"
+#include "throttle.h"
 #ifdef ENABLE_XATTR
 #include "xattr.h"
 #endif
@@ -78,8 +85,23 @@ typedef struct
   char *id;                     /* initial directory */
   char *target;                 /* target file name */
   struct url *proxy;            /* FTWK-style proxy */
+  char *listing;                /* directory listing kept in memory */
+  size_t listing_size;          /* its size */
+  bool listing_mlsd;            /* whether it came from MLSD */
+  char *cwd;                    /* u->dir of the last CWD done */
+  struct ftp_pool *pool;        /* additional control connections */
+  struct hash_table *listings;  /* listings fetched by the pool */
 } ccon;
 
+/* Directory listings are read from the data connection into memory
+   and parsed from there, unless the user wants LIST_FILENAME kept or
+   the C library cannot do it.  */
+#if defined HAVE_OPEN_MEMSTREAM && defined HAVE_FMEMOPEN
+# define LISTING_IN_MEMORY (opt.remove_listing)
+#else
+# define LISTING_IN_MEMORY false
+#endif
+
 
 /* Look for regexp "( *[0-9]+ *byte" (literal parenthesis) anywhere in
    the string S, and return the number converted to wgint, if found, 0
@@ -117,9 +139,10 @@ ftp_expected_bytes (const char *s)
 /*
  * This function sets up a passive data connection with the FTP server.
  * It is merely a wrapper around ftp_epsv, ftp_lpsv and ftp_pasv.
+ * A refused EPSV is remembered in the connection status ST.
  */
 static uerr_t
-ftp_do_pasv (int csock, ip_address *addr, int *port)
+ftp_do_pasv (int csock, int *st, ip_address *addr, int *port)
 {
   uerr_t err;
 
@@ -140,11 +163,17 @@ ftp_do_pasv (int csock, ip_address *addr, int *port)
       err = ftp_pasv (csock, addr, port);
       break;
     case AF_INET6:
-      if (!opt.server_response)
-        logputs (LOG_VERBOSE, "==> EPSV ... ");
-      err = ftp_epsv (csock, addr, port);
-
-      /* If EPSV is not supported try LPSV */
+      /* If EPSV is not supported try LPSV, and remember it for the next
+         data connections.  */
+      err = FTPNOPASV;
+      if (!(*st & AVOID_EPSV))
+        {
+          if (!opt.server_response)
+            logputs (LOG_VERBOSE, "==> EPSV ... ");
+          err = ftp_epsv (csock, addr, port);
+          if (err == FTPNOPASV)
+            *st |= AVOID_EPSV;
+        }
       if (err == FTPNOPASV)
         {
           if (!opt.server_response)
@@ -162,9 +191,10 @@ ftp_do_pasv (int csock, ip_address *addr, int *port)
 /*
  * This function sets up an active data connection with the FTP server.
  * It is merely a wrapper around ftp_eprt, ftp_lprt and ftp_port.
+ * A refused EPRT is remembered in the connection status ST.
  */
 static uerr_t
-ftp_do_port (int csock, int *local_sock)
+ftp_do_port (int csock, int *st, int *local_sock)
 {
   uerr_t err;
   ip_address cip;
@@ -183,11 +213,17 @@ ftp_do_port (int csock, int *local_sock)
       err = ftp_port (csock, local_sock);
       break;
     case AF_INET6:
-      if (!opt.server_response)
-        logputs (LOG_VERBOSE, "==> EPRT ... ");
-      err = ftp_eprt (csock, local_sock);
-
-      /* If EPRT is not supported try LPRT */
+      /* If EPRT is not supported try LPRT, and remember it for the next
+         data connections.  */
+      err = FTPPORTERR;
+      if (!(*st & AVOID_EPRT))
+        {
+          if (!opt.server_response)
+            logputs (LOG_VERBOSE, "==> EPRT ... ");
+          err = ftp_eprt (csock, local_sock);
+          if (err == FTPPORTERR)
+            *st |= AVOID_EPRT;
+        }
       if (err == FTPPORTERR)
         {
           if (!opt.server_response)
@@ -203,7 +239,7 @@ ftp_do_port (int csock, int *local_sock)
 #else
 
 static uerr_t
-ftp_do_pasv (int csock, ip_address *addr, int *port)
+ftp_do_pasv (int csock, int *st _GL_UNUSED, ip_address *addr, int *port)
 {
   if (!opt.server_response)
     logputs (LOG_VERBOSE, "==> PASV ... ");
@@ -211,7 +247,7 @@ ftp_do_pasv (int csock, ip_address *addr, int *port)
 }
 
 static uerr_t
-ftp_do_port (int csock, int *local_sock)
+ftp_do_port (int csock, int *st _GL_UNUSED, int *local_sock)
 {
   if (!opt.server_response)
     logputs (LOG_VERBOSE, "==> PORT ... ");
@@ -272,7 +308,9 @@ init_control_ssl_connection (int csock, struct url *u, bool *using_control_secur
     logputs (LOG_VERBOSE, "==> AUTH TLS ... ");
   if (opt.ftps_implicit || ftp_auth (csock, SCHEME_FTPS) == FTPOK)
     {
-      if (!ssl_connect_wget (csock, u->host, NULL))
+      double tls_start = metrics_now ();
+
+      if (!ssl_connect_wget (csock, u->host, NULL, NULL))
         {
           fd_close (csock);
           return CONSSLERR;
@@ -282,6 +320,7 @@ init_control_ssl_connection (int csock, struct url *u, bool *using_control_secur
           fd_close (csock);
           return VERIFCERTERR;
         }
+      metrics_phase (METRICS_TLS, tls_start);
 
       if (!opt.ftps_implicit && !opt.server_response)
         logputs (LOG_VERBOSE, " done.\n");
@@ -312,6 +351,486 @@ init_control_ssl_connection (int csock, struct url *u, bool *using_control_secur
 }
 #endif
 
+/* Find the user name and password to log in to U's server with.  */
+static void
+ftp_credentials (const struct url *u, const char **user, const char **passwd)
+{
+  /* Find the username with priority */
+  if (u->user)
+    *user = u->user;
+  else if (opt.user && (opt.use_askpass || opt.ask_passwd))
+    *user = opt.user;
+  else if (opt.ftp_user)
+    *user = opt.ftp_user;
+  else if (opt.user)
+    *user = opt.user;
+  else
+    *user = NULL;
+
+  /* Find the password with priority */
+  if (u->passwd)
+    *passwd = u->passwd;
+  else if (opt.passwd && (opt.use_askpass || opt.ask_passwd))
+    *passwd = opt.passwd;
+  else if (opt.ftp_passwd)
+    *passwd = opt.ftp_passwd;
+  else if (opt.passwd)
+    *passwd = opt.passwd;
+  else
+    *passwd = NULL;
+
+  /* Check for ~/.netrc if none of the above match */
+  if (opt.netrc && (!*user || !*passwd))
+    search_netrc (u->host, user, passwd, 1, NULL);
+
+  if (!*user) *user = "anonymous";
+  if (!*passwd) *passwd = "-wget@";
+}
+
+/* Segmented retrievals (--segments).
+
+   As for HTTP, a large file is split into byte ranges retrieved at
+   once.  Each range has its own control connection, which logs in,
+   changes to the file's directory and sends "REST offset" and "RETR",
+   and its own passive data connection, closed once the range is
+   complete.  The server answers the early close with a 426 reply,
+   which is read before the control connection is reused for another
+   range.  The first range uses the control and data connections getftp
+   has already set up.  */
+
+/* Never split off a range smaller than this. */
+#define FTP_SEGMENT_MIN_SIZE (1024 * 1024)
+
+/* Hard limit on the number of connections used for one file. */
+#define MAX_FTP_SEGMENTS 16
+
+static char *ftp_absolute_dir (const struct url *, const ccon *);
+
+struct ftp_segment {
+  int csock;                    /* control connection, or -1 */
+  int dsock;                    /* data connection, or -1 */
+  wgint start;                  /* offset where the range began */
+  wgint pos;                    /* offset of the next byte to arrive */
+  wgint end;                    /* offset one past the last byte we want */
+  int wait_for;                 /* what DSOCK must become ready for */
+};
+
+/* A segmented retrieval in progress.  */
+
+struct ftp_segmented {
+  const struct url *u;
+  ccon *con;
+  const char *file;             /* remote file name */
+  char *dir;                    /* and its absolute directory */
+  FILE *fp;
+  struct ftp_segment segs[MAX_FTP_SEGMENTS];
+  int count;                    /* number of segments in SEGS */
+  wgint rd_size;                /* bytes received */
+  void *progress;
+  struct ptimer *timer;
+  double last_read_tm;
+  int res;                      /* -1 for a read error, -2 for a write error */
+};
+
+/* Close SEG's data connection, and read the reply to its RETR.  The
+   control connection is closed if the reply doesn't come.  */
+
+static void
+fseg_stop (struct ftp_segment *seg)
+{
+  char *respline;
+
+  if (seg->dsock < 0)
+    return;
+  fd_close (seg->dsock);
+  seg->dsock = -1;
+  if (seg->csock < 0)
+    return;
+  if (ftp_response (seg->csock, &respline) == FTPOK)
+    xfree (respline);
+  else
+    {
+      fd_close (seg->csock);
+      seg->csock = -1;
+    }
+}
+
+/* Get SEG's range flowing, over SEG->csock if that control connection
+   is idle, or else over a new one logged in to the server.  */
+
+static bool
+fseg_start (struct ftp_segment *seg, struct ftp_segmented *sf)
+{
+  ip_address addr;
+  int port;
+  uerr_t err;
+
+  if (seg->csock < 0)
+    {
+      const char *user, *passwd;
+
+      seg->csock = connect_to_host (sf->u->host, sf->u->port);
+      if (seg->csock < 0)
+        {
+          seg->csock = -1;
+          return false;
+        }
+      ftp_credentials (sf->u, &user, &passwd);
+      if (ftp_greeting (seg->csock) != FTPOK
+          || ftp_login (seg->csock, user, passwd) != FTPOK
+          || ftp_type (seg->csock, 'I') != FTPOK
+          || ftp_cwd (seg->csock, sf->dir) != FTPOK)
+        goto fail;
+    }
+
+  /* Like ftp_do_pasv, without the progress messages.  */
+  if (!socket_ip_address (seg->csock, &addr, ENDPOINT_PEER))
+    goto fail;
+#ifdef ENABLE_IPV6
+  if (addr.family != AF_INET)
+    err = ftp_epsv (seg->csock, &addr, &port);
+  else
+#endif
+    err = ftp_pasv (seg->csock, &addr, &port);
+  if (err != FTPOK)
+    goto fail;
+  seg->dsock = connect_to_ip (&addr, port, NULL);
+  if (seg->dsock < 0)
+    {
+      seg->dsock = -1;
+      goto fail;
+    }
+  if (seg->pos > 0 && ftp_rest (seg->csock, seg->pos) != FTPOK)
+    goto fail;
+  if (ftp_retr (seg->csock, sf->file) != FTPOK)
+    goto fail;
+  seg->wait_for = WAIT_FOR_READ;
+  return true;
+
+ fail:
+  /* Whatever replies were pending have been read, or the connection
+     is of no use anyway.  */
+  if (seg->dsock >= 0)
+    fd_close (seg->dsock);
+  seg->dsock = -1;
+  fd_close (seg->csock);
+  seg->csock = -1;
+  return false;
+}
+
+/* Find the running segment with the most data left and move the upper
+   half of its range to SPARE.  Returns the index of the segment that
+   was split, or -1 if none was worth splitting.  */
+
+static int
+fseg_split (struct ftp_segment *segs, int count, struct ftp_segment *spare)
+{
+  int i, best = -1;
+  wgint mid;
+
+  for (i = 0; i < count; i++)
+    if (segs[i].dsock >= 0 && &segs[i] != spare
+        && segs[i].end - segs[i].pos >= 2 * FTP_SEGMENT_MIN_SIZE
+        && (best == -1
+            || segs[i].end - segs[i].pos > segs[best].end - segs[best].pos))
+      best = i;
+  if (best == -1)
+    return -1;
+
+  mid = segs[best].pos + (segs[best].end - segs[best].pos) / 2;
+  spare->start = spare->pos = mid;
+  spare->end = segs[best].end;
+  segs[best].end = mid;
+  return best;
+}
+
+/* Find new work for SEG, whose range has just been completed: resume
+   a segment whose connections were lost, or take over half of the
+   largest remaining one.  */
+
+static void
+fseg_reassign (struct ftp_segmented *sf, struct ftp_segment *seg)
+{
+  struct ftp_segment *segs = sf->segs;
+  int i, split;
+
+  fseg_stop (seg);
+  if (seg->csock < 0)
+    return;
+
+  for (i = 0; i < sf->count; i++)
+    if (segs[i].csock < 0 && segs[i].pos < segs[i].end)
+      {
+        segs[i].csock = seg->csock;
+        seg->csock = -1;
+        fseg_start (&segs[i], sf);
+        return;
+      }
+
+  split = fseg_split (segs, sf->count, seg);
+  if (split == -1)
+    return;
+  if (!fseg_start (seg, sf))
+    {
+      /* Give the range back. */
+      segs[split].end = seg->end;
+      seg->pos = seg->end;
+    }
+  else
+    DEBUGP (("Segment %d now fetches %s-%s.\n", (int) (seg - segs),
+             number_to_static_string (seg->pos),
+             number_to_static_string (seg->end)));
+}
+
+/* Show what every connection of SF is doing under its progress bar. */
+
+static void
+fseg_show_progress (struct ftp_segmented *sf)
+{
+  int i, waiting = 0;
+
+  for (i = 0; i < sf->count; i++)
+    {
+      struct ftp_segment *seg = &sf->segs[i];
+      if (seg->dsock >= 0 && seg->pos < seg->end)
+        progress_set_connection (sf->progress, i, NULL, seg->pos - seg->start,
+                                 seg->end - seg->start);
+      else
+        {
+          progress_set_connection (sf->progress, i, NULL, 0, -1);
+          if (seg->pos < seg->end)
+            waiting++;
+        }
+    }
+  progress_set_waiting (sf->progress, waiting);
+}
+
+/* Called by fd_dispatch when the data connection FD of one of the
+   segments of SF can be read from.  */
+
+static void
+fseg_readable (int fd, int events _GL_UNUSED, void *arg)
+{
+  struct ftp_segmented *sf = arg;
+  struct ftp_segment *seg;
+  static char buf[16384];
+  int i, ret, size;
+
+  for (i = 0; i < sf->count; i++)
+    if (sf->segs[i].dsock == fd && sf->segs[i].pos < sf->segs[i].end)
+      break;
+  if (i == sf->count || sf->res != 0)
+    return;
+  seg = &sf->segs[i];
+
+  /* The other segments may have used up what the rate limit allows.  */
+  size = throttle_quota (sf->u->host,
+                         MIN ((wgint) sizeof (buf), seg->end - seg->pos));
+  if (!size)
+    return;
+  ret = fd_read_nb (fd, buf, size, &seg->wait_for);
+  if (ret == FD_WOULDBLOCK)
+    return;
+  seg->wait_for = WAIT_FOR_READ;
+  if (ret <= 0)
+    {
+      /* Carry on from where we got, over the same control connection
+         if it survived.  */
+      fseg_stop (seg);
+      if (!fseg_start (seg, sf))
+        DEBUGP (("Segment %d lost its connection at %s.\n",
+                 i, number_to_static_string (seg->pos)));
+      return;
+    }
+
+  if (!write_file_at (sf->fp, buf, ret, seg->pos))
+    sf->res = -2;
+  seg->pos += ret;
+  sf->rd_size += ret;
+  throttle_account (sf->u->host, ret);
+
+  sf->last_read_tm = ptimer_measure (sf->timer);
+  if (sf->progress)
+    {
+      fseg_show_progress (sf);
+      progress_update (sf->progress, ret, sf->last_read_tm);
+    }
+
+  if (seg->pos == seg->end && sf->res == 0)
+    fseg_reassign (sf, seg);
+}
+
+/* Whether getftp may retrieve the SIZE-byte file of U over several
+   connections instead of reading DTSOCK alone.  */
+
+static bool
+ftp_segments_usable (const struct url *u, const ccon *con, wgint size)
+{
+  return (opt.segments > 1
+          && size >= 2 * FTP_SEGMENT_MIN_SIZE
+          && u->scheme == SCHEME_FTP
+          && !con->proxy
+          && opt.ftp_pasv
+          && con->id
+          && (con->rs == ST_UNIX || con->rs == ST_WINNT)
+          && ftp_process_type (u->params) == 'I'
+          && !output_stream
+          && !opt.warc_filename);
+}
+
+/* Retrieve the SIZE-byte remote FILE of U into FP using up to
+   opt.segments connections.  The first range arrives over DTSOCK, to
+   which con->csock has just sent RETR; DTSOCK is closed on return, and
+   the reply to RETR has been read.  *CSOCK is set to -1 if the control
+   connection was lost.
+
+   Returns what fd_read_body would; *QTYREAD is set to the length of
+   the contiguous part of the file, the rest of which is truncated so
+   that the retrieval can be continued from there.  */
+
+static int
+ftp_read_segmented (const struct url *u, ccon *con, const char *file,
+                    int *csock, int dtsock, FILE *fp, wgint size,
+                    const char *local_file, wgint *rd_size, wgint *qtyread,
+                    double *elapsed)
+{
+  struct ftp_segmented sf;
+  struct ftp_segment *segs = sf.segs;
+  int nsegs, i, main_csock = *csock;
+
+  nsegs = MIN (opt.segments, MAX_FTP_SEGMENTS);
+
+  /* The file is written out of order, which running digests of FP
+     cannot follow.  */
+  body_digests_invalidate ();
+
+  /* The segments are written where they belong in the file.  */
+  presize_file (fp, size, opt.preallocate);
+
+  xzero (sf);
+  sf.u = u;
+  sf.con = con;
+  sf.file = file;
+  sf.dir = ftp_absolute_dir (u, con);
+  sf.fp = fp;
+
+  segs[0].csock = main_csock;
+  segs[0].dsock = dtsock;
+  segs[0].start = segs[0].pos = 0;
+  segs[0].end = size;
+  segs[0].wait_for = WAIT_FOR_READ;
+  for (sf.count = 1; sf.count < nsegs; sf.count++)
+    {
+      struct ftp_segment *seg = &segs[sf.count];
+      int split;
+
+      seg->csock = seg->dsock = -1;
+      split = fseg_split (segs, sf.count, seg);
+      if (split == -1)
+        break;
+      if (!fseg_start (seg, &sf))
+        {
+          segs[split].end = seg->end;
+          break;
+        }
+    }
+  if (sf.count > 1)
+    logprintf (LOG_VERBOSE, _("Downloading in %d segments.\n"), sf.count);
+
+  if (opt.show_progress)
+    {
+      const char *filename_progress = local_file;
+      if (opt.dir_prefix)
+        filename_progress += strlen (opt.dir_prefix) + 1;
+      sf.progress = progress_create (filename_progress, 0, size);
+    }
+  sf.timer = ptimer_new ();
+
+  while (sf.res == 0)
+    {
+      int n = 0, run;
+      double delay;
+
+      for (i = 0; i < sf.count; i++)
+        if (segs[i].dsock >= 0 && segs[i].pos < segs[i].end)
+          {
+            fd_watch (segs[i].dsock, segs[i].wait_for, fseg_readable, &sf);
+            n++;
+          }
+      if (!n)
+        break;
+
+      /* Until the rate limit allows reading again, leave the data
+         where it is.  */
+      if ((delay = throttle_delay (sf.u->host)) > 0)
+        {
+          xsleep (delay);
+          continue;
+        }
+
+      run = fd_dispatch (0.95);
+      if (run < 0)
+        sf.res = -1;
+      else if (run == 0)
+        {
+          double now = ptimer_measure (sf.timer);
+          if (opt.read_timeout && now - sf.last_read_tm >= opt.read_timeout)
+            {
+              errno = ETIMEDOUT;
+              sf.res = -1;
+            }
+          else if (sf.progress)
+            {
+              fseg_show_progress (&sf);
+              progress_update (sf.progress, 0, now);
+            }
+        }
+    }
+
+  /* Everything below the first missing byte is in place.  The main
+     control connection may have moved to another segment; it is the
+     only one kept.  */
+  *qtyread = size;
+  *csock = -1;
+  for (i = 0; i < sf.count; i++)
+    {
+      if (segs[i].csock == main_csock && segs[i].csock >= 0)
+        {
+          fseg_stop (&segs[i]);
+          *csock = segs[i].csock;
+        }
+      else
+        {
+          if (segs[i].dsock >= 0)
+            fd_close (segs[i].dsock);
+          if (segs[i].csock >= 0)
+            fd_close (segs[i].csock);
+        }
+      if (segs[i].pos < segs[i].end && segs[i].pos < *qtyread)
+        *qtyread = segs[i].pos;
+    }
+  if (*qtyread < size && sf.res != -2)
+    {
+      if (fflush (fp) != 0 || ftruncate (fileno (fp), *qtyread) != 0)
+        sf.res = -2;
+      else
+        fseeko (fp, *qtyread, SEEK_SET);
+      if (sf.res == 0)
+        sf.res = -1;
+    }
+  else if (sf.res == 0 && fseeko (fp, size, SEEK_SET) != 0)
+    sf.res = -2;
+
+  if (sf.progress)
+    progress_finish (sf.progress, ptimer_read (sf.timer));
+  *elapsed = ptimer_read (sf.timer);
+  *rd_size = sf.rd_size;
+  ptimer_destroy (sf.timer);
+  xfree (sf.dir);
+
+  return sf.res;
+}
+
 /* Retrieves a file with denoted parameters through opening an FTP
    connection to the server.  It always closes the data connection,
    and closes the control connection in case of error.  If warc_tmp
@@ -336,6 +855,10 @@ getftp (struct url *u, struct url *original_url,
   char type_char;
   bool try_again;
   bool list_a_used = false;
+  bool mlsd_used = false;
+  bool pipelined = false;        /* SYST, PWD and TYPE sent at once */
+  bool segmented = false;        /* retrieved by ftp_read_segmented */
+  bool listing_in_memory = (cmd & DO_LIST) && LISTING_IN_MEMORY;
 #ifdef HAVE_SSL
   enum prot_level prot = (opt.ftps_clear_data_connection ? PROT_CLEAR : PROT_PRIVATE);
   /* these variables tell whether the target server
@@ -358,36 +881,7 @@ getftp (struct url *u, struct url *original_url,
 
   *qtyread = restval;
 
-  /* Find the username with priority */
-  if (u->user)
-    user = u->user;
-  else if (opt.user && (opt.use_askpass || opt.ask_passwd))
-    user = opt.user;
-  else if (opt.ftp_user)
-    user = opt.ftp_user;
-  else if (opt.user)
-    user = opt.user;
-  else
-    user = NULL;
-
-  /* Find the password with priority */
-  if (u->passwd)
-    passwd = u->passwd;
-  else if (opt.passwd && (opt.use_askpass || opt.ask_passwd))
-    passwd = opt.passwd;
-  else if (opt.ftp_passwd)
-    passwd = opt.ftp_passwd;
-  else if (opt.passwd)
-    passwd = opt.passwd;
-  else
-    passwd = NULL;
-
-  /* Check for ~/.netrc if none of the above match */
-  if (opt.netrc && (!user || !passwd))
-    search_netrc (u->host, (const char **) &user, (const char **) &passwd, 1, NULL);
-
-  if (!user) user = "anonymous";
-  if (!passwd) passwd = "-wget@";
+  ftp_credentials (u, &user, &passwd);
 
   dtsock = -1;
   local_sock = -1;
@@ -428,6 +922,9 @@ getftp (struct url *u, struct url *original_url,
       char    *host = con->proxy ? con->proxy->host : u->host;
       int      port = con->proxy ? con->proxy->port : u->port;
 
+      /* A new connection starts in the initial directory.  */
+      xfree (con->cwd);
+
       /* Login to the server: */
 
       /* First: Establish the control connection.  */
@@ -578,6 +1075,23 @@ Error in server response, closing control connection.\n"));
         }
 #endif
 
+      /* With --ftp-pipelining, SYST, PWD and TYPE, which don't depend
+         on each other, are sent at once, and ftp_syst, ftp_pwd and
+         ftp_type just read their replies.  A server that loses them
+         gets them one at a time when the connection is retried.  */
+      type_char = ftp_process_type (u->params);
+      if (opt.ftp_pipelining && !(con->st & AVOID_PIPELINING))
+        {
+          char type_cmd[8];
+          const char *commands[3];
+
+          snprintf (type_cmd, sizeof (type_cmd), "TYPE %c", type_char);
+          commands[0] = "SYST";
+          commands[1] = "PWD";
+          commands[2] = type_cmd;
+          pipelined = ftp_pipeline (csock, commands, countof (commands)) == FTPOK;
+        }
+
       /* Third: Get the system type */
       if (!opt.server_response)
         logprintf (LOG_VERBOSE, "==> SYST ... ");
@@ -589,6 +1103,8 @@ Error in server response, closing control connection.\n"));
           logputs (LOG_VERBOSE, "\n");
           logputs (LOG_NOTQUIET, _("\
 Error in server response, closing control connection.\n"));
+          if (pipelined)
+            con->st |= AVOID_PIPELINING;
           fd_close (csock);
           con->csock = -1;
           return err;
@@ -656,6 +1172,8 @@ Error in server response, closing control connection.\n"));
           logputs (LOG_VERBOSE, "\n");
           logputs (LOG_NOTQUIET, _("\
 Error in server response, closing control connection.\n"));
+          if (pipelined)
+            con->st |= AVOID_PIPELINING;
           fd_close (csock);
           con->csock = -1;
           return err;
@@ -710,7 +1228,6 @@ Error in server response, closing control connection.\n"));
         logputs (LOG_VERBOSE, _("done.\n"));
 
       /* Fifth: Set the FTP type.  */
-      type_char = ftp_process_type (u->params);
       if (!opt.server_response)
         logprintf (LOG_VERBOSE, "==> TYPE %c ... ", type_char);
       err = ftp_type (csock, type_char);
@@ -721,6 +1238,8 @@ Error in server response, closing control connection.\n"));
           logputs (LOG_VERBOSE, "\n");
           logputs (LOG_NOTQUIET, _("\
 Error in server response, closing control connection.\n"));
+          if (pipelined)
+            con->st |= AVOID_PIPELINING;
           fd_close (csock);
           con->csock = -1;
           return err;
@@ -749,7 +1268,8 @@ Error in server response, closing control connection.\n"));
         logputs (LOG_VERBOSE, _("done.  "));
     } /* do login */
 
-  if (cmd & DO_CWD)
+  /* Don't repeat the CWD the connection is known to be in.  */
+  if ((cmd & DO_CWD) && !(con->cwd && !strcmp (con->cwd, u->dir)))
     {
       if (!*u->dir)
         logputs (LOG_VERBOSE, _("==> CWD not needed.\n"));
@@ -768,7 +1288,6 @@ Error in server response, closing control connection.\n"));
           if (opt.encoding_remote && strcasecmp (opt.encoding_remote, opt.locale))
             {
               target_r = convert_fname (target, opt.locale, opt.encoding_remote);
-              xfree (target);
               target = target_r;
             }
 
@@ -1006,6 +1525,8 @@ Error in server response, closing control connection.\n"));
           /* 2004-09-20 SMS. */
 
           xfree (target_r);
+          xfree (con->cwd);
+          con->cwd = xstrdup (u->dir);
         } /* else */
     }
   else /* do not CWD */
@@ -1075,7 +1596,7 @@ Error in server response, closing control connection.\n"));
         {
           ip_address passive_addr;
           int        passive_port;
-          err = ftp_do_pasv (csock, &passive_addr, &passive_port);
+          err = ftp_do_pasv (csock, &con->st, &passive_addr, &passive_port);
           /* FTPRERR, WRITEFAILED, FTPNOPASV, FTPINVPASV */
           switch (err)
             {
@@ -1137,7 +1658,7 @@ Error in server response, closing control connection.\n"));
         }
       else
         {
-          err = ftp_do_port (csock, &local_sock);
+          err = ftp_do_port (csock, &con->st, &local_sock);
           /* FTPRERR, WRITEFAILED, bindport (FTPSYSERR), HOSTERR,
              FTPPORTERR */
           switch (err)
@@ -1353,7 +1874,13 @@ Error in server response, closing control connection.\n"));
       /* As Maciej W. Rozycki (macro@ds2.pg.gda.pl) says, `LIST'
          without arguments is better than `LIST .'; confirmed by
          RFC959.  */
-      err = ftp_list (csock, NULL, con->st&AVOID_LIST_A, con->st&AVOID_LIST, &list_a_used);
+      err = ftp_list (csock, NULL, con->st&AVOID_MLSD, con->st&AVOID_LIST_A,
+                      con->st&AVOID_LIST, &mlsd_used, &list_a_used);
+      /* A server that does not know MLSD will not learn it during
+         this session.  */
+      if (err == FTPOK && !mlsd_used)
+        con->st |= AVOID_MLSD;
+      con->listing_mlsd = mlsd_used;
 
       /* FTPRERR, WRITEFAILED */
       switch (err)
@@ -1437,7 +1964,28 @@ Error in server response, closing control connection.\n"));
   else
     target_locale = xstrdup (con->target);
 
-  if (!output_stream || con->cmd & DO_LIST)
+  if (listing_in_memory)
+    {
+#if defined HAVE_OPEN_MEMSTREAM && defined HAVE_FMEMOPEN
+      /* Keep creating the directory, so that empty remote
+         directories are mirrored as before.  */
+      mkalldirs (target_locale);
+      xfree (con->listing);
+      con->listing_size = 0;
+      fp = open_memstream (&con->listing, &con->listing_size);
+#endif
+      if (!fp)
+        {
+          logprintf (LOG_NOTQUIET, "open_memstream: %s\n", strerror (errno));
+          xfree (target_locale);
+          fd_close (csock);
+          con->csock = -1;
+          fd_close (dtsock);
+          fd_close (local_sock);
+          return FOPENERR;
+        }
+    }
+  else if (!output_stream || con->cmd & DO_LIST)
     {
 /* On VMS, alter the name as required. */
 #ifdef __VMS
@@ -1589,11 +2137,11 @@ Error in server response, closing control connection.\n"));
       /* We should try to restore the existing SSL session in the data connection
        * and fall back to establishing a new session if the server doesn't want to restore it.
        */
-      if (!opt.ftps_resume_ssl || !ssl_connect_wget (dtsock, u->host, &csock))
+      if (!opt.ftps_resume_ssl || !ssl_connect_wget (dtsock, u->host, &csock, NULL))
         {
           if (opt.ftps_resume_ssl)
             logputs (LOG_NOTQUIET, "Server does not want to resume the SSL session. Trying with a new one.\n");
-          if (!ssl_connect_wget (dtsock, u->host, NULL))
+          if (!ssl_connect_wget (dtsock, u->host, NULL, NULL))
             {
               xfree (target_locale);
               fd_close (csock);
@@ -1622,16 +2170,36 @@ Error in server response, closing control connection.\n"));
   if (restval && rest_failed)
     flags |= rb_skip_startpos;
   rd_size = 0;
-  res = fd_read_body (target_locale, dtsock, fp,
-                      expected_bytes ? expected_bytes - restval : 0,
-                      restval, &rd_size, qtyread, &con->dltime, flags, warc_tmp);
+  if ((cmd & DO_RETR) && !restval && !rest_failed
+      && ftp_segments_usable (u, con, expected_bytes))
+    {
+      char *file_remote;
+
+      if (opt.encoding_remote && strcasecmp (opt.encoding_remote, opt.locale))
+        file_remote = convert_fname (u->file, opt.locale, opt.encoding_remote);
+      else
+        file_remote = xstrdup (u->file);
+      res = ftp_read_segmented (u, con, file_remote, &csock, dtsock, fp,
+                                expected_bytes, target_locale, &rd_size,
+                                qtyread, &con->dltime);
+      xfree (file_remote);
+      dtsock = -1;
+      segmented = true;
+      if (con->csock >= 0)
+        con->csock = csock;
+    }
+  else
+    res = fd_read_body (target_locale, dtsock, u->host, fp,
+                        expected_bytes ? expected_bytes - restval : 0,
+                        restval, &rd_size, qtyread, &con->dltime, flags,
+                        warc_tmp);
 
   tms = datetime_str (time (NULL));
   tmrate = retr_rate (rd_size, con->dltime);
   total_download_time += con->dltime;
 
 #ifdef ENABLE_XATTR
-  if (opt.enable_xattr)
+  if (opt.enable_xattr && !listing_in_memory)
     set_file_metadata (u, NULL, fp);
 #endif
 
@@ -1668,48 +2236,62 @@ Error in server response, closing control connection.\n"));
     }
   fd_close (dtsock);
 
-  /* Get the server to tell us if everything is retrieved.  */
-  err = ftp_response (csock, &respline);
-  if (err != FTPOK)
+  if (segmented)
     {
-      /* The control connection is decidedly closed.  Print the time
-         only if it hasn't already been printed.  */
-      if (res != -1)
-        logprintf (LOG_NOTQUIET, "%s (%s) - ", tms, tmrate);
-      logputs (LOG_NOTQUIET, _("Control connection closed.\n"));
-      /* If there is an error on the control connection, close it, but
-         return FTPRETRINT, since there is a possibility that the
-         whole file was retrieved nevertheless (but that is for
-         ftp_loop_internal to decide).  */
-      xfree (target_locale);
-      fd_close (csock);
-      con->csock = -1;
-      return FTPRETRINT;
-    } /* err != FTPOK */
-  *last_expected_bytes = ftp_expected_bytes (respline);
-  /* If retrieval failed for any reason, return FTPRETRINT, but do not
-     close socket, since the control connection is still alive.  If
-     there is something wrong with the control connection, it will
-     become apparent later.  */
-  if (*respline != '2')
-    {
-      if (res != -1)
-        logprintf (LOG_NOTQUIET, "%s (%s) - ", tms, tmrate);
-      logputs (LOG_NOTQUIET, _("Data transfer aborted.\n"));
-#ifdef HAVE_SSL
-      if (!c_strncasecmp (respline, "425", 3) && u->scheme == SCHEME_FTPS)
+      /* ftp_read_segmented has read the replies.  */
+      if (csock < 0)
         {
-          logputs (LOG_NOTQUIET, "FTPS server rejects new SSL sessions in the data connection.\n");
-          xfree (respline);
+          logputs (LOG_NOTQUIET, _("Control connection closed.\n"));
+          con->csock = -1;
           xfree (target_locale);
-          return FTPRESTFAIL;
+          return FTPRETRINT;
         }
+    }
+  else
+    {
+      /* Get the server to tell us if everything is retrieved.  */
+      err = ftp_response (csock, &respline);
+      if (err != FTPOK)
+        {
+          /* The control connection is decidedly closed.  Print the time
+             only if it hasn't already been printed.  */
+          if (res != -1)
+            logprintf (LOG_NOTQUIET, "%s (%s) - ", tms, tmrate);
+          logputs (LOG_NOTQUIET, _("Control connection closed.\n"));
+          /* If there is an error on the control connection, close it, but
+             return FTPRETRINT, since there is a possibility that the
+             whole file was retrieved nevertheless (but that is for
+             ftp_loop_internal to decide).  */
+          xfree (target_locale);
+          fd_close (csock);
+          con->csock = -1;
+          return FTPRETRINT;
+        } /* err != FTPOK */
+      *last_expected_bytes = ftp_expected_bytes (respline);
+      /* If retrieval failed for any reason, return FTPRETRINT, but do not
+         close socket, since the control connection is still alive.  If
+         there is something wrong with the control connection, it will
+         become apparent later.  */
+      if (*respline != '2')
+        {
+          if (res != -1)
+            logprintf (LOG_NOTQUIET, "%s (%s) - ", tms, tmrate);
+          logputs (LOG_NOTQUIET, _("Data transfer aborted.\n"));
+#ifdef HAVE_SSL
+          if (!c_strncasecmp (respline, "425", 3) && u->scheme == SCHEME_FTPS)
+            {
+              logputs (LOG_NOTQUIET, "FTPS server rejects new SSL sessions in the data connection.\n");
+              xfree (respline);
+              xfree (target_locale);
+              return FTPRESTFAIL;
+            }
 #endif
+          xfree (respline);
+          xfree (target_locale);
+          return FTPRETRINT;
+        }
       xfree (respline);
-      xfree (target_locale);
-      return FTPRETRINT;
     }
-  xfree (respline);
 
   if (res == -1)
     {
@@ -1730,7 +2312,26 @@ Error in server response, closing control connection.\n"));
      print it out.  */
   if (con->cmd & DO_LIST)
     {
-      if (opt.server_response)
+      if (opt.server_response && listing_in_memory)
+        {
+          const char *p = con->listing, *end = p + con->listing_size;
+
+          while (p < end)
+            {
+              const char *eol = memchr (p, '\n', end - p);
+              size_t len = (eol ? eol : end) - p;
+              char *line;
+
+              while (len > 0 && p[len - 1] == '\r')
+                --len;
+              line = xmemdup0 (p, len);
+              logprintf (LOG_ALWAYS, "%s\n",
+                         quotearg_style (escape_quoting_style, line));
+              xfree (line);
+              p = eol ? eol + 1 : end;
+            }
+        }
+      else if (opt.server_response)
         {
 /* 2005-02-25 SMS.
    Much of this work may already have been done, but repeating it should
@@ -1791,7 +2392,7 @@ Error in server response, closing control connection.\n"));
           ("LIST -a" is used to get also the hidden files)
 
           */
-      if (!(con->st & LIST_AFTER_LIST_A_CHECK_DONE))
+      if (!mlsd_used && !(con->st & LIST_AFTER_LIST_A_CHECK_DONE))
         {
           /* We still have to check "LIST" after the first "LIST -a" to see
              if with "LIST" we get more data than "LIST -a", that means
@@ -1974,7 +2575,7 @@ ftp_loop_internal (struct url *u, struct url *original_url, struct fileinfo *f,
     {
       /* Increment the pass counter.  */
       ++count;
-      sleep_between_retrievals (count);
+      sleep_between_retrievals (u, count);
       if (con->st & ON_YOUR_OWN)
         {
           con->cmd = 0;
@@ -2058,8 +2659,13 @@ ftp_loop_internal (struct url *u, struct url *original_url, struct fileinfo *f,
 
       /* If we are working on a WARC record, getftp should also write
          to the warc_tmp file. */
+      metrics_begin ();
+      if (con->csock >= 0)
+        metrics_reused ();
       err = getftp (u, original_url, len, &qtyread, restval, con, count,
                     &last_expected_bytes, warc_tmp);
+      metrics_end (u, count, qtyread - restval, qtyread - restval,
+                   con->dltime, err == RETRFINISHED);
 
       if (con->csock == -1)
         con->st &= ~DONE_CWD;
@@ -2090,6 +2696,7 @@ ftp_loop_internal (struct url *u, struct url *original_url, struct fileinfo *f,
         case FTPPORTERR: case FTPLOGREFUSED: case FTPINVPASV:
         case FOPEN_EXCL_ERR:
           printwhat (count, opt.ntry);
+          retry_schedule (u, count, 0, false);
           /* non-fatal errors */
           if (err == FOPEN_EXCL_ERR)
             {
@@ -2113,6 +2720,7 @@ ftp_loop_internal (struct url *u, struct url *original_url, struct fileinfo *f,
           if (!f || qtyread != f->size)
             {
               printwhat (count, opt.ntry);
+              retry_schedule (u, count, 0, false);
               continue;
             }
           break;
@@ -2248,50 +2856,963 @@ RET:
   return err;
 }
 
-/* Return the directory listing in a reusable format.  The directory
-   is specified in u->dir.  */
-static uerr_t
-ftp_get_listing (struct url *u, struct url *original_url, ccon *con,
-                 struct fileinfo **f)
-{
-  uerr_t err;
-  char *uf;                     /* url file name */
-  char *rf;                     /* remote file full name */
-  char *lf;                     /* list file name */
-  char *url_enc;
-  char *old_target = con->target;
+/* Parallel retrieval (--ftp-connections).
 
-  con->st &= ~ON_YOUR_OWN;
-  con->cmd |= (DO_LIST | LEAVE_PENDING);
-  con->cmd &= ~DO_RETR;
+   A recursive retrieval spends most of its time waiting for the
+   server to answer CWD, PASV and LIST or RETR, one command after the
+   other.  With --ftp-connections=N, the listings of the subdirectories
+   of a directory, and the plain files in it, are instead handed out to
+   up to N control connections logged in to the same server.  The
+   exchanges on all of them are multiplexed with fd_dispatch, like the
+   segments of an HTTP download, so no threads are involved.
 
-  /* Find the listing file name.  We do it by taking the file name of
-     the URL and replacing the last component with the listing file
-     name.  */
-  uf = url_file_name (u, NULL);
-  lf = file_merge (uf, LIST_FILENAME);
-  xfree (uf);
-  uf = lf;
+   The main control connection is lent to the pool for each run; the
+   others are opened the first time they are needed and kept until
+   ftp_loop returns.  Whatever the pool fails to do is done again over
+   the main connection the usual way, which takes care of retrying and
+   of reporting the error.  */
 
-  url_enc = u->enc_type == ENC_IRI ? "UTF-8" : u->ori_enc;
-  if (opt.encoding_remote && strcasecmp (url_enc, opt.encoding_remote))
-    rf = convert_fname (uf, url_enc, opt.encoding_remote);
-  else
-    rf = xstrdup (uf);
+/* Hard limit on the number of control connections. */
+#define MAX_FTP_CONNECTIONS 16
 
-  lf = convert_fname (uf, url_enc, opt.locale);
+enum ftp_job_kind
+{
+  FTP_JOB_LIST,                 /* list a directory */
+  FTP_JOB_RETR                  /* retrieve a plain file */
+};
+
+struct ftp_job {
+  enum ftp_job_kind kind;
+  char *dir;                    /* absolute remote directory */
+  char *file;                   /* remote file name, for FTP_JOB_RETR */
+  char *local;                  /* and the local one */
+  struct fileinfo *f;           /* the file's listing entry */
+  bool force_full;              /* for ftp_loop_internal, if it fails */
+
+  bool ok;                      /* whether the job was done */
+  char *listing;                /* the listing, for FTP_JOB_LIST */
+  size_t listing_size;
+  bool mlsd;                    /* whether it came from MLSD */
+  wgint bytes;                  /* bytes received */
+  double dltime;                /* and how long it took */
+};
+
+enum ftp_worker_state
+{
+  FW_IDLE,                      /* waiting for a job */
+  FW_CWD,                       /* CWD sent */
+  FW_PASV,                      /* PASV or EPSV sent */
+  FW_CONNECT,                   /* data connection being established */
+  FW_TRANSFER,                  /* LIST or RETR sent */
+  FW_DEAD                       /* control connection lost */
+};
+
+struct ftp_worker {
+  struct ftp_pool *pool;
+  int csock;                    /* control connection */
+  int dsock;                    /* data connection, or -1 */
+  int data_wait;                /* what DSOCK must become ready for */
+  enum ftp_worker_state state;
+  char *cwd;                    /* current remote directory */
+  struct ftp_job *job;          /* the job being done */
+  int list_cmd;                 /* the list command being tried */
+  size_t listing_alloc;         /* allocated size of job->listing */
+  FILE *fp;                     /* file being retrieved */
+  bool data_done;               /* the data connection reached EOF */
+  bool reply_done;              /* the final reply has arrived */
+  char *reply;                  /* unparsed control connection input */
+  int reply_len, reply_size;
+  struct ptimer *timer;
+};
+
+struct ftp_pool {
+  struct ftp_worker workers[MAX_FTP_CONNECTIONS];
+  int count;                    /* connections besides the main one */
+  int st;                       /* ccon status: list commands to avoid */
+  struct ptimer *timer;
+  double last_activity;
+  char *host;                   /* whose rate limit applies */
+
+  void *progress;               /* gauge of a batch of retrievals */
+  double progress_start;        /* when the batch began */
+  int running;                  /* workers taking part in the batch */
+  int waiting;                  /* jobs no worker has taken yet */
+};
+
+/* The list commands ftp_list tries, in its order.  */
+static const char *pool_list_commands[] = { "MLSD", "LIST -a", "LIST" };
+static const int pool_list_avoid[] = { AVOID_MLSD, AVOID_LIST_A, AVOID_LIST };
+
+static void fw_finish (struct ftp_worker *, bool);
+
+/* Show the file every worker of POOL is retrieving under its progress
+   bar.  */
+
+static void
+pool_show_progress (struct ftp_pool *pool)
+{
+  int i;
+
+  for (i = 0; i < pool->running; i++)
+    {
+      struct ftp_worker *w = &pool->workers[i];
+      if (w->job && w->state == FW_TRANSFER)
+        progress_set_connection (pool->progress, i, w->job->local,
+                                 w->job->bytes,
+                                 w->job->f ? w->job->f->size : 0);
+      else
+        progress_set_connection (pool->progress, i, NULL, 0, -1);
+    }
+  progress_set_waiting (pool->progress, pool->waiting);
+}
+
+/* Close W's connections, giving up on its job.  */
+
+static void
+fw_kill (struct ftp_worker *w)
+{
+  if (w->job)
+    fw_finish (w, false);
+  if (w->csock >= 0)
+    fd_close (w->csock);
+  w->csock = -1;
+  w->state = FW_DEAD;
+  w->reply_len = 0;
+  xfree (w->cwd);
+}
+
+/* Record the outcome of W's job, and make W ready for the next one.  */
+
+static void
+fw_finish (struct ftp_worker *w, bool ok)
+{
+  struct ftp_job *job = w->job;
+  /* The server still owes a reply for a transfer cut short, and
+     there's no telling when it will come.  */
+  bool owed = w->state == FW_TRANSFER && !w->reply_done;
+
+  if (w->dsock >= 0)
+    fd_close (w->dsock);
+  w->dsock = -1;
+  if (w->fp && fclose (w->fp) != 0)
+    ok = false;
+  w->fp = NULL;
+
+  job->ok = ok;
+  job->dltime = ptimer_measure (w->timer);
+  if (!ok)
+    {
+      xfree (job->listing);
+      job->listing_size = 0;
+    }
+  DEBUGP (("[fw %d] %s %s%s%s\n", w->csock, ok ? "finished" : "failed",
+           job->dir, job->file ? "/" : "", job->file ? job->file : ""));
+  w->job = NULL;
+  w->state = FW_IDLE;
+  if (owed)
+    fw_kill (w);
+}
+
+/* Send COMMAND, with ARG if non-NULL, over W's control connection.
+   Returns false if the connection is lost.  */
+
+static bool
+fw_command (struct ftp_worker *w, const char *command, const char *arg)
+{
+  char *request = ftp_request (command, arg);
+  int res;
+
+  DEBUGP (("[fw %d] --> %s", w->csock, request));
+  res = fd_write (w->csock, request, strlen (request), -1);
+  xfree (request);
+  if (res < 0)
+    {
+      fw_kill (w);
+      return false;
+    }
+  return true;
+}
+
+/* Ask for a passive data connection.  */
+
+static void
+fw_pasv (struct ftp_worker *w)
+{
+  bool ipv4 = socket_family (w->csock, ENDPOINT_PEER) == AF_INET;
+
+  if (fw_command (w, ipv4 ? "PASV" : "EPSV", NULL))
+    w->state = FW_PASV;
+}
+
+/* Start W on JOB.  */
+
+static void
+fw_start (struct ftp_worker *w, struct ftp_job *job)
+{
+  w->job = job;
+  w->list_cmd = -1;
+  w->listing_alloc = 0;
+  w->data_done = w->reply_done = false;
+  job->ok = false;
+  job->bytes = 0;
+  ptimer_reset (w->timer);
+
+  if (w->cwd && !strcmp (w->cwd, job->dir))
+    fw_pasv (w);
+  else if (fw_command (w, "CWD", job->dir))
+    w->state = FW_CWD;
+}
+
+/* Send the next list command W's server may accept.  Returns false if
+   none is left.  */
+
+static bool
+fw_next_list_command (struct ftp_worker *w)
+{
+  while (++w->list_cmd < countof (pool_list_commands))
+    if (!(w->pool->st & pool_list_avoid[w->list_cmd]))
+      {
+        w->job->mlsd = pool_list_avoid[w->list_cmd] == AVOID_MLSD;
+        return fw_command (w, pool_list_commands[w->list_cmd], NULL);
+      }
+  return false;
+}
+
+/* Start the transfer of W's job over the data connection just
+   established.  */
+
+static void
+fw_transfer (struct ftp_worker *w)
+{
+  struct ftp_job *job = w->job;
+
+  w->state = FW_TRANSFER;
+  if (job->kind == FTP_JOB_LIST)
+    {
+      if (!fw_next_list_command (w) && w->job)
+        {
+          w->reply_done = true;
+          fw_finish (w, false);
+        }
+      return;
+    }
+
+  mkalldirs (job->local);
+  remove_link (job->local);
+  if (opt.unlink_requested && file_exists_p (job->local, NULL))
+    unlink (job->local);
+  w->fp = fopen (job->local, "wb");
+  if (!w->fp)
+    {
+      /* ftp_loop_internal will report it.  */
+      w->reply_done = true;
+      fw_finish (w, false);
+      return;
+    }
+  fw_command (w, "RETR", job->file);
+}
+
+/* Set up the data connection announced by the PASV or EPSV reply
+   CODE, whose first line is LINE.  The server's address is taken from
+   the control connection, as EPSV requires anyway; this also gets
+   around servers behind NAT advertising their private address.  */
+
+static bool
+fw_open_data (struct ftp_worker *w, int code, const char *line)
+{
+  ip_address ip;
+  int port = -1;
+  const char *p;
+
+  if (!socket_ip_address (w->csock, &ip, ENDPOINT_PEER))
+    return false;
+
+  if (code == 227)
+    {
+      int n[6];
+
+      for (p = line + 4; *p && !c_isdigit (*p); p++)
+        ;
+      if (sscanf (p, "%d,%d,%d,%d,%d,%d",
+                  &n[0], &n[1], &n[2], &n[3], &n[4], &n[5]) == 6)
+        port = (n[4] << 8) + n[5];
+    }
+  else if (code == 229 && (p = strchr (line, '(')) != NULL
+           && p[1] && p[2] == p[1] && p[3] == p[1])
+    port = atoi (p + 4);
+
+  if (port <= 0 || port > 65535)
+    return false;
+
+  w->dsock = connect_to_ip_start (&ip, port);
+  if (w->dsock < 0)
+    return false;
+  w->state = FW_CONNECT;
+  w->data_wait = WAIT_FOR_WRITE;
+  return true;
+}
+
+/* Act on the reply CODE to the last command W sent.  */
+
+static void
+fw_reply (struct ftp_worker *w, int code, const char *line)
+{
+  switch (w->state)
+    {
+    case FW_CWD:
+      if (code / 100 != 2)
+        {
+          fw_finish (w, false);
+          break;
+        }
+      xfree (w->cwd);
+      w->cwd = xstrdup (w->job->dir);
+      fw_pasv (w);
+      break;
+    case FW_PASV:
+      if (!fw_open_data (w, code, line))
+        fw_finish (w, false);
+      break;
+    case FW_TRANSFER:
+      if (code / 100 == 1)
+        break;                  /* the transfer has started */
+      if (code / 100 == 2)
+        {
+          w->reply_done = true;
+          if (w->data_done)
+            fw_finish (w, true);
+          break;
+        }
+      /* As in ftp_list, a refused list command is followed by the next
+         one over the same data connection.  */
+      if (w->job->kind == FTP_JOB_LIST && code / 100 == 5
+          && !w->data_done && fw_next_list_command (w))
+        break;
+      w->reply_done = true;
+      if (w->job)
+        fw_finish (w, false);
+      break;
+    default:
+      /* Nothing was asked.  */
+      fw_kill (w);
+      break;
+    }
+}
+
+/* If W->reply starts with a complete reply, remove it and return its
+   code, with its first line copied to LINE.  Returns 0 if the reply
+   is not complete yet, -1 if it is malformed.  */
+
+static int
+fw_take_reply (struct ftp_worker *w, char *line, size_t size)
+{
+  char *p = w->reply, *end = w->reply + w->reply_len, *eol, *last;
+  size_t len;
+  int code;
+
+  eol = memchr (p, '\n', end - p);
+  if (!eol)
+    return 0;
+  if (eol - p < 3 || !c_isdigit (p[0]) || !c_isdigit (p[1])
+      || !c_isdigit (p[2]))
+    return -1;
+  code = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+
+  /* A multi-line reply ends with a line starting with its code and a
+     space.  */
+  last = eol;
+  if (eol - p > 3 && p[3] == '-')
+    {
+      char *q = eol + 1;
+      for (;;)
+        {
+          char *qe = memchr (q, '\n', end - q);
+          if (!qe)
+            return 0;
+          if (qe - q > 3 && !memcmp (q, p, 3) && q[3] == ' ')
+            {
+              last = qe;
+              break;
+            }
+          q = qe + 1;
+        }
+    }
+
+  len = eol - p;
+  if (len > 0 && p[len - 1] == '\r')
+    --len;
+  if (len >= size)
+    len = size - 1;
+  memcpy (line, p, len);
+  line[len] = '\0';
+  DEBUGP (("[fw %d] <-- %s\n", w->csock, line));
+
+  w->reply_len = end - (last + 1);
+  memmove (w->reply, last + 1, w->reply_len);
+  return code;
+}
+
+/* Called by fd_dispatch when the control connection of worker ARG can
+   be read from.  */
+
+static void
+fw_control_ready (int fd, int events _GL_UNUSED, void *arg)
+{
+  struct ftp_worker *w = arg;
+  char line[512];
+  int ret, wait_for, code;
+
+  if (fd != w->csock)
+    return;
+  if (w->reply_size - w->reply_len < 512)
+    {
+      w->reply_size = w->reply_size ? 2 * w->reply_size : 1024;
+      w->reply = xrealloc (w->reply, w->reply_size);
+    }
+  ret = fd_read_nb (fd, w->reply + w->reply_len,
+                    w->reply_size - w->reply_len, &wait_for);
+  if (ret == FD_WOULDBLOCK)
+    return;
+  if (ret <= 0)
+    {
+      fw_kill (w);
+      return;
+    }
+  w->reply_len += ret;
+  w->pool->last_activity = ptimer_measure (w->pool->timer);
+
+  while (w->state != FW_DEAD
+         && (code = fw_take_reply (w, line, sizeof (line))) != 0)
+    {
+      if (code < 0)
+        fw_kill (w);
+      else
+        fw_reply (w, code, line);
+    }
+}
+
+/* Called by fd_dispatch when the data connection of worker ARG is
+   ready for what it waits for.  */
+
+static void
+fw_data_ready (int fd, int events _GL_UNUSED, void *arg)
+{
+  struct ftp_worker *w = arg;
+  struct ftp_job *job = w->job;
+  static char buf[16384];
+  int ret, size;
+
+  if (fd != w->dsock)
+    return;
+  w->pool->last_activity = ptimer_measure (w->pool->timer);
+
+  if (w->state == FW_CONNECT)
+    {
+      if (connect_to_ip_finish (fd) < 0)
+        {
+          DEBUGP (("[fw %d] data connection failed: %s\n",
+                   w->csock, strerror (errno)));
+          fw_finish (w, false);
+          return;
+        }
+      w->data_wait = WAIT_FOR_READ;
+      fw_transfer (w);
+      return;
+    }
+  if (w->state != FW_TRANSFER || w->data_done)
+    return;
+
+  if (!(size = throttle_quota (w->pool->host, sizeof (buf))))
+    return;
+  ret = fd_read_nb (fd, buf, size, &w->data_wait);
+  if (ret == FD_WOULDBLOCK)
+    return;
+  w->data_wait = WAIT_FOR_READ;
+  if (ret < 0)
+    {
+      fw_finish (w, false);
+      return;
+    }
+  if (ret == 0)
+    {
+      w->data_done = true;
+      fd_close (w->dsock);
+      w->dsock = -1;
+      if (w->reply_done)
+        fw_finish (w, true);
+      return;
+    }
+
+  if (job->kind == FTP_JOB_LIST)
+    {
+      if (job->listing_size + ret > w->listing_alloc)
+        {
+          w->listing_alloc = MAX (2 * w->listing_alloc,
+                                  job->listing_size + ret);
+          job->listing = xrealloc (job->listing, w->listing_alloc);
+        }
+      memcpy (job->listing + job->listing_size, buf, ret);
+      job->listing_size += ret;
+    }
+  else if (fwrite (buf, 1, ret, w->fp) < (size_t) ret)
+    {
+      fw_finish (w, false);
+      return;
+    }
+  job->bytes += ret;
+  throttle_account (w->pool->host, ret);
+
+  if (w->pool->progress)
+    {
+      struct ftp_pool *pool = w->pool;
+      pool_show_progress (pool);
+      progress_update (pool->progress, ret,
+                       ptimer_measure (pool->timer) - pool->progress_start);
+    }
+}
+
+static void
+fw_init (struct ftp_worker *w, struct ftp_pool *pool, int csock)
+{
+  xzero (*w);
+  w->pool = pool;
+  w->csock = csock;
+  w->dsock = -1;
+  w->state = FW_IDLE;
+  w->timer = ptimer_new ();
+}
+
+/* Open the connections of CON's pool besides the main one, logging in
+   to U's server.  Stops at the first connection the server refuses,
+   since it is most likely limiting the connections per client.  */
+
+static void
+ftp_pool_open (ccon *con, const struct url *u)
+{
+  struct ftp_pool *pool = xnew0 (struct ftp_pool);
+  int wanted = MIN (opt.ftp_connections, MAX_FTP_CONNECTIONS) - 1;
+  const char *user, *passwd;
+
+  ftp_credentials (u, &user, &passwd);
+  pool->timer = ptimer_new ();
+  pool->host = xstrdup (u->host);
+  con->pool = pool;
+
+  while (pool->count < wanted)
+    {
+      int csock = connect_to_host (u->host, u->port);
+      if (csock < 0)
+        break;
+      if (ftp_greeting (csock) != FTPOK
+          || ftp_login (csock, user, passwd) != FTPOK
+          || ftp_type (csock, 'I') != FTPOK)
+        {
+          fd_close (csock);
+          break;
+        }
+      fw_init (&pool->workers[pool->count++], pool, csock);
+    }
+  if (pool->count < wanted)
+    logprintf (LOG_VERBOSE,
+               _("The server accepted %d of %d additional control connections.\n"),
+               pool->count, wanted);
+}
+
+/* Close the connections of POOL and free it.  */
+
+static void
+ftp_pool_close (struct ftp_pool *pool)
+{
+  int i;
+
+  for (i = 0; i < pool->count; i++)
+    {
+      struct ftp_worker *w = &pool->workers[i];
+      if (w->csock >= 0)
+        fd_close (w->csock);
+      xfree (w->cwd);
+      xfree (w->reply);
+      ptimer_destroy (w->timer);
+    }
+  ptimer_destroy (pool->timer);
+  xfree (pool->host);
+  xfree (pool);
+}
+
+/* Whether CON's retrievals from U can be handed to the pool: plain FTP
+   in binary passive mode, straight to the server, with the directory
+   syntax of getftp's CWD and a list command already settled on.  */
+
+static bool
+ftp_pool_usable (const struct url *u, const ccon *con)
+{
+  return (opt.ftp_connections > 1
+          && opt.recursive
+          && u->scheme == SCHEME_FTP
+          && !con->proxy
+          && opt.ftp_pasv
+          && !opt.warc_filename
+          && con->id
+          && (con->rs == ST_UNIX || con->rs == ST_WINNT)
+          && ftp_process_type (u->params) == 'I'
+          && (!(con->st & AVOID_MLSD)
+              || (con->st & LIST_AFTER_LIST_A_CHECK_DONE)));
+}
+
+/* Whether plain files can also be retrieved by the pool: the options
+   that make getftp do more than write the file from the start are
+   left to it.  */
+
+static bool
+ftp_pool_retr_usable (const struct url *u, const ccon *con)
+{
+  return (ftp_pool_usable (u, con)
+          && !opt.spider
+          && !opt.output_document
+          && !opt.always_rest
+          && opt.start_pos < 0
+          && !opt.noclobber
+          && !opt.backups
+#ifdef ENABLE_XATTR
+          && !opt.enable_xattr
+#endif
+          && (opt.dirstruct || opt.timestamping));
+}
+
+/* Do the COUNT JOBS over the connections of CON's pool, opening it if
+   necessary, and the main connection.  The jobs that could not be done
+   are left with ok set to false.  */
+
+static void
+ftp_pool_run (ccon *con, const struct url *u, struct ftp_job *jobs, int count)
+{
+  struct ftp_pool *pool;
+  struct ftp_worker *main_worker;
+  int next = 0, workers, i;
+
+  if (!con->pool)
+    ftp_pool_open (con, u);
+  pool = con->pool;
+  pool->st = con->st;
+  pool->last_activity = ptimer_measure (pool->timer);
+
+  workers = pool->count;
+  main_worker = &pool->workers[workers];
+  if (con->csock >= 0)
+    {
+      /* The main connection ends up elsewhere.  */
+      fw_init (main_worker, pool, con->csock);
+      con->st &= ~DONE_CWD;
+      xfree (con->cwd);
+      workers++;
+    }
+
+  if (jobs[0].kind == FTP_JOB_LIST)
+    logprintf (LOG_VERBOSE, _("Listing %d directories over %d connections.\n"),
+               count, MIN (workers, count));
+  else
+    {
+      logprintf (LOG_VERBOSE, _("Retrieving %d files over %d connections.\n"),
+                 count, MIN (workers, count));
+      if (opt.show_progress)
+        {
+          wgint total = 0;
+          char *name = aprintf (ngettext ("%d file", "%d files", count),
+                                count);
+          for (i = 0; i < count; i++)
+            if (jobs[i].f && jobs[i].f->size > 0)
+              total += jobs[i].f->size;
+          pool->progress = progress_create (name, 0, total);
+          pool->progress_start = pool->last_activity;
+          xfree (name);
+        }
+    }
+  pool->running = workers;
+
+  for (;;)
+    {
+      int busy = 0, run;
+      double delay = throttle_delay (pool->host);
+
+      for (i = 0; i < workers; i++)
+        {
+          struct ftp_worker *w = &pool->workers[i];
+
+          if (w->state == FW_IDLE && next < count)
+            fw_start (w, &jobs[next++]);
+          if (w->state == FW_IDLE || w->state == FW_DEAD)
+            continue;
+          busy++;
+          /* Watching a descriptor again costs nothing.  While the rate
+             limit has the transfers wait, only the replies are.  */
+          fd_watch (w->csock, WAIT_FOR_READ, fw_control_ready, w);
+          if (w->dsock >= 0 && !w->data_done)
+            {
+              if (delay > 0 && w->state == FW_TRANSFER)
+                fd_unwatch (w->dsock);
+              else
+                fd_watch (w->dsock, w->data_wait, fw_data_ready, w);
+            }
+        }
+      if (!busy)
+        break;
+      pool->waiting = count - next;
+
+      run = fd_dispatch (delay > 0 ? MIN (delay, 0.95) : 0.95);
+      if (run < 0
+          || (run == 0 && opt.read_timeout
+              && (ptimer_measure (pool->timer) - pool->last_activity
+                  >= opt.read_timeout)))
+        {
+          DEBUGP (("Giving up on the busy FTP connections.\n"));
+          for (i = 0; i < workers; i++)
+            if (pool->workers[i].state != FW_IDLE
+                && pool->workers[i].state != FW_DEAD)
+              fw_kill (&pool->workers[i]);
+        }
+      else if (run == 0 && pool->progress)
+        {
+          pool_show_progress (pool);
+          progress_update (pool->progress, 0, (ptimer_measure (pool->timer)
+                                               - pool->progress_start));
+        }
+    }
+
+  if (pool->progress)
+    {
+      progress_finish (pool->progress,
+                       ptimer_measure (pool->timer) - pool->progress_start);
+      pool->progress = NULL;
+    }
+
+  for (i = 0; i < workers; i++)
+    if (pool->workers[i].csock >= 0)
+      fd_unwatch (pool->workers[i].csock);
+
+  if (main_worker->timer)
+    {
+      con->csock = main_worker->csock;
+      xfree (main_worker->cwd);
+      xfree (main_worker->reply);
+      ptimer_destroy (main_worker->timer);
+      xzero (*main_worker);
+    }
+}
+
+/* Return the absolute remote directory of U, the one getftp changes
+   to: a relative directory is relative to the initial directory.  The
+   pool and the listing cache use it.  */
+
+static char *
+ftp_absolute_dir (const struct url *u, const ccon *con)
+{
+  size_t idlen = strlen (con->id);
+  char *dir, *res;
+
+  if (opt.encoding_remote && strcasecmp (opt.encoding_remote, opt.locale))
+    dir = convert_fname (u->dir, opt.locale, opt.encoding_remote);
+  else
+    dir = xstrdup (u->dir);
+  if (*dir == '/')
+    return dir;
+
+  while (idlen > 0 && con->id[idlen - 1] == '/')
+    --idlen;
+  if (*dir)
+    res = aprintf ("%.*s/%s", (int) idlen, con->id, dir);
+  else
+    res = idlen ? xstrndup (con->id, idlen) : xstrdup ("/");
+  xfree (dir);
+  return res;
+}
+
+/* Before ftp_retrieve_dirs descends into the subdirectories in F,
+   list them all over the pool, so that ftp_get_listing finds their
+   listings waiting in CON->listings.  */
+
+static void
+ftp_prefetch_listings (struct url *u, struct fileinfo *f, ccon *con)
+{
+  struct ftp_job *jobs = NULL;
+  int count = 0, size = 0, i;
+  char *odir = xstrdup (u->dir);
+
+  for (; f; f = f->next)
+    {
+      char *dir_locale, *newdir;
+
+      if (f->type != FT_DIRECTORY)
+        continue;
+      if (*odir == '\0' || (*odir == '/' && odir[1] == '\0'))
+        newdir = concat_strings (odir, f->name, (char *) 0);
+      else
+        newdir = concat_strings (odir, "/", f->name, (char *) 0);
+      if (opt.encoding_remote && strcasecmp (opt.encoding_remote, opt.locale))
+        dir_locale = convert_fname (newdir, opt.encoding_remote, opt.locale);
+      else
+        dir_locale = xstrdup (newdir);
+      xfree (newdir);
+
+      if (!accdir (dir_locale))
+        {
+          xfree (dir_locale);
+          continue;
+        }
+      url_set_dir (u, dir_locale);
+      xfree (dir_locale);
+
+      if (count == size)
+        {
+          size = size ? 2 * size : 16;
+          jobs = xrealloc (jobs, size * sizeof (*jobs));
+        }
+      xzero (jobs[count]);
+      jobs[count].kind = FTP_JOB_LIST;
+      jobs[count].dir = ftp_absolute_dir (u, con);
+      count++;
+    }
+  url_set_dir (u, odir);
+  xfree (odir);
+
+  /* A single directory is listed just as fast by the main
+     connection.  */
+  if (count > 1)
+    {
+      ftp_pool_run (con, u, jobs, count);
+      if (!con->listings)
+        con->listings = make_string_hash_table (0);
+      for (i = 0; i < count; i++)
+        if (jobs[i].ok && !hash_table_contains (con->listings, jobs[i].dir))
+          {
+            struct ftp_job *job = xmemdup (&jobs[i], sizeof (*job));
+            hash_table_put (con->listings, job->dir, job);
+            jobs[i].dir = NULL;
+            jobs[i].listing = NULL;
+          }
+    }
+  for (i = 0; i < count; i++)
+    {
+      xfree (jobs[i].dir);
+      xfree (jobs[i].listing);
+    }
+  xfree (jobs);
+}
+
+/* Return the directory listing in a reusable format.  The directory
+   is specified in u->dir.  */
+static uerr_t
+ftp_get_listing (struct url *u, struct url *original_url, ccon *con,
+                 struct fileinfo **f)
+{
+  uerr_t err;
+  char *uf;                     /* url file name */
+  char *rf;                     /* remote file full name */
+  char *lf;                     /* list file name */
+  char *url_enc;
+  char *old_target = con->target;
+  struct ftp_job *job = NULL;
+
+  con->st &= ~ON_YOUR_OWN;
+  con->cmd |= (DO_LIST | LEAVE_PENDING);
+  con->cmd &= ~DO_RETR;
+
+  /* Find the listing file name.  We do it by taking the file name of
+     the URL and replacing the last component with the listing file
+     name.  */
+  uf = url_file_name (u, NULL);
+  lf = file_merge (uf, LIST_FILENAME);
+  xfree (uf);
+  uf = lf;
+
+  url_enc = u->enc_type == ENC_IRI ? "UTF-8" : u->ori_enc;
+  if (opt.encoding_remote && strcasecmp (url_enc, opt.encoding_remote))
+    rf = convert_fname (uf, url_enc, opt.encoding_remote);
+  else
+    rf = xstrdup (uf);
+
+  lf = convert_fname (uf, url_enc, opt.locale);
 
   xfree (uf);
   DEBUGP ((_("Using %s as listing tmp file.\n"), quote (lf)));
 
-  con->target = rf;
-  err = ftp_loop_internal (u, original_url, NULL, con, NULL, false);
-  xfree (con->target);
-  con->target = old_target;
+  if (con->listings && con->id)
+    {
+      char *dir = ftp_absolute_dir (u, con);
+      job = hash_table_get (con->listings, dir);
+      xfree (dir);
+    }
+  if (job)
+    {
+      /* Listed by the pool.  */
+      DEBUGP (("Using the listing of %s fetched earlier.\n", job->dir));
+      con->listing = job->listing;
+      con->listing_size = job->listing_size;
+      con->listing_mlsd = job->mlsd;
+      job->listing = NULL;
+      job->listing_size = 0;
+      hash_table_remove (con->listings, job->dir);
+      xfree (job->dir);
+      xfree (job);
+      err = RETROK;
+      xfree (rf);
 
-  if (err == RETROK)
+      if (!LISTING_IN_MEMORY)
+        {
+          FILE *fp;
+          bool written = false;
+
+          mkalldirs (lf);
+          fp = fopen (lf, "wb");
+          if (fp)
+            {
+              written = (fwrite (con->listing, 1, con->listing_size, fp)
+                         == con->listing_size);
+              if (fclose (fp) != 0)
+                written = false;
+            }
+          if (!written)
+            {
+              logprintf (LOG_NOTQUIET, "%s: %s\n", lf, strerror (errno));
+              err = FOPENERR;
+            }
+          else if (!opt.remove_listing)
+            {
+              total_downloaded_bytes += con->listing_size;
+              numurls++;
+            }
+          xfree (con->listing);
+          con->listing_size = 0;
+        }
+    }
+  else
     {
-      *f = ftp_parse_ls (lf, con->rs);
+      con->target = rf;
+      err = ftp_loop_internal (u, original_url, NULL, con, NULL, false);
+      xfree (con->target);
+      con->target = old_target;
+    }
+
+  *f = NULL;
+  if (err == RETROK && con->listing)
+    {
+      if (con->listing_mlsd)
+        *f = ftp_parse_mlsd (con->listing, con->listing_size);
+#ifdef HAVE_FMEMOPEN
+      else
+        *f = ftp_parse_ls_mem (con->listing, con->listing_size, con->rs);
+#endif
+    }
+  else if (err == RETROK)
+    {
+      if (con->listing_mlsd)
+        {
+          struct file_memory *fm = wget_read_file (lf);
+          *f = fm ? ftp_parse_mlsd (fm->content, fm->length) : NULL;
+          if (fm)
+            wget_read_file_free (fm);
+        }
+      else
+        *f = ftp_parse_ls (lf, con->rs);
       if (opt.remove_listing)
         {
           if (unlink (lf))
@@ -2300,8 +3821,8 @@ ftp_get_listing (struct url *u, struct url *original_url, ccon *con,
             logprintf (LOG_VERBOSE, _("Removed %s.\n"), quote (lf));
         }
     }
-  else
-    *f = NULL;
+  xfree (con->listing);
+  con->listing_size = 0;
   xfree (lf);
   con->cmd &= ~DO_LIST;
   return err;
@@ -2312,6 +3833,142 @@ static uerr_t ftp_retrieve_dirs (struct url *, struct url *,
 static uerr_t ftp_retrieve_glob (struct url *, struct url *, ccon *, int);
 static struct fileinfo *delelement (struct fileinfo **, struct fileinfo **);
 
+/* Set the permissions and the time-stamp of the local copy
+   TARGET_LOCALE of F, as retrieved if DLTHIS.  */
+static void
+ftp_set_local_attributes (struct fileinfo *f, const char *target_locale,
+                          bool dlthis)
+{
+  const char *actual_target = NULL;
+
+  /* 2004-12-15 SMS.
+   * Set permissions _before_ setting the times, as setting the
+   * permissions changes the modified-time, at least on VMS.
+   * Also, use the opt.output_document name here, too, as
+   * appropriate.  (Do the test once, and save the result.)
+   */
+
+  set_local_file (&actual_target, target_locale);
+
+  /* If downloading a plain file, and the user requested it, then
+     set valid (non-zero) permissions. */
+  if (dlthis && (actual_target != NULL) &&
+   (f->type == FT_PLAINFILE) && opt.preserve_perm)
+    {
+      if (f->perms)
+        {
+          if (chmod (actual_target, f->perms))
+            logprintf (LOG_NOTQUIET,
+                       _("Failed to set permissions for %s.\n"),
+                       actual_target);
+        }
+      else
+        DEBUGP (("Unrecognized permissions for %s.\n", actual_target));
+    }
+
+  /* Set the time-stamp information to the local file.  Symlinks
+     are not to be stamped because it sets the stamp on the
+     original.  :( */
+  if (actual_target != NULL)
+    {
+      if (opt.useservertimestamps
+          && !(f->type == FT_SYMLINK && !opt.retr_symlinks)
+          && f->tstamp != -1
+          && dlthis
+          && file_exists_p (target_locale, NULL))
+        {
+          touch (actual_target, f->tstamp);
+        }
+      else if (f->tstamp == -1)
+        logprintf (LOG_NOTQUIET, _("%s: corrupt time-stamp.\n"),
+                   actual_target);
+    }
+}
+
+/* Retrieve the COUNT plain files in JOBS, deferred by
+   ftp_retrieve_list, over the pool when there is more than one.  The
+   files the pool could not retrieve are retrieved over the main
+   connection by ftp_loop_internal.  */
+static uerr_t
+ftp_retrieve_deferred (struct url *u, struct url *original_url, ccon *con,
+                       struct ftp_job *jobs, int count)
+{
+  uerr_t err = RETROK;
+  int i;
+
+  if (count > 1)
+    ftp_pool_run (con, u, jobs, count);
+
+  for (i = 0; i < count; i++)
+    {
+      struct ftp_job *job = &jobs[i];
+      char *ofile, *file_locale;
+
+      if (opt.quota && total_downloaded_bytes > opt.quota)
+        return QUOTEXC;
+
+      ofile = xstrdup (u->file);
+      if (opt.encoding_remote && strcasecmp (opt.encoding_remote, opt.locale))
+        file_locale = convert_fname (job->file, opt.encoding_remote,
+                                     opt.locale);
+      else
+        file_locale = xstrdup (job->file);
+      url_set_file (u, file_locale);
+      xfree (file_locale);
+      if (count > 1)
+        metrics_end (u, 1, job->bytes, job->bytes, job->dltime, job->ok);
+
+      if (job->ok)
+        {
+          char *tms = datetime_str (time (NULL));
+
+          total_download_time += job->dltime;
+          downloaded_file (FILE_DOWNLOADED_NORMALLY, job->local);
+          logprintf (LOG_VERBOSE, _("%s (%s) - %s saved [%s]\n\n"),
+                     tms, retr_rate (job->bytes, job->dltime),
+                     quote (job->local), number_to_static_string (job->bytes));
+          if (!opt.verbose && !opt.quiet)
+            {
+              char *hurl = url_string (u, URL_AUTH_HIDE_PASSWD);
+              logprintf (LOG_NONVERBOSE, "%s URL: %s [%s] -> \"%s\" [%d]\n",
+                         tms, hurl, number_to_static_string (job->bytes),
+                         job->local, 1);
+              xfree (hurl);
+            }
+          total_downloaded_bytes += job->bytes;
+          numurls++;
+
+          if (opt.delete_after && !input_file_url (opt.input_filename))
+            {
+              logprintf (LOG_VERBOSE, _("Removing %s.\n"), job->local);
+              if (unlink (job->local))
+                logprintf (LOG_NOTQUIET, "unlink: %s\n", strerror (errno));
+            }
+          err = RETROK;
+        }
+      else
+        {
+          con->st &= ~DONE_CWD;
+          con->cmd |= DO_CWD;
+          if (con->csock < 0)
+            con->cmd |= DO_LOGIN;
+          err = ftp_loop_internal (u, original_url, job->f, con, NULL,
+                                   job->force_full);
+          con->cmd &= ~(DO_CWD | DO_LOGIN);
+        }
+
+      ftp_set_local_attributes (job->f, job->local, true);
+      url_set_file (u, ofile);
+      xfree (ofile);
+
+      /* Break on fatals.  */
+      if (err == QUOTEXC || err == HOSTERR || err == FWRITEERR)
+        break;
+    }
+  return err;
+}
+
+
 /* Retrieve a list of files given in struct fileinfo linked list.  If
    a file is a symbolic link, do not retrieve it, but rather try to
    set up a similar link on the local disk, if the symlinks are
@@ -2329,8 +3986,10 @@ ftp_retrieve_list (struct url *u, struct url *original_url,
   wgint local_size;
   time_t tml;
   bool dlthis; /* Download this (file). */
-  const char *actual_target = NULL;
   bool force_full_retrieve = false;
+  struct ftp_job *jobs = NULL;  /* files deferred to the pool */
+  int jobs_count = 0, jobs_size = 0, i;
+  bool pool_retr = ftp_pool_retr_usable (u, con);
 
   /* Increase the depth.  */
   ++depth;
@@ -2363,6 +4022,7 @@ ftp_retrieve_list (struct url *u, struct url *original_url,
     {
       char *ofile, *file_locale, *target_u, *target_locale;
       char *url_enc;
+      bool deferred = false;
 
       if (opt.quota && total_downloaded_bytes > opt.quota)
         {
@@ -2527,8 +4187,28 @@ Already have correct symlink %s -> %s\n\n"),
                        quote (f->name));
           break;
         case FT_PLAINFILE:
+          if (dlthis && pool_retr)
+            {
+              /* Retrieved with the others after the loop.  */
+              struct ftp_job *job;
+
+              if (jobs_count == jobs_size)
+                {
+                  jobs_size = jobs_size ? 2 * jobs_size : 16;
+                  jobs = xrealloc (jobs, jobs_size * sizeof (*jobs));
+                }
+              job = &jobs[jobs_count++];
+              xzero (*job);
+              job->kind = FTP_JOB_RETR;
+              job->dir = ftp_absolute_dir (u, con);
+              job->file = xstrdup (f->name);
+              job->local = xstrdup (target_locale);
+              job->f = f;
+              job->force_full = force_full_retrieve;
+              deferred = true;
+            }
           /* Call the retrieve loop.  */
-          if (dlthis)
+          else if (dlthis)
             {
               err = ftp_loop_internal (u, original_url, f, con, NULL,
                                        force_full_retrieve);
@@ -2542,48 +4222,8 @@ Already have correct symlink %s -> %s\n\n"),
         }       /* switch */
 
 
-      /* 2004-12-15 SMS.
-       * Set permissions _before_ setting the times, as setting the
-       * permissions changes the modified-time, at least on VMS.
-       * Also, use the opt.output_document name here, too, as
-       * appropriate.  (Do the test once, and save the result.)
-       */
-
-      set_local_file (&actual_target, target_locale);
-
-      /* If downloading a plain file, and the user requested it, then
-         set valid (non-zero) permissions. */
-      if (dlthis && (actual_target != NULL) &&
-       (f->type == FT_PLAINFILE) && opt.preserve_perm)
-        {
-          if (f->perms)
-            {
-              if (chmod (actual_target, f->perms))
-                logprintf (LOG_NOTQUIET,
-                           _("Failed to set permissions for %s.\n"),
-                           actual_target);
-            }
-          else
-            DEBUGP (("Unrecognized permissions for %s.\n", actual_target));
-        }
-
-      /* Set the time-stamp information to the local file.  Symlinks
-         are not to be stamped because it sets the stamp on the
-         original.  :( */
-      if (actual_target != NULL)
-        {
-          if (opt.useservertimestamps
-              && !(f->type == FT_SYMLINK && !opt.retr_symlinks)
-              && f->tstamp != -1
-              && dlthis
-              && file_exists_p (target_locale, NULL))
-            {
-              touch (actual_target, f->tstamp);
-            }
-          else if (f->tstamp == -1)
-            logprintf (LOG_NOTQUIET, _("%s: corrupt time-stamp.\n"),
-                       actual_target);
-        }
+      if (!deferred)
+        ftp_set_local_attributes (f, target_locale, dlthis);
 
       xfree (target_locale);
 
@@ -2599,6 +4239,19 @@ Already have correct symlink %s -> %s\n\n"),
       f = f->next;
     }
 
+  if (jobs_count)
+    {
+      if (!f)
+        err = ftp_retrieve_deferred (u, original_url, con, jobs, jobs_count);
+      for (i = 0; i < jobs_count; i++)
+        {
+          xfree (jobs[i].dir);
+          xfree (jobs[i].file);
+          xfree (jobs[i].local);
+        }
+      xfree (jobs);
+    }
+
   /* We do not want to call ftp_retrieve_dirs here */
   if (opt.recursive &&
       !(opt.reclevel != INFINITE_RECURSION && depth >= opt.reclevel))
@@ -2622,6 +4275,9 @@ ftp_retrieve_dirs (struct url *u, struct url *original_url,
   char *container = buf;
   int container_size = sizeof (buf);
 
+  if (ftp_pool_usable (u, con))
+    ftp_prefetch_listings (u, f, con);
+
   for (; f; f = f->next)
     {
       int size;
@@ -3017,6 +4673,23 @@ ftp_loop (struct url *u, struct url *original_url, char **local_file, int *dt,
     fd_close (con.csock);
   xfree (con.id);
   xfree (con.target);
+  xfree (con.listing);
+  xfree (con.cwd);
+  if (con.pool)
+    ftp_pool_close (con.pool);
+  if (con.listings)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (con.listings, &iter);
+           hash_table_iter_next (&iter); )
+        {
+          struct ftp_job *job = iter.value;
+          xfree (job->dir);
+          xfree (job->listing);
+          xfree (job);
+        }
+      hash_table_destroy (con.listings);
+    }
   return res;
 }
 
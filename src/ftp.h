@@ -68,6 +68,8 @@ enum prot_level
 #endif
 
 uerr_t ftp_response (int, char **);
+char *ftp_request (const char *, const char *);
+uerr_t ftp_pipeline (int, const char **, int);
 uerr_t ftp_greeting (int);
 uerr_t ftp_login (int, const char *, const char *);
 uerr_t ftp_port (int, int *);
@@ -87,7 +89,7 @@ uerr_t ftp_type (int, int);
 uerr_t ftp_cwd (int, const char *);
 uerr_t ftp_retr (int, const char *);
 uerr_t ftp_rest (int, wgint);
-uerr_t ftp_list (int, const char *, bool, bool, bool *);
+uerr_t ftp_list (int, const char *, bool, bool, bool, bool *, bool *);
 uerr_t ftp_syst (int, enum stype *, enum ustype *);
 uerr_t ftp_pwd (int, char **);
 uerr_t ftp_size (int, const char *, wgint *);
@@ -167,11 +169,21 @@ enum wget_ftp_fstatus
                                checked "LIST" after the first
                                "LIST -a" to handle the case of
                                file/folders named "-a". */
-  DATA_CHANNEL_SECURITY = 0x0020 /* Establish a secure data channel */
+  DATA_CHANNEL_SECURITY = 0x0020, /* Establish a secure data channel */
+  AVOID_MLSD    = 0x0040,   /* The server refused "MLSD" during
+                               this session, use "LIST".  */
+  AVOID_EPSV    = 0x0080,   /* The server refused "EPSV", go
+                               straight to "LPSV".  */
+  AVOID_EPRT    = 0x0100,   /* The server refused "EPRT", go
+                               straight to "LPRT".  */
+  AVOID_PIPELINING = 0x0200 /* The server lost pipelined commands,
+                               send them one at a time.  */
 };
 
 struct fileinfo *ftp_parse_ls (const char *, const enum stype);
 struct fileinfo *ftp_parse_ls_fp (FILE *, const enum stype);
+struct fileinfo *ftp_parse_ls_mem (const char *, size_t, const enum stype);
+struct fileinfo *ftp_parse_mlsd (const char *, size_t);
 void freefileinfo(struct fileinfo *);
 uerr_t ftp_loop (struct url *, struct url *, char **, int *, struct url *,
                  bool, bool);
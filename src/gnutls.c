@@ -484,6 +484,64 @@ wgnutls_peek (int fd, char *buf, int bufsize, void *arg, double timeout)
   return offset + read;
 }
 
+/* Receive or send once without waiting for the socket, for
+   fd_read_nb and fd_write_nb.  */
+
+static int
+wgnutls_transfer_nb (int fd, char *buf, int bufsize, void *arg,
+                     int *wait_for, bool writing)
+{
+  struct wgnutls_transport_context *ctx = arg;
+  int ret;
+
+  /* Let the blocking functions deal with renegotiation.  */
+  if (ctx->last_error == GNUTLS_E_REHANDSHAKE
+#if GNUTLS_VERSION_NUMBER >= 0x030604
+      || ctx->last_error == GNUTLS_E_REAUTH_REQUEST
+#endif
+      )
+    return writing ? wgnutls_write (fd, buf, bufsize, arg)
+                   : wgnutls_read (fd, buf, bufsize, arg, -1);
+
+  if (!writing && ctx->peeklen)
+    return wgnutls_read (fd, buf, bufsize, arg, 0);
+
+  set_socket_nonblocking (fd, true);
+  do
+    ret = writing ? gnutls_record_send (ctx->session, buf, bufsize)
+                  : gnutls_record_recv (ctx->session, buf, bufsize);
+  while (ret == GNUTLS_E_INTERRUPTED);
+  set_socket_nonblocking (fd, false);
+
+  if (ret == GNUTLS_E_AGAIN)
+    {
+      *wait_for = gnutls_record_get_direction (ctx->session)
+        ? WAIT_FOR_WRITE : WAIT_FOR_READ;
+      return FD_WOULDBLOCK;
+    }
+  ctx->last_error = ret;
+  return ret;
+}
+
+static int
+wgnutls_read_nb (int fd, char *buf, int bufsize, void *arg, int *wait_for)
+{
+  return wgnutls_transfer_nb (fd, buf, bufsize, arg, wait_for, false);
+}
+
+static int
+wgnutls_write_nb (int fd, char *buf, int bufsize, void *arg, int *wait_for)
+{
+  return wgnutls_transfer_nb (fd, buf, bufsize, arg, wait_for, true);
+}
+
+static bool
+wgnutls_pending (int fd _GL_UNUSED, void *arg)
+{
+  struct wgnutls_transport_context *ctx = arg;
+  return ctx->peeklen || gnutls_record_check_pending (ctx->session);
+}
+
 static const char *
 wgnutls_errstr (int fd _GL_UNUSED, void *arg)
 {
@@ -522,7 +580,9 @@ wgnutls_close (int fd, void *arg)
 static struct transport_implementation wgnutls_transport =
 {
   wgnutls_read, wgnutls_write, wgnutls_poll,
-  wgnutls_peek, wgnutls_errstr, wgnutls_close
+  wgnutls_peek, wgnutls_errstr, wgnutls_close,
+  wgnutls_read_nb, wgnutls_write_nb, wgnutls_pending,
+  NULL
 };
 
 static int
@@ -852,13 +912,21 @@ set_prio_default (gnutls_session_t session)
   return err;
 }
 
+/* Perform the SSL handshake on FD and register the GnuTLS session
+   with it.  If H2 is non-NULL, HTTP/2 is offered to the server through
+   ALPN, and *H2 is set to whether the server chose it.  */
+
 bool
-ssl_connect_wget (int fd, const char *hostname, int *continue_session)
+ssl_connect_wget (int fd, const char *hostname, int *continue_session,
+                  bool *h2)
 {
   struct wgnutls_transport_context *ctx;
   gnutls_session_t session;
   int err;
 
+  if (h2)
+    *h2 = false;
+
 #if GNUTLS_VERSION_NUMBER >= 0x030604
   // enable support of TLS1.3 post-handshake authentication
   gnutls_init (&session, GNUTLS_CLIENT | GNUTLS_POST_HANDSHAKE_AUTH);
@@ -933,6 +1001,25 @@ ssl_connect_wget (int fd, const char *hostname, int *continue_session)
         }
     }
 
+#if GNUTLS_VERSION_NUMBER >= 0x030200
+  if (h2)
+    {
+      static const gnutls_datum_t protocols[] = {
+        { (unsigned char *) "h2", 2 },
+        { (unsigned char *) "http/1.1", 8 },
+      };
+
+      err = gnutls_alpn_set_protocols (session, protocols,
+                                       countof (protocols), 0);
+      if (err < 0)
+        {
+          logprintf (LOG_NOTQUIET, "GnuTLS: %s\n", gnutls_strerror (err));
+          gnutls_deinit (session);
+          return false;
+        }
+    }
+#endif
+
   err = _do_handshake (session, fd, NULL);
 
   if (err < 0)
@@ -941,6 +1028,16 @@ ssl_connect_wget (int fd, const char *hostname, int *continue_session)
       return false;
     }
 
+#if GNUTLS_VERSION_NUMBER >= 0x030200
+  if (h2)
+    {
+      gnutls_datum_t selected;
+
+      if (gnutls_alpn_get_selected_protocol (session, &selected) == 0)
+        *h2 = selected.size == 2 && 0 == memcmp (selected.data, "h2", 2);
+    }
+#endif
+
   ctx = xnew0 (struct wgnutls_transport_context);
   ctx->session_data = xnew0 (gnutls_datum_t);
   ctx->session = session;
@@ -1014,13 +1111,17 @@ pkp_pin_peer_pubkey (gnutls_x509_crt_t cert, const char *pinnedpubkey)
       success = false;\
     }
 
-bool
-ssl_check_certificate (int fd, const char *host)
-{
-  struct wgnutls_transport_context *ctx = fd_transport_context (fd);
+/* Check the certificate SESSION was given by HOST, as
+   ssl_check_certificate does.  */
 
+static bool
+check_session_certificate (gnutls_session_t session, const char *host)
+{
   unsigned int status;
   int err;
+  const gnutls_datum_t *peers;
+  unsigned int npeers;
+  long cached;
 
   /* If the user has specified --no-check-cert, we still want to warn
      him about problems with the server's certificate.  */
@@ -1032,13 +1133,27 @@ ssl_check_certificate (int fd, const char *host)
   if (opt.check_cert == CHECK_CERT_QUIET && pinsuccess)
     return success;
 
-  err = gnutls_certificate_verify_peers2 (ctx->session, &status);
-  if (err < 0)
+  /* Verifying the chain is costly; reuse the status of a recent
+     verification of the same certificate for the same host.  */
+  peers = gnutls_certificate_get_peers (session, &npeers);
+  if (peers && npeers
+      && cert_verify_cache_get (host, peers[0].data, peers[0].size, &cached))
     {
-      logprintf (LOG_NOTQUIET, _("%s: No certificate presented by %s.\n"),
-                 severity, quotearg_style (escape_quoting_style, host));
-      success = false;
-      goto out;
+      DEBUGP (("Reusing the verification of %s's certificate.\n", host));
+      status = (unsigned int) cached;
+    }
+  else
+    {
+      err = gnutls_certificate_verify_peers2 (session, &status);
+      if (err < 0)
+        {
+          logprintf (LOG_NOTQUIET, _("%s: No certificate presented by %s.\n"),
+                     severity, quotearg_style (escape_quoting_style, host));
+          success = false;
+          goto out;
+        }
+      if (peers && npeers)
+        cert_verify_cache_put (host, peers[0].data, peers[0].size, status);
     }
 
   _CHECK_CERT (GNUTLS_CERT_INVALID, _("%s: The certificate of %s is not trusted.\n"));
@@ -1049,7 +1164,7 @@ ssl_check_certificate (int fd, const char *host)
   _CHECK_CERT (GNUTLS_CERT_NOT_ACTIVATED, _("%s: The certificate of %s is not yet activated.\n"));
   _CHECK_CERT (GNUTLS_CERT_EXPIRED, _("%s: The certificate of %s has expired.\n"));
 
-  if (gnutls_certificate_type_get (ctx->session) == GNUTLS_CRT_X509)
+  if (gnutls_certificate_type_get (session) == GNUTLS_CRT_X509)
     {
       time_t now = time (NULL);
       gnutls_x509_crt_t cert;
@@ -1065,7 +1180,7 @@ ssl_check_certificate (int fd, const char *host)
           goto out;
         }
 
-      cert_list = gnutls_certificate_get_peers (ctx->session, &cert_list_size);
+      cert_list = gnutls_certificate_get_peers (session, &cert_list_size);
       if (!cert_list)
         {
           logprintf (LOG_NOTQUIET, _("No certificate found\n"));
@@ -1120,3 +1235,53 @@ ssl_check_certificate (int fd, const char *host)
   /* never return true if pinsuccess fails */
   return !pinsuccess ? false : (opt.check_cert == CHECK_CERT_ON ? success : true);
 }
+
+bool
+ssl_check_certificate (int fd, const char *host)
+{
+  struct wgnutls_transport_context *ctx = fd_transport_context (fd);
+
+  return check_session_certificate (ctx->session, host);
+}
+
+#ifdef HAVE_HTTP3
+/* Prepare SESSION, a client session whose handshake is carried by a
+   QUIC connection to HOST, with the certificates and the server name
+   of the sessions ssl_connect_wget makes.  QUIC takes TLS 1.3, without
+   the middlebox compatibility mode.  */
+
+bool
+ssl_quic_prepare (gnutls_session_t session, const char *host)
+{
+  int err;
+
+  if (! is_valid_ip_address (host))
+    {
+      const char *sni_hostname = _sni_hostname (host);
+
+      gnutls_server_name_set (session, GNUTLS_NAME_DNS, sni_hostname,
+                              strlen (sni_hostname));
+      xfree (sni_hostname);
+    }
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, credentials);
+
+  err = gnutls_priority_set_direct (session,
+                                    "NORMAL:-VERS-ALL:+VERS-TLS1.3:"
+                                    "%DISABLE_TLS13_COMPAT_MODE", NULL);
+  if (err < 0)
+    {
+      logprintf (LOG_NOTQUIET, "GnuTLS: %s\n", gnutls_strerror (err));
+      return false;
+    }
+  return true;
+}
+
+/* Check the certificate HOST presented in SESSION, a session prepared
+   with ssl_quic_prepare.  */
+
+bool
+ssl_quic_check_certificate (gnutls_session_t session, const char *host)
+{
+  return check_session_certificate (session, host);
+}
+#endif /* HAVE_HTTP3 */
@@ -29,7 +29,8 @@ shall include the source code for the parts of OpenSSL used as well
 as that of the covered work.  */
 
 /* With -DSTANDALONE, this file can be compiled outside Wget source
-   tree.  To test, also use -DTEST.  */
+   tree.  To test, also use -DTEST.  To time the table operations,
+   use -DBENCHMARK instead.  */
 
 #ifndef STANDALONE
 # include "wget.h"
@@ -44,8 +45,11 @@ as that of the covered work.  */
 #ifndef STANDALONE
 /* Get Wget's utility headers. */
 # include "utils.h"
+# include "stats.h"
 #else
 /* Make do without them. */
+# define xmalloc malloc
+# define xcalloc calloc
 # define xnew(type) (xmalloc (sizeof (type)))
 # define xnew0(type) (xcalloc (1, sizeof (type)))
 # define xnew_array(type, len) (xmalloc ((len) * sizeof (type)))
@@ -57,6 +61,7 @@ as that of the covered work.  */
 # include <ctype.h>
 # define c_tolower(x) tolower ((unsigned char) (x))
 # include <stdint.h>
+# define STATS_ADD(entry, n) do { } while (0)
 #endif
 
 #include "hash.h"
@@ -107,41 +112,45 @@ as that of the covered work.  */
 
 /* IMPLEMENTATION:
 
-   The hash table is implemented as an open-addressed table with
-   linear probing collision resolution.
-
-   The above means that all the cells (each cell containing a key and
-   a value pointer) are stored in a contiguous array.  Array position
-   of each cell is determined by the hash value of its key and the
-   size of the table: location := hash(key) % size.  If two different
-   keys end up on the same position (collide), the one that came
-   second is stored in the first unoccupied cell that follows it.
-   This collision resolution technique is called "linear probing".
-
-   There are more advanced collision resolution methods (quadratic
-   probing, double hashing), but we don't use them because they incur
-   more non-sequential access to the array, which results in worse CPU
-   cache behavior.  Linear probing works well as long as the
-   count/size ratio (fullness) is kept below 75%.  We make sure to
-   grow and rehash the table whenever this threshold is exceeded.
-
-   Collisions complicate deletion because simply clearing a cell
-   followed by previously collided entries would cause those neighbors
-   to not be picked up by find_cell later.  One solution is to leave a
-   "tombstone" marker instead of clearing the cell, and another is to
-   recalculate the positions of adjacent cells.  We take the latter
-   approach because it results in less bookkeeping garbage and faster
-   retrieval at the (slight) expense of deletion.  */
-
-/* Maximum allowed fullness: when hash table's fullness exceeds this
-   value, the table is resized.  */
-#define HASH_MAX_FULLNESS 0.75
-
-/* The hash table size is multiplied by this factor (and then rounded
-   to the next prime) with each resize.  This guarantees infrequent
-   resizes.  */
+   The hash table is an open-addressed table in the style of the
+   "Swiss tables": besides the array of cells (each cell containing a
+   key and a value pointer), it keeps a control byte per cell, which
+   tells whether the cell is empty, deleted, or occupied, and in the
+   latter case holds 7 bits of the hash of its key.  The hash of each
+   key is also kept in the table, so that growing the table doesn't
+   call the hash function again.
+
+   The size of the table is a power of two, and the cells are split in
+   groups of 8, whose control bytes are read as a single 64-bit word.
+   A key is looked for starting with the group given by its hash, and
+   in the groups that follow it: the bytes of a group that match the
+   7 bits of the hash are found at once with a few arithmetic
+   operations on the control word, and only the keys of those cells
+   are compared with the test function.  The search stops at the
+   first group with an empty cell.  Keeping whole groups in a word is
+   portable and works about as well with Wget's small tables as
+   vector instructions would.
+
+   Removed entries leave a "deleted" marker behind, unless their group
+   has an empty cell, in which case no search can have gone past it
+   and the cell is simply emptied.  The markers are cleared when the
+   table is rebuilt, which happens when the occupied and deleted cells
+   together exceed the maximum fullness.  Since entries never move
+   otherwise, the entry being mapped by hash_table_for_each can be
+   removed safely.  */
+
+/* Maximum allowed fullness: when the number of occupied and deleted
+   cells exceeds this fraction of the size, the table is rebuilt.  */
+#define HASH_MAX_FULLNESS 0.875
+
+/* The hash table size is multiplied by this factor with each resize.
+   This guarantees infrequent resizes.  */
 #define HASH_RESIZE_FACTOR 2
 
+/* The number of cells in a group, i.e. of control bytes in a 64-bit
+   word.  This is also the smallest size of a table.  */
+#define GROUP_SIZE 8
+
 struct cell {
   void *key;
   void *value;
@@ -155,93 +164,114 @@ struct hash_table {
   testfun_t test_function;
 
   struct cell *cells;           /* contiguous array of cells. */
-  int size;                     /* size of the array. */
+  uint64_t *ctrl;               /* control bytes of the cells, 8 in
+                                   each word. */
+  uint32_t *hashes;             /* hashes of the keys of the cells. */
+  int size;                     /* size of the arrays, a power of 2. */
 
   int count;                    /* number of occupied entries. */
-  int resize_threshold;         /* after size exceeds this number of
-                                   entries, resize the table.  */
-  int prime_offset;             /* the offset of the current prime in
-                                   the prime table. */
+  int deleted;                  /* number of deleted entries. */
+  int resize_threshold;         /* after count + deleted exceeds this
+                                   number, rebuild the table.  */
 };
 
-/* We use the all-bits-set constant (INVALID_PTR) marker to mean that
-   a cell is empty.  It is unaligned and therefore illegal as a
-   pointer.  INVALID_PTR_CHAR (0xff) is the single-character constant
-   used to initialize the entire cells array as empty.
+/* The control byte of a cell is CTRL_EMPTY or CTRL_DELETED, or, when
+   the cell is occupied, the top 7 bits of the hash of its key, which
+   leaves its high bit clear.  */
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
 
-   The all-bits-set value is a better choice than NULL because it
-   allows the use of NULL/0 keys.  Since the keys are either integers
-   or pointers, the only key that cannot be used is the integer value
-   -1.  This is acceptable because it still allows the use of
-   nonnegative integer keys.  */
+#define BYTES_01 0x0101010101010101ULL
+#define BYTES_80 0x8080808080808080ULL
 
-#define INVALID_PTR ((void *) ~(uintptr_t) 0)
-#ifndef UCHAR_MAX
-# define UCHAR_MAX 0xff
-#endif
-#define INVALID_PTR_CHAR UCHAR_MAX
+/* The control byte of cell I.  */
+#define CTRL(ht, i) ((unsigned char) ((ht)->ctrl[(i) / GROUP_SIZE]         \
+                                      >> (i) % GROUP_SIZE * 8))
 
-/* Whether the cell C is occupied (non-empty). */
-#define CELL_OCCUPIED(c) ((c)->key != INVALID_PTR)
+/* Whether the cell I is occupied (non-empty). */
+#define CELL_OCCUPIED(ht, i) (!(CTRL (ht, i) & 0x80))
 
-/* Clear the cell C, i.e. mark it as empty (unoccupied). */
-#define CLEAR_CELL(c) ((c)->key = INVALID_PTR)
+static inline void
+set_ctrl (struct hash_table *ht, int i, unsigned char c)
+{
+  int shift = i % GROUP_SIZE * 8;
+  uint64_t *w = &ht->ctrl[i / GROUP_SIZE];
+  *w = (*w & ~((uint64_t) 0xff << shift)) | (uint64_t) c << shift;
+}
 
-/* "Next" cell is the cell following C, but wrapping back to CELLS
-   when C would reach CELLS+SIZE.  */
-#define NEXT_CELL(c, cells, size) (c != cells + (size - 1) ? c + 1 : cells)
+/* In the control word of a group, select the high bits of the bytes
+   equal to C (with a rare false positive, which the caller weeds out
+   by comparing the hashes), of the empty bytes, and of the bytes that
+   are empty or deleted.  */
 
-/* Loop over occupied cells starting at C, terminating the loop when
-   an empty cell is encountered.  */
-#define FOREACH_OCCUPIED_ADJACENT(c, cells, size)                               \
-  for (; CELL_OCCUPIED (c); c = NEXT_CELL (c, cells, size))
+static inline uint64_t
+group_match (uint64_t group, unsigned char c)
+{
+  uint64_t x = group ^ (BYTES_01 * c);
+  return (x - BYTES_01) & ~x & BYTES_80;
+}
 
-/* Return the position of KEY in hash table SIZE large, hash function
-   being HASHFUN.  */
-#define HASH_POSITION(key, hashfun, size) ((hashfun) (key) % size)
+#define GROUP_MATCH_EMPTY(group) ((group) & ~((group) << 6) & BYTES_80)
+#define GROUP_MATCH_FREE(group) ((group) & BYTES_80)
 
-/* Find a prime near, but greater than or equal to SIZE.  The primes
-   are looked up from a table with a selection of primes convenient
-   for this purpose.
+/* Return the position in its group of the lowest byte selected in
+   MATCH, and clear it from MATCH.  */
 
-   PRIME_OFFSET is a minor optimization: it specifies start position
-   for the search for the large enough prime.  The final offset is
-   stored in the same variable.  That way the list of primes does not
-   have to be scanned from the beginning each time around.  */
+static inline int
+group_next (uint64_t *match)
+{
+  uint64_t m = *match;
+  int pos;
 
-static int
-prime_size (int size, int *prime_offset)
-{
-  static const int primes[] = {
-    13, 19, 29, 41, 59, 79, 107, 149, 197, 263, 347, 457, 599, 787, 1031,
-    1361, 1777, 2333, 3037, 3967, 5167, 6719, 8737, 11369, 14783,
-    19219, 24989, 32491, 42257, 54941, 71429, 92861, 120721, 156941,
-    204047, 265271, 344857, 448321, 582821, 757693, 985003, 1280519,
-    1664681, 2164111, 2813353, 3657361, 4754591, 6180989, 8035301,
-    10445899, 13579681, 17653589, 22949669, 29834603, 38784989,
-    50420551, 65546729, 85210757, 110774011, 144006217, 187208107,
-    243370577, 316381771, 411296309, 534685237, 695090819, 903618083,
-    1174703521, 1527114613, 1837299131, 2147483647
-  };
-  size_t i;
-
-  for (i = *prime_offset; i < countof (primes); i++)
-    if (primes[i] >= size)
-      {
-        /* Set the offset to the next prime.  That is safe because,
-           next time we are called, it will be with a larger SIZE,
-           which means we could never return the same prime anyway.
-           (If that is not the case, the caller can simply reset
-           *prime_offset.)  */
-        *prime_offset = i + 1;
-        return primes[i];
-      }
+  *match = m & (m - 1);
+#if defined __GNUC__ && __GNUC__ >= 4
+  pos = __builtin_ctzll (m) / 8;
+#else
+  for (pos = 0; !(m & 0x80); m >>= 8)
+    pos++;
+#endif
+  return pos;
+}
+
+/* Return the hash of KEY as the table keeps it.  The hash functions
+   used with Wget's tables are not all good at spreading their bits,
+   so they are mixed with the finalizer of MurmurHash3.  */
 
-  abort ();
+#ifdef __clang__
+__attribute__((no_sanitize("integer")))
+#endif
+static inline uint32_t
+table_hash (const struct hash_table *ht, const void *key)
+{
+  uint64_t h = ht->hash_function (key);
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (uint32_t) h;
 }
 
+#define HASH_CTRL(h) ((unsigned char) ((h) >> 25))
+
 static int cmp_pointer (const void *, const void *);
 
+/* Allocate the arrays of HT for SIZE cells, all empty.  */
+
+static void
+alloc_cells (struct hash_table *ht, int size)
+{
+  ht->size = size;
+  ht->resize_threshold = (int) (size * HASH_MAX_FULLNESS);
+  ht->cells = xnew_array (struct cell, size);
+  ht->hashes = xnew_array (uint32_t, size);
+  ht->ctrl = xnew_array (uint64_t, size / GROUP_SIZE);
+  memset (ht->ctrl, CTRL_EMPTY, size / GROUP_SIZE * sizeof (uint64_t));
+  ht->count = 0;
+  ht->deleted = 0;
+}
+
 /* Create a hash table with hash function HASH_FUNCTION and test
    function TEST_FUNCTION.  The table is empty (its count is 0), but
    pre-allocated to store at least ITEMS items.
@@ -254,9 +284,8 @@ static int cmp_pointer (const void *, const void *);
 
    Note that hash tables grow dynamically regardless of ITEMS.  The
    only use of ITEMS is to preallocate the table and avoid unnecessary
-   dynamic regrows.  Don't bother making ITEMS prime because it's not
-   used as size unchanged.  To start with a small table that grows as
-   needed, simply specify zero ITEMS.
+   dynamic regrows.  To start with a small table that grows as needed,
+   simply specify zero ITEMS.
 
    If hash and test callbacks are not specified, identity mapping is
    assumed, i.e. pointer values are used for key comparison.  (Common
@@ -271,31 +300,21 @@ hash_table_new (int items,
                 unsigned long (*hash_function) (const void *),
                 int (*test_function) (const void *, const void *))
 {
-  int size;
+  int size = GROUP_SIZE;
   struct hash_table *ht = xnew (struct hash_table);
 
   ht->hash_function = hash_function ? hash_function : hash_pointer;
   ht->test_function = test_function ? test_function : cmp_pointer;
 
-  /* If the size of struct hash_table ever becomes a concern, this
-     field can go.  (Wget doesn't create many hashes.)  */
-  ht->prime_offset = 0;
-
   /* Calculate the size that ensures that the table will store at
      least ITEMS keys without the need to resize.  */
-  size = (int) (1 + items / HASH_MAX_FULLNESS);
-  size = prime_size (size, &ht->prime_offset);
-  ht->size = size;
-  ht->resize_threshold = (int) (size * HASH_MAX_FULLNESS);
-  /*assert (ht->resize_threshold >= items);*/
-
-  ht->cells = xnew_array (struct cell, ht->size);
-
-  /* Mark cells as empty.  We use 0xff rather than 0 to mark empty
-     keys because it allows us to use NULL/0 as keys.  */
-  memset (ht->cells, INVALID_PTR_CHAR, size * sizeof (struct cell));
-
-  ht->count = 0;
+  while (size * HASH_MAX_FULLNESS < items + 1)
+    {
+      if (size > INT_MAX / 2)
+        abort ();
+      size *= 2;
+    }
+  alloc_cells (ht, size);
 
   return ht;
 }
@@ -306,25 +325,63 @@ void
 hash_table_destroy (struct hash_table *ht)
 {
   xfree (ht->cells);
+  xfree (ht->hashes);
+  xfree (ht->ctrl);
   xfree (ht);
 }
 
 /* The heart of most functions in this file -- find the cell whose
-   KEY is equal to key, using linear probing.  Returns the cell
-   that matches KEY, or the first empty cell if none matches.  */
+   key is equal to KEY, whose hash is H.  Returns the index of the
+   cell, or -1 if none matches.  */
 
-static inline struct cell *
-find_cell (const struct hash_table *ht, const void *key)
+static inline int
+find_cell (const struct hash_table *ht, const void *key, uint32_t h)
 {
-  struct cell *cells = ht->cells;
-  int size = ht->size;
-  struct cell *c = cells + HASH_POSITION (key, ht->hash_function, size);
-  testfun_t equals = ht->test_function;
+  int groups = ht->size / GROUP_SIZE;
+  int g = (h & (ht->size - 1)) / GROUP_SIZE;
+  unsigned char c = HASH_CTRL (h);
+  int probes = 1;
+
+  for (;;)
+    {
+      uint64_t group = ht->ctrl[g];
+      uint64_t match = group_match (group, c);
 
-  FOREACH_OCCUPIED_ADJACENT (c, cells, size)
-    if (equals (key, c->key))
-      break;
-  return c;
+      while (match)
+        {
+          int i = g * GROUP_SIZE + group_next (&match);
+          if (ht->hashes[i] == h && ht->test_function (key, ht->cells[i].key))
+            {
+              STATS_ADD (STATS_HASH_LOOKUP, probes);
+              return i;
+            }
+        }
+      if (GROUP_MATCH_EMPTY (group))
+        {
+          STATS_ADD (STATS_HASH_LOOKUP, probes);
+          return -1;
+        }
+      g = (g + 1) & (groups - 1);
+      probes++;
+    }
+}
+
+/* Return the index of the first empty or deleted cell where a key
+   whose hash is H can go.  */
+
+static inline int
+find_free_cell (const struct hash_table *ht, uint32_t h)
+{
+  int groups = ht->size / GROUP_SIZE;
+  int g = (h & (ht->size - 1)) / GROUP_SIZE;
+
+  for (;;)
+    {
+      uint64_t match = GROUP_MATCH_FREE (ht->ctrl[g]);
+      if (match)
+        return g * GROUP_SIZE + group_next (&match);
+      g = (g + 1) & (groups - 1);
+    }
 }
 
 /* Get the value that corresponds to the key KEY in the hash table HT.
@@ -337,9 +394,9 @@ find_cell (const struct hash_table *ht, const void *key)
 void *
 hash_table_get (const struct hash_table *ht, const void *key)
 {
-  struct cell *c = find_cell (ht, key);
-  if (CELL_OCCUPIED (c))
-    return c->value;
+  int i = find_cell (ht, key, table_hash (ht, key));
+  if (i >= 0)
+    return ht->cells[i].value;
   else
     return NULL;
 }
@@ -351,13 +408,13 @@ int
 hash_table_get_pair (const struct hash_table *ht, const void *lookup_key,
                      void *orig_key, void *value)
 {
-  struct cell *c = find_cell (ht, lookup_key);
-  if (CELL_OCCUPIED (c))
+  int i = find_cell (ht, lookup_key, table_hash (ht, lookup_key));
+  if (i >= 0)
     {
       if (orig_key)
-        *(void **)orig_key = c->key;
+        *(void **)orig_key = ht->cells[i].key;
       if (value)
-        *(void **)value = c->value;
+        *(void **)value = ht->cells[i].value;
       return 1;
     }
   else
@@ -369,23 +426,26 @@ hash_table_get_pair (const struct hash_table *ht, const void *lookup_key,
 int
 hash_table_contains (const struct hash_table *ht, const void *key)
 {
-  struct cell *c = find_cell (ht, key);
-  return CELL_OCCUPIED (c);
+  return find_cell (ht, key, table_hash (ht, key)) >= 0;
 }
 
-/* Grow hash table HT as necessary, and rehash all the key-value
-   mappings.  */
+/* Rebuild hash table HT, growing it if it is really full rather than
+   full of deleted cells, and put all the key-value mappings back in
+   place of their stored hashes.  */
 
 static void
 grow_hash_table (struct hash_table *ht)
 {
-  hashfun_t hasher = ht->hash_function;
-  struct cell *old_cells = ht->cells;
-  struct cell *old_end   = ht->cells + ht->size;
-  struct cell *c, *cells;
-  int newsize;
+  struct hash_table old = *ht;
+  int newsize = ht->size;
+  int i;
 
-  newsize = prime_size (ht->size * HASH_RESIZE_FACTOR, &ht->prime_offset);
+  if (ht->count >= ht->resize_threshold / 2)
+    {
+      if (newsize > INT_MAX / HASH_RESIZE_FACTOR)
+        abort ();
+      newsize *= HASH_RESIZE_FACTOR;
+    }
 #if 0
   printf ("growing from %d to %d; fullness %.2f%% to %.2f%%\n",
           ht->size, newsize,
@@ -393,27 +453,26 @@ grow_hash_table (struct hash_table *ht)
           100.0 * ht->count / newsize);
 #endif
 
-  ht->size = newsize;
-  ht->resize_threshold = (int) (newsize * HASH_MAX_FULLNESS);
-
-  cells = xnew_array (struct cell, newsize);
-  memset (cells, INVALID_PTR_CHAR, newsize * sizeof (struct cell));
-  ht->cells = cells;
+  alloc_cells (ht, newsize);
+  ht->count = old.count;
 
-  for (c = old_cells; c < old_end; c++)
-    if (CELL_OCCUPIED (c))
+  for (i = 0; i < old.size; i++)
+    if (CELL_OCCUPIED (&old, i))
       {
-        struct cell *new_c;
         /* We don't need to test for uniqueness of keys because they
            come from the hash table and are therefore known to be
            unique.  */
-        new_c = cells + HASH_POSITION (c->key, hasher, newsize);
-        FOREACH_OCCUPIED_ADJACENT (new_c, cells, newsize)
-          ;
-        *new_c = *c;
+        uint32_t h = old.hashes[i];
+        int j = find_free_cell (ht, h);
+
+        ht->cells[j] = old.cells[i];
+        ht->hashes[j] = h;
+        set_ctrl (ht, j, HASH_CTRL (h));
       }
 
-  xfree (old_cells);
+  xfree (old.cells);
+  xfree (old.hashes);
+  xfree (old.ctrl);
 }
 
 /* Put VALUE in the hash table HT under the key KEY.  This regrows the
@@ -422,27 +481,30 @@ grow_hash_table (struct hash_table *ht)
 void
 hash_table_put (struct hash_table *ht, const void *key, const void *value)
 {
-  struct cell *c = find_cell (ht, key);
-  if (CELL_OCCUPIED (c))
+  uint32_t h = table_hash (ht, key);
+  int i = find_cell (ht, key, h);
+  if (i >= 0)
     {
       /* update existing item */
-      c->key   = (void *)key; /* const? */
-      c->value = (void *)value;
+      ht->cells[i].key   = (void *)key; /* const? */
+      ht->cells[i].value = (void *)value;
       return;
     }
 
   /* If adding the item would make the table exceed max. fullness,
-     grow the table first.  */
-  if (ht->count >= ht->resize_threshold)
-    {
-      grow_hash_table (ht);
-      c = find_cell (ht, key);
-    }
+     rebuild the table first.  */
+  if (ht->count + ht->deleted >= ht->resize_threshold)
+    grow_hash_table (ht);
 
   /* add new item */
+  i = find_free_cell (ht, h);
+  if (CTRL (ht, i) == CTRL_DELETED)
+    --ht->deleted;
   ++ht->count;
-  c->key   = (void *)key;       /* const? */
-  c->value = (void *)value;
+  ht->cells[i].key   = (void *)key;       /* const? */
+  ht->cells[i].value = (void *)value;
+  ht->hashes[i] = h;
+  set_ctrl (ht, i, HASH_CTRL (h));
 }
 
 /* Remove KEY->value mapping from HT.  Return 0 if there was no such
@@ -451,45 +513,21 @@ hash_table_put (struct hash_table *ht, const void *key, const void *value)
 int
 hash_table_remove (struct hash_table *ht, const void *key)
 {
-  struct cell *c = find_cell (ht, key);
-  if (!CELL_OCCUPIED (c))
+  int i = find_cell (ht, key, table_hash (ht, key));
+  if (i < 0)
     return 0;
+
+  /* A search only goes past a group without empty cells, so a cell of
+     a group with one can be emptied right away.  */
+  if (GROUP_MATCH_EMPTY (ht->ctrl[i / GROUP_SIZE]))
+    set_ctrl (ht, i, CTRL_EMPTY);
   else
     {
-      int size = ht->size;
-      struct cell *cells = ht->cells;
-      hashfun_t hasher = ht->hash_function;
-
-      CLEAR_CELL (c);
-      --ht->count;
-
-      /* Rehash all the entries following C.  The alternative
-         approach is to mark the entry as deleted, i.e. create a
-         "tombstone".  That speeds up removal, but leaves a lot of
-         garbage and slows down hash_table_get and hash_table_put.  */
-
-      c = NEXT_CELL (c, cells, size);
-      FOREACH_OCCUPIED_ADJACENT (c, cells, size)
-        {
-          const void *key2 = c->key;
-          struct cell *c_new;
-
-          /* Find the new location for the key. */
-          c_new = cells + HASH_POSITION (key2, hasher, size);
-          FOREACH_OCCUPIED_ADJACENT (c_new, cells, size)
-            if (key2 == c_new->key)
-              /* The cell C (key2) is already where we want it (in
-                 C_NEW's "chain" of keys.)  */
-              goto next_rehash;
-
-          *c_new = *c;
-          CLEAR_CELL (c);
-
-        next_rehash:
-          ;
-        }
-      return 1;
+      set_ctrl (ht, i, CTRL_DELETED);
+      ++ht->deleted;
     }
+  --ht->count;
+  return 1;
 }
 
 /* Clear HT of all entries.  After calling this function, the count
@@ -499,8 +537,9 @@ hash_table_remove (struct hash_table *ht, const void *key)
 void
 hash_table_clear (struct hash_table *ht)
 {
-  memset (ht->cells, INVALID_PTR_CHAR, ht->size * sizeof (struct cell));
+  memset (ht->ctrl, CTRL_EMPTY, ht->size / GROUP_SIZE * sizeof (uint64_t));
   ht->count = 0;
+  ht->deleted = 0;
 }
 
 /* Call FN for each entry in HT.  FN is called with three arguments:
@@ -510,29 +549,18 @@ hash_table_clear (struct hash_table *ht)
    It is undefined what happens if you add or remove entries in the
    hash table while hash_table_for_each is running.  The exception is
    the entry you're currently mapping over; you may call
-   hash_table_put or hash_table_remove on that entry's key.  That is
-   also the reason why this function cannot be implemented in terms of
-   hash_table_iterate.  */
+   hash_table_put or hash_table_remove on that entry's key.  */
 
 void
 hash_table_for_each (struct hash_table *ht,
                      int (*fn) (void *, void *, void *), void *arg)
 {
-  struct cell *c = ht->cells;
-  struct cell *end = ht->cells + ht->size;
+  int i;
 
-  for (; c < end; c++)
-    if (CELL_OCCUPIED (c))
-      {
-        void *key;
-      repeat:
-        key = c->key;
-        if (fn (key, c->value, arg))
-          return;
-        /* hash_table_remove might have moved the adjacent cells. */
-        if (c->key != key && CELL_OCCUPIED (c))
-          goto repeat;
-      }
+  for (i = 0; i < ht->size; i++)
+    if (CELL_OCCUPIED (ht, i))
+      if (fn (ht->cells[i].key, ht->cells[i].value, arg))
+        return;
 }
 
 /* Initiate iteration over HT.  Entries are obtained with
@@ -548,8 +576,8 @@ hash_table_for_each (struct hash_table *ht,
 void
 hash_table_iterate (struct hash_table *ht, hash_table_iterator *iter)
 {
-  iter->pos = ht->cells;
-  iter->end = ht->cells + ht->size;
+  iter->table = ht;
+  iter->pos = 0;
 }
 
 /* Get the next hash table entry.  ITER is an iterator object
@@ -564,16 +592,18 @@ hash_table_iterate (struct hash_table *ht, hash_table_iterator *iter)
 int
 hash_table_iter_next (hash_table_iterator *iter)
 {
-  struct cell *c = iter->pos;
-  struct cell *end = iter->end;
-  for (; c < end; c++)
-    if (CELL_OCCUPIED (c))
+  struct hash_table *ht = iter->table;
+  int i;
+
+  for (i = iter->pos; i < ht->size; i++)
+    if (CELL_OCCUPIED (ht, i))
       {
-        iter->key = c->key;
-        iter->value = c->value;
-        iter->pos = c + 1;
+        iter->key = ht->cells[i].key;
+        iter->value = ht->cells[i].value;
+        iter->pos = i + 1;
         return 1;
       }
+  iter->pos = ht->size;
   return 0;
 }
 
@@ -628,12 +658,46 @@ hash_table_count (const struct hash_table *ht)
  *
  */
 
-/* Base 31 hash function.  Taken from Gnome's glib, modified to use
-   standard C types.
+/* String hash function, taking the string 8 bytes at a time.  Each
+   word goes through a round of XXH64, and the result through its
+   final avalanche.  We used to use glib's base 31 hash, one byte at a
+   time, which made the long URL keys of Wget's big tables costly to
+   hash.
+
+   The words are read with memcpy after strlen has found the end of
+   the string, so that nothing is read past it.  They are read in the
+   native byte order, which makes the hash differ between machines,
+   but it is never stored.  */
 
-   We used to use the popular hash function from the Dragon Book, but
-   this one seems to perform much better, both by being faster and by
-   generating less collisions.  */
+#define XXH_PRIME64_1 0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3 0x165667b19e3779f9ULL
+
+#ifdef __clang__
+__attribute__((no_sanitize("integer")))
+#endif
+static inline uint64_t
+hash_round (uint64_t h, uint64_t word)
+{
+  h += word * XXH_PRIME64_2;
+  h = h << 31 | h >> 33;
+  return h * XXH_PRIME64_1;
+}
+
+#ifdef __clang__
+__attribute__((no_sanitize("integer")))
+#endif
+static inline unsigned long
+hash_finish (uint64_t h)
+{
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  /* unsigned long is 32 bits wide on Windows.  */
+  return (unsigned long) h;
+}
 
 #ifdef __clang__
 __attribute__((no_sanitize("integer")))
@@ -642,13 +706,23 @@ static unsigned long
 hash_string (const void *key)
 {
   const char *p = key;
-  unsigned int h = *p;
+  size_t len = strlen (p);
+  uint64_t h = XXH_PRIME64_3 ^ len;
+  uint64_t word;
 
-  if (h)
-    for (p += 1; *p != '\0'; p++)
-      h = (h << 5) - h + *p;
+  for (; len >= 8; len -= 8, p += 8)
+    {
+      memcpy (&word, p, 8);
+      h = hash_round (h, word);
+    }
+  if (len)
+    {
+      word = 0;
+      memcpy (&word, p, len);
+      h = hash_round (h, word);
+    }
 
-  return h;
+  return hash_finish (h);
 }
 
 /* Frontend for strcmp usable for hash tables. */
@@ -674,7 +748,9 @@ make_string_hash_table (int items)
  *
  */
 
-/* Like hash_string, but produce the same hash regardless of the case. */
+/* Like hash_string, but produce the same hash regardless of the case.
+   This one is still glib's base 31 hash, one byte at a time: taking
+   the key a word at a time and lowercasing each word made it slower.  */
 
 #ifdef __clang__
 __attribute__((no_sanitize("integer")))
@@ -811,3 +887,153 @@ main (void)
   return 0;
 }
 #endif /* TEST */
+
+#ifdef BENCHMARK
+
+#include <time.h>
+
+/* Time the hash functions for strings and the operations on a string
+   table, over N synthetic URLs or over the lines of a file, such as a
+   list of the URLs of a crawl:
+
+     cc -O2 -DSTANDALONE -DBENCHMARK hash.c -o hash-bench
+     ./hash-bench urls.txt  */
+
+static double
+seconds_since (clock_t start)
+{
+  return (double) (clock () - start) / CLOCKS_PER_SEC;
+}
+
+/* The byte-at-a-time base 31 hash used before, to compare with.  */
+
+static unsigned long
+hash_string_base31 (const void *key)
+{
+  const char *p = key;
+  unsigned int h = *p;
+
+  if (h)
+    for (p += 1; *p != '\0'; p++)
+      h = (h << 5) - h + *p;
+  return h;
+}
+
+static int
+cmp_hash (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Time hashing the N distinct KEYS with HASH, 10 million keys in
+   all, and count the keys whose 32-bit hash is that of another key.  */
+
+static void
+bench_hash (const char *name, unsigned long (*hash) (const void *),
+            char **keys, int n)
+{
+  uint32_t *hashes = xnew_array (uint32_t, n);
+  unsigned long sum = 0;
+  int collisions = 0;
+  clock_t start;
+  int i, pass, passes = 1 + 10000000 / n;
+
+  start = clock ();
+  for (pass = 0; pass < passes; pass++)
+    for (i = 0; i < n; i++)
+      sum += hash (keys[i]);
+  printf ("%-22s %.3f s", name, seconds_since (start));
+
+  for (i = 0; i < n; i++)
+    hashes[i] = (uint32_t) hash (keys[i]);
+  qsort (hashes, n, sizeof (uint32_t), cmp_hash);
+  for (i = 1; i < n; i++)
+    if (hashes[i] == hashes[i - 1])
+      collisions++;
+  printf ("  %d collisions  (%lu)\n", collisions, sum & 1);
+  free (hashes);
+}
+
+int
+main (int argc, char **argv)
+{
+  FILE *fp = argc > 1 ? fopen (argv[1], "r") : NULL;
+  int n = 0, max = fp ? 1024 : (argc > 1 ? atoi (argv[1]) : 1000000);
+  char **keys = xnew_array (char *, max);
+  char **absent;
+  struct hash_table *ht = make_string_hash_table (0);
+  hash_table_iterator iter;
+  char buf[4096];
+  long found = 0;
+  clock_t start;
+  int i;
+
+  if (fp)
+    {
+      while (fgets (buf, sizeof (buf), fp))
+        {
+          buf[strcspn (buf, "\r\n")] = '\0';
+          if (n == max)
+            keys = realloc (keys, (max *= 2) * sizeof (char *));
+          keys[n++] = strdup (buf);
+        }
+      fclose (fp);
+    }
+  else
+    for (; n < max; n++)
+      {
+        snprintf (buf, sizeof (buf), "http://host%d.example.com/dir/%d.html",
+                  n % 1000, n);
+        keys[n] = strdup (buf);
+      }
+
+  /* Look for absent keys that are like the present ones.  */
+  absent = xnew_array (char *, n);
+  for (i = 0; i < n; i++)
+    {
+      snprintf (buf, sizeof (buf), "%s#", keys[i]);
+      absent[i] = strdup (buf);
+    }
+
+  start = clock ();
+  for (i = 0; i < n; i++)
+    hash_table_put (ht, keys[i], keys[i]);
+  printf ("put:         %.3f s\n", seconds_since (start));
+
+  start = clock ();
+  for (i = 0; i < n; i++)
+    found += hash_table_get (ht, keys[i]) != NULL;
+  printf ("get (hit):   %.3f s\n", seconds_since (start));
+
+  start = clock ();
+  for (i = 0; i < n; i++)
+    found += hash_table_get (ht, absent[i]) != NULL;
+  printf ("get (miss):  %.3f s\n", seconds_since (start));
+
+  start = clock ();
+  for (hash_table_iterate (ht, &iter); hash_table_iter_next (&iter); )
+    found++;
+  printf ("iterate:     %.3f s\n", seconds_since (start));
+
+  /* Hash the distinct keys only, for the count of collisions.  */
+  n = 0;
+  for (hash_table_iterate (ht, &iter); hash_table_iter_next (&iter); )
+    keys[n++] = iter.key;
+  printf ("\n%d distinct keys:\n", n);
+  bench_hash ("hash_string", hash_string, keys, n);
+  bench_hash ("  byte-wise base 31", hash_string_base31, keys, n);
+  bench_hash ("hash_string_nocase", hash_string_nocase, keys, n);
+  printf ("\n");
+
+  start = clock ();
+  for (i = 0; i < n; i += 2)
+    hash_table_remove (ht, keys[i]);
+  for (i = 0; i < n; i++)
+    found += hash_table_contains (ht, keys[i]);
+  printf ("remove half: %.3f s\n", seconds_since (start));
+
+  printf ("%ld %d\n", found, hash_table_count (ht));
+  return 0;
+}
+#endif /* BENCHMARK */
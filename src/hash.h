@@ -51,7 +51,8 @@ void hash_table_for_each (struct hash_table *,
 
 typedef struct {
   void *key, *value;    /* public members */
-  void *pos, *end;      /* private members */
+  struct hash_table *table;     /* private members */
+  int pos;
 } hash_table_iterator;
 void hash_table_iterate (struct hash_table *, hash_table_iterator *);
 int hash_table_iter_next (hash_table_iterator *);
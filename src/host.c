@@ -55,12 +55,23 @@ as that of the covered work.  */
 #endif /* WINDOWS */
 
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
 
 #include "utils.h"
 #include "host.h"
 #include "url.h"
 #include "hash.h"
 #include "ptimer.h"
+#include "stats.h"
+
+/* Resolving hosts ahead of time needs getaddrinfo, which, unlike
+   gethostbyname, can be called from several threads.  */
+#if defined ENABLE_IPV6 && defined HAVE_PTHREAD
+# define ENABLE_PREFETCH
+# include <pthread.h>
+#endif
 
 #ifndef NO_ADDRESS
 # define NO_ADDRESS NO_DATA
@@ -82,6 +93,13 @@ struct address_list {
   bool connected;               /* whether we were able to connect to
                                    one of the addresses in the list,
                                    at least once. */
+  int family;                   /* the family of the address connected
+                                   to last, or 0. */
+
+  time_t expires;               /* when the cached addresses expire, or
+                                   0 if they don't. */
+  time_t refresh;               /* when to look them up again in the
+                                   background, or 0. */
 
   int refcount;                 /* reference count; when it drops to
                                    0, the entry is freed. */
@@ -185,6 +203,23 @@ address_list_connected_p (const struct address_list *al)
   return al->connected;
 }
 
+/* Remember that connecting to an address of FAMILY succeeded, so that
+   connect.c tries that family first the next time.  */
+
+void
+address_list_set_family (struct address_list *al, int family)
+{
+  al->family = family;
+}
+
+/* Return the family last connected to, or 0 if none.  */
+
+int
+address_list_family (const struct address_list *al)
+{
+  return al->family;
+}
+
 #ifdef ENABLE_IPV6
 
 /* Create an address_list from the addresses in the given struct
@@ -205,8 +240,10 @@ address_list_from_addrinfo (const struct addrinfo *ai)
   if (cnt == 0)
     return NULL;
 
+  MEMACCT_ENTER (memacct_saved, MEMACCT_DNS);
   al = xnew0 (struct address_list);
   al->addresses = xnew_array (ip_address, cnt);
+  MEMACCT_LEAVE (memacct_saved);
   al->count     = cnt;
   al->refcount  = 1;
 
@@ -261,6 +298,19 @@ cmp_prefer_ipv6 (const void *addr1, const void *addr2)
   return !IS_IPV6 (addr1) - !IS_IPV6 (addr2);
 }
 
+/* Reorder the addresses of AL so that IPv4 ones (or IPv6 ones, as per
+   --prefer-family) come first.  Sorting is stable so the order of the
+   addresses with the same family is undisturbed.  */
+
+static void
+sort_addresses (struct address_list *al)
+{
+  if (al->count > 1 && opt.prefer_family != prefer_none)
+    stable_sort (al->addresses, al->count, sizeof (ip_address),
+                 opt.prefer_family == prefer_ipv4
+                 ? cmp_prefer_ipv4 : cmp_prefer_ipv6);
+}
+
 #else  /* not ENABLE_IPV6 */
 
 /* Create an address_list from a NULL-terminated vector of IPv4
@@ -270,6 +320,7 @@ static struct address_list *
 address_list_from_ipv4_addresses (char **vec)
 {
   int count, i;
+  MEMACCT_ENTER (memacct_saved, MEMACCT_DNS);
   struct address_list *al = xnew0 (struct address_list);
 
   count = 0;
@@ -278,6 +329,7 @@ address_list_from_ipv4_addresses (char **vec)
   assert (count > 0);
 
   al->addresses = xnew_array (ip_address, count);
+  MEMACCT_LEAVE (memacct_saved);
   al->count     = count;
   al->refcount  = 1;
 
@@ -395,6 +447,24 @@ getaddrinfo_with_timeout_callback (void *arg)
    In case of timeout, the EAI_SYSTEM error code is returned and errno
    is set to ETIMEDOUT.  */
 
+/* Fill in HINTS for looking up the addresses to connect to.  */
+
+static void
+set_lookup_hints (struct addrinfo *hints)
+{
+  xzero (*hints);
+  hints->ai_socktype = SOCK_STREAM;
+  if (opt.ipv4_only)
+    hints->ai_family = AF_INET;
+  else if (opt.ipv6_only)
+    hints->ai_family = AF_INET6;
+  else
+    /* We tried using AI_ADDRCONFIG, but removed it because: it
+       misinterprets IPv6 loopbacks, it is broken on AIX 5.1, and
+       it's unneeded since we sort the addresses anyway.  */
+    hints->ai_family = AF_UNSPEC;
+}
+
 static int
 getaddrinfo_with_timeout (const char *node, const char *service,
                           const struct addrinfo *hints, struct addrinfo **res,
@@ -425,11 +495,20 @@ print_address (const ip_address *addr)
 {
   static char buf[64];
 
-  if (!inet_ntop (addr->family, IP_INADDR_DATA (addr), buf, sizeof buf))
+  return format_address (addr, buf, sizeof buf);
+}
+
+/* Like print_address, but into the SIZE bytes at BUF, for the threads
+   that cannot share its buffer.  Returns BUF.  */
+
+const char *
+format_address (const ip_address *addr, char *buf, size_t size)
+{
+  if (!inet_ntop (addr->family, IP_INADDR_DATA (addr), buf, size))
 #ifndef WINDOWS
-    snprintf (buf, sizeof buf, "<error: %s>", strerror (errno));
+    snprintf (buf, size, "<error: %s>", strerror (errno));
 #else
-    snprintf (buf, sizeof buf, "<WSA error: %X>", WSAGetLastError());
+    snprintf (buf, size, "<WSA error: %X>", WSAGetLastError());
 #endif
 
   return buf;
@@ -581,13 +660,22 @@ is_valid_ipv6_address (const char *str, const char *end)
 }
 
 /* Simple host cache, used by lookup_host to speed up resolving.  The
-   cache doesn't handle TTL because Wget is a fairly short-lived
-   application.  Refreshing is attempted when connect fails, though --
-   see connect_to_host.  */
+   addresses are cached for the TTL reported by the resolver, which
+   only c-ares does, or else for --dns-cache-ttl seconds.  When the
+   last tenth of that time is reached, they are looked up again in the
+   background where possible (see prefetch_host), so that mirrors
+   running for days don't stall on DNS whenever an entry expires.
+   Refreshing is also attempted when connect fails -- see
+   connect_to_host.  */
 
 /* Mapping between known hosts and to lists of their addresses. */
 static struct hash_table *host_name_addresses_map;
 
+static void cache_remove (const char *);
+#ifdef ENABLE_PREFETCH
+static void prefetch_start (const char *);
+static void prefetch_harvest (const char *);
+#endif
 
 /* Return the host's resolved addresses from the cache, if
    available.  */
@@ -598,9 +686,27 @@ cache_query (const char *host)
   struct address_list *al;
   if (!host_name_addresses_map)
     return NULL;
+#ifdef ENABLE_PREFETCH
+  prefetch_harvest (host);
+#endif
   al = hash_table_get (host_name_addresses_map, host);
   if (al)
     {
+      time_t now = time (NULL);
+
+      if (al->expires && now >= al->expires)
+        {
+          DEBUGP (("The cached addresses of %s have expired.\n", host));
+          cache_remove (host);
+          return NULL;
+        }
+#ifdef ENABLE_PREFETCH
+      if (al->refresh && now >= al->refresh)
+        {
+          al->refresh = 0;
+          prefetch_start (host);
+        }
+#endif
       DEBUGP (("Found %s in host_name_addresses_map (%p)\n", host, (void *) al));
       ++al->refcount;
       return al;
@@ -608,17 +714,34 @@ cache_query (const char *host)
   return NULL;
 }
 
-/* Cache the DNS lookup of HOST.  Subsequent invocations of
-   lookup_host will return the cached value.  */
+/* Return when addresses that may be cached for TTL seconds expire, or
+   0 if they don't.  A negative TTL means the resolver didn't say.  */
+
+static time_t
+cache_expiry (int ttl)
+{
+  if (ttl < 0)
+    ttl = opt.dns_cache_ttl;
+  return ttl > 0 ? time (NULL) + ttl : 0;
+}
+
+/* Cache the DNS lookup of HOST until EXPIRES (see cache_expiry).
+   Subsequent invocations of lookup_host will return the cached
+   value.  */
 
 static void
-cache_store (const char *host, struct address_list *al)
+cache_store (const char *host, struct address_list *al, time_t expires)
 {
+  MEMACCT_ENTER (memacct_saved, MEMACCT_DNS);
   if (!host_name_addresses_map)
     host_name_addresses_map = make_nocase_string_hash_table (0);
 
+  al->expires = expires;
+  al->refresh = expires ? expires - (expires - time (NULL)) / 10 : 0;
+
   ++al->refcount;
   hash_table_put (host_name_addresses_map, xstrdup_lower (host), al);
+  MEMACCT_LEAVE (memacct_saved);
 
   IF_DEBUG
     {
@@ -637,13 +760,14 @@ static void
 cache_remove (const char *host)
 {
   struct address_list *al;
+  char *key;
   if (!host_name_addresses_map)
     return;
-  al = hash_table_get (host_name_addresses_map, host);
-  if (al)
+  if (hash_table_get_pair (host_name_addresses_map, host, &key, &al))
     {
-      address_list_release (al);
       hash_table_remove (host_name_addresses_map, host);
+      xfree (key);
+      address_list_release (al);
     }
 }
 
@@ -667,6 +791,7 @@ merge_address_lists (struct address_list *al1, struct address_list *al2)
   return al1;
 }
 
+#if ARES_VERSION < 0x011000
 static struct address_list *
 address_list_from_hostent (struct hostent *host)
 {
@@ -691,6 +816,7 @@ address_list_from_hostent (struct hostent *host)
 
   return al;
 }
+#endif /* ARES_VERSION < 0x011000 */
 
 /* Since GnuLib's select() (i.e. rpl_select()) cannot handle socket-numbers
  * returned from C-ares, we must use the original select() from Winsock.
@@ -740,6 +866,7 @@ wait_ares (ares_channel channel)
     ptimer_destroy (timer);
 }
 
+#if ARES_VERSION < 0x011000
 static void
 callback (void *arg, int status, int timeouts _GL_UNUSED, struct hostent *host)
 {
@@ -753,7 +880,405 @@ callback (void *arg, int status, int timeouts _GL_UNUSED, struct hostent *host)
 
   *al = address_list_from_hostent (host);
 }
+#else  /* ARES_VERSION >= 0x011000 */
+/* The addresses found by ares_getaddrinfo, and the smallest of their
+   TTLs.  */
+struct ares_result {
+  struct address_list *al;
+  int ttl;
+};
+
+static void
+addrinfo_callback (void *arg, int status, int timeouts _GL_UNUSED,
+                   struct ares_addrinfo *res)
+{
+  struct ares_result *result = (struct ares_result *) arg;
+  struct ares_addrinfo_node *node;
+  struct address_list *al;
+  int count = 0;
+
+  if (status == ARES_SUCCESS && res)
+    for (node = res->nodes; node; node = node->ai_next)
+      if (node->ai_family == AF_INET
+#ifdef ENABLE_IPV6
+          || node->ai_family == AF_INET6
+#endif
+          )
+        ++count;
+  if (!count)
+    {
+      if (res)
+        ares_freeaddrinfo (res);
+      return;
+    }
+
+  al = xnew0 (struct address_list);
+  al->addresses = xnew_array (ip_address, count);
+  al->refcount  = 1;
+
+  for (node = res->nodes; node; node = node->ai_next)
+    {
+      ip_address *ip = &al->addresses[al->count];
+
+      if (node->ai_family == AF_INET)
+        {
+          const struct sockaddr_in *sin
+            = (const struct sockaddr_in *) node->ai_addr;
+          ip->family = AF_INET;
+          ip->data.d4 = sin->sin_addr;
+        }
+#ifdef ENABLE_IPV6
+      else if (node->ai_family == AF_INET6)
+        {
+          const struct sockaddr_in6 *sin6
+            = (const struct sockaddr_in6 *) node->ai_addr;
+          ip->family = AF_INET6;
+          ip->data.d6 = sin6->sin6_addr;
+#ifdef HAVE_SOCKADDR_IN6_SCOPE_ID
+          ip->ipv6_scope = sin6->sin6_scope_id;
+#endif
+        }
+#endif
+      else
+        continue;
+
+      ++al->count;
+      if (result->ttl < 0 || node->ai_ttl < result->ttl)
+        result->ttl = node->ai_ttl;
+    }
+
+  result->al = al;
+  ares_freeaddrinfo (res);
+}
+#endif /* ARES_VERSION >= 0x011000 */
+
+/* Look up the IPv4 addresses of HOST if WANT4 and its IPv6 addresses
+   if WANT6, using c-ares.  *TTL is set to how many seconds the
+   addresses may be cached for, or to -1 if that isn't known.  */
+
+static struct address_list *
+ares_lookup (const char *host, bool want4, bool want6 _GL_UNUSED, int *ttl)
+{
+  struct address_list *al4 = NULL, *al6 = NULL;
+#if ARES_VERSION >= 0x011000
+  struct ares_result result4 = { NULL, -1 }, result6 = { NULL, -1 };
+  struct ares_addrinfo_hints hints;
+
+  xzero (hints);
+  if (want4)
+    {
+      hints.ai_family = AF_INET;
+      ares_getaddrinfo (ares, host, NULL, &hints, addrinfo_callback, &result4);
+    }
+#ifdef ENABLE_IPV6
+  if (want6)
+    {
+      hints.ai_family = AF_INET6;
+      ares_getaddrinfo (ares, host, NULL, &hints, addrinfo_callback, &result6);
+    }
+#endif
+
+  wait_ares (ares);
+
+  al4 = result4.al;
+  al6 = result6.al;
+  *ttl = result4.ttl;
+  if (result6.ttl >= 0 && (*ttl < 0 || result6.ttl < *ttl))
+    *ttl = result6.ttl;
+#else  /* ARES_VERSION < 0x011000 */
+  if (want4)
+    ares_gethostbyname (ares, host, AF_INET, callback, &al4);
+#ifdef ENABLE_IPV6
+  if (want6)
+    ares_gethostbyname (ares, host, AF_INET6, callback, &al6);
+#endif
+
+  wait_ares (ares);
+
+  *ttl = -1;
+#endif /* ARES_VERSION < 0x011000 */
+
+  if (al4 && al6)
+    return merge_address_lists (al4, al6);
+  return al4 ? al4 : al6;
+}
+#endif /* HAVE_LIBCARES */
+
+/* Resolving ahead of time.  During recursive retrieval, the hosts of
+   the links accepted for download are known well before they are
+   connected to.  prefetch_host hands such a host to a few resolver
+   threads, so that lookup_host finds its addresses resolved when the
+   link is retrieved, instead of waiting for DNS then.
+
+   The threads only call getaddrinfo.  Turning the result into an
+   address list, printing and caching it is left to lookup_host, on
+   the main thread, so that a prefetched host is reported just like
+   one resolved on the spot.  */
+
+#ifdef ENABLE_PREFETCH
+/* Number of resolver threads.  */
+#define PREFETCH_THREADS 4
+
+/* Maximum number of hosts resolved ahead, including the ones whose
+   addresses haven't been picked up by lookup_host yet.  */
+#define MAX_PREFETCHES 64
+
+struct prefetch {
+  char *host;
+  struct addrinfo *res;         /* the result of getaddrinfo */
+  int exit_code;
+
+  bool started;                 /* a thread is resolving HOST */
+  bool done;                    /* RES and EXIT_CODE are set */
+  bool abandoned;               /* lookup_host gave up waiting; the
+                                   thread frees the entry */
+  struct prefetch *next;        /* next in the queue */
+};
+
+/* Protects the queue, the number of threads and the fields of the
+   entries, except HOST.  */
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+/* The entries no thread has taken yet.  */
+static struct prefetch *prefetch_head, *prefetch_tail;
+static int prefetch_threads;
+
+/* Maps the hosts handed to prefetch_host to their entries.  Only used
+   by the main thread.  */
+static struct hash_table *prefetch_map;
+
+static void
+prefetch_free (struct prefetch *p)
+{
+  if (p->res)
+    freeaddrinfo (p->res);
+  xfree (p->host);
+  xfree (p);
+}
+
+/* Resolve the queued hosts until there are none left.  */
+
+static void *
+prefetch_thread (void *arg _GL_UNUSED)
+{
+  struct addrinfo hints;
+
+  set_lookup_hints (&hints);
+
+  pthread_mutex_lock (&prefetch_lock);
+  while (prefetch_head)
+    {
+      struct prefetch *p = prefetch_head;
+      struct addrinfo *res = NULL;
+      int exit_code;
+
+      prefetch_head = p->next;
+      if (!prefetch_head)
+        prefetch_tail = NULL;
+      p->started = true;
+      pthread_mutex_unlock (&prefetch_lock);
+
+      exit_code = getaddrinfo (p->host, NULL, &hints, &res);
+
+      pthread_mutex_lock (&prefetch_lock);
+      p->res = exit_code == 0 ? res : NULL;
+      p->exit_code = exit_code;
+      p->done = true;
+      if (p->abandoned)
+        prefetch_free (p);
+      else
+        pthread_cond_broadcast (&prefetch_cond);
+    }
+  --prefetch_threads;
+  pthread_mutex_unlock (&prefetch_lock);
+  return NULL;
+}
+
+/* Take the entry of HOST out of the prefetching machinery.  If its
+   lookup is finished, or finishes within the DNS timeout when WAIT is
+   true, store its result in *RES and *EXIT_CODE and return true.
+   Return false if HOST is not being prefetched, or its lookup hasn't
+   started.  */
+
+static bool
+prefetch_take (const char *host, bool wait, struct addrinfo **res,
+               int *exit_code)
+{
+  struct prefetch *p;
+  bool taken = false, timed_out = false, abandoned = false;
+
+  if (!prefetch_map || !(p = hash_table_get (prefetch_map, host)))
+    return false;
+  hash_table_remove (prefetch_map, host);
+
+  pthread_mutex_lock (&prefetch_lock);
+  if (!p->started)
+    {
+      /* Still queued; resolving it right away is faster.  */
+      struct prefetch *prev = NULL, *cur;
+
+      for (cur = prefetch_head; cur != p; cur = cur->next)
+        prev = cur;
+      if (prev)
+        prev->next = p->next;
+      else
+        prefetch_head = p->next;
+      if (prefetch_tail == p)
+        prefetch_tail = prev;
+    }
+  else if (!wait)
+    ;
+  else if (!p->done && opt.dns_timeout)
+    {
+      struct timespec deadline;
+      double secs = opt.dns_timeout;
+
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += (time_t) secs;
+      deadline.tv_nsec += (long) (1e9 * (secs - (time_t) secs));
+      if (deadline.tv_nsec >= 1000000000)
+        {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+      while (!p->done && !timed_out)
+        timed_out = pthread_cond_timedwait (&prefetch_cond, &prefetch_lock,
+                                            &deadline) == ETIMEDOUT;
+    }
+  else
+    while (!p->done)
+      pthread_cond_wait (&prefetch_cond, &prefetch_lock);
+
+  if (p->done)
+    {
+      *res = p->res;
+      *exit_code = p->exit_code;
+      p->res = NULL;
+      taken = true;
+    }
+  else if (p->started)
+    p->abandoned = abandoned = true;
+  pthread_mutex_unlock (&prefetch_lock);
+
+  /* Otherwise the thread still resolving it frees it.  */
+  if (!abandoned)
+    prefetch_free (p);
+
+  if (timed_out && !taken)
+    {
+      /* Report this like getaddrinfo_with_timeout would.  */
+      *res = NULL;
+      *exit_code = EAI_SYSTEM;
+      errno = ETIMEDOUT;
+      taken = true;
+    }
+  return taken;
+}
+
+/* Queue HOST for the resolver threads, unless it is queued already.  */
+
+static void
+prefetch_start (const char *host)
+{
+  struct prefetch *p;
+
+#ifdef HAVE_LIBCARES
+  /* The threads would bypass the name servers given to c-ares.  */
+  if (ares)
+    return;
 #endif
+  if (!prefetch_map)
+    prefetch_map = make_nocase_string_hash_table (0);
+  else if (hash_table_contains (prefetch_map, host)
+           || hash_table_count (prefetch_map) >= MAX_PREFETCHES)
+    return;
+
+  p = xnew0 (struct prefetch);
+  p->host = xstrdup_lower (host);
+  hash_table_put (prefetch_map, p->host, p);
+  DEBUGP (("Resolving %s in the background.\n", host));
+
+  pthread_mutex_lock (&prefetch_lock);
+  if (prefetch_tail)
+    prefetch_tail->next = p;
+  else
+    prefetch_head = p;
+  prefetch_tail = p;
+  if (prefetch_threads < PREFETCH_THREADS)
+    {
+      pthread_t thread;
+
+      /* If no thread can be started, lookup_host takes the entry out
+         of the queue and resolves the host itself.  */
+      if (pthread_create (&thread, NULL, prefetch_thread, NULL) == 0)
+        {
+          pthread_detach (thread);
+          ++prefetch_threads;
+        }
+    }
+  pthread_mutex_unlock (&prefetch_lock);
+}
+
+/* If the addresses of HOST, which is cached, have been looked up
+   again in the background, cache the new ones.  */
+
+static void
+prefetch_harvest (const char *host)
+{
+  struct prefetch *p;
+  struct address_list *al;
+  struct addrinfo *res;
+  int exit_code;
+  bool done;
+
+  if (!prefetch_map || !(p = hash_table_get (prefetch_map, host))
+      || !hash_table_contains (host_name_addresses_map, host))
+    return;
+
+  pthread_mutex_lock (&prefetch_lock);
+  done = p->done;
+  pthread_mutex_unlock (&prefetch_lock);
+  if (!done)
+    return;
+
+  prefetch_take (host, false, &res, &exit_code);
+  if (exit_code != 0 || !res)
+    {
+      /* Keep using the old addresses until they expire.  */
+      DEBUGP (("Refreshing the addresses of %s failed.\n", host));
+      return;
+    }
+  al = address_list_from_addrinfo (res);
+  freeaddrinfo (res);
+  if (!al)
+    return;
+
+  sort_addresses (al);
+  cache_remove (host);
+  cache_store (host, al, cache_expiry (-1));
+  address_list_release (al);
+}
+#endif /* ENABLE_PREFETCH */
+
+/* Start resolving HOST in the background, if it isn't known yet.  */
+
+void
+prefetch_host (const char *host _GL_UNUSED)
+{
+#ifdef ENABLE_PREFETCH
+  const char *end = host + strlen (host);
+
+  if (!opt.dns_cache || !opt.dns_prefetch)
+    return;
+  if (is_valid_ipv4_address (host, end) || is_valid_ipv6_address (host, end))
+    return;
+  if (host_name_addresses_map
+      && hash_table_contains (host_name_addresses_map, host))
+    return;
+  prefetch_start (host);
+#endif /* ENABLE_PREFETCH */
+}
 
 /* Look up HOST in DNS and return a list of IP addresses.
 
@@ -785,6 +1310,7 @@ lookup_host (const char *host, int flags)
   bool use_cache;
   bool numeric_address = false;
   double timeout = opt.dns_timeout;
+  int ttl = -1;
 
 #ifndef ENABLE_IPV6
   /* If we're not using getaddrinfo, first check if HOST specifies a
@@ -833,13 +1359,18 @@ lookup_host (const char *host, int flags)
         {
           al = cache_query (host);
           if (al)
-            return al;
+            {
+              STATS_ADD (STATS_DNS_CACHED, 0);
+              return al;
+            }
         }
       else
         cache_remove (host);
     }
 
-  /* No luck with the cache; resolve HOST. */
+  /* No luck with the cache; resolve HOST.  Only successful lookups
+     are timed for --stats.  */
+  STATS_START (start);
 
   if (!silent && !numeric_address)
     {
@@ -861,42 +1392,15 @@ lookup_host (const char *host, int flags)
 #ifdef ENABLE_IPV6
 #ifdef HAVE_LIBCARES
   if (ares)
-    {
-      struct address_list *al4 = NULL;
-      struct address_list *al6 = NULL;
-
-      if (opt.ipv4_only || !opt.ipv6_only)
-        ares_gethostbyname (ares, host, AF_INET, callback, &al4);
-      if (opt.ipv6_only || !opt.ipv4_only)
-        ares_gethostbyname (ares, host, AF_INET6, callback, &al6);
-
-      wait_ares (ares);
-
-      if (al4 && al6)
-        al = merge_address_lists (al4, al6);
-      else if (al4)
-        al = al4;
-      else
-        al = al6;
-    }
+    al = ares_lookup (host, opt.ipv4_only || !opt.ipv6_only,
+                      opt.ipv6_only || !opt.ipv4_only, &ttl);
   else
 #endif
     {
       int err;
       struct addrinfo hints, *res;
 
-      xzero (hints);
-      hints.ai_socktype = SOCK_STREAM;
-      if (opt.ipv4_only)
-        hints.ai_family = AF_INET;
-      else if (opt.ipv6_only)
-        hints.ai_family = AF_INET6;
-      else
-        /* We tried using AI_ADDRCONFIG, but removed it because: it
-           misinterprets IPv6 loopbacks, it is broken on AIX 5.1, and
-           it's unneeded since we sort the addresses anyway.  */
-        hints.ai_family = AF_UNSPEC;
-
+      set_lookup_hints (&hints);
       if (flags & LH_BIND)
         hints.ai_flags |= AI_PASSIVE;
 
@@ -912,7 +1416,10 @@ lookup_host (const char *host, int flags)
         }
 #endif
 
-      err = getaddrinfo_with_timeout (host, NULL, &hints, &res, timeout);
+#ifdef ENABLE_PREFETCH
+      if ((flags & LH_BIND) || !prefetch_take (host, true, &res, &err))
+#endif
+        err = getaddrinfo_with_timeout (host, NULL, &hints, &res, timeout);
 
       if (err != 0 || res == NULL)
         {
@@ -932,20 +1439,11 @@ lookup_host (const char *host, int flags)
       return NULL;
     }
 
-  /* Reorder addresses so that IPv4 ones (or IPv6 ones, as per
-     --prefer-family) come first.  Sorting is stable so the order of
-     the addresses with the same family is undisturbed.  */
-  if (al->count > 1 && opt.prefer_family != prefer_none)
-    stable_sort (al->addresses, al->count, sizeof (ip_address),
-                 opt.prefer_family == prefer_ipv4
-                 ? cmp_prefer_ipv4 : cmp_prefer_ipv6);
+  sort_addresses (al);
 #else  /* not ENABLE_IPV6 */
 #ifdef HAVE_LIBCARES
   if (ares)
-    {
-      ares_gethostbyname (ares, host, AF_INET, callback, &al);
-      wait_ares (ares);
-    }
+    al = ares_lookup (host, true, false, &ttl);
   else
 #endif
     {
@@ -966,6 +1464,7 @@ lookup_host (const char *host, int flags)
       al = address_list_from_ipv4_addresses (hptr->h_addr_list);
     }
 #endif /* not ENABLE_IPV6 */
+  STATS_STOP (STATS_DNS_RESOLVED, start, 0);
 
   /* Print the addresses determined by DNS lookup, but no more than
      three if show_all_dns_entries is not specified.  */
@@ -988,13 +1487,175 @@ lookup_host (const char *host, int flags)
       logputs (LOG_VERBOSE, "\n");
     }
 
-  /* Cache the lookup information. */
-  if (use_cache)
-    cache_store (host, al);
+  /* Cache the lookup information, unless the resolver says not to. */
+  if (use_cache && ttl != 0)
+    cache_store (host, al, cache_expiry (ttl));
 
   return al;
 }
 
+/* Keeping the DNS cache between runs, with --dns-cache-file.  Each
+   line of the file holds a host name, the time its addresses expire,
+   and the addresses:
+
+     example.com 1700000000 93.184.216.34 2606:2800:220:1:248:1893:25c8:1946
+
+   Addresses cached without a time limit are not saved.  */
+
+/* Parse the textual address STR into IP.  */
+
+static bool
+parse_address (const char *str, ip_address *ip)
+{
+  xzero (*ip);
+  if (inet_pton (AF_INET, str, &ip->data.d4) == 1)
+    {
+      ip->family = AF_INET;
+#ifdef ENABLE_IPV6
+      return !opt.ipv6_only;
+#else
+      return true;
+#endif
+    }
+#ifdef ENABLE_IPV6
+  if (inet_pton (AF_INET6, str, &ip->data.d6) == 1)
+    {
+      ip->family = AF_INET6;
+      return !opt.ipv4_only;
+    }
+#endif
+  return false;
+}
+
+/* Cache the entries read from FP that haven't expired yet, except for
+   hosts already in the cache.  Addresses Wget isn't allowed to use
+   (with -4 or -6) are skipped.  */
+
+static void
+dns_cache_read (FILE *fp)
+{
+  char *line = NULL;
+  size_t len = 0;
+  time_t now = time (NULL);
+
+  while (getline (&line, &len, fp) > 0)
+    {
+      char *host, *tok, *saveptr;
+      struct address_list *al;
+      long long expires;
+
+      host = strtok_r (line, " \t\r\n", &saveptr);
+      if (!host || *host == '#')
+        continue;
+      tok = strtok_r (NULL, " \t\r\n", &saveptr);
+      if (!tok || (expires = strtoll (tok, NULL, 10)) <= now)
+        continue;
+      if (host_name_addresses_map
+          && hash_table_contains (host_name_addresses_map, host))
+        continue;
+
+      al = xnew0 (struct address_list);
+      al->refcount = 1;
+      while ((tok = strtok_r (NULL, " \t\r\n", &saveptr)) != NULL)
+        {
+          ip_address ip;
+
+          if (!parse_address (tok, &ip))
+            continue;
+          al->addresses = xrealloc (al->addresses,
+                                    (al->count + 1) * sizeof (ip_address));
+          al->addresses[al->count++] = ip;
+        }
+      if (al->count)
+        {
+#ifdef ENABLE_IPV6
+          sort_addresses (al);
+#endif
+          cache_store (host, al, (time_t) expires);
+        }
+      address_list_release (al);
+    }
+
+  xfree (line);
+}
+
+/* Cache the addresses saved in FILE by previous runs.  */
+
+void
+dns_cache_load (const char *file)
+{
+  FILE *fp = fopen (file, "r");
+
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        logprintf (LOG_NOTQUIET, _("Cannot read DNS cache %s: %s\n"),
+                   quote (file), strerror (errno));
+      return;
+    }
+
+  DEBUGP (("Reading the DNS cache from %s.\n", file));
+  dns_cache_read (fp);
+  fclose (fp);
+}
+
+/* Save the cached addresses to FILE, along with those other Wget
+   processes have saved there meanwhile.  */
+
+void
+dns_cache_save (const char *file)
+{
+  hash_table_iterator iter;
+  time_t now = time (NULL);
+  FILE *fp = fopen (file, "a+");
+
+  if (!fp)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot write DNS cache %s: %s\n"),
+                 quote (file), strerror (errno));
+      return;
+    }
+
+  /* Lock the file so that concurrent runs don't lose each other's
+     entries.  */
+  flock (fileno (fp), LOCK_EX);
+  fseek (fp, 0, SEEK_SET);
+  dns_cache_read (fp);
+  fseek (fp, 0, SEEK_SET);
+  if (ftruncate (fileno (fp), 0) < 0)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot write DNS cache %s: %s\n"),
+                 quote (file), strerror (errno));
+      fclose (fp);
+      return;
+    }
+
+  DEBUGP (("Saving the DNS cache to %s.\n", file));
+  fputs ("# DNS cache for GNU Wget.\n", fp);
+  fputs ("# <hostname>\t<expires>\t<addresses>...\n", fp);
+  if (host_name_addresses_map)
+    for (hash_table_iterate (host_name_addresses_map, &iter);
+         hash_table_iter_next (&iter);
+         )
+      {
+        const struct address_list *al = iter.value;
+        int i;
+
+        if (!al->expires || al->expires <= now)
+          continue;
+        fprintf (fp, "%s\t%" PRId64, (const char *) iter.key,
+                 (int64_t) al->expires);
+        for (i = 0; i < al->count; i++)
+          fprintf (fp, "\t%s", print_address (al->addresses + i));
+        fputc ('\n', fp);
+      }
+
+  /* fclose unlocks the file.  */
+  if (fclose (fp) == EOF)
+    logprintf (LOG_NOTQUIET, _("Cannot write DNS cache %s: %s\n"),
+               quote (file), strerror (errno));
+}
+
 /* Determine whether a URL is acceptable to be followed, according to
    a list of domains to accept.  */
 bool
@@ -1014,38 +1675,150 @@ accept_domain (struct url *u)
   return true;
 }
 
+/* The domains of a list given to sufmatch, as a trie of their labels,
+   the last one first: "www.example.com" is the child "www" of the
+   child "example" of the child "com" of the root.  A host is then
+   matched against all the domains of the list by walking down as many
+   nodes as it has labels.  */
+struct domain_trie
+{
+  struct hash_table *children;  /* label -> struct domain_trie,
+                                   case-insensitively */
+  bool domain;                  /* a domain ends here, matching itself
+                                   and its subdomains */
+  bool subdomains;              /* a dot-prefixed domain ends here,
+                                   matching only its subdomains */
+};
+
+/* The tries of the lists given to sufmatch, by list.  The lists are
+   those of options, which are not changed once they are in use.  */
+static struct hash_table *domain_tries;
+
+/* Return where the last label of S, which ends at END, begins.  */
+
+static char *
+last_label (char *s, char *end)
+{
+  char *label = end;
+
+  while (label > s && label[-1] != '.')
+    label--;
+  return label;
+}
+
+static void
+domain_trie_add (struct domain_trie *node, const char *domain)
+{
+  bool subdomains = *domain == '.';
+  char *copy = xstrdup (domain + subdomains);
+  char *end = strchr (copy, '\0');
+
+  for (;;)
+    {
+      char *label = last_label (copy, end);
+      struct domain_trie *child = NULL;
+
+      if (!node->children)
+        node->children = make_nocase_string_hash_table (0);
+      else
+        child = hash_table_get (node->children, label);
+      if (!child)
+        {
+          child = xnew0 (struct domain_trie);
+          hash_table_put (node->children, xstrdup (label), child);
+        }
+      node = child;
+
+      if (label == copy)
+        break;
+      end = label - 1;
+      *end = '\0';
+    }
+
+  if (subdomains)
+    node->subdomains = true;
+  else
+    node->domain = true;
+  xfree (copy);
+}
+
+static void
+domain_trie_free (struct domain_trie *node)
+{
+  if (node->children)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (node->children, &iter);
+           hash_table_iter_next (&iter); )
+        {
+          xfree (iter.key);
+          domain_trie_free (iter.value);
+        }
+      hash_table_destroy (node->children);
+    }
+  xfree (node);
+}
+
 /* Check whether WHAT is matched in LIST, each element of LIST being a
-   pattern to match WHAT against, using backward matching (see
-   match_backwards() in utils.c).
+   domain that matches itself and its subdomains, or, if it begins
+   with a dot, only its subdomains.  Case is ignored.
+
+   LIST is made into a domain_trie when first given, so that WHAT is
+   matched against all of it by following its labels.
 
    If an element of LIST matched, 1 is returned, 0 otherwise.  */
 bool
 sufmatch (const char **list, const char *what)
 {
-  int i, j, k, lw;
+  const struct domain_trie *node;
+  size_t len = strlen (what);
+  char buf[256], *copy, *end;
+  bool matched = false;
+
+  if (!domain_tries)
+    domain_tries = hash_table_new (0, NULL, NULL);
+  if (!(node = hash_table_get (domain_tries, list)))
+    {
+      struct domain_trie *trie = xnew0 (struct domain_trie);
+      int i;
 
-  lw = strlen (what);
+      for (i = 0; list[i]; i++)
+        domain_trie_add (trie, list[i]);
+      hash_table_put (domain_tries, list, trie);
+      node = trie;
+    }
+
+  copy = len < sizeof buf ? buf : xmalloc (len + 1);
+  memcpy (copy, what, len + 1);
+  end = copy + len;
 
-  for (i = 0; list[i]; i++)
+  for (;;)
     {
-      j = strlen (list[i]);
-      if (lw < j)
-        continue; /* what is no (sub)domain of list[i] */
+      char *label = last_label (copy, end);
 
-      for (k = lw; j >= 0 && k >= 0; j--, k--)
-        if (c_tolower (list[i][j]) != c_tolower (what[k]))
+      if (!node->children
+          || !(node = hash_table_get (node->children, label)))
+        break;
+      if (node->domain)
+        {
+          matched = true;
           break;
-
-      /* Domain or subdomain match
-       * k == -1: exact match
-       * k >= 0 && what[k] == '.': subdomain match
-       * k >= 0 && list[i][0] == '.': dot-prefixed subdomain match
-       */
-      if (j == -1 && (k == -1 || what[k] == '.' || list[i][0] == '.'))
-        return true;
+        }
+      /* A dot-prefixed domain wants another label.  */
+      if (label == copy)
+        break;
+      if (node->subdomains)
+        {
+          matched = true;
+          break;
+        }
+      end = label - 1;
+      *end = '\0';
     }
 
-  return false;
+  if (copy != buf)
+    xfree (copy);
+  return matched;
 }
 
 #if defined DEBUG_MALLOC || defined TESTING
@@ -1068,6 +1841,35 @@ host_cleanup (void)
       hash_table_destroy (host_name_addresses_map);
       host_name_addresses_map = NULL;
     }
+  if (domain_tries)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (domain_tries, &iter);
+           hash_table_iter_next (&iter); )
+        domain_trie_free (iter.value);
+      hash_table_destroy (domain_tries);
+      domain_tries = NULL;
+    }
+#ifdef ENABLE_PREFETCH
+  if (prefetch_map)
+    {
+      /* prefetch_take removes the entries, so the table can't be
+         iterated over.  */
+      while (hash_table_count (prefetch_map))
+        {
+          hash_table_iterator iter;
+          struct addrinfo *res;
+          int exit_code;
+
+          hash_table_iterate (prefetch_map, &iter);
+          hash_table_iter_next (&iter);
+          if (prefetch_take (iter.key, false, &res, &exit_code) && res)
+            freeaddrinfo (res);
+        }
+      hash_table_destroy (prefetch_map);
+      prefetch_map = NULL;
+    }
+#endif
 }
 #endif
 
@@ -1085,3 +1887,76 @@ is_valid_ip_address (const char *name)
 #endif
   return false;
 }
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+
+const char *
+test_dns_cache_read (void)
+{
+  struct address_list *al;
+  int64_t expires = time (NULL) + 60;
+  FILE *fp = tmpfile ();
+
+  if (!fp)
+    return NULL;
+
+  fputs ("# dummy comment\n\n", fp);
+  fprintf (fp, "foo.example.com\t%" PRId64 "\t192.0.2.1\t192.0.2.2\n", expires);
+  fprintf (fp, "old.example.com\t%" PRId64 "\t192.0.2.3\n", expires - 120);
+  fprintf (fp, "bad.example.com\t%" PRId64 "\tnot-an-address\n", expires);
+  fputs ("noexpiry.example.com\n", fp);
+  rewind (fp);
+
+  dns_cache_read (fp);
+  fclose (fp);
+
+  mu_assert ("No cache", host_name_addresses_map != NULL);
+
+  al = hash_table_get (host_name_addresses_map, "foo.example.com");
+  mu_assert ("foo.example.com not read", al != NULL);
+  mu_assert ("Wrong address count", al->count == 2);
+  mu_assert ("Wrong expiry", al->expires == (time_t) expires);
+  mu_assert ("Wrong address",
+             !strcmp (print_address (al->addresses + 1), "192.0.2.2"));
+
+  mu_assert ("Expired entry read",
+             !hash_table_contains (host_name_addresses_map, "old.example.com"));
+  mu_assert ("Entry without addresses read",
+             !hash_table_contains (host_name_addresses_map, "bad.example.com"));
+  mu_assert ("Entry without expiry read",
+             !hash_table_contains (host_name_addresses_map,
+                                   "noexpiry.example.com"));
+
+  host_cleanup ();
+  return NULL;
+}
+
+const char *
+test_sufmatch (void)
+{
+  static const char *list[] = { "Example.com", ".sub.test", "org", NULL };
+  static const struct {
+    const char *host;
+    bool result;
+  } test_array[] = {
+    { "example.com", true },
+    { "www.EXAMPLE.com", true },
+    { "badexample.com", false },
+    { "example.com.evil", false },
+    { "sub.test", false },
+    { "a.sub.test", true },
+    { "a.b.sub.test", true },
+    { "foo.org", true },
+    { "com", false },
+  };
+  unsigned i;
+
+  for (i = 0; i < countof (test_array); i++)
+    mu_assert ("test_sufmatch: wrong result",
+               sufmatch (list, test_array[i].host) == test_array[i].result);
+
+  host_cleanup ();
+  return NULL;
+}
+#endif /* TESTING */
@@ -83,6 +83,9 @@ enum {
   LH_REFRESH = 4
 };
 struct address_list *lookup_host (const char *, int);
+void prefetch_host (const char *);
+void dns_cache_load (const char *);
+void dns_cache_save (const char *);
 
 void address_list_get_bounds (const struct address_list *, int *, int *);
 const ip_address *address_list_address_at (const struct address_list *, int);
@@ -90,9 +93,12 @@ bool address_list_contains (const struct address_list *, const ip_address *);
 void address_list_set_faulty (struct address_list *, int);
 void address_list_set_connected (struct address_list *);
 bool address_list_connected_p (const struct address_list *);
+void address_list_set_family (struct address_list *, int);
+int address_list_family (const struct address_list *);
 void address_list_release (struct address_list *);
 
 const char *print_address (const ip_address *);
+const char *format_address (const ip_address *, char *, size_t);
 #ifdef ENABLE_IPV6
 bool is_valid_ipv6_address (const char *, const char *);
 #endif
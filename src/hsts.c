@@ -35,6 +35,7 @@ as that of the covered work.  */
 #include "host.h" /* for is_valid_ip_address() */
 #include "hash.h"
 #include "c-ctype.h"
+#include "c-strcase.h"
 #ifdef TESTING
 #include "init.h" /* for ajoin_dir_file() */
 #include "../tests/unit-tests.h"
@@ -49,9 +50,27 @@ as that of the covered work.  */
 #include <stdio.h>
 #include <sys/file.h>
 
+struct hsts_removed_entry {
+  char *host;
+  int explicit_port;
+  int64_t removed;
+};
+
 struct hsts_store {
   struct hash_table *table;
-  time_t last_mtime;
+  /* Hosts whose entries have already been looked up in the database
+     file. */
+  struct hash_table *looked_up;
+  /* Entries removed since the store was opened.  They are written out
+     as lines with a max-age of zero. */
+  struct hsts_removed_entry *removed;
+  int removed_count;
+  int removed_size;
+  /* The database file, read on first use and never parsed as a whole. */
+  char *filename;
+  char *db;
+  size_t db_size;
+  bool db_read;
   bool changed;
 };
 
@@ -64,6 +83,8 @@ struct hsts_kh_info {
   int64_t created;
   int64_t max_age;
   bool include_subdomains;
+  /* Entry was created or updated by us and has to be saved. */
+  bool dirty;
 };
 
 enum hsts_kh_match {
@@ -82,6 +103,13 @@ enum hsts_kh_match {
 #define MAKE_EXPLICIT_PORT(s, p) (s == SCHEME_HTTPS ? (p == DEFAULT_SSL_PORT ? 0 : p) \
     : (p == DEFAULT_HTTP_PORT ? 0 : p))
 
+/* hsts_store_save appends the changed entries to the database.  Once
+   the file grows past this size, it is rewritten with only the live
+   entries instead. */
+#define HSTS_COMPACT_SIZE (64 * 1024)
+
+#define HSTS_LINE_FORMAT "%s\t%d\t%d\t%" PRId64 "\t%" PRId64 "\n"
+
 /* Hashing and comparison functions for the hash table */
 
 #ifdef __clang__
@@ -111,6 +139,103 @@ hsts_cmp_func (const void *h1, const void *h2)
 
 /* Private functions. Feel free to make some of these public when needed. */
 
+static struct hsts_kh_info *hsts_new_entry_internal (hsts_store_t, const char *,
+                                                     int, int64_t, int64_t,
+                                                     bool, bool, bool, bool);
+
+/* Read the database file into memory, unless that has been done
+   already.  The file is not mapped, since other Wget processes may
+   truncate it while we're running. */
+static void
+hsts_read_file (hsts_store_t store)
+{
+  struct stat st;
+  FILE *fp;
+
+  if (store->db_read)
+    return;
+  store->db_read = true;
+
+  if (!store->filename || !(fp = fopen (store->filename, "r")))
+    return;
+
+  if (fstat (fileno (fp), &st) == 0 && st.st_size > 0)
+    {
+      store->db = xmalloc (st.st_size);
+      store->db_size = fread (store->db, 1, st.st_size, fp);
+    }
+  fclose (fp);
+}
+
+/* Load the entry for KH from the database file, if there is one and
+   it is not known yet.  Only the lines of that host are parsed.  The
+   file is appended to by hsts_store_save, so the line with the latest
+   creation time wins, and a later line wins a tie. */
+static void
+hsts_load_entry (hsts_store_t store, const struct hsts_kh *kh)
+{
+  size_t hostlen = strlen (kh->host);
+  const char *p, *end, *eol;
+  struct hsts_kh *k;
+  bool found = false;
+  int64_t found_created = 0, found_max_age = 0;
+  int found_include_subdomains = 0;
+
+  if (hash_table_contains (store->looked_up, kh)
+      || hash_table_contains (store->table, kh))
+    return;
+
+  k = xnew (struct hsts_kh);
+  k->host = xstrdup (kh->host);
+  k->explicit_port = kh->explicit_port;
+  hash_table_put (store->looked_up, k, k);
+
+  hsts_read_file (store);
+  if (!store->db)
+    return;
+
+  for (p = store->db, end = p + store->db_size; p < end; p = eol + 1)
+    {
+      char line[512], host[256];
+      int port, include_subdomains;
+      int64_t created, max_age;
+
+      eol = memchr (p, '\n', end - p);
+      if (!eol)
+        eol = end;
+
+      while (p < eol && c_isspace (*p))
+        p++;
+
+      if ((size_t) (eol - p) <= hostlen
+          || (size_t) (eol - p) >= sizeof (line)
+          || c_strncasecmp (p, kh->host, hostlen) != 0
+          || !c_isspace (p[hostlen]))
+        continue;
+
+      memcpy (line, p, eol - p);
+      line[eol - p] = '\0';
+
+      if (sscanf (line, "%255s %d %d %" SCNd64 " %" SCNd64,
+                  host, &port, &include_subdomains, &created, &max_age) == 5
+          && MAKE_EXPLICIT_PORT (SCHEME_HTTPS, port) == kh->explicit_port
+          && (!found || created >= found_created))
+        {
+          found = true;
+          found_created = created;
+          found_max_age = max_age;
+          found_include_subdomains = include_subdomains;
+        }
+    }
+
+  /* A max-age of zero records a removed entry. */
+  if (found && found_max_age > 0)
+    hsts_new_entry_internal (store, kh->host, kh->explicit_port,
+                             found_created, found_max_age,
+                             !!found_include_subdomains,
+                             true, true, false);
+}
+
 static struct hsts_kh_info *
 hsts_find_entry (hsts_store_t store,
                  const char *host, int explicit_port,
@@ -130,6 +255,7 @@ hsts_find_entry (hsts_store_t store,
   /* save pointer so that we don't get into trouble later when freeing */
   org_ptr = k->host;
 
+  hsts_load_entry (store, k);
   khi = (struct hsts_kh_info *) hash_table_get (store->table, k);
   if (khi)
     {
@@ -142,6 +268,7 @@ hsts_find_entry (hsts_store_t store,
       strchr (pos + 1, '.'))
     {
       k->host += (pos - k->host + 1);
+      hsts_load_entry (store, k);
       khi = (struct hsts_kh_info *) hash_table_get (store->table, k);
       if (khi)
         match = SUPERDOMAIN_MATCH;
@@ -163,7 +290,7 @@ end:
   return khi;
 }
 
-static bool
+static struct hsts_kh_info *
 hsts_new_entry_internal (hsts_store_t store,
                          const char *host, int port,
                          int64_t created, int64_t max_age,
@@ -206,7 +333,7 @@ bail:
       xfree (khi);
     }
 
-  return success;
+  return success ? khi : NULL;
 }
 
 /*
@@ -219,72 +346,84 @@ hsts_add_entry (hsts_store_t store,
                 int64_t max_age, bool include_subdomains)
 {
   int64_t t = (int64_t) time (NULL);
+  struct hsts_kh_info *khi;
 
   /* It might happen time() returned -1 */
-  return (t == -1) ?
-      false :
-      hsts_new_entry_internal (store, host, port, t, max_age, include_subdomains, false, true, false);
-}
+  if (t == -1)
+    return false;
 
-/* Creates a new entry, unless an identical one already exists. */
-static bool
-hsts_new_entry (hsts_store_t store,
-                const char *host, int port,
-                int64_t created, int64_t max_age,
-                bool include_subdomains)
-{
-  return hsts_new_entry_internal (store, host, port, created, max_age, include_subdomains, true, true, true);
+  khi = hsts_new_entry_internal (store, host, port, t, max_age, include_subdomains, false, true, false);
+  if (khi)
+    khi->dirty = true;
+
+  return khi != NULL;
 }
 
 static void
 hsts_remove_entry (hsts_store_t store, struct hsts_kh *kh)
 {
+  void *key, *value;
+  int64_t t = (int64_t) time (NULL);
+
+  if (!hash_table_get_pair (store->table, kh, &key, &value))
+    return;
+
+  DO_REALLOC (store->removed, store->removed_size,
+              store->removed_count + 1, struct hsts_removed_entry);
+  store->removed[store->removed_count].host = xstrdup (kh->host);
+  store->removed[store->removed_count].explicit_port = kh->explicit_port;
+  store->removed[store->removed_count].removed =
+    (t == -1) ? ((struct hsts_kh_info *) value)->created : t;
+  store->removed_count++;
+
   hash_table_remove (store->table, kh);
+  xfree (((struct hsts_kh *) key)->host);
+  xfree (key);
+  xfree (value);
 }
 
-static bool
+/* Merge a line of the database file with the entries in memory, so
+   that the newest information about the host wins.  Entries we
+   changed ourselves win a tie. */
+static void
 hsts_store_merge (hsts_store_t store,
                   const char *host, int port,
                   int64_t created, int64_t max_age,
                   bool include_subdomains)
 {
-  enum hsts_kh_match match_type = NO_MATCH;
-  struct hsts_kh_info *khi = NULL;
-  bool success = false;
+  struct hsts_kh kh;
+  struct hsts_kh_info *khi;
+
+  kh.host = xstrdup_lower (host);
+  kh.explicit_port = MAKE_EXPLICIT_PORT (SCHEME_HTTPS, port);
 
-  port = MAKE_EXPLICIT_PORT (SCHEME_HTTPS, port);
-  khi = hsts_find_entry (store, host, port, &match_type, NULL);
-  if (khi && match_type == CONGRUENT_MATCH && created > khi->created)
+  khi = (struct hsts_kh_info *) hash_table_get (store->table, &kh);
+  if (!khi)
+    hsts_new_entry_internal (store, host, port, created, max_age, include_subdomains, true, true, false);
+  else if (created > khi->created || (created == khi->created && !khi->dirty))
     {
-      /* update the entry with the new info */
       khi->created = created;
       khi->max_age = max_age;
       khi->include_subdomains = include_subdomains;
-
-      success = true;
     }
-  else if (!khi)
-    success = hsts_new_entry (store, host, port, created, max_age, include_subdomains);
 
-  return success;
+  xfree (kh.host);
 }
 
-static bool
-hsts_read_database (hsts_store_t store, FILE *fp, bool merge_with_existing_entries)
+/* Read every line of the database into the store, to compact it. */
+static void
+hsts_read_database (hsts_store_t store, FILE *fp)
 {
   char *line = NULL, *p;
   size_t len = 0;
   int items_read;
-  bool result = false;
-  bool (*func)(hsts_store_t, const char *, int, int64_t, int64_t, bool);
+  int i;
 
   char host[256];
   int port;
   int64_t created, max_age;
   int include_subdomains;
 
-  func = (merge_with_existing_entries ? hsts_store_merge : hsts_new_entry);
-
   while (getline (&line, &len, fp) > 0)
     {
       for (p = line; c_isspace (*p); p++)
@@ -301,24 +440,51 @@ hsts_read_database (hsts_store_t store, FILE *fp, bool merge_with_existing_entri
                            &max_age);
 
       if (items_read == 5)
-        func (store, host, port, created, max_age, !!include_subdomains);
+        hsts_store_merge (store, host, port, created, max_age, !!include_subdomains);
     }
 
   xfree (line);
-  result = true;
 
-  return result;
+  /* Now drop whatever we removed since, unless it was added again. */
+  for (i = 0; i < store->removed_count; i++)
+    {
+      struct hsts_removed_entry *r = &store->removed[i];
+      struct hsts_kh kh = { r->host, r->explicit_port };
+      struct hsts_kh_info *khi = hash_table_get (store->table, &kh);
+
+      if (khi && (khi->created < r->removed
+                  || (khi->created == r->removed && !khi->dirty)))
+        khi->max_age = 0;
+    }
 }
 
+/* Write the database header, for a new or rewritten file. */
 static void
-hsts_store_dump (hsts_store_t store, FILE *fp)
+hsts_store_dump_header (FILE *fp)
 {
-  hash_table_iterator it;
-
   /* Print preliminary comments. We don't care if any of these fail. */
   fputs ("# HSTS 1.0 Known Hosts database for GNU Wget.\n", fp);
   fputs ("# Edit at your own risk.\n", fp);
   fputs ("# <hostname>\t<port>\t<incl. subdomains>\t<created>\t<max-age>\n", fp);
+}
+
+/* Write the entries of the store to the database.  If CHANGES_ONLY,
+   only the entries removed or changed since the store was opened;
+   they are appended and supersede the earlier lines.  Otherwise all
+   live entries. */
+static void
+hsts_store_dump (hsts_store_t store, FILE *fp, bool changes_only)
+{
+  hash_table_iterator it;
+  int64_t now = (int64_t) time (NULL);
+  int i;
+
+  if (changes_only)
+    for (i = 0; i < store->removed_count; i++)
+      if (fprintf (fp, HSTS_LINE_FORMAT, store->removed[i].host,
+                   store->removed[i].explicit_port, 0,
+                   store->removed[i].removed, (int64_t) 0) < 0)
+        goto error;
 
   /* Now cycle through the HSTS store in memory and dump the entries */
   for (hash_table_iterate (store->table, &it); hash_table_iter_next (&it);)
@@ -326,14 +492,19 @@ hsts_store_dump (hsts_store_t store, FILE *fp)
       struct hsts_kh *kh = (struct hsts_kh *) it.key;
       struct hsts_kh_info *khi = (struct hsts_kh_info *) it.value;
 
-      if (fprintf (fp, "%s\t%d\t%d\t%" PRId64 "\t%" PRId64 "\n",
+      if (changes_only ? !khi->dirty
+          : khi->max_age <= 0 || khi->created + khi->max_age < now)
+        continue;
+
+      if (fprintf (fp, HSTS_LINE_FORMAT,
                    kh->host, kh->explicit_port, khi->include_subdomains,
                    khi->created, khi->max_age) < 0)
-        {
-          logprintf (LOG_ALWAYS, "Could not write the HSTS database correctly.\n");
-          break;
-        }
+        goto error;
     }
+  return;
+
+error:
+  logprintf (LOG_ALWAYS, "Could not write the HSTS database correctly.\n");
 }
 
 /*
@@ -396,7 +567,6 @@ hsts_match (hsts_store_t store, struct url *u)
                   if (u->port == 80)
                     u->port = 443;
                   url_changed = true;
-                  store->changed = true;
                 }
             }
           else
@@ -470,6 +640,7 @@ hsts_store_entry (hsts_store_t store,
                   entry->created = t;
                   entry->max_age = max_age;
                   entry->include_subdomains = include_subdomains;
+                  entry->dirty = true;
                   store->changed = true;
                 }
             }
@@ -497,57 +668,47 @@ hsts_store_entry (hsts_store_t store,
   return result;
 }
 
+/*
+   Opens the HSTS store kept in FILENAME.
+
+   The file is not read here: the entries of a host are looked up the
+   first time that host is matched against, so that a single download
+   does not have to parse the whole database.
+ */
 hsts_store_t
 hsts_store_open (const char *filename)
 {
   hsts_store_t store = NULL;
   file_stats_t fstats;
 
+  if (file_exists_p (filename, &fstats) && !hsts_file_access_valid (filename))
+    {
+      /*
+       * If we're not reading the HSTS database,
+       * then by all means act as if HSTS was disabled.
+       */
+      logprintf (LOG_NOTQUIET, "Will not apply HSTS. "
+                 "The HSTS database must be a regular and non-world-writable file.\n");
+      return NULL;
+    }
+
   store = xnew0 (struct hsts_store);
   store->table = hash_table_new (0, hsts_hash_func, hsts_cmp_func);
-  store->last_mtime = 0;
+  store->looked_up = hash_table_new (0, hsts_hash_func, hsts_cmp_func);
+  store->filename = filename ? xstrdup (filename) : NULL;
   store->changed = false;
 
-  if (file_exists_p (filename, &fstats))
-    {
-      if (hsts_file_access_valid (filename))
-        {
-          struct stat st;
-          FILE *fp = fopen_stat (filename, "r", &fstats);
-
-          if (!fp || !hsts_read_database (store, fp, false))
-            {
-              /* abort! */
-              hsts_store_close (store);
-              xfree (store);
-              if (fp)
-                fclose (fp);
-              goto out;
-            }
-
-          if (fstat (fileno (fp), &st) == 0)
-            store->last_mtime = st.st_mtime;
-
-          fclose (fp);
-        }
-      else
-        {
-          /*
-           * If we're not reading the HSTS database,
-           * then by all means act as if HSTS was disabled.
-           */
-          hsts_store_close (store);
-          xfree (store);
-
-          logprintf (LOG_NOTQUIET, "Will not apply HSTS. "
-                     "The HSTS database must be a regular and non-world-writable file.\n");
-        }
-    }
-
-out:
   return store;
 }
 
+/*
+   Saves the changes made to the HSTS store.
+
+   The removed and changed entries are appended to FILENAME, so the
+   lines already there need not be read back.  Once the file has grown
+   past HSTS_COMPACT_SIZE, it is read in full, merged with our changes
+   and rewritten with the live entries only.
+ */
 void
 hsts_store_save (hsts_store_t store, const char *filename)
 {
@@ -555,7 +716,7 @@ hsts_store_save (hsts_store_t store, const char *filename)
   FILE *fp = NULL;
   int fd = 0;
 
-  if (filename && hash_table_count (store->table) > 0)
+  if (filename && store->changed)
     {
       fp = fopen (filename, "a+");
       if (fp)
@@ -564,20 +725,29 @@ hsts_store_save (hsts_store_t store, const char *filename)
           fd = fileno (fp);
           flock (fd, LOCK_EX);
 
-          /* If the file has changed, merge the changes with our in-memory data
-             before dumping them to the file.
-             Otherwise we could potentially overwrite the data stored by other Wget processes.
-           */
-          if (store->last_mtime && stat (filename, &st) == 0 && st.st_mtime > store->last_mtime)
-            hsts_read_database (store, fp, true);
+          if (fstat (fd, &st) != 0)
+            st.st_size = 0;
 
-          /* We've merged the latest changes so we can now truncate the file
-             and dump everything. */
-          fseek (fp, 0, SEEK_SET);
-          ftruncate (fd, 0);
+          if (st.st_size > HSTS_COMPACT_SIZE)
+            {
+              /* Merge the lines written by us and by other Wget
+                 processes, then truncate the file and dump
+                 everything. */
+              fseek (fp, 0, SEEK_SET);
+              hsts_read_database (store, fp);
 
-          /* now dump to the file */
-          hsts_store_dump (store, fp);
+              fseek (fp, 0, SEEK_SET);
+              ftruncate (fd, 0);
+
+              hsts_store_dump_header (fp);
+              hsts_store_dump (store, fp, false);
+            }
+          else
+            {
+              if (st.st_size == 0)
+                hsts_store_dump_header (fp);
+              hsts_store_dump (store, fp, true);
+            }
 
           /* fclose is expected to unlock the file for us */
           fclose (fp);
@@ -595,6 +765,7 @@ void
 hsts_store_close (hsts_store_t store)
 {
   hash_table_iterator it;
+  int i;
 
   /* free all the host fields */
   for (hash_table_iterate (store->table, &it); hash_table_iter_next (&it);)
@@ -605,6 +776,21 @@ hsts_store_close (hsts_store_t store)
     }
 
   hash_table_destroy (store->table);
+
+  for (hash_table_iterate (store->looked_up, &it); hash_table_iter_next (&it);)
+    {
+      xfree (((struct hsts_kh *) it.key)->host);
+      xfree (it.key);
+    }
+
+  hash_table_destroy (store->looked_up);
+
+  for (i = 0; i < store->removed_count; i++)
+    xfree (store->removed[i].host);
+
+  xfree (store->removed);
+  xfree (store->filename);
+  xfree (store->db);
 }
 
 #ifdef TESTING
@@ -824,5 +1010,57 @@ test_hsts_read_database (void)
 
   return NULL;
 }
+
+const char*
+test_hsts_append_database (void)
+{
+  hsts_store_t table;
+  char *file = NULL;
+  FILE *fp = NULL;
+  char *line = NULL;
+  size_t len = 0;
+  int lines = 0;
+  int64_t created = time(NULL) - 10;
+
+  if (opt.homedir)
+    {
+      file = ajoin_dir_file (opt.homedir, ".wget-hsts-testing");
+      fp = fopen (file, "w");
+      mu_assert("Could not create the HSTS database", fp != NULL);
+      fprintf (fp, "foo.example.com\t0\t1\t%" PRId64 "\t1234\n", created);
+      fprintf (fp, "bar.example.com\t0\t0\t%" PRId64 "\t1234\n", created);
+      fclose (fp);
+
+      /* Remove one entry and update the other one. */
+      table = hsts_store_open (file);
+      TEST_URL_RW (table, "www.foo.example.com", 80);
+      hsts_store_entry (table, SCHEME_HTTPS, "foo.example.com", 443, 0, true);
+      hsts_store_entry (table, SCHEME_HTTPS, "bar.example.com", 443, 5678, true);
+      hsts_store_save (table, file);
+      hsts_store_close (table);
+      xfree (table);
+
+      table = hsts_store_open (file);
+      TEST_URL_NORW (table, "foo.example.com", 80);
+      TEST_URL_RW (table, "www.bar.example.com", 80);
+      hsts_store_close (table);
+      xfree (table);
+
+      /* The second save should have only appended to the file. */
+      fp = fopen (file, "r");
+      mu_assert("The HSTS database should have been created", fp != NULL);
+      while (getline (&line, &len, fp) > 0)
+        if (*line != '#')
+          lines++;
+      fclose (fp);
+      xfree (line);
+      unlink (file);
+      xfree (file);
+
+      mu_assert("The HSTS database should have been appended to", lines == 4);
+    }
+
+  return NULL;
+}
 #endif /* TESTING */
 #endif /* HAVE_HSTS */
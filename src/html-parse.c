@@ -99,9 +99,13 @@ as that of the covered work.  */
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 #include "utils.h"
 #include "html-parse.h"
+#include "stats.h"
 
 #ifdef STANDALONE
 # undef xmalloc
@@ -126,17 +130,6 @@ as that of the covered work.  */
 # define c_isalnum(x) isalnum (x)
 # define c_tolower(x) tolower (x)
 # define c_toupper(x) toupper (x)
-
-struct hash_table {
-  int dummy;
-};
-static void *
-hash_table_get (const struct hash_table *ht, void *ptr)
-{
-  return ptr;
-}
-#else  /* not STANDALONE */
-# include "hash.h"
 #endif
 
 /* Pool support.  A pool is a resizable chunk of memory.  It is first
@@ -147,8 +140,9 @@ hash_table_get (const struct hash_table *ht, void *ptr)
    Thus taginfo->name, and attr->name and attr->value for each
    attribute, do not point into separately allocated areas, but into
    different parts of the pool, separated only by terminating zeros.
-   This ensures minimum amount of allocation and, for most tags, no
-   allocation because the entire pool is kept on the stack.  */
+   This ensures minimum amount of allocation.  map_html_tags() starts
+   with the pool the previous document left it, see struct
+   parser_state, so that most documents need no allocation at all.  */
 
 struct pool {
   char *contents;               /* pointer to the contents. */
@@ -156,12 +150,6 @@ struct pool {
   int tail;                     /* next available position index. */
   bool resized;                 /* whether the pool has been resized
                                    using malloc. */
-
-  char *orig_contents;          /* original pool contents, usually
-                                   stack-allocated.  used by POOL_FREE
-                                   to restore the pool to the initial
-                                   state. */
-  int orig_size;
 };
 
 /* Initialize the pool to hold INITIAL_SIZE bytes of storage. */
@@ -172,8 +160,6 @@ struct pool {
   P->size = (initial_size);                                     \
   P->tail = 0;                                                  \
   P->resized = false;                                           \
-  P->orig_contents = P->contents;                               \
-  P->orig_size = P->size;                                       \
 } while (0)
 
 /* Grow the pool to accommodate at least SIZE new bytes.  If the pool
@@ -206,22 +192,6 @@ struct pool {
 /* Forget old pool contents.  The allocated memory is not freed. */
 #define POOL_REWIND(p) (p)->tail = 0
 
-/* Free heap-allocated memory for contents of POOL.  This calls
-   xfree() if the memory was allocated through malloc.  It also
-   restores `contents' and `size' to their original, pre-malloc
-   values.  That way after POOL_FREE, the pool is fully usable, just
-   as if it were freshly initialized with POOL_INIT.  */
-
-#define POOL_FREE(p) do {                       \
-  struct pool *P = p;                           \
-  if (P->resized)                               \
-    xfree (P->contents);                        \
-  P->contents = P->orig_contents;               \
-  P->size = P->orig_size;                       \
-  P->tail = 0;                                  \
-  P->resized = false;                           \
-} while (0)
-
 /* Used for small stack-allocated memory chunks that might grow.  Like
    DO_REALLOC, this macro grows BASEVAR as necessary to take
    NEEDED_SIZE items of TYPE.
@@ -276,89 +246,162 @@ struct tagstack_item {
   const char *tagname_begin;
   const char *tagname_end;
   const char *contents_begin;
-  struct tagstack_item *prev;
-  struct tagstack_item *next;
+};
+
+/* The tags whose end tags are yet to be seen, innermost last.  */
+struct tagstack {
+  struct tagstack_item *items;
+  int count;
+  int size;
 };
 
 static struct tagstack_item *
-tagstack_push (struct tagstack_item **head, struct tagstack_item **tail)
+tagstack_push (struct tagstack *stack)
 {
-  struct tagstack_item *ts = xmalloc(sizeof(struct tagstack_item));
-  if (*head == NULL)
+  if (stack->count == stack->size)
     {
-      *head = *tail = ts;
-      ts->prev = ts->next = NULL;
+      stack->size = stack->size ? stack->size << 1 : 16;
+      stack->items = xrealloc (stack->items,
+                               stack->size * sizeof (struct tagstack_item));
     }
-  else
+  return &stack->items[stack->count++];
+}
+
+/* Return the position in STACK of the innermost tag named
+   [TAGNAME_BEGIN, TAGNAME_END), or -1 if there is none.  Removing it
+   and everything after it from the stack is setting the count to
+   it.  */
+static int
+tagstack_find (const struct tagstack *stack, const char *tagname_begin,
+               const char *tagname_end)
+{
+  int len = tagname_end - tagname_begin;
+  int i;
+
+  for (i = stack->count - 1; i >= 0; i--)
     {
-      (*tail)->next = ts;
-      ts->prev = *tail;
-      *tail = ts;
-      ts->next = NULL;
+      const struct tagstack_item *ts = &stack->items[i];
+      if (len == (ts->tagname_end - ts->tagname_begin))
+        {
+          if (0 == strncasecmp (ts->tagname_begin, tagname_begin, len))
+            return i;
+        }
     }
+  return -1;
+}
+
+/* What map_html_tags keeps from one document to the next: the pool,
+   the attributes and the tag stack, as large as the documents parsed
+   so far needed them, so that they are not grown again for each
+   document.  Each thread has its own.  Buffers grown past
+   PARSER_KEEP_MAX bytes by some huge document are not kept.  */
+struct parser_state {
+  char *pool;
+  int pool_size;
+  struct attr_pair *pairs;
+  int pairs_size;
+  struct tagstack tags;
+  bool busy;                    /* in use by map_html_tags */
+};
 
-  return ts;
+#define PARSER_KEEP_MAX (1 << 20)
+
+static void
+parser_state_free (void *arg)
+{
+  struct parser_state *state = arg;
+
+  xfree (state->pool);
+  xfree (state->pairs);
+  xfree (state->tags.items);
+  xfree (state);
 }
 
-/* remove ts and everything after it from the stack */
+#ifdef HAVE_PTHREAD
+static pthread_key_t parser_key;
+static pthread_once_t parser_key_once = PTHREAD_ONCE_INIT;
+
 static void
-tagstack_pop (struct tagstack_item **head, struct tagstack_item **tail,
-              struct tagstack_item *ts)
+parser_key_init (void)
 {
-  if (*head == NULL)
-    return;
+  pthread_key_create (&parser_key, parser_state_free);
+}
+
+# define get_parser_state() \
+  (pthread_once (&parser_key_once, parser_key_init), \
+   (struct parser_state *) pthread_getspecific (parser_key))
+# define set_parser_state(s) pthread_setspecific (parser_key, (s))
+#else /* not HAVE_PTHREAD */
+static struct parser_state *thread_parser_state;
+
+# define get_parser_state() thread_parser_state
+# define set_parser_state(s) (thread_parser_state = (s))
+#endif /* not HAVE_PTHREAD */
+
+/* Return the parser state of the calling thread, or a new one if it
+   is already in use.  */
+
+static struct parser_state *
+parser_state_take (void)
+{
+  struct parser_state *state = get_parser_state ();
 
-  if (ts == *tail)
+  if (!state || state->busy)
     {
-      if (ts == *head)
-        {
-          xfree (ts);
-          *head = *tail = NULL;
-        }
-      else
-        {
-          ts->prev->next = NULL;
-          *tail = ts->prev;
-          xfree (ts);
-        }
+      state = xmalloc (sizeof (struct parser_state));
+      memset (state, 0, sizeof (*state));
+      state->pool_size = 256;
+      state->pool = xmalloc (state->pool_size);
+      state->pairs_size = 8;
+      state->pairs = xmalloc (state->pairs_size * sizeof (struct attr_pair));
+      if (!get_parser_state ())
+        set_parser_state (state);
     }
-  else
-    {
-      if (ts == *head)
-        {
-          *head = NULL;
-        }
-      *tail = ts->prev;
+  state->busy = true;
+  return state;
+}
 
-      if (ts->prev)
-        {
-          ts->prev->next = NULL;
-        }
-      while (ts)
-        {
-          struct tagstack_item *p = ts->next;
-          xfree (ts);
-          ts = p;
-        }
+/* Give back STATE, taken by parser_state_take.  */
+
+static void
+parser_state_give_back (struct parser_state *state)
+{
+  if (state != get_parser_state ())
+    {
+      parser_state_free (state);
+      return;
+    }
+  state->busy = false;
+  state->tags.count = 0;
+  if (state->pool_size > PARSER_KEEP_MAX)
+    {
+      xfree (state->pool);
+      state->pool_size = 256;
+      state->pool = xmalloc (state->pool_size);
+    }
+  if (state->pairs_size * (int) sizeof (struct attr_pair) > PARSER_KEEP_MAX)
+    {
+      xfree (state->pairs);
+      state->pairs_size = 8;
+      state->pairs = xmalloc (state->pairs_size * sizeof (struct attr_pair));
     }
 }
 
-static struct tagstack_item *
-tagstack_find (struct tagstack_item *tail, const char *tagname_begin,
-               const char *tagname_end)
+#if defined DEBUG_MALLOC || defined TESTING
+/* Free the parser state of the calling thread.  */
+
+void
+html_parse_cleanup (void)
 {
-  int len = tagname_end - tagname_begin;
-  while (tail)
+  struct parser_state *state = get_parser_state ();
+
+  if (state)
     {
-      if (len == (tail->tagname_end - tail->tagname_begin))
-        {
-          if (0 == strncasecmp (tail->tagname_begin, tagname_begin, len))
-            return tail;
-        }
-      tail = tail->prev;
+      set_parser_state (NULL);
+      parser_state_free (state);
     }
-  return NULL;
 }
+#endif
 
 /* Decode the HTML character entity at *PTR, considering END to be end
    of buffer.  It is assumed that the "&" character that marks the
@@ -729,75 +772,28 @@ advance_declaration (const char *beg, const char *end)
 static const char *
 find_comment_end (const char *beg, const char *end)
 {
-  /* Open-coded Boyer-Moore search for "-->".  Examine the third char;
-     if it's not '>' or '-', advance by three characters.  Otherwise,
-     look at the preceding characters and try to find a match.  */
+  /* Let memchr() skip to each '>' and look back for the two dashes.
+     '>' is rare inside comments, so this touches few characters
+     outside of the (vectorized) memchr scan.  */
 
-  const char *p = beg - 1;
+  const char *p = beg + 2;
 
-  while ((p += 3) < end)
-    switch (p[0])
-      {
-      case '>':
-        if (p[-1] == '-' && p[-2] == '-')
-          return p + 1;
-        break;
-      case '-':
-      at_dash:
-        if (p[-1] == '-')
-          {
-          at_dash_dash:
-            if (++p == end) return NULL;
-            switch (p[0])
-              {
-              case '>': return p + 1;
-              case '-': goto at_dash_dash;
-              }
-          }
-        else
-          {
-            if ((p += 2) >= end) return NULL;
-            switch (p[0])
-              {
-              case '>':
-                if (p[-1] == '-')
-                  return p + 1;
-                break;
-              case '-':
-                goto at_dash;
-              }
-          }
-      }
+  while (p < end && (p = memchr (p, '>', end - p)) != NULL)
+    {
+      if (p[-1] == '-' && p[-2] == '-')
+        return p + 1;
+      ++p;
+    }
   return NULL;
 }
 
 /* Return true if the string containing of characters inside [b, e) is
-   present in hash table HT.  */
+   accepted by FILTER, or if there is no filter.  */
 
-static bool
-name_allowed (const struct hash_table *ht, const char *b, const char *e)
+static inline bool
+name_allowed (html_name_filter_t filter, const char *b, const char *e)
 {
-  char buf[256], *copy;
-  size_t len = e - b;
-  bool ret;
-
-  if (!ht)
-    return true;
-
-  if (len < sizeof (buf))
-    copy = buf;
-  else
-    copy = xmalloc (len + 1);
-
-  memcpy (copy, b, len);
-  copy[len] = 0;
-
-  ret = hash_table_get (ht, copy) != NULL;
-
-  if (copy != buf)
-    xfree (copy);
-
-  return ret;
+  return !filter || filter (b, e - b);
 }
 
 /* Advance P (a char pointer), with the explicit intent of being able
@@ -825,10 +821,10 @@ static int tag_backout_count;
    MAPFUN will be called with two arguments: pointer to an initialized
    struct taginfo, and MAPARG.
 
-   ALLOWED_TAGS and ALLOWED_ATTRIBUTES are hash tables the keys of
-   which are the tags and attribute names that this function should
-   use.  If ALLOWED_TAGS is NULL, all tags are processed; if
-   ALLOWED_ATTRIBUTES is NULL, all attributes are returned.
+   ALLOWED_TAGS and ALLOWED_ATTRIBUTES are predicates that accept the
+   tags and attribute names that this function should use.  If
+   ALLOWED_TAGS is NULL, all tags are processed; if ALLOWED_ATTRIBUTES
+   is NULL, all attributes are returned.
 
    (Obviously, the caller can filter out unwanted tags and attributes
    just as well, but this is just an optimization designed to avoid
@@ -839,29 +835,43 @@ void
 map_html_tags (const char *text, int size,
                void (*mapfun) (struct taginfo *, void *), void *maparg,
                int flags,
-               const struct hash_table *allowed_tags,
-               const struct hash_table *allowed_attributes)
+               html_name_filter_t allowed_tags,
+               html_name_filter_t allowed_attributes)
 {
-  /* storage for strings passed to MAPFUN callback; if 256 bytes is
-     too little, POOL_APPEND allocates more with malloc. */
-  char pool_initial_storage[256];
+  /* The buffers kept from the previous documents.  */
+  struct parser_state *state;
+
+  /* storage for strings passed to MAPFUN callback; POOL_APPEND grows
+     it as needed. */
   struct pool pool;
 
   const char *p = text;
   const char *end = text + size;
 
-  struct attr_pair attr_pair_initial_storage[8];
-  int attr_pair_size = countof (attr_pair_initial_storage);
-  bool attr_pair_resized = false;
-  struct attr_pair *pairs = attr_pair_initial_storage;
+  int attr_pair_size;
+  bool attr_pair_resized = true;
+  struct attr_pair *pairs;
+
+  struct tagstack *tags;
 
-  struct tagstack_item *head = NULL;
-  struct tagstack_item *tail = NULL;
+  /* Position of the next double and single quote at or after the
+     last point where they were searched for, or END if there are no
+     more.  Remembering them keeps the quoted-value scan below linear
+     even when unterminated values force it to back out.  */
+  const char *next_quote[2] = { NULL, NULL };
 
   if (!size)
     return;
 
-  POOL_INIT (&pool, pool_initial_storage, countof (pool_initial_storage));
+  STATS_START (start);
+  MEMACCT_ENTER (memacct_saved, MEMACCT_HTML);
+
+  state = parser_state_take ();
+  POOL_INIT (&pool, state->pool, state->pool_size);
+  pool.resized = true;
+  pairs = state->pairs;
+  attr_pair_size = state->pairs_size;
+  tags = &state->tags;
 
   {
     int nattrs, end_tag;
@@ -927,13 +937,10 @@ map_html_tags (const char *text, int size,
 
     if (!end_tag)
       {
-        struct tagstack_item *ts = tagstack_push (&head, &tail);
-        if (ts)
-          {
-            ts->tagname_begin  = tag_name_begin;
-            ts->tagname_end    = tag_name_end;
-            ts->contents_begin = NULL;
-          }
+        struct tagstack_item *ts = tagstack_push (tags);
+        ts->tagname_begin  = tag_name_begin;
+        ts->tagname_end    = tag_name_end;
+        ts->contents_begin = NULL;
       }
 
     if (end_tag && *p != '>' && *p != '<')
@@ -1011,6 +1018,20 @@ map_html_tags (const char *text, int size,
                 ADVANCE (p);
                 attr_value_begin = p; /* <foo bar="baz"> */
                                       /*           ^     */
+                {
+                  /* Find the closing quote with memchr() and jump
+                     straight to it, unless there's a newline in the
+                     way, which the loop below handles.  */
+                  const char **qp = &next_quote[quote_char == '\''];
+                  if (!*qp || *qp < p)
+                    {
+                      *qp = memchr (p, quote_char, end - p);
+                      if (!*qp)
+                        *qp = end;
+                    }
+                  if (*qp < end && !memchr (p, '\n', *qp - p))
+                    p = *qp;
+                }
                 while (*p != quote_char)
                   {
                     if (!newline_seen && *p == '\n')
@@ -1098,9 +1119,10 @@ map_html_tags (const char *text, int size,
         ++nattrs;
       }
 
-    if (!end_tag && tail && (tail->tagname_begin == tag_name_begin))
+    if (!end_tag && tags->count
+        && tags->items[tags->count - 1].tagname_begin == tag_name_begin)
       {
-        tail->contents_begin = p+1;
+        tags->items[tags->count - 1].contents_begin = p+1;
       }
 
     if (uninteresting_tag)
@@ -1114,7 +1136,6 @@ map_html_tags (const char *text, int size,
     {
       int i;
       struct taginfo taginfo;
-      struct tagstack_item *ts = NULL;
 
       taginfo.name      = pool.contents;
       taginfo.end_tag_p = end_tag;
@@ -1136,15 +1157,16 @@ map_html_tags (const char *text, int size,
 
       if (end_tag)
         {
-          ts = tagstack_find (tail, tag_name_begin, tag_name_end);
-          if (ts)
+          int pos = tagstack_find (tags, tag_name_begin, tag_name_end);
+          if (pos >= 0)
             {
+              const struct tagstack_item *ts = &tags->items[pos];
               if (ts->contents_begin)
                 {
                   taginfo.contents_begin = ts->contents_begin;
                   taginfo.contents_end   = tag_start_position;
                 }
-              tagstack_pop (&head, &tail, ts);
+              tags->count = pos;
             }
         }
 
@@ -1165,11 +1187,13 @@ map_html_tags (const char *text, int size,
   }
 
  finish:
-  POOL_FREE (&pool);
-  if (attr_pair_resized)
-    xfree (pairs);
-  /* pop any tag stack that's left */
-  tagstack_pop (&head, &tail, head);
+  state->pool = pool.contents;
+  state->pool_size = pool.size;
+  state->pairs = pairs;
+  state->pairs_size = attr_pair_size;
+  parser_state_give_back (state);
+  MEMACCT_LEAVE (memacct_saved);
+  STATS_STOP (STATS_MAP_HTML_TAGS, start, size);
 }
 
 #undef ADVANCE
@@ -57,7 +57,10 @@ struct taginfo {
   const char *contents_end;     /* only valid if end_tag_p */
 };
 
-struct hash_table;              /* forward declaration */
+/* Predicate that tells map_html_tags whether a tag or attribute name
+   is of interest.  The name is passed as a pointer and a length; it
+   is not NUL-terminated and not case-folded.  */
+typedef bool (*html_name_filter_t) (const char *, size_t);
 
 /* Flags for map_html_tags: */
 #define MHT_STRICT_COMMENTS  1  /* use strict comment interpretation */
@@ -66,6 +69,7 @@ struct hash_table;              /* forward declaration */
 
 void map_html_tags (const char *, int,
                     void (*) (struct taginfo *, void *), void *, int,
-                    const struct hash_table *, const struct hash_table *);
+                    html_name_filter_t, html_name_filter_t);
+void html_parse_cleanup (void);
 
 #endif /* HTML_PARSE_H */
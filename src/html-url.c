@@ -35,6 +35,9 @@ as that of the covered work.  */
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 #include "exits.h"
 #include "html-parse.h"
@@ -188,14 +191,93 @@ static const char *additional_attributes[] = {
   "srcset",                     /* used by tag_handle_img */
 };
 
-static struct hash_table *interesting_tags;
-static struct hash_table *interesting_attributes;
+/* A set of names, looked up case-insensitively and without copying
+   through a perfect hash.  The sets don't change after
+   init_interesting, so it simply searches for a hash seed under which
+   none of the names collide; with a table several times the size of
+   the largest set, that takes a handful of attempts.  */
+
+#define NAME_SET_SIZE 128
 
-/* Will contains the (last) charset found in 'http-equiv=content-type'
-   by html 4.01 or 'charset=' by html5 of meta tags.  */
-static char *meta_charset;
+struct name_set {
+  unsigned int seed;
+  const char *names[NAME_SET_SIZE];
+  unsigned char lengths[NAME_SET_SIZE];
+  int values[NAME_SET_SIZE];
+};
+
+static unsigned int
+name_hash (const char *name, size_t len, unsigned int seed)
+{
+  /* FNV-1a over the lower-cased name, with the seed folded into the
+     offset basis.  */
+  unsigned int h = 2166136261U ^ seed;
+  while (len--)
+    {
+      h ^= (unsigned char) c_tolower (*name++);
+      h *= 16777619U;
+    }
+  return (h ^ (h >> 15)) % NAME_SET_SIZE;
+}
+
+/* Look up NAME (LEN characters, not NUL-terminated) in SET.  Return
+   the value stored for it, or -1 if it is not in the set.  */
+
+static int
+name_set_lookup (const struct name_set *set, const char *name, size_t len)
+{
+  unsigned int slot = name_hash (name, len, set->seed);
+  if (set->names[slot] && set->lengths[slot] == len
+      && 0 == c_strncasecmp (set->names[slot], name, len))
+    return set->values[slot];
+  return -1;
+}
+
+/* Build SET out of the COUNT names in NAMES, storing VALUES[i] (or i,
+   if VALUES is NULL) for NAMES[i].  Duplicate names keep the first
+   value.  */
 
 static void
+name_set_init (struct name_set *set, const char **names, const int *values,
+               int count)
+{
+  int i;
+
+  for (set->seed = 0; ; set->seed++)
+    {
+      memset (set->names, 0, sizeof (set->names));
+      for (i = 0; i < count; i++)
+        {
+          size_t len = strlen (names[i]);
+          unsigned int slot = name_hash (names[i], len, set->seed);
+          if (!set->names[slot])
+            {
+              set->names[slot] = names[i];
+              set->lengths[slot] = len;
+              set->values[slot] = values ? values[i] : i;
+            }
+          else if (set->lengths[slot] != len
+                   || c_strncasecmp (set->names[slot], names[i], len))
+            break;              /* collision, try the next seed */
+        }
+      if (i == count)
+        return;
+    }
+}
+
+/* interesting_tags maps the names of the known tags that are not
+   excluded by --ignore-tags or --follow-tags to their index in
+   known_tags.  interesting_attributes holds the attribute names the
+   tag handlers look at.  */
+static struct name_set interesting_tags;
+static struct name_set interesting_attributes;
+static bool interesting_initialized;
+
+/* Init the tables used to parse HTML.  get_urls_html does this on
+   first use; threads that parse documents concurrently must have it
+   done beforehand.  */
+
+void
 init_interesting (void)
 {
   /* Init the variables interesting_tags and interesting_attributes
@@ -207,47 +289,68 @@ init_interesting (void)
      matches the user's preferences as specified through --ignore-tags
      and --follow-tags.  */
 
+  const char *names[countof (known_tags)
+                    + countof (additional_attributes)
+                    + countof (tag_url_attributes)];
+  int values[countof (known_tags)];
   size_t i;
-  interesting_tags = make_nocase_string_hash_table (countof (known_tags));
+  int count = 0;
 
-  /* First, add all the tags we know hot to handle, mapped to their
-     respective entries in known_tags.  */
-  for (i = 0; i < countof (known_tags); i++)
-    hash_table_put (interesting_tags, known_tags[i].name, known_tags + i);
-
-  /* Then remove the tags ignored through --ignore-tags.  */
-  if (opt.ignore_tags)
-    {
-      char **ignored;
-      for (ignored = opt.ignore_tags; *ignored; ignored++)
-        hash_table_remove (interesting_tags, *ignored);
-    }
+  if (interesting_initialized)
+    return;
 
-  /* If --follow-tags is specified, use only those tags.  */
-  if (opt.follow_tags)
+  /* First, take all the tags we know how to handle, mapped to their
+     respective entries in known_tags, except the ones ignored through
+     --ignore-tags, or not listed in --follow-tags if it is specified.
+     Unknown --follow-tags entries are ignored.  */
+  for (i = 0; i < countof (known_tags); i++)
     {
-      /* Create a new table intersecting --follow-tags and known_tags,
-         and use it as interesting_tags.  */
-      struct hash_table *intersect = make_nocase_string_hash_table (0);
-      char **followed;
-      for (followed = opt.follow_tags; *followed; followed++)
+      char **tags;
+      if (opt.ignore_tags)
+        {
+          for (tags = opt.ignore_tags; *tags; tags++)
+            if (!c_strcasecmp (*tags, known_tags[i].name))
+              break;
+          if (*tags)
+            continue;
+        }
+      if (opt.follow_tags)
         {
-          struct known_tag *t = hash_table_get (interesting_tags, *followed);
-          if (!t)
-            continue;           /* ignore unknown --follow-tags entries. */
-          hash_table_put (intersect, *followed, t);
+          for (tags = opt.follow_tags; *tags; tags++)
+            if (!c_strcasecmp (*tags, known_tags[i].name))
+              break;
+          if (!*tags)
+            continue;
         }
-      hash_table_destroy (interesting_tags);
-      interesting_tags = intersect;
+      names[count] = known_tags[i].name;
+      values[count] = i;
+      ++count;
     }
+  name_set_init (&interesting_tags, names, values, count);
 
   /* Add the attributes we care about. */
-  interesting_attributes = make_nocase_string_hash_table (10);
+  count = 0;
   for (i = 0; i < countof (additional_attributes); i++)
-    hash_table_put (interesting_attributes, additional_attributes[i], "1");
+    names[count++] = additional_attributes[i];
   for (i = 0; i < countof (tag_url_attributes); i++)
-    hash_table_put (interesting_attributes,
-                    tag_url_attributes[i].attr_name, "1");
+    names[count++] = tag_url_attributes[i].attr_name;
+  name_set_init (&interesting_attributes, names, NULL, count);
+
+  interesting_initialized = true;
+}
+
+/* Name filters passed to map_html_tags.  */
+
+static bool
+interesting_attribute_p (const char *name, size_t len)
+{
+  return name_set_lookup (&interesting_attributes, name, len) >= 0;
+}
+
+static bool
+meta_tag_p (const char *name, size_t len)
+{
+  return len == 4 && 0 == c_strncasecmp (name, "meta", 4);
 }
 
 /* Find the value of attribute named NAME in the taginfo TAG.  If the
@@ -274,6 +377,138 @@ find_attr (struct taginfo *tag, const char *name, int *attrind)
 #define ATTR_SIZE(tag, attrind) \
  (tag->attrs[attrind].value_raw_size)
 
+/* The URLs the links last merged by append_url parsed to, so that the
+   links repeated on many pages, such as those of a navigation menu,
+   are merged and parsed once.  The entries are kept by key in
+   merge_cache, and in merge_lru from the most recently used, whose
+   last one makes room for a new one once there are MERGE_CACHE_SIZE
+   of them.  */
+#define MERGE_CACHE_SIZE 4096
+
+struct merge_entry {
+  char *key;                    /* see merge_key */
+  struct url *url;              /* the parsed URL, or NULL if the link
+                                   doesn't parse */
+  struct merge_entry *prev, *next;
+};
+
+static struct hash_table *merge_cache;
+static struct merge_entry *merge_lru, *merge_lru_tail;
+
+#ifdef HAVE_PTHREAD
+/* The links of the files converted by several threads are merged
+   concurrently.  */
+static pthread_mutex_t merge_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+# define MERGE_CACHE_LOCK() pthread_mutex_lock (&merge_cache_lock)
+# define MERGE_CACHE_UNLOCK() pthread_mutex_unlock (&merge_cache_lock)
+#else
+# define MERGE_CACHE_LOCK()
+# define MERGE_CACHE_UNLOCK()
+#endif
+
+/* Return the key of the merge of LINK with BASE into URL: what
+   url_parse depends on, that is the encodings of URL, the part of
+   BASE the merge depends on, and LINK.  Each but the last is
+   preceded by its length.  */
+
+static char *
+merge_key (const char *base, const char *link, const struct url *url)
+{
+  const char *ori_enc = url->ori_enc ? url->ori_enc : "";
+  const char *content_enc = url->content_enc ? url->content_enc : "";
+  int base_len = url_merge_base_length (base, link);
+
+  return aprintf ("%d:%s%d:%s%d:%.*s%s", (int) strlen (ori_enc), ori_enc,
+                  (int) strlen (content_enc), content_enc,
+                  base_len, base_len, base, link);
+}
+
+static void
+merge_lru_unlink (struct merge_entry *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    merge_lru = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    merge_lru_tail = e->prev;
+}
+
+static void
+merge_lru_push (struct merge_entry *e)
+{
+  e->prev = NULL;
+  e->next = merge_lru;
+  if (merge_lru)
+    merge_lru->prev = e;
+  else
+    merge_lru_tail = e;
+  merge_lru = e;
+}
+
+/* If KEY is cached, store a copy of its URL, or NULL if it doesn't
+   parse, to *URL and return true.  */
+
+static bool
+merge_cache_get (const char *key, struct url **url)
+{
+  struct merge_entry *e;
+
+  MERGE_CACHE_LOCK ();
+  e = merge_cache ? hash_table_get (merge_cache, key) : NULL;
+  if (e)
+    {
+      merge_lru_unlink (e);
+      merge_lru_push (e);
+      *url = e->url ? url_dup (e->url) : NULL;
+    }
+  MERGE_CACHE_UNLOCK ();
+  return e != NULL;
+}
+
+static void
+merge_entry_free (struct merge_entry *e)
+{
+  xfree (e->key);
+  url_free (e->url);
+  xfree (e);
+}
+
+/* Cache URL, or NULL if it doesn't parse, under KEY, which is taken
+   over.  */
+
+static void
+merge_cache_put (char *key, struct url *url)
+{
+  struct merge_entry *e;
+
+  MERGE_CACHE_LOCK ();
+  if (!merge_cache)
+    merge_cache = make_string_hash_table (0);
+  if (hash_table_contains (merge_cache, key))
+    {
+      /* Another thread got there first.  */
+      MERGE_CACHE_UNLOCK ();
+      xfree (key);
+      return;
+    }
+  if (hash_table_count (merge_cache) >= MERGE_CACHE_SIZE)
+    {
+      e = merge_lru_tail;
+      merge_lru_unlink (e);
+      hash_table_remove (merge_cache, e->key);
+      merge_entry_free (e);
+    }
+  e = xnew (struct merge_entry);
+  e->key = key;
+  e->url = url ? url_dup (url) : NULL;
+  hash_table_put (merge_cache, key, e);
+  merge_lru_push (e);
+  MERGE_CACHE_UNLOCK ();
+}
+
 /* Append LINK_URL to the urlpos structure that is being built.
 
    LINK_URL will be merged with the current document base.
@@ -338,25 +573,52 @@ append_url (const char *link_url, int position, int size,
     }
   else
     {
-      /* Merge BASE with LINK_URI, but also make sure the result is
-         canonicalized, i.e. that "../" have been resolved.
-         (parse_url will do that for us.) */
-      char *complete_url = url_merge (base, link_url);
-      url->ori_url = xstrdup (complete_url);
-      xfree (complete_url);
-
-      DEBUGP (("%s: merge(%s, %s) -> %s (%s)\n",
-               quotearg_n_style (0, escape_quoting_style, ctx->document_file),
-               quote_n (1, base),
-               quote_n (2, link_url),
-               quotearg_n_style (3, escape_quoting_style, url->ori_url),
-               url->ori_enc));
+      char *key = merge_key (base, link_url, url);
+      struct url *cached;
 
-      if (url_parse (url, true, true))
+      if (merge_cache_get (key, &cached))
         {
-          DEBUGP (("%s: link \"%s\" doesn't parse.\n",
-                   ctx->document_file, url->ori_url));
-          goto failed;
+          xfree (key);
+          if (!cached)
+            {
+              DEBUGP (("%s: link \"%s\" doesn't parse.\n",
+                       ctx->document_file, link_url));
+              goto failed;
+            }
+          url_free (url);
+          url = cached;
+          DEBUGP (("%s: merge(%s, %s) -> %s (cached)\n",
+                   quotearg_n_style (0, escape_quoting_style,
+                                     ctx->document_file),
+                   quote_n (1, base),
+                   quote_n (2, link_url),
+                   quotearg_n_style (3, escape_quoting_style, url->url)));
+        }
+      else
+        {
+          /* Merge BASE with LINK_URI, but also make sure the result is
+             canonicalized, i.e. that "../" have been resolved.
+             (parse_url will do that for us.) */
+          char *complete_url = url_merge (base, link_url);
+          url->ori_url = xstrdup (complete_url);
+          xfree (complete_url);
+
+          DEBUGP (("%s: merge(%s, %s) -> %s (%s)\n",
+                   quotearg_n_style (0, escape_quoting_style,
+                                     ctx->document_file),
+                   quote_n (1, base),
+                   quote_n (2, link_url),
+                   quotearg_n_style (3, escape_quoting_style, url->ori_url),
+                   url->ori_enc));
+
+          if (url_parse (url, true, true))
+            {
+              DEBUGP (("%s: link \"%s\" doesn't parse.\n",
+                       ctx->document_file, url->ori_url));
+              merge_cache_put (key, NULL);
+              goto failed;
+            }
+          merge_cache_put (key, url);
         }
     }
 
@@ -658,8 +920,8 @@ tag_handle_meta (int tagid _GL_UNUSED, struct taginfo *tag, struct map_context *
       if (!mcharset)
         return;
 
-      xfree (meta_charset);
-      meta_charset = mcharset;
+      xfree (ctx->meta_charset);
+      ctx->meta_charset = mcharset;
     }
   else if (charset && check_encoding_name (charset))
     {
@@ -667,8 +929,8 @@ tag_handle_meta (int tagid _GL_UNUSED, struct taginfo *tag, struct map_context *
          <meta charset="CHARSET">
          This is the html5 standard. */
 
-      xfree (meta_charset);
-      meta_charset = xstrdup (charset);
+      xfree (ctx->meta_charset);
+      ctx->meta_charset = xstrdup (charset);
     }
   else if (name && 0 == c_strcasecmp (name, "robots"))
     {
@@ -808,10 +1070,10 @@ collect_tags_mapper (struct taginfo *tag, void *arg)
      to map_html_tags.  This way we can check all tags for a style
      attribute.
   */
-  struct known_tag *t = hash_table_get (interesting_tags, tag->name);
+  int i = name_set_lookup (&interesting_tags, tag->name, strlen (tag->name));
 
-  if (t != NULL)
-    t->handler (t->tagid, tag, ctx);
+  if (i >= 0)
+    known_tags[i].handler (known_tags[i].tagid, tag, ctx);
 
   check_style_attr (tag, ctx);
 
@@ -856,6 +1118,57 @@ cleanup:
   return ret;
 }
 
+#ifdef HAVE_ICONV
+/* How much of the document to search for a meta charset before the
+   full parse.  Browsers look at the first 1024 bytes; be a bit more
+   generous to cover heads with large inline scripts or styles.  */
+#define META_PRESCAN_SIZE 4096
+
+/* Mapper for prescan_meta_charset: store the charset declared by the
+   first META tag that has one, the way tag_handle_meta finds it.  */
+
+static void
+prescan_meta_mapper (struct taginfo *tag, void *arg)
+{
+  char **charset = (char **) arg;
+  char *http_equiv, *value;
+
+  if (*charset)
+    return;
+
+  http_equiv = find_attr (tag, "http-equiv", NULL);
+  if (http_equiv && 0 == c_strcasecmp (http_equiv, "content-type"))
+    {
+      value = find_attr (tag, "content", NULL);
+      if (value)
+        *charset = parse_charset (value);
+    }
+  else if (!http_equiv || c_strcasecmp (http_equiv, "refresh"))
+    {
+      value = find_attr (tag, "charset", NULL);
+      if (value && check_encoding_name (value))
+        *charset = xstrdup (value);
+    }
+}
+
+/* Look for a META charset declaration near the beginning of FM, so
+   that the document can be parsed with the right encoding in a
+   single pass.  Returns a malloc'ed charset name, or NULL.  */
+
+static char *
+prescan_meta_charset (const struct file_memory *fm, int flags)
+{
+  char *charset = NULL;
+
+  /* --ignore-tags=meta also disables the prescan.  */
+  if (name_set_lookup (&interesting_tags, "meta", 4) >= 0)
+    map_html_tags (fm->content, MIN (fm->length, META_PRESCAN_SIZE),
+                   prescan_meta_mapper, &charset, flags,
+                   meta_tag_p, interesting_attribute_p);
+  return charset;
+}
+#endif /* HAVE_ICONV */
+
 /* Analyze HTML tags FILE and construct a list of URLs referenced from
    it.  It merges relative links in FILE with URL.  It is aware of
    <base href=...> and does the right thing.  */
@@ -866,6 +1179,9 @@ get_urls_html_fm (const char *file, const struct file_memory *fm,
 {
   struct map_context ctx;
   int flags;
+#ifdef HAVE_ICONV
+  bool meta_charset_applies;
+#endif
 
   if (!set_map_context_by_url (&ctx, url))
     return NULL;
@@ -875,9 +1191,9 @@ get_urls_html_fm (const char *file, const struct file_memory *fm,
   ctx.text = fm->content;
   ctx.document_file = file;
   ctx.nofollow = false;
+  ctx.meta_charset = NULL;
 
-  if (!interesting_tags)
-    init_interesting ();
+  init_interesting ();
 
   /* Specify MHT_TRIM_VALUES because of buggy HTML generators that
      generate <a href=" foo"> instead of <a href="foo"> (browsers
@@ -890,26 +1206,48 @@ get_urls_html_fm (const char *file, const struct file_memory *fm,
   if (opt.strict_comments)
     flags |= MHT_STRICT_COMMENTS;
 
+#ifdef HAVE_ICONV
+  /* Meta charset is only valid if there was no HTTP header Content-Type charset. */
+  /* This is true for HTTP 1.0 and 1.1. */
+  meta_charset_applies = url && !url->content_enc;
+  if (meta_charset_applies)
+    {
+      /* Pick up the charset before the parse, so that the links are
+         decoded correctly the first time around.  */
+      url->content_enc = prescan_meta_charset (fm, flags);
+      ctx.text_enc = url->content_enc;
+      if (url->content_enc)
+        DEBUGP (("Encoding charset found: %s\n", url->content_enc));
+    }
+#endif
+
   /* the NULL here used to be interesting_tags */
   map_html_tags (fm->content, fm->length, collect_tags_mapper, &ctx, flags,
-                 NULL, interesting_attributes);
+                 NULL, interesting_attribute_p);
 
 #ifdef HAVE_ICONV
-  /* Meta charset is only valid if there was no HTTP header Content-Type charset. */
-  /* This is true for HTTP 1.0 and 1.1. */
-  if (url && !url->content_enc && meta_charset)
+  /* The last META charset in the document is the one that counts.
+     If the prescan missed it or found a different one, re-parse.  */
+  if (meta_charset_applies
+      && (ctx.meta_charset && url->content_enc
+          ? c_strcasecmp (ctx.meta_charset, url->content_enc) != 0
+          : ctx.meta_charset != url->content_enc))
     {
-      DEBUGP (("Encoding charset found: %s, re-parsing ...\n", meta_charset));
+      DEBUGP (("Encoding charset found: %s, re-parsing ...\n",
+               ctx.meta_charset ? ctx.meta_charset : "none"));
       /* different charset, re-parse. ctx.text_enc == url->content_enc */
-      url->content_enc = xstrdup (meta_charset);
+      xfree (url->content_enc);
+      url->content_enc = ctx.meta_charset;
+      ctx.meta_charset = NULL;
       ctx.text_enc = url->content_enc;
       free_urlpos (ctx.head);
       ctx.head = NULL;
+      xfree (ctx.base);
       map_html_tags (fm->content, fm->length, collect_tags_mapper, &ctx, flags,
-                     NULL, interesting_attributes);
+                     NULL, interesting_attribute_p);
     }
 #endif
-  xfree (meta_charset);
+  xfree (ctx.meta_charset);
 
   DEBUGP (("nofollow in %s: %d\n", file, ctx.nofollow));
 
@@ -939,29 +1277,51 @@ get_urls_html (const char *file, struct url *url, bool *meta_disallow_follow)
   return urls;
 }
 
-/* This doesn't really have anything to do with HTML, but it's similar
-   to get_urls_html, so we put it here.  */
+/* Reading a list of URLs, one per line, as given to -i.  This doesn't
+   really have anything to do with HTML, but it's similar to
+   get_urls_html, so we put it here.  The file is read a line at a
+   time, so that its size doesn't matter.  */
+
+struct url_file {
+  FILE *fp;
+  char *file;                   /* its name, for messages */
+  char *text_enc;               /* encoding of the URLs */
+  char *line;                   /* buffer for getline */
+  size_t bufsize;
+};
 
-struct urlpos *
-get_urls_file (const char *file, const char *text_enc)
+/* Open FILE, or the standard input if FILE is "-", to read URLs in
+   TEXT_ENC from it with url_file_next.  Return NULL if it can't be
+   opened.  */
+
+struct url_file *
+url_file_open (const char *file, const char *text_enc)
 {
-  struct file_memory *fm;
-  struct urlpos *head, *tail;
-  const char *text, *text_end;
+  struct url_file *uf;
+  FILE *fp = HYPHENP (file) ? stdin : fopen (file, "r");
 
-  /* Load the file.  */
-  fm = wget_read_file (file);
-  if (!fm)
+  if (!fp)
     {
       logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
       return NULL;
     }
-  DEBUGP (("Loaded %s (size %s).\n", file, number_to_static_string (fm->length)));
+  uf = xnew0 (struct url_file);
+  uf->fp = fp;
+  uf->file = xstrdup (file);
+  uf->text_enc = text_enc ? xstrdup (text_enc) : NULL;
+  return uf;
+}
 
-  head = tail = NULL;
-  text = fm->content;
-  text_end = fm->content + fm->length;
-  while (text < text_end)
+/* Return the next URL of UF, or NULL at the end of the file.  Lines
+   that are empty are skipped, and so are invalid URLs, which are
+   reported.  */
+
+struct urlpos *
+url_file_next (struct url_file *uf)
+{
+  ssize_t len;
+
+  while ((len = getline (&uf->line, &uf->bufsize, uf->fp)) > 0)
     {
       int up_error_code;
       char *url_text;
@@ -969,13 +1329,8 @@ get_urls_file (const char *file, const char *text_enc)
       struct urlpos *entry;
       struct url *url;
 
-      const char *line_beg = text;
-      const char *line_end = memchr (text, '\n', text_end - text);
-      if (!line_end)
-        line_end = text_end;
-      else
-        ++line_end;
-      text = line_end;
+      const char *line_beg = uf->line;
+      const char *line_end = uf->line + len;
 
       /* Strip whitespace from the beginning and end of line. */
       while (line_beg < line_end && c_isspace (*line_beg))
@@ -987,9 +1342,6 @@ get_urls_file (const char *file, const char *text_enc)
         continue;
 
       /* The URL is in the [line_beg, line_end) region. */
-
-      /* We must copy the URL to a zero-terminated string, and we
-         can't use alloca because we're in a loop.  *sigh*.  */
       url_text = strdupdelim (line_beg, line_end);
 
       if (opt.base_href)
@@ -1009,12 +1361,12 @@ get_urls_file (const char *file, const char *text_enc)
 
       url = url_new_init ();
       url->ori_url = xstrdup (url_text);
-      url->ori_enc = xstrdup (text_enc ? text_enc : opt.locale);
+      url->ori_enc = xstrdup (uf->text_enc ? uf->text_enc : opt.locale);
       up_error_code = url_parse (url, true, true);
       if (up_error_code)
         {
           logprintf (LOG_NOTQUIET, _("%s: Invalid URL %s: %s\n"),
-                     file, url_text, url_error (up_error_code));
+                     uf->file, url_text, url_error (up_error_code));
           xfree (url_text);
           url_free (url);
           inform_exit_status (URLERROR);
@@ -1024,26 +1376,60 @@ get_urls_file (const char *file, const char *text_enc)
 
       entry = xnew0 (struct urlpos);
       entry->url = url;
+      return entry;
+    }
+  if (ferror (uf->fp))
+    logprintf (LOG_NOTQUIET, "%s: %s\n", uf->file, strerror (errno));
+  return NULL;
+}
+
+void
+url_file_close (struct url_file *uf)
+{
+  if (uf->fp != stdin)
+    fclose (uf->fp);
+  xfree (uf->file);
+  xfree (uf->text_enc);
+  xfree (uf->line);
+  xfree (uf);
+}
+
+/* Read all the URLs of FILE, as url_file_next does, into a list.  */
+
+struct urlpos *
+get_urls_file (const char *file, const char *text_enc)
+{
+  struct url_file *uf = url_file_open (file, text_enc);
+  struct urlpos *head = NULL, *tail = NULL, *entry;
 
+  if (!uf)
+    return NULL;
+  while ((entry = url_file_next (uf)) != NULL)
+    {
       if (!head)
         head = entry;
       else
         tail->next = entry;
       tail = entry;
     }
-  wget_read_file_free (fm);
+  url_file_close (uf);
   return head;
 }
 
 #if defined DEBUG_MALLOC || defined TESTING
 void
-cleanup_html_url (void)
+html_url_cleanup (void)
 {
-  /* Destroy the hash tables.  The hash table keys and values are not
-     allocated by this code, so we don't need to free them here.  */
-  if (interesting_tags)
-    hash_table_destroy (interesting_tags);
-  if (interesting_attributes)
-    hash_table_destroy (interesting_attributes);
+  while (merge_lru)
+    {
+      struct merge_entry *e = merge_lru;
+      merge_lru_unlink (e);
+      merge_entry_free (e);
+    }
+  if (merge_cache)
+    {
+      hash_table_destroy (merge_cache);
+      merge_cache = NULL;
+    }
 }
 #endif
@@ -47,16 +47,23 @@ struct map_context {
   const char *document_file;    /* File name of this document. */
   bool nofollow;                /* whether NOFOLLOW was specified in a
                                    <meta name=robots> tag. */
+  char *meta_charset;           /* the (last) charset declared by a
+                                   <meta> tag. */
 
   struct urlpos *head;          /* List of URLs that is being built. */
 };
 
+void init_interesting (void);
 bool set_map_context_by_url (struct map_context *ctx, struct url *url);
+struct url_file;
+struct url_file *url_file_open (const char *, const char *);
+struct urlpos *url_file_next (struct url_file *);
+void url_file_close (struct url_file *);
 struct urlpos *get_urls_file (const char *, const char *);
 struct urlpos *get_urls_html (const char *, struct url *, bool *);
 struct urlpos *get_urls_html_fm (const char *, const struct file_memory *, struct url *, bool *);
 struct urlpos *append_url (const char *, int, int, struct map_context *);
 void free_urlpos (struct urlpos *);
-void cleanup_html_url (void);
+void html_url_cleanup (void);
 
 #endif /* HTML_URL_H */
@@ -140,8 +140,15 @@ SSPI take in charge the whole MESSAGE.
 
 #include "log.h"
 #include "utils.h" // base64
+#include "hash.h"
 
 
+/* Credentials handles, by package, user and password.  A handle was
+   acquired for each handshake before, which looked the logon session
+   up again for every new connection; keep them for the whole run and
+   share them among the connections instead.  */
+static struct hash_table *credentials_cache;
+
 // https://docs.microsoft.com/en-us/windows/win32/api/sspi/ns-sspi-sec_winnt_auth_identity_a
 static void ntlm_gen_identity(char *domain, char *user, char *passwd, SEC_WINNT_AUTH_IDENTITY *pId) {
     pId->User = user;
@@ -153,22 +160,28 @@ static void ntlm_gen_identity(char *domain, char *user, char *passwd, SEC_WINNT_
     pId->Flags = SEC_WINNT_AUTH_IDENTITY_ANSI;
 }
 
-static bool ntlm_create_type1_message(struct ntlmdata *ntlm, char *user, char *passwd) {
+static PCredHandle ntlm_credentials(const char *package, char *user, char *passwd) {
     SEC_WINNT_AUTH_IDENTITY identity, *pId;
-    char *p;
-
     SECURITY_STATUS Status;
-    SecBuffer       type1_buf;
-    SecBufferDesc   type1_desc;
-    DWORD           dwSSPIOutFlags;
     TimeStamp       tsExpiry;
+    PCredHandle     pCreds;
+    char *key, *p;
 
-    DEBUGP(("NTLM-Auth: Create NEGOTIATE message ...\n"));
+    key = aprintf("%s\n%s\n%s", package, user ? user : "", passwd ? passwd : "");
+    if (credentials_cache == NULL) {
+        credentials_cache = make_string_hash_table(0);
+    }
+    pCreds = hash_table_get(credentials_cache, key);
+    if (pCreds) {
+        DEBUGP(("NTLM-Auth: Reusing %s credentials.\n", package));
+        xfree(key);
+        return pCreds;
+    }
 
     // prepare identity
     pId = NULL; // indicates use default
-    p = strchr(user, '\\'); // not `/`
-    if (user && *user && p != NULL) {
+    p = user ? strchr(user, '\\') : NULL; // not `/`
+    if (p != NULL && passwd) {
         *p = 0;
         ntlm_gen_identity(user, p + 1, passwd, &identity);
         *p = '\\';
@@ -177,110 +190,143 @@ static bool ntlm_create_type1_message(struct ntlmdata *ntlm, char *user, char *p
 
     // Init Credentials
     // https://docs.microsoft.com/en-us/windows/win32/secauthn/acquirecredentialshandle--ntlm
-    Status = g_pSSPI->AcquireCredentialsHandle(NULL, "NTLM",
+    pCreds = xnew(CredHandle);
+    Status = g_pSSPI->AcquireCredentialsHandle(NULL, (SEC_CHAR *) package,
                                                SECPKG_CRED_OUTBOUND, NULL,
                                                pId, NULL, NULL,
-                                               &ntlm->hCreds, &tsExpiry);
+                                               pCreds, &tsExpiry);
 
     if (Status != SEC_E_OK) {
         logprintf(LOG_NOTQUIET, "NTLM-Auth: AcquireCredentialsHandle error %s\n", sspi_strerror(Status));
-        return false;
+        xfree(pCreds);
+        xfree(key);
+        return NULL;
     }
+    DEBUGP(("NTLM-Auth: %s credentials acquired.\n", package));
+    hash_table_put(credentials_cache, key, pCreds);
 
-    // service principal name (SPN)
-    // https://docs.microsoft.com/en-us/windows/win32/ad/service-principal-names
-    // <service class>/<host>[:port[/service name]]
-    if (ntlm->host == NULL) ntlm->host = ""; // in case of uninitialized using/fuzzing
-    ntlm->spn = malloc(5 + strlen(ntlm->host) + 6); // max port, no service name
-    if (ntlm->spn == NULL) {
-        logprintf(LOG_NOTQUIET, "malloc failed.\n");
-        return false;
+    return pCreds;
+}
+
+/* Delete the security context of the handshake and the buffers it used. */
+static void ntlm_release_context(struct ntlmdata *ntlm) {
+    if (ntlm->has_context) {
+        g_pSSPI->DeleteSecurityContext(&ntlm->hContext);
+        ntlm->has_context = false;
     }
-    sprintf(ntlm->spn, "%s/%s/%d", "HTTP", ntlm->host, ntlm->port);
+    free(ntlm->in);
+    ntlm->in = NULL;
+    ntlm->in_len = 0;
+    xfree(ntlm->spn);
+}
+
+/* Feed IN_DESC, the token of the server if any, to the security context,
+   and keep the token to send in ntlm->out.  *DONE tells whether it is
+   the last one: Kerberos is done with the first token, NTLM with the
+   third. */
+static bool ntlm_step(struct ntlmdata *ntlm, SecBufferDesc *in_desc, bool *done) {
+    SECURITY_STATUS Status;
+    SecBuffer       out_buf;
+    SecBufferDesc   out_desc;
+    DWORD           dwSSPIOutFlags;
+    TimeStamp       tsExpiry;
 
-    InitSecBuffer(&type1_buf, 0, NULL, SECBUFFER_TOKEN);
-    InitSecBufferDesc(&type1_desc, 1, &type1_buf);
+    InitSecBuffer(&out_buf, 0, NULL, SECBUFFER_TOKEN);
+    InitSecBufferDesc(&out_desc, 1, &out_buf);
 
     // Init context & token, use `ISC_REQ_ALLOCATE_MEMORY`
+    // https://docs.microsoft.com/en-us/windows/win32/secauthn/initializesecuritycontext--ntlm
     Status = g_pSSPI->InitializeSecurityContext(
-                    &ntlm->hCreds, NULL, ntlm->spn, ISC_REQ_ALLOCATE_MEMORY,
+                    ntlm->pCreds, ntlm->has_context ? &ntlm->hContext : NULL,
+                    ntlm->spn, ISC_REQ_ALLOCATE_MEMORY,
                     0, SECURITY_NETWORK_DREP,
-                    NULL,
+                    in_desc,
                     0,
-                    &ntlm->hContext, &type1_desc, &dwSSPIOutFlags, &tsExpiry);
+                    &ntlm->hContext, &out_desc, &dwSSPIOutFlags, &tsExpiry);
+
+    if (FAILED(Status)) {
+        logprintf(LOG_NOTQUIET, "%s-Auth: InitializeSecurityContext error %s\n", ntlm->package, sspi_strerror(Status));
+        return false;
+    }
+    ntlm->has_context = true;
 
     if (Status == SEC_I_COMPLETE_NEEDED || Status == SEC_I_COMPLETE_AND_CONTINUE) {
-        Status = g_pSSPI->CompleteAuthToken(&ntlm->hContext, &type1_desc);
-        if (Status != SEC_E_OK) {
-            logprintf(LOG_NOTQUIET, "NTLM-Auth: CompleteAuthToken error %s\n", sspi_strerror(Status));
+        SECURITY_STATUS Completed = g_pSSPI->CompleteAuthToken(&ntlm->hContext, &out_desc);
+        if (Completed != SEC_E_OK) {
+            logprintf(LOG_NOTQUIET, "%s-Auth: CompleteAuthToken error %s\n", ntlm->package, sspi_strerror(Completed));
+            g_pSSPI->FreeContextBuffer(out_buf.pvBuffer);
             return false;
         }
-    }
-    else if (Status != SEC_E_OK && Status != SEC_I_CONTINUE_NEEDED) {
-        logprintf(LOG_NOTQUIET, "NTLM-Auth: InitializeSecurityContext error %s\n", sspi_strerror(Status));
-        return false;
+        Status = Status == SEC_I_COMPLETE_NEEDED ? SEC_E_OK : SEC_I_CONTINUE_NEEDED;
     }
 
-    ntlm->out = type1_buf.pvBuffer;
-    ntlm->out_len = type1_buf.cbBuffer;
+    ntlm->out = out_buf.pvBuffer;
+    ntlm->out_len = out_buf.cbBuffer;
+    *done = Status == SEC_E_OK;
 
     return true;
 }
 
-static bool ntlm_create_type3_message(struct ntlmdata *ntlm) {
-    SECURITY_STATUS Status;
-    SecBuffer       type2_bufs[2];
-    SecBufferDesc   type2_desc;
-    SecBuffer       type3_buf;
-    SecBufferDesc   type3_desc;
-    DWORD           dwSSPIOutFlags;
-    TimeStamp       tsExpiry;
+static bool ntlm_create_type1_message(struct ntlmdata *ntlm, char *user, char *passwd, bool *done) {
+    DEBUGP(("%s-Auth: Create NEGOTIATE message ...\n", ntlm->package));
 
-    DEBUGP(("NTLM-Auth: Create AUTHENTICATE message ...\n"));
+    ntlm_release_context(ntlm); // in case of restarting
 
-    InitSecBuffer(&type2_bufs[0], ntlm->in_len, ntlm->in, SECBUFFER_TOKEN);
-    InitSecBufferDesc(&type2_desc, 1, type2_bufs);
+    ntlm->pCreds = ntlm_credentials(ntlm->package, user, passwd);
+    if (ntlm->pCreds == NULL) {
+        return false;
+    }
 
-    // https? Haven't pass over here! need the SSL\TLS `PCtxtHandle`
+    // service principal name (SPN)
+    // https://docs.microsoft.com/en-us/windows/win32/ad/service-principal-names
+    // <service class>/<host>[:port[/service name]]
+    if (ntlm->host == NULL) ntlm->host = ""; // in case of uninitialized using/fuzzing
+    if (strcmp(ntlm->package, "Negotiate") == 0) {
+        // Kerberos looks the service up by host only, as browsers ask for it
+        ntlm->spn = aprintf("HTTP/%s", ntlm->host);
+    }
+    else {
+        ntlm->spn = aprintf("%s/%s/%d", "HTTP", ntlm->host, ntlm->port);
+    }
 
-    InitSecBuffer(&type3_buf, 0, NULL, SECBUFFER_TOKEN);
-    InitSecBufferDesc(&type3_desc, 1, &type3_buf);
+    return ntlm_step(ntlm, NULL, done);
+}
 
-    // https://docs.microsoft.com/en-us/windows/win32/secauthn/initializesecuritycontext--ntlm
-    Status = g_pSSPI->InitializeSecurityContext(
-                    &ntlm->hCreds, &ntlm->hContext, ntlm->spn, ISC_REQ_ALLOCATE_MEMORY,
-                    0, SECURITY_NETWORK_DREP,
-                    &type2_desc,
-                    0,
-                    NULL, &type3_desc, &dwSSPIOutFlags, &tsExpiry);
+static bool ntlm_create_type3_message(struct ntlmdata *ntlm, bool *done) {
+    SecBuffer       type2_bufs[2];
+    SecBufferDesc   type2_desc;
 
-    if (Status != SEC_E_OK) {
-        logprintf(LOG_NOTQUIET, "NTLM-Auth: InitializeSecurityContext error %s\n", sspi_strerror(Status));
+    DEBUGP(("%s-Auth: Create AUTHENTICATE message ...\n", ntlm->package));
+
+    if (!ntlm->has_context) {
+        // challenged without having been asked
+        logprintf(LOG_NOTQUIET, "%s-Auth: fatal error!\n", ntlm->package);
         return false;
     }
 
-    ntlm->out = type3_buf.pvBuffer;
-    ntlm->out_len = type3_buf.cbBuffer;
+    InitSecBuffer(&type2_bufs[0], ntlm->in_len, ntlm->in, SECBUFFER_TOKEN);
+    InitSecBufferDesc(&type2_desc, 1, type2_bufs);
 
-    return true;
-}
+    // https? Haven't pass over here! need the SSL\TLS `PCtxtHandle`
 
-static void ntlm_cleanup(struct ntlmdata *ntlm) {
-    g_pSSPI->FreeCredentialsHandle(&ntlm->hCreds);
-    g_pSSPI->DeleteSecurityContext(&ntlm->hContext);
-    free(ntlm->in);
-    free(ntlm->spn);
+    return ntlm_step(ntlm, &type2_desc, done);
 }
 
 /* Process remote (server/proxy) response
     1. got auth request, return and go to create type-1 message as output
     2. decode type-2 message, and then go to create type-3 message as output
+   HEADER is the "NTLM" or "Negotiate" challenge, the latter carrying
+   Kerberos, or NTLM when Kerberos isn't available.
 */
 bool ntlm_input(struct ntlmdata *ntlm, const char *header) {
+    const char *package;
     size_t len_enc;
+    ssize_t len_dec;
 
-    if (strncmp(header, "NTLM", 4)) return false;
-    header += 4;
+    if (!strncmp(header, "NTLM", 4)) package = "NTLM";
+    else if (!strncmp(header, "Negotiate", 9)) package = "Negotiate";
+    else return false;
+    header += strlen(package);
 
     if (g_pSSPI == NULL) {
         if (!LoadSecurityLibrary()) {
@@ -289,15 +335,24 @@ bool ntlm_input(struct ntlmdata *ntlm, const char *header) {
         }
     }
 
+    if (ntlm->package == NULL || strcmp(ntlm->package, package)) {
+        // first or another scheme, start over
+        ntlm_release_context(ntlm);
+        ntlm->package = package;
+        ntlm->state = NTLMSTATE_NONE;
+        ntlm->unasked = false;
+    }
+
     while (*header && isspace(*header)) header++;
 
     if (*header) {
-        DEBUGP(("NTLM-Auth: CHALLENGE message received.\n"));
+        DEBUGP(("%s-Auth: CHALLENGE message received.\n", package));
         len_enc = strlen(header);
         if (len_enc % 4) {
-            logprintf(LOG_NOTQUIET, "NTLM-Auth: illegal data.\n");
+            logprintf(LOG_NOTQUIET, "%s-Auth: illegal data.\n", package);
             return false;
         }
+        free(ntlm->in);
         ntlm->in_len = len_enc / 4 * 3;
         ntlm->in = malloc(ntlm->in_len);
         if (ntlm->in == NULL) {
@@ -305,28 +360,37 @@ bool ntlm_input(struct ntlmdata *ntlm, const char *header) {
             return false;
         }
         //
-        if (wget_base64_decode(header, ntlm->in, ntlm->in_len) < 0) {
-            logprintf(LOG_NOTQUIET, "NTLM-Auth: invalid data.\n");
+        len_dec = wget_base64_decode(header, ntlm->in, ntlm->in_len);
+        if (len_dec < 0) {
+            logprintf(LOG_NOTQUIET, "%s-Auth: invalid data.\n", package);
             return false;
         }
+        ntlm->in_len = len_dec;
         //
+        ntlm->unasked = false;
         ntlm->state = NTLMSTATE_TYPE2; // <--- got
     }
+    else if (ntlm->unasked && (ntlm->state == NTLMSTATE_TYPE1 || ntlm->state == NTLMSTATE_TYPE3)) {
+        // the token sent ahead wasn't taken, answer the challenge once
+        DEBUGP(("%s-Auth: Token sent ahead refused, starting over ...\n", package));
+        ntlm->unasked = false;
+        ntlm->state = NTLMSTATE_TYPE1;
+    }
     else if (ntlm->state == NTLMSTATE_LAST) {
-        logprintf(LOG_NOTQUIET, "NTLM-Auth: restarted.\n"); // continue
+        logprintf(LOG_NOTQUIET, "%s-Auth: restarted.\n", package); // continue
     }
     else if (ntlm->state == NTLMSTATE_TYPE3) {
-        logprintf(LOG_NOTQUIET, "NTLM-Auth: rejected.\n");
+        logprintf(LOG_NOTQUIET, "%s-Auth: rejected.\n", package);
         ntlm->state = NTLMSTATE_NONE;
         return false;
     }
     else if (ntlm->state > NTLMSTATE_NONE) {
         // type1, type2: got 'empty' response? Wrong turn ...
-        logprintf(LOG_NOTQUIET, "NTLM-Auth: fatal error!\n");
+        logprintf(LOG_NOTQUIET, "%s-Auth: fatal error!\n", package);
         return false;
     }
     else { // <--- 0, start from here
-        DEBUGP(("NTLM-Auth: Starting ...\n"));
+        DEBUGP(("%s-Auth: Starting ...\n", package));
         ntlm->state = NTLMSTATE_TYPE1;
     }
 
@@ -335,39 +399,55 @@ bool ntlm_input(struct ntlmdata *ntlm, const char *header) {
 
 static char* ntlm_encode_message(struct ntlmdata *ntlm) {
     char *out;
-    size_t len;
+    size_t len, len_scheme;
 
+    len_scheme = strlen(ntlm->package);
     len = (ntlm->out_len + 2) / 3 * 4;
-    out = malloc(len + 6);
+    out = malloc(len_scheme + 1 + len + 1);
     if (out == NULL) {
         logprintf(LOG_NOTQUIET, "malloc failed.\n");
+        g_pSSPI->FreeContextBuffer(ntlm->out);
         return NULL;
     }
 
-    memcpy(out, "NTLM ", 5);
-    wget_base64_encode(ntlm->out, ntlm->out_len, out + 5);
+    memcpy(out, ntlm->package, len_scheme);
+    out[len_scheme] = ' ';
+    wget_base64_encode(ntlm->out, ntlm->out_len, out + len_scheme + 1);
     g_pSSPI->FreeContextBuffer(ntlm->out); // free every round
-    DEBUGP(("NTLM-Auth: Message has been encoded.\n"));
+    DEBUGP(("%s-Auth: Message has been encoded.\n", ntlm->package));
 
     return out;
 }
 
 /* return the base64 ecoded type-1/type-3 MESSAGE */
 char *ntlm_output(struct ntlmdata *ntlm, const char *user, const char *passwd, bool *ready) {
+    bool done = false;
+
     ntlm->out = NULL;
     ntlm->out_len = 0;
 
     switch (ntlm->state) {
     case NTLMSTATE_TYPE1:   // server request start
     default:                // (re)start
-        if (ntlm_create_type1_message(ntlm, (char*)user, (char*)passwd)) {
+        if (ntlm_create_type1_message(ntlm, (char*)user, (char*)passwd, &done)) {
+            if (done) {     // Kerberos: a single message
+                ntlm_release_context(ntlm);
+                ntlm->state = NTLMSTATE_TYPE3;
+                *ready = true;
+            }
+            else {
+                ntlm->state = NTLMSTATE_TYPE1;
+            }
             return ntlm_encode_message(ntlm);
         }
         break;
     case NTLMSTATE_TYPE2:   // got type2 response
-        if (ntlm_create_type3_message(ntlm)) {
-            ntlm_cleanup(ntlm);
-            *ready = true; // should finish successful or failed
+        if (ntlm_create_type3_message(ntlm, &done)) {
+            if (done) {     // otherwise Negotiate goes on
+                ntlm_release_context(ntlm);
+                ntlm->state = NTLMSTATE_TYPE3;
+                *ready = true; // should finish successful or failed
+            }
             return ntlm_encode_message(ntlm);
         }
         break;
@@ -379,3 +459,38 @@ char *ntlm_output(struct ntlmdata *ntlm, const char *user, const char *passwd, b
 
     return NULL;
 }
+
+/* Start the handshake of PACKAGE, "NTLM" or "Negotiate", with the
+   first request on a new connection to a host that asked for it
+   before, saving the round trip of the challenge. */
+char *ntlm_output_ahead(struct ntlmdata *ntlm, const char *package, const char *user, const char *passwd, bool *ready) {
+    if (!ntlm_input(ntlm, package)) {
+        return NULL;
+    }
+    ntlm->unasked = true;
+    return ntlm_output(ntlm, user, passwd, ready);
+}
+
+/* Release what the handshake of a connection holds, once it is closed. */
+void ntlm_free(struct ntlmdata *ntlm) {
+    if (g_pSSPI != NULL) {
+        ntlm_release_context(ntlm);
+    }
+    ntlm->state = NTLMSTATE_NONE;
+    ntlm->package = NULL;
+    ntlm->unasked = false;
+}
+
+void ntlm_cleanup(void) {
+    hash_table_iterator iter;
+
+    if (credentials_cache == NULL) return;
+
+    for (hash_table_iterate(credentials_cache, &iter); hash_table_iter_next(&iter); ) {
+        g_pSSPI->FreeCredentialsHandle(iter.value);
+        xfree(iter.key);
+        xfree(iter.value);
+    }
+    hash_table_destroy(credentials_cache);
+    credentials_cache = NULL;
+}
@@ -47,10 +47,13 @@ typedef enum {
 struct ntlmdata {
   wgetntlm state;
 #ifdef HAVE_WINTLS
+  const char *package;          /* "NTLM" or "Negotiate" */
+  bool unasked;                 /* first token sent without a challenge */
   char *host;
   int port;
-  CredHandle hCreds;
+  PCredHandle pCreds;           /* shared by the connections */
   CtxtHandle hContext;
+  bool has_context;
   char *spn;
   char *in;
   size_t in_len;
@@ -66,4 +69,13 @@ bool ntlm_input (struct ntlmdata *, const char *);
 
 /* this is for creating ntlm header output */
 char *ntlm_output (struct ntlmdata *, const char *, const char *, bool *);
+
+#ifdef HAVE_WINTLS
+/* this is for sending the first header of a known scheme unasked */
+char *ntlm_output_ahead (struct ntlmdata *, const char *, const char *,
+                         const char *, bool *);
+
+void ntlm_free (struct ntlmdata *);
+void ntlm_cleanup (void);
+#endif
 #endif
@@ -55,6 +55,13 @@ as that of the covered work.  */
 #ifdef ENABLE_NTLM
 # include "http-ntlm.h"
 #endif
+#ifdef HAVE_NGHTTP2
+# include "http2.h"
+#endif
+#ifdef HAVE_HTTP3
+# include "altsvc.h"
+# include "http3.h"
+#endif
 #include "cookies.h"
 # ifdef HAVE_WINHASHES
 # include "win-hashes.h"
@@ -63,10 +70,19 @@ as that of the covered work.  */
 # endif
 #include "convert.h"
 #include "spider.h"
+#include "res.h"
+#include "validators.h"
+#include "httpcache.h"
 #include "warc.h"
 #include "c-strcase.h"
 #include "version.h"
 #include "xstrndup.h"
+#include "ptimer.h"
+#include "progress.h"
+#include "metrics.h"
+#include "stats.h"
+#include "throttle.h"
+#include "zsync.h"
 #ifdef HAVE_METALINK
 # include "metalink.h"
 #endif
@@ -85,11 +101,17 @@ as that of the covered work.  */
 
 /* Forward decls. */
 struct http_stat;
-static char *create_authorization_line (const char *, const char *,
+struct request;
+static char *create_authorization_line (const struct url *, const char *,
                                         const char *, const char *,
-                                        const char *, bool *, uerr_t *);
+                                        const char *, const char *,
+                                        bool *, uerr_t *);
 static char *basic_authentication_encode (const char *, const char *);
 static bool known_authentication_scheme_p (const char *, const char *);
+#ifdef ENABLE_DIGEST
+static bool maybe_send_digest_creds (const struct url *, const char *,
+                                     const char *, struct request *);
+#endif
 static void ensure_extension (struct http_stat *, const char *, int *);
 static void load_cookies (void);
 
@@ -133,6 +155,7 @@ static struct cookie_jar *wget_cookie_jar;
 #define HTTP_STATUS_FORBIDDEN             403
 #define HTTP_STATUS_NOT_FOUND             404
 #define HTTP_STATUS_RANGE_NOT_SATISFIABLE 416
+#define HTTP_STATUS_TOO_MANY_REQUESTS     429
 
 /* Server errors 5xx.  */
 #define HTTP_STATUS_INTERNAL              500
@@ -327,15 +350,14 @@ request_remove_header (struct request *req, const char *name)
   p += A_len;                                   \
 } while (0)
 
-/* Construct the request and write it to FD using fd_write.
-   If warc_tmp is set to a file pointer, the request string will
-   also be written to that file. */
+/* Return the text of the request REQ, as it is sent to the server,
+   and store its length in *SIZE.  */
 
-static int
-request_send (const struct request *req, int fd, FILE *warc_tmp)
+static char *
+request_format (const struct request *req, int *size_ref)
 {
   char *request_string, *p;
-  int i, size, write_error;
+  int i, size;
 
   /* Count the request size. */
   size = 0;
@@ -375,19 +397,35 @@ request_send (const struct request *req, int fd, FILE *warc_tmp)
 
 #undef APPEND
 
+  *size_ref = size - 1;
+  return request_string;
+}
+
+/* Construct the request and write it to FD using fd_write.
+   If warc_tmp is set to a file pointer, the request string will
+   also be written to that file. */
+
+static int
+request_send (const struct request *req, int fd, FILE *warc_tmp)
+{
+  char *request_string;
+  int size, write_error;
+
+  request_string = request_format (req, &size);
+
   DEBUGP (("\n---request begin---\n%s---request end---\n", request_string));
 
   /* Send the request to the server. */
 
-  write_error = fd_write (fd, request_string, size - 1, -1);
+  write_error = fd_write (fd, request_string, size, -1);
   if (write_error < 0)
     logprintf (LOG_VERBOSE, _("Failed writing HTTP request: %s.\n"),
                fd_errstr (fd));
   else if (warc_tmp != NULL)
     {
       /* Write a copy of the data to the WARC record. */
-      int warc_tmp_written = fwrite (request_string, 1, size - 1, warc_tmp);
-      if (warc_tmp_written != size - 1)
+      int warc_tmp_written = fwrite (request_string, 1, size, warc_tmp);
+      if (warc_tmp_written != size)
         write_error = -2;
     }
   xfree (request_string);
@@ -466,6 +504,69 @@ register_basic_auth_host (const char *hostname)
     }
 }
 
+#if defined ENABLE_NTLM && defined HAVE_WINTLS
+/* The servers, by "host:port", that took NTLM or Negotiate
+   authentication, with the scheme they took.  These authorize
+   connections rather than requests, so each new connection to them
+   would otherwise be refused once before the handshake could start.  */
+static struct hash_table *sspi_authed_hosts;
+
+static void
+register_sspi_auth_host (const char *host, int port, const char *scheme)
+{
+  char *key = aprintf ("%s:%d", host, port);
+  char *old_key;
+
+  if (!sspi_authed_hosts)
+    sspi_authed_hosts = make_nocase_string_hash_table (1);
+  if (hash_table_get_pair (sspi_authed_hosts, key, &old_key, NULL))
+    {
+      hash_table_put (sspi_authed_hosts, old_key, (void *) scheme);
+      xfree (key);
+    }
+  else
+    {
+      hash_table_put (sspi_authed_hosts, key, (void *) scheme);
+      DEBUGP (("Inserted %s into sspi_authed_hosts\n", quote (key)));
+    }
+}
+
+/* If HOST:PORT took NTLM or Negotiate authentication before, start the
+   handshake of the new connection to it in NTLM with REQ rather than
+   wait for the server to refuse the request.  */
+
+static bool
+maybe_send_sspi_token (const char *host, int port, const char *user,
+                       const char *passwd, struct ntlmdata *ntlm,
+                       struct request *req)
+{
+  const char *scheme;
+  char *key, *value;
+  bool finished = false;
+
+  if (!sspi_authed_hosts || !user || !passwd)
+    return false;
+  key = aprintf ("%s:%d", host, port);
+  scheme = hash_table_get (sspi_authed_hosts, key);
+  xfree (key);
+  if (!scheme)
+    return false;
+
+  ntlm_free (ntlm);
+  ntlm->host = (char *) host;
+  ntlm->port = port;
+  value = ntlm_output_ahead (ntlm, scheme, user, passwd, &finished);
+  if (!value)
+    {
+      ntlm_free (ntlm);
+      return false;
+    }
+  DEBUGP (("Sending %s authorization ahead to %s:%d.\n", scheme, host, port));
+  request_set_header (req, "Authorization", value, rel_value);
+  return true;
+}
+#endif /* ENABLE_NTLM && HAVE_WINTLS */
+
 /* Send the contents of FILE_NAME to SOCK.  Make sure that exactly
    PROMISED_SIZE bytes are sent over the wire -- if the file is
    longer, read only that much; if the file is shorter, report an error.
@@ -478,39 +579,68 @@ body_file_send (int sock, const char *file_name, wgint promised_size, FILE *warc
   static char chunk[8192];
   wgint written = 0;
   int write_error;
-  FILE *fp;
+  int fd;
 
   DEBUGP (("[writing BODY file %s ... ", file_name));
 
-  fp = fopen (file_name, "rb");
-  if (!fp)
-    return -1;
-  while (!feof (fp) && written < promised_size)
+  if (warc_tmp != NULL)
     {
-      int towrite;
-      int length = fread (chunk, 1, sizeof (chunk), fp);
-      if (length == 0)
-        break;
-      towrite = MIN (promised_size - written, length);
-      write_error = fd_write (sock, chunk, towrite, -1);
-      if (write_error < 0)
+      /* The data is needed twice, so send it and copy it to the WARC
+         record from a mapped view of the file.  */
+      struct file_memory *fm = wget_read_file (file_name);
+      if (!fm)
+        return -1;
+      while (written < MIN (promised_size, fm->length))
+        {
+          int towrite = MIN (MIN (promised_size, fm->length) - written,
+                             1024 * 1024);
+          write_error = fd_write (sock, fm->content + written, towrite, -1);
+          if (write_error < 0)
+            {
+              wget_read_file_free (fm);
+              return -1;
+            }
+          /* Write a copy of the data to the WARC record. */
+          if (fwrite (fm->content + written, 1, towrite, warc_tmp)
+              != (size_t) towrite)
+            {
+              wget_read_file_free (fm);
+              return -2;
+            }
+          written += towrite;
+        }
+      wget_read_file_free (fm);
+    }
+  else
+    {
+      fd = open (file_name, O_RDONLY | O_BINARY);
+      if (fd < 0)
+        return -1;
+
+      /* Over plain connections the kernel can copy the file to the
+         socket itself.  Whatever it doesn't send is sent below.  */
+      written = fd_send_file (sock, fd, promised_size, -1);
+      if (written < 0)
         {
-          fclose (fp);
+          close (fd);
           return -1;
         }
-      if (warc_tmp != NULL)
+      while (written < promised_size)
         {
-          /* Write a copy of the data to the WARC record. */
-          int warc_tmp_written = fwrite (chunk, 1, towrite, warc_tmp);
-          if (warc_tmp_written != towrite)
+          int length = read (fd, chunk, MIN (promised_size - written,
+                                             (wgint) sizeof (chunk)));
+          if (length <= 0)
+            break;
+          write_error = fd_write (sock, chunk, length, -1);
+          if (write_error < 0)
             {
-              fclose (fp);
-              return -2;
+              close (fd);
+              return -1;
             }
+          written += length;
         }
-      written += towrite;
+      close (fd);
     }
-  fclose (fp);
 
   /* If we've written less than was promised, report a (probably
      nonsensical) error rather than break the promise.  */
@@ -528,17 +658,18 @@ body_file_send (int sock, const char *file_name, wgint promised_size, FILE *warc
 /* Determine whether [START, PEEKED + PEEKLEN) contains an empty line.
    If so, return the pointer to the position after the line, otherwise
    return NULL.  This is used as callback to fd_read_hunk.  The data
-   between START and PEEKED has been read and cannot be "unread"; the
-   data after PEEKED has only been peeked.  */
+   between START and PEEKED was seen by the previous calls; the data
+   after PEEKED has just arrived, and what follows the returned
+   position is given back for the body.  */
 
 static const char *
 response_head_terminator (const char *start, const char *peeked, int peeklen)
 {
   const char *p, *end;
 
-  /* If at first peek, verify whether HUNK starts with "HTTP".  If
-     not, this is a HTTP/0.9 request and we must bail out without
-     reading anything.  */
+  /* If at first read, verify whether HUNK starts with "HTTP".  If
+     not, this is a HTTP/0.9 request and we must bail out, giving
+     back everything.  */
   if (start == peeked && 0 != memcmp (start, "HTTP", MIN (peeklen, 4)))
     return start;
 
@@ -549,15 +680,23 @@ response_head_terminator (const char *start, const char *peeked, int peeklen)
   p = peeked - start < 2 ? start : peeked - 2;
   end = peeked + peeklen;
 
-  /* Check for \n\r\n or \n\n anywhere in [p, end-2). */
-  for (; p < end - 2; p++)
-    if (*p == '\n')
-      {
-        if (p[1] == '\r' && p[2] == '\n')
-          return p + 3;
-        else if (p[1] == '\n')
-          return p + 2;
-      }
+  /* Check for \n\r\n or \n\n anywhere in [p, end-2).  memchr skips
+     over the text of the header lines much faster than a loop
+     looking at each character.  */
+  while (p < end - 2)
+    {
+      p = memchr (p, '\n', end - 2 - p);
+      if (!p)
+        {
+          p = end - 2;
+          break;
+        }
+      if (p[1] == '\r' && p[2] == '\n')
+        return p + 3;
+      else if (p[1] == '\n')
+        return p + 2;
+      ++p;
+    }
   /* p==end-2: check for \n\n directly preceding END. */
   if (peeklen >= 2 && p[0] == '\n' && p[1] == '\n')
     return p + 2;
@@ -588,6 +727,10 @@ read_http_response_head (int fd)
                        HTTP_RESPONSE_MAX_SIZE);
 }
 
+/* Number of buckets of the header index of a response.  Responses
+   seldom have more headers than this.  */
+#define RESP_HASH_SIZE 32
+
 struct response {
   /* The response data. */
   const char *data;
@@ -611,8 +754,30 @@ struct response {
      beginning of the second one, etc.  */
 
   const char **headers;
+
+  /* The headers hashed by name, so that resp_header_locate doesn't
+     compare NAME with each of them.  hash_first holds the index of
+     the first header of each bucket, and hash_next that of the next
+     header in the same bucket, in order; 0 ends a bucket, as
+     headers[0] is the status line.  */
+  int hash_first[RESP_HASH_SIZE];
+  int *hash_next;
 };
 
+/* Return the bucket of the header name that is LEN characters long at
+   NAME.  */
+
+static int
+resp_hash_name (const char *name, int len)
+{
+  unsigned int h = 0;
+  int i;
+
+  for (i = 0; i < len; i++)
+    h = h * 31 + c_tolower (name[i]);
+  return h % RESP_HASH_SIZE;
+}
+
 /* Create a new response object from the text of the HTTP response,
    available in HEAD.  That text is automatically split into
    constituent header lines for fast retrieval using
@@ -622,7 +787,7 @@ static struct response *
 resp_new (char *head)
 {
   char *hdr;
-  int count, size;
+  int count, size, i;
 
   struct response *resp = xnew0 (struct response);
   resp->data = head;
@@ -674,6 +839,22 @@ resp_new (char *head)
   DO_REALLOC (resp->headers, size, count + 1, const char *);
   resp->headers[count] = NULL;
 
+  /* Index the headers, last to first so that the buckets list them
+     in order.  */
+  resp->hash_next = xnew0_array (int, count);
+  for (i = count - 2; i >= 1; i--)
+    {
+      const char *colon = memchr (resp->headers[i], ':',
+                                  resp->headers[i + 1] - resp->headers[i]);
+      int h;
+
+      if (!colon)
+        continue;
+      h = resp_hash_name (resp->headers[i], colon - resp->headers[i]);
+      resp->hash_next[i] = resp->hash_first[h];
+      resp->hash_first[h] = i;
+    }
+
   return resp;
 }
 
@@ -701,16 +882,16 @@ resp_header_locate (const struct response *resp, const char *name, int start,
     return -1;
 
   name_len = strlen (name);
-  if (start > 0)
-    i = start;
-  else
-    i = 1;
+  if (start < 1)
+    start = 1;
 
-  for (; headers[i + 1]; i++)
+  for (i = resp->hash_first[resp_hash_name (name, name_len)]; i;
+       i = resp->hash_next[i])
     {
       const char *b = headers[i];
       const char *e = headers[i + 1];
-      if (e - b > name_len
+      if (i >= start
+          && e - b > name_len
           && b[name_len] == ':'
           && 0 == c_strncasecmp (b, name, name_len))
         {
@@ -778,6 +959,40 @@ resp_header_strdup (const struct response *resp, const char *name)
   return strdupdelim (b, e);
 }
 
+/* The usual reason phrase of STATUS, for the responses of protocols
+   that carry none, HTTP/2 and HTTP/3, to be logged with.  */
+
+const char *
+http_status_reason (int status)
+{
+  switch (status)
+    {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 410: return "Gone";
+    case 416: return "Range Not Satisfiable";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "";
+    }
+}
+
 /* Parse the HTTP status line, which is of format:
 
    HTTP-Version SP Status-Code SP Reason-Phrase
@@ -857,6 +1072,7 @@ resp_free (struct response **resp_ref)
     return;
 
   xfree (resp->headers);
+  xfree (resp->hash_next);
   xfree (resp);
 
   *resp_ref = NULL;
@@ -963,93 +1179,30 @@ parse_content_range (const char *hdr, wgint *first_byte_ptr,
   return true;
 }
 
-/* Read the body of the request, but don't store it anywhere and don't
-   display a progress gauge.  This is useful for reading the bodies of
-   administrative responses to which we will soon issue another
-   request.  The response is not useful to the user, but reading it
-   allows us to continue using the same connection to the server.
-
-   If reading fails, false is returned, true otherwise.  In debug
-   mode, the body is displayed for debugging purposes.  */
-
-static bool
-skip_short_body (int fd, wgint contlen, bool chunked)
+/* Parse the `Retry-After' header, which gives either a number of
+   seconds or an HTTP date.  Returns the number of seconds to wait, or
+   0 if the header is malformed or the date is past.  */
+static double
+retry_after_seconds (const char *hdr)
 {
-  enum {
-    SKIP_SIZE = 512,                /* size of the download buffer */
-    SKIP_THRESHOLD = 4096        /* the largest size we read */
-  };
-  wgint remaining_chunk_size = 0;
-  char dlbuf[SKIP_SIZE + 1];
-  dlbuf[SKIP_SIZE] = '\0';        /* so DEBUGP can safely print it */
-
-  /* If the body is too large, it makes more sense to simply close the
-     connection than to try to read the body.  */
-  if (contlen > SKIP_THRESHOLD)
-    return false;
+  time_t when;
 
-  while (contlen > 0 || chunked)
+  while (c_isspace (*hdr))
+    ++hdr;
+  if (c_isdigit (*hdr))
     {
-      int ret;
-      if (chunked)
-        {
-          if (remaining_chunk_size == 0)
-            {
-              char *line = fd_read_line (fd);
-              char *endl;
-              if (line == NULL)
-                break;
-
-              remaining_chunk_size = strtol (line, &endl, 16);
-              xfree (line);
-
-              if (remaining_chunk_size < 0)
-                return false;
-
-              if (remaining_chunk_size == 0)
-                {
-                  line = fd_read_line (fd);
-                  xfree (line);
-                  break;
-                }
-            }
-
-          contlen = MIN (remaining_chunk_size, SKIP_SIZE);
-        }
-
-      DEBUGP (("Skipping %s bytes of body: [", number_to_static_string (contlen)));
-
-      ret = fd_read (fd, dlbuf, MIN (contlen, SKIP_SIZE), -1);
-      if (ret <= 0)
-        {
-          /* Don't normally report the error since this is an
-             optimization that should be invisible to the user.  */
-          DEBUGP (("] aborting (%s).\n",
-                   ret < 0 ? fd_errstr (fd) : "EOF received"));
-          return false;
-        }
-      contlen -= ret;
-
-      if (chunked)
-        {
-          remaining_chunk_size -= ret;
-          if (remaining_chunk_size == 0)
-            {
-              char *line = fd_read_line (fd);
-              if (line == NULL)
-                return false;
-              else
-                xfree (line);
-            }
-        }
+      double secs = 0;
 
-      /* Safe even if %.*s bogusly expects terminating \0 because
-         we've zero-terminated dlbuf above.  */
-      DEBUGP (("%.*s", ret, dlbuf));
+      for (; c_isdigit (*hdr); hdr++)
+        secs = 10 * secs + (*hdr - '0');
+      while (c_isspace (*hdr))
+        ++hdr;
+      return *hdr ? 0 : secs;
     }
-
-  DEBUGP (("] done.\n"));
-  return true;
+  when = http_atotm (hdr);
+  if (when == (time_t) -1)
+    return 0;
+  return MAX (0, difftime (when, time (NULL)));
 }
 
 #define NOT_RFC2231 0
@@ -1356,21 +1509,158 @@ parse_strict_transport_security (const char *header, int64_t *max_age, bool *inc
 }
 #endif
 
-/* Persistent connections.  Currently, we cache the most recently used
-   connection as persistent, provided that the HTTP server agrees to
-   make it such.  The persistence data is stored in the variables
-   below.  Ideally, it should be possible to cache an arbitrary fixed
-   number of these connections.  */
+/* Parse the Cache-Control header HEADER of a permanent redirection.
+   Returns false if the redirection may not be remembered, otherwise
+   sets *MAX_AGE to how many seconds it may be, or -1 for as long as
+   Wget runs.  */
 
-/* Whether a persistent connection is active. */
-static bool pconn_active;
+static bool
+parse_redirect_cache_control (const char *header, int64_t *max_age)
+{
+  param_token name, value;
+
+  *max_age = -1;
+  if (!header)
+    return true;
+  while (extract_param (&header, &name, &value, ',', NULL))
+    {
+      if (BOUNDED_EQUAL_NO_CASE (name.b, name.e, "no-store")
+          || BOUNDED_EQUAL_NO_CASE (name.b, name.e, "no-cache"))
+        return false;
+      if (BOUNDED_EQUAL_NO_CASE (name.b, name.e, "max-age") && value.b)
+        {
+          char *age = strdupdelim (value.b, value.e);
+          *max_age = (int64_t) strtoll (age, NULL, 10);
+          xfree (age);
+          if (*max_age <= 0)
+            return false;
+        }
+    }
+  return true;
+}
+
+/* Parse the Cache-Control header CACHE_CONTROL of a response that
+   arrived at NOW, along with its Expires and Date headers.  Any of
+   them may be NULL.  Returns false if the response may not be kept in
+   the HTTP cache, otherwise sets *FRESH_UNTIL to until when it may be
+   used from there without asking the server, or 0 if not at all.  */
+
+static bool
+parse_cache_freshness (const char *cache_control, const char *expires,
+                       const char *date, time_t now, time_t *fresh_until)
+{
+  param_token name, value;
+  bool no_cache = false, max_age_seen = false;
+
+  *fresh_until = 0;
+  if (cache_control)
+    {
+      while (extract_param (&cache_control, &name, &value, ',', NULL))
+        {
+          if (BOUNDED_EQUAL_NO_CASE (name.b, name.e, "no-store"))
+            return false;
+          if (BOUNDED_EQUAL_NO_CASE (name.b, name.e, "no-cache"))
+            no_cache = true;
+          else if (BOUNDED_EQUAL_NO_CASE (name.b, name.e, "max-age")
+                   && value.b)
+            {
+              char *age = strdupdelim (value.b, value.e);
+              int64_t seconds = (int64_t) strtoll (age, NULL, 10);
+
+              xfree (age);
+              max_age_seen = true;
+              if (seconds > 0)
+                *fresh_until = now + (time_t) MIN (seconds, INT_MAX);
+            }
+        }
+      /* A directive that can't be parsed might have forbidden it.  */
+      if (*cache_control)
+        return false;
+    }
+
+  if (!max_age_seen && expires)
+    {
+      time_t end = http_atotm (expires);
+      time_t start = date ? http_atotm (date) : (time_t) -1;
+
+      /* Counting from Date spares relying on the clocks of the server
+         and of this host to agree.  */
+      if (end != (time_t) -1)
+        {
+          if (start != (time_t) -1)
+            end = now + (end - start);
+          if (end > now)
+            *fresh_until = end;
+        }
+    }
+
+  if (no_cache)
+    *fresh_until = 0;
+  return true;
+}
+
+/* Return true if RESP, a 200 response to a GET, may be kept in the
+   HTTP cache, and set *FRESH_UNTIL as parse_cache_freshness does.  The
+   cache has a single response per URL, so the responses that vary with
+   the headers of the request don't qualify, but for Accept-Encoding:
+   the body is always kept decoded.  */
+
+static bool
+response_cacheable_p (const struct response *resp, time_t *fresh_until)
+{
+  char *cache_control = resp_header_strdup (resp, "Cache-Control");
+  char *expires = resp_header_strdup (resp, "Expires");
+  char *date = resp_header_strdup (resp, "Date");
+  char *vary = resp_header_strdup (resp, "Vary");
+  bool ok;
+
+  ok = parse_cache_freshness (cache_control, expires, date, time (NULL),
+                              fresh_until);
+  if (ok && vary)
+    {
+      const char *p = vary;
+      param_token name, value;
+
+      while (ok && extract_param (&p, &name, &value, ',', NULL))
+        if (!BOUNDED_EQUAL_NO_CASE (name.b, name.e, "Accept-Encoding"))
+          ok = false;
+      if (*p)
+        ok = false;
+    }
+
+  xfree (cache_control);
+  xfree (expires);
+  xfree (date);
+  xfree (vary);
+  return ok;
+}
+
+/* Persistent connections.  The connection used by the most recent
+   request is kept in PCONN, provided that the HTTP server agrees to
+   keep it open.  When we move on to a different host, the previous
+   connection is not closed but parked in a small pool of idle
+   connections, from where it can be checked out again when a later
+   request goes back to the same host.  This matters for recursive
+   retrievals that interleave several hosts (e.g. a site and its
+   CDN), which would otherwise reconnect on nearly every request.  */
+
+/* Maximum number of idle connections kept in the pool. */
+#define PCONN_POOL_SIZE 8
+
+/* Maximum number of idle connections kept to the same host:port. */
+#define PCONN_MAX_PER_HOST 2
+
+/* Idle connections older than this many seconds are closed rather
+   than reused; most servers will have timed them out anyway.  */
+#define PCONN_IDLE_TIMEOUT 30
 
-static struct {
+struct persistent_connection {
   /* The socket of the connection.  */
   int socket;
 
-  /* Host and port of the currently active persistent connection. */
-  char *host;
+  /* Host and port of the connection.  The host is interned, see
+     url_intern_host.  */
+  const char *host;
   int port;
 
   /* Whether a ssl handshake has occurred on this connection.  */
@@ -1382,91 +1672,691 @@ static struct {
      useful optimization.)  */
   bool authorized;
 
+  /* When the connection was parked in the pool. */
+  time_t idle_since;
+
+  /* The unwanted body still being read off the connection, if any;
+     see skip_short_body.  */
+  struct body_drain *drain;
+
 #ifdef ENABLE_NTLM
-  /* NTLM data of the current connection.  */
+  /* NTLM data of the connection.  */
   struct ntlmdata ntlm;
 #endif
-} pconn;
+};
 
-/* Mark the persistent connection as invalid and free the resources it
-   uses.  This is used by the CLOSE_* macros after they forcefully
-   close a registered persistent connection.  */
+/* Whether a persistent connection is active. */
+static bool pconn_active;
+
+/* The currently active persistent connection. */
+static struct persistent_connection pconn;
+
+/* Idle persistent connections, in the order they were parked. */
+static struct persistent_connection pconn_pool[PCONN_POOL_SIZE];
+static int pconn_pool_count;
+
+/* Pipelining: for recursive retrievals with --pipeline, the requests
+   for the next URLs queued for the same host are written to the
+   active persistent connection right after the current one, and
+   their responses are read in order when gethttp gets to them.  A
+   request sent ahead is used only if it is byte for byte the request
+   gethttp builds for that URL; on any mismatch the connection, with
+   the responses still pending on it, is closed.  */
+
+/* Maximum number of requests kept in flight on a connection. */
+#define PIPELINE_MAX 16
+
+/* How many seconds to wait for the response to a pipelined request
+   before concluding that the server ignored it.  */
+#define PIPELINE_TIMEOUT 10
+
+struct pipelined_request {
+  char *url;                    /* the URL asked for */
+  char *text;                   /* the request, as it was sent */
+  int stream;                   /* the stream it was sent on, for HTTP/2 */
+};
+
+/* The requests sent ahead on the active persistent connection whose
+   responses haven't been read yet, oldest first.  */
+static struct pipelined_request pipeline[PIPELINE_MAX];
+static int pipeline_count;
+
+struct pipeline_hint {
+  struct url *url;              /* a URL expected to be retrieved soon */
+  char *referer;                /* the referer it will be retrieved with */
+};
+
+/* The URLs the recursion will retrieve next, in order, as supplied
+   through http_pipeline_hint.  */
+static struct pipeline_hint pipeline_hints[PIPELINE_MAX];
+static int pipeline_hint_count;
+
+/* Hosts whose servers did not answer pipelined requests properly. */
+static struct hash_table *pipeline_refused_hosts;
+
+/* Forget the requests sent ahead.  The connection they were sent on
+   must be closed by the caller, unless the pipeline is empty.  */
 
 static void
-invalidate_persistent (void)
+pipeline_clear (void)
 {
-  DEBUGP (("Disabling further reuse of socket %d.\n", pconn.socket));
-  pconn_active = false;
-  fd_close (pconn.socket);
-  xfree (pconn.host);
-  xzero (pconn);
+  int i;
+
+  for (i = 0; i < pipeline_count; i++)
+    {
+      xfree (pipeline[i].url);
+      xfree (pipeline[i].text);
+    }
+  pipeline_count = 0;
 }
 
-/* Register FD, which should be a TCP/IP connection to HOST:PORT, as
-   persistent.  This will enable someone to use the same connection
-   later.  In the context of HTTP, this must be called only AFTER the
-   response has been received and the server has promised that the
-   connection will remain alive.
+/* Draining.  To reuse a connection after a response whose body is
+   not wanted, such as a redirect or an error page, the body has to be
+   read off it first.  That is worth it only while reading the body
+   takes less time than setting up a new connection, which depends on
+   the host: the limit is what the host was last seen to deliver in the
+   time a new connection to it took, between DRAIN_MIN and DRAIN_MAX.
+
+   What has already arrived is read at once.  The rest is left to
+   arrive in the background, while the next request may go out on
+   another connection: the draining connection is watched for
+   fd_dispatch, and read from whenever the pool is looked at.  It is
+   finished with, blocking, only when it is about to be reused.  */
+
+/* The limit with no measurements of the host; this used to be the
+   fixed limit.  */
+#define DRAIN_MIN 4096
+
+#define DRAIN_MAX (1024 * 1024)
+
+/* How much is read at a time.  */
+#define DRAIN_BUFSIZE 8192
+
+/* Bodies shorter than this are read too fast for their rate to say
+   anything.  */
+#define DRAIN_RATE_MIN_BYTES 16384
+
+struct body_drain {
+  wgint left;                   /* what remains of a body with a length */
+  bool chunked;
+  struct dechunker dc;          /* where a chunked body is */
+  wgint budget;                 /* what may still be read of it */
+  int wait_for;                 /* what fd_read_nb last waited for */
+};
 
-   If a previous connection was persistent, it is closed. */
+/* The measurements of a host, smoothed over its connections.  */
+struct host_link {
+  double setup;                 /* seconds to connect, including TLS */
+  double rate;                  /* bytes per second of its bodies */
+  double ttfb;                  /* seconds from request to response */
+  int slow;                     /* responses in a row much slower than
+                                   TTFB */
+  bool rate_held;               /* the last body came as fast as those
+                                   before */
+  double budget;                /* connections it may have at once, 0
+                                   until it has had to be backed off */
+  double backed_off;            /* when it last was, see host_link_now */
+};
 
-static void
-register_persistent (const char *host, int port, int fd, bool ssl)
+/* Mapping of host names to their struct host_link.  */
+static struct hash_table *host_links;
+
+static struct host_link *
+host_link_get (const char *host)
 {
-  if (pconn_active)
+  struct host_link *hl;
+
+  if (!host_links)
+    host_links = make_nocase_string_hash_table (0);
+  hl = hash_table_get (host_links, host);
+  if (!hl)
     {
-      if (pconn.socket == fd)
-        {
-          /* The connection FD is already registered. */
-          return;
-        }
-      else
-        {
-          /* The old persistent connection is still active; close it
-             first.  This situation arises whenever a persistent
-             connection exists, but we then connect to a different
-             host, and try to register a persistent connection to that
-             one.  */
-          invalidate_persistent ();
-        }
+      hl = xnew0 (struct host_link);
+      hl->rate_held = true;
+      hl->backed_off = -1;
+      hash_table_put (host_links, xstrdup (host), hl);
     }
+  return hl;
+}
 
-  pconn_active = true;
-  pconn.socket = fd;
-  pconn.host = xstrdup (host);
-  pconn.port = port;
-  pconn.ssl = ssl;
-  pconn.authorized = false;
+/* Fold SAMPLE into the smoothed value *V, giving it a quarter of the
+   weight, so that one slow connection doesn't decide on its own.  */
 
-  DEBUGP (("Registered socket %d for persistent reuse.\n", fd));
+static void
+host_link_smooth (double *v, double sample)
+{
+  *v = *v > 0 ? (3 * *v + sample) / 4 : sample;
 }
 
-/* Return true if a persistent connection is available for connecting
-   to HOST:PORT.  */
+/* Record that setting up a new connection to HOST took SECS.  */
 
-static bool
-persistent_available_p (const char *host, int port, bool ssl,
-                        bool *host_lookup_failed)
+static void
+host_link_setup (const char *host, double secs)
 {
-  /* First, check whether a persistent connection is active at all.  */
-  if (!pconn_active)
-    return false;
+  if (secs > 0)
+    host_link_smooth (&host_link_get (host)->setup, secs);
+}
 
-  /* If we want SSL and the last connection wasn't or vice versa,
-     don't use it.  Checking for host and port is not enough because
-     HTTP and HTTPS can apparently coexist on the same port.  */
-  if (ssl != pconn.ssl)
-    return false;
+/* A body slower than this much of the usual rate doesn't let its
+   connection budget grow.  */
+#define HOST_RATE_HOLD 0.75
 
-  /* If we're not connecting to the same port, we're not interested. */
-  if (port != pconn.port)
-    return false;
+/* Record that a body of BYTES took SECS to arrive from HOST.  */
+
+static void
+host_link_rate (const char *host, wgint bytes, double secs)
+{
+  struct host_link *hl;
+  double rate;
+
+  if (bytes < DRAIN_RATE_MIN_BYTES || secs <= 0)
+    return;
+  hl = host_link_get (host);
+  rate = bytes / secs;
+  hl->rate_held = !(hl->rate > 0 && rate < HOST_RATE_HOLD * hl->rate);
+  host_link_smooth (&hl->rate, rate);
+}
+
+/* The largest body from HOST that is read to keep its connection.  */
+
+static wgint
+drain_limit (const char *host)
+{
+  struct host_link *hl = host_links ? hash_table_get (host_links, host) : NULL;
+  double limit;
+
+  if (!hl || hl->setup <= 0 || hl->rate <= 0)
+    return DRAIN_MIN;
+  limit = hl->setup * hl->rate;
+  return limit < DRAIN_MIN ? DRAIN_MIN
+    : limit > DRAIN_MAX ? DRAIN_MAX : (wgint) limit;
+}
+
+/* Per-host concurrency.  The link checks of a spider go to a host over
+   as many connections at once as its budget allows, which is adjusted
+   like a TCP congestion window (additive increase, multiplicative
+   decrease).  A host starts with no budget, so that the connections
+   asked for are all used.  The budget is halved when the host answers
+   429 or 503, resets a connection, or takes much longer than usual to
+   answer several times in a row, and grows back by about one connection
+   per budget's worth of responses that come as fast as usual, while its
+   bodies keep arriving as fast per connection as before.  */
+
+/* A response is slow when it takes this many times as long as usual,
+   and at least HOST_TTFB_RISE_MIN seconds longer, which keeps the
+   jitter of a host that answers in microseconds from counting.
+   HOST_TTFB_SLOW slow responses in a row back the host off.  */
+#define HOST_TTFB_RISE 2.0
+#define HOST_TTFB_RISE_MIN 0.05
+#define HOST_TTFB_SLOW 3
+
+/* The budget at which a host is left alone again.  */
+#define HOST_BUDGET_MAX 32
+
+/* A host is backed off at most once in this many seconds, so that the
+   connections a burst of errors comes over halve its budget once.  */
+#define HOST_BACK_OFF_INTERVAL 1.0
+
+/* Return the time on the clock of the per-host measurements.  */
+
+static double
+host_link_now (void)
+{
+  static struct ptimer *timer;
+
+  if (!timer)
+    timer = ptimer_new ();
+  return ptimer_measure (timer);
+}
+
+/* Cut the budget of HOST, which has IN_USE connections, because it
+   seems overloaded.  */
+
+static void
+host_link_back_off (const char *host, int in_use)
+{
+  struct host_link *hl = host_link_get (host);
+  double now = host_link_now (), base;
+
+  if (hl->backed_off >= 0 && now - hl->backed_off < HOST_BACK_OFF_INTERVAL)
+    return;
+  hl->backed_off = now;
+  base = MAX (in_use, 1);
+  if (hl->budget > 0)
+    base = MIN (base, hl->budget);
+  hl->budget = MAX (1, base / 2);
+  DEBUGP (("Budget of %s cut to %d connections.\n", host, (int) hl->budget));
+}
+
+/* Record that a response of HOST, which has IN_USE connections, took
+   SECS to arrive after the request was sent, and adjust its budget.  */
+
+static void
+host_link_ttfb (const char *host, int in_use, double secs)
+{
+  struct host_link *hl = host_link_get (host);
+
+  if (secs <= 0)
+    return;
+  if (hl->ttfb > 0 && secs > HOST_TTFB_RISE * hl->ttfb
+      && secs - hl->ttfb > HOST_TTFB_RISE_MIN)
+    {
+      /* Until there are enough of them, slow responses are kept out of
+         the usual time they are compared with.  */
+      if (++hl->slow < HOST_TTFB_SLOW)
+        return;
+      hl->slow = 0;
+      host_link_back_off (host, in_use);
+    }
+  else
+    {
+      hl->slow = 0;
+      if (hl->budget > 0 && hl->rate_held)
+        {
+          hl->budget += 1 / hl->budget;
+          if (hl->budget >= HOST_BUDGET_MAX)
+            hl->budget = 0;
+        }
+    }
+  host_link_smooth (&hl->ttfb, secs);
+}
+
+/* Record that HOST answered STATCODE, or, if STATCODE is 0, that it
+   reset one of the IN_USE connections to it.  */
+
+static void
+host_link_status (const char *host, int in_use, int statcode)
+{
+  if (statcode == 0 || statcode == HTTP_STATUS_TOO_MANY_REQUESTS
+      || statcode == HTTP_STATUS_UNAVAILABLE)
+    host_link_back_off (host, in_use);
+}
+
+/* Return how many connections HOST may have at once, or 0 if it has
+   no budget.  */
+
+static int
+host_budget (const char *host)
+{
+  struct host_link *hl = host_links ? hash_table_get (host_links, host) : NULL;
+
+  return hl ? (int) hl->budget : 0;
+}
+
+/* Return whether HOST is held to a budget because it was backed off.  */
+
+static bool
+host_backed_off (const char *host)
+{
+  struct host_link *hl = host_links ? hash_table_get (host_links, host) : NULL;
+
+  return hl && hl->backed_off >= 0 && hl->budget > 0;
+}
+
+/* Read and throw away the body drained by D off FD.  Unless BLOCK,
+   only what can be read without waiting is.  Returns 1 when the body
+   is over, 0 when more is to come, and -1 if the connection cannot be
+   reused after all.  In debug mode, the body is displayed.  */
+
+static int
+drain_pump (int fd, struct body_drain *d, bool block)
+{
+  char buf[DRAIN_BUFSIZE + 1];
+  buf[DRAIN_BUFSIZE] = '\0';     /* so DEBUGP can safely print it */
+
+  while (d->chunked ? d->dc.state != CHUNK_DONE : d->left > 0)
+    {
+      int want = d->chunked ? DRAIN_BUFSIZE : MIN (d->left, DRAIN_BUFSIZE);
+      int ret, len;
+
+      if (d->budget <= 0)
+        {
+          DEBUGP (("Body on socket %d is too long to drain.\n", fd));
+          return -1;
+        }
+      ret = block ? fd_read (fd, buf, want, -1)
+                  : fd_read_nb (fd, buf, want, &d->wait_for);
+      if (ret == FD_WOULDBLOCK)
+        return 0;
+      if (ret <= 0)
+        {
+          /* Don't normally report the error since this is an
+             optimization that should be invisible to the user.  */
+          DEBUGP (("Draining socket %d aborted (%s).\n", fd,
+                   ret < 0 ? fd_errstr (fd) : "EOF received"));
+          return -1;
+        }
+      d->budget -= ret;
+
+      if (d->chunked)
+        {
+          int used;
+          len = dechunk (&d->dc, buf, ret, &used, false);
+          if (len < 0)
+            {
+              DEBUGP (("Draining socket %d aborted (bad chunk).\n", fd));
+              return -1;
+            }
+          /* The rest is the next response.  */
+          fd_unread (fd, buf + used, ret - used);
+        }
+      else
+        {
+          len = ret;
+          d->left -= ret;
+        }
+
+      /* Safe even if %.*s bogusly expects terminating \0 because
+         we've zero-terminated buf above.  */
+      DEBUGP (("Skipped %d bytes of body: [%.*s]\n", len, len, buf));
+    }
+  return 1;
+}
+
+/* Close the idle connection at position I in the pool and remove it
+   from the pool.  */
+
+static void
+pconn_pool_drop (int i)
+{
+  DEBUGP (("Closing idle persistent socket %d to %s:%d.\n",
+           pconn_pool[i].socket, pconn_pool[i].host, pconn_pool[i].port));
+  fd_close (pconn_pool[i].socket);
+  xfree (pconn_pool[i].drain);
+#if defined ENABLE_NTLM && defined HAVE_WINTLS
+  ntlm_free (&pconn_pool[i].ntlm);
+#endif
+  --pconn_pool_count;
+  memmove (pconn_pool + i, pconn_pool + i + 1,
+           (pconn_pool_count - i) * sizeof (pconn_pool[0]));
+  xzero (pconn_pool[pconn_pool_count]);
+}
+
+static void pconn_drain_ready (int, int, void *);
+
+/* Read what can be read without waiting of the body drained off PC.
+   Returns false if PC cannot be reused anymore.  */
+
+static bool
+pconn_drain_poll (struct persistent_connection *pc)
+{
+  int res = drain_pump (pc->socket, pc->drain, false);
+
+  if (res == 0)
+    {
+      fd_watch (pc->socket, pc->drain->wait_for, pconn_drain_ready, NULL);
+      return true;
+    }
+  DEBUGP (("Done draining socket %d.\n", pc->socket));
+  fd_unwatch (pc->socket);
+  xfree (pc->drain);
+  return res > 0;
+}
+
+/* Close the pooled connections that have been idle for too long, and
+   move on with the bodies being drained off the others.  */
+
+static void
+pconn_pool_expire (void)
+{
+  time_t now = time (NULL);
+  int i;
+
+  for (i = 0; i < pconn_pool_count; )
+    if (now - pconn_pool[i].idle_since > PCONN_IDLE_TIMEOUT)
+      pconn_pool_drop (i);
+    else
+      ++i;
+
+  /* Meanwhile, read what has arrived of the bodies being drained.  */
+  for (i = 0; i < pconn_pool_count; )
+    if (pconn_pool[i].drain && !pconn_drain_poll (&pconn_pool[i]))
+      pconn_pool_drop (i);
+    else
+      ++i;
+}
+
+/* Move the active persistent connection into the pool of idle
+   connections, making room for it by closing the oldest connection
+   to the same host (if PCONN_MAX_PER_HOST is reached) or the oldest
+   connection overall (if the pool is full).  */
+
+static void
+pconn_park (void)
+{
+  int i, same_host = 0, oldest_same_host = -1;
+
+  pconn_pool_expire ();
+
+  for (i = 0; i < pconn_pool_count; i++)
+    if (pconn_pool[i].port == pconn.port
+        && pconn_pool[i].ssl == pconn.ssl
+        && pconn_pool[i].host == pconn.host)
+      {
+        if (oldest_same_host == -1)
+          oldest_same_host = i;
+        ++same_host;
+      }
+
+  if (same_host >= PCONN_MAX_PER_HOST)
+    pconn_pool_drop (oldest_same_host);
+  else if (pconn_pool_count == PCONN_POOL_SIZE)
+    pconn_pool_drop (0);
+
+  DEBUGP (("Parking socket %d to %s:%d for later reuse.\n",
+           pconn.socket, pconn.host, pconn.port));
+  pconn.idle_since = time (NULL);
+  pconn_pool[pconn_pool_count++] = pconn;
+  pconn_active = false;
+  xzero (pconn);
+}
+
+/* Remove the idle connection at position I from the pool, and return
+   it.  */
+
+static struct persistent_connection
+pconn_pool_take (int i)
+{
+  struct persistent_connection found = pconn_pool[i];
+
+  --pconn_pool_count;
+  memmove (pconn_pool + i, pconn_pool + i + 1,
+           (pconn_pool_count - i) * sizeof (pconn_pool[0]));
+  xzero (pconn_pool[pconn_pool_count]);
+  return found;
+}
+
+/* Make the pooled connection at position I the active persistent
+   connection, parking the currently active one, if any.  */
+
+static void
+pconn_checkout (int i)
+{
+  struct persistent_connection found = pconn_pool_take (i);
+
+  if (pconn_active)
+    pconn_park ();
+
+  DEBUGP (("Checked out idle socket %d to %s:%d.\n",
+           found.socket, found.host, found.port));
+  pconn = found;
+  pconn_active = true;
+}
+
+/* Mark the persistent connection as invalid and free the resources it
+   uses.  This is used by the CLOSE_* macros after they forcefully
+   close a registered persistent connection.  */
+
+static void
+invalidate_persistent (void)
+{
+  DEBUGP (("Disabling further reuse of socket %d.\n", pconn.socket));
+  pipeline_clear ();
+  pconn_active = false;
+  fd_close (pconn.socket);
+  xfree (pconn.drain);
+#if defined ENABLE_NTLM && defined HAVE_WINTLS
+  ntlm_free (&pconn.ntlm);
+#endif
+  xzero (pconn);
+}
+
+/* Register FD, which should be a TCP/IP connection to HOST:PORT, as
+   persistent.  This will enable someone to use the same connection
+   later.  In the context of HTTP, this must be called only AFTER the
+   response has been received and the server has promised that the
+   connection will remain alive.
+
+   If a previous connection was persistent, it is moved to the pool of
+   idle connections. */
+
+static void
+register_persistent (const char *host, int port, int fd, bool ssl)
+{
+  if (pconn_active)
+    {
+      if (pconn.socket == fd)
+        {
+          /* The connection FD is already registered. */
+          return;
+        }
+      else
+        {
+          /* The old persistent connection is still active; park it.
+             This situation arises whenever a persistent connection
+             exists, but we then connect to a different host, and try
+             to register a persistent connection to that one.  */
+          pconn_park ();
+        }
+    }
+
+  pconn_active = true;
+  pconn.socket = fd;
+  pconn.host = url_intern_host (host);
+  pconn.port = port;
+  pconn.ssl = ssl;
+  pconn.authorized = false;
+
+  DEBUGP (("Registered socket %d for persistent reuse.\n", fd));
+}
+
+/* Called by fd_dispatch when the connection FD, whose body is being
+   drained, has more of it.  */
+
+static void
+pconn_drain_ready (int fd, int ready _GL_UNUSED, void *arg _GL_UNUSED)
+{
+  int i;
+
+  if (pconn_active && pconn.socket == fd && pconn.drain)
+    {
+      if (!pconn_drain_poll (&pconn))
+        invalidate_persistent ();
+      return;
+    }
+  for (i = 0; i < pconn_pool_count; i++)
+    if (pconn_pool[i].socket == fd && pconn_pool[i].drain)
+      {
+        if (!pconn_drain_poll (&pconn_pool[i]))
+          pconn_pool_drop (i);
+        return;
+      }
+  /* Not draining anymore.  */
+  fd_unwatch (fd);
+}
+
+/* Read the body of the response on FD from HOST, but don't store it
+   anywhere and don't display a progress gauge.  This is useful for
+   reading the bodies of administrative responses to which we will
+   soon issue another request.  The response is not useful to the
+   user, but reading it allows us to continue using the same
+   connection to the server.
+
+   If FD is the active persistent connection, what hasn't arrived yet
+   of the body is drained in the background, and the connection must
+   not be used before persistent_available_p has been called for it.
+
+   If reading fails, or the body is too large to be worth reading,
+   false is returned, true otherwise.  */
+
+static bool
+skip_short_body (int fd, const char *host, wgint contlen, bool chunked)
+{
+  struct body_drain d;
+  int res;
+
+  xzero (d);
+  d.left = contlen;
+  d.chunked = chunked;
+  d.budget = drain_limit (host);
+
+  /* If the body is too large, it makes more sense to simply close the
+     connection than to try to read the body.  */
+  if (!chunked && contlen > d.budget)
+    {
+      DEBUGP (("Not draining %s bytes of body from %s (limit %s).\n",
+               number_to_static_string (contlen), host,
+               number_to_static_string (d.budget)));
+      return false;
+    }
+  res = drain_pump (fd, &d, false);
+  if (res == 0)
+    {
+      /* The responses to pipelined requests follow at once, so the
+         body is in the way of the next one.  */
+      if (pconn_active && pconn.socket == fd && !pipeline_count)
+        {
+          DEBUGP (("Draining the rest of the body on socket %d in the "
+                   "background.\n", fd));
+          pconn.drain = xmemdup (&d, sizeof (d));
+          fd_watch (fd, d.wait_for, pconn_drain_ready, NULL);
+          return true;
+        }
+      res = drain_pump (fd, &d, true);
+    }
+  return res > 0;
+}
+
+/* Finish draining the body off the active persistent connection.
+   Returns false if the connection cannot be reused.  */
+
+static bool
+pconn_drain_finish (void)
+{
+  int res;
+
+  fd_unwatch (pconn.socket);
+  DEBUGP (("Finishing draining socket %d.\n", pconn.socket));
+  res = drain_pump (pconn.socket, pconn.drain, true);
+  xfree (pconn.drain);
+  return res > 0;
+}
+
+/* Return true if the connection PC can be used for talking to
+   HOST:PORT.  This doesn't check whether the connection is still
+   open.  */
+
+static bool
+pconn_matches (const struct persistent_connection *pc,
+               const char *host, int port, bool ssl,
+               bool *host_lookup_failed)
+{
+  /* If we want SSL and the last connection wasn't or vice versa,
+     don't use it.  Checking for host and port is not enough because
+     HTTP and HTTPS can apparently coexist on the same port.  */
+  if (ssl != pc->ssl)
+    return false;
+
+  /* If we're not connecting to the same port, we're not interested. */
+  if (port != pc->port)
+    return false;
 
   /* If the host is the same, we're in business.  If not, there is
-     still hope -- read below.  */
-  if (0 != strcasecmp (host, pconn.host))
+     still hope -- read below.  HOST is a URL's, hence interned like
+     PC's.  */
+  if (host != pc->host)
     {
-      /* Check if pconn.socket is talking to HOST under another name.
+      /* Check if pc->socket is talking to HOST under another name.
          This happens often when both sites are virtual hosts
          distinguished only by name and served by the same network
          interface, and hence the same web server (possibly set up by
@@ -1484,17 +2374,16 @@ persistent_available_p (const char *host, int port, bool ssl,
            name-based virtual hosting is even possible with SSL.)  */
         return false;
 
-      /* If pconn.socket's peer is one of the IP addresses HOST
-         resolves to, pconn.socket is for all intents and purposes
+      /* If pc->socket's peer is one of the IP addresses HOST
+         resolves to, pc->socket is for all intents and purposes
          already talking to HOST.  */
 
-      if (!socket_ip_address (pconn.socket, &ip, ENDPOINT_PEER))
-        {
-          /* Can't get the peer's address -- something must be very
-             wrong with the connection.  */
-          invalidate_persistent ();
-          return false;
-        }
+      if (!socket_ip_address (pc->socket, &ip, ENDPOINT_PEER))
+        /* Can't get the peer's address -- something must be very
+           wrong with the connection.  test_socket_open will weed it
+           out.  */
+        return false;
+
       al = lookup_host (host, 0);
       if (!al)
         {
@@ -1508,9 +2397,45 @@ persistent_available_p (const char *host, int port, bool ssl,
       if (!found)
         return false;
 
-      /* The persistent connection's peer address was found among the
-         addresses HOST resolved to; therefore, pconn.sock is in fact
-         already talking to HOST -- no need to reconnect.  */
+      /* The connection's peer address was found among the addresses
+         HOST resolved to; therefore, pc->socket is in fact already
+         talking to HOST -- no need to reconnect.  */
+    }
+
+  return true;
+}
+
+/* Return true if a persistent connection is available for connecting
+   to HOST:PORT.  If the active connection is not suitable, the pool
+   of idle connections is searched, and a matching connection found
+   there becomes the active one.  */
+
+static bool
+persistent_available_p (const char *host, int port, bool ssl,
+                        bool *host_lookup_failed)
+{
+  int i;
+
+  pconn_pool_expire ();
+
+  if (!pconn_active
+      || !pconn_matches (&pconn, host, port, ssl, host_lookup_failed))
+    {
+      if (*host_lookup_failed)
+        return false;
+
+      /* Look for the most recently parked matching connection. */
+      for (i = pconn_pool_count - 1; i >= 0; i--)
+        if (pconn_matches (&pconn_pool[i], host, port, ssl,
+                           host_lookup_failed))
+          break;
+        else if (*host_lookup_failed)
+          return false;
+
+      if (i < 0)
+        return false;
+
+      pconn_checkout (i);
     }
 
   /* Finally, check whether the connection is still open.  This is
@@ -1526,9 +2451,15 @@ persistent_available_p (const char *host, int port, bool ssl,
      body in response to HEAD, or if it sends more than conent-length
      data, we won't reuse the corrupted connection.)  */
 
-  if (!test_socket_open (pconn.socket))
+  if (pconn.drain && !pconn_drain_finish ())
     {
-      /* Oops, the socket is no longer open.  Now that we know that,
+      invalidate_persistent ();
+      return false;
+    }
+
+  if (!test_socket_open (pconn.socket))
+    {
+      /* Oops, the socket is no longer open.  Now that we know that,
          let's invalidate the persistent connection before returning
          0.  */
       invalidate_persistent ();
@@ -1538,6 +2469,28 @@ persistent_available_p (const char *host, int port, bool ssl,
   return true;
 }
 
+/* Return true if there is an active or idle persistent connection to
+   HOST:PORT, without checking whether it is still usable.  This is
+   meant for callers outside this file that want to know whether a
+   new connection to HOST will be needed.  */
+
+bool
+persistent_connection_exists_p (const char *host, int port, bool ssl)
+{
+  int i;
+
+  if (pconn_active && pconn.port == port && pconn.ssl == ssl
+      && pconn.host == host)
+    return true;
+
+  for (i = 0; i < pconn_pool_count; i++)
+    if (pconn_pool[i].port == port && pconn_pool[i].ssl == ssl
+        && pconn_pool[i].host == host)
+      return true;
+
+  return false;
+}
+
 /* The idea behind these two CLOSE macros is to distinguish between
    two cases: one when the job we've been doing is finished, and we
    want to close the connection and leave, and two when something is
@@ -1579,7 +2532,8 @@ typedef enum
   ENC_GZIP,                     /* gzip compression */
   ENC_DEFLATE,                  /* deflate compression */
   ENC_COMPRESS,                 /* compress compression */
-  ENC_BROTLI                    /* brotli compression */
+  ENC_BROTLI,                   /* brotli compression */
+  ENC_ZSTD                      /* zstd compression */
 } encoding_t;
 
 struct http_stat
@@ -1591,9 +2545,11 @@ struct http_stat
   char *rderrmsg;               /* error message from read error */
   char *newloc;                 /* new location (redirection) */
   char *remote_time;            /* remote time-stamp string */
+  char *etag;                   /* ETag of the response */
   char *error;                  /* textual HTTP error */
   int statcode;                 /* status code */
   char *message;                /* status message */
+  double retry_after;           /* seconds to wait as per Retry-After */
   wgint rd_size;                /* amount of data read from socket */
   double dltime;                /* time it took to download the data */
   const char *referer;          /* value of the referer header. */
@@ -1609,6 +2565,10 @@ struct http_stat
   wgint orig_file_size;         /* size of file to compare for time-stamping */
   time_t orig_file_tstamp;      /* time-stamp of file to compare for
                                  * time-stamping */
+  char *cond_etag;              /* ETag to send in If-None-Match */
+  char *cond_last_modified;     /* Last-Modified to send in
+                                   If-Modified-Since, instead of the
+                                   time-stamp of the file */
 #ifdef HAVE_METALINK
   metalink_t *metalink;
 #endif
@@ -1617,6 +2577,14 @@ struct http_stat
   encoding_t remote_encoding;   /* the encoding of the remote file */
 
   bool temporary;               /* downloading a temporary file */
+  bool captured;                /* the body was only digested, see
+                                   body_digests_capture_p */
+
+  struct http_cache_entry *cache_entry; /* what --http-cache holds of
+                                           the URL, or NULL */
+  bool cache_store;             /* whether the body goes to the cache */
+  time_t cache_expires;         /* until when it may be used from there */
+  char *content_type;           /* Content-Type to store along with it */
 };
 
 static void
@@ -1624,11 +2592,16 @@ free_hstat (struct http_stat *hs)
 {
   xfree (hs->newloc);
   xfree (hs->remote_time);
+  xfree (hs->etag);
   xfree (hs->error);
   xfree (hs->rderrmsg);
   xfree (hs->local_file);
   xfree (hs->orig_file_name);
+  xfree (hs->cond_etag);
+  xfree (hs->cond_last_modified);
   xfree (hs->message);
+  http_cache_entry_free (&hs->cache_entry);
+  xfree (hs->content_type);
 #ifdef HAVE_METALINK
   metalink_delete (hs->metalink);
   hs->metalink = NULL;
@@ -1649,6 +2622,8 @@ File %s already there; not retrieving.\n\n"), quote (filename));
     *dt |= TEXTHTML;
 }
 
+static void set_content_type (int *, const char *);
+
 /* Download the response body from the socket and writes it to
    an output file.  The headers have already been read from the
    socket.  If WARC is enabled, the response body will also be
@@ -1658,8 +2633,9 @@ File %s already there; not retrieving.\n\n"), quote (filename));
    parameters from the gethttp method.  fp is a pointer to the
    output file.
 
-   url, warc_timestamp_str, warc_request_uuid, warc_ip, type
+   The URL of u, warc_timestamp_str, warc_request_uuid, warc_ip, type
    and statcode will be saved in the headers of the WARC record.
+   The rate limit of the host of u applies to the body.
    The head parameter contains the HTTP headers of the response.
 
    If fp is NULL and WARC is enabled, the response body will be
@@ -1672,15 +2648,25 @@ File %s already there; not retrieving.\n\n"), quote (filename));
 static int
 read_response_body (struct http_stat *hs, int sock, FILE *fp, wgint contlen,
                     wgint contrange, bool chunked_transfer_encoding,
-                    char *url, char *warc_timestamp_str, char *warc_request_uuid,
+                    const struct url *u, char *warc_timestamp_str, char *warc_request_uuid,
                     ip_address *warc_ip, char *type, int statcode, char *head)
 {
   int warc_payload_offset = 0;
   FILE *warc_tmp = NULL;
+  struct warc_digests *warc_digests = NULL;
+  struct warc_response_stream *warc_stream = NULL;
   int warcerr = 0;
   int flags = 0;
 
-  if (opt.warc_filename != NULL)
+  /* When the size of the body is known, the record is written to the
+     WARC file as the body is received.  */
+  if (opt.warc_filename != NULL && contlen != -1
+      && !chunked_transfer_encoding)
+    warc_tmp = warc_response_stream_start (u->url, warc_timestamp_str,
+                                           warc_request_uuid, warc_ip, head,
+                                           contlen, &warc_stream);
+
+  if (opt.warc_filename != NULL && warc_stream == NULL)
     {
       /* Open a temporary file where we can write the response before we
          add it to the WARC record.  */
@@ -1696,6 +2682,11 @@ read_response_body (struct http_stat *hs, int sock, FILE *fp, wgint contlen,
           if (warc_tmp_written != head_len)
             warcerr = WARC_TMP_FWRITEERR;
           warc_payload_offset = head_len;
+
+          /* Compute the record digests as the response is received,
+             instead of reading warc_tmp back.  */
+          if (warcerr == 0)
+            warc_digests = warc_digests_start (head, head_len);
         }
 
       if (warcerr != 0)
@@ -1729,27 +2720,51 @@ read_response_body (struct http_stat *hs, int sock, FILE *fp, wgint contlen,
 
   if (hs->remote_encoding == ENC_GZIP)
     flags |= rb_compressed_gzip;
+  else if (hs->remote_encoding == ENC_BROTLI)
+    flags |= rb_compressed_brotli;
+  else if (hs->remote_encoding == ENC_ZSTD)
+    flags |= rb_compressed_zstd;
+
+  {
+    int type_dt = 0;
+    set_content_type (&type_dt, type);
+    if (type_dt & (TEXTHTML | TEXTCSS))
+      flags |= rb_document;
+  }
+  if (hs->captured)
+    flags |= rb_capture_only;
 
   hs->len = hs->restval;
   hs->rd_size = 0;
   /* Download the response body and write it to fp.
      If we are working on a WARC file, we simultaneously write the
      response body to warc_tmp.  */
-  hs->res = fd_read_body (hs->local_file, sock, fp, contlen != -1 ? contlen : 0,
+  hs->res = fd_read_body (hs->local_file, sock, u->host, fp,
+                          contlen != -1 ? contlen : 0,
                           hs->restval, &hs->rd_size, &hs->len, &hs->dltime,
                           flags, warc_tmp);
   if (hs->res >= 0)
     {
-      if (warc_tmp != NULL)
+      host_link_rate (u->host, hs->rd_size, hs->dltime);
+      if (warc_stream != NULL)
+        {
+          if (!warc_response_stream_finish (warc_stream, u->url,
+                                            warc_timestamp_str,
+                                            warc_request_uuid, warc_ip,
+                                            type, statcode, hs->newloc))
+            return WARC_ERR;
+        }
+      else if (warc_tmp != NULL)
         {
           /* Create a response record and write it to the WARC file.
              Note: per the WARC standard, the request and response should share
              the same date header.  We re-use the timestamp of the request.
              The response record should also refer to the uuid of the request.  */
-          bool r = warc_write_response_record (url, warc_timestamp_str,
+          bool r = warc_write_response_record (u->url, warc_timestamp_str,
                                                warc_request_uuid, warc_ip,
                                                warc_tmp, warc_payload_offset,
-                                               type, statcode, hs->newloc);
+                                               type, statcode, hs->newloc,
+                                               warc_digests);
 
           /* warc_write_response_record has closed warc_tmp. */
 
@@ -1760,8 +2775,11 @@ read_response_body (struct http_stat *hs, int sock, FILE *fp, wgint contlen,
       return RETRFINISHED;
     }
 
-  if (warc_tmp != NULL)
+  if (warc_stream != NULL)
+    warc_response_stream_abort (warc_stream);
+  else if (warc_tmp != NULL)
     fclose (warc_tmp);
+  warc_digests_free (warc_digests);
 
   if (hs->res == -2)
     {
@@ -1782,6 +2800,437 @@ read_response_body (struct http_stat *hs, int sock, FILE *fp, wgint contlen,
     }
 }
 
+/* Segmented downloads (--segments).
+
+   A body of known length is split into byte ranges, each fetched over
+   its own connection with a "Range" request and written at its offset
+   in the output file.  The connections are multiplexed with
+   fd_dispatch, so no threads are involved.  Whenever a segment
+   finishes, its connection takes over the upper half of the segment
+   with the most data left, which keeps every connection busy until the
+   end and stops one slow connection from holding up the whole file.  */
+
+/* Hard limit on the number of connections used for one file. */
+#define MAX_SEGMENTS 16
+
+/* Never split off a range smaller than this. */
+#define SEGMENT_MIN_SIZE (1024 * 1024)
+
+struct segment {
+  int sock;                     /* connection receiving this range, or -1 */
+  wgint start;                  /* offset where the range began */
+  wgint pos;                    /* offset of the next byte to arrive */
+  wgint end;                    /* offset one past the last byte we want */
+  wgint resp_end;               /* where the server's response ends */
+  int wait_for;                 /* what SOCK must become ready for */
+  bool retried;                 /* reconnected since data last arrived */
+};
+
+/* Send REQ over SOCK asking for bytes [START, END) of the file, and
+   check that the server delivers exactly that range.  */
+
+static bool
+segment_request (int sock, struct request *req, wgint start, wgint end)
+{
+  struct response *resp;
+  char *head;
+  char hdrval[256];
+  wgint first = -1, last = -1, entity = -1;
+  bool ok = false;
+
+  request_set_header (req, "Range",
+                      aprintf ("bytes=%s-%s", number_to_static_string (start),
+                               number_to_static_string (end - 1)),
+                      rel_value);
+  if (request_send (req, sock, NULL) < 0)
+    return false;
+
+  head = read_http_response_head (sock);
+  if (!head)
+    return false;
+  resp = resp_new (head);
+  if (resp_status (resp, NULL) == HTTP_STATUS_PARTIAL_CONTENTS
+      && resp_header_copy (resp, "Content-Range", hdrval, sizeof (hdrval))
+      && parse_content_range (hdrval, &first, &last, &entity)
+      && first == start && last == end - 1
+      && !resp_header_copy (resp, "Transfer-Encoding", NULL, 0))
+    ok = true;
+  else
+    DEBUGP (("Server refused range %s-%s:\n%s",
+             number_to_static_string (start),
+             number_to_static_string (end - 1), head));
+  resp_free (&resp);
+  xfree (head);
+  return ok;
+}
+
+/* Get SEG's range flowing, over SEG->sock if that connection is idle,
+   or else over a new connection to U.  */
+
+static bool
+segment_start (struct segment *seg, const struct url *u, struct request *req)
+{
+  if (seg->sock >= 0)
+    {
+      if (segment_request (seg->sock, req, seg->pos, seg->end))
+        goto started;
+      /* The server may have closed the idle connection; try a new one. */
+      CLOSE_INVALIDATE (seg->sock);
+    }
+
+  seg->sock = connect_to_host (u->host, u->port);
+  if (seg->sock < 0)
+    return false;
+#ifdef HAVE_SSL
+  if (u->scheme == SCHEME_HTTPS
+      && (!ssl_connect_wget (seg->sock, u->host, NULL, NULL)
+          || !ssl_check_certificate (seg->sock, u->host)))
+    goto fail;
+#endif
+  if (!segment_request (seg->sock, req, seg->pos, seg->end))
+    goto fail;
+
+ started:
+  seg->resp_end = seg->end;
+  seg->wait_for = WAIT_FOR_READ;
+  return true;
+
+ fail:
+  CLOSE_INVALIDATE (seg->sock);
+  return false;
+}
+
+/* Find the running segment with the most data left and move the upper
+   half of its range to SPARE.  Returns the index of the segment that
+   was split, or -1 if none was worth splitting.  */
+
+static int
+segment_split (struct segment *segs, int count, struct segment *spare)
+{
+  int i, best = -1;
+  wgint mid;
+
+  for (i = 0; i < count; i++)
+    if (segs[i].sock >= 0 && &segs[i] != spare
+        && segs[i].end - segs[i].pos >= 2 * SEGMENT_MIN_SIZE
+        && (best == -1
+            || segs[i].end - segs[i].pos > segs[best].end - segs[best].pos))
+      best = i;
+  if (best == -1)
+    return -1;
+
+  mid = segs[best].pos + (segs[best].end - segs[best].pos) / 2;
+  spare->start = spare->pos = mid;
+  spare->end = segs[best].end;
+  segs[best].end = mid;
+  return best;
+}
+
+/* Find new work for SEG, whose range has just been completed: resume
+   a segment whose connection was lost, or take over half of the
+   largest remaining one.  */
+
+static void
+segment_reassign (struct segment *segs, int count, struct segment *seg,
+                  const struct url *u, struct request *req)
+{
+  int i, split;
+
+  /* Unread data of the current response would be taken for the
+     response to our next request.  */
+  if (seg->sock >= 0 && seg->pos != seg->resp_end)
+    {
+      CLOSE_INVALIDATE (seg->sock);
+    }
+
+  for (i = 0; i < count; i++)
+    if (segs[i].sock < 0 && segs[i].pos < segs[i].end)
+      {
+        segs[i].sock = seg->sock;
+        seg->sock = -1;
+        segment_start (&segs[i], u, req);
+        return;
+      }
+
+  split = segment_split (segs, count, seg);
+  if (split == -1)
+    {
+      if (seg->sock >= 0)
+        CLOSE_INVALIDATE (seg->sock);
+      return;
+    }
+  if (!segment_start (seg, u, req))
+    {
+      /* Give the range back. */
+      segs[split].end = seg->end;
+      seg->pos = seg->end;
+    }
+  else
+    DEBUGP (("Segment %d now fetches %s-%s.\n", (int) (seg - segs),
+             number_to_static_string (seg->pos),
+             number_to_static_string (seg->end)));
+}
+
+/* A segmented download in progress.  */
+
+struct segmented_body {
+  struct http_stat *hs;
+  const struct url *u;
+  struct request *req;
+  FILE *fp;
+  struct segment segs[MAX_SEGMENTS];
+  int count;                    /* number of segments in SEGS */
+  void *progress;
+  struct ptimer *timer;
+  double last_read_tm;
+  int res;                      /* -1 for a read error, -2 for a write error */
+};
+
+/* Show what every connection of SB is doing under its progress bar. */
+
+static void
+segments_show_progress (struct segmented_body *sb)
+{
+  int i, waiting = 0;
+
+  for (i = 0; i < sb->count; i++)
+    {
+      struct segment *seg = &sb->segs[i];
+      if (seg->sock >= 0 && seg->pos < seg->end)
+        progress_set_connection (sb->progress, i, NULL, seg->pos - seg->start,
+                                 seg->end - seg->start);
+      else
+        {
+          progress_set_connection (sb->progress, i, NULL, 0, -1);
+          if (seg->pos < seg->end)
+            waiting++;
+        }
+    }
+  progress_set_waiting (sb->progress, waiting);
+}
+
+/* Called by fd_dispatch when the connection FD of one of the segments
+   of SB can be read from.  */
+
+static void
+segment_readable (int fd, int events _GL_UNUSED, void *arg)
+{
+  struct segmented_body *sb = arg;
+  struct segment *seg;
+  static char buf[16384];
+  int i, ret, size;
+
+  for (i = 0; i < sb->count; i++)
+    if (sb->segs[i].sock == fd && sb->segs[i].pos < sb->segs[i].end)
+      break;
+  if (i == sb->count || sb->res != 0)
+    return;
+  seg = &sb->segs[i];
+
+  /* The other segments may have used up what the rate limit allows.  */
+  size = throttle_quota (sb->u->host,
+                         MIN ((wgint) sizeof (buf), seg->end - seg->pos));
+  if (!size)
+    return;
+  ret = fd_read_nb (fd, buf, size, &seg->wait_for);
+  if (ret == FD_WOULDBLOCK)
+    return;
+  seg->wait_for = WAIT_FOR_READ;
+  if (ret <= 0)
+    {
+      if (ret < 0)
+        {
+          bool reset = errno == ECONNRESET;
+          xfree (sb->hs->rderrmsg);
+          sb->hs->rderrmsg = xstrdup (fd_errstr (seg->sock));
+          if (reset)
+            host_link_status (sb->u->host, sb->count, 0);
+        }
+      CLOSE_INVALIDATE (seg->sock);
+
+      /* Reconnect once and carry on from where we got.  A range whose
+         new connection is lost too before any data arrives is left to
+         the connection of the next segment to finish, see
+         segment_reassign, and failing that to the next try.  */
+      if (!seg->retried)
+        {
+          seg->retried = true;
+          if (segment_start (seg, sb->u, sb->req))
+            return;
+        }
+      DEBUGP (("Segment %d lost its connection at %s.\n",
+               i, number_to_static_string (seg->pos)));
+      if (!sb->hs->rderrmsg)
+        sb->hs->rderrmsg = xstrdup (_("Connection closed"));
+      return;
+    }
+
+  if (!write_file_at (sb->fp, buf, ret, seg->pos))
+    sb->res = -2;
+  seg->retried = false;
+  seg->pos += ret;
+  sb->hs->rd_size += ret;
+  throttle_account (sb->u->host, ret);
+
+  sb->last_read_tm = ptimer_measure (sb->timer);
+  if (sb->progress)
+    {
+      segments_show_progress (sb);
+      progress_update (sb->progress, ret, sb->last_read_tm);
+    }
+
+  if (seg->pos == seg->end && sb->res == 0)
+    segment_reassign (sb->segs, sb->count, seg, sb->u, sb->req);
+}
+
+/* Download the CONTLEN-byte body of the response to REQ using up to
+   opt.segments connections, the first of which is SOCK, already
+   positioned at the start of the body.  All connections, SOCK
+   included, are closed on return.
+
+   The return value and the fields of HS are set the way
+   read_response_body sets them: when a range could not be
+   completed, HS->len is the length of the contiguous part of the file
+   and the rest of the file is truncated, so that the download can be
+   continued from there.  */
+
+static int
+read_segmented_body (struct http_stat *hs, const struct url *u,
+                     struct request *req, int sock, FILE *fp, wgint contlen)
+{
+  struct segmented_body sb;
+  struct segment *segs = sb.segs;
+  int nsegs, i;
+
+  /* The number of connections is the user's call; the budget of the
+     host isn't applied to it.  */
+  nsegs = MIN (opt.segments, MAX_SEGMENTS);
+
+  /* The body is written out of order, which running digests of FP
+     cannot follow.  */
+  body_digests_invalidate ();
+
+  /* The segments are written where they belong in the file.  */
+  presize_file (fp, contlen, opt.preallocate);
+
+  xzero (sb);
+  sb.hs = hs;
+  sb.u = u;
+  sb.req = req;
+  sb.fp = fp;
+
+  segs[0].sock = sock;
+  segs[0].start = segs[0].pos = 0;
+  segs[0].end = segs[0].resp_end = contlen;
+  segs[0].wait_for = WAIT_FOR_READ;
+  for (sb.count = 1; sb.count < nsegs; sb.count++)
+    {
+      struct segment *seg = &segs[sb.count];
+      int split;
+
+      seg->sock = -1;
+      split = segment_split (segs, sb.count, seg);
+      if (split == -1)
+        break;
+      if (!segment_start (seg, u, req))
+        {
+          segs[split].end = seg->end;
+          break;
+        }
+    }
+  if (sb.count > 1)
+    logprintf (LOG_VERBOSE, _("Downloading in %d segments.\n"), sb.count);
+
+  if (opt.show_progress)
+    {
+      const char *filename_progress = hs->local_file;
+      if (opt.dir_prefix)
+        filename_progress += strlen (opt.dir_prefix) + 1;
+      sb.progress = progress_create (filename_progress, 0, contlen);
+    }
+  sb.timer = ptimer_new ();
+
+  while (sb.res == 0)
+    {
+      int n = 0, run;
+      double delay;
+
+      /* Connections come and go in the callbacks; watching one that is
+         already watched costs nothing.  */
+      for (i = 0; i < sb.count; i++)
+        if (segs[i].sock >= 0 && segs[i].pos < segs[i].end)
+          {
+            fd_watch (segs[i].sock, segs[i].wait_for, segment_readable, &sb);
+            n++;
+          }
+      if (!n)
+        break;
+
+      /* Until the rate limit allows reading again, leave the data
+         where it is.  */
+      if ((delay = throttle_delay (u->host)) > 0)
+        {
+          xsleep (delay);
+          continue;
+        }
+
+      /* Wake up about once a second so that the progress bar keeps
+         moving while everything stalls.  */
+      run = fd_dispatch (0.95);
+      if (run < 0)
+        sb.res = -1;
+      else if (run == 0)
+        {
+          double now = ptimer_measure (sb.timer);
+          if (opt.read_timeout && now - sb.last_read_tm >= opt.read_timeout)
+            {
+              errno = ETIMEDOUT;
+              sb.res = -1;
+            }
+          else if (sb.progress)
+            {
+              segments_show_progress (&sb);
+              progress_update (sb.progress, 0, now);
+            }
+        }
+    }
+
+  /* Everything below the first missing byte is in place.  */
+  hs->len = contlen;
+  for (i = 0; i < sb.count; i++)
+    {
+      if (segs[i].sock >= 0)
+        CLOSE_INVALIDATE (segs[i].sock);
+      if (segs[i].pos < segs[i].end && segs[i].pos < hs->len)
+        hs->len = segs[i].pos;
+    }
+  if (hs->len < contlen && sb.res != -2)
+    {
+      if (fflush (fp) != 0 || ftruncate (fileno (fp), hs->len) != 0)
+        sb.res = -2;
+      else
+        fseeko (fp, hs->len, SEEK_SET);
+      if (sb.res == 0 && hs->rderrmsg)
+        sb.res = -1;
+    }
+  else if (sb.res == 0)
+    {
+      /* Errors we recovered from don't matter.  */
+      xfree (hs->rderrmsg);
+      if (fseeko (fp, contlen, SEEK_SET) != 0)
+        sb.res = -2;
+    }
+
+  if (sb.progress)
+    progress_finish (sb.progress, ptimer_read (sb.timer));
+  hs->dltime = ptimer_read (sb.timer);
+  ptimer_destroy (sb.timer);
+  if (sb.res == 0)
+    host_link_rate (u->host, hs->rd_size / sb.count, hs->dltime);
+
+  return sb.res;
+}
+
 #define BEGINS_WITH(line, string_constant)                               \
   (!c_strncasecmp (line, string_constant, sizeof (string_constant) - 1)    \
    && (c_isspace (line[sizeof (string_constant) - 1])                      \
@@ -1849,100 +3298,547 @@ time_to_rfc1123 (time_t time, char *buf, size_t bufsize)
   return RETROK;
 }
 
-static struct request *
-initialize_request (const struct url *u, struct http_stat *hs, int *dt, struct url *proxy,
-                    bool inhibit_keep_alive, bool *basic_auth_finished,
-                    wgint *body_data_size, char **user, char **passwd, uerr_t *ret)
+/* Generate the Host header, HOST:PORT.  Take into account that:
+
+   - Broken server-side software often doesn't recognize the PORT
+     argument, so we must generate "Host: www.server.com" instead of
+     "Host: www.server.com:80" (and likewise for https port).
+
+   - IPv6 addresses contain ":", so "Host: 3ffe:8100:200:2::2:1234"
+     becomes ambiguous and needs to be rewritten as "Host:
+     [3ffe:8100:200:2::2]:1234".  */
+
+static void
+request_set_host (struct request *req, const struct url *u)
 {
-  bool head_only = !!(*dt & HEAD_ONLY);
-  struct request *req;
+  /* Formats arranged for hfmt[add_port][add_squares].  */
+  static const char *hfmt[][2] = {
+    { "%s", "[%s]" }, { "%s:%d", "[%s]:%d" }
+  };
+  int add_port = u->port != scheme_default_port (u->scheme);
+  int add_squares = strchr (u->host, ':') != NULL;
+  request_set_header (req, "Host",
+                      aprintf (hfmt[add_port][add_squares], u->host, u->port),
+                      rel_value);
+}
 
-  /* Prepare the request to send. */
-  {
-    char *meth_arg;
-    const char *meth = "GET";
-    if (head_only)
-      meth = "HEAD";
-    else if (opt.method)
-      meth = opt.method;
-    /* Use the full path, i.e. one that includes the leading slash and
-       the query string.  E.g. if u->path is "foo/bar" and u->query is
-       "param=value", full_path will be "/foo/bar?param=value".  */
-    if (proxy
-#ifdef HAVE_SSL
-        /* When using SSL over proxy, CONNECT establishes a direct
-           connection to the HTTPS server.  Therefore use the same
-           argument as when talking to the server directly. */
-        && u->scheme != SCHEME_HTTPS
-#endif
-        )
-      meth_arg = xstrdup (u->url);
-    else
-      meth_arg = url_full_path (u);
-    req = request_new (meth, meth_arg);
-  }
+/* Piece downloads (used for Metalink files with piece hashes).
 
-  /* Generate the Host header, HOST:PORT.  Take into account that:
+   Every connection asks one mirror for one piece at a time.  A piece
+   is only written to the file after it has been checked, so a mirror
+   serving bad data is found out after one piece and dropped, and its
+   pieces are handed to the other mirrors.  */
 
-     - Broken server-side software often doesn't recognize the PORT
-       argument, so we must generate "Host: www.server.com" instead of
-       "Host: www.server.com:80" (and likewise for https port).
+/* Give up on a mirror after this many failed requests. */
+#define PIECE_MAX_FAILURES 3
 
-     - IPv6 addresses contain ":", so "Host: 3ffe:8100:200:2::2:1234"
-       becomes ambiguous and needs to be rewritten as "Host:
-       [3ffe:8100:200:2::2]:1234".  */
-  {
-    /* Formats arranged for hfmt[add_port][add_squares].  */
-    static const char *hfmt[][2] = {
-      { "%s", "[%s]" }, { "%s:%d", "[%s]:%d" }
-    };
-    int add_port = u->port != scheme_default_port (u->scheme);
-    int add_squares = strchr (u->host, ':') != NULL;
-    request_set_header (req, "Host",
-                        aprintf (hfmt[add_port][add_squares], u->host, u->port),
-                        rel_value);
-  }
+enum { PIECE_TODO, PIECE_BUSY, PIECE_DONE };
 
-  request_set_header (req, "Referer", hs->referer, rel_none);
-  if (*dt & SEND_NOCACHE)
-    {
-      /* Cache-Control MUST be obeyed by all HTTP/1.1 caching mechanisms...  */
-      request_set_header (req, "Cache-Control", "no-cache", rel_none);
+struct piece_source {
+  const struct url *url;
+  struct request *req;
+  int failures;
+  int conns;                    /* connections currently using it */
+  bool dropped;
+};
 
-      /* ... but some HTTP/1.0 caches doesn't implement Cache-Control.  */
-      request_set_header (req, "Pragma", "no-cache", rel_none);
-    }
-  if (*dt & IF_MODIFIED_SINCE)
-    {
-      char strtime[32];
-      uerr_t err = time_to_rfc1123 (hs->orig_file_tstamp, strtime, countof (strtime));
+struct piece_conn {
+  struct segment seg;           /* range of the piece still to arrive */
+  int source;                   /* index of the mirror */
+  int piece;                    /* piece being fetched, or -1 */
+  wgint start;                  /* offset of the piece in the file */
+  char *buf;                    /* piece data */
+};
 
-      if (err != RETROK)
-        {
-          logputs (LOG_VERBOSE, _("Cannot convert timestamp to http format. "
-                                  "Falling back to time 0 as last modification "
-                                  "time.\n"));
-          strcpy (strtime, "Thu, 01 Jan 1970 00:00:00 GMT");
-        }
-      request_set_header (req, "If-Modified-Since", xstrdup (strtime), rel_value);
-    }
-  if (hs->restval)
-    request_set_header (req, "Range",
-                        aprintf ("bytes=%s-",
-                                 number_to_static_string (hs->restval)),
-                        rel_value);
+struct piece_job {
+  struct piece_source *sources;
+  int nsources;
+  struct piece_conn *conns;
+  int nconns;
+  char *state;                  /* PIECE_* for every piece */
+  int npieces;
+  int first_todo;               /* no PIECE_TODO below this one */
+  int done;                     /* number of PIECE_DONE pieces */
+  FILE *fp;
+  bool (*verify) (int, const char *, wgint, void *);
+  void *verify_arg;
+  void *progress;
+  struct ptimer *timer;
+  double last_read_tm;
+  uerr_t err;
+};
+
+static struct request *
+piece_request_new (const struct url *u)
+{
+  struct request *req = request_new ("GET", url_full_path (u));
+  int i;
+
+  request_set_host (req, u);
   SET_USER_AGENT (req);
   request_set_header (req, "Accept", "*/*", rel_none);
-#ifdef HAVE_LIBZ
-  if (opt.compression != compression_none)
-    request_set_header (req, "Accept-Encoding", "gzip", rel_none);
-  else
-#endif
-    request_set_header (req, "Accept-Encoding", "identity", rel_none);
+  request_set_header (req, "Accept-Encoding", "identity", rel_none);
+  request_set_header (req, "Connection", "Keep-Alive", rel_none);
+  if (opt.user_headers)
+    for (i = 0; opt.user_headers[i]; i++)
+      request_set_user_header (req, opt.user_headers[i]);
+  return req;
+}
 
-  /* Find the username with priority */
-  if (u->user)
-    *user = u->user;
+/* Stop fetching C's piece and put it back in the queue.  */
+
+static void
+piece_release (struct piece_job *job, struct piece_conn *c)
+{
+  if (c->seg.sock >= 0)
+    CLOSE_INVALIDATE (c->seg.sock);
+  if (c->piece >= 0)
+    {
+      job->state[c->piece] = PIECE_TODO;
+      job->first_todo = MIN (job->first_todo, c->piece);
+      c->piece = -1;
+    }
+}
+
+/* Stop using mirror SOURCE.  */
+
+static void
+piece_drop_source (struct piece_job *job, int source)
+{
+  int i;
+
+  if (job->sources[source].dropped)
+    return;
+  job->sources[source].dropped = true;
+  logprintf (LOG_VERBOSE, _("Dropping mirror %s.\n"),
+             quote (job->sources[source].url->url));
+  for (i = 0; i < job->nconns; i++)
+    if (job->conns[i].source == source)
+      piece_release (job, &job->conns[i]);
+}
+
+/* Record a failed request to C's mirror.  */
+
+static void
+piece_fail (struct piece_job *job, struct piece_conn *c)
+{
+  piece_release (job, c);
+  if (++job->sources[c->source].failures >= PIECE_MAX_FAILURES)
+    piece_drop_source (job, c->source);
+}
+
+/* Give idle connection C the next piece in the queue, switching it to
+   the least busy mirror if its own has been dropped.  Returns false
+   if there is nothing left to hand out.  */
+
+static bool
+piece_assign (struct piece_job *job, struct piece_conn *c,
+              wgint size, wgint piece_size)
+{
+  int npieces = (size + piece_size - 1) / piece_size;
+  int i, piece;
+
+  while (job->first_todo < npieces
+         && job->state[job->first_todo] != PIECE_TODO)
+    job->first_todo++;
+  piece = job->first_todo;
+  if (piece >= npieces)
+    return false;
+
+  if (job->sources[c->source].dropped)
+    {
+      int best = -1;
+      for (i = 0; i < job->nsources; i++)
+        if (!job->sources[i].dropped
+            && (best == -1 || job->sources[i].conns < job->sources[best].conns))
+          best = i;
+      if (best == -1)
+        return false;
+      job->sources[c->source].conns--;
+      job->sources[best].conns++;
+      c->source = best;
+    }
+
+  c->piece = piece;
+  c->start = (wgint) piece * piece_size;
+  c->seg.pos = c->start;
+  c->seg.end = MIN (c->start + piece_size, size);
+  job->state[piece] = PIECE_BUSY;
+
+  if (!segment_start (&c->seg, job->sources[c->source].url,
+                      job->sources[c->source].req))
+    {
+      DEBUGP (("Could not request piece %d from %s.\n", piece,
+               job->sources[c->source].url->url));
+      piece_fail (job, c);
+    }
+  return true;
+}
+
+/* Show what every connection of JOB is doing under its progress
+   bar, labeling each with the mirror it talks to.  */
+
+static void
+pieces_show_progress (struct piece_job *job)
+{
+  int i, busy = 0;
+
+  for (i = 0; i < job->nconns; i++)
+    {
+      struct piece_conn *c = &job->conns[i];
+      const char *host = job->sources[c->source].url->host;
+      if (c->piece >= 0)
+        {
+          progress_set_connection (job->progress, i, host,
+                                   c->seg.pos - c->start,
+                                   c->seg.end - c->start);
+          busy++;
+        }
+      else
+        progress_set_connection (job->progress, i, host, 0, -1);
+    }
+  progress_set_waiting (job->progress, job->npieces - job->done - busy);
+}
+
+/* Called by fd_dispatch when the connection FD of one of the
+   connections of JOB can be read from.  */
+
+static void
+piece_readable (int fd, int events _GL_UNUSED, void *arg)
+{
+  struct piece_job *job = arg;
+  struct piece_conn *c;
+  const char *host;
+  wgint len;
+  int i, ret, size;
+
+  for (i = 0; i < job->nconns; i++)
+    if (job->conns[i].seg.sock == fd && job->conns[i].piece >= 0)
+      break;
+  if (i == job->nconns || job->err != RETROK)
+    return;
+  c = &job->conns[i];
+  host = job->sources[c->source].url->host;
+
+  size = throttle_quota (host, MIN (16384, c->seg.end - c->seg.pos));
+  if (!size)
+    return;
+  ret = fd_read_nb (fd, c->buf + (c->seg.pos - c->start), size,
+                    &c->seg.wait_for);
+  if (ret == FD_WOULDBLOCK)
+    return;
+  c->seg.wait_for = WAIT_FOR_READ;
+  if (ret <= 0)
+    {
+      piece_fail (job, c);
+      return;
+    }
+  c->seg.pos += ret;
+  throttle_account (host, ret);
+  job->last_read_tm = ptimer_measure (job->timer);
+  if (job->progress)
+    {
+      pieces_show_progress (job);
+      progress_update (job->progress, ret, job->last_read_tm);
+    }
+  if (c->seg.pos < c->seg.end)
+    return;
+
+  len = c->seg.end - c->start;
+  if (!job->verify (c->piece, c->buf, len, job->verify_arg))
+    {
+      int others = 0;
+
+      logprintf (LOG_NOTQUIET,
+                 _("Piece %d from %s failed verification.\n"),
+                 c->piece, quote (job->sources[c->source].url->url));
+      for (i = 0; i < job->nsources; i++)
+        others += i != c->source && !job->sources[i].dropped;
+      /* The piece is left to the other mirrors, or, if there are none,
+         the mirror gets a few more tries, as after other failures.  */
+      if (others)
+        {
+          piece_release (job, c);
+          piece_drop_source (job, c->source);
+        }
+      else
+        piece_fail (job, c);
+      return;
+    }
+  if (!write_file_at (job->fp, c->buf, len, c->start))
+    {
+      job->err = FWRITEERR;
+      return;
+    }
+  job->state[c->piece] = PIECE_DONE;
+  job->sources[c->source].failures = 0;
+  c->piece = -1;
+  job->done++;
+}
+
+/* Download a file of SIZE bytes, in pieces of PIECE_SIZE bytes, from
+   the NURLS mirrors in URLS and write it to FP.  VERIFY is called for
+   every piece as soon as it has arrived and must return whether its
+   contents are right.  If HAVE is non-NULL, the pieces it is true for
+   are already in FP and verified, and are not fetched again.  NAME is
+   shown in the progress indicator.
+
+   Returns RETROK if all pieces were retrieved and verified.  */
+
+uerr_t
+http_get_pieces (struct url **urls, int nurls, FILE *fp, const char *name,
+                 wgint size, wgint piece_size, const bool *have,
+                 bool (*verify) (int, const char *, wgint, void *), void *arg)
+{
+  struct piece_job job;
+  int npieces = (size + piece_size - 1) / piece_size;
+  wgint have_size = 0;
+  int live, i;
+  uerr_t err;
+
+  xzero (job);
+  job.nsources = nurls;
+  job.sources = xcalloc (nurls, sizeof (struct piece_source));
+  for (i = 0; i < nurls; i++)
+    {
+      job.sources[i].url = urls[i];
+      job.sources[i].req = piece_request_new (urls[i]);
+    }
+
+  /* At least one connection per mirror, more if --segments asks.  */
+  job.nconns = MIN (MAX (opt.segments, nurls), MAX_SEGMENTS);
+  job.conns = xcalloc (job.nconns, sizeof (struct piece_conn));
+  for (i = 0; i < job.nconns; i++)
+    {
+      job.conns[i].seg.sock = -1;
+      job.conns[i].source = i % nurls;
+      job.conns[i].piece = -1;
+      job.conns[i].buf = xmalloc (piece_size);
+      job.sources[i % nurls].conns++;
+    }
+  job.state = xcalloc (npieces, 1);
+  for (i = 0; have && i < npieces; i++)
+    if (have[i])
+      {
+        job.state[i] = PIECE_DONE;
+        job.done++;
+        have_size += MIN (piece_size, size - (wgint) i * piece_size);
+      }
+  job.npieces = npieces;
+  job.fp = fp;
+  presize_file (fp, size, opt.preallocate);
+  job.verify = verify;
+  job.verify_arg = arg;
+  job.err = RETROK;
+
+  logprintf (LOG_VERBOSE, _("Downloading %d pieces from %d mirrors.\n"),
+             npieces - job.done, nurls);
+  if (opt.show_progress)
+    job.progress = progress_create (name, have_size, size);
+  job.timer = ptimer_new ();
+
+  while (job.done < npieces && job.err == RETROK)
+    {
+      int n = 0, run;
+      double wait;
+
+      for (i = 0; i < job.nconns; i++)
+        if (job.conns[i].piece < 0)
+          piece_assign (&job, &job.conns[i], size, piece_size);
+
+      /* The mirrors whose rate limit has them wait are not watched,
+         so that they don't hold up the others.  */
+      wait = 0;
+      for (i = 0; i < job.nconns; i++)
+        if (job.conns[i].piece >= 0)
+          {
+            struct piece_conn *c = &job.conns[i];
+            double delay = throttle_delay (job.sources[c->source].url->host);
+            if (delay > 0)
+              {
+                fd_unwatch (c->seg.sock);
+                wait = wait > 0 ? MIN (wait, delay) : delay;
+              }
+            else
+              {
+                fd_watch (c->seg.sock, c->seg.wait_for, piece_readable, &job);
+                n++;
+              }
+          }
+      if (!n && wait > 0)
+        {
+          xsleep (wait);
+          continue;
+        }
+      if (!n)
+        {
+          for (live = i = 0; i < nurls; i++)
+            live += !job.sources[i].dropped;
+          if (live)
+            /* Failed requests may have been requeued; try again.  */
+            continue;
+          logputs (LOG_NOTQUIET, _("No usable mirrors left.\n"));
+          job.err = METALINK_RETR_ERROR;
+          break;
+        }
+
+      run = fd_dispatch (wait > 0 ? MIN (wait, 0.95) : 0.95);
+      if (run < 0)
+        job.err = METALINK_RETR_ERROR;
+      else if (run == 0)
+        {
+          double now = ptimer_measure (job.timer);
+          if (opt.read_timeout && now - job.last_read_tm >= opt.read_timeout)
+            {
+              /* Blame the mirrors that kept us waiting.  */
+              for (i = 0; i < job.nconns; i++)
+                if (job.conns[i].piece >= 0)
+                  piece_fail (&job, &job.conns[i]);
+              job.last_read_tm = now;
+            }
+          else if (job.progress)
+            {
+              pieces_show_progress (&job);
+              progress_update (job.progress, 0, now);
+            }
+        }
+    }
+
+  err = job.err;
+  if (err == RETROK && fseeko (fp, size, SEEK_SET) != 0)
+    err = FWRITEERR;
+
+  if (job.progress)
+    progress_finish (job.progress, ptimer_read (job.timer));
+  ptimer_destroy (job.timer);
+
+  for (i = 0; i < job.nconns; i++)
+    {
+      if (job.conns[i].seg.sock >= 0)
+        CLOSE_INVALIDATE (job.conns[i].seg.sock);
+      xfree (job.conns[i].buf);
+    }
+  for (i = 0; i < nurls; i++)
+    request_free (&job.sources[i].req);
+  xfree (job.conns);
+  xfree (job.sources);
+  xfree (job.state);
+
+  return err;
+}
+
+#ifdef HAVE_COMPRESSION
+/* The Accept-Encoding value for opt.compression: the one coding that
+   was asked for, or with "auto" every coding fd_read_body can
+   decode.  */
+
+static const char *
+accept_encoding (void)
+{
+  switch (opt.compression)
+    {
+    case compression_gzip:
+      return "gzip";
+    case compression_brotli:
+      return "br";
+    case compression_zstd:
+      return "zstd";
+    default:
+      return ""
+#ifdef HAVE_LIBZSTD
+        "zstd, "
+#endif
+#ifdef HAVE_LIBBROTLIDEC
+        "br, "
+#endif
+#ifdef HAVE_LIBZ
+        "gzip, "
+#endif
+        "identity";
+    }
+}
+#endif /* HAVE_COMPRESSION */
+
+static struct request *
+initialize_request (const struct url *u, struct http_stat *hs, int *dt, struct url *proxy,
+                    bool inhibit_keep_alive, bool *basic_auth_finished,
+                    wgint *body_data_size, char **user, char **passwd, uerr_t *ret)
+{
+  bool head_only = !!(*dt & HEAD_ONLY);
+  struct request *req;
+
+  /* Prepare the request to send. */
+  {
+    char *meth_arg;
+    const char *meth = "GET";
+    if (head_only)
+      meth = "HEAD";
+    else if (opt.method)
+      meth = opt.method;
+    /* Use the full path, i.e. one that includes the leading slash and
+       the query string.  E.g. if u->path is "foo/bar" and u->query is
+       "param=value", full_path will be "/foo/bar?param=value".  */
+    if (proxy
+#ifdef HAVE_SSL
+        /* When using SSL over proxy, CONNECT establishes a direct
+           connection to the HTTPS server.  Therefore use the same
+           argument as when talking to the server directly. */
+        && u->scheme != SCHEME_HTTPS
+#endif
+        )
+      meth_arg = xstrdup (u->url);
+    else
+      meth_arg = url_full_path (u);
+    req = request_new (meth, meth_arg);
+  }
+
+  request_set_host (req, u);
+
+  request_set_header (req, "Referer", hs->referer, rel_none);
+  if (*dt & SEND_NOCACHE)
+    {
+      /* Cache-Control MUST be obeyed by all HTTP/1.1 caching mechanisms...  */
+      request_set_header (req, "Cache-Control", "no-cache", rel_none);
+
+      /* ... but some HTTP/1.0 caches doesn't implement Cache-Control.  */
+      request_set_header (req, "Pragma", "no-cache", rel_none);
+    }
+  if (*dt & IF_MODIFIED_SINCE && hs->cond_etag)
+    request_set_header (req, "If-None-Match", hs->cond_etag, rel_none);
+  if (*dt & IF_MODIFIED_SINCE && hs->cond_last_modified)
+    request_set_header (req, "If-Modified-Since", hs->cond_last_modified,
+                        rel_none);
+  else if (*dt & IF_MODIFIED_SINCE && !hs->cond_etag)
+    {
+      char strtime[32];
+      uerr_t err = time_to_rfc1123 (hs->orig_file_tstamp, strtime, countof (strtime));
+
+      if (err != RETROK)
+        {
+          logputs (LOG_VERBOSE, _("Cannot convert timestamp to http format. "
+                                  "Falling back to time 0 as last modification "
+                                  "time.\n"));
+          strcpy (strtime, "Thu, 01 Jan 1970 00:00:00 GMT");
+        }
+      request_set_header (req, "If-Modified-Since", xstrdup (strtime), rel_value);
+    }
+  if (hs->restval)
+    request_set_header (req, "Range",
+                        aprintf ("bytes=%s-",
+                                 number_to_static_string (hs->restval)),
+                        rel_value);
+  SET_USER_AGENT (req);
+  request_set_header (req, "Accept", "*/*", rel_none);
+#ifdef HAVE_COMPRESSION
+  if (opt.compression != compression_none)
+    request_set_header (req, "Accept-Encoding", accept_encoding (), rel_none);
+  else
+#endif
+    request_set_header (req, "Accept-Encoding", "identity", rel_none);
+
+  /* Find the username with priority */
+  if (u->user)
+    *user = u->user;
   else if (opt.user && (opt.use_askpass || opt.ask_passwd))
     *user = opt.user;
   else if (opt.http_user)
@@ -1977,6 +3873,12 @@ initialize_request (const struct url *u, struct http_stat *hs, int *dt, struct u
        * challenge, we'll go ahead and send Basic authentication creds. */
       *basic_auth_finished = maybe_send_basic_creds (u->host, *user, *passwd, req);
     }
+#ifdef ENABLE_DIGEST
+  /* Likewise with a Digest challenge answered before: the nonce is
+     answered again rather than a new one asked for.  */
+  if (*user && *passwd && !*basic_auth_finished)
+    maybe_send_digest_creds (u, *user, *passwd, req);
+#endif
 
   if (inhibit_keep_alive)
     request_set_header (req, "Connection", "Close", rel_none);
@@ -2053,1610 +3955,3163 @@ initialize_proxy_configuration (const struct url *u, struct request *req,
     request_set_header (req, "Proxy-Authorization", *proxyauth, rel_value);
 }
 
-static uerr_t
-establish_connection (const struct url *u, const struct url **conn_ref,
-                      struct http_stat *hs, struct url *proxy,
-                      char **proxyauth,
-                      struct request **req_ref, bool *using_ssl,
-                      bool inhibit_keep_alive,
-                      int *sock_ref)
-{
-  bool host_lookup_failed = false;
-  int sock = *sock_ref;
-  struct request *req = *req_ref;
-  const struct url *conn = *conn_ref;
-  struct response *resp;
-  int write_error;
-  int statcode;
-
-  if (! inhibit_keep_alive)
-    {
-      /* Look for a persistent connection to target host, unless a
-         proxy is used.  The exception is when SSL is in use, in which
-         case the proxy is nothing but a passthrough to the target
-         host, registered as a connection to the latter.  */
-      const struct url *relevant = conn;
-#ifdef HAVE_SSL
-      if (u->scheme == SCHEME_HTTPS)
-        relevant = u;
-#endif
+/* Add the Cookie header for U and the headers given with --header
+   to REQ.  */
 
-      if (persistent_available_p (relevant->host, relevant->port,
+static void
+request_add_session_headers (struct request *req, const struct url *u)
+{
+  if (opt.cookies)
+    request_set_header (req, "Cookie",
+                        cookie_header (wget_cookie_jar,
+                                       u->host, u->port, u->path,
 #ifdef HAVE_SSL
-                                  relevant->scheme == SCHEME_HTTPS,
+                                       u->scheme == SCHEME_HTTPS
 #else
-                                  0,
-#endif
-                                  &host_lookup_failed))
-        {
-          int family = socket_family (pconn.socket, ENDPOINT_PEER);
-          sock = pconn.socket;
-          *using_ssl = pconn.ssl;
-#if ENABLE_IPV6
-          if (family == AF_INET6)
-             logprintf (LOG_VERBOSE, _("Reusing existing connection to [%s]:%d.\n"),
-                        quotearg_style (escape_quoting_style, pconn.host),
-                         pconn.port);
-          else
+                                       0
 #endif
-             logprintf (LOG_VERBOSE, _("Reusing existing connection to %s:%d.\n"),
-                        quotearg_style (escape_quoting_style, pconn.host),
-                        pconn.port);
-          DEBUGP (("Reusing fd %d.\n", sock));
-          if (pconn.authorized)
-            /* If the connection is already authorized, the "Basic"
-               authorization added by code above is unnecessary and
-               only hurts us.  */
-            request_remove_header (req, "Authorization");
-        }
-      else if (host_lookup_failed)
-        {
-          logprintf(LOG_NOTQUIET,
-                    _("%s: unable to resolve host address %s\n"),
-                    exec_name, quote (relevant->host));
-          return HOSTERR;
-        }
-      else if (sock != -1)
-        {
-          sock = -1;
-        }
-    }
+                                       ),
+                        rel_value);
 
-  if (sock < 0)
+  /* Add the user headers. */
+  if (opt.user_headers)
     {
-      sock = connect_to_host (conn->host, conn->port);
-      if (sock == E_HOST)
-        return HOSTERR;
-      else if (sock < 0)
-        return (retryable_socket_connect_error (errno)
-                ? CONERROR : CONIMPOSSIBLE);
+      int i;
+      for (i = 0; opt.user_headers[i]; i++)
+        request_set_user_header (req, opt.user_headers[i]);
+    }
+}
 
-#ifdef HAVE_SSL
-      if (proxy && u->scheme == SCHEME_HTTPS)
-        {
-          char *head;
-          char *message;
-          /* When requesting SSL URLs through proxies, use the
-             CONNECT method to request passthrough.  */
-          struct request *connreq = request_new ("CONNECT",
-                              aprintf ("%s:%d", u->host, u->port));
-          SET_USER_AGENT (connreq);
-          if (proxyauth)
-            {
-              request_set_header (connreq, "Proxy-Authorization",
-                                  *proxyauth, rel_value);
-              /* Now that PROXYAUTH is part of the CONNECT request,
-                 zero it out so we don't send proxy authorization with
-                 the regular request below.  */
-              *proxyauth = NULL;
-            }
-          request_set_header (connreq, "Host",
-                              aprintf ("%s:%d", u->host, u->port),
-                              rel_value);
+/* Remember U, to be retrieved with REFERER, as one of the URLs the
+   recursion will retrieve next.  Hints are given in the order of
+   retrieval and remain until http_pipeline_hints_clear is called.  */
 
-          write_error = request_send (connreq, sock, 0);
-          request_free (&connreq);
-          if (write_error < 0)
-            {
-              CLOSE_INVALIDATE (sock);
-              return WRITEFAILED;
-            }
+void
+http_pipeline_hint (struct url *u, const char *referer)
+{
+  struct pipeline_hint *hint;
 
-          head = read_http_response_head (sock);
-          if (!head)
-            {
-              logprintf (LOG_VERBOSE, _("Failed reading proxy response: %s\n"),
-                         fd_errstr (sock));
-              CLOSE_INVALIDATE (sock);
-              return HERR;
-            }
-          message = NULL;
-          if (!*head)
-            {
-              xfree (head);
-              goto failed_tunnel;
-            }
-          DEBUGP (("proxy responded with: [%s]\n", head));
+  if (pipeline_hint_count == PIPELINE_MAX)
+    return;
+  hint = &pipeline_hints[pipeline_hint_count++];
+  hint->url = url_dup (u);
+  hint->referer = referer ? xstrdup (referer) : NULL;
+}
 
-          resp = resp_new (head);
-          statcode = resp_status (resp, &message);
-          if (statcode < 0)
-            {
-              char *tms = datetime_str (time (NULL));
-              logprintf (LOG_VERBOSE, "%d\n", statcode);
-              logprintf (LOG_NOTQUIET, _("%s ERROR %d: %s.\n"), tms, statcode,
-                         quotearg_style (escape_quoting_style,
-                                         _("Malformed status line")));
-              xfree (head);
-              return HERR;
-            }
-          xfree (hs->message);
-          hs->message = xstrdup (message);
-          resp_free (&resp);
-          xfree (head);
-          if (statcode != 200)
-            {
-            failed_tunnel:
-              logprintf (LOG_NOTQUIET, _("Proxy tunneling failed: %s"),
-                         message ? quotearg_style (escape_quoting_style, message) : "?");
-              xfree (message);
-              return CONSSLERR;
-            }
-          xfree (message);
+/* Forget the URLs given to http_pipeline_hint. */
 
-          /* SOCK is now *really* connected to u->host, so update CONN
-             to reflect this.  That way register_persistent will
-             register SOCK as being connected to u->host:u->port.  */
-          conn = u;
-        }
+void
+http_pipeline_hints_clear (void)
+{
+  int i;
 
-      if (conn->scheme == SCHEME_HTTPS)
-        {
-          if (!ssl_connect_wget (sock, u->host, NULL))
-            {
-              CLOSE_INVALIDATE (sock);
-              return CONSSLERR;
-            }
-          else if (!ssl_check_certificate (sock, u->host))
-            {
-              CLOSE_INVALIDATE (sock);
-              return VERIFCERTERR;
-            }
-          *using_ssl = true;
-        }
-#endif /* HAVE_SSL */
+  for (i = 0; i < pipeline_hint_count; i++)
+    {
+      url_free (pipeline_hints[i].url);
+      xfree (pipeline_hints[i].referer);
     }
-  *conn_ref = conn;
-  *req_ref = req;
-  *sock_ref = sock;
-  return RETROK;
+  pipeline_hint_count = 0;
 }
 
-static uerr_t
-set_file_timestamp (struct http_stat *hs)
+/* Return true if the requests for the hinted URLs may be sent along
+   with REQ, before their URLs come up.  */
+
+static bool
+send_ahead_p (const struct request *req)
 {
-  bool local_dot_orig_file_exists = false;
-  char *local_filename = NULL;
-  struct stat st;
-  char buf[1024];
+  if (!pipeline_hint_count)
+    return false;
+  if (strcmp (req->method, "GET") != 0
+      || opt.method || opt.body_data || opt.body_file)
+    return false;
+  /* These make the requests depend on the state of the local files,
+     which is only known when the URL comes up.  */
+  if (opt.timestamping || opt.always_rest || opt.start_pos >= 0
+      || opt.spider || opt.warc_filename)
+    return false;
+  /* Likewise with the HTTP cache, which may answer them.  */
+  if (opt.http_cache)
+    return false;
+  return true;
+}
 
-  if (opt.backup_converted)
-    /* If -K is specified, we'll act on the assumption that it was specified
-        last time these files were downloaded as well, and instead of just
-        comparing local file X against server file X, we'll compare local
-        file X.orig (if extant, else X) against server file X.  If -K
-        _wasn't_ specified last time, or the server contains files called
-        *.orig, -N will be back to not operating correctly with -k. */
-    {
-      size_t filename_len = strlen (hs->local_file);
-      char *filename_plus_orig_suffix;
+/* Return true if requests may be sent ahead of REQ, a request for U
+   just sent on SOCK.  */
 
-      if (filename_len + sizeof (ORIG_SFX) > sizeof (buf))
-        filename_plus_orig_suffix = xmalloc (filename_len + sizeof (ORIG_SFX));
-      else
-        filename_plus_orig_suffix = buf;
+static bool
+pipeline_allowed_p (const struct url *u, const struct url *proxy,
+                    const struct request *req, int sock)
+{
+  if (opt.pipeline <= 0 || !send_ahead_p (req))
+    return false;
+  /* Only a connection the server has already kept open once is
+     trusted with requests in flight.  */
+  if (!pconn_active || pconn.socket != sock || proxy)
+    return false;
+  if (pipeline_refused_hosts
+      && string_set_contains (pipeline_refused_hosts, u->host))
+    return false;
+  return true;
+}
 
-      /* Would a single s[n]printf() call be faster?  --dan
+/* Build the request for the hinted URL of HINT the way gethttp would
+   build it for a first attempt.  */
 
-          Definitely not.  sprintf() is horribly slow.  It's a
-          different question whether the difference between the two
-          affects a program.  Usually I'd say "no", but at one
-          point I profiled Wget, and found that a measurable and
-          non-negligible amount of time was lost calling sprintf()
-          in url.c.  Replacing sprintf with inline calls to
-          strcpy() and number_to_string() made a difference.
-          --hniksic */
-      memcpy (filename_plus_orig_suffix, hs->local_file, filename_len);
-      memcpy (filename_plus_orig_suffix + filename_len,
-              ORIG_SFX, sizeof (ORIG_SFX));
+static struct request *
+hint_request (const struct pipeline_hint *hint)
+{
+  struct http_stat hs;
+  struct request *req;
+  char *user, *passwd;
+  bool basic_auth_finished = false;
+  wgint body_data_size = 0;
+  uerr_t ret;
+  int dt;
+
+  xzero (hs);
+  hs.referer = hint->referer ? hint->referer : opt.referer;
+  dt = opt.allow_cache ? 0 : SEND_NOCACHE;
+  req = initialize_request (hint->url, &hs, &dt, NULL, false,
+                            &basic_auth_finished, &body_data_size,
+                            &user, &passwd, &ret);
+  if (req)
+    request_add_session_headers (req, hint->url);
+  return req;
+}
 
-      /* Try to stat() the .orig file. */
-      if (stat (filename_plus_orig_suffix, &st) == 0)
-        {
-          local_dot_orig_file_exists = true;
-          local_filename = filename_plus_orig_suffix;
-        }
-    }
+/* Write the requests for up to opt.pipeline of the hinted URLs on the
+   same host as U to SOCK, the active persistent connection.  The
+   requests are written at once: a server that handles pipelining
+   badly then typically answers only the first of them and drops the
+   rest, which pipeline_response_arrives detects.  A server can't be
+   relied upon to drop the requests consistently if more arrive while
+   it answers, which is why the pipeline is only refilled once it is
+   empty.  */
 
-  if (!local_dot_orig_file_exists)
-    /* Couldn't stat() <file>.orig, so try to stat() <file>. */
-    if (stat (hs->local_file, &st) == 0)
-      {
-        if (local_filename != buf)
-          xfree (local_filename);
-        local_filename = hs->local_file;
-      }
+static void
+pipeline_send_ahead (const struct url *u, int sock)
+{
+  int depth = MIN (opt.pipeline, PIPELINE_MAX);
+  char *batch = NULL;
+  int batch_size = 0;
+  int i;
 
-  if (local_filename != NULL)
-    /* There was a local file, so we'll check later to see if the version
-        the server has is the same version we already have, allowing us to
-        skip a download. */
+  if (pipeline_count)
+    return;
+
+  for (i = 0; i < pipeline_hint_count && pipeline_count < depth; i++)
     {
-      if (local_filename == buf || local_filename == hs->local_file)
-        hs->orig_file_name = xstrdup (local_filename); // on stack or a copy, make a heap copy
-      else
-        hs->orig_file_name = local_filename; // was previously malloc'ed
-      hs->orig_file_size = st.st_size;
-      hs->orig_file_tstamp = st.st_mtime;
-#ifdef WINDOWS
-      /* Modification time granularity is 2 seconds for Windows (FAT drives),
-         so increase local time by 1 second for later comparison. */
-      /* Timestamps on FAT drives (<= FAT32) always end with an even number of seconds:
-         https://en.wikipedia.org/wiki/File_Allocation_Table
-         Floppy, USB drive etc. NTFS has no limit on this. */
-      ++hs->orig_file_tstamp;
-#endif
-      hs->timestamp_checked = true;
+      struct url *hu = pipeline_hints[i].url;
+      struct request *req;
+      char *text;
+      int size;
+
+      if (hu->scheme != u->scheme || hu->port != u->port
+          || !URL_SAME_HOST (hu, u)
+          || 0 == strcmp (hu->url, u->url))
+        continue;
+
+      req = hint_request (&pipeline_hints[i]);
+      if (!req)
+        continue;
+      text = request_format (req, &size);
+      request_free (&req);
+
+      DEBUGP (("\n---pipelined request begin---\n%s---request end---\n",
+               text));
+      batch = xrealloc (batch, batch_size + size);
+      memcpy (batch + batch_size, text, size);
+      batch_size += size;
+
+      pipeline[pipeline_count].url = xstrdup (hu->url);
+      pipeline[pipeline_count].text = text;
+      ++pipeline_count;
     }
 
-  return RETROK;
+  /* If the write fails, the connection is found broken when the first
+     response is read.  */
+  if (batch_size)
+    fd_write (sock, batch, batch_size, -1);
+  xfree (batch);
 }
 
-static uerr_t
-check_file_output (const struct url *u, struct http_stat *hs,
-                   struct response *resp, char *hdrval, size_t hdrsize)
+/* Return true if REQ, the request for U, was already sent ahead on
+   the active persistent connection, in which case it is removed from
+   the pipeline and its response is the next one to read.  Otherwise,
+   the connection is closed if requests are in flight on it.  */
+
+static bool
+pipeline_take (const struct url *u, const struct request *req)
 {
-  /* Determine the local filename if needed. Notice that if -O is used
-   * hstat.local_file is set by http_loop to the argument of -O. */
-  if (!hs->local_file)
-    {
-      char *file_disposition = NULL;
-      char *str_u, *url_enc;
+  char *text;
+  int size;
+  bool match;
 
-      /* Honor Content-Disposition whether possible. */
-      if (!opt.content_disposition
-          || !resp_header_copy (resp, "Content-Disposition",
-                                hdrval, hdrsize)
-          || !parse_content_disposition (hdrval, &file_disposition))
-        {
-          /* The Content-Disposition header is missing or broken.
-           * Choose unique file name according to given URL. */
-          str_u = url_file_name (u, NULL);
-        }
-      else
-        {
-          DEBUGP (("Parsed filename from Content-Disposition: %s\n",
-                  file_disposition));
-          str_u = url_file_name (u, file_disposition);
-        }
+  if (!pipeline_count)
+    return false;
 
-      url_enc = u->enc_type == ENC_IRI ? "UTF-8" : u->ori_enc;
-      if (strcasecmp (url_enc, opt.locale))
-        {
-          hs->local_file = convert_fname (str_u, url_enc, opt.locale);
-          xfree (str_u);
-        }
-      else
-        hs->local_file = str_u;
-
-      xfree (file_disposition);
-    }
+  text = request_format (req, &size);
+  match = (0 == strcmp (pipeline[0].url, u->url)
+           && 0 == strcmp (pipeline[0].text, text));
+  xfree (text);
 
-  hs->temporary = opt.delete_after || opt.spider || !acceptable (hs->local_file);
-  if (hs->temporary)
+  if (!match)
     {
-      char *tmp = aprintf ("%s.tmp", hs->local_file);
-      xfree (hs->local_file);
-      hs->local_file = tmp;
+      DEBUGP (("Request for %s was not sent ahead as needed; "
+               "dropping %d pipelined requests.\n",
+               u->url, pipeline_count));
+      invalidate_persistent ();
+      return false;
     }
 
-  /* TODO: perform this check only once. */
-  if (!hs->existence_checked && file_exists_p (hs->local_file, NULL))
+  xfree (pipeline[0].url);
+  xfree (pipeline[0].text);
+  --pipeline_count;
+  memmove (pipeline, pipeline + 1, pipeline_count * sizeof (pipeline[0]));
+  xzero (pipeline[pipeline_count]);
+  return true;
+}
+
+/* Wait for the response to a pipelined request to start arriving on
+   SOCK and return true if it does.  Servers that mishandle pipelining
+   usually just drop the requests sent ahead, and would otherwise be
+   waited on for the whole read timeout.  */
+
+static bool
+pipeline_response_arrives (int sock)
+{
+  double timeout = PIPELINE_TIMEOUT;
+  char c;
+
+  if (opt.read_timeout && opt.read_timeout < timeout)
+    timeout = opt.read_timeout;
+  return fd_peek (sock, &c, 1, timeout) > 0;
+}
+
+/* Note that the server for HOST failed to answer a pipelined
+   request, so that requests to it are sent one at a time from now
+   on.  */
+
+static void
+pipeline_refused (const char *host)
+{
+  logprintf (LOG_NOTQUIET,
+             _("Pipelined request to %s failed; "
+               "sending requests one at a time.\n"),
+             quotearg_style (escape_quoting_style, host));
+  if (!pipeline_refused_hosts)
+    pipeline_refused_hosts = make_string_hash_table (0);
+  string_set_add (pipeline_refused_hosts, host);
+}
+
+#if defined HAVE_NGHTTP2 || defined HAVE_HTTP3
+/* Headers that are specific to an HTTP/1.1 connection and must not be
+   sent over HTTP/2 or HTTP/3.  */
+static const char *const http2_skipped_headers[] = {
+  "Host", "Connection", "Keep-Alive", "Proxy-Connection",
+  "Transfer-Encoding", "Upgrade", "TE"
+};
+
+/* The header fields of a request as sent over HTTP/2 and HTTP/3, and
+   the strings allocated for them.  */
+struct request_fields {
+  struct http2_header *headers;
+  int count;
+  char **allocated;
+  int allocated_count;
+};
+
+/* Fill F with the header fields of REQ, the request for U, pseudo-header
+   fields first.  The header names are lowercased, and the Cookie header
+   is split into its crumbs, which compress better.  */
+
+static void
+request_fields_build (struct request_fields *f, const struct request *req,
+                      const struct url *u)
+{
+  struct http2_header *headers;
+  char **allocated;
+  int count = 0, allocated_count = 0, size;
+  int i;
+  const char *p;
+
+  /* The four pseudo-headers, and room for splitting any header at its
+     semicolons.  */
+  size = 4 + req->hcount;
+  for (i = 0; i < req->hcount; i++)
+    for (p = req->headers[i].value; *p; p++)
+      size += *p == ';';
+  headers = xnew_array (struct http2_header, size);
+  allocated = xnew_array (char *, size);
+
+  headers[count].name = ":method", headers[count++].value = req->method;
+  headers[count].name = ":scheme", headers[count++].value = "https";
+  headers[count].name = ":authority", headers[count++].value = u->host;
+  headers[count].name = ":path", headers[count++].value = req->arg;
+
+  for (i = 0; i < req->hcount; i++)
     {
-      if (opt.noclobber && !opt.output_document)
-        {
-          /* If opt.noclobber is turned on and file already exists, do not
-             retrieve the file. But if the output_document was given, then this
-             test was already done and the file didn't exist. Hence the !opt.output_document */
-          return RETRUNNEEDED;
-        }
-      else if (!ALLOW_CLOBBER)
+      const struct request_header *hdr = &req->headers[i];
+      char *name;
+      size_t j;
+
+      if (0 == c_strcasecmp (hdr->name, "Host"))
+        headers[2].value = hdr->value;
+      for (j = 0; j < countof (http2_skipped_headers); j++)
+        if (0 == c_strcasecmp (hdr->name, http2_skipped_headers[j]))
+          break;
+      if (j < countof (http2_skipped_headers))
+        continue;
+
+      name = allocated[allocated_count++] = xstrdup (hdr->name);
+      for (j = 0; name[j]; j++)
+        name[j] = c_tolower (name[j]);
+
+      if (0 == strcmp (name, "cookie"))
         {
-          char *unique = unique_name_passthrough (hs->local_file);
-          if (unique != hs->local_file)
-            xfree (hs->local_file);
-          hs->local_file = unique;
+          p = hdr->value;
+          while (*p)
+            {
+              const char *end = strchr (p, ';');
+              char *crumb;
+              if (!end)
+                end = p + strlen (p);
+              crumb = allocated[allocated_count++] = strdupdelim (p, end);
+              headers[count].name = name, headers[count++].value = crumb;
+              p = end;
+              while (*p == ';' || *p == ' ')
+                ++p;
+            }
+          continue;
         }
-    }
-  hs->existence_checked = true;
 
-  /* Support timestamping */
-  if (opt.timestamping && !hs->timestamp_checked)
-    {
-      uerr_t timestamp_err = set_file_timestamp (hs);
-      if (timestamp_err != RETROK)
-        return timestamp_err;
+      headers[count].name = name, headers[count++].value = hdr->value;
     }
-  return RETROK;
+
+  f->headers = headers;
+  f->count = count;
+  f->allocated = allocated;
+  f->allocated_count = allocated_count;
 }
 
-static uerr_t
-check_auth (const struct url *u, char *user, char *passwd, struct response *resp,
-            struct request *req, bool *ntlm_seen_ref, bool *retry,
-            bool *basic_auth_finished_ref, bool *auth_finished_ref)
+static void
+request_fields_free (struct request_fields *f)
 {
-  uerr_t auth_err = RETROK;
-  bool basic_auth_finished = *basic_auth_finished_ref;
-  bool auth_finished = *auth_finished_ref;
-  bool ntlm_seen = *ntlm_seen_ref;
-  char buf[256], *tmp = NULL;
-
-  *retry = false;
+  int i;
 
-  if (!auth_finished && (user && passwd))
-    {
-      /* IIS sends multiple copies of WWW-Authenticate, one with
-         the value "negotiate", and other(s) with data.  Loop over
-         all the occurrences and pick the one we recognize.  */
-      int wapos;
-      const char *www_authenticate = NULL;
-      const char *wabeg, *waend;
-      const char *digest = NULL, *basic = NULL, *ntlm = NULL;
+  for (i = 0; i < f->allocated_count; i++)
+    xfree (f->allocated[i]);
+  xfree (f->allocated);
+  xfree (f->headers);
+}
+#endif /* HAVE_NGHTTP2 || HAVE_HTTP3 */
 
-      for (wapos = 0; !ntlm
-             && (wapos = resp_header_locate (resp, "WWW-Authenticate", wapos,
-                                             &wabeg, &waend)) != -1;
-           ++wapos)
-        {
-          param_token name, value;
-          size_t len = waend - wabeg;
+#ifdef HAVE_NGHTTP2
+/* How many of the hinted URLs to request ahead on an HTTP/2 session
+   when --pipeline doesn't say.  */
+#define HTTP2_AHEAD 8
 
-          if (tmp != buf)
-            xfree (tmp);
+/* The streams opened ahead of time on HTTP/2 sessions.  */
+static struct pipelined_request http2_ahead[PIPELINE_MAX];
+static int http2_ahead_count;
 
-          if (len < sizeof (buf))
-            tmp = buf;
-          else
-            tmp = xmalloc (len + 1);
+/* Return true if the request for U may be sent over HTTP/2.  Requests
+   with a body are left to HTTP/1.1, as are proxied ones and those
+   recorded to WARC files, whose request records hold what was sent on
+   the wire.  */
 
-          memcpy (tmp, wabeg, len);
-          tmp[len] = 0;
+static bool
+http2_allowed_p (const struct url *u, const struct url *proxy,
+                 bool inhibit_keep_alive)
+{
+  return (opt.http2 && u->scheme == SCHEME_HTTPS && !proxy
+          && !inhibit_keep_alive && !opt.body_data && !opt.body_file
+          && !opt.warc_filename);
+}
 
-          www_authenticate = tmp;
+/* Send REQ, the request for U, on the HTTP/2 session of SOCK, and
+   return the descriptor of its stream, or -1 on failure.  */
 
-          for (;!ntlm;)
-            {
-              /* extract the auth-scheme */
-              while (c_isspace (*www_authenticate)) www_authenticate++;
-              name.e = name.b = www_authenticate;
-              while (*name.e && !c_isspace (*name.e)) name.e++;
+static int
+request_send_http2 (const struct request *req, const struct url *u, int sock)
+{
+  struct request_fields f;
+  int fd;
 
-              if (name.b == name.e)
-                break;
+  if (opt.debug)
+    {
+      int size;
+      char *text = request_format (req, &size);
+      DEBUGP (("\n---HTTP/2 request begin---\n%s---request end---\n",
+               text));
+      xfree (text);
+    }
 
-              DEBUGP (("Auth scheme found '%.*s'\n", (int) (name.e - name.b), name.b));
+  request_fields_build (&f, req, u);
+  fd = http2_open_stream (sock, f.headers, f.count);
+  request_fields_free (&f);
+  return fd;
+}
 
-              if (known_authentication_scheme_p (name.b, name.e))
-                {
-                  if (BEGINS_WITH (name.b, "NTLM"))
-                    {
-                      ntlm = name.b;
-                      break; /* this is the most secure challenge, stop here */
-                    }
-                  else if (!digest && BEGINS_WITH (name.b, "Digest"))
-                    digest = name.b;
-                  else if (!basic && BEGINS_WITH (name.b, "Basic"))
-                    basic = name.b;
-                }
+/* Forget the stream opened ahead of time at index I, cancelling it
+   unless it was taken.  */
 
-              /* now advance over the auth-params */
-              www_authenticate = name.e;
-              DEBUGP (("Auth param list '%s'\n", www_authenticate));
-              while (extract_param (&www_authenticate, &name, &value, ',', NULL) && name.b && value.b)
-                {
-                  DEBUGP (("Auth param %.*s=%.*s\n",
-                           (int) (name.e - name.b), name.b, (int) (value.e - value.b), value.b));
-                }
-            }
-        }
+static void
+http2_ahead_drop (int i)
+{
+  if (http2_ahead[i].stream >= 0)
+    fd_close (http2_ahead[i].stream);
+  xfree (http2_ahead[i].url);
+  xfree (http2_ahead[i].text);
+  --http2_ahead_count;
+  memmove (http2_ahead + i, http2_ahead + i + 1,
+           (http2_ahead_count - i) * sizeof (http2_ahead[0]));
+  xzero (http2_ahead[http2_ahead_count]);
+}
 
-      if (!basic && !digest && !ntlm)
-        {
-          /* If the authentication header is missing or
-             unrecognized, there's no sense in retrying.  */
-          logputs (LOG_NOTQUIET, _("Unknown authentication scheme.\n"));
-        }
-      else if (!basic_auth_finished
-               || !basic)
-        {
-          char *pth = url_full_path (u);
-          const char *value;
-          uerr_t *auth_stat;
-          auth_stat = xmalloc (sizeof (uerr_t));
-          *auth_stat = RETROK;
+/* Return the descriptor of the stream opened ahead of time for REQ,
+   the request for U, or -1 if there is none.  A stream opened for U
+   with a different request is cancelled.  */
 
-          if (ntlm)
-            www_authenticate = ntlm;
-          else if (digest)
-            www_authenticate = digest;
-          else
-            www_authenticate = basic;
+static int
+http2_take (const struct url *u, const struct request *req)
+{
+  int i, fd = -1;
 
-          logprintf (LOG_NOTQUIET, _("Authentication selected: %s\n"), www_authenticate);
+  for (i = 0; i < http2_ahead_count; i++)
+    if (0 == strcmp (http2_ahead[i].url, u->url))
+      break;
+  if (i == http2_ahead_count)
+    return -1;
 
-          value =  create_authorization_line (www_authenticate,
-                                              user, passwd,
-                                              request_method (req),
-                                              pth,
-                                              &auth_finished,
-                                              auth_stat);
+  {
+    int size;
+    char *text = request_format (req, &size);
+    if (0 == strcmp (http2_ahead[i].text, text))
+      {
+        fd = http2_ahead[i].stream;
+        http2_ahead[i].stream = -1;
+      }
+    xfree (text);
+  }
+  http2_ahead_drop (i);
+  return fd;
+}
 
-          auth_err = *auth_stat;
-          xfree (auth_stat);
-          xfree (pth);
-          if (auth_err == RETROK)
-            {
-              request_set_header (req, "Authorization", value, rel_value);
+/* Open streams for the hinted URLs on the same host as U on the
+   HTTP/2 session of SOCK, so that their responses come in while that
+   for U is read.  Unlike with pipelining, the responses may arrive in
+   any order and a stream that isn't needed after all is simply
+   cancelled.  */
 
-              if (BEGINS_WITH (www_authenticate, "NTLM"))
-                ntlm_seen = true;
-              else if (!u->user && BEGINS_WITH (www_authenticate, "Basic"))
-                {
-                  /* Need to register this host as using basic auth,
-                   * so we automatically send creds next time. */
-                  register_basic_auth_host (u->host);
-                }
+static void
+http2_send_ahead (const struct url *u, int sock)
+{
+  int depth = MIN (opt.pipeline > 0 ? opt.pipeline : HTTP2_AHEAD,
+                   PIPELINE_MAX);
+  int i, j;
 
-              *retry = true;
-              goto cleanup;
-            }
-          else
-            {
-              /* Creating the Authorization header went wrong */
-              xfree (value);
-            }
-        }
+  /* Cancel the streams for URLs that are no longer going to be
+     retrieved next.  */
+  for (i = 0; i < http2_ahead_count; )
+    {
+      for (j = 0; j < pipeline_hint_count; j++)
+        if (0 == strcmp (pipeline_hints[j].url->url, http2_ahead[i].url))
+          break;
+      if (j == pipeline_hint_count)
+        http2_ahead_drop (i);
       else
+        i++;
+    }
+
+  for (i = 0; i < pipeline_hint_count && http2_ahead_count < depth; i++)
+    {
+      struct url *hu = pipeline_hints[i].url;
+      struct request *req;
+      int fd, size;
+
+      if (hu->scheme != u->scheme || hu->port != u->port
+          || !URL_SAME_HOST (hu, u)
+          || 0 == strcmp (hu->url, u->url))
+        continue;
+      for (j = 0; j < http2_ahead_count; j++)
+        if (0 == strcmp (http2_ahead[j].url, hu->url))
+          break;
+      if (j < http2_ahead_count)
+        continue;
+
+      req = hint_request (&pipeline_hints[i]);
+      if (!req)
+        continue;
+      fd = request_send_http2 (req, hu, sock);
+      if (fd < 0)
         {
-          /* We already did Basic auth, and it failed. Gotta
-           * give up. */
+          request_free (&req);
+          break;
         }
+      http2_ahead[http2_ahead_count].url = xstrdup (hu->url);
+      http2_ahead[http2_ahead_count].text = request_format (req, &size);
+      http2_ahead[http2_ahead_count].stream = fd;
+      ++http2_ahead_count;
+      request_free (&req);
     }
+}
+#endif /* HAVE_NGHTTP2 */
 
- cleanup:
-   if (tmp != buf)
-     xfree (tmp);
-  *ntlm_seen_ref = ntlm_seen;
-  *basic_auth_finished_ref = basic_auth_finished;
-  *auth_finished_ref = auth_finished;
-  return auth_err;
+#ifdef HAVE_HTTP3
+/* Return true if the request for U may be sent over HTTP/3, to an
+   alternative the server announced.  What is left to HTTP/1.1 on
+   HTTP/2 is left to TCP, and so are requests with another method than
+   GET or HEAD, as a resumed connection sends them in 0-RTT data, which
+   can be replayed.  */
+
+static bool
+http3_allowed_p (const struct url *u, const struct url *proxy,
+                 bool inhibit_keep_alive)
+{
+  return (opt.http3 && u->scheme == SCHEME_HTTPS && !proxy
+          && !inhibit_keep_alive && !opt.method && !opt.body_data
+          && !opt.body_file && !opt.warc_filename);
 }
 
-static uerr_t
-open_output_stream (struct http_stat *hs, int count, FILE **fp)
+/* Send REQ, the request for U, on the HTTP/3 session of SOCK, and
+   return the descriptor of its stream, or -1 on failure.  */
+
+static int
+request_send_http3 (const struct request *req, const struct url *u, int sock)
 {
-/* 2005-06-17 SMS.
-   For VMS, define common fopen() optional arguments.
-*/
-#ifdef __VMS
-# define FOPEN_OPT_ARGS "fop=sqo", "acc", acc_cb, &open_id
-# define FOPEN_BIN_FLAG 3
-#else /* def __VMS */
-# define FOPEN_BIN_FLAG true
-#endif /* def __VMS [else] */
+  struct request_fields f;
+  int fd;
 
-  /* Open the local file.  */
-  if (!output_stream)
+  if (opt.debug)
     {
-      mkalldirs (hs->local_file);
-      if (opt.backups)
-        rotate_backups (hs->local_file);
-      if (hs->restval)
-        {
-#ifdef __VMS
-          int open_id;
-
-          open_id = 21;
-          *fp = fopen (hs->local_file, "ab", FOPEN_OPT_ARGS);
-#else /* def __VMS */
-          *fp = fopen (hs->local_file, "ab");
-#endif /* def __VMS [else] */
-        }
-      else if (ALLOW_CLOBBER || count > 1)
-        {
-          if (opt.unlink_requested && file_exists_p (hs->local_file, NULL))
-            {
-              if (unlink (hs->local_file) < 0)
-                {
-                  logprintf (LOG_NOTQUIET, "%s: %s\n", hs->local_file,
-                             strerror (errno));
-                  return UNLINKERR;
-                }
-            }
+      int size;
+      char *text = request_format (req, &size);
+      DEBUGP (("\n---HTTP/3 request begin---\n%s---request end---\n",
+               text));
+      xfree (text);
+    }
 
-#ifdef __VMS
-          int open_id;
+  request_fields_build (&f, req, u);
+  fd = http3_open_stream (sock, f.headers, f.count);
+  request_fields_free (&f);
+  return fd;
+}
+#endif /* HAVE_HTTP3 */
 
-          open_id = 22;
-          *fp = fopen (hs->local_file, "wb", FOPEN_OPT_ARGS);
-#else /* def __VMS */
-          if (hs->temporary)
-            {
-              *fp = fdopen (open (hs->local_file, O_BINARY | O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR), "wb");
-            }
-          else
-            {
-              *fp = fopen (hs->local_file, "wb");
-            }
+static uerr_t
+establish_connection (const struct url *u, const struct url **conn_ref,
+                      struct http_stat *hs, struct url *proxy,
+                      char **proxyauth,
+                      struct request **req_ref, bool *using_ssl,
+                      bool inhibit_keep_alive,
+                      int *sock_ref)
+{
+  bool host_lookup_failed = false;
+  int sock = *sock_ref;
+  struct request *req = *req_ref;
+  const struct url *conn = *conn_ref;
+  struct response *resp;
+  int write_error;
+  int statcode;
+#ifdef HAVE_HTTP3
+  if (http3_allowed_p (u, proxy, inhibit_keep_alive))
+    {
+      char *alt_host;
+      int alt_port;
+      int h3sock = http3_session_find (u->host, u->port);
 
-#endif /* def __VMS [else] */
+      if (h3sock >= 0)
+        {
+          logprintf (LOG_VERBOSE,
+                     _("Reusing HTTP/3 connection to %s:%d.\n"),
+                     quotearg_style (escape_quoting_style, u->host), u->port);
+          *using_ssl = true;
+          *sock_ref = h3sock;
+          return RETROK;
         }
-      else
+      /* Without an alternative that works, the connection is made
+         over TCP as usual.  */
+      if (altsvc_lookup (u->host, u->port, &alt_host, &alt_port))
         {
-          *fp = fopen_excl (hs->local_file, FOPEN_BIN_FLAG);
-          if (!*fp && errno == EEXIST)
+          h3sock = http3_session_new (u->host, u->port, alt_host, alt_port);
+          xfree (alt_host);
+          if (h3sock >= 0)
             {
-              /* We cannot just invent a new name and use it (which is
-                 what functions like unique_create typically do)
-                 because we told the user we'd use this name.
-                 Instead, return and retry the download.  */
-              logprintf (LOG_NOTQUIET,
-                         _("%s has sprung into existence.\n"),
-                         hs->local_file);
-              return FOPEN_EXCL_ERR;
+              logputs (LOG_VERBOSE, _("Using HTTP/3.\n"));
+              *using_ssl = true;
+              *sock_ref = h3sock;
+              return RETROK;
             }
         }
-      if (!*fp)
-        {
-          logprintf (LOG_NOTQUIET, "%s: %s\n", hs->local_file, strerror (errno));
-          return FOPENERR;
-        }
     }
-  else
-    *fp = output_stream;
-
-  /* Print fetch message, if opt.verbose.  */
-  logprintf (LOG_VERBOSE, _("Saving to: '%s'\n"),
-             HYPHENP (hs->local_file) ? "STDOUT" : hs->local_file);
-
-  return RETROK;
-}
-
-/* Set proper type flags based on type string.  */
-static void
-set_content_type (int *dt, const char *type)
-{
-  /* If content-type is not given, assume text/html.  This is because
-     of the multitude of broken CGI's that "forget" to generate the
-     content-type.  */
-  if (!type ||
-      0 == c_strcasecmp (type, TEXTHTML_S) ||
-      0 == c_strcasecmp (type, TEXTXHTML_S))
-    *dt |= TEXTHTML;
-  else
-    *dt &= ~TEXTHTML;
-
-  if (type &&
-      0 == c_strcasecmp (type, TEXTCSS_S))
-    *dt |= TEXTCSS;
-  else
-    *dt &= ~TEXTCSS;
-}
-
-#ifdef HAVE_METALINK
-/* Will return proper metalink_t structure if enough data was found in
-   http response resp. Otherwise returns NULL.
-   Two exit points: one for success and one for failure.  */
-static metalink_t *
-metalink_from_http (const struct response *resp, const struct http_stat *hs,
-                    const struct url *u)
-{
-  metalink_t *metalink = NULL;
-  metalink_file_t *mfile = xnew0 (metalink_file_t);
-  const char *val_beg, *val_end;
-  int res_count = 0, meta_count = 0, hash_count = 0, sig_count = 0, i;
-
-  DEBUGP (("Checking for Metalink in HTTP response\n"));
+#endif
+#ifdef HAVE_NGHTTP2
+  bool h2_allowed = http2_allowed_p (u, proxy, inhibit_keep_alive);
+  bool h2 = false;
 
-  /* Initialize metalink file for our simple use case.  */
-  if (hs->local_file)
+  if (h2_allowed)
     {
-      /* Align with response. */
-      char *local_file = xstrdup (hs->local_file);
-      char *url_enc = u->content_enc ? u->content_enc : "UTF-8";
-      if (strcasecmp (url_enc, opt.locale))
+      int h2sock = http2_session_find (u->host, u->port);
+      if (h2sock >= 0)
         {
-          mfile->name = convert_fname (local_file, opt.locale, url_enc);
-          xfree (local_file);
+          logprintf (LOG_VERBOSE,
+                     _("Reusing HTTP/2 connection to %s:%d.\n"),
+                     quotearg_style (escape_quoting_style, u->host), u->port);
+          *using_ssl = true;
+          *sock_ref = h2sock;
+          return RETROK;
         }
-      else
-        mfile->name = local_file;
     }
-  else
-    mfile->name = url_file_name (u, NULL);
-
-  /* Begin with 1-element array (for 0-termination). */
-  mfile->checksums = xnew0 (metalink_checksum_t *);
-  mfile->resources = xnew0 (metalink_resource_t *);
-  mfile->metaurls = xnew0 (metalink_metaurl_t *);
+#endif
 
-  /* Process the Content-Type header.  */
-  if (resp_header_locate (resp, "Content-Type", 0, &val_beg, &val_end) != -1)
+  if (! inhibit_keep_alive)
     {
-      metalink_metaurl_t murl = {0};
-
-      const char *type_beg, *type_end;
-      char *typestr = NULL;
-      char *namestr = NULL;
-      size_t type_len;
-
-      DEBUGP (("Processing Content-Type header...\n"));
-
-      /* Find beginning of type.  */
-      type_beg = val_beg;
-      while (type_beg < val_end && c_isspace (*type_beg))
-        type_beg++;
-
-      /* Find end of type.  */
-      type_end = type_beg + 1;
-      while (type_end < val_end &&
-             *type_end != ';' &&
-             *type_end != ' ' &&
-             *type_end != '\r' &&
-             *type_end != '\n')
-        type_end++;
+      /* Look for a persistent connection to target host, unless a
+         proxy is used.  The exception is when SSL is in use, in which
+         case the proxy is nothing but a passthrough to the target
+         host, registered as a connection to the latter.  */
+      const struct url *relevant = conn;
+#ifdef HAVE_SSL
+      if (u->scheme == SCHEME_HTTPS)
+        relevant = u;
+#endif
 
-      if (type_beg >= val_end || type_end > val_end)
+      if (persistent_available_p (relevant->host, relevant->port,
+#ifdef HAVE_SSL
+                                  relevant->scheme == SCHEME_HTTPS,
+#else
+                                  0,
+#endif
+                                  &host_lookup_failed))
         {
-          DEBUGP (("Invalid Content-Type header. Ignoring.\n"));
-          goto skip_content_type;
+          int family = socket_family (pconn.socket, ENDPOINT_PEER);
+          sock = pconn.socket;
+          *using_ssl = pconn.ssl;
+#if ENABLE_IPV6
+          if (family == AF_INET6)
+             logprintf (LOG_VERBOSE, _("Reusing existing connection to [%s]:%d.\n"),
+                        quotearg_style (escape_quoting_style, pconn.host),
+                         pconn.port);
+          else
+#endif
+             logprintf (LOG_VERBOSE, _("Reusing existing connection to %s:%d.\n"),
+                        quotearg_style (escape_quoting_style, pconn.host),
+                        pconn.port);
+          DEBUGP (("Reusing fd %d.\n", sock));
+          metrics_reused ();
+          STATS_ADD (STATS_PCONN_HIT, 0);
+          if (pconn.authorized)
+            /* If the connection is already authorized, the "Basic"
+               authorization added by code above is unnecessary and
+               only hurts us.  */
+            request_remove_header (req, "Authorization");
         }
-
-      type_len = type_end - type_beg;
-      typestr = xstrndup (type_beg, type_len);
-
-      DEBUGP (("Content-Type: %s\n", typestr));
-
-      if (strcmp (typestr, "application/metalink4+xml"))
+      else if (host_lookup_failed)
         {
-          xfree (typestr);
-          goto skip_content_type;
+          logprintf(LOG_NOTQUIET,
+                    _("%s: unable to resolve host address %s\n"),
+                    exec_name, quote (relevant->host));
+          return HOSTERR;
         }
-
-      /*
-        Valid ranges for the "pri" attribute are from
-        1 to 999999.  Mirror servers with a lower value of the "pri"
-        attribute have a higher priority, while mirrors with an undefined
-        "pri" attribute are considered to have a value of 999999, which is
-        the lowest priority.
-
-        rfc6249 section 3.1
-      */
-      murl.priority = DEFAULT_PRI;
-
-      murl.mediatype = typestr;
-      typestr = NULL;
-
-      if (opt.content_disposition
-          && resp_header_locate (resp, "Content-Disposition", 0, &val_beg, &val_end) != -1)
+      else if (sock != -1)
         {
-          find_key_value (val_beg, val_end, "filename", &namestr);
-          murl.name = namestr;
-          namestr = NULL;
+          sock = -1;
         }
-
-      murl.url = xstrdup (u->url);
-
-      DEBUGP (("URL=%s\n", murl.url));
-      DEBUGP (("MEDIATYPE=%s\n", murl.mediatype));
-      DEBUGP (("NAME=%s\n", murl.name ? murl.name : ""));
-      DEBUGP (("PRIORITY=%d\n", murl.priority));
-
-      /* 1 slot from new resource, 1 slot for null-termination.  */
-      mfile->metaurls = xrealloc (mfile->metaurls,
-                                  sizeof (metalink_metaurl_t *) * (meta_count + 2));
-      mfile->metaurls[meta_count] = xnew0 (metalink_metaurl_t);
-      *mfile->metaurls[meta_count] = murl;
-      meta_count++;
     }
-skip_content_type:
 
-  /* Find all Link headers.  */
-  for (i = 0;
-       (i = resp_header_locate (resp, "Link", i, &val_beg, &val_end)) != -1;
-       i++)
+  if (sock < 0)
     {
-      char *rel = NULL, *reltype = NULL;
-      char *urlstr = NULL;
-      const char *url_beg, *url_end, *attrs_beg;
-      size_t url_len;
-
-      /* Sample Metalink Link headers:
-
-           Link: <http://www2.example.com/dir1/dir2/dir3/dir4/dir5/example.ext>;
-           rel=duplicate; pri=1; pref; geo=gb; depth=4
-
-           Link: <http://example.com/example.ext.asc>; rel=describedby;
-           type="application/pgp-signature"
-       */
+      /* Times the setup of the connection, for drain_limit.  */
+      static struct ptimer *setup_timer;
 
-      /* Find beginning of URL.  */
-      url_beg = val_beg;
-      while (url_beg < val_end - 1 && c_isspace (*url_beg))
-        url_beg++;
+      if (!setup_timer)
+        setup_timer = ptimer_new ();
+      else
+        ptimer_reset (setup_timer);
 
-      /* Find end of URL.  */
-      /* The convention here is that end ptr points to one element after
-         end of string. In this case, it should be pointing to the '>', which
-         is one element after end of actual URL. Therefore, it should never point
-         to val_end, which is one element after entire header value string.  */
-      url_end = url_beg + 1;
-      while (url_end < val_end - 1 && *url_end != '>')
-        url_end++;
+      STATS_ADD (STATS_PCONN_MISS, 0);
+      sock = connect_to_host (conn->host, conn->port);
+      if (sock == E_HOST)
+        return HOSTERR;
+      else if (sock < 0)
+        return (retryable_socket_connect_error (errno)
+                ? CONERROR : CONIMPOSSIBLE);
 
-      if (url_beg >= val_end || url_end >= val_end ||
-          *url_beg != '<' || *url_end != '>')
+#ifdef HAVE_SSL
+      if (proxy && u->scheme == SCHEME_HTTPS)
         {
-          DEBUGP (("This is not a valid Link header. Ignoring.\n"));
-          continue;
-        }
-
-      /* Skip <.  */
-      url_beg++;
-      url_len = url_end - url_beg;
+          char *head;
+          char *message;
+          /* When requesting SSL URLs through proxies, use the
+             CONNECT method to request passthrough.  */
+          struct request *connreq = request_new ("CONNECT",
+                              aprintf ("%s:%d", u->host, u->port));
+          SET_USER_AGENT (connreq);
+          if (proxyauth)
+            {
+              request_set_header (connreq, "Proxy-Authorization",
+                                  *proxyauth, rel_value);
+              /* Now that PROXYAUTH is part of the CONNECT request,
+                 zero it out so we don't send proxy authorization with
+                 the regular request below.  */
+              *proxyauth = NULL;
+            }
+          request_set_header (connreq, "Host",
+                              aprintf ("%s:%d", u->host, u->port),
+                              rel_value);
 
-      /* URL found. Now handle the attributes.  */
-      attrs_beg = url_end + 1;
+          write_error = request_send (connreq, sock, 0);
+          request_free (&connreq);
+          if (write_error < 0)
+            {
+              CLOSE_INVALIDATE (sock);
+              return WRITEFAILED;
+            }
 
-      /* First we need to find out what type of link it is. Currently, we
-         support rel=duplicate and rel=describedby.  */
-      if (!find_key_value (attrs_beg, val_end, "rel", &rel))
-        {
-          DEBUGP (("No rel value in Link header, skipping.\n"));
-          continue;
-        }
+          head = read_http_response_head (sock);
+          if (!head)
+            {
+              logprintf (LOG_VERBOSE, _("Failed reading proxy response: %s\n"),
+                         fd_errstr (sock));
+              CLOSE_INVALIDATE (sock);
+              return HERR;
+            }
+          message = NULL;
+          if (!*head)
+            {
+              xfree (head);
+              goto failed_tunnel;
+            }
+          DEBUGP (("proxy responded with: [%s]\n", head));
 
-      urlstr = xstrndup (url_beg, url_len);
-      DEBUGP (("URL=%s\n", urlstr));
-      DEBUGP (("rel=%s\n", rel));
+          resp = resp_new (head);
+          statcode = resp_status (resp, &message);
+          if (statcode < 0)
+            {
+              char *tms = datetime_str (time (NULL));
+              logprintf (LOG_VERBOSE, "%d\n", statcode);
+              logprintf (LOG_NOTQUIET, _("%s ERROR %d: %s.\n"), tms, statcode,
+                         quotearg_style (escape_quoting_style,
+                                         _("Malformed status line")));
+              xfree (head);
+              return HERR;
+            }
+          xfree (hs->message);
+          hs->message = xstrdup (message);
+          resp_free (&resp);
+          xfree (head);
+          if (statcode != 200)
+            {
+            failed_tunnel:
+              logprintf (LOG_NOTQUIET, _("Proxy tunneling failed: %s"),
+                         message ? quotearg_style (escape_quoting_style, message) : "?");
+              xfree (message);
+              return CONSSLERR;
+            }
+          xfree (message);
 
-      if (!strcmp (rel, "describedby"))
-        find_key_value (attrs_beg, val_end, "type", &reltype);
+          /* SOCK is now *really* connected to u->host, so update CONN
+             to reflect this.  That way register_persistent will
+             register SOCK as being connected to u->host:u->port.  */
+          conn = u;
+        }
 
-      /* Handle signatures.
-         Libmetalink only supports one signature per file. Therefore we stop
-         as soon as we successfully get first supported signature.  */
-      if (sig_count == 0 &&
-          reltype && !strcmp (reltype, "application/pgp-signature"))
+      if (conn->scheme == SCHEME_HTTPS)
         {
-          /* Download the signature to a temporary file.  */
-          FILE *_output_stream = output_stream;
-          bool _output_stream_regular = output_stream_regular;
-
-          output_stream = tmpfile ();
-          if (output_stream)
+          double tls_start = metrics_now ();
+#ifdef HAVE_NGHTTP2
+          if (!ssl_connect_wget (sock, u->host, NULL,
+                                 h2_allowed ? &h2 : NULL))
+#else
+          if (!ssl_connect_wget (sock, u->host, NULL, NULL))
+#endif
             {
-              int url_err;
-              /* If url enqueued by retrieve_tree, free after dequeued */
-              struct url *url = url_new_init ();
-
-              url->ori_url = xstrdup (urlstr);
-              url_err = url_parse (url, true, true);
-
-              if (url_err)
+              CLOSE_INVALIDATE (sock);
+              return CONSSLERR;
+            }
+          else if (!ssl_check_certificate (sock, u->host))
+            {
+              CLOSE_INVALIDATE (sock);
+              return VERIFCERTERR;
+            }
+          *using_ssl = true;
+          metrics_phase (METRICS_TLS, tls_start);
+#ifdef HAVE_NGHTTP2
+          if (h2)
+            {
+              if (!http2_session_new (sock, u->host, u->port))
                 {
-                  logprintf (LOG_NOTQUIET, _("When downloading signature:\n"
-                                             "%s: %s.\n"), urlstr, url_error (url_err));
-                  url_free (url);
+                  logputs (LOG_NOTQUIET,
+                           _("Unable to start an HTTP/2 session.\n"));
+                  CLOSE_INVALIDATE (sock);
+                  return CONSSLERR;
                 }
-              else
-                {
-                  /* Avoid recursive Metalink from HTTP headers.  */
-                  bool _metalink_http = opt.metalink_over_http;
-                  uerr_t retr_err;
+              logputs (LOG_VERBOSE, _("Using HTTP/2.\n"));
+            }
+#endif
+        }
+#endif /* HAVE_SSL */
+      host_link_setup (u->host, ptimer_measure (setup_timer));
+    }
+  *conn_ref = conn;
+  *req_ref = req;
+  *sock_ref = sock;
+  return RETROK;
+}
 
-                  opt.metalink_over_http = false;
-                  retr_err = retrieve_url (url, NULL, NULL,
-                                           NULL, NULL, false, false);
-                  url_free (url);
-                  opt.metalink_over_http = _metalink_http;
+static uerr_t
+set_file_timestamp (struct http_stat *hs)
+{
+  bool local_dot_orig_file_exists = false;
+  char *local_filename = NULL;
+  struct stat st;
+  char buf[1024];
 
-                  if (retr_err == RETROK)
-                    {
-                      /* Signature is in the temporary file. Read it into
-                         metalink resource structure.  */
-                      metalink_signature_t msig;
-                      size_t siglen;
+  if (opt.backup_converted)
+    /* If -K is specified, we'll act on the assumption that it was specified
+        last time these files were downloaded as well, and instead of just
+        comparing local file X against server file X, we'll compare local
+        file X.orig (if extant, else X) against server file X.  If -K
+        _wasn't_ specified last time, or the server contains files called
+        *.orig, -N will be back to not operating correctly with -k. */
+    {
+      size_t filename_len = strlen (hs->local_file);
+      char *filename_plus_orig_suffix;
 
-                      fseek (output_stream, 0, SEEK_END);
-                      siglen = ftell (output_stream);
-                      fseek (output_stream, 0, SEEK_SET);
+      if (filename_len + sizeof (ORIG_SFX) > sizeof (buf))
+        filename_plus_orig_suffix = xmalloc (filename_len + sizeof (ORIG_SFX));
+      else
+        filename_plus_orig_suffix = buf;
 
-                      DEBUGP (("siglen=%lu\n", siglen));
+      /* Would a single s[n]printf() call be faster?  --dan
 
-                      msig.signature = xmalloc (siglen + 1);
-                      if (fread (msig.signature, siglen, 1, output_stream) != 1)
-                        {
-                          logputs (LOG_NOTQUIET,
-                                   _("Unable to read signature content from "
-                                     "temporary file. Skipping.\n"));
-                          xfree (msig.signature);
-                        }
-                      else
-                        {
-                          msig.signature[siglen] = '\0'; /* Just in case.  */
-                          msig.mediatype = xstrdup ("application/pgp-signature");
+          Definitely not.  sprintf() is horribly slow.  It's a
+          different question whether the difference between the two
+          affects a program.  Usually I'd say "no", but at one
+          point I profiled Wget, and found that a measurable and
+          non-negligible amount of time was lost calling sprintf()
+          in url.c.  Replacing sprintf with inline calls to
+          strcpy() and number_to_string() made a difference.
+          --hniksic */
+      memcpy (filename_plus_orig_suffix, hs->local_file, filename_len);
+      memcpy (filename_plus_orig_suffix + filename_len,
+              ORIG_SFX, sizeof (ORIG_SFX));
 
-                          DEBUGP (("Signature (%s):\n%s\n",
-                                   msig.mediatype, msig.signature));
+      /* Try to stat() the .orig file. */
+      if (stat (filename_plus_orig_suffix, &st) == 0)
+        {
+          local_dot_orig_file_exists = true;
+          local_filename = filename_plus_orig_suffix;
+        }
+    }
 
-                          mfile->signature = xnew (metalink_signature_t);
-                          *mfile->signature = msig;
+  if (!local_dot_orig_file_exists)
+    /* Couldn't stat() <file>.orig, so try to stat() <file>. */
+    if (stat (hs->local_file, &st) == 0)
+      {
+        if (local_filename != buf)
+          xfree (local_filename);
+        local_filename = hs->local_file;
+      }
 
-                          sig_count++;
-                        }
+  if (local_filename != NULL)
+    /* There was a local file, so we'll check later to see if the version
+        the server has is the same version we already have, allowing us to
+        skip a download. */
+    {
+      if (local_filename == buf || local_filename == hs->local_file)
+        hs->orig_file_name = xstrdup (local_filename); // on stack or a copy, make a heap copy
+      else
+        hs->orig_file_name = local_filename; // was previously malloc'ed
+      hs->orig_file_size = st.st_size;
+      hs->orig_file_tstamp = st.st_mtime;
+#ifdef WINDOWS
+      /* Modification time granularity is 2 seconds for Windows (FAT drives),
+         so increase local time by 1 second for later comparison. */
+      /* Timestamps on FAT drives (<= FAT32) always end with an even number of seconds:
+         https://en.wikipedia.org/wiki/File_Allocation_Table
+         Floppy, USB drive etc. NTFS has no limit on this. */
+      ++hs->orig_file_tstamp;
+#endif
+      hs->timestamp_checked = true;
+    }
+
+  return RETROK;
+}
+
+static uerr_t
+check_file_output (struct url *u, struct http_stat *hs,
+                   struct response *resp, char *hdrval, size_t hdrsize)
+{
+  /* Determine the local filename if needed. Notice that if -O is used
+   * hstat.local_file is set by http_loop to the argument of -O. */
+  if (!hs->local_file)
+    {
+      char *file_disposition = NULL;
+      char *str_u, *url_enc;
+
+      /* Honor Content-Disposition whether possible. */
+      if (!opt.content_disposition
+          || !resp_header_copy (resp, "Content-Disposition",
+                                hdrval, hdrsize)
+          || !parse_content_disposition (hdrval, &file_disposition))
+        {
+          /* The Content-Disposition header is missing or broken.
+           * Choose unique file name according to given URL. */
+          str_u = url_file_name (u, NULL);
+        }
+      else
+        {
+          DEBUGP (("Parsed filename from Content-Disposition: %s\n",
+                  file_disposition));
+          str_u = url_file_name (u, file_disposition);
+        }
+
+      url_enc = u->enc_type == ENC_IRI ? "UTF-8" : u->ori_enc;
+      if (strcasecmp (url_enc, opt.locale))
+        {
+          hs->local_file = convert_fname (str_u, url_enc, opt.locale);
+          xfree (str_u);
+        }
+      else
+        hs->local_file = str_u;
+
+      xfree (file_disposition);
+    }
+
+  hs->temporary = opt.delete_after || opt.spider || !acceptable (hs->local_file);
+  if (hs->temporary)
+    {
+      char *tmp = aprintf ("%s.tmp", hs->local_file);
+      xfree (hs->local_file);
+      hs->local_file = tmp;
+    }
+
+  /* TODO: perform this check only once. */
+  if (!hs->existence_checked && file_exists_p (hs->local_file, NULL))
+    {
+      if (opt.noclobber && !opt.output_document)
+        {
+          /* If opt.noclobber is turned on and file already exists, do not
+             retrieve the file. But if the output_document was given, then this
+             test was already done and the file didn't exist. Hence the !opt.output_document */
+          return RETRUNNEEDED;
+        }
+      else if (!ALLOW_CLOBBER)
+        {
+          char *unique = unique_name_passthrough (hs->local_file);
+          if (unique != hs->local_file)
+            xfree (hs->local_file);
+          hs->local_file = unique;
+        }
+    }
+  hs->existence_checked = true;
+
+  /* Support timestamping */
+  if (opt.timestamping && !hs->timestamp_checked)
+    {
+      uerr_t timestamp_err = set_file_timestamp (hs);
+      if (timestamp_err != RETROK)
+        return timestamp_err;
+    }
+  return RETROK;
+}
+
+static uerr_t
+check_auth (const struct url *u, char *user, char *passwd, struct response *resp,
+            struct request *req, bool *ntlm_seen_ref, bool *retry,
+            bool *basic_auth_finished_ref, bool *auth_finished_ref)
+{
+  uerr_t auth_err = RETROK;
+  bool basic_auth_finished = *basic_auth_finished_ref;
+  bool auth_finished = *auth_finished_ref;
+  bool ntlm_seen = *ntlm_seen_ref;
+  char buf[256], *tmp = NULL;
+
+  *retry = false;
+
+  if (!auth_finished && (user && passwd))
+    {
+      /* IIS sends multiple copies of WWW-Authenticate, one with
+         the value "negotiate", and other(s) with data.  Loop over
+         all the occurrences and pick the one we recognize.  */
+      int wapos;
+      const char *www_authenticate = NULL;
+      const char *wabeg, *waend;
+      const char *digest = NULL, *basic = NULL, *ntlm = NULL;
+
+      for (wapos = 0; !ntlm
+             && (wapos = resp_header_locate (resp, "WWW-Authenticate", wapos,
+                                             &wabeg, &waend)) != -1;
+           ++wapos)
+        {
+          param_token name, value;
+          size_t len = waend - wabeg;
+
+          if (tmp != buf)
+            xfree (tmp);
+
+          if (len < sizeof (buf))
+            tmp = buf;
+          else
+            tmp = xmalloc (len + 1);
+
+          memcpy (tmp, wabeg, len);
+          tmp[len] = 0;
+
+          www_authenticate = tmp;
+
+          for (;!ntlm;)
+            {
+              /* extract the auth-scheme */
+              while (c_isspace (*www_authenticate)) www_authenticate++;
+              name.e = name.b = www_authenticate;
+              while (*name.e && !c_isspace (*name.e)) name.e++;
+
+              if (name.b == name.e)
+                break;
+
+              DEBUGP (("Auth scheme found '%.*s'\n", (int) (name.e - name.b), name.b));
+
+              if (known_authentication_scheme_p (name.b, name.e))
+                {
+                  if (BEGINS_WITH (name.b, "NTLM")
+                      || BEGINS_WITH (name.b, "Negotiate"))
+                    {
+                      /* IIS offers Negotiate first, which SSPI
+                         answers with Kerberos or else NTLM.  */
+                      ntlm = name.b;
+                      break; /* this is the most secure challenge, stop here */
                     }
+                  else if (!digest && BEGINS_WITH (name.b, "Digest"))
+                    digest = name.b;
+                  else if (!basic && BEGINS_WITH (name.b, "Basic"))
+                    basic = name.b;
                 }
-              fclose (output_stream);
+
+              /* now advance over the auth-params */
+              www_authenticate = name.e;
+              DEBUGP (("Auth param list '%s'\n", www_authenticate));
+              while (extract_param (&www_authenticate, &name, &value, ',', NULL) && name.b && value.b)
+                {
+                  DEBUGP (("Auth param %.*s=%.*s\n",
+                           (int) (name.e - name.b), name.b, (int) (value.e - value.b), value.b));
+                }
+            }
+        }
+
+      if (!basic && !digest && !ntlm)
+        {
+          /* If the authentication header is missing or
+             unrecognized, there's no sense in retrying.  */
+          logputs (LOG_NOTQUIET, _("Unknown authentication scheme.\n"));
+        }
+      else if (!basic_auth_finished
+               || !basic)
+        {
+          char *pth = url_full_path (u);
+          const char *value;
+          uerr_t *auth_stat;
+          auth_stat = xmalloc (sizeof (uerr_t));
+          *auth_stat = RETROK;
+
+          if (ntlm)
+            www_authenticate = ntlm;
+          else if (digest)
+            www_authenticate = digest;
+          else
+            www_authenticate = basic;
+
+          logprintf (LOG_NOTQUIET, _("Authentication selected: %s\n"), www_authenticate);
+
+          value =  create_authorization_line (u, www_authenticate,
+                                              user, passwd,
+                                              request_method (req),
+                                              pth,
+                                              &auth_finished,
+                                              auth_stat);
+
+          auth_err = *auth_stat;
+          xfree (auth_stat);
+          xfree (pth);
+          if (auth_err == RETROK)
+            {
+              request_set_header (req, "Authorization", value, rel_value);
+
+              if (BEGINS_WITH (www_authenticate, "NTLM")
+                  || BEGINS_WITH (www_authenticate, "Negotiate"))
+                ntlm_seen = true;
+              else if (!u->user && BEGINS_WITH (www_authenticate, "Basic"))
+                {
+                  /* Need to register this host as using basic auth,
+                   * so we automatically send creds next time. */
+                  register_basic_auth_host (u->host);
+                }
+
+              *retry = true;
+              goto cleanup;
             }
           else
             {
-              logputs (LOG_NOTQUIET, _("Could not create temporary file. "
-                                       "Skipping signature download.\n"));
+              /* Creating the Authorization header went wrong */
+              xfree (value);
             }
-          output_stream_regular = _output_stream_regular;
-          output_stream = _output_stream;
-        } /* Iterate over signatures.  */
+        }
+      else
+        {
+          /* We already did Basic auth, and it failed. Gotta
+           * give up. */
+        }
+    }
+
+ cleanup:
+   if (tmp != buf)
+     xfree (tmp);
+  *ntlm_seen_ref = ntlm_seen;
+  *basic_auth_finished_ref = basic_auth_finished;
+  *auth_finished_ref = auth_finished;
+  return auth_err;
+}
+
+static uerr_t
+open_output_stream (struct http_stat *hs, int count, FILE **fp)
+{
+/* 2005-06-17 SMS.
+   For VMS, define common fopen() optional arguments.
+*/
+#ifdef __VMS
+# define FOPEN_OPT_ARGS "fop=sqo", "acc", acc_cb, &open_id
+# define FOPEN_BIN_FLAG 3
+#else /* def __VMS */
+# define FOPEN_BIN_FLAG true
+#endif /* def __VMS [else] */
+
+  /* Open the local file.  */
+  if (!output_stream)
+    {
+      mkalldirs (hs->local_file);
+      if (opt.backups)
+        rotate_backups (hs->local_file);
+      if (hs->restval)
+        {
+#ifdef __VMS
+          int open_id;
+
+          open_id = 21;
+          *fp = fopen (hs->local_file, "ab", FOPEN_OPT_ARGS);
+#else /* def __VMS */
+          *fp = fopen (hs->local_file, "ab");
+#endif /* def __VMS [else] */
+        }
+      else if (ALLOW_CLOBBER || count > 1)
+        {
+          if (opt.unlink_requested && file_exists_p (hs->local_file, NULL))
+            {
+              if (unlink (hs->local_file) < 0)
+                {
+                  logprintf (LOG_NOTQUIET, "%s: %s\n", hs->local_file,
+                             strerror (errno));
+                  return UNLINKERR;
+                }
+            }
+
+#ifdef __VMS
+          int open_id;
+
+          open_id = 22;
+          *fp = fopen (hs->local_file, "wb", FOPEN_OPT_ARGS);
+#else /* def __VMS */
+          if (hs->temporary)
+            {
+              *fp = fdopen (open (hs->local_file, O_BINARY | O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR), "wb");
+            }
+          else
+            {
+              *fp = fopen (hs->local_file, "wb");
+            }
+
+#endif /* def __VMS [else] */
+        }
+      else
+        {
+          *fp = fopen_excl (hs->local_file, FOPEN_BIN_FLAG);
+          if (!*fp && errno == EEXIST)
+            {
+              /* We cannot just invent a new name and use it (which is
+                 what functions like unique_create typically do)
+                 because we told the user we'd use this name.
+                 Instead, return and retry the download.  */
+              logprintf (LOG_NOTQUIET,
+                         _("%s has sprung into existence.\n"),
+                         hs->local_file);
+              return FOPEN_EXCL_ERR;
+            }
+        }
+      if (!*fp)
+        {
+          logprintf (LOG_NOTQUIET, "%s: %s\n", hs->local_file, strerror (errno));
+          return FOPENERR;
+        }
+    }
+  else
+    *fp = output_stream;
+
+  /* Print fetch message, if opt.verbose.  */
+  logprintf (LOG_VERBOSE, _("Saving to: '%s'\n"),
+             HYPHENP (hs->local_file) ? "STDOUT" : hs->local_file);
+
+  return RETROK;
+}
+
+/* Set proper type flags based on type string.  */
+static void
+set_content_type (int *dt, const char *type)
+{
+  /* If content-type is not given, assume text/html.  This is because
+     of the multitude of broken CGI's that "forget" to generate the
+     content-type.  */
+  if (!type ||
+      0 == c_strcasecmp (type, TEXTHTML_S) ||
+      0 == c_strcasecmp (type, TEXTXHTML_S))
+    *dt |= TEXTHTML;
+  else
+    *dt &= ~TEXTHTML;
+
+  if (type &&
+      0 == c_strcasecmp (type, TEXTCSS_S))
+    *dt |= TEXTCSS;
+  else
+    *dt &= ~TEXTCSS;
+}
+
+#ifdef HAVE_METALINK
+/* Will return proper metalink_t structure if enough data was found in
+   http response resp. Otherwise returns NULL.
+   Two exit points: one for success and one for failure.  */
+static metalink_t *
+metalink_from_http (const struct response *resp, const struct http_stat *hs,
+                    const struct url *u)
+{
+  metalink_t *metalink = NULL;
+  metalink_file_t *mfile = xnew0 (metalink_file_t);
+  const char *val_beg, *val_end;
+  int res_count = 0, meta_count = 0, hash_count = 0, sig_count = 0, i;
+
+  DEBUGP (("Checking for Metalink in HTTP response\n"));
+
+  /* Initialize metalink file for our simple use case.  */
+  if (hs->local_file)
+    {
+      /* Align with response. */
+      char *local_file = xstrdup (hs->local_file);
+      char *url_enc = u->content_enc ? u->content_enc : "UTF-8";
+      if (strcasecmp (url_enc, opt.locale))
+        {
+          mfile->name = convert_fname (local_file, opt.locale, url_enc);
+          xfree (local_file);
+        }
+      else
+        mfile->name = local_file;
+    }
+  else
+    mfile->name = url_file_name (u, NULL);
+
+  /* Begin with 1-element array (for 0-termination). */
+  mfile->checksums = xnew0 (metalink_checksum_t *);
+  mfile->resources = xnew0 (metalink_resource_t *);
+  mfile->metaurls = xnew0 (metalink_metaurl_t *);
+
+  /* Process the Content-Type header.  */
+  if (resp_header_locate (resp, "Content-Type", 0, &val_beg, &val_end) != -1)
+    {
+      metalink_metaurl_t murl = {0};
+
+      const char *type_beg, *type_end;
+      char *typestr = NULL;
+      char *namestr = NULL;
+      size_t type_len;
+
+      DEBUGP (("Processing Content-Type header...\n"));
+
+      /* Find beginning of type.  */
+      type_beg = val_beg;
+      while (type_beg < val_end && c_isspace (*type_beg))
+        type_beg++;
+
+      /* Find end of type.  */
+      type_end = type_beg + 1;
+      while (type_end < val_end &&
+             *type_end != ';' &&
+             *type_end != ' ' &&
+             *type_end != '\r' &&
+             *type_end != '\n')
+        type_end++;
+
+      if (type_beg >= val_end || type_end > val_end)
+        {
+          DEBUGP (("Invalid Content-Type header. Ignoring.\n"));
+          goto skip_content_type;
+        }
+
+      type_len = type_end - type_beg;
+      typestr = xstrndup (type_beg, type_len);
+
+      DEBUGP (("Content-Type: %s\n", typestr));
+
+      if (strcmp (typestr, "application/metalink4+xml"))
+        {
+          xfree (typestr);
+          goto skip_content_type;
+        }
+
+      /*
+        Valid ranges for the "pri" attribute are from
+        1 to 999999.  Mirror servers with a lower value of the "pri"
+        attribute have a higher priority, while mirrors with an undefined
+        "pri" attribute are considered to have a value of 999999, which is
+        the lowest priority.
+
+        rfc6249 section 3.1
+      */
+      murl.priority = DEFAULT_PRI;
+
+      murl.mediatype = typestr;
+      typestr = NULL;
+
+      if (opt.content_disposition
+          && resp_header_locate (resp, "Content-Disposition", 0, &val_beg, &val_end) != -1)
+        {
+          find_key_value (val_beg, val_end, "filename", &namestr);
+          murl.name = namestr;
+          namestr = NULL;
+        }
+
+      murl.url = xstrdup (u->url);
+
+      DEBUGP (("URL=%s\n", murl.url));
+      DEBUGP (("MEDIATYPE=%s\n", murl.mediatype));
+      DEBUGP (("NAME=%s\n", murl.name ? murl.name : ""));
+      DEBUGP (("PRIORITY=%d\n", murl.priority));
+
+      /* 1 slot from new resource, 1 slot for null-termination.  */
+      mfile->metaurls = xrealloc (mfile->metaurls,
+                                  sizeof (metalink_metaurl_t *) * (meta_count + 2));
+      mfile->metaurls[meta_count] = xnew0 (metalink_metaurl_t);
+      *mfile->metaurls[meta_count] = murl;
+      meta_count++;
+    }
+skip_content_type:
+
+  /* Find all Link headers.  */
+  for (i = 0;
+       (i = resp_header_locate (resp, "Link", i, &val_beg, &val_end)) != -1;
+       i++)
+    {
+      char *rel = NULL, *reltype = NULL;
+      char *urlstr = NULL;
+      const char *url_beg, *url_end, *attrs_beg;
+      size_t url_len;
+
+      /* Sample Metalink Link headers:
+
+           Link: <http://www2.example.com/dir1/dir2/dir3/dir4/dir5/example.ext>;
+           rel=duplicate; pri=1; pref; geo=gb; depth=4
+
+           Link: <http://example.com/example.ext.asc>; rel=describedby;
+           type="application/pgp-signature"
+       */
+
+      /* Find beginning of URL.  */
+      url_beg = val_beg;
+      while (url_beg < val_end - 1 && c_isspace (*url_beg))
+        url_beg++;
+
+      /* Find end of URL.  */
+      /* The convention here is that end ptr points to one element after
+         end of string. In this case, it should be pointing to the '>', which
+         is one element after end of actual URL. Therefore, it should never point
+         to val_end, which is one element after entire header value string.  */
+      url_end = url_beg + 1;
+      while (url_end < val_end - 1 && *url_end != '>')
+        url_end++;
+
+      if (url_beg >= val_end || url_end >= val_end ||
+          *url_beg != '<' || *url_end != '>')
+        {
+          DEBUGP (("This is not a valid Link header. Ignoring.\n"));
+          continue;
+        }
+
+      /* Skip <.  */
+      url_beg++;
+      url_len = url_end - url_beg;
+
+      /* URL found. Now handle the attributes.  */
+      attrs_beg = url_end + 1;
+
+      /* First we need to find out what type of link it is. Currently, we
+         support rel=duplicate and rel=describedby.  */
+      if (!find_key_value (attrs_beg, val_end, "rel", &rel))
+        {
+          DEBUGP (("No rel value in Link header, skipping.\n"));
+          continue;
+        }
+
+      urlstr = xstrndup (url_beg, url_len);
+      DEBUGP (("URL=%s\n", urlstr));
+      DEBUGP (("rel=%s\n", rel));
+
+      if (!strcmp (rel, "describedby"))
+        find_key_value (attrs_beg, val_end, "type", &reltype);
+
+      /* Handle signatures.
+         Libmetalink only supports one signature per file. Therefore we stop
+         as soon as we successfully get first supported signature.  */
+      if (sig_count == 0 &&
+          reltype && !strcmp (reltype, "application/pgp-signature"))
+        {
+          /* Download the signature to a temporary file.  */
+          FILE *_output_stream = output_stream;
+          bool _output_stream_regular = output_stream_regular;
+
+          output_stream = tmpfile ();
+          if (output_stream)
+            {
+              int url_err;
+              /* If url enqueued by retrieve_tree, free after dequeued */
+              struct url *url = url_new_init ();
+
+              url->ori_url = xstrdup (urlstr);
+              url_err = url_parse (url, true, true);
+
+              if (url_err)
+                {
+                  logprintf (LOG_NOTQUIET, _("When downloading signature:\n"
+                                             "%s: %s.\n"), urlstr, url_error (url_err));
+                  url_free (url);
+                }
+              else
+                {
+                  /* Avoid recursive Metalink from HTTP headers.  */
+                  bool _metalink_http = opt.metalink_over_http;
+                  uerr_t retr_err;
+
+                  opt.metalink_over_http = false;
+                  retr_err = retrieve_url (url, NULL, NULL,
+                                           NULL, NULL, false, false);
+                  url_free (url);
+                  opt.metalink_over_http = _metalink_http;
+
+                  if (retr_err == RETROK)
+                    {
+                      /* Signature is in the temporary file. Read it into
+                         metalink resource structure.  */
+                      metalink_signature_t msig;
+                      size_t siglen;
+
+                      fseek (output_stream, 0, SEEK_END);
+                      siglen = ftell (output_stream);
+                      fseek (output_stream, 0, SEEK_SET);
+
+                      DEBUGP (("siglen=%lu\n", siglen));
+
+                      msig.signature = xmalloc (siglen + 1);
+                      if (fread (msig.signature, siglen, 1, output_stream) != 1)
+                        {
+                          logputs (LOG_NOTQUIET,
+                                   _("Unable to read signature content from "
+                                     "temporary file. Skipping.\n"));
+                          xfree (msig.signature);
+                        }
+                      else
+                        {
+                          msig.signature[siglen] = '\0'; /* Just in case.  */
+                          msig.mediatype = xstrdup ("application/pgp-signature");
+
+                          DEBUGP (("Signature (%s):\n%s\n",
+                                   msig.mediatype, msig.signature));
+
+                          mfile->signature = xnew (metalink_signature_t);
+                          *mfile->signature = msig;
+
+                          sig_count++;
+                        }
+                    }
+                }
+              fclose (output_stream);
+            }
+          else
+            {
+              logputs (LOG_NOTQUIET, _("Could not create temporary file. "
+                                       "Skipping signature download.\n"));
+            }
+          output_stream_regular = _output_stream_regular;
+          output_stream = _output_stream;
+        } /* Iterate over signatures.  */
+
+        /* Handle Metalink resources.  */
+      else if (!strcmp (rel, "duplicate"))
+        {
+          metalink_resource_t mres = {0};
+          char *pristr;
+
+          /*
+             Valid ranges for the "pri" attribute are from
+             1 to 999999.  Mirror servers with a lower value of the "pri"
+             attribute have a higher priority, while mirrors with an undefined
+             "pri" attribute are considered to have a value of 999999, which is
+             the lowest priority.
+
+             rfc6249 section 3.1
+           */
+          mres.priority = DEFAULT_PRI;
+          if (find_key_value (url_end, val_end, "pri", &pristr))
+            {
+              long pri;
+              char *end_pristr;
+              /* Do not care for errno since 0 is error in this case.  */
+              pri = strtol (pristr, &end_pristr, 10);
+              if (end_pristr != pristr + strlen (pristr) ||
+                  !VALID_PRI_RANGE (pri))
+                {
+                  /* This is against the specification, so let's inform the user.  */
+                  logprintf (LOG_NOTQUIET,
+                             _("Invalid pri value. Assuming %d.\n"),
+                             DEFAULT_PRI);
+                }
+              else
+                mres.priority = pri;
+              xfree (pristr);
+            }
+
+          switch (url_scheme (urlstr))
+            {
+            case SCHEME_HTTP:
+              mres.type = xstrdup ("http");
+              break;
+#ifdef HAVE_SSL
+            case SCHEME_HTTPS:
+              mres.type = xstrdup ("https");
+              break;
+            case SCHEME_FTPS:
+              mres.type = xstrdup ("ftps");
+              break;
+#endif
+            case SCHEME_FTP:
+              mres.type = xstrdup ("ftp");
+              break;
+            default:
+              DEBUGP (("Unsupported url scheme in %s. Skipping resource.\n", urlstr));
+            }
+
+          if (mres.type)
+            {
+              DEBUGP (("TYPE=%s\n", mres.type));
+
+              /* At this point we have validated the new resource.  */
+
+              find_key_value (url_end, val_end, "geo", &mres.location);
+
+              mres.url = urlstr;
+              urlstr = NULL;
+
+              mres.preference = 0;
+              if (has_key (url_end, val_end, "pref"))
+                {
+                  DEBUGP (("This resource has preference\n"));
+                  mres.preference = 1;
+                }
+
+              /* 1 slot from new resource, 1 slot for null-termination.  */
+              mfile->resources = xrealloc (mfile->resources,
+                                           sizeof (metalink_resource_t *) * (res_count + 2));
+              mfile->resources[res_count] = xnew0 (metalink_resource_t);
+              *mfile->resources[res_count] = mres;
+              res_count++;
+            }
+        } /* Handle resource link (rel=duplicate).  */
+
+      /* Handle Metalink/XML resources.  */
+      else if (reltype && !strcmp (reltype, "application/metalink4+xml"))
+        {
+          metalink_metaurl_t murl = {0};
+          char *pristr;
+
+          /*
+             Valid ranges for the "pri" attribute are from
+             1 to 999999.  Mirror servers with a lower value of the "pri"
+             attribute have a higher priority, while mirrors with an undefined
+             "pri" attribute are considered to have a value of 999999, which is
+             the lowest priority.
+
+             rfc6249 section 3.1
+           */
+          murl.priority = DEFAULT_PRI;
+          if (find_key_value (url_end, val_end, "pri", &pristr))
+            {
+              long pri;
+              char *end_pristr;
+              /* Do not care for errno since 0 is error in this case.  */
+              pri = strtol (pristr, &end_pristr, 10);
+              if (end_pristr != pristr + strlen (pristr) ||
+                  !VALID_PRI_RANGE (pri))
+                {
+                  /* This is against the specification, so let's inform the user.  */
+                  logprintf (LOG_NOTQUIET,
+                             _("Invalid pri value. Assuming %d.\n"),
+                             DEFAULT_PRI);
+                }
+              else
+                murl.priority = pri;
+              xfree (pristr);
+            }
+
+          murl.mediatype = xstrdup (reltype);
+
+          DEBUGP (("MEDIATYPE=%s\n", murl.mediatype));
+
+          /* At this point we have validated the new resource.  */
+
+          find_key_value (url_end, val_end, "name", &murl.name);
+
+          murl.url = urlstr;
+          urlstr = NULL;
+
+          /* 1 slot from new resource, 1 slot for null-termination.  */
+          mfile->metaurls = xrealloc (mfile->metaurls,
+                                       sizeof (metalink_metaurl_t *) * (meta_count + 2));
+          mfile->metaurls[meta_count] = xnew0 (metalink_metaurl_t);
+          *mfile->metaurls[meta_count] = murl;
+          meta_count++;
+        } /* Handle resource link (rel=describedby).  */
+      else
+        DEBUGP (("This link header was not used for Metalink\n"));
+
+      xfree (urlstr);
+      xfree (reltype);
+      xfree (rel);
+    } /* Iterate over link headers.  */
+
+  /* Null-terminate resources array.  */
+  mfile->resources[res_count] = 0;
+  mfile->metaurls[meta_count] = 0;
+
+  if (res_count == 0 && meta_count == 0)
+    {
+      DEBUGP (("No valid metalink references found.\n"));
+      goto fail;
+    }
+
+  /* Find all Digest headers.  */
+  for (i = 0;
+       (i = resp_header_locate (resp, "Digest", i, &val_beg, &val_end)) != -1;
+       i++)
+    {
+      const char *dig_pos;
+      char *dig_type, *dig_hash;
+
+      /* Each Digest header can include multiple hashes. Example:
+           Digest: SHA=thvDyvhfIqlvFe+A9MYgxAfm1q5=,unixsum=30637
+           Digest: md5=HUXZLQLMuI/KZ5KDcJPcOA==
+       */
+      for (dig_pos = val_beg;
+           (dig_pos = find_key_values (dig_pos, val_end, &dig_type, &dig_hash));
+           dig_pos++)
+        {
+          /* The hash here is assumed to be base64. We need the hash in hex.
+             Therefore we convert: base64 -> binary -> hex.  */
+          const size_t dig_hash_str_len = strlen (dig_hash);
+          char bin_hash[256];
+          ssize_t hash_bin_len;
+
+          // there is no hash with that size
+          if (dig_hash_str_len >= sizeof (bin_hash))
+            {
+              DEBUGP (("Hash too long, ignored.\n"));
+              xfree (dig_type);
+              xfree (dig_hash);
+              continue;
+            }
+
+          hash_bin_len = wget_base64_decode (dig_hash, bin_hash, dig_hash_str_len * 3 / 4 + 1);
+
+          /* Detect malformed base64 input.  */
+          if (hash_bin_len < 0)
+            {
+              DEBUGP (("Malformed base64 input, ignored.\n"));
+              xfree (dig_type);
+              xfree (dig_hash);
+              continue;
+            }
+
+          /* One slot for me, one for zero-termination.  */
+          mfile->checksums =
+                  xrealloc (mfile->checksums,
+                            sizeof (metalink_checksum_t *) * (hash_count + 2));
+          mfile->checksums[hash_count] = xnew (metalink_checksum_t);
+          mfile->checksums[hash_count]->type = dig_type;
+
+          mfile->checksums[hash_count]->hash = xmalloc ((size_t)hash_bin_len * 2 + 1);
+          wg_hex_to_string (mfile->checksums[hash_count]->hash, bin_hash, (size_t)hash_bin_len);
+
+          xfree (dig_hash);
+
+          hash_count++;
+        }
+    }
+
+  /* Zero-terminate checksums array.  */
+  mfile->checksums[hash_count] = 0;
+
+  /*
+    If Instance Digests are not provided by the Metalink servers, the
+    Link header fields pertaining to this specification MUST be ignored.
+
+    rfc6249 section 6
+   */
+  if (res_count && hash_count == 0)
+    {
+      logputs (LOG_VERBOSE,
+               _("Could not find acceptable digest for Metalink resources.\n"
+                 "Ignoring them.\n"));
+      goto fail;
+    }
+
+  /* Metalink data is OK. Now we just need to sort the resources based
+     on their priorities, preference, and perhaps location.  */
+  stable_sort (mfile->resources, res_count, sizeof (metalink_resource_t *), metalink_res_cmp);
+  stable_sort (mfile->metaurls, meta_count, sizeof (metalink_metaurl_t *), metalink_meta_cmp);
+
+  /* Restore sensible preference values (in case someone cares to look).  */
+  for (i = 0; i < res_count; ++i)
+    mfile->resources[i]->preference = 1000000 - mfile->resources[i]->priority;
+
+  metalink = xnew0 (metalink_t);
+  metalink->files = xmalloc (sizeof (metalink_file_t *) * 2);
+  metalink->files[0] = mfile;
+  metalink->files[1] = 0;
+  metalink->origin = xstrdup (u->url);
+  metalink->version = METALINK_VERSION_4;
+  /* Leave other fields set to 0.  */
+
+  return metalink;
+
+fail:
+  /* Free all allocated memory.  */
+  if (metalink)
+    metalink_delete (metalink);
+  else
+    metalink_file_delete (mfile);
+  return NULL;
+}
+#endif /* HAVE_METALINK */
+
+/* Store the cookies set by the Set-Cookie headers of RESP, the
+   response for U.  */
+
+static void
+resp_handle_set_cookies (const struct response *resp, const struct url *u)
+{
+  int scpos;
+  const char *scbeg, *scend;
+
+  /* The jar should have been created by now. */
+  assert (wget_cookie_jar != NULL);
+  for (scpos = 0;
+       (scpos = resp_header_locate (resp, "Set-Cookie", scpos,
+                                    &scbeg, &scend)) != -1;
+       ++scpos)
+    {
+      char buf[1024], *set_cookie;
+      size_t len = scend - scbeg;
+
+      if (len < sizeof (buf))
+        set_cookie = buf;
+      else
+        set_cookie = xmalloc (len + 1);
+
+      memcpy (set_cookie, scbeg, len);
+      set_cookie[len] = 0;
+
+      cookie_handle_set_cookie (wget_cookie_jar, u->host, u->port,
+                                u->path, set_cookie);
+
+      if (set_cookie != buf)
+        xfree (set_cookie);
+    }
+}
+
+#ifdef HAVE_HSTS
+/* Record the HSTS policy the Strict-Transport-Security header of
+   RESP, the response for U, announces.  */
+
+static void
+resp_handle_hsts (const struct response *resp, const struct url *u)
+{
+#ifdef TESTING
+  /* we don't link against main.o when we're testing */
+  hsts_store_t hsts_store = NULL;
+#else
+  extern hsts_store_t hsts_store;
+#endif
+
+  if (opt.hsts && hsts_store)
+    {
+      int64_t max_age;
+      const char *hsts_params = resp_header_strdup (resp, "Strict-Transport-Security");
+      bool include_subdomains;
+
+      if (parse_strict_transport_security (hsts_params, &max_age, &include_subdomains))
+        {
+          /* process strict transport security */
+          if (hsts_store_entry (hsts_store, u->scheme, u->host, u->port, max_age, include_subdomains))
+            DEBUGP(("Added new HSTS host: %s:%" PRIu32 " (max-age: %" PRId64 ", includeSubdomains: %s)\n",
+                   u->host,
+                   (uint32_t) u->port,
+                   max_age,
+                   (include_subdomains ? "true" : "false")));
+          else
+            DEBUGP(("Updated HSTS host: %s:%" PRIu32 " (max-age: %" PRId64 ", includeSubdomains: %s)\n",
+                   u->host,
+                   (uint32_t) u->port,
+                   max_age,
+                   (include_subdomains ? "true" : "false")));
+        }
+      xfree (hsts_params);
+    }
+}
+#endif
+
+#ifdef HAVE_HTTP3
+/* Record the HTTP/3 alternative the Alt-Svc header of RESP, the
+   response for U, announces, or its withdrawal.  Only those of HTTPS
+   origins are taken, whose certificate the alternative has to
+   present as well.  */
+
+static void
+resp_handle_altsvc (const struct response *resp, const struct url *u)
+{
+  char *value;
+
+  if (!opt.http3 || u->scheme != SCHEME_HTTPS)
+    return;
+  value = resp_header_strdup (resp, "Alt-Svc");
+  if (value)
+    {
+      altsvc_store (u->host, u->port, value);
+      xfree (value);
+    }
+}
+#endif
+
+/* Return true if the response to REQ may be taken from, and kept in,
+   the HTTP cache.  Only the plain GET requests whose body is saved as
+   it is to a file of its own qualify, and only those without
+   credentials: what they get is not for the other runs to see.  */
+
+static bool
+cache_usable_p (const struct http_stat *hs, int dt, const struct request *req,
+                const char *user, const char *passwd)
+{
+  if (!opt.http_cache || !opt.allow_cache
+      || (dt & (HEAD_ONLY | IF_MODIFIED_SINCE)))
+    return false;
+  if (strcmp (req->method, "GET") != 0 || opt.body_data || opt.body_file)
+    return false;
+  if (opt.output_document || opt.warc_filename || opt.timestamping
+      || opt.always_rest || opt.start_pos >= 0 || opt.spider
+      || opt.content_disposition || opt.save_headers || hs->restval)
+    return false;
+  return !user && !passwd;
+}
+
+/* Answer the request for U with the body hs->cache_entry names, which
+   is copied to the local file as the response would have been saved.
+   Returns false if the copy failed, in which case the file is to be
+   named anew from the response unless NAMED says it was named before
+   the cache was looked up.  */
+
+static bool
+cache_answer (struct url *u, struct url *original_url, struct http_stat *hs,
+              int *dt, bool named)
+{
+  const struct http_cache_entry *e = hs->cache_entry;
+  char *type = e->content_type ? xstrdup (e->content_type) : NULL;
+
+  if (type)
+    {
+      char *tmp = strchr (type, ';');
+      if (tmp)
+        {
+          char *charset = NULL;
+
+          if (!opt.encoding_remote)
+            charset = parse_charset (tmp + 1);
+
+          while (tmp > type && c_isspace (tmp[-1]))
+            --tmp;
+          *tmp = '\0';
+          if (charset)
+            {
+              xfree (u->content_enc);
+              u->content_enc = xstrdup (charset);
+              if (original_url != u)
+                {
+                  xfree (original_url->content_enc);
+                  original_url->content_enc = xstrdup (charset);
+                }
+              xfree (charset);
+            }
+        }
+    }
+  set_content_type (dt, type);
+  xfree (type);
+
+  hs->local_encoding = hs->remote_encoding = ENC_NONE;
+  if (opt.adjust_extension)
+    {
+      if (*dt & TEXTHTML)
+        ensure_extension (hs, ".html", dt);
+      else if (*dt & TEXTCSS)
+        ensure_extension (hs, ".css", dt);
+    }
+
+  if (!http_cache_copy (e, hs->local_file))
+    {
+      *dt &= ~ADDED_HTML_EXTENSION;
+      if (!named)
+        {
+          xfree (hs->local_file);
+          hs->existence_checked = false;
+        }
+      return false;
+    }
+  logprintf (LOG_VERBOSE, _("Copied %s from the HTTP cache.\n"),
+             quote (hs->local_file));
+
+  *dt |= RETROKF;
+  hs->statcode = HTTP_STATUS_OK;
+  xfree (hs->error);
+  hs->error = xstrdup ("OK");
+  hs->len = hs->contlen = e->size;
+  hs->res = 0;
+  hs->restval = 0;
+  hs->rd_size = 0;
+  hs->dltime = 0;
+  xfree (hs->remote_time);
+  hs->remote_time = e->last_modified ? xstrdup (e->last_modified) : NULL;
+  xfree (hs->etag);
+  hs->etag = e->etag ? xstrdup (e->etag) : NULL;
+  return true;
+}
+
+/* Retrieve a document through HTTP protocol.  It recognizes status
+   code, and correctly handles redirections.  It closes the network
+   socket.  If it receives an error from the functions below it, it
+   will print it if there is enough information to do so (almost
+   always), returning the error to the caller (i.e. http_loop).
+
+   Various HTTP parameters are stored to hs.
+
+   If PROXY is non-NULL, the connection will be made to the proxy
+   server, and u->url will be requested.  */
+static uerr_t
+gethttp (struct url *u, struct url *original_url, struct http_stat *hs,
+         int *dt, struct url *proxy, int count)
+{
+  struct request *req = NULL;
 
-        /* Handle Metalink resources.  */
-      else if (!strcmp (rel, "duplicate"))
-        {
-          metalink_resource_t mres = {0};
-          char *pristr;
+  char *type = NULL;
+  char *user, *passwd;
+  char *proxyauth;
+  int statcode;
+  int write_error;
+  wgint contlen, contrange;
+  const struct url *conn;
+  FILE *fp = NULL;
+  int err;
+  uerr_t retval;
 
-          /*
-             Valid ranges for the "pri" attribute are from
-             1 to 999999.  Mirror servers with a lower value of the "pri"
-             attribute have a higher priority, while mirrors with an undefined
-             "pri" attribute are considered to have a value of 999999, which is
-             the lowest priority.
+  int sock = -1;
 
-             rfc6249 section 3.1
-           */
-          mres.priority = DEFAULT_PRI;
-          if (find_key_value (url_end, val_end, "pri", &pristr))
-            {
-              long pri;
-              char *end_pristr;
-              /* Do not care for errno since 0 is error in this case.  */
-              pri = strtol (pristr, &end_pristr, 10);
-              if (end_pristr != pristr + strlen (pristr) ||
-                  !VALID_PRI_RANGE (pri))
-                {
-                  /* This is against the specification, so let's inform the user.  */
-                  logprintf (LOG_NOTQUIET,
-                             _("Invalid pri value. Assuming %d.\n"),
-                             DEFAULT_PRI);
-                }
-              else
-                mres.priority = pri;
-              xfree (pristr);
-            }
+  /* Set to 1 when the authorization has already been sent and should
+     not be tried again. */
+  bool auth_finished = false;
 
-          switch (url_scheme (urlstr))
-            {
-            case SCHEME_HTTP:
-              mres.type = xstrdup ("http");
-              break;
-#ifdef HAVE_SSL
-            case SCHEME_HTTPS:
-              mres.type = xstrdup ("https");
-              break;
-            case SCHEME_FTPS:
-              mres.type = xstrdup ("ftps");
-              break;
+  /* Set to 1 when just globally-set Basic authorization has been sent;
+   * should prevent further Basic negotiations, but not other
+   * mechanisms. */
+  bool basic_auth_finished = false;
+
+  /* Whether NTLM authentication is used for this request. */
+  bool ntlm_seen = false;
+
+#if defined ENABLE_NTLM && defined HAVE_WINTLS
+  /* The handshake started on a new connection, until the connection
+     is registered.  */
+  struct ntlmdata ntlm_ahead;
 #endif
-            case SCHEME_FTP:
-              mres.type = xstrdup ("ftp");
-              break;
-            default:
-              DEBUGP (("Unsupported url scheme in %s. Skipping resource.\n", urlstr));
-            }
 
-          if (mres.type)
-            {
-              DEBUGP (("TYPE=%s\n", mres.type));
+  /* Whether our connection to the remote host is through SSL.  */
+  bool using_ssl = false;
 
-              /* At this point we have validated the new resource.  */
+  /* Whether a HEAD request will be issued (as opposed to GET or
+     POST). */
+  bool head_only = !!(*dt & HEAD_ONLY);
 
-              find_key_value (url_end, val_end, "geo", &mres.location);
+  /* Whether conditional get request will be issued.  */
+  bool cond_get = !!(*dt & IF_MODIFIED_SINCE);
 
-              mres.url = urlstr;
-              urlstr = NULL;
+  /* Whether the response may come from, or go to, the HTTP cache, and
+     whether the local file had its name before.  */
+  bool use_cache, named = !!hs->local_file;
 
-              mres.preference = 0;
-              if (has_key (url_end, val_end, "pref"))
-                {
-                  DEBUGP (("This resource has preference\n"));
-                  mres.preference = 1;
-                }
+#ifdef HAVE_METALINK
+  /* Are we looking for metalink info in HTTP headers?  */
+  bool metalink = !!(*dt & METALINK_METADATA);
+#endif
 
-              /* 1 slot from new resource, 1 slot for null-termination.  */
-              mfile->resources = xrealloc (mfile->resources,
-                                           sizeof (metalink_resource_t *) * (res_count + 2));
-              mfile->resources[res_count] = xnew0 (metalink_resource_t);
-              *mfile->resources[res_count] = mres;
-              res_count++;
-            }
-        } /* Handle resource link (rel=duplicate).  */
+  char *head = NULL;
+  struct response *resp = NULL;
+  char hdrval[512];
+  char *message = NULL;
 
-      /* Handle Metalink/XML resources.  */
-      else if (reltype && !strcmp (reltype, "application/metalink4+xml"))
-        {
-          metalink_metaurl_t murl = {0};
-          char *pristr;
+  /* Declare WARC variables. */
+  bool warc_enabled = (opt.warc_filename != NULL);
+  FILE *warc_tmp = NULL;
+  char warc_timestamp_str [21];
+  char warc_request_uuid [48];
+  ip_address warc_ip_buf, *warc_ip = NULL;
+  off_t warc_payload_offset = -1;
 
-          /*
-             Valid ranges for the "pri" attribute are from
-             1 to 999999.  Mirror servers with a lower value of the "pri"
-             attribute have a higher priority, while mirrors with an undefined
-             "pri" attribute are considered to have a value of 999999, which is
-             the lowest priority.
+  /* Whether this connection will be kept alive after the HTTP request
+     is done. */
+  bool keep_alive;
 
-             rfc6249 section 3.1
-           */
-          murl.priority = DEFAULT_PRI;
-          if (find_key_value (url_end, val_end, "pri", &pristr))
-            {
-              long pri;
-              char *end_pristr;
-              /* Do not care for errno since 0 is error in this case.  */
-              pri = strtol (pristr, &end_pristr, 10);
-              if (end_pristr != pristr + strlen (pristr) ||
-                  !VALID_PRI_RANGE (pri))
-                {
-                  /* This is against the specification, so let's inform the user.  */
-                  logprintf (LOG_NOTQUIET,
-                             _("Invalid pri value. Assuming %d.\n"),
-                             DEFAULT_PRI);
-                }
-              else
-                murl.priority = pri;
-              xfree (pristr);
-            }
+  /* Is the server using the chunked transfer encoding?  */
+  bool chunked_transfer_encoding = false;
 
-          murl.mediatype = xstrdup (reltype);
+  /* Whether the request was sent ahead with an earlier one.  */
+  bool pipelined = false;
 
-          DEBUGP (("MEDIATYPE=%s\n", murl.mediatype));
+  /* When the request went out, for the metrics and on the clock of
+     the per-host measurements.  */
+  double request_tm, link_tm;
 
-          /* At this point we have validated the new resource.  */
+#ifdef HAVE_NGHTTP2
+  /* Whether the request was sent again on a new connection after the
+     HTTP/2 session it was to be sent on failed.  */
+  bool h2_retried = false;
+#endif
+#ifdef HAVE_HTTP3
+  /* Likewise for an HTTP/3 session.  */
+  bool h3_retried = false;
+#endif
 
-          find_key_value (url_end, val_end, "name", &murl.name);
+  /* Whether keep-alive should be inhibited.  */
+  bool inhibit_keep_alive =
+    !opt.http_keep_alive || opt.ignore_length;
 
-          murl.url = urlstr;
-          urlstr = NULL;
+  /* Headers sent when using POST. */
+  wgint body_data_size = 0;
 
-          /* 1 slot from new resource, 1 slot for null-termination.  */
-          mfile->metaurls = xrealloc (mfile->metaurls,
-                                       sizeof (metalink_metaurl_t *) * (meta_count + 2));
-          mfile->metaurls[meta_count] = xnew0 (metalink_metaurl_t);
-          *mfile->metaurls[meta_count] = murl;
-          meta_count++;
-        } /* Handle resource link (rel=describedby).  */
-      else
-        DEBUGP (("This link header was not used for Metalink\n"));
+#if defined ENABLE_NTLM && defined HAVE_WINTLS
+  xzero (ntlm_ahead);
+#endif
 
-      xfree (urlstr);
-      xfree (reltype);
-      xfree (rel);
-    } /* Iterate over link headers.  */
+#ifdef HAVE_SSL
+  if (u->scheme == SCHEME_HTTPS)
+    {
+      /* Initialize the SSL context.  After this has once been done,
+         it becomes a no-op.  */
+      if (!ssl_init ())
+        {
+          scheme_disable (SCHEME_HTTPS);
+          logprintf (LOG_NOTQUIET,
+                     _("Disabling SSL due to encountered errors.\n"));
+          retval = SSLINITFAILED;
+          goto cleanup;
+        }
+    }
+#endif /* HAVE_SSL */
 
-  /* Null-terminate resources array.  */
-  mfile->resources[res_count] = 0;
-  mfile->metaurls[meta_count] = 0;
+  /* Initialize certain elements of struct http_stat.
+   * Since this function is called in a loop, we have to xfree certain
+   * members. */
+  hs->len = 0;
+  hs->contlen = -1;
+  hs->res = -1;
+  hs->retry_after = 0;
+  xfree (hs->rderrmsg);
+  xfree (hs->newloc);
+  xfree (hs->remote_time);
+  xfree (hs->etag);
+  xfree (hs->error);
+  xfree (hs->message);
+  hs->local_encoding = ENC_NONE;
+  hs->remote_encoding = ENC_NONE;
+  hs->captured = false;
+  http_cache_entry_free (&hs->cache_entry);
+  hs->cache_store = false;
+
+  conn = u;
+
+  {
+    uerr_t ret;
+    req = initialize_request (u, hs, dt, proxy, inhibit_keep_alive,
+                              &basic_auth_finished, &body_data_size,
+                              &user, &passwd, &ret);
+    if (req == NULL)
+      {
+        retval = ret;
+        goto cleanup;
+      }
+  }
+
+  /* A fresh copy in the HTTP cache is used as it is; the server is
+     asked whether a stale one still holds.  */
+  use_cache = cache_usable_p (hs, *dt, req, user, passwd);
+  if (use_cache)
+    {
+      hs->cache_entry = http_cache_lookup (u->url);
+      if (hs->cache_entry && http_cache_fresh_p (hs->cache_entry))
+        {
+          uerr_t ret = check_file_output (u, hs, NULL, hdrval, sizeof hdrval);
+          if (ret != RETROK)
+            {
+              retval = ret;
+              goto cleanup;
+            }
+          if (cache_answer (u, original_url, hs, dt, named))
+            {
+              retval = RETRFINISHED;
+              goto cleanup;
+            }
+          http_cache_entry_free (&hs->cache_entry);
+        }
+      if (hs->cache_entry)
+        {
+          request_set_header (req, "If-None-Match", hs->cache_entry->etag,
+                              rel_none);
+          request_set_header (req, "If-Modified-Since",
+                              hs->cache_entry->last_modified, rel_none);
+        }
+    }
+
+ retry_with_auth:
+  /* We need to come back here when the initial attempt to retrieve
+     without authorization header fails.  (Expected to happen at least
+     for the Digest authorization scheme.)  */
+
+  request_add_session_headers (req, u);
+
+  proxyauth = NULL;
+  if (proxy)
+    {
+      conn = proxy;
+      initialize_proxy_configuration (u, req, proxy, &proxyauth);
+    }
+  keep_alive = true;
+
+  /* Establish the connection.  */
+  if (inhibit_keep_alive)
+    keep_alive = false;
 
-  if (res_count == 0 && meta_count == 0)
+ send_request:
+  /* The request may have been sent ahead with the previous one.  */
+  pipelined = pipeline_take (u, req);
+  if (pipelined)
     {
-      DEBUGP (("No valid metalink references found.\n"));
-      goto fail;
+      sock = pconn.socket;
+      using_ssl = pconn.ssl;
+      logprintf (LOG_VERBOSE,
+                 _("Request was pipelined on the connection to %s:%d.\n"),
+                 quotearg_style (escape_quoting_style, pconn.host),
+                 pconn.port);
+      metrics_reused ();
+      STATS_ADD (STATS_PCONN_HIT, 0);
+      goto request_sent;
     }
 
-  /* Find all Digest headers.  */
-  for (i = 0;
-       (i = resp_header_locate (resp, "Digest", i, &val_beg, &val_end)) != -1;
-       i++)
+  {
+    uerr_t conn_err = establish_connection (u, &conn, hs, proxy, &proxyauth, &req,
+                                            &using_ssl, inhibit_keep_alive, &sock);
+    if (conn_err != RETROK)
+      {
+        retval = conn_err;
+        goto cleanup;
+      }
+  }
+
+#ifdef HAVE_HTTP3
+  if (http3_session_p (sock))
     {
-      const char *dig_pos;
-      char *dig_type, *dig_hash;
+      int h3sock = sock;
 
-      /* Each Digest header can include multiple hashes. Example:
-           Digest: SHA=thvDyvhfIqlvFe+A9MYgxAfm1q5=,unixsum=30637
-           Digest: md5=HUXZLQLMuI/KZ5KDcJPcOA==
-       */
-      for (dig_pos = val_beg;
-           (dig_pos = find_key_values (dig_pos, val_end, &dig_type, &dig_hash));
-           dig_pos++)
+      sock = request_send_http3 (req, u, h3sock);
+      if (sock < 0)
         {
-          /* The hash here is assumed to be base64. We need the hash in hex.
-             Therefore we convert: base64 -> binary -> hex.  */
-          const size_t dig_hash_str_len = strlen (dig_hash);
-          char bin_hash[256];
-          ssize_t hash_bin_len;
-
-          // there is no hash with that size
-          if (dig_hash_str_len >= sizeof (bin_hash))
+          /* The session went away while idle, or its resumed handshake
+             failed, after which the alternative isn't used; a new
+             connection is tried once.  */
+          http3_session_close (h3sock);
+          if (!h3_retried)
             {
-              DEBUGP (("Hash too long, ignored.\n"));
-              xfree (dig_type);
-              xfree (dig_hash);
-              continue;
+              h3_retried = true;
+              goto send_request;
             }
+          retval = WRITEFAILED;
+          goto cleanup;
+        }
+      /* The stream is done with once the response is read.  */
+      keep_alive = false;
+      goto request_sent;
+    }
+#endif
 
-          hash_bin_len = wget_base64_decode (dig_hash, bin_hash, dig_hash_str_len * 3 / 4 + 1);
+#ifdef HAVE_NGHTTP2
+  if (http2_session_p (sock))
+    {
+      int h2sock = sock;
 
-          /* Detect malformed base64 input.  */
-          if (hash_bin_len < 0)
+      sock = http2_take (u, req);
+      if (sock >= 0)
+        logputs (LOG_VERBOSE, _("Request was sent ahead on the HTTP/2 "
+                                "connection.\n"));
+      else
+        sock = request_send_http2 (req, u, h2sock);
+      if (sock < 0)
+        {
+          /* The session went away while idle; a new connection is
+             tried once.  */
+          http2_session_close (h2sock);
+          if (!h2_retried)
             {
-              DEBUGP (("Malformed base64 input, ignored.\n"));
-              xfree (dig_type);
-              xfree (dig_hash);
-              continue;
+              h2_retried = true;
+              goto send_request;
             }
+          retval = WRITEFAILED;
+          goto cleanup;
+        }
+      /* The stream is done with once the response is read.  */
+      keep_alive = false;
+      if (send_ahead_p (req))
+        http2_send_ahead (u, h2sock);
+      goto request_sent;
+    }
+#endif
 
-          /* One slot for me, one for zero-termination.  */
-          mfile->checksums =
-                  xrealloc (mfile->checksums,
-                            sizeof (metalink_checksum_t *) * (hash_count + 2));
-          mfile->checksums[hash_count] = xnew (metalink_checksum_t);
-          mfile->checksums[hash_count]->type = dig_type;
+#if defined ENABLE_NTLM && defined HAVE_WINTLS
+  if (!proxy && !ntlm_seen && !auth_finished
+      && !(pconn_active && pconn.socket == sock)
+      && maybe_send_sspi_token (conn->host, conn->port, user, passwd,
+                                &ntlm_ahead, req))
+    ntlm_seen = true;
+#endif
 
-          mfile->checksums[hash_count]->hash = xmalloc ((size_t)hash_bin_len * 2 + 1);
-          wg_hex_to_string (mfile->checksums[hash_count]->hash, bin_hash, (size_t)hash_bin_len);
+  /* Open the temporary file where we will write the request. */
+  if (warc_enabled)
+    {
+      warc_tmp = warc_tempfile ();
+      if (warc_tmp == NULL)
+        {
+          CLOSE_INVALIDATE (sock);
+          retval = WARC_TMP_FOPENERR;
+          goto cleanup;
+        }
 
-          xfree (dig_hash);
+      if (! proxy)
+        {
+          warc_ip = &warc_ip_buf;
+          socket_ip_address (sock, warc_ip, ENDPOINT_PEER);
+        }
+    }
 
-          hash_count++;
+  /* Send the request to server.  */
+  write_error = request_send (req, sock, warc_tmp);
+
+  if (write_error >= 0)
+    {
+      if (opt.body_data)
+        {
+          DEBUGP (("[BODY data: %s]\n", opt.body_data));
+          write_error = fd_write (sock, opt.body_data, body_data_size, -1);
+          if (write_error >= 0 && warc_tmp != NULL)
+            {
+              int warc_tmp_written;
+
+              /* Remember end of headers / start of payload. */
+              warc_payload_offset = ftello (warc_tmp);
+
+              /* Write a copy of the data to the WARC record. */
+              warc_tmp_written = fwrite (opt.body_data, 1, body_data_size, warc_tmp);
+              if (warc_tmp_written != body_data_size)
+                write_error = -2;
+            }
+         }
+      else if (opt.body_file && body_data_size != 0)
+        {
+          if (warc_tmp != NULL)
+            /* Remember end of headers / start of payload */
+            warc_payload_offset = ftello (warc_tmp);
+
+          write_error = body_file_send (sock, opt.body_file, body_data_size, warc_tmp);
         }
     }
 
-  /* Zero-terminate checksums array.  */
-  mfile->checksums[hash_count] = 0;
+  if (write_error < 0)
+    {
+      CLOSE_INVALIDATE (sock);
 
-  /*
-    If Instance Digests are not provided by the Metalink servers, the
-    Link header fields pertaining to this specification MUST be ignored.
+      if (warc_tmp != NULL)
+        fclose (warc_tmp);
 
-    rfc6249 section 6
-   */
-  if (res_count && hash_count == 0)
+      if (write_error == -2)
+        retval = WARC_TMP_FWRITEERR;
+      else
+        retval = WRITEFAILED;
+      goto cleanup;
+    }
+
+ request_sent:
+  request_tm = metrics_now ();
+  link_tm = host_link_now ();
+  if (pipeline_allowed_p (u, proxy, req, sock))
+    pipeline_send_ahead (u, sock);
+
+  logprintf (LOG_VERBOSE, _("%s request sent, awaiting response... "),
+             proxy ? "Proxy" : "HTTP");
+  contlen = -1;
+  contrange = 0;
+  *dt &= ~RETROKF;
+
+
+  if (warc_enabled)
     {
-      logputs (LOG_VERBOSE,
-               _("Could not find acceptable digest for Metalink resources.\n"
-                 "Ignoring them.\n"));
-      goto fail;
+      bool warc_result;
+
+      /* Generate a timestamp and uuid for this request. */
+      warc_timestamp (warc_timestamp_str, sizeof (warc_timestamp_str));
+      warc_uuid_str (warc_request_uuid, sizeof (warc_request_uuid));
+
+      /* Create a request record and store it in the WARC file. */
+      warc_result = warc_write_request_record (u->url, warc_timestamp_str,
+                                               warc_request_uuid, warc_ip,
+                                               warc_tmp, warc_payload_offset);
+      if (! warc_result)
+        {
+          CLOSE_INVALIDATE (sock);
+          retval = WARC_ERR;
+          goto cleanup;
+        }
+
+      /* warc_write_request_record has also closed warc_tmp. */
     }
 
-  /* Metalink data is OK. Now we just need to sort the resources based
-     on their priorities, preference, and perhaps location.  */
-  stable_sort (mfile->resources, res_count, sizeof (metalink_resource_t *), metalink_res_cmp);
-  stable_sort (mfile->metaurls, meta_count, sizeof (metalink_metaurl_t *), metalink_meta_cmp);
+  if (pipelined && !pipeline_response_arrives (sock))
+    {
+      pipeline_refused (u->host);
+      CLOSE_INVALIDATE (sock);
+      goto send_request;
+    }
 
-  /* Restore sensible preference values (in case someone cares to look).  */
-  for (i = 0; i < res_count; ++i)
-    mfile->resources[i]->preference = 1000000 - mfile->resources[i]->priority;
+  /* Repeat while we receive a 10x response code.  */
+  {
+    bool _repeat;
 
-  metalink = xnew0 (metalink_t);
-  metalink->files = xmalloc (sizeof (metalink_file_t *) * 2);
-  metalink->files[0] = mfile;
-  metalink->files[1] = 0;
-  metalink->origin = xstrdup (u->url);
-  metalink->version = METALINK_VERSION_4;
-  /* Leave other fields set to 0.  */
+    do
+      {
+        head = read_http_response_head (sock);
+        if (!head && pipelined)
+          {
+            /* The server dropped or ignored the requests sent
+               ahead; ask again on a new connection.  */
+            pipeline_refused (u->host);
+            CLOSE_INVALIDATE (sock);
+            goto send_request;
+          }
+        if (!head)
+          {
+            if (errno == 0)
+              {
+                logputs (LOG_NOTQUIET, _("No data received.\n"));
+                CLOSE_INVALIDATE (sock);
+                retval = HEOF;
+              }
+            else
+              {
+                bool reset = errno == ECONNRESET;
+                logprintf (LOG_NOTQUIET, _("Read error (%s) in headers.\n"),
+                           fd_errstr (sock));
+                CLOSE_INVALIDATE (sock);
+                if (reset)
+                  host_link_status (u->host, 1, 0);
+                retval = HERR;
+              }
+            goto cleanup;
+          }
+        metrics_phase (METRICS_TTFB, request_tm);
+        /* A response sent ahead may have waited for others.  */
+        if (!pipelined)
+          host_link_ttfb (u->host, 1, host_link_now () - link_tm);
+        DEBUGP (("\n---response begin---\n%s---response end---\n", head));
 
-  return metalink;
+        resp = resp_new (head);
 
-fail:
-  /* Free all allocated memory.  */
-  if (metalink)
-    metalink_delete (metalink);
-  else
-    metalink_file_delete (mfile);
-  return NULL;
-}
-#endif /* HAVE_METALINK */
+        /* Check for status line.  */
+        xfree (message);
+        statcode = resp_status (resp, &message);
+        if (statcode < 0 && pipelined)
+          {
+            xfree (head);
+            resp_free (&resp);
+            pipeline_refused (u->host);
+            CLOSE_INVALIDATE (sock);
+            goto send_request;
+          }
+        if (statcode < 0)
+          {
+            char *tms = datetime_str (time (NULL));
+            logprintf (LOG_VERBOSE, "%d\n", statcode);
+            logprintf (LOG_NOTQUIET, _("%s ERROR %d: %s.\n"), tms, statcode,
+                       quotearg_style (escape_quoting_style,
+                                       _("Malformed status line")));
+            CLOSE_INVALIDATE (sock);
+            retval = HERR;
+            goto cleanup;
+          }
 
-/* Retrieve a document through HTTP protocol.  It recognizes status
-   code, and correctly handles redirections.  It closes the network
-   socket.  If it receives an error from the functions below it, it
-   will print it if there is enough information to do so (almost
-   always), returning the error to the caller (i.e. http_loop).
+        if (H_10X (statcode))
+          {
+            xfree (head);
+            resp_free (&resp);
+            _repeat = true;
+            DEBUGP (("Ignoring response\n"));
+          }
+        else
+          {
+            _repeat = false;
+          }
+      }
+    while (_repeat);
+  }
 
-   Various HTTP parameters are stored to hs.
+  xfree (hs->message);
+  hs->message = xstrdup (message);
+  if (!opt.server_response)
+    logprintf (LOG_VERBOSE, "%2d %s\n", statcode,
+               message ? quotearg_style (escape_quoting_style, message) : "");
+  else
+    {
+      logprintf (LOG_VERBOSE, "\n");
+      print_server_response (resp, "  ");
+    }
 
-   If PROXY is non-NULL, the connection will be made to the proxy
-   server, and u->url will be requested.  */
-static uerr_t
-gethttp (struct url *u, struct url *original_url, struct http_stat *hs,
-         int *dt, struct url *proxy, int count)
-{
-  struct request *req = NULL;
+  if (!opt.ignore_length
+      && resp_header_copy (resp, "Content-Length", hdrval, sizeof (hdrval)))
+    {
+      wgint parsed;
+      errno = 0;
+      parsed = str_to_wgint (hdrval, NULL, 10);
+      if (parsed == WGINT_MAX && errno == ERANGE)
+        {
+          /* Out of range.
+             #### If Content-Length is out of range, it most likely
+             means that the file is larger than 2G and that we're
+             compiled without LFS.  In that case we should probably
+             refuse to even attempt to download the file.  */
+          contlen = -1;
+        }
+      else if (parsed < 0)
+        {
+          /* Negative Content-Length; nonsensical, so we can't
+             assume any information about the content to receive. */
+          contlen = -1;
+        }
+      else
+        contlen = parsed;
+    }
 
-  char *type = NULL;
-  char *user, *passwd;
-  char *proxyauth;
-  int statcode;
-  int write_error;
-  wgint contlen, contrange;
-  const struct url *conn;
-  FILE *fp;
-  int err;
-  uerr_t retval;
-#ifdef HAVE_HSTS
-#ifdef TESTING
-  /* we don't link against main.o when we're testing */
-  hsts_store_t hsts_store = NULL;
-#else
-  extern hsts_store_t hsts_store;
-#endif
-#endif
+  /* Check for keep-alive related responses. */
+  if (!inhibit_keep_alive)
+    {
+      if (resp_header_copy (resp, "Connection", hdrval, sizeof (hdrval)))
+        {
+          if (0 == c_strcasecmp (hdrval, "Close"))
+            keep_alive = false;
+        }
+    }
 
-  int sock = -1;
+  chunked_transfer_encoding = false;
+  if (resp_header_copy (resp, "Transfer-Encoding", hdrval, sizeof (hdrval))
+      && 0 == c_strcasecmp (hdrval, "chunked"))
+    chunked_transfer_encoding = true;
 
-  /* Set to 1 when the authorization has already been sent and should
-     not be tried again. */
-  bool auth_finished = false;
+  /* Handle (possibly multiple instances of) the Set-Cookie header. */
+  if (opt.cookies)
+    resp_handle_set_cookies (resp, u);
 
-  /* Set to 1 when just globally-set Basic authorization has been sent;
-   * should prevent further Basic negotiations, but not other
-   * mechanisms. */
-  bool basic_auth_finished = false;
+  if (keep_alive)
+    {
+      /* The server has promised that it will not close the connection
+         when we're done.  This means that we can register it.  */
+      register_persistent (conn->host, conn->port, sock, using_ssl);
+#if defined ENABLE_NTLM && defined HAVE_WINTLS
+      if (ntlm_ahead.state != NTLMSTATE_NONE)
+        {
+          pconn.ntlm = ntlm_ahead;
+          xzero (ntlm_ahead);
+        }
+#endif
+    }
 
-  /* Whether NTLM authentication is used for this request. */
-  bool ntlm_seen = false;
+  /* Detect charset for content */
+  type = resp_header_strdup (resp, "Content-Type");
+  if (type)
+    {
+      char *tmp = strchr (type, ';');
+      if (tmp)
+        {
+          char *tmp2 = tmp + 1;
 
-  /* Whether our connection to the remote host is through SSL.  */
-  bool using_ssl = false;
+          while (tmp > type && c_isspace (tmp[-1]))
+            --tmp;
+          *tmp = '\0';
 
-  /* Whether a HEAD request will be issued (as opposed to GET or
-     POST). */
-  bool head_only = !!(*dt & HEAD_ONLY);
+          /* Try to get remote encoding if needed.
+             Still need it to encode the local file name correctly. */
+          /* As info. We need be aware of different charset. */
+          if (!opt.encoding_remote)
+            {
+              tmp = parse_charset (tmp2);
+              if (tmp)
+                {
+                  DEBUGP (("charset found in headers: %s\n", tmp));
+                  /* u is new; original_url will be used to for '-r'. */
+                  u->content_enc = xstrdup (tmp);
+                  original_url->content_enc = xstrdup (tmp);
+                }
+              xfree (tmp);
+            }
+        }
+    }
 
-  /* Whether conditional get request will be issued.  */
-  bool cond_get = !!(*dt & IF_MODIFIED_SINCE);
+  set_content_type (dt, type);
 
 #ifdef HAVE_METALINK
-  /* Are we looking for metalink info in HTTP headers?  */
-  bool metalink = !!(*dt & METALINK_METADATA);
+  /* We need to check for the Metalink data in the very first response
+     we get from the server (before redirections, authorization, etc.).  */
+  if (metalink)
+    {
+      hs->metalink = metalink_from_http (resp, hs, u);
+      /* Bugfix: hs->local_file is NULL (opt.content_disposition).  */
+      if (!hs->local_file && hs->metalink && hs->metalink->origin)
+        hs->local_file = xstrdup (hs->metalink->origin);
+      xfree (hs->message);
+      retval = RETR_WITH_METALINK;
+      CLOSE_FINISH (sock);
+      goto cleanup;
+    }
 #endif
 
-  char *head = NULL;
-  struct response *resp = NULL;
-  char hdrval[512];
-  char *message = NULL;
-
-  /* Declare WARC variables. */
-  bool warc_enabled = (opt.warc_filename != NULL);
-  FILE *warc_tmp = NULL;
-  char warc_timestamp_str [21];
-  char warc_request_uuid [48];
-  ip_address warc_ip_buf, *warc_ip = NULL;
-  off_t warc_payload_offset = -1;
-
-  /* Whether this connection will be kept alive after the HTTP request
-     is done. */
-  bool keep_alive;
-
-  /* Is the server using the chunked transfer encoding?  */
-  bool chunked_transfer_encoding = false;
+  if (statcode == HTTP_STATUS_UNAUTHORIZED)
+    {
+      /* Authorization is required.  */
+      uerr_t auth_err = RETROK;
+      bool retry;
+      /* Normally we are not interested in the response body.
+         But if we are writing a WARC file we are: we like to keep everything.  */
+      if (warc_enabled)
+        {
+          int _err;
+          _err = read_response_body (hs, sock, NULL, contlen, 0,
+                                    chunked_transfer_encoding,
+                                    u, warc_timestamp_str,
+                                    warc_request_uuid, warc_ip, type,
+                                    statcode, head);
 
-  /* Whether keep-alive should be inhibited.  */
-  bool inhibit_keep_alive =
-    !opt.http_keep_alive || opt.ignore_length;
+          if (_err != RETRFINISHED || hs->res < 0)
+            {
+              CLOSE_INVALIDATE (sock);
+              retval = _err;
+              goto cleanup;
+            }
+          else
+            CLOSE_FINISH (sock);
+        }
+      else
+        {
+          /* Since WARC is disabled, we are not interested in the response body.  */
+          if (keep_alive && !head_only
+              && skip_short_body (sock, u->host, contlen,
+                                  chunked_transfer_encoding))
+            CLOSE_FINISH (sock);
+          else
+            CLOSE_INVALIDATE (sock);
+        }
 
-  /* Headers sent when using POST. */
-  wgint body_data_size = 0;
+      pconn.authorized = false;
 
-#ifdef HAVE_SSL
-  if (u->scheme == SCHEME_HTTPS)
+      {
+        auth_err = check_auth (u, user, passwd, resp, req,
+                               &ntlm_seen, &retry,
+                               &basic_auth_finished,
+                               &auth_finished);
+        if (auth_err == RETROK && retry)
+          {
+            resp_free (&resp);
+            xfree (message);
+            xfree (head);
+            goto retry_with_auth;
+          }
+      }
+      if (auth_err == RETROK)
+        retval = AUTHFAILED;
+      else
+        retval = auth_err;
+      goto cleanup;
+    }
+  else /* statcode != HTTP_STATUS_UNAUTHORIZED */
     {
-      /* Initialize the SSL context.  After this has once been done,
-         it becomes a no-op.  */
-      if (!ssl_init ())
+      /* Kludge: if NTLM is used, mark the TCP connection as authorized. */
+      if (ntlm_seen)
         {
-          scheme_disable (SCHEME_HTTPS);
-          logprintf (LOG_NOTQUIET,
-                     _("Disabling SSL due to encountered errors.\n"));
-          retval = SSLINITFAILED;
-          goto cleanup;
+          pconn.authorized = true;
+#if defined ENABLE_NTLM && defined HAVE_WINTLS
+          if (!proxy && keep_alive && pconn.ntlm.package)
+            register_sspi_auth_host (conn->host, conn->port,
+                                     pconn.ntlm.package);
+#endif
         }
     }
-#endif /* HAVE_SSL */
-
-  /* Initialize certain elements of struct http_stat.
-   * Since this function is called in a loop, we have to xfree certain
-   * members. */
-  hs->len = 0;
-  hs->contlen = -1;
-  hs->res = -1;
-  xfree (hs->rderrmsg);
-  xfree (hs->newloc);
-  xfree (hs->remote_time);
-  xfree (hs->error);
-  xfree (hs->message);
-  hs->local_encoding = ENC_NONE;
-  hs->remote_encoding = ENC_NONE;
-
-  conn = u;
 
   {
-    uerr_t ret;
-    req = initialize_request (u, hs, dt, proxy, inhibit_keep_alive,
-                              &basic_auth_finished, &body_data_size,
-                              &user, &passwd, &ret);
-    if (req == NULL)
+    uerr_t ret = check_file_output (u, hs, resp, hdrval, sizeof hdrval);
+    if (ret != RETROK)
       {
         retval = ret;
         goto cleanup;
       }
   }
- retry_with_auth:
-  /* We need to come back here when the initial attempt to retrieve
-     without authorization header fails.  (Expected to happen at least
-     for the Digest authorization scheme.)  */
 
-  if (opt.cookies)
-    request_set_header (req, "Cookie",
-                        cookie_header (wget_cookie_jar,
-                                       u->host, u->port, u->path,
-#ifdef HAVE_SSL
-                                       u->scheme == SCHEME_HTTPS
-#else
-                                       0
+  hs->statcode = statcode;
+  metrics_status (statcode);
+  host_link_status (u->host, 1, statcode);
+  if (host_backed_off (u->host))
+    metrics_budget (host_budget (u->host));
+  xfree (hs->error);
+  if (statcode == -1)
+    hs->error = xstrdup (_("Malformed status line"));
+  else if (!message || !*message)
+    hs->error = xstrdup (_("(no description)"));
+  else
+    hs->error = xstrdup (message);
+
+#ifdef HAVE_HSTS
+  resp_handle_hsts (resp, u);
+#endif
+#ifdef HAVE_HTTP3
+  resp_handle_altsvc (resp, u);
 #endif
-                                       ),
-                        rel_value);
 
-  /* Add the user headers. */
-  if (opt.user_headers)
+  xfree (hs->newloc);
+  hs->newloc = resp_header_strdup (resp, "Location");
+  xfree (hs->remote_time);
+  hs->remote_time = resp_header_strdup (resp, "Last-Modified");
+  if (!hs->remote_time) // now look for the Wayback Machine's timestamp
+    hs->remote_time = resp_header_strdup (resp, "X-Archive-Orig-last-modified");
+  xfree (hs->etag);
+  hs->etag = resp_header_strdup (resp, "ETag");
+  if ((statcode == HTTP_STATUS_UNAVAILABLE
+       || statcode == HTTP_STATUS_TOO_MANY_REQUESTS)
+      && resp_header_copy (resp, "Retry-After", hdrval, sizeof (hdrval)))
+    hs->retry_after = retry_after_seconds (hdrval);
+
+  if (resp_header_copy (resp, "Content-Range", hdrval, sizeof (hdrval)))
     {
-      int i;
-      for (i = 0; opt.user_headers[i]; i++)
-        request_set_user_header (req, opt.user_headers[i]);
+      wgint first_byte_pos, last_byte_pos, entity_length;
+      if (parse_content_range (hdrval, &first_byte_pos, &last_byte_pos,
+                               &entity_length))
+        {
+          contrange = first_byte_pos;
+          contlen = last_byte_pos - first_byte_pos + 1;
+        }
     }
 
-  proxyauth = NULL;
-  if (proxy)
+  if (resp_header_copy (resp, "Content-Encoding", hdrval, sizeof (hdrval)))
     {
-      conn = proxy;
-      initialize_proxy_configuration (u, req, proxy, &proxyauth);
-    }
-  keep_alive = true;
+      hs->local_encoding = ENC_INVALID;
 
-  /* Establish the connection.  */
-  if (inhibit_keep_alive)
-    keep_alive = false;
+      switch (hdrval[0])
+        {
+        case 'b': case 'B':
+          if (0 == c_strcasecmp(hdrval, "br"))
+            hs->local_encoding = ENC_BROTLI;
+          break;
+        case 'c': case 'C':
+          if (0 == c_strcasecmp(hdrval, "compress"))
+            hs->local_encoding = ENC_COMPRESS;
+          break;
+        case 'd': case 'D':
+          if (0 == c_strcasecmp(hdrval, "deflate"))
+            hs->local_encoding = ENC_DEFLATE;
+          break;
+        case 'g': case 'G':
+          if (0 == c_strcasecmp(hdrval, "gzip"))
+            hs->local_encoding = ENC_GZIP;
+          break;
+        case 'i': case 'I':
+          if (0 == c_strcasecmp(hdrval, "identity"))
+            hs->local_encoding = ENC_NONE;
+          break;
+        case 'x': case 'X':
+          if (0 == c_strcasecmp(hdrval, "x-compress"))
+            hs->local_encoding = ENC_COMPRESS;
+          else if (0 == c_strcasecmp(hdrval, "x-gzip"))
+            hs->local_encoding = ENC_GZIP;
+          break;
+        case 'z': case 'Z':
+          if (0 == c_strcasecmp(hdrval, "zstd"))
+            hs->local_encoding = ENC_ZSTD;
+          break;
+        case '\0':
+          hs->local_encoding = ENC_NONE;
+        }
 
-  {
-    uerr_t conn_err = establish_connection (u, &conn, hs, proxy, &proxyauth, &req,
-                                            &using_ssl, inhibit_keep_alive, &sock);
-    if (conn_err != RETROK)
-      {
-        retval = conn_err;
-        goto cleanup;
-      }
-  }
+      if (hs->local_encoding == ENC_INVALID)
+        {
+          DEBUGP (("Unrecognized Content-Encoding: %s\n", hdrval));
+          hs->local_encoding = ENC_NONE;
+        }
+#ifdef HAVE_LIBZ
+      else if (hs->local_encoding == ENC_GZIP
+               && opt.compression != compression_none)
+        {
+          const char *p;
 
-  /* Open the temporary file where we will write the request. */
-  if (warc_enabled)
-    {
-      warc_tmp = warc_tempfile ();
-      if (warc_tmp == NULL)
+          /* Make sure the Content-Type is not gzip before decompressing */
+          if (type)
+            {
+              p = strchr (type, '/');
+              if (p == NULL)
+                {
+                  hs->remote_encoding = ENC_GZIP;
+                  hs->local_encoding = ENC_NONE;
+                }
+              else
+                {
+                  p++;
+                  if (c_tolower(p[0]) == 'x' && p[1] == '-')
+                    p += 2;
+                  if (0 != c_strcasecmp (p, "gzip"))
+                    {
+                      hs->remote_encoding = ENC_GZIP;
+                      hs->local_encoding = ENC_NONE;
+                    }
+                }
+            }
+          else
+            {
+               hs->remote_encoding = ENC_GZIP;
+               hs->local_encoding = ENC_NONE;
+            }
+
+          /* don't uncompress if a file ends with '.gz' or '.tgz' */
+          if (hs->remote_encoding == ENC_GZIP
+              && (p = strrchr(u->file, '.'))
+              && (c_strcasecmp(p, ".gz") == 0 || c_strcasecmp(p, ".tgz") == 0))
+            {
+               DEBUGP (("Enabling broken server workaround. Will not decompress this GZip file.\n"));
+               hs->remote_encoding = ENC_NONE;
+            }
+        }
+#endif
+#ifdef HAVE_LIBBROTLIDEC
+      else if (hs->local_encoding == ENC_BROTLI
+               && opt.compression != compression_none)
         {
-          CLOSE_INVALIDATE (sock);
-          retval = WARC_TMP_FOPENERR;
-          goto cleanup;
+          hs->remote_encoding = ENC_BROTLI;
+          hs->local_encoding = ENC_NONE;
+        }
+#endif
+#ifdef HAVE_LIBZSTD
+      else if (hs->local_encoding == ENC_ZSTD
+               && opt.compression != compression_none)
+        {
+          hs->remote_encoding = ENC_ZSTD;
+          hs->local_encoding = ENC_NONE;
         }
+#endif
+    }
 
-      if (! proxy)
+  if (hs->cache_entry && statcode == HTTP_STATUS_NOT_MODIFIED)
+    {
+      time_t fresh_until;
+
+      CLOSE_FINISH (sock);
+      if (response_cacheable_p (resp, &fresh_until))
+        http_cache_refresh (hs->cache_entry, fresh_until);
+      if (cache_answer (u, original_url, hs, dt, named))
         {
-          warc_ip = &warc_ip_buf;
-          socket_ip_address (sock, warc_ip, ENDPOINT_PEER);
+          retval = RETRFINISHED;
+          goto cleanup;
         }
+
+      /* The body is retrieved after all.  */
+      request_remove_header (req, "If-None-Match");
+      request_remove_header (req, "If-Modified-Since");
+      http_cache_entry_free (&hs->cache_entry);
+      resp_free (&resp);
+      xfree (message);
+      xfree (head);
+      xfree (type);
+      goto retry_with_auth;
     }
 
-  /* Send the request to server.  */
-  write_error = request_send (req, sock, warc_tmp);
+  /* Only a body fresh for a while, or that can be validated, is worth
+     keeping.  Encoded bodies are left out, as the same URL might be
+     saved decoded in another run.  */
+  if (use_cache && statcode == HTTP_STATUS_OK
+      && hs->local_encoding == ENC_NONE)
+    {
+      hs->cache_store = (response_cacheable_p (resp, &hs->cache_expires)
+                         && (hs->cache_expires || hs->etag
+                             || hs->remote_time));
+      xfree (hs->content_type);
+      hs->content_type = resp_header_strdup (resp, "Content-Type");
+    }
 
-  if (write_error >= 0)
+  /* 20x responses are counted among successful by default.  */
+  if (H_20X (statcode))
+    *dt |= RETROKF;
+
+  if (statcode == HTTP_STATUS_NO_CONTENT)
     {
-      if (opt.body_data)
+      /* 204 response has no body (RFC 2616, 4.3) */
+
+      /* In case the caller cares to look...  */
+      hs->len = 0;
+      hs->res = 0;
+      hs->restval = 0;
+
+      CLOSE_FINISH (sock);
+
+      retval = RETRFINISHED;
+      goto cleanup;
+    }
+
+  /* Return if redirected.  */
+  if (H_REDIRECTED (statcode) || statcode == HTTP_STATUS_MULTIPLE_CHOICES)
+    {
+      /* RFC2068 says that in case of the 300 (multiple choices)
+         response, the server can output a preferred URL through
+         `Location' header; otherwise, the request should be treated
+         like GET.  So, if the location is set, it will be a
+         redirection; otherwise, just proceed normally.  */
+      if (statcode == HTTP_STATUS_MULTIPLE_CHOICES && !hs->newloc)
+        *dt |= RETROKF;
+      else
         {
-          DEBUGP (("[BODY data: %s]\n", opt.body_data));
-          write_error = fd_write (sock, opt.body_data, body_data_size, -1);
-          if (write_error >= 0 && warc_tmp != NULL)
+          logprintf (LOG_VERBOSE,
+                     _("Location: %s%s\n"),
+                     hs->newloc ? escnonprint_uri (hs->newloc) : _("unspecified"),
+                     hs->newloc ? _(" [following]") : "");
+
+          /* Only what holds for a GET is remembered.  */
+          if (hs->newloc
+              && (statcode == HTTP_STATUS_MOVED_PERMANENTLY
+                  || statcode == HTTP_STATUS_PERMANENT_REDIRECT)
+              && (!opt.method || !c_strcasecmp (opt.method, "GET")
+                  || !c_strcasecmp (opt.method, "HEAD")))
             {
-              int warc_tmp_written;
+              char *cache_control = resp_header_strdup (resp, "Cache-Control");
+              int64_t max_age;
+              if (parse_redirect_cache_control (cache_control, &max_age))
+                moved_permanently_add (u, hs->newloc, max_age);
+              xfree (cache_control);
+            }
 
-              /* Remember end of headers / start of payload. */
-              warc_payload_offset = ftello (warc_tmp);
+          /* In case the caller cares to look...  */
+          hs->len = 0;
+          hs->res = 0;
+          hs->restval = 0;
 
-              /* Write a copy of the data to the WARC record. */
-              warc_tmp_written = fwrite (opt.body_data, 1, body_data_size, warc_tmp);
-              if (warc_tmp_written != body_data_size)
-                write_error = -2;
+          /* Normally we are not interested in the response body of a redirect.
+             But if we are writing a WARC file we are: we like to keep everything.  */
+          if (warc_enabled)
+            {
+              int _err = read_response_body (hs, sock, NULL, contlen, 0,
+                                            chunked_transfer_encoding,
+                                            u, warc_timestamp_str,
+                                            warc_request_uuid, warc_ip, type,
+                                            statcode, head);
+
+              if (_err != RETRFINISHED || hs->res < 0)
+                {
+                  CLOSE_INVALIDATE (sock);
+                  retval = _err;
+                  goto cleanup;
+                }
+              else
+                CLOSE_FINISH (sock);
+            }
+          else
+            {
+              /* Since WARC is disabled, we are not interested in the response body.  */
+              if (keep_alive && !head_only
+                  && skip_short_body (sock, u->host, contlen,
+                                      chunked_transfer_encoding))
+                CLOSE_FINISH (sock);
+              else
+                CLOSE_INVALIDATE (sock);
             }
-         }
-      else if (opt.body_file && body_data_size != 0)
-        {
-          if (warc_tmp != NULL)
-            /* Remember end of headers / start of payload */
-            warc_payload_offset = ftello (warc_tmp);
 
-          write_error = body_file_send (sock, opt.body_file, body_data_size, warc_tmp);
-        }
-    }
+          /* From RFC2616: The status codes 303 and 307 have
+             been added for servers that wish to make unambiguously
+             clear which kind of reaction is expected of the client.
 
-  if (write_error < 0)
-    {
-      CLOSE_INVALIDATE (sock);
+             A 307 should be redirected using the same method,
+             in other words, a POST should be preserved and not
+             converted to a GET in that case.
 
-      if (warc_tmp != NULL)
-        fclose (warc_tmp);
+             With strict adherence to RFC2616, POST requests are not
+             converted to a GET request on 301 Permanent Redirect
+             or 302 Temporary Redirect.
 
-      if (write_error == -2)
-        retval = WARC_TMP_FWRITEERR;
-      else
-        retval = WRITEFAILED;
-      goto cleanup;
+             A switch may be provided later based on the HTTPbis draft
+             that allows clients to convert POST requests to GET
+             requests on 301 and 302 response codes. */
+          switch (statcode)
+            {
+            case HTTP_STATUS_TEMPORARY_REDIRECT:
+            case HTTP_STATUS_PERMANENT_REDIRECT:
+              retval = NEWLOCATION_KEEP_POST;
+              goto cleanup;
+            case HTTP_STATUS_MOVED_PERMANENTLY:
+              if (opt.method && c_strcasecmp (opt.method, "post") != 0)
+                {
+                  retval = NEWLOCATION_KEEP_POST;
+                  goto cleanup;
+                }
+              break;
+            case HTTP_STATUS_MOVED_TEMPORARILY:
+              if (opt.method && c_strcasecmp (opt.method, "post") != 0)
+                {
+                  retval = NEWLOCATION_KEEP_POST;
+                  goto cleanup;
+                }
+              break;
+            }
+          retval = NEWLOCATION;
+          goto cleanup;
+        }
     }
-  logprintf (LOG_VERBOSE, _("%s request sent, awaiting response... "),
-             proxy ? "Proxy" : "HTTP");
-  contlen = -1;
-  contrange = 0;
-  *dt &= ~RETROKF;
 
-
-  if (warc_enabled)
+  if (cond_get)
     {
-      bool warc_result;
-
-      /* Generate a timestamp and uuid for this request. */
-      warc_timestamp (warc_timestamp_str, sizeof (warc_timestamp_str));
-      warc_uuid_str (warc_request_uuid, sizeof (warc_request_uuid));
-
-      /* Create a request record and store it in the WARC file. */
-      warc_result = warc_write_request_record (u->url, warc_timestamp_str,
-                                               warc_request_uuid, warc_ip,
-                                               warc_tmp, warc_payload_offset);
-      if (! warc_result)
+      if (statcode == HTTP_STATUS_NOT_MODIFIED)
         {
-          CLOSE_INVALIDATE (sock);
-          retval = WARC_ERR;
+          logprintf (LOG_VERBOSE,
+                     _ ("File %s not modified on server. Omitting download.\n\n"),
+                     quote (hs->local_file));
+          *dt |= RETROKF;
+          CLOSE_FINISH (sock);
+          retval = RETRUNNEEDED;
           goto cleanup;
         }
-
-      /* warc_write_request_record has also closed warc_tmp. */
-    }
-
-  /* Repeat while we receive a 10x response code.  */
-  {
-    bool _repeat;
-
-    do
-      {
-        head = read_http_response_head (sock);
-        if (!head)
-          {
-            if (errno == 0)
-              {
-                logputs (LOG_NOTQUIET, _("No data received.\n"));
-                CLOSE_INVALIDATE (sock);
-                retval = HEOF;
-              }
-            else
-              {
-                logprintf (LOG_NOTQUIET, _("Read error (%s) in headers.\n"),
-                           fd_errstr (sock));
-                CLOSE_INVALIDATE (sock);
-                retval = HERR;
-              }
-            goto cleanup;
-          }
-        DEBUGP (("\n---response begin---\n%s---response end---\n", head));
-
-        resp = resp_new (head);
-
-        /* Check for status line.  */
-        xfree (message);
-        statcode = resp_status (resp, &message);
-        if (statcode < 0)
-          {
-            char *tms = datetime_str (time (NULL));
-            logprintf (LOG_VERBOSE, "%d\n", statcode);
-            logprintf (LOG_NOTQUIET, _("%s ERROR %d: %s.\n"), tms, statcode,
-                       quotearg_style (escape_quoting_style,
-                                       _("Malformed status line")));
-            CLOSE_INVALIDATE (sock);
-            retval = HERR;
-            goto cleanup;
-          }
-
-        if (H_10X (statcode))
-          {
-            xfree (head);
-            resp_free (&resp);
-            _repeat = true;
-            DEBUGP (("Ignoring response\n"));
-          }
-        else
-          {
-            _repeat = false;
-          }
-      }
-    while (_repeat);
-  }
-
-  xfree (hs->message);
-  hs->message = xstrdup (message);
-  if (!opt.server_response)
-    logprintf (LOG_VERBOSE, "%2d %s\n", statcode,
-               message ? quotearg_style (escape_quoting_style, message) : "");
-  else
-    {
-      logprintf (LOG_VERBOSE, "\n");
-      print_server_response (resp, "  ");
     }
 
-  if (!opt.ignore_length
-      && resp_header_copy (resp, "Content-Length", hdrval, sizeof (hdrval)))
+  if (opt.adjust_extension)
     {
-      wgint parsed;
-      errno = 0;
-      parsed = str_to_wgint (hdrval, NULL, 10);
-      if (parsed == WGINT_MAX && errno == ERANGE)
+      const char *encoding_ext = NULL;
+      switch (hs->local_encoding)
         {
-          /* Out of range.
-             #### If Content-Length is out of range, it most likely
-             means that the file is larger than 2G and that we're
-             compiled without LFS.  In that case we should probably
-             refuse to even attempt to download the file.  */
-          contlen = -1;
+        case ENC_INVALID:
+        case ENC_NONE:
+          break;
+        case ENC_BROTLI:
+          encoding_ext = ".br";
+          break;
+        case ENC_COMPRESS:
+          encoding_ext = ".Z";
+          break;
+        case ENC_DEFLATE:
+          encoding_ext = ".zlib";
+          break;
+        case ENC_GZIP:
+          encoding_ext = ".gz";
+          break;
+        case ENC_ZSTD:
+          encoding_ext = ".zst";
+          break;
+        default:
+          DEBUGP (("No extension found for encoding %d\n",
+                   hs->local_encoding));
+      }
+      if (encoding_ext != NULL)
+        {
+          char *file_ext = strrchr (hs->local_file, '.');
+          /* strip Content-Encoding extension (it will be re-added later) */
+          if (file_ext != NULL && 0 == strcasecmp (file_ext, encoding_ext))
+            *file_ext = '\0';
         }
-      else if (parsed < 0)
+      if (*dt & TEXTHTML)
+        /* -E / --adjust-extension / adjust_extension = on was specified,
+           and this is a text/html file.  If some case-insensitive
+           variation on ".htm[l]" isn't already the file's suffix,
+           tack on ".html". */
         {
-          /* Negative Content-Length; nonsensical, so we can't
-             assume any information about the content to receive. */
-          contlen = -1;
+          ensure_extension (hs, ".html", dt);
+        }
+      else if (*dt & TEXTCSS)
+        {
+          ensure_extension (hs, ".css", dt);
+        }
+      if (encoding_ext != NULL)
+        {
+          ensure_extension (hs, encoding_ext, dt);
         }
-      else
-        contlen = parsed;
     }
 
-  /* Check for keep-alive related responses. */
-  if (!inhibit_keep_alive)
+  if (cond_get)
     {
-      if (resp_header_copy (resp, "Connection", hdrval, sizeof (hdrval)))
+      /* Handle the case when server ignores If-Modified-Since header.  */
+      if (statcode == HTTP_STATUS_OK && hs->remote_time)
         {
-          if (0 == c_strcasecmp (hdrval, "Close"))
-            keep_alive = false;
+          time_t tmr = http_atotm (hs->remote_time);
+
+          /* Check if the local file is up-to-date based on Last-Modified header
+             and content length.  */
+          if (tmr != (time_t) - 1 && tmr <= hs->orig_file_tstamp
+              && (contlen == -1 || contlen == hs->orig_file_size))
+            {
+              logprintf (LOG_VERBOSE,
+                         _("Server ignored If-Modified-Since header for file %s.\n"
+                           "You might want to add --no-if-modified-since option."
+                           "\n\n"),
+                         quote (hs->local_file));
+              *dt |= RETROKF;
+              CLOSE_INVALIDATE (sock);
+              retval = RETRUNNEEDED;
+              goto cleanup;
+            }
+        }
+
+      /* Likewise when the server ignores If-None-Match but sends the
+         same entity tag.  */
+      if (statcode == HTTP_STATUS_OK && hs->cond_etag && hs->etag
+          && !strcmp (hs->etag, hs->cond_etag)
+          && (contlen == -1 || contlen == hs->orig_file_size))
+        {
+          logprintf (LOG_VERBOSE,
+                     _("Server ignored If-None-Match header for file %s.\n\n"),
+                     quote (hs->local_file));
+          *dt |= RETROKF;
+          CLOSE_INVALIDATE (sock);
+          retval = RETRUNNEEDED;
+          goto cleanup;
         }
     }
 
-  chunked_transfer_encoding = false;
-  if (resp_header_copy (resp, "Transfer-Encoding", hdrval, sizeof (hdrval))
-      && 0 == c_strcasecmp (hdrval, "chunked"))
-    chunked_transfer_encoding = true;
+  if (statcode == HTTP_STATUS_RANGE_NOT_SATISFIABLE
+      || (!opt.timestamping && hs->restval > 0 && statcode == HTTP_STATUS_OK
+          && contrange == 0 && contlen >= 0 && hs->restval >= contlen))
+    {
+      /* If `-c' is in use and the file has been fully downloaded (or
+         the remote file has shrunk), Wget effectively requests bytes
+         after the end of file and the server response with 416
+         (or 200 with a <= Content-Length.  */
+      logputs (LOG_VERBOSE, _("\
+\n    The file is already fully retrieved; nothing to do.\n\n"));
+      /* In case the caller inspects. */
+      hs->len = contlen;
+      hs->res = 0;
+      /* Mark as successfully retrieved. */
+      *dt |= RETROKF;
 
-  /* Handle (possibly multiple instances of) the Set-Cookie header. */
-  if (opt.cookies)
+      /* Try to maintain the keep-alive connection. It is often cheaper to
+       * consume some bytes which have already been sent than to negotiate
+       * a new connection. However, if the body is too large, or we don't
+       * care about keep-alive, then simply terminate the connection */
+      if (keep_alive &&
+          skip_short_body (sock, u->host, contlen,
+                           chunked_transfer_encoding))
+        CLOSE_FINISH (sock);
+      else
+        CLOSE_INVALIDATE (sock);
+      retval = RETRUNNEEDED;
+      goto cleanup;
+    }
+  if ((contrange != 0 && contrange != hs->restval)
+      || (H_PARTIAL (statcode) && !contrange && hs->restval))
     {
-      int scpos;
-      const char *scbeg, *scend;
-      /* The jar should have been created by now. */
-      assert (wget_cookie_jar != NULL);
-      for (scpos = 0;
-           (scpos = resp_header_locate (resp, "Set-Cookie", scpos,
-                                        &scbeg, &scend)) != -1;
-           ++scpos)
-        {
-          char buf[1024], *set_cookie;
-          size_t len = scend - scbeg;
-
-          if (len < sizeof (buf))
-            set_cookie = buf;
-          else
-            set_cookie = xmalloc (len + 1);
-
-          memcpy (set_cookie, scbeg, len);
-          set_cookie[len] = 0;
-
-          cookie_handle_set_cookie (wget_cookie_jar, u->host, u->port,
-                                    u->path, set_cookie);
-
-          if (set_cookie != buf)
-            xfree (set_cookie);
-        }
+      /* The Range request was somehow misunderstood by the server.
+         Bail out.  */
+      CLOSE_INVALIDATE (sock);
+      retval = RANGEERR;
+      goto cleanup;
     }
+  if (contlen == -1)
+    hs->contlen = -1;
+  /* If the response is compressed, the uncompressed size is unknown. */
+  else if (hs->remote_encoding != ENC_NONE)
+    hs->contlen = -1;
+  else
+    hs->contlen = contlen + contrange;
 
-  if (keep_alive)
-    /* The server has promised that it will not close the connection
-       when we're done.  This means that we can register it.  */
-    register_persistent (conn->host, conn->port, sock, using_ssl);
-
-  /* Detect charset for content */
-  type = resp_header_strdup (resp, "Content-Type");
-  if (type)
+  if (opt.verbose)
     {
-      char *tmp = strchr (type, ';');
-      if (tmp)
+      if (*dt & RETROKF)
         {
-          char *tmp2 = tmp + 1;
-
-          while (tmp > type && c_isspace (tmp[-1]))
-            --tmp;
-          *tmp = '\0';
-
-          /* Try to get remote encoding if needed.
-             Still need it to encode the local file name correctly. */
-          /* As info. We need be aware of different charset. */
-          if (!opt.encoding_remote)
+          /* No need to print this output if the body won't be
+             downloaded at all, or if the original server response is
+             printed.  */
+          logputs (LOG_VERBOSE, _("Length: "));
+          if (contlen != -1)
             {
-              tmp = parse_charset (tmp2);
-              if (tmp)
+              logputs (LOG_VERBOSE, number_to_static_string (contlen + contrange));
+              if (contlen + contrange >= 1024)
+                logprintf (LOG_VERBOSE, " (%s)",
+                           human_readable (contlen + contrange, 10, 1));
+              if (contrange)
                 {
-                  DEBUGP (("charset found in headers: %s\n", tmp));
-                  /* u is new; original_url will be used to for '-r'. */
-                  u->content_enc = xstrdup (tmp);
-                  original_url->content_enc = xstrdup (tmp);
+                  if (contlen >= 1024)
+                    logprintf (LOG_VERBOSE, _(", %s (%s) remaining"),
+                               number_to_static_string (contlen),
+                               human_readable (contlen, 10, 1));
+                  else
+                    logprintf (LOG_VERBOSE, _(", %s remaining"),
+                               number_to_static_string (contlen));
                 }
-              xfree (tmp);
             }
+          else
+            logputs (LOG_VERBOSE,
+                     opt.ignore_length ? _("ignored") : _("unspecified"));
+          if (type)
+            logprintf (LOG_VERBOSE, " [%s]\n", quotearg_style (escape_quoting_style, type));
+          else
+            logputs (LOG_VERBOSE, "\n");
         }
     }
 
-  set_content_type (dt, type);
-
-#ifdef HAVE_METALINK
-  /* We need to check for the Metalink data in the very first response
-     we get from the server (before redirections, authorization, etc.).  */
-  if (metalink)
+  /* Return if we have no intention of further downloading.  */
+  if ((!(*dt & RETROKF) && !opt.content_on_error) || head_only || (opt.spider && !opt.recursive))
     {
-      hs->metalink = metalink_from_http (resp, hs, u);
-      /* Bugfix: hs->local_file is NULL (opt.content_disposition).  */
-      if (!hs->local_file && hs->metalink && hs->metalink->origin)
-        hs->local_file = xstrdup (hs->metalink->origin);
-      xfree (hs->message);
-      retval = RETR_WITH_METALINK;
-      CLOSE_FINISH (sock);
-      goto cleanup;
-    }
-#endif
+      /* In case the caller cares to look...  */
+      hs->len = 0;
+      hs->res = 0;
+      hs->restval = 0;
 
-  if (statcode == HTTP_STATUS_UNAUTHORIZED)
-    {
-      /* Authorization is required.  */
-      uerr_t auth_err = RETROK;
-      bool retry;
-      /* Normally we are not interested in the response body.
+      /* Normally we are not interested in the response body of a error responses.
          But if we are writing a WARC file we are: we like to keep everything.  */
       if (warc_enabled)
         {
-          int _err;
-          _err = read_response_body (hs, sock, NULL, contlen, 0,
-                                    chunked_transfer_encoding,
-                                    u->url, warc_timestamp_str,
-                                    warc_request_uuid, warc_ip, type,
-                                    statcode, head);
+          int _err = read_response_body (hs, sock, NULL, contlen, 0,
+                                        chunked_transfer_encoding,
+                                        u, warc_timestamp_str,
+                                        warc_request_uuid, warc_ip, type,
+                                        statcode, head);
 
           if (_err != RETRFINISHED || hs->res < 0)
             {
@@ -3664,588 +7119,763 @@ gethttp (struct url *u, struct url *original_url, struct http_stat *hs,
               retval = _err;
               goto cleanup;
             }
-          else
-            CLOSE_FINISH (sock);
+
+          CLOSE_FINISH (sock);
         }
       else
         {
           /* Since WARC is disabled, we are not interested in the response body.  */
-          if (keep_alive && !head_only
-              && skip_short_body (sock, contlen, chunked_transfer_encoding))
+          if (head_only)
+            /* Pre-1.10 Wget used CLOSE_INVALIDATE here.  Now we trust the
+               servers not to send body in response to a HEAD request, and
+               those that do will likely be caught by test_socket_open.
+               If not, they can be worked around using
+               `--no-http-keep-alive'.  */
+            CLOSE_FINISH (sock);
+          else if (opt.spider && !opt.recursive)
+            /* we just want to see if the page exists - no downloading required */
+            CLOSE_INVALIDATE (sock);
+          else if (keep_alive
+                   && skip_short_body (sock, u->host, contlen,
+                                       chunked_transfer_encoding))
+            /* Successfully skipped the body; also keep using the socket. */
             CLOSE_FINISH (sock);
           else
             CLOSE_INVALIDATE (sock);
         }
 
-      pconn.authorized = false;
-
-      {
-        auth_err = check_auth (u, user, passwd, resp, req,
-                               &ntlm_seen, &retry,
-                               &basic_auth_finished,
-                               &auth_finished);
-        if (auth_err == RETROK && retry)
-          {
-            resp_free (&resp);
-            xfree (message);
-            xfree (head);
-            goto retry_with_auth;
-          }
-      }
-      if (auth_err == RETROK)
-        retval = AUTHFAILED;
+      if (statcode == HTTP_STATUS_GATEWAY_TIMEOUT)
+        retval = GATEWAYTIMEOUT;
       else
-        retval = auth_err;
+        retval = RETRFINISHED;
+
       goto cleanup;
     }
-  else /* statcode != HTTP_STATUS_UNAUTHORIZED */
+
+  /* A recursive spider retrieves documents only for their links,
+     which retrieve_tree can parse from the copy its digest keeps:
+     there is no need to write them out.  */
+  hs->captured = opt.spider && opt.recursive && (*dt & (TEXTHTML | TEXTCSS))
+    && body_digests_capture_p () && !hs->restval && !output_stream
+    && !warc_enabled && !opt.save_headers;
+
+  if (!hs->captured)
     {
-      /* Kludge: if NTLM is used, mark the TCP connection as authorized. */
-      if (ntlm_seen)
-        pconn.authorized = true;
+      err = open_output_stream (hs, count, &fp);
+      if (err != RETROK)
+        {
+          CLOSE_INVALIDATE (sock);
+          retval = err;
+          goto cleanup;
+        }
+
+#ifdef ENABLE_XATTR
+      if (opt.enable_xattr)
+        {
+          if (original_url != u)
+            set_file_metadata (u, original_url, fp);
+          else
+            set_file_metadata (u, NULL, fp);
+        }
+#endif
     }
 
-  {
-    uerr_t ret = check_file_output (u, hs, resp, hdrval, sizeof hdrval);
-    if (ret != RETROK)
-      {
-        retval = ret;
-        goto cleanup;
-      }
-  }
+  /* Split the body across several connections if asked to, and if
+     the response and the output file allow it.  */
+  if (opt.segments > 1 && statcode == HTTP_STATUS_OK && !hs->captured
+      && contlen >= 2 * SEGMENT_MIN_SIZE && !contrange && !hs->restval
+      && !chunked_transfer_encoding && hs->remote_encoding == ENC_NONE
+      && conn == u && !ntlm_seen && !output_stream && !warc_enabled
+      && !opt.save_headers
+      && !(resp_header_copy (resp, "Accept-Ranges", hdrval, sizeof (hdrval))
+           && 0 == c_strcasecmp (hdrval, "none")))
+    {
+      hs->len = hs->rd_size = 0;
+      hs->res = read_segmented_body (hs, u, req, sock, fp, contlen);
+      sock = -1;
+      err = hs->res == -2 ? FWRITEERR : RETRFINISHED;
+    }
+  else
+    {
+      err = read_response_body (hs, sock, fp, contlen, contrange,
+                                chunked_transfer_encoding,
+                                u, warc_timestamp_str,
+                                warc_request_uuid, warc_ip, type,
+                                statcode, head);
+
+      if (hs->res >= 0)
+        CLOSE_FINISH (sock);
+      else
+        CLOSE_INVALIDATE (sock);
+    }
+
+  if (fp && !output_stream)
+    fclose (fp);
+
+  retval = err;
+
+  cleanup:
+#if defined ENABLE_NTLM && defined HAVE_WINTLS
+  ntlm_free (&ntlm_ahead);
+#endif
+  xfree (head);
+  xfree (type);
+  xfree (message);
+  resp_free (&resp);
+  request_free (&req);
+
+  return retval;
+}
+
+/* With --validators-file, remember the ETag and Last-Modified of the
+   file U was just retrieved to, for the next -N run to send.  */
+static void
+remember_validators (const struct url *u, const struct http_stat *hs,
+                     int dt)
+{
+  if (opt.timestamping && (dt & RETROKF) && !hs->captured)
+    validators_record (u->url, hs->etag, hs->remote_time, hs->local_file);
+}
+
+/* With --http-cache, keep the body U was just retrieved to for the
+   next runs.  */
+static void
+remember_in_cache (const struct url *u, const struct http_stat *hs, int dt)
+{
+  if (hs->cache_store && (dt & RETROKF) && !hs->captured)
+    http_cache_store (u->url, hs->local_file, hs->cache_expires, hs->etag,
+                      hs->remote_time, hs->content_type);
+}
+
+/* Return true if retrieve_url retries U without encoding it in UTF-8
+   when it fails: only then does the encoding change the URL.  */
+static bool
+iri_fallback_p (const struct url *u)
+{
+  const char *p;
+
+  if (u->enc_type != ENC_IRI)
+    return false;
+  for (p = u->ori_url; *p; p++)
+    if (!c_isascii (*p))
+      return true;
+  return false;
+}
+
+/* Check whether the supplied HTTP status code is among those
+   listed for the --retry-on-http-error option. */
+static bool
+check_retry_on_http_error (const int statcode)
+{
+  const char *tok = opt.retry_on_http_error;
+  while (tok && *tok)
+    {
+      if (atoi (tok) == statcode)
+        return true;
+      if ((tok = strchr (tok, ',')))
+        ++tok;
+    }
+  return false;
+}
+
+/* Parallel link checking (--spider-connections).
+
+   A recursive spider mostly waits for the server to answer one
+   request after the other.  The links retrieve_tree won't follow,
+   such as images or the pages at the maximum depth, need nothing but
+   a HEAD request to be checked.  retrieve_tree collects them and
+   hands them here in batches, and their requests go out over up to
+   opt.spider_connections connections at once, multiplexed with
+   fd_dispatch like the segments of a download.
+
+   Only the plain outcomes are decided here: success, or an error that
+   makes the link broken.  Whatever takes more than one request, such
+   as a redirection or an authentication challenge, and whatever goes
+   wrong with the connection, is left for http_loop to do again the
+   usual way, which takes care of retrying and of reporting.  */
+
+/* Hard limit on the number of connections used for checking. */
+#define MAX_LINK_CONNECTIONS 32
+
+enum link_conn_state
+{
+  LC_IDLE,                      /* waiting for a check */
+  LC_CONNECTING,                /* connection being established */
+  LC_SENDING,                   /* request being written */
+  LC_READING                    /* response head being read */
+};
+
+struct link_conn {
+  struct link_checker *lc;
+  struct link_check *check;     /* the check in progress, or NULL */
+  enum link_conn_state state;
+  int sock;                     /* connection, or -1 */
+  int wait_for;                 /* what SOCK must become ready for */
+  const char *host;             /* where SOCK is connected to */
+  int port;
+  bool ssl;
+  bool reused;                  /* SOCK has served a request before */
+  bool retried;                 /* the check was restarted once */
+  char *request;                /* the request being sent */
+  int request_size, sent;
+  char *head;                   /* the response head read so far */
+  int head_len, head_size;
+  double last_activity;
+  double sent_tm;               /* when the request was sent, see
+                                   host_link_now */
+};
 
-  hs->statcode = statcode;
-  xfree (hs->error);
-  if (statcode == -1)
-    hs->error = xstrdup (_("Malformed status line"));
-  else if (!message || !*message)
-    hs->error = xstrdup (_("(no description)"));
-  else
-    hs->error = xstrdup (message);
+struct link_checker {
+  struct link_conn conns[MAX_LINK_CONNECTIONS];
+  int count;
+  struct ptimer *timer;
+  bool *started;                /* which of the checks were started */
+  int next;                     /* and the first that may not be */
+};
 
-#ifdef HAVE_HSTS
-  if (opt.hsts && hsts_store)
-    {
-      int64_t max_age;
-      const char *hsts_params = resp_header_strdup (resp, "Strict-Transport-Security");
-      bool include_subdomains;
+/* Return true if the link U can be checked by http_check_links: an
+   HTTP or HTTPS URL asked for straight from its server, with no wait
+   to respect between the requests to its host.  */
 
-      if (parse_strict_transport_security (hsts_params, &max_age, &include_subdomains))
-        {
-          /* process strict transport security */
-          if (hsts_store_entry (hsts_store, u->scheme, u->host, u->port, max_age, include_subdomains))
-            DEBUGP(("Added new HSTS host: %s:%" PRIu32 " (max-age: %" PRId64 ", includeSubdomains: %s)\n",
-                   u->host,
-                   (uint32_t) u->port,
-                   max_age,
-                   (include_subdomains ? "true" : "false")));
-          else
-            DEBUGP(("Updated HSTS host: %s:%" PRIu32 " (max-age: %" PRId64 ", includeSubdomains: %s)\n",
-                   u->host,
-                   (uint32_t) u->port,
-                   max_age,
-                   (include_subdomains ? "true" : "false")));
-        }
-      xfree (hsts_params);
-    }
+bool
+http_link_checkable (struct url *u)
+{
+  struct robot_specs *specs;
+
+  if (u->scheme != SCHEME_HTTP
+#ifdef HAVE_SSL
+      && u->scheme != SCHEME_HTTPS
+#endif
+      )
+    return false;
+  if (opt.wait || opt.method || opt.body_data || opt.body_file)
+    return false;
+#ifdef HAVE_NGHTTP2
+  if (opt.http2 && u->scheme == SCHEME_HTTPS)
+    return false;
 #endif
+  if (url_uses_proxy (u))
+    return false;
+  if (opt.use_robots && (specs = res_get_specs (u->host, u->port))
+      && res_crawl_delay (specs) > 0)
+    return false;
+  return true;
+}
 
-  xfree (hs->newloc);
-  hs->newloc = resp_header_strdup (resp, "Location");
-  xfree (hs->remote_time);
-  hs->remote_time = resp_header_strdup (resp, "Last-Modified");
-  if (!hs->remote_time) // now look for the Wayback Machine's timestamp
-    hs->remote_time = resp_header_strdup (resp, "X-Archive-Orig-last-modified");
+/* Close C's connection.  */
 
-  if (resp_header_copy (resp, "Content-Range", hdrval, sizeof (hdrval)))
-    {
-      wgint first_byte_pos, last_byte_pos, entity_length;
-      if (parse_content_range (hdrval, &first_byte_pos, &last_byte_pos,
-                               &entity_length))
-        {
-          contrange = first_byte_pos;
-          contlen = last_byte_pos - first_byte_pos + 1;
-        }
-    }
+static void
+lc_close (struct link_conn *c)
+{
+  if (c->sock >= 0)
+    fd_close (c->sock);
+  c->sock = -1;
+  c->host = NULL;
+}
 
-  if (resp_header_copy (resp, "Content-Encoding", hdrval, sizeof (hdrval)))
-    {
-      hs->local_encoding = ENC_INVALID;
+/* Return how many connections of LC are checking links of HOST.  */
 
-      switch (hdrval[0])
-        {
-        case 'b': case 'B':
-          if (0 == c_strcasecmp(hdrval, "br"))
-            hs->local_encoding = ENC_BROTLI;
-          break;
-        case 'c': case 'C':
-          if (0 == c_strcasecmp(hdrval, "compress"))
-            hs->local_encoding = ENC_COMPRESS;
-          break;
-        case 'd': case 'D':
-          if (0 == c_strcasecmp(hdrval, "deflate"))
-            hs->local_encoding = ENC_DEFLATE;
-          break;
-        case 'g': case 'G':
-          if (0 == c_strcasecmp(hdrval, "gzip"))
-            hs->local_encoding = ENC_GZIP;
-          break;
-        case 'i': case 'I':
-          if (0 == c_strcasecmp(hdrval, "identity"))
-            hs->local_encoding = ENC_NONE;
-          break;
-        case 'x': case 'X':
-          if (0 == c_strcasecmp(hdrval, "x-compress"))
-            hs->local_encoding = ENC_COMPRESS;
-          else if (0 == c_strcasecmp(hdrval, "x-gzip"))
-            hs->local_encoding = ENC_GZIP;
-          break;
-        case '\0':
-          hs->local_encoding = ENC_NONE;
-        }
+static int
+lc_host_conns (const struct link_checker *lc, const char *host)
+{
+  int i, n = 0;
 
-      if (hs->local_encoding == ENC_INVALID)
-        {
-          DEBUGP (("Unrecognized Content-Encoding: %s\n", hdrval));
-          hs->local_encoding = ENC_NONE;
-        }
-#ifdef HAVE_LIBZ
-      else if (hs->local_encoding == ENC_GZIP
-               && opt.compression != compression_none)
-        {
-          const char *p;
+  for (i = 0; i < lc->count; i++)
+    if (lc->conns[i].check
+        && lc->conns[i].check->url->host == host)
+      n++;
+  return n;
+}
 
-          /* Make sure the Content-Type is not gzip before decompressing */
-          if (type)
-            {
-              p = strchr (type, '/');
-              if (p == NULL)
-                {
-                  hs->remote_encoding = ENC_GZIP;
-                  hs->local_encoding = ENC_NONE;
-                }
-              else
-                {
-                  p++;
-                  if (c_tolower(p[0]) == 'x' && p[1] == '-')
-                    p += 2;
-                  if (0 != c_strcasecmp (p, "gzip"))
-                    {
-                      hs->remote_encoding = ENC_GZIP;
-                      hs->local_encoding = ENC_NONE;
-                    }
-                }
-            }
-          else
-            {
-               hs->remote_encoding = ENC_GZIP;
-               hs->local_encoding = ENC_NONE;
-            }
+/* Return the first of the COUNT CHECKS that is yet to be started and
+   whose host can have another connection within its budget, or NULL,
+   and mark it started.  */
 
-          /* don't uncompress if a file ends with '.gz' or '.tgz' */
-          if (hs->remote_encoding == ENC_GZIP
-              && (p = strrchr(u->file, '.'))
-              && (c_strcasecmp(p, ".gz") == 0 || c_strcasecmp(p, ".tgz") == 0))
-            {
-               DEBUGP (("Enabling broken server workaround. Will not decompress this GZip file.\n"));
-               hs->remote_encoding = ENC_NONE;
-            }
-        }
-#endif
-    }
+static struct link_check *
+lc_pick (struct link_checker *lc, struct link_check *checks, int count)
+{
+  int i;
 
-  /* 20x responses are counted among successful by default.  */
-  if (H_20X (statcode))
-    *dt |= RETROKF;
+  while (lc->next < count && lc->started[lc->next])
+    lc->next++;
+  for (i = lc->next; i < count; i++)
+    if (!lc->started[i])
+      {
+        const char *host = checks[i].url->host;
+        int budget = host_budget (host);
 
-  if (statcode == HTTP_STATUS_NO_CONTENT)
-    {
-      /* 204 response has no body (RFC 2616, 4.3) */
+        if (budget > 0 && lc_host_conns (lc, host) >= budget)
+          continue;
+        lc->started[i] = true;
+        return &checks[i];
+      }
+  return NULL;
+}
 
-      /* In case the caller cares to look...  */
-      hs->len = 0;
-      hs->res = 0;
-      hs->restval = 0;
+/* Make C ready for the next check.  */
 
-      CLOSE_FINISH (sock);
+static void
+lc_done (struct link_conn *c)
+{
+  c->check = NULL;
+  c->state = LC_IDLE;
+  xfree (c->request);
+  c->head_len = 0;
+}
 
-      retval = RETRFINISHED;
-      goto cleanup;
-    }
+/* Give up on C's check, leaving it unchecked, and on its connection.  */
 
-  /* Return if redirected.  */
-  if (H_REDIRECTED (statcode) || statcode == HTTP_STATUS_MULTIPLE_CHOICES)
-    {
-      /* RFC2068 says that in case of the 300 (multiple choices)
-         response, the server can output a preferred URL through
-         `Location' header; otherwise, the request should be treated
-         like GET.  So, if the location is set, it will be a
-         redirection; otherwise, just proceed normally.  */
-      if (statcode == HTTP_STATUS_MULTIPLE_CHOICES && !hs->newloc)
-        *dt |= RETROKF;
-      else
-        {
-          logprintf (LOG_VERBOSE,
-                     _("Location: %s%s\n"),
-                     hs->newloc ? escnonprint_uri (hs->newloc) : _("unspecified"),
-                     hs->newloc ? _(" [following]") : "");
+static void
+lc_fail (struct link_conn *c)
+{
+  DEBUGP (("Could not check %s.\n", c->check->url->url));
+  lc_close (c);
+  lc_done (c);
+}
 
-          /* In case the caller cares to look...  */
-          hs->len = 0;
-          hs->res = 0;
-          hs->restval = 0;
+/* Get a connection to U's server for C: the one C already has, an idle
+   persistent connection, or a new one.  */
 
-          /* Normally we are not interested in the response body of a redirect.
-             But if we are writing a WARC file we are: we like to keep everything.  */
-          if (warc_enabled)
-            {
-              int _err = read_response_body (hs, sock, NULL, contlen, 0,
-                                            chunked_transfer_encoding,
-                                            u->url, warc_timestamp_str,
-                                            warc_request_uuid, warc_ip, type,
-                                            statcode, head);
+static bool
+lc_connect (struct link_conn *c, const struct url *u)
+{
+  struct address_list *al;
+  bool ssl = false;
+  int i;
 
-              if (_err != RETRFINISHED || hs->res < 0)
-                {
-                  CLOSE_INVALIDATE (sock);
-                  retval = _err;
-                  goto cleanup;
-                }
-              else
-                CLOSE_FINISH (sock);
-            }
-          else
-            {
-              /* Since WARC is disabled, we are not interested in the response body.  */
-              if (keep_alive && !head_only
-                  && skip_short_body (sock, contlen, chunked_transfer_encoding))
-                CLOSE_FINISH (sock);
-              else
-                CLOSE_INVALIDATE (sock);
-            }
+#ifdef HAVE_SSL
+  ssl = u->scheme == SCHEME_HTTPS;
+#endif
+  c->sent = 0;
+  c->head_len = 0;
+
+  if (c->sock >= 0 && c->port == u->port && c->ssl == ssl
+      && c->host == u->host && test_socket_open (c->sock))
+    goto connected;
+  lc_close (c);
+
+  for (i = pconn_pool_count - 1; i >= 0; i--)
+    if (pconn_pool[i].port == u->port && pconn_pool[i].ssl == ssl
+        && !pconn_pool[i].authorized
+        && pconn_pool[i].host == u->host)
+      {
+        struct persistent_connection found = pconn_pool_take (i);
+        if (!test_socket_open (found.socket))
+          {
+            fd_close (found.socket);
+            continue;
+          }
+        DEBUGP (("Checking %s over idle socket %d.\n", u->url, found.socket));
+        c->sock = found.socket;
+        c->host = found.host;
+        c->port = found.port;
+        c->ssl = ssl;
+        c->reused = true;
+        goto connected;
+      }
+
+  al = lookup_host (u->host, LH_SILENT);
+  if (!al)
+    return false;
+  c->sock = connect_to_ip_start (address_list_address_at (al, 0), u->port);
+  address_list_release (al);
+  if (c->sock < 0)
+    return false;
+  c->host = u->host;
+  c->port = u->port;
+  c->ssl = ssl;
+  c->reused = false;
+  c->state = LC_CONNECTING;
+  c->wait_for = WAIT_FOR_WRITE;
+  return true;
+
+ connected:
+  c->state = LC_SENDING;
+  c->wait_for = WAIT_FOR_WRITE;
+  return true;
+}
+
+/* Start checking CHECK over C.  If that can't be done, CHECK is left
+   unchecked and C idle.  */
+
+static void
+lc_start (struct link_conn *c, struct link_check *check)
+{
+  struct url *u = check->url;
+  struct http_stat hs;
+  struct request *req;
+  char *user, *passwd;
+  bool basic_auth_finished = false;
+  wgint body_data_size = 0;
+  uerr_t ret;
+  int dt;
+#ifdef HAVE_HSTS
+#ifdef TESTING
+  /* we don't link against main.o when we're testing */
+  hsts_store_t hsts_store = NULL;
+#else
+  extern hsts_store_t hsts_store;
+#endif
+
+  check->result = LINK_UNCHECKED;
+  if (opt.hsts && hsts_store && hsts_match (hsts_store, u))
+    {
+      logprintf (LOG_VERBOSE, "URL transformed to HTTPS due to an HSTS policy\n");
+      if (!http_link_checkable (u))
+        return;
+    }
+#else
+  check->result = LINK_UNCHECKED;
+#endif
+#ifdef HAVE_SSL
+  if (u->scheme == SCHEME_HTTPS && !ssl_init ())
+    return;
+#endif
 
-          /* From RFC2616: The status codes 303 and 307 have
-             been added for servers that wish to make unambiguously
-             clear which kind of reaction is expected of the client.
+  /* The request is the one gethttp sends first.  */
+  xzero (hs);
+  hs.referer = check->referer ? check->referer : opt.referer;
+  dt = HEAD_ONLY | (opt.allow_cache ? 0 : SEND_NOCACHE);
+  req = initialize_request (u, &hs, &dt, NULL,
+                            !opt.http_keep_alive || opt.ignore_length,
+                            &basic_auth_finished, &body_data_size,
+                            &user, &passwd, &ret);
+  if (!req)
+    return;
+  request_add_session_headers (req, u);
+  c->request = request_format (req, &c->request_size);
+  request_free (&req);
 
-             A 307 should be redirected using the same method,
-             in other words, a POST should be preserved and not
-             converted to a GET in that case.
+  c->check = check;
+  c->retried = false;
+  c->last_activity = ptimer_measure (c->lc->timer);
+  if (!lc_connect (c, u))
+    lc_fail (c);
+}
 
-             With strict adherence to RFC2616, POST requests are not
-             converted to a GET request on 301 Permanent Redirect
-             or 302 Temporary Redirect.
+/* C's connection failed before a response arrived.  A persistent
+   connection may have been closed by the server while it was idle,
+   so the check is tried once more on a new connection.  */
 
-             A switch may be provided later based on the HTTPbis draft
-             that allows clients to convert POST requests to GET
-             requests on 301 and 302 response codes. */
-          switch (statcode)
-            {
-            case HTTP_STATUS_TEMPORARY_REDIRECT:
-            case HTTP_STATUS_PERMANENT_REDIRECT:
-              retval = NEWLOCATION_KEEP_POST;
-              goto cleanup;
-            case HTTP_STATUS_MOVED_PERMANENTLY:
-              if (opt.method && c_strcasecmp (opt.method, "post") != 0)
-                {
-                  retval = NEWLOCATION_KEEP_POST;
-                  goto cleanup;
-                }
-              break;
-            case HTTP_STATUS_MOVED_TEMPORARILY:
-              if (opt.method && c_strcasecmp (opt.method, "post") != 0)
-                {
-                  retval = NEWLOCATION_KEEP_POST;
-                  goto cleanup;
-                }
-              break;
-            }
-          retval = NEWLOCATION;
-          goto cleanup;
-        }
+static void
+lc_restart (struct link_conn *c)
+{
+  if (c->reused && !c->retried && c->head_len == 0)
+    {
+      DEBUGP (("Socket %d was closed; checking %s again.\n",
+               c->sock, c->check->url->url));
+      c->retried = true;
+      lc_close (c);
+      if (lc_connect (c, c->check->url))
+        return;
     }
+  lc_fail (c);
+}
 
-  if (cond_get)
+/* Log the outcome of CHECK, whose response was RESP, the way
+   http_loop does.  */
+
+static void
+link_check_report (const struct link_check *check,
+                   const struct response *resp, const char *message)
+{
+  char *tms = datetime_str (time (NULL));
+  char *hurl = url_string (check->url, URL_AUTH_HIDE_PASSWD);
+  const char *quoted =
+    message ? quotearg_style (escape_quoting_style, message) : "";
+
+  logprintf (LOG_VERBOSE, "--%s--  %s\n", tms, hurl);
+  logprintf (LOG_VERBOSE, _("%s request sent, awaiting response... "),
+             "HTTP");
+  if (!opt.server_response)
+    logprintf (LOG_VERBOSE, "%2d %s\n", check->statcode, quoted);
+  else
     {
-      if (statcode == HTTP_STATUS_NOT_MODIFIED)
-        {
-          logprintf (LOG_VERBOSE,
-                     _ ("File %s not modified on server. Omitting download.\n\n"),
-                     quote (hs->local_file));
-          *dt |= RETROKF;
-          CLOSE_FINISH (sock);
-          retval = RETRUNNEEDED;
-          goto cleanup;
-        }
+      logprintf (LOG_VERBOSE, "\n");
+      print_server_response (resp, "  ");
     }
 
-  if (opt.adjust_extension)
+  if (check->result == LINK_OK)
     {
-      const char *encoding_ext = NULL;
-      switch (hs->local_encoding)
-        {
-        case ENC_INVALID:
-        case ENC_NONE:
-          break;
-        case ENC_BROTLI:
-          encoding_ext = ".br";
-          break;
-        case ENC_COMPRESS:
-          encoding_ext = ".Z";
-          break;
-        case ENC_DEFLATE:
-          encoding_ext = ".zlib";
-          break;
-        case ENC_GZIP:
-          encoding_ext = ".gz";
-          break;
-        default:
-          DEBUGP (("No extension found for encoding %d\n",
-                   hs->local_encoding));
-      }
-      if (encoding_ext != NULL)
-        {
-          char *file_ext = strrchr (hs->local_file, '.');
-          /* strip Content-Encoding extension (it will be re-added later) */
-          if (file_ext != NULL && 0 == strcasecmp (file_ext, encoding_ext))
-            *file_ext = '\0';
-        }
-      if (*dt & TEXTHTML)
-        /* -E / --adjust-extension / adjust_extension = on was specified,
-           and this is a text/html file.  If some case-insensitive
-           variation on ".htm[l]" isn't already the file's suffix,
-           tack on ".html". */
-        {
-          ensure_extension (hs, ".html", dt);
-        }
-      else if (*dt & TEXTCSS)
-        {
-          ensure_extension (hs, ".css", dt);
-        }
-      if (encoding_ext != NULL)
-        {
-          ensure_extension (hs, encoding_ext, dt);
-        }
+      logputs (LOG_VERBOSE, _("Remote file exists.\n\n"));
+      logprintf (LOG_NONVERBOSE, _("%s URL: %s %2d %s\n"),
+                 tms, hurl, check->statcode, quoted);
     }
-
-  if (cond_get)
+  else
     {
-      /* Handle the case when server ignores If-Modified-Since header.  */
-      if (statcode == HTTP_STATUS_OK && hs->remote_time)
-        {
-          time_t tmr = http_atotm (hs->remote_time);
-
-          /* Check if the local file is up-to-date based on Last-Modified header
-             and content length.  */
-          if (tmr != (time_t) - 1 && tmr <= hs->orig_file_tstamp
-              && (contlen == -1 || contlen == hs->orig_file_size))
-            {
-              logprintf (LOG_VERBOSE,
-                         _("Server ignored If-Modified-Since header for file %s.\n"
-                           "You might want to add --no-if-modified-since option."
-                           "\n\n"),
-                         quote (hs->local_file));
-              *dt |= RETROKF;
-              CLOSE_INVALIDATE (sock);
-              retval = RETRUNNEEDED;
-              goto cleanup;
-            }
-        }
+      logprintf (LOG_NONVERBOSE, "%s:\n", hurl);
+      nonexisting_url (hurl);
+      logprintf (LOG_NOTQUIET, _("\
+Remote file does not exist -- broken link!!!\n"));
+      logputs (LOG_VERBOSE, "\n");
     }
+  xfree (hurl);
+}
 
-  if (statcode == HTTP_STATUS_RANGE_NOT_SATISFIABLE
-      || (!opt.timestamping && hs->restval > 0 && statcode == HTTP_STATUS_OK
-          && contrange == 0 && contlen >= 0 && hs->restval >= contlen))
-    {
-      /* If `-c' is in use and the file has been fully downloaded (or
-         the remote file has shrunk), Wget effectively requests bytes
-         after the end of file and the server response with 416
-         (or 200 with a <= Content-Length.  */
-      logputs (LOG_VERBOSE, _("\
-\n    The file is already fully retrieved; nothing to do.\n\n"));
-      /* In case the caller inspects. */
-      hs->len = contlen;
-      hs->res = 0;
-      /* Mark as successfully retrieved. */
-      *dt |= RETROKF;
+/* Decide the outcome of C's check from the response head, the first
+   LEN bytes read.  */
 
-      /* Try to maintain the keep-alive connection. It is often cheaper to
-       * consume some bytes which have already been sent than to negotiate
-       * a new connection. However, if the body is too large, or we don't
-       * care about keep-alive, then simply terminate the connection */
-      if (keep_alive &&
-          skip_short_body (sock, contlen, chunked_transfer_encoding))
-        CLOSE_FINISH (sock);
-      else
-        CLOSE_INVALIDATE (sock);
-      retval = RETRUNNEEDED;
-      goto cleanup;
-    }
-  if ((contrange != 0 && contrange != hs->restval)
-      || (H_PARTIAL (statcode) && !contrange && hs->restval))
+static void
+lc_response (struct link_conn *c, int len)
+{
+  struct link_check *check = c->check;
+  struct url *u = check->url;
+  char *head = xstrndup (c->head, len);
+  struct response *resp;
+  char *message = NULL;
+  char hdrval[256];
+  int statcode, dt = 0;
+  /* Whatever follows the head would be taken for the next response. */
+  bool keep_alive = opt.http_keep_alive && !opt.ignore_length
+    && c->head_len == len;
+
+  DEBUGP (("\n---response begin---\n%s---response end---\n", head));
+  resp = resp_new (head);
+  statcode = resp_status (resp, &message);
+  host_link_ttfb (u->host, lc_host_conns (c->lc, u->host),
+                  host_link_now () - c->sent_tm);
+  host_link_status (u->host, lc_host_conns (c->lc, u->host), statcode);
+
+  if (resp_header_copy (resp, "Connection", hdrval, sizeof (hdrval)))
     {
-      /* The Range request was somehow misunderstood by the server.
-         Bail out.  */
-      CLOSE_INVALIDATE (sock);
-      retval = RANGEERR;
-      goto cleanup;
+      if (0 == c_strcasecmp (hdrval, "Close"))
+        keep_alive = false;
     }
-  if (contlen == -1)
-    hs->contlen = -1;
-  /* If the response is gzipped, the uncompressed size is unknown. */
-  else if (hs->remote_encoding == ENC_GZIP)
-    hs->contlen = -1;
-  else
-    hs->contlen = contlen + contrange;
+  else if (0 == strncmp (head, "HTTP/1.0", 8))
+    /* An HTTP/1.0 server closes the connection unless it says
+       otherwise.  */
+    keep_alive = false;
 
-  if (opt.verbose)
+  if (opt.cookies)
+    resp_handle_set_cookies (resp, u);
+#ifdef HAVE_HSTS
+  resp_handle_hsts (resp, u);
+#endif
+
+  if (resp_header_copy (resp, "Content-Type", hdrval, sizeof (hdrval)))
     {
-      if (*dt & RETROKF)
+      char *p = strchr (hdrval, ';');
+      if (p)
         {
-          /* No need to print this output if the body won't be
-             downloaded at all, or if the original server response is
-             printed.  */
-          logputs (LOG_VERBOSE, _("Length: "));
-          if (contlen != -1)
-            {
-              logputs (LOG_VERBOSE, number_to_static_string (contlen + contrange));
-              if (contlen + contrange >= 1024)
-                logprintf (LOG_VERBOSE, " (%s)",
-                           human_readable (contlen + contrange, 10, 1));
-              if (contrange)
-                {
-                  if (contlen >= 1024)
-                    logprintf (LOG_VERBOSE, _(", %s (%s) remaining"),
-                               number_to_static_string (contlen),
-                               human_readable (contlen, 10, 1));
-                  else
-                    logprintf (LOG_VERBOSE, _(", %s remaining"),
-                               number_to_static_string (contlen));
-                }
-            }
-          else
-            logputs (LOG_VERBOSE,
-                     opt.ignore_length ? _("ignored") : _("unspecified"));
-          if (type)
-            logprintf (LOG_VERBOSE, " [%s]\n", quotearg_style (escape_quoting_style, type));
-          else
-            logputs (LOG_VERBOSE, "\n");
+          while (p > hdrval && c_isspace (p[-1]))
+            --p;
+          *p = '\0';
         }
+      set_content_type (&dt, hdrval);
     }
 
-  /* Return if we have no intention of further downloading.  */
-  if ((!(*dt & RETROKF) && !opt.content_on_error) || head_only || (opt.spider && !opt.recursive))
-    {
-      /* In case the caller cares to look...  */
-      hs->len = 0;
-      hs->res = 0;
-      hs->restval = 0;
+  /* As in http_loop, a HEAD answered with 500 or 501 is tried again
+     with GET, 401 asks for authentication and 504 is retried.  A
+     link only fails for good once it is also tried unencoded.  */
+  check->statcode = statcode;
+  if (H_20X (statcode))
+    check->result = (check->follow_css && (dt & TEXTCSS)
+                     ? LINK_UNCHECKED : LINK_OK);
+  else if (statcode >= 400 && statcode < 600
+           && statcode != HTTP_STATUS_UNAUTHORIZED
+           && statcode != HTTP_STATUS_INTERNAL
+           && statcode != HTTP_STATUS_NOT_IMPLEMENTED
+           && statcode != HTTP_STATUS_GATEWAY_TIMEOUT
+           && !iri_fallback_p (u))
+    check->result = LINK_BROKEN;
+
+  if (check->result != LINK_UNCHECKED)
+    link_check_report (check, resp, message);
 
-      /* Normally we are not interested in the response body of a error responses.
-         But if we are writing a WARC file we are: we like to keep everything.  */
-      if (warc_enabled)
-        {
-          int _err = read_response_body (hs, sock, NULL, contlen, 0,
-                                        chunked_transfer_encoding,
-                                        u->url, warc_timestamp_str,
-                                        warc_request_uuid, warc_ip, type,
-                                        statcode, head);
+  xfree (message);
+  resp_free (&resp);
+  xfree (head);
 
-          if (_err != RETRFINISHED || hs->res < 0)
-            {
-              CLOSE_INVALIDATE (sock);
-              retval = _err;
-              goto cleanup;
-            }
+  lc_done (c);
+  if (keep_alive)
+    c->reused = true;
+  else
+    lc_close (c);
+}
 
-          CLOSE_FINISH (sock);
+/* Called by fd_dispatch when the connection FD of the link_conn ARG is
+   ready for what it waits for.  */
+
+static void
+link_conn_ready (int fd, int events _GL_UNUSED, void *arg)
+{
+  struct link_conn *c = arg;
+  const char *end;
+  int ret;
+
+  if (fd != c->sock || !c->check)
+    return;
+  c->last_activity = ptimer_measure (c->lc->timer);
+
+  if (c->state == LC_CONNECTING)
+    {
+      if (connect_to_ip_finish (fd) < 0)
+        {
+          DEBUGP (("Connection to %s:%d failed: %s\n",
+                   c->host, c->port, strerror (errno)));
+          lc_fail (c);
+          return;
         }
-      else
+#ifdef HAVE_SSL
+      if (c->ssl && (!ssl_connect_wget (fd, c->host, NULL, NULL)
+                     || !ssl_check_certificate (fd, c->host)))
         {
-          /* Since WARC is disabled, we are not interested in the response body.  */
-          if (head_only)
-            /* Pre-1.10 Wget used CLOSE_INVALIDATE here.  Now we trust the
-               servers not to send body in response to a HEAD request, and
-               those that do will likely be caught by test_socket_open.
-               If not, they can be worked around using
-               `--no-http-keep-alive'.  */
-            CLOSE_FINISH (sock);
-          else if (opt.spider && !opt.recursive)
-            /* we just want to see if the page exists - no downloading required */
-            CLOSE_INVALIDATE (sock);
-          else if (keep_alive
-                   && skip_short_body (sock, contlen, chunked_transfer_encoding))
-            /* Successfully skipped the body; also keep using the socket. */
-            CLOSE_FINISH (sock);
-          else
-            CLOSE_INVALIDATE (sock);
+          lc_fail (c);
+          return;
         }
+#endif
+      c->state = LC_SENDING;
+    }
 
-      if (statcode == HTTP_STATUS_GATEWAY_TIMEOUT)
-        retval = GATEWAYTIMEOUT;
-      else
-        retval = RETRFINISHED;
-
-      goto cleanup;
+  if (c->state == LC_SENDING)
+    {
+      ret = fd_write_nb (fd, c->request + c->sent,
+                         c->request_size - c->sent, &c->wait_for);
+      if (ret == FD_WOULDBLOCK)
+        return;
+      if (ret < 0)
+        {
+          lc_restart (c);
+          return;
+        }
+      c->sent += ret;
+      if (c->sent == c->request_size)
+        {
+          DEBUGP (("\n---request begin---\n%s---request end---\n",
+                   c->request));
+          c->sent_tm = host_link_now ();
+          c->state = LC_READING;
+          c->wait_for = WAIT_FOR_READ;
+        }
+      return;
     }
 
-  err = open_output_stream (hs, count, &fp);
-  if (err != RETROK)
+  if (c->head_size - c->head_len < 4096)
     {
-      CLOSE_INVALIDATE (sock);
-      retval = err;
-      goto cleanup;
+      c->head_size = c->head_size ? 2 * c->head_size : 8192;
+      c->head = xrealloc (c->head, c->head_size);
+    }
+  ret = fd_read_nb (fd, c->head + c->head_len, c->head_size - c->head_len,
+                    &c->wait_for);
+  if (ret == FD_WOULDBLOCK)
+    return;
+  if (ret <= 0)
+    {
+      if (ret < 0 && errno == ECONNRESET)
+        host_link_status (c->host, lc_host_conns (c->lc, c->host), 0);
+      lc_restart (c);
+      return;
     }
+  c->head_len += ret;
+
+  end = response_head_terminator (c->head, c->head + c->head_len - ret, ret);
+  if (end == c->head)
+    /* An HTTP/0.9 response.  */
+    lc_fail (c);
+  else if (end)
+    lc_response (c, end - c->head);
+  else if (c->head_len >= HTTP_RESPONSE_MAX_SIZE)
+    lc_fail (c);
+}
 
-#ifdef ENABLE_XATTR
-  if (opt.enable_xattr)
+/* Check the COUNT links of CHECKS with HEAD requests, over up to
+   opt.spider_connections connections at once, as many per host as its
+   budget allows, and set the result of each.  The broken links are reported and recorded with
+   nonexisting_url; retrieve_tree is to retrieve the unchecked ones.  */
+
+void
+http_check_links (struct link_check *checks, int count)
+{
+  struct link_checker lc;
+  struct link_check *check;
+  int i;
+
+  xzero (lc);
+  lc.count = MIN (MIN (opt.spider_connections, MAX_LINK_CONNECTIONS), count);
+  lc.timer = ptimer_new ();
+  lc.started = xcalloc (count, sizeof (bool));
+  for (i = 0; i < lc.count; i++)
     {
-      if (original_url != u)
-        set_file_metadata (u, original_url, fp);
-      else
-        set_file_metadata (u, NULL, fp);
+      lc.conns[i].lc = &lc;
+      lc.conns[i].sock = -1;
     }
-#endif
+  for (i = 0; i < count; i++)
+    checks[i].result = LINK_UNCHECKED;
 
-  err = read_response_body (hs, sock, fp, contlen, contrange,
-                            chunked_transfer_encoding,
-                            u->url, warc_timestamp_str,
-                            warc_request_uuid, warc_ip, type,
-                            statcode, head);
+  /* The active connection is as good as the idle ones: a spider
+     sends no requests ahead on it.  */
+  if (pconn_active)
+    pconn_park ();
 
-  if (hs->res >= 0)
-    CLOSE_FINISH (sock);
-  else
-    CLOSE_INVALIDATE (sock);
+  logprintf (LOG_VERBOSE, _("Checking %d links over %d connections.\n"),
+             count, lc.count);
 
-  if (!output_stream)
-    fclose (fp);
+  for (;;)
+    {
+      double now = ptimer_measure (lc.timer);
+      int busy = 0;
 
-  retval = err;
+      for (i = 0; i < lc.count; i++)
+        {
+          struct link_conn *c = &lc.conns[i];
 
-  cleanup:
-  xfree (head);
-  xfree (type);
-  xfree (message);
-  resp_free (&resp);
-  request_free (&req);
+          if (c->check)
+            {
+              double timeout = (c->state == LC_CONNECTING
+                                ? opt.connect_timeout : opt.read_timeout);
+              if (timeout && now - c->last_activity >= timeout)
+                lc_fail (c);
+            }
+          while (!c->check && (check = lc_pick (&lc, checks, count)))
+            lc_start (c, check);
+          if (!c->check)
+            continue;
+          busy++;
+          /* Watching a descriptor again costs nothing.  */
+          fd_watch (c->sock, c->wait_for, link_conn_ready, c);
+        }
+      if (!busy)
+        break;
 
-  return retval;
+      if (fd_dispatch (0.95) < 0)
+        for (i = 0; i < lc.count; i++)
+          if (lc.conns[i].check)
+            lc_fail (&lc.conns[i]);
+    }
+
+  /* Keep the connections for what comes next.  */
+  for (i = 0; i < lc.count; i++)
+    {
+      struct link_conn *c = &lc.conns[i];
+      if (c->sock >= 0)
+        {
+          fd_unwatch (c->sock);
+          register_persistent (c->host, c->port, c->sock, c->ssl);
+          pconn_park ();
+          c->sock = -1;
+        }
+      xfree (c->head);
+    }
+  xfree (lc.started);
+  ptimer_destroy (lc.timer);
 }
 
-/* Check whether the supplied HTTP status code is among those
-   listed for the --retry-on-http-error option. */
+/* Say whether attempt COUNT at U, which failed as HS tells, is
+   followed by another, and schedule it with retry_schedule.  A
+   deferred retry starts afresh, so only one that has nothing to
+   resume, and only if DEFERRABLE, is left for later: true is returned
+   then.  */
 static bool
-check_retry_on_http_error (const int statcode)
+http_retry (const struct url *u, int count, const struct http_stat *hs,
+            bool deferrable)
 {
-  const char *tok = opt.retry_on_http_error;
-  while (tok && *tok)
+  if (retry_schedule (u, count, hs->retry_after,
+                      deferrable && !hs->len && !hs->restval))
     {
-      if (atoi (tok) == statcode)
-        return true;
-      if ((tok = strchr (tok, ',')))
-        ++tok;
+      logputs (LOG_VERBOSE, _("Retrying later.\n\n"));
+      return true;
     }
+  printwhat (count, opt.ntry);
   return false;
 }
 
@@ -4267,6 +7897,10 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
   struct stat st;
   bool send_head_first = true;
   bool force_full_retrieve = false;
+  wgint zsync_fetched;           /* bytes fetched by zsync_retrieve */
+  /* Whether a retry can be left to the caller: not that of a
+     retrieval this one starts, such as that of a Metalink file.  */
+  bool deferrable = retry_deferral (false);
 
 
   /* If we are writing to a WARC file: always retrieve the whole file. */
@@ -4326,8 +7960,8 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
       goto exit;
     }
 
-  /* Reset the counter. */
-  count = 0;
+  /* Reset the counter, but not for a deferred retry. */
+  count = retry_deferred_tries (u);
 
   /* Reset the document type. */
   *dt = 0;
@@ -4351,16 +7985,43 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
 
   if (opt.timestamping)
     {
+      const struct validator *v = NULL;
+
+      if (opt.validators_file && !send_head_first && got_name
+          && file_exists_p (hstat.local_file, NULL))
+        {
+          uerr_t timestamp_err = set_file_timestamp (&hstat);
+          if (timestamp_err != RETROK)
+            return timestamp_err;
+          v = validators_lookup (u->url, hstat.orig_file_name);
+        }
+
+      /* Updating the file from its zsync control file needs to know
+         that it changed before its body is asked for.  */
+      if (opt.zsync && got_name && file_exists_p (hstat.local_file, NULL))
+        send_head_first = true;
       /* Use conditional get request if requested
        * and if timestamp is known at this moment.  */
-      if (opt.if_modified_since && !send_head_first && got_name && file_exists_p (hstat.local_file, NULL))
+      else if (v && (v->etag || opt.if_modified_since))
         {
+          /* Send the validators the server gave for the file, which
+             work where it has no Last-Modified, or one unrelated to
+             the time-stamp of the local file.  */
           *dt |= IF_MODIFIED_SINCE;
-          {
-            uerr_t timestamp_err = set_file_timestamp (&hstat);
-            if (timestamp_err != RETROK)
-              return timestamp_err;
-          }
+          if (v->etag)
+            hstat.cond_etag = xstrdup (v->etag);
+          if (v->last_modified && opt.if_modified_since)
+            hstat.cond_last_modified = xstrdup (v->last_modified);
+        }
+      else if (opt.if_modified_since && !send_head_first && got_name && file_exists_p (hstat.local_file, NULL))
+        {
+          *dt |= IF_MODIFIED_SINCE;
+          if (!hstat.timestamp_checked)
+            {
+              uerr_t timestamp_err = set_file_timestamp (&hstat);
+              if (timestamp_err != RETROK)
+                return timestamp_err;
+            }
         }
         /* Send preliminary HEAD request if -N is given and we have existing
          * destination file or content disposition is enabled.  */
@@ -4373,7 +8034,7 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
     {
       /* Increment the pass counter.  */
       ++count;
-      sleep_between_retrievals (count);
+      sleep_between_retrievals (u, count);
 
       /* Get the current time string.  */
       tms = datetime_str (time (NULL));
@@ -4427,9 +8088,11 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
            hstat.len even if count>1 because we don't want a failed
            first attempt to clobber existing data.)  */
         hstat.restval = st.st_size;
-      else if (count > 1)
+      else if (count > 1 && !hstat.captured)
         {
-          /* otherwise, continue where the previous try left off */
+          /* otherwise, continue where the previous try left off;
+             a body that was only digested is read again from the
+             start */
           if (hstat.len < hstat.restval)
             hstat.restval -= hstat.len;
           else
@@ -4450,8 +8113,16 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
       else
         *dt &= ~SEND_NOCACHE;
 
-      /* Try fetching the document, or at least its head.  */
+      /* Try fetching the document, or at least its head.  The byte
+         counts are only updated by a body being read.  */
+      hstat.rd_size = 0;
+      hstat.dltime = 0;
+      metrics_begin ();
       err = gethttp (u, original_url, &hstat, dt, proxy, count);
+      metrics_end (u, count, hstat.rd_size, hstat.len - hstat.restval,
+                   hstat.dltime,
+                   (err == RETROK || err == RETRFINISHED)
+                   && (*dt & RETROKF) != 0);
 
       /* Time?  */
       tms = datetime_str (time (NULL));
@@ -4468,7 +8139,11 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
           /* Non-fatal errors continue executing the loop, which will
              bring them to "while" statement at the end, to judge
              whether the number of tries was exceeded.  */
-          printwhat (count, opt.ntry);
+          if (http_retry (u, count, &hstat, deferrable))
+            {
+              ret = RETRYLATER;
+              goto exit;
+            }
           continue;
         case FWRITEERR: case FOPENERR:
           /* Another fatal error.  */
@@ -4481,7 +8156,11 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
           /* Fatal unless option set otherwise. */
           if ( opt.retry_on_host_error )
             {
-              printwhat (count, opt.ntry);
+              if (http_retry (u, count, &hstat, deferrable))
+                {
+                  ret = RETRYLATER;
+                  goto exit;
+                }
               continue;
             }
           ret = err;
@@ -4599,7 +8278,7 @@ http_loop (struct url *u, struct url *original_url, char **newloc,
            * spider mode.
            * Don't log error if it was UTF-8 encoded because we will try
            * once unencoded. */
-          else if (opt.spider && u->enc_type != ENC_IRI)
+          else if (opt.spider && !iri_fallback_p (u))
             {
               /* #### Again: ugly ugly ugly! */
               if (!hurl)
@@ -4610,8 +8289,12 @@ Remote file does not exist -- broken link!!!\n"));
             }
           else if (check_retry_on_http_error (hstat.statcode))
             {
-              printwhat (count, opt.ntry);
               xfree (hurl);
+              if (http_retry (u, count, &hstat, deferrable))
+                {
+                  ret = RETRYLATER;
+                  goto exit;
+                }
               continue;
             }
           else
@@ -4695,6 +8378,25 @@ The sizes do not match (local %s) -- retrieving.\n"),
                         }
                     }
 
+                  /* The file is to be retrieved again; with --zsync,
+                     only the blocks of it that changed are.  */
+                  if (opt.zsync && hstat.orig_file_name && !hstat.temporary
+                      && zsync_retrieve (u, hstat.local_file,
+                                         hstat.orig_file_name, hstat.contlen,
+                                         &zsync_fetched))
+                    {
+                      if (opt.useservertimestamps && tmr != (time_t) (-1))
+                        touch (hstat.local_file, tmr);
+                      ++numurls;
+                      total_downloaded_bytes += zsync_fetched;
+                      remember_validators (u, &hstat, *dt);
+                      downloaded_file (FILE_DOWNLOADED_NORMALLY,
+                                       hstat.local_file);
+                      *dt &= ~HEAD_ONLY;
+                      ret = RETROK;
+                      goto exit;
+                    }
+
                   /* free_hstat (&hstat); */
                   hstat.timestamp_checked = true;
                 }
@@ -4750,7 +8452,7 @@ Remote file exists.\n\n"));
             } /* send_head_first */
         } /* !got_head */
 
-      if (opt.useservertimestamps
+      if (opt.useservertimestamps && !hstat.captured
           && (tmr != (time_t) (-1))
           && ((hstat.len == hstat.contlen) ||
               ((hstat.res == 0) && (hstat.contlen == -1))))
@@ -4782,14 +8484,20 @@ Remote file exists.\n\n"));
             {
               bool write_to_stdout = (opt.output_document && HYPHENP (opt.output_document));
 
-              logprintf (LOG_VERBOSE,
-                         write_to_stdout
-                         ? _("%s (%s) - written to stdout %s[%s/%s]\n\n")
-                         : _("%s (%s) - '%s' saved [%s/%s]\n\n"),
-                         tms, tmrate,
-                         write_to_stdout ? "" : hstat.local_file,
-                         number_to_static_string (hstat.len),
-                         number_to_static_string (hstat.contlen));
+              if (hstat.captured)
+                logprintf (LOG_VERBOSE,
+                           _("%s (%s) - read for its links [%s/%s]\n\n"),
+                           tms, tmrate, number_to_static_string (hstat.len),
+                           number_to_static_string (hstat.contlen));
+              else
+                logprintf (LOG_VERBOSE,
+                           write_to_stdout
+                           ? _("%s (%s) - written to stdout %s[%s/%s]\n\n")
+                           : _("%s (%s) - '%s' saved [%s/%s]\n\n"),
+                           tms, tmrate,
+                           write_to_stdout ? "" : hstat.local_file,
+                           number_to_static_string (hstat.len),
+                           number_to_static_string (hstat.contlen));
               logprintf (LOG_NONVERBOSE,
                          "%s URL:%s [%s/%s] -> \"%s\" [%d]\n",
                          tms, u->url,
@@ -4800,6 +8508,9 @@ Remote file exists.\n\n"));
           ++numurls;
           total_downloaded_bytes += hstat.rd_size;
 
+          remember_validators (u, &hstat, *dt);
+          remember_in_cache (u, &hstat, *dt);
+
           /* Remember that we downloaded the file for later ".orig" code. */
           if (*dt & ADDED_HTML_EXTENSION)
             downloaded_file (FILE_DOWNLOADED_AND_HTML_EXTENSION_ADDED, hstat.local_file);
@@ -4818,13 +8529,19 @@ Remote file exists.\n\n"));
                 {
                   bool write_to_stdout = (opt.output_document && HYPHENP (opt.output_document));
 
-                  logprintf (LOG_VERBOSE,
-                             write_to_stdout
-                             ? _("%s (%s) - written to stdout %s[%s]\n\n")
-                             : _("%s (%s) - '%s' saved [%s]\n\n"),
-                             tms, tmrate,
-                             write_to_stdout ? "" : hstat.local_file,
-                             number_to_static_string (hstat.len));
+                  if (hstat.captured)
+                    logprintf (LOG_VERBOSE,
+                               _("%s (%s) - read for its links [%s]\n\n"),
+                               tms, tmrate,
+                               number_to_static_string (hstat.len));
+                  else
+                    logprintf (LOG_VERBOSE,
+                               write_to_stdout
+                               ? _("%s (%s) - written to stdout %s[%s]\n\n")
+                               : _("%s (%s) - '%s' saved [%s]\n\n"),
+                               tms, tmrate,
+                               write_to_stdout ? "" : hstat.local_file,
+                               number_to_static_string (hstat.len));
                   if (!(opt.verbose || opt.quiet))
                     {
                       char *url = url_string (u, URL_AUTH_HIDE_PASSWD);
@@ -4838,6 +8555,9 @@ Remote file exists.\n\n"));
               ++numurls;
               total_downloaded_bytes += hstat.rd_size;
 
+              remember_validators (u, &hstat, *dt);
+              remember_in_cache (u, &hstat, *dt);
+
               /* Remember that we downloaded the file for later ".orig" code. */
               if (*dt & ADDED_HTML_EXTENSION)
                 downloaded_file (FILE_DOWNLOADED_AND_HTML_EXTENSION_ADDED, hstat.local_file);
@@ -4853,7 +8573,7 @@ Remote file exists.\n\n"));
               logprintf (LOG_VERBOSE,
                          _("%s (%s) - Connection closed at byte %s. "),
                          tms, tmrate, number_to_static_string (hstat.len));
-              printwhat (count, opt.ntry);
+              http_retry (u, count, &hstat, false);
               continue;
             }
           else if (hstat.len != hstat.restval)
@@ -4877,7 +8597,7 @@ Remote file exists.\n\n"));
                          _("%s (%s) - Read error at byte %s (%s)."),
                          tms, tmrate, number_to_static_string (hstat.len),
                          hstat.rderrmsg);
-              printwhat (count, opt.ntry);
+              http_retry (u, count, &hstat, false);
               continue;
             }
           else /* hstat.res == -1 and contlen is given */
@@ -4888,7 +8608,7 @@ Remote file exists.\n\n"));
                          number_to_static_string (hstat.len),
                          number_to_static_string (hstat.contlen),
                          hstat.rderrmsg);
-              printwhat (count, opt.ntry);
+              http_retry (u, count, &hstat, false);
               continue;
             }
         }
@@ -4897,6 +8617,7 @@ Remote file exists.\n\n"));
   while (!opt.ntry || (count < opt.ntry));
 
 exit:
+  retry_deferral (deferrable);
   if ((ret == RETROK || opt.content_on_error) && local_file)
     {
       xfree (*local_file);
@@ -5096,32 +8817,53 @@ dump_hash (char *buf, const unsigned char *hash)
   *buf = '\0';
 }
 
-/* Take the line apart to find the challenge, and compose a digest
-   authorization header.  See RFC2069 section 2.1.2.  */
-static char *
-digest_authentication_encode (const char *au, const char *user,
-                              const char *passwd, const char *method,
-                              const char *path, uerr_t *auth_err)
+/* A Digest challenge answered with a user's credentials.  The
+   challenge is kept by the server it came from, so that the requests
+   that follow are answered without waiting to be challenged again;
+   the nonce count goes up with each answer.  */
+struct digest_space {
+  char *realm, *opaque, *nonce, *qop, *algorithm;
+  char *user;                   /* whose credentials answered it */
+  char *dir;                    /* directory of the path it came for */
+  char cnonce[16];
+  unsigned int nc;              /* the nonce count of the last answer */
+};
+
+/* The Digest challenges answered, by "host:port".  */
+static struct hash_table *digest_spaces;
+
+static void
+digest_space_free (struct digest_space *space)
+{
+  xfree (space->realm);
+  xfree (space->opaque);
+  xfree (space->nonce);
+  xfree (space->qop);
+  xfree (space->algorithm);
+  xfree (space->user);
+  xfree (space->dir);
+  xfree (space);
+}
+
+/* Take the line apart to find the challenge, and return it as a
+   protection space of USER for PATH, or NULL if it misses attributes.
+   See RFC2069 section 2.1.2.  */
+static struct digest_space *
+digest_space_new (const char *au, const char *user, const char *path)
 {
-  static char *realm, *opaque, *nonce, *qop, *algorithm;
-  static struct {
+  struct digest_space *space = xnew0 (struct digest_space);
+  struct {
     const char *name;
     char **variable;
   } options[] = {
-    { "realm", &realm },
-    { "opaque", &opaque },
-    { "nonce", &nonce },
-    { "qop", &qop },
-    { "algorithm", &algorithm }
+    { "realm", &space->realm },
+    { "opaque", &space->opaque },
+    { "nonce", &space->nonce },
+    { "qop", &space->qop },
+    { "algorithm", &space->algorithm }
   };
-  char cnonce[16] = "";
-  char *res = NULL;
-  int res_len;
-  size_t res_size;
   param_token name, value;
-
-
-  realm = opaque = nonce = algorithm = qop = NULL;
+  const char *end;
 
   au += 6;                      /* skip over `Digest' */
   while (extract_param (&au, &name, &value, ',', NULL))
@@ -5133,27 +8875,56 @@ digest_authentication_encode (const char *au, const char *user,
             && 0 == strncmp (name.b, options[i].name,
                              namelen))
           {
+            xfree (*options[i].variable);
             *options[i].variable = strdupdelim (value.b, value.e);
             break;
           }
     }
 
-  if (qop && strcmp (qop, "auth"))
+  if (space->qop && strcmp (space->qop, "auth"))
     {
-      logprintf (LOG_NOTQUIET, _("Unsupported quality of protection '%s'.\n"), qop);
-      xfree (qop); /* force freeing mem and continue */
+      logprintf (LOG_NOTQUIET, _("Unsupported quality of protection '%s'.\n"), space->qop);
+      xfree (space->qop); /* force freeing mem and continue */
     }
-  else if (algorithm && strcmp (algorithm,"MD5") && strcmp (algorithm,"MD5-sess"))
+  else if (space->algorithm && strcmp (space->algorithm,"MD5")
+           && strcmp (space->algorithm,"MD5-sess"))
     {
-      logprintf (LOG_NOTQUIET, _("Unsupported algorithm '%s'.\n"), algorithm);
-      xfree (algorithm); /* force freeing mem and continue */
+      logprintf (LOG_NOTQUIET, _("Unsupported algorithm '%s'.\n"), space->algorithm);
+      xfree (space->algorithm); /* force freeing mem and continue */
     }
 
-  if (!realm || !nonce || !user || !passwd || !path || !method)
+  if (!space->realm || !space->nonce || !user || !path)
     {
-      *auth_err = ATTRMISSING;
-      goto cleanup;
-   }
+      digest_space_free (space);
+      return NULL;
+    }
+
+  /* generate random hex string */
+  snprintf (space->cnonce, sizeof (space->cnonce), "%08x",
+            (unsigned) random_number (INT_MAX));
+  space->user = xstrdup (user);
+  end = strrchr (path, '/');
+  space->dir = end ? strdupdelim (path, end + 1) : xstrdup ("");
+  return space;
+}
+
+/* Compose the authorization header answering the challenge of SPACE
+   for METHOD and PATH, counting one more use of its nonce.  */
+static char *
+digest_space_answer (struct digest_space *space, const char *passwd,
+                     const char *method, const char *path)
+{
+  const char *user = space->user, *realm = space->realm;
+  const char *nonce = space->nonce, *opaque = space->opaque;
+  const char *qop = space->qop, *algorithm = space->algorithm;
+  const char *cnonce = space->cnonce;
+  char nc[9];
+  char *res;
+  int res_len;
+  size_t res_size;
+
+  ++space->nc;
+  snprintf (nc, sizeof (nc), "%08x", space->nc);
 
   /* Calculate the digest value.  */
   {
@@ -5176,9 +8947,6 @@ digest_authentication_encode (const char *au, const char *user,
     if (algorithm && !strcmp (algorithm, "MD5-sess"))
       {
         /* A1BUF = H( H(user ":" realm ":" password) ":" nonce ":" cnonce ) */
-        snprintf (cnonce, sizeof (cnonce), "%08x",
-          (unsigned) random_number (INT_MAX));
-
         md5_init_ctx (&ctx);
         /* md5_process_bytes (hash, MD5_DIGEST_SIZE, &ctx); */
         md5_process_bytes (a1buf, MD5_DIGEST_SIZE * 2, &ctx);
@@ -5202,18 +8970,13 @@ digest_authentication_encode (const char *au, const char *user,
     if (qop && !strcmp (qop, "auth"))
       {
         /* RFC 2617 Digest Access Authentication */
-        /* generate random hex string */
-        if (!*cnonce)
-          snprintf (cnonce, sizeof (cnonce), "%08x",
-            (unsigned) random_number (INT_MAX));
-
         /* RESPONSE_DIGEST = H(A1BUF ":" nonce ":" noncecount ":" clientnonce ":" qop ": " A2BUF) */
         md5_init_ctx (&ctx);
         md5_process_bytes ((unsigned char *)a1buf, MD5_DIGEST_SIZE * 2, &ctx);
         md5_process_bytes ((unsigned char *)":", 1, &ctx);
         md5_process_bytes ((unsigned char *)nonce, strlen (nonce), &ctx);
         md5_process_bytes ((unsigned char *)":", 1, &ctx);
-        md5_process_bytes ((unsigned char *)"00000001", 8, &ctx); /* TODO: keep track of server nonce values */
+        md5_process_bytes ((unsigned char *)nc, 8, &ctx);
         md5_process_bytes ((unsigned char *)":", 1, &ctx);
         md5_process_bytes ((unsigned char *)cnonce, strlen (cnonce), &ctx);
         md5_process_bytes ((unsigned char *)":", 1, &ctx);
@@ -5254,8 +9017,8 @@ digest_authentication_encode (const char *au, const char *user,
       {
         res_len = snprintf (res, res_size, "Digest "\
                 "username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", response=\"%s\""\
-                ", qop=auth, nc=00000001, cnonce=\"%s\"",
-                  user, realm, nonce, path, response_digest, cnonce);
+                ", qop=auth, nc=%s, cnonce=\"%s\"",
+                  user, realm, nonce, path, response_digest, nc, cnonce);
 
       }
     else
@@ -5276,15 +9039,86 @@ digest_authentication_encode (const char *au, const char *user,
       }
   }
 
-cleanup:
-  xfree (realm);
-  xfree (opaque);
-  xfree (nonce);
-  xfree (qop);
-  xfree (algorithm);
-
   return res;
 }
+
+static char *
+digest_space_key (const struct url *u)
+{
+  return aprintf ("%s:%d", u->host, u->port);
+}
+
+/* Answer the Digest challenge AU of U's server, and keep it for
+   answering the requests that follow.  */
+static char *
+digest_authentication_encode (const struct url *u, const char *au,
+                              const char *user, const char *passwd,
+                              const char *method, const char *path,
+                              uerr_t *auth_err)
+{
+  struct digest_space *space, *old;
+  char *key, *old_key;
+
+  if (!passwd || !method)
+    {
+      *auth_err = ATTRMISSING;
+      return NULL;
+    }
+  space = digest_space_new (au, user, path);
+  if (!space)
+    {
+      *auth_err = ATTRMISSING;
+      return NULL;
+    }
+
+  if (!digest_spaces)
+    digest_spaces = make_nocase_string_hash_table (1);
+  key = digest_space_key (u);
+  if (hash_table_get_pair (digest_spaces, key, &old_key, &old))
+    {
+      digest_space_free (old);
+      hash_table_put (digest_spaces, old_key, space);
+      xfree (key);
+    }
+  else
+    hash_table_put (digest_spaces, key, space);
+
+  return digest_space_answer (space, passwd, method, path);
+}
+
+/* If USER answered a Digest challenge of U's server for a directory
+   U's path is in, answer it again in REQ rather than wait for the
+   server to refuse the request.  */
+static bool
+maybe_send_digest_creds (const struct url *u, const char *user,
+                         const char *passwd, struct request *req)
+{
+  struct digest_space *space;
+  char *key, *path;
+
+  if (!digest_spaces)
+    return false;
+  key = digest_space_key (u);
+  space = hash_table_get (digest_spaces, key);
+  xfree (key);
+  if (!space || strcmp (space->user, user))
+    return false;
+
+  path = url_full_path (u);
+  if (strncmp (path, space->dir, strlen (space->dir)) != 0)
+    {
+      xfree (path);
+      return false;
+    }
+  DEBUGP (("Answering Digest challenge of realm %s ahead.\n",
+           quote (space->realm)));
+  request_set_header (req, "Authorization",
+                      digest_space_answer (space, passwd,
+                                           request_method (req), path),
+                      rel_value);
+  xfree (path);
+  return true;
+}
 #endif /* ENABLE_DIGEST */
 
 /* Computing the size of a string literal must take into account that
@@ -5310,6 +9144,9 @@ known_authentication_scheme_p (const char *hdrbeg, const char *hdrend)
 #endif
 #ifdef ENABLE_NTLM
     || STARTS ("NTLM", hdrbeg, hdrend)
+# ifdef HAVE_WINTLS
+    || STARTS ("Negotiate", hdrbeg, hdrend)
+# endif
 #endif
     ;
 }
@@ -5322,7 +9159,8 @@ known_authentication_scheme_p (const char *hdrbeg, const char *hdrend)
    are supported by the current implementation), produce an
    appropriate HTTP authorization request header.  */
 static char *
-create_authorization_line (const char *au, const char *user,
+create_authorization_line (const struct url *u,
+                           const char *au, const char *user,
                            const char *passwd, const char *method,
                            const char *path, bool *finished, uerr_t *auth_err)
 {
@@ -5336,12 +9174,13 @@ create_authorization_line (const char *au, const char *user,
 #ifdef ENABLE_DIGEST
     case 'D':                   /* Digest */
       *finished = true;
-      return digest_authentication_encode (au, user, passwd, method, path, auth_err);
+      return digest_authentication_encode (u, au, user, passwd, method, path,
+                                           auth_err);
 #endif
 #ifdef ENABLE_NTLM
-    case 'N':                   /* NTLM */
+    case 'N':                   /* NTLM, Negotiate */
 # ifdef HAVE_WINTLS
-      pconn.ntlm.host = pconn.host;
+      pconn.ntlm.host = (char *) pconn.host;
       pconn.ntlm.port = pconn.port;
 # endif
       if (!ntlm_input (&pconn.ntlm, au))
@@ -5383,6 +9222,8 @@ http_cleanup (void)
 {
   if (pconn_active)
     invalidate_persistent ();
+  while (pconn_pool_count)
+    pconn_pool_drop (0);
 
   if (wget_cookie_jar)
     {
@@ -5400,6 +9241,62 @@ http_cleanup (void)
       hash_table_destroy (basic_authed_hosts);
       basic_authed_hosts = NULL;
     }
+
+#ifdef ENABLE_DIGEST
+  if (digest_spaces)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (digest_spaces, &iter); hash_table_iter_next (&iter); )
+        {
+          xfree (iter.key);
+          digest_space_free (iter.value);
+        }
+      hash_table_destroy (digest_spaces);
+      digest_spaces = NULL;
+    }
+#endif
+
+#if defined ENABLE_NTLM && defined HAVE_WINTLS
+  if (sspi_authed_hosts)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (sspi_authed_hosts, &iter); hash_table_iter_next (&iter); )
+        {
+          xfree (iter.key);
+        }
+      hash_table_destroy (sspi_authed_hosts);
+      sspi_authed_hosts = NULL;
+    }
+  ntlm_cleanup ();
+#endif
+
+  http_pipeline_hints_clear ();
+  if (host_links)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (host_links, &iter); hash_table_iter_next (&iter); )
+        {
+          xfree (iter.key);
+          xfree (iter.value);
+        }
+      hash_table_destroy (host_links);
+      host_links = NULL;
+    }
+
+  if (pipeline_refused_hosts)
+    {
+      string_set_free (pipeline_refused_hosts);
+      pipeline_refused_hosts = NULL;
+    }
+
+#ifdef HAVE_NGHTTP2
+  while (http2_ahead_count)
+    http2_ahead_drop (0);
+  http2_cleanup ();
+#endif
+#ifdef HAVE_HTTP3
+  http3_cleanup ();
+#endif
 }
 #endif
 
@@ -5528,6 +9425,237 @@ filename*1=\"B\"", "AA.ext", true },
   return NULL;
 }
 
+const char *
+test_resp_header_locate (void)
+{
+  char head[] = "HTTP/1.1 200 OK\r\n"
+    "Set-Cookie: a=1\r\n"
+    "content-length: 42\r\n"
+    "X-Folded: one\r\n two\r\n"
+    "set-cookie: b=2\r\n"
+    "Content-Length-Extra: 7\r\n"
+    "\r\n";
+  struct response *resp = resp_new (head);
+  const char *b, *e;
+  int pos, n = 0;
+  char buf[32];
+
+  mu_assert ("test_resp_header_locate: Content-Length",
+             resp_header_copy (resp, "Content-Length", buf, sizeof (buf))
+             && 0 == strcmp (buf, "42"));
+  mu_assert ("test_resp_header_locate: X-Folded",
+             resp_header_copy (resp, "x-folded", buf, sizeof (buf))
+             && 0 == strcmp (buf, "one   two"));
+  mu_assert ("test_resp_header_locate: missing header",
+             !resp_header_get (resp, "Location", &b, &e));
+
+  for (pos = 0; (pos = resp_header_locate (resp, "Set-Cookie", pos,
+                                            &b, &e)) != -1; pos++)
+    {
+      mu_assert ("test_resp_header_locate: Set-Cookie order",
+                 0 == strncmp (b, n == 0 ? "a=1" : "b=2", e - b));
+      ++n;
+    }
+  mu_assert ("test_resp_header_locate: Set-Cookie count", n == 2);
+
+  resp_free (&resp);
+  return NULL;
+}
+
+#ifdef ENABLE_DIGEST
+static struct url *
+test_url (const char *url)
+{
+  struct url *u = url_new_init ();
+
+  u->ori_url = xstrdup (url);
+  if (url_parse (u, true, false) != 0)
+    abort ();
+  return u;
+}
+
+const char *
+test_digest_answered_ahead (void)
+{
+  struct url *u, *other;
+  struct request *req;
+  uerr_t err = RETROK;
+  char *first;
+  const char *value;
+
+  u = test_url ("http://example.com/dir/a.html");
+  first = digest_authentication_encode (u, "Digest realm=\"r\", nonce=\"n1\", "
+                                        "qop=\"auth\"", "user", "pass",
+                                        "GET", "/dir/a.html", &err);
+  mu_assert ("test_digest_answered_ahead: first answer",
+             err == RETROK && first && strstr (first, "nc=00000001"));
+  xfree (first);
+
+  other = test_url ("http://example.com/dir/sub/b.html");
+  req = request_new ("GET", url_full_path (other));
+  mu_assert ("test_digest_answered_ahead: same directory",
+             maybe_send_digest_creds (other, "user", "pass", req)
+             && req->hcount == 1);
+  value = req->headers[0].value;
+  mu_assert ("test_digest_answered_ahead: nonce count",
+             strstr (value, "nc=00000002")
+             && strstr (value, "uri=\"/dir/sub/b.html\"")
+             && strstr (value, "nonce=\"n1\""));
+  request_free (&req);
+  url_free (other);
+
+  other = test_url ("http://example.com/elsewhere.html");
+  req = request_new ("GET", url_full_path (other));
+  mu_assert ("test_digest_answered_ahead: other directory",
+             !maybe_send_digest_creds (other, "user", "pass", req));
+  mu_assert ("test_digest_answered_ahead: other user",
+             !maybe_send_digest_creds (u, "someone", "pass", req));
+  request_free (&req);
+  url_free (other);
+
+  url_free (u);
+  return NULL;
+}
+#endif
+
+const char *
+test_drain_limit (void)
+{
+  mu_assert ("test_drain_limit: unknown host",
+             drain_limit ("unknown.example") == DRAIN_MIN);
+
+  host_link_setup ("fast.example", 0.1);
+  mu_assert ("test_drain_limit: no rate yet",
+             drain_limit ("fast.example") == DRAIN_MIN);
+  /* A body too short to say anything about the rate.  */
+  host_link_rate ("fast.example", 100, 0.001);
+  mu_assert ("test_drain_limit: short body",
+             drain_limit ("fast.example") == DRAIN_MIN);
+  host_link_rate ("fast.example", 1000000, 1);
+  mu_assert ("test_drain_limit: setup time's worth",
+             drain_limit ("FAST.example") == 100000);
+  /* Smoothed: a second setup of 0.5s makes it 0.2s.  */
+  host_link_setup ("fast.example", 0.5);
+  mu_assert ("test_drain_limit: smoothed",
+             drain_limit ("fast.example") == 200000);
+  host_link_rate ("fast.example", 100000000, 1);
+  mu_assert ("test_drain_limit: at most DRAIN_MAX",
+             drain_limit ("fast.example") == DRAIN_MAX);
+
+  host_link_setup ("slow.example", 0.01);
+  host_link_rate ("slow.example", 20000, 1);
+  mu_assert ("test_drain_limit: at least DRAIN_MIN",
+             drain_limit ("slow.example") == DRAIN_MIN);
+
+  return NULL;
+}
+
+const char *
+test_host_budget (void)
+{
+  int i;
+
+  mu_assert ("test_host_budget: no budget at first",
+             host_budget ("busy.example") == 0);
+  host_link_ttfb ("busy.example", 8, 0.1);
+  mu_assert ("test_host_budget: no budget to grow",
+             host_budget ("busy.example") == 0);
+
+  /* Halved from what was in use, once for a burst.  */
+  host_link_status ("busy.example", 8, HTTP_STATUS_UNAVAILABLE);
+  host_link_status ("busy.example", 8, HTTP_STATUS_TOO_MANY_REQUESTS);
+  mu_assert ("test_host_budget: backed off",
+             host_budget ("BUSY.example") == 4);
+  host_link_status ("busy.example", 4, HTTP_STATUS_OK);
+  mu_assert ("test_host_budget: 200", host_budget ("busy.example") == 4);
+
+  /* About one more connection per budget's worth of responses.  */
+  for (i = 0; i < 4; i++)
+    host_link_ttfb ("busy.example", 4, 0.1);
+  mu_assert ("test_host_budget: grown", host_budget ("busy.example") == 4
+             && host_link_get ("busy.example")->budget > 4.9);
+  host_link_ttfb ("busy.example", 4, 0.1);
+  mu_assert ("test_host_budget: grown to 5",
+             host_budget ("busy.example") == 5);
+
+  /* Not while the bodies come slower.  */
+  host_link_rate ("busy.example", 1000000, 1);
+  host_link_rate ("busy.example", 100000, 1);
+  host_link_ttfb ("busy.example", 5, 0.1);
+  mu_assert ("test_host_budget: rate not held",
+             host_budget ("busy.example") == 5
+             && host_link_get ("busy.example")->budget < 5.4);
+
+  /* Responses much slower than usual, several in a row.  */
+  host_link_get ("busy.example")->backed_off = -1;
+  host_link_ttfb ("busy.example", 5, 1);
+  host_link_ttfb ("busy.example", 5, 1);
+  mu_assert ("test_host_budget: two slow responses",
+             host_budget ("busy.example") == 5
+             && host_link_get ("busy.example")->ttfb < 0.2);
+  host_link_ttfb ("busy.example", 5, 1);
+  mu_assert ("test_host_budget: slow responses",
+             host_budget ("busy.example") == 2);
+
+  /* The jitter of a fast host is no slowdown.  */
+  for (i = 0; i < 3; i++)
+    host_link_ttfb ("fast.example", 8, 0.0001);
+  for (i = 0; i < 5; i++)
+    host_link_ttfb ("fast.example", 8, 0.001);
+  mu_assert ("test_host_budget: jitter",
+             host_budget ("fast.example") == 0);
+  return NULL;
+}
+
+const char *
+test_retry_after (void)
+{
+  mu_assert ("test_retry_after: seconds",
+             retry_after_seconds ("120") == 120);
+  mu_assert ("test_retry_after: spaces",
+             retry_after_seconds (" 5 ") == 5);
+  mu_assert ("test_retry_after: malformed",
+             retry_after_seconds ("5s") == 0
+             && retry_after_seconds ("soon") == 0);
+  mu_assert ("test_retry_after: past date",
+             retry_after_seconds ("Sun, 06 Nov 1994 08:49:37 GMT") == 0);
+  mu_assert ("test_retry_after: future date",
+             retry_after_seconds ("Fri, 31 Dec 2100 23:59:59 GMT") > 0);
+  return NULL;
+}
+
+const char *
+test_parse_cache_freshness (void)
+{
+  const char *date = "Sun, 06 Nov 1994 08:49:37 GMT";
+  const char *later = "Sun, 06 Nov 1994 09:49:37 GMT";
+  time_t now = 1000000000, t;
+
+  mu_assert ("test_parse_cache_freshness: no headers",
+             parse_cache_freshness (NULL, NULL, NULL, now, &t) && t == 0);
+  mu_assert ("test_parse_cache_freshness: max-age",
+             parse_cache_freshness ("public, max-age=60", NULL, NULL, now, &t)
+             && t == now + 60);
+  mu_assert ("test_parse_cache_freshness: max-age over Expires",
+             parse_cache_freshness ("max-age=0", later, date, now, &t)
+             && t == 0);
+  mu_assert ("test_parse_cache_freshness: Expires from Date",
+             parse_cache_freshness (NULL, later, date, now, &t)
+             && t == now + 3600);
+  mu_assert ("test_parse_cache_freshness: past Expires",
+             parse_cache_freshness (NULL, "0", date, now, &t) && t == 0);
+  mu_assert ("test_parse_cache_freshness: no-cache",
+             parse_cache_freshness ("max-age=60, no-cache", NULL, NULL, now,
+                                    &t)
+             && t == 0);
+  mu_assert ("test_parse_cache_freshness: no-store",
+             !parse_cache_freshness ("private, no-store", NULL, NULL, now,
+                                     &t));
+  mu_assert ("test_parse_cache_freshness: malformed",
+             !parse_cache_freshness ("max-age=60, =", NULL, NULL, now, &t));
+  return NULL;
+}
+
 #endif /* TESTING */
 
 /*
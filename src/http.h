@@ -39,7 +39,29 @@ uerr_t http_loop (struct url *, struct url *, char **, char **, const char *,
                   int *, struct url *);
 void save_cookies (void);
 void http_cleanup (void);
+bool persistent_connection_exists_p (const char *, int, bool);
+void http_pipeline_hint (struct url *, const char *);
+void http_pipeline_hints_clear (void);
+uerr_t http_get_pieces (struct url **, int, FILE *, const char *, wgint, wgint,
+                        const bool *,
+                        bool (*) (int, const char *, wgint, void *), void *);
 time_t http_atotm (const char *);
+const char *http_status_reason (int);
+
+/* The outcome of a link check.  */
+enum { LINK_UNCHECKED, LINK_OK, LINK_BROKEN };
+
+/* A link to check with http_check_links.  */
+struct link_check {
+  struct url *url;
+  char *referer;
+  bool follow_css;              /* whether CSS found there is parsed */
+  int result;                   /* set by http_check_links */
+  int statcode;
+};
+
+bool http_link_checkable (struct url *);
+void http_check_links (struct link_check *, int);
 
 typedef struct {
   /* A token consists of characters in the [b, e) range. */
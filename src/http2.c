@@ -0,0 +1,681 @@
+/* HTTP/2 client sessions.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <nghttp2/nghttp2.h>
+
+#include "utils.h"
+#include "connect.h"
+#include "http.h"
+#include "http2.h"
+
+/* An HTTP/2 session multiplexes the requests to a host over a single
+   TLS connection, for which the server chose "h2" through ALPN.
+   http.c keeps using its HTTP/1.1 request and response code with it:
+   each request is opened as a stream, and the stream is handed out as
+   a file descriptor of its own (a dup of the connection's socket) with
+   a transport registered on it.  Reading from that descriptor yields
+   the response head, written out as an HTTP/1.1 head for resp_new to
+   parse, followed by the body.  The frames of all the streams of a
+   session are processed whenever any of them is read, so the
+   responses to requests opened ahead of time come in while an earlier
+   response is being read.
+
+   nghttp2 does the framing and the HPACK header compression.  The
+   headers repeated in every request, such as User-Agent and Cookie,
+   are sent in full once and as references to the dynamic table of the
+   connection afterwards.  */
+
+/* Maximum number of sessions kept open, to as many hosts. */
+#define HTTP2_SESSIONS_MAX 8
+
+/* Flow control windows.  A stream opened ahead of time may have this
+   much of its body received before it is read ...  */
+#define HTTP2_STREAM_WINDOW (256 * 1024)
+
+/* ... and the stream being read may have this much in flight.  */
+#define HTTP2_ACTIVE_WINDOW (16 * 1024 * 1024)
+
+/* The connection window is kept out of the way, so that streams
+   waiting to be read never hold up the one that is.  */
+#define HTTP2_CONNECTION_WINDOW (1 << 30)
+
+struct http2_session {
+  nghttp2_session *ngh;
+  int sock;                     /* the TLS connection, -1 once closed */
+  char *host;
+  int port;
+  int streams;                  /* number of open stream descriptors */
+  bool listed;                  /* whether new streams may be opened */
+};
+
+/* Bytes received for a stream and not read yet.  */
+struct stream_buf {
+  char *data;
+  size_t pos, len, size;
+};
+
+struct http2_stream {
+  struct http2_session *session;
+  int32_t id;
+  struct stream_buf head;       /* the response heads, as HTTP/1.1 text */
+  struct stream_buf body;       /* the DATA received */
+  int status;                   /* status of the head being received */
+  bool final_head;              /* the non-1xx head has been received */
+  bool reading;                 /* read from, see HTTP2_ACTIVE_WINDOW */
+  bool closed;                  /* closed by the server or nghttp2 */
+  uint32_t error;               /* the error code it was closed with */
+};
+
+/* The sessions to which requests can be sent, oldest first.  */
+static struct http2_session *sessions[HTTP2_SESSIONS_MAX];
+static int session_count;
+
+static void
+stream_buf_append (struct stream_buf *b, const void *data, size_t n)
+{
+  if (b->pos == b->len)
+    b->pos = b->len = 0;
+  if (b->len + n > b->size && b->pos)
+    {
+      memmove (b->data, b->data + b->pos, b->len - b->pos);
+      b->len -= b->pos;
+      b->pos = 0;
+    }
+  if (b->len + n > b->size)
+    {
+      b->size = MAX (2 * b->size, b->len + n);
+      b->data = xrealloc (b->data, b->size);
+    }
+  memcpy (b->data + b->len, data, n);
+  b->len += n;
+}
+
+static int
+on_header (nghttp2_session *ngh, const nghttp2_frame *frame,
+           const uint8_t *name, size_t namelen,
+           const uint8_t *value, size_t valuelen,
+           uint8_t flags _GL_UNUSED, void *arg _GL_UNUSED)
+{
+  struct http2_stream *st;
+
+  if (frame->hd.type != NGHTTP2_HEADERS)
+    return 0;
+  st = nghttp2_session_get_stream_user_data (ngh, frame->hd.stream_id);
+  /* The headers following the final head are trailers, which Wget
+     has no use for.  */
+  if (!st || st->final_head)
+    return 0;
+
+  if (namelen == 7 && 0 == memcmp (name, ":status", 7))
+    {
+      char *line;
+
+      st->status = atoi ((const char *) value);
+      line = aprintf ("HTTP/2 %.*s %s\r\n", (int) valuelen, value,
+                      http_status_reason (st->status));
+      stream_buf_append (&st->head, line, strlen (line));
+      xfree (line);
+    }
+  else if (st->status)
+    {
+      stream_buf_append (&st->head, name, namelen);
+      stream_buf_append (&st->head, ": ", 2);
+      stream_buf_append (&st->head, value, valuelen);
+      stream_buf_append (&st->head, "\r\n", 2);
+    }
+  return 0;
+}
+
+static int
+on_frame_recv (nghttp2_session *ngh, const nghttp2_frame *frame,
+               void *arg _GL_UNUSED)
+{
+  struct http2_stream *st;
+
+  if (frame->hd.type != NGHTTP2_HEADERS
+      || !(frame->hd.flags & NGHTTP2_FLAG_END_HEADERS))
+    return 0;
+  st = nghttp2_session_get_stream_user_data (ngh, frame->hd.stream_id);
+  if (!st || st->final_head || !st->status)
+    return 0;
+
+  stream_buf_append (&st->head, "\r\n", 2);
+  if (st->status >= 200)
+    st->final_head = true;
+  st->status = 0;
+  return 0;
+}
+
+static int
+on_data_chunk_recv (nghttp2_session *ngh, uint8_t flags _GL_UNUSED,
+                    int32_t stream_id, const uint8_t *data, size_t len,
+                    void *arg _GL_UNUSED)
+{
+  struct http2_stream *st;
+
+  nghttp2_session_consume_connection (ngh, len);
+  st = nghttp2_session_get_stream_user_data (ngh, stream_id);
+  if (st)
+    stream_buf_append (&st->body, data, len);
+  return 0;
+}
+
+static int
+on_stream_close (nghttp2_session *ngh, int32_t stream_id,
+                 uint32_t error_code, void *arg _GL_UNUSED)
+{
+  struct http2_stream *st;
+
+  st = nghttp2_session_get_stream_user_data (ngh, stream_id);
+  if (st)
+    {
+      st->closed = true;
+      st->error = error_code;
+    }
+  return 0;
+}
+
+/* Write out what nghttp2 has queued for S.  */
+
+static bool
+session_flush (struct http2_session *s)
+{
+  const uint8_t *data;
+  ssize_t n;
+
+  if (s->sock < 0)
+    return false;
+  while ((n = nghttp2_session_mem_send (s->ngh, &data)) > 0)
+    if (fd_write (s->sock, (char *) data, n, -1) < 0)
+      return false;
+  return n == 0;
+}
+
+/* Release S, saying goodbye to the server if the connection is still
+   open.  */
+
+static void
+session_free (struct http2_session *s)
+{
+  DEBUGP (("Closing HTTP/2 session to %s:%d.\n", s->host, s->port));
+  if (s->sock >= 0)
+    {
+      nghttp2_session_terminate_session (s->ngh, NGHTTP2_NO_ERROR);
+      session_flush (s);
+      fd_close (s->sock);
+    }
+  nghttp2_session_del (s->ngh);
+  xfree (s->host);
+  xfree (s);
+}
+
+/* Stop opening streams on S, and close it once the streams already
+   open are done with.  */
+
+static void
+session_retire (struct http2_session *s)
+{
+  int i;
+
+  for (i = 0; i < session_count; i++)
+    if (sessions[i] == s)
+      {
+        --session_count;
+        memmove (sessions + i, sessions + i + 1,
+                 (session_count - i) * sizeof (sessions[0]));
+        sessions[session_count] = NULL;
+        break;
+      }
+  s->listed = false;
+  if (!s->streams)
+    session_free (s);
+}
+
+/* Close the connection of S after a read or write error, or once the
+   server closed it.  The streams still open on S fail when read.  */
+
+static void
+session_fail (struct http2_session *s)
+{
+  int saved_errno = errno;
+
+  DEBUGP (("HTTP/2 connection to %s:%d failed.\n", s->host, s->port));
+  if (s->sock >= 0)
+    {
+      fd_close (s->sock);
+      s->sock = -1;
+    }
+  session_retire (s);
+  errno = saved_errno;
+}
+
+/* Wait no longer than TIMEOUT for data on the connection of S and
+   process the frames received.  The return value is that of fd_read
+   on the connection.  */
+
+static int
+session_receive (struct http2_session *s, double timeout)
+{
+  char buf[16384];
+  int n;
+
+  if (!session_flush (s))
+    return -1;
+  n = fd_read (s->sock, buf, sizeof (buf), timeout);
+  if (n > 0)
+    {
+      ssize_t ret = nghttp2_session_mem_recv (s->ngh, (uint8_t *) buf, n);
+      if (ret < 0)
+        {
+          logprintf (LOG_NOTQUIET, _("HTTP/2 error from %s: %s\n"),
+                     s->host, nghttp2_strerror ((int) ret));
+          errno = EIO;
+          return -1;
+        }
+      if (!session_flush (s))
+        return -1;
+    }
+  return n;
+}
+
+/* Wait until something can be read from ST and return the buffer to
+   read it from, or NULL at the end of the stream or on error, in which
+   case *RESULT is set to what the reader returns.  */
+
+static struct stream_buf *
+stream_wait (struct http2_stream *st, double timeout, int *result)
+{
+  int n;
+
+  for (;;)
+    {
+      if (st->head.pos < st->head.len)
+        return &st->head;
+      if (st->body.pos < st->body.len)
+        return &st->body;
+      if (st->closed)
+        {
+          if (st->error != NGHTTP2_NO_ERROR)
+            {
+              errno = ECONNRESET;
+              *result = -1;
+            }
+          else
+            *result = 0;
+          return NULL;
+        }
+      if (st->session->sock < 0)
+        {
+          errno = ECONNRESET;
+          *result = -1;
+          return NULL;
+        }
+
+      n = session_receive (st->session, timeout);
+      if (n <= 0)
+        {
+          if (n == 0)
+            errno = ECONNRESET;
+          /* A timeout leaves the connection in an unknown state, just
+             as with HTTP/1.1.  */
+          session_fail (st->session);
+          *result = -1;
+          return NULL;
+        }
+    }
+}
+
+/* The stream being read gets a larger flow control window than those
+   still waiting.  */
+
+static void
+stream_start_reading (struct http2_stream *st)
+{
+  if (st->reading || st->closed || st->session->sock < 0)
+    return;
+  st->reading = true;
+  nghttp2_session_set_local_window_size (st->session->ngh, NGHTTP2_FLAG_NONE,
+                                         st->id, HTTP2_ACTIVE_WINDOW);
+}
+
+static int
+stream_read (int fd _GL_UNUSED, char *buf, int bufsize, void *arg,
+             double timeout)
+{
+  struct http2_stream *st = arg;
+  struct stream_buf *b;
+  int n;
+
+  stream_start_reading (st);
+  b = stream_wait (st, timeout, &n);
+  if (!b)
+    return n;
+
+  n = MIN ((size_t) bufsize, b->len - b->pos);
+  memcpy (buf, b->data + b->pos, n);
+  b->pos += n;
+  if (b == &st->body && !st->closed)
+    nghttp2_session_consume_stream (st->session->ngh, st->id, n);
+  return n;
+}
+
+static int
+stream_peek (int fd _GL_UNUSED, char *buf, int bufsize, void *arg,
+             double timeout)
+{
+  struct http2_stream *st = arg;
+  struct stream_buf *b;
+  int n;
+
+  stream_start_reading (st);
+  b = stream_wait (st, timeout, &n);
+  if (!b)
+    return n;
+
+  n = MIN ((size_t) bufsize, b->len - b->pos);
+  memcpy (buf, b->data + b->pos, n);
+  return n;
+}
+
+static int
+stream_poll (int fd _GL_UNUSED, double timeout, int wait_for, void *arg)
+{
+  struct http2_stream *st = arg;
+  int n;
+
+  if (!(wait_for & WAIT_FOR_READ))
+    return 1;
+  if (st->head.pos < st->head.len || st->body.pos < st->body.len
+      || st->closed || st->session->sock < 0)
+    return 1;
+  n = session_receive (st->session, timeout);
+  if (n < 0 && errno == ETIMEDOUT)
+    return 0;
+  return 1;
+}
+
+/* Requests are submitted through http2_open_stream; nothing is ever
+   written to a stream descriptor.  */
+
+static int
+stream_write (int fd _GL_UNUSED, char *buf _GL_UNUSED, int bufsize _GL_UNUSED,
+              void *arg _GL_UNUSED)
+{
+  errno = EBADF;
+  return -1;
+}
+
+static const char *
+stream_errstr (int fd _GL_UNUSED, void *arg)
+{
+  struct http2_stream *st = arg;
+  static char buf[128];
+
+  if (!st->closed || st->error == NGHTTP2_NO_ERROR)
+    return NULL;
+  snprintf (buf, sizeof (buf), _("HTTP/2 stream reset by the server (%s)"),
+            nghttp2_http2_strerror (st->error));
+  return buf;
+}
+
+static void
+stream_close (int fd, void *arg)
+{
+  struct http2_stream *st = arg;
+  struct http2_session *s = st->session;
+
+  if (s->sock >= 0)
+    {
+      nghttp2_session_set_stream_user_data (s->ngh, st->id, NULL);
+      if (!st->closed)
+        {
+          nghttp2_submit_rst_stream (s->ngh, NGHTTP2_FLAG_NONE, st->id,
+                                     NGHTTP2_CANCEL);
+          session_flush (s);
+        }
+    }
+  close (fd);
+  DEBUGP (("Closed HTTP/2 stream %d (fd %d).\n", (int) st->id, fd));
+
+  xfree (st->head.data);
+  xfree (st->body.data);
+  xfree (st);
+  if (--s->streams == 0 && !s->listed)
+    session_free (s);
+}
+
+static struct transport_implementation stream_transport = {
+  stream_read, stream_write, stream_poll, stream_peek, stream_errstr,
+  stream_close, NULL, NULL, NULL, NULL
+};
+
+/* Start an HTTP/2 session on SOCK, a TLS connection to HOST:PORT for
+   which the server selected HTTP/2.  On success, the session takes
+   over SOCK.  */
+
+bool
+http2_session_new (int sock, const char *host, int port)
+{
+  static const nghttp2_settings_entry settings[] = {
+    { NGHTTP2_SETTINGS_ENABLE_PUSH, 0 },
+    { NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, HTTP2_STREAM_WINDOW },
+  };
+  nghttp2_session_callbacks *callbacks;
+  nghttp2_option *option;
+  struct http2_session *s;
+  int err;
+
+  if (nghttp2_session_callbacks_new (&callbacks) != 0)
+    return false;
+  nghttp2_session_callbacks_set_on_header_callback (callbacks, on_header);
+  nghttp2_session_callbacks_set_on_frame_recv_callback (callbacks,
+                                                        on_frame_recv);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback (callbacks,
+                                                             on_data_chunk_recv);
+  nghttp2_session_callbacks_set_on_stream_close_callback (callbacks,
+                                                          on_stream_close);
+  if (nghttp2_option_new (&option) != 0)
+    {
+      nghttp2_session_callbacks_del (callbacks);
+      return false;
+    }
+  /* Window updates are sent as the data is read, see stream_read.  */
+  nghttp2_option_set_no_auto_window_update (option, 1);
+
+  s = xnew0 (struct http2_session);
+  s->sock = sock;
+  err = nghttp2_session_client_new2 (&s->ngh, callbacks, s, option);
+  nghttp2_session_callbacks_del (callbacks);
+  nghttp2_option_del (option);
+  if (err != 0)
+    {
+      xfree (s);
+      return false;
+    }
+
+  nghttp2_submit_settings (s->ngh, NGHTTP2_FLAG_NONE, settings,
+                           countof (settings));
+  nghttp2_session_set_local_window_size (s->ngh, NGHTTP2_FLAG_NONE, 0,
+                                         HTTP2_CONNECTION_WINDOW);
+  if (!session_flush (s))
+    {
+      nghttp2_session_del (s->ngh);
+      xfree (s);
+      return false;
+    }
+
+  s->host = xstrdup (host);
+  s->port = port;
+  s->listed = true;
+  if (session_count == HTTP2_SESSIONS_MAX)
+    session_retire (sessions[0]);
+  sessions[session_count++] = s;
+  DEBUGP (("Started HTTP/2 session to %s:%d on socket %d.\n", host, port,
+           sock));
+  return true;
+}
+
+static struct http2_session *
+session_by_socket (int sock)
+{
+  int i;
+
+  for (i = 0; i < session_count; i++)
+    if (sessions[i]->sock == sock)
+      return sessions[i];
+  return NULL;
+}
+
+/* Return the socket of the session to HOST:PORT, or -1 if there is
+   none that takes new requests.  Frames that arrived while the
+   session was idle, such as a GOAWAY, are processed first.  */
+
+int
+http2_session_find (const char *host, int port)
+{
+  int i;
+
+  for (i = session_count - 1; i >= 0; i--)
+    {
+      struct http2_session *s = sessions[i];
+
+      if (s->port != port || 0 != strcasecmp (s->host, host))
+        continue;
+
+      while (s->sock >= 0 && select_fd (s->sock, 0, WAIT_FOR_READ) > 0)
+        if (session_receive (s, -1) <= 0)
+          {
+            session_fail (s);
+            return -1;
+          }
+      if (!nghttp2_session_check_request_allowed (s->ngh))
+        {
+          session_retire (s);
+          return -1;
+        }
+      return s->sock;
+    }
+  return -1;
+}
+
+/* Return true if SOCK is the connection of an HTTP/2 session. */
+
+bool
+http2_session_p (int sock)
+{
+  return sock >= 0 && session_by_socket (sock) != NULL;
+}
+
+/* Open no more streams on the session of SOCK.  */
+
+void
+http2_session_close (int sock)
+{
+  struct http2_session *s = session_by_socket (sock);
+
+  if (s)
+    session_retire (s);
+}
+
+/* Send a request with the COUNT header fields in HEADERS, pseudo-header
+   fields first, on the session of SOCK.  Return the descriptor from
+   which the response is read, or -1 if the request couldn't be sent.
+   The descriptor is closed with fd_close, which cancels the stream if
+   the response hasn't been read to its end.  */
+
+int
+http2_open_stream (int sock, const struct http2_header *headers, int count)
+{
+  struct http2_session *s = session_by_socket (sock);
+  struct http2_stream *st;
+  nghttp2_nv *nva;
+  int32_t id;
+  int i, fd;
+
+  if (!s)
+    return -1;
+
+  nva = xnew_array (nghttp2_nv, count);
+  for (i = 0; i < count; i++)
+    {
+      nva[i].name = (uint8_t *) headers[i].name;
+      nva[i].namelen = strlen (headers[i].name);
+      nva[i].value = (uint8_t *) headers[i].value;
+      nva[i].valuelen = strlen (headers[i].value);
+      nva[i].flags = NGHTTP2_NV_FLAG_NONE;
+    }
+
+  st = xnew0 (struct http2_stream);
+  st->session = s;
+  id = nghttp2_submit_request (s->ngh, NULL, nva, count, NULL, st);
+  xfree (nva);
+  if (id < 0)
+    {
+      DEBUGP (("Cannot open HTTP/2 stream: %s\n", nghttp2_strerror (id)));
+      xfree (st);
+      return -1;
+    }
+  st->id = id;
+
+  fd = dup (sock);
+  if (fd < 0 || !session_flush (s))
+    {
+      if (fd >= 0)
+        close (fd);
+      nghttp2_session_set_stream_user_data (s->ngh, id, NULL);
+      xfree (st);
+      session_fail (s);
+      return -1;
+    }
+
+  ++s->streams;
+  fd_register_transport (fd, &stream_transport, st);
+  DEBUGP (("Opened HTTP/2 stream %d to %s:%d as fd %d.\n", (int) id,
+           s->host, s->port, fd));
+  return fd;
+}
+
+/* Close all sessions.  Streams still open keep theirs until they are
+   closed.  */
+
+void
+http2_cleanup (void)
+{
+  while (session_count)
+    session_retire (sessions[0]);
+}
@@ -1,13 +1,13 @@
-/* Declarations for css.lex
-   Copyright (C) 2006, 2009-2011, 2015, 2018-2023 Free Software
-   Foundation, Inc.
+/* Declarations for http2.c
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
 
 This file is part of GNU Wget.
 
 GNU Wget is free software; you can redistribute it and/or modify
 it under the terms of the GNU General Public License as published by
-the Free Software Foundation; either version 3 of the License, or (at
-your option) any later version.
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
 
 GNU Wget is distributed in the hope that it will be useful,
 but WITHOUT ANY WARRANTY; without even the implied warranty of
@@ -28,38 +28,20 @@ Corresponding Source for a non-source form of such a combination
 shall include the source code for the parts of OpenSSL used as well
 as that of the covered work.  */
 
-#ifndef CSS_TOKENS_H
-#define CSS_TOKENS_H
+#ifndef HTTP2_H
+#define HTTP2_H
 
-enum {
-  CSSEOF = 0,
-  S = 1,
-  CDO = 2,
-  CDC = 3,
-  INCLUDES = 4,
-  DASHMATCH = 5,
-  STRING = 6,
-  BAD_STRING = 7,
-  IDENT = 8,
-  HASH = 9,
-  IMPORT_SYM = 10,
-  PAGE_SYM = 11,
-  MEDIA_SYM = 12,
-  CHARSET_SYM = 13,
-  IMPORTANT_SYM = 14,
-  EMS = 15,
-  EXS = 16,
-  LENGTH = 17,
-  ANGLE = 18,
-  TIME = 19,
-  FREQ = 20,
-  DIMENSION = 21,
-  PERCENTAGE = 22,
-  NUMBER = 23,
-  URI = 24,
-  BAD_URI = 25,
-  FUNCTION = 26,
-  COMMENT = 27
+/* A header field of a request, as given to http2_open_stream.  */
+struct http2_header {
+  const char *name;
+  const char *value;
 };
 
-#endif /* CSS_TOKENS_H */
+bool http2_session_new (int, const char *, int);
+int http2_session_find (const char *, int);
+bool http2_session_p (int);
+void http2_session_close (int);
+int http2_open_stream (int, const struct http2_header *, int);
+void http2_cleanup (void);
+
+#endif /* HTTP2_H */
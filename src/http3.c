@@ -0,0 +1,1427 @@
+/* HTTP/3 client sessions over QUIC.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <ngtcp2/ngtcp2.h>
+#include <ngtcp2/ngtcp2_crypto.h>
+#include <ngtcp2/ngtcp2_crypto_gnutls.h>
+#include <nghttp3/nghttp3.h>
+
+#include "utils.h"
+#include "connect.h"
+#include "http.h"
+#include "ssl.h"
+#include "altsvc.h"
+#include "http3.h"
+
+/* An HTTP/3 session carries the requests to a host over a QUIC
+   connection, on the UDP alternative the host announced in Alt-Svc
+   (see altsvc.c).  It is handed to http.c just as an HTTP/2 session
+   is: each request is opened as a stream, and read through a
+   descriptor of its own, a dup of the UDP socket with a transport
+   registered on it, that yields the response head as HTTP/1.1 text
+   followed by the body.
+
+   ngtcp2 does QUIC, with GnuTLS for the TLS 1.3 handshake, and
+   nghttp3 the HTTP/3 framing and QPACK.  Unlike TCP, QUIC loses no
+   time to a lost packet on the streams whose packets weren't lost,
+   and its congestion control is that of the client, so BBR is used,
+   which doesn't take every loss for congestion.  The session ticket
+   of a connection is remembered for the rest of the run, so that the
+   requests to a host connected to again go out in 0-RTT data, with
+   the first flight of the handshake.  */
+
+/* Maximum number of sessions kept open, to as many hosts. */
+#define HTTP3_SESSIONS_MAX 8
+
+/* Flow control windows, as for HTTP/2.  */
+#define HTTP3_STREAM_WINDOW (256 * 1024)
+#define HTTP3_ACTIVE_WINDOW (16 * 1024 * 1024)
+#define HTTP3_CONNECTION_WINDOW (1 << 30)
+
+/* Time, in seconds, the handshake may take when no connect timeout is
+   set.  A server that announces HTTP/3 but can't be reached over UDP
+   costs no more than this once; altsvc_broken keeps it on TCP
+   afterwards.  */
+#define HTTP3_HANDSHAKE_TIMEOUT 10
+
+/* Time, in seconds, an idle connection is kept by either side.  */
+#define HTTP3_IDLE_TIMEOUT 30
+
+/* Size of the UDP datagrams sent, and the most written in a row
+   before the socket is read again.  */
+#define HTTP3_PACKET_SIZE 1452
+#define HTTP3_BURST 64
+
+/* Number of session tickets remembered.  */
+#define HTTP3_TICKETS_MAX 16
+
+struct http3_stream;
+
+struct http3_session {
+  ngtcp2_conn *conn;
+  nghttp3_conn *h3;             /* NULL until set up, see session_setup_h3 */
+  gnutls_session_t tls;
+  ngtcp2_crypto_conn_ref conn_ref;
+  ngtcp2_ccerr ccerr;           /* what the connection is closed with */
+  int sock;                     /* the UDP socket, -1 once closed */
+  struct sockaddr_storage local, remote;
+  ngtcp2_path path;
+  char *host;                   /* the origin, not the alternative */
+  int port;
+  int streams;                  /* number of open stream descriptors */
+  bool listed;                  /* whether new streams may be opened */
+  bool goaway;                  /* the server sent a GOAWAY */
+  bool early;                   /* resumed, the handshake isn't done */
+  struct http3_stream *stream_list;
+};
+
+/* Bytes received for a stream and not read yet.  */
+struct stream_buf {
+  char *data;
+  size_t pos, len, size;
+};
+
+struct http3_stream {
+  struct http3_session *session;
+  struct http3_stream *next;
+  int64_t id;                   /* -1 until submitted */
+  nghttp3_nv *nva;              /* the request, kept for resubmission */
+  size_t nvlen;
+  struct stream_buf head;       /* the response heads, as HTTP/1.1 text */
+  struct stream_buf body;       /* the DATA received */
+  int status;                   /* status of the head being received */
+  bool final_head;              /* the non-1xx head has been received */
+  bool reading;                 /* read from, see HTTP3_ACTIVE_WINDOW */
+  bool closed;                  /* closed by the server or nghttp3 */
+  uint64_t error;               /* the error code it was closed with */
+};
+
+/* A session ticket, with the transport parameters of the connection
+   it came from, which 0-RTT data must keep to.  They are secrets and
+   are never written out.  */
+struct http3_ticket {
+  char *host;
+  int port;
+  gnutls_datum_t data;
+  uint8_t *params;
+  size_t params_len;
+};
+
+/* The sessions to which requests can be sent, oldest first.  */
+static struct http3_session *sessions[HTTP3_SESSIONS_MAX];
+static int session_count;
+
+static struct http3_ticket tickets[HTTP3_TICKETS_MAX];
+static int ticket_next;
+
+static ngtcp2_tstamp
+timestamp (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (ngtcp2_tstamp) ts.tv_sec * NGTCP2_SECONDS + ts.tv_nsec;
+}
+
+static struct http3_ticket *
+ticket_find (const char *host, int port)
+{
+  int i;
+
+  for (i = 0; i < HTTP3_TICKETS_MAX; i++)
+    if (tickets[i].host && tickets[i].port == port
+        && 0 == strcasecmp (tickets[i].host, host))
+      return &tickets[i];
+  return NULL;
+}
+
+static void
+ticket_free (struct http3_ticket *t)
+{
+  xfree (t->host);
+  gnutls_free (t->data.data);
+  t->data.data = NULL;
+  xfree (t->params);
+}
+
+/* Forget the ticket for HOST:PORT, after a failed resumption.  */
+
+static void
+ticket_forget (const char *host, int port)
+{
+  struct http3_ticket *t = ticket_find (host, port);
+
+  if (t)
+    ticket_free (t);
+}
+
+/* Called by GnuTLS for each NewSessionTicket message of the server;
+   keep the last one for the origin of the session.  */
+
+static int
+on_session_ticket (gnutls_session_t tls, unsigned int htype _GL_UNUSED,
+                   unsigned int when _GL_UNUSED,
+                   unsigned int incoming _GL_UNUSED,
+                   const gnutls_datum_t *msg _GL_UNUSED)
+{
+  ngtcp2_crypto_conn_ref *ref = gnutls_session_get_ptr (tls);
+  struct http3_session *s = ref->user_data;
+  struct http3_ticket *t;
+  gnutls_datum_t data;
+  uint8_t params[256];
+  ngtcp2_ssize n;
+
+  n = ngtcp2_conn_encode_0rtt_transport_params (s->conn, params,
+                                                sizeof (params));
+  if (n < 0 || gnutls_session_get_data2 (tls, &data) < 0)
+    return 0;
+
+  t = ticket_find (s->host, s->port);
+  if (!t)
+    {
+      t = &tickets[ticket_next];
+      ticket_next = (ticket_next + 1) % HTTP3_TICKETS_MAX;
+    }
+  ticket_free (t);
+  t->host = xstrdup (s->host);
+  t->port = s->port;
+  t->data = data;
+  t->params = xmemdup (params, n);
+  t->params_len = n;
+  DEBUGP (("Got an HTTP/3 session ticket from %s:%d.\n", s->host, s->port));
+  return 0;
+}
+
+static void
+stream_buf_append (struct stream_buf *b, const void *data, size_t n)
+{
+  if (b->pos == b->len)
+    b->pos = b->len = 0;
+  if (b->len + n > b->size && b->pos)
+    {
+      memmove (b->data, b->data + b->pos, b->len - b->pos);
+      b->len -= b->pos;
+      b->pos = 0;
+    }
+  if (b->len + n > b->size)
+    {
+      b->size = MAX (2 * b->size, b->len + n);
+      b->data = xrealloc (b->data, b->size);
+    }
+  memcpy (b->data + b->len, data, n);
+  b->len += n;
+}
+
+/* Give the connection and STREAM_ID credit for N more bytes.  */
+
+static void
+session_consume (struct http3_session *s, int64_t stream_id, size_t n)
+{
+  ngtcp2_conn_extend_max_stream_offset (s->conn, stream_id, n);
+  ngtcp2_conn_extend_max_offset (s->conn, n);
+}
+
+/* nghttp3 callbacks.  */
+
+static int
+h3_recv_header (nghttp3_conn *h3 _GL_UNUSED, int64_t stream_id _GL_UNUSED,
+                int32_t token, nghttp3_rcbuf *name, nghttp3_rcbuf *value,
+                uint8_t flags _GL_UNUSED, void *arg _GL_UNUSED,
+                void *stream_arg)
+{
+  struct http3_stream *st = stream_arg;
+  nghttp3_vec n = nghttp3_rcbuf_get_buf (name);
+  nghttp3_vec v = nghttp3_rcbuf_get_buf (value);
+
+  /* Trailers come through recv_trailer, which isn't set.  */
+  if (!st || st->final_head)
+    return 0;
+
+  if (token == NGHTTP3_QPACK_TOKEN__STATUS)
+    {
+      char *line;
+
+      st->status = atoi ((const char *) v.base);
+      line = aprintf ("HTTP/3 %.*s %s\r\n", (int) v.len, v.base,
+                      http_status_reason (st->status));
+      stream_buf_append (&st->head, line, strlen (line));
+      xfree (line);
+    }
+  else if (st->status)
+    {
+      stream_buf_append (&st->head, n.base, n.len);
+      stream_buf_append (&st->head, ": ", 2);
+      stream_buf_append (&st->head, v.base, v.len);
+      stream_buf_append (&st->head, "\r\n", 2);
+    }
+  return 0;
+}
+
+static int
+h3_end_headers (nghttp3_conn *h3 _GL_UNUSED, int64_t stream_id _GL_UNUSED,
+                int fin _GL_UNUSED, void *arg _GL_UNUSED, void *stream_arg)
+{
+  struct http3_stream *st = stream_arg;
+
+  if (!st || st->final_head || !st->status)
+    return 0;
+
+  stream_buf_append (&st->head, "\r\n", 2);
+  if (st->status >= 200)
+    st->final_head = true;
+  st->status = 0;
+  return 0;
+}
+
+static int
+h3_recv_data (nghttp3_conn *h3 _GL_UNUSED, int64_t stream_id,
+              const uint8_t *data, size_t len, void *arg, void *stream_arg)
+{
+  struct http3_session *s = arg;
+  struct http3_stream *st = stream_arg;
+
+  /* The credit for the data is given back as it is read from the
+     stream, see stream_read.  */
+  if (st)
+    stream_buf_append (&st->body, data, len);
+  else
+    session_consume (s, stream_id, len);
+  return 0;
+}
+
+static int
+h3_deferred_consume (nghttp3_conn *h3 _GL_UNUSED, int64_t stream_id,
+                     size_t consumed, void *arg, void *stream_arg _GL_UNUSED)
+{
+  session_consume (arg, stream_id, consumed);
+  return 0;
+}
+
+static int
+h3_stream_close (nghttp3_conn *h3 _GL_UNUSED, int64_t stream_id _GL_UNUSED,
+                 uint64_t error_code, void *arg _GL_UNUSED, void *stream_arg)
+{
+  struct http3_stream *st = stream_arg;
+
+  if (st && !st->closed)
+    {
+      st->closed = true;
+      st->error = error_code;
+    }
+  return 0;
+}
+
+static int
+h3_end_stream (nghttp3_conn *h3 _GL_UNUSED, int64_t stream_id _GL_UNUSED,
+               void *arg _GL_UNUSED, void *stream_arg)
+{
+  struct http3_stream *st = stream_arg;
+
+  if (st)
+    st->closed = true;
+  return 0;
+}
+
+static int
+h3_stop_sending (nghttp3_conn *h3 _GL_UNUSED, int64_t stream_id,
+                 uint64_t error_code, void *arg, void *stream_arg _GL_UNUSED)
+{
+  struct http3_session *s = arg;
+
+  ngtcp2_conn_shutdown_stream_read (s->conn, 0, stream_id, error_code);
+  return 0;
+}
+
+static int
+h3_reset_stream (nghttp3_conn *h3 _GL_UNUSED, int64_t stream_id,
+                 uint64_t error_code, void *arg, void *stream_arg _GL_UNUSED)
+{
+  struct http3_session *s = arg;
+
+  ngtcp2_conn_shutdown_stream_write (s->conn, 0, stream_id, error_code);
+  return 0;
+}
+
+static int
+h3_shutdown (nghttp3_conn *h3 _GL_UNUSED, int64_t id _GL_UNUSED, void *arg)
+{
+  struct http3_session *s = arg;
+
+  s->goaway = true;
+  return 0;
+}
+
+/* Set up the HTTP/3 connection of S, with its control and QPACK
+   streams.  */
+
+static bool
+session_setup_h3 (struct http3_session *s)
+{
+  nghttp3_callbacks callbacks;
+  nghttp3_settings settings;
+  int64_t control, encoder, decoder;
+
+  if (ngtcp2_conn_get_streams_uni_left (s->conn) < 3)
+    return false;
+
+  xzero (callbacks);
+  callbacks.stream_close = h3_stream_close;
+  callbacks.recv_data = h3_recv_data;
+  callbacks.deferred_consume = h3_deferred_consume;
+  callbacks.recv_header = h3_recv_header;
+  callbacks.end_headers = h3_end_headers;
+  callbacks.stop_sending = h3_stop_sending;
+  callbacks.end_stream = h3_end_stream;
+  callbacks.reset_stream = h3_reset_stream;
+  callbacks.shutdown = h3_shutdown;
+  nghttp3_settings_default (&settings);
+
+  if (nghttp3_conn_client_new (&s->h3, &callbacks, &settings, NULL, s) != 0)
+    return false;
+  if (ngtcp2_conn_open_uni_stream (s->conn, &control, NULL) != 0
+      || nghttp3_conn_bind_control_stream (s->h3, control) != 0
+      || ngtcp2_conn_open_uni_stream (s->conn, &encoder, NULL) != 0
+      || ngtcp2_conn_open_uni_stream (s->conn, &decoder, NULL) != 0
+      || nghttp3_conn_bind_qpack_streams (s->h3, encoder, decoder) != 0)
+    {
+      nghttp3_conn_del (s->h3);
+      s->h3 = NULL;
+      return false;
+    }
+  return true;
+}
+
+/* Submit the requests of S that haven't been, as far as the server
+   lets streams be opened.  */
+
+static int
+session_submit (struct http3_session *s)
+{
+  struct http3_stream *st;
+
+  if (!s->h3)
+    return 0;
+  for (st = s->stream_list; st; st = st->next)
+    {
+      int64_t id;
+      int err;
+
+      if (st->id >= 0)
+        continue;
+      if (ngtcp2_conn_get_streams_bidi_left (s->conn) == 0)
+        break;
+      if (ngtcp2_conn_open_bidi_stream (s->conn, &id, st) != 0)
+        break;
+      err = nghttp3_conn_submit_request (s->h3, id, st->nva, st->nvlen,
+                                         NULL, st);
+      if (err != 0)
+        {
+          DEBUGP (("Cannot submit HTTP/3 request: %s\n",
+                   nghttp3_strerror (err)));
+          return err;
+        }
+      st->id = id;
+      DEBUGP (("Submitted HTTP/3 request on stream %lld.\n", (long long) id));
+    }
+  return 0;
+}
+
+/* ngtcp2 callbacks.  */
+
+static void
+on_rand (uint8_t *dest, size_t len, const ngtcp2_rand_ctx *ctx _GL_UNUSED)
+{
+  gnutls_rnd (GNUTLS_RND_RANDOM, dest, len);
+}
+
+static int
+on_new_connection_id (ngtcp2_conn *conn _GL_UNUSED, ngtcp2_cid *cid,
+                      uint8_t *token, size_t cidlen, void *arg _GL_UNUSED)
+{
+  if (gnutls_rnd (GNUTLS_RND_RANDOM, cid->data, cidlen) != 0
+      || gnutls_rnd (GNUTLS_RND_RANDOM, token,
+                     NGTCP2_STATELESS_RESET_TOKENLEN) != 0)
+    return NGTCP2_ERR_CALLBACK_FAILURE;
+  cid->datalen = cidlen;
+  return 0;
+}
+
+static int
+on_recv_stream_data (ngtcp2_conn *conn _GL_UNUSED, uint32_t flags,
+                     int64_t stream_id, uint64_t offset _GL_UNUSED,
+                     const uint8_t *data, size_t len, void *arg,
+                     void *stream_arg _GL_UNUSED)
+{
+  struct http3_session *s = arg;
+  nghttp3_ssize n;
+
+  if (!s->h3)
+    return 0;
+  n = nghttp3_conn_read_stream (s->h3, stream_id, data, len,
+                                flags & NGTCP2_STREAM_DATA_FLAG_FIN);
+  if (n < 0)
+    {
+      logprintf (LOG_NOTQUIET, _("HTTP/3 error from %s: %s\n"),
+                 s->host, nghttp3_strerror ((int) n));
+      ngtcp2_ccerr_set_application_error
+        (&s->ccerr, nghttp3_err_infer_quic_app_error_code ((int) n),
+         NULL, 0);
+      return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+  /* What nghttp3 consumed itself, framing and headers; the DATA is
+     accounted for when it is read.  */
+  session_consume (s, stream_id, n);
+  return 0;
+}
+
+static int
+on_acked_stream_data_offset (ngtcp2_conn *conn _GL_UNUSED, int64_t stream_id,
+                             uint64_t offset _GL_UNUSED, uint64_t len,
+                             void *arg, void *stream_arg _GL_UNUSED)
+{
+  struct http3_session *s = arg;
+
+  if (s->h3 && nghttp3_conn_add_ack_offset (s->h3, stream_id, len) != 0)
+    return NGTCP2_ERR_CALLBACK_FAILURE;
+  return 0;
+}
+
+static int
+on_stream_close (ngtcp2_conn *conn _GL_UNUSED, uint32_t flags,
+                 int64_t stream_id, uint64_t error_code, void *arg,
+                 void *stream_arg)
+{
+  struct http3_session *s = arg;
+  struct http3_stream *st = stream_arg;
+  int err;
+
+  if (!(flags & NGTCP2_STREAM_CLOSE_FLAG_APP_ERROR_CODE_SET))
+    error_code = NGHTTP3_H3_NO_ERROR;
+  if (st && !st->closed)
+    {
+      st->closed = true;
+      st->error = error_code;
+    }
+  if (!s->h3)
+    return 0;
+  err = nghttp3_conn_close_stream (s->h3, stream_id, error_code);
+  if (err != 0 && err != NGHTTP3_ERR_STREAM_NOT_FOUND)
+    {
+      ngtcp2_ccerr_set_application_error
+        (&s->ccerr, nghttp3_err_infer_quic_app_error_code (err), NULL, 0);
+      return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+  return 0;
+}
+
+static int
+on_stream_reset (ngtcp2_conn *conn _GL_UNUSED, int64_t stream_id,
+                 uint64_t final_size _GL_UNUSED,
+                 uint64_t error_code _GL_UNUSED, void *arg,
+                 void *stream_arg _GL_UNUSED)
+{
+  struct http3_session *s = arg;
+
+  if (s->h3 && nghttp3_conn_shutdown_stream_read (s->h3, stream_id) != 0)
+    return NGTCP2_ERR_CALLBACK_FAILURE;
+  return 0;
+}
+
+static int
+on_extend_max_stream_data (ngtcp2_conn *conn _GL_UNUSED, int64_t stream_id,
+                           uint64_t max_data _GL_UNUSED, void *arg,
+                           void *stream_arg _GL_UNUSED)
+{
+  struct http3_session *s = arg;
+
+  if (s->h3 && nghttp3_conn_unblock_stream (s->h3, stream_id) != 0)
+    return NGTCP2_ERR_CALLBACK_FAILURE;
+  return 0;
+}
+
+static int
+on_extend_max_local_streams_bidi (ngtcp2_conn *conn _GL_UNUSED,
+                                  uint64_t max_streams _GL_UNUSED, void *arg)
+{
+  return session_submit (arg) == 0 ? 0 : NGTCP2_ERR_CALLBACK_FAILURE;
+}
+
+static int
+on_handshake_completed (ngtcp2_conn *conn _GL_UNUSED, void *arg)
+{
+  struct http3_session *s = arg;
+
+  if (!ssl_quic_check_certificate (s->tls, s->host))
+    return NGTCP2_ERR_CALLBACK_FAILURE;
+  s->early = false;
+  /* After rejected early data, the requests go again in 1-RTT.  */
+  if (!s->h3 && !session_setup_h3 (s))
+    return NGTCP2_ERR_CALLBACK_FAILURE;
+  return session_submit (s) == 0 ? 0 : NGTCP2_ERR_CALLBACK_FAILURE;
+}
+
+/* The server didn't take the 0-RTT data, for which ngtcp2 forgets the
+   streams opened; start HTTP/3 over once the handshake is done.  */
+
+static int
+on_tls_early_data_rejected (ngtcp2_conn *conn _GL_UNUSED, void *arg)
+{
+  struct http3_session *s = arg;
+  struct http3_stream *st;
+
+  DEBUGP (("Early data rejected by %s:%d.\n", s->host, s->port));
+  nghttp3_conn_del (s->h3);
+  s->h3 = NULL;
+  for (st = s->stream_list; st; st = st->next)
+    {
+      if (st->id >= 0)
+        ngtcp2_conn_set_stream_user_data (s->conn, st->id, NULL);
+      st->id = -1;
+      st->head.pos = st->head.len = 0;
+      st->body.pos = st->body.len = 0;
+      st->status = 0;
+      st->final_head = st->reading = st->closed = false;
+      st->error = 0;
+    }
+  return 0;
+}
+
+static ngtcp2_conn *
+get_conn (ngtcp2_crypto_conn_ref *ref)
+{
+  struct http3_session *s = ref->user_data;
+
+  return s->conn;
+}
+
+/* Record the failure of S with an error code of ngtcp2 in errno, and
+   in what the connection is closed with.  */
+
+static void
+session_error (struct http3_session *s, int err)
+{
+  if (err == NGTCP2_ERR_CRYPTO)
+    ngtcp2_ccerr_set_tls_alert (&s->ccerr,
+                                ngtcp2_conn_get_tls_alert (s->conn), NULL, 0);
+  else if (err != NGTCP2_ERR_CALLBACK_FAILURE)
+    ngtcp2_ccerr_set_liberr (&s->ccerr, err, NULL, 0);
+
+  switch (err)
+    {
+    case NGTCP2_ERR_IDLE_CLOSE:
+    case NGTCP2_ERR_DRAINING:
+    case NGTCP2_ERR_CLOSING:
+      errno = ECONNRESET;
+      break;
+    case NGTCP2_ERR_HANDSHAKE_TIMEOUT:
+      errno = ETIMEDOUT;
+      break;
+    default:
+      DEBUGP (("QUIC error on %s:%d: %s\n", s->host, s->port,
+               ngtcp2_strerror (err)));
+      errno = EIO;
+    }
+}
+
+static bool
+send_packet (struct http3_session *s, const uint8_t *data, size_t len)
+{
+  ssize_t n;
+
+  do
+    n = send (s->sock, data, len, 0);
+  while (n < 0 && errno == EINTR);
+  /* A packet dropped here is lost as it could be on the way, and
+     sent again.  */
+  return n >= 0 || errno == EAGAIN || errno == EWOULDBLOCK
+    || errno == ENOBUFS;
+}
+
+/* Write out what ngtcp2 and nghttp3 have queued for S.  */
+
+static bool
+session_flush (struct http3_session *s)
+{
+  uint8_t buf[HTTP3_PACKET_SIZE];
+  ngtcp2_tstamp ts = timestamp ();
+  int packets = 0;
+
+  if (s->sock < 0)
+    return false;
+  while (packets < HTTP3_BURST)
+    {
+      nghttp3_vec vec[16];
+      nghttp3_ssize veccnt = 0;
+      int64_t stream_id = -1;
+      int fin = 0;
+      uint32_t flags = NGTCP2_WRITE_STREAM_FLAG_MORE;
+      ngtcp2_ssize n, datalen;
+
+      if (s->h3 && ngtcp2_conn_get_max_data_left (s->conn))
+        {
+          veccnt = nghttp3_conn_writev_stream (s->h3, &stream_id, &fin,
+                                               vec, countof (vec));
+          if (veccnt < 0)
+            {
+              session_error (s, NGTCP2_ERR_CALLBACK_FAILURE);
+              return false;
+            }
+        }
+      if (fin)
+        flags |= NGTCP2_WRITE_STREAM_FLAG_FIN;
+
+      n = ngtcp2_conn_writev_stream (s->conn, NULL, NULL, buf, sizeof (buf),
+                                     &datalen, flags, stream_id,
+                                     (const ngtcp2_vec *) vec, veccnt, ts);
+      if (n < 0)
+        switch (n)
+          {
+          case NGTCP2_ERR_STREAM_DATA_BLOCKED:
+            nghttp3_conn_block_stream (s->h3, stream_id);
+            continue;
+          case NGTCP2_ERR_STREAM_SHUT_WR:
+            nghttp3_conn_shutdown_stream_write (s->h3, stream_id);
+            continue;
+          case NGTCP2_ERR_WRITE_MORE:
+            if (nghttp3_conn_add_write_offset (s->h3, stream_id,
+                                               datalen) != 0)
+              {
+                session_error (s, NGTCP2_ERR_CALLBACK_FAILURE);
+                return false;
+              }
+            continue;
+          default:
+            session_error (s, (int) n);
+            return false;
+          }
+
+      if (datalen >= 0
+          && nghttp3_conn_add_write_offset (s->h3, stream_id, datalen) != 0)
+        {
+          session_error (s, NGTCP2_ERR_CALLBACK_FAILURE);
+          return false;
+        }
+      if (n == 0)
+        break;
+      if (!send_packet (s, buf, n))
+        return false;
+      ++packets;
+    }
+  /* Pace what is left, see ngtcp2_conn_get_expiry.  */
+  ngtcp2_conn_update_pkt_tx_time (s->conn, ts);
+  return true;
+}
+
+/* Process the packets that arrived for S and the timers that ran out,
+   without waiting, and send what they call for.  */
+
+static bool
+session_poll (struct http3_session *s)
+{
+  uint8_t buf[65536];
+  ngtcp2_pkt_info pi;
+  ngtcp2_tstamp now;
+  ssize_t n;
+  int err;
+
+  if (s->sock < 0)
+    return false;
+  xzero (pi);
+  for (;;)
+    {
+      n = recv (s->sock, buf, sizeof (buf), MSG_DONTWAIT);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+          /* Such as ECONNREFUSED, for an ICMP error.  */
+          return false;
+        }
+      err = ngtcp2_conn_read_pkt (s->conn, &s->path, &pi, buf, n,
+                                  timestamp ());
+      if (err != 0)
+        {
+          session_error (s, err);
+          return false;
+        }
+    }
+
+  now = timestamp ();
+  if (ngtcp2_conn_get_expiry (s->conn) <= now)
+    {
+      err = ngtcp2_conn_handle_expiry (s->conn, now);
+      if (err != 0)
+        {
+          session_error (s, err);
+          return false;
+        }
+    }
+  return session_flush (s);
+}
+
+/* Wait until DEADLINE, 0 for none, or the next timer of S for packets
+   to arrive, and process them.  */
+
+static bool
+session_io (struct http3_session *s, ngtcp2_tstamp deadline)
+{
+  ngtcp2_tstamp now, expiry;
+  double wait;
+
+  if (!session_flush (s))
+    return false;
+  now = timestamp ();
+  expiry = ngtcp2_conn_get_expiry (s->conn);
+  if (deadline && deadline < expiry)
+    expiry = deadline;
+  wait = expiry > now ? (double) (expiry - now) / NGTCP2_SECONDS : 0;
+  /* There is always the idle timer, but for a server that doesn't
+     take part.  */
+  if (wait > HTTP3_IDLE_TIMEOUT)
+    wait = HTTP3_IDLE_TIMEOUT;
+  if (wait > 0 && select_fd (s->sock, wait, WAIT_FOR_READ) < 0)
+    return false;
+  return session_poll (s);
+}
+
+/* Release S, saying goodbye to the server if the connection is still
+   open.  */
+
+static void
+session_free (struct http3_session *s)
+{
+  DEBUGP (("Closing HTTP/3 session to %s:%d.\n", s->host, s->port));
+  if (s->sock >= 0)
+    {
+      uint8_t buf[HTTP3_PACKET_SIZE];
+      ngtcp2_ssize n;
+
+      n = ngtcp2_conn_write_connection_close (s->conn, NULL, NULL, buf,
+                                              sizeof (buf), &s->ccerr,
+                                              timestamp ());
+      if (n > 0)
+        send_packet (s, buf, n);
+      fd_close (s->sock);
+    }
+  nghttp3_conn_del (s->h3);
+  ngtcp2_conn_del (s->conn);
+  gnutls_deinit (s->tls);
+  xfree (s->host);
+  xfree (s);
+}
+
+/* Stop opening streams on S, and close it once the streams already
+   open are done with.  */
+
+static void
+session_retire (struct http3_session *s)
+{
+  int i;
+
+  for (i = 0; i < session_count; i++)
+    if (sessions[i] == s)
+      {
+        --session_count;
+        memmove (sessions + i, sessions + i + 1,
+                 (session_count - i) * sizeof (sessions[0]));
+        sessions[session_count] = NULL;
+        break;
+      }
+  s->listed = false;
+  if (!s->streams)
+    session_free (s);
+}
+
+/* Close the connection of S after an error, or once the server closed
+   it.  The streams still open on S fail when read.  */
+
+static void
+session_fail (struct http3_session *s)
+{
+  int saved_errno = errno;
+
+  DEBUGP (("HTTP/3 connection to %s:%d failed.\n", s->host, s->port));
+  if (s->sock >= 0)
+    {
+      fd_close (s->sock);
+      s->sock = -1;
+    }
+  session_retire (s);
+  errno = saved_errno;
+}
+
+/* Complete the handshake of S.  On failure, the alternative of its
+   origin is not used again for a while.  */
+
+static bool
+session_handshake (struct http3_session *s)
+{
+  while (!ngtcp2_conn_get_handshake_completed (s->conn))
+    if (!session_io (s, 0))
+      {
+        logprintf (LOG_NOTQUIET,
+                   _("HTTP/3 handshake with %s:%d failed: %s\n"),
+                   s->host, s->port, strerror (errno));
+        altsvc_broken (s->host, s->port);
+        ticket_forget (s->host, s->port);
+        return false;
+      }
+  return true;
+}
+
+/* Wait until something can be read from ST and return the buffer to
+   read it from, or NULL at the end of the stream or on error, in which
+   case *RESULT is set to what the reader returns.  TIMEOUT is as for
+   fd_read.  */
+
+static struct stream_buf *
+stream_wait (struct http3_stream *st, double timeout, int *result)
+{
+  ngtcp2_tstamp deadline = 0;
+
+  if (timeout == -1)
+    timeout = opt.read_timeout;
+  if (timeout)
+    deadline = timestamp () + (ngtcp2_tstamp) (timeout * NGTCP2_SECONDS);
+
+  for (;;)
+    {
+      if (st->head.pos < st->head.len)
+        return &st->head;
+      if (st->body.pos < st->body.len)
+        return &st->body;
+      if (st->closed)
+        {
+          if (st->error != NGHTTP3_H3_NO_ERROR)
+            {
+              errno = ECONNRESET;
+              *result = -1;
+            }
+          else
+            *result = 0;
+          return NULL;
+        }
+      if (st->session->sock < 0)
+        {
+          errno = ECONNRESET;
+          *result = -1;
+          return NULL;
+        }
+
+      if (!session_io (st->session, deadline))
+        {
+          session_fail (st->session);
+          *result = -1;
+          return NULL;
+        }
+      if (deadline && timestamp () >= deadline
+          && st->head.pos == st->head.len && st->body.pos == st->body.len
+          && !st->closed)
+        {
+          /* A timeout leaves the stream in an unknown state, just as
+             with HTTP/1.1.  */
+          errno = ETIMEDOUT;
+          session_fail (st->session);
+          *result = -1;
+          return NULL;
+        }
+    }
+}
+
+/* The stream being read gets a larger flow control window than those
+   still waiting.  */
+
+static void
+stream_start_reading (struct http3_stream *st)
+{
+  if (st->reading || st->closed || st->id < 0 || st->session->sock < 0)
+    return;
+  st->reading = true;
+  ngtcp2_conn_extend_max_stream_offset (st->session->conn, st->id,
+                                        HTTP3_ACTIVE_WINDOW
+                                        - HTTP3_STREAM_WINDOW);
+}
+
+static int
+stream_read (int fd _GL_UNUSED, char *buf, int bufsize, void *arg,
+             double timeout)
+{
+  struct http3_stream *st = arg;
+  struct stream_buf *b;
+  int n;
+
+  stream_start_reading (st);
+  b = stream_wait (st, timeout, &n);
+  if (!b)
+    return n;
+
+  n = MIN ((size_t) bufsize, b->len - b->pos);
+  memcpy (buf, b->data + b->pos, n);
+  b->pos += n;
+  if (b == &st->body)
+    {
+      struct http3_session *s = st->session;
+
+      /* The packets that came in meanwhile are processed now rather
+         than once the buffer runs dry, so that the ACKs and the
+         credit given back go out in time.  */
+      session_consume (s, st->id, n);
+      if (s->sock >= 0 && !session_poll (s))
+        session_fail (s);
+    }
+  return n;
+}
+
+static int
+stream_peek (int fd _GL_UNUSED, char *buf, int bufsize, void *arg,
+             double timeout)
+{
+  struct http3_stream *st = arg;
+  struct stream_buf *b;
+  int n;
+
+  stream_start_reading (st);
+  b = stream_wait (st, timeout, &n);
+  if (!b)
+    return n;
+
+  n = MIN ((size_t) bufsize, b->len - b->pos);
+  memcpy (buf, b->data + b->pos, n);
+  return n;
+}
+
+static int
+stream_poll (int fd _GL_UNUSED, double timeout, int wait_for, void *arg)
+{
+  struct http3_stream *st = arg;
+  struct http3_session *s = st->session;
+  ngtcp2_tstamp deadline;
+
+  if (!(wait_for & WAIT_FOR_READ))
+    return 1;
+  if (timeout == -1)
+    timeout = opt.read_timeout;
+  deadline = 0;
+  if (timeout)
+    deadline = timestamp () + (ngtcp2_tstamp) (timeout * NGTCP2_SECONDS);
+  while (st->head.pos == st->head.len && st->body.pos == st->body.len
+         && !st->closed && s->sock >= 0)
+    {
+      if (!session_io (s, deadline))
+        return 1;
+      if (deadline && timestamp () >= deadline)
+        return 0;
+    }
+  return 1;
+}
+
+/* Requests are submitted through http3_open_stream; nothing is ever
+   written to a stream descriptor.  */
+
+static int
+stream_write (int fd _GL_UNUSED, char *buf _GL_UNUSED, int bufsize _GL_UNUSED,
+              void *arg _GL_UNUSED)
+{
+  errno = EBADF;
+  return -1;
+}
+
+static const char *
+stream_errstr (int fd _GL_UNUSED, void *arg)
+{
+  struct http3_stream *st = arg;
+  static char buf[128];
+
+  if (!st->closed || st->error == NGHTTP3_H3_NO_ERROR)
+    return NULL;
+  snprintf (buf, sizeof (buf),
+            _("HTTP/3 stream reset by the server (error 0x%llx)"),
+            (unsigned long long) st->error);
+  return buf;
+}
+
+static void
+stream_free (struct http3_stream *st)
+{
+  size_t i;
+
+  for (i = 0; i < st->nvlen; i++)
+    {
+      xfree (st->nva[i].name);
+      xfree (st->nva[i].value);
+    }
+  xfree (st->nva);
+  xfree (st->head.data);
+  xfree (st->body.data);
+  xfree (st);
+}
+
+static void
+stream_close (int fd, void *arg)
+{
+  struct http3_stream *st = arg;
+  struct http3_session *s = st->session;
+  struct http3_stream **p;
+
+  if (s->sock >= 0 && st->id >= 0)
+    {
+      if (s->h3)
+        nghttp3_conn_set_stream_user_data (s->h3, st->id, NULL);
+      ngtcp2_conn_set_stream_user_data (s->conn, st->id, NULL);
+      if (!st->closed)
+        {
+          /* The credit for what won't be read is given back too.  */
+          session_consume (s, st->id, st->body.len - st->body.pos);
+          ngtcp2_conn_shutdown_stream (s->conn, 0, st->id,
+                                       NGHTTP3_H3_REQUEST_CANCELLED);
+          session_flush (s);
+        }
+      else
+        ngtcp2_conn_extend_max_offset (s->conn, st->body.len - st->body.pos);
+    }
+  close (fd);
+  DEBUGP (("Closed HTTP/3 stream %lld (fd %d).\n", (long long) st->id, fd));
+
+  for (p = &s->stream_list; *p; p = &(*p)->next)
+    if (*p == st)
+      {
+        *p = st->next;
+        break;
+      }
+  stream_free (st);
+  if (--s->streams == 0 && !s->listed)
+    session_free (s);
+}
+
+static struct transport_implementation stream_transport = {
+  stream_read, stream_write, stream_poll, stream_peek, stream_errstr,
+  stream_close, NULL, NULL, NULL, NULL
+};
+
+static struct http3_session *
+session_by_socket (int sock)
+{
+  int i;
+
+  for (i = 0; i < session_count; i++)
+    if (sessions[i]->sock == sock)
+      return sessions[i];
+  return NULL;
+}
+
+/* Start an HTTP/3 session to the origin HOST:PORT on its alternative
+   ALT_HOST:ALT_PORT.  Return the UDP socket of the session, or -1 if
+   the alternative couldn't be used, in which case the request goes
+   over TCP.  A handshake resumed with a ticket completes as the first
+   request is sent, see http3_open_stream.  */
+
+int
+http3_session_new (const char *host, int port, const char *alt_host,
+                   int alt_port)
+{
+  static const gnutls_datum_t alpn = { (unsigned char *) "h3", 2 };
+  ngtcp2_callbacks callbacks;
+  ngtcp2_settings settings;
+  ngtcp2_transport_params params;
+  ngtcp2_cid dcid, scid;
+  struct http3_session *s;
+  struct http3_ticket *t;
+  socklen_t len;
+  int sock, err;
+
+  sock = connect_udp_to_host (alt_host, alt_port);
+  if (sock < 0)
+    {
+      altsvc_broken (host, port);
+      return -1;
+    }
+
+  s = xnew0 (struct http3_session);
+  s->sock = sock;
+  s->host = xstrdup (host);
+  s->port = port;
+  ngtcp2_ccerr_default (&s->ccerr);
+
+  len = sizeof (s->local);
+  getsockname (sock, (struct sockaddr *) &s->local, &len);
+  s->path.local.addr = (ngtcp2_sockaddr *) &s->local;
+  s->path.local.addrlen = len;
+  len = sizeof (s->remote);
+  getpeername (sock, (struct sockaddr *) &s->remote, &len);
+  s->path.remote.addr = (ngtcp2_sockaddr *) &s->remote;
+  s->path.remote.addrlen = len;
+
+  if (gnutls_init (&s->tls, GNUTLS_CLIENT | GNUTLS_ENABLE_EARLY_DATA
+                   | GNUTLS_NO_END_OF_EARLY_DATA) < 0)
+    goto fail;
+  if (!ssl_quic_prepare (s->tls, host)
+      || ngtcp2_crypto_gnutls_configure_client_session (s->tls) != 0
+      || gnutls_alpn_set_protocols (s->tls, &alpn, 1,
+                                    GNUTLS_ALPN_MANDATORY) < 0)
+    goto fail;
+  s->conn_ref.get_conn = get_conn;
+  s->conn_ref.user_data = s;
+  gnutls_session_set_ptr (s->tls, &s->conn_ref);
+  gnutls_handshake_set_hook_function (s->tls,
+                                      GNUTLS_HANDSHAKE_NEW_SESSION_TICKET,
+                                      GNUTLS_HOOK_POST, on_session_ticket);
+
+  xzero (callbacks);
+  callbacks.client_initial = ngtcp2_crypto_client_initial_cb;
+  callbacks.recv_crypto_data = ngtcp2_crypto_recv_crypto_data_cb;
+  callbacks.encrypt = ngtcp2_crypto_encrypt_cb;
+  callbacks.decrypt = ngtcp2_crypto_decrypt_cb;
+  callbacks.hp_mask = ngtcp2_crypto_hp_mask_cb;
+  callbacks.recv_retry = ngtcp2_crypto_recv_retry_cb;
+  callbacks.update_key = ngtcp2_crypto_update_key_cb;
+  callbacks.delete_crypto_aead_ctx = ngtcp2_crypto_delete_crypto_aead_ctx_cb;
+  callbacks.delete_crypto_cipher_ctx =
+    ngtcp2_crypto_delete_crypto_cipher_ctx_cb;
+  callbacks.get_path_challenge_data = ngtcp2_crypto_get_path_challenge_data_cb;
+  callbacks.version_negotiation = ngtcp2_crypto_version_negotiation_cb;
+  callbacks.rand = on_rand;
+  callbacks.get_new_connection_id = on_new_connection_id;
+  callbacks.recv_stream_data = on_recv_stream_data;
+  callbacks.acked_stream_data_offset = on_acked_stream_data_offset;
+  callbacks.stream_close = on_stream_close;
+  callbacks.stream_reset = on_stream_reset;
+  callbacks.extend_max_stream_data = on_extend_max_stream_data;
+  callbacks.extend_max_local_streams_bidi = on_extend_max_local_streams_bidi;
+  callbacks.handshake_completed = on_handshake_completed;
+  callbacks.tls_early_data_rejected = on_tls_early_data_rejected;
+
+  ngtcp2_settings_default (&settings);
+  settings.initial_ts = timestamp ();
+  settings.cc_algo = NGTCP2_CC_ALGO_BBR;
+  settings.max_tx_udp_payload_size = HTTP3_PACKET_SIZE;
+  settings.handshake_timeout =
+    (ngtcp2_duration) ((opt.connect_timeout ? opt.connect_timeout
+                        : HTTP3_HANDSHAKE_TIMEOUT) * NGTCP2_SECONDS);
+
+  ngtcp2_transport_params_default (&params);
+  params.initial_max_stream_data_bidi_local = HTTP3_STREAM_WINDOW;
+  params.initial_max_stream_data_uni = HTTP3_STREAM_WINDOW;
+  params.initial_max_data = HTTP3_CONNECTION_WINDOW;
+  params.initial_max_streams_uni = 3;
+  params.max_idle_timeout = HTTP3_IDLE_TIMEOUT * NGTCP2_SECONDS;
+
+  dcid.datalen = NGTCP2_MIN_INITIAL_DCIDLEN;
+  scid.datalen = 8;
+  if (gnutls_rnd (GNUTLS_RND_RANDOM, dcid.data, dcid.datalen) != 0
+      || gnutls_rnd (GNUTLS_RND_RANDOM, scid.data, scid.datalen) != 0)
+    goto fail;
+
+  err = ngtcp2_conn_client_new (&s->conn, &dcid, &scid, &s->path,
+                                NGTCP2_PROTO_VER_V1, &callbacks, &settings,
+                                &params, NULL, s);
+  if (err != 0)
+    {
+      DEBUGP (("Cannot create QUIC connection: %s\n", ngtcp2_strerror (err)));
+      goto fail;
+    }
+  ngtcp2_conn_set_tls_native_handle (s->conn, s->tls);
+
+  /* With a ticket, the requests go in 0-RTT data, under the transport
+     parameters the server gave last time.  */
+  t = ticket_find (host, port);
+  if (t && gnutls_session_set_data (s->tls, t->data.data, t->data.size) == 0
+      && ngtcp2_conn_decode_and_set_0rtt_transport_params
+           (s->conn, t->params, t->params_len) == 0
+      && session_setup_h3 (s))
+    {
+      s->early = true;
+      if (!session_flush (s))
+        {
+          logprintf (LOG_NOTQUIET,
+                     _("HTTP/3 handshake with %s:%d failed: %s\n"),
+                     host, port, strerror (errno));
+          altsvc_broken (host, port);
+          ticket_forget (host, port);
+          goto fail;
+        }
+    }
+  else if (!session_handshake (s))
+    goto fail;
+
+  s->listed = true;
+  if (session_count == HTTP3_SESSIONS_MAX)
+    session_retire (sessions[0]);
+  sessions[session_count++] = s;
+  DEBUGP (("Started HTTP/3 session to %s:%d on socket %d%s.\n", host, port,
+           sock, s->early ? ", in 0-RTT" : ""));
+  return sock;
+
+ fail:
+  nghttp3_conn_del (s->h3);
+  ngtcp2_conn_del (s->conn);
+  if (s->tls)
+    gnutls_deinit (s->tls);
+  fd_close (sock);
+  xfree (s->host);
+  xfree (s);
+  return -1;
+}
+
+/* Return the socket of the session to HOST:PORT, or -1 if there is
+   none that takes new requests.  Packets that arrived while the
+   session was idle, such as a GOAWAY, are processed first.  */
+
+int
+http3_session_find (const char *host, int port)
+{
+  int i;
+
+  for (i = session_count - 1; i >= 0; i--)
+    {
+      struct http3_session *s = sessions[i];
+
+      if (s->port != port || 0 != strcasecmp (s->host, host))
+        continue;
+
+      if (!session_poll (s))
+        {
+          session_fail (s);
+          return -1;
+        }
+      if (s->goaway)
+        {
+          session_retire (s);
+          return -1;
+        }
+      return s->sock;
+    }
+  return -1;
+}
+
+/* Return true if SOCK is the connection of an HTTP/3 session. */
+
+bool
+http3_session_p (int sock)
+{
+  return sock >= 0 && session_by_socket (sock) != NULL;
+}
+
+/* Open no more streams on the session of SOCK.  */
+
+void
+http3_session_close (int sock)
+{
+  struct http3_session *s = session_by_socket (sock);
+
+  if (s)
+    session_retire (s);
+}
+
+/* Send a request with the COUNT header fields in HEADERS, pseudo-header
+   fields first, on the session of SOCK, as http2_open_stream does.
+   On a session resumed in 0-RTT, the handshake is completed first, so
+   that a failure can still fall back to TCP; a return of -1 means the
+   request wasn't sent and the session is gone.  */
+
+int
+http3_open_stream (int sock, const struct http2_header *headers, int count)
+{
+  struct http3_session *s = session_by_socket (sock);
+  struct http3_stream *st, **p;
+  int i, fd;
+
+  if (!s)
+    return -1;
+
+  st = xnew0 (struct http3_stream);
+  st->session = s;
+  st->id = -1;
+  st->nva = xnew_array (nghttp3_nv, count);
+  st->nvlen = count;
+  for (i = 0; i < count; i++)
+    {
+      st->nva[i].name = (uint8_t *) xstrdup (headers[i].name);
+      st->nva[i].namelen = strlen (headers[i].name);
+      st->nva[i].value = (uint8_t *) xstrdup (headers[i].value);
+      st->nva[i].valuelen = strlen (headers[i].value);
+      st->nva[i].flags = NGHTTP3_NV_FLAG_NONE;
+    }
+  /* Submitted in the order opened.  */
+  for (p = &s->stream_list; *p; p = &(*p)->next)
+    ;
+  *p = st;
+
+  fd = dup (sock);
+  if (fd < 0 || session_submit (s) != 0 || !session_flush (s)
+      || (s->early && !session_handshake (s)))
+    {
+      if (fd >= 0)
+        close (fd);
+      if (st->id >= 0)
+        {
+          if (s->h3)
+            nghttp3_conn_set_stream_user_data (s->h3, st->id, NULL);
+          ngtcp2_conn_set_stream_user_data (s->conn, st->id, NULL);
+        }
+      *p = NULL;
+      stream_free (st);
+      session_fail (s);
+      return -1;
+    }
+
+  ++s->streams;
+  fd_register_transport (fd, &stream_transport, st);
+  DEBUGP (("Opened HTTP/3 stream to %s:%d as fd %d.\n", s->host, s->port,
+           fd));
+  return fd;
+}
+
+/* Close all sessions.  Streams still open keep theirs until they are
+   closed.  */
+
+void
+http3_cleanup (void)
+{
+  int i;
+
+  while (session_count)
+    session_retire (sessions[0]);
+  for (i = 0; i < HTTP3_TICKETS_MAX; i++)
+    ticket_free (&tickets[i]);
+}
@@ -0,0 +1,496 @@
+/* A shared cache of HTTP responses on disk.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_LINUX_FS_H
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+#endif
+
+#include "httpcache.h"
+#include "utils.h"
+#include "url.h"
+#ifdef HAVE_WINHASHES
+# include "win-hashes.h"
+#else
+# include "sha256.h"
+#endif
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+
+/* With --http-cache=DIR, the bodies of the responses to plain GET
+   requests are kept in DIR, where later runs, concurrent ones
+   included, find them again.  A body is stored once, however many URLs
+   it was retrieved from, in a file named by the SHA-256 of its
+   contents:
+
+     DIR/bodies/<2 first digits>/<sha256 of the body>
+
+   What is known of the response to a URL is kept in a file named by
+   the SHA-256 of the URL:
+
+     DIR/urls/<2 first digits>/<sha256 of the URL>
+
+   which holds a single line:
+
+     <url> TAB <body> TAB <size> TAB <expires> TAB <etag> TAB
+     <last-modified> TAB <content-type>
+
+   where a missing header is written as "-".  Until EXPIRES, the body
+   may be used without asking the server; after it, the server is
+   asked whether it still holds, with the validators.
+
+   Every file is written under a name of its own and then renamed into
+   place.  A reader thus sees either the previous file or the new one,
+   whole, and runs sharing the cache need not lock each other out.  */
+
+#define HEX_DIGEST_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+/* Return the name of the file of KIND named by the digest HEX.  */
+
+static char *
+cache_file (const char *kind, const char *hex)
+{
+  return aprintf ("%s/%s/%.2s/%s", opt.http_cache, kind, hex, hex);
+}
+
+static char *
+url_entry_file (const char *url)
+{
+  char digest[SHA256_DIGEST_SIZE];
+  char hex[HEX_DIGEST_SIZE];
+
+  sha256_buffer (url, strlen (url), digest);
+  wg_hex_to_string (hex, digest, sizeof digest);
+  return cache_file ("urls", hex);
+}
+
+static void
+cache_error (const char *file)
+{
+  logprintf (LOG_NOTQUIET, _("Cannot write to the HTTP cache %s: %s\n"),
+             quote (file), strerror (errno));
+}
+
+/* Open a file to be renamed to FILE once written, and return its
+   descriptor, or -1.  *TMP is set to its name.  */
+
+static int
+cache_create (const char *file, char **tmp)
+{
+  int fd = -1;
+
+  *tmp = aprintf ("%s.%ld.tmp", file, (long) getpid ());
+  if (mkalldirs (file) == 0)
+    {
+      fd = open (*tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+      if (fd < 0)
+        cache_error (*tmp);
+    }
+  if (fd < 0)
+    xfree (*tmp);
+  return fd;
+}
+
+/* Put TMP in the place of FILE if it was written whole, as OK says,
+   and remove it otherwise.  */
+
+static bool
+cache_commit (char *tmp, const char *file, bool ok)
+{
+  if (ok && rename (tmp, file) != 0)
+    {
+      cache_error (file);
+      ok = false;
+    }
+  if (!ok)
+    unlink (tmp);
+  xfree (tmp);
+  return ok;
+}
+
+/* Copy the contents of the open file FROM to the open file TO.  Where
+   the file system supports it, as Btrfs and XFS do, TO is made to
+   share the blocks of FROM instead.  */
+
+static bool
+copy_contents (int from, int to)
+{
+  enum { COPY_BUFSIZE = 64 * 1024 };
+  char *buf;
+  ssize_t n;
+
+#ifdef FICLONE
+  if (ioctl (to, FICLONE, from) == 0)
+    return true;
+#endif
+
+  buf = xmalloc (COPY_BUFSIZE);
+  while ((n = read (from, buf, COPY_BUFSIZE)) > 0)
+    {
+      char *p = buf;
+
+      while (n > 0)
+        {
+          ssize_t written = write (to, p, n);
+          if (written < 0)
+            {
+              xfree (buf);
+              return false;
+            }
+          p += written;
+          n -= written;
+        }
+    }
+  xfree (buf);
+  return n == 0;
+}
+
+/* Whether S can be written as a field of a line.  */
+
+static bool
+field_valid_p (const char *s)
+{
+  return s && *s && strcmp (s, "-") && !strpbrk (s, "\t\r\n");
+}
+
+static char *
+field_value (const char *field)
+{
+  if (!strcmp (field, "-"))
+    return NULL;
+  return xstrdup (field);
+}
+
+/* Parse LINE, the contents of the file of an entry, which is modified.
+   Returns NULL if the line is malformed.  */
+
+static struct http_cache_entry *
+entry_parse (char *line)
+{
+  char *fields[7];
+  char *p = line;
+  struct http_cache_entry *e;
+  int n;
+
+  p[strcspn (p, "\r\n")] = '\0';
+  for (n = 0; n < countof (fields) && p; n++)
+    {
+      fields[n] = p;
+      p = strchr (p, '\t');
+      if (p)
+        *p++ = '\0';
+    }
+  /* The body is named by its digest: anything else in its place could
+     make it name a file out of the cache.  */
+  if (n != countof (fields)
+      || strlen (fields[1]) != HEX_DIGEST_SIZE - 1
+      || strspn (fields[1], "0123456789abcdef") != HEX_DIGEST_SIZE - 1)
+    return NULL;
+
+  e = xnew0 (struct http_cache_entry);
+  e->url = xstrdup (fields[0]);
+  e->body = xstrdup (fields[1]);
+  e->size = str_to_wgint (fields[2], NULL, 10);
+  e->expires = (time_t) strtoll (fields[3], NULL, 10);
+  e->etag = field_value (fields[4]);
+  e->last_modified = field_value (fields[5]);
+  e->content_type = field_value (fields[6]);
+  return e;
+}
+
+/* Write the file of entry E.  */
+
+static void
+entry_write (const struct http_cache_entry *e)
+{
+  char *file = url_entry_file (e->url);
+  char *tmp;
+  int fd = cache_create (file, &tmp);
+  FILE *fp;
+  bool ok;
+
+  if (fd < 0)
+    {
+      xfree (file);
+      return;
+    }
+  fp = fdopen (fd, "w");
+  if (!fp)
+    {
+      close (fd);
+      cache_commit (tmp, file, false);
+      xfree (file);
+      return;
+    }
+
+  fprintf (fp, "%s\t%s\t%s\t%" PRId64 "\t%s\t%s\t%s\n", e->url, e->body,
+           number_to_static_string (e->size), (int64_t) e->expires,
+           e->etag ? e->etag : "-",
+           e->last_modified ? e->last_modified : "-",
+           e->content_type ? e->content_type : "-");
+  ok = !ferror (fp);
+  if (fclose (fp) == EOF)
+    ok = false;
+  if (!ok)
+    cache_error (tmp);
+  cache_commit (tmp, file, ok);
+  xfree (file);
+}
+
+/* Return what the cache holds of URL, or NULL if it holds nothing.  */
+
+struct http_cache_entry *
+http_cache_lookup (const char *url)
+{
+  struct http_cache_entry *e = NULL;
+  char *file = url_entry_file (url);
+  FILE *fp = fopen (file, "r");
+
+  if (fp)
+    {
+      char *line = NULL;
+      size_t len = 0;
+
+      if (getline (&line, &len, fp) > 0)
+        e = entry_parse (line);
+      xfree (line);
+      fclose (fp);
+    }
+  xfree (file);
+
+  /* The body may have been removed from under the entry, by hand or
+     by another run.  */
+  if (e && !strcmp (e->url, url))
+    {
+      char *body = cache_file ("bodies", e->body);
+      struct stat st;
+      bool found = stat (body, &st) == 0 && st.st_size == e->size;
+
+      xfree (body);
+      if (found)
+        {
+          DEBUGP (("Found %s in the HTTP cache, %s.\n", url,
+                   http_cache_fresh_p (e) ? "fresh" : "stale"));
+          return e;
+        }
+    }
+  http_cache_entry_free (&e);
+  return NULL;
+}
+
+/* Whether the body of E may be used without asking the server.  */
+
+bool
+http_cache_fresh_p (const struct http_cache_entry *e)
+{
+  return e->expires > time (NULL);
+}
+
+/* Copy the body of E to FILE.  */
+
+bool
+http_cache_copy (const struct http_cache_entry *e, const char *file)
+{
+  char *body = cache_file ("bodies", e->body);
+  bool ok = false;
+  int from, to = -1;
+
+  from = open (body, O_RDONLY | O_BINARY);
+  if (from >= 0)
+    {
+      to = open (file, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+      if (to >= 0)
+        {
+          struct stat st;
+
+          ok = (copy_contents (from, to) && fstat (to, &st) == 0
+                && st.st_size == e->size);
+          if (close (to) != 0)
+            ok = false;
+        }
+      close (from);
+    }
+  if (!ok)
+    {
+      logprintf (LOG_NOTQUIET,
+                 _("Cannot copy %s from the HTTP cache to %s.\n"),
+                 quote_n (0, e->url), quote_n (1, file));
+      /* Leave no part of the body behind.  */
+      if (to >= 0)
+        unlink (file);
+    }
+  xfree (body);
+  return ok;
+}
+
+/* Store FILE, just retrieved from URL, as the body of URL until
+   EXPIRES, along with the headers of the response.  The headers may
+   be NULL.  */
+
+void
+http_cache_store (const char *url, const char *file, time_t expires,
+                  const char *etag, const char *last_modified,
+                  const char *content_type)
+{
+  struct http_cache_entry e;
+  char digest[SHA256_DIGEST_SIZE];
+  char hex[HEX_DIGEST_SIZE];
+  struct stat st, body_st;
+  char *body;
+  FILE *fp;
+
+  if (!field_valid_p (url))
+    return;
+  fp = fopen (file, "rb");
+  if (!fp)
+    return;
+  if (fstat (fileno (fp), &st) != 0 || sha256_stream (fp, digest) != 0)
+    {
+      fclose (fp);
+      return;
+    }
+  wg_hex_to_string (hex, digest, sizeof digest);
+
+  /* A body already there need not be written again.  */
+  body = cache_file ("bodies", hex);
+  if (stat (body, &body_st) != 0 || body_st.st_size != st.st_size)
+    {
+      char *tmp;
+      int fd = cache_create (body, &tmp);
+      bool ok;
+
+      if (fd < 0)
+        {
+          xfree (body);
+          fclose (fp);
+          return;
+        }
+      ok = (lseek (fileno (fp), 0, SEEK_SET) == 0
+            && copy_contents (fileno (fp), fd));
+      if (close (fd) != 0)
+        ok = false;
+      if (!ok)
+        cache_error (tmp);
+      if (!cache_commit (tmp, body, ok))
+        {
+          xfree (body);
+          fclose (fp);
+          return;
+        }
+      DEBUGP (("Stored the body of %s in the HTTP cache.\n", url));
+    }
+  xfree (body);
+  fclose (fp);
+
+  e.url = (char *) url;
+  e.body = hex;
+  e.size = st.st_size;
+  e.expires = expires;
+  e.etag = field_valid_p (etag) ? (char *) etag : NULL;
+  e.last_modified = field_valid_p (last_modified) ? (char *) last_modified
+                                                  : NULL;
+  e.content_type = field_valid_p (content_type) ? (char *) content_type
+                                                : NULL;
+  entry_write (&e);
+}
+
+/* Record that the body of E, confirmed by the server, holds until
+   EXPIRES.  */
+
+void
+http_cache_refresh (struct http_cache_entry *e, time_t expires)
+{
+  e->expires = expires;
+  entry_write (e);
+}
+
+void
+http_cache_entry_free (struct http_cache_entry **e)
+{
+  if (!*e)
+    return;
+  xfree ((*e)->url);
+  xfree ((*e)->body);
+  xfree ((*e)->etag);
+  xfree ((*e)->last_modified);
+  xfree ((*e)->content_type);
+  xfree (*e);
+}
+
+#ifdef TESTING
+
+const char *
+test_http_cache_entry_parse (void)
+{
+  static const char body[] =
+    "2cf24dba5fb0a30e26e83b2ac5b9e29e1b161e5c1fa7425e73043362938b9824";
+  struct http_cache_entry *e;
+  char line[512];
+
+  snprintf (line, sizeof line,
+            "http://example.com/a\t%s\t5\t1700000000\t\"xyz\"\t-\t"
+            "text/html; charset=utf-8\n", body);
+  e = entry_parse (line);
+  mu_assert ("test_http_cache_entry_parse: entry", e != NULL);
+  mu_assert ("test_http_cache_entry_parse: fields",
+             !strcmp (e->url, "http://example.com/a")
+             && !strcmp (e->body, body) && e->size == 5
+             && e->expires == 1700000000
+             && !strcmp (e->etag, "\"xyz\"") && !e->last_modified
+             && !strcmp (e->content_type, "text/html; charset=utf-8"));
+  http_cache_entry_free (&e);
+  mu_assert ("test_http_cache_entry_parse: freed", e == NULL);
+
+  snprintf (line, sizeof line, "http://example.com/a\t%s\t5\t0\t-\t-\n",
+            body);
+  mu_assert ("test_http_cache_entry_parse: short line",
+             entry_parse (line) == NULL);
+
+  strcpy (line, "http://example.com/a\t../../../etc/passwd\t5\t0\t-\t-\t-\n");
+  mu_assert ("test_http_cache_entry_parse: bad body",
+             entry_parse (line) == NULL);
+  return NULL;
+}
+
+#endif /* TESTING */
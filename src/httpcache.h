@@ -0,0 +1,56 @@
+/* Declarations for httpcache.c.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+#ifndef HTTPCACHE_H
+#define HTTPCACHE_H
+
+/* What the HTTP cache holds of the response to a URL.  */
+struct http_cache_entry
+{
+  char *url;
+  char *body;                   /* SHA-256 of the body, in hex */
+  wgint size;                   /* size of the body */
+  time_t expires;               /* until when the body may be used
+                                   without asking the server */
+  char *etag;                   /* ETag of the response, or NULL */
+  char *last_modified;          /* Last-Modified of the response, or NULL */
+  char *content_type;           /* Content-Type of the response, or NULL */
+};
+
+struct http_cache_entry *http_cache_lookup (const char *);
+bool http_cache_fresh_p (const struct http_cache_entry *);
+bool http_cache_copy (const struct http_cache_entry *, const char *);
+void http_cache_store (const char *, const char *, time_t, const char *,
+                       const char *, const char *);
+void http_cache_refresh (struct http_cache_entry *, time_t);
+void http_cache_entry_free (struct http_cache_entry **);
+
+#endif /* HTTPCACHE_H */
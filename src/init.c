@@ -62,12 +62,23 @@ as that of the covered work.  */
 #include "ssl.h"                /* for ssl_cleanup */
 #include "recur.h"              /* for INFINITE_RECURSION */
 #include "convert.h"            /* for convert_cleanup */
+#include "html-url.h"           /* for html_url_cleanup */
+#include "html-parse.h"         /* for html_parse_cleanup */
 #include "res.h"                /* for res_cleanup */
 #include "http.h"               /* for http_cleanup */
 #include "retr.h"               /* for output_stream */
 #include "warc.h"               /* for warc_close */
+#include "metrics.h"            /* for metrics_close */
+#include "validators.h"         /* for validators_close */
+#include "dedup.h"              /* for dedup_cleanup */
+#include "cluster.h"            /* for cluster_close */
+#include "status.h"             /* for status_cleanup */
+#include "stats.h"              /* for stats_print */
 #include "spider.h"             /* for spider_cleanup */
-#include "html-url.h"           /* for cleanup_html_url */
+#include "throttle.h"           /* for throttle_cleanup */
+#ifdef HAVE_HTTP3
+# include "altsvc.h"            /* for altsvc_cleanup */
+#endif
 #include "ptimer.h"             /* for ptimer_destroy */
 #include "c-strcase.h"
 
@@ -98,12 +109,17 @@ CMD_DECLARE (cmd_vector);
 
 CMD_DECLARE (cmd_use_askpass);
 
-#ifdef HAVE_LIBZ
+#ifdef HAVE_COMPRESSION
 CMD_DECLARE (cmd_spec_compression);
 #endif
+CMD_DECLARE (cmd_spec_crawl_order);
+CMD_DECLARE (cmd_spec_debug);
 CMD_DECLARE (cmd_spec_dirstruct);
 CMD_DECLARE (cmd_spec_header);
 CMD_DECLARE (cmd_spec_warc_header);
+#if defined HAVE_LIBZ || defined HAVE_LIBZSTD
+CMD_DECLARE (cmd_spec_warc_compression);
+#endif
 CMD_DECLARE (cmd_spec_htmlify);
 CMD_DECLARE (cmd_spec_mirror);
 CMD_DECLARE (cmd_spec_prefer_family);
@@ -138,6 +154,9 @@ static const struct {
   { "acceptregex",      &opt.acceptregex_s,     cmd_string },
   { "addhostdir",       &opt.add_hostdir,       cmd_boolean },
   { "adjustextension",  &opt.adjust_extension,  cmd_boolean },
+#ifdef HAVE_HTTP3
+  { "altsvcfile",       &opt.altsvc_file,       cmd_file },
+#endif
   { "alwaysrest",       &opt.always_rest,       cmd_boolean }, /* deprecated */
   { "askpassword",      &opt.ask_passwd,        cmd_boolean },
   { "authnochallenge",  &opt.auth_without_challenge,
@@ -146,6 +165,7 @@ static const struct {
   { "backupconverted",  &opt.backup_converted,  cmd_boolean },
   { "backups",          &opt.backups,           cmd_number },
   { "base",             &opt.base_href,         cmd_string },
+  { "batch",            &opt.batch_filename,    cmd_file },
   { "bindaddress",      &opt.bind_address,      cmd_string },
 #ifdef HAVE_LIBCARES
   { "binddnsaddress",   &opt.bind_dns_address,  cmd_string },
@@ -158,6 +178,7 @@ static const struct {
   { "cache",            &opt.allow_cache,       cmd_boolean },
 #ifdef HAVE_SSL
   { "cadirectory",      &opt.ca_directory,      cmd_directory },
+  { "castorelookup",    &opt.ca_store_lookup,   cmd_boolean },
   { "certificate",      &opt.cert_file,         cmd_file },
   { "certificatetype",  &opt.cert_type,         cmd_cert_type },
   { "checkcertificate", &opt.check_cert,        cmd_check_cert },
@@ -166,7 +187,9 @@ static const struct {
 #ifdef HAVE_SSL
   { "ciphers",          &opt.tls_ciphers_string, cmd_string },
 #endif
-#ifdef HAVE_LIBZ
+  { "cluster",          &opt.cluster,           cmd_vector },
+  { "clusternode",      &opt.cluster_node,      cmd_number },
+#ifdef HAVE_COMPRESSION
   { "compression",      &opt.compression,       cmd_spec_compression },
 #endif
   { "connecttimeout",   &opt.connect_timeout,   cmd_time },
@@ -175,17 +198,25 @@ static const struct {
   { "continue",         &opt.always_rest,       cmd_boolean },
   { "convertfileonly",  &opt.convert_file_only, cmd_boolean },
   { "convertlinks",     &opt.convert_links,     cmd_boolean },
+  { "convertthreads",   &opt.convert_threads,   cmd_number },
   { "cookies",          &opt.cookies,           cmd_boolean },
+  { "cookiesindex",     &opt.cookies_index,     cmd_boolean },
+  { "crawlorder",       NULL,                   cmd_spec_crawl_order },
+  { "crawlstate",       &opt.crawl_state,       cmd_file },
 #ifdef HAVE_SSL
   { "crlfile",          &opt.crl_file,          cmd_file_once },
 #endif
   { "cutdirs",          &opt.cut_dirs,          cmd_number },
-  { "debug",            &opt.debug,             cmd_boolean },
+  { "debug",            &opt.debug,             cmd_spec_debug },
+  { "dedupfiles",       &opt.dedup_files,       cmd_boolean },
   { "defaultpage",      &opt.default_page,      cmd_string },
   { "deleteafter",      &opt.delete_after,      cmd_boolean },
   { "dirprefix",        &opt.dir_prefix,        cmd_directory },
   { "dirstruct",        NULL,                   cmd_spec_dirstruct },
   { "dnscache",         &opt.dns_cache,         cmd_boolean },
+  { "dnscachefile",     &opt.dns_cache_file,    cmd_file },
+  { "dnscachettl",      &opt.dns_cache_ttl,     cmd_time },
+  { "dnsprefetch",      &opt.dns_prefetch,      cmd_boolean },
 #ifdef HAVE_LIBCARES
   { "dnsservers",       &opt.dns_servers,       cmd_string },
 #endif
@@ -200,11 +231,14 @@ static const struct {
 #endif
   { "excludedirectories", &opt.excludes,        cmd_directory_vector },
   { "excludedomains",   &opt.exclude_domains,   cmd_vector },
+  { "flushinterval",    &opt.flush_interval,    cmd_time },
   { "followftp",        &opt.follow_ftp,        cmd_boolean },
   { "followtags",       &opt.follow_tags,       cmd_vector },
   { "forcehtml",        &opt.force_html,        cmd_boolean },
+  { "ftpconnections",   &opt.ftp_connections,   cmd_number },
   { "ftppasswd",        &opt.ftp_passwd,        cmd_string }, /* deprecated */
   { "ftppassword",      &opt.ftp_passwd,        cmd_string },
+  { "ftppipelining",    &opt.ftp_pipelining,    cmd_boolean },
   { "ftpproxy",         &opt.ftp_proxy,         cmd_string },
 #ifdef HAVE_SSL
   { "ftpscleardataconnection", &opt.ftps_clear_data_connection, cmd_boolean },
@@ -224,6 +258,13 @@ static const struct {
 #endif
   { "htmlextension",    &opt.adjust_extension,  cmd_boolean }, /* deprecated */
   { "htmlify",          NULL,                   cmd_spec_htmlify },
+#ifdef HAVE_NGHTTP2
+  { "http2",            &opt.http2,             cmd_boolean },
+#endif
+#ifdef HAVE_HTTP3
+  { "http3",            &opt.http3,             cmd_boolean },
+#endif
+  { "httpcache",        &opt.http_cache,        cmd_directory },
   { "httpkeepalive",    &opt.http_keep_alive,   cmd_boolean },
   { "httppasswd",       &opt.http_passwd,       cmd_string }, /* deprecated */
   { "httppassword",     &opt.http_passwd,       cmd_string },
@@ -245,11 +286,19 @@ static const struct {
   { "input",            &opt.input_filename,    cmd_file },
 #ifdef HAVE_METALINK
   { "inputmetalink",    &opt.input_metalink,    cmd_file },
+#endif
+  { "inputunique",      &opt.input_unique,      cmd_boolean },
+#ifdef HAVE_LIBURING
+  { "iouring",          &opt.io_uring,          cmd_boolean },
 #endif
   { "iri",              &opt.enable_iri,        cmd_boolean },
   { "keepbadhash",      &opt.keep_badhash,      cmd_boolean },
   { "keepsessioncookies", &opt.keep_session_cookies, cmd_boolean },
+#ifdef HAVE_SSL
+  { "ktls",             &opt.ktls,              cmd_boolean },
+#endif
   { "limitrate",        &opt.limit_rate,        cmd_bytes },
+  { "limitrateperhost", &opt.limit_rate_per_host, cmd_bytes },
   { "loadcookies",      &opt.cookies_input,     cmd_file },
   { "localencoding",    &opt.encoding_local,     cmd_string },
   { "logfile",          &opt.lfilename,         cmd_file },
@@ -260,6 +309,7 @@ static const struct {
   { "metalinkoverhttp", &opt.metalink_over_http, cmd_boolean },
 #endif
   { "method",           &opt.method,            cmd_string_uppercase },
+  { "metricsfile",      &opt.metrics_file,      cmd_file },
   { "mirror",           NULL,                   cmd_spec_mirror },
   { "netrc",            &opt.netrc,             cmd_boolean },
   { "noclobber",        &opt.noclobber,         cmd_boolean },
@@ -275,8 +325,11 @@ static const struct {
 #ifdef HAVE_SSL
   { "pinnedpubkey",     &opt.pinnedpubkey,      cmd_string },
 #endif
+  { "pipeline",         &opt.pipeline,          cmd_number },
   { "postdata",         &opt.post_data,         cmd_string },
   { "postfile",         &opt.post_file_name,    cmd_file },
+  { "preallocate",      &opt.preallocate,       cmd_boolean },
+  { "preconnect",       &opt.preconnect,        cmd_number },
   { "preferfamily",     NULL,                   cmd_spec_prefer_family },
 #ifdef HAVE_METALINK
   { "preferredlocation", &opt.preferred_location, cmd_string },
@@ -310,6 +363,7 @@ static const struct {
   { "removelisting",    &opt.remove_listing,    cmd_boolean },
   { "reportspeed",             &opt.report_bps, cmd_spec_report_speed},
   { "restrictfilenames", NULL,                  cmd_spec_restrict_file_names },
+  { "resumecrawl",      &opt.resume_crawl,      cmd_boolean },
   { "retrsymlinks",     &opt.retr_symlinks,     cmd_boolean },
   { "retryconnrefused", &opt.retry_connrefused, cmd_boolean },
   { "retryonhosterror", &opt.retry_on_host_error, cmd_boolean },
@@ -320,13 +374,22 @@ static const struct {
 #ifdef HAVE_SSL
   { "secureprotocol",   &opt.secure_protocol,   cmd_spec_secure_protocol },
 #endif
+  { "segments",         &opt.segments,          cmd_number },
   { "serverresponse",   &opt.server_response,   cmd_boolean },
   { "showalldnsentries", &opt.show_all_dns_entries, cmd_boolean },
   { "showprogress",     &opt.show_progress,     cmd_spec_progressdisp },
   { "spanhosts",        &opt.spanhost,          cmd_boolean },
   { "spider",           &opt.spider,            cmd_boolean },
+  { "spiderconnections", &opt.spider_connections, cmd_number },
   { "startpos",         &opt.start_pos,         cmd_bytes },
+  { "stats",            &opt.stats,             cmd_boolean },
+  { "statusfile",       &opt.status_file,       cmd_file },
   { "strictcomments",   &opt.strict_comments,   cmd_boolean },
+  { "tcpcongestion",    &opt.tcp_congestion,    cmd_string },
+  { "tcpfastopen",      &opt.tcp_fastopen,      cmd_boolean },
+  { "tcpnodelay",       &opt.tcp_nodelay,       cmd_boolean },
+  { "tcprcvbuf",        &opt.tcp_rcvbuf,        cmd_bytes },
+  { "tcpsndbuf",        &opt.tcp_sndbuf,        cmd_bytes },
   { "timeout",          NULL,                   cmd_spec_timeout },
   { "timestamping",     &opt.timestamping,      cmd_boolean },
   { "tries",            &opt.ntry,              cmd_number_inf },
@@ -339,26 +402,35 @@ static const struct {
   { "user",             &opt.user,              cmd_string },
   { "useragent",        NULL,                   cmd_spec_useragent },
   { "useservertimestamps", &opt.useservertimestamps, cmd_boolean },
+  { "validatorsfile",   &opt.validators_file,   cmd_file },
   { "verbose",          NULL,                   cmd_spec_verbose },
   { "wait",             &opt.wait,              cmd_time },
   { "waitretry",        &opt.waitretry,         cmd_time },
   { "warccdx",          &opt.warc_cdx_enabled,  cmd_boolean },
   { "warccdxdedup",     &opt.warc_cdx_dedup_filename,  cmd_file },
+#if defined HAVE_LIBZ || defined HAVE_LIBZSTD
+  { "warccompression",  NULL,                   cmd_spec_warc_compression },
+#endif
 #ifdef HAVE_LIBZ
-  { "warccompression",  &opt.warc_compression_enabled, cmd_boolean },
+  { "warccompressionthreads", &opt.warc_compression_threads, cmd_number },
 #endif
+  { "warcdedupcrawl",   &opt.warc_dedup_crawl,  cmd_boolean },
   { "warcdigests",      &opt.warc_digests_enabled, cmd_boolean },
   { "warcfile",         &opt.warc_filename,     cmd_file },
   { "warcheader",       NULL,                   cmd_spec_warc_header },
   { "warckeeplog",      &opt.warc_keep_log,     cmd_boolean },
   { "warcmaxsize",      &opt.warc_maxsize,      cmd_bytes },
   { "warctempdir",      &opt.warc_tempdir,      cmd_directory },
+#ifdef HAVE_LIBZSTD
+  { "warczstddictionary", &opt.warc_zstd_dictionary, cmd_file },
+#endif
 #ifdef USE_WATT32
   { "wdebug",           &opt.wdebug,            cmd_boolean },
 #endif
 #ifdef ENABLE_XATTR
   { "xattr",            &opt.enable_xattr,      cmd_boolean },
 #endif
+  { "zsync",            &opt.zsync,             cmd_boolean },
 };
 
 /* Look up CMDNAME in the commands[] and return its position in the
@@ -421,6 +493,7 @@ defaults (void)
   opt.if_modified_since = true;
 
   opt.read_timeout = 900;
+  opt.flush_interval = 1;
   opt.use_robots = true;
 
   opt.remove_listing = true;
@@ -430,6 +503,9 @@ defaults (void)
   opt.dots_in_line = 50;
 
   opt.dns_cache = true;
+  opt.dns_cache_ttl = 3600;
+  opt.dns_prefetch = true;
+  opt.tcp_nodelay = true;
   opt.ftp_pasv = true;
   /* 2014-09-07  Darshit Shah  <darnir@gmail.com>
    * opt.retr_symlinks is set to true by default. Creating symbolic links on the
@@ -456,7 +532,7 @@ defaults (void)
   opt.ftps_clear_data_connection = false;
 #endif
 
-#ifdef HAVE_LIBZ
+#ifdef HAVE_COMPRESSION
   opt.compression = compression_none;
 #endif
 
@@ -495,6 +571,8 @@ defaults (void)
   opt.warc_compression_enabled = true;
 #else
   opt.warc_compression_enabled = false;
+  /* zstd is the only compressor there may be.  */
+  opt.warc_compression_zstd = true;
 #endif
   opt.warc_digests_enabled = true;
   opt.warc_cdx_enabled = false;
@@ -512,6 +590,10 @@ defaults (void)
   opt.hsts = true;
 #endif
 
+#ifdef HAVE_NGHTTP2
+  opt.http2 = true;
+#endif
+
   opt.enable_xattr = false;
 }
 
@@ -1497,13 +1579,21 @@ cmd_cert_type (const char *com, const char *val, void *place)
 
 static bool check_user_specified_header (const char *);
 
-#ifdef HAVE_LIBZ
+#ifdef HAVE_COMPRESSION
 static bool
 cmd_spec_compression (const char *com, const char *val, void *place)
 {
   static const struct decode_item choices[] = {
     { "auto", compression_auto },
+#ifdef HAVE_LIBZ
     { "gzip", compression_gzip },
+#endif
+#ifdef HAVE_LIBBROTLIDEC
+    { "br", compression_brotli },
+#endif
+#ifdef HAVE_LIBZSTD
+    { "zstd", compression_zstd },
+#endif
     { "none", compression_none },
   };
   int ok = decode_string (val, choices, countof (choices), place);
@@ -1516,6 +1606,37 @@ cmd_spec_compression (const char *com, const char *val, void *place)
 }
 #endif
 
+/* Set the order of the recursion queue: "breadth", "documents" or
+   "pages".  */
+static bool
+cmd_spec_crawl_order (const char *com, const char *val, void *place_ignored _GL_UNUSED)
+{
+  static const struct decode_item choices[] = {
+    { "breadth", crawl_order_breadth },
+    { "documents", crawl_order_documents },
+    { "pages", crawl_order_pages },
+  };
+  int crawl_order = crawl_order_breadth;
+  int ok = decode_string (val, choices, countof (choices), &crawl_order);
+  if (!ok)
+    fprintf (stderr, _("%s: %s: Invalid value %s.\n"), exec_name, com, quote (val));
+  opt.crawl_order = crawl_order;
+  return ok;
+}
+
+/* Turn debugging on or off, or with "startup", print the time spent
+   in each phase of the startup.  */
+static bool
+cmd_spec_debug (const char *com, const char *val, void *place_ignored _GL_UNUSED)
+{
+  if (0 == c_strcasecmp (val, "startup"))
+    {
+      opt.debug_startup = true;
+      return true;
+    }
+  return cmd_boolean (com, val, &opt.debug);
+}
+
 static bool
 cmd_spec_dirstruct (const char *com, const char *val, void *place_ignored _GL_UNUSED)
 {
@@ -1530,6 +1651,33 @@ cmd_spec_dirstruct (const char *com, const char *val, void *place_ignored _GL_UN
   return true;
 }
 
+#if defined HAVE_LIBZ || defined HAVE_LIBZSTD
+/* Turn WARC compression on or off, or choose the compressor: "gzip"
+   or "zstd".  */
+static bool
+cmd_spec_warc_compression (const char *com, const char *val,
+                           void *place_ignored _GL_UNUSED)
+{
+#ifdef HAVE_LIBZ
+  if (0 == c_strcasecmp (val, "gzip"))
+    {
+      opt.warc_compression_enabled = true;
+      opt.warc_compression_zstd = false;
+      return true;
+    }
+#endif
+#ifdef HAVE_LIBZSTD
+  if (0 == c_strcasecmp (val, "zstd"))
+    {
+      opt.warc_compression_enabled = true;
+      opt.warc_compression_zstd = true;
+      return true;
+    }
+#endif
+  return cmd_boolean (com, val, &opt.warc_compression_enabled);
+}
+#endif
+
 static bool
 cmd_spec_header (const char *com, const char *val, void *place_ignored _GL_UNUSED)
 {
@@ -1937,6 +2085,13 @@ cleanup (void)
   if (opt.warc_filename != 0)
     warc_close ();
 
+  metrics_close ();
+  cluster_close ();
+  validators_close ();
+  status_cleanup ();
+  stats_print ();
+  memacct_print ();
+
   log_close ();
 
   if (output_stream && output_stream != stderr)
@@ -1960,15 +2115,28 @@ cleanup (void)
 
 #if defined DEBUG_MALLOC || defined TESTING
   convert_cleanup ();
+  html_url_cleanup ();
+  html_parse_cleanup ();
+  dedup_cleanup ();
   res_cleanup ();
   http_cleanup ();
-  cleanup_html_url ();
+#ifdef HAVE_HTTP3
+  altsvc_cleanup ();
+#endif
   spider_cleanup ();
   host_cleanup ();
+  throttle_cleanup ();
+  politeness_cleanup ();
+  moved_permanently_cleanup ();
   log_cleanup ();
   netrc_cleanup ();
-#if defined HAVE_SSL && !defined HAVE_WINTLS
+  iri_cleanup ();
+  url_cleanup ();
+  unique_name_cleanup ();
+  acclist_cleanup ();
+#ifdef HAVE_SSL
   ssl_cleanup ();
+  cert_verify_cache_cleanup ();
 #endif
   connect_cleanup ();
 
@@ -1998,6 +2166,7 @@ cleanup (void)
   free_vec ((char **)opt.excludes);
   free_vec ((char **)opt.includes);
   free_vec (opt.domains);
+  free_vec (opt.cluster);
   free_vec (opt.exclude_domains);
   free_vec (opt.follow_tags);
   free_vec (opt.ignore_tags);
@@ -2005,6 +2174,7 @@ cleanup (void)
   xfree (opt.warc_filename);
   xfree (opt.warc_tempdir);
   xfree (opt.warc_cdx_dedup_filename);
+  xfree (opt.warc_zstd_dictionary);
   xfree (opt.ftp_user);
   xfree (opt.ftp_passwd);
   xfree (opt.ftp_proxy);
@@ -2031,6 +2201,8 @@ cleanup (void)
   xfree (opt.egd_file);
 # endif
   xfree (opt.bind_address);
+  xfree (opt.tcp_congestion);
+  xfree (opt.batch_filename);
   xfree (opt.cookies_input);
   xfree (opt.cookies_output);
   xfree (opt.user);
@@ -2042,6 +2214,11 @@ cleanup (void)
   xfree (opt.body_data);
   xfree (opt.body_file);
   xfree (opt.rejected_log);
+  xfree (opt.metrics_file);
+  xfree (opt.validators_file);
+  xfree (opt.http_cache);
+  xfree (opt.status_file);
+  xfree (opt.crawl_state);
   xfree (opt.use_askpass);
   xfree (opt.retry_on_http_error);
 
@@ -2050,6 +2227,10 @@ cleanup (void)
   xfree (opt.locale);
 #ifdef HAVE_HSTS
   xfree (opt.hsts_file);
+  xfree (opt.dns_cache_file);
+#endif
+#ifdef HAVE_HTTP3
+  xfree (opt.altsvc_file);
 #endif
 
   xfree (opt.wgetrcfile);
@@ -38,6 +38,9 @@ as that of the covered work.  */
 #ifdef HAVE_ICONV
 # include <iconv.h>
 #endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 #ifdef ENABLE_IRI
 #ifndef WINDOWS
@@ -54,6 +57,11 @@ as that of the covered work.  */
 #include "c-strcase.h"
 #include "c-strcasestr.h"
 #include "xstrndup.h"
+#include "hash.h"
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
 
 /* Note: locale encoding is kept in options struct (opt.locale) */
 
@@ -129,16 +137,116 @@ check_encoding_name (const char *encoding)
   return true;
 }
 
-/* Do the conversion according to the passed conversion descriptor cd. *out
-   will contain the transcoded string on success. *out content is
+/* Return true if ENCODING is one of the common encodings that
+   represent the ASCII characters as themselves, so that converting
+   pure ASCII from one of them to another needs no work.  */
+
+static bool
+ascii_compatible_p (const char *encoding)
+{
+  static const char *const prefixes[] = {
+    "UTF-8", "UTF8", "ASCII", "US-ASCII", "ANSI_X3.4", "ISO-8859-",
+    "ISO8859-", "ISO_8859-", "LATIN", "CP125", "WINDOWS-125", "KOI8-"
+  };
+  size_t i;
+
+  for (i = 0; i < countof (prefixes); i++)
+    if (!c_strncasecmp (encoding, prefixes[i], strlen (prefixes[i])))
+      return true;
+  return false;
+}
+
+/* Return true if the LEN bytes at S are all ASCII.  */
+
+static bool
+ascii_p (const char *s, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    if (!c_isascii (s[i]))
+      return false;
+  return true;
+}
+
+/* The conversion descriptors opened by transcode.  Opening one is
+   costly, more so with win-iconv, and a crawl converts its URLs and
+   file names with the same few pairs of encodings, so they are kept
+   open.  */
+
+#define ICONV_CACHE_SIZE 4
+
+static struct {
+  char *tocode, *fromcode;
+  iconv_t cd;
+} iconv_cache[ICONV_CACHE_SIZE];
+
+/* The entry of iconv_cache to replace next.  */
+static int iconv_cache_next;
+
+/* The buffer transcode converts into, grown as needed.  */
+static char *iconv_buf;
+static size_t iconv_bufsize;
+
+#ifdef HAVE_PTHREAD
+/* The links of the files converted by several threads are parsed
+   concurrently, and their URLs transcoded with the descriptors and
+   the buffer above.  */
+static pthread_mutex_t iconv_lock = PTHREAD_MUTEX_INITIALIZER;
+# define ICONV_LOCK() pthread_mutex_lock (&iconv_lock)
+# define ICONV_UNLOCK() pthread_mutex_unlock (&iconv_lock)
+#else
+# define ICONV_LOCK()
+# define ICONV_UNLOCK()
+#endif
+
+/* Return a descriptor converting from FROMCODE to TOCODE, in its
+   initial state, or (iconv_t) -1 if there is no such conversion.  */
+
+static iconv_t
+iconv_cache_get (const char *tocode, const char *fromcode)
+{
+  iconv_t cd;
+  int i;
+
+  for (i = 0; i < ICONV_CACHE_SIZE; i++)
+    if (iconv_cache[i].tocode
+        && !strcasecmp (iconv_cache[i].tocode, tocode)
+        && !strcasecmp (iconv_cache[i].fromcode, fromcode))
+      {
+        /* Reset the shift state a failed conversion may have left.  */
+        iconv (iconv_cache[i].cd, NULL, NULL, NULL, NULL);
+        return iconv_cache[i].cd;
+      }
+
+  cd = iconv_open (tocode, fromcode);
+  if (cd == (iconv_t)(-1))
+    return cd;
+
+  i = iconv_cache_next;
+  iconv_cache_next = (i + 1) % ICONV_CACHE_SIZE;
+  if (iconv_cache[i].tocode)
+    {
+      iconv_close (iconv_cache[i].cd);
+      xfree (iconv_cache[i].tocode);
+      xfree (iconv_cache[i].fromcode);
+    }
+  iconv_cache[i].tocode = xstrdup (tocode);
+  iconv_cache[i].fromcode = xstrdup (fromcode);
+  iconv_cache[i].cd = cd;
+  return cd;
+}
+
+/* Convert the INLEN bytes at IN from FROMCODE to TOCODE.  *out will
+   contain the transcoded string on success, terminated by two zero
+   bytes for the encodings with wide characters.  *out content is
    unspecified otherwise. */
 bool
 transcode (const char *tocode, const char *fromcode, char const *in, size_t inlen, char **out)
 {
   iconv_t cd;
-  size_t len, done, outlen;
-  int invalid = 0, tooshort = 0;
   char *s;
+  size_t outlen;
   bool ret = false;
 
   if (!strcasecmp (fromcode, tocode))
@@ -148,38 +256,59 @@ transcode (const char *tocode, const char *fromcode, char const *in, size_t inle
       return true;
     }
 
-  cd = iconv_open (tocode, fromcode);
+  /* Most URLs and file names are plain ASCII, which would only be
+     copied by iconv, at the cost of opening a descriptor.  */
+  if (ascii_p (in, inlen) && ascii_compatible_p (fromcode)
+      && ascii_compatible_p (tocode))
+    {
+      *out = xstrndup (in, inlen);
+      return true;
+    }
+
+  ICONV_LOCK ();
+  cd = iconv_cache_get (tocode, fromcode);
   if (cd == (iconv_t)(-1))
     {
+      ICONV_UNLOCK ();
       logprintf (LOG_VERBOSE, _("Conversion from %s to %s isn't supported\n"),
                  quote_n (0, fromcode), quote_n (1, tocode));
       *out = NULL;
       return ret;
     }
 
-  len = outlen = inlen * 2;
-  *out = s = xmalloc (outlen + 2); /* Unicode too */
-  done = 0;
+  /* Convert into iconv_buf, so that the result can be copied at its
+     exact size, rather than guessing the size and growing the guess
+     for each string.  */
+  if (iconv_bufsize < inlen * 2)
+    {
+      iconv_bufsize = MAX (inlen * 2, 256);
+      iconv_buf = xrealloc (iconv_buf, iconv_bufsize);
+    }
+  s = iconv_buf;
+  outlen = iconv_bufsize;
 
   for (;;)
     {
-      if (iconv (cd, (ICONV_CONST char **) &in, &inlen, out, &outlen) != (size_t)(-1) &&
-          iconv (cd, NULL, NULL, out, &outlen) != (size_t)(-1))
+      if (iconv (cd, (ICONV_CONST char **) &in, &inlen, &s, &outlen) != (size_t)(-1) &&
+          iconv (cd, NULL, NULL, &s, &outlen) != (size_t)(-1))
         {
-          *out = s;
-          *(short*)(s + len - outlen - done) = '\0';
+          size_t done = s - iconv_buf;
+
+          *out = xmalloc (done + 2); /* Unicode too */
+          memcpy (*out, iconv_buf, done);
+          memset (*out + done, '\0', 2);
           ret = true;
           break;
         }
 
       if (errno == E2BIG) /* Output buffer full */
         {
-          tooshort++;
-          done = len;
-          len = done + inlen * 2;
-          s = xrealloc (s, len + 1);
-          *out = s + done - outlen;
-          outlen += inlen * 2;
+          size_t done = s - iconv_buf;
+
+          iconv_bufsize *= 2;
+          iconv_buf = xrealloc (iconv_buf, iconv_bufsize);
+          s = iconv_buf + done;
+          outlen = iconv_bufsize - done;
         }
       else if (errno == EINVAL || errno == EILSEQ)
         {
@@ -193,18 +322,56 @@ transcode (const char *tocode, const char *fromcode, char const *in, size_t inle
           break;
         }
     }
-
-  iconv_close(cd);
+  ICONV_UNLOCK ();
 
   if (!ret)
+    *out = NULL;
+
+  return ret;
+}
+
+#ifdef TESTING
+
+const char *
+test_transcode (void)
+{
+  char in[600], *out;
+  int i;
+
+  /* Once with a new descriptor, once with the kept one.  */
+  for (i = 0; i < 2; i++)
     {
-      xfree (s);
-      *out = NULL;
+      mu_assert ("transcode: Latin-1",
+                 transcode ("UTF-8", "ISO-8859-1", "caf\xe9", 4, &out));
+      mu_assert ("transcode: Latin-1 result", !strcmp (out, "caf\xc3\xa9"));
+      xfree (out);
     }
 
-  return ret;
+  /* A failed conversion must not leave the descriptor unusable.  */
+  mu_assert ("transcode: invalid UTF-8",
+             !transcode ("ISO-8859-1", "UTF-8", "caf\xc3", 4, &out));
+  mu_assert ("transcode: invalid UTF-8 result", out == NULL);
+  mu_assert ("transcode: after a failure",
+             transcode ("ISO-8859-1", "UTF-8", "caf\xc3\xa9", 5, &out));
+  mu_assert ("transcode: after a failure result", !strcmp (out, "caf\xe9"));
+  xfree (out);
+
+  /* Output four times as long as the input.  */
+  memset (in, '\xe9', sizeof in);
+  mu_assert ("transcode: long output",
+             transcode ("UTF-32LE", "ISO-8859-1", in, sizeof in, &out));
+  for (i = 0; i < (int) sizeof in; i++)
+    mu_assert ("transcode: long output result",
+               !memcmp (out + i * 4, "\xe9\0\0\0", 4));
+  mu_assert ("transcode: long output end", !memcmp (out + sizeof in * 4, "\0\0", 2));
+  xfree (out);
+
+  iri_cleanup ();
+  return NULL;
 }
 
+#endif /* TESTING */
+
 /* Transcode only.
    unescape/escape (reencode_escapes) in url_parse.
 */
@@ -287,10 +454,10 @@ remote_to_utf8 (const char *encoding, const char *str, char **new)
 
 #else
 
-/* Try to "ASCII encode" UTF-8 host. Return the new domain on success or NULL
-   on error. */
-char *
-idn_encode (const char *encoding, const char *host)
+/* Try to "ASCII encode" the host HOST in ENCODING.  Return the new
+   domain on success or NULL on error. */
+static char *
+idn_to_ascii (const char *encoding, const char *host)
 {
   int ret;
   char *ascii_encoded;
@@ -353,31 +520,182 @@ idn_encode (const char *encoding, const char *host)
   return ret == IDN2_OK ? ascii_encoded : NULL;
 }
 
+#endif /* not WINDOWS */
+
+/* The hosts idn_encode has seen, prefixed by their encoding and a
+   space, mapped to their ASCII form, or to NULL if that failed.  A
+   crawl under --iri parses the URLs of the same few hosts over and
+   over, and the IDNA conversion is not cheap.  */
+static struct hash_table *idn_encoded;
+
+/* The ASCII forms found by idn_encode mapped to the hosts in UTF-8,
+   for idn_decode.  */
+static struct hash_table *idn_decoded;
+
+#ifdef HAVE_PTHREAD
+/* The hosts of the links of the files converted by several threads
+   are encoded concurrently.  */
+static pthread_mutex_t idn_lock = PTHREAD_MUTEX_INITIALIZER;
+# define IDN_LOCK() pthread_mutex_lock (&idn_lock)
+# define IDN_UNLOCK() pthread_mutex_unlock (&idn_lock)
+#else
+# define IDN_LOCK()
+# define IDN_UNLOCK()
 #endif
 
+/* Try to "ASCII encode" HOST, in ENCODING. Return the new domain on
+   success or NULL on error, or if HOST is ASCII already. */
+char *
+idn_encode (const char *encoding, const char *host)
+{
+  char *key, *ascii, *utf8;
+
+  /* There is nothing to do for ASCII labels, which are the bulk of
+     the host names.  */
+  if (ascii_p (host, strlen (host)))
+    return NULL;
+
+  IDN_LOCK ();
+  if (!idn_encoded)
+    {
+      idn_encoded = make_nocase_string_hash_table (0);
+      idn_decoded = make_nocase_string_hash_table (0);
+    }
+
+  key = aprintf ("%s %s", encoding, host);
+  if (hash_table_get_pair (idn_encoded, key, NULL, &ascii))
+    {
+      xfree (key);
+      ascii = ascii ? xstrdup (ascii) : NULL;
+      IDN_UNLOCK ();
+      return ascii;
+    }
+
+  ascii = idn_to_ascii (encoding, host);
+  hash_table_put (idn_encoded, key, ascii ? xstrdup (ascii) : NULL);
+
+  if (ascii && !hash_table_contains (idn_decoded, ascii))
+    {
+      if (!c_strcasecmp (encoding, "UTF-8"))
+        utf8 = xstrdup (host);
+      else if (!remote_to_utf8 (encoding, host, &utf8))
+        utf8 = NULL;
+      if (utf8)
+        hash_table_put (idn_decoded, xstrdup (ascii), utf8);
+    }
+  IDN_UNLOCK ();
+
+  return ascii;
+}
+
 /* Try to decode an "ASCII encoded" host. Return the new domain in the locale
    on success or NULL on error. */
 char *
 idn_decode (const char *host)
 {
-/*
-  char *new;
-  int ret;
+  const char *utf8 = NULL;
+  char *res;
+
+  /* Only the hosts idn_encode produced are decoded, and only for a
+     UTF-8 locale: this is used to print them, and neither the
+     conversion label by label nor one to a locale that may not have
+     the characters is worth it.  */
+  IDN_LOCK ();
+  if (idn_decoded && opt.locale && !c_strcasecmp (opt.locale, "UTF-8"))
+    utf8 = hash_table_get (idn_decoded, host);
+  res = xstrdup (utf8 ? utf8 : host);
+  IDN_UNLOCK ();
+
+  return res;
+}
 
-  ret = idn2_register_u8 (NULL, host, (uint8_t **) &new, 0);
-  if (ret != IDN2_OK)
+/* Free the tables of idn_encode.  */
+static void
+idn_cleanup (void)
+{
+  hash_table_iterator iter;
+
+  if (!idn_encoded)
+    return;
+
+  for (hash_table_iterate (idn_encoded, &iter); hash_table_iter_next (&iter); )
     {
-      logprintf (LOG_VERBOSE, _("idn2_register_u8 failed (%d): %s: %s\n"), ret,
-                 quote (idn2_strerror (ret)), host);
-      return NULL;
+      xfree (iter.key);
+      xfree (iter.value);
     }
+  hash_table_destroy (idn_encoded);
+  idn_encoded = NULL;
 
-  return new;
-*/
-  /* idn2_register_u8() just works label by label.
-   * That is pretty much overhead for just displaying the original ulabels.
-   * To keep at least the debug output format, return a cloned host. */
-  return xstrdup(host);
+  for (hash_table_iterate (idn_decoded, &iter); hash_table_iter_next (&iter); )
+    {
+      xfree (iter.key);
+      xfree (iter.value);
+    }
+  hash_table_destroy (idn_decoded);
+  idn_decoded = NULL;
 }
 
-#endif
+#ifdef TESTING
+
+const char *
+test_idn_encode (void)
+{
+  const char *saved_locale = opt.locale;
+  char *ascii;
+  int i;
+
+  mu_assert ("idn_encode: ASCII host", !idn_encode ("UTF-8", "example.com"));
+
+  /* Once converted, once from the table.  */
+  for (i = 0; i < 2; i++)
+    {
+      ascii = idn_encode ("UTF-8", "b\xc3\xbc" "cher.example");
+      mu_assert ("idn_encode: UTF-8 host",
+                 ascii && !strcmp (ascii, "xn--bcher-kva.example"));
+      xfree (ascii);
+    }
+  ascii = idn_encode ("ISO-8859-1", "b\xfc" "cher.example");
+  mu_assert ("idn_encode: Latin-1 host",
+             ascii && !strcmp (ascii, "xn--bcher-kva.example"));
+  xfree (ascii);
+
+  opt.locale = "UTF-8";
+  ascii = idn_decode ("xn--bcher-kva.example");
+  mu_assert ("idn_decode: known host", !strcmp (ascii, "b\xc3\xbc" "cher.example"));
+  xfree (ascii);
+  ascii = idn_decode ("xn--caf-dma.example");
+  mu_assert ("idn_decode: unknown host", !strcmp (ascii, "xn--caf-dma.example"));
+  xfree (ascii);
+  opt.locale = saved_locale;
+
+  idn_cleanup ();
+  return NULL;
+}
+
+#endif /* TESTING */
+
+#endif /* ENABLE_IRI */
+
+#if defined HAVE_ICONV && defined ENABLE_IRI
+
+/* Close the descriptors kept by transcode, and free the other tables
+   of this file.  */
+void
+iri_cleanup (void)
+{
+  int i;
+
+  for (i = 0; i < ICONV_CACHE_SIZE; i++)
+    if (iconv_cache[i].tocode)
+      {
+        iconv_close (iconv_cache[i].cd);
+        xfree (iconv_cache[i].tocode);
+        xfree (iconv_cache[i].fromcode);
+      }
+  iconv_cache_next = 0;
+  xfree (iconv_buf);
+  iconv_bufsize = 0;
+  idn_cleanup ();
+}
+
+#endif /* HAVE_ICONV && ENABLE_IRI */
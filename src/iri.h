@@ -61,12 +61,14 @@ bool transcode (const char *tocode, const char *fromcode,
 
 char *idn_encode (const char *encoding, const char *host);
 char *idn_decode (const char *host);
+void iri_cleanup (void);
 
 #else /* ENABLE_IRI */
 
 #define idn_encode(a,b)             NULL
 #define idn_decode(str)             NULL
 #define idn2_free(str)              ((void)0)
+#define iri_cleanup()               ((void)0)
 
 #endif /* ENABLE_IRI */
 #endif /* IRI_H */
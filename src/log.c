@@ -37,6 +37,9 @@ as that of the covered work.  */
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 #include "utils.h"
 #include "exits.h"
@@ -71,7 +74,10 @@ as that of the covered work.  */
    request for certain output not to be stored.
 
    - Inhibiting output.  When Wget receives SIGHUP, but redirecting
-   the output fails, logging is inhibited.  */
+   the output fails, logging is inhibited.
+
+   - Capturing output.  A thread other than the main one can have its
+   messages kept in memory, for the main thread to log them later.  */
 
 
 /* The file descriptor used for logging.  This is NULL before log_init
@@ -349,11 +355,325 @@ get_warc_log_fp (void)
   return stderr;
 }
 
-/* Sets the file descriptor for the secondary log file.  */
+/* The messages captured from one thread: each is the byte of its
+   log_options followed by its text and a '\0'.  */
+struct log_capture {
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+/* The capture of the calling thread, if any.  */
+#ifdef HAVE_PTHREAD
+static pthread_key_t capture_key;
+static pthread_once_t capture_key_once = PTHREAD_ONCE_INIT;
+
+static void
+capture_key_init (void)
+{
+  pthread_key_create (&capture_key, NULL);
+}
+
+static struct log_capture *
+current_capture (void)
+{
+  pthread_once (&capture_key_once, capture_key_init);
+  return pthread_getspecific (capture_key);
+}
+
+static void
+set_current_capture (struct log_capture *capture)
+{
+  pthread_once (&capture_key_once, capture_key_init);
+  pthread_setspecific (capture_key, capture);
+}
+#else /* not HAVE_PTHREAD */
+static struct log_capture *thread_capture;
+
+# define current_capture() thread_capture
+# define set_current_capture(c) (thread_capture = (c))
+#endif /* not HAVE_PTHREAD */
+
+/* Keep the messages the calling thread logs from now on, instead of
+   logging them, until log_capture_end is called.  Returns the capture,
+   which is to be passed to log_capture_replay.  */
+
+struct log_capture *
+log_capture_begin (void)
+{
+  struct log_capture *capture = xnew0 (struct log_capture);
+  set_current_capture (capture);
+  return capture;
+}
+
+/* Stop capturing the messages of the calling thread.  */
+
+void
+log_capture_end (void)
+{
+  set_current_capture (NULL);
+}
+
+/* Log the messages in CAPTURE, and free it.  */
+
+void
+log_capture_replay (struct log_capture *capture)
+{
+  size_t pos = 0;
+
+  while (pos < capture->len)
+    {
+      enum log_options o = (enum log_options) capture->data[pos];
+      const char *s = capture->data + pos + 1;
+      logputs (o, s);
+      pos += 1 + strlen (s) + 1;
+    }
+  xfree (capture->data);
+  xfree (capture);
+}
+
+/* If the calling thread's messages are being captured, add S to
+   them and return true.  */
+
+static bool
+capture_message (enum log_options o, const char *s)
+{
+  struct log_capture *capture = current_capture ();
+  size_t len;
+
+  if (!capture)
+    return false;
+
+  len = strlen (s);
+  if (capture->size - capture->len < len + 2)
+    {
+      capture->size = MAX (capture->size * 2, capture->len + len + 2);
+      capture->data = xrealloc (capture->data, capture->size);
+    }
+  capture->data[capture->len++] = (char) o;
+  memcpy (capture->data + capture->len, s, len + 1);
+  capture->len += len + 1;
+  return true;
+}
+
+/* Like capture_message, for a message to be formatted.  */
+
+static bool GCC_FORMAT_ATTR (2, 0)
+capture_vprintf (enum log_options o, const char *fmt, va_list args)
+{
+  char *s;
+
+  if (!current_capture ())
+    return false;
+  if (vasprintf (&s, fmt, args) < 0)
+    return true;
+  capture_message (o, s);
+  free (s);
+  return true;
+}
+
+#ifdef HAVE_PTHREAD
+/* When the log goes to a file opened by log_init, the messages are
+   not written by the thread logging them but by a writer thread: the
+   text is copied to LOG_RING, and the writer writes it to LOGFP (and
+   WARCLOGFP) from there, flushing once whenever it catches up rather
+   than after each message.  logflush waits for the writer to catch
+   up, so the log is complete whenever someone asks for the flush, and
+   before the log is closed or the program exits.  */
+
+#define LOG_RING_SIZE (64 * 1024)
+
+static struct {
+  char data[LOG_RING_SIZE];
+  size_t head;                  /* where the next byte is copied to */
+  size_t tail;                  /* where the writer writes from */
+  size_t used;                  /* bytes between TAIL and HEAD */
+  bool busy;                    /* whether the writer is writing */
+  bool stop;                    /* whether the writer is to exit */
+} log_ring;
+
+static pthread_mutex_t log_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_ring_data = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_ring_space = PTHREAD_COND_INITIALIZER;
+static pthread_t log_writer_thread;
+
+/* Whether LOGFP is written by the writer thread, and whether that
+   thread is running.  */
+static bool async_log_p;
+static bool log_writer_running;
+
+static void *
+log_writer (void *arg _GL_UNUSED)
+{
+  pthread_mutex_lock (&log_ring_lock);
+  for (;;)
+    {
+      const char *start;
+      size_t len;
+      FILE *fp, *warcfp;
+
+      while (!log_ring.used && !log_ring.stop)
+        pthread_cond_wait (&log_ring_data, &log_ring_lock);
+      if (!log_ring.used)
+        break;
+
+      /* Write the contiguous part of the ring without holding the
+         lock; the producers only ever copy to the free part.  */
+      start = log_ring.data + log_ring.tail;
+      len = MIN (log_ring.used, LOG_RING_SIZE - log_ring.tail);
+      fp = logfp;
+      warcfp = warclogfp;
+      log_ring.busy = true;
+      pthread_mutex_unlock (&log_ring_lock);
+
+      fwrite (start, 1, len, fp);
+      if (warcfp != NULL && warcfp != fp)
+        fwrite (start, 1, len, warcfp);
+
+      pthread_mutex_lock (&log_ring_lock);
+      log_ring.tail = (log_ring.tail + len) % LOG_RING_SIZE;
+      log_ring.used -= len;
+      if (!log_ring.used)
+        {
+          /* Caught up: this is the one flush for everything written
+             since the last one.  */
+          pthread_mutex_unlock (&log_ring_lock);
+          fflush (fp);
+          if (warcfp != NULL && warcfp != fp)
+            fflush (warcfp);
+          pthread_mutex_lock (&log_ring_lock);
+        }
+      log_ring.busy = false;
+      pthread_cond_broadcast (&log_ring_space);
+    }
+  pthread_mutex_unlock (&log_ring_lock);
+  return NULL;
+}
+
+/* Wait until the writer thread has written and flushed everything
+   in the ring.  */
+
+static void
+log_ring_drain (void)
+{
+  if (!log_writer_running)
+    return;
+  pthread_mutex_lock (&log_ring_lock);
+  while (log_ring.used || log_ring.busy)
+    pthread_cond_wait (&log_ring_space, &log_ring_lock);
+  pthread_mutex_unlock (&log_ring_lock);
+}
+
+/* Write out what is left and stop the writer thread.  Also called at
+   exit, so that the messages of a fatal error are not lost.  */
+
+static void
+log_writer_stop (void)
+{
+  if (!log_writer_running)
+    return;
+  pthread_mutex_lock (&log_ring_lock);
+  log_ring.stop = true;
+  pthread_cond_signal (&log_ring_data);
+  pthread_mutex_unlock (&log_ring_lock);
+  pthread_join (log_writer_thread, NULL);
+  log_writer_running = false;
+  log_ring.stop = false;
+}
+
+/* Around fork, as done by fork_to_background: the child does not
+   inherit the writer thread, so it gets an empty ring and starts its
+   own writer when it first logs.  */
+
+static void
+log_fork_prepare (void)
+{
+  log_ring_drain ();
+  pthread_mutex_lock (&log_ring_lock);
+}
+
+static void
+log_fork_parent (void)
+{
+  pthread_mutex_unlock (&log_ring_lock);
+}
+
+static void
+log_fork_child (void)
+{
+  log_writer_running = false;
+  log_ring.head = log_ring.tail = log_ring.used = 0;
+  log_ring.busy = log_ring.stop = false;
+  pthread_mutex_unlock (&log_ring_lock);
+}
+
+static bool
+log_writer_start (void)
+{
+  static bool registered;
+
+  if (pthread_create (&log_writer_thread, NULL, log_writer, NULL) != 0)
+    return false;
+  log_writer_running = true;
+  if (!registered)
+    {
+      atexit (log_writer_stop);
+      pthread_atfork (log_fork_prepare, log_fork_parent, log_fork_child);
+      registered = true;
+    }
+  return true;
+}
+
+/* If FP is written by the writer thread, copy S to the ring for it
+   and return true.  Waits for room if the ring is full.  */
+
+static bool
+log_ring_put (FILE *fp, const char *s)
+{
+  size_t len;
+
+  if (!async_log_p || fp != logfp)
+    return false;
+  if (!log_writer_running && !log_writer_start ())
+    {
+      async_log_p = false;
+      return false;
+    }
+
+  len = strlen (s);
+  pthread_mutex_lock (&log_ring_lock);
+  while (len)
+    {
+      size_t n;
+
+      while (log_ring.used == LOG_RING_SIZE)
+        pthread_cond_wait (&log_ring_space, &log_ring_lock);
+      n = MIN (len, LOG_RING_SIZE - log_ring.used);
+      n = MIN (n, LOG_RING_SIZE - log_ring.head);
+      memcpy (log_ring.data + log_ring.head, s, n);
+      log_ring.head = (log_ring.head + n) % LOG_RING_SIZE;
+      log_ring.used += n;
+      s += n;
+      len -= n;
+      pthread_cond_signal (&log_ring_data);
+    }
+  pthread_mutex_unlock (&log_ring_lock);
+  return true;
+}
+#else /* not HAVE_PTHREAD */
+# define async_log_p false
+# define log_ring_put(fp, s) false
+# define log_ring_drain() (void) 0
+# define log_writer_stop() (void) 0
+#endif /* not HAVE_PTHREAD */
+
+/* Sets the file descriptor for the secondary log file.  What was
+   logged so far is written out to the previous one first.  */
 
 void
 log_set_warc_log_fp (FILE * fp)
 {
+  log_ring_drain ();
   warclogfp = fp;
 }
 
@@ -367,6 +687,9 @@ logputs (enum log_options o, const char *s)
   FILE *warcfp;
   int errno_save = errno;
 
+  if (capture_message (o, s))
+    return;
+
   check_redirect_output ();
   if (o == LOG_PROGRESS)
     fp = get_progress_fp ();
@@ -383,6 +706,12 @@ logputs (enum log_options o, const char *s)
 
   CHECK_VERBOSE (o);
 
+  if (log_ring_put (fp, s))
+    {
+      errno = errno_save;
+      return;
+    }
+
   FPUTS (s, fp);
   if (warcfp != NULL)
     FPUTS (s, warcfp);
@@ -430,7 +759,7 @@ log_vprintf_internal (struct logvprintf_state *state, const char *fmt,
   if (fp == NULL)
       return false;
 
-  if (!save_context_p && warcfp == NULL)
+  if (!save_context_p && warcfp == NULL && !async_log_p)
     {
       /* In the simple case just call vfprintf(), to avoid needless
          allocation and games with vsnprintf(). */
@@ -480,6 +809,11 @@ log_vprintf_internal (struct logvprintf_state *state, const char *fmt,
     }
 
   /* Writing succeeded. */
+  if (log_ring_put (fp, write_ptr))
+    {
+      xfree (state->bigmsg);
+      return true;
+    }
   if (save_context_p)
     saved_append (write_ptr);
   FPUTS (write_ptr, fp);
@@ -502,6 +836,8 @@ logflush (void)
 {
   FILE *fp = get_log_fp ();
   FILE *warcfp = get_warc_log_fp ();
+
+  log_ring_drain ();
   if (fp)
     {
 /* 2005-10-25 SMS.
@@ -571,6 +907,15 @@ logprintf (enum log_options o, const char *fmt, ...)
 
   CHECK_VERBOSE (o);
 
+  va_start (args, fmt);
+  done = capture_vprintf (o, fmt, args);
+  va_end (args);
+  if (done)
+    {
+      errno = errno_saved;
+      return;
+    }
+
   check_redirect_output ();
   errno = errno_saved;
   if (inhibit_logging)
@@ -604,6 +949,12 @@ debug_logprintf (const char *fmt, ...)
       struct logvprintf_state lpstate;
       bool done;
 
+      va_start (args, fmt);
+      done = capture_vprintf (LOG_ALWAYS, fmt, args);
+      va_end (args);
+      if (done)
+        return;
+
 #ifndef TESTING
       check_redirect_output ();
 #endif
@@ -643,6 +994,9 @@ log_init (const char *file, bool appendp)
               exit (WGET_EXIT_GENERIC_ERROR);
             }
           logfp = filelogfp;
+#ifdef HAVE_PTHREAD
+          async_log_p = true;
+#endif
         }
     }
   else
@@ -683,6 +1037,11 @@ log_close (void)
 {
   int i;
 
+  log_writer_stop ();
+#ifdef HAVE_PTHREAD
+  async_log_p = false;
+#endif
+
   if (logfp && logfp != stderr && logfp != stdout)
     {
       if (logfp == stdlogfp)
@@ -48,6 +48,11 @@ void logflush (void);
 void log_set_flush (bool);
 bool log_set_save_context (bool);
 
+struct log_capture;
+struct log_capture *log_capture_begin (void);
+void log_capture_end (void);
+void log_capture_replay (struct log_capture *);
+
 void log_init (const char *, bool);
 void log_close (void);
 void log_cleanup (void);
@@ -54,8 +54,13 @@ as that of the covered work.  */
 #include "spider.h"
 #include "http.h"               /* for save_cookies */
 #include "hsts.h"               /* for initializing hsts_store to NULL */
+#ifdef HAVE_HTTP3
+# include "altsvc.h"             /* for altsvc_save */
+#endif
 #include "ptimer.h"
 #include "warc.h"
+#include "validators.h"         /* for validators_open */
+#include "status.h"
 #include "version.h"
 #include "c-strcase.h"
 #include "dirname.h"
@@ -137,6 +142,19 @@ redirect_output_signal (int sig)
 }
 #endif /* defined(SIGHUP) || defined(SIGUSR1) */
 
+#ifdef SIGUSR1
+/* SIGUSR1 handler.  It redirects the output like SIGHUP, and asks for
+   a status report to be printed there.  */
+
+static void
+status_signal (int sig)
+{
+  redirect_output_signal (sig);
+  status_request ();
+  signal (sig, status_signal);
+}
+#endif /* SIGUSR1 */
+
 static void
 i18n_initialize (void)
 {
@@ -271,6 +289,9 @@ static struct cmdline_option option_data[] =
     { "accept", 'A', OPT_VALUE, "accept", -1 },
     { "accept-regex", 0, OPT_VALUE, "acceptregex", -1 },
     { "adjust-extension", 'E', OPT_BOOLEAN, "adjustextension", -1 },
+#ifdef HAVE_HTTP3
+    { "altsvc-file", 0, OPT_VALUE, "altsvcfile", -1 },
+#endif
     { "append-output", 'a', OPT__APPEND_OUTPUT, NULL, required_argument },
     { "ask-password", 0, OPT_BOOLEAN, "askpassword", -1 },
     { "auth-no-challenge", 0, OPT_BOOLEAN, "authnochallenge", -1 },
@@ -278,6 +299,7 @@ static struct cmdline_option option_data[] =
     { "backup-converted", 'K', OPT_BOOLEAN, "backupconverted", -1 },
     { "backups", 0, OPT_BOOLEAN, "backups", -1 },
     { "base", 'B', OPT_VALUE, "base", -1 },
+    { "batch", 0, OPT_VALUE, "batch", -1 },
     { "bind-address", 0, OPT_VALUE, "bindaddress", -1 },
 #ifdef HAVE_LIBCARES
     { "bind-dns-address", 0, OPT_VALUE, "binddnsaddress", -1 },
@@ -286,12 +308,15 @@ static struct cmdline_option option_data[] =
     { "body-file", 0, OPT_VALUE, "bodyfile", -1 },
     IF_SSL ( "ca-certificate", 0, OPT_VALUE, "cacertificate", -1 )
     IF_SSL ( "ca-directory", 0, OPT_VALUE, "cadirectory", -1 )
+    IF_SSL ( "ca-store-lookup", 0, OPT_BOOLEAN, "castorelookup", -1 )
     { "cache", 0, OPT_BOOLEAN, "cache", -1 },
     IF_SSL ( "certificate", 0, OPT_VALUE, "certificate", -1 )
     IF_SSL ( "certificate-type", 0, OPT_VALUE, "certificatetype", -1 )
     IF_SSL ( "check-certificate", 0, OPT_BOOLEAN, "checkcertificate", -1 )
     { "clobber", 0, OPT__CLOBBER, NULL, optional_argument },
-#ifdef HAVE_LIBZ
+    { "cluster", 0, OPT_VALUE, "cluster", -1 },
+    { "cluster-node", 0, OPT_VALUE, "clusternode", -1 },
+#ifdef HAVE_COMPRESSION
     { "compression", 0, OPT_VALUE, "compression", -1 },
 #endif
     { "config", 0, OPT_VALUE, "chooseconfig", -1 },
@@ -299,17 +324,25 @@ static struct cmdline_option option_data[] =
     { "continue", 'c', OPT_BOOLEAN, "continue", -1 },
     { "convert-file-only", 0, OPT_BOOLEAN, "convertfileonly", -1 },
     { "convert-links", 'k', OPT_BOOLEAN, "convertlinks", -1 },
+    { "convert-threads", 0, OPT_VALUE, "convertthreads", -1 },
     { "content-disposition", 0, OPT_BOOLEAN, "contentdisposition", -1 },
+    { "crawl-order", 0, OPT_VALUE, "crawlorder", -1 },
+    { "crawl-state", 0, OPT_VALUE, "crawlstate", -1 },
     { "content-on-error", 0, OPT_BOOLEAN, "contentonerror", -1 },
     { "cookies", 0, OPT_BOOLEAN, "cookies", -1 },
+    { "cookies-index", 0, OPT_BOOLEAN, "cookiesindex", -1 },
     IF_SSL ( "crl-file", 0, OPT_VALUE, "crlfile", -1 )
     { "cut-dirs", 0, OPT_VALUE, "cutdirs", -1 },
     { "debug", 'd', OPT_BOOLEAN, "debug", -1 },
+    { "dedup-files", 0, OPT_BOOLEAN, "dedupfiles", -1 },
     { "default-page", 0, OPT_VALUE, "defaultpage", -1 },
     { "delete-after", 0, OPT_BOOLEAN, "deleteafter", -1 },
     { "directories", 0, OPT_BOOLEAN, "dirstruct", -1 },
     { "directory-prefix", 'P', OPT_VALUE, "dirprefix", -1 },
     { "dns-cache", 0, OPT_BOOLEAN, "dnscache", -1 },
+    { "dns-cache-file", 0, OPT_VALUE, "dnscachefile", -1 },
+    { "dns-cache-ttl", 0, OPT_VALUE, "dnscachettl", -1 },
+    { "dns-prefetch", 0, OPT_BOOLEAN, "dnsprefetch", -1 },
 #ifdef HAVE_LIBCARES
     { "dns-servers", 0, OPT_VALUE, "dnsservers", -1 },
 #endif
@@ -321,11 +354,14 @@ static struct cmdline_option option_data[] =
     { "exclude-directories", 'X', OPT_VALUE, "excludedirectories", -1 },
     { "exclude-domains", 0, OPT_VALUE, "excludedomains", -1 },
     { "execute", 'e', OPT__EXECUTE, NULL, required_argument },
+    { "flush-interval", 0, OPT_VALUE, "flushinterval", -1 },
     { "follow-ftp", 0, OPT_BOOLEAN, "followftp", -1 },
     { "follow-tags", 0, OPT_VALUE, "followtags", -1 },
     { "force-directories", 'x', OPT_BOOLEAN, "dirstruct", -1 },
     { "force-html", 'F', OPT_BOOLEAN, "forcehtml", -1 },
+    { "ftp-connections", 0, OPT_VALUE, "ftpconnections", -1 },
     { "ftp-password", 0, OPT_VALUE, "ftppassword", -1 },
+    { "ftp-pipelining", 0, OPT_BOOLEAN, "ftppipelining", -1 },
 #ifdef __VMS
     { "ftp-stmlf", 0, OPT_BOOLEAN, "ftpstmlf", -1 },
 #endif /* def __VMS */
@@ -344,6 +380,13 @@ static struct cmdline_option option_data[] =
 #endif
     { "html-extension", 'E', OPT_BOOLEAN, "adjustextension", -1 }, /* deprecated */
     { "htmlify", 0, OPT_BOOLEAN, "htmlify", -1 },
+#ifdef HAVE_NGHTTP2
+    { "http2", 0, OPT_BOOLEAN, "http2", -1 },
+#endif
+#ifdef HAVE_HTTP3
+    { "http3", 0, OPT_BOOLEAN, "http3", -1 },
+#endif
+    { "http-cache", 0, OPT_VALUE, "httpcache", -1 },
     { "http-keep-alive", 0, OPT_BOOLEAN, "httpkeepalive", -1 },
     { "http-passwd", 0, OPT_VALUE, "httppassword", -1 }, /* deprecated */
     { "http-password", 0, OPT_VALUE, "httppassword", -1 },
@@ -360,12 +403,18 @@ static struct cmdline_option option_data[] =
     { "input-file", 'i', OPT_VALUE, "input", -1 },
 #ifdef HAVE_METALINK
     { "input-metalink", 0, OPT_VALUE, "inputmetalink", -1 },
+#endif
+    { "input-unique", 0, OPT_BOOLEAN, "inputunique", -1 },
+#ifdef HAVE_LIBURING
+    { "io-uring", 0, OPT_BOOLEAN, "iouring", -1 },
 #endif
     { "iri", 0, OPT_BOOLEAN, "iri", -1 },
     { "keep-badhash", 0, OPT_BOOLEAN, "keepbadhash", -1 },
     { "keep-session-cookies", 0, OPT_BOOLEAN, "keepsessioncookies", -1 },
+    IF_SSL ( "ktls", 0, OPT_BOOLEAN, "ktls", -1 )
     { "level", 'l', OPT_VALUE, "reclevel", -1 },
     { "limit-rate", 0, OPT_VALUE, "limitrate", -1 },
+    { "limit-rate-per-host", 0, OPT_VALUE, "limitrateperhost", -1 },
     { "load-cookies", 0, OPT_VALUE, "loadcookies", -1 },
     { "local-encoding", 0, OPT_VALUE, "localencoding", -1 },
     { "rejected-log", 0, OPT_VALUE, "rejectedlog", -1 },
@@ -375,6 +424,7 @@ static struct cmdline_option option_data[] =
     { "metalink-over-http", 0, OPT_BOOLEAN, "metalinkoverhttp", -1 },
 #endif
     { "method", 0, OPT_VALUE, "method", -1 },
+    { "metrics-file", 0, OPT_VALUE, "metricsfile", -1 },
     { "mirror", 'm', OPT_BOOLEAN, "mirror", -1 },
     { "netrc", 0, OPT_BOOLEAN, "netrc", -1 },
     { "no", 'n', OPT__NO, NULL, required_argument },
@@ -388,8 +438,11 @@ static struct cmdline_option option_data[] =
     { "passive-ftp", 0, OPT_BOOLEAN, "passiveftp", -1 },
     { "password", 0, OPT_VALUE, "password", -1 },
     IF_SSL ( "pinnedpubkey", 0, OPT_VALUE, "pinnedpubkey", -1 )
+    { "pipeline", 0, OPT_VALUE, "pipeline", -1 },
     { "post-data", 0, OPT_VALUE, "postdata", -1 },
     { "post-file", 0, OPT_VALUE, "postfile", -1 },
+    { "preallocate", 0, OPT_BOOLEAN, "preallocate", -1 },
+    { "preconnect", 0, OPT_VALUE, "preconnect", -1 },
     { "prefer-family", 0, OPT_VALUE, "preferfamily", -1 },
 #ifdef HAVE_METALINK
     { "preferred-location", 0, OPT_VALUE, "preferredlocation", -1 },
@@ -421,6 +474,7 @@ static struct cmdline_option option_data[] =
     { "remove-listing", 0, OPT_BOOLEAN, "removelisting", -1 },
     { "report-speed", 0, OPT_BOOLEAN, "reportspeed", -1 },
     { "restrict-file-names", 0, OPT_BOOLEAN, "restrictfilenames", -1 },
+    { "resume-crawl", 0, OPT_BOOLEAN, "resumecrawl", -1 },
     { "retr-symlinks", 0, OPT_BOOLEAN, "retrsymlinks", -1 },
     { "retry-connrefused", 0, OPT_BOOLEAN, "retryconnrefused", -1 },
     { "retry-on-host-error", 0, OPT_BOOLEAN, "retryonhosterror", -1 },
@@ -428,11 +482,20 @@ static struct cmdline_option option_data[] =
     { "save-cookies", 0, OPT_VALUE, "savecookies", -1 },
     { "save-headers", 0, OPT_BOOLEAN, "saveheaders", -1 },
     IF_SSL ( "secure-protocol", 0, OPT_VALUE, "secureprotocol", -1 )
+    { "segments", 0, OPT_VALUE, "segments", -1 },
     { "server-response", 'S', OPT_BOOLEAN, "serverresponse", -1 },
     { "span-hosts", 'H', OPT_BOOLEAN, "spanhosts", -1 },
     { "spider", 0, OPT_BOOLEAN, "spider", -1 },
+    { "spider-connections", 0, OPT_VALUE, "spiderconnections", -1 },
     { "start-pos", 0, OPT_VALUE, "startpos", -1 },
+    { "stats", 0, OPT_BOOLEAN, "stats", -1 },
+    { "status-file", 0, OPT_VALUE, "statusfile", -1 },
     { "strict-comments", 0, OPT_BOOLEAN, "strictcomments", -1 },
+    { "tcp-congestion", 0, OPT_VALUE, "tcpcongestion", -1 },
+    { "tcp-fastopen", 0, OPT_BOOLEAN, "tcpfastopen", -1 },
+    { "tcp-nodelay", 0, OPT_BOOLEAN, "tcpnodelay", -1 },
+    { "tcp-rcvbuf", 0, OPT_VALUE, "tcprcvbuf", -1 },
+    { "tcp-sndbuf", 0, OPT_VALUE, "tcpsndbuf", -1 },
     { "timeout", 'T', OPT_VALUE, "timeout", -1 },
     { "timestamping", 'N', OPT_BOOLEAN, "timestamping", -1 },
     { "if-modified-since", 0, OPT_BOOLEAN, "ifmodifiedsince", -1 },
@@ -445,27 +508,36 @@ static struct cmdline_option option_data[] =
     { "use-server-timestamps", 0, OPT_BOOLEAN, "useservertimestamps", -1 },
     { "user", 0, OPT_VALUE, "user", -1 },
     { "user-agent", 'U', OPT_VALUE, "useragent", -1 },
+    { "validators-file", 0, OPT_VALUE, "validatorsfile", -1 },
     { "verbose", 'v', OPT_BOOLEAN, "verbose", -1 },
     { "version", 'V', OPT_FUNCALL, (void *) print_version, no_argument },
     { "wait", 'w', OPT_VALUE, "wait", -1 },
     { "waitretry", 0, OPT_VALUE, "waitretry", -1 },
     { "warc-cdx", 0, OPT_BOOLEAN, "warccdx", -1 },
-#ifdef HAVE_LIBZ
+#if defined HAVE_LIBZ || defined HAVE_LIBZSTD
     { "warc-compression", 0, OPT_BOOLEAN, "warccompression", -1 },
+#endif
+#ifdef HAVE_LIBZ
+    { "warc-compression-threads", 0, OPT_VALUE, "warccompressionthreads", -1 },
 #endif
     { "warc-dedup", 0, OPT_VALUE, "warccdxdedup", -1 },
+    { "warc-dedup-crawl", 0, OPT_BOOLEAN, "warcdedupcrawl", -1 },
     { "warc-digests", 0, OPT_BOOLEAN, "warcdigests", -1 },
     { "warc-file", 0, OPT_VALUE, "warcfile", -1 },
     { "warc-header", 0, OPT_VALUE, "warcheader", -1 },
     { "warc-keep-log", 0, OPT_BOOLEAN, "warckeeplog", -1 },
     { "warc-max-size", 0, OPT_VALUE, "warcmaxsize", -1 },
     { "warc-tempdir", 0, OPT_VALUE, "warctempdir", -1 },
+#ifdef HAVE_LIBZSTD
+    { "warc-zstd-dictionary", 0, OPT_VALUE, "warczstddictionary", -1 },
+#endif
 #ifdef USE_WATT32
     { "wdebug", 0, OPT_BOOLEAN, "wdebug", -1 },
 #endif
 #ifdef ENABLE_XATTR
     { "xattr", 0, OPT_BOOLEAN, "xattr", -1 },
 #endif
+    { "zsync", 0, OPT_BOOLEAN, "zsync", -1 },
   };
 
 #undef IF_SSL
@@ -495,7 +567,7 @@ static struct option long_options[2 * countof (option_data) + 1];
 static char short_options[128];
 
 /* Mapping between short option chars and option_data indices. */
-static unsigned char optmap[96];
+static unsigned short optmap[96];
 
 /* Marker for `--no-FOO' values in long_options.  */
 #define BOOLEAN_NEG_MARKER 1024
@@ -614,6 +686,13 @@ Logging and input file:\n"),
 #ifdef ENABLE_DEBUG
     N_("\
   -d,  --debug                     print lots of debugging information\n"),
+#endif
+    N_("\
+       --debug=startup             print the time spent in each startup phase\n"),
+#ifdef ENABLE_STATS
+    N_("\
+       --stats                     print counts and timings of hot operations\n\
+                                     at exit\n"),
 #endif
 #ifdef USE_WATT32
     N_("\
@@ -633,6 +712,12 @@ Logging and input file:\n"),
     N_("\
        --input-metalink=FILE       download files covered in local Metalink FILE\n"),
 #endif
+    N_("\
+       --input-unique              skip the URLs that came up before in the\n\
+                                     input file\n"),
+    N_("\
+       --batch=FILE                run the download jobs read from FILE, one per\n\
+                                     line, as they arrive\n"),
     N_("\
   -F,  --force-html                treat input file as HTML\n"),
     N_("\
@@ -644,6 +729,11 @@ Logging and input file:\n"),
        --no-config                 do not read any config file\n"),
     N_("\
        --rejected-log=FILE         log reasons for URL rejection to FILE\n"),
+    N_("\
+       --metrics-file=FILE         append timings of every transfer to FILE\n\
+                                     as JSON lines\n"),
+    N_("\
+       --status-file=FILE          keep a report of the progress made in FILE\n"),
     "\n",
 
     N_("\
@@ -677,6 +767,12 @@ Download:\n"),
     N_("\
        --no-if-modified-since      don't use conditional if-modified-since get\n\
                                      requests in timestamping mode\n"),
+    N_("\
+       --validators-file=FILE      keep the ETags and modification times of\n\
+                                     the files in FILE for timestamping\n"),
+    N_("\
+       --zsync                     with -N, fetch only the changed blocks of\n\
+                                     files that have a .zsync control file\n"),
     N_("\
        --no-use-server-timestamps  don't set the local file's timestamp by\n\
                                      the one on the server\n"),
@@ -684,6 +780,9 @@ Download:\n"),
   -S,  --server-response           print server response\n"),
     N_("\
        --spider                    don't download anything\n"),
+    N_("\
+       --spider-connections=N      check the links a recursive spider doesn't\n\
+                                     follow over up to N connections at once\n"),
     N_("\
   -T,  --timeout=SECONDS           set all timeout values to SECONDS\n"),
 #ifdef HAVE_LIBCARES
@@ -713,10 +812,42 @@ Download:\n"),
   -Q,  --quota=NUMBER              set retrieval quota to NUMBER\n"),
     N_("\
        --bind-address=ADDRESS      bind to ADDRESS (hostname or IP) on local host\n"),
+    N_("\
+       --tcp-rcvbuf=SIZE           set the socket receive buffer to SIZE\n"),
+    N_("\
+       --tcp-sndbuf=SIZE           set the socket send buffer to SIZE\n"),
+    N_("\
+       --no-tcp-nodelay            let small writes wait (Nagle's algorithm)\n"),
+    N_("\
+       --tcp-fastopen              use TCP Fast Open with known servers\n"),
+    N_("\
+       --tcp-congestion=NAME       use the TCP congestion control NAME\n"),
     N_("\
        --limit-rate=RATE           limit download rate to RATE\n"),
+    N_("\
+       --limit-rate-per-host=RATE  limit download rate from each host to RATE\n"),
+    N_("\
+       --segments=N                download large files over N connections\n\
+                                     using byte ranges\n"),
+    N_("\
+       --flush-interval=SECS       flush downloaded data to disk every SECS\n\
+                                     seconds (0 flushes after every read)\n"),
+    N_("\
+       --preallocate               reserve disk space for files of known size\n"),
+#ifdef HAVE_LIBURING
+    N_("\
+       --io-uring                  receive plain HTTP bodies through io_uring\n"),
+#endif
     N_("\
        --no-dns-cache              disable caching DNS lookups\n"),
+    N_("\
+       --dns-cache-ttl=SECS        cache DNS lookups for SECS seconds unless the\n\
+                                     resolver gives their TTL (0 for no limit)\n"),
+    N_("\
+       --dns-cache-file=FILE       keep the DNS cache in FILE between runs\n"),
+    N_("\
+       --no-dns-prefetch           don't resolve the hosts of links found while\n\
+                                     recursing ahead of time\n"),
     N_("\
        --restrict-file-names=OS    restrict chars in file names to ones OS allows\n"),
     N_("\
@@ -751,6 +882,9 @@ Download:\n"),
        --remote-encoding=ENC       use ENC as the default remote url encoding\n"),
     N_("\
        --unlink                    remove file before clobber\n"),
+    N_("\
+       --dedup-files               hard-link the files retrieved with the same\n\
+                                     contents to each other\n"),
 #ifdef HAVE_METALINK
     N_("\
        --keep-badhash              keep files with checksum mismatch (append .badhash)\n"),
@@ -791,6 +925,9 @@ HTTP options:\n"),
        --http-password=PASS        set http password to PASS\n"),
     N_("\
        --no-cache                  disallow server-cached data\n"),
+    N_("\
+       --http-cache=DIR            keep the responses in DIR, for the next\n\
+                                     runs to use as long as they hold\n"),
     N_ ("\
        --default-page=NAME         change the default page name (normally\n\
                                      this is 'index.html'.)\n"),
@@ -800,9 +937,10 @@ HTTP options:\n"),
        --ignore-length             ignore 'Content-Length' header field\n"),
     N_("\
        --header=STRING             insert STRING among the headers\n"),
-#ifdef HAVE_LIBZ
+#ifdef HAVE_COMPRESSION
     N_("\
-       --compression=TYPE          choose compression, one of auto, gzip and none. (default: none)\n"),
+       --compression=TYPE          choose compression, one of auto, gzip,\n\
+                                     br, zstd and none. (default: none)\n"),
 #endif
     N_("\
        --max-redirect              maximum redirections allowed per page\n"),
@@ -818,6 +956,16 @@ HTTP options:\n"),
   -U,  --user-agent=AGENT          identify as AGENT instead of Wget/VERSION\n"),
     N_("\
        --no-http-keep-alive        disable HTTP keep-alive (persistent connections)\n"),
+#ifdef HAVE_NGHTTP2
+    N_("\
+       --no-http2                  don't offer HTTP/2 to HTTPS servers\n"),
+#endif
+#ifdef HAVE_HTTP3
+    N_("\
+       --http3                     use HTTP/3 where HTTPS servers announce it\n"),
+    N_("\
+       --altsvc-file               path of the HTTP/3 alternatives database\n"),
+#endif
     N_("\
        --no-cookies                don't use cookies\n"),
     N_("\
@@ -826,6 +974,8 @@ HTTP options:\n"),
        --save-cookies=FILE         save cookies to FILE after session\n"),
     N_("\
        --keep-session-cookies      load and save session (non-permanent) cookies\n"),
+    N_("\
+       --cookies-index             load cookies through an index, FILE.idx\n"),
     N_("\
        --post-data=STRING          use the POST method; send STRING as the data\n"),
     N_("\
@@ -869,6 +1019,9 @@ HTTPS (SSL/TLS) options:\n"),
        --ca-certificate=FILE       file with the bundle of CAs\n"),
     N_("\
        --ca-directory=DIR          directory where hash list of CAs is stored\n"),
+    N_("\
+       --ca-store-lookup           look up CAs in the Windows ROOT store as\n\
+                                   needed instead of loading all of them\n"),
     N_("\
        --crl-file=FILE             file with bundle of CRLs\n"),
     N_("\
@@ -876,6 +1029,8 @@ HTTPS (SSL/TLS) options:\n"),
                                    of base64 encoded sha256 hashes preceded by\n\
                                    \'sha256//\' and separated by \';\', to verify\n\
                                    peer against\n"),
+    N_("\
+       --ktls                      let the kernel decrypt TLS (OpenSSL on Linux)\n"),
 #if defined(HAVE_LIBSSL) || defined(HAVE_LIBSSL32)
     N_("\
        --random-file=FILE          file with random data for seeding the SSL PRNG\n"),
@@ -913,6 +1068,10 @@ FTP options:\n"),
        --ftp-password=PASS         set ftp password to PASS\n"),
     N_("\
        --no-remove-listing         don't remove '.listing' files\n"),
+    N_("\
+       --ftp-connections=N         use up to N control connections when recursing\n"),
+    N_("\
+       --ftp-pipelining            send the FTP setup commands without waiting\n"),
     N_("\
        --no-glob                   turn off FTP file name globbing\n"),
     N_("\
@@ -949,9 +1108,24 @@ WARC options:\n"),
        --warc-cdx                  write CDX index files\n"),
     N_("\
        --warc-dedup=FILENAME       do not store records listed in this CDX file\n"),
-#ifdef HAVE_LIBZ
+    N_("\
+       --warc-dedup-crawl          store payloads seen earlier in the crawl as\n\
+                                     revisit records\n"),
+#if defined HAVE_LIBZ || defined HAVE_LIBZSTD
     N_("\
        --no-warc-compression       do not compress WARC files with GZIP\n"),
+#endif
+#ifdef HAVE_LIBZSTD
+    N_("\
+       --warc-compression=zstd     compress WARC files with zstd (.warc.zst)\n"),
+    N_("\
+       --warc-zstd-dictionary=FILE  use the zstd dictionary in FILE instead\n\
+                                     of training one\n"),
+#endif
+#ifdef HAVE_LIBZ
+    N_("\
+       --warc-compression-threads=N    compress WARC records in N threads\n\
+                                     (default: one per processor)\n"),
 #endif
     N_("\
        --no-warc-digests           do not calculate SHA1 digests\n"),
@@ -975,6 +1149,9 @@ Recursive download:\n"),
                                      local files\n"),
     N_("\
        --convert-file-only         convert the file part of the URLs only (usually known as the basename)\n"),
+    N_("\
+       --convert-threads=NUMBER    convert links in NUMBER threads (default: one\n\
+                                     per processor)\n"),
     N_("\
        --backups=N                 before writing file X, rotate up to N backup files\n"),
 
@@ -991,6 +1168,24 @@ Recursive download:\n"),
   -p,  --page-requisites           get all images, etc. needed to display HTML page\n"),
     N_("\
        --strict-comments           turn on strict (SGML) handling of HTML comments\n"),
+    N_("\
+       --preconnect=N              connect to the hosts of up to N queued URLs\n\
+                                     ahead of time\n"),
+    N_("\
+       --pipeline=N                send up to N queued requests to the same\n\
+                                     host ahead of time\n"),
+    N_("\
+       --crawl-order=ORDER         retrieve queued URLs in ORDER: breadth,\n\
+                                     documents or pages\n"),
+    N_("\
+       --crawl-state=FILE          save the state of the recursion to FILE\n"),
+    N_("\
+       --resume-crawl              resume the recursion saved by --crawl-state\n"),
+    N_("\
+       --cluster=NODES             share the recursion with the comma-separated\n\
+                                     HOST:PORT list of nodes\n"),
+    N_("\
+       --cluster-node=N            be node N of the --cluster list, from 0\n"),
     "\n",
 
     N_("\
@@ -1361,6 +1556,43 @@ const char *program_argstring; /* Needed by wget_warc.c. */
 struct ptimer *timer;
 int cleaned_up;
 
+/* The phases of the startup, and the time each of them ended, for
+   --debug=startup.  They are recorded before the options are known,
+   and printed once logging is set up.  */
+static struct {
+  const char *name;
+  double end_time;
+} startup_phases[16];
+static int startup_phase_count;
+
+static void
+startup_phase_done (const char *name)
+{
+  if (startup_phase_count < countof (startup_phases))
+    {
+      startup_phases[startup_phase_count].name = name;
+      startup_phases[startup_phase_count].end_time = ptimer_measure (timer);
+      ++startup_phase_count;
+    }
+}
+
+static void
+print_startup_phases (double start_time)
+{
+  double last = start_time;
+  int i;
+
+  for (i = 0; i < startup_phase_count; i++)
+    {
+      logprintf (LOG_ALWAYS, "startup: %-10s %8.3f ms\n",
+                 startup_phases[i].name,
+                 (startup_phases[i].end_time - last) * 1000);
+      last = startup_phases[i].end_time;
+    }
+  logprintf (LOG_ALWAYS, "startup: %-10s %8.3f ms\n", "total",
+             (last - start_time) * 1000);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -1381,6 +1613,7 @@ main (int argc, char **argv)
   program_name = argv[0];
 
   i18n_initialize ();
+  startup_phase_done ("locale");
 
   /* Construct the name of the executable, without the directory part.  */
 #ifdef __VMS
@@ -1463,6 +1696,7 @@ main (int argc, char **argv)
   if (noconfig == false && use_userconfig == false)
     if ((ret = initialize ()))
       return ret;
+  startup_phase_done ("wgetrc");
 
   opterr = 0;
   optind = 0;
@@ -1583,9 +1817,11 @@ main (int argc, char **argv)
     }
 
   nurls = argc - optind;
+  startup_phase_done ("options");
 
   /* Initialize logging ASAP.  */
   log_init (opt.lfilename, append_to_log);
+  startup_phase_done ("log");
 
   /* If we do not have Debug support compiled in AND Wget is invoked with the
    * --debug switch, instead of failing, we silently turn it into a no-op. For
@@ -1600,6 +1836,14 @@ main (int argc, char **argv)
       opt.debug = false;
     }
 #endif
+#ifndef ENABLE_STATS
+  if (opt.stats)
+    {
+      fprintf (stderr, _("Statistics support not compiled in. "
+                         "Ignoring --stats flag.\n"));
+      opt.stats = false;
+    }
+#endif
 
   /* All user options have now been processed, so it's now safe to do
      interoption dependency checks. */
@@ -1621,6 +1865,11 @@ main (int argc, char **argv)
   if (opt.spider || opt.delete_after)
       opt.no_dirstruct = true;
 
+  /* A file linked to another is to be replaced, not written over, when
+     it is retrieved again.  */
+  if (opt.dedup_files)
+    opt.unlink_requested = true;
+
   if (opt.page_requisites && !opt.recursive)
     {
       /* Don't set opt.recursive here because it would confuse the FTP
@@ -1654,6 +1903,25 @@ Can't timestamp and not clobber old files at the same time.\n"));
       print_usage (1);
       exit (WGET_EXIT_GENERIC_ERROR);
     }
+  if (opt.resume_crawl && !opt.crawl_state)
+    {
+      fprintf (stderr, _("--resume-crawl requires --crawl-state.\n"));
+      print_usage (1);
+      exit (WGET_EXIT_GENERIC_ERROR);
+    }
+  if (opt.cluster)
+    {
+      int count = 0;
+      while (opt.cluster[count])
+        count++;
+      if (opt.cluster_node < 0 || opt.cluster_node >= count)
+        {
+          fprintf (stderr, _("--cluster-node must be between 0 and %d.\n"),
+                   count - 1);
+          print_usage (1);
+          exit (WGET_EXIT_GENERIC_ERROR);
+        }
+    }
 #ifdef ENABLE_IPV6
   if (opt.ipv4_only && opt.ipv6_only)
     {
@@ -1740,7 +2008,7 @@ for details.\n\n"));
         }
     }
 
-#ifdef HAVE_LIBZ
+#ifdef HAVE_COMPRESSION
   if (opt.always_rest || opt.start_pos >= 0)
     {
       if (opt.compression == compression_auto)
@@ -1782,7 +2050,7 @@ for details.\n\n"));
       opt.always_rest = false;
     }
 
-  if (!nurls && !opt.input_filename
+  if (!nurls && !opt.input_filename && !opt.batch_filename
 #ifdef HAVE_METALINK
       && !opt.input_metalink
 #endif
@@ -1912,6 +2180,7 @@ for details.\n\n"));
       exit (WGET_EXIT_GENERIC_ERROR);
     }
 #endif
+  startup_phase_done ("iri");
 
   if (opt.ask_passwd)
     {
@@ -2018,6 +2287,12 @@ outputting to a regular file.\n"));
 only if outputting to a regular file.\n"));
           exit (WGET_EXIT_GENERIC_ERROR);
         }
+      if (output_stream == stdout && opt.batch_filename)
+        {
+          fprintf (stderr, _("--batch reports the jobs on the standard output, \
+so it cannot be used with -O -.\n"));
+          exit (WGET_EXIT_GENERIC_ERROR);
+        }
     }
 
 #ifdef HAVE_LIBCARES
@@ -2084,6 +2359,7 @@ only if outputting to a regular file.\n"));
 
 #ifdef WINDOWS
   ws_startup ();
+  startup_phase_done ("winsock");
 #endif
 
 #ifdef SIGHUP
@@ -2092,9 +2368,11 @@ only if outputting to a regular file.\n"));
   if (signal(SIGHUP, SIG_IGN) != SIG_IGN)
     signal(SIGHUP, redirect_output_signal);
 #endif
-  /* ...and do the same for SIGUSR1.  */
+  /* ...and do the same for SIGUSR1, which also asks for a status
+     report.  */
+  status_init ();
 #ifdef SIGUSR1
-  signal (SIGUSR1, redirect_output_signal);
+  signal (SIGUSR1, status_signal);
 #endif
 #ifdef SIGPIPE
   /* Writing to a closed socket normally signals SIGPIPE, and the
@@ -2105,6 +2383,7 @@ only if outputting to a regular file.\n"));
 #ifdef SIGWINCH
   signal (SIGWINCH, progress_handle_sigwinch);
 #endif
+  startup_phase_done ("setup");
 
 #ifdef HAVE_HSTS
   /* Load the HSTS database.
@@ -2114,8 +2393,19 @@ only if outputting to a regular file.\n"));
    */
   if (opt.hsts)
     load_hsts ();
+  startup_phase_done ("hsts");
 #endif
 
+  if (opt.dns_cache && opt.dns_cache_file)
+    dns_cache_load (opt.dns_cache_file);
+  startup_phase_done ("dns-cache");
+
+  if (opt.timestamping && opt.validators_file)
+    validators_open (opt.validators_file);
+
+  if (opt.debug_startup)
+    print_startup_phases (start_time);
+
   /* Retrieve the URLs from argument list.  */
   for (i = 0; i < nurls; i++, optind++)
     {
@@ -2200,6 +2490,10 @@ only if outputting to a regular file.\n"));
                    opt.input_filename);
     }
 
+  /* And then the batch jobs, if any.  */
+  if (opt.batch_filename)
+    inform_exit_status (retrieve_from_batch (opt.batch_filename));
+
 #ifdef HAVE_METALINK
   /* Finally, from metlink file, if any.  */
   if (opt.input_metalink)
@@ -2294,6 +2588,13 @@ only if outputting to a regular file.\n"));
   if (opt.hsts && hsts_store)
     save_hsts ();
 #endif
+#ifdef HAVE_HTTP3
+  if (opt.http3)
+    altsvc_save ();
+#endif
+
+  if (opt.dns_cache && opt.dns_cache_file)
+    dns_cache_save (opt.dns_cache_file);
 
   if ((opt.convert_links || opt.convert_file_only) && !opt.delete_after)
     convert_all_links ();
@@ -0,0 +1,400 @@
+/* Accounting of the memory allocated by the subsystems of Wget.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#include "wget.h"
+
+#ifdef ENABLE_MEMACCT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include "memacct.h"
+#include "utils.h"
+
+/* The wrappers below call the functions they stand for.  */
+#undef xmalloc
+#undef xcalloc
+#undef xrealloc
+#undef xstrdup
+#undef xstrndup
+#undef xmemdup
+#undef xmemdup0
+
+#include "xstrndup.h"
+#include "xmemdup0.h"
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+
+/* Every block allocated by one of the wrappers is kept in a table, an
+   open-addressed hash table keyed by its address, with its size and
+   the subsystem it is charged to: the one of the innermost
+   MEMACCT_ENTER under way when it was allocated.  Blocks freed with
+   free rather than xfree stay in the table until their address is
+   allocated again.  The helper threads share the subsystem of the main
+   thread, which is about as good a guess as any.  */
+
+enum memacct_tag memacct_current;
+
+struct memacct_block {
+  void *ptr;                    /* NULL for a free slot */
+  size_t size;
+  enum memacct_tag tag;
+};
+
+static struct memacct_block *blocks;
+static size_t blocks_size, blocks_count;
+
+struct memacct_counter {
+  wgint live;                   /* bytes allocated and not freed */
+  wgint peak;                   /* the most LIVE has been */
+  wgint allocs;                 /* blocks allocated */
+};
+
+static struct memacct_counter counters[MEMACCT_TAGS];
+static struct memacct_counter total;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t memacct_lock = PTHREAD_MUTEX_INITIALIZER;
+# define MEMACCT_LOCK() pthread_mutex_lock (&memacct_lock)
+# define MEMACCT_UNLOCK() pthread_mutex_unlock (&memacct_lock)
+#else
+# define MEMACCT_LOCK() do { } while (0)
+# define MEMACCT_UNLOCK() do { } while (0)
+#endif
+
+static const char *tag_names[MEMACCT_TAGS] = {
+  [MEMACCT_OTHER]      = "other",
+  [MEMACCT_URL]        = "url",
+  [MEMACCT_QUEUE]      = "queue",
+  [MEMACCT_BLACKLIST]  = "blacklist",
+  [MEMACCT_HTML]       = "html-parse",
+  [MEMACCT_COOKIES]    = "cookies",
+  [MEMACCT_WARC_DEDUP] = "warc dedup",
+  [MEMACCT_DNS]        = "dns cache",
+};
+
+static size_t
+block_home (const void *ptr)
+{
+  uint64_t h = (uintptr_t) ptr;
+
+  h = (h >> 4) * UINT64_C (0x9e3779b97f4a7c15);
+  return (h >> 32) & (blocks_size - 1);
+}
+
+/* Return the slot of PTR, or the free slot where it would go.  */
+
+static size_t
+block_find (const void *ptr)
+{
+  size_t i = block_home (ptr);
+
+  while (blocks[i].ptr && blocks[i].ptr != ptr)
+    i = (i + 1) & (blocks_size - 1);
+  return i;
+}
+
+static void
+blocks_grow (void)
+{
+  struct memacct_block *old = blocks;
+  size_t old_size = blocks_size, i;
+
+  blocks_size = old_size ? old_size * 2 : 1024;
+  blocks = xcalloc (blocks_size, sizeof (*blocks));
+  for (i = 0; i < old_size; i++)
+    if (old[i].ptr)
+      blocks[block_find (old[i].ptr)] = old[i];
+  free (old);
+}
+
+static void
+counter_sub (struct memacct_counter *c, size_t size)
+{
+  c->live -= size;
+}
+
+static void
+counter_add (struct memacct_counter *c, size_t size)
+{
+  c->live += size;
+  c->allocs++;
+  if (c->live > c->peak)
+    c->peak = c->live;
+}
+
+/* Empty slot I, moving back the blocks of the following slots that
+   would no longer be found.  */
+
+static void
+block_remove (size_t i)
+{
+  size_t mask = blocks_size - 1, j = i;
+
+  counter_sub (&counters[blocks[i].tag], blocks[i].size);
+  counter_sub (&total, blocks[i].size);
+  blocks_count--;
+
+  for (;;)
+    {
+      size_t home;
+
+      j = (j + 1) & mask;
+      if (!blocks[j].ptr)
+        break;
+      home = block_home (blocks[j].ptr);
+      /* The block can move to I unless its home lies cyclically in
+         (I, J].  */
+      if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+        {
+          blocks[i] = blocks[j];
+          i = j;
+        }
+    }
+  blocks[i].ptr = NULL;
+}
+
+/* Record the block PTR of SIZE bytes, charged to the current
+   subsystem.  */
+
+static void
+memacct_add (void *ptr, size_t size)
+{
+  size_t i;
+
+  if (!ptr)
+    return;
+  MEMACCT_LOCK ();
+  if (blocks_count >= blocks_size / 2)
+    blocks_grow ();
+  i = block_find (ptr);
+  if (blocks[i].ptr)
+    {
+      /* A block freed behind our back, whose address was reused.  */
+      block_remove (i);
+      i = block_find (ptr);
+    }
+  blocks[i].ptr = ptr;
+  blocks[i].size = size;
+  blocks[i].tag = memacct_current;
+  blocks_count++;
+  counter_add (&counters[memacct_current], size);
+  counter_add (&total, size);
+  MEMACCT_UNLOCK ();
+}
+
+/* Forget the block PTR, about to be freed or reallocated.  */
+
+static void
+memacct_remove (void *ptr)
+{
+  size_t i;
+
+  if (!ptr)
+    return;
+  MEMACCT_LOCK ();
+  if (blocks_size)
+    {
+      i = block_find (ptr);
+      if (blocks[i].ptr)
+        block_remove (i);
+    }
+  MEMACCT_UNLOCK ();
+}
+
+void *
+memacct_xmalloc (size_t n)
+{
+  void *p = xmalloc (n);
+  memacct_add (p, n);
+  return p;
+}
+
+void *
+memacct_xcalloc (size_t n, size_t s)
+{
+  /* xcalloc has checked that N * S doesn't overflow.  */
+  void *p = xcalloc (n, s);
+  memacct_add (p, n * s);
+  return p;
+}
+
+void *
+memacct_xrealloc (void *p, size_t n)
+{
+  memacct_remove (p);
+  p = xrealloc (p, n);
+  memacct_add (p, n);
+  return p;
+}
+
+char *
+memacct_xstrdup (const char *s)
+{
+  char *p = xstrdup (s);
+  memacct_add (p, strlen (p) + 1);
+  return p;
+}
+
+char *
+memacct_xstrndup (const char *s, size_t n)
+{
+  char *p = xstrndup (s, n);
+  memacct_add (p, strlen (p) + 1);
+  return p;
+}
+
+void *
+memacct_xmemdup (void const *p, size_t n)
+{
+  void *q = xmemdup (p, n);
+  memacct_add (q, n);
+  return q;
+}
+
+char *
+memacct_xmemdup0 (void const *p, size_t n)
+{
+  char *q = xmemdup0 (p, n);
+  memacct_add (q, n + 1);
+  return q;
+}
+
+void
+memacct_free (void *p)
+{
+  memacct_remove (p);
+  free (p);
+}
+
+/* Print the live and peak bytes of each subsystem.  The peak of the
+   total is that of the sum, not the sum of the peaks.  */
+
+void
+memacct_print (void)
+{
+  struct memacct_counter snapshot[MEMACCT_TAGS], sum;
+  int i;
+
+  /* Logging allocates, which must not change the figures printed.  */
+  MEMACCT_LOCK ();
+  memcpy (snapshot, counters, sizeof (snapshot));
+  sum = total;
+  MEMACCT_UNLOCK ();
+
+  logprintf (LOG_ALWAYS, "\n%-14s %14s %14s %12s\n",
+             _("memory"), _("live bytes"), _("peak bytes"), _("allocations"));
+  for (i = 0; i < MEMACCT_TAGS; i++)
+    logprintf (LOG_ALWAYS, "%-14s %14s %14s %12s\n", tag_names[i],
+               number_to_static_string (snapshot[i].live),
+               number_to_static_string (snapshot[i].peak),
+               number_to_static_string (snapshot[i].allocs));
+  logprintf (LOG_ALWAYS, "%-14s %14s %14s %12s\n", _("total"),
+             number_to_static_string (sum.live),
+             number_to_static_string (sum.peak),
+             number_to_static_string (sum.allocs));
+}
+
+/* Store the bytes live and the most that were in LIVE and PEAK.  */
+
+void
+memacct_totals (wgint *live, wgint *peak)
+{
+  MEMACCT_LOCK ();
+  *live = total.live;
+  *peak = total.peak;
+  MEMACCT_UNLOCK ();
+}
+
+#ifdef TESTING
+
+const char *
+test_memacct_blocks (void)
+{
+  enum { N = 3000 };
+  static void *p[N];
+  wgint live = counters[MEMACCT_DNS].live;
+  wgint total_live = total.live;
+  wgint sum = 0;
+  size_t i;
+
+  MEMACCT_ENTER (saved, MEMACCT_DNS);
+  for (i = 0; i < N; i++)
+    {
+      p[i] = memacct_xmalloc (i % 50 + 1);
+      sum += i % 50 + 1;
+    }
+  MEMACCT_LEAVE (saved);
+  mu_assert ("test_memacct_blocks: charged to the subsystem",
+             counters[MEMACCT_DNS].live == live + sum
+             && counters[MEMACCT_DNS].peak >= live + sum
+             && total.live == total_live + sum);
+
+  /* Freeing every other block moves the others back in the table,
+     where they must still be found.  */
+  for (i = 0; i < N; i += 2)
+    {
+      memacct_free (p[i]);
+      sum -= i % 50 + 1;
+    }
+  for (i = 1; i < N; i += 2)
+    mu_assert ("test_memacct_blocks: block lost",
+               blocks[block_find (p[i])].ptr == p[i]);
+  mu_assert ("test_memacct_blocks: freed blocks discharged",
+             counters[MEMACCT_DNS].live == live + sum);
+
+  memacct_current = MEMACCT_DNS;
+  for (i = 1; i < N; i += 2)
+    {
+      p[i] = memacct_xrealloc (p[i], 100);
+      sum += 100 - (i % 50 + 1);
+    }
+  MEMACCT_LEAVE (saved);
+  mu_assert ("test_memacct_blocks: reallocated blocks",
+             counters[MEMACCT_DNS].live == live + sum);
+
+  for (i = 1; i < N; i += 2)
+    memacct_free (p[i]);
+  mu_assert ("test_memacct_blocks: all discharged",
+             counters[MEMACCT_DNS].live == live
+             && total.live == total_live);
+  return NULL;
+}
+
+#endif /* TESTING */
+
+#endif /* ENABLE_MEMACCT */
@@ -0,0 +1,92 @@
+/* Declarations for memacct.c.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#ifndef MEMACCT_H
+#define MEMACCT_H
+
+/* The subsystems memory is charged to by the accounting of
+   --enable-memory-accounting builds.  */
+enum memacct_tag
+{
+  MEMACCT_OTHER,                /* none of the following */
+  MEMACCT_URL,                  /* parsed URLs */
+  MEMACCT_QUEUE,                /* the queue of the recursive retrieval */
+  MEMACCT_BLACKLIST,            /* the sets of URLs already seen */
+  MEMACCT_HTML,                 /* map_html_tags and its pool */
+  MEMACCT_COOKIES,              /* the cookie jar */
+  MEMACCT_WARC_DEDUP,           /* the records of --warc-dedup */
+  MEMACCT_DNS,                  /* the DNS cache */
+  MEMACCT_TAGS
+};
+
+#ifdef ENABLE_MEMACCT
+
+#include <stddef.h>
+
+extern enum memacct_tag memacct_current;
+
+void *memacct_xmalloc (size_t);
+void *memacct_xcalloc (size_t, size_t);
+void *memacct_xrealloc (void *, size_t);
+char *memacct_xstrdup (const char *);
+char *memacct_xstrndup (const char *, size_t);
+void *memacct_xmemdup (void const *, size_t);
+char *memacct_xmemdup0 (void const *, size_t);
+void memacct_free (void *);
+
+void memacct_print (void);
+void memacct_totals (wgint *, wgint *);
+
+/* The allocations of Wget are recorded, along with the subsystem that
+   made them, until they are freed with xfree.  Memory the libraries
+   allocate isn't accounted for.  */
+# define xmalloc(n) memacct_xmalloc (n)
+# define xcalloc(n, s) memacct_xcalloc (n, s)
+# define xrealloc(p, n) memacct_xrealloc (p, n)
+# define xstrdup(s) memacct_xstrdup (s)
+# define xstrndup(s, n) memacct_xstrndup (s, n)
+# define xmemdup(p, n) memacct_xmemdup (p, n)
+# define xmemdup0(p, n) memacct_xmemdup0 (p, n)
+
+/* Charge the allocations made from here on to TAG, saving the subsystem
+   they were charged to in VAR for MEMACCT_LEAVE to go back to.  */
+# define MEMACCT_ENTER(var, tag)                                \
+  enum memacct_tag var = memacct_current; memacct_current = (tag)
+# define MEMACCT_LEAVE(var) (memacct_current = (var))
+
+#else  /* not ENABLE_MEMACCT */
+
+# define MEMACCT_ENTER(var, tag) do { } while (0)
+# define MEMACCT_LEAVE(var) do { } while (0)
+# define memacct_print() do { } while (0)
+
+#endif /* not ENABLE_MEMACCT */
+
+#endif /* MEMACCT_H */
@@ -34,6 +34,8 @@ as that of the covered work.  */
 #include "retr.h"
 #include "exits.h"
 #include "utils.h"
+#include "url.h"
+#include "http.h"
 # ifdef HAVE_WINHASHES
 # include "win-hashes.h"
 # else
@@ -50,6 +52,7 @@ as that of the covered work.  */
 #include "c-strcase.h"
 #include <errno.h>
 #include <unistd.h> /* For unlink.  */
+#include <sys/stat.h>
 #include <metalink/metalink_parser.h>
 #ifdef HAVE_GPGME
 #include <gpgme.h>
@@ -60,6 +63,384 @@ as that of the covered work.  */
 #include "../tests/unit-tests.h"
 #endif
 
+/* Piece hashes of the file being retrieved, indexed by piece number.  */
+struct piece_check {
+  const char *type;
+  char **hashes;
+};
+
+/* Return the digest size of the piece hash TYPE, or 0 if we cannot
+   compute it.  */
+static int
+piece_hash_size (const char *type)
+{
+  if (c_strcasecmp (type, "md5") == 0)
+    return MD5_DIGEST_SIZE;
+  if (c_strcasecmp (type, "sha1") == 0 || c_strcasecmp (type, "sha-1") == 0)
+    return SHA1_DIGEST_SIZE;
+  if (c_strcasecmp (type, "sha256") == 0 || c_strcasecmp (type, "sha-256") == 0)
+    return SHA256_DIGEST_SIZE;
+  if (c_strcasecmp (type, "sha384") == 0 || c_strcasecmp (type, "sha-384") == 0)
+    return SHA384_DIGEST_SIZE;
+  if (c_strcasecmp (type, "sha512") == 0 || c_strcasecmp (type, "sha-512") == 0)
+    return SHA512_DIGEST_SIZE;
+  return 0;
+}
+
+/* Verifier for http_get_pieces: check PIECE against its hash.  */
+static bool
+verify_piece (int piece, const char *data, wgint size, void *arg)
+{
+  const struct piece_check *check = arg;
+  char digest[SHA512_DIGEST_SIZE];
+  char digest_txt[2 * SHA512_DIGEST_SIZE + 1];
+  int digest_size = piece_hash_size (check->type);
+
+  switch (digest_size)
+    {
+    case MD5_DIGEST_SIZE:
+      md5_buffer (data, size, digest);
+      break;
+    case SHA1_DIGEST_SIZE:
+      sha1_buffer (data, size, digest);
+      break;
+    case SHA256_DIGEST_SIZE:
+      sha256_buffer (data, size, digest);
+      break;
+    case SHA384_DIGEST_SIZE:
+      sha384_buffer (data, size, digest);
+      break;
+    default:
+      sha512_buffer (data, size, digest);
+      break;
+    }
+  wg_hex_to_string (digest_txt, digest, digest_size);
+  DEBUGP (("Piece %d: declared hash %s, computed hash %s\n",
+           piece, check->hashes[piece], digest_txt));
+  return c_strcasecmp (digest_txt, check->hashes[piece]) == 0;
+}
+
+/* Check which of the NPIECES pieces of PIECE_SIZE bytes FP already
+   holds, as when continuing a download, so that only the others are
+   fetched.  SIZE is the size of the whole file.  Returns what
+   http_get_pieces expects as HAVE, or NULL if FP is empty.  */
+static bool *
+pieces_present (FILE *fp, wgint size, wgint piece_size, int npieces,
+                const struct piece_check *check)
+{
+  struct stat st;
+  wgint length;
+  bool *have;
+  char *buf;
+  int i, good = 0;
+
+  if (fflush (fp) != 0 || fstat (fileno (fp), &st) != 0 || st.st_size <= 0)
+    return NULL;
+  length = MIN (st.st_size, size);
+
+  have = xcalloc (npieces, sizeof (bool));
+  buf = xmalloc (piece_size);
+  for (i = 0; i < npieces; i++)
+    {
+      wgint start = (wgint) i * piece_size;
+      wgint len = MIN (piece_size, size - start);
+
+      if (start + len > length || fseeko (fp, start, SEEK_SET) != 0
+          || fread (buf, 1, len, fp) != (size_t) len)
+        break;
+      have[i] = verify_piece (i, buf, len, (void *) check);
+      good += have[i];
+    }
+  xfree (buf);
+
+  logprintf (LOG_VERBOSE, _("%d of %d pieces are already in the file.\n"),
+             good, npieces);
+  return have;
+}
+
+/* If MFILE lists piece hashes and HTTP mirrors, fetch its pieces from
+   all mirrors at once with http_get_pieces, writing them to FP.  The
+   pieces FP already holds are kept if they check out.  Returns RETROK
+   on success and METALINK_MISSING_RESOURCE if MFILE isn't suitable,
+   in which case nothing has been written.  */
+static uerr_t
+retrieve_pieces_from_mirrors (metalink_file_t *mfile, FILE *fp,
+                              const char *name)
+{
+  metalink_chunk_checksum_t *chunks = mfile->chunk_checksum;
+  metalink_resource_t **mres_ptr;
+  metalink_piece_hash_t **phash_ptr;
+  struct piece_check check;
+  struct url **urls;
+  bool *have = NULL;
+  int nurls = 0, npieces, i;
+  uerr_t err = METALINK_MISSING_RESOURCE;
+
+  if (!chunks || !chunks->piece_hashes || chunks->length <= 0
+      || mfile->size <= 0 || !piece_hash_size (chunks->type))
+    return METALINK_MISSING_RESOURCE;
+
+  /* Every piece needs a hash, or we cannot check it.  */
+  npieces = (mfile->size + chunks->length - 1) / chunks->length;
+  check.type = chunks->type;
+  check.hashes = xcalloc (npieces, sizeof (char *));
+  for (phash_ptr = chunks->piece_hashes; *phash_ptr; phash_ptr++)
+    if ((*phash_ptr)->piece >= 0 && (*phash_ptr)->piece < npieces)
+      check.hashes[(*phash_ptr)->piece] = (*phash_ptr)->hash;
+  for (i = 0; i < npieces; i++)
+    if (!check.hashes[i])
+      {
+        xfree (check.hashes);
+        return METALINK_MISSING_RESOURCE;
+      }
+
+  for (mres_ptr = mfile->resources; *mres_ptr; mres_ptr++)
+    nurls++;
+  urls = xcalloc (nurls + 1, sizeof (struct url *));
+  nurls = 0;
+  for (mres_ptr = mfile->resources; *mres_ptr; mres_ptr++)
+    {
+      metalink_resource_t *mres = *mres_ptr;
+      struct url *url;
+
+      clean_metalink_string (&mres->url);
+      if (!RES_TYPE_SUPPORTED (mres->type))
+        continue;
+      url = url_new_init ();
+      url->ori_url = xstrdup (mres->url);
+      if (url_parse (url, true, true)
+          || (url->scheme != SCHEME_HTTP
+#ifdef HAVE_SSL
+              && url->scheme != SCHEME_HTTPS
+#endif
+              )
+          || url_uses_proxy (url))
+        {
+          url_free (url);
+          continue;
+        }
+      urls[nurls++] = url;
+    }
+
+  if (nurls > 0)
+    {
+      have = pieces_present (fp, mfile->size, chunks->length, npieces,
+                             &check);
+      err = http_get_pieces (urls, nurls, fp, name, mfile->size,
+                             chunks->length, have, verify_piece, &check);
+    }
+
+  for (i = 0; i < nurls; i++)
+    url_free (urls[i]);
+  xfree (urls);
+  xfree (have);
+  xfree (check.hashes);
+  return err;
+}
+
+/* The checksum types we can compute.  */
+enum checksum_kind {
+  CHECKSUM_NONE,
+  CHECKSUM_MD2,
+  CHECKSUM_MD4,
+  CHECKSUM_MD5,
+  CHECKSUM_SHA1,
+#ifndef HAVE_WINHASHES
+  CHECKSUM_SHA224,
+#endif
+  CHECKSUM_SHA256,
+  CHECKSUM_SHA384,
+  CHECKSUM_SHA512
+};
+
+static enum checksum_kind
+checksum_kind (const char *type)
+{
+  /* I have seen both variants...  */
+  if (c_strcasecmp (type, "md2") == 0)
+    return CHECKSUM_MD2;
+  if (c_strcasecmp (type, "md4") == 0)
+    return CHECKSUM_MD4;
+  if (c_strcasecmp (type, "md5") == 0)
+    return CHECKSUM_MD5;
+  if (c_strcasecmp (type, "sha1") == 0 || c_strcasecmp (type, "sha-1") == 0)
+    return CHECKSUM_SHA1;
+#ifndef HAVE_WINHASHES
+  if (c_strcasecmp (type, "sha224") == 0 || c_strcasecmp (type, "sha-224") == 0)
+    return CHECKSUM_SHA224;
+#endif
+  if (c_strcasecmp (type, "sha256") == 0 || c_strcasecmp (type, "sha-256") == 0)
+    return CHECKSUM_SHA256;
+  if (c_strcasecmp (type, "sha384") == 0 || c_strcasecmp (type, "sha-384") == 0)
+    return CHECKSUM_SHA384;
+  if (c_strcasecmp (type, "sha512") == 0 || c_strcasecmp (type, "sha-512") == 0)
+    return CHECKSUM_SHA512;
+  return CHECKSUM_NONE;
+}
+
+/* The checksum of the file being retrieved, computed by fd_read_body
+   as the file is written, which saves reading the file back to verify
+   it.  */
+struct file_checksum {
+  enum checksum_kind kind;
+  bool started;
+  union {
+    struct md2_ctx md2;
+    struct md4_ctx md4;
+    struct md5_ctx md5;
+    struct sha1_ctx sha1;
+    struct sha256_ctx sha256;   /* also SHA-224 */
+    struct sha512_ctx sha512;   /* also SHA-384 */
+  } ctx;
+  struct body_digest digest;
+};
+
+/* Store the checksum in DIGEST and return its size.  */
+static int
+file_checksum_finish (struct file_checksum *fc, char *digest)
+{
+  fc->started = false;
+  switch (fc->kind)
+    {
+    case CHECKSUM_MD2:
+      md2_finish_ctx (&fc->ctx.md2, digest);
+      return MD2_DIGEST_SIZE;
+    case CHECKSUM_MD4:
+      md4_finish_ctx (&fc->ctx.md4, digest);
+      return MD4_DIGEST_SIZE;
+    case CHECKSUM_MD5:
+      md5_finish_ctx (&fc->ctx.md5, digest);
+      return MD5_DIGEST_SIZE;
+    case CHECKSUM_SHA1:
+      sha1_finish_ctx (&fc->ctx.sha1, digest);
+      return SHA1_DIGEST_SIZE;
+#ifndef HAVE_WINHASHES
+    case CHECKSUM_SHA224:
+      sha224_finish_ctx (&fc->ctx.sha256, digest);
+      return SHA224_DIGEST_SIZE;
+#endif
+    case CHECKSUM_SHA256:
+      sha256_finish_ctx (&fc->ctx.sha256, digest);
+      return SHA256_DIGEST_SIZE;
+    case CHECKSUM_SHA384:
+      sha384_finish_ctx (&fc->ctx.sha512, digest);
+      return SHA384_DIGEST_SIZE;
+    case CHECKSUM_SHA512:
+      sha512_finish_ctx (&fc->ctx.sha512, digest);
+      return SHA512_DIGEST_SIZE;
+    default:
+      return 0;
+    }
+}
+
+/* Finish a checksum that won't be used, releasing what it holds.  */
+static void
+file_checksum_discard (struct file_checksum *fc)
+{
+  char digest[SHA512_DIGEST_SIZE];
+
+  if (fc->started)
+    file_checksum_finish (fc, digest);
+}
+
+static void
+file_checksum_init (void *arg)
+{
+  struct file_checksum *fc = arg;
+
+  file_checksum_discard (fc);
+  fc->started = true;
+  switch (fc->kind)
+    {
+    case CHECKSUM_MD2:
+      md2_init_ctx (&fc->ctx.md2);
+      break;
+    case CHECKSUM_MD4:
+      md4_init_ctx (&fc->ctx.md4);
+      break;
+    case CHECKSUM_MD5:
+      md5_init_ctx (&fc->ctx.md5);
+      break;
+    case CHECKSUM_SHA1:
+      sha1_init_ctx (&fc->ctx.sha1);
+      break;
+#ifndef HAVE_WINHASHES
+    case CHECKSUM_SHA224:
+      sha224_init_ctx (&fc->ctx.sha256);
+      break;
+#endif
+    case CHECKSUM_SHA256:
+      sha256_init_ctx (&fc->ctx.sha256);
+      break;
+    case CHECKSUM_SHA384:
+      sha384_init_ctx (&fc->ctx.sha512);
+      break;
+    case CHECKSUM_SHA512:
+      sha512_init_ctx (&fc->ctx.sha512);
+      break;
+    default:
+      fc->started = false;
+      break;
+    }
+}
+
+static void
+file_checksum_update (const char *buf, size_t len, void *arg)
+{
+  struct file_checksum *fc = arg;
+
+  switch (fc->kind)
+    {
+    case CHECKSUM_MD2:
+      md2_process_bytes (buf, len, &fc->ctx.md2);
+      break;
+    case CHECKSUM_MD4:
+      md4_process_bytes (buf, len, &fc->ctx.md4);
+      break;
+    case CHECKSUM_MD5:
+      md5_process_bytes (buf, len, &fc->ctx.md5);
+      break;
+    case CHECKSUM_SHA1:
+      sha1_process_bytes (buf, len, &fc->ctx.sha1);
+      break;
+#ifndef HAVE_WINHASHES
+    case CHECKSUM_SHA224:
+#endif
+    case CHECKSUM_SHA256:
+      sha256_process_bytes (buf, len, &fc->ctx.sha256);
+      break;
+    case CHECKSUM_SHA384:
+    case CHECKSUM_SHA512:
+      sha512_process_bytes (buf, len, &fc->ctx.sha512);
+      break;
+    default:
+      break;
+    }
+}
+
+/* Set FC up for the checksum of MFILE that will be verified: the first
+   one of a supported type.  */
+static void
+file_checksum_setup (struct file_checksum *fc, metalink_file_t *mfile)
+{
+  metalink_checksum_t **mchksum_ptr;
+
+  file_checksum_discard (fc);
+  fc->kind = CHECKSUM_NONE;
+  for (mchksum_ptr = mfile->checksums; mchksum_ptr && *mchksum_ptr; mchksum_ptr++)
+    {
+      fc->kind = checksum_kind ((*mchksum_ptr)->type);
+      if (fc->kind != CHECKSUM_NONE)
+        break;
+    }
+  fc->digest.init = file_checksum_init;
+  fc->digest.update = file_checksum_update;
+  fc->digest.ctx = fc;
+  fc->digest.raw = false;
+  fc->digest.documents_only = false;
+  fc->digest.valid = false;
+}
+
 /* Loop through all files in metalink structure and retrieve them.
    Returns RETROK if all files were downloaded.
    Returns last retrieval error (from retrieve_url) if some files
@@ -69,6 +450,7 @@ retrieve_from_metalink (const metalink_t* metalink)
 {
   metalink_file_t **mfile_ptr;
   uerr_t last_retr_err = RETROK; /* Store last encountered retrieve error.  */
+  struct file_checksum running;
 
   FILE *_output_stream = output_stream;
   bool _output_stream_regular = output_stream_regular;
@@ -89,6 +471,8 @@ retrieve_from_metalink (const metalink_t* metalink)
   if (!metalink->files)
     return RETROK;
 
+  xzero (running);
+
   if (opt.output_document)
     {
       /* We cannot support output_document as we need to compute checksum
@@ -109,6 +493,8 @@ retrieve_from_metalink (const metalink_t* metalink)
       char *destname = NULL;
       bool size_ok = false;
       bool hash_ok = false;
+      bool use_running = false;
+      bool try_pieces = true;
 
       uerr_t retr_err = METALINK_MISSING_RESOURCE;
 
@@ -121,6 +507,8 @@ retrieve_from_metalink (const metalink_t* metalink)
 
       output_stream = NULL;
 
+      file_checksum_setup (&running, mfile);
+
       mfc++;
 
       /* The directory prefix for opt.metalink_over_http is handled by
@@ -449,8 +837,16 @@ retrieve_from_metalink (const metalink_t* metalink)
                      it as output_stream. We restore the original configuration
                      after we are finished with the file.  */
                   if (opt.always_rest)
-                    /* continue previous download */
-                    output_stream = fopen (safename, "ab");
+                    {
+                      /* Continue the previous download.  Pieces may be
+                         written anywhere in the file, which append mode
+                         would not allow.  */
+                      output_stream = fopen (safename, "r+b");
+                      if (output_stream)
+                        fseeko (output_stream, 0, SEEK_END);
+                      else
+                        output_stream = fopen (safename, "ab");
+                    }
                   else
                     /* create a file with an unique name */
                     output_stream = unique_create (safename, true, &destname);
@@ -482,8 +878,44 @@ retrieve_from_metalink (const metalink_t* metalink)
 
               opt.metalink_over_http = false;
               DEBUGP (("Storing to %s\n", destname));
-              retr_err = retrieve_url (url, NULL, NULL,
-                                       NULL, NULL, opt.recursive, false);
+
+              /* Try to fetch verified pieces from all mirrors at once
+                 first, and fall back to one mirror at a time.  */
+              retr_err = METALINK_MISSING_RESOURCE;
+              if (try_pieces && output_stream)
+                {
+                  try_pieces = false;
+                  retr_err = retrieve_pieces_from_mirrors (mfile, output_stream,
+                                                           destname);
+                  if (retr_err != RETROK && retr_err != METALINK_MISSING_RESOURCE
+                      && opt.always_rest)
+                    {
+                      /* The file has holes where pieces are missing, so
+                         it cannot be continued at its end.  Keep the
+                         verified pieces for the next --continue.  */
+                      logputs (LOG_VERBOSE, _("Keeping the verified pieces "
+                                              "for a later retry.\n"));
+                      skip_mfile = true;
+                    }
+                  else if (retr_err != RETROK
+                           && retr_err != METALINK_MISSING_RESOURCE)
+                    {
+                      /* Start over with a clean file.  */
+                      logputs (LOG_VERBOSE, _("Falling back to downloading "
+                                              "from one mirror at a time.\n"));
+                      if (fflush (output_stream) == 0
+                          && ftruncate (fileno (output_stream), 0) == 0)
+                        rewind (output_stream);
+                    }
+                }
+              if (retr_err != RETROK && !skip_mfile)
+                {
+                  if (running.kind != CHECKSUM_NONE)
+                    body_digest_add (&running.digest);
+                  retr_err = retrieve_url (url, NULL, NULL,
+                                           NULL, NULL, opt.recursive, false);
+                  body_digest_remove (&running.digest);
+                }
               url_free (url);
               opt.metalink_over_http = _metalink_http;
 
@@ -548,6 +980,11 @@ retrieve_from_metalink (const metalink_t* metalink)
                     }
                 }
 
+              /* The checksum computed while downloading is good if the
+                 whole file was written in one go.  */
+              use_running = running.started && running.digest.valid
+                && running.digest.length == file_size (destname);
+
               for (mchksum_ptr = mfile->checksums; *mchksum_ptr; mchksum_ptr++)
                 {
                   char md2[MD2_DIGEST_SIZE];
@@ -606,7 +1043,20 @@ retrieve_from_metalink (const metalink_t* metalink)
 
                   DEBUGP (("Declared hash: %s\n", mchksum->hash));
 
-                  if (c_strcasecmp (mchksum->type, "md2") == 0)
+                  if (use_running
+                      && checksum_kind (mchksum->type) == running.kind)
+                    {
+                      char digest[SHA512_DIGEST_SIZE];
+                      char digest_txt[2 * SHA512_DIGEST_SIZE + 1];
+                      int digest_size = file_checksum_finish (&running, digest);
+
+                      wg_hex_to_string (digest_txt, digest, digest_size);
+                      DEBUGP (("Computed hash (while downloading): %s\n",
+                               digest_txt));
+                      if (!strcmp (digest_txt, mchksum->hash))
+                        hash_ok = true;
+                    }
+                  else if (c_strcasecmp (mchksum->type, "md2") == 0)
                     {
                       md2_stream (local_file, md2);
                       wg_hex_to_string (md2_txt, md2, MD2_DIGEST_SIZE);
@@ -924,6 +1374,8 @@ gpg_skip_verification:
       xfree (planname);
     } /* Iterate over files.  */
 
+  file_checksum_discard (&running);
+
   /* Restore original values.  */
   opt.output_document = _output_document;
   output_stream_regular = _output_stream_regular;
@@ -0,0 +1,55 @@
+/* Declarations for metrics.c
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/* The phases of a transfer whose duration is recorded.  */
+enum metrics_phase
+{
+  METRICS_DNS,                  /* host name lookup */
+  METRICS_CONNECT,              /* TCP connection */
+  METRICS_TLS,                  /* TLS handshake */
+  METRICS_TTFB,                 /* request sent to response head */
+  METRICS_PHASES
+};
+
+struct url;
+
+void metrics_begin (void);
+double metrics_now (void);
+void metrics_phase (enum metrics_phase, double);
+void metrics_reused (void);
+void metrics_status (int);
+void metrics_budget (int);
+void metrics_end (const struct url *, int, wgint, wgint, double, bool);
+void metrics_close (void);
+
+#endif /* METRICS_H */
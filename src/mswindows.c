@@ -37,11 +37,13 @@ as that of the covered work.  */
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <mswsock.h>            /* TransmitFile */
 
 
 #include "utils.h"
 #include "url.h"
 #include "exits.h"
+#include "status.h"
 
 #ifndef ES_SYSTEM_REQUIRED
 #define ES_SYSTEM_REQUIRED  0x00000001
@@ -349,6 +351,11 @@ ws_handler (DWORD dwEvent)
     case CTRL_BREAK_EVENT:
       ws_hangup ("CTRL+Break");
       return TRUE;
+#else
+    case CTRL_BREAK_EVENT:
+      /* Stand in for SIGUSR1.  */
+      status_request ();
+      return TRUE;
 #endif
     default:
       return FALSE;
@@ -515,19 +522,65 @@ thread_helper (void *arg)
   return 0;
 }
 
+/* The worker thread used by run_with_timeout.  It is created on first
+   use and then waits for further calls, so that the common case of FUN
+   finishing in time doesn't pay for creating a thread.  Since Wget
+   calls run_with_timeout from one thread only, one worker is enough.
+   The worker is only terminated, and recreated on the next call, when
+   FUN times out.  */
+
+static HANDLE worker_thread;
+static HANDLE worker_go, worker_done; /* auto-reset events */
+static struct thread_data *worker_job;
+
+static DWORD WINAPI
+worker_loop (void *arg)
+{
+  for (;;)
+    {
+      WaitForSingleObject (worker_go, INFINITE);
+      thread_helper (worker_job);
+      SetEvent (worker_done);
+    }
+  return 0;
+}
+
+static bool
+start_worker (void)
+{
+  DWORD thread_id;
+
+  if (!worker_go)
+    worker_go = CreateEvent (NULL, FALSE, FALSE, NULL);
+  if (!worker_done)
+    worker_done = CreateEvent (NULL, FALSE, FALSE, NULL);
+  if (!worker_go || !worker_done)
+    return false;
+
+  worker_thread = CreateThread (NULL, THREAD_STACK_SIZE, worker_loop,
+                                NULL, 0, &thread_id);
+  if (!worker_thread)
+    {
+      DEBUGP (("CreateThread() failed; [%#lx]\n",
+               (unsigned long) GetLastError ()));
+      return false;
+    }
+  return true;
+}
+
 /* Call FUN(ARG), but don't allow it to run for more than TIMEOUT
    seconds.  Returns true if the function was interrupted with a
    timeout, false otherwise.
 
-   This works by running FUN in a separate thread and terminating the
-   thread if it doesn't finish in the specified time.  */
+   This works by running FUN in the worker thread and terminating the
+   thread if it doesn't finish in the specified time.  Connecting and
+   the SChannel handshake no longer come through here; they wait with
+   select instead, which leaves mostly DNS lookups.  */
 
 bool
 run_with_timeout (double seconds, void (*fun) (void *), void *arg)
 {
-  HANDLE thread_hnd;
   struct thread_data thread_arg;
-  DWORD thread_id;
   bool rc;
 
   DEBUGP (("timeout: seconds %.2f\n", seconds));
@@ -539,19 +592,19 @@ run_with_timeout (double seconds, void (*fun) (void *), void *arg)
       return false;
     }
 
+  if (!worker_thread && !start_worker ())
+    goto blocking_fallback;
+
   thread_arg.fun = fun;
   thread_arg.arg = arg;
   thread_arg.ws_error = WSAGetLastError ();
-  thread_hnd = CreateThread (NULL, THREAD_STACK_SIZE, thread_helper,
-                             &thread_arg, 0, &thread_id);
-  if (!thread_hnd)
-    {
-      DEBUGP (("CreateThread() failed; [%#lx]\n",
-               (unsigned long) GetLastError ()));
-      goto blocking_fallback;
-    }
+  worker_job = &thread_arg;
+  /* A worker killed after finishing its last job may have left the
+     event set.  */
+  ResetEvent (worker_done);
+  SetEvent (worker_go);
 
-  if (WaitForSingleObject (thread_hnd, (DWORD)(1000 * seconds))
+  if (WaitForSingleObject (worker_done, (DWORD)(1000 * seconds))
       == WAIT_OBJECT_0)
     {
       /* Propagate error state (which is per-thread) to this thread,
@@ -562,12 +615,12 @@ run_with_timeout (double seconds, void (*fun) (void *), void *arg)
     }
   else
     {
-      TerminateThread (thread_hnd, 1);
+      TerminateThread (worker_thread, 1);
+      CloseHandle (worker_thread);  /* Clear-up after TerminateThread().  */
+      worker_thread = NULL;
       rc = true;
     }
 
-  CloseHandle (thread_hnd);     /* Clear-up after TerminateThread().  */
-  thread_hnd = NULL;
   return rc;
 }
 
@@ -606,3 +659,176 @@ set_windows_fd_as_blocking_socket (int fd)
     }
   return;
 }
+
+/* Windows version of mmap for wget_read_file: map the file open on FD
+   into memory, copy-on-write like MAP_PRIVATE, and store its size to
+   *LENGTH.  Return NULL if the file cannot be mapped, for instance
+   because it is not a disk file or is empty, which CreateFileMapping
+   refuses.  */
+
+char *
+ws_map_file (int fd, long *length)
+{
+  HANDLE file = (HANDLE) _get_osfhandle (fd);
+  HANDLE mapping;
+  LARGE_INTEGER size;
+  char *view;
+
+  if (file == INVALID_HANDLE_VALUE || GetFileType (file) != FILE_TYPE_DISK)
+    return NULL;
+  if (!GetFileSizeEx (file, &size)
+      || size.QuadPart <= 0 || size.QuadPart > LONG_MAX)
+    return NULL;
+
+  mapping = CreateFileMapping (file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  if (!mapping)
+    return NULL;
+  view = MapViewOfFile (mapping, FILE_MAP_COPY, 0, 0, 0);
+  /* The view keeps the mapping alive until it is unmapped.  */
+  CloseHandle (mapping);
+  if (!view)
+    return NULL;
+
+  *length = (long) size.QuadPart;
+  return view;
+}
+
+/* Release the view returned by ws_map_file.  */
+
+void
+ws_unmap_file (char *view)
+{
+  UnmapViewOfFile (view);
+}
+
+/* Windows version of fallocate with FALLOC_FL_KEEP_SIZE for
+   preallocate_file: grow the allocation of the disk file open on FD
+   by LENGTH bytes without moving its end.  SetFileValidData would
+   also avoid zero-filling, but it needs SE_MANAGE_VOLUME_NAME and
+   exposes whatever the disk held before, so it is not used.  */
+
+void
+ws_preallocate (int fd, int64_t length)
+{
+  HANDLE file = (HANDLE) _get_osfhandle (fd);
+  LARGE_INTEGER size;
+  FILE_ALLOCATION_INFO info;
+
+  if (file == INVALID_HANDLE_VALUE || GetFileType (file) != FILE_TYPE_DISK
+      || !GetFileSizeEx (file, &size))
+    return;
+
+  info.AllocationSize.QuadPart = size.QuadPart + length;
+  if (!SetFileInformationByHandle (file, FileAllocationInfo,
+                                   &info, sizeof (info)))
+    DEBUGP (("Cannot preallocate %s bytes: error %lu\n",
+             number_to_static_string (length), GetLastError ()));
+}
+
+/* Windows version of presize_file: make the disk file open on FD
+   LENGTH bytes long, reserving the space first if ALLOCATE.  Writes
+   beyond the valid data length still zero the part before them, once;
+   SetFileValidData would spare that, for the reason given above it
+   isn't used either.  */
+
+void
+ws_presize (int fd, int64_t length, bool allocate)
+{
+  HANDLE file = (HANDLE) _get_osfhandle (fd);
+  LARGE_INTEGER size;
+  FILE_ALLOCATION_INFO alloc;
+  FILE_END_OF_FILE_INFO eof;
+
+  if (file == INVALID_HANDLE_VALUE || GetFileType (file) != FILE_TYPE_DISK
+      || !GetFileSizeEx (file, &size) || size.QuadPart >= length)
+    return;
+
+  if (allocate)
+    {
+      alloc.AllocationSize.QuadPart = length;
+      if (!SetFileInformationByHandle (file, FileAllocationInfo,
+                                       &alloc, sizeof (alloc)))
+        DEBUGP (("Cannot preallocate %s bytes: error %lu\n",
+                 number_to_static_string (length), GetLastError ()));
+    }
+  eof.EndOfFile.QuadPart = length;
+  if (!SetFileInformationByHandle (file, FileEndOfFileInfo,
+                                   &eof, sizeof (eof)))
+    DEBUGP (("Cannot extend the file to %s bytes: error %lu\n",
+             number_to_static_string (length), GetLastError ()));
+}
+
+/* Windows version of pwrite for write_file_at: write SIZE bytes of BUF
+   at offset POS of the file open on FD, the offset given to WriteFile
+   rather than sought to first.  */
+
+bool
+ws_pwrite (int fd, const char *buf, size_t size, int64_t pos)
+{
+  HANDLE file = (HANDLE) _get_osfhandle (fd);
+
+  if (file == INVALID_HANDLE_VALUE)
+    {
+      errno = EBADF;
+      return false;
+    }
+  while (size)
+    {
+      OVERLAPPED ov;
+      DWORD written;
+
+      xzero (ov);
+      ov.Offset = (DWORD) pos;
+      ov.OffsetHigh = (DWORD) (pos >> 32);
+      if (!WriteFile (file, buf, (DWORD) MIN (size, 1 << 30), &written, &ov))
+        {
+          errno = EIO;
+          return false;
+        }
+      buf += written;
+      size -= written;
+      pos += written;
+    }
+  return true;
+}
+
+/* Windows version of sendfile for fd_send_file: send up to COUNT
+   bytes of the file open on FILE_FD, from its current position, to
+   socket SOCK with TransmitFile.  Return the number of bytes sent and
+   leave the file position after them, or return -1 on error.  */
+
+int64_t
+ws_transmit_file (int sock, int file_fd, int64_t count)
+{
+  SOCKET s = (SOCKET) _get_osfhandle (sock);
+  HANDLE file = (HANDLE) _get_osfhandle (file_fd);
+  LARGE_INTEGER pos, size;
+  int64_t sent = 0;
+
+  if (file == INVALID_HANDLE_VALUE || GetFileType (file) != FILE_TYPE_DISK
+      || !GetFileSizeEx (file, &size))
+    return 0;
+  pos.QuadPart = 0;
+  if (!SetFilePointerEx (file, pos, &pos, FILE_CURRENT))
+    return 0;
+  if (count > size.QuadPart - pos.QuadPart)
+    count = size.QuadPart - pos.QuadPart;
+
+  while (sent < count)
+    {
+      /* TransmitFile sends at most 2^31 - 2 bytes per call.  */
+      DWORD chunk = (DWORD) MIN (count - sent, 0x40000000);
+      if (!TransmitFile (s, file, chunk, 0, NULL, NULL, 0))
+        {
+          DEBUGP (("TransmitFile: Winsock error: %d\n", WSAGetLastError ()));
+          errno = EIO;
+          return -1;
+        }
+      sent += chunk;
+      pos.QuadPart += chunk;
+      /* TransmitFile reads from the current position but is not
+         guaranteed to move it.  */
+      SetFilePointerEx (file, pos, NULL, FILE_BEGIN);
+    }
+  return sent;
+}
@@ -72,5 +72,11 @@ void ws_percenttitle (double);
 char *ws_mypath (void);
 void windows_main (char **);
 void set_windows_fd_as_blocking_socket (int);
+char *ws_map_file (int, long *);
+void ws_unmap_file (char *);
+void ws_preallocate (int, int64_t);
+void ws_presize (int, int64_t, bool);
+bool ws_pwrite (int, const char *, size_t, int64_t);
+int64_t ws_transmit_file (int, int, int64_t);
 
 #endif /* MSWINDOWS_H */
@@ -86,6 +86,28 @@ PCCERT_CONTEXT WINAPI CertEnumCertificatesInStore(
     HCERTSTORE hCertStore,
     PCCERT_CONTEXT pPrevCertContext
 );
+
+#define X509_ASN_ENCODING       0x00000001
+#define CERT_FIND_SUBJECT_NAME  0x00020007
+
+typedef struct _CERT_NAME_BLOB
+{
+    unsigned int cbData;
+    unsigned char *pbData;
+} CERT_NAME_BLOB;
+
+PCCERT_CONTEXT WINAPI CertFindCertificateInStore(
+    HCERTSTORE hCertStore,
+    unsigned int dwCertEncodingType,
+    unsigned int dwFindFlags,
+    unsigned int dwFindType,
+    const void *pvFindPara,
+    PCCERT_CONTEXT pPrevCertContext
+);
+BOOL WINAPI CertCloseStore(
+    HCERTSTORE hCertStore,
+    unsigned int dwFlags
+);
 #endif
 
 /* Application-wide SSL context.  This is common to all SSL
@@ -199,6 +221,45 @@ static int ssl_true_initialized = 0;
 
    Returns true on success, false otherwise.  */
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+# define X509_STORE_CTX_get0_cert(store_ctx) ((store_ctx)->cert)
+#endif
+
+/* Verify the certificate chain in STORE_CTX, unless the same leaf
+   certificate was verified for the same host a short while ago, in
+   which case that result is reused.  Either way the result ends up
+   in the connection's verify result, which ssl_check_certificate
+   reports.  The host is the connection's app data, set by
+   ssl_connect_wget for the duration of the handshake.  */
+
+static int
+ssl_verify_cert_chain (X509_STORE_CTX *store_ctx, void *arg _GL_UNUSED)
+{
+  SSL *conn = X509_STORE_CTX_get_ex_data (store_ctx,
+                                          SSL_get_ex_data_X509_STORE_CTX_idx ());
+  const char *host = conn ? SSL_get_app_data (conn) : NULL;
+  X509 *leaf = X509_STORE_CTX_get0_cert (store_ctx);
+  unsigned char *der = NULL;
+  int der_len = leaf ? i2d_X509 (leaf, &der) : -1;
+  long result;
+  int ok;
+
+  if (der_len > 0 && cert_verify_cache_get (host, der, der_len, &result))
+    {
+      DEBUGP (("Reusing the verification of %s's certificate.\n", host));
+      X509_STORE_CTX_set_error (store_ctx, (int) result);
+      OPENSSL_free (der);
+      return result == X509_V_OK;
+    }
+
+  ok = X509_verify_cert (store_ctx);
+  if (ok >= 0 && der_len > 0)
+    cert_verify_cache_put (host, der, der_len,
+                           X509_STORE_CTX_get_error (store_ctx));
+  OPENSSL_free (der);
+  return ok;
+}
+
 bool
 ssl_init (void)
 {
@@ -327,6 +388,17 @@ ssl_init (void)
   if (!ssl_ctx)
     goto error;
 
+#ifdef SSL_OP_ENABLE_KTLS
+  /* The kernel takes over the record layer where it can; see
+     openssl_spliceable.  */
+  if (opt.ktls)
+    ssl_options |= SSL_OP_ENABLE_KTLS;
+#else
+  if (opt.ktls)
+    logprintf (LOG_VERBOSE,
+               _("Your OpenSSL version does not support kernel TLS.\n"));
+#endif
+
   if (ssl_options)
     SSL_CTX_set_options (ssl_ctx, ssl_options);
 
@@ -366,41 +438,8 @@ ssl_init (void)
       goto error;
     }
 
-  SSL_CTX_set_default_verify_paths (ssl_ctx);
-
-  /* Start: Windows SSL Cert Changes */
-#ifdef WINDOWS
-  /* Only attempt to use the Windows store if one is not specified */
-  if (!opt.ca_cert)
-  {
-    /* Open the default Windows cert store */
-    void* hStore = CertOpenSystemStoreA(NULL, "ROOT");
-    if (hStore)
-    {
-      /* And then open the OpenSSL store */
-      X509_STORE * store = SSL_CTX_get_cert_store(ssl_ctx);
-      CERT_CONTEXT * pCertCtx = NULL;
-      /* Loop through all the certs in the Windows cert store */
-      for ( pCertCtx = CertEnumCertificatesInStore(hStore, NULL);
-          pCertCtx != NULL;
-          pCertCtx = CertEnumCertificatesInStore(hStore, pCertCtx) )
-      {
-        if ((pCertCtx->dwCertEncodingType & PKCS_7_ASN_ENCODING) != PKCS_7_ASN_ENCODING)
-        {
-          /* Add all certs we find to OpenSSL's store */
-          X509 *cert = d2i_X509(NULL,
-                            (const unsigned char**)&pCertCtx->pbCertEncoded,
-                            pCertCtx->cbCertEncoded);
-          X509_STORE_add_cert(store, cert);
-          X509_free(cert);
-        }
-      }
-    }
-  }
-#endif
-  /* End: Windows SSL Cert Changes */
-
-  SSL_CTX_load_verify_locations (ssl_ctx, opt.ca_cert, opt.ca_directory);
+  /* The CA certificates are loaded by ssl_load_trust, on the first
+     handshake.  */
 
 #ifdef X509_V_FLAG_PARTIAL_CHAIN
   /* Set X509_V_FLAG_PARTIAL_CHAIN to allow the client to anchor trust in
@@ -450,6 +489,7 @@ ssl_init (void)
      ssl_check_certificate, which provides much better diagnostics
      than examining the error stack after a failed SSL_connect.  */
   SSL_CTX_set_verify (ssl_ctx, SSL_VERIFY_NONE, NULL);
+  SSL_CTX_set_cert_verify_callback (ssl_ctx, ssl_verify_cert_chain, NULL);
 
   /* Use the private key from the cert file unless otherwise specified. */
   if (opt.cert_file && !opt.private_key)
@@ -493,9 +533,151 @@ ssl_init (void)
   return false;
 }
 
+/* Whether ssl_load_trust has run.  */
+static bool ssl_trust_loaded;
+
+#ifdef WINDOWS
+/* The Windows ROOT store, kept open for windows_root_by_subject.  */
+static HCERTSTORE windows_root;
+
+/* Add CERT_CTX, a certificate of the Windows store, to STORE.  Returns
+   the certificate, which the caller must free, or NULL.  */
+
+static X509 *
+windows_cert_to_store (X509_STORE *store, PCCERT_CONTEXT cert_ctx)
+{
+  const unsigned char *der = cert_ctx->pbCertEncoded;
+  X509 *cert;
+
+  if ((cert_ctx->dwCertEncodingType & PKCS_7_ASN_ENCODING) == PKCS_7_ASN_ENCODING)
+    return NULL;
+  cert = d2i_X509 (NULL, &der, cert_ctx->cbCertEncoded);
+  if (cert)
+    X509_STORE_add_cert (store, cert);
+  return cert;
+}
+
+#if !defined(LIBRESSL_VERSION_NUMBER) && (OPENSSL_VERSION_NUMBER >= 0x1010009fL)
+# define HAVE_WINDOWS_ROOT_LOOKUP
+
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef const X509_NAME lookup_name_t;
+# else
+typedef X509_NAME lookup_name_t;
+# endif
+
+/* X509_LOOKUP method for --ca-store-lookup: when OpenSSL looks for
+   the issuer NAME while building a chain, copy the certificates of
+   that subject from the Windows ROOT store into the X509 store, and
+   return one of them.  */
+
+static int
+windows_root_by_subject (X509_LOOKUP *lookup, X509_LOOKUP_TYPE type,
+                         lookup_name_t *name, X509_OBJECT *ret)
+{
+  X509_STORE *store = X509_LOOKUP_get_store (lookup);
+  PCCERT_CONTEXT cert_ctx = NULL;
+  CERT_NAME_BLOB blob;
+  unsigned char *der = NULL;
+  int der_len;
+  int found = 0;
+
+  if (type != X509_LU_X509 || !windows_root)
+    return 0;
+  der_len = i2d_X509_NAME ((X509_NAME *) name, &der);
+  if (der_len <= 0)
+    return 0;
+
+  blob.cbData = der_len;
+  blob.pbData = der;
+  while ((cert_ctx = CertFindCertificateInStore (windows_root,
+                                                 X509_ASN_ENCODING, 0,
+                                                 CERT_FIND_SUBJECT_NAME,
+                                                 &blob, cert_ctx)))
+    {
+      /* All of them are added, as a renewed CA keeps its name.  */
+      X509 *cert = windows_cert_to_store (store, cert_ctx);
+      if (cert && !found)
+        found = X509_OBJECT_set1_X509 (ret, cert);
+      X509_free (cert);
+    }
+
+  OPENSSL_free (der);
+  return found;
+}
+#endif /* OpenSSL >= 1.1.0i */
+
+/* Make the certificates of the Windows ROOT store trusted, either by
+   copying them all, or, with --ca-store-lookup, by looking up the
+   issuers in it as chains are verified.  */
+
+static void
+windows_root_load (X509_STORE *store)
+{
+  PCCERT_CONTEXT cert_ctx;
+
+  windows_root = CertOpenSystemStoreA (0, "ROOT");
+  if (!windows_root)
+    return;
+
+#ifdef HAVE_WINDOWS_ROOT_LOOKUP
+  if (opt.ca_store_lookup)
+    {
+      static X509_LOOKUP_METHOD *method;
+
+      if (!method)
+        {
+          method = X509_LOOKUP_meth_new ("Windows ROOT store");
+          if (method)
+            X509_LOOKUP_meth_set_get_by_subject (method,
+                                                 windows_root_by_subject);
+        }
+      if (method && X509_STORE_add_lookup (store, method))
+        return;
+      DEBUGP (("Could not look up the Windows ROOT store, loading it.\n"));
+    }
+#endif
+
+  for (cert_ctx = CertEnumCertificatesInStore (windows_root, NULL);
+       cert_ctx != NULL;
+       cert_ctx = CertEnumCertificatesInStore (windows_root, cert_ctx))
+    X509_free (windows_cert_to_store (store, cert_ctx));
+}
+#endif /* WINDOWS */
+
+/* Load the CA certificates into the store of ssl_ctx.  Parsing a big
+   bundle takes a while, so this is put off until the first handshake
+   rather than done by ssl_init, which also runs for retrievals that
+   end before any connection is made.  */
+
+static void
+ssl_load_trust (void)
+{
+  if (ssl_trust_loaded)
+    return;
+  ssl_trust_loaded = true;
+
+  SSL_CTX_set_default_verify_paths (ssl_ctx);
+
+#ifdef WINDOWS
+  /* Only attempt to use the Windows store if one is not specified */
+  if (!opt.ca_cert)
+    windows_root_load (SSL_CTX_get_cert_store (ssl_ctx));
+#endif
+
+  SSL_CTX_load_verify_locations (ssl_ctx, opt.ca_cert, opt.ca_directory);
+}
+
 void
 ssl_cleanup (void)
 {
+#ifdef WINDOWS
+  if (windows_root)
+    {
+      CertCloseStore (windows_root, 0);
+      windows_root = NULL;
+    }
+#endif
 }
 
 struct openssl_transport_context
@@ -503,6 +685,7 @@ struct openssl_transport_context
   SSL *conn;                    /* SSL connection handle */
   SSL_SESSION *sess;            /* SSL session info */
   char *last_error;             /* last error printed with openssl_errstr */
+  bool ktls_recv;               /* the kernel decrypts what is received */
 };
 
 typedef int (*ssl_fn_t)(SSL *, void *, int);
@@ -759,6 +942,76 @@ openssl_peek (int fd, char *buf, int bufsize, void *arg, double timeout)
   return openssl_read_peek (fd, buf, bufsize, arg, timeout, SSL_peek);
 }
 
+/* Run SSL_read or SSL_write without letting it wait for the socket,
+   as fd_read_nb and fd_write_nb require.  */
+
+static int
+openssl_transfer_nb (int fd, char *buf, int bufsize, void *arg,
+                     int *wait_for, bool writing)
+{
+  struct openssl_transport_context *ctx = arg;
+  SSL *conn = ctx->conn;
+  bool buffered = !writing && SSL_pending (conn);
+  int ret, err;
+
+  if (!buffered)
+    set_socket_nonblocking (fd, true);
+  ERR_clear_error ();
+  do
+    {
+      ret = writing ? SSL_write (conn, buf, bufsize)
+                    : SSL_read (conn, buf, bufsize);
+      err = ret > 0 ? SSL_ERROR_NONE : SSL_get_error (conn, ret);
+    }
+  while (err == SSL_ERROR_SYSCALL && ret == -1 && errno == EINTR);
+  if (!buffered)
+    set_socket_nonblocking (fd, false);
+
+  switch (err)
+    {
+    case SSL_ERROR_WANT_READ:
+      *wait_for = WAIT_FOR_READ;
+      return FD_WOULDBLOCK;
+    case SSL_ERROR_WANT_WRITE:
+      *wait_for = WAIT_FOR_WRITE;
+      return FD_WOULDBLOCK;
+    }
+  return ret;
+}
+
+static int
+openssl_read_nb (int fd, char *buf, int bufsize, void *arg, int *wait_for)
+{
+  return openssl_transfer_nb (fd, buf, bufsize, arg, wait_for, false);
+}
+
+static int
+openssl_write_nb (int fd, char *buf, int bufsize, void *arg, int *wait_for)
+{
+  return openssl_transfer_nb (fd, buf, bufsize, arg, wait_for, true);
+}
+
+static bool
+openssl_pending (int fd _GL_UNUSED, void *arg)
+{
+  struct openssl_transport_context *ctx = arg;
+  return SSL_pending (ctx->conn) > 0;
+}
+
+/* With kernel TLS, what is read from the socket is already plain, as
+   long as OpenSSL holds nothing it has read ahead.  */
+
+static bool
+openssl_spliceable (int fd _GL_UNUSED, void *arg)
+{
+  struct openssl_transport_context *ctx = arg;
+#ifdef BIO_get_ktls_recv
+  return ctx->ktls_recv && !SSL_has_pending (ctx->conn);
+#else
+  return ctx->ktls_recv;
+#endif
+}
+
 static const char *
 openssl_errstr (int fd _GL_UNUSED, void *arg)
 {
@@ -829,7 +1082,9 @@ openssl_close (int fd, void *arg)
 
 static struct transport_implementation openssl_transport = {
   openssl_read, openssl_write, openssl_poll,
-  openssl_peek, openssl_errstr, openssl_close
+  openssl_peek, openssl_errstr, openssl_close,
+  openssl_read_nb, openssl_write_nb, openssl_pending,
+  openssl_spliceable
 };
 
 static const char *
@@ -854,17 +1109,25 @@ _sni_hostname(const char *hostname)
    fd_register_transport, so that subsequent calls to fd_read,
    fd_write, etc., will use the corresponding SSL functions.
 
+   If H2 is non-NULL, HTTP/2 is offered to the server through ALPN,
+   and *H2 is set to whether the server chose it.
+
    Returns true on success, false on failure.  */
 
 bool
-ssl_connect_wget (int fd, const char *hostname, int *continue_session)
+ssl_connect_wget (int fd, const char *hostname, int *continue_session,
+                  bool *h2)
 {
   SSL *conn;
   struct openssl_transport_context *ctx;
 
   DEBUGP (("Initiating SSL handshake.\n"));
 
+  if (h2)
+    *h2 = false;
+
   assert (ssl_ctx != NULL);
+  ssl_load_trust ();
   conn = SSL_new (ssl_ctx);
   if (!conn)
     goto error;
@@ -900,6 +1163,18 @@ ssl_connect_wget (int fd, const char *hostname, int *continue_session)
   if (!SSL_set_fd (conn, FD_TO_SOCKET (fd)))
     goto error;
   SSL_set_connect_state (conn);
+  SSL_set_app_data (conn, (char *) hostname);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(OPENSSL_NO_TLSEXT)
+  if (h2)
+    {
+      /* The protocols in ALPN wire format, preferred first.  */
+      static const unsigned char alpn[] = "\x02h2\x08http/1.1";
+
+      if (SSL_set_alpn_protos (conn, alpn, sizeof (alpn) - 1) != 0)
+        goto error;
+    }
+#endif
 
   /* Re-seed the PRNG before the SSL handshake */
   init_prng ();
@@ -914,9 +1189,29 @@ ssl_connect_wget (int fd, const char *hostname, int *continue_session)
       || !SSL_is_init_finished(conn))
     goto timedout;
 
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(OPENSSL_NO_TLSEXT)
+  if (h2)
+    {
+      const unsigned char *proto;
+      unsigned int len;
+
+      SSL_get0_alpn_selected (conn, &proto, &len);
+      *h2 = len == 2 && 0 == memcmp (proto, "h2", 2);
+    }
+#endif
+
+  /* HOSTNAME is not ours to keep.  */
+  SSL_set_app_data (conn, NULL);
+
   ctx = xnew0 (struct openssl_transport_context);
   ctx->conn = conn;
   ctx->sess = SSL_get0_session (conn);
+#ifdef BIO_get_ktls_recv
+  ctx->ktls_recv = BIO_get_ktls_recv (SSL_get_rbio (conn));
+  if (opt.ktls)
+    DEBUGP (("Kernel TLS %s for receiving on socket %d.\n",
+             ctx->ktls_recv ? "enabled" : "not available", fd));
+#endif
   if (!ctx->sess)
     logprintf (LOG_NOTQUIET, "WARNING: Could not save SSL session data for socket %d\n", fd);
 
@@ -55,6 +55,23 @@ struct options
   bool no_parent;               /* Restrict access to the parent
                                    directory.  */
   int reclevel;                 /* Maximum level of recursion */
+  int preconnect;               /* Number of hosts from the recursion
+                                   queue to connect to ahead of time. */
+  int pipeline;                 /* Number of requests from the recursion
+                                   queue to send ahead on a persistent
+                                   connection. */
+  enum {
+    crawl_order_breadth,
+    crawl_order_documents,
+    crawl_order_pages
+  } crawl_order;                /* How to order the recursion queue. */
+  char *crawl_state;            /* The file to save the state of the
+                                   recursive retrieval to. */
+  bool resume_crawl;            /* Resume the recursive retrieval from
+                                   crawl_state. */
+  char **cluster;               /* The HOST:PORT of the nodes sharing
+                                   the recursive retrieval. */
+  int cluster_node;             /* Which of them this one is. */
   bool dirstruct;               /* Do we build the directory structure
                                    as we go along? */
   bool no_dirstruct;            /* Do we hate dirstruct? */
@@ -63,9 +80,13 @@ struct options
   bool protocol_directories;    /* Whether to prepend "http"/"ftp" to dirs. */
   bool noclobber;               /* Disables clobbering of existing data. */
   bool unlink_requested;        /* remove file before clobbering */
+  bool dedup_files;             /* hard-link identical files together */
   char *dir_prefix;             /* The top of directory tree */
   char *lfilename;              /* Log filename */
   char *input_filename;         /* Input filename */
+  bool input_unique;            /* Skip the URLs of the input file that
+                                   came up before in it. */
+  char *batch_filename;         /* File the batch jobs are read from */
 #ifdef HAVE_METALINK
   char *input_metalink;         /* Input metalink file */
   int metalink_index;           /* Metalink application/metalink4+xml metaurl ordinal number. */
@@ -79,6 +100,8 @@ struct options
   char *default_page;           /* Alternative default page (index file) */
 
   bool spider;                  /* Is Wget in spider mode? */
+  int spider_connections;       /* Connections used to check the links
+                                   a recursive spider doesn't follow. */
 
   char **accepts;               /* List of patterns to accept. */
   char **rejects;               /* List of patterns to reject. */
@@ -109,6 +132,12 @@ struct options
   char **domains;               /* See host.c */
   char **exclude_domains;
   bool dns_cache;               /* whether we cache DNS lookups. */
+  double dns_cache_ttl;         /* how long to cache lookups the
+                                   resolver gives no TTL for. */
+  char *dns_cache_file;         /* where to keep the DNS cache between
+                                   runs. */
+  bool dns_prefetch;            /* whether the hosts of links found while
+                                   recursing are resolved ahead. */
 
   char **follow_tags;           /* List of HTML tags to recursively follow. */
   char **ignore_tags;           /* List of HTML tags to ignore if recursing. */
@@ -122,8 +151,14 @@ struct options
   char *warc_filename;          /* WARC output filename */
   char *warc_tempdir;           /* WARC temp dir */
   char *warc_cdx_dedup_filename;/* CDX file to be used for deduplication. */
+  bool warc_dedup_crawl;        /* Deduplicate payloads within the crawl. */
   wgint warc_maxsize;           /* WARC max archive size */
-  bool warc_compression_enabled;/* For GZIP compression. */
+  bool warc_compression_enabled;/* For GZIP or zstd compression. */
+  bool warc_compression_zstd;   /* Compress with zstd rather than GZIP. */
+  char *warc_zstd_dictionary;   /* The zstd dictionary for the records,
+                                   or NULL to train one. */
+  int warc_compression_threads; /* How many threads compress WARC
+                                   records; 0 for one per processor. */
   bool warc_digests_enabled;    /* For SHA1 digests. */
   bool warc_cdx_enabled;        /* Create CDX files? */
   bool warc_keep_log;           /* Store the log file in a WARC record. */
@@ -143,6 +178,9 @@ struct options
   bool netrc;                   /* Whether to read .netrc. */
   bool ftp_glob;                /* FTP globbing */
   bool ftp_pasv;                /* Passive FTP. */
+  int ftp_connections;          /* Control connections used by
+                                   recursive FTP retrievals. */
+  bool ftp_pipelining;          /* Send the setup commands at once. */
 
   char *http_user;              /* HTTP username. */
   char *http_passwd;            /* HTTP password. */
@@ -151,6 +189,7 @@ struct options
 
   bool use_proxy;               /* Do we use proxy? */
   bool allow_cache;             /* Do we allow server-side caching? */
+  char *http_cache;             /* Directory of the local HTTP cache. */
   char *http_proxy, *ftp_proxy, *https_proxy;
   char **no_proxy;
   char *base_href;
@@ -171,8 +210,19 @@ struct options
 
   wgint limit_rate;             /* Limit the download rate to this
                                    many bps. */
+  wgint limit_rate_per_host;    /* Limit the rate of the connections
+                                   to each host to this many bps. */
   wgint quota;                  /* Maximum file size to download and
                                    store. */
+  int segments;                 /* Number of connections to split a
+                                   single HTTP download across. */
+  double flush_interval;        /* Flush downloaded data at most this
+                                   often; 0 flushes after every read. */
+  bool preallocate;             /* Reserve disk space for downloads of
+                                   known length. */
+#ifdef HAVE_LIBURING
+  bool io_uring;                /* Receive bodies through io_uring. */
+#endif
 
   bool server_response;         /* Do we print server response? */
   bool save_headers;            /* Do we save headers together with
@@ -181,6 +231,9 @@ struct options
                                    status code indicates a server error */
 
   bool debug;                   /* Debugging on/off */
+  bool debug_startup;           /* Print the time spent in each
+                                   startup phase. */
+  bool stats;                   /* Print operation counters at exit. */
 
 #ifdef USE_WATT32
   bool wdebug;                  /* Watt-32 tcp/ip debugging on/off */
@@ -188,6 +241,10 @@ struct options
 
   bool timestamping;            /* Whether to use time-stamping. */
   bool if_modified_since;       /* Whether to use conditional get requests.  */
+  char *validators_file;        /* Where -N keeps the ETag and
+                                   Last-Modified of retrieved files. */
+  bool zsync;                   /* Whether -N updates files from
+                                   their zsync control files. */
 
   bool backup_converted;        /* Do we save pre-converted files as *.orig? */
   int backups;                  /* Are numeric backups made? */
@@ -201,6 +258,8 @@ struct options
                                    locally? */
   bool convert_file_only;       /* Convert only the file portion of the URI (i.e. basename).
                                    Leave everything else untouched. */
+  int convert_threads;          /* How many threads convert links;
+                                   0 for one per processor. */
 
   bool remove_listing;          /* Do we remove .listing files
                                    generated by FTP? */
@@ -221,6 +280,11 @@ struct options
   bool page_requisites;         /* Whether we need to download all files
                                    necessary to display a page properly. */
   char *bind_address;           /* What local IP address to bind to. */
+  wgint tcp_rcvbuf;             /* socket buffer sizes, 0 for the */
+  wgint tcp_sndbuf;             /*  system's default */
+  bool tcp_nodelay;             /* disable Nagle's algorithm */
+  bool tcp_fastopen;            /* use TCP Fast Open where possible */
+  char *tcp_congestion;         /* congestion control algorithm */
 
 #ifdef HAVE_SSL
   enum {
@@ -246,6 +310,9 @@ struct options
 
   char *ca_directory;           /* CA directory (hash files) */
   char *ca_cert;                /* CA certificate file to use */
+  bool ca_store_lookup;         /* look up CAs in the system store as
+                                   needed, rather than loading it */
+  bool ktls;                    /* hand the record layer to the kernel */
   char *crl_file;               /* file with CRLs */
 
   char *pinnedpubkey;           /* Public key (PEM/DER) file, or any number
@@ -267,6 +334,8 @@ struct options
   bool cookies;                 /* whether cookies are used. */
   char *cookies_input;          /* file we're loading the cookies from. */
   char *cookies_output;         /* file we're saving the cookies to. */
+  bool cookies_index;           /* whether the cookies file is read
+                                   through an index. */
   bool keep_badhash;            /* Keep files with checksum mismatch. */
   bool keep_session_cookies;    /* whether session cookies should be
                                    saved and loaded. */
@@ -331,21 +400,38 @@ struct options
                                    name. */
   bool report_bps;              /*Output bandwidth in bits format*/
 
-#ifdef HAVE_LIBZ
+#ifdef HAVE_COMPRESSION
   enum compression_options {
     compression_auto,
     compression_gzip,
-    compression_none
+    compression_none,
+    compression_brotli,
+    compression_zstd
   } compression;                /* type of HTTP compression to use */
 #endif
 
   char *rejected_log;           /* The file to log rejected URLS to. */
+  char *metrics_file;           /* The file to append transfer metrics
+                                   to. */
+  char *status_file;            /* The file to keep the status report
+                                   in. */
 
 #ifdef HAVE_HSTS
   bool hsts;
   char *hsts_file;
 #endif
 
+#ifdef HAVE_NGHTTP2
+  bool http2;                   /* whether to offer HTTP/2 to HTTPS
+                                   servers */
+#endif
+
+#ifdef HAVE_HTTP3
+  bool http3;                   /* whether to use the HTTP/3 alternatives
+                                   of HTTPS servers */
+  char *altsvc_file;
+#endif
+
   const char *homedir;          /* the homedir of the running process */
   const char *wgetrcfile;       /* the wgetrc file to be loaded */
 };
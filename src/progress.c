@@ -52,6 +52,8 @@ struct progress_implementation {
   void (*draw) (void *);
   void (*finish) (void *, double);
   void (*set_params) (const char *);
+  void (*set_connection) (void *, int, const char *, wgint, wgint);
+  void (*set_waiting) (void *, int);
 };
 
 /* Necessary forward declarations. */
@@ -67,10 +69,14 @@ static void bar_update (void *, wgint, double);
 static void bar_draw (void *);
 static void bar_finish (void *, double);
 static void bar_set_params (const char *);
+static void bar_set_connection (void *, int, const char *, wgint, wgint);
+static void bar_set_waiting (void *, int);
 
 static struct progress_implementation implementations[] = {
-  { "dot", 0, dot_create, dot_update, dot_draw, dot_finish, dot_set_params },
-  { "bar", 1, bar_create, bar_update, bar_draw, bar_finish, bar_set_params }
+  { "dot", 0, dot_create, dot_update, dot_draw, dot_finish, dot_set_params,
+    NULL, NULL },
+  { "bar", 1, bar_create, bar_update, bar_draw, bar_finish, bar_set_params,
+    bar_set_connection, bar_set_waiting }
 };
 static struct progress_implementation *current_impl;
 static int current_impl_locked;
@@ -197,6 +203,32 @@ progress_update (void *progress, wgint howmuch, double dltime)
   current_impl->draw (progress);
 }
 
+/* Tell the progress gauge what connection number CONN of a download
+   spread over several connections is doing: it has received DONE of
+   the SIZE bytes of its current range or file, LABEL (or "#CONN" if
+   LABEL is NULL) naming that range or file.  A negative SIZE means
+   the connection is idle.  The aggregate count is still reported with
+   progress_update; implementations that can't show connections
+   separately simply ignore this.  */
+
+void
+progress_set_connection (void *progress, int conn, const char *label,
+                         wgint done, wgint size)
+{
+  if (current_impl->set_connection)
+    current_impl->set_connection (progress, conn, label, done, size);
+}
+
+/* Tell the progress gauge how many ranges or files are still waiting
+   for a free connection.  */
+
+void
+progress_set_waiting (void *progress, int waiting)
+{
+  if (current_impl->set_waiting)
+    current_impl->set_waiting (progress, waiting);
+}
+
 /* Tell the progress gauge to clean up.  Calling this will free the
    PROGRESS object, the further use of which is not allowed.  */
 
@@ -587,6 +619,13 @@ static volatile sig_atomic_t received_sigwinch;
    This allows ETA to change approximately once per second.  */
 #define ETA_REFRESH_INTERVAL 0.99
 
+/* The number of connections of one download that get a row of their
+   own under the progress bar.  */
+#define MAX_PROGRESS_CONNECTIONS 16
+
+/* Width of the small bar in a connection row. */
+#define CONN_BAR_WIDTH 20
+
 struct bar_progress {
   char *f_download;             /* Filename of the downloaded file */
   wgint initial_length;         /* how many bytes have been downloaded
@@ -640,6 +679,19 @@ struct bar_progress {
                                    speed and ETA, measured since the
                                    beginning of download. */
   int last_eta_value;
+
+  /* Per-connection state of a download spread over several
+     connections, drawn as rows under the bar.  */
+  struct bar_connection {
+    char *label;                /* file or range name, NULL for "#N" */
+    wgint done;                 /* bytes received of the current range */
+    wgint size;                 /* size of the range, negative if idle */
+  } conns[MAX_PROGRESS_CONNECTIONS];
+  int nconns;                   /* highest connection number used + 1 */
+  int waiting;                  /* ranges waiting for a connection */
+  int rows;                     /* rows drawn under the bar last time */
+  bool multirow;                /* whether the terminal lets us move
+                                   the cursor back up to the bar */
 };
 
 static void create_image (struct bar_progress *, double, bool);
@@ -711,6 +763,30 @@ prepare_filename (char *dest, const char *src)
 }
 #endif /* USE_NLS_PROGRESS_BAR */
 
+/* Return true if the terminal understands the ANSI sequences used to
+   draw connection rows under the bar and move back up to it.  Windows
+   consoles understand them only once asked to.  */
+
+static bool
+multirow_supported (void)
+{
+#ifdef WINDOWS
+# ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#  define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+# endif
+  HANDLE h = GetStdHandle (STD_ERROR_HANDLE);
+  DWORD mode;
+
+  if (!GetConsoleMode (h, &mode))
+    return false;
+  if (mode & ENABLE_VIRTUAL_TERMINAL_PROCESSING)
+    return true;
+  return SetConsoleMode (h, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING) != 0;
+#else
+  return true;
+#endif
+}
+
 static void *
 bar_create (const char *f_download, wgint initial, wgint total)
 {
@@ -747,6 +823,7 @@ bar_create (const char *f_download, wgint initial, wgint total)
    * for multibyte characters. */
 #define BUF_LEN (bp->width * 2 + 100)
   bp->buffer = xcalloc (BUF_LEN, 1);
+  bp->multirow = multirow_supported ();
 
   logputs (LOG_VERBOSE, "\n");
 
@@ -757,6 +834,7 @@ bar_create (const char *f_download, wgint initial, wgint total)
 }
 
 static void update_speed_ring (struct bar_progress *, wgint, double);
+static void draw_connections (struct bar_progress *);
 
 static void
 bar_update (void *progress, wgint howmuch, double dltime)
@@ -811,6 +889,8 @@ bar_draw (void *progress)
 
   create_image (bp, bp->dltime, false);
   display_image (bp->buffer);
+  if (bp->multirow && (bp->nconns > 1 || bp->rows))
+    draw_connections (bp);
   bp->last_screen_update = bp->dltime;
 }
 
@@ -826,10 +906,16 @@ bar_finish (void *progress, double dltime)
 
   create_image (bp, dltime, true);
   display_image (bp->buffer);
+  if (bp->rows)
+    /* The connection rows are of no interest once the download is
+       over; erase them.  */
+    logputs (LOG_PROGRESS, "\033[J");
 
   logputs (LOG_VERBOSE, "\n");
   logputs (LOG_PROGRESS, "\n");
 
+  for (int i = 0; i < bp->nconns; i++)
+    xfree (bp->conns[i].label);
   xfree (bp->f_download);
   xfree (bp->buffer);
   xfree (bp);
@@ -1362,6 +1448,118 @@ display_image (char *buf)
   log_set_save_context (old);
 }
 
+static void
+bar_set_connection (void *progress, int conn, const char *label,
+                    wgint done, wgint size)
+{
+  struct bar_progress *bp = progress;
+  struct bar_connection *c;
+
+  if (conn < 0 || conn >= MAX_PROGRESS_CONNECTIONS)
+    return;
+  c = &bp->conns[conn];
+  for (int i = bp->nconns; i <= conn; i++)
+    bp->conns[i].size = -1;
+  if (conn >= bp->nconns)
+    bp->nconns = conn + 1;
+
+  if (!label)
+    xfree (c->label);
+  else if (!c->label || strcmp (c->label, label))
+    {
+      xfree (c->label);
+      c->label = xmalloc (prepare_filename (NULL, label));
+      prepare_filename (c->label, label);
+    }
+  c->done = done;
+  c->size = size;
+}
+
+static void
+bar_set_waiting (void *progress, int waiting)
+{
+  struct bar_progress *bp = progress;
+  bp->waiting = waiting;
+}
+
+/* Draw a row per connection under the bar, followed by a line
+   counting busy connections and waiting ranges, then move the cursor
+   back up to the bar, which display_image overwrites next time.  */
+
+static void
+draw_connections (struct bar_progress *bp)
+{
+  char *row = xmalloc (bp->width + 1);
+  char done_str[8], size_str[8];
+  /* "  " label " [" bar "] " "100% " "1023K/1023K" */
+  int label_width = bp->width - 2 - 1 - (CONN_BAR_WIDTH + 2) - 5 - 11;
+  int busy = 0;
+  bool old = log_set_save_context (false);
+
+  /* Clear whatever the previous rows left below the bar. */
+  logputs (LOG_PROGRESS, "\033[J");
+  for (int i = 0; i < bp->nconns; i++)
+    {
+      struct bar_connection *c = &bp->conns[i];
+      char num[16];
+      const char *label = c->label;
+      int len;
+
+      if (!label)
+        {
+          snprintf (num, sizeof num, "#%d", i + 1);
+          label = num;
+        }
+      len = strlen (label);
+      if (len > label_width)
+        /* Keep the end of the label, which is what tells files in the
+           same directory apart.  */
+        label += len - label_width;
+
+      if (c->size < 0)
+        snprintf (row, bp->width + 1, "  %-*.*s %s", label_width, label_width,
+                  label, _("idle"));
+      else
+        {
+          char bar[CONN_BAR_WIDTH + 1];
+          int fill = c->size > 0 ? (int) (CONN_BAR_WIDTH * (double) c->done
+                                          / c->size) : 0;
+          int pct = c->size > 0 ? (int) (100.0 * c->done / c->size) : 0;
+
+          if (fill > CONN_BAR_WIDTH)
+            fill = CONN_BAR_WIDTH;
+          if (pct > 100)
+            pct = 100;
+          memset (bar, '=', fill);
+          memset (bar + fill, ' ', CONN_BAR_WIDTH - fill);
+          bar[CONN_BAR_WIDTH] = '\0';
+          snprintf (done_str, sizeof done_str, "%s",
+                    human_readable (c->done, 10, 1));
+          snprintf (size_str, sizeof size_str, "%s",
+                    human_readable (c->size, 10, 1));
+          snprintf (row, bp->width + 1, "  %-*.*s [%s] %3d%% %5s/%-5s",
+                    label_width, label_width, label, bar, pct,
+                    done_str, size_str);
+          busy++;
+        }
+      logputs (LOG_PROGRESS, "\n");
+      logputs (LOG_PROGRESS, row);
+    }
+
+  if (bp->waiting)
+    snprintf (row, bp->width + 1, _("  connections: %d busy, %d waiting"),
+              busy, bp->waiting);
+  else
+    snprintf (row, bp->width + 1, _("  connections: %d busy"), busy);
+  logputs (LOG_PROGRESS, "\n");
+  logputs (LOG_PROGRESS, row);
+
+  bp->rows = bp->nconns + 1;
+  logprintf (LOG_PROGRESS, "\033[%dA", bp->rows);
+  log_set_save_context (old);
+  xfree (row);
+}
+
 static void
 bar_set_params (const char *params)
 {
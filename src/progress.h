@@ -38,6 +38,8 @@ void progress_schedule_redirect (void);
 void *progress_create (const char *, wgint, wgint);
 bool progress_interactive_p (void *);
 void progress_update (void *, wgint, double);
+void progress_set_connection (void *, int, const char *, wgint, wgint);
+void progress_set_waiting (void *, int);
 void progress_finish (void *, double);
 
 void progress_handle_sigwinch (int);
@@ -36,6 +36,7 @@ as that of the covered work.  */
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 
 #include "url.h"
 #include "recur.h"
@@ -50,6 +51,15 @@ as that of the covered work.  */
 #include "css-url.h"
 #include "spider.h"
 #include "exits.h"
+#include "connect.h"
+#include "http.h"
+#include "urlset.h"
+#include "status.h"
+#include "cluster.h"
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
 
 /* Functions for maintaining the URL queue.  */
 
@@ -61,15 +71,56 @@ struct queue_element {
                                    be treated as HTML. */
   bool css_allowed;             /* whether the document is allowed to
                                    be treated as CSS. */
+  bool requisite;               /* whether it is needed to display the
+                                   page that links to it */
+  int rank;                     /* where it goes in the queue */
   struct queue_element *next;   /* next element in queue */
 };
 
+/* The ranks of the queued URLs, in the order they are retrieved.  URLs
+   of the same rank are retrieved in the order they were queued.  With
+   --crawl-order=breadth all the URLs have the same rank.  */
+enum {
+  RANK_REQUISITE,               /* the requisites of the last page */
+  RANK_DOCUMENT,                /* HTML and CSS, which have links */
+  RANK_OTHER,                   /* the rest */
+  RANK_COUNT
+};
+
+/* At most this many queued URLs are kept in memory.  The ones queued
+   after them wait in a temporary file, and are read back in batches of
+   half as many when the queue in memory runs empty.  */
+#define QUEUE_MEMORY_MAX 16384
+
+/* Queue elements are allocated this many at a time, and kept on a
+   free list once dequeued, so that enqueuing and dequeuing only take
+   an element off the list and put it back.  */
+#define QUEUE_SLAB_SIZE 256
+
+struct queue_slab {
+  struct queue_slab *next;
+  struct queue_element elements[QUEUE_SLAB_SIZE];
+};
+
 struct url_queue {
   struct queue_element *head;
   struct queue_element *tail;
+  struct queue_element *last[RANK_COUNT]; /* the last of each rank */
   int count, maxcount;
+  int in_memory;                /* the number of elements in the list */
+  FILE *spill;                  /* the elements that follow, or NULL */
+  int spilled;                  /* the number of elements in SPILL */
+  off_t spill_pos;              /* where the next one starts */
+  bool spill_failed;            /* don't try to spill again */
+  struct queue_slab *slabs;     /* the memory of all the elements */
+  struct queue_element *free;   /* the elements not in use */
 };
 
+/* The queue and the blacklist of the recursive retrieval in progress,
+   for the status report.  */
+static struct url_queue *tree_queue;
+static struct url_set *tree_blacklist;
+
 /* Create a URL queue. */
 
 static struct url_queue *
@@ -79,29 +130,238 @@ url_queue_new (void)
   return queue;
 }
 
-/* Delete a URL queue. */
+/* Delete a URL queue, with what is left in it. */
 
 static void
 url_queue_delete (struct url_queue *queue)
 {
+  struct queue_element *qel;
+  struct queue_slab *slab, *next;
+
+  for (qel = queue->head; qel; qel = qel->next)
+    {
+      url_free (qel->url);
+      xfree (qel->referer);
+    }
+  for (slab = queue->slabs; slab; slab = next)
+    {
+      next = slab->next;
+      xfree (slab);
+    }
+  if (queue->spill)
+    fclose (queue->spill);
   xfree (queue);
 }
 
+/* Get an unused element for QUEUE.  */
+
+static struct queue_element *
+queue_element_new (struct url_queue *queue)
+{
+  struct queue_element *qel;
+
+  if (!queue->free)
+    {
+      MEMACCT_ENTER (memacct_saved, MEMACCT_QUEUE);
+      struct queue_slab *slab = xnew (struct queue_slab);
+      int i;
+
+      slab->next = queue->slabs;
+      queue->slabs = slab;
+      for (i = QUEUE_SLAB_SIZE - 1; i >= 0; i--)
+        {
+          slab->elements[i].next = queue->free;
+          queue->free = &slab->elements[i];
+        }
+      MEMACCT_LEAVE (memacct_saved);
+    }
+
+  qel = queue->free;
+  queue->free = qel->next;
+  return qel;
+}
+
+/* Give QEL back to QUEUE, once its contents are taken care of.  */
+
+static void
+queue_element_release (struct url_queue *queue, struct queue_element *qel)
+{
+  qel->next = queue->free;
+  queue->free = qel;
+}
+
+/* Write QEL to FP, as a record of the spill file or of the saved
+   state of the crawl.  */
+
+static void
+queue_element_write (FILE *fp, const struct queue_element *qel)
+{
+  fput_int (fp, qel->depth);
+  fput_int (fp, qel->html_allowed | qel->css_allowed << 1
+           | qel->requisite << 2);
+  fput_string (fp, qel->referer);
+  url_write (fp, qel->url);
+}
+
+/* Read an element written by queue_element_write from FP into QEL.
+   Return false on error.  */
+
+static bool
+queue_element_read (FILE *fp, struct queue_element *qel)
+{
+  int flags;
+  char *referer = NULL;
+
+  if (!fget_int (fp, &qel->depth)
+      || !fget_int (fp, &flags)
+      || !fget_string (fp, &referer)
+      || !(qel->url = url_read (fp)))
+    {
+      xfree (referer);
+      return false;
+    }
+  qel->referer = referer;
+  qel->html_allowed = flags & 1;
+  qel->css_allowed = (flags & 2) != 0;
+  qel->requisite = (flags & 4) != 0;
+  return true;
+}
+
+/* Write QEL to the end of the spill file.  Return false if that
+   failed, in which case nothing has been freed.  */
+
+static bool
+url_queue_spill (struct url_queue *queue, const struct queue_element *qel)
+{
+  if (!queue->spill)
+    {
+      queue->spill = temp_file (NULL);
+      if (!queue->spill)
+        return false;
+      DEBUGP (("Spilling the queue to a temporary file.\n"));
+    }
+
+  if (fseeko (queue->spill, 0, SEEK_END) != 0)
+    return false;
+  queue_element_write (queue->spill, qel);
+  return !ferror (queue->spill);
+}
+
+/* Decide the rank of QEL according to --crawl-order.  The documents
+   that may have links are taken before the rest, which doesn't change
+   the depth at which any of them is found: among themselves they are
+   still taken in the order they were queued.  With
+   --crawl-order=pages, the requisites of a page other than frames come
+   before all that, right after the page.  */
+
+static int
+queue_element_rank (const struct queue_element *qel)
+{
+  switch (opt.crawl_order)
+    {
+    case crawl_order_pages:
+      if (qel->requisite && !qel->html_allowed)
+        return RANK_REQUISITE;
+      /* fall through */
+    case crawl_order_documents:
+      if (qel->html_allowed || qel->css_allowed)
+        return RANK_DOCUMENT;
+      return RANK_OTHER;
+    default:
+      return RANK_DOCUMENT;
+    }
+}
+
+/* Put QEL in the list in memory, after the elements of its rank and
+   the ones before.  */
+
+static void
+url_queue_insert (struct url_queue *queue, struct queue_element *qel)
+{
+  struct queue_element *prev = NULL;
+  int rank;
+
+  qel->rank = queue_element_rank (qel);
+  for (rank = qel->rank; rank >= 0 && !prev; rank--)
+    prev = queue->last[rank];
+  queue->last[qel->rank] = qel;
+
+  if (prev)
+    {
+      qel->next = prev->next;
+      prev->next = qel;
+    }
+  else
+    {
+      qel->next = queue->head;
+      queue->head = qel;
+    }
+  if (queue->tail == prev)
+    queue->tail = qel;
+  ++queue->in_memory;
+}
+
+/* Move the next batch of spilled elements into memory.  */
+
+static void
+url_queue_refill (struct url_queue *queue)
+{
+  int n;
+
+  if (fseeko (queue->spill, queue->spill_pos, SEEK_SET) != 0)
+    n = 0;
+  else
+    for (n = 0; n < QUEUE_MEMORY_MAX / 2 && queue->spilled > 0; n++)
+      {
+        struct queue_element *qel = queue_element_new (queue);
+        if (!queue_element_read (queue->spill, qel))
+          {
+            queue_element_release (queue, qel);
+            break;
+          }
+        url_queue_insert (queue, qel);
+        --queue->spilled;
+      }
+  queue->spill_pos = ftello (queue->spill);
+
+  if (queue->spilled > 0 && n == 0)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot read the queue back from its "
+                                 "temporary file: %s\n"), strerror (errno));
+      queue->count -= queue->spilled;
+      queue->spilled = 0;
+    }
+
+  /* Start the file over once it has been read back entirely.  */
+  if (queue->spilled == 0)
+    {
+      fflush (queue->spill);
+      if (ftruncate (fileno (queue->spill), 0) == 0)
+        queue->spill_pos = 0;
+    }
+}
+
 /* Enqueue a URL in the queue.  The queue is FIFO: the items will be
    retrieved ("dequeued") from the queue in the order they were placed
-   into it.  */
+   into it, within each of the ranks decided by --crawl-order.
+   REQUISITE tells whether the URL is needed to display the page that
+   links to it.
+
+   The ranks only order the URLs kept in memory, which come before the
+   spilled ones.  */
 
 static void
 url_enqueue (struct url_queue *queue, struct url *url,
              const char *referer, int depth,
-             bool html_allowed, bool css_allowed)
+             bool html_allowed, bool css_allowed, bool requisite)
 {
-  struct queue_element *qel = xnew (struct queue_element);
+  struct queue_element *qel = queue_element_new (queue);
   qel->url = url;
   qel->referer = referer;
   qel->depth = depth;
   qel->html_allowed = html_allowed;
   qel->css_allowed = css_allowed;
+  qel->requisite = requisite;
   qel->next = NULL;
 
   ++queue->count;
@@ -116,30 +376,91 @@ url_enqueue (struct url_queue *queue, struct url *url,
                         : "None"), depth));
   DEBUGP (("Queue count %d, maxcount %d.\n", queue->count, queue->maxcount));
 
-  if (queue->tail)
-    queue->tail->next = qel;
-  queue->tail = qel;
+  /* Once elements are spilled, the following ones must be too, to
+     keep them in order.  The requisites of the page just retrieved are
+     few, and are kept in memory to be taken next.  */
+  if ((queue->spilled > 0 || queue->in_memory >= QUEUE_MEMORY_MAX)
+      && !queue->spill_failed
+      && queue_element_rank (qel) != RANK_REQUISITE)
+    {
+      if (url_queue_spill (queue, qel))
+        {
+          ++queue->spilled;
+          url_free (url);
+          xfree (qel->referer);
+          queue_element_release (queue, qel);
+          return;
+        }
+      logprintf (LOG_NOTQUIET, _("Cannot write the queue to a temporary "
+                                 "file, keeping it in memory: %s\n"),
+                 strerror (errno));
+      queue->spill_failed = true;
+    }
 
-  if (!queue->head)
-    queue->head = queue->tail;
+  url_queue_insert (queue, qel);
+}
+
+/* How many queued URLs to look at for one whose host can be visited
+   at once, when the host of the first has to be waited for.  */
+#define POLITENESS_LOOKAHEAD 256
+
+/* Take the element that follows PREV, or the first one if PREV is
+   NULL, out of the list in memory.  */
+
+static struct queue_element *
+url_queue_unlink (struct url_queue *queue, struct queue_element *prev)
+{
+  struct queue_element *qel = prev ? prev->next : queue->head;
+
+  if (prev)
+    prev->next = qel->next;
+  else
+    queue->head = qel->next;
+  if (queue->tail == qel)
+    queue->tail = prev;
+  if (queue->last[qel->rank] == qel)
+    queue->last[qel->rank] = prev && prev->rank == qel->rank ? prev : NULL;
+  --queue->in_memory;
+  return qel;
 }
 
 /* Take a URL out of the queue.  Return true if this operation
-   succeeded, or false if the queue is empty.  */
+   succeeded, or false if the queue is empty.
+
+   The URLs come out in the order of url_enqueue, except when
+   --wait or a Crawl-delay has the host of the first one waited for:
+   then the first URL of the next few whose host can be visited right
+   away is taken instead.  */
 
 static bool
 url_dequeue (struct url_queue *queue, struct url **url,
              const char **referer, int *depth,
              bool *html_allowed, bool *css_allowed)
 {
-  struct queue_element *qel = queue->head;
+  struct queue_element *qel, *prev = NULL;
 
-  if (!qel)
-    return false;
+  if (!queue->head && queue->spilled > 0)
+    url_queue_refill (queue);
 
-  queue->head = queue->head->next;
   if (!queue->head)
-    queue->tail = NULL;
+    return false;
+
+  if (politeness_delay (queue->head->url) > 0)
+    {
+      int i;
+      for (qel = queue->head, i = 0;
+           qel->next && i < POLITENESS_LOOKAHEAD;
+           qel = qel->next, i++)
+        if (politeness_delay (qel->next->url) == 0)
+          {
+            prev = qel;
+            DEBUGP (("Taking %s out of turn while %s is waited for.\n",
+                     quote_n (0, qel->next->url->host),
+                     quote_n (1, queue->head->url->host)));
+            break;
+          }
+    }
+  qel = url_queue_unlink (queue, prev);
 
   *url = qel->url;
   *referer = qel->referer;
@@ -153,46 +474,470 @@ url_dequeue (struct url_queue *queue, struct url **url,
            quotearg_n_style (0, escape_quoting_style, qel->url->url), qel->depth));
   DEBUGP (("Queue count %d, maxcount %d.\n", queue->count, queue->maxcount));
 
-  xfree (qel);
+  queue_element_release (queue, qel);
+  return true;
+}
+
+/* How many queued URLs to look at when deciding which hosts to
+   preconnect to.  */
+#define PRECONNECT_LOOKAHEAD 64
+
+/* Start connections to the hosts of the URLs at the head of QUEUE,
+   other than CURRENT, which we are about to download.  Hosts to which
+   a persistent connection already exists or which are reached through
+   a proxy are skipped.  */
+
+static void
+preconnect_queued_hosts (const struct url_queue *queue,
+                         const struct url *current)
+{
+  const struct queue_element *qel;
+  int seen;
+
+  for (qel = queue->head, seen = 0;
+       qel && seen < PRECONNECT_LOOKAHEAD;
+       qel = qel->next, seen++)
+    {
+      struct url *u = qel->url;
+      bool ssl = false;
+
+      if (u->port == current->port && URL_SAME_HOST (u, current))
+        continue;
+      if (url_uses_proxy (u))
+        continue;
+#ifdef HAVE_SSL
+      ssl = u->scheme == SCHEME_HTTPS;
+#endif
+      if (u->scheme != SCHEME_FTP
+#ifdef HAVE_SSL
+          && u->scheme != SCHEME_FTPS
+#endif
+          && persistent_connection_exists_p (u->host, u->port, ssl))
+        continue;
+
+      preconnect_to_host (u->host, u->port, opt.preconnect);
+    }
+}
+
+/* Tell the HTTP code about the URLs at the head of QUEUE that are on
+   the same host as CURRENT, which we are about to download, so that
+   their requests can be pipelined on its connection, or opened as
+   streams ahead of time over HTTP/2.  The run stops
+   at the first URL on another host, which will need the connection
+   to itself.  */
+
+static void
+pipeline_queued_urls (const struct url_queue *queue, struct url *current)
+{
+  const struct queue_element *qel;
+
+  http_pipeline_hints_clear ();
+  if (current->scheme != SCHEME_HTTP
+#ifdef HAVE_SSL
+      && current->scheme != SCHEME_HTTPS
+#endif
+      )
+    return;
+  if (url_uses_proxy (current))
+    return;
+
+  for (qel = queue->head; qel; qel = qel->next)
+    {
+      struct url *u = qel->url;
+
+      if (u->scheme != current->scheme || u->port != current->port
+          || !URL_SAME_HOST (u, current))
+        break;
+      /* Already downloaded URLs are not retrieved again.  */
+      if (dl_url_file_map && hash_table_contains (dl_url_file_map, u->url))
+        continue;
+      http_pipeline_hint (u, qel->referer);
+    }
+}
+
+/* Start resolving the hosts of the CHILDREN of PARENT that are likely
+   to be followed.  download_child checks them one at a time, and
+   retrieving robots.txt from a new host has to wait for its lookup;
+   resolved ahead, the hosts of the links that come later are known by
+   the time they are checked.  Only the cheap host checks of
+   download_child are done here.  */
+
+static void
+prefetch_child_hosts (const struct urlpos *children,
+                      const struct url *parent, bool dash_p_leaf_HTML)
+{
+  const struct urlpos *child;
+
+  /* Without -H, the links are on hosts already resolved.  */
+  if (!opt.spanhost || !opt.dns_prefetch)
+    return;
+
+  for (child = children; child; child = child->next)
+    {
+      struct url *u = child->url;
+
+      if (child->ignore_when_downloading
+          || (dash_p_leaf_HTML && !child->link_inline_p))
+        continue;
+      if (URL_SAME_HOST (parent, u))
+        continue;
+      if (!accept_domain (u) || url_uses_proxy (u))
+        continue;
+      prefetch_host (u->host);
+    }
+}
+
+/* Saving the state of the crawl with --crawl-state, and picking it up
+   again with --resume-crawl.
+
+   The state file holds the start URLs whose retrieval is complete,
+   the tables of downloaded files kept by convert.c, and, when a
+   retrieval is under way, its start URL, blacklist and queue.  It is
+   written anew after every CHECKPOINT_URLS retrieved URLs or every
+   CHECKPOINT_SECONDS seconds, whichever comes first, and when
+   retrieve_tree returns.  URLs retrieved since the last save are
+   retrieved again when resuming; the others are known to be done and
+   are not touched.  */
+
+#define CHECKPOINT_URLS 100
+#define CHECKPOINT_SECONDS 60
+
+#define CRAWL_STATE_MAGIC "Wget crawl state 2"
+
+/* The start URLs whose retrieval is complete.  */
+static struct hash_table *finished_trees;
+
+/* What was read from the state file, until used by the retrieve_tree
+   it belongs to.  */
+static struct {
+  bool loaded;
+  char *start_url;              /* the retrieval under way, or NULL */
+  struct url_set *blacklist;    /* its blacklist */
+  FILE *fp;                     /* positioned at its queue */
+} resume;
+
+/* Write the elements of QUEUE to FP, in order.  Return false if the
+   spilled ones couldn't be read.  */
+
+static bool
+url_queue_write (FILE *fp, struct url_queue *queue)
+{
+  const struct queue_element *qel;
+
+  fput_int (fp, queue->in_memory + queue->spilled);
+  for (qel = queue->head; qel; qel = qel->next)
+    queue_element_write (fp, qel);
+
+  /* The spilled elements are in the same format already.  */
+  if (queue->spilled > 0)
+    {
+      char buf[8192];
+      size_t n;
+
+      if (fseeko (queue->spill, queue->spill_pos, SEEK_SET) != 0)
+        return false;
+      while ((n = fread (buf, 1, sizeof (buf), queue->spill)) > 0)
+        fwrite (buf, 1, n, fp);
+      if (ferror (queue->spill))
+        return false;
+    }
   return true;
 }
 
-static void blacklist_add (struct hash_table *blacklist, const char *url)
+static void
+write_finished_trees (FILE *fp)
 {
-  char *url_unescaped = xstrdup (url);
+  hash_table_iterator iter;
 
-  url_unescape (url_unescaped);
-  string_set_add (blacklist, url_unescaped);
-  xfree (url_unescaped);
+  fput_int (fp, finished_trees ? hash_table_count (finished_trees) : 0);
+  if (finished_trees)
+    for (hash_table_iterate (finished_trees, &iter);
+         hash_table_iter_next (&iter); )
+      fput_string (fp, iter.key);
 }
 
-static int blacklist_contains (struct hash_table *blacklist, const char *url)
+/* Write the state of the crawl to opt.crawl_state.  START_URL is that
+   of the retrieval under way, if any, and BLACKLIST and QUEUE are its
+   own.  The file is written under a temporary name first, so that an
+   interruption doesn't leave a truncated state behind.  */
+
+static void
+crawl_state_save (const char *start_url, const struct url_set *blacklist,
+                  struct url_queue *queue)
 {
-  char *url_unescaped = xstrdup(url);
-  int ret;
+  char *tmpname = aprintf ("%s.tmp", opt.crawl_state);
+  FILE *fp = fopen (tmpname, "wb");
+  bool ok = true;
+
+  if (!fp)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", tmpname, strerror (errno));
+      xfree (tmpname);
+      return;
+    }
 
-  url_unescape (url_unescaped);
-  ret = string_set_contains (blacklist, url_unescaped);
-  xfree (url_unescaped);
+  fput_string (fp, CRAWL_STATE_MAGIC);
+  write_finished_trees (fp);
+  convert_write_state (fp);
+  fput_string (fp, start_url);
+  if (start_url)
+    {
+      url_set_write (fp, blacklist);
+      ok = url_queue_write (fp, queue);
+    }
 
-  return ret;
+  if (ferror (fp))
+    ok = false;
+  if (fclose (fp) != 0)
+    ok = false;
+  if (ok && rename (tmpname, opt.crawl_state) != 0)
+    ok = false;
+  if (!ok)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot save the state of the crawl to %s: %s\n"),
+                 quote (opt.crawl_state), strerror (errno));
+      unlink (tmpname);
+    }
+  else
+    DEBUGP (("Saved the state of the crawl to %s.\n", opt.crawl_state));
+  xfree (tmpname);
+}
+
+/* Read the state file, except for the queue, which is left for the
+   retrieve_tree resuming it.  Exits if the file is not valid.  */
+
+static void
+crawl_state_load (void)
+{
+  FILE *fp;
+  char *magic = NULL;
+  int count;
+  bool ok;
+
+  resume.loaded = true;
+  fp = fopen (opt.crawl_state, "rb");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        {
+          logprintf (LOG_NOTQUIET, "%s: %s\n", opt.crawl_state, strerror (errno));
+          exit (WGET_EXIT_GENERIC_ERROR);
+        }
+      logprintf (LOG_VERBOSE, _("No saved state in %s, starting over.\n"),
+                 quote (opt.crawl_state));
+      return;
+    }
+
+  ok = fget_string (fp, &magic) && magic
+    && !strcmp (magic, CRAWL_STATE_MAGIC);
+  xfree (magic);
+
+  if (ok && (ok = fget_int (fp, &count)))
+    for (; count > 0; count--)
+      {
+        char *url;
+
+        if (!fget_string (fp, &url) || !url)
+          {
+            ok = false;
+            break;
+          }
+        if (!finished_trees)
+          finished_trees = make_string_hash_table (0);
+        string_set_add (finished_trees, url);
+        xfree (url);
+      }
+
+  ok = ok && convert_read_state (fp) && fget_string (fp, &resume.start_url);
+  if (ok && resume.start_url)
+    ok = (resume.blacklist = url_set_read (fp)) != NULL;
+
+  if (!ok)
+    {
+      logprintf (LOG_NOTQUIET, _("%s is not a valid crawl state file.\n"),
+                 quote (opt.crawl_state));
+      exit (WGET_EXIT_GENERIC_ERROR);
+    }
+
+  if (resume.start_url)
+    resume.fp = fp;
+  else
+    fclose (fp);
+}
+
+/* If the retrieval of START_URL was under way in the saved state,
+   restore its queue into QUEUE and set *BLACKLIST to its blacklist.
+   Returns the number of URLs queued, or -1 if there is nothing to
+   resume.  */
+
+static int
+crawl_state_resume (const char *start_url, struct url_queue *queue,
+                    struct url_set **blacklist)
+{
+  int count, n;
+
+  if (!resume.loaded)
+    crawl_state_load ();
+  if (!resume.start_url || strcmp (resume.start_url, start_url))
+    return -1;
+
+  if (!fget_int (resume.fp, &count))
+    count = -1;
+  for (n = 0; n < count; n++)
+    {
+      struct queue_element qel;
+
+      if (!queue_element_read (resume.fp, &qel))
+        break;
+      url_enqueue (queue, qel.url, qel.referer, qel.depth,
+                   qel.html_allowed, qel.css_allowed, qel.requisite);
+    }
+  if (n < count || count < 0)
+    {
+      logprintf (LOG_NOTQUIET, _("%s is not a valid crawl state file.\n"),
+                 quote (opt.crawl_state));
+      exit (WGET_EXIT_GENERIC_ERROR);
+    }
+
+  fclose (resume.fp);
+  resume.fp = NULL;
+  xfree (resume.start_url);
+  *blacklist = resume.blacklist;
+  resume.blacklist = NULL;
+  return count;
 }
 
 typedef enum
 {
   WG_RR_SUCCESS, WG_RR_BLACKLIST, WG_RR_NOTHTTPS, WG_RR_NONHTTP, WG_RR_ABSOLUTE,
   WG_RR_DOMAIN, WG_RR_PARENT, WG_RR_LIST, WG_RR_REGEX, WG_RR_RULES,
-  WG_RR_SPANNEDHOST, WG_RR_ROBOTS
+  WG_RR_SPANNEDHOST, WG_RR_ROBOTS, WG_RR_CLUSTER
 } reject_reason;
 
-static reject_reason download_child (const struct urlpos *, struct url *, int,
-                              struct url *, struct hash_table *);
+static reject_reason download_child (struct urlpos *, struct url *, int,
+                              struct url *, struct url_set *);
 static reject_reason descend_redirect (const char *, struct url *, int,
-                              struct url *, struct hash_table *);
+                              struct url *, struct url_set *);
+static bool robots_allow (struct url *, struct url_set *);
+static void tree_receive (const char *, const char *, int,
+                          bool, bool, bool);
 static void write_reject_log_header (FILE *);
 static void write_reject_log_reason (FILE *, reject_reason,
                               const struct url *, const struct url *);
 
+/* The body of the HTML or CSS document being retrieved, as written by
+   fd_read_body, so that its links can be extracted without reading
+   the file back.  */
+
+struct body_capture {
+  struct file_memory fm;
+  long size;                    /* allocated size of fm.content */
+};
+
+static void
+body_capture_init (void *ctx)
+{
+  struct body_capture *capture = ctx;
+  capture->fm.length = 0;
+}
+
+static void
+body_capture_update (const char *buf, size_t len, void *ctx)
+{
+  struct body_capture *capture = ctx;
+
+  DO_REALLOC (capture->fm.content, capture->size,
+              capture->fm.length + (long) len, char);
+  memcpy (capture->fm.content + capture->fm.length, buf, len);
+  capture->fm.length += len;
+}
+
+/* With --spider-connections, the links a spider won't follow are not
+   retrieved one by one, but set aside as they come out of the queue
+   and checked LINK_BATCH_SIZE at a time with http_check_links.  */
+
+#define LINK_BATCH_SIZE 256
+
+struct link_batch {
+  struct link_check checks[LINK_BATCH_SIZE];
+  int depth[LINK_BATCH_SIZE];
+  bool html_allowed[LINK_BATCH_SIZE];
+  bool css_allowed[LINK_BATCH_SIZE];
+  int count;
+
+  /* The links http_check_links left unchecked, which are to be
+     retrieved the usual way.  */
+  struct url_set *serial;
+};
+
+/* Set URL, taken out of the queue at DEPTH with HTML_ALLOWED and
+   CSS_ALLOWED, aside in BATCH if the spider would not follow its
+   links.  Returns false if URL is to be retrieved instead.  */
+
+static bool
+link_batch_add (struct link_batch *batch, struct url *url, char *referer,
+                int depth, bool html_allowed, bool css_allowed)
+{
+  bool depth_leaf = (opt.reclevel != INFINITE_RECURSION
+                     && depth >= opt.reclevel && !opt.page_requisites);
+  struct link_check *check;
+
+  if ((html_allowed || css_allowed) && !depth_leaf)
+    return false;
+  if (dl_url_file_map && hash_table_contains (dl_url_file_map, url->url))
+    return false;
+  if (url_set_contains (batch->serial, url->url)
+      || !http_link_checkable (url))
+    return false;
+
+  check = &batch->checks[batch->count];
+  check->url = url;
+  check->referer = referer;
+  /* Like retrieve_tree, follow a link to CSS even where none was
+     expected, as long as the depth allows.  */
+  check->follow_css = !depth_leaf;
+  batch->depth[batch->count] = depth;
+  batch->html_allowed[batch->count] = html_allowed;
+  batch->css_allowed[batch->count] = css_allowed;
+  batch->count++;
+  return true;
+}
+
+/* Check the links of BATCH if CHECK is true, and empty it.  The
+   links left unchecked are put back in QUEUE, to be retrieved.  */
+
+static void
+link_batch_flush (struct link_batch *batch, struct url_queue *queue,
+                  bool check)
+{
+  int i;
+
+  if (check)
+    http_check_links (batch->checks, batch->count);
+
+  for (i = 0; i < batch->count; i++)
+    {
+      struct link_check *c = &batch->checks[i];
+
+      if (!check || c->result == LINK_UNCHECKED)
+        {
+          if (check)
+            url_set_add (batch->serial, c->url->url);
+          url_enqueue (queue, c->url, c->referer, batch->depth[i],
+                       batch->html_allowed[i], batch->css_allowed[i],
+                       false);
+          continue;
+        }
+
+      visited_url (c->url->url, c->referer);
+      if (c->result == LINK_BROKEN)
+        inform_exit_status (WRONGCODE);
+      url_free (c->url);
+      xfree (c->referer);
+    }
+  batch->count = 0;
+}
+
 /* Retrieve a part of the web beginning with START_URL.  This used to
    be called "recursive retrieval", because the old function was
    recursive and implemented depth-first search.  retrieve_tree on the
@@ -228,15 +973,71 @@ retrieve_tree (struct url *start_url_parsed)
 
   /* The URLs we do not wish to enqueue, because they are already in
      the queue, but haven't been downloaded yet.  */
-  struct hash_table *blacklist;
+  struct url_set *blacklist;
 
   FILE *rejectedlog = NULL; /* Don't write a rejected log. */
 
+  /* When the crawl state was last saved, and how many URLs have been
+     retrieved since.  */
+  time_t last_save = time (NULL);
+  int retrieved = 0;
+  bool complete = false;
+
+  /* The capture of the document being retrieved.  */
+  struct body_capture capture;
+  struct body_digest capture_digest;
+
+  /* The links set aside to be checked in parallel.  */
+  struct link_batch *batch = NULL;
+
+  xzero (capture);
+  xzero (capture_digest);
+  capture_digest.init = body_capture_init;
+  capture_digest.update = body_capture_update;
+  capture_digest.ctx = &capture;
+  capture_digest.documents_only = true;
+
+  if (opt.spider && opt.spider_connections > 1)
+    {
+      batch = xnew0 (struct link_batch);
+      batch->serial = url_set_new ();
+    }
+
   queue = url_queue_new ();
-  blacklist = make_string_hash_table (0);
+  blacklist = NULL;
 
-  url_enqueue (queue, start_url, NULL, 0, true, false);
-  blacklist_add (blacklist, start_url_parsed->url);
+  if (opt.resume_crawl)
+    {
+      int queued = crawl_state_resume (start_url_parsed->url, queue,
+                                       &blacklist);
+      if (queued >= 0)
+        logprintf (LOG_VERBOSE, _("Resuming the retrieval of %s, "
+                                  "with %d URLs in the queue.\n"),
+                   quote (start_url_parsed->url), queued);
+      else if (finished_trees
+               && string_set_contains (finished_trees, start_url_parsed->url))
+        {
+          logprintf (LOG_VERBOSE, _("The retrieval of %s was completed "
+                                    "before, skipping it.\n"),
+                     quote (start_url_parsed->url));
+          url_queue_delete (queue);
+          url_free (start_url);
+          return RETROK;
+        }
+    }
+
+  cluster_begin (tree_receive);
+  if (blacklist || !cluster_local_p (start_url))
+    url_free (start_url);
+  else
+    url_enqueue (queue, start_url, NULL, 0, true, false, false);
+  if (!blacklist)
+    {
+      blacklist = url_set_new ();
+      url_set_add (blacklist, start_url_parsed->url);
+    }
+  tree_queue = queue;
+  tree_blacklist = blacklist;
 
   if (opt.rejected_log)
     {
@@ -255,16 +1056,43 @@ retrieve_tree (struct url *start_url_parsed)
       bool html_allowed, css_allowed;
       bool is_css = false;
       bool dash_p_leaf_HTML = false;
+      bool captured = false, unwritten = false;
 
       if (opt.quota && total_downloaded_bytes > opt.quota)
         break;
       if (status == FWRITEERR)
         break;
 
+      /* Make the status report SIGUSR1 may have asked for.  */
+      status_poll ();
+
+      if (!cluster_poll ())
+        break;
+
       /* Get the next URL from the queue... */
       if (!url_dequeue (queue, &url, (const char **)&referer,
                         &depth, &html_allowed, &css_allowed))
-        break;
+        {
+          if (batch && batch->count)
+            {
+              link_batch_flush (batch, queue, true);
+              continue;
+            }
+          /* With --cluster, more URLs may still come from the other
+             nodes.  */
+          if (cluster_wait ())
+            continue;
+          complete = true;
+          break;
+        }
+
+      if (batch && link_batch_add (batch, url, referer, depth,
+                                   html_allowed, css_allowed))
+        {
+          if (batch->count == LINK_BATCH_SIZE)
+            link_batch_flush (batch, queue, true);
+          continue;
+        }
 
       /* ...and download it.  Note that this download is in most cases
          unconditional, as download_child already makes sure a file
@@ -299,8 +1127,44 @@ retrieve_tree (struct url *start_url_parsed)
           int dt = 0;
           char *redirected = NULL;
 
+          if (opt.preconnect > 0)
+            preconnect_queued_hosts (queue, url);
+          if (opt.pipeline > 0
+#ifdef HAVE_NGHTTP2
+              || opt.http2
+#endif
+              )
+            pipeline_queued_urls (queue, url);
+
+          if (html_allowed || css_allowed)
+            body_digest_add (&capture_digest);
+          retry_deferral (true);
           status = retrieve_url (url, &file, &redirected, referer,
                                  &dt, false, true);
+          retry_deferral (false);
+          if (html_allowed || css_allowed)
+            body_digest_remove (&capture_digest);
+
+          if (status == RETRYLATER)
+            {
+              /* The host is backed off; the URL is tried again once
+                 the queue comes back to it, and the URLs of other
+                 hosts are retrieved in the meantime.  */
+              url_enqueue (queue, url, referer, depth,
+                           html_allowed, css_allowed, false);
+              xfree (file);
+              xfree (redirected);
+              continue;
+            }
+
+          if (html_allowed || css_allowed)
+            {
+              /* The file may hold more than the body, as with -O or
+                 --save-headers.  A spider need not write it at all.  */
+              unwritten = capture_digest.valid && capture_digest.unwritten;
+              captured = file && capture_digest.valid
+                && (unwritten || file_size (file) == capture_digest.length);
+            }
 
           if (html_allowed && file && status == RETROK
               && (dt & RETROKF) && (dt & TEXTHTML))
@@ -329,11 +1193,14 @@ retrieve_tree (struct url *start_url_parsed)
                 {
                   reject_reason r = descend_redirect (redirected, url,
                                     depth, start_url_parsed, blacklist);
-                  if (r == WG_RR_SUCCESS)
+                  /* Redirected to a host of another cluster node,
+                     the document is here already, so it is parsed
+                     here.  */
+                  if (r == WG_RR_SUCCESS || r == WG_RR_CLUSTER)
                     {
                       /* Make sure that the old pre-redirect form gets
                          blacklisted. */
-                      blacklist_add (blacklist, url->url);
+                      url_set_add (blacklist, url->url);
                     }
                   else
                     {
@@ -381,9 +1248,33 @@ retrieve_tree (struct url *start_url_parsed)
       if (descend)
         {
           bool meta_disallow_follow = false;
-          struct urlpos *children
-            = is_css ? get_urls_css_file (file, url) :
-                       get_urls_html (file, url, &meta_disallow_follow);
+          bool convert = ((opt.convert_links || opt.convert_file_only)
+                          && !opt.delete_after);
+          char *parse_enc = NULL;
+          struct urlpos *children;
+
+          /* The links are kept for the conversion, which reuses them
+             if it would parse the file the same way.  Parsing may set
+             the charset of URL from the file itself, so remember what
+             it was before.  */
+          if (convert && url->content_enc)
+            parse_enc = xstrdup (url->content_enc);
+
+          if (captured)
+            {
+              DEBUGP (("Parsing %s as downloaded (size %s).\n", file,
+                       number_to_static_string (capture.fm.length)));
+              children = is_css ? get_urls_css_fm (file, &capture.fm, url) :
+                get_urls_html_fm (file, &capture.fm, url,
+                                  &meta_disallow_follow);
+            }
+          else
+            children = is_css ? get_urls_css_file (file, url) :
+                                get_urls_html (file, url, &meta_disallow_follow);
+
+          if (convert)
+            register_links (file, url, parse_enc, is_css, children);
+          xfree (parse_enc);
 
           if (opt.use_robots && meta_disallow_follow)
             {
@@ -405,6 +1296,8 @@ retrieve_tree (struct url *start_url_parsed)
               if (strip_auth)
                 referer_url = url_string (url, URL_AUTH_HIDE);
 
+              prefetch_child_hosts (children, url, dash_p_leaf_HTML);
+
               for (; child; child = child->next)
                 {
                   reject_reason r;
@@ -425,17 +1318,29 @@ retrieve_tree (struct url *start_url_parsed)
                                       start_url_parsed, blacklist);
                   if (r == WG_RR_SUCCESS)
                     {
+                      /* We blacklist the URL we enqueue, because we
+                         don't want to enqueue (and hence download) the
+                         same URL twice.  */
+                      url_set_add (blacklist, child->url->url);
+                      /* The queue takes the url struct, and may free
+                         it if it is written to disk.  */
                       url_enqueue (queue, child->url,
                                    xstrdup (referer_url), depth + 1,
                                    child->link_expect_html,
-                                   child->link_expect_css);
-                      /* We blacklist the URL we have enqueued, because we
-                         don't want to enqueue (and hence download) the
-                         same URL twice.  */
-                      blacklist_add (blacklist, child->url->url);
-                      /* Keep the enqueued url struct */
+                                   child->link_expect_css,
+                                   child->link_inline_p);
                       child->url = NULL;
                     }
+                  else if (r == WG_RR_CLUSTER)
+                    {
+                      /* It is left to its node, which is told about it
+                         only once.  */
+                      url_set_add (blacklist, child->url->url);
+                      cluster_forward (child->url, referer_url, depth + 1,
+                                       child->link_expect_html,
+                                       child->link_expect_css,
+                                       child->link_inline_p);
+                    }
                   else
                     {
                       write_reject_log_reason (rejectedlog, r, child->url, url);
@@ -448,7 +1353,7 @@ retrieve_tree (struct url *start_url_parsed)
             }
         }
 
-      if (file
+      if (file && !unwritten
           && (opt.delete_after
               || opt.spider /* opt.recursive is implicitly true */
               || !acceptable (file)))
@@ -475,6 +1380,43 @@ retrieve_tree (struct url *start_url_parsed)
       url_free (url);
       xfree (referer);
       xfree (file);
+
+      if (opt.crawl_state
+          && (++retrieved >= CHECKPOINT_URLS
+              || time (NULL) - last_save >= CHECKPOINT_SECONDS))
+        {
+          /* The links set aside are saved with the queue once they
+             have been checked.  */
+          if (batch && batch->count)
+            link_batch_flush (batch, queue, true);
+          crawl_state_save (start_url_parsed->url, blacklist, queue);
+          retrieved = 0;
+          last_save = time (NULL);
+        }
+    }
+
+  cluster_end (complete);
+
+  if (batch)
+    {
+      /* After a premature exit, what was set aside goes back to the
+         queue, which is saved or freed.  */
+      link_batch_flush (batch, queue, false);
+      url_set_free (batch->serial);
+      xfree (batch);
+    }
+
+  if (opt.crawl_state)
+    {
+      if (complete)
+        {
+          if (!finished_trees)
+            finished_trees = make_string_hash_table (0);
+          string_set_add (finished_trees, start_url_parsed->url);
+          crawl_state_save (NULL, NULL, NULL);
+        }
+      else
+        crawl_state_save (start_url_parsed->url, blacklist, queue);
     }
 
   if (rejectedlog)
@@ -483,22 +1425,19 @@ retrieve_tree (struct url *start_url_parsed)
       rejectedlog = NULL;
     }
 
-  /* If anything is left of the queue due to a premature exit, free it
-     now.  */
-  {
-    struct url *d1;
-    char *d2;
-    int d3;
-    bool d4, d5;
-    while (url_dequeue (queue, &d1, (const char **)&d2, &d3, &d4, &d5))
-      {
-        url_free (d1);
-        xfree (d2);
-      }
-  }
+  /* If anything is left of the queue due to a premature exit, it is
+     freed with it.  */
+  tree_queue = NULL;
+  tree_blacklist = NULL;
   url_queue_delete (queue);
+  preconnect_discard_all ();
+  http_pipeline_hints_clear ();
+  xfree (capture.fm.content);
 
-  string_set_free (blacklist);
+  DEBUGP (("Blacklisted %s URLs in %s bytes.\n",
+           number_to_static_string (url_set_count (blacklist)),
+           number_to_static_string (url_set_memory (blacklist))));
+  url_set_free (blacklist);
 
   if (opt.quota && total_downloaded_bytes > opt.quota)
     return QUOTEXC;
@@ -508,17 +1447,74 @@ retrieve_tree (struct url *start_url_parsed)
     return RETROK;
 }
 
+/* Store the number of URLs in the queue of the recursive retrieval in
+   progress, the most it held, how many of them were spilled to disk and
+   the number of URLs seen in QUEUED, MAX_QUEUED, SPILLED and SEEN.
+   Returns false if no recursive retrieval is in progress.  */
+
+bool
+recursive_status (int *queued, int *max_queued, int *spilled, size_t *seen)
+{
+  if (!tree_queue)
+    return false;
+  *queued = tree_queue->count;
+  *max_queued = tree_queue->maxcount;
+  *spilled = tree_queue->spilled;
+  *seen = url_set_count (tree_blacklist);
+  return true;
+}
+
+/* Queue URL, forwarded by another --cluster node, unless it was seen
+   before or robots.txt forbids it.  The other arguments are those of
+   url_enqueue.  */
+
+static void
+tree_receive (const char *url, const char *referer, int depth,
+              bool html_allowed, bool css_allowed, bool requisite)
+{
+  struct url *u;
+
+  if (url_set_contains (tree_blacklist, url))
+    {
+      DEBUGP (("Forwarded %s is already on the black list.\n", url));
+      return;
+    }
+
+  u = url_new_init ();
+  u->ori_url = xstrdup (url);
+  if (url_parse (u, false, false) != 0)
+    {
+      DEBUGP (("Cannot parse forwarded %s.\n", quote (url)));
+      url_free (u);
+      return;
+    }
+  url_set_add (tree_blacklist, u->url);
+
+  if (opt.use_robots && schemes_are_similar_p (u->scheme, SCHEME_HTTP)
+      && !robots_allow (u, tree_blacklist))
+    {
+      url_free (u);
+      return;
+    }
+  url_enqueue (tree_queue, u, referer ? xstrdup (referer) : NULL, depth,
+               html_allowed, css_allowed, requisite);
+}
+
 /* Based on the context provided by retrieve_tree, decide whether a
    URL is to be descended to.  This is only ever called from
    retrieve_tree, but is in a separate function for clarity.
 
    The most expensive checks (such as those for robots) are memoized
    by storing these URLs to BLACKLIST.  This may or may not help.  It
-   will help if those URLs are encountered many times.  */
+   will help if those URLs are encountered many times.
+
+   A URL known to have moved permanently is replaced in UPOS by its
+   new location, which is what the checks are then made on, and what
+   gets enqueued.  */
 
 static reject_reason
-download_child (const struct urlpos *upos, struct url *parent, int depth,
-                struct url *start_url_parsed, struct hash_table *blacklist)
+download_child (struct urlpos *upos, struct url *parent, int depth,
+                struct url *start_url_parsed, struct url_set *blacklist)
 {
   struct url *u = upos->url;
   const char *url = u->url;
@@ -527,7 +1523,20 @@ download_child (const struct urlpos *upos, struct url *parent, int depth,
 
   DEBUGP (("Deciding whether to enqueue \"%s\".\n", url));
 
-  if (blacklist_contains (blacklist, url))
+  if (schemes_are_similar_p (u->scheme, SCHEME_HTTP) && !opt.method)
+    {
+      struct url *moved = moved_permanently_lookup (u);
+      if (moved)
+        {
+          DEBUGP (("It has moved permanently to \"%s\".\n", moved->url));
+          url_set_add (blacklist, url);
+          url_free (upos->url);
+          upos->url = u = moved;
+          url = u->url;
+        }
+    }
+
+  if (url_set_contains (blacklist, url))
     {
       if (opt.spider)
         {
@@ -613,7 +1622,7 @@ download_child (const struct urlpos *upos, struct url *parent, int depth,
      the parent page when in -p mode.  */
   if (opt.no_parent
       && schemes_are_similar_p (u->scheme, start_url_parsed->scheme)
-      && 0 == strcasecmp (u->host, start_url_parsed->host)
+      && URL_SAME_HOST (u, start_url_parsed)
       && (u->scheme != start_url_parsed->scheme
           || u->port == start_url_parsed->port)
       && !(opt.page_requisites && upos->link_inline_p))
@@ -674,7 +1683,7 @@ download_child (const struct urlpos *upos, struct url *parent, int depth,
 
   /* 7. */
   if (schemes_are_similar_p (u->scheme, parent->scheme))
-    if (!opt.spanhost && 0 != strcasecmp (parent->host, u->host))
+    if (!opt.spanhost && !URL_SAME_HOST (parent, u))
       {
         DEBUGP (("This is not the same hostname as the parent's (%s and %s).\n",
                  u->host, parent->host));
@@ -682,55 +1691,20 @@ download_child (const struct urlpos *upos, struct url *parent, int depth,
         goto out;
       }
 
-  /* 8. */
-  if (opt.use_robots && u_scheme_like_http)
-    {
-      /* robots.txt is encoded in UTF-8 or a subset of UTF-8
-         https://developers.google.com/search/reference/robots_txt
-         https://stackoverflow.com/questions/3816795/robots-txt-what-encoding
-         host name should be transcoded in UTF-8 or compatible with UTF-8,
-         or it won't work.
-      */
-      struct robot_specs *specs = res_get_specs (u->host, u->port);
-      if (!specs)
-        {
-          char *rfile;
-          if (res_retrieve_file (u, &rfile))
-            {
-              specs = res_parse_from_file (rfile);
-
-              /* Delete the robots.txt file if we chose to either delete the
-                 files after downloading or we're just running a spider or
-                 we use page requisites or pattern matching. */
-              if (opt.delete_after || opt.spider || match_tail(rfile, ".tmp", false))
-                {
-                  logprintf (LOG_VERBOSE, _("Removing %s.\n"), rfile);
-                  if (unlink (rfile))
-                      logprintf (LOG_NOTQUIET, "unlink: %s\n",
-                                 strerror (errno));
-                }
-
-              xfree (rfile);
-            }
-          else
-            {
-              /* If we cannot get real specs, at least produce
-                 dummy ones so that we can register them and stop
-                 trying to retrieve them.  */
-              specs = res_parse ("", 0);
-            }
-          res_register_specs (u->host, u->port, specs);
-        }
+  /* The URLs of the hosts of other --cluster nodes are theirs to check
+     against robots.txt and to retrieve.  */
+  if (!cluster_local_p (u))
+    {
+      DEBUGP (("The host %s belongs to another cluster node.\n", u->host));
+      reason = WG_RR_CLUSTER;
+      goto out;
+    }
 
-      /* Now that we have (or don't have) robots.txt specs, we can
-         check what they say.  */
-      if (!res_match_path (specs, u->path))
-        {
-          DEBUGP (("Not following %s because robots.txt forbids it.\n", url));
-          blacklist_add (blacklist, url);
-          reason = WG_RR_ROBOTS;
-          goto out;
-        }
+  /* 8. */
+  if (opt.use_robots && u_scheme_like_http && !robots_allow (u, blacklist))
+    {
+      reason = WG_RR_ROBOTS;
+      goto out;
     }
 
   out:
@@ -745,6 +1719,62 @@ download_child (const struct urlpos *upos, struct url *parent, int depth,
   return reason;
 }
 
+/* Return whether the robots.txt of the host of U allows its retrieval,
+   retrieving it first if needed.  A URL that isn't allowed is added to
+   BLACKLIST.  */
+
+static bool
+robots_allow (struct url *u, struct url_set *blacklist)
+{
+  /* robots.txt is encoded in UTF-8 or a subset of UTF-8
+     https://developers.google.com/search/reference/robots_txt
+     https://stackoverflow.com/questions/3816795/robots-txt-what-encoding
+     host name should be transcoded in UTF-8 or compatible with UTF-8,
+     or it won't work.
+  */
+  struct robot_specs *specs = res_get_specs (u->host, u->port);
+  if (!specs)
+    {
+      char *rfile;
+      if (res_retrieve_file (u, &rfile))
+        {
+          specs = res_parse_from_file (rfile);
+
+          /* Delete the robots.txt file if we chose to either delete the
+             files after downloading or we're just running a spider or
+             we use page requisites or pattern matching. */
+          if (opt.delete_after || opt.spider || match_tail(rfile, ".tmp", false))
+            {
+              logprintf (LOG_VERBOSE, _("Removing %s.\n"), rfile);
+              if (unlink (rfile))
+                  logprintf (LOG_NOTQUIET, "unlink: %s\n",
+                             strerror (errno));
+            }
+
+          xfree (rfile);
+        }
+      else
+        {
+          /* If we cannot get real specs, at least produce
+             dummy ones so that we can register them and stop
+             trying to retrieve them.  */
+          specs = res_parse ("", 0);
+        }
+      res_register_specs (u->host, u->port, specs);
+    }
+
+  /* Now that we have (or don't have) robots.txt specs, we can
+     check what they say.  */
+  if (!res_match_path (specs, u->path))
+    {
+      DEBUGP (("Not following %s because robots.txt forbids it.\n",
+               u->url));
+      url_set_add (blacklist, u->url);
+      return false;
+    }
+  return true;
+}
+
 /* This function determines whether we will consider downloading the
    children of a URL whose download resulted in a redirection,
    possibly to another host, etc.  It is needed very rarely, and thus
@@ -752,7 +1782,7 @@ download_child (const struct urlpos *upos, struct url *parent, int depth,
 
 static reject_reason
 descend_redirect (const char *redirected, struct url *orig_parsed, int depth,
-                    struct url *start_url_parsed, struct hash_table *blacklist)
+                    struct url *start_url_parsed, struct url_set *blacklist)
 {
   struct url *new_parsed = url_new_init ();
   struct urlpos *upos;
@@ -773,17 +1803,18 @@ descend_redirect (const char *redirected, struct url *orig_parsed, int depth,
                            start_url_parsed, blacklist);
 
   if (reason == WG_RR_SUCCESS)
-    blacklist_add (blacklist, upos->url->url);
+    url_set_add (blacklist, upos->url->url);
   else if (reason == WG_RR_LIST || reason == WG_RR_REGEX)
     {
       DEBUGP (("Ignoring decision for redirects, decided to load it.\n"));
-      blacklist_add (blacklist, upos->url->url);
+      url_set_add (blacklist, upos->url->url);
       reason = WG_RR_SUCCESS;
     }
   else
     DEBUGP (("Redirection \"%s\" failed the test.\n", redirected));
 
-  url_free (new_parsed);
+  /* Which download_child may have replaced.  */
+  url_free (upos->url);
   xfree (upos);
 
   return reason;
@@ -865,6 +1896,7 @@ write_reject_log_reason (FILE *fp, reject_reason reason,
       case WG_RR_RULES:       reason_str = "RULES";       break;
       case WG_RR_SPANNEDHOST: reason_str = "SPANNEDHOST"; break;
       case WG_RR_ROBOTS:      reason_str = "ROBOTS";      break;
+      case WG_RR_CLUSTER:     reason_str = "CLUSTER";     break;
       default:                reason_str = "UNKNOWN";     break;
     }
 
@@ -875,4 +1907,125 @@ write_reject_log_reason (FILE *fp, reject_reason reason,
   fprintf (fp, "\n");
 }
 
+
+#ifdef TESTING
+
+const char *
+test_url_queue (void)
+{
+  struct url_queue *queue = url_queue_new ();
+  struct queue_slab *slab;
+  struct url *u;
+  const char *referer;
+  bool html_allowed, css_allowed;
+  char expected[32];
+  int round, i, depth, slabs;
+
+  for (round = 0; round < 2; round++)
+    {
+      for (i = 0; i < 1000; i++)
+        {
+          u = xnew0 (struct url);
+          u->url = aprintf ("http://host/%d", i);
+          url_enqueue (queue, u, NULL, round, true, false, false);
+        }
+      for (i = 0; i < 1000; i++)
+        {
+          mu_assert ("url_dequeue",
+                     url_dequeue (queue, &u, &referer, &depth,
+                                  &html_allowed, &css_allowed));
+          snprintf (expected, sizeof (expected), "http://host/%d", i);
+          mu_assert ("url_dequeue: order",
+                     !strcmp (u->url, expected) && depth == round);
+          url_free (u);
+        }
+      mu_assert ("url_dequeue: empty",
+                 !url_dequeue (queue, &u, &referer, &depth,
+                               &html_allowed, &css_allowed));
+    }
+
+  /* The second round reused the elements of the first.  */
+  for (slabs = 0, slab = queue->slabs; slab; slab = slab->next)
+    slabs++;
+  mu_assert ("url_queue: slabs",
+             slabs == (1000 + QUEUE_SLAB_SIZE - 1) / QUEUE_SLAB_SIZE);
+
+  url_queue_delete (queue);
+  return NULL;
+}
+
+const char *
+test_url_queue_order (void)
+{
+  /* The URLs to queue, whether they may be HTML and whether they are
+     requisites, and the order they come out in.  */
+  static const struct {
+    const char *url;
+    bool html, requisite;
+  } queued[] = {
+    { "a.html", true, false },
+    { "a.zip", false, false },
+    { "a.png", false, true },
+    { "b.html", true, false },
+    { "frame.html", true, true },
+    { "b.png", false, true },
+  };
+  static const struct {
+    int order;
+    const char *expected;
+  } tests[] = {
+    { crawl_order_breadth,
+      "a.html a.zip a.png b.html frame.html b.png c.png c.html " },
+    { crawl_order_documents,
+      "a.html b.html frame.html c.html a.zip a.png b.png c.png " },
+    { crawl_order_pages,
+      "a.png b.png a.html c.png b.html frame.html c.html a.zip " },
+  };
+  int saved_order = opt.crawl_order;
+  unsigned t, i;
+
+  for (t = 0; t < countof (tests); t++)
+    {
+      struct url_queue *queue = url_queue_new ();
+      struct url *u;
+      const char *referer;
+      bool html_allowed, css_allowed;
+      int depth;
+      char got[128] = "";
+
+      opt.crawl_order = tests[t].order;
+      for (i = 0; i < countof (queued); i++)
+        {
+          u = xnew0 (struct url);
+          u->url = xstrdup (queued[i].url);
+          url_enqueue (queue, u, NULL, 1, queued[i].html, false,
+                       queued[i].requisite);
+        }
+      /* The links of a.html are queued once it is taken.  */
+      while (url_dequeue (queue, &u, &referer, &depth,
+                          &html_allowed, &css_allowed))
+        {
+          strcat (got, u->url);
+          strcat (got, " ");
+          if (!strcmp (u->url, "a.html"))
+            {
+              struct url *child = xnew0 (struct url);
+              child->url = xstrdup ("c.png");
+              url_enqueue (queue, child, NULL, 2, false, false, true);
+              child = xnew0 (struct url);
+              child->url = xstrdup ("c.html");
+              url_enqueue (queue, child, NULL, 2, true, false, false);
+            }
+          url_free (u);
+        }
+      url_queue_delete (queue);
+      mu_assert ("url_dequeue: order", !strcmp (got, tests[t].expected));
+    }
+
+  opt.crawl_order = saved_order;
+  return NULL;
+}
+
+#endif /* TESTING */
+
 /* vim:set sts=2 sw=2 cino+={s: */
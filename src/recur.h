@@ -45,5 +45,6 @@ struct urlpos;
 
 void recursive_cleanup (void);
 uerr_t retrieve_tree (struct url *);
+bool recursive_status (int *, int *, int *, size_t *);
 
 #endif /* RECUR_H */
@@ -93,10 +93,41 @@ struct path_info {
   bool user_agent_exact_p;
 };
 
+/* The paths of the specs are compiled into a trie of their decoded
+   bytes, except for the paths with a `*' wildcard, which are kept as
+   the list of their literal segments.  A path ending with `$' must
+   match the whole URL path.  Either way, the rule that applies is
+   the first in the file, as before, so a node of the trie holds the
+   lowest index of the paths that end there.  */
+
+struct res_node {
+  int child;                    /* first child, or -1 */
+  int sibling;                  /* next sibling, or -1 */
+  int rule;                     /* path ending here, or -1 */
+  int end_rule;                 /* path ending here with `$', or -1 */
+  unsigned char c;              /* the byte leading to this node */
+};
+
+struct res_glob {
+  int rule;                     /* the index of the path */
+  bool anchored;                /* whether it ends with `$' */
+  int nsegs;                    /* the number of segments, at least 2 */
+  int *lens;                    /* their lengths */
+  char *chars;                  /* their decoded bytes, one after the
+                                   other */
+};
+
 struct robot_specs {
   int count;
   int size;
   struct path_info *paths;
+
+  struct res_node *nodes;       /* the trie, whose root is nodes[0] */
+  int node_count, node_size;
+  struct res_glob *globs;       /* the paths with wildcards */
+  int glob_count;
+
+  double crawl_delay;           /* seconds asked by Crawl-delay, or 0 */
 };
 
 /* Parsing the robot spec. */
@@ -179,6 +210,149 @@ prune_non_exact (struct robot_specs *specs)
   specs->size  = cnt;
 }
 
+/* Matching of a path according to the specs. */
+
+/* If C is '%' and (ptr[1], ptr[2]) form a hexadecimal number, and if
+   that number is not a numerical representation of '/', decode C and
+   advance the pointer.  */
+
+#define DECODE_MAYBE(c, ptr) do {                               \
+  if (c == '%' && c_isxdigit (ptr[1]) && c_isxdigit (ptr[2]))       \
+    {                                                           \
+      unsigned char decoded = X2DIGITS_TO_NUM (ptr[1], ptr[2]);          \
+      if (decoded != '/')                                       \
+        {                                                       \
+          c = decoded;                                          \
+          ptr += 2;                                             \
+        }                                                       \
+    }                                                           \
+} while (0)
+
+/* Decode the path from B to E into OUT, as the paths are compared:
+   %XX is decoded unless it stands for `/'.  Return the length
+   of the result, which is at most that of the path.  */
+
+static int
+decode_path (const char *b, const char *e, char *out)
+{
+  char *o = out;
+
+  for (; b < e; b++)
+    {
+      char c = *b;
+      if (e - b >= 3)
+        DECODE_MAYBE (c, b);
+      *o++ = c;
+    }
+  return o - out;
+}
+
+/* Return the child of node N of SPECS for byte C, creating it if
+   CREATE is true, or -1.  */
+
+static int
+trie_child (struct robot_specs *specs, int n, unsigned char c, bool create)
+{
+  struct res_node *node;
+  int i;
+
+  for (i = specs->nodes[n].child; i >= 0; i = specs->nodes[i].sibling)
+    if (specs->nodes[i].c == c)
+      return i;
+  if (!create)
+    return -1;
+
+  if (specs->node_count == specs->node_size)
+    {
+      specs->node_size *= 2;
+      specs->nodes = xrealloc (specs->nodes,
+                               specs->node_size * sizeof (struct res_node));
+    }
+  i = specs->node_count++;
+  node = &specs->nodes[i];
+  node->c = c;
+  node->child = -1;
+  node->rule = node->end_rule = -1;
+  node->sibling = specs->nodes[n].child;
+  specs->nodes[n].child = i;
+  return i;
+}
+
+/* Compile path I of SPECS, stripped of its `$', if ANCHORED, and
+   given its end E.  */
+
+static void
+compile_path (struct robot_specs *specs, int i, const char *e, bool anchored)
+{
+  const char *b = specs->paths[i].path, *star = memchr (b, '*', e - b);
+  char *buf = xmalloc (e - b + 1);
+
+  if (!star)
+    {
+      int len = decode_path (b, e, buf), k, n = 0;
+      int *rule;
+
+      for (k = 0; k < len; k++)
+        n = trie_child (specs, n, buf[k], true);
+      rule = anchored ? &specs->nodes[n].end_rule : &specs->nodes[n].rule;
+      if (*rule < 0)
+        *rule = i;
+      xfree (buf);
+    }
+  else
+    {
+      struct res_glob *g;
+      int offset = 0;
+
+      specs->globs = xrealloc (specs->globs, (specs->glob_count + 1)
+                               * sizeof (struct res_glob));
+      g = &specs->globs[specs->glob_count++];
+      g->rule = i;
+      g->anchored = anchored;
+      g->nsegs = 0;
+      g->lens = xnew_array (int, e - b + 1);
+      g->chars = buf;
+
+      /* Split the path at each `*'.  Consecutive ones are as one.  */
+      for (;;)
+        {
+          g->lens[g->nsegs] = decode_path (b, star, buf + offset);
+          offset += g->lens[g->nsegs++];
+          if (star == e)
+            break;
+          for (b = star; b < e && *b == '*'; b++)
+            ;
+          star = memchr (b, '*', e - b);
+          if (!star)
+            star = e;
+        }
+    }
+}
+
+/* Compile the paths of SPECS for res_match_path.  */
+
+static void
+compile_specs (struct robot_specs *specs)
+{
+  int i;
+
+  specs->node_size = 64;
+  specs->nodes = xnew_array (struct res_node, specs->node_size);
+  specs->node_count = 1;
+  specs->nodes[0].child = specs->nodes[0].sibling = -1;
+  specs->nodes[0].rule = specs->nodes[0].end_rule = -1;
+  specs->nodes[0].c = 0;
+
+  for (i = 0; i < specs->count; i++)
+    {
+      const char *path = specs->paths[i].path;
+      const char *e = path + strlen (path);
+      bool anchored = e > path && e[-1] == '$';
+
+      compile_path (specs, i, anchored ? e - 1 : e, anchored);
+    }
+}
+
 #define EOL(p) ((p) >= lineend)
 
 #define SKIP_SPACE(p) do {              \
@@ -241,6 +415,9 @@ res_parse (const char *source, int length)
      the last `user-agent' instructions.  */
   int record_count = 0;
 
+  /* Crawl-delay given to "*" and to Wget.  */
+  double delay_any = 0, delay_exact = 0;
+
   struct robot_specs *specs = xnew0 (struct robot_specs);
 
   while (1)
@@ -352,6 +529,29 @@ res_parse (const char *source, int length)
             }
           ++record_count;
         }
+      else if (FIELD_IS ("crawl-delay"))
+        {
+          /* Not part of the original standard, but widely used: the
+             seconds to wait between requests to the server.  */
+          if (user_agent_applies)
+            {
+              char buf[32], *endp;
+              double delay;
+              int len = MIN (value_e - value_b, (int) sizeof (buf) - 1);
+
+              memcpy (buf, value_b, len);
+              buf[len] = '\0';
+              delay = strtod (buf, &endp);
+              if (endp == buf || *endp || !(delay >= 0))
+                DEBUGP (("Ignoring malformed Crawl-delay at line %d\n",
+                         line_count));
+              else if (user_agent_exact)
+                delay_exact = delay;
+              else
+                delay_any = delay;
+            }
+          ++record_count;
+        }
       else
         {
           DEBUGP (("Ignoring unknown field at line %d\n", line_count));
@@ -378,6 +578,11 @@ res_parse (const char *source, int length)
       specs->size = specs->count;
     }
 
+  /* Like the paths, a delay given to Wget overrides one given to
+     everyone.  */
+  specs->crawl_delay = found_exact ? delay_exact : delay_any;
+
+  compile_specs (specs);
   return specs;
 }
 
@@ -407,74 +612,133 @@ free_specs (struct robot_specs *specs)
   for (i = 0; i < specs->count; i++)
     xfree (specs->paths[i].path);
   xfree (specs->paths);
+  for (i = 0; i < specs->glob_count; i++)
+    {
+      xfree (specs->globs[i].lens);
+      xfree (specs->globs[i].chars);
+    }
+  xfree (specs->globs);
+  xfree (specs->nodes);
   xfree (specs);
 }
 
-/* Matching of a path according to the specs. */
-
-/* If C is '%' and (ptr[1], ptr[2]) form a hexadecimal number, and if
-   that number is not a numerical representation of '/', decode C and
-   advance the pointer.  */
+/* Return the position of the LEN bytes at NEEDLE in the bytes from
+   P to END, or NULL.  */
 
-#define DECODE_MAYBE(c, ptr) do {                               \
-  if (c == '%' && c_isxdigit (ptr[1]) && c_isxdigit (ptr[2]))       \
-    {                                                           \
-      unsigned char decoded = X2DIGITS_TO_NUM (ptr[1], ptr[2]);          \
-      if (decoded != '/')                                       \
-        {                                                       \
-          c = decoded;                                          \
-          ptr += 2;                                             \
-        }                                                       \
-    }                                                           \
-} while (0)
+static const char *
+find_bytes (const char *p, const char *end, const char *needle, int len)
+{
+  for (; end - p >= len; p++)
+    if (!memcmp (p, needle, len))
+      return p;
+  return NULL;
+}
 
-/* The inner matching engine: return true if RECORD_PATH matches
-   URL_PATH.  The rules for matching are described at
-   <http://www.robotstxt.org/norobots-rfc.txt>, section 3.2.2.  */
+/* Return true if glob G matches the decoded URL path of length LEN.
+   As the segments between the wildcards are literal, taking the
+   leftmost occurrence of each is never wrong.  */
 
 static bool
-matches (const char *record_path, const char *url_path)
+glob_matches (const struct res_glob *g, const char *path, int len)
 {
-  const char *rp = record_path;
-  const char *up = url_path;
+  const char *p = path, *end = path + len;
+  const char *seg = g->chars;
+  int i, last = g->nsegs - 1;
+
+  if (len < g->lens[0] || memcmp (path, seg, g->lens[0]))
+    return false;
+  p += g->lens[0];
+  seg += g->lens[0];
 
-  for (; ; ++rp, ++up)
+  for (i = 1; i < last; i++)
     {
-      char rc = *rp;
-      char uc = *up;
-      if (!rc)
-        return true;
-      if (!uc)
-        return false;
-      DECODE_MAYBE(rc, rp);
-      DECODE_MAYBE(uc, up);
-      if (rc != uc)
+      p = find_bytes (p, end, seg, g->lens[i]);
+      if (!p)
         return false;
+      p += g->lens[i];
+      seg += g->lens[i];
     }
+
+  if (g->anchored)
+    return end - p >= g->lens[last]
+      && !memcmp (end - g->lens[last], seg, g->lens[last]);
+  return find_bytes (p, end, seg, g->lens[last]) != NULL;
 }
 
-/* Iterate through all paths in SPECS.  For the first one that
-   matches, return its allow/reject status.  If none matches,
-   retrieval is by default allowed.  */
+/* Find the first path in SPECS that matches PATH, walking down the
+   trie along PATH, and return its allow/reject status.  If none
+   matches, retrieval is by default allowed.  The rules for matching
+   are described at <http://www.robotstxt.org/norobots-rfc.txt>,
+   section 3.2.2, with the addition of the `*' and `$' wildcards.  */
 
 bool
 res_match_path (const struct robot_specs *specs, const char *path)
 {
-  int i;
+  const char *p;
+  int n = 0, best = -1, i;
+
   if (!specs)
     return true;
-  for (i = 0; i < specs->count; i++)
-    if (matches (specs->paths[i].path, path))
-      {
-        bool allowedp = specs->paths[i].allowedp;
-        DEBUGP (("%s path %s because of rule %s.\n",
-                 allowedp ? "Allowing" : "Rejecting",
-                 path, quote (specs->paths[i].path)));
-        return allowedp;
-      }
+
+  for (p = path; ; p++)
+    {
+      const struct res_node *node = &specs->nodes[n];
+      char c = *p;
+
+      if (node->rule >= 0 && (best < 0 || node->rule < best))
+        best = node->rule;
+      if (!c)
+        {
+          if (node->end_rule >= 0 && (best < 0 || node->end_rule < best))
+            best = node->end_rule;
+          break;
+        }
+      DECODE_MAYBE (c, p);
+      n = trie_child ((struct robot_specs *) specs, n, c, false);
+      if (n < 0)
+        break;
+    }
+
+  if (specs->glob_count)
+    {
+      int len = strlen (path);
+      char *decoded = xmalloc (len + 1);
+
+      len = decode_path (path, path + len, decoded);
+      for (i = 0; i < specs->glob_count; i++)
+        {
+          const struct res_glob *g = &specs->globs[i];
+          if (best >= 0 && g->rule > best)
+            break;
+          if (glob_matches (g, decoded, len))
+            {
+              best = g->rule;
+              break;
+            }
+        }
+      xfree (decoded);
+    }
+
+  if (best >= 0)
+    {
+      bool allowedp = specs->paths[best].allowedp;
+      DEBUGP (("%s path %s because of rule %s.\n",
+               allowedp ? "Allowing" : "Rejecting",
+               path, quote (specs->paths[best].path)));
+      return allowedp;
+    }
   return true;
 }
 
+/* Return the number of seconds SPECS ask crawlers to wait between
+   requests, 0 if they don't.  */
+
+double
+res_crawl_delay (const struct robot_specs *specs)
+{
+  return specs->crawl_delay;
+}
+
 /* Registering the specs. */
 
 static struct hash_table *registered_specs;
@@ -636,6 +900,82 @@ test_is_robots_txt_url(void)
   return NULL;
 }
 
+const char *
+test_res_match_path(void)
+{
+  static const char robots[] =
+    "User-agent: *\n"
+    "Allow: /private/public\n"
+    "Disallow: /private\n"
+    "Disallow: /%7Euser/\n"
+    "Disallow: /a%2Fb\n"
+    "Disallow: /*.gif$\n"
+    "Disallow: /exact$\n"
+    "Allow: /cgi-bin/*/ok\n"
+    "Disallow: /cgi-bin/\n";
+  static const struct {
+    const char *path;
+    bool allowed;
+  } test_array[] = {
+    { "index.html", true },
+    { "private/public/x", true },
+    { "private/x", false },
+    { "privat", true },
+    { "~user/x", false },
+    { "%7euser/x", false },
+    { "a/b", true },
+    { "a%2Fb", false },
+    { "img/x.gif", false },
+    { "img/x.gif?y", true },
+    { "exact", false },
+    { "exact/", true },
+    { "cgi-bin/a/b/ok", true },
+    { "cgi-bin/ok", false },
+    { "cgi-bin/a", false },
+  };
+  struct robot_specs *specs = res_parse (robots, sizeof robots - 1);
+  unsigned i;
+
+  for (i = 0; i < countof(test_array); ++i)
+    mu_assert ("test_res_match_path: wrong result",
+               res_match_path (specs, test_array[i].path)
+               == test_array[i].allowed);
+
+  free_specs (specs);
+  return NULL;
+}
+
+const char *
+test_res_crawl_delay(void)
+{
+  static const struct {
+    const char *robots;
+    double delay;
+  } test_array[] = {
+    { "User-agent: *\nDisallow: /x\n", 0 },
+    { "User-agent: *\nCrawl-delay: 2\n", 2 },
+    { "User-agent: *\nCrawl-delay: 0.5 # seconds\n", 0.5 },
+    { "User-agent: other\nCrawl-delay: 9\n", 0 },
+    { "User-agent: *\nCrawl-delay: 9\n\n"
+      "User-agent: wget\nCrawl-delay: 1\n", 1 },
+    { "User-agent: wget\nCrawl-delay: 1\n\n"
+      "User-agent: *\nCrawl-delay: 9\n", 1 },
+    { "User-agent: *\nCrawl-delay: soon\n", 0 },
+    { "User-agent: *\nCrawl-delay: -3\n", 0 },
+  };
+  unsigned i;
+
+  for (i = 0; i < countof(test_array); ++i)
+    {
+      struct robot_specs *specs = res_parse (test_array[i].robots,
+                                             strlen (test_array[i].robots));
+      mu_assert ("test_res_crawl_delay: wrong delay",
+                 res_crawl_delay (specs) == test_array[i].delay);
+      free_specs (specs);
+    }
+  return NULL;
+}
+
 #endif /* TESTING */
 
 /*
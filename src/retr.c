@@ -36,6 +36,7 @@ as that of the covered work.  */
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #ifdef VMS
 # include <unixio.h>            /* For delete(). */
 #endif
@@ -43,11 +44,20 @@ as that of the covered work.  */
 #ifdef HAVE_LIBZ
 # include <zlib.h>
 #endif
+#ifdef HAVE_LIBBROTLIDEC
+# include <brotli/decode.h>
+#endif
+#ifdef HAVE_LIBZSTD
+# include <zstd.h>
+#endif
 
 #include "exits.h"
 #include "utils.h"
 #include "retr.h"
 #include "progress.h"
+#include "stats.h"
+#include "throttle.h"
+#include "status.h"
 #include "url.h"
 #include "recur.h"
 #include "ftp.h"
@@ -59,6 +69,16 @@ as that of the covered work.  */
 #include "html-url.h"
 #include "iri.h"
 #include "hsts.h"
+#include "hash.h"
+#include "res.h"
+#include "urlset.h"
+#include "dedup.h"
+#include "c-strcase.h"
+
+#if defined TESTING && !defined WINDOWS
+# include <sys/socket.h>
+# include "../tests/unit-tests.h"
+#endif
 
 /* Total size of downloaded files.  Used to enforce quota.  */
 wgint total_downloaded_bytes;
@@ -74,17 +94,28 @@ FILE *output_stream;
    i.e. not `-' or a device file. */
 bool output_stream_regular;
 
-static struct {
-  wgint chunk_bytes;
-  double chunk_start;
-  double sleep_adjust;
-} limit_data;
+/* Content decoders, undoing the Content-Encoding of a body as it
+   arrives.  */
 
-static void
-limit_bandwidth_reset (void)
+struct body_decoder
 {
-  xzero (limit_data);
-}
+  int flag;                     /* the rb_compressed_* flag */
+  const char *name;             /* for debug messages */
+
+  /* Start decoding a new body.  Return the decoder state, or NULL
+     with errno set.  */
+  void *(*start) (void);
+
+  /* Decode *INLEN bytes at *IN into the OUTLEN bytes at OUT, advancing
+     *IN and *INLEN past the input consumed.  Return the number of
+     bytes written to OUT, or -1 with errno set on error.  Set *DONE
+     when the end of the encoded stream has been reached.  */
+  int (*decode) (void *, const char **in, size_t *inlen,
+                 char *out, size_t outlen, bool *done);
+
+  /* Release the state; return false if that failed.  */
+  bool (*finish) (void *);
+};
 
 #ifdef HAVE_LIBZ
 static voidpf
@@ -100,59 +131,272 @@ zfree (voidpf opaque, voidpf address)
   (void) opaque;
   xfree (address);
 }
-#endif
 
-/* Limit the bandwidth by pausing the download for an amount of time.
-   BYTES is the number of bytes received from the network, and TIMER
-   is the timer that started at the beginning of download.  */
+static void *
+gzip_start (void)
+{
+  z_stream *gzstream = xnew0 (z_stream);
+  int err;
+
+  gzstream->zalloc = zalloc;
+  gzstream->zfree = zfree;
+  gzstream->opaque = Z_NULL;
+  gzstream->next_in = Z_NULL;
+  gzstream->avail_in = 0;
+
+  #define GZIP_DETECT 32 /* gzip format detection */
+  #define GZIP_WINDOW 15 /* logarithmic window size (default: 15) */
+  err = inflateInit2 (gzstream, GZIP_DETECT | GZIP_WINDOW);
+  if (err != Z_OK)
+    {
+      xfree (gzstream);
+      errno = (err == Z_MEM_ERROR) ? ENOMEM : EINVAL;
+      return NULL;
+    }
+  return gzstream;
+}
 
-static void
-limit_bandwidth (wgint bytes, struct ptimer *timer)
+static int
+gzip_decode (void *state, const char **in, size_t *inlen,
+             char *out, size_t outlen, bool *done)
 {
-  double delta_t = ptimer_read (timer) - limit_data.chunk_start;
-  double expected;
+  z_stream *gzstream = state;
+  int err;
 
-  limit_data.chunk_bytes += bytes;
+  gzstream->next_in = (unsigned char *) *in;
+  gzstream->avail_in = *inlen;
+  gzstream->next_out = (unsigned char *) out;
+  gzstream->avail_out = outlen;
 
-  /* Calculate the amount of time we expect downloading the chunk
-     should take.  If in reality it took less time, sleep to
-     compensate for the difference.  */
-  expected = (double) limit_data.chunk_bytes / opt.limit_rate;
+  err = inflate (gzstream, Z_NO_FLUSH);
 
-  if (expected > delta_t)
+  *in = (const char *) gzstream->next_in;
+  *inlen = gzstream->avail_in;
+
+  switch (err)
     {
-      double slp = expected - delta_t + limit_data.sleep_adjust;
-      double t0, t1;
-      if (slp < 0.2)
-        {
-          DEBUGP (("deferring a %.2f ms sleep (%s/%.2f).\n",
-                   slp * 1000, number_to_static_string (limit_data.chunk_bytes),
-                   delta_t));
-          return;
-        }
-      DEBUGP (("\nsleeping %.2f ms for %s bytes, adjust %.2f ms\n",
-               slp * 1000, number_to_static_string (limit_data.chunk_bytes),
-               limit_data.sleep_adjust));
-
-      t0 = ptimer_read (timer);
-      xsleep (slp);
-      t1 = ptimer_measure (timer);
-
-      /* Due to scheduling, we probably slept slightly longer (or
-         shorter) than desired.  Calculate the difference between the
-         desired and the actual sleep, and adjust the next sleep by
-         that amount.  */
-      limit_data.sleep_adjust = slp - (t1 - t0);
-      /* If sleep_adjust is very large, it's likely due to suspension
-         and not clock inaccuracy.  Don't enforce those.  */
-      if (limit_data.sleep_adjust > 0.5)
-        limit_data.sleep_adjust = 0.5;
-      else if (limit_data.sleep_adjust < -0.5)
-        limit_data.sleep_adjust = -0.5;
+    case Z_MEM_ERROR:
+      errno = ENOMEM;
+      return -1;
+    case Z_NEED_DICT:
+    case Z_DATA_ERROR:
+      errno = EINVAL;
+      return -1;
+    case Z_STREAM_END:
+      *done = true;
+      break;
+    }
+  return outlen - gzstream->avail_out;
+}
+
+static bool
+gzip_finish (void *state)
+{
+  z_stream *gzstream = state;
+  int err = inflateEnd (gzstream);
+  xfree (gzstream);
+  return err == Z_OK;
+}
+#endif /* HAVE_LIBZ */
+
+#ifdef HAVE_LIBBROTLIDEC
+static void *
+brotli_start (void)
+{
+  BrotliDecoderState *state = BrotliDecoderCreateInstance (NULL, NULL, NULL);
+  if (!state)
+    errno = ENOMEM;
+  return state;
+}
+
+static int
+brotli_decode (void *state, const char **in, size_t *inlen,
+               char *out, size_t outlen, bool *done)
+{
+  const uint8_t *next_in = (const uint8_t *) *in;
+  uint8_t *next_out = (uint8_t *) out;
+  size_t avail_out = outlen;
+  BrotliDecoderResult res;
+
+  res = BrotliDecoderDecompressStream (state, inlen, &next_in,
+                                       &avail_out, &next_out, NULL);
+  *in = (const char *) next_in;
+
+  if (res == BROTLI_DECODER_RESULT_ERROR)
+    {
+      DEBUGP (("brotli: %s\n", BrotliDecoderErrorString (
+                 BrotliDecoderGetErrorCode (state))));
+      errno = EINVAL;
+      return -1;
+    }
+  if (res == BROTLI_DECODER_RESULT_SUCCESS)
+    *done = true;
+  return outlen - avail_out;
+}
+
+static bool
+brotli_finish (void *state)
+{
+  BrotliDecoderDestroyInstance (state);
+  return true;
+}
+#endif /* HAVE_LIBBROTLIDEC */
+
+#ifdef HAVE_LIBZSTD
+static void *
+zstd_start (void)
+{
+  ZSTD_DStream *state = ZSTD_createDStream ();
+  if (!state || ZSTD_isError (ZSTD_initDStream (state)))
+    {
+      ZSTD_freeDStream (state);
+      errno = ENOMEM;
+      return NULL;
     }
+  return state;
+}
+
+static int
+zstd_decode (void *state, const char **in, size_t *inlen,
+             char *out, size_t outlen, bool *done)
+{
+  ZSTD_inBuffer input = { *in, *inlen, 0 };
+  ZSTD_outBuffer output = { out, outlen, 0 };
+  size_t res = ZSTD_decompressStream (state, &output, &input);
+
+  *in += input.pos;
+  *inlen -= input.pos;
+
+  if (ZSTD_isError (res))
+    {
+      DEBUGP (("zstd: %s\n", ZSTD_getErrorName (res)));
+      errno = EINVAL;
+      return -1;
+    }
+  /* A zstd body may consist of several frames; only the end of the
+     input tells whether the stream ended with this one.  */
+  *done = res == 0 && !*inlen;
+  return output.pos;
+}
+
+static bool
+zstd_finish (void *state)
+{
+  ZSTD_freeDStream (state);
+  return true;
+}
+#endif /* HAVE_LIBZSTD */
+
+static const struct body_decoder body_decoders[] = {
+#ifdef HAVE_LIBZ
+  { rb_compressed_gzip, "zlib", gzip_start, gzip_decode, gzip_finish },
+#endif
+#ifdef HAVE_LIBBROTLIDEC
+  { rb_compressed_brotli, "brotli", brotli_start, brotli_decode,
+    brotli_finish },
+#endif
+#ifdef HAVE_LIBZSTD
+  { rb_compressed_zstd, "zstd", zstd_start, zstd_decode, zstd_finish },
+#endif
+  { 0, NULL, NULL, NULL, NULL }
+};
+
+/* Return the decoder for the Content-Encoding in FLAGS, or NULL if
+   the body is to be written as is.  */
 
-  limit_data.chunk_bytes = 0;
-  limit_data.chunk_start = ptimer_read (timer);
+static const struct body_decoder *
+find_body_decoder (int flags)
+{
+  const struct body_decoder *decoder;
+
+  for (decoder = body_decoders; decoder->flag; decoder++)
+    if (flags & decoder->flag)
+      return decoder;
+  return NULL;
+}
+
+/* The digests fed by fd_read_body.  */
+static struct body_digest *body_digests;
+
+/* Have fd_read_body feed D until body_digest_remove is called.  */
+void
+body_digest_add (struct body_digest *d)
+{
+  d->valid = false;
+  d->unwritten = false;
+  d->length = 0;
+  d->next = body_digests;
+  body_digests = d;
+}
+
+void
+body_digest_remove (struct body_digest *d)
+{
+  struct body_digest **p;
+
+  for (p = &body_digests; *p; p = &(*p)->next)
+    if (*p == d)
+      {
+        *p = d->next;
+        break;
+      }
+}
+
+/* Called when the output file is written other than by fd_read_body,
+   which the digests of it cannot follow.  */
+void
+body_digests_invalidate (void)
+{
+  struct body_digest *d;
+
+  for (d = body_digests; d; d = d->next)
+    if (!d->raw)
+      d->valid = false;
+}
+
+/* Return true if a document needs not be written out to be parsed
+   for links: a digest keeps a copy of it.  */
+bool
+body_digests_capture_p (void)
+{
+  struct body_digest *d;
+
+  for (d = body_digests; d; d = d->next)
+    if (d->documents_only)
+      return true;
+  return false;
+}
+
+/* Restart the digests of OUT for a new body read with FLAGS.  They
+   are only useful if the body is written from the start of the file.  */
+static void
+body_digests_start (FILE *out, wgint startpos, int flags)
+{
+  struct body_digest *d;
+  bool capture_only = flags & rb_capture_only;
+
+  for (d = body_digests; d; d = d->next)
+    if (!d->raw)
+      {
+        d->init (d->ctx);
+        d->length = 0;
+        d->valid = (out != NULL || capture_only) && startpos == 0
+          && (!d->documents_only || (flags & rb_document));
+        d->unwritten = capture_only;
+      }
+}
+
+static void
+body_digests_update (bool raw, const char *buf, size_t len)
+{
+  struct body_digest *d;
+
+  for (d = body_digests; d; d = d->next)
+    if (d->raw == raw && (raw || d->valid))
+      {
+        d->update (buf, len, d->ctx);
+        d->length += len;
+      }
 }
 
 /* Write data in BUF to OUT.  However, if *SKIP is non-zero, skip that
@@ -191,29 +435,17 @@ write_data (FILE *out, FILE *out2, const char *buf, int bufsize,
   if (out2)
     fwrite (buf, 1, bufsize, out2);
 
+  if (body_digests)
+    {
+      if (out)
+        body_digests_update (false, buf, bufsize);
+      if (out2)
+        body_digests_update (true, buf, bufsize);
+    }
+
   if (written)
     *written += bufsize;
 
-  /* Immediately flush the downloaded data.  This should not hinder
-     performance: fast downloads will arrive in large 16K chunks
-     (which stdio would write out immediately anyway), and slow
-     downloads wouldn't be limited by disk speed.  */
-
-  /* 2005-04-20 SMS.
-     Perhaps it shouldn't hinder performance, but it sure does, at least
-     on VMS (more than 2X).  Rather than speculate on what it should or
-     shouldn't do, it might make more sense to test it.  Even better, it
-     might be nice to explain what possible benefit it could offer, as
-     it appears to be a clear invitation to poor performance with no
-     actual justification.  (Also, why 16K?  Anyone test other values?)
-  */
-#ifndef __VMS
-  if (out)
-    fflush (out);
-  if (out2)
-    fflush (out2);
-#endif /* ndef __VMS */
-
   if (out && ferror (out))
     return -2;
   else if (out2 && ferror (out2))
@@ -222,10 +454,155 @@ write_data (FILE *out, FILE *out2, const char *buf, int bufsize,
   return 0;
 }
 
+/* Like write_data, for a body read with rb_capture_only.  */
+
+static int
+capture_data (const char *buf, int bufsize, wgint *written)
+{
+  body_digests_update (false, buf, bufsize);
+  *written += bufsize;
+  return 0;
+}
+
+/* Decode the LEN bytes at BUF, the next part of a chunked body,
+   moving the data of its chunks to the start of BUF unless SCAN.
+   Returns the length of that data, or -1 if the chunking is
+   malformed.  *USED is set to the number of bytes of BUF that belong
+   to the body, which is less than LEN only once its end is seen.  */
+
+int
+dechunk (struct dechunker *dc, char *buf, int len, int *used, bool scan)
+{
+  char *p = buf, *end = buf + len, *out = buf, *nl;
+  int n;
+
+  while (p < end && dc->state != CHUNK_DONE)
+    switch (dc->state)
+      {
+      case CHUNK_SIZE_START:
+        if (*p == ' ' || *p == '\t')
+          {
+            ++p;
+            break;
+          }
+        dc->state = CHUNK_SIZE;
+        dc->remaining = 0;
+        dc->digits = 0;
+        /* fall through */
+      case CHUNK_SIZE:
+        if (c_isxdigit (*p))
+          {
+            /* Refuse sizes that don't fit in a wgint.  */
+            if (++dc->digits > 15)
+              return -1;
+            dc->remaining = (dc->remaining << 4) + _unhex (*p++);
+            break;
+          }
+        if (!dc->digits)
+          return -1;
+        dc->state = CHUNK_SIZE_REST;
+        /* fall through */
+      case CHUNK_SIZE_REST:
+      case CHUNK_DATA_END:
+      case CHUNK_TRAILER:
+        /* The extensions, anything between the data and the next size,
+           and the trailer fields are ignored.  */
+        nl = memchr (p, '\n', end - p);
+        if (!nl)
+          {
+            p = end;
+            break;
+          }
+        p = nl + 1;
+        if (dc->state == CHUNK_SIZE_REST)
+          dc->state = dc->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+        else if (dc->state == CHUNK_DATA_END)
+          dc->state = CHUNK_SIZE_START;
+        else
+          dc->state = CHUNK_TRAILER_START;
+        break;
+      case CHUNK_DATA:
+        n = MIN (dc->remaining, end - p);
+        if (!scan && out != p)
+          memmove (out, p, n);
+        out += n;
+        p += n;
+        dc->remaining -= n;
+        if (!dc->remaining)
+          dc->state = CHUNK_DATA_END;
+        break;
+      case CHUNK_TRAILER_START:
+        if (*p == '\r')
+          ++p;
+        else if (*p == '\n')
+          {
+            ++p;
+            dc->state = CHUNK_DONE;
+          }
+        else
+          dc->state = CHUNK_TRAILER;
+        break;
+      case CHUNK_DONE:
+        break;
+      }
+
+  *used = p - buf;
+  return out - buf;
+}
+
+/* fd_read_body starts out reading DLBUF_INITIAL_SIZE bytes at a time,
+   and doubles that, up to DLBUF_MAX_SIZE, whenever a read fills the
+   whole buffer, i.e. when data arrives faster than it is read.  */
+#define DLBUF_INITIAL_SIZE (64 * 1024)
+#define DLBUF_MAX_SIZE (1024 * 1024)
+
+/* fd_read_body hands the progress gauge the bytes received at most
+   this often, in seconds.  The gauges don't redraw more often than
+   that anyway, and updating one costs far more than counting.  */
+#define PROGRESS_UPDATE_INTERVAL 0.05
+
+/* The buffers used by fd_read_body.  They are kept from one call to
+   the next, so that retrieving many small files doesn't allocate
+   them for each file.  */
+static char *dlbuf;
+static int dlbuf_size;
+static char *decbuf;
+#define DECBUF_SIZE (4 * DLBUF_INITIAL_SIZE)
+
+/* Make sure dlbuf can hold SIZE bytes.  Its contents are not kept,
+   so this must not be called while they are still needed.  */
+
+static void
+dlbuf_reserve (int size)
+{
+  if (size > dlbuf_size)
+    {
+      xfree (dlbuf);
+      dlbuf = xmalloc (size);
+      dlbuf_size = size;
+    }
+}
+
+/* Bring the position of OUT up to date with that of its descriptor,
+   which fd_recv_file wrote to behind its back, once it has written
+   all it received.  OUT must have been flushed.  Return false if
+   writing failed.  */
+
+static bool
+sync_file_position (FILE *out)
+{
+  bool ok = fd_recv_file_finish () == 0;
+  off_t pos = lseek (fileno (out), 0, SEEK_CUR);
+  if (pos >= 0)
+    fseeko (out, pos, SEEK_SET);
+  return ok;
+}
+
 /* Read the contents of file descriptor FD until it the connection
    terminates or a read error occurs.  The data is read in portions of
    up to 16K and written to OUT as it arrives.  If opt.verbose is set,
-   the progress is shown.
+   the progress is shown.  HOST is the host FD is connected to, whose
+   rate limit applies along with the global one.
 
    TOREAD is the amount of data expected to arrive, normally only used
    by the progress gauge.
@@ -240,7 +617,9 @@ write_data (FILE *out, FILE *out2, const char *buf, int bufsize,
    If OUT2 is non-NULL, the contents is also written to OUT2.
    OUT2 will get an exact copy of the response: if this is a chunked
    response, everything -- including the chunk headers -- is written
-   to OUT2.  (OUT will only get the unchunked response.)
+   to OUT2.  (OUT will only get the unchunked response.)  A chunked
+   body is read in blocks like any other, and whatever is read past
+   its end is given back to FD with fd_unread.
 
    The function exits and returns the amount of data read.  In case of
    error while reading data, -1 is returned.  In case of error while
@@ -248,14 +627,16 @@ write_data (FILE *out, FILE *out2, const char *buf, int bufsize,
    data to OUT2, -3 is returned.  */
 
 int
-fd_read_body (const char *downloaded_filename, int fd, FILE *out, wgint toread, wgint startpos,
+fd_read_body (const char *downloaded_filename, int fd, const char *host,
+              FILE *out, wgint toread, wgint startpos,
 
               wgint *qtyread, wgint *qtywritten, double *elapsed, int flags,
               FILE *out2)
 {
   int ret = 0;
-  int dlbufsize = MAX (BUFSIZ, 64 * 1024);
-  char *dlbuf = xmalloc (dlbufsize);
+  /* How much to read at a time.  */
+  int dlbufsize = DLBUF_INITIAL_SIZE;
+  int dlbufsize_max = DLBUF_MAX_SIZE;
 
   struct ptimer *timer = NULL;
   double last_successful_read_tm = 0;
@@ -270,48 +651,75 @@ fd_read_body (const char *downloaded_filename, int fd, FILE *out, wgint toread,
   bool progress_interactive = false;
 
   bool exact = !!(flags & rb_read_exactly);
+  bool capture_only = !!(flags & rb_capture_only);
 
   /* Used only by HTTP/HTTPS chunked transfer encoding.  */
   bool chunked = flags & rb_chunked_transfer_encoding;
+  struct dechunker dc = { CHUNK_SIZE_START, 0, 0 };
   wgint skip = 0;
 
+  /* Where the data goes along with OUT.  A chunked body goes to OUT2
+     as it was read, before it is dechunked.  */
+  FILE *data_out2 = chunked ? NULL : out2;
+
   /* How much data we've read/written.  */
   wgint sum_read = 0;
   wgint sum_written = 0;
-  wgint remaining_chunk_size = 0;
 
-#ifdef HAVE_LIBZ
-  /* try to minimize the number of calls to inflate() and write_data() per
-     call to fd_read() */
-  unsigned int gzbufsize = dlbufsize * 4;
-  char *gzbuf = NULL;
-  z_stream gzstream;
+  /* When the written data was last flushed.  */
+  double last_flush_tm = 0;
 
-  if (flags & rb_compressed_gzip)
+  /* Bytes not yet reported to the progress gauge, and when it was
+     last updated.  */
+  wgint progress_pending = 0;
+  double last_progress_tm = 0;
+
+  /* Undoes the Content-Encoding, if any.  */
+  const struct body_decoder *decoder = find_body_decoder (flags);
+  void *decoder_state = NULL;
+  bool decoder_done = false;
+  wgint sum_decoded = 0;
+
+  /* Whether the body can go from FD to OUT without passing through
+     dlbuf, and whether some did since the position of OUT was last
+     brought up to date.  */
+  bool splice = false;
+  bool spliced = false;
+
+  if (decoder)
     {
-      gzbuf = xmalloc (gzbufsize);
-      gzstream.zalloc = zalloc;
-      gzstream.zfree = zfree;
-      gzstream.opaque = Z_NULL;
-      gzstream.next_in = Z_NULL;
-      gzstream.avail_in = 0;
-
-      #define GZIP_DETECT 32 /* gzip format detection */
-      #define GZIP_WINDOW 15 /* logarithmic window size (default: 15) */
-      ret = inflateInit2 (&gzstream, GZIP_DETECT | GZIP_WINDOW);
-      if (ret != Z_OK)
+      decoder_state = decoder->start ();
+      if (!decoder_state)
         {
-          xfree (gzbuf);
-          errno = (ret == Z_MEM_ERROR) ? ENOMEM : EINVAL;
+          decoder = NULL;
           ret = -1;
           goto out;
         }
+      /* Decoding into a buffer larger than the reads keeps down the
+         number of calls to the decoder and to write_data.  */
+      if (!decbuf)
+        decbuf = xmalloc (DECBUF_SIZE);
     }
-#endif
 
   if (flags & rb_skip_startpos)
     skip = startpos;
 
+  if (body_digests)
+    body_digests_start (out, startpos, flags);
+
+  /* The kernel can only move the data when nothing needs to see it on
+     the way.  */
+  if (out && out != stdout && !capture_only && !chunked && !decoder
+      && !out2 && !body_digests && !skip
+      && !opt.limit_rate && !opt.limit_rate_per_host)
+    splice = fd_splice_p (fd);
+
+  /* The length of a compressed body says nothing about how much will
+     be written.  */
+  if (opt.preallocate && out && toread > skip
+      && !decoder)
+    preallocate_file (out, toread - skip);
+
   if (opt.show_progress)
     {
       const char *filename_progress;
@@ -327,24 +735,16 @@ fd_read_body (const char *downloaded_filename, int fd, FILE *out, wgint toread,
       progress_interactive = progress_interactive_p (progress);
     }
 
-  if (opt.limit_rate)
-    limit_bandwidth_reset ();
-
   /* A timer is needed for tracking progress, for throttling, and for
      tracking elapsed time.  If either of these are requested, start
      the timer.  */
-  if (progress || opt.limit_rate || elapsed)
+  if (progress || elapsed || opt.flush_interval)
     {
       timer = ptimer_new ();
       last_successful_read_tm = 0;
     }
 
-  /* Use a smaller buffer for low requested bandwidths.  For example,
-     with --limit-rate=2k, it doesn't make sense to slurp in 16K of
-     data and then sleep for 8s.  With buffer size equal to the limit,
-     we never have to sleep for more than one second.  */
-  if (opt.limit_rate && opt.limit_rate < dlbufsize)
-    dlbufsize = opt.limit_rate;
+  status_transfer_begin (downloaded_filename, host, startpos, toread);
 
   /* Read from FD while there is data to read.  Normally toread==0
      means that it is unknown how much data is to arrive.  However, if
@@ -354,50 +754,10 @@ fd_read_body (const char *downloaded_filename, int fd, FILE *out, wgint toread,
     {
       int rdsize;
       double tmout = opt.read_timeout;
+      bool in_file = false;
 
-      if (chunked)
-        {
-          if (remaining_chunk_size == 0)
-            {
-              char *line = fd_read_line (fd);
-              char *endl;
-              if (line == NULL)
-                {
-                  ret = -1;
-                  break;
-                }
-              else if (out2 != NULL)
-                fwrite (line, 1, strlen (line), out2);
-
-              remaining_chunk_size = strtol (line, &endl, 16);
-              xfree (line);
-
-              if (remaining_chunk_size < 0)
-                {
-                  ret = -1;
-                  break;
-                }
-
-              if (remaining_chunk_size == 0)
-                {
-                  ret = 0;
-                  line = fd_read_line (fd);
-                  if (line == NULL)
-                    ret = -1;
-                  else
-                    {
-                      if (out2 != NULL)
-                        fwrite (line, 1, strlen (line), out2);
-                      xfree (line);
-                    }
-                  break;
-                }
-            }
-
-          rdsize = MIN (remaining_chunk_size, dlbufsize);
-        }
-      else
-        rdsize = exact ? MIN (toread - sum_read, dlbufsize) : dlbufsize;
+      rdsize = exact && !chunked ? MIN (toread - sum_read, dlbufsize)
+                                 : dlbufsize;
 
       if (progress_interactive)
         {
@@ -425,85 +785,159 @@ fd_read_body (const char *downloaded_filename, int fd, FILE *out, wgint toread,
                 }
             }
         }
-      ret = fd_read (fd, dlbuf, rdsize, tmout);
+      /* Wait for the rate limits to allow the read, and read no more
+         than they allow.  */
+      if (opt.limit_rate || opt.limit_rate_per_host)
+        {
+          double delay;
+          while ((delay = throttle_delay (host)) > 0)
+            xsleep (delay);
+          rdsize = throttle_quota (host, rdsize);
+        }
+
+      ret = -2;
+      if (splice)
+        {
+          /* What went through OUT must come first.  */
+          fflush (out);
+          ret = fd_recv_file (fd, fileno (out), rdsize, tmout);
+          in_file = ret > 0;
+          spliced |= in_file;
+        }
+      if (ret == -2)
+        {
+          if (spliced)
+            {
+              spliced = false;
+              if (!sync_file_position (out))
+                {
+                  ret = -2;
+                  goto out;
+                }
+            }
+          /* Only as much as is read, so that short bodies don't need a
+             large buffer.  */
+          dlbuf_reserve (rdsize);
+          ret = fd_read (fd, dlbuf, rdsize, tmout);
+        }
+
+      /* A full buffer means more data was waiting; read more at a
+         time from now on.  */
+      if (ret == dlbufsize && dlbufsize < dlbufsize_max)
+        dlbufsize = MIN (dlbufsize * 2, dlbufsize_max);
 
       if (progress_interactive && ret < 0 && errno == ETIMEDOUT)
         ret = 0;                /* interactive timeout, handled above */
+      else if (ret == 0 && chunked)
+        {
+          /* The connection may only end after the last chunk.  */
+          ret = -1;
+          break;
+        }
       else if (ret <= 0)
         break;                  /* EOF or read error */
 
-      if (progress || opt.limit_rate || elapsed)
+      if (progress || elapsed || opt.flush_interval)
         {
           ptimer_measure (timer);
           if (ret > 0)
             last_successful_read_tm = ptimer_read (timer);
         }
 
+      /* Parse the chunking in place, leaving the data of the chunks at
+         the start of dlbuf.  What follows the body belongs to the
+         next response and is given back.  */
+      if (chunked && ret > 0)
+        {
+          int used, w;
+
+          if (out2)
+            {
+              struct dechunker probe = dc;
+              if (dechunk (&probe, dlbuf, ret, &used, true) < 0)
+                {
+                  ret = -1;
+                  break;
+                }
+              w = write_data (NULL, out2, dlbuf, used, NULL, NULL);
+              if (w < 0)
+                {
+                  ret = w;
+                  goto out;
+                }
+            }
+          w = dechunk (&dc, dlbuf, ret, &used, false);
+          if (w < 0)
+            {
+              ret = -1;
+              break;
+            }
+          fd_unread (fd, dlbuf + used, ret - used);
+          ret = w;
+        }
+
       if (ret > 0)
         {
           int write_res;
 
           sum_read += ret;
 
-#ifdef HAVE_LIBZ
-          if (gzbuf)
+          if (decoder)
             {
-              int err;
-              int towrite;
+              const char *in = dlbuf;
+              size_t inlen = ret;
+              int towrite = 0;
 
               /* Write original data to WARC file */
-              write_res = write_data (NULL, out2, dlbuf, ret, NULL, NULL);
+              write_res = write_data (NULL, data_out2, dlbuf, ret, NULL, NULL);
               if (write_res < 0)
                 {
                   ret = write_res;
                   goto out;
                 }
 
-              gzstream.avail_in = ret;
-              gzstream.next_in = (unsigned char *) dlbuf;
-
-              do
+              /* Decode until the input is used up and the output
+                 didn't fill the buffer, so that nothing is left
+                 pending.  Whatever follows the end of the stream is
+                 ignored.  */
+              while (!decoder_done && (inlen || towrite == DECBUF_SIZE))
                 {
-                  gzstream.avail_out = gzbufsize;
-                  gzstream.next_out = (unsigned char *) gzbuf;
-
-                  err = inflate (&gzstream, Z_NO_FLUSH);
-
-                  switch (err)
+                  STATS_START (start);
+                  towrite = decoder->decode (decoder_state, &in, &inlen,
+                                             decbuf, DECBUF_SIZE,
+                                             &decoder_done);
+                  if (towrite < 0)
                     {
-                    case Z_MEM_ERROR:
-                      errno = ENOMEM;
                       ret = -1;
                       goto out;
-                    case Z_NEED_DICT:
-                    case Z_DATA_ERROR:
-                      errno = EINVAL;
-                      ret = -1;
-                      goto out;
-                    case Z_STREAM_END:
-                      if (exact && sum_read != toread)
-                        {
-                          DEBUGP(("zlib stream ended unexpectedly after %"PRId64"/%"PRId64
-                                  " bytes\n", sum_read, toread));
-                        }
                     }
-
-                  towrite = gzbufsize - gzstream.avail_out;
-                  write_res = write_data (out, NULL, gzbuf, towrite, &skip,
-                                          &sum_written);
+                  STATS_STOP (STATS_DECODE, start, towrite);
+                  write_res = capture_only
+                    ? capture_data (decbuf, towrite, &sum_written)
+                    : write_data (out, NULL, decbuf, towrite, &skip,
+                                  &sum_written);
                   if (write_res < 0)
                     {
                       ret = write_res;
                       goto out;
                     }
                 }
-              while (gzstream.avail_out == 0);
+
+              sum_decoded += ret - inlen;
+              if (decoder_done && exact && sum_read != toread)
+                {
+                  DEBUGP(("%s stream ended unexpectedly after %"PRId64"/%"PRId64
+                          " bytes\n", decoder->name, sum_read, toread));
+                }
             }
+          else if (in_file)
+            sum_written += ret;
           else
-#endif
             {
-              write_res = write_data (out, out2, dlbuf, ret, &skip,
-                                      &sum_written);
+              write_res = capture_only
+                ? capture_data (dlbuf, ret, &sum_written)
+                : write_data (out, data_out2, dlbuf, ret, &skip,
+                              &sum_written);
               if (write_res < 0)
                 {
                   ret = write_res;
@@ -511,44 +945,88 @@ fd_read_body (const char *downloaded_filename, int fd, FILE *out, wgint toread,
                 }
             }
 
-          if (chunked)
+#ifndef __VMS
+          /* Flush the written data now and then, so that an
+             interrupted download leaves most of it on disk and the
+             file can be watched as it grows.  Flushing after every
+             read, which --flush-interval=0 still does, costs a lot of
+             throughput on some systems: more than 2X on VMS, and
+             worse on Windows with antivirus software scanning each
+             write.  Standard output is always flushed, for the sake
+             of whatever is reading from it.  */
+          if (out == stdout || !opt.flush_interval
+              || ptimer_read (timer) - last_flush_tm >= opt.flush_interval)
             {
-              remaining_chunk_size -= ret;
-              if (remaining_chunk_size == 0)
+              if (out)
+                fflush (out);
+              if (out2)
+                fflush (out2);
+              if (timer)
+                last_flush_tm = ptimer_read (timer);
+              if (out && ferror (out))
                 {
-                  char *line = fd_read_line (fd);
-                  if (line == NULL)
-                    {
-                      ret = -1;
-                      break;
-                    }
-                  else
-                    {
-                      if (out2 != NULL)
-                        fwrite (line, 1, strlen (line), out2);
-                      xfree (line);
-                    }
+                  ret = -2;
+                  goto out;
+                }
+              if (out2 && ferror (out2))
+                {
+                  ret = -3;
+                  goto out;
                 }
             }
+#endif /* ndef __VMS */
         }
 
-      if (opt.limit_rate)
-        limit_bandwidth (ret, timer);
+      if (ret > 0)
+        {
+          throttle_account (host, ret);
+          status_transfer.bytes += ret;
+        }
 
-      if (progress)
-        progress_update (progress, ret, ptimer_read (timer));
+      /* An interactive timeout (ret == 0) is passed on at once, so
+         that the gauge notices stalls and keeps moving.  */
+      progress_pending += ret;
+      if (progress
+          && (ret == 0
+              || ptimer_read (timer) - last_progress_tm
+                 >= PROGRESS_UPDATE_INTERVAL))
+        {
+          last_progress_tm = ptimer_read (timer);
+          progress_update (progress, progress_pending, last_progress_tm);
+          progress_pending = 0;
 #ifdef WINDOWS
-      if (toread > 0 && opt.show_progress)
-        ws_percenttitle (100.0 *
-                         (startpos + sum_read) / (startpos + toread));
+          if (toread > 0)
+            ws_percenttitle (100.0 *
+                             (startpos + sum_read) / (startpos + toread));
 #endif
+        }
+      status_poll ();
+
+      if (dc.state == CHUNK_DONE)
+        {
+          ret = 0;
+          break;
+        }
     }
   if (ret < -1)
     ret = -1;
 
  out:
+  /* Write out what is left in the buffers, and catch the errors that
+     only show up then.  */
+  if (out && fflush (out) != 0 && ret >= 0)
+    ret = -2;
+  if (spliced && !sync_file_position (out) && ret >= 0)
+    ret = -2;
+  if (out2 && fflush (out2) != 0 && ret >= 0)
+    ret = -3;
+
   if (progress)
-    progress_finish (progress, ptimer_read (timer));
+    {
+      if (progress_pending)
+        progress_update (progress, progress_pending, ptimer_read (timer));
+      progress_finish (progress, ptimer_read (timer));
+    }
 
   if (timer)
     {
@@ -557,14 +1035,15 @@ fd_read_body (const char *downloaded_filename, int fd, FILE *out, wgint toread,
       ptimer_destroy (timer);
     }
 
-#ifdef HAVE_LIBZ
-  if (gzbuf)
+  status_transfer_end ();
+
+  if (decoder)
     {
-      int err = inflateEnd (&gzstream);
+      bool ok = decoder->finish (decoder_state);
       if (ret >= 0)
         {
           /* with compression enabled, ret must be 0 if successful */
-          if (err == Z_OK)
+          if (ok)
             ret = 0;
           else
             {
@@ -572,23 +1051,18 @@ fd_read_body (const char *downloaded_filename, int fd, FILE *out, wgint toread,
               ret = -1;
             }
         }
-      xfree (gzbuf);
-
-      if (gzstream.total_in != (uLong) sum_read)
+      if (sum_decoded != sum_read)
         {
-          DEBUGP(("zlib read size differs from raw read size (%lu/%"PRId64")\n",
-                  gzstream.total_in, sum_read));
+          DEBUGP(("%s read size differs from raw read size (%"PRId64"/%"PRId64")\n",
+                  decoder->name, sum_decoded, sum_read));
         }
     }
-#endif
 
   if (qtyread)
     *qtyread += sum_read;
   if (qtywritten)
     *qtywritten += sum_written;
 
-  xfree (dlbuf);
-
   return ret;
 }
 
@@ -607,33 +1081,23 @@ fd_read_body (const char *downloaded_filename, int fd, FILE *out, wgint toread,
    not contain the terminator.
 
    The TERMINATOR function is called with three arguments: the
-   beginning of the data read so far, the beginning of the current
-   block of peeked-at data, and the length of the current block.
-   Depending on its needs, the function is free to choose whether to
-   analyze all data or just the newly arrived data.  If TERMINATOR
-   returns NULL, it means that the terminator has not been seen.
-   Otherwise it should return a pointer to the charactre immediately
-   following the terminator.
+   beginning of the data read so far, the beginning of the block of
+   data just read, and the length of that block.  Depending on its
+   needs, the function is free to choose whether to analyze all data
+   or just the newly arrived data.  If TERMINATOR returns NULL, it
+   means that the terminator has not been seen.  Otherwise it should
+   return a pointer to the charactre immediately following the
+   terminator.
 
    The idea is to be able to read a line of input, or otherwise a hunk
    of text, such as the head of an HTTP request, without crossing the
    boundary, so that the next call to fd_read etc. reads the data
-   after the hunk.  To achieve that, this function does the following:
-
-   1. Peek at incoming data.
-
-   2. Determine whether the peeked data, along with the previously
-      read data, includes the terminator.
-
-      2a. If yes, read the data until the end of the terminator, and
-          exit.
-
-      2b. If no, read the peeked data and goto 1.
-
-   The function is careful to assume as little as possible about the
-   implementation of peeking.  For example, every peek is followed by
-   a read.  If the read returns a different amount of data, the
-   process is retried until all data arrives safely.
+   after the hunk.  Rather than peeking at the data and reading it
+   again, which costs two system calls and, over TLS, two copies out
+   of the decrypted data, the data is read as it comes, and what
+   follows the terminator is given back with fd_unread.  The next
+   reads from FD, such as those of fd_read_body for the body that
+   follows the response head, return it first.
 
    SIZEHINT is the buffer size sufficient to hold all the data in the
    typical case (it is used as the initial buffer size).  MAXSIZE is
@@ -655,53 +1119,14 @@ fd_read_hunk (int fd, hunk_terminator_t terminator, long sizehint, long maxsize)
   while (1)
     {
       const char *end;
-      int pklen, rdlen, remain;
-
-      /* First, peek at the available data. */
-
-      pklen = fd_peek (fd, hunk + tail, bufsize - 1 - tail, -1);
-      if (pklen < 0)
-        {
-          xfree (hunk);
-          return NULL;
-        }
-      end = terminator (hunk, hunk + tail, pklen);
-      if (end)
-        {
-          /* The data contains the terminator: we'll drain the data up
-             to the end of the terminator.  */
-          remain = end - (hunk + tail);
-          assert (remain >= 0);
-          if (remain == 0)
-            {
-              /* No more data needs to be read. */
-              hunk[tail] = '\0';
-              return hunk;
-            }
-          if (bufsize - 1 < tail + remain)
-            {
-              bufsize = tail + remain + 1;
-              hunk = xrealloc (hunk, bufsize);
-            }
-        }
-      else
-        /* No terminator: simply read the data we know is (or should
-           be) available.  */
-        remain = pklen;
-
-      /* Now, read the data.  Note that we make no assumptions about
-         how much data we'll get.  (Some TCP stacks are notorious for
-         read returning less data than the previous MSG_PEEK.)  */
+      int rdlen;
 
-      rdlen = fd_read (fd, hunk + tail, remain, 0);
+      rdlen = fd_read (fd, hunk + tail, bufsize - 1 - tail, -1);
       if (rdlen < 0)
         {
           xfree (hunk);
           return NULL;
         }
-      tail += rdlen;
-      hunk[tail] = '\0';
-
       if (rdlen == 0)
         {
           if (tail == 0)
@@ -711,14 +1136,24 @@ fd_read_hunk (int fd, hunk_terminator_t terminator, long sizehint, long maxsize)
               errno = 0;
               return NULL;
             }
-          else
-            /* EOF seen: return the data we've read. */
-            return hunk;
+          /* EOF seen: return the data we've read. */
+          hunk[tail] = '\0';
+          return hunk;
         }
-      if (end && rdlen == remain)
-        /* The terminator was seen and the remaining data drained --
-           we got what we came for.  */
-        return hunk;
+
+      end = terminator (hunk, hunk + tail, rdlen);
+      if (end)
+        {
+          /* The terminator was seen: the data after it is for the
+             next reader.  */
+          assert (end >= hunk + tail && end <= hunk + tail + rdlen);
+          fd_unread (fd, end, hunk + tail + rdlen - end);
+          tail = end - hunk;
+          hunk[tail] = '\0';
+          return hunk;
+        }
+      tail += rdlen;
+      hunk[tail] = '\0';
 
       /* Keep looping until all the data arrives. */
 
@@ -834,7 +1269,121 @@ calc_rate (wgint bytes, double secs, int *units)
   return dlrate;
 }
 
-
+
+/* Permanent redirections.  A 301 or 308 response to a GET says that
+   the document has moved for good, so the redirection is remembered
+   for as long as the Cache-Control of the response allows.  Then
+   retrieve_url goes straight to the new location, and the recursion
+   enqueues the new location instead of the old one.  Without this,
+   a site whose pages link to http:// URLs that all redirect to
+   https://, or to directories without their trailing slash, costs
+   an extra request per link.  */
+
+struct moved_url {
+  char *to;                     /* the new location, absolute */
+  time_t expires;               /* when to forget it, 0 for never */
+};
+
+/* Mapping of URLs to their struct moved_url.  */
+static struct hash_table *moved_urls;
+
+/* Remember that FROM has moved permanently to LOCATION, which may be
+   relative to it.  If MAX_AGE is not negative, the redirection is
+   forgotten after that many seconds.  */
+
+void
+moved_permanently_add (const struct url *from, const char *location,
+                       int64_t max_age)
+{
+  struct url *to = url_new_init ();
+  struct moved_url *m;
+  char *old_key;
+
+  to->ori_url = url_merge (from->url, location);
+  if (url_parse (to, true, true) != 0 || !strcmp (to->url, from->url))
+    {
+      url_free (to);
+      return;
+    }
+
+  if (!moved_urls)
+    moved_urls = make_string_hash_table (0);
+  if (hash_table_get_pair (moved_urls, from->url, &old_key, &m))
+    xfree (m->to);
+  else
+    {
+      m = xnew (struct moved_url);
+      hash_table_put (moved_urls, xstrdup (from->url), m);
+    }
+  m->to = xstrdup (to->url);
+  m->expires = max_age >= 0 ? time (NULL) + max_age : 0;
+  DEBUGP (("Remembering that %s has moved to %s.\n", from->url, m->to));
+  url_free (to);
+}
+
+/* The new location of U, following the remembered permanent
+   redirections, as a new struct url, or NULL if U hasn't moved.  */
+
+struct url *
+moved_permanently_lookup (const struct url *u)
+{
+  const char *url = u->url;
+  struct moved_url *m;
+  struct url *to;
+  time_t now;
+  int hops;
+
+  if (!moved_urls)
+    return NULL;
+  now = time (NULL);
+  /* A chain of redirections ends where the server said it does, or
+     after as many redirections as are followed by default, in case
+     it loops.  */
+  for (hops = 0; hops < 20; hops++)
+    {
+      m = hash_table_get (moved_urls, url);
+      if (!m || (m->expires && m->expires <= now))
+        break;
+      url = m->to;
+    }
+  if (url == u->url)
+    return NULL;
+
+  to = url_new_init ();
+  to->ori_url = xstrdup (url);
+  if (u->content_enc)
+    {
+      xfree (to->content_enc);
+      to->content_enc = xstrdup (u->content_enc);
+    }
+  if (url_parse (to, true, true) != 0)
+    {
+      url_free (to);
+      return NULL;
+    }
+  return to;
+}
+
+/* Forget the permanent redirections.  */
+
+void
+moved_permanently_cleanup (void)
+{
+  hash_table_iterator iter;
+
+  if (!moved_urls)
+    return;
+  for (hash_table_iterate (moved_urls, &iter); hash_table_iter_next (&iter); )
+    {
+      struct moved_url *m = iter.value;
+      xfree (iter.key);
+      xfree (m->to);
+      xfree (m);
+    }
+  hash_table_destroy (moved_urls);
+  moved_urls = NULL;
+}
+
 #define SUSPEND_METHOD do {                     \
   method_suspended = true;                      \
   saved_body_data = opt.body_data;              \
@@ -884,6 +1433,9 @@ retrieve_url (struct url * orig_parsed, char **file,
   char *saved_method = NULL;
   char *saved_body_file_name = NULL;
 
+  /* The digest of the file for --dedup-files.  */
+  struct dedup_digest *dedup;
+
   /* If dt is NULL, use local storage.  */
   if (!dt)
     {
@@ -899,6 +1451,8 @@ retrieve_url (struct url * orig_parsed, char **file,
   if (!refurl)
     refurl = opt.referer;
 
+  dedup = dedup_begin ();
+
  redirected:
   /* (also for IRI fallbacking) */
 
@@ -937,6 +1491,36 @@ retrieve_url (struct url * orig_parsed, char **file,
       xfree (proxy);
     }
 
+  /* A permanent redirection already seen for a GET is followed
+     without asking the server again.  */
+  if (schemes_are_similar_p (u->scheme, SCHEME_HTTP)
+      && (!opt.method || !c_strcasecmp (opt.method, "GET")
+          || !c_strcasecmp (opt.method, "HEAD")))
+    {
+      struct url *moved = moved_permanently_lookup (u);
+      if (moved)
+        {
+          logprintf (LOG_VERBOSE, _("%s has moved permanently to %s.\n"),
+                     escnonprint_uri (u->url), escnonprint_uri (moved->url));
+          url_free (proxy_url);
+          if (++redirection_count > opt.max_redirect)
+            {
+              logprintf (LOG_NOTQUIET, _("%d redirections exceeded.\n"),
+                         opt.max_redirect);
+              url_free (moved);
+              xfree (url);
+              result = WRONGCODE;
+              goto bail;
+            }
+          xfree (url);
+          url = xstrdup (moved->url);
+          if (orig_parsed != u)
+            url_free (u);
+          u = moved;
+          goto redirected;
+        }
+    }
+
   if (u->scheme == SCHEME_HTTP
 #ifdef HAVE_SSL
       || u->scheme == SCHEME_HTTPS
@@ -1076,7 +1660,7 @@ retrieve_url (struct url * orig_parsed, char **file,
     }
 
   /* Try to not encode in UTF-8 if fetching failed */
-  if (!(*dt & RETROKF) && u->enc_type == ENC_IRI)
+  if (!(*dt & RETROKF) && u->enc_type == ENC_IRI && result != RETRYLATER)
     {
       struct url *u2 = url_new_init ();
       u2->ori_url = xstrdup (u->ori_url);
@@ -1105,6 +1689,9 @@ retrieve_url (struct url * orig_parsed, char **file,
       url_free (u2);
     }
 
+  if (local_file && result == RETROK && (*dt & RETROKF))
+    dedup_end (&dedup, local_file);
+
   if (local_file && u && (*dt & RETROKF || opt.content_on_error))
     {
       /* Store a copy of url for link conversion in case of `orig_parsed == u`
@@ -1143,6 +1730,7 @@ retrieve_url (struct url * orig_parsed, char **file,
 
 bail:
   RESTORE_METHOD;
+  dedup_end (&dedup, NULL);
 
   if (orig_parsed != u)
     url_free (u);
@@ -1153,9 +1741,164 @@ bail:
   return result;
 }
 
+/* How many URLs of the input file are read ahead of the one being
+   retrieved, when --preconnect, --pipeline or HTTP/2 can make use of
+   them.  Both the preconnections and the pipelined requests are capped
+   at about as many.  */
+#define INPUT_LOOKAHEAD 16
+
+/* The URLs of the input file: either all of them, as found in an HTML
+   file, or read from a text file as they are needed, so that a long
+   list doesn't have to be held in memory.  The first AHEAD_COUNT are
+   read already, in AHEAD.  */
+
+struct input_urls {
+  struct urlpos *list;          /* the URLs found in an HTML file */
+  struct url_file *file;        /* or the text file they are read from */
+  struct urlpos *ahead, *ahead_tail;
+  int ahead_count;
+  struct url_set *seen;         /* the URLs read, with --input-unique */
+};
+
+/* Read URLs from INPUT until N of them are ahead, or there are no
+   more.  */
+
+static void
+input_urls_fill (struct input_urls *input, int n)
+{
+  while (input->ahead_count < n)
+    {
+      struct urlpos *entry;
+
+      if (input->list)
+        {
+          entry = input->list;
+          input->list = entry->next;
+        }
+      else if (input->file)
+        {
+          entry = url_file_next (input->file);
+          if (!entry)
+            {
+              url_file_close (input->file);
+              input->file = NULL;
+            }
+        }
+      else
+        entry = NULL;
+      if (!entry)
+        break;
+
+      entry->next = NULL;
+      if (input->seen && !url_set_add (input->seen, entry->url->url))
+        {
+          DEBUGP (("Skipping %s, which came up before in the input file.\n",
+                   entry->url->url));
+          free_urlpos (entry);
+          continue;
+        }
+      if (input->ahead_tail)
+        input->ahead_tail->next = entry;
+      else
+        input->ahead = entry;
+      input->ahead_tail = entry;
+      ++input->ahead_count;
+    }
+}
+
+/* Take the next URL of INPUT, or return NULL at the end.  */
+
+static struct urlpos *
+input_urls_next (struct input_urls *input)
+{
+  struct urlpos *entry;
+
+  input_urls_fill (input, 1);
+  entry = input->ahead;
+  if (entry)
+    {
+      input->ahead = entry->next;
+      if (!input->ahead)
+        input->ahead_tail = NULL;
+      --input->ahead_count;
+      entry->next = NULL;
+    }
+  return entry;
+}
+
+static void
+input_urls_free (struct input_urls *input)
+{
+  free_urlpos (input->ahead);
+  free_urlpos (input->list);
+  if (input->file)
+    url_file_close (input->file);
+  if (input->seen)
+    url_set_free (input->seen);
+}
+
+/* Prepare for the URLs following CURRENT in INPUT, the way the
+   recursion does for its queue: start connecting to their hosts with
+   --preconnect, and have the requests of those on the same host as
+   CURRENT sent ahead with --pipeline or opened as HTTP/2 streams.  */
+
+static void
+input_urls_prepare (struct input_urls *input, struct url *current)
+{
+  const struct urlpos *entry;
+  bool same_host = true;
+
+  if (opt.preconnect <= 0 && opt.pipeline <= 0
+#ifdef HAVE_NGHTTP2
+      && !opt.http2
+#endif
+      )
+    return;
+
+  input_urls_fill (input, INPUT_LOOKAHEAD);
+  http_pipeline_hints_clear ();
+  if ((current->scheme != SCHEME_HTTP
+#ifdef HAVE_SSL
+       && current->scheme != SCHEME_HTTPS
+#endif
+       ) || url_uses_proxy (current))
+    same_host = false;
+
+  for (entry = input->ahead; entry; entry = entry->next)
+    {
+      struct url *u = entry->url;
+      bool on_current = u->port == current->port
+        && URL_SAME_HOST (u, current);
+      bool ssl = false;
+
+      if (entry->ignore_when_downloading)
+        continue;
+
+      /* The run of URLs on the host of CURRENT can share its
+         connection, and the others need their own.  */
+      if (same_host && on_current && u->scheme == current->scheme)
+        http_pipeline_hint (u, NULL);
+      else
+        same_host = false;
+
+      if (opt.preconnect <= 0 || on_current || url_uses_proxy (u))
+        continue;
+#ifdef HAVE_SSL
+      ssl = u->scheme == SCHEME_HTTPS;
+#endif
+      if (u->scheme != SCHEME_FTP
+#ifdef HAVE_SSL
+          && u->scheme != SCHEME_FTPS
+#endif
+          && persistent_connection_exists_p (u->host, u->port, ssl))
+        continue;
+      preconnect_to_host (u->host, u->port, opt.preconnect);
+    }
+}
+
 /* Find the URLs in the file and call retrieve_url() for each of them.
    If HTML is true, treat the file as HTML, and construct the URLs
-   accordingly.
+   accordingly.  A text file is read as the URLs are retrieved.
 
    If opt.recursive is set, call retrieve_tree() for each file.  */
 
@@ -1163,7 +1906,8 @@ uerr_t
 retrieve_from_file (const char *file, bool html, int *count)
 {
   uerr_t status;
-  struct urlpos *url_list, *cur_url;
+  struct input_urls input;
+  struct urlpos *cur_url;
   struct url *url_parsed = url_new_init ();
 
   char *input_file, *url_file = NULL;
@@ -1209,13 +1953,18 @@ retrieve_from_file (const char *file, bool html, int *count)
       input_file = (char *) file;
     }
 
-  url_list = (html ? get_urls_html (input_file, url_parsed, false)
-              : get_urls_file (input_file, url_parsed->content_enc));
+  xzero (input);
+  if (opt.input_unique)
+    input.seen = url_set_new ();
+  if (html)
+    input.list = get_urls_html (input_file, url_parsed, false);
+  else
+    input.file = url_file_open (input_file, url_parsed->content_enc);
 
   url_free (url_parsed);
   xfree (url_file);
 
-  for (cur_url = url_list; cur_url; cur_url = cur_url->next, ++*count)
+  for (; (cur_url = input_urls_next (&input)); free_urlpos (cur_url), ++*count)
     {
       char *filename = NULL, *new_file = NULL, *proxy;
       int dt = 0;
@@ -1226,6 +1975,7 @@ retrieve_from_file (const char *file, bool html, int *count)
       if (opt.quota && total_downloaded_bytes > opt.quota)
         {
           status = QUOTEXC;
+          free_urlpos (cur_url);
           break;
         }
 
@@ -1253,6 +2003,7 @@ retrieve_from_file (const char *file, bool html, int *count)
         }
       else
         {
+          input_urls_prepare (&input, cur_url->url);
           status = retrieve_url (cur_url->url, &filename,
                                  &new_file, NULL, &dt, opt.recursive, true);
         }
@@ -1273,9 +2024,206 @@ Removing file due to --delete-after in retrieve_from_file():\n"));
       xfree (filename);
     }
 
-  /* Free the linked list of URL-s.  */
-  free_urlpos (url_list);
+  /* Free the URLs not retrieved.  */
+  input_urls_free (&input);
+  http_pipeline_hints_clear ();
+  preconnect_discard_all ();
+
+  return status;
+}
+
+/* Run the batch job JOB: a URL, optionally followed by TAB-separated
+   options for that job alone.  Store the URL to *URL_STRING, and the
+   file the document was saved to, if known, to *FILE.  */
+static uerr_t
+retrieve_batch_job (char *job, const char **url_string, char **file)
+{
+  FILE *saved_output_stream = output_stream;
+  bool saved_output_stream_regular = output_stream_regular;
+  char *saved_output_document = opt.output_document;
+  char **saved_user_headers = opt.user_headers;
+  char **headers = NULL;
+  char *output = NULL;
+  char *filename = NULL, *new_file = NULL;
+  char *field, *next;
+  struct url *u;
+  int dt = 0, url_err, i;
+  uerr_t status;
+
+  next = strchr (job, '\t');
+  if (next)
+    *next++ = '\0';
+  *url_string = job;
+
+  for (i = 0; saved_user_headers && saved_user_headers[i]; i++)
+    headers = vec_append (headers, saved_user_headers[i]);
+
+  for (field = next; field; field = next)
+    {
+      next = strchr (field, '\t');
+      if (next)
+        *next++ = '\0';
+
+      if (!strncmp (field, "output=", 7) && field[7] && !HYPHENP (field + 7))
+        output = field + 7;
+      else if (!strncmp (field, "header=", 7) && strchr (field + 7, ':'))
+        headers = vec_append (headers, field + 7);
+      else if (*field)
+        {
+          logprintf (LOG_NOTQUIET, _("%s: Invalid batch job option %s.\n"),
+                     job, quote (field));
+          free_vec (headers);
+          return URLERROR;
+        }
+    }
+
+  u = url_new_init ();
+  u->ori_url = xstrdup (job);
+  url_err = url_parse (u, true, true);
+  if (url_err)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s.\n", job, url_error (url_err));
+      url_free (u);
+      free_vec (headers);
+      return URLERROR;
+    }
+
+  if (output)
+    {
+      struct stat st;
+
+      output_stream = fopen (output, opt.always_rest ? "ab" : "wb");
+      if (!output_stream)
+        {
+          logprintf (LOG_NOTQUIET, "%s: %s\n", output, strerror (errno));
+          output_stream = saved_output_stream;
+          url_free (u);
+          free_vec (headers);
+          return FOPENERR;
+        }
+      output_stream_regular = fstat (fileno (output_stream), &st) == 0
+        && S_ISREG (st.st_mode);
+      opt.output_document = output;
+    }
+  opt.user_headers = headers;
+
+  if ((opt.recursive || opt.page_requisites)
+      && ((u->scheme != SCHEME_FTP
+#ifdef HAVE_SSL
+           && u->scheme != SCHEME_FTPS
+#endif
+           ) || url_uses_proxy (u)))
+    {
+      int old_follow_ftp = opt.follow_ftp;
+
+      /* Turn opt.follow_ftp on in case of recursive FTP retrieval */
+      if (u->scheme == SCHEME_FTP
+#ifdef HAVE_SSL
+          || u->scheme == SCHEME_FTPS
+#endif
+          )
+        opt.follow_ftp = 1;
+
+      status = retrieve_tree (u);
+
+      opt.follow_ftp = old_follow_ftp;
+    }
+  else
+    status = retrieve_url (u, &filename, &new_file, NULL, &dt,
+                           opt.recursive, true);
+
+  if (filename && opt.delete_after && file_exists_p (filename, NULL))
+    {
+      logprintf (LOG_VERBOSE, _("Removing %s.\n"), filename);
+      if (unlink (filename))
+        logprintf (LOG_NOTQUIET, "Failed to unlink %s: (%d) %s\n", filename, errno, strerror (errno));
+      xfree (filename);
+    }
+
+  if (output)
+    {
+      if (fclose (output_stream) != 0 && status == RETROK)
+        status = FWRITEERR;
+      xfree (filename);
+      filename = xstrdup (output);
+      output_stream = saved_output_stream;
+      output_stream_regular = saved_output_stream_regular;
+      opt.output_document = saved_output_document;
+    }
+  opt.user_headers = saved_user_headers;
+  free_vec (headers);
+
+  url_free (u);
+  xfree (new_file);
+  *file = filename;
+  return status;
+}
+
+/* Run the download jobs read from FILE, or from the standard input if
+   FILE is "-", one per line and as soon as each line arrives.  As
+   they all run in this process, the DNS cache, the persistent
+   connections, the TLS sessions, and the HSTS and cookie state are
+   kept from one job to the next.
+
+   A job is a URL, optionally followed by TAB-separated options that
+   apply to that job alone:
+
+     output=FILE    save the document to FILE, as with -O FILE
+     header=LINE    send LINE as an additional header, as with --header
+
+   Empty lines and lines beginning with `#' are ignored.  When a job
+   is done, the line "STATUS\tFILE\tURL" is written to the standard
+   output, where STATUS is the exit status Wget would have returned
+   for that job alone, and FILE is the file the document was saved to,
+   or "-".  */
+uerr_t
+retrieve_from_batch (const char *file)
+{
+  char *line = NULL;
+  size_t bufsize = 0;
+  ssize_t len;
+  uerr_t status = RETROK;
+  FILE *fp;
+
+  fp = HYPHENP (file) ? stdin : fopen (file, "r");
+  if (!fp)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", file, strerror (errno));
+      return FOPENERR;
+    }
+
+  while ((len = getline (&line, &bufsize, fp)) > 0)
+    {
+      const char *url = NULL;
+      char *filename = NULL;
+      uerr_t job_status;
+
+      if (line[len - 1] == '\n')
+        line[--len] = '\0';
+      if (len > 0 && line[len - 1] == '\r')
+        line[--len] = '\0';
+      if (!*line || *line == '#')
+        continue;
+
+      if (opt.quota && total_downloaded_bytes > opt.quota)
+        {
+          status = QUOTEXC;
+          break;
+        }
 
+      job_status = retrieve_batch_job (line, &url, &filename);
+      if (job_status != RETROK)
+        status = job_status;
+
+      printf ("%d\t%s\t%s\n", get_status_for_err (job_status),
+              filename ? filename : "-", url);
+      fflush (stdout);
+      xfree (filename);
+    }
+
+  xfree (line);
+  if (fp != stdin)
+    fclose (fp);
   return status;
 }
 
@@ -1287,50 +2235,269 @@ printwhat (int n1, int n2)
   logputs (LOG_VERBOSE, (n1 == n2) ? _("Giving up.\n\n") : _("Retrying.\n\n"));
 }
 
-/* If opt.wait or opt.waitretry are specified, and if certain
-   conditions are met, sleep the appropriate number of seconds.  See
-   the documentation of --wait and --waitretry for more information.
+/* --wait is kept per host: what is waited for is the interval since
+   the last request to the same host, so that a crawl spanning several
+   hosts can go on with another one in the meantime.  The Crawl-delay
+   of a host's robots.txt, if longer, is waited for instead.
 
-   COUNT is the count of current retrieval, beginning with 1. */
+   The retrievals are done one after the other: the one started by the
+   last call to sleep_between_retrievals is over when the next call,
+   or one to politeness_delay, is made.  */
 
-void
-sleep_between_retrievals (int count)
+struct host_visit {
+  double next;                  /* when the next retrieval may start */
+  double retry;                 /* and when a retry of the last may,
+                                   which --random-wait doesn't vary */
+};
+
+/* Mapping of host names to their struct host_visit.  */
+static struct hash_table *host_visits;
+static struct ptimer *visit_timer;
+
+/* The host of the retrieval in progress, if any, and its port.  */
+static char *visit_host;
+static int visit_port;
+
+/* The attempts already made at the URLs whose retry was deferred, by
+   URL.  See retry_schedule.  */
+static struct hash_table *deferred_tries;
+
+/* Whether the caller of retrieve_url takes a deferred retry.  */
+static bool retry_deferrable;
+
+/* Return the struct host_visit of HOST, making it if need be.  */
+
+static struct host_visit *
+host_visit_get (const char *host)
 {
-  static bool first_retrieval = true;
+  struct host_visit *v;
 
-  if (first_retrieval)
+  if (!host_visits)
+    host_visits = make_nocase_string_hash_table (0);
+  v = hash_table_get (host_visits, host);
+  if (!v)
     {
-      /* Don't sleep before the very first retrieval. */
-      first_retrieval = false;
-      return;
+      v = xnew0 (struct host_visit);
+      hash_table_put (host_visits, xstrdup (host), v);
     }
+  return v;
+}
+
+/* Record the end of the retrieval in progress.  */
+
+static void
+politeness_release (void)
+{
+  struct robot_specs *specs;
+  struct host_visit *v;
+  double interval = opt.wait, crawl_delay = 0, now;
 
-  if (opt.waitretry && count > 1)
+  if (!visit_host)
+    return;
+
+  if (opt.use_robots && (specs = res_get_specs (visit_host, visit_port)))
+    crawl_delay = res_crawl_delay (specs);
+  if (opt.wait || crawl_delay)
     {
-      /* If opt.waitretry is specified and this is a retry, wait for
-         COUNT-1 number of seconds, or for opt.waitretry seconds.  */
-      if (count <= opt.waitretry)
-        xsleep (count - 1);
-      else
-        xsleep (opt.waitretry);
+      /* Wait a random amount of time averaging in opt.wait seconds.
+         The waiting amount ranges from 0.5*opt.wait to
+         1.5*opt.wait.  */
+      if (opt.random_wait)
+        interval *= 0.5 + random_float ();
+      interval = MAX (interval, crawl_delay);
+
+      v = host_visit_get (visit_host);
+      now = ptimer_measure (visit_timer);
+      v->next = now + interval;
+      v->retry = now + MAX (opt.wait, crawl_delay);
+      DEBUGP (("Next request to %s in %.2f s.\n", visit_host, interval));
+    }
+  xfree (visit_host);
+}
+
+/* Return the number of seconds to wait before retrieving U, so as
+   not to make requests to its host more often than --wait and the
+   host's Crawl-delay allow.  RETRY is true for another attempt at the
+   retrieval that was done last.  */
+
+static double
+host_delay (const struct url *u, bool retry)
+{
+  struct host_visit *v;
+
+  politeness_release ();
+  if (!host_visits || !(v = hash_table_get (host_visits, u->host)))
+    return 0;
+  return MAX (0, (retry ? v->retry : v->next) - ptimer_measure (visit_timer));
+}
+
+/* Return the number of seconds to wait before retrieving U.  */
+
+double
+politeness_delay (const struct url *u)
+{
+  return host_delay (u, false);
+}
+
+/* The longest Retry-After honoured beyond --waitretry, in seconds.  */
+#define RETRY_AFTER_MAX 300
+
+/* Return the number of seconds to wait after attempt COUNT at a
+   retrieval failed.  The wait doubles with each attempt, from one
+   second up to --waitretry, and is jittered down by up to half, so
+   that the clients a server turned away together don't come back
+   together.  RETRY_AFTER is the wait the server asked for with
+   Retry-After, if positive: it is honoured up to --waitretry or
+   RETRY_AFTER_MAX seconds, whichever is longer.  */
+
+static double
+retry_backoff (int count, double retry_after)
+{
+  double delay = 0;
+
+  if (opt.waitretry > 0)
+    {
+      delay = 1;
+      while (--count > 0 && delay < opt.waitretry)
+        delay *= 2;
+      delay = MIN (delay, opt.waitretry);
+      delay *= 1 - random_float () / 2;
     }
-  else if (opt.wait)
+  if (retry_after > delay)
+    delay = MIN (retry_after, MAX (opt.waitretry, RETRY_AFTER_MAX));
+  return delay;
+}
+
+/* Schedule another attempt at U, attempt COUNT at which just failed,
+   unless it was the last one --tries allows.  The host is backed off
+   as retry_backoff says, and every retrieval from it waits for that,
+   whereas the retrievals from other hosts can go on.  RETRY_AFTER is
+   the wait asked for by the server, or 0.
+
+   If DEFER, and the caller of retrieve_url takes deferred retries
+   (see retry_deferral), the attempt is left to it: true is returned
+   and the caller of this function gives up on U for now with
+   RETRYLATER.  The attempts made so far are remembered, so that
+   --tries limits all of them.  */
+
+bool
+retry_schedule (const struct url *u, int count, double retry_after,
+                bool defer)
+{
+  double delay;
+  char *key;
+
+  if (opt.ntry && count >= opt.ntry)
+    return false;
+
+  if (!visit_timer)
+    visit_timer = ptimer_new ();
+  politeness_release ();
+
+  delay = retry_backoff (count, retry_after);
+  if (delay > 0)
     {
-      if (!opt.random_wait || count > 1)
-        /* If random-wait is not specified, or if we are sleeping
-           between retries of the same download, sleep the fixed
-           interval.  */
-        xsleep (opt.wait);
-      else
+      struct host_visit *v = host_visit_get (u->host);
+      double until = ptimer_measure (visit_timer) + delay;
+
+      v->next = MAX (v->next, until);
+      v->retry = MAX (v->retry, until);
+      DEBUGP (("Backing off %s for %.2f s.\n", u->host, delay));
+    }
+
+  if (!defer || !retry_deferrable)
+    return false;
+
+  if (!deferred_tries)
+    deferred_tries = make_string_hash_table (0);
+  if (!hash_table_get_pair (deferred_tries, u->url, &key, NULL))
+    key = xstrdup (u->url);
+  hash_table_put (deferred_tries, key, (void *) (intptr_t) count);
+  return true;
+}
+
+/* Set whether the caller of retrieve_url takes deferred retries, by
+   queueing the URL again when RETRYLATER is returned.  Returns the
+   previous setting.  */
+
+bool
+retry_deferral (bool deferrable)
+{
+  bool previous = retry_deferrable;
+  retry_deferrable = deferrable;
+  return previous;
+}
+
+/* Return the number of attempts made at U before its retry was
+   deferred, or 0.  */
+
+int
+retry_deferred_tries (const struct url *u)
+{
+  char *key;
+  void *tries;
+
+  if (!deferred_tries
+      || !hash_table_get_pair (deferred_tries, u->url, &key, &tries))
+    return 0;
+  hash_table_remove (deferred_tries, u->url);
+  xfree (key);
+  return (intptr_t) tries;
+}
+
+/* Sleep as long as --wait, the backoff of a retry and the Crawl-delay
+   of the host call for before retrieving U.  See the documentation of
+   --wait and --waitretry for more information.
+
+   COUNT is the count of current retrieval, beginning with 1. */
+
+void
+sleep_between_retrievals (const struct url *u, int count)
+{
+  double delay;
+
+  if (!visit_timer)
+    visit_timer = ptimer_new ();
+
+  if ((delay = host_delay (u, count > 1)) > 0)
+    {
+      DEBUGP (("Waiting %.2f s before the request to %s.\n",
+               delay, u->host));
+      xsleep (delay);
+    }
+
+  visit_host = xstrdup (u->host);
+  visit_port = u->port;
+}
+
+/* Free the memory of the per-host waits.  */
+
+void
+politeness_cleanup (void)
+{
+  if (host_visits)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (host_visits, &iter);
+           hash_table_iter_next (&iter);
+           )
         {
-          /* Sleep a random amount of time averaging in opt.wait
-             seconds.  The sleeping amount ranges from 0.5*opt.wait to
-             1.5*opt.wait.  */
-          double waitsecs = (0.5 + random_float ()) * opt.wait;
-          DEBUGP (("sleep_between_retrievals: avg=%f,sleep=%f\n",
-                   opt.wait, waitsecs));
-          xsleep (waitsecs);
+          xfree (iter.key);
+          xfree (iter.value);
         }
+      hash_table_destroy (host_visits);
+      host_visits = NULL;
+    }
+  if (deferred_tries)
+    {
+      string_set_free (deferred_tries);
+      deferred_tries = NULL;
+    }
+  xfree (visit_host);
+  if (visit_timer)
+    {
+      ptimer_destroy (visit_timer);
+      visit_timer = NULL;
     }
 }
 
@@ -1519,3 +2686,162 @@ input_file_url (const char *input_file)
   else
     return false;
 }
+
+#if defined TESTING && !defined WINDOWS
+
+const char *
+test_fd_read_hunk (void)
+{
+  static const char data[] =
+    "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nbody"
+    "first line\nsecond";
+  char buf[16];
+  char *head, *line;
+  int fds[2], n;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return NULL;
+  if (write (fds[1], data, sizeof (data) - 1) != sizeof (data) - 1)
+    {
+      close (fds[0]);
+      close (fds[1]);
+      return NULL;
+    }
+  close (fds[1]);
+
+  /* The head is read along with what follows it, which is given back
+     to the next reads.  */
+  head = fd_read_hunk (fds[0], line_terminator, 512, 0);
+  mu_assert ("test_fd_read_hunk: first line",
+             head && !strcmp (head, "HTTP/1.1 200 OK\r\n"));
+  xfree (head);
+  line = fd_read_line (fds[0]);
+  mu_assert ("test_fd_read_hunk: given back",
+             line && !strcmp (line, "Content-Length: 4\r\n"));
+  xfree (line);
+  line = fd_read_line (fds[0]);
+  mu_assert ("test_fd_read_hunk: empty line",
+             line && !strcmp (line, "\r\n"));
+  xfree (line);
+
+  n = fd_peek (fds[0], buf, 4, -1);
+  mu_assert ("test_fd_read_hunk: peek", n == 4 && !memcmp (buf, "body", 4));
+  n = fd_read (fds[0], buf, 4, -1);
+  mu_assert ("test_fd_read_hunk: body", n == 4 && !memcmp (buf, "body", 4));
+
+  line = fd_read_line (fds[0]);
+  mu_assert ("test_fd_read_hunk: line after the body",
+             line && !strcmp (line, "first line\n"));
+  xfree (line);
+  line = fd_read_line (fds[0]);
+  mu_assert ("test_fd_read_hunk: last line without terminator",
+             line && !strcmp (line, "second"));
+  xfree (line);
+  line = fd_read_line (fds[0]);
+  mu_assert ("test_fd_read_hunk: EOF", !line && errno == 0);
+
+  fd_close (fds[0]);
+  return NULL;
+}
+
+#endif /* TESTING && !WINDOWS */
+
+#ifdef TESTING
+
+const char *
+test_dechunk (void)
+{
+  static const char body[] =
+    "4;ext=1\r\nWiki\r\n5\r\npedia\r\n0\r\nTrailer: x\r\n\r\nNEXT";
+  struct dechunker dc;
+  char buf[sizeof (body)], out[sizeof (body)];
+  int len = sizeof (body) - 1, pos, step, n, used, total;
+
+  /* The same body in pieces of every size, so that every line is
+     split across reads somewhere.  */
+  for (step = 1; step <= len; step++)
+    {
+      memset (&dc, 0, sizeof (dc));
+      total = 0;
+      for (pos = 0; pos < len && dc.state != CHUNK_DONE; pos += used)
+        {
+          int piece = MIN (step, len - pos);
+          memcpy (buf, body + pos, piece);
+          n = dechunk (&dc, buf, piece, &used, false);
+          mu_assert ("test_dechunk: well-formed", n >= 0);
+          memcpy (out + total, buf, n);
+          total += n;
+        }
+      mu_assert ("test_dechunk: done", dc.state == CHUNK_DONE);
+      mu_assert ("test_dechunk: data",
+                 total == 9 && !memcmp (out, "Wikipedia", 9));
+      mu_assert ("test_dechunk: stops at the end",
+                 !strcmp (body + pos, "NEXT"));
+    }
+
+  memset (&dc, 0, sizeof (dc));
+  memcpy (buf, "xyz\r\n", 5);
+  mu_assert ("test_dechunk: bad size", dechunk (&dc, buf, 5, &used, false) < 0);
+
+  return NULL;
+}
+
+const char *
+test_moved_permanently (void)
+{
+  struct url *from = url_new_init (), *mid = url_new_init (), *to;
+
+  from->ori_url = xstrdup ("http://example.com/dir");
+  mid->ori_url = xstrdup ("https://example.com/dir/");
+  mu_assert ("test_moved_permanently: parse",
+             url_parse (from, true, false) == 0
+             && url_parse (mid, true, false) == 0);
+
+  mu_assert ("test_moved_permanently: not moved",
+             !moved_permanently_lookup (from));
+
+  /* The trailing slash added after the switch to HTTPS.  */
+  moved_permanently_add (from, "https://example.com/dir/", -1);
+  moved_permanently_add (mid, "index.html", -1);
+  to = moved_permanently_lookup (from);
+  mu_assert ("test_moved_permanently: chain",
+             to && !strcmp (to->url, "https://example.com/dir/index.html"));
+  url_free (to);
+
+  /* An expired redirection is not followed.  */
+  moved_permanently_add (from, "https://example.com/elsewhere", 0);
+  mu_assert ("test_moved_permanently: expired",
+             !moved_permanently_lookup (from));
+
+  url_free (mid);
+  url_free (from);
+  moved_permanently_cleanup ();
+  return NULL;
+}
+
+const char *
+test_retry_backoff (void)
+{
+  double waitretry = opt.waitretry, delay;
+
+  opt.waitretry = 10;
+  delay = retry_backoff (1, 0);
+  mu_assert ("test_retry_backoff: first", delay >= 0.5 && delay <= 1);
+  delay = retry_backoff (3, 0);
+  mu_assert ("test_retry_backoff: doubled", delay >= 2 && delay <= 4);
+  delay = retry_backoff (20, 0);
+  mu_assert ("test_retry_backoff: capped", delay >= 5 && delay <= 10);
+  mu_assert ("test_retry_backoff: Retry-After",
+             retry_backoff (1, 60) == 60);
+  mu_assert ("test_retry_backoff: Retry-After capped",
+             retry_backoff (1, 86400) == RETRY_AFTER_MAX);
+
+  opt.waitretry = 0;
+  mu_assert ("test_retry_backoff: no --waitretry",
+             retry_backoff (5, 0) == 0 && retry_backoff (5, 30) == 30);
+
+  opt.waitretry = waitretry;
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -50,10 +50,69 @@ enum {
   /* Used by HTTP/HTTPS*/
   rb_chunked_transfer_encoding = 4,
 
-  rb_compressed_gzip = 8
+  rb_compressed_gzip = 8,
+
+  /* The body is an HTML or CSS document.  */
+  rb_document = 16,
+
+  rb_compressed_brotli = 32,
+  rb_compressed_zstd = 64,
+
+  /* The body goes nowhere but to the digests of the output.  */
+  rb_capture_only = 128
+};
+
+int fd_read_body (const char *, int, const char *, FILE *, wgint, wgint, wgint *, wgint *, double *, int, FILE *);
+
+/* A running digest that fd_read_body feeds with the data it writes,
+   so that it needs not be computed by reading the file back.  A RAW
+   digest is fed what goes to OUT2; the others are fed what goes to OUT
+   and are restarted by each call, since each call writes the file
+   anew.  */
+struct body_digest
+{
+  void (*init) (void *);                        /* not used if RAW */
+  void (*update) (const char *, size_t, void *);
+  void *ctx;                    /* passed to the above */
+  bool raw;
+  bool documents_only;          /* only fed rb_document bodies */
+  bool valid;                   /* covers OUT from its start */
+  bool unwritten;               /* the body was only digested */
+  wgint length;                 /* number of bytes digested */
+  struct body_digest *next;
 };
 
-int fd_read_body (const char *, int, FILE *, wgint, wgint, wgint *, wgint *, double *, int, FILE *);
+void body_digest_add (struct body_digest *);
+void body_digest_remove (struct body_digest *);
+void body_digests_invalidate (void);
+bool body_digests_capture_p (void);
+
+/* Where the decoding of a body sent with the chunked transfer coding
+   is.  The chunk-size lines, the CRLF after the data of each chunk
+   and the trailer are parsed where they were read, as they come, so
+   that they cost neither an allocation nor a read of their own.  A
+   zeroed dechunker is at the start of a body.  */
+enum chunk_state
+{
+  CHUNK_SIZE_START,             /* before the size of a chunk */
+  CHUNK_SIZE,                   /* in its hex digits */
+  CHUNK_SIZE_REST,              /* in the extensions and line end after them */
+  CHUNK_DATA,                   /* in the data of the chunk */
+  CHUNK_DATA_END,               /* in the line end after the data */
+  CHUNK_TRAILER_START,          /* at the start of a trailer line */
+  CHUNK_TRAILER,                /* in a trailer line */
+  CHUNK_DONE                    /* past the empty line ending the body */
+};
+
+struct dechunker
+{
+  enum chunk_state state;
+  wgint remaining;              /* bytes left of the chunk, or its size
+                                   so far in CHUNK_SIZE */
+  int digits;                   /* digits of the size so far */
+};
+
+int dechunk (struct dechunker *, char *, int, int *, bool);
 
 typedef const char *(*hunk_terminator_t) (const char *, const char *, int);
 
@@ -63,15 +122,25 @@ char *fd_read_line (int);
 uerr_t retrieve_url (struct url *, char **, char **,
                      const char *, int *, bool, bool);
 uerr_t retrieve_from_file (const char *, bool, int *);
+uerr_t retrieve_from_batch (const char *);
 
 const char *retr_rate (wgint, double);
 double calc_rate (wgint, double, int *);
 void printwhat (int, int);
 
-void sleep_between_retrievals (int);
+void sleep_between_retrievals (const struct url *, int);
+bool retry_schedule (const struct url *, int, double, bool);
+bool retry_deferral (bool);
+int retry_deferred_tries (const struct url *);
+double politeness_delay (const struct url *);
+void politeness_cleanup (void);
 
 void rotate_backups (const char *);
 
+void moved_permanently_add (const struct url *, const char *, int64_t);
+struct url *moved_permanently_lookup (const struct url *);
+void moved_permanently_cleanup (void);
+
 bool url_uses_proxy (struct url *);
 
 void set_local_file (const char **, const char *);
@@ -32,16 +32,20 @@ as that of the covered work.  */
 
 #include <stdio.h>
 #include <errno.h>
-#include <assert.h>
 
 #include "spider.h"
 #include "url.h"
 #include "utils.h"
-#include "hash.h"
 #include "res.h"
+#include "urlset.h"
 
-
-static struct hash_table *nonexisting_urls_set;
+/* The broken links, in the order they were found.  The set only
+   keeps them from being listed twice: a crawl that checks many links
+   then holds the fingerprints of the URLs rather than a hash table of
+   them.  */
+static struct url_set *nonexisting_urls_set;
+static char **nonexisting_urls;
+static int nonexisting_count, nonexisting_size;
 
 /* Cleanup the data structures associated with this file.  */
 
@@ -49,8 +53,15 @@ static struct hash_table *nonexisting_urls_set;
 void
 spider_cleanup (void)
 {
+  int i;
+
   if (nonexisting_urls_set)
-    string_set_free (nonexisting_urls_set);
+    url_set_free (nonexisting_urls_set);
+  nonexisting_urls_set = NULL;
+  for (i = 0; i < nonexisting_count; i++)
+    xfree (nonexisting_urls[i]);
+  xfree (nonexisting_urls);
+  nonexisting_count = nonexisting_size = 0;
 }
 #endif
 
@@ -62,37 +73,32 @@ nonexisting_url (const char *url)
   if (is_robots_txt_url (url))
     return;
   if (!nonexisting_urls_set)
-    nonexisting_urls_set = make_string_hash_table (0);
-  string_set_add (nonexisting_urls_set, url);
+    nonexisting_urls_set = url_set_new ();
+  if (!url_set_add (nonexisting_urls_set, url))
+    return;
+  DO_REALLOC (nonexisting_urls, nonexisting_size, nonexisting_count + 1,
+              char *);
+  nonexisting_urls[nonexisting_count++] = xstrdup (url);
 }
 
 void
 print_broken_links (void)
 {
-  hash_table_iterator iter;
-  int num_elems;
+  int i;
 
-  if (!nonexisting_urls_set)
+  if (!nonexisting_count)
     {
       logprintf (LOG_NOTQUIET, _("Found no broken links.\n\n"));
       return;
     }
 
-  num_elems = hash_table_count (nonexisting_urls_set);
-  assert (num_elems > 0);
-
   logprintf (LOG_NOTQUIET, ngettext("Found %d broken link.\n\n",
-                                    "Found %d broken links.\n\n", num_elems),
-             num_elems);
-
-  for (hash_table_iterate (nonexisting_urls_set, &iter);
-       hash_table_iter_next (&iter); )
-    {
-      /* Struct url_list *list; */
-      const char *url = (const char *) iter.key;
+                                    "Found %d broken links.\n\n",
+                                    nonexisting_count),
+             nonexisting_count);
 
-      logprintf (LOG_NOTQUIET, _("%s\n"), url);
-    }
+  for (i = 0; i < nonexisting_count; i++)
+    logprintf (LOG_NOTQUIET, _("%s\n"), nonexisting_urls[i]);
   logputs (LOG_NOTQUIET, "\n");
 }
 
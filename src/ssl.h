@@ -34,7 +34,14 @@ as that of the covered work.  */
 
 bool ssl_init (void);
 void ssl_cleanup (void);
-bool ssl_connect_wget (int, const char *, int *);
+bool ssl_connect_wget (int, const char *, int *, bool *);
 bool ssl_check_certificate (int, const char *);
 
+#ifdef HAVE_HTTP3
+/* HTTP/3 is only built with GnuTLS.  */
+# include <gnutls/gnutls.h>
+bool ssl_quic_prepare (gnutls_session_t, const char *);
+bool ssl_quic_check_certificate (gnutls_session_t, const char *);
+#endif
+
 #endif /* GEN_SSLFUNC_H */
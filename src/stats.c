@@ -0,0 +1,124 @@
+/* Counters of hot operations for --stats.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#include "wget.h"
+
+#ifdef ENABLE_STATS
+
+#include <stdio.h>
+
+#include "stats.h"
+#include "ptimer.h"
+#include "utils.h"
+
+/* The counters are always updated, which costs an increment or two;
+   only the clock reads for the timings depend on --stats.  Configure
+   with --disable-stats to leave all of it out.  */
+
+struct stats_counter stats_counters[STATS_ENTRIES];
+
+static const struct {
+  const char *name;
+  const char *unit;             /* of the amount, NULL if not counted */
+  bool timed;
+} stats_info[STATS_ENTRIES] = {
+  [STATS_FD_READ]       = { "fd_read", "bytes", true },
+  [STATS_FD_WRITE]      = { "fd_write", "bytes", true },
+  [STATS_URL_PARSE]     = { "url_parse", NULL, true },
+  [STATS_MAP_HTML_TAGS] = { "map_html_tags", "bytes", true },
+  [STATS_CONVERT_LINKS] = { "convert_links", NULL, true },
+  [STATS_DNS_CACHED]    = { "lookup_host cached", NULL, false },
+  [STATS_DNS_RESOLVED]  = { "lookup_host resolved", NULL, true },
+  [STATS_HASH_LOOKUP]   = { "hash lookups", "groups", false },
+  [STATS_PCONN_HIT]     = { "connection reused", NULL, false },
+  [STATS_PCONN_MISS]    = { "connection opened", NULL, false },
+  [STATS_DECODE]        = { "body decoding", "bytes", true },
+};
+
+static struct ptimer *stats_timer;
+
+/* Return the time to pass to stats_stop once the operation ends.  */
+
+double
+stats_now (void)
+{
+  if (!opt.stats)
+    return 0;
+  if (!stats_timer)
+    stats_timer = ptimer_new ();
+  return ptimer_measure (stats_timer);
+}
+
+/* Count an ENTRY operation that began at START and involved AMOUNT
+   units.  */
+
+void
+stats_stop (enum stats_entry entry, double start, wgint amount)
+{
+  struct stats_counter *c = &stats_counters[entry];
+
+  c->calls++;
+  c->amount += amount;
+  if (opt.stats)
+    c->time += stats_now () - start;
+}
+
+/* Print the table of counters, if --stats asks for it.  */
+
+void
+stats_print (void)
+{
+  int i;
+
+  if (!opt.stats)
+    return;
+
+  logprintf (LOG_ALWAYS, "\n%-22s %12s %16s %12s\n",
+             _("operation"), _("calls"), _("amount"), _("seconds"));
+  for (i = 0; i < STATS_ENTRIES; i++)
+    {
+      const struct stats_counter *c = &stats_counters[i];
+      char amount[32] = "", time[32] = "";
+
+      if (stats_info[i].unit)
+        snprintf (amount, sizeof (amount), "%s %s",
+                  number_to_static_string (c->amount), stats_info[i].unit);
+      if (stats_info[i].timed)
+        snprintf (time, sizeof (time), "%.3f", c->time);
+      logprintf (LOG_ALWAYS, "%-22s %12s %16s %12s\n", stats_info[i].name,
+                 number_to_static_string (c->calls), amount, time);
+    }
+  if (stats_counters[STATS_HASH_LOOKUP].calls)
+    logprintf (LOG_ALWAYS, _("%.2f groups probed per hash lookup\n"),
+               (double) stats_counters[STATS_HASH_LOOKUP].amount
+               / stats_counters[STATS_HASH_LOOKUP].calls);
+}
+
+#endif /* ENABLE_STATS */
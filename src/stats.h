@@ -0,0 +1,86 @@
+/* Declarations for stats.c
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#ifndef STATS_H
+#define STATS_H
+
+/* Operations counted for --stats.  */
+enum stats_entry
+{
+  STATS_FD_READ,                /* fd_read and fd_read_nb */
+  STATS_FD_WRITE,               /* fd_write */
+  STATS_URL_PARSE,              /* url_parse */
+  STATS_MAP_HTML_TAGS,          /* map_html_tags */
+  STATS_CONVERT_LINKS,          /* convert_links, per file */
+  STATS_DNS_CACHED,             /* lookup_host answered from the cache */
+  STATS_DNS_RESOLVED,           /* lookup_host asking the resolver */
+  STATS_HASH_LOOKUP,            /* find_cell in hash.c */
+  STATS_PCONN_HIT,              /* persistent connection reused */
+  STATS_PCONN_MISS,             /* new connection opened */
+  STATS_DECODE,                 /* body decompression */
+  STATS_ENTRIES
+};
+
+#ifdef ENABLE_STATS
+
+struct stats_counter {
+  wgint calls;
+  wgint amount;                 /* bytes, probes, ... */
+  double time;                  /* seconds, only with --stats */
+};
+
+extern struct stats_counter stats_counters[STATS_ENTRIES];
+
+double stats_now (void);
+void stats_stop (enum stats_entry, double, wgint);
+void stats_print (void);
+
+/* Count an ENTRY operation involving N units.  */
+# define STATS_ADD(entry, n) do {                       \
+  stats_counters[entry].calls++;                        \
+  stats_counters[entry].amount += (n);                  \
+} while (0)
+
+/* Declare VAR holding the time an operation started, and count the
+   operation, with N units, and its duration when it ends.  Reading the clock is the
+   only part left out without --stats.  */
+# define STATS_START(var) double var = stats_now ()
+# define STATS_STOP(entry, var, n) stats_stop (entry, var, n)
+
+#else  /* not ENABLE_STATS */
+
+# define STATS_ADD(entry, n) do { } while (0)
+# define STATS_START(var) do { } while (0)
+# define STATS_STOP(entry, var, n) do { } while (0)
+# define stats_print() do { } while (0)
+
+#endif /* not ENABLE_STATS */
+
+#endif /* STATS_H */
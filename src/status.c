@@ -0,0 +1,453 @@
+/* Status reports of the retrieval in progress.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_RESOURCE_H
+# include <sys/resource.h>
+#endif
+
+#include "status.h"
+#include "hash.h"
+#include "utils.h"
+#include "ptimer.h"
+#include "retr.h"
+#include "recur.h"
+#include "stats.h"
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+
+/* A status report tells how far the retrieval has gone: what was
+   downloaded and how fast, the transfer in progress, the state of the
+   queue of the recursive retrieval, the hosts the bytes came from, how
+   often the caches spared a lookup or a connection, and the memory in
+   use.
+
+   It is printed to the log when SIGUSR1 (or Ctrl-Break on Windows)
+   asks for it, and written to the --status-file, replacing what was
+   there, at most every STATUS_FILE_INTERVAL seconds.  Neither is done
+   from the signal handler: it only sets status_requested, and the
+   report is made at the next call to status_poll, as soon as the
+   download in progress reads more data or the recursive retrieval
+   moves to another URL.  */
+
+#define STATUS_FILE_INTERVAL 1
+
+/* The hosts with the most bytes the report to the log lists.  */
+#define STATUS_LOG_HOSTS 10
+
+struct status_transfer status_transfer;
+volatile sig_atomic_t status_requested;
+
+/* What was received from a host.  */
+struct host_status {
+  char *host;
+  wgint bytes;
+  double secs;                  /* spent receiving them */
+  int files;
+};
+
+static struct ptimer *status_timer;
+static struct hash_table *host_status;
+static double last_write = -STATUS_FILE_INTERVAL;
+static bool status_file_failed;
+
+static double
+status_now (void)
+{
+  if (!status_timer)
+    status_timer = ptimer_new ();
+  return ptimer_measure (status_timer);
+}
+
+/* Start the clock the report measures the elapsed time with.  */
+
+void
+status_init (void)
+{
+  status_now ();
+}
+
+/* Ask for a report to the log.  Safe to call from a signal handler.  */
+
+void
+status_request (void)
+{
+  status_requested = 1;
+}
+
+/* Note the start of the transfer of FILE from HOST, which holds START
+   bytes already, out of TOTAL if that is known.  */
+
+void
+status_transfer_begin (const char *file, const char *host, wgint start,
+                       wgint total)
+{
+  status_transfer.file = file ? file : "";
+  status_transfer.host = host ? host : "";
+  status_transfer.start = start;
+  status_transfer.total = total;
+  status_transfer.bytes = 0;
+  status_transfer.started = status_now ();
+}
+
+/* Charge the transfer in progress to its host, and note that none is
+   in progress any more.  */
+
+void
+status_transfer_end (void)
+{
+  struct host_status *hs;
+
+  if (!status_transfer.file)
+    return;
+
+  if (!host_status)
+    host_status = make_nocase_string_hash_table (0);
+  hs = hash_table_get (host_status, status_transfer.host);
+  if (!hs)
+    {
+      hs = xnew0 (struct host_status);
+      hs->host = xstrdup (status_transfer.host);
+      hash_table_put (host_status, hs->host, hs);
+    }
+  hs->bytes += status_transfer.bytes;
+  hs->secs += status_now () - status_transfer.started;
+  hs->files++;
+
+  xzero (status_transfer);
+}
+
+/* Print a line of the report to FP, or to the log if FP is NULL.  */
+
+static void
+status_printf (FILE *fp, const char *fmt, ...)
+{
+  char line[1024];
+  va_list args;
+
+  va_start (args, fmt);
+  vsnprintf (line, sizeof (line), fmt, args);
+  va_end (args);
+  if (fp)
+    fputs (line, fp);
+  else
+    logputs (LOG_ALWAYS, line);
+}
+
+static const char *
+status_duration (double secs)
+{
+  static char buf[32];
+  long s = (long) secs;
+
+  if (s >= 3600)
+    snprintf (buf, sizeof (buf), "%ldh %02ldm %02lds",
+              s / 3600, s / 60 % 60, s % 60);
+  else if (s >= 60)
+    snprintf (buf, sizeof (buf), "%ldm %02lds", s / 60, s % 60);
+  else
+    snprintf (buf, sizeof (buf), "%.1fs", secs);
+  return buf;
+}
+
+static int
+host_status_cmp (const void *a, const void *b)
+{
+  const struct host_status *ha = *(const struct host_status **) a;
+  const struct host_status *hb = *(const struct host_status **) b;
+
+  if (ha->bytes != hb->bytes)
+    return ha->bytes < hb->bytes ? 1 : -1;
+  return strcmp (ha->host, hb->host);
+}
+
+/* Print the hosts with the most bytes, at most MAX of them unless it
+   is 0.  */
+
+static void
+status_print_hosts (FILE *fp, int max)
+{
+  struct host_status **hosts;
+  hash_table_iterator iter;
+  int count, i;
+
+  if (!host_status || !hash_table_count (host_status))
+    return;
+
+  count = hash_table_count (host_status);
+  hosts = xnew_array (struct host_status *, count);
+  i = 0;
+  for (hash_table_iterate (host_status, &iter); hash_table_iter_next (&iter);)
+    hosts[i++] = iter.value;
+  qsort (hosts, count, sizeof (hosts[0]), host_status_cmp);
+
+  status_printf (fp, _("Hosts:\n"));
+  for (i = 0; i < count && (!max || i < max); i++)
+    {
+      char size[16];
+
+      snprintf (size, sizeof (size), "%s",
+                human_readable (hosts[i]->bytes, 10, 1));
+      status_printf (fp, "  %-40s %8s %12s %6d %s\n", hosts[i]->host, size,
+                     retr_rate (hosts[i]->bytes, hosts[i]->secs),
+                     hosts[i]->files, _("files"));
+    }
+  if (i < count)
+    status_printf (fp, _("  ... and %d more\n"), count - i);
+  xfree (hosts);
+}
+
+/* The share of HITS among HITS and MISSES, as a percentage.  */
+
+static double
+status_ratio (wgint hits, wgint misses)
+{
+  return hits + misses ? 100.0 * hits / (hits + misses) : 0;
+}
+
+/* Print the report to FP, or to the log if FP is NULL.  */
+
+static void
+status_print (FILE *fp)
+{
+  double now = status_now ();
+  int queued, max_queued, spilled;
+  size_t seen;
+  char size[16];
+
+  status_printf (fp, _("Status after %s:\n"), status_duration (now));
+
+  snprintf (size, sizeof (size), "%s",
+            human_readable (total_downloaded_bytes, 10, 1));
+  status_printf (fp, _("Downloaded: %d files, %s (%s)\n"), numurls, size,
+                 retr_rate (total_downloaded_bytes, total_download_time));
+
+  if (status_transfer.file)
+    {
+      double secs = now - status_transfer.started;
+
+      if (status_transfer.total)
+        status_printf (fp, _("In progress: %s from %s, %s of %s bytes (%s)\n"),
+                       status_transfer.file, status_transfer.host,
+                       number_to_static_string (status_transfer.start
+                                                + status_transfer.bytes),
+                       number_to_static_string (status_transfer.start
+                                                + status_transfer.total),
+                       retr_rate (status_transfer.bytes, secs));
+      else
+        status_printf (fp, _("In progress: %s from %s, %s bytes (%s)\n"),
+                       status_transfer.file, status_transfer.host,
+                       number_to_static_string (status_transfer.start
+                                                + status_transfer.bytes),
+                       retr_rate (status_transfer.bytes, secs));
+    }
+
+  if (recursive_status (&queued, &max_queued, &spilled, &seen))
+    status_printf (fp, _("Queue: %d URLs, %d of them on disk, at most %d; "
+                         "%s URLs seen\n"),
+                   queued, spilled, max_queued,
+                   number_to_static_string (seen));
+
+  status_print_hosts (fp, fp ? 0 : STATUS_LOG_HOSTS);
+
+#ifdef ENABLE_STATS
+  {
+    wgint dns_hits = stats_counters[STATS_DNS_CACHED].calls;
+    wgint dns_misses = stats_counters[STATS_DNS_RESOLVED].calls;
+    wgint conn_hits = stats_counters[STATS_PCONN_HIT].calls;
+    wgint conn_misses = stats_counters[STATS_PCONN_MISS].calls;
+
+    if (dns_hits + dns_misses)
+      status_printf (fp, _("DNS cache: %.0f%% of %s lookups\n"),
+                     status_ratio (dns_hits, dns_misses),
+                     number_to_static_string (dns_hits + dns_misses));
+    if (conn_hits + conn_misses)
+      status_printf (fp, _("Persistent connections: %.0f%% of %s "
+                           "connections reused\n"),
+                     status_ratio (conn_hits, conn_misses),
+                     number_to_static_string (conn_hits + conn_misses));
+  }
+#endif
+
+#ifdef ENABLE_MEMACCT
+  {
+    wgint live, peak;
+
+    memacct_totals (&live, &peak);
+    snprintf (size, sizeof (size), "%s", human_readable (live, 10, 1));
+    status_printf (fp, _("Memory: %s allocated, at most %s\n"), size,
+                   human_readable (peak, 10, 1));
+  }
+#elif defined HAVE_GETRUSAGE
+  {
+    struct rusage usage;
+
+    /* ru_maxrss is in kilobytes on most systems.  */
+    if (getrusage (RUSAGE_SELF, &usage) == 0 && usage.ru_maxrss)
+      status_printf (fp, _("Memory: at most %s resident\n"),
+                     human_readable ((wgint) usage.ru_maxrss * 1024, 10, 1));
+  }
+#endif
+}
+
+/* Replace the contents of the status file with the report.  */
+
+static void
+status_write_file (void)
+{
+  char *tmp;
+  FILE *fp;
+
+  if (status_file_failed)
+    return;
+
+  /* Written aside and renamed, so that a reader never sees half of
+     it.  */
+  tmp = aprintf ("%s.tmp", opt.status_file);
+  fp = fopen (tmp, "w");
+  if (fp)
+    {
+      status_print (fp);
+      if (fclose (fp) == 0 && rename (tmp, opt.status_file) == 0)
+        {
+          xfree (tmp);
+          return;
+        }
+    }
+  logprintf (LOG_NOTQUIET, _("Cannot write status file %s: %s\n"),
+             quote (opt.status_file), strerror (errno));
+  unlink (tmp);
+  status_file_failed = true;
+  xfree (tmp);
+}
+
+/* Make the report a signal asked for, and rewrite the status file if
+   it wasn't for STATUS_FILE_INTERVAL seconds.  */
+
+void
+status_report (void)
+{
+  if (status_requested)
+    {
+      status_requested = 0;
+      logputs (LOG_ALWAYS, "\n");
+      status_print (NULL);
+      memacct_print ();
+    }
+  if (opt.status_file)
+    {
+      double now = status_now ();
+
+      if (now - last_write >= STATUS_FILE_INTERVAL)
+        {
+          last_write = now;
+          status_write_file ();
+        }
+    }
+}
+
+/* Write the final report to the status file, and free what the reports
+   needed.  */
+
+void
+status_cleanup (void)
+{
+  if (opt.status_file)
+    status_write_file ();
+
+  if (host_status)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (host_status, &iter);
+           hash_table_iter_next (&iter);
+           )
+        {
+          struct host_status *hs = iter.value;
+          xfree (hs->host);
+          xfree (hs);
+        }
+      hash_table_destroy (host_status);
+      host_status = NULL;
+    }
+  if (status_timer)
+    {
+      ptimer_destroy (status_timer);
+      status_timer = NULL;
+    }
+}
+
+#ifdef TESTING
+
+const char *
+test_status_hosts (void)
+{
+  struct host_status *hs;
+
+  status_transfer_begin ("a/1", "a.example", 0, 100);
+  status_transfer.bytes += 100;
+  status_transfer_end ();
+  status_transfer_begin ("b/1", "b.example", 0, 0);
+  status_transfer.bytes += 10;
+  status_transfer_end ();
+  status_transfer_begin ("a/2", "A.example", 50, 100);
+  status_transfer.bytes += 50;
+  mu_assert ("test_status_hosts: transfer in progress",
+             status_transfer.file && !strcmp (status_transfer.host,
+                                              "A.example"));
+  status_transfer_end ();
+  mu_assert ("test_status_hosts: transfer done", !status_transfer.file);
+
+  /* Not a transfer: nothing to charge.  */
+  status_transfer_end ();
+
+  mu_assert ("test_status_hosts: host count",
+             hash_table_count (host_status) == 2);
+  hs = hash_table_get (host_status, "a.example");
+  mu_assert ("test_status_hosts: host names compared without case",
+             hs && hs->bytes == 150 && hs->files == 2);
+  hs = hash_table_get (host_status, "b.example");
+  mu_assert ("test_status_hosts: second host",
+             hs && hs->bytes == 10 && hs->files == 1);
+
+  status_cleanup ();
+  return NULL;
+}
+
+#endif /* TESTING */
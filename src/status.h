@@ -0,0 +1,65 @@
+/* Declarations for status.c.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <signal.h>
+
+/* The transfer in progress, which fd_read_body keeps up to date.  */
+struct status_transfer
+{
+  const char *file;             /* the file written, NULL when idle */
+  const char *host;             /* the host it comes from */
+  wgint start;                  /* the bytes it had before */
+  wgint total;                  /* the bytes expected, 0 if unknown */
+  wgint bytes;                  /* the bytes received so far */
+  double started;               /* when the transfer started */
+};
+
+extern struct status_transfer status_transfer;
+extern volatile sig_atomic_t status_requested;
+
+void status_init (void);
+void status_request (void);
+void status_transfer_begin (const char *, const char *, wgint, wgint);
+void status_transfer_end (void);
+void status_report (void);
+void status_cleanup (void);
+
+/* Print the status report a signal asked for, and rewrite the status
+   file when it is due.  Called where the retrieval makes progress.  */
+#define status_poll() do {                      \
+  if (status_requested || opt.status_file)      \
+    status_report ();                           \
+} while (0)
+
+#endif /* STATUS_H */
@@ -0,0 +1,273 @@
+/* Download rate limits shared between connections.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "throttle.h"
+#include "hash.h"
+#include "ptimer.h"
+#include "utils.h"
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+
+/* --limit-rate caps the rate at which all connections together
+   receive data, and --limit-rate-per-host that of the connections to
+   each host.  Each cap is a token bucket that fills at the capped
+   rate, up to THROTTLE_BURST seconds' worth, and every byte read
+   takes a token out of the buckets of its connection.
+
+   A connection may read once its buckets hold THROTTLE_SLICE
+   seconds' worth of tokens, and then no more than they hold.
+   fd_read_body sleeps for throttle_delay before each read; the loops
+   that multiplex connections with fd_dispatch stop watching those
+   that have to wait, and sleep only when none is left.  A connection
+   receiving nothing thus takes nothing from a bucket it shares, and
+   as the buckets are small, it cannot save up for a burst while
+   idle either.  */
+
+#define THROTTLE_SLICE 0.005
+#define THROTTLE_BURST 0.02
+
+struct bucket {
+  double rate;                  /* bytes per second */
+  double tokens;                /* bytes that may be read */
+  double stamp;                 /* when TOKENS was last topped up */
+};
+
+static struct bucket *global_bucket;
+static struct hash_table *host_buckets;
+static struct ptimer *throttle_timer;
+
+static struct bucket *
+bucket_new (wgint rate, double now)
+{
+  struct bucket *b = xnew0 (struct bucket);
+  b->rate = rate;
+  b->tokens = MAX (rate * THROTTLE_BURST, 1);
+  b->stamp = now;
+  return b;
+}
+
+/* Top up B with the tokens that came in since it was last used.  */
+
+static void
+bucket_fill (struct bucket *b, double now)
+{
+  if (now > b->stamp)
+    {
+      double burst = MAX (b->rate * THROTTLE_BURST, 1);
+      b->tokens = MIN (burst, b->tokens + (now - b->stamp) * b->rate);
+      b->stamp = now;
+    }
+}
+
+/* The least number of tokens a read waits for.  */
+
+static double
+bucket_slice (const struct bucket *b)
+{
+  return MAX (b->rate * THROTTLE_SLICE, 1);
+}
+
+/* Seconds until a read may take from B.  */
+
+static double
+bucket_delay (struct bucket *b, double now)
+{
+  double slice = bucket_slice (b);
+
+  bucket_fill (b, now);
+  if (b->tokens >= slice)
+    return 0;
+  return (slice - b->tokens) / b->rate;
+}
+
+/* How many of SIZE bytes a read may take from B now.  */
+
+static int
+bucket_quota (struct bucket *b, int size, double now)
+{
+  bucket_fill (b, now);
+  if (b->tokens < bucket_slice (b))
+    return 0;
+  return MIN (size, (int) MIN (b->tokens, INT_MAX));
+}
+
+/* The buckets a connection to HOST draws from.  Returns their number;
+   the per-host bucket is created on first use.  */
+
+static int
+throttle_buckets (const char *host, struct bucket **buckets, double *now)
+{
+  int n = 0;
+
+  if (!throttle_timer)
+    throttle_timer = ptimer_new ();
+  *now = ptimer_measure (throttle_timer);
+
+  if (opt.limit_rate)
+    {
+      if (!global_bucket)
+        global_bucket = bucket_new (opt.limit_rate, *now);
+      buckets[n++] = global_bucket;
+    }
+  if (opt.limit_rate_per_host && host)
+    {
+      struct bucket *b;
+
+      if (!host_buckets)
+        host_buckets = make_nocase_string_hash_table (0);
+      b = hash_table_get (host_buckets, host);
+      if (!b)
+        {
+          b = bucket_new (opt.limit_rate_per_host, *now);
+          hash_table_put (host_buckets, xstrdup (host), b);
+        }
+      buckets[n++] = b;
+    }
+  return n;
+}
+
+/* Return the number of seconds a connection to HOST has to wait
+   before reading, 0 if it may read now.  HOST may be NULL when only
+   the global limit applies.  */
+
+double
+throttle_delay (const char *host)
+{
+  struct bucket *buckets[2];
+  double now, delay = 0;
+  int i, n;
+
+  if (!opt.limit_rate && !opt.limit_rate_per_host)
+    return 0;
+  n = throttle_buckets (host, buckets, &now);
+  for (i = 0; i < n; i++)
+    delay = MAX (delay, bucket_delay (buckets[i], now));
+  return delay;
+}
+
+/* Return how many of SIZE bytes a connection to HOST may read now,
+   0 if it has to wait.  */
+
+int
+throttle_quota (const char *host, int size)
+{
+  struct bucket *buckets[2];
+  double now;
+  int i, n;
+
+  if (!opt.limit_rate && !opt.limit_rate_per_host)
+    return size;
+  n = throttle_buckets (host, buckets, &now);
+  for (i = 0; i < n; i++)
+    size = bucket_quota (buckets[i], size, now);
+  return size;
+}
+
+/* Account for BYTES read over a connection to HOST.  */
+
+void
+throttle_account (const char *host, wgint bytes)
+{
+  struct bucket *buckets[2];
+  double now;
+  int i, n;
+
+  if (!opt.limit_rate && !opt.limit_rate_per_host)
+    return;
+  n = throttle_buckets (host, buckets, &now);
+  for (i = 0; i < n; i++)
+    buckets[i]->tokens -= bytes;
+}
+
+void
+throttle_cleanup (void)
+{
+  if (host_buckets)
+    {
+      hash_table_iterator iter;
+      for (hash_table_iterate (host_buckets, &iter);
+           hash_table_iter_next (&iter);
+           )
+        {
+          xfree (iter.key);
+          xfree (iter.value);
+        }
+      hash_table_destroy (host_buckets);
+      host_buckets = NULL;
+    }
+  xfree (global_bucket);
+  if (throttle_timer)
+    {
+      ptimer_destroy (throttle_timer);
+      throttle_timer = NULL;
+    }
+}
+
+#ifdef TESTING
+
+const char *
+test_throttle_bucket (void)
+{
+  struct bucket *b = bucket_new (1000, 0);
+
+  /* A new bucket holds a burst: 20 ms' worth, read straight away.  */
+  mu_assert ("a new bucket must not make one wait",
+             bucket_delay (b, 0) == 0);
+  mu_assert ("a read must take no more than the bucket holds",
+             bucket_quota (b, 16384, 0) == 20);
+  b->tokens -= 20;
+
+  /* Then 5 ms' worth has to come in before the next read.  */
+  mu_assert ("an empty bucket must have no quota",
+             bucket_quota (b, 16384, 0.001) == 0);
+  mu_assert ("the wait must be for the rest of a slice",
+             bucket_delay (b, 0.001) > 0.0039
+             && bucket_delay (b, 0.001) < 0.0041);
+  mu_assert ("a slice must be readable once it has come in",
+             bucket_quota (b, 16384, 0.006) == 6);
+
+  /* Idling doesn't save up more than a burst.  */
+  mu_assert ("an idle bucket must not fill beyond a burst",
+             bucket_quota (b, 16384, 60) == 20);
+  mu_assert ("the quota must not exceed the size asked for",
+             bucket_quota (b, 8, 60) == 8);
+
+  xfree (b);
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -36,11 +36,16 @@ as that of the covered work.  */
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 #include "utils.h"
 #include "url.h"
 #include "host.h"  /* for is_valid_ipv6_address */
+#include "hash.h"
 #include "c-strcase.h"
+#include "stats.h"
 
 #ifdef HAVE_ICONV
 # include <iconv.h>
@@ -175,15 +180,28 @@ static const unsigned char urlchr_table[256] =
 static void
 url_unescape_1 (char *s, unsigned char mask)
 {
-  unsigned char *t = (unsigned char *) s; /* t - tortoise */
-  unsigned char *h = (unsigned char *) s; /* h - hare     */
+  unsigned char *t;             /* t - tortoise */
+  unsigned char *h;             /* h - hare     */
+
+  /* Most strings have no escapes at all, and are left untouched.
+     strchr is the fastest way to find that out, as the C library
+     implements it several bytes at a time.  */
+  h = (unsigned char *) strchr (s, '%');
+  if (!h)
+    return;
 
-  for (; *h; h++, t++)
+  for (t = h; *h; h++, t++)
     {
       if (*h != '%')
         {
-        copychar:
-          *t = *h;
+          /* Move the run of characters up to the next `%' at once.  */
+          unsigned char *next = (unsigned char *) strchr ((char *) h, '%');
+          size_t len = next ? (size_t) (next - h) : strlen ((char *) h);
+
+          if (t != h)
+            memmove (t, h, len);
+          t += len - 1;
+          h += len - 1;
         }
       else
         {
@@ -200,6 +218,9 @@ url_unescape_1 (char *s, unsigned char mask)
             goto copychar;
           *t = c;
           h += 2;
+          continue;
+        copychar:
+          *t = *h;
         }
     }
   *t = '\0';
@@ -240,23 +261,29 @@ url_unescape_except_reserved (char *s)
 static char *
 url_escape_1 (const char *s, unsigned char mask, bool allow_passthrough)
 {
-  const char *p1;
+  const char *p1, *clean_e;
   char *p2, *newstr;
   int newlen;
   int addition = 0;
 
-  for (p1 = s; *p1; p1++)
+  /* Find the first character to quote.  The characters before it
+     need neither counting nor examining again.  */
+  for (p1 = s; *p1 && !urlchr_test (*p1, mask); p1++)
+    ;
+  if (!*p1)
+    return allow_passthrough ? (char *)s : xstrdup (s);
+  clean_e = p1;
+
+  for (; *p1; p1++)
     if (urlchr_test (*p1, mask))
       addition += 2;            /* Two more characters (hex digits) */
 
-  if (!addition)
-    return allow_passthrough ? (char *)s : xstrdup (s);
-
   newlen = (p1 - s) + addition;
   newstr = xmalloc (newlen + 1);
 
-  p1 = s;
-  p2 = newstr;
+  memcpy (newstr, s, clean_e - s);
+  p1 = clean_e;
+  p2 = newstr + (clean_e - s);
   while (*p1)
     {
       /* Quote the characters that match the test mask. */
@@ -320,10 +347,10 @@ char_needs_escaping (const char *p)
         /* Garbled %.. sequence: encode `%'. */
         return true;
     }
-  else if (URL_UNSAFE_CHAR (*p) && !URL_RESERVED_CHAR (*p))
-    return true;
   else
-    return false;
+    /* Unsafe, but not reserved.  */
+    return urlchr_test (*p, urlchr_unsafe | urlchr_reserved)
+      == urlchr_unsafe;
 }
 
 /* Translate a %-escaped (but possibly non-conformant) input string S
@@ -407,21 +434,25 @@ char_needs_escaping (const char *p)
 static char *
 reencode_escapes (const char *s)
 {
-  const char *p1;
+  const char *p1, *clean_e;
   char *newstr, *p2;
   int oldlen, newlen;
 
   int encode_count = 0;
 
   /* First pass: inspect the string to see if there's anything to do,
-     and to calculate the new length.  */
-  for (p1 = s; *p1; p1++)
-    if (char_needs_escaping (p1))
-      ++encode_count;
-
-  if (!encode_count)
+     and to calculate the new length.  The part before the first char
+     to encode is simply copied in the second pass.  */
+  for (p1 = s; *p1 && !char_needs_escaping (p1); p1++)
+    ;
+  if (!*p1)
     /* The string is good as it is. */
     return (char *) s;          /* C const model sucks. */
+  clean_e = p1;
+
+  for (; *p1; p1++)
+    if (char_needs_escaping (p1))
+      ++encode_count;
 
   oldlen = p1 - s;
   /* Each encoding adds two characters (hex digits).  */
@@ -430,8 +461,9 @@ reencode_escapes (const char *s)
 
   /* Second pass: copy the string to the destination address, encoding
      chars when needed.  */
-  p1 = s;
-  p2 = newstr;
+  memcpy (newstr, s, clean_e - s);
+  p1 = clean_e;
+  p2 = newstr + (clean_e - s);
 
   while (*p1)
     if (char_needs_escaping (p1))
@@ -624,6 +656,66 @@ rewrite_shorthand_url (const char *url)
 
 static void get_local_path (struct url *url);
 
+/* Copy the string from BEG to END (empty if BEG is NULL) to *NEXT,
+   and advance *NEXT past it.  */
+
+static char *
+url_part_copy (char **next, const char *beg, const char *end)
+{
+  char *res = *next;
+  size_t len = beg ? end - beg : 0;
+
+  memcpy (res, beg ? beg : "", len);
+  res[len] = '\0';
+  *next += len + 1;
+  return res;
+}
+
+/* Free S, one of the strings of URL, unless it belongs to the block
+   of URL's parts.  */
+
+static void
+url_free_part (struct url *url, char *s)
+{
+  if (!url->parts || s < url->parts || s >= url->parts + url->parts_size)
+    xfree (s);
+}
+
+/* The host names of the URLs, each stored once.  A crawl has few
+   hosts for many URLs, which can then be compared by their host
+   pointers, see URL_SAME_HOST.  */
+static struct hash_table *url_hosts;
+
+#ifdef HAVE_PTHREAD
+/* The links of the files converted by several threads are parsed
+   concurrently, and may be the first to name a host.  */
+static pthread_mutex_t url_hosts_lock = PTHREAD_MUTEX_INITIALIZER;
+# define URL_HOSTS_LOCK() pthread_mutex_lock (&url_hosts_lock)
+# define URL_HOSTS_UNLOCK() pthread_mutex_unlock (&url_hosts_lock)
+#else
+# define URL_HOSTS_LOCK()
+# define URL_HOSTS_UNLOCK()
+#endif
+
+/* Return the interned copy of HOST, which lives until url_cleanup.  */
+
+const char *
+url_intern_host (const char *host)
+{
+  char *interned;
+
+  URL_HOSTS_LOCK ();
+  if (!url_hosts)
+    url_hosts = make_string_hash_table (0);
+  if (!hash_table_get_pair (url_hosts, host, &interned, NULL))
+    {
+      interned = xstrdup (host);
+      hash_table_put (url_hosts, interned, interned);
+    }
+  URL_HOSTS_UNLOCK ();
+  return interned;
+}
+
 /* Like strpbrk, with the exception that it returns the pointer to the
    terminating zero (end-of-string aka "eos") if no matching character
    is found.  */
@@ -654,12 +746,14 @@ lowercase_str (char *str)
 }
 
 static const char *
-init_seps (enum url_scheme scheme)
+init_seps (enum url_scheme scheme, char seps[8])
 {
-  static char seps[8] = ":/";
   char *p = seps + 2;
   int flags = supported_schemes[scheme].flags;
 
+  seps[0] = ':';
+  seps[1] = '/';
+
   if (flags & scm_has_params)
     *p++ = ';';
   if (flags & scm_has_query)
@@ -710,6 +804,7 @@ url_parse (struct url *u, bool percent_encode, bool utf8_encode)
 
   enum url_scheme scheme;
   const char *seps;
+  char seps_buf[8];
 
   const char *uname_b,     *uname_e;
   const char *host_b,      *host_e;
@@ -726,6 +821,8 @@ url_parse (struct url *u, bool percent_encode, bool utf8_encode)
 
   int error_code = PE_NO_ERROR;
 
+  STATS_START (start);
+  MEMACCT_ENTER (memacct_saved, MEMACCT_URL);
   DEBUGP (("url_parse start\n"));
 
   scheme = url_scheme (url);
@@ -782,7 +879,7 @@ url_parse (struct url *u, bool percent_encode, bool utf8_encode)
   /* Initialize separators for optional parts of URL, depending on the
      scheme.  For example, FTP has params, and HTTP and HTTPS have
      query string and fragment. */
-  seps = init_seps (scheme);
+  seps = init_seps (scheme, seps_buf);
 
   host_b = p;
 
@@ -910,19 +1007,30 @@ url_parse (struct url *u, bool percent_encode, bool utf8_encode)
     }
 
   u->scheme = scheme;
-  u->host   = strdupdelim (host_b, host_e);
   u->port   = port;
   u->user   = user;
   u->passwd = passwd;
 
-  u->path = strdupdelim (path_b, path_e);
-
-  if (params_b)
-    u->params = strdupdelim (params_b, params_e);
-  if (query_b)
-    u->query = strdupdelim (query_b, query_e);
-  if (fragment_b)
-    u->fragment = strdupdelim (fragment_b, fragment_e);
+  /* Allocate the parts of the URL in one go; they are only ever
+     freed together, except by the few mutators below.  */
+  {
+    char *next;
+
+    u->parts_size = (host_e - host_b) + 1 + (path_b ? path_e - path_b : 0) + 1
+      + (params_b ? params_e - params_b + 1 : 0)
+      + (query_b ? query_e - query_b + 1 : 0)
+      + (fragment_b ? fragment_e - fragment_b + 1 : 0);
+    u->parts = next = xmalloc (u->parts_size);
+
+    u->host = url_part_copy (&next, host_b, host_e);
+    u->path = url_part_copy (&next, path_b, path_e);
+    if (params_b)
+      u->params = url_part_copy (&next, params_b, params_e);
+    if (query_b)
+      u->query = url_part_copy (&next, query_b, query_e);
+    if (fragment_b)
+      u->fragment = url_part_copy (&next, fragment_b, fragment_e);
+  }
 
   path_modified = path_simplify (scheme, u->path);
 
@@ -955,13 +1063,22 @@ url_parse (struct url *u, bool percent_encode, bool utf8_encode)
                                   : u->ori_enc, u->host);
           if (new)
             {
-              xfree (u->host);
+              url_free_part (u, u->host);
               u->host = new;
               host_modified = true;
             }
         }
     }
 
+  /* The host is interned only once the URL has parsed, so that U's
+     host is either in its parts or interned, never to be freed on its
+     own.  */
+  {
+    char *host = (char *) url_intern_host (u->host);
+    url_free_part (u, u->host);
+    u->host = host;
+  }
+
   if (opt.enable_iri || host_modified || path_modified || path_b == path_e || u->fragment)
     {
       /* If we suspect that a transformation has rendered what
@@ -969,25 +1086,27 @@ url_parse (struct url *u, bool percent_encode, bool utf8_encode)
          u->url using url_string.  */
       u->url = url_string (u, URL_AUTH_SHOW);
 
-      if (url_encoded != url)
+      if (url_encoded != u->ori_url)
         xfree (url_encoded);
     }
   else
     {
-      if (url_encoded == url)
-        u->url = xstrdup (url);
+      if (url_encoded == u->ori_url)
+        u->url = xstrdup (url_encoded);
       else
         u->url = (char *) url_encoded;
     }
 
 exit:
   DEBUGP (("url_parse end\n"));
+  MEMACCT_LEAVE (memacct_saved);
+  STATS_STOP (STATS_URL_PARSE, start, 0);
 
   return error_code;
 
 error:
   /* Cleanup in case of error: */
-  if (url_encoded && url_encoded != url)
+  if (url_encoded && url_encoded != u->ori_url)
     xfree (url_encoded);
 
   goto exit;
@@ -1023,39 +1142,51 @@ url_error (int error_code)
 
    DIR and FILE are freshly allocated.  */
 
+/* Return NAME, unescaped and in FROM_ENCODING, converted to the
+   locale charset.  NAME is either returned or freed.  */
+
+static char *
+local_fname (char *name, const char *from_encoding)
+{
+  char *res;
+
+  /* Nothing to convert, which is by far the most common case.  */
+  if (from_encoding && opt.locale && !strcasecmp (from_encoding, opt.locale))
+    return name;
+
+  res = convert_fname (name, from_encoding, opt.locale);
+  xfree (name);
+  return res;
+}
+
 static void
 get_local_path (struct url *url)
 {
   char *last_slash = strrchr (url->path, '/');
-  char *dir_u, *file_u;
-  char *dir_l, *file_l;
+  char *dir, *file;
   const char *from_encoding;
 
   if (!last_slash)
     {
-      dir_u = xstrdup ("");
-      file_u = xstrdup (url->path);
+      dir = xstrdup ("");
+      file = xstrdup (url->path);
     }
   else
     {
-      dir_u = strdupdelim (url->path, last_slash);
-      file_u = xstrdup (last_slash + 1);
+      dir = strdupdelim (url->path, last_slash);
+      file = xstrdup (last_slash + 1);
     }
 
-  url_unescape (dir_u);
-  url_unescape (file_u);
+  url_unescape (dir);
+  url_unescape (file);
 
   from_encoding = url->enc_type == ENC_IRI ? "UTF-8"
                   : url->enc_type == ENC_URL ? url->ori_enc
                   : opt.locale;
-  dir_l = convert_fname (dir_u, from_encoding, opt.locale);
-  file_l = convert_fname (file_u, from_encoding, opt.locale);
-  xfree (dir_u);
   xfree (url->dir);
-  xfree (file_u);
   xfree (url->file);
-  url->dir = dir_l;
-  url->file = file_l;
+  url->dir = local_fname (dir, from_encoding);
+  url->file = local_fname (file, from_encoding);
 
   DEBUGP (("Locale dir: '%s' (%s)\n", url->dir, opt.locale));
   DEBUGP (("Locale file: '%s' (%s)\n", url->file, opt.locale));
@@ -1174,7 +1305,8 @@ sync_path (struct url *u)
 {
   char *newpath, *efile, *edir;
 
-  xfree (u->path);
+  url_free_part (u, u->path);
+  xfree (u->file_name);
 
   /* u->dir and u->file are not escaped.  URL-escape them before
      reassembling them into u->path.  That way, if they contain
@@ -1253,6 +1385,7 @@ url_set_file (struct url *url, const char *newfile)
 
 struct url *url_new_init ()
 {
+  MEMACCT_ENTER (memacct_saved, MEMACCT_URL);
   struct url *url = xcalloc (1, sizeof (struct url));
 
 #ifdef HAVE_ICONV
@@ -1264,12 +1397,14 @@ struct url *url_new_init ()
     url->content_enc = xstrdup (opt.encoding_remote);
 #endif
 
+  MEMACCT_LEAVE (memacct_saved);
   return url;
 }
 
 struct url *
 url_dup (struct url *url)
 {
+  MEMACCT_ENTER (memacct_saved, MEMACCT_URL);
   struct url *url_new = xcalloc (1, sizeof (struct url));
 #define xdupx(n, o, i) if (o->i) n->i = xstrdup (o->i);
   xdupx (url_new, url, ori_url)
@@ -1278,7 +1413,8 @@ url_dup (struct url *url)
   xdupx (url_new, url, url)
   url_new->enc_type = url->enc_type;
   url_new->scheme = url->scheme;
-  xdupx (url_new, url, host)
+  if (url->host)
+    url_new->host = (char *) url_intern_host (url->host);
   url_new->port = url->port;
   xdupx (url_new, url, user)
   xdupx (url_new, url, passwd)
@@ -1289,6 +1425,7 @@ url_dup (struct url *url)
   xdupx (url_new, url, dir)
   xdupx (url_new, url, file)
 #undef xdupx
+  MEMACCT_LEAVE (memacct_saved);
   return url_new;
 }
 
@@ -1304,23 +1441,94 @@ url_free (struct url *url)
 
       xfree (url->url);
 
-      xfree (url->host);
+      /* The host is in the parts or interned.  */
 
-      xfree (url->path);
-      xfree (url->params);
-      xfree (url->query);
-      xfree (url->fragment);
+      url_free_part (url, url->path);
+      url_free_part (url, url->params);
+      url_free_part (url, url->query);
+      url_free_part (url, url->fragment);
 
       xfree (url->user);
       xfree (url->passwd);
 
       xfree (url->dir);
       xfree (url->file);
+      xfree (url->file_name);
 
+      xfree (url->parts);
       xfree (url);
     }
 }
 
+/* Write URL to FP, field by field.  Unlike the URL string, this gives
+   back the same struct when read by url_read, whereas parsing it
+   again could give different results with IRI support.  */
+void
+url_write (FILE *fp, const struct url *url)
+{
+  fput_string (fp, url->ori_url);
+  fput_string (fp, url->ori_enc);
+  fput_string (fp, url->content_enc);
+  fput_string (fp, url->url);
+  fput_int (fp, url->enc_type);
+  fput_int (fp, url->scheme);
+  fput_string (fp, url->host);
+  fput_int (fp, url->port);
+  fput_string (fp, url->user);
+  fput_string (fp, url->passwd);
+  fput_string (fp, url->path);
+  fput_string (fp, url->params);
+  fput_string (fp, url->query);
+  fput_string (fp, url->fragment);
+  fput_string (fp, url->dir);
+  fput_string (fp, url->file);
+}
+
+/* Read a URL written by url_write from FP.  Returns NULL on error.  */
+struct url *
+url_read (FILE *fp)
+{
+  MEMACCT_ENTER (memacct_saved, MEMACCT_URL);
+  struct url *url = xnew0 (struct url);
+  int enc_type, scheme;
+
+  if (fget_string (fp, &url->ori_url)
+      && fget_string (fp, &url->ori_enc)
+      && fget_string (fp, &url->content_enc)
+      && fget_string (fp, &url->url)
+      && fget_int (fp, &enc_type)
+      && fget_int (fp, &scheme)
+      && fget_string (fp, &url->host)
+      && fget_int (fp, &url->port)
+      && fget_string (fp, &url->user)
+      && fget_string (fp, &url->passwd)
+      && fget_string (fp, &url->path)
+      && fget_string (fp, &url->params)
+      && fget_string (fp, &url->query)
+      && fget_string (fp, &url->fragment)
+      && fget_string (fp, &url->dir)
+      && fget_string (fp, &url->file)
+      && url->url && url->host)
+    {
+      char *host = url->host;
+      url->host = (char *) url_intern_host (host);
+      xfree (host);
+      url->enc_type = enc_type;
+      url->scheme = scheme;
+      MEMACCT_LEAVE (memacct_saved);
+      return url;
+    }
+  xfree (url->host);
+  url_free (url);
+  MEMACCT_LEAVE (memacct_saved);
+  return NULL;
+}
+
+/* The directories mkalldirs found or created.  They are taken to
+   exist for the rest of the run, so that saving the many files of a
+   directory costs a single stat().  */
+static struct hash_table *existing_dirs;
+
 /* Create all the necessary directories for PATH (a file).  Calls
    make_directory internally.  */
 int
@@ -1328,6 +1536,7 @@ mkalldirs (const char *path)
 {
   const char *p;
   char *t;
+  char buf[1024];
   struct stat st;
   int res;
 
@@ -1337,14 +1546,32 @@ mkalldirs (const char *path)
   /* Don't create if it's just a file.  */
   if ((p == path) && (*p != '/'))
     return 0;
-  t = strdupdelim (path, p);
+  if ((size_t) (p - path) < sizeof (buf))
+    {
+      memcpy (buf, path, p - path);
+      buf[p - path] = '\0';
+      t = buf;
+    }
+  else
+    t = strdupdelim (path, p);
+
+  if (existing_dirs && string_set_contains (existing_dirs, t))
+    {
+      if (t != buf)
+        xfree (t);
+      return 0;
+    }
+  if (!existing_dirs)
+    existing_dirs = make_string_hash_table (0);
 
   /* Check whether the directory exists.  */
   if ((stat (t, &st) == 0))
     {
       if (S_ISDIR (st.st_mode))
         {
-          xfree (t);
+          string_set_add (existing_dirs, t);
+          if (t != buf)
+            xfree (t);
           return 0;
         }
       else
@@ -1370,7 +1597,10 @@ mkalldirs (const char *path)
   res = make_directory (t);
   if (res != 0)
     logprintf (LOG_NOTQUIET, "%s: %s\n", t, strerror (errno));
-  xfree (t);
+  else
+    string_set_add (existing_dirs, t);
+  if (t != buf)
+    xfree (t);
   return res;
 }
 
@@ -1532,6 +1762,54 @@ UVWC, VC, VC, VC,  VC, VC, VC, VC,   /* NUL SOH STX ETX  EOT ENQ ACK BEL */
  (((opt.restrict_files_os != restrict_vms) && \
    (opt.restrict_files_os != restrict_windows)) ? "?" : "@")
 
+/* The characters FILE_CHAR_TEST finds unsafe with MASK and the
+   current --restrict-file-names=nonascii setting, as 1 or 0, so that
+   append_url_pathel counts them without branching.  */
+static unsigned char pathel_unsafe[256];
+static int pathel_unsafe_mask = -1;
+
+static const unsigned char *
+pathel_unsafe_table (int mask)
+{
+  int key = mask | (opt.restrict_files_nonascii ? 0x100 : 0);
+
+  if (key != pathel_unsafe_mask)
+    {
+      int c;
+      for (c = 0; c < 256; c++)
+        pathel_unsafe[c] = FILE_CHAR_TEST (c, mask) ? 1 : 0;
+      pathel_unsafe_mask = key;
+    }
+  return pathel_unsafe;
+}
+
+#ifndef WINDOWS
+/* The maximum file name lengths get_max_length found for the
+   directories append_url_pathel appended to, by directory.  */
+static struct hash_table *name_max_map;
+
+/* Return the maximum length of a name in the directory DEST holds,
+   asking pathconf only once per directory.  */
+
+static long
+pathel_max_length (const struct growable *dest)
+{
+  const char *dir = dest->base ? dest->base : "";
+  long *max;
+
+  if (!name_max_map)
+    name_max_map = make_string_hash_table (0);
+  max = hash_table_get (name_max_map, dir);
+  if (!max)
+    {
+      max = xnew (long);
+      *max = get_max_length (dest->base, dest->tail, _PC_NAME_MAX);
+      hash_table_put (name_max_map, xstrdup (dir), max);
+    }
+  return *max;
+}
+#endif /* not WINDOWS */
+
 /* Quote path element, characters in [b, e), as file name, and append
    the quoted string to DEST.  Each character is quoted as per
    file_unsafe_char and the corresponding table.
@@ -1549,6 +1827,7 @@ append_url_pathel (const char *b, const char *e, bool escaped,
   int quoted, outlen;
   int mask;
   int max_length;
+  const unsigned char *unsafe;
 
   if (!dest)
     return;
@@ -1562,6 +1841,7 @@ append_url_pathel (const char *b, const char *e, bool escaped,
 
   if (opt.restrict_files_ctrl)
     mask |= filechr_control;
+  unsafe = pathel_unsafe_table (mask);
 
   /* Copy [b, e) to PATHEL and URL-unescape it. */
   if (escaped)
@@ -1592,8 +1872,7 @@ append_url_pathel (const char *b, const char *e, bool escaped,
      to quote.  */
   quoted = 0;
   for (p = b; p < e; p++)
-    if (FILE_CHAR_TEST (*p, mask))
-      ++quoted;
+    quoted += unsafe[(unsigned char) *p];
 
   /* Calculate the length of the output string.  e-b is the input
      string length.  Each quoted char introduces two additional
@@ -1602,7 +1881,7 @@ append_url_pathel (const char *b, const char *e, bool escaped,
 # ifdef WINDOWS
   max_length = MAX_PATH;
 # else
-  max_length = get_max_length(dest->base, dest->tail, _PC_NAME_MAX);
+  max_length = pathel_max_length (dest);
 # endif
   max_length -= CHOMP_BUFFER;
   if (max_length > 0 && outlen > max_length)
@@ -1631,7 +1910,7 @@ append_url_pathel (const char *b, const char *e, bool escaped,
 
       for (i = 0, p = b; p < e; p++)
         {
-          if (!FILE_CHAR_TEST (*p, mask))
+          if (!unsafe[(unsigned char) *p])
             {
               if (i == outlen)
                 break;
@@ -1689,7 +1968,11 @@ convert_fname (const char *fname, const char *from_encoding, const char *to_enco
     DEBUGP (("Converted file name:  '%s' (%s)\n", out, to_encoding));
   else
     {
+      /* reencode_escapes returns FNAME itself if there is nothing to
+         escape, but the caller expects a copy.  */
       out = reencode_escapes (fname);
+      if (out == fname)
+        out = xstrdup (fname);
       DEBUGP (("Converted file name: invalid chars escaped: '%s' (%s)\n", out, to_encoding));
     }
 
@@ -1745,20 +2028,81 @@ append_dir_structure (const struct url *u, struct growable *dest)
     }
 }
 
-/* Return a unique file name that matches the given URL as well as
-   possible.  Does not create directories on the file system.  */
-/* Result is with url encoding, as ftp server would use it besides local.
-   local <-=> UTF-8 <=-> remote */
+/* The directory prefix, converted to the last URL encoding other
+   than the locale's that url_file_name was called for.  */
+static char *dir_prefix_enc;
+static char *dir_prefix_converted;
 
-char *
-url_file_name (const struct url *u, char *replaced_filename)
+/* The directories --protocol-directories and the host directory add
+   for the last scheme, host and port url_file_name was called for.  */
+static struct {
+  enum url_scheme scheme;
+  char *host;
+  int port;
+  char *dirs;
+} last_host_dirs;
+
+/* Append to DEST the directories U's scheme, host and port add in
+   front of its path.  */
+
+static void
+append_host_dirs (const struct url *u, struct growable *dest)
+{
+  if (!last_host_dirs.dirs || last_host_dirs.scheme != u->scheme
+      || last_host_dirs.port != u->port || strcmp (last_host_dirs.host, u->host))
+    {
+      struct growable dirs;
+
+      dirs.base = NULL;
+      dirs.size = 0;
+      dirs.tail = 0;
+      if (opt.protocol_directories)
+        append_string (supported_schemes[u->scheme].name, &dirs);
+      if (opt.add_hostdir)
+        {
+          if (dirs.tail)
+            append_char ('/', &dirs);
+          if (0 != strcmp (u->host, ".."))
+            append_string (u->host, &dirs);
+          else
+            /* Host name can come from the network; malicious DNS may
+               allow ".." to be resolved, causing us to write to
+               "../<file>".  Defang such host names.  */
+            append_string ("%2E%2E", &dirs);
+          if (u->port != scheme_default_port (u->scheme))
+            {
+              char portstr[24];
+              number_to_string (portstr, u->port);
+              append_char (FN_PORT_SEP, &dirs);
+              append_string (portstr, &dirs);
+            }
+        }
+      append_char ('\0', &dirs);
+
+      xfree (last_host_dirs.host);
+      xfree (last_host_dirs.dirs);
+      last_host_dirs.scheme = u->scheme;
+      last_host_dirs.host = xstrdup (u->host);
+      last_host_dirs.port = u->port;
+      last_host_dirs.dirs = dirs.base;
+    }
+
+  if (*last_host_dirs.dirs)
+    append_string (last_host_dirs.dirs, dest);
+}
+
+/* Return the file name matching the given URL, as url_file_name
+   before it is made unique.  */
+
+static char *
+make_file_name (const struct url *u, char *replaced_filename)
 {
   struct growable fnres;        /* stands for "file name result" */
   struct growable temp_fnres;
 
   char *url_enc = u->enc_type == ENC_IRI ? "UTF-8" : u->ori_enc;
   const char *u_file;
-  char *fname, *unique, *fname_len_check;
+  char *fname_len_check;
   const char *index_filename = "index.html"; /* The default index file is index.html */
 
   fnres.base = NULL;
@@ -1779,9 +2123,15 @@ url_file_name (const struct url *u, char *replaced_filename)
     {
       if (strcasecmp (url_enc, opt.locale))
         {
-          char *prefix_local = convert_fname (opt.dir_prefix, opt.locale, url_enc);
-          append_string (prefix_local, &fnres);
-          xfree (prefix_local);
+          if (!dir_prefix_enc || strcasecmp (dir_prefix_enc, url_enc))
+            {
+              xfree (dir_prefix_enc);
+              xfree (dir_prefix_converted);
+              dir_prefix_enc = xstrdup (url_enc);
+              dir_prefix_converted = convert_fname (opt.dir_prefix,
+                                                    opt.locale, url_enc);
+            }
+          append_string (dir_prefix_converted, &fnres);
         }
       else
         append_string (opt.dir_prefix, &fnres);
@@ -1792,32 +2142,7 @@ url_file_name (const struct url *u, char *replaced_filename)
      directory structure.  */
   if (opt.dirstruct)
     {
-      if (opt.protocol_directories)
-        {
-          if (temp_fnres.tail)
-            append_char ('/', &temp_fnres);
-          append_string (supported_schemes[u->scheme].name, &temp_fnres);
-        }
-      if (opt.add_hostdir)
-        {
-          if (temp_fnres.tail)
-            append_char ('/', &temp_fnres);
-          if (0 != strcmp (u->host, ".."))
-            append_string (u->host, &temp_fnres);
-          else
-            /* Host name can come from the network; malicious DNS may
-               allow ".." to be resolved, causing us to write to
-               "../<file>".  Defang such host names.  */
-            append_string ("%2E%2E", &temp_fnres);
-          if (u->port != scheme_default_port (u->scheme))
-            {
-              char portstr[24];
-              number_to_string (portstr, u->port);
-              append_char (FN_PORT_SEP, &temp_fnres);
-              append_string (portstr, &temp_fnres);
-            }
-        }
-
+      append_host_dirs (u, &temp_fnres);
       append_dir_structure (u, &temp_fnres);
     }
 
@@ -1872,11 +2197,39 @@ url_file_name (const struct url *u, char *replaced_filename)
   append_string (temp_fnres.base, &fnres);
   xfree (temp_fnres.base);
 
-  fname = fnres.base;
-
   /* Make a final check that the path length is acceptable? */
   /* TODO: check fnres.base for path length problem */
 
+  return fnres.base;
+}
+
+/* Return a unique file name that matches the given URL as well as
+   possible.  Does not create directories on the file system.  */
+/* Result is with url encoding, as ftp server would use it besides local.
+   local <-=> UTF-8 <=-> remote */
+
+char *
+url_file_name (struct url *u, char *replaced_filename)
+{
+  char *fname, *unique;
+
+  /* The name only depends on the URL and the options, so it is made
+     once per URL, unless REPLACED_FILENAME stands for its file.  */
+  if (replaced_filename)
+    fname = make_file_name (u, replaced_filename);
+  else
+    {
+      if (!u->file_name || u->file_name_scheme != u->scheme
+          || u->file_name_port != u->port)
+        {
+          xfree (u->file_name);
+          u->file_name = make_file_name (u, NULL);
+          u->file_name_scheme = u->scheme;
+          u->file_name_port = u->port;
+        }
+      fname = xstrdup (u->file_name);
+    }
+
   /* Check the cases in which the unique extensions are not used:
      1) Clobbering is turned off (-nc).
      2) Retrieval with regetting.
@@ -2015,10 +2368,11 @@ path_end (const char *url)
 {
   enum url_scheme scheme = url_scheme (url);
   const char *seps;
+  char seps_buf[8];
   if (scheme == SCHEME_INVALID)
     scheme = SCHEME_HTTP;       /* use http semantics for rel links */
   /* +2 to ignore the first two separators ':' and '/' */
-  seps = init_seps (scheme) + 2;
+  seps = init_seps (scheme, seps_buf) + 2;
   return strpbrk_or_eos (url, seps);
 }
 
@@ -2217,6 +2571,38 @@ url_merge (const char *base, const char *link)
   return merge;
 }
 
+/* Return how many leading characters of BASE the merge of LINK with
+   it depends on.  A relative or absolute path only depends on the
+   directory of BASE, so that the links of the pages of a directory
+   merge the same.  */
+
+int
+url_merge_base_length (const char *base, const char *link)
+{
+  const char *end, *last_slash;
+
+  if (url_has_scheme (link))
+    return 0;
+  if (!*link)
+    return strlen (base);
+  end = path_end (base);
+  if (*link == '?')
+    return end - base;
+  if (*link == '#')
+    {
+      const char *end1 = strchr (base, '#');
+      return end1 ? end1 - base : (int) strlen (base);
+    }
+
+  last_slash = find_last_char (base, end, '/');
+  if (!last_slash)
+    return 0;
+  if (last_slash >= base + 2 && last_slash[-2] == ':' && last_slash[-1] == '/')
+    /* No path: "http://host".  */
+    return end - base;
+  return last_slash + 1 - base;
+}
+
 #define APPEND(p, s) do {                       \
   int len = strlen (s);                         \
   memcpy (p, s, len);                           \
@@ -2413,6 +2799,33 @@ are_urls_equal (const char *u1, const char *u2)
   return (*p == 0 && *q == 0 ? true : false);
 }
 
+/* Free the caches of mkalldirs and url_file_name.  */
+
+void
+url_cleanup (void)
+{
+  if (existing_dirs)
+    string_set_free (existing_dirs);
+  existing_dirs = NULL;
+#ifndef WINDOWS
+  if (name_max_map)
+    {
+      free_keys_and_values (name_max_map, free);
+      hash_table_destroy (name_max_map);
+    }
+  name_max_map = NULL;
+#endif
+  xfree (dir_prefix_enc);
+  xfree (dir_prefix_converted);
+  xfree (last_host_dirs.host);
+  xfree (last_host_dirs.dirs);
+  if (url_hosts)
+    {
+      string_set_free (url_hosts);
+      url_hosts = NULL;
+    }
+}
+
 #ifdef TESTING
 /* Debugging and testing support for path_simplify. */
 
@@ -2564,6 +2977,269 @@ test_are_urls_equal(void)
   return NULL;
 }
 
+const char *
+test_url_escapes (void)
+{
+  static const struct {
+    const char *input;
+    const char *reencoded;
+    const char *unescaped;
+  } test_array[] = {
+    { "", "", "" },
+    { "http://abc.xyz/plain/path.html", "http://abc.xyz/plain/path.html",
+      "http://abc.xyz/plain/path.html" },
+    { "http://abc.xyz/%20%3F%%36%31%25aa% a?a=%61+a%2Ba&b=b%26c%3Dc",
+      "http://abc.xyz/%20%3F%25%36%31%25aa%25%20a?a=%61+a%2Ba&b=b%26c%3Dc",
+      "http://abc.xyz/ ?%61%aa% a?a=a+a+a&b=b&c=c" },
+    { "foo bar", "foo%20bar", "foo bar" },
+    { "foo %20bar", "foo%20%20bar", "foo  bar" },
+    { "foo%%20bar", "foo%25%20bar", "foo% bar" },
+    { "foo%2%20bar", "foo%252%20bar", "foo%2 bar" },
+    { "foo%2b+bar", "foo%2b+bar", "foo++bar" },
+    { "a%00b%4", "a%00b%254", "a%00b%4" },
+    { "%41%42", "%41%42", "AB" },
+  };
+  unsigned i;
+
+  for (i = 0; i < countof(test_array); ++i)
+    {
+      char *reencoded = reencode_escapes (test_array[i].input);
+      char *unescaped = xstrdup (test_array[i].input);
+      bool ok;
+
+      url_unescape (unescaped);
+      ok = !strcmp (reencoded, test_array[i].reencoded);
+      if (reencoded != test_array[i].input)
+        xfree (reencoded);
+      mu_assert ("test_url_escapes: wrong reencode_escapes result", ok);
+      ok = !strcmp (unescaped, test_array[i].unescaped);
+      xfree (unescaped);
+      mu_assert ("test_url_escapes: wrong url_unescape result", ok);
+    }
+
+  {
+    static const char plain[] = "plain";
+    char *escaped = url_escape ("a b/%c");
+    bool ok = !strcmp (escaped, "a%20b/%25c");
+
+    xfree (escaped);
+    mu_assert ("test_url_escapes: wrong url_escape result", ok);
+    mu_assert ("test_url_escapes: clean string copied",
+               url_escape_allow_passthrough (plain) == plain);
+  }
+
+  return NULL;
+}
+
+const char *
+test_url_parse_parts (void)
+{
+  const char *locale = opt.locale;
+  struct url *u;
+
+  if (!opt.locale)
+    opt.locale = "UTF-8";
+
+  u = url_new_init ();
+  u->ori_url = xstrdup ("http://user:pw@Example.COM:8080/a/./b?q=1#f");
+  mu_assert ("url_parse", url_parse (u, true, false) == PE_NO_ERROR);
+  mu_assert ("url_parse: host", !strcmp (u->host, "example.com"));
+  mu_assert ("url_parse: port", u->port == 8080);
+  mu_assert ("url_parse: user", !strcmp (u->user, "user"));
+  mu_assert ("url_parse: passwd", !strcmp (u->passwd, "pw"));
+  mu_assert ("url_parse: path", !strcmp (u->path, "a/b"));
+  mu_assert ("url_parse: query", !strcmp (u->query, "q=1"));
+  mu_assert ("url_parse: fragment", !strcmp (u->fragment, "f"));
+  mu_assert ("url_parse: no params", u->params == NULL);
+
+  /* The path moves out of the block of parts.  */
+  url_set_file (u, "c");
+  mu_assert ("url_set_file: path", !strcmp (u->path, "a/c"));
+  mu_assert ("url_set_file: url",
+             !strcmp (u->url, "http://user:pw@example.com:8080/a/c?q=1"));
+  url_set_dir (u, "d");
+  mu_assert ("url_set_dir: path", !strcmp (u->path, "d/c"));
+  url_free (u);
+
+#ifdef ENABLE_IRI
+  /* A document in a single-byte encoding whose characters take three
+     bytes in UTF-8 makes the transcoding outgrow its first buffer.  */
+  {
+    bool enable_iri = opt.enable_iri;
+    int i;
+
+    opt.enable_iri = true;
+    u = url_new_init ();
+    xfree (u->ori_enc);
+    u->ori_enc = xstrdup ("CP1252");
+    u->ori_url = xstrdup ("http://example.com/"
+                          "\x96\x96\x96\x96\x96\x96\x96\x96\x96\x96\x96\x96"
+                          "\x96\x96\x96\x96\x96\x96\x96\x96\x96\x96\x96\x96x");
+    mu_assert ("url_parse: iri", url_parse (u, true, true) == PE_NO_ERROR);
+    for (i = 0; i < 24; i++)
+      mu_assert ("url_parse: iri path",
+                 !strncmp (u->path + 9 * i, "%E2%80%93", 9));
+    mu_assert ("url_parse: iri path end", !strcmp (u->path + 9 * i, "x"));
+    url_free (u);
+    opt.enable_iri = enable_iri;
+  }
+#endif
+
+  opt.locale = locale;
+  return NULL;
+}
+
+const char *
+test_url_file_name (void)
+{
+  const char *locale = opt.locale;
+  bool dirstruct = opt.dirstruct, add_hostdir = opt.add_hostdir;
+  struct url *u;
+  char *f1, *f2, *f3, *f4;
+
+  if (!opt.locale)
+    opt.locale = "UTF-8";
+  opt.dirstruct = opt.add_hostdir = true;
+
+  u = url_new_init ();
+  u->ori_url = xstrdup ("http://example.com/a%20b/c.html");
+  mu_assert ("test_url_file_name: url_parse",
+             url_parse (u, true, false) == PE_NO_ERROR);
+  f1 = url_file_name (u, NULL);
+  f2 = url_file_name (u, NULL);
+  url_set_file (u, "d.html");
+  f3 = url_file_name (u, NULL);
+  /* The host directories are reused, but not for another port.  */
+  u->port = 8080;
+  f4 = url_file_name (u, NULL);
+  url_free (u);
+
+  opt.dirstruct = dirstruct;
+  opt.add_hostdir = add_hostdir;
+  opt.locale = locale;
+
+  mu_assert ("test_url_file_name: name",
+             !strcmp (f1, "example.com/a b/c.html"));
+  mu_assert ("test_url_file_name: same name", !strcmp (f1, f2));
+  mu_assert ("test_url_file_name: file changed",
+             !strcmp (f3, "example.com/a b/d.html"));
+  mu_assert ("test_url_file_name: port changed",
+             !strncmp (f4, "example.com", 11) && strstr (f4, "8080/a b/d.html"));
+  xfree (f1);
+  xfree (f2);
+  xfree (f3);
+  xfree (f4);
+  return NULL;
+}
+
+const char *
+test_url_merge_base_length (void)
+{
+  static const struct {
+    const char *base, *link;
+    int length;
+  } test_array[] = {
+    { "http://host/dir/a.html?q", "b.html", 16 },
+    { "http://host/dir/a.html?q", "/b.html", 16 },
+    { "http://host/dir/a.html?q", "?r", 22 },
+    { "http://host/dir/a.html?q", "#f", 24 },
+    { "http://host/dir/a.html?q", "", 24 },
+    { "http://host/dir/a.html", "http://other/", 0 },
+    { "http://host", "b.html", 11 },
+    { "a.html", "b.html", 0 },
+  };
+  unsigned i;
+
+  for (i = 0; i < countof (test_array); i++)
+    {
+      const char *base = test_array[i].base, *link = test_array[i].link;
+      int length = url_merge_base_length (base, link);
+      char *merged = url_merge (base, link);
+      /* Another page of the directory merges the same.  */
+      char *other = aprintf ("%.*sother.html?other#other", length, base);
+      char *merged_other = url_merge (other, link);
+      bool same = !strcmp (merged, merged_other);
+
+      xfree (merged);
+      xfree (other);
+      xfree (merged_other);
+      mu_assert ("test_url_merge_base_length: wrong length",
+                 length == test_array[i].length);
+      mu_assert ("test_url_merge_base_length: merge differs",
+                 same || (length && base[length - 1] != '/'));
+    }
+  return NULL;
+}
+
+static struct url *
+test_parsed_url (const char *url)
+{
+  struct url *u = url_new_init ();
+  u->ori_url = xstrdup (url);
+  if (url_parse (u, true, false) != PE_NO_ERROR)
+    {
+      url_free (u);
+      return NULL;
+    }
+  return u;
+}
+
+const char *
+test_url_intern_host (void)
+{
+  const char *locale = opt.locale;
+  struct url *a, *b, *c, *d;
+  bool same, dup_same, other;
+
+  if (!opt.locale)
+    opt.locale = "UTF-8";
+  a = test_parsed_url ("http://example.com/a");
+  b = test_parsed_url ("http://EXAMPLE.com:8080/b");
+  c = test_parsed_url ("http://example.org/");
+  d = a ? url_dup (a) : NULL;
+  opt.locale = locale;
+
+  mu_assert ("test_url_intern_host: url_parse", a && b && c && d);
+  same = URL_SAME_HOST (a, b);
+  dup_same = URL_SAME_HOST (a, d);
+  other = URL_SAME_HOST (a, c);
+  url_free (a);
+  url_free (b);
+  url_free (c);
+  url_free (d);
+  mu_assert ("test_url_intern_host: same host", same && dup_same);
+  mu_assert ("test_url_intern_host: other host", !other);
+  return NULL;
+}
+
+const char *
+test_mkalldirs (void)
+{
+  struct stat st;
+  bool made;
+
+  url_cleanup ();
+  mu_assert ("test_mkalldirs: chain",
+             mkalldirs ("test-mkalldirs.d/a/b/file") == 0);
+  made = stat ("test-mkalldirs.d/a/b", &st) == 0 && S_ISDIR (st.st_mode);
+  mu_assert ("test_mkalldirs: sibling",
+             mkalldirs ("test-mkalldirs.d/a/c/file") == 0);
+  made = made && stat ("test-mkalldirs.d/a/c", &st) == 0;
+
+  /* A directory removed behind its back is still taken to exist.  */
+  rmdir ("test-mkalldirs.d/a/c");
+  mu_assert ("test_mkalldirs: known",
+             mkalldirs ("test-mkalldirs.d/a/c/file") == 0
+             && stat ("test-mkalldirs.d/a/c", &st) != 0);
+
+  rmdir ("test-mkalldirs.d/a/b");
+  rmdir ("test-mkalldirs.d/a");
+  rmdir ("test-mkalldirs.d");
+  url_cleanup ();
+  mu_assert ("test_mkalldirs: directories made", made);
+  return NULL;
+}
+
 #endif /* TESTING */
 
 /*
@@ -182,8 +182,25 @@ struct url
   /* Extracted path info (unquoted), locale encoding. */
   char *dir;
   char *file;
+
+  /* The block in which url_parse stores host, path, params, query
+     and fragment, instead of allocating each of them.  */
+  char *parts;
+  size_t parts_size;
+
+  /* The file name url_file_name made of the URL before making it
+     unique, and the scheme and port it was made with.  It is dropped
+     when the path changes.  */
+  char *file_name;
+  enum url_scheme file_name_scheme;
+  int file_name_port;
 };
 
+/* Whether the URLs A and B are on the same host.  The host names of
+   the URLs made by url_parse, url_dup and url_read are interned, so
+   comparing them is comparing their pointers.  */
+#define URL_SAME_HOST(a, b) ((a)->host == (b)->host)
+
 /* Function declarations */
 
 char *url_escape (const char *);
@@ -196,9 +213,12 @@ const char *url_error (int);
 char *url_full_path (const struct url *);
 void url_set_dir (struct url *, const char *);
 void url_set_file (struct url *, const char *);
+const char *url_intern_host (const char *);
 struct url *url_new_init ();
 struct url *url_dup (struct url *url);
 void url_free (struct url *);
+void url_write (FILE *, const struct url *);
+struct url *url_read (FILE *);
 
 enum url_scheme url_scheme (const char *);
 bool url_has_scheme (const char *);
@@ -208,13 +228,15 @@ void scheme_disable (enum url_scheme);
 const char *scheme_leading_string (enum url_scheme);
 
 char *url_string (const struct url *, enum url_auth_mode);
-char *url_file_name (const struct url *, char *);
+char *url_file_name (struct url *, char *);
 
 char *convert_fname (const char *fname, const char *from_encoding, const char *to_encoding);
 
 char *url_merge (const char *, const char *);
+int url_merge_base_length (const char *, const char *);
 
 int mkalldirs (const char *);
+void url_cleanup (void);
 
 char *rewrite_shorthand_url (const char *);
 bool schemes_are_similar_p (enum url_scheme a, enum url_scheme b);
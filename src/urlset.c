@@ -0,0 +1,294 @@
+/* Compact sets of URLs, stored as fingerprints.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "urlset.h"
+#include "utils.h"
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+
+/* A set of URLs as used for the blacklist of retrieve_tree.  Rather
+   than the URL strings, it stores a 64-bit fingerprint of each, in an
+   open-addressed table with linear probing.  That takes 8 bytes per
+   URL, at a load of at most 3/4, instead of the string plus a hash
+   table cell, and looking a URL up allocates nothing.
+
+   URLs are compared as url_unescape would leave them; the fingerprint
+   is computed while unescaping, without copying the URL.
+
+   Two different URLs get the same fingerprint with a probability of
+   about N/2^64 for each lookup in a set of N URLs, i.e. 1 in 10^11
+   with 100 million URLs.  The worst that can happen then is that a URL
+   is taken for one already seen and not downloaded.  */
+
+struct url_set {
+  uint64_t *slots;              /* fingerprints; 0 marks a free slot */
+  size_t size;                  /* number of slots, a power of 2 */
+  size_t count;                 /* number of fingerprints stored */
+};
+
+#define URL_SET_INITIAL_SIZE 1024
+
+/* Return the fingerprint of URL as url_unescape would leave it.  */
+
+static uint64_t
+url_fingerprint (const char *url)
+{
+  const unsigned char *p = (const unsigned char *) url;
+  uint64_t h = 14695981039346656037ULL; /* 64-bit FNV-1a */
+
+  for (; *p; p++)
+    {
+      unsigned char c = *p;
+
+      /* Same rules as url_unescape: %00 is left alone.  */
+      if (c == '%' && c_isxdigit (p[1]) && c_isxdigit (p[2])
+          && (p[1] != '0' || p[2] != '0'))
+        {
+          c = X2DIGITS_TO_NUM (p[1], p[2]);
+          p += 2;
+        }
+      h ^= c;
+      h *= 1099511628211ULL;
+    }
+
+  /* Mix the bits, so that the low ones can index the table.  */
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h ? h : 1;
+}
+
+struct url_set *
+url_set_new (void)
+{
+  MEMACCT_ENTER (memacct_saved, MEMACCT_BLACKLIST);
+  struct url_set *set = xnew (struct url_set);
+
+  set->size = URL_SET_INITIAL_SIZE;
+  set->count = 0;
+  set->slots = xcalloc (set->size, sizeof (uint64_t));
+  MEMACCT_LEAVE (memacct_saved);
+  return set;
+}
+
+void
+url_set_free (struct url_set *set)
+{
+  if (set)
+    {
+      xfree (set->slots);
+      xfree (set);
+    }
+}
+
+/* Return the slot holding FP, or the free slot where it would go.  */
+
+static uint64_t *
+url_set_find (const struct url_set *set, uint64_t fp)
+{
+  size_t mask = set->size - 1;
+  size_t i = fp & mask;
+
+  while (set->slots[i] && set->slots[i] != fp)
+    i = (i + 1) & mask;
+  return &set->slots[i];
+}
+
+static void
+url_set_grow (struct url_set *set)
+{
+  uint64_t *old = set->slots;
+  size_t old_size = set->size, i;
+
+  MEMACCT_ENTER (memacct_saved, MEMACCT_BLACKLIST);
+  set->size *= 2;
+  set->slots = xcalloc (set->size, sizeof (uint64_t));
+  MEMACCT_LEAVE (memacct_saved);
+  for (i = 0; i < old_size; i++)
+    if (old[i])
+      *url_set_find (set, old[i]) = old[i];
+  xfree (old);
+}
+
+/* Add URL to SET.  Return true if it wasn't there yet.  */
+
+bool
+url_set_add (struct url_set *set, const char *url)
+{
+  uint64_t fp = url_fingerprint (url);
+  uint64_t *slot = url_set_find (set, fp);
+
+  if (*slot)
+    return false;
+
+  *slot = fp;
+  if (++set->count > set->size / 4 * 3)
+    url_set_grow (set);
+  return true;
+}
+
+bool
+url_set_contains (const struct url_set *set, const char *url)
+{
+  return *url_set_find (set, url_fingerprint (url)) != 0;
+}
+
+size_t
+url_set_count (const struct url_set *set)
+{
+  return set->count;
+}
+
+/* The memory taken by SET, in bytes.  */
+
+size_t
+url_set_memory (const struct url_set *set)
+{
+  return sizeof (*set) + set->size * sizeof (uint64_t);
+}
+
+/* Write the fingerprints in SET to FP, to be read back by
+   url_set_read.  Errors are to be checked with ferror.  */
+
+void
+url_set_write (FILE *fp, const struct url_set *set)
+{
+  uint64_t count = set->count;
+  size_t i;
+
+  fwrite (&count, sizeof (count), 1, fp);
+  for (i = 0; i < set->size; i++)
+    if (set->slots[i])
+      fwrite (&set->slots[i], sizeof (uint64_t), 1, fp);
+}
+
+/* Read a set written by url_set_write from FP.  Returns NULL on
+   error.  */
+
+struct url_set *
+url_set_read (FILE *fp)
+{
+  struct url_set *set;
+  uint64_t count, i;
+
+  if (fread (&count, sizeof (count), 1, fp) != 1)
+    return NULL;
+
+  set = url_set_new ();
+  for (i = 0; i < count; i++)
+    {
+      uint64_t value;
+      uint64_t *slot;
+
+      if (fread (&value, sizeof (value), 1, fp) != 1 || !value)
+        {
+          url_set_free (set);
+          return NULL;
+        }
+      slot = url_set_find (set, value);
+      if (*slot)
+        continue;
+      *slot = value;
+      if (++set->count > set->size / 4 * 3)
+        url_set_grow (set);
+    }
+  return set;
+}
+
+#ifdef TESTING
+
+const char *
+test_url_set (void)
+{
+  struct url_set *set = url_set_new (), *copy;
+  char url[64];
+  FILE *tmp;
+  int i;
+
+  mu_assert ("url_set_add: new URL", url_set_add (set, "http://a/b c"));
+  mu_assert ("url_set_add: same URL", !url_set_add (set, "http://a/b c"));
+  mu_assert ("url_set_contains: escaped form",
+             url_set_contains (set, "http://a/b%20c"));
+  mu_assert ("url_set_contains: other URL",
+             !url_set_contains (set, "http://a/b"));
+
+  /* %00 stays escaped, as url_unescape leaves it.  */
+  url_set_add (set, "http://a/%00");
+  mu_assert ("url_set_contains: %00", url_set_contains (set, "http://a/%00"));
+  mu_assert ("url_set_contains: literal %00",
+             !url_set_contains (set, "http://a/"));
+
+  /* Survive growing the table.  */
+  for (i = 0; i < 10000; i++)
+    {
+      snprintf (url, sizeof (url), "http://host/%d", i);
+      url_set_add (set, url);
+    }
+  for (i = 0; i < 10000; i++)
+    {
+      snprintf (url, sizeof (url), "http://host/%d", i);
+      mu_assert ("url_set_contains: after growing", url_set_contains (set, url));
+    }
+  mu_assert ("url_set_count", url_set_count (set) == 10000 + 2);
+  mu_assert ("url_set_contains: absent after growing",
+             !url_set_contains (set, "http://host/10000"));
+
+  /* Read back what was written.  */
+  tmp = tmpfile ();
+  mu_assert ("tmpfile", tmp != NULL);
+  url_set_write (tmp, set);
+  rewind (tmp);
+  copy = url_set_read (tmp);
+  fclose (tmp);
+  mu_assert ("url_set_read", copy != NULL);
+  mu_assert ("url_set_read: count",
+             url_set_count (copy) == url_set_count (set));
+  mu_assert ("url_set_read: contents",
+             url_set_contains (copy, "http://host/9999")
+             && url_set_contains (copy, "http://a/b%20c")
+             && !url_set_contains (copy, "http://host/10000"));
+  url_set_free (copy);
+
+  url_set_free (set);
+  return NULL;
+}
+
+#endif /* TESTING */
@@ -54,6 +54,7 @@ as that of the covered work.  */
 #include <sys/time.h>
 
 #include <sys/stat.h>
+#include <dirent.h>
 
 /* For TIOCGWINSZ and friends: */
 #ifndef WINDOWS
@@ -66,6 +67,11 @@ as that of the covered work.  */
 #include <setjmp.h>
 
 #include <regex.h>
+#include <tmpdir.h>
+
+#ifndef O_TEMPORARY
+# define O_TEMPORARY 0
+#endif
 #ifdef HAVE_LIBPCRE2
 # define PCRE2_CODE_UNIT_WIDTH 8
 # include <pcre2.h>
@@ -647,9 +653,162 @@ file_size (const char *filename)
 
 #ifdef UNIQ_SEP
 
+/* Once this many suffixes of a name have been found taken, the
+   directory is listed instead of probed with stat.  */
+#define UNIQ_PROBES 4
+
+/* The numeric suffixes taken among the files of a listed directory,
+   for one file name.  */
+struct uniq_suffixes
+{
+  int *taken;                   /* sorted */
+  int count;
+  int size;
+  int next;                     /* the lowest suffix that may be free */
+};
+
+/* The suffixes of the files of the listed directories, by the name
+   they suffix, as given to unique_name_1.  */
+static struct hash_table *uniq_suffix_map;
+
+/* The directories listed into uniq_suffix_map.  */
+static struct hash_table *uniq_listed_dirs;
+
+static int
+cmp_int (const void *a, const void *b)
+{
+  int x = *(const int *) a, y = *(const int *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Return the value of SUFFIX if it is one that unique_name_1 could
+   have made, -1 otherwise.  */
+
+static int
+uniq_suffix_value (const char *suffix)
+{
+  int n = 0;
+
+  if (*suffix < '1' || *suffix > '9')
+    return -1;
+  for (; *suffix; suffix++)
+    {
+      if (!c_isdigit (*suffix) || n > 99999)
+        return -1;
+      n = n * 10 + (*suffix - '0');
+    }
+  return n;
+}
+
+/* Record the numeric suffixes of the files in directory DIR, of which
+   the names given to unique_name_1 start with DIRLEN bytes of
+   PREFIX.  */
+
+static void
+uniq_list_directory (const char *dir, const char *prefix, int dirlen)
+{
+  DIR *dp;
+  struct dirent *ent;
+  hash_table_iterator iter;
+
+  if (!uniq_suffix_map)
+    {
+      uniq_suffix_map = make_string_hash_table (0);
+      uniq_listed_dirs = make_string_hash_table (0);
+    }
+  string_set_add (uniq_listed_dirs, dir);
+
+  dp = opendir (dir);
+  if (!dp)
+    return;
+  DEBUGP (("Listing %s for the suffixes of its file names.\n", dir));
+  while ((ent = readdir (dp)) != NULL)
+    {
+      char *sep = strrchr (ent->d_name, UNIQ_SEP);
+      struct uniq_suffixes *s;
+      char *key;
+      int n;
+
+      if (!sep || sep == ent->d_name || (n = uniq_suffix_value (sep + 1)) < 0)
+        continue;
+      key = xmalloc (dirlen + (sep - ent->d_name) + 1);
+      memcpy (key, prefix, dirlen);
+      memcpy (key + dirlen, ent->d_name, sep - ent->d_name);
+      key[dirlen + (sep - ent->d_name)] = '\0';
+
+      s = hash_table_get (uniq_suffix_map, key);
+      if (!s)
+        {
+          s = xnew0 (struct uniq_suffixes);
+          s->next = 1;
+          hash_table_put (uniq_suffix_map, key, s);
+        }
+      else
+        xfree (key);
+      if (s->count == s->size)
+        {
+          s->size = s->size ? 2 * s->size : 8;
+          s->taken = xrealloc (s->taken, s->size * sizeof (int));
+        }
+      s->taken[s->count++] = n;
+    }
+  closedir (dp);
+
+  for (hash_table_iterate (uniq_suffix_map, &iter);
+       hash_table_iter_next (&iter);
+       )
+    {
+      struct uniq_suffixes *s = iter.value;
+      qsort (s->taken, s->count, sizeof (int), cmp_int);
+    }
+}
+
+/* Return the suffixes of PREFIX, listing its directory if it hasn't
+   been.  */
+
+static struct uniq_suffixes *
+uniq_suffixes (const char *prefix)
+{
+  const char *slash = strrchr (prefix, '/');
+  int dirlen = slash ? slash - prefix + 1 : 0;
+  struct uniq_suffixes *s;
+  char *dir;
+
+  if (uniq_suffix_map
+      && (s = hash_table_get (uniq_suffix_map, prefix)) != NULL)
+    return s;
+
+  if (!slash)
+    dir = xstrdup (".");
+  else if (slash == prefix)
+    dir = xstrdup ("/");
+  else
+    dir = strdupdelim (prefix, slash);
+  if (!uniq_listed_dirs || !string_set_contains (uniq_listed_dirs, dir))
+    uniq_list_directory (dir, prefix, dirlen);
+  xfree (dir);
+
+  /* Listed anew, or the files of PREFIX were made after the
+     listing.  */
+  s = hash_table_get (uniq_suffix_map, prefix);
+  if (!s)
+    {
+      s = xnew0 (struct uniq_suffixes);
+      s->next = 1;
+      hash_table_put (uniq_suffix_map, xstrdup (prefix), s);
+    }
+  return s;
+}
+
 /* stat file names named PREFIX.1, PREFIX.2, etc., until one that
    doesn't exist is found.  Return a freshly allocated copy of the
-   unused file name.  */
+   unused file name.
+
+   Past the first few, the suffixes are looked up in a listing of the
+   directory, made once, where the suffixes of its files were sorted.
+   From then on, a suffix is only checked with stat if the listing
+   doesn't have it, to find the files made since, and the search for
+   the next name of PREFIX starts where the last one stopped.  */
 
 static char *
 unique_name_1 (const char *prefix)
@@ -658,17 +817,70 @@ unique_name_1 (const char *prefix)
   int plen = strlen (prefix);
   char *template = xmalloc (plen + 1 + 24);
   char *template_tail = template + plen;
+  struct uniq_suffixes *s = NULL;
+  int i = 0;
 
   memcpy (template, prefix, plen);
   *template_tail++ = UNIQ_SEP;
 
-  do
-    number_to_string (template_tail, count++);
-  while (file_exists_p (template, NULL) && count < 999999);
+  if (uniq_suffix_map)
+    s = hash_table_get (uniq_suffix_map, prefix);
+
+  if (!s)
+    {
+      for (; count <= UNIQ_PROBES; count++)
+        {
+          number_to_string (template_tail, count);
+          if (!file_exists_p (template, NULL))
+            return template;
+        }
+      s = uniq_suffixes (prefix);
+    }
 
+  count = MAX (s->next, count);
+  for (;;)
+    {
+      /* The listed suffixes below COUNT are behind us.  */
+      while (i < s->count && s->taken[i] < count)
+        i++;
+      if (i < s->count && s->taken[i] == count)
+        {
+          count++;
+          continue;
+        }
+      number_to_string (template_tail, count);
+      if (count >= 999999 || !file_exists_p (template, NULL))
+        break;
+      count++;
+    }
+  s->next = count;
   return template;
 }
 
+/* Forget the directory listings of unique_name_1.  */
+
+void
+unique_name_cleanup (void)
+{
+  hash_table_iterator iter;
+
+  if (!uniq_suffix_map)
+    return;
+  for (hash_table_iterate (uniq_suffix_map, &iter);
+       hash_table_iter_next (&iter);
+       )
+    {
+      struct uniq_suffixes *s = iter.value;
+      xfree (iter.key);
+      xfree (s->taken);
+      xfree (s);
+    }
+  hash_table_destroy (uniq_suffix_map);
+  uniq_suffix_map = NULL;
+  string_set_free (uniq_listed_dirs);
+  uniq_listed_dirs = NULL;
+}
+
 /* Return a unique file name, based on FILE.
 
    More precisely, if FILE doesn't exist, it is returned unmodified.
@@ -725,6 +937,11 @@ unique_name (const char *file)
   return xstrdup (file);
 }
 
+void
+unique_name_cleanup (void)
+{
+}
+
 #endif /* def UNIQ_SEP [else] */
 
 /* Create a file based on NAME, except without overwriting an existing
@@ -905,6 +1122,97 @@ fopen_stat(const char *fname, const char *mode, file_stats_t *fstats)
   return fp;
 }
 
+/* Create a temporary file in DIR, or in the system's directory for
+   temporary files if DIR is NULL.  It is removed when closed.
+   Returns the pointer to the temporary file, or NULL. */
+FILE *
+temp_file (const char *dir)
+{
+  char filename[100];
+  int fd;
+
+  if (path_search (filename, 100, dir, "wget", true) == -1)
+    return NULL;
+
+#ifdef __VMS
+  /* 2013-07-12 SMS.
+   * mkostemp()+unlink()+fdopen() scheme causes trouble on VMS, so use
+   * mktemp() to uniquify the (VMS-style) name, and then use a normal
+   * fopen() with a "create temp file marked for delete" option.
+   */
+  {
+    char *tfn;
+
+    tfn = mktemp (filename);            /* Get unique name from template. */
+    if (tfn == NULL)
+      return NULL;
+    return fopen (tfn, "w+", "fop=tmd");    /* Create auto-delete temp file. */
+  }
+#else /* def __VMS */
+  fd = mkostemp (filename, O_TEMPORARY);
+  if (fd < 0)
+    return NULL;
+
+#if !O_TEMPORARY
+  if (unlink (filename) < 0)
+    {
+      close(fd);
+      return NULL;
+    }
+#endif
+
+  return fdopen (fd, "wb+");
+#endif /* def __VMS [else] */
+}
+
+/* Write N, or the string S as its length (-1 for NULL) followed by
+   its bytes, to FP in the machine's format.  These are meant for
+   files read back by the same Wget, such as the spilled queue of
+   retrieve_tree.  Errors are to be checked with ferror.  */
+void
+fput_int (FILE *fp, int n)
+{
+  fwrite (&n, sizeof (n), 1, fp);
+}
+
+void
+fput_string (FILE *fp, const char *s)
+{
+  int len = s ? (int) strlen (s) : -1;
+
+  fput_int (fp, len);
+  if (len > 0)
+    fwrite (s, 1, len, fp);
+}
+
+/* Read back what fput_int and fput_string have written.  Return false
+   on error or at the end of file.  The string is malloc-ed.  */
+bool
+fget_int (FILE *fp, int *n)
+{
+  return fread (n, sizeof (*n), 1, fp) == 1;
+}
+
+bool
+fget_string (FILE *fp, char **s)
+{
+  int len;
+
+  *s = NULL;
+  if (!fget_int (fp, &len))
+    return false;
+  if (len < 0)
+    return true;
+  *s = xmalloc (len + 1);
+  if (len > 0 && fread (*s, 1, len, fp) != (size_t) len)
+    {
+      xfree (*s);
+      return false;
+    }
+  (*s)[len] = '\0';
+  return true;
+}
+
 /* open_stat assumes that file_exists_p() was called earlier to save file_stats
    file_stats_t passed to this function was returned from file_exists_p()
    This is to prevent TOCTTOU race condition.
@@ -970,6 +1278,11 @@ make_directory (const char *directory)
   char *dir;
   size_t len = strlen (directory);
 
+  /* Usually only the last component is missing, and one mkdir() is
+     all it takes.  */
+  if (mkdir (directory, 0777) == 0 || errno == EEXIST)
+    return 0;
+
   /* Make a copy of dir, to be able to write to it.  Otherwise, the
      function is unsafe if called with a read-only char *argument.  */
   if (len < sizeof(buf))
@@ -989,12 +1302,12 @@ make_directory (const char *directory)
       if (!dir[i])
         quit = 1;
       dir[i] = '\0';
-      /* Check whether the directory already exists.  Allow creation of
-         of intermediate directories to fail, as the initial path components
-         are not necessarily directories!  */
-      if (!file_exists_p (dir, NULL))
-        ret = mkdir (dir, 0777);
-      else
+      /* Allow creation of intermediate directories to fail, as the
+         initial path components are not necessarily directories!  An
+         existing component, directory or not, counts as created; rather
+         than stat() each of them first, let mkdir() tell.  */
+      ret = mkdir (dir, 0777);
+      if (ret != 0 && errno == EEXIST)
         ret = 0;
       if (quit)
         break;
@@ -1045,7 +1358,106 @@ fnmatch_nocase (const char *pattern, const char *string, int flags)
   return fnmatch (pattern, string, flags | FNM_CASEFOLD);
 }
 
-static bool in_acclist (const char *const *, const char *, bool);
+/* A list of -A/-R patterns or of -I/-X directories, sorted out when
+   first used, so that the entries without wildcards are all matched
+   at once by a few hash lookups instead of one by one.  Only the
+   entries with wildcards are left to fnmatch.  */
+struct match_list
+{
+  const void *source;           /* the vector compiled, or NULL */
+  bool fold_case;               /* opt.ignore_case when compiled */
+  bool match_all;               /* an entry matches everything */
+  struct hash_table *literals;  /* the entries without wildcards */
+  int *lengths;                 /* their distinct lengths */
+  int lengths_count;
+  const char **globs;           /* the others, NULL-terminated */
+};
+
+static struct match_list accept_list, reject_list;
+static struct match_list include_list, exclude_list;
+
+static void
+match_list_free (struct match_list *ml)
+{
+  if (ml->literals)
+    string_set_free (ml->literals);
+  xfree (ml->lengths);
+  xfree (ml->globs);
+  xzero (*ml);
+}
+
+/* Compile SOURCE into ML, unless it is already.  The entries of a
+   list of DIRS lose their leading '/'; those of a list of names that
+   are a `*' followed by no wildcards are suffixes like the entries
+   without wildcards.  */
+
+static void
+match_list_compile (struct match_list *ml, const char *const *source,
+                    bool dirs)
+{
+  const char *const *x;
+  int count = 0, globs = 0;
+
+  if (ml->source == source && ml->fold_case == opt.ignore_case)
+    return;
+  match_list_free (ml);
+  ml->source = source;
+  ml->fold_case = opt.ignore_case;
+  ml->literals = opt.ignore_case ? make_nocase_string_hash_table (0)
+                                 : make_string_hash_table (0);
+
+  for (x = source; *x; x++)
+    count++;
+  ml->lengths = xnew_array (int, count);
+  ml->globs = xnew_array (const char *, count + 1);
+
+  for (x = source; *x; x++)
+    {
+      const char *p = *x;
+      int len, i;
+
+      if (dirs)
+        p += (*p == '/');
+      else if (*p == '*' && p[1] && !has_wildcards_p (p + 1))
+        p++;
+
+      if (has_wildcards_p (p))
+        {
+          ml->globs[globs++] = p;
+          continue;
+        }
+      if (!*p)
+        {
+          ml->match_all = true;
+          continue;
+        }
+      if (string_set_contains (ml->literals, p))
+        continue;
+      string_set_add (ml->literals, p);
+
+      len = strlen (p);
+      for (i = 0; i < ml->lengths_count; i++)
+        if (ml->lengths[i] == len)
+          break;
+      if (i == ml->lengths_count)
+        ml->lengths[ml->lengths_count++] = len;
+    }
+  ml->globs[globs] = NULL;
+}
+
+/* Free the compiled accept/reject and include/exclude lists.  */
+
+void
+acclist_cleanup (void)
+{
+  match_list_free (&accept_list);
+  match_list_free (&reject_list);
+  match_list_free (&include_list);
+  match_list_free (&exclude_list);
+}
+
+static bool in_acclist (struct match_list *, const char *const *,
+                        const char *);
 
 /* Determine whether a file is acceptable to be followed, according to
    lists of patterns to accept/reject.  */
@@ -1063,13 +1475,16 @@ acceptable (const char *s)
   if (opt.accepts)
     {
       if (opt.rejects)
-        return (in_acclist ((const char *const *)opt.accepts, s, true)
-                && !in_acclist ((const char *const *)opt.rejects, s, true));
+        return (in_acclist (&accept_list,
+                            (const char *const *)opt.accepts, s)
+                && !in_acclist (&reject_list,
+                                (const char *const *)opt.rejects, s));
       else
-        return in_acclist ((const char *const *)opt.accepts, s, true);
+        return in_acclist (&accept_list,
+                           (const char *const *)opt.accepts, s);
     }
   else if (opt.rejects)
-    return !in_acclist ((const char *const *)opt.rejects, s, true);
+    return !in_acclist (&reject_list, (const char *const *)opt.rejects, s);
 
   return true;
 }
@@ -1105,33 +1520,46 @@ subdir_p (const char *d1, const char *d2)
   return *d1 == '\0' && (*d2 == '\0' || *d2 == '/');
 }
 
-/* Iterate through DIRLIST (which must be NULL-terminated), and return the
-   first element that matches DIR, through wildcards or front comparison (as
-   appropriate).  */
+/* Return whether an element of DIRLIST (which must be NULL-terminated),
+   compiled into ML, matches DIR, through wildcards or front comparison
+   (as appropriate).  DIR matches an element without wildcards if it is
+   a subdirectory of it, as by subdir_p, so its leading directories are
+   looked up in turn.  */
 static bool
-dir_matches_p (const char **dirlist, const char *dir)
+dir_matches_p (struct match_list *ml, const char **dirlist, const char *dir)
 {
   const char **x;
   int (*matcher) (const char *, const char *, int)
     = opt.ignore_case ? fnmatch_nocase : fnmatch;
 
-  for (x = dirlist; *x; x++)
+  match_list_compile (ml, (const char *const *) dirlist, true);
+  if (ml->match_all)
+    return true;
+
+  if (ml->lengths_count)
     {
-      /* Remove leading '/' */
-      const char *p = *x + (**x == '/');
-      if (has_wildcards_p (p))
-        {
-          if (matcher (p, dir, FNM_PATHNAME) == 0)
-            break;
-        }
-      else
-        {
-          if (subdir_p (p, dir))
-            break;
-        }
+      char *copy = xstrdup (dir), *p;
+      bool found = false;
+
+      for (p = copy; !found; p++)
+        if (*p == '/' || !*p)
+          {
+            char c = *p;
+            *p = '\0';
+            found = string_set_contains (ml->literals, copy);
+            *p = c;
+            if (!c)
+              break;
+          }
+      xfree (copy);
+      if (found)
+        return true;
     }
 
-  return *x ? true : false;
+  for (x = ml->globs; *x; x++)
+    if (matcher (*x, dir, FNM_PATHNAME) == 0)
+      return true;
+  return false;
 }
 
 /* Returns whether DIRECTORY is acceptable for download, wrt the
@@ -1148,12 +1576,12 @@ accdir (const char *directory)
     ++directory;
   if (opt.includes)
     {
-      if (!dir_matches_p (opt.includes, directory))
+      if (!dir_matches_p (&include_list, opt.includes, directory))
         return false;
     }
   if (opt.excludes)
     {
-      if (dir_matches_p (opt.excludes, directory))
+      if (dir_matches_p (&exclude_list, opt.excludes, directory))
         return false;
     }
   return true;
@@ -1181,40 +1609,35 @@ match_tail (const char *string, const char *tail, bool fold_case)
     return !strcasecmp (string + pos, tail);
 }
 
-/* Checks whether string S matches each element of ACCEPTS.  A list
-   element are matched either with fnmatch() or match_tail(),
-   according to whether the element contains wildcards or not.
-
-   If the BACKWARD is false, don't do backward comparison -- just compare
-   them normally.  */
+/* Checks whether string S matches an element of ACCEPTS, compiled
+   into ML.  A list element is matched either with fnmatch() or
+   match_tail(), according to whether the element contains wildcards
+   or not; the latter are all matched by looking up the tails of S of
+   their lengths.  */
 static bool
-in_acclist (const char *const *accepts, const char *s, bool backward)
+in_acclist (struct match_list *ml, const char *const *accepts,
+            const char *s)
 {
-  for (; *accepts; accepts++)
+  const char **x;
+  size_t len = strlen (s);
+  int i;
+
+  match_list_compile (ml, accepts, false);
+  if (ml->match_all)
+    return true;
+
+  for (i = 0; i < ml->lengths_count; i++)
+    if ((size_t) ml->lengths[i] <= len
+        && string_set_contains (ml->literals, s + len - ml->lengths[i]))
+      return true;
+
+  for (x = ml->globs; *x; x++)
     {
-      if (has_wildcards_p (*accepts))
-        {
-          int res = opt.ignore_case
-            ? fnmatch_nocase (*accepts, s, 0) : fnmatch (*accepts, s, 0);
-          /* fnmatch returns 0 if the pattern *does* match the string.  */
-          if (res == 0)
-            return true;
-        }
-      else
-        {
-          if (backward)
-            {
-              if (match_tail (s, *accepts, opt.ignore_case))
-                return true;
-            }
-          else
-            {
-              int cmp = opt.ignore_case
-                ? strcasecmp (s, *accepts) : strcmp (s, *accepts);
-              if (cmp == 0)
-                return true;
-            }
-        }
+      int res = opt.ignore_case
+        ? fnmatch_nocase (*x, s, 0) : fnmatch (*x, s, 0);
+      /* fnmatch returns 0 if the pattern *does* match the string.  */
+      if (res == 0)
+        return true;
     }
   return false;
 }
@@ -1280,8 +1703,9 @@ has_html_suffix_p (const char *fname)
    release the memory.
 
    Depending on the operating system and the type of file that is
-   being read, wget_read_file() either mmap's the file into memory, or
-   reads the file into the core using read().
+   being read, wget_read_file() either mmap's the file into memory
+   (maps a view of it on Windows), or reads the file into the core
+   using read().
 
    If file is named "-", fileno(stdin) is used for reading instead.
    If you want to read from a real file named "-", use "./-" instead.  */
@@ -1337,31 +1761,38 @@ wget_read_file (const char *file)
      to a plain file.  However, it's also possible that mmap() doesn't
      work for a particular type of file.  Therefore, whenever mmap()
      fails, we just fall back to the regular method.  */
+#elif defined WINDOWS
+  fm->content = ws_map_file (fd, &fm->length);
+  if (fm->content)
+    {
+      if (!inhibit_close)
+        close (fd);
+      fm->mmap_p = 1;
+      return fm;
+    }
 #endif /* HAVE_MMAP */
 
   fm->length = 0;
   size = 512;                   /* number of bytes fm->contents can
                                    hold at any given time. */
+  {
+    /* Size the buffer of a plain file for reading it in one go, with
+       a byte to spare so that the end of file is seen without growing
+       the buffer.  */
+    struct stat buf;
+    if (fstat (fd, &buf) == 0 && S_ISREG (buf.st_mode)
+        && buf.st_size > 0 && buf.st_size < LONG_MAX)
+      size = buf.st_size + 1;
+  }
   fm->content = xmalloc (size);
   while (1)
     {
       wgint nread;
-      if (fm->length > size / 2)
+      if (fm->length == size)
         {
-          /* #### I'm not sure whether the whole exponential-growth
-             thing makes sense with kernel read.  On Linux at least,
-             read() refuses to read more than 4K from a file at a
-             single chunk anyway.  But other Unixes might optimize it
-             better, and it doesn't *hurt* anything, so I'm leaving
-             it.  */
-
-          /* Normally, we grow SIZE exponentially to make the number
-             of calls to read() and realloc() logarithmic in relation
-             to file size.  However, read() can read an amount of data
-             smaller than requested, and it would be unreasonable to
-             double SIZE every time *something* was read.  Therefore,
-             we double SIZE only when the length exceeds half of the
-             entire allocated size.  */
+          /* The file was not plain, or grew.  Grow SIZE exponentially
+             to make the number of calls to read() and realloc()
+             logarithmic in relation to file size.  */
           size <<= 1;
           fm->content = xrealloc (fm->content, size);
         }
@@ -1378,7 +1809,7 @@ wget_read_file (const char *file)
     }
   if (!inhibit_close)
     close (fd);
-  if (size > fm->length && fm->length != 0)
+  if (size > fm->length + 1 && fm->length != 0)
     /* Due to exponential growth of fm->content, the allocated region
        might be much larger than what is actually needed.  */
     fm->content = xrealloc (fm->content, fm->length);
@@ -1407,6 +1838,10 @@ wget_read_file_free (struct file_memory *fm)
       munmap (fm->content, fm->length);
     }
   else
+#elif defined WINDOWS
+  if (fm->mmap_p)
+    ws_unmap_file (fm->content);
+  else
 #endif
     {
       xfree (fm->content);
@@ -1414,6 +1849,112 @@ wget_read_file_free (struct file_memory *fm)
   xfree (fm);
 }
 
+/* Ask the file system to reserve room for LENGTH more bytes at the
+   end of the file open on FP, so that a large download is laid out
+   contiguously instead of growing extent by extent.  The size of the
+   file doesn't change, so an interrupted download can still be
+   continued with -c.  This is only a hint; if it fails, the download
+   simply goes ahead without it.  */
+
+void
+preallocate_file (FILE *fp, wgint length)
+{
+#if defined HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+  int fd = fileno (fp);
+  struct stat st;
+
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode)
+      && fallocate (fd, FALLOC_FL_KEEP_SIZE, st.st_size, length) != 0)
+    DEBUGP (("Cannot preallocate %s bytes: %s\n",
+             number_to_static_string (length), strerror (errno)));
+#elif defined WINDOWS
+  ws_preallocate (fileno (fp), length);
+#else
+  (void) fp;
+  (void) length;
+#endif
+}
+
+/* Make the file open on FP LENGTH bytes long before it is written out
+   of order with write_file_at, so that the writes land inside the file
+   rather than extend it.  With ALLOCATE, the space is reserved as
+   well, as --preallocate asks; otherwise what isn't written yet may be
+   left as a hole.  Files already as long, and those other than regular
+   files, are left alone.  Like preallocate_file, this is only a hint.  */
+
+void
+presize_file (FILE *fp, wgint length, bool allocate)
+{
+  int fd;
+
+  if (fflush (fp) != 0)
+    return;
+  fd = fileno (fp);
+#ifdef WINDOWS
+  ws_presize (fd, length, allocate);
+#else
+  {
+    struct stat st;
+
+    if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)
+        || st.st_size >= length)
+      return;
+    if (allocate)
+      {
+# if defined HAVE_FALLOCATE
+        /* Unlike posix_fallocate, this fails instead of writing zeros
+           where the file system can't reserve the space.  */
+        if (fallocate (fd, 0, 0, length) == 0)
+          return;
+# elif defined HAVE_POSIX_FALLOCATE
+        if ((errno = posix_fallocate (fd, 0, length)) == 0)
+          return;
+# endif
+        DEBUGP (("Cannot preallocate %s bytes: %s\n",
+                 number_to_static_string (length), strerror (errno)));
+      }
+    if (ftruncate (fd, length) != 0)
+      DEBUGP (("Cannot extend the file to %s bytes: %s\n",
+               number_to_static_string (length), strerror (errno)));
+  }
+#endif
+}
+
+/* Write the SIZE bytes of BUF at offset POS of the file open on FP,
+   with a single system call where possible instead of a seek and a
+   write through the buffer of FP.  FP must have no output buffered
+   and must not be open for appending, and its position is unspecified
+   afterwards.  Return false on error, with errno set.  */
+
+bool
+write_file_at (FILE *fp, const char *buf, size_t size, wgint pos)
+{
+#if defined WINDOWS
+  return ws_pwrite (fileno (fp), buf, size, pos);
+#elif defined HAVE_PWRITE
+  int fd = fileno (fp);
+
+  while (size)
+    {
+      ssize_t ret = pwrite (fd, buf, size, pos);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+      buf += ret;
+      size -= ret;
+      pos += ret;
+    }
+  return true;
+#else
+  return (fseeko (fp, pos, SEEK_SET) == 0
+          && fwrite (buf, 1, size, fp) == size
+          && fflush (fp) == 0);
+#endif
+}
+
 /* Free the pointers in a NULL-terminated vector of pointers, then
    free the pointer itself.  */
 void
@@ -2447,6 +2988,9 @@ compile_pcre2_regex (const char *str)
       fprintf (stderr, _("Invalid regular expression %s, PCRE2 error %d\n"),
                quote (str), errornumber);
     }
+  else
+    /* Where JIT is not supported, the regex is interpreted.  */
+    pcre2_jit_compile (regex, PCRE2_JIT_COMPLETE);
   return regex;
 }
 #endif
@@ -2500,15 +3044,15 @@ bool
 match_pcre2_regex (const void *regex, const char *str)
 {
   int rc;
-  pcre2_match_data *match_data;
+  /* Only whether it matches is wanted, so a single pair of offsets
+     serves every regex, and is kept for the next URL.  */
+  static pcre2_match_data *match_data;
 
-  match_data = pcre2_match_data_create_from_pattern(regex, NULL);
+  if (!match_data)
+    match_data = pcre2_match_data_create (1, NULL);
 
   if (match_data)
-    {
-      rc = pcre2_match(regex, (PCRE2_SPTR) str, strlen(str), 0, 0, match_data, NULL);
-      pcre2_match_data_free(match_data);
-    }
+    rc = pcre2_match(regex, (PCRE2_SPTR) str, strlen(str), 0, 0, match_data, NULL);
   else
 	  rc = PCRE2_ERROR_NOMEMORY;
 
@@ -2931,6 +3475,110 @@ cleanup:
 
 #endif /* HAVE_SSL */
 
+#ifdef HAVE_SSL
+
+/* How long, in seconds, a certificate verification result is trusted
+   before the chain is verified again.  This bounds how late a
+   revocation is noticed within one run.  */
+#define CERT_VERIFY_TTL 600
+
+struct cert_verification {
+  long result;                  /* backend-specific verification status */
+  time_t expires;
+};
+
+/* Verification results, keyed by "HOST/SHA256" of the leaf certificate
+   presented by HOST.  */
+static struct hash_table *cert_verifications;
+
+static char *
+cert_verify_key (const char *host, const void *der, size_t der_len)
+{
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  size_t hostlen = strlen (host);
+  char *key = xmalloc (hostlen + 1 + 2 * SHA256_DIGEST_SIZE + 1);
+
+  sha256_buffer (der, der_len, digest);
+  memcpy (key, host, hostlen);
+  key[hostlen] = '/';
+  wg_hex_to_string (key + hostlen + 1, (const char *) digest,
+                    SHA256_DIGEST_SIZE);
+  return key;
+}
+
+/* Look up how the certificate DER (of DER_LEN bytes) presented by HOST
+   was verified earlier.  If a result is known and has not expired, it
+   is stored to *RESULT and true is returned.  */
+
+bool
+cert_verify_cache_get (const char *host, const void *der, size_t der_len,
+                       long *result)
+{
+  struct cert_verification *v;
+  char *key;
+
+  if (!cert_verifications || !host || !der || !der_len)
+    return false;
+
+  key = cert_verify_key (host, der, der_len);
+  v = hash_table_get (cert_verifications, key);
+  xfree (key);
+  if (!v || v->expires <= time (NULL))
+    return false;
+
+  *result = v->result;
+  return true;
+}
+
+/* Remember that the certificate DER presented by HOST verified with
+   RESULT, so that connections made to HOST soon after skip the chain
+   verification.  */
+
+void
+cert_verify_cache_put (const char *host, const void *der, size_t der_len,
+                       long result)
+{
+  struct cert_verification *v;
+  char *key;
+
+  if (!host || !der || !der_len)
+    return;
+  if (!cert_verifications)
+    cert_verifications = make_nocase_string_hash_table (0);
+
+  key = cert_verify_key (host, der, der_len);
+  v = hash_table_get (cert_verifications, key);
+  if (v)
+    xfree (key);
+  else
+    {
+      v = xnew (struct cert_verification);
+      hash_table_put (cert_verifications, key, v);
+    }
+  v->result = result;
+  v->expires = time (NULL) + CERT_VERIFY_TTL;
+}
+
+void
+cert_verify_cache_cleanup (void)
+{
+  hash_table_iterator iter;
+
+  if (!cert_verifications)
+    return;
+
+  for (hash_table_iterate (cert_verifications, &iter);
+       hash_table_iter_next (&iter); )
+    {
+      xfree (iter.key);
+      xfree (iter.value);
+    }
+  hash_table_destroy (cert_verifications);
+  cert_verifications = NULL;
+}
+
+#endif /* HAVE_SSL */
+
 #ifdef TESTING
 
 const char *
@@ -2986,7 +3634,12 @@ test_dir_matches_p(void)
 
   for (i = 0; i < countof(test_array); ++i)
     {
-      bool res = dir_matches_p (test_array[i].dirlist, test_array[i].dir);
+      struct match_list ml;
+      bool res;
+
+      xzero (ml);
+      res = dir_matches_p (&ml, test_array[i].dirlist, test_array[i].dir);
+      match_list_free (&ml);
 
       mu_assert ("test_dir_matches_p: wrong result",
                  res == test_array[i].result);
@@ -2995,4 +3648,169 @@ test_dir_matches_p(void)
   return NULL;
 }
 
+const char *
+test_in_acclist (void)
+{
+  static const char *accepts[] = { "jpg", ".tar.gz", "*.PNG", "a?c", NULL };
+  static const struct {
+    const char *s;
+    bool ignore_case;
+    bool result;
+  } test_array[] = {
+    { "photo.jpg", false, true },
+    { "photojpg", false, true },
+    { "photo.JPG", false, false },
+    { "photo.JPG", true, true },
+    { "x.tar.gz", false, true },
+    { "x.gz", false, false },
+    { "image.PNG", false, true },
+    { "image.png", false, false },
+    { "image.png", true, true },
+    { "abc", false, true },
+    { "abcd", false, false },
+    { "pg", false, false },
+  };
+  bool ignore_case = opt.ignore_case;
+  struct match_list ml;
+  unsigned i;
+
+  xzero (ml);
+  for (i = 0; i < countof(test_array); ++i)
+    {
+      bool res;
+
+      opt.ignore_case = test_array[i].ignore_case;
+      res = in_acclist (&ml, accepts, test_array[i].s);
+      if (res != test_array[i].result)
+        break;
+    }
+  match_list_free (&ml);
+  opt.ignore_case = ignore_case;
+  mu_assert ("test_in_acclist: wrong result", i == countof(test_array));
+  return NULL;
+}
+
+#ifdef UNIQ_SEP
+static void
+touch_test_file (const char *name)
+{
+  FILE *fp = fopen (name, "w");
+  if (fp)
+    fclose (fp);
+}
+
+const char *
+test_unique_name (void)
+{
+  static const char *files[] = {
+    "f", "f.1", "f.2", "f.3", "f.4", "f.5", "f.6", "f.8", "f.01", "g"
+  };
+  char name[64], *u1, *u2, *u3, *u4;
+  unsigned i;
+
+  unique_name_cleanup ();
+  mkdir ("test-unique-name.d", 0777);
+  for (i = 0; i < countof (files); i++)
+    {
+      snprintf (name, sizeof (name), "test-unique-name.d/%s", files[i]);
+      touch_test_file (name);
+    }
+
+  /* Past the probes, the listing finds the gap.  */
+  u1 = unique_name ("test-unique-name.d/f");
+  touch_test_file (u1);
+  /* The next one starts from there, and skips the listed f.8.  */
+  u2 = unique_name ("test-unique-name.d/f");
+  /* A name not yet used is probed as usual.  */
+  u3 = unique_name ("test-unique-name.d/g");
+  /* So is one the listing didn't see.  */
+  touch_test_file ("test-unique-name.d/h");
+  u4 = unique_name ("test-unique-name.d/h");
+
+  for (i = 0; i < countof (files); i++)
+    {
+      snprintf (name, sizeof (name), "test-unique-name.d/%s", files[i]);
+      unlink (name);
+    }
+  unlink ("test-unique-name.d/h");
+  unlink (u1);
+  rmdir ("test-unique-name.d");
+  unique_name_cleanup ();
+
+  mu_assert ("test_unique_name: gap",
+             !strcmp (u1, "test-unique-name.d/f.7"));
+  mu_assert ("test_unique_name: after the listed suffix",
+             !strcmp (u2, "test-unique-name.d/f.9"));
+  mu_assert ("test_unique_name: probed",
+             !strcmp (u3, "test-unique-name.d/g.1"));
+  mu_assert ("test_unique_name: made after the listing",
+             !strcmp (u4, "test-unique-name.d/h.1"));
+  xfree (u1);
+  xfree (u2);
+  xfree (u3);
+  xfree (u4);
+  return NULL;
+}
+#endif
+
+const char *
+test_write_file_at (void)
+{
+  char buf[16];
+  FILE *fp = tmpfile ();
+
+  if (!fp)
+    return NULL;
+
+  presize_file (fp, 12, false);
+  mu_assert ("test_write_file_at: tail",
+             write_file_at (fp, "world!", 6, 6));
+  mu_assert ("test_write_file_at: head",
+             write_file_at (fp, "hello ", 6, 0));
+  fseeko (fp, 0, SEEK_END);
+  mu_assert ("test_write_file_at: length", ftello (fp) == 12);
+  rewind (fp);
+  mu_assert ("test_write_file_at: contents",
+             fread (buf, 1, sizeof (buf), fp) == 12
+             && !memcmp (buf, "hello world!", 12));
+  fclose (fp);
+  return NULL;
+}
+
+#ifdef HAVE_SSL
+const char *
+test_cert_verify_cache (void)
+{
+  static const char leaf[] = "leaf certificate";
+  static const char other[] = "other certificate";
+  long result = -1;
+
+  mu_assert ("test_cert_verify_cache: empty",
+             !cert_verify_cache_get ("example.com", leaf, sizeof (leaf),
+                                     &result));
+
+  cert_verify_cache_put ("example.com", leaf, sizeof (leaf), 19);
+  mu_assert ("test_cert_verify_cache: hit",
+             cert_verify_cache_get ("EXAMPLE.com", leaf, sizeof (leaf),
+                                    &result) && result == 19);
+  mu_assert ("test_cert_verify_cache: other host",
+             !cert_verify_cache_get ("example.org", leaf, sizeof (leaf),
+                                     &result));
+  mu_assert ("test_cert_verify_cache: other certificate",
+             !cert_verify_cache_get ("example.com", other, sizeof (other),
+                                     &result));
+
+  cert_verify_cache_put ("example.com", leaf, sizeof (leaf), 0);
+  mu_assert ("test_cert_verify_cache: replaced",
+             cert_verify_cache_get ("example.com", leaf, sizeof (leaf),
+                                    &result) && result == 0);
+
+  cert_verify_cache_cleanup ();
+  mu_assert ("test_cert_verify_cache: cleanup",
+             !cert_verify_cache_get ("example.com", leaf, sizeof (leaf),
+                                     &result));
+  return NULL;
+}
+#endif
+
 #endif /* TESTING */
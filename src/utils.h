@@ -51,7 +51,11 @@ as that of the covered work.  */
 #define xnew_array(type, len) (xmalloc ((len) * sizeof (type)))
 #define xnew0_array(type, len) (xcalloc ((len), sizeof (type)))
 
-#define xfree(p) do { free ((void *) (p)); p = NULL; } while (0)
+#ifdef ENABLE_MEMACCT
+# define xfree(p) do { memacct_free ((void *) (p)); p = NULL; } while (0)
+#else
+# define xfree(p) do { free ((void *) (p)); p = NULL; } while (0)
+#endif
 
 struct hash_table;
 
@@ -90,9 +94,15 @@ wgint file_size (const char *);
 int make_directory (const char *);
 char *unique_name_passthrough (const char *);
 char *unique_name (const char *);
+void unique_name_cleanup (void);
 FILE *unique_create (const char *, bool, char **);
 FILE *fopen_excl (const char *, int);
 FILE *fopen_stat (const char *, const char *, file_stats_t *);
+FILE *temp_file (const char *);
+void fput_int (FILE *, int);
+void fput_string (FILE *, const char *);
+bool fget_int (FILE *, int *);
+bool fget_string (FILE *, char **);
 int   open_stat  (const char *, int, mode_t, file_stats_t *);
 char *file_merge (const char *, const char *);
 
@@ -100,6 +110,7 @@ int fnmatch_nocase (const char *, const char *, int);
 bool acceptable (const char *);
 bool accept_url (const char *);
 bool accdir (const char *s);
+void acclist_cleanup (void);
 char *suffix (const char *s);
 bool match_tail (const char *, const char *, bool);
 bool has_wildcards_p (const char *);
@@ -108,6 +119,9 @@ bool has_html_suffix_p (const char *);
 
 struct file_memory *wget_read_file (const char *);
 void wget_read_file_free (struct file_memory *);
+void preallocate_file (FILE *, wgint);
+void presize_file (FILE *, wgint, bool);
+bool write_file_at (FILE *, const char *, size_t, wgint);
 
 void free_vec (char **);
 char **merge_vecs (char **, char **);
@@ -177,4 +191,11 @@ extern unsigned char char_prop[];
 bool wg_pin_peer_pubkey (const char *pinnedpubkey, const char *pubkey, size_t pubkeylen);
 #endif
 
+#ifdef HAVE_SSL
+/* Certificate verification results, by host and leaf certificate. */
+bool cert_verify_cache_get (const char *, const void *, size_t, long *);
+void cert_verify_cache_put (const char *, const void *, size_t, long);
+void cert_verify_cache_cleanup (void);
+#endif
+
 #endif /* UTILS_H */
@@ -0,0 +1,436 @@
+/* Keeping the validators of retrieved files between runs.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "validators.h"
+#include "hash.h"
+#include "utils.h"
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+
+/* With --validators-file, the ETag and Last-Modified headers of the
+   files -N retrieves are kept in a text file, one URL per line:
+
+     <url> TAB <size> TAB <mtime> TAB <etag> TAB <last-modified>
+
+   where a missing header is written as "-".  The size and the
+   modification time are those of the local file once it was written
+   and time-stamped; the validators are only used while the file is
+   still in that state, so that a file changed or replaced since is
+   retrieved anew rather than declared up to date by a 304.
+
+   The changes are appended to the file as they are made, so that an
+   interrupted run doesn't lose them, and the last line of a URL wins.
+   A line holding only the URL drops the earlier ones.  The file is
+   rewritten with the live entries when it is closed, once the lines
+   superseded by later ones outnumber them.  */
+
+static struct hash_table *validators;
+static char *validators_file;
+static FILE *validators_fp;     /* opened for appending on the first change */
+static bool validators_failed;
+
+/* The lines read from the file or appended to it, and how many of them
+   hold an entry that is still live.  */
+static int validators_lines;
+static int validators_live;
+
+static void
+validator_free (struct validator *v)
+{
+  xfree (v->etag);
+  xfree (v->last_modified);
+  xfree (v);
+}
+
+/* Whether V is the mark of a URL whose validators were dropped.  */
+
+static bool
+validator_dropped_p (const struct validator *v)
+{
+  return !v->etag && !v->last_modified;
+}
+
+/* Make V the entry of URL, replacing the one it had.  */
+
+static void
+validator_store (const char *url, struct validator *v)
+{
+  char *key;
+  struct validator *old;
+
+  if (hash_table_get_pair (validators, url, &key, &old))
+    {
+      if (!validator_dropped_p (old))
+        --validators_live;
+      validator_free (old);
+      hash_table_put (validators, key, v);
+    }
+  else
+    hash_table_put (validators, xstrdup (url), v);
+  if (!validator_dropped_p (v))
+    ++validators_live;
+}
+
+static char *
+field_value (const char *field)
+{
+  if (!field || !strcmp (field, "-"))
+    return NULL;
+  return xstrdup (field);
+}
+
+/* Read the lines of FP into the table.  */
+
+static void
+validators_read (FILE *fp)
+{
+  char *line = NULL;
+  size_t len = 0;
+
+  while (getline (&line, &len, fp) > 0)
+    {
+      char *fields[5];
+      char *p = line;
+      struct validator *v;
+      int n;
+
+      p[strcspn (p, "\r\n")] = '\0';
+      if (!*p || *p == '#')
+        continue;
+      for (n = 0; n < countof (fields) && p; n++)
+        {
+          fields[n] = p;
+          p = strchr (p, '\t');
+          if (p)
+            *p++ = '\0';
+        }
+      ++validators_lines;
+
+      v = xnew0 (struct validator);
+      if (n == countof (fields))
+        {
+          v->size = str_to_wgint (fields[1], NULL, 10);
+          v->mtime = (time_t) strtoll (fields[2], NULL, 10);
+          v->etag = field_value (fields[3]);
+          v->last_modified = field_value (fields[4]);
+        }
+      validator_store (fields[0], v);
+    }
+
+  xfree (line);
+}
+
+/* Load the validators saved in FILE by previous runs, and record the
+   changes there.  */
+
+void
+validators_open (const char *file)
+{
+  FILE *fp;
+
+  validators = make_string_hash_table (0);
+  validators_file = xstrdup (file);
+
+  fp = fopen (file, "r");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        logprintf (LOG_NOTQUIET, _("Cannot read validators file %s: %s\n"),
+                   quote (file), strerror (errno));
+      return;
+    }
+
+  DEBUGP (("Reading the validators from %s.\n", file));
+  validators_read (fp);
+  fclose (fp);
+}
+
+/* Return the validators of URL if FILE is still as it was left when
+   they were recorded, NULL otherwise.  */
+
+const struct validator *
+validators_lookup (const char *url, const char *file)
+{
+  struct validator *v;
+  struct stat st;
+
+  if (!validators || !file)
+    return NULL;
+  v = hash_table_get (validators, url);
+  if (!v || validator_dropped_p (v))
+    return NULL;
+  if (stat (file, &st) != 0 || st.st_size != v->size
+      || st.st_mtime != v->mtime)
+    {
+      DEBUGP (("%s changed since its validators were recorded.\n", file));
+      return NULL;
+    }
+  return v;
+}
+
+/* Append the line of URL's entry V to the file.  */
+
+static void
+validators_append (const char *url, const struct validator *v)
+{
+  if (validators_failed)
+    return;
+  if (!validators_fp)
+    {
+      validators_fp = fopen (validators_file, "a");
+      if (!validators_fp)
+        {
+          logprintf (LOG_NOTQUIET, _("Cannot write validators file %s: %s\n"),
+                     quote (validators_file), strerror (errno));
+          validators_failed = true;
+          return;
+        }
+    }
+
+  /* Keep the line whole among those of concurrent runs.  */
+  flock (fileno (validators_fp), LOCK_EX);
+  if (validator_dropped_p (v))
+    fprintf (validators_fp, "%s\n", url);
+  else
+    fprintf (validators_fp, "%s\t%s\t%" PRId64 "\t%s\t%s\n", url,
+             number_to_static_string (v->size), (int64_t) v->mtime,
+             v->etag ? v->etag : "-",
+             v->last_modified ? v->last_modified : "-");
+  fflush (validators_fp);
+  flock (fileno (validators_fp), LOCK_UN);
+  ++validators_lines;
+}
+
+/* Whether S can be written as a field of a line.  */
+
+static bool
+field_valid_p (const char *s)
+{
+  return s && *s && strcmp (s, "-") && !strpbrk (s, "\t\r\n");
+}
+
+static bool
+strings_equal (const char *a, const char *b)
+{
+  return a == b || (a && b && !strcmp (a, b));
+}
+
+/* Record ETAG and LAST_MODIFIED, either of which may be NULL, as the
+   validators of URL, just retrieved to FILE.  With neither, the
+   validators recorded before are dropped.  */
+
+void
+validators_record (const char *url, const char *etag,
+                   const char *last_modified, const char *file)
+{
+  struct validator *old, *v;
+  struct stat st;
+
+  if (!validators)
+    return;
+  if (!field_valid_p (etag))
+    etag = NULL;
+  if (!field_valid_p (last_modified))
+    last_modified = NULL;
+
+  old = hash_table_get (validators, url);
+  v = xnew0 (struct validator);
+  if (etag || last_modified)
+    {
+      if (stat (file, &st) != 0)
+        {
+          xfree (v);
+          return;
+        }
+      v->etag = etag ? xstrdup (etag) : NULL;
+      v->last_modified = last_modified ? xstrdup (last_modified) : NULL;
+      v->size = st.st_size;
+      v->mtime = st.st_mtime;
+    }
+
+  if (old ? (strings_equal (old->etag, v->etag)
+             && strings_equal (old->last_modified, v->last_modified)
+             && old->size == v->size && old->mtime == v->mtime)
+      : validator_dropped_p (v))
+    {
+      validator_free (v);
+      return;
+    }
+
+  validators_append (url, v);
+  validator_store (url, v);
+}
+
+/* Rewrite the file with the live entries, those other runs have
+   appended included.  */
+
+static void
+validators_compact (void)
+{
+  hash_table_iterator iter;
+  FILE *fp = fopen (validators_file, "a+");
+
+  if (!fp)
+    return;
+  flock (fileno (fp), LOCK_EX);
+
+  /* The file holds the changes of this run, so it is all that needs
+     to be read.  */
+  for (hash_table_iterate (validators, &iter); hash_table_iter_next (&iter);)
+    {
+      xfree (iter.key);
+      validator_free (iter.value);
+    }
+  hash_table_clear (validators);
+  validators_lines = validators_live = 0;
+  fseek (fp, 0, SEEK_SET);
+  validators_read (fp);
+
+  fseek (fp, 0, SEEK_SET);
+  if (ftruncate (fileno (fp), 0) < 0)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot write validators file %s: %s\n"),
+                 quote (validators_file), strerror (errno));
+      fclose (fp);
+      return;
+    }
+
+  DEBUGP (("Rewriting the validators in %s.\n", validators_file));
+  fputs ("# Validators of the files retrieved by GNU Wget.\n", fp);
+  fputs ("# <url>\t<size>\t<mtime>\t<etag>\t<last-modified>\n", fp);
+  for (hash_table_iterate (validators, &iter); hash_table_iter_next (&iter);)
+    {
+      const struct validator *v = iter.value;
+
+      if (validator_dropped_p (v))
+        continue;
+      fprintf (fp, "%s\t%s\t%" PRId64 "\t%s\t%s\n", (const char *) iter.key,
+               number_to_static_string (v->size), (int64_t) v->mtime,
+               v->etag ? v->etag : "-",
+               v->last_modified ? v->last_modified : "-");
+    }
+
+  /* fclose unlocks the file.  */
+  if (fclose (fp) == EOF)
+    logprintf (LOG_NOTQUIET, _("Cannot write validators file %s: %s\n"),
+               quote (validators_file), strerror (errno));
+}
+
+/* Close the file, rewriting it first if it has grown mostly stale, and
+   free the table.  */
+
+void
+validators_close (void)
+{
+  hash_table_iterator iter;
+
+  if (!validators)
+    return;
+  if (validators_fp)
+    {
+      fclose (validators_fp);
+      validators_fp = NULL;
+      if (validators_lines > 2 * validators_live + 64)
+        validators_compact ();
+    }
+
+  for (hash_table_iterate (validators, &iter); hash_table_iter_next (&iter);)
+    {
+      xfree (iter.key);
+      validator_free (iter.value);
+    }
+  hash_table_destroy (validators);
+  validators = NULL;
+  xfree (validators_file);
+  validators_lines = validators_live = 0;
+  validators_failed = false;
+}
+
+#ifdef TESTING
+
+const char *
+test_validators_read (void)
+{
+  const struct validator *v;
+  FILE *fp = tmpfile ();
+
+  if (!fp)
+    return NULL;
+
+  fputs ("# comment\n\n", fp);
+  fputs ("http://a.example/\t10\t1000\t\"x1\"\t-\n", fp);
+  fputs ("http://b.example/\t20\t2000\t-\tThu, 01 Jan 2015 00:00:00 GMT\n", fp);
+  fputs ("http://a.example/\t11\t1001\t\"x2\"\t-\n", fp);
+  fputs ("http://c.example/\t30\t3000\t\"y\"\t-\n", fp);
+  fputs ("http://c.example/\n", fp);
+  rewind (fp);
+
+  validators = make_string_hash_table (0);
+  validators_read (fp);
+  fclose (fp);
+
+  mu_assert ("test_validators_read: line count", validators_lines == 5);
+  mu_assert ("test_validators_read: live count", validators_live == 2);
+
+  v = hash_table_get (validators, "http://a.example/");
+  mu_assert ("test_validators_read: later line wins",
+             v && v->size == 11 && v->mtime == 1001
+             && !strcmp (v->etag, "\"x2\"") && !v->last_modified);
+
+  v = hash_table_get (validators, "http://b.example/");
+  mu_assert ("test_validators_read: Last-Modified only",
+             v && !v->etag
+             && !strcmp (v->last_modified, "Thu, 01 Jan 2015 00:00:00 GMT"));
+
+  v = hash_table_get (validators, "http://c.example/");
+  mu_assert ("test_validators_read: dropped entry",
+             v && validator_dropped_p (v));
+  mu_assert ("test_validators_read: lookup of dropped entry",
+             !validators_lookup ("http://c.example/", "."));
+
+  validators_close ();
+  return NULL;
+}
+
+#endif /* TESTING */
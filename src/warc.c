@@ -34,11 +34,14 @@ as that of the covered work.  */
 #include "version.h"
 #include "dirname.h"
 #include "url.h"
+#include "retr.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include <tmpdir.h>
 # ifdef HAVE_WINHASHES
 # include "win-hashes.h"
@@ -50,6 +53,14 @@ as that of the covered work.  */
 #ifdef HAVE_LIBZ
 #include <zlib.h>
 #endif
+#ifdef HAVE_LIBZSTD
+# include <zstd.h>
+# include <zdict.h>
+#endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+# include "nproc.h"
+#endif
 
 #ifdef HAVE_LIBUUID
 #include <uuid/uuid.h>
@@ -114,19 +125,70 @@ static char *warc_current_filename;
    WARC file's filename. */
 static int warc_current_file_number;
 
-/* The table of CDX records, if deduplication is enabled. */
-static struct hash_table * warc_cdx_dedup_table;
-
 static bool warc_start_new_file (bool meta);
 
+#ifdef HAVE_PTHREAD
+/* The writer thread (see warc_writer_main) quotes file names in a slot
+   of its own, which the main thread allocates in warc_writer_start, so
+   that they never race with the quote() calls of the main thread.  */
+# define WARC_QUOTE_SLOT 3
+# define warc_quote(s) quote_n (WARC_QUOTE_SLOT, (s))
+#else
+# define warc_quote(s) quote (s)
+#endif
+
 
-struct warc_cdx_record
+/* The deduplication index: the records of the CDX file sorted by
+   payload digest.  Each entry points at the url of the record in the
+   string blob, which is followed by its record id.  The index is saved
+   next to the CDX file, in the byte order of the host, so that later
+   crawls only have to map it.  */
+struct warc_cdx_entry
 {
-  char *url;
-  char *uuid;
   char digest[SHA1_DIGEST_SIZE];
+  char unused[4];
+  uint64_t strings;
+};
+
+struct warc_cdx_index_header
+{
+  char magic[8];
+  /* The size and modification time of the CDX file it was built from. */
+  uint64_t cdx_size;
+  int64_t cdx_mtime;
+  uint64_t count;
+  uint64_t strings_size;
 };
 
+#define WARC_CDX_INDEX_MAGIC "WgetCDX1"
+
+struct warc_cdx_index
+{
+  const struct warc_cdx_entry *entries;
+  size_t count;
+  const char *strings;
+  size_t strings_size;
+  /* The mapped index file, or NULL if the index was built in memory.  */
+  struct file_memory *fm;
+};
+
+/* The deduplication index (or NULL, if deduplication is disabled). */
+static struct warc_cdx_index *warc_cdx_dedup_index;
+
+/* The payloads archived so far in this crawl, with --warc-dedup-crawl:
+   the digest of each and the id of its response record, packed.  */
+struct warc_crawl_record
+{
+  char digest[SHA1_DIGEST_SIZE];
+  unsigned char uuid[16];
+};
+
+static struct hash_table *warc_crawl_dedup_table;
+
+/* Smaller payloads are archived again: a revisit record would not be
+   any smaller.  */
+#define WARC_CRAWL_DEDUP_MIN_SIZE 1024
+
 static unsigned long
 warc_hash_sha1_digest (const void *key)
 {
@@ -143,6 +205,716 @@ warc_cmp_sha1_digest (const void *digest1, const void *digest2)
 }
 
 
+#define EXTRA_GZIP_HEADER_SIZE 14
+#define GZIP_STATIC_HEADER_SIZE  10
+#define FLG_FEXTRA          0x04
+#define OFF_FLG             3
+
+/* Fill EXTRA_HEADER, the extra GZIP header field of a record, with the
+   size of the gzip member and that of the uncompressed record.  */
+static void
+warc_gzip_extra_header (char *extra_header, off_t member_size,
+                        off_t uncompressed_size)
+{
+  /* XLEN, the length of the extra header fields.  */
+  extra_header[0]  = ((EXTRA_GZIP_HEADER_SIZE - 2) & 255);
+  extra_header[1]  = ((EXTRA_GZIP_HEADER_SIZE - 2) >> 8) & 255;
+  /* The extra header field identifier for the WARC skip length. */
+  extra_header[2]  = 's';
+  extra_header[3]  = 'l';
+  /* The size of the field value (8 bytes).  */
+  extra_header[4]  = (8 & 255);
+  extra_header[5]  = ((8 >> 8) & 255);
+  /* The size of the gzip member.  */
+  extra_header[6]  = (member_size & 255);
+  extra_header[7]  = (member_size >> 8) & 255;
+  extra_header[8]  = (member_size >> 16) & 255;
+  extra_header[9]  = (member_size >> 24) & 255;
+  /* The size of the uncompressed record.  */
+  extra_header[10] = (uncompressed_size & 255);
+  extra_header[11] = (uncompressed_size >> 8) & 255;
+  extra_header[12] = (uncompressed_size >> 16) & 255;
+  extra_header[13] = (uncompressed_size >> 24) & 255;
+}
+
+#if defined HAVE_LIBZ && defined HAVE_PTHREAD
+/* Compressing the records in parallel.
+
+   Each record is still a gzip member of its own, but instead of going
+   through gzwrite, it is collected in chunks of WARC_GZ_CHUNK_SIZE
+   bytes that the threads of a pool deflate independently, each primed
+   with the data that precedes it as in pigz.  All chunks but the last
+   of a record end with a sync flush, so that their output is simply
+   concatenated.  The main thread writes the chunks out in order as
+   they are done, with the gzip header before the first chunk of a
+   record and the trailer after the last.  The offset of a record in
+   the WARC file is only known once it is written, so its CDX line is
+   held until then.  */
+
+#define WARC_GZ_CHUNK_SIZE (1024 * 1024)
+
+/* The deflate window, i.e. how much of the preceding data a chunk
+   may refer to.  */
+#define WARC_GZ_WINDOW 32768
+
+struct warc_gz_chunk
+{
+  char *in;                     /* the uncompressed data */
+  size_t in_len;
+  char *dict;                   /* the data before IN in the record */
+  size_t dict_len;
+  bool first, last;             /* whether IN starts or ends a record */
+
+  unsigned char *out;           /* the deflated data */
+  size_t out_len;
+  uLong crc;                    /* the CRC-32 of IN */
+  bool done, failed;
+
+  char *cdx_head, *cdx_tail;    /* the CDX line, but for the offset */
+  struct warc_gz_chunk *next;
+};
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t work;          /* a chunk was queued, or stopping */
+  pthread_cond_t done;          /* a chunk was compressed */
+  pthread_t *threads;
+  int thread_count;             /* 0 if records are compressed by gzwrite */
+  bool started, stopping;
+
+  /* The chunks not written yet, in order, and the first of them not
+     taken by a thread yet.  */
+  struct warc_gz_chunk *head, *tail, *next_todo;
+  int pending;
+} warc_gz_pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER
+};
+
+/* The record being collected by the main thread: the chunk being
+   filled, and the last WARC_GZ_WINDOW bytes before it.  */
+static bool warc_gz_collecting;
+static bool warc_gz_record_first;
+static char *warc_gz_buf;
+static size_t warc_gz_buf_len;
+static char warc_gz_window[WARC_GZ_WINDOW];
+static size_t warc_gz_window_len;
+
+/* The last chunk of the record last collected, until it is written.  */
+static struct warc_gz_chunk *warc_gz_last_record;
+
+/* The member being written: where it starts, and the CRC-32 and size
+   of its data so far.  */
+static off_t warc_gz_member_offset;
+static uLong warc_gz_member_crc;
+static off_t warc_gz_member_size;
+
+/* Deflate chunk C.  */
+static void
+warc_gz_compress (struct warc_gz_chunk *c)
+{
+  z_stream z;
+  size_t size;
+  int ret;
+
+  xzero (z);
+  if (deflateInit2 (&z, 9, Z_DEFLATED, -MAX_WBITS, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      c->failed = true;
+      return;
+    }
+  if (c->dict_len)
+    deflateSetDictionary (&z, (Bytef *) c->dict, c->dict_len);
+
+  /* Room for the sync flush marker, besides what deflateBound
+     allows for.  */
+  size = deflateBound (&z, c->in_len) + 16;
+  c->out = xmalloc (size);
+  z.next_in = (Bytef *) c->in;
+  z.avail_in = c->in_len;
+  for (;;)
+    {
+      z.next_out = c->out + c->out_len;
+      z.avail_out = size - c->out_len;
+      ret = deflate (&z, c->last ? Z_FINISH : Z_SYNC_FLUSH);
+      c->out_len = size - z.avail_out;
+      if (ret == Z_STREAM_END || (!c->last && ret == Z_OK && z.avail_out))
+        break;
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+          c->failed = true;
+          break;
+        }
+      size *= 2;
+      c->out = xrealloc (c->out, size);
+    }
+  deflateEnd (&z);
+  c->crc = crc32 (0L, (Bytef *) c->in, c->in_len);
+}
+
+static void *
+warc_gz_worker (void *arg _GL_UNUSED)
+{
+  for (;;)
+    {
+      struct warc_gz_chunk *c;
+
+      pthread_mutex_lock (&warc_gz_pool.lock);
+      while (!warc_gz_pool.next_todo && !warc_gz_pool.stopping)
+        pthread_cond_wait (&warc_gz_pool.work, &warc_gz_pool.lock);
+      c = warc_gz_pool.next_todo;
+      if (c)
+        warc_gz_pool.next_todo = c->next;
+      pthread_mutex_unlock (&warc_gz_pool.lock);
+      if (!c)
+        break;
+
+      warc_gz_compress (c);
+
+      pthread_mutex_lock (&warc_gz_pool.lock);
+      c->done = true;
+      pthread_cond_broadcast (&warc_gz_pool.done);
+      pthread_mutex_unlock (&warc_gz_pool.lock);
+    }
+  return NULL;
+}
+
+/* Start the threads that compress the records, unless one thread is
+   enough.  Returns whether records are compressed in parallel.  */
+static bool
+warc_gz_pool_start (void)
+{
+  int threads = opt.warc_compression_threads;
+  int i;
+
+  if (warc_gz_pool.started)
+    return warc_gz_pool.thread_count > 0;
+  warc_gz_pool.started = true;
+
+  if (!threads)
+    threads = num_processors (NPROC_CURRENT);
+  if (threads <= 1)
+    return false;
+
+  warc_gz_pool.threads = xnew_array (pthread_t, threads);
+  for (i = 0; i < threads; i++)
+    if (pthread_create (&warc_gz_pool.threads[i], NULL, warc_gz_worker,
+                        NULL) != 0)
+      break;
+  warc_gz_pool.thread_count = i;
+  DEBUGP (("Compressing WARC records in %d threads.\n", i));
+  return i > 0;
+}
+
+/* Write C, a compressed chunk, to the WARC file and free it.  */
+static void
+warc_gz_write_chunk (struct warc_gz_chunk *c)
+{
+  if (c->failed)
+    {
+      logprintf (LOG_NOTQUIET, _("Error compressing WARC record.\n"));
+      warc_write_ok = false;
+    }
+
+  if (warc_write_ok && c->first)
+    {
+      /* The header of a gzip member, with room for the extra field.  */
+      static const char header[GZIP_STATIC_HEADER_SIZE
+                               + EXTRA_GZIP_HEADER_SIZE] = {
+        0x1f, 0x8b, Z_DEFLATED, FLG_FEXTRA, 0, 0, 0, 0, 2, (char) 255
+      };
+
+      fseeko (warc_current_file, 0L, SEEK_END);
+      warc_gz_member_offset = ftello (warc_current_file);
+      warc_gz_member_crc = crc32 (0L, Z_NULL, 0);
+      warc_gz_member_size = 0;
+      if (fwrite (header, 1, sizeof (header), warc_current_file)
+          != sizeof (header))
+        warc_write_ok = false;
+    }
+
+  if (warc_write_ok
+      && fwrite (c->out, 1, c->out_len, warc_current_file) != c->out_len)
+    warc_write_ok = false;
+  warc_gz_member_crc = crc32_combine (warc_gz_member_crc, c->crc,
+                                      c->in_len);
+  warc_gz_member_size += c->in_len;
+
+  if (warc_write_ok && c->last)
+    {
+      unsigned char trailer[8];
+      char extra_header[EXTRA_GZIP_HEADER_SIZE];
+      off_t end;
+      int i;
+
+      for (i = 0; i < 4; i++)
+        {
+          trailer[i] = (warc_gz_member_crc >> (8 * i)) & 255;
+          trailer[4 + i] = (warc_gz_member_size >> (8 * i)) & 255;
+        }
+      if (fwrite (trailer, 1, sizeof (trailer), warc_current_file)
+          != sizeof (trailer))
+        warc_write_ok = false;
+
+      end = ftello (warc_current_file);
+      warc_gzip_extra_header (extra_header, end - warc_gz_member_offset,
+                              warc_gz_member_size);
+      if (fseeko (warc_current_file,
+                  warc_gz_member_offset + GZIP_STATIC_HEADER_SIZE,
+                  SEEK_SET) != 0
+          || fwrite (extra_header, 1, EXTRA_GZIP_HEADER_SIZE,
+                     warc_current_file) != EXTRA_GZIP_HEADER_SIZE)
+        warc_write_ok = false;
+      fseeko (warc_current_file, 0L, SEEK_END);
+
+      if (warc_write_ok && c->cdx_head)
+        {
+          char offset_string[MAX_INT_TO_STRING_LEN(off_t)];
+
+          number_to_string (offset_string, warc_gz_member_offset);
+          fprintf (warc_current_cdx_file, "%s%s%s", c->cdx_head,
+                   offset_string, c->cdx_tail);
+          fflush (warc_current_cdx_file);
+        }
+    }
+
+  if (c == warc_gz_last_record)
+    warc_gz_last_record = NULL;
+  xfree (c->in);
+  xfree (c->dict);
+  xfree (c->out);
+  xfree (c->cdx_head);
+  xfree (c->cdx_tail);
+  xfree (c);
+}
+
+/* Write the chunks that are done, in order.  If WAIT_FOR is non-zero,
+   first wait until no more than that many chunks are pending; if it
+   is negative, until all of them are written.  */
+static void
+warc_gz_write_done (int wait_for)
+{
+  pthread_mutex_lock (&warc_gz_pool.lock);
+  for (;;)
+    {
+      struct warc_gz_chunk *c = warc_gz_pool.head;
+
+      if (!c)
+        break;
+      if (!c->done)
+        {
+          if (wait_for < 0 || (wait_for > 0
+                               && warc_gz_pool.pending > wait_for))
+            {
+              pthread_cond_wait (&warc_gz_pool.done, &warc_gz_pool.lock);
+              continue;
+            }
+          break;
+        }
+      warc_gz_pool.head = c->next;
+      if (!warc_gz_pool.head)
+        warc_gz_pool.tail = NULL;
+      --warc_gz_pool.pending;
+      pthread_mutex_unlock (&warc_gz_pool.lock);
+      warc_gz_write_chunk (c);
+      pthread_mutex_lock (&warc_gz_pool.lock);
+    }
+  pthread_mutex_unlock (&warc_gz_pool.lock);
+}
+
+/* Hand the chunk collected so far to the threads.  */
+static void
+warc_gz_submit (bool last)
+{
+  struct warc_gz_chunk *c = xnew0 (struct warc_gz_chunk);
+
+  c->in = warc_gz_buf;
+  c->in_len = warc_gz_buf_len;
+  c->first = warc_gz_record_first;
+  c->last = last;
+  if (warc_gz_window_len)
+    {
+      c->dict = xmemdup (warc_gz_window, warc_gz_window_len);
+      c->dict_len = warc_gz_window_len;
+    }
+  warc_gz_buf = NULL;
+  warc_gz_buf_len = 0;
+  warc_gz_record_first = false;
+
+  /* Keep the end of the data for priming the next chunk.  */
+  if (c->in_len >= WARC_GZ_WINDOW)
+    memcpy (warc_gz_window, c->in + c->in_len - WARC_GZ_WINDOW,
+            WARC_GZ_WINDOW);
+  else
+    {
+      size_t keep = MIN (warc_gz_window_len, WARC_GZ_WINDOW - c->in_len);
+      memmove (warc_gz_window, warc_gz_window + warc_gz_window_len - keep,
+               keep);
+      memcpy (warc_gz_window + keep, c->in, c->in_len);
+    }
+  warc_gz_window_len = MIN (warc_gz_window_len + c->in_len, WARC_GZ_WINDOW);
+
+  if (last)
+    warc_gz_last_record = c;
+
+  pthread_mutex_lock (&warc_gz_pool.lock);
+  if (warc_gz_pool.tail)
+    warc_gz_pool.tail->next = c;
+  else
+    warc_gz_pool.head = c;
+  warc_gz_pool.tail = c;
+  if (!warc_gz_pool.next_todo)
+    warc_gz_pool.next_todo = c;
+  ++warc_gz_pool.pending;
+  pthread_cond_signal (&warc_gz_pool.work);
+  pthread_mutex_unlock (&warc_gz_pool.lock);
+
+  /* Bound the memory held by the chunks in flight.  */
+  warc_gz_write_done (2 * warc_gz_pool.thread_count);
+}
+
+/* Add SIZE bytes from BUFFER to the record being collected.  */
+static void
+warc_gz_collect (const char *buffer, size_t size)
+{
+  while (size)
+    {
+      size_t n = MIN (size, WARC_GZ_CHUNK_SIZE - warc_gz_buf_len);
+
+      if (!warc_gz_buf)
+        warc_gz_buf = xmalloc (WARC_GZ_CHUNK_SIZE);
+      memcpy (warc_gz_buf + warc_gz_buf_len, buffer, n);
+      warc_gz_buf_len += n;
+      buffer += n;
+      size -= n;
+      if (warc_gz_buf_len == WARC_GZ_CHUNK_SIZE)
+        warc_gz_submit (false);
+    }
+}
+
+/* Write out all the records collected, and stop the threads if STOP.  */
+static void
+warc_gz_flush (bool stop)
+{
+  int i;
+
+  if (!warc_gz_pool.thread_count)
+    return;
+  warc_gz_write_done (-1);
+  if (!stop)
+    return;
+
+  pthread_mutex_lock (&warc_gz_pool.lock);
+  warc_gz_pool.stopping = true;
+  pthread_cond_broadcast (&warc_gz_pool.work);
+  pthread_mutex_unlock (&warc_gz_pool.lock);
+  for (i = 0; i < warc_gz_pool.thread_count; i++)
+    pthread_join (warc_gz_pool.threads[i], NULL);
+  xfree (warc_gz_pool.threads);
+  warc_gz_pool.thread_count = 0;
+  warc_gz_pool.stopping = false;
+  warc_gz_pool.started = false;
+}
+#else /* not (HAVE_LIBZ && HAVE_PTHREAD) */
+# define warc_gz_flush(stop) do { } while (0)
+#endif /* not (HAVE_LIBZ && HAVE_PTHREAD) */
+
+#ifdef HAVE_LIBZSTD
+/* With --warc-compression=zstd every record is a zstd frame of its
+   own, compressed with a dictionary that is stored at the start of
+   each WARC file, in a skippable frame, so that readers find it
+   before the first record.  Unless --warc-zstd-dictionary names one,
+   the dictionary is trained on the first records of the crawl, which
+   are held in memory until there are enough of them.  */
+
+/* The magic number of the skippable frame holding the dictionary.  */
+#define WARC_ZSTD_DICT_MAGIC 0x184D2A5D
+
+/* The size of a trained dictionary.  */
+#define WARC_ZSTD_DICT_SIZE (110 * 1024)
+
+/* How many bytes, and how many records, are held for training at
+   most.  A record larger than WARC_ZSTD_SAMPLE_MAX ends the training
+   early, as the records after it would wait for too long.  */
+#define WARC_ZSTD_TRAIN_SIZE (1024 * 1024)
+#define WARC_ZSTD_TRAIN_RECORDS 200
+#define WARC_ZSTD_SAMPLE_MAX (64 * 1024)
+
+/* A record held until the dictionary is trained, with its CDX line
+   less the offset.  */
+struct warc_zstd_record
+{
+  char *data;
+  size_t len;
+  size_t size;
+  char *cdx_head;
+  char *cdx_tail;
+  struct warc_zstd_record *next;
+};
+
+/* The compression context (or NULL, if zstd is not used).  */
+static ZSTD_CCtx *warc_zstd_cctx;
+
+/* The dictionary, raw and digested (or NULL, if there is none).  */
+static void *warc_zstd_dict;
+static size_t warc_zstd_dict_len;
+static ZSTD_CDict *warc_zstd_cdict;
+
+/* This is true while the records are held for training.  */
+static bool warc_zstd_training;
+
+/* The records held so far, and the one being held.  */
+static struct warc_zstd_record *warc_zstd_held;
+static struct warc_zstd_record *warc_zstd_held_tail;
+static size_t warc_zstd_held_size;
+static int warc_zstd_held_count;
+static struct warc_zstd_record *warc_zstd_current;
+
+/* The offset of the frame last started in the WARC file.  */
+static off_t warc_zstd_frame_offset;
+
+/* The output buffer of the compressor.  */
+static char *warc_zstd_out;
+static size_t warc_zstd_out_size;
+
+/* Makes the LEN bytes at DICT, which are then owned by the writer,
+   the dictionary of the records.  */
+static bool
+warc_zstd_set_dict (void *dict, size_t len)
+{
+  warc_zstd_cdict = ZSTD_createCDict (dict, len, ZSTD_CLEVEL_DEFAULT);
+  if (warc_zstd_cdict == NULL)
+    {
+      xfree (dict);
+      return false;
+    }
+  warc_zstd_dict = dict;
+  warc_zstd_dict_len = len;
+  return true;
+}
+
+/* Sets up zstd compression.  Returns false if the dictionary named
+   by --warc-zstd-dictionary cannot be used.  */
+static bool
+warc_zstd_init (void)
+{
+  warc_zstd_cctx = ZSTD_createCCtx ();
+  if (warc_zstd_cctx == NULL)
+    return false;
+  ZSTD_CCtx_setParameter (warc_zstd_cctx, ZSTD_c_compressionLevel,
+                          ZSTD_CLEVEL_DEFAULT);
+  ZSTD_CCtx_setParameter (warc_zstd_cctx, ZSTD_c_checksumFlag, 1);
+
+  warc_zstd_out_size = ZSTD_CStreamOutSize ();
+  warc_zstd_out = xmalloc (warc_zstd_out_size);
+
+  if (opt.warc_zstd_dictionary)
+    {
+      struct file_memory *fm = wget_read_file (opt.warc_zstd_dictionary);
+      void *dict;
+
+      if (fm == NULL || fm->length == 0)
+        {
+          logprintf (LOG_NOTQUIET, _("Could not read zstd dictionary %s.\n"),
+                     quote (opt.warc_zstd_dictionary));
+          if (fm)
+            wget_read_file_free (fm);
+          return false;
+        }
+      dict = xmemdup (fm->content, fm->length);
+      if (!warc_zstd_set_dict (dict, fm->length))
+        {
+          logprintf (LOG_NOTQUIET, _("Invalid zstd dictionary %s.\n"),
+                     quote (opt.warc_zstd_dictionary));
+          wget_read_file_free (fm);
+          return false;
+        }
+      wget_read_file_free (fm);
+    }
+  else
+    warc_zstd_training = true;
+  return true;
+}
+
+/* Compresses SIZE bytes from BUFFER into the current frame; with
+   ZSTD_e_end, the frame is finished.  Returns false on error.  */
+static bool
+warc_zstd_compress (const char *buffer, size_t size, ZSTD_EndDirective end)
+{
+  ZSTD_inBuffer in = { buffer, size, 0 };
+  size_t left;
+
+  do
+    {
+      ZSTD_outBuffer out = { warc_zstd_out, warc_zstd_out_size, 0 };
+
+      left = ZSTD_compressStream2 (warc_zstd_cctx, &out, &in, end);
+      if (ZSTD_isError (left))
+        {
+          logprintf (LOG_NOTQUIET, _("Error compressing WARC record: %s.\n"),
+                     ZSTD_getErrorName (left));
+          return false;
+        }
+      if (fwrite (warc_zstd_out, 1, out.pos, warc_current_file) != out.pos)
+        return false;
+    }
+  while (end == ZSTD_e_end ? left != 0 : in.pos < in.size);
+  return true;
+}
+
+/* Starts a new frame at the end of the current WARC file.  */
+static void
+warc_zstd_frame_start (void)
+{
+  ZSTD_CCtx_reset (warc_zstd_cctx, ZSTD_reset_session_only);
+  ZSTD_CCtx_refCDict (warc_zstd_cctx, warc_zstd_cdict);
+  warc_zstd_frame_offset = ftello (warc_current_file);
+}
+
+/* Writes the dictionary, if there is one, to the current WARC file.  */
+static bool
+warc_zstd_write_dict (void)
+{
+  unsigned char header[8];
+  uint32_t magic = WARC_ZSTD_DICT_MAGIC;
+  uint32_t len = warc_zstd_dict_len;
+  int i;
+
+  if (warc_zstd_dict == NULL)
+    return true;
+
+  /* Both fields are little-endian.  */
+  for (i = 0; i < 4; i++)
+    {
+      header[i] = (magic >> (8 * i)) & 0xff;
+      header[4 + i] = (len >> (8 * i)) & 0xff;
+    }
+  return fwrite (header, 1, sizeof header, warc_current_file) == sizeof header
+    && fwrite (warc_zstd_dict, 1, len, warc_current_file) == len;
+}
+
+/* Adds SIZE bytes from BUFFER to the record being held.  */
+static void
+warc_zstd_hold (const char *buffer, size_t size)
+{
+  struct warc_zstd_record *r = warc_zstd_current;
+
+  if (r->len + size > r->size)
+    {
+      r->size = MAX (r->size * 2, r->len + size);
+      r->data = xrealloc (r->data, r->size);
+    }
+  memcpy (r->data + r->len, buffer, size);
+  r->len += size;
+}
+
+/* Trains the dictionary on the records held so far, which are then
+   written to the current WARC file after it, with their CDX lines.
+   The record being held, if there is one, goes on as the frame being
+   written.  If the training fails, the records are compressed
+   without a dictionary.  */
+static void
+warc_zstd_train (void)
+{
+  struct warc_zstd_record *r, *next;
+  size_t count = warc_zstd_held_count, total = warc_zstd_held_size;
+  size_t *sizes;
+  char *samples, *p;
+  void *dict;
+  size_t dict_len;
+  int i = 0;
+
+  if (warc_zstd_current)
+    {
+      count++;
+      total += warc_zstd_current->len;
+    }
+
+  samples = p = xmalloc (total + 1);
+  sizes = xnew_array (size_t, count + 1);
+  for (r = warc_zstd_held; r; r = r->next)
+    {
+      memcpy (p, r->data, r->len);
+      p += r->len;
+      sizes[i++] = r->len;
+    }
+  if (warc_zstd_current)
+    {
+      memcpy (p, warc_zstd_current->data, warc_zstd_current->len);
+      sizes[i++] = warc_zstd_current->len;
+    }
+
+  dict = xmalloc (WARC_ZSTD_DICT_SIZE);
+  dict_len = ZDICT_trainFromBuffer (dict, WARC_ZSTD_DICT_SIZE, samples,
+                                    sizes, count);
+  if (ZDICT_isError (dict_len))
+    {
+      DEBUGP (("Could not train a zstd dictionary: %s\n",
+               ZDICT_getErrorName (dict_len)));
+      xfree (dict);
+    }
+  else
+    warc_zstd_set_dict (xrealloc (dict, dict_len), dict_len);
+  xfree (samples);
+  xfree (sizes);
+
+  warc_zstd_training = false;
+  if (warc_write_ok && !warc_zstd_write_dict ())
+    warc_write_ok = false;
+
+  for (r = warc_zstd_held; r; r = next)
+    {
+      next = r->next;
+      if (warc_write_ok)
+        {
+          warc_zstd_frame_start ();
+          if (!warc_zstd_compress (r->data, r->len, ZSTD_e_end))
+            warc_write_ok = false;
+        }
+      if (r->cdx_head)
+        {
+          char offset_string[MAX_INT_TO_STRING_LEN(off_t)];
+
+          number_to_string (offset_string, warc_zstd_frame_offset);
+          fprintf (warc_current_cdx_file, "%s%s%s", r->cdx_head,
+                   offset_string, r->cdx_tail);
+          fflush (warc_current_cdx_file);
+          xfree (r->cdx_head);
+          xfree (r->cdx_tail);
+        }
+      xfree (r->data);
+      xfree (r);
+    }
+  warc_zstd_held = warc_zstd_held_tail = NULL;
+  warc_zstd_held_size = 0;
+  warc_zstd_held_count = 0;
+
+  if (warc_zstd_current)
+    {
+      warc_zstd_frame_start ();
+      if (warc_write_ok
+          && !warc_zstd_compress (warc_zstd_current->data,
+                                  warc_zstd_current->len, ZSTD_e_continue))
+        warc_write_ok = false;
+      xfree (warc_zstd_current->data);
+      xfree (warc_zstd_current);
+    }
+}
+
+/* Frees the compressor.  */
+static void
+warc_zstd_cleanup (void)
+{
+  ZSTD_freeCCtx (warc_zstd_cctx);
+  ZSTD_freeCDict (warc_zstd_cdict);
+  warc_zstd_cctx = NULL;
+  warc_zstd_cdict = NULL;
+  xfree (warc_zstd_dict);
+  xfree (warc_zstd_out);
+}
+#endif /* HAVE_LIBZSTD */
 
 /* Writes SIZE bytes from BUFFER to the current WARC file,
    through gzwrite if compression is enabled.
@@ -150,6 +922,24 @@ warc_cmp_sha1_digest (const void *digest1, const void *digest2)
 static size_t
 warc_write_buffer (const char *buffer, size_t size)
 {
+#if defined HAVE_LIBZ && defined HAVE_PTHREAD
+  if (warc_gz_collecting)
+    {
+      warc_gz_collect (buffer, size);
+      return size;
+    }
+#endif
+#ifdef HAVE_LIBZSTD
+  if (warc_zstd_current)
+    {
+      warc_zstd_hold (buffer, size);
+      if (warc_zstd_current->len > WARC_ZSTD_SAMPLE_MAX)
+        warc_zstd_train ();
+      return size;
+    }
+  if (warc_zstd_cctx)
+    return warc_zstd_compress (buffer, size, ZSTD_e_continue) ? size : 0;
+#endif
 #ifdef HAVE_LIBZ
   if (warc_current_gzfile)
     {
@@ -180,11 +970,6 @@ warc_write_string (const char *str)
 }
 
 
-#define EXTRA_GZIP_HEADER_SIZE 14
-#define GZIP_STATIC_HEADER_SIZE  10
-#define FLG_FEXTRA          0x04
-#define OFF_FLG             3
-
 /* Starts a new WARC record.  Writes the version header.
    If opt.warc_maxsize is set and the current file is becoming
    too large, this will open a new WARC file.
@@ -200,13 +985,40 @@ warc_write_start_record (void)
   if (!warc_write_ok)
     return false;
 
+  if (opt.warc_maxsize > 0)
+    warc_gz_flush (false);
   fflush (warc_current_file);
   if (opt.warc_maxsize > 0 && ftello (warc_current_file) >= opt.warc_maxsize)
     warc_start_new_file (false);
 
+#ifdef HAVE_LIBZSTD
+  if (warc_zstd_cctx)
+    {
+      /* Do not hold more than fits in one file.  */
+      if (warc_zstd_training && opt.warc_maxsize > 0
+          && warc_zstd_held_size >= opt.warc_maxsize)
+        warc_zstd_train ();
+      if (warc_zstd_training)
+        warc_zstd_current = xnew0 (struct warc_zstd_record);
+      else
+        warc_zstd_frame_start ();
+    }
+#endif
+
+#if defined HAVE_LIBZ && defined HAVE_PTHREAD
+  /* Collect the record for the threads to compress, if there are.  */
+  if (opt.warc_compression_enabled && !opt.warc_compression_zstd
+      && warc_gz_pool_start ())
+    {
+      warc_gz_collecting = true;
+      warc_gz_record_first = true;
+      warc_gz_window_len = 0;
+    }
+  else
+#endif
 #ifdef HAVE_LIBZ
   /* Start a GZIP stream, if required. */
-  if (opt.warc_compression_enabled)
+  if (opt.warc_compression_enabled && !opt.warc_compression_zstd)
     {
       int dup_fd;
       /* Record the starting offset of the new record. */
@@ -337,6 +1149,40 @@ warc_write_end_record (void)
       return false;
     }
 
+#if defined HAVE_LIBZ && defined HAVE_PTHREAD
+  if (warc_gz_collecting)
+    {
+      warc_gz_collecting = false;
+      warc_gz_submit (true);
+      return warc_write_ok;
+    }
+#endif
+
+#ifdef HAVE_LIBZSTD
+  if (warc_zstd_current)
+    {
+      if (warc_zstd_held_tail)
+        warc_zstd_held_tail->next = warc_zstd_current;
+      else
+        warc_zstd_held = warc_zstd_current;
+      warc_zstd_held_tail = warc_zstd_current;
+      warc_zstd_held_size += warc_zstd_current->len;
+      warc_zstd_held_count++;
+      warc_zstd_current = NULL;
+      if (warc_zstd_held_size >= WARC_ZSTD_TRAIN_SIZE
+          || warc_zstd_held_count >= WARC_ZSTD_TRAIN_RECORDS)
+        warc_zstd_train ();
+      return warc_write_ok;
+    }
+  /* Each record is a frame of its own.  */
+  if (warc_zstd_cctx)
+    {
+      if (warc_write_ok && !warc_zstd_compress (NULL, 0, ZSTD_e_end))
+        warc_write_ok = false;
+      return warc_write_ok;
+    }
+#endif
+
 #ifdef HAVE_LIBZ
   /* We start a new gzip stream for each record.  */
   if (warc_write_ok && warc_current_gzfile)
@@ -402,25 +1248,8 @@ warc_write_end_record (void)
       fwrite (static_header, 1, GZIP_STATIC_HEADER_SIZE, warc_current_file);
 
       /* Prepare the extra GZIP header. */
-      /* XLEN, the length of the extra header fields.  */
-      extra_header[0]  = ((EXTRA_GZIP_HEADER_SIZE - 2) & 255);
-      extra_header[1]  = ((EXTRA_GZIP_HEADER_SIZE - 2) >> 8) & 255;
-      /* The extra header field identifier for the WARC skip length. */
-      extra_header[2]  = 's';
-      extra_header[3]  = 'l';
-      /* The size of the field value (8 bytes).  */
-      extra_header[4]  = (8 & 255);
-      extra_header[5]  = ((8 >> 8) & 255);
-      /* The size of the uncompressed record.  */
-      extra_header[6]  = (uncompressed_size & 255);
-      extra_header[7]  = (uncompressed_size >> 8) & 255;
-      extra_header[8]  = (uncompressed_size >> 16) & 255;
-      extra_header[9]  = (uncompressed_size >> 24) & 255;
-      /* The size of the compressed record.  */
-      extra_header[10] = (compressed_size & 255);
-      extra_header[11] = (compressed_size >> 8) & 255;
-      extra_header[12] = (compressed_size >> 16) & 255;
-      extra_header[13] = (compressed_size >> 24) & 255;
+      warc_gzip_extra_header (extra_header, uncompressed_size,
+                              compressed_size);
 
       /* Write the extra header after the static header. */
       fseeko (warc_current_file, warc_current_gzfile_offset
@@ -455,8 +1284,12 @@ warc_write_date_header (const char *timestamp)
 static bool
 warc_write_ip_header (const ip_address *ip)
 {
+  char buf[64];
+
+  /* This runs on the writer thread: print_address is not safe there.  */
   if (ip != NULL)
-    return warc_write_header ("WARC-IP-Address", print_address (ip));
+    return warc_write_header ("WARC-IP-Address",
+                              format_address (ip, buf, sizeof buf));
   else
     return warc_write_ok;
 }
@@ -473,7 +1306,7 @@ warc_write_ip_header (const ip_address *ip)
    portion of the file starting at payload_offset and continuing to
    the end of the file.  The digest number will be written into the
    16 bytes beginning ad RES_PAYLOAD.  */
-static int
+int
 warc_sha1_stream_with_payload (FILE *stream, void *res_block, void *res_payload,
                                off_t payload_offset)
 {
@@ -586,6 +1419,68 @@ warc_sha1_stream_with_payload (FILE *stream, void *res_block, void *res_payload,
 #undef BLOCKSIZE
 }
 
+/* The block and payload digests of a response record, computed by
+   fd_read_body while it writes the response to the temporary file.  */
+struct warc_digests
+{
+  struct sha1_ctx ctx_block;
+  struct sha1_ctx ctx_payload;
+  struct body_digest digest;
+};
+
+static void
+warc_digests_update (const char *buf, size_t len, void *arg)
+{
+  struct warc_digests *d = arg;
+
+  sha1_process_bytes (buf, len, &d->ctx_block);
+  sha1_process_bytes (buf, len, &d->ctx_payload);
+}
+
+/* Start the digests of a response record whose headers, HEAD, have
+   been written to the temporary file, the payload being what
+   fd_read_body writes after them.  Returns NULL if WARC digests are
+   disabled.  */
+struct warc_digests *
+warc_digests_start (const char *head, size_t head_len)
+{
+  struct warc_digests *d;
+
+  if (!opt.warc_digests_enabled)
+    return NULL;
+
+  d = xnew0 (struct warc_digests);
+  sha1_init_ctx (&d->ctx_block);
+  sha1_init_ctx (&d->ctx_payload);
+  sha1_process_bytes (head, head_len, &d->ctx_block);
+
+  d->digest.update = warc_digests_update;
+  d->digest.ctx = d;
+  d->digest.raw = true;
+  body_digest_add (&d->digest);
+  return d;
+}
+
+/* Store the digests of D and free it.  */
+static void
+warc_digests_finish (struct warc_digests *d, void *res_block, void *res_payload)
+{
+  body_digest_remove (&d->digest);
+  sha1_finish_ctx (&d->ctx_block, res_block);
+  sha1_finish_ctx (&d->ctx_payload, res_payload);
+  xfree (d);
+}
+
+/* Discard digests that won't be used.  */
+void
+warc_digests_free (struct warc_digests *d)
+{
+  char res[SHA1_DIGEST_SIZE];
+
+  if (d)
+    warc_digests_finish (d, res, res);
+}
+
 /* Converts the SHA1 digest to a base32-encoded string.
    "sha1:DIGEST\0"  (Allocates a new string for the response.)  */
 static char *
@@ -642,7 +1537,16 @@ char *
 warc_timestamp (char *timestamp, size_t timestamp_size)
 {
   time_t rawtime = time (NULL);
-  struct tm * timeinfo = gmtime (&rawtime);
+  struct tm * timeinfo;
+#ifdef WINDOWS
+  /* The C runtime keeps the result per thread.  */
+  timeinfo = gmtime (&rawtime);
+#else
+  struct tm tm_buf;
+
+  /* The writer thread calls this too.  */
+  timeinfo = gmtime_r (&rawtime, &tm_buf);
+#endif
 
   if (strftime (timestamp, timestamp_size, "%Y-%m-%dT%H:%M:%SZ", timeinfo) == 0 && timestamp_size > 0)
     *timestamp = 0;
@@ -853,14 +1757,20 @@ warc_start_new_file (bool meta)
 {
 #ifdef __VMS
 # define WARC_GZ "warc-gz"
+# define WARC_ZST "warc-zst"
 #else /* def __VMS */
 # define WARC_GZ "warc.gz"
+# define WARC_ZST "warc.zst"
 #endif /* def __VMS [else] */
 
-#ifdef HAVE_LIBZ
-  const char *extension = (opt.warc_compression_enabled ? WARC_GZ : "warc");
-#else
   const char *extension = "warc";
+#ifdef HAVE_LIBZSTD
+  if (opt.warc_compression_enabled && opt.warc_compression_zstd)
+    extension = WARC_ZST;
+#endif
+#ifdef HAVE_LIBZ
+  if (opt.warc_compression_enabled && !opt.warc_compression_zstd)
+    extension = WARC_GZ;
 #endif
 
   int base_filename_length;
@@ -870,7 +1780,14 @@ warc_start_new_file (bool meta)
     return false;
 
   if (warc_current_file != NULL)
-    fclose (warc_current_file);
+    {
+      warc_gz_flush (false);
+#ifdef HAVE_LIBZSTD
+      if (warc_zstd_training)
+        warc_zstd_train ();
+#endif
+      fclose (warc_current_file);
+    }
 
   *warc_current_warcinfo_uuid_str = 0;
   xfree (warc_current_filename);
@@ -879,7 +1796,8 @@ warc_start_new_file (bool meta)
 
   base_filename_length = strlen (opt.warc_filename);
   /* filename format:  base + "-" + 5 digit serial number + ".warc.gz" */
-  new_filename = xmalloc (base_filename_length + 1 + 5 + 8 + 1);
+  new_filename = xmalloc (base_filename_length + 1 + 5 + 1
+                          + strlen (extension) + 1);
 
   warc_current_filename = new_filename;
 
@@ -894,17 +1812,28 @@ warc_start_new_file (bool meta)
   else
     sprintf (new_filename, "%s.%s", opt.warc_filename, extension);
 
-  logprintf (LOG_VERBOSE, _("Opening WARC file %s.\n\n"), quote (new_filename));
+  logprintf (LOG_VERBOSE, _("Opening WARC file %s.\n\n"),
+             warc_quote (new_filename));
 
   /* Open the WARC file. */
   warc_current_file = fopen (new_filename, "wb+");
   if (warc_current_file == NULL)
     {
       logprintf (LOG_NOTQUIET, _("Error opening WARC file %s.\n"),
-                 quote (new_filename));
+                 warc_quote (new_filename));
       return false;
     }
 
+#ifdef HAVE_LIBZSTD
+  /* A trained dictionary is written once it is known.  */
+  if (warc_zstd_cctx && !warc_zstd_training && !warc_zstd_write_dict ())
+    {
+      logprintf (LOG_NOTQUIET, _("Error writing WARC file %s.\n"),
+                 warc_quote (new_filename));
+      return false;
+    }
+#endif
+
   if (! warc_write_warcinfo_record (new_filename))
     return false;
 
@@ -992,10 +1921,22 @@ warc_parse_cdx_header (char *lineptr, int *field_num_original_url,
          && *field_num_record_id != -1;
 }
 
-/* Parse the CDX record and add it to the warc_cdx_dedup_table hash table. */
+/* An index being built: the arrays grow as lines are read.  */
+struct warc_cdx_builder
+{
+  struct warc_cdx_entry *entries;
+  size_t count;
+  size_t size;
+  char *strings;
+  size_t strings_len;
+  size_t strings_size;
+};
+
+/* Parse the CDX record and add it to the index being built.  */
 static void
 warc_process_cdx_line (char *lineptr, int field_num_original_url,
-                       int field_num_checksum, int field_num_record_id)
+                       int field_num_checksum, int field_num_record_id,
+                       struct warc_cdx_builder *b)
 {
   char *original_url = NULL;
   char *checksum = NULL;
@@ -1019,7 +1960,7 @@ warc_process_cdx_line (char *lineptr, int field_num_original_url,
         val = NULL;
 
       if (val != NULL)
-        *val = strdup (token);
+        *val = token;
 
       token = strtok_r (NULL, CDX_FIELDSEP, &save_ptr);
       field_num++;
@@ -1030,133 +1971,628 @@ warc_process_cdx_line (char *lineptr, int field_num_original_url,
       /* For some extra efficiency, we decode the base32 encoded
          checksum value.  This should produce exactly SHA1_DIGEST_SIZE
          bytes.  */
-      idx_t checksum_l;
-      char * checksum_v;
-      base32_decode_alloc (checksum, strlen (checksum), &checksum_v,
-                           &checksum_l);
-      xfree (checksum);
+      char checksum_v[SHA1_DIGEST_SIZE + 8];
+      idx_t checksum_l = sizeof checksum_v;
 
-      if (checksum_v != NULL && checksum_l == SHA1_DIGEST_SIZE)
+      if (base32_decode (checksum, strlen (checksum), checksum_v, &checksum_l)
+          && checksum_l == SHA1_DIGEST_SIZE)
         {
           /* This is a valid line with a valid checksum. */
-          struct warc_cdx_record *rec;
-          rec = xmalloc (sizeof (struct warc_cdx_record));
-          rec->url = original_url;
-          rec->uuid = record_id;
-          memcpy (rec->digest, checksum_v, SHA1_DIGEST_SIZE);
-          hash_table_put (warc_cdx_dedup_table, rec->digest, rec);
-          xfree (checksum_v);
+          size_t url_len = strlen (original_url) + 1;
+          size_t id_len = strlen (record_id) + 1;
+          struct warc_cdx_entry *e;
+
+          if (b->count == b->size)
+            {
+              b->size = MAX (1024, b->size * 2);
+              b->entries = xrealloc (b->entries, b->size * sizeof *b->entries);
+            }
+          if (b->strings_len + url_len + id_len > b->strings_size)
+            {
+              b->strings_size = MAX (b->strings_size * 2,
+                                     b->strings_len + url_len + id_len + 4096);
+              b->strings = xrealloc (b->strings, b->strings_size);
+            }
+
+          e = &b->entries[b->count++];
+          memcpy (e->digest, checksum_v, SHA1_DIGEST_SIZE);
+          memset (e->unused, 0, sizeof e->unused);
+          e->strings = b->strings_len;
+          memcpy (b->strings + b->strings_len, original_url, url_len);
+          memcpy (b->strings + b->strings_len + url_len, record_id, id_len);
+          b->strings_len += url_len + id_len;
         }
+    }
+}
+
+/* Orders the entries by digest, the later lines of the CDX file first:
+   they replace the earlier ones.  */
+static int
+warc_cdx_entry_cmp (const void *p1, const void *p2)
+{
+  const struct warc_cdx_entry *e1 = p1, *e2 = p2;
+  int cmp = memcmp (e1->digest, e2->digest, SHA1_DIGEST_SIZE);
+
+  if (cmp)
+    return cmp;
+  return e1->strings < e2->strings ? 1 : e1->strings > e2->strings ? -1 : 0;
+}
+
+/* Builds the index from the CDX file F.  Returns NULL if the file does
+   not have the columns deduplication needs.  */
+static struct warc_cdx_index *
+warc_build_cdx_index (FILE *f)
+{
+  struct warc_cdx_builder b = { NULL, 0, 0, NULL, 0, 0 };
+  struct warc_cdx_index *index;
+  char *lineptr = NULL;
+  size_t n = 0;
+  ssize_t line_length;
+  int field_num_original_url = -1;
+  int field_num_checksum = -1;
+  int field_num_record_id = -1;
+
+  /* The first line should contain the CDX header.
+     Format:  " CDX x x x x x"
+     where x are field type indicators.  For our purposes, we only
+     need 'a' (the original url), 'k' (the SHA1 checksum) and
+     'u' (the WARC record id). */
+  line_length = getline (&lineptr, &n, f);
+  if (line_length != -1)
+    warc_parse_cdx_header (lineptr, &field_num_original_url,
+                           &field_num_checksum, &field_num_record_id);
+
+  /* If the file contains all three fields, read the complete file. */
+  if (field_num_original_url == -1
+      || field_num_checksum == -1
+      || field_num_record_id == -1)
+    {
+      if (field_num_original_url == -1)
+        logprintf (LOG_NOTQUIET,
+_("CDX file does not list original urls. (Missing column 'a'.)\n"));
+      if (field_num_checksum == -1)
+        logprintf (LOG_NOTQUIET,
+_("CDX file does not list checksums. (Missing column 'k'.)\n"));
+      if (field_num_record_id == -1)
+        logprintf (LOG_NOTQUIET,
+_("CDX file does not list record ids. (Missing column 'u'.)\n"));
+      xfree (lineptr);
+      return NULL;
+    }
+
+  while ((line_length = getline (&lineptr, &n, f)) != -1)
+    warc_process_cdx_line (lineptr, field_num_original_url,
+                           field_num_checksum, field_num_record_id, &b);
+  xfree (lineptr);
+
+  qsort (b.entries, b.count, sizeof *b.entries, warc_cdx_entry_cmp);
+
+  index = xnew0 (struct warc_cdx_index);
+  index->entries = b.entries;
+  index->count = b.count;
+  index->strings = b.strings;
+  index->strings_size = b.strings_len;
+  return index;
+}
+
+/* Maps the index saved in PATH, if it was built from the CDX file
+   described by ST.  Returns NULL otherwise.  */
+static struct warc_cdx_index *
+warc_map_cdx_index (const char *path, const struct stat *st)
+{
+  struct warc_cdx_index_header header;
+  struct warc_cdx_index *index;
+  struct file_memory *fm;
+
+  fm = wget_read_file (path);
+  if (fm == NULL)
+    return NULL;
+
+  if (fm->length < (wgint) sizeof header)
+    goto invalid;
+  memcpy (&header, fm->content, sizeof header);
+  if (memcmp (header.magic, WARC_CDX_INDEX_MAGIC, sizeof header.magic)
+      || header.cdx_size != (uint64_t) st->st_size
+      || header.cdx_mtime != (int64_t) st->st_mtime
+      || header.count > (fm->length - sizeof header)
+                        / sizeof (struct warc_cdx_entry)
+      || sizeof header + header.count * sizeof (struct warc_cdx_entry)
+         + header.strings_size != (uint64_t) fm->length
+      || (header.strings_size
+          && fm->content[fm->length - 1] != '\0'))
+    goto invalid;
+
+  index = xnew0 (struct warc_cdx_index);
+  index->entries = (const void *) (fm->content + sizeof header);
+  index->count = header.count;
+  index->strings = (const char *) (index->entries + header.count);
+  index->strings_size = header.strings_size;
+  index->fm = fm;
+  return index;
+
+ invalid:
+  wget_read_file_free (fm);
+  return NULL;
+}
+
+/* Saves INDEX to PATH for the CDX file described by ST.  The index is
+   written to a temporary file first, so that another crawl never maps
+   half of it.  */
+static void
+warc_save_cdx_index (const char *path, const struct stat *st,
+                     const struct warc_cdx_index *index)
+{
+  struct warc_cdx_index_header header;
+  char *tmp_path = aprintf ("%s.tmp", path);
+  FILE *f;
+  bool ok;
+
+  memset (&header, 0, sizeof header);
+  memcpy (header.magic, WARC_CDX_INDEX_MAGIC, sizeof header.magic);
+  header.cdx_size = st->st_size;
+  header.cdx_mtime = st->st_mtime;
+  header.count = index->count;
+  header.strings_size = index->strings_size;
+
+  f = fopen (tmp_path, "wb");
+  if (f == NULL)
+    {
+      DEBUGP (("Could not save CDX index %s: %s\n", quote (path),
+               strerror (errno)));
+      xfree (tmp_path);
+      return;
+    }
+  ok = fwrite (&header, sizeof header, 1, f) == 1
+    && fwrite (index->entries, sizeof *index->entries, index->count, f)
+       == index->count
+    && fwrite (index->strings, 1, index->strings_size, f)
+       == index->strings_size;
+  if (fclose (f) != 0)
+    ok = false;
+  if (!ok || rename (tmp_path, path) != 0)
+    {
+      DEBUGP (("Could not save CDX index %s: %s\n", quote (path),
+               strerror (errno)));
+      unlink (tmp_path);
+    }
+  xfree (tmp_path);
+}
+
+/* Loads the CDX file from opt.warc_cdx_dedup_filename into
+   warc_cdx_dedup_index.  The saved index is used if it is up to date;
+   otherwise it is built, and saved for the next crawl.  */
+static bool
+warc_load_cdx_dedup_file (void)
+{
+  struct stat st;
+  char *index_path;
+  FILE *f;
+  int nrecords;
+
+  f = fopen (opt.warc_cdx_dedup_filename, "r");
+  if (f == NULL)
+    return false;
+  if (fstat (fileno (f), &st) != 0)
+    {
+      fclose (f);
+      return false;
+    }
+
+  index_path = aprintf ("%s.idx", opt.warc_cdx_dedup_filename);
+  MEMACCT_ENTER (memacct_saved, MEMACCT_WARC_DEDUP);
+  warc_cdx_dedup_index = warc_map_cdx_index (index_path, &st);
+  if (warc_cdx_dedup_index == NULL)
+    {
+      warc_cdx_dedup_index = warc_build_cdx_index (f);
+      if (warc_cdx_dedup_index != NULL)
+        warc_save_cdx_index (index_path, &st, warc_cdx_dedup_index);
+    }
+  MEMACCT_LEAVE (memacct_saved);
+  xfree (index_path);
+  fclose (f);
+
+  /* Print results. */
+  if (warc_cdx_dedup_index != NULL)
+    {
+      nrecords = warc_cdx_dedup_index->count;
+      logprintf (LOG_VERBOSE, ngettext ("Loaded %d record from CDX.\n\n",
+                                        "Loaded %d records from CDX.\n\n",
+                                         nrecords),
+                              nrecords);
+    }
+
+  return true;
+}
+#undef CDX_FIELDSEP
+
+/* Returns the record id of the existing duplicate CDX record for the
+   given url and payload digest.  Returns NULL if the url is not found
+   or if the payload digest does not match, or if CDX deduplication is
+   disabled. */
+static const char *
+warc_find_duplicate_cdx_record (const char *url, char *sha1_digest_payload)
+{
+  const struct warc_cdx_index *index = warc_cdx_dedup_index;
+  size_t lo = 0, hi, i;
+
+  if (index == NULL)
+    return NULL;
+
+  /* Find the first entry with the digest...  */
+  hi = index->count;
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (memcmp (index->entries[mid].digest, sha1_digest_payload,
+                  SHA1_DIGEST_SIZE) < 0)
+        lo = mid + 1;
       else
-        {
-          xfree (original_url);
-          xfree (checksum_v);
-          xfree (record_id);
-        }
+        hi = mid;
     }
-  else
+
+  /* ...and the first of those with the url.  */
+  for (i = lo; i < index->count
+         && !memcmp (index->entries[i].digest, sha1_digest_payload,
+                     SHA1_DIGEST_SIZE); i++)
+    {
+      uint64_t offset = index->entries[i].strings;
+      const char *record_url;
+
+      if (offset >= index->strings_size)
+        break;
+      record_url = index->strings + offset;
+      offset += strlen (record_url) + 1;
+      if (offset < index->strings_size && strcmp (record_url, url) == 0)
+        return index->strings + offset;
+    }
+  return NULL;
+}
+
+/* Writes the record id packed in ID to URN_STR, in the form of
+   warc_uuid_str.  */
+static void
+warc_unpack_uuid (const unsigned char *id, char *urn_str, size_t urn_size)
+{
+  snprintf (urn_str, urn_size,
+    "<urn:uuid:%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x>",
+    id[0], id[1], id[2], id[3], id[4], id[5], id[6], id[7], id[8], id[9],
+    id[10], id[11], id[12], id[13], id[14], id[15]);
+}
+
+/* Packs the record id URN_STR into the 16 bytes at ID.  Returns false
+   if it would not be written back the same.  */
+static bool
+warc_pack_uuid (const char *urn_str, unsigned char *id)
+{
+  const char *p = urn_str + strlen ("<urn:uuid:");
+  char check[48];
+  int i;
+
+  if (strncmp (urn_str, "<urn:uuid:", strlen ("<urn:uuid:")) != 0)
+    return false;
+  for (i = 0; i < 16; i++)
     {
-      xfree(checksum);
-      xfree(original_url);
-      xfree(record_id);
+      if (*p == '-')
+        p++;
+      if (!c_isxdigit (p[0]) || !c_isxdigit (p[1]))
+        return false;
+      id[i] = X2DIGITS_TO_NUM (p[0], p[1]);
+      p += 2;
     }
+  warc_unpack_uuid (id, check, sizeof (check));
+  return strcmp (check, urn_str) == 0;
+}
+
+/* Returns the size of the payload in BODY, which starts at
+   PAYLOAD_OFFSET, or -1 if it is not known.  */
+static off_t
+warc_payload_size (FILE *body, off_t payload_offset)
+{
+  off_t pos = ftello (body), size;
+
+  if (payload_offset < 0 || fseeko (body, 0, SEEK_END) != 0)
+    return -1;
+  size = ftello (body);
+  fseeko (body, pos, SEEK_SET);
+  return size - payload_offset;
 }
 
-/* Loads the CDX file from opt.warc_cdx_dedup_filename and fills
-   the warc_cdx_dedup_table. */
+/* Looks the payload digest up among the payloads archived in this
+   crawl.  Returns true and writes the id of the response record to
+   URN_STR if it was found.  */
 static bool
-warc_load_cdx_dedup_file (void)
+warc_find_crawl_duplicate (const char *sha1_digest_payload, char *urn_str,
+                           size_t urn_size)
 {
-  FILE *f;
-  char *lineptr = NULL;
-  size_t n = 0;
-  ssize_t line_length;
-  int field_num_original_url = -1;
-  int field_num_checksum = -1;
-  int field_num_record_id = -1;
+  struct warc_crawl_record *rec;
 
-  f = fopen (opt.warc_cdx_dedup_filename, "r");
-  if (f == NULL)
+  if (warc_crawl_dedup_table == NULL)
     return false;
+  rec = hash_table_get (warc_crawl_dedup_table, sha1_digest_payload);
+  if (rec == NULL)
+    return false;
+  warc_unpack_uuid (rec->uuid, urn_str, urn_size);
+  return true;
+}
 
-  /* The first line should contain the CDX header.
-     Format:  " CDX x x x x x"
-     where x are field type indicators.  For our purposes, we only
-     need 'a' (the original url), 'k' (the SHA1 checksum) and
-     'u' (the WARC record id). */
-  line_length = getline (&lineptr, &n, f);
-  if (line_length != -1)
-    warc_parse_cdx_header (lineptr, &field_num_original_url,
-                           &field_num_checksum, &field_num_record_id);
+/* Remembers that the payload with the digest was archived in the
+   response record RESPONSE_UUID.  */
+static void
+warc_add_crawl_record (const char *sha1_digest_payload,
+                       const char *response_uuid)
+{
+  struct warc_crawl_record *rec = xnew (struct warc_crawl_record);
 
-  /* If the file contains all three fields, read the complete file. */
-  if (field_num_original_url == -1
-      || field_num_checksum == -1
-      || field_num_record_id == -1)
+  if (!warc_pack_uuid (response_uuid, rec->uuid))
     {
-      if (field_num_original_url == -1)
-        logprintf (LOG_NOTQUIET,
-_("CDX file does not list original urls. (Missing column 'a'.)\n"));
-      if (field_num_checksum == -1)
-        logprintf (LOG_NOTQUIET,
-_("CDX file does not list checksums. (Missing column 'k'.)\n"));
-      if (field_num_record_id == -1)
-        logprintf (LOG_NOTQUIET,
-_("CDX file does not list record ids. (Missing column 'u'.)\n"));
+      xfree (rec);
+      return;
     }
-  else
-    {
-      int nrecords;
-
-      /* Initialize the table. */
-      warc_cdx_dedup_table = hash_table_new (1000, warc_hash_sha1_digest,
+  memcpy (rec->digest, sha1_digest_payload, SHA1_DIGEST_SIZE);
+  if (warc_crawl_dedup_table == NULL)
+    warc_crawl_dedup_table = hash_table_new (1000, warc_hash_sha1_digest,
                                              warc_cmp_sha1_digest);
+  hash_table_put (warc_crawl_dedup_table, rec->digest, rec);
+}
 
-      do
-        {
-          line_length = getline (&lineptr, &n, f);
-          if (line_length != -1)
-            {
-              warc_process_cdx_line (lineptr, field_num_original_url,
-                            field_num_checksum, field_num_record_id);
-            }
+static bool warc_write_request_record_now (const char *, const char *,
+                                           const char *, const ip_address *,
+                                           FILE *, off_t);
+static bool warc_write_response_record_now (const char *, const char *,
+                                            const char *, const ip_address *,
+                                            FILE *, off_t, const char *, int,
+                                            const char *, const char *);
+
+#ifdef HAVE_PTHREAD
+/* The records are written by a thread of their own, so that the
+   downloads go on while they are compressed and written to disk.  The
+   public warc_write_*_record functions queue a copy of their arguments
+   and return at once, unless the queue is full.  The messages the
+   writer logs are captured and logged by the main thread the next time
+   it queues a record, in the order of the records.
+
+   The writer owns the WARC and CDX files, and everything else this
+   file keeps about them, until warc_writer_drain returns.  */
+
+/* How many records may wait to be written.  */
+#define WARC_WRITER_QUEUE_SIZE 16
+
+enum warc_job_type { WARC_JOB_REQUEST, WARC_JOB_RESPONSE, WARC_JOB_RECORD };
+
+/* A record to be written, with copies of the arguments of the
+   warc_write_*_record function that queued it.  */
+struct warc_job
+{
+  enum warc_job_type type;
+  const char *record_type;      /* "resource" or "metadata" */
+  char *url;
+  char *timestamp_str;
+  char *uuid;
+  char *concurrent_to_uuid;
+  char *content_type;           /* or the mime type of a response */
+  char *redirect_location;
+  ip_address ip;
+  bool has_ip;
+  FILE *body;
+  off_t payload_offset;
+  int response_code;
+  bool digested;
+  char digests[2 * SHA1_DIGEST_SIZE];
+  struct log_capture *log;
+  struct warc_job *next;
+};
 
-        }
-      while (line_length != -1);
+static struct
+{
+  bool running;
+  bool stopping;
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  /* The records waiting, the first of which is being written.  */
+  struct warc_job *queue;
+  struct warc_job *queue_tail;
+  int queue_size;
+  /* The records written whose messages were not logged yet.  */
+  struct warc_job *done;
+  struct warc_job *done_tail;
+} warc_writer = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                  .changed = PTHREAD_COND_INITIALIZER };
+
+static bool warc_write_record (const char *, const char *, const char *,
+                               const char *, const char *,
+                               const ip_address *, const char *, FILE *,
+                               off_t);
 
-      /* Print results. */
-      nrecords = hash_table_count (warc_cdx_dedup_table);
-      logprintf (LOG_VERBOSE, ngettext ("Loaded %d record from CDX.\n\n",
-                                        "Loaded %d records from CDX.\n\n",
-                                         nrecords),
-                              nrecords);
+static void
+warc_job_run (struct warc_job *job)
+{
+  const ip_address *ip = job->has_ip ? &job->ip : NULL;
+
+  switch (job->type)
+    {
+    case WARC_JOB_REQUEST:
+      warc_write_request_record_now (job->url, job->timestamp_str, job->uuid,
+                                     ip, job->body, job->payload_offset);
+      break;
+    case WARC_JOB_RESPONSE:
+      warc_write_response_record_now (job->url, job->timestamp_str,
+                                      job->concurrent_to_uuid, ip, job->body,
+                                      job->payload_offset, job->content_type,
+                                      job->response_code,
+                                      job->redirect_location,
+                                      job->digested ? job->digests : NULL);
+      break;
+    case WARC_JOB_RECORD:
+      warc_write_record (job->record_type, job->uuid, job->url,
+                         job->timestamp_str, job->concurrent_to_uuid, ip,
+                         job->content_type, job->body, job->payload_offset);
+      break;
     }
+}
 
-  xfree (lineptr);
-  fclose (f);
+static void
+warc_job_free (struct warc_job *job)
+{
+  xfree (job->url);
+  xfree (job->timestamp_str);
+  xfree (job->uuid);
+  xfree (job->concurrent_to_uuid);
+  xfree (job->content_type);
+  xfree (job->redirect_location);
+  xfree (job);
+}
 
-  return true;
+static void *
+warc_writer_main (void *arg _GL_UNUSED)
+{
+  pthread_mutex_lock (&warc_writer.lock);
+  for (;;)
+    {
+      struct warc_job *job;
+
+      while (!warc_writer.queue && !warc_writer.stopping)
+        pthread_cond_wait (&warc_writer.changed, &warc_writer.lock);
+      job = warc_writer.queue;
+      if (job == NULL)
+        break;
+      pthread_mutex_unlock (&warc_writer.lock);
+
+      job->log = log_capture_begin ();
+      warc_job_run (job);
+      log_capture_end ();
+
+      pthread_mutex_lock (&warc_writer.lock);
+      warc_writer.queue = job->next;
+      if (warc_writer.queue == NULL)
+        warc_writer.queue_tail = NULL;
+      warc_writer.queue_size--;
+      job->next = NULL;
+      if (warc_writer.done_tail)
+        warc_writer.done_tail->next = job;
+      else
+        warc_writer.done = job;
+      warc_writer.done_tail = job;
+      pthread_cond_broadcast (&warc_writer.changed);
+    }
+  pthread_mutex_unlock (&warc_writer.lock);
+  return NULL;
 }
-#undef CDX_FIELDSEP
 
-/* Returns the existing duplicate CDX record for the given url and payload
-   digest.  Returns NULL if the url is not found or if the payload digest
-   does not match, or if CDX deduplication is disabled. */
-static struct warc_cdx_record *
-warc_find_duplicate_cdx_record (const char *url, char *sha1_digest_payload)
+/* Starts the writer thread.  If it cannot be started, the records are
+   written by the calling thread as before.  */
+static void
+warc_writer_start (void)
+{
+  /* Allocate the quoting slot of the writer; see WARC_QUOTE_SLOT.  */
+  warc_quote ("");
+  warc_writer.stopping = false;
+  warc_writer.running =
+    pthread_create (&warc_writer.tid, NULL, warc_writer_main, NULL) == 0;
+}
+
+/* Logs the messages of the records written so far.  */
+static void
+warc_writer_log (void)
 {
-  struct warc_cdx_record *rec_existing;
+  struct warc_job *job;
 
-  if (warc_cdx_dedup_table == NULL)
-    return NULL;
+  pthread_mutex_lock (&warc_writer.lock);
+  job = warc_writer.done;
+  warc_writer.done = warc_writer.done_tail = NULL;
+  pthread_mutex_unlock (&warc_writer.lock);
 
-  rec_existing = hash_table_get (warc_cdx_dedup_table, sha1_digest_payload);
+  while (job)
+    {
+      struct warc_job *next = job->next;
+      log_capture_replay (job->log);
+      warc_job_free (job);
+      job = next;
+    }
+}
+
+/* Queues JOB, waiting while the queue is full.  Returns false if
+   writing a record has failed.  */
+static bool
+warc_writer_add (struct warc_job *job)
+{
+  bool ok;
 
-  if (rec_existing && strcmp (rec_existing->url, url) == 0)
-    return rec_existing;
+  pthread_mutex_lock (&warc_writer.lock);
+  while (warc_writer.queue_size >= WARC_WRITER_QUEUE_SIZE)
+    pthread_cond_wait (&warc_writer.changed, &warc_writer.lock);
+  if (warc_writer.queue_tail)
+    warc_writer.queue_tail->next = job;
   else
-    return NULL;
+    warc_writer.queue = job;
+  warc_writer.queue_tail = job;
+  warc_writer.queue_size++;
+  pthread_cond_broadcast (&warc_writer.changed);
+  ok = warc_write_ok;
+  pthread_mutex_unlock (&warc_writer.lock);
+
+  warc_writer_log ();
+  return ok;
+}
+
+/* Waits until the records queued so far are written.  The files are
+   the calling thread's again until the next record is queued.  */
+static void
+warc_writer_drain (void)
+{
+  if (!warc_writer.running)
+    return;
+  pthread_mutex_lock (&warc_writer.lock);
+  while (warc_writer.queue)
+    pthread_cond_wait (&warc_writer.changed, &warc_writer.lock);
+  pthread_mutex_unlock (&warc_writer.lock);
+  warc_writer_log ();
+}
+
+/* Writes the records queued so far and ends the writer thread.  */
+static void
+warc_writer_stop (void)
+{
+  if (!warc_writer.running)
+    return;
+  pthread_mutex_lock (&warc_writer.lock);
+  warc_writer.stopping = true;
+  pthread_cond_broadcast (&warc_writer.changed);
+  pthread_mutex_unlock (&warc_writer.lock);
+  pthread_join (warc_writer.tid, NULL);
+  warc_writer.running = false;
+  warc_writer_log ();
+}
+
+/* Returns a new job of TYPE with copies of the arguments common to
+   all records.  */
+static struct warc_job *
+warc_job_new (enum warc_job_type type, const char *url,
+              const char *timestamp_str, const char *uuid,
+              const char *concurrent_to_uuid, const ip_address *ip,
+              const char *content_type, FILE *body, off_t payload_offset)
+{
+  struct warc_job *job = xnew0 (struct warc_job);
+
+  job->type = type;
+  job->url = url ? xstrdup (url) : NULL;
+  job->timestamp_str = timestamp_str ? xstrdup (timestamp_str) : NULL;
+  job->uuid = uuid ? xstrdup (uuid) : NULL;
+  job->concurrent_to_uuid =
+    concurrent_to_uuid ? xstrdup (concurrent_to_uuid) : NULL;
+  job->content_type = content_type ? xstrdup (content_type) : NULL;
+  if (ip)
+    {
+      job->ip = *ip;
+      job->has_ip = true;
+    }
+  job->body = body;
+  job->payload_offset = payload_offset;
+  return job;
 }
+#else /* not HAVE_PTHREAD */
+# define warc_writer_drain() do { } while (0)
+#endif /* not HAVE_PTHREAD */
 
 /* Initializes the WARC writer (if opt.warc_filename is set).
    This should be called before any WARC record is written. */
@@ -1198,6 +2634,15 @@ warc_init (void)
           log_set_warc_log_fp (warc_log_fp);
         }
 
+#ifdef HAVE_LIBZSTD
+      if (opt.warc_compression_enabled && opt.warc_compression_zstd
+          && ! warc_zstd_init ())
+        {
+          logprintf (LOG_NOTQUIET, _("Could not set up zstd compression.\n"));
+          exit (WGET_EXIT_GENERIC_ERROR);
+        }
+#endif
+
       warc_current_file_number = -1;
       if (! warc_start_new_file (false))
         {
@@ -1214,6 +2659,10 @@ warc_init (void)
               exit (WGET_EXIT_GENERIC_ERROR);
             }
         }
+
+#ifdef HAVE_PTHREAD
+      warc_writer_start ();
+#endif
     }
 }
 
@@ -1254,6 +2703,8 @@ warc_write_metadata (void)
 
   if (warc_log_fp != NULL)
     {
+      /* Have the log written out before it is copied.  */
+      logflush ();
       warc_write_resource_record (NULL,
                               "metadata://gnu.org/software/wget/warc/wget.log",
                                   NULL, manifest_uuid, NULL, "text/plain",
@@ -1270,12 +2721,25 @@ warc_write_metadata (void)
 void
 warc_close (void)
 {
+#ifdef HAVE_PTHREAD
+  warc_writer_stop ();
+#endif
+
   if (warc_current_file != NULL)
     {
       warc_write_metadata ();
+      warc_gz_flush (true);
+#ifdef HAVE_LIBZSTD
+      if (warc_zstd_training)
+        warc_zstd_train ();
+#endif
       *warc_current_warcinfo_uuid_str = 0;
       fclose (warc_current_file);
       warc_current_file = NULL;
+#ifdef HAVE_LIBZSTD
+      if (warc_zstd_cctx)
+        warc_zstd_cleanup ();
+#endif
     }
 
   if (warc_current_cdx_file != NULL)
@@ -1297,41 +2761,7 @@ warc_close (void)
 FILE *
 warc_tempfile (void)
 {
-  char filename[100];
-  int fd;
-
-  if (path_search (filename, 100, opt.warc_tempdir, "wget", true) == -1)
-    return NULL;
-
-#ifdef __VMS
-  /* 2013-07-12 SMS.
-   * mkostemp()+unlink()+fdopen() scheme causes trouble on VMS, so use
-   * mktemp() to uniquify the (VMS-style) name, and then use a normal
-   * fopen() with a "create temp file marked for delete" option.
-   */
-  {
-    char *tfn;
-
-    tfn = mktemp (filename);            /* Get unique name from template. */
-    if (tfn == NULL)
-      return NULL;
-    return fopen (tfn, "w+", "fop=tmd");    /* Create auto-delete temp file. */
-  }
-#else /* def __VMS */
-  fd = mkostemp (filename, O_TEMPORARY);
-  if (fd < 0)
-    return NULL;
-
-#if !O_TEMPORARY
-  if (unlink (filename) < 0)
-    {
-      close(fd);
-      return NULL;
-    }
-#endif
-
-  return fdopen (fd, "wb+");
-#endif /* def __VMS [else] */
+  return temp_file (opt.warc_tempdir);
 }
 
 
@@ -1347,6 +2777,22 @@ bool
 warc_write_request_record (const char *url, const char *timestamp_str,
                            const char *record_uuid, const ip_address *ip,
                            FILE *body, off_t payload_offset)
+{
+#ifdef HAVE_PTHREAD
+  if (warc_writer.running)
+    return warc_writer_add (warc_job_new (WARC_JOB_REQUEST, url, timestamp_str,
+                                          record_uuid, NULL, ip, NULL, body,
+                                          payload_offset));
+#endif
+  return warc_write_request_record_now (url, timestamp_str, record_uuid, ip,
+                                        body, payload_offset);
+}
+
+/* Writes the request record on the calling thread.  */
+static bool
+warc_write_request_record_now (const char *url, const char *timestamp_str,
+                               const char *record_uuid, const ip_address *ip,
+                               FILE *body, off_t payload_offset)
 {
   warc_write_start_record ();
   warc_write_header ("WARC-Type", "request");
@@ -1411,6 +2857,39 @@ warc_write_cdx_record (const char *url, const char *timestamp_str,
   else
     tmp_location = url_escape(redirect_location);
 
+#if defined HAVE_LIBZ && defined HAVE_PTHREAD
+  /* The record is still being compressed; the line is printed once
+     its offset is known.  */
+  if (warc_gz_last_record)
+    {
+      warc_gz_last_record->cdx_head =
+        aprintf ("%s %s %s %s %d %s %s - ", url, timestamp_str_cdx, url,
+                 mime_type, response_code, checksum, tmp_location);
+      warc_gz_last_record->cdx_tail =
+        aprintf (" %s %s\n", warc_current_filename, response_uuid);
+      free (tmp_location);
+      return true;
+    }
+  /* Otherwise it was already written.  */
+  if (warc_gz_pool.thread_count)
+    offset = warc_gz_member_offset;
+#endif
+#ifdef HAVE_LIBZSTD
+  /* Likewise, the record is held until the dictionary is trained.  */
+  if (warc_zstd_training)
+    {
+      warc_zstd_held_tail->cdx_head =
+        aprintf ("%s %s %s %s %d %s %s - ", url, timestamp_str_cdx, url,
+                 mime_type, response_code, checksum, tmp_location);
+      warc_zstd_held_tail->cdx_tail =
+        aprintf (" %s %s\n", warc_current_filename, response_uuid);
+      free (tmp_location);
+      return true;
+    }
+  if (warc_zstd_cctx)
+    offset = warc_zstd_frame_offset;
+#endif
+
   number_to_string (offset_string, offset);
 
   /* Print the CDX line. */
@@ -1484,13 +2963,61 @@ warc_write_revisit_record (const char *url, const char *timestamp_str,
    mime_type  is the mime type of the response body (will be printed to CDX),
    response_code  is the HTTP response code (will be printed to CDX),
    redirect_location  is the contents of the Location: header, or NULL (will be printed to CDX),
-   Calling this function will close body.
+   digests  are the digests computed while writing body (see warc_digests_start),
+            or NULL to compute them by reading body.
+   Calling this function will close body and free digests.
    Returns true on success, false on error. */
 bool
 warc_write_response_record (const char *url, const char *timestamp_str,
                             const char *concurrent_to_uuid, const ip_address *ip,
                             FILE *body, off_t payload_offset, const char *mime_type,
-                            int response_code, const char *redirect_location)
+                            int response_code, const char *redirect_location,
+                            struct warc_digests *digests)
+{
+  char digested[2 * SHA1_DIGEST_SIZE];
+
+  /* The digests are taken off the body reader here, on the thread
+     reading the body.  */
+  if (digests)
+    warc_digests_finish (digests, digested, digested + SHA1_DIGEST_SIZE);
+
+#ifdef HAVE_PTHREAD
+  if (warc_writer.running)
+    {
+      struct warc_job *job;
+
+      job = warc_job_new (WARC_JOB_RESPONSE, url, timestamp_str, NULL,
+                          concurrent_to_uuid, ip, mime_type, body,
+                          payload_offset);
+      job->response_code = response_code;
+      job->redirect_location =
+        redirect_location ? xstrdup (redirect_location) : NULL;
+      if (digests)
+        {
+          memcpy (job->digests, digested, sizeof (digested));
+          job->digested = true;
+        }
+      return warc_writer_add (job);
+    }
+#endif
+  return warc_write_response_record_now (url, timestamp_str,
+                                         concurrent_to_uuid, ip, body,
+                                         payload_offset, mime_type,
+                                         response_code, redirect_location,
+                                         digests ? digested : NULL);
+}
+
+/* Writes the response record on the calling thread.  DIGESTED holds
+   the block and payload digests, or is NULL to compute them by reading
+   body.  */
+static bool
+warc_write_response_record_now (const char *url, const char *timestamp_str,
+                                const char *concurrent_to_uuid,
+                                const ip_address *ip, FILE *body,
+                                off_t payload_offset, const char *mime_type,
+                                int response_code,
+                                const char *redirect_location,
+                                const char *digested)
 {
   char block_digest[BASE32_LENGTH(SHA1_DIGEST_SIZE) + 1 + 5];
   char payload_digest[BASE32_LENGTH(SHA1_DIGEST_SIZE) + 1 + 5];
@@ -1498,25 +3025,48 @@ warc_write_response_record (const char *url, const char *timestamp_str,
   char sha1_res_payload[SHA1_DIGEST_SIZE];
   char response_uuid [48];
   off_t offset;
+  bool crawl_dedup = false;
 
   if (opt.warc_digests_enabled)
     {
-      /* Calculate the block and payload digests. */
+      int err = 0;
+
+      /* Calculate the block and payload digests, unless that was
+         done as the response was received. */
       rewind (body);
-      if (warc_sha1_stream_with_payload (body, sha1_res_block, sha1_res_payload,
-          payload_offset) == 0)
+      if (digested)
+        {
+          memcpy (sha1_res_block, digested, SHA1_DIGEST_SIZE);
+          memcpy (sha1_res_payload, digested + SHA1_DIGEST_SIZE,
+                  SHA1_DIGEST_SIZE);
+        }
+      else
+        err = warc_sha1_stream_with_payload (body, sha1_res_block,
+                                             sha1_res_payload, payload_offset);
+      if (err == 0)
         {
           /* Decide (based on url + payload digest) if we have seen this
              data before. */
-          struct warc_cdx_record *rec_existing;
-          rec_existing = warc_find_duplicate_cdx_record (url, sha1_res_payload);
-          if (rec_existing != NULL)
-            {
-              bool result;
+          const char *uuid_existing;
+          char uuid_crawl[48];
 
-              /* Found an existing record. */
-              logprintf (LOG_VERBOSE,
+          uuid_existing = warc_find_duplicate_cdx_record (url,
+                                                          sha1_res_payload);
+          if (uuid_existing != NULL)
+            logprintf (LOG_VERBOSE,
           _("Found exact match in CDX file. Saving revisit record to WARC.\n"));
+          else if (opt.warc_dedup_crawl
+                   && warc_find_crawl_duplicate (sha1_res_payload, uuid_crawl,
+                                                 sizeof (uuid_crawl)))
+            {
+              uuid_existing = uuid_crawl;
+              logprintf (LOG_VERBOSE,
+          _("Found the same payload earlier in this crawl. Saving revisit record to WARC.\n"));
+            }
+
+          if (uuid_existing != NULL)
+            {
+              bool result;
 
               /* Remove the payload from the file. */
               if (payload_offset > 0)
@@ -1528,7 +3078,7 @@ warc_write_response_record (const char *url, const char *timestamp_str,
               /* Send the original payload digest. */
               warc_base32_sha1_digest (sha1_res_payload, payload_digest, sizeof(payload_digest));
               result = warc_write_revisit_record (url, timestamp_str,
-                         concurrent_to_uuid, payload_digest, rec_existing->uuid,
+                         concurrent_to_uuid, payload_digest, uuid_existing,
                          ip, body);
 
               return result;
@@ -1536,6 +3086,12 @@ warc_write_response_record (const char *url, const char *timestamp_str,
 
           warc_base32_sha1_digest (sha1_res_block, block_digest, sizeof(block_digest));
           warc_base32_sha1_digest (sha1_res_payload, payload_digest, sizeof(payload_digest));
+
+          /* Later copies of a payload large enough can refer to this one.  */
+          if (opt.warc_dedup_crawl
+              && warc_payload_size (body, payload_offset)
+                 >= WARC_CRAWL_DEDUP_MIN_SIZE)
+            crawl_dedup = true;
         }
     }
 
@@ -1562,6 +3118,9 @@ warc_write_response_record (const char *url, const char *timestamp_str,
 
   fclose (body);
 
+  if (warc_write_ok && crawl_dedup)
+    warc_add_crawl_record (sha1_res_payload, response_uuid);
+
   if (warc_write_ok && opt.warc_cdx_enabled)
     {
       /* Add this record to the CDX. */
@@ -1573,6 +3132,189 @@ warc_write_response_record (const char *url, const char *timestamp_str,
   return warc_write_ok;
 }
 
+/* A response record whose block fd_read_body writes straight to the
+   WARC file, see warc_response_stream_start.  */
+struct warc_response_stream
+{
+  off_t record_offset;          /* where the record starts */
+  off_t block_digest_offset;    /* where the digests are filled in, */
+  off_t payload_digest_offset;  /* or -1 if digests are disabled */
+  off_t block_offset;           /* where the block starts */
+  off_t block_size;             /* the size given in Content-Length */
+  off_t payload_offset;         /* the size of the HTTP head */
+  char uuid[48];
+  struct warc_digests *digests;
+};
+
+/* The text written in place of a digest until it is known.  */
+#define WARC_DIGEST_PLACEHOLDER "sha1:"                                 \
+  "00000000000000000000000000000000"
+
+/* Start a response record for a response whose HEAD is followed by a
+   body of BODY_SIZE bytes, and return the file to which the body is
+   to be written, as it is received, before calling
+   warc_response_stream_finish.  The digests are computed as the body
+   is written and filled in at the space reserved for them in the
+   record headers.  This saves copying the response through a
+   temporary file, but is only possible when the records are not
+   compressed and don't need to be deduplicated.  Otherwise, NULL is
+   returned and the response is to be written to a warc_tempfile for
+   warc_write_response_record.  */
+FILE *
+warc_response_stream_start (const char *url, const char *timestamp_str,
+                            const char *concurrent_to_uuid,
+                            const ip_address *ip, const char *head,
+                            wgint body_size,
+                            struct warc_response_stream **stream_ref)
+{
+  char content_length[MAX_INT_TO_STRING_LEN(off_t)];
+  struct warc_response_stream *s;
+  size_t head_len = strlen (head);
+
+  /* The record is written from this thread.  */
+  warc_writer_drain ();
+
+  if (opt.warc_compression_enabled || warc_cdx_dedup_index
+      || opt.warc_dedup_crawl
+      || !warc_write_ok || body_size < 0)
+    return NULL;
+
+  s = xnew0 (struct warc_response_stream);
+  s->block_digest_offset = s->payload_digest_offset = -1;
+  s->payload_offset = head_len;
+  s->block_size = head_len + body_size;
+  warc_uuid_str (s->uuid, sizeof (s->uuid));
+
+  fseeko (warc_current_file, 0L, SEEK_END);
+  warc_write_start_record ();
+  /* warc_write_start_record may have moved to a new file.  */
+  s->record_offset = ftello (warc_current_file) - strlen ("WARC/1.0\r\n");
+
+  warc_write_header ("WARC-Type", "response");
+  warc_write_header ("WARC-Record-ID", s->uuid);
+  warc_write_header ("WARC-Warcinfo-ID", warc_current_warcinfo_uuid_str);
+  warc_write_header ("WARC-Concurrent-To", concurrent_to_uuid);
+  warc_write_header_uri ("WARC-Target-URI", url);
+  warc_write_date_header (timestamp_str);
+  warc_write_ip_header (ip);
+  if (opt.warc_digests_enabled)
+    {
+      warc_write_string ("WARC-Block-Digest: ");
+      s->block_digest_offset = ftello (warc_current_file);
+      warc_write_string (WARC_DIGEST_PLACEHOLDER "\r\n");
+      warc_write_string ("WARC-Payload-Digest: ");
+      s->payload_digest_offset = ftello (warc_current_file);
+      warc_write_string (WARC_DIGEST_PLACEHOLDER "\r\n");
+    }
+  warc_write_header ("Content-Type", "application/http;msgtype=response");
+  number_to_string (content_length, s->block_size);
+  warc_write_header ("Content-Length", content_length);
+  warc_write_string ("\r\n");
+  s->block_offset = ftello (warc_current_file);
+  warc_write_string (head);
+
+  if (!warc_write_ok)
+    {
+      warc_response_stream_abort (s);
+      return NULL;
+    }
+
+  s->digests = warc_digests_start (head, head_len);
+  *stream_ref = s;
+  return warc_current_file;
+}
+
+/* Remove the record of S from the WARC file, and free S.  */
+void
+warc_response_stream_abort (struct warc_response_stream *s)
+{
+  warc_digests_free (s->digests);
+  fflush (warc_current_file);
+  if (ftruncate (fileno (warc_current_file), s->record_offset) != 0)
+    warc_write_ok = false;
+  fseeko (warc_current_file, 0L, SEEK_END);
+  xfree (s);
+}
+
+/* Complete the record of S once the body has been written, and free S.
+   The other arguments are those of warc_write_response_record.  If
+   the body turns out shorter than announced, it is moved to a
+   temporary file and written with warc_write_response_record.
+   Returns true on success, false on error.  */
+bool
+warc_response_stream_finish (struct warc_response_stream *s,
+                             const char *url, const char *timestamp_str,
+                             const char *concurrent_to_uuid,
+                             const ip_address *ip, const char *mime_type,
+                             int response_code,
+                             const char *redirect_location)
+{
+  char block_digest[BASE32_LENGTH(SHA1_DIGEST_SIZE) + 1 + 5];
+  char payload_digest[BASE32_LENGTH(SHA1_DIGEST_SIZE) + 1 + 5];
+  char sha1_res_block[SHA1_DIGEST_SIZE];
+  char sha1_res_payload[SHA1_DIGEST_SIZE];
+  bool have_digests = s->digests != NULL;
+
+  fflush (warc_current_file);
+  fseeko (warc_current_file, 0L, SEEK_END);
+  if (ftello (warc_current_file) - s->block_offset != s->block_size)
+    {
+      off_t payload_offset = s->payload_offset;
+      char buffer[BUFSIZ];
+      size_t n;
+      FILE *body = warc_tempfile ();
+
+      if (!body)
+        {
+          warc_response_stream_abort (s);
+          return false;
+        }
+      fseeko (warc_current_file, s->block_offset, SEEK_SET);
+      while ((n = fread (buffer, 1, sizeof (buffer), warc_current_file)) > 0)
+        fwrite (buffer, 1, n, body);
+      warc_response_stream_abort (s);
+      if (ferror (body))
+        {
+          fclose (body);
+          return false;
+        }
+      return warc_write_response_record (url, timestamp_str,
+                                         concurrent_to_uuid, ip, body,
+                                         payload_offset, mime_type,
+                                         response_code, redirect_location,
+                                         NULL);
+    }
+
+  if (have_digests)
+    {
+      warc_digests_finish (s->digests, sha1_res_block, sha1_res_payload);
+      warc_base32_sha1_digest (sha1_res_block, block_digest,
+                               sizeof (block_digest));
+      warc_base32_sha1_digest (sha1_res_payload, payload_digest,
+                               sizeof (payload_digest));
+      if (fseeko (warc_current_file, s->block_digest_offset, SEEK_SET) != 0
+          || fwrite (block_digest, 1, strlen (block_digest),
+                     warc_current_file) != strlen (block_digest)
+          || fseeko (warc_current_file, s->payload_digest_offset,
+                     SEEK_SET) != 0
+          || fwrite (payload_digest, 1, strlen (payload_digest),
+                     warc_current_file) != strlen (payload_digest))
+        warc_write_ok = false;
+      fseeko (warc_current_file, 0L, SEEK_END);
+    }
+
+  warc_write_end_record ();
+
+  if (warc_write_ok && opt.warc_cdx_enabled)
+    warc_write_cdx_record (url, timestamp_str, mime_type, response_code,
+                           have_digests ? payload_digest : NULL,
+                           redirect_location, s->record_offset,
+                           warc_current_filename, s->uuid);
+
+  xfree (s);
+  return warc_write_ok;
+}
+
 /* Writes a resource or metadata record to the WARC file.
    warc_type  is either "resource" or "metadata",
    resource_uuid  is the uuid of the resource (or NULL),
@@ -1638,6 +3380,18 @@ warc_write_resource_record (const char *resource_uuid, const char *url,
                  const ip_address *ip, const char *content_type, FILE *body,
                  off_t payload_offset)
 {
+#ifdef HAVE_PTHREAD
+  if (warc_writer.running)
+    {
+      struct warc_job *job;
+
+      job = warc_job_new (WARC_JOB_RECORD, url, timestamp_str, resource_uuid,
+                          concurrent_to_uuid, ip, content_type, body,
+                          payload_offset);
+      job->record_type = "resource";
+      return warc_writer_add (job);
+    }
+#endif
   return warc_write_record ("resource",
       resource_uuid, url, timestamp_str, concurrent_to_uuid,
       ip, content_type, body, payload_offset);
@@ -1660,6 +3414,18 @@ warc_write_metadata_record (const char *record_uuid, const char *url,
                  ip_address *ip, const char *content_type, FILE *body,
                  off_t payload_offset)
 {
+#ifdef HAVE_PTHREAD
+  if (warc_writer.running)
+    {
+      struct warc_job *job;
+
+      job = warc_job_new (WARC_JOB_RECORD, url, timestamp_str, record_uuid,
+                          concurrent_to_uuid, ip, content_type, body,
+                          payload_offset);
+      job->record_type = "metadata";
+      return warc_writer_add (job);
+    }
+#endif
   return warc_write_record ("metadata",
       record_uuid, url, timestamp_str, concurrent_to_uuid,
       ip, content_type, body, payload_offset);
@@ -12,11 +12,26 @@ char * warc_timestamp (char *timestamp, size_t timestamp_size);
 
 FILE * warc_tempfile (void);
 
+struct warc_digests;
+struct warc_digests *warc_digests_start (const char *head, size_t head_len);
+void warc_digests_free (struct warc_digests *);
+
+struct warc_response_stream;
+FILE *warc_response_stream_start (const char *url, const char *timestamp_str,
+  const char *concurrent_to_uuid, const ip_address *ip, const char *head,
+  wgint body_size, struct warc_response_stream **stream_ref);
+bool warc_response_stream_finish (struct warc_response_stream *stream,
+  const char *url, const char *timestamp_str, const char *concurrent_to_uuid,
+  const ip_address *ip, const char *mime_type, int response_code,
+  const char *redirect_location);
+void warc_response_stream_abort (struct warc_response_stream *stream);
+
 bool warc_write_request_record (const char *url, const char *timestamp_str,
   const char *concurrent_to_uuid, const ip_address *ip, FILE *body, off_t payload_offset);
 bool warc_write_response_record (const char *url, const char *timestamp_str,
   const char *concurrent_to_uuid, const ip_address *ip, FILE *body, off_t payload_offset,
-  const char *mime_type, int response_code, const char *redirect_location);
+  const char *mime_type, int response_code, const char *redirect_location,
+  struct warc_digests *digests);
 bool warc_write_resource_record (const char *resource_uuid, const char *url,
   const char *timestamp_str, const char *concurrent_to_uuid, const ip_address *ip,
   const char *content_type, FILE *body, off_t payload_offset);
@@ -24,4 +39,6 @@ bool warc_write_metadata_record (const char *record_uuid, const char *url,
   const char *timestamp_str, const char *concurrent_to_uuid, ip_address *ip,
   const char *content_type, FILE *body, off_t payload_offset);
 
+int warc_sha1_stream_with_payload (FILE *, void *, void *, off_t);
+
 #endif /* WARC_H */
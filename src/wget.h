@@ -58,6 +58,11 @@ as that of the covered work.  */
 # define HAVE_HSTS /* There's no sense in enabling HSTS without SSL */
 #endif
 
+/* Can any Content-Encoding be decoded? */
+#if defined HAVE_LIBZ || defined HAVE_LIBBROTLIDEC || defined HAVE_LIBZSTD
+# define HAVE_COMPRESSION
+#endif
+
 /* `gettext (FOO)' is long to write, so we use `_(FOO)'.  If NLS is
    unavailable, _(STRING) simply returns STRING.  */
 #include "gettext.h"
@@ -153,6 +158,8 @@ typedef int64_t wgint;
 #  undef _Noreturn
 #endif
 #include "xalloc.h"
+/* Allocations are traced by subsystem with --enable-memory-accounting.  */
+#include "memacct.h"
 
 /* Likewise for logging functions.  */
 #include "log.h"
@@ -280,7 +287,7 @@ typedef enum
   METALINK_PARSE_ERROR, METALINK_RETR_ERROR,
   METALINK_CHKSUM_ERROR, METALINK_SIG_ERROR, METALINK_MISSING_RESOURCE,
   RETR_WITH_METALINK,
-  METALINK_SIZE_ERROR
+  METALINK_SIZE_ERROR, RETRYLATER
 } uerr_t;
 
 /* 2005-02-19 SMS.
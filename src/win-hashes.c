@@ -85,41 +85,106 @@ Not hash. We use native SSPI.
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <windows.h>
 #include <wincrypt.h>
+#include <bcrypt.h>
 
 #include "win-hashes.h"
 
 /* Ref:
-    https://docs.microsoft.com/en-us/windows/win32/api/wincrypt/nf-wincrypt-cryptacquirecontexta
-    https://docs.microsoft.com/en-us/windows/win32/seccrypto/cryptographic-provider-types
-
-PROV_RSA_AES Hashing:
-MD2
-MD4
-MD5
-SHA-1
-SHA-2 (SHA-256, SHA-384, and SHA-512)
+    https://docs.microsoft.com/en-us/windows/win32/seccng/cng-algorithm-identifiers
+    https://docs.microsoft.com/en-us/windows/win32/seccng/creating-a-hash-with-cng
+
+CNG replaces the CryptoAPI (CryptAcquireContext/CryptCreateHash) that
+was used here before.  An algorithm provider is opened once per
+algorithm and kept for the whole run.  Since Windows 8 providers can
+hand out reusable hash objects, which are reset by BCryptFinishHash;
+one of those is kept per algorithm, so that hashing many small buffers
+(metalink pieces, WARC records) doesn't pay any setup.
+
+The ALG_ID of the CryptoAPI is kept as algorithm identifier so that
+the macros of win-hashes.h can stay as they are.
 */
+struct hash_alg {
+    ALG_ID id;
+    LPCWSTR name;
+    ULONG size;                 /* digest size */
+    bool opened;
+    BCRYPT_ALG_HANDLE hAlg;
+    ULONG flags;                /* flags hAlg was opened with */
+    BCRYPT_HASH_HANDLE spare;   /* reusable hash object, not in use */
+};
+
+static struct hash_alg hash_algs[] = {
+    { CALG_MD2,     BCRYPT_MD2_ALGORITHM,       MD2_DIGEST_SIZE },
+    { CALG_MD4,     BCRYPT_MD4_ALGORITHM,       MD4_DIGEST_SIZE },
+    { CALG_MD5,     BCRYPT_MD5_ALGORITHM,       MD5_DIGEST_SIZE },
+    { CALG_SHA1,    BCRYPT_SHA1_ALGORITHM,      SHA1_DIGEST_SIZE },
+    { CALG_SHA_256, BCRYPT_SHA256_ALGORITHM,    SHA256_DIGEST_SIZE },
+    { CALG_SHA_384, BCRYPT_SHA384_ALGORITHM,    SHA384_DIGEST_SIZE },
+    { CALG_SHA_512, BCRYPT_SHA512_ALGORITHM,    SHA512_DIGEST_SIZE },
+};
+
+static struct hash_alg * hash_alg_open(ALG_ID id) {
+    struct hash_alg *alg;
+    size_t i;
+
+    for (i = 0; i < sizeof(hash_algs) / sizeof(hash_algs[0]); i++) {
+        alg = &hash_algs[i];
+        if (alg->id != id) continue;
+        if (!alg->opened) {
+            alg->opened = true;
+            alg->flags = BCRYPT_HASH_REUSABLE_FLAG;
+            if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&alg->hAlg, alg->name, NULL, alg->flags))) {
+                // before Windows 8
+                alg->flags = 0;
+                if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&alg->hAlg, alg->name, NULL, alg->flags))) {
+                    alg->hAlg = NULL;
+                }
+            }
+        }
+        return alg->hAlg ? alg : NULL;
+    }
+    return NULL;
+}
+
 void hash_init(ALG_ID id, CRYPT_CTX *ctx) {
-    if (CryptAcquireContext(&ctx->hCryptProv, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT | CRYPT_SILENT)) {
-        CryptCreateHash(ctx->hCryptProv, id, 0, 0, &ctx->hHash);
+    struct hash_alg *alg = hash_alg_open(id);
+
+    ctx->alg = alg;
+    ctx->hHash = NULL;
+    if (!alg) return;
+
+    if (alg->spare) {
+        ctx->hHash = alg->spare;
+        alg->spare = NULL;
+    }
+    // let CNG allocate the hash object (Windows 7 and later)
+    else if (!BCRYPT_SUCCESS(BCryptCreateHash(alg->hAlg, &ctx->hHash, NULL, 0, NULL, 0, alg->flags))) {
+        ctx->hHash = NULL;
     }
 }
 
 void hash_update(CRYPT_CTX *ctx, const unsigned char *data, unsigned int len) {
-    CryptHashData(ctx->hHash, data, len, 0);
+    if (ctx->hHash) BCryptHashData(ctx->hHash, (PUCHAR) data, len, 0);
 }
 
 void * hash_final(CRYPT_CTX *ctx, unsigned char *digest) {
-    unsigned long length;
+    struct hash_alg *alg = ctx->alg;
+
+    if (!ctx->hHash) return digest;
+
+    BCryptFinishHash(ctx->hHash, digest, alg->size, 0);
 
-    // https://docs.microsoft.com/en-us/windows/win32/api/wincrypt/nf-wincrypt-cryptgethashparam
-    if (CryptGetHashParam(ctx->hHash, HP_HASHVAL, NULL, &length, 0)) { // <-- finish and get result length
-        CryptGetHashParam(ctx->hHash, HP_HASHVAL, digest, &length, 0);
+    // a reusable object is ready for the next hash now
+    if ((alg->flags & BCRYPT_HASH_REUSABLE_FLAG) && !alg->spare) {
+        alg->spare = ctx->hHash;
     }
-    if (ctx->hHash) CryptDestroyHash(ctx->hHash);
-    if (ctx->hCryptProv) CryptReleaseContext(ctx->hCryptProv, 0);
+    else {
+        BCryptDestroyHash(ctx->hHash);
+    }
+    ctx->hHash = NULL;
 
     return digest;
 }
@@ -133,6 +198,8 @@ void * hash_buffer(ALG_ID id, const char *buffer, size_t len, unsigned char *dig
     return hash_final(&ctx, digest);
 }
 
+#ifndef WINHASHES_BENCHMARK
+
 // the following needs gnulib
 
 #include "af_alg.h"
@@ -177,3 +244,81 @@ process_partial_block:
     free(buffer);
     return 0;
 }
+
+#else /* WINHASHES_BENCHMARK */
+
+/* Throughput of the CNG engine against the CryptoAPI one it replaced,
+   for SHA-1 and SHA-256, on many small buffers and on one large one:
+
+     gcc -O2 -DWINHASHES_BENCHMARK -o win-hashes-bench win-hashes.c -lbcrypt
+     win-hashes-bench
+*/
+
+static void * capi_hash_buffer(ALG_ID id, const char *buffer, size_t len, unsigned char *digest) {
+    HCRYPTPROV hCryptProv;
+    HCRYPTHASH hHash = 0;
+    DWORD length = 64;
+
+    if (CryptAcquireContext(&hCryptProv, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT | CRYPT_SILENT)) {
+        if (CryptCreateHash(hCryptProv, id, 0, 0, &hHash)) {
+            CryptHashData(hHash, (const BYTE *) buffer, len, 0);
+            CryptGetHashParam(hHash, HP_HASHVAL, digest, &length, 0);
+            CryptDestroyHash(hHash);
+        }
+        CryptReleaseContext(hCryptProv, 0);
+    }
+    return digest;
+}
+
+static double now(void) {
+    LARGE_INTEGER freq, count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double) count.QuadPart / freq.QuadPart;
+}
+
+static void bench(const char *label, ALG_ID id,
+                  void * (*fn)(ALG_ID, const char *, size_t, unsigned char *),
+                  const char *buffer, size_t len, int rounds) {
+    unsigned char digest[64];
+    double start, secs;
+    int i;
+
+    start = now();
+    for (i = 0; i < rounds; i++) {
+        fn(id, buffer, len, digest);
+    }
+    secs = now() - start;
+    printf("%-26s %9lu bytes x %6d: %8.1f MB/s, %7.2f us/call\n", label, (unsigned long) len, rounds,
+           (double) len * rounds / secs / (1024 * 1024), secs * 1e6 / rounds);
+}
+
+int main(void) {
+    static const struct { const char *name; ALG_ID id; } algs[] = {
+        { "sha1", CALG_SHA1 }, { "sha256", CALG_SHA_256 },
+    };
+    size_t sizes[] = { 1024, 16 * 1024, 64 * 1024 * 1024 };
+    char label[32];
+    char *buffer;
+    size_t i, j;
+
+    buffer = malloc(sizes[2]);
+    if (!buffer) return 1;
+    for (i = 0; i < sizes[2]; i++) buffer[i] = (char) (i * 31);
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 3; j++) {
+            int rounds = j < 2 ? 20000 : 4;
+            snprintf(label, sizeof(label), "%s CryptoAPI", algs[i].name);
+            bench(label, algs[i].id, capi_hash_buffer, buffer, sizes[j], rounds);
+            snprintf(label, sizeof(label), "%s CNG", algs[i].name);
+            bench(label, algs[i].id, hash_buffer, buffer, sizes[j], rounds);
+        }
+    }
+
+    free(buffer);
+    return 0;
+}
+
+#endif /* WINHASHES_BENCHMARK */
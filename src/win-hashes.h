@@ -34,8 +34,10 @@ as that of the covered work.  */
 #define __WIN_HASHES_H__
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <windows.h>
 #include <wincrypt.h>
+#include <bcrypt.h>
 
 #define hash_block  hash_update
 
@@ -84,7 +86,7 @@ as that of the covered work.  */
 #define sha256_finish_ctx(ctx, hash)            hash_final(ctx, hash)
 #define sha256_buffer(buff, len, hash)          hash_buffer(CALG_SHA_256, buff, len, hash)
 
-#define SHA384_DIGEST_SIZE  46
+#define SHA384_DIGEST_SIZE  48
 #define sha384_ctx          _CRYPT_CTX
 #define sha384_init_ctx(ctx)                    hash_init(CALG_SHA_384, ctx)
 #define sha384_process_bytes(buff, len, ctx)    hash_update(ctx, buff, len)
@@ -102,8 +104,8 @@ as that of the covered work.  */
 
 
 typedef struct _CRYPT_CTX {
-    HCRYPTPROV hCryptProv;
-    HCRYPTHASH hHash;
+    struct hash_alg *alg;       /* win-hashes.c */
+    BCRYPT_HASH_HANDLE hHash;
 } CRYPT_CTX, *P_CRYPT_CTX;
 
 void hash_init(ALG_ID id, CRYPT_CTX *ctx);
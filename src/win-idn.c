@@ -37,7 +37,7 @@ as that of the covered work.  */
 */
 #define IDN_MAX_LENGTH 254 // https://en.wikipedia.org/wiki/Hostname
 
-char *idn_encode(const char *encoding, const char *host) {
+static char *idn_to_ascii(const char *encoding, const char *host) {
     wchar_t *host_w = NULL;
     wchar_t *punycode_w = NULL;
     char *punycode = NULL;
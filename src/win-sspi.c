@@ -126,7 +126,12 @@ char *sspi_strerror(SECURITY_STATUS err) {
     char *txt;
     static char hex[11] = {0};
     switch (err) {
+    ERR2TXT(CERT_E_CHAINING);
+    ERR2TXT(CERT_E_CN_NO_MATCH);
+    ERR2TXT(CERT_E_EXPIRED);
     ERR2TXT(CERT_E_INVALID_NAME);
+    ERR2TXT(CERT_E_UNTRUSTEDROOT);
+    ERR2TXT(CERT_E_WRONG_USAGE);
     ERR2TXT(CERT_E_REVOKED);
     ERR2TXT(CRYPT_E_REVOKED);
     ERR2TXT(CRYPT_E_NO_REVOCATION_CHECK);
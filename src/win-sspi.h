@@ -32,7 +32,8 @@ as that of the covered work.  */
 
 /* SSPI declarations for using Windows encryption/decryption
     For: https, ftps; NTLM
-    Todo: Digest, Kerberos
+    Todo: Digest
+    Kerberos: through Negotiate, see http-ntlm-ms.c
     4 types on Win:
     https://docs.microsoft.com/en-us/windows/win32/secauthn/ssp-packages-provided-by-microsoft
     HTTP/1.1 Authentication:
@@ -296,6 +296,9 @@ struct transport_implementation {
   int (*peeker) (int, char *, int, void *, double);
   const char *(*errstr) (int, void *);
   void (*closer) (int, void *);
+  int (*nb_reader) (int, char *, int, void *, int *);
+  int (*nb_writer) (int, char *, int, void *, int *);
+  bool (*pending) (int, void *);
 };
 ```
 
@@ -318,6 +321,9 @@ void fd_close (int);
 `fd_peek`   ==> peeker; poll_internal, sock_peek;
 `fd_errstr` ==> errstr;
 `fd_close`  ==> closer;
+`fd_read_nb`  ==> nb_reader; sock_transfer_nb;
+`fd_write_nb` ==> nb_writer (none here: poller, then writer);
+`fd_dispatch` ==> pending, for data already received;
 
 */
 
@@ -335,7 +341,9 @@ void fd_close (int);
 #include "win-sspi.h"
 
 #include "connect.h"
+#include "hash.h"
 #include "log.h"
+#include "ptimer.h"
 #include "utils.h"
 
 
@@ -457,18 +465,55 @@ static int ez_socket_recv(SOCKET socket, EZ_BUFF *buff, int flags) {
 typedef struct _WINTLS_TRANSPORT_CONTEXT {
     SOCKET      socket;
     SEC_CHAR    *hostname;
-    CredHandle  hCreds;
+    PCredHandle pCreds;     // shared, see session_credentials()
     CtxtHandle  hContext;
     DWORD       dwSSPIFlags;
-    EZ_BUFF     rcv_buff;
-    EZ_BUFF     dec_buff;
+    EZ_BUFF     rcv_buff;   // received records, decrypted in place
+    int         enc_start;  // rcv_buff.data[enc_start, used) is still encrypted
+    char        *plain;     // decrypted data not read yet, inside rcv_buff
+    int         plain_len;
+    EZ_BUFF     send_buff;  // one record: header, application data, trailer
+    int         send_pending;   // application data waiting in send_buff
     HSK_NEGO_STAGE  stage;
     bool            can_recv;
     SecPkgContext_StreamSizes stream_sizes;
     int         err_no;
+    struct ptimer *timer;   // started by each timed operation
+    double      timeout;    // seconds the current operation may take, 0 = forever
+    bool        offer_h2;   // offer HTTP/2 through ALPN in the client hello
 } WINTLS_TRANSPORT_CONTEXT, *P_WINTLS_TRANSPORT_CONTEXT;
 
 
+/* Wait for the socket to become readable within what is left of the
+   current operation's timeout.  This replaces running whole
+   operations in a thread that gets killed on timeout.  Once the time
+   is up, the socket is still checked without waiting, which is all
+   non-blocking reads do (see WINTLS_NO_WAIT).  */
+static bool wintls_wait_readable(WINTLS_TRANSPORT_CONTEXT *ctx) {
+    double left;
+    int ret;
+
+    if (ctx->timeout <= 0) return true;
+
+    left = ctx->timeout - ptimer_read(ctx->timer);
+    ret = select_fd(ctx->socket, left > 0 ? left : 0, WAIT_FOR_READ);
+    if (ret == 0) errno = ETIMEDOUT;
+    if (ret <= 0) {
+        ctx->err_no = errno;
+        return false;
+    }
+    return true;
+}
+
+static void wintls_start_timer(WINTLS_TRANSPORT_CONTEXT *ctx, double timeout) {
+    ctx->timeout = timeout;
+    if (timeout > 0) {
+        if (!ctx->timer) ctx->timer = ptimer_new();
+        ptimer_reset(ctx->timer);
+    }
+}
+
+
 // https://docs.microsoft.com/en-us/windows/win32/seccrypto/alg-id
 // https://github.com/curl/curl/blob/master/docs/CIPHERS.md#schannel
 static bool set_ciphers(SCHANNEL_CRED *schannel_cred, char *ciphers) {
@@ -651,13 +696,10 @@ static SECURITY_STATUS CreateCredentials(PCredHandle phCreds) {
         logprintf(LOG_NOTQUIET, "WinTLS: unsupported 'secure-protocol' value!\n");
         break;
     }
-    // WinCE is out of date
-    if (opt.check_cert == CHECK_CERT_ON) {
-        schannel_cred.dwFlags = SCH_CRED_AUTO_CRED_VALIDATION | SCH_CRED_REVOCATION_CHECK_CHAIN | SCH_CRED_IGNORE_REVOCATION_OFFLINE;
-    }
-    else { // --no-check-certificate
-        schannel_cred.dwFlags = SCH_CRED_MANUAL_CRED_VALIDATION;
-    }
+    // The server certificate is verified by ssl_check_certificate(),
+    // which reuses recent results instead of building the chain on
+    // every handshake, and warns under `--no-check-certificate'
+    schannel_cred.dwFlags = SCH_CRED_MANUAL_CRED_VALIDATION;
 
     // --ciphers overrides everything
     if (opt.tls_ciphers_string) {
@@ -687,7 +729,7 @@ CLEANUP:
     WinCE? Out of date!
 
 ALPN (Application Layer Protocol Negotiation):
-HTTP/2;
+HTTP/2, offered in the client hello when ctx->offer_h2;
 since Windows 8.1 and Windows Server 2012 R2.
 */
 static SECURITY_STATUS PerformHandshake(WINTLS_TRANSPORT_CONTEXT *ctx) {
@@ -704,6 +746,13 @@ static SECURITY_STATUS PerformHandshake(WINTLS_TRANSPORT_CONTEXT *ctx) {
     SecBuffer       InBuffers[2];
     SecBufferDesc   InBufferDesc;
     SecBuffer       ExtraData;
+    //
+    SecBufferDesc   *pAlpn = NULL;
+#ifdef SECBUFFER_APPLICATION_PROTOCOLS
+    unsigned char   alpn[32];
+    SecBuffer       AlpnBuffer;
+    SecBufferDesc   AlpnBufferDesc;
+#endif
     //
     INT             i;
 
@@ -721,11 +770,29 @@ static SECURITY_STATUS PerformHandshake(WINTLS_TRANSPORT_CONTEXT *ctx) {
 
     if (ctx->stage > HSK_CLIENT_HELLO) goto HANDSHAKE_LOOP;
 
+#ifdef SECBUFFER_APPLICATION_PROTOCOLS
+    // ALPN: SEC_APPLICATION_PROTOCOLS with a single list, in wire format
+    if (ctx->offer_h2) {
+        static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+        unsigned long list_size = sizeof(unsigned long) + sizeof(unsigned short) + sizeof(protocols) - 1;
+        unsigned long ext = SecApplicationProtocolNegotiationExt_ALPN;
+        unsigned short protocols_size = sizeof(protocols) - 1;
+        cbData = 0;
+        memcpy(alpn + cbData, &list_size, sizeof(list_size));           cbData += sizeof(list_size);
+        memcpy(alpn + cbData, &ext, sizeof(ext));                       cbData += sizeof(ext);
+        memcpy(alpn + cbData, &protocols_size, sizeof(protocols_size)); cbData += sizeof(protocols_size);
+        memcpy(alpn + cbData, protocols, protocols_size);               cbData += protocols_size;
+        InitSecBuffer(&AlpnBuffer, cbData, alpn, SECBUFFER_APPLICATION_PROTOCOLS);
+        InitSecBufferDesc(&AlpnBufferDesc, 1, &AlpnBuffer);
+        pAlpn = &AlpnBufferDesc;
+    }
+#endif
+
     // initiate client hello
     Status = g_pSSPI->InitializeSecurityContext(
-                    &ctx->hCreds, NULL, ctx->hostname, ctx->dwSSPIFlags,
+                    ctx->pCreds, NULL, ctx->hostname, ctx->dwSSPIFlags,
                     0, 0,
-                    NULL,
+                    pAlpn,
                     0,
                     &ctx->hContext, &OutBufferDesc, &dwSSPIOutFlags, &tsExpiry);
     //
@@ -770,6 +837,10 @@ HANDSHAKE_LOOP:
     {
         // need read server response
         if (ctx->can_recv) {
+            if (!wintls_wait_readable(ctx)) {
+                Status = SEC_E_INTERNAL_ERROR;
+                break;
+            }
             i = ez_socket_recv(ctx->socket, rcv_buff, 0);
             ctx->err_no = errno;
             if (i <= 0) {
@@ -783,7 +854,7 @@ HANDSHAKE_LOOP:
         InitSecBufferDesc(&InBufferDesc, 2, InBuffers);
 
         Status = g_pSSPI->InitializeSecurityContext(
-                        &ctx->hCreds, &ctx->hContext, ctx->hostname, ctx->dwSSPIFlags,
+                        ctx->pCreds, &ctx->hContext, ctx->hostname, ctx->dwSSPIFlags,
                         0, 0,
                         &InBufferDesc,
                         0,
@@ -910,7 +981,7 @@ static SECURITY_STATUS DisconnectFromServer(WINTLS_TRANSPORT_CONTEXT *ctx) {
     InitSecBufferDesc(&OutBufferDesc, 1, OutBuffers);
 
     Status = g_pSSPI->InitializeSecurityContext(
-                    &ctx->hCreds, &ctx->hContext, NULL, ctx->dwSSPIFlags,
+                    ctx->pCreds, &ctx->hContext, NULL, ctx->dwSSPIFlags,
                     0, SECURITY_NATIVE_DREP,
                     NULL,
                     0,
@@ -938,295 +1009,328 @@ static SECURITY_STATUS DisconnectFromServer(WINTLS_TRANSPORT_CONTEXT *ctx) {
 }
 
 
-/* operate with timeout */
+/* operate with timeout
 
-typedef int (*ssl_fn_t)(WINTLS_TRANSPORT_CONTEXT *, char *, int);
+   Every recv() is preceded by wintls_wait_readable(), which bounds the
+   wait by the time left for the whole operation, so no helper thread
+   is needed.  */
 
-// Handshake callback args
-typedef struct _WINTLS_HSK_CB_ARGS {
-    WINTLS_TRANSPORT_CONTEXT    *ctx;
-    SECURITY_STATUS             retval;
-} WINTLS_HSK_CB_ARGS, *P_WINTLS_HSK_CB_ARGS;
-
-static void perform_handshake_with_timeout_callback(void *arg) {
-    WINTLS_HSK_CB_ARGS *args = (WINTLS_HSK_CB_ARGS*)arg;
-    args->retval = PerformHandshake(args->ctx);
-}
+typedef int (*ssl_fn_t)(WINTLS_TRANSPORT_CONTEXT *, char *, int);
 
 static bool perform_handshake_with_timeout(WINTLS_TRANSPORT_CONTEXT *ctx, double timeout) {
-    WINTLS_HSK_CB_ARGS args;
+    SECURITY_STATUS status;
 
     ctx->err_no = 0;
-    args.ctx = ctx;
-    if (run_with_timeout(timeout, perform_handshake_with_timeout_callback, &args)) {
+    wintls_start_timer(ctx, timeout);
+    status = PerformHandshake(ctx);
+    ctx->timeout = 0;
+    if (status != SEC_E_OK && ctx->err_no == ETIMEDOUT) {
         DEBUGP(("WinTLS: timeout!\n"));
-        ctx->err_no = ETIMEDOUT;
         return false;
     }
 
-    return args.retval == SEC_E_OK;
-}
-
-// Read/Peek callback args
-typedef struct _WINTLS_RP_CB_ARGS {
-    WINTLS_TRANSPORT_CONTEXT *ctx;
-    ssl_fn_t func;
-    char    *buf;
-    int     bufsize;
-    int     retval;
-} WINTLS_RP_CB_ARGS, *P_WINTLS_RP_CB_ARGS;
-
-static void wintls_read_peek_callback(void *arg) {
-    WINTLS_RP_CB_ARGS *args = (WINTLS_RP_CB_ARGS *) arg;
-    args->retval = args->func(args->ctx, args->buf, args->bufsize);
+    return status == SEC_E_OK;
 }
 
 static int wintls_read_peek(int fd, char *buf, int bufsize, void *arg, double timeout, ssl_fn_t func) {
-    WINTLS_RP_CB_ARGS args;
+    WINTLS_TRANSPORT_CONTEXT *ctx = (WINTLS_TRANSPORT_CONTEXT*) arg;
+    int ret;
 
     if (timeout == -1) timeout = opt.read_timeout; // fd_read/fd_peek defines `-1`
 
-    args.ctx = (WINTLS_TRANSPORT_CONTEXT*) arg;
-    args.func = func;
-    args.buf = buf;
-    args.bufsize = bufsize;
-
-    args.ctx->err_no = 0;
+    // the peer may be waiting for what we have gathered
+    if (schannel_flush(ctx) < 0) return -1;
 
-    if (run_with_timeout(timeout, wintls_read_peek_callback, &args)) {
+    ctx->err_no = 0;
+    wintls_start_timer(ctx, timeout);
+    ret = func(ctx, buf, bufsize);
+    ctx->timeout = 0;
+    if (ret < 0 && ctx->err_no == ETIMEDOUT) {
         DEBUGP(("WinTLS: timeout!\n"));
-        args.ctx->err_no = ETIMEDOUT;
         return -1;
     }
 
-    return args.retval;
+    return ret;
 }
 
 // #endif /* OPENSSL_RUN_WITHTIMEOUT */
 
 /* Part 2: data exchange using the secure connection */
 
+static SECURITY_STATUS query_stream_sizes(WINTLS_TRANSPORT_CONTEXT *ctx) {
+    SECURITY_STATUS Status = SEC_E_OK;
+
+    if (ctx->stream_sizes.cbMaximumMessage == 0) {
+        Status = g_pSSPI->QueryContextAttributes(&ctx->hContext, SECPKG_ATTR_STREAM_SIZES, &ctx->stream_sizes);
+        if (Status != SEC_E_OK) {
+            logprintf(LOG_NOTQUIET, "error reading SECPKG_ATTR_STREAM_SIZES\n");
+        }
+    }
+    return Status;
+}
+
 // socket layer
-static int schannel_send(WINTLS_TRANSPORT_CONTEXT *ctx, char *buf, int len) {
-    int n;
-    EZ_BUFF SendBuff = {0};
+/* Encrypt the data gathered in ctx->send_buff as one record and send
+   it.  Returns 0 on success, -1 on failure.  */
+static int schannel_flush(WINTLS_TRANSPORT_CONTEXT *ctx) {
+    int n, sent, ret;
     SECURITY_STATUS Status;
     SecBufferDesc   Message;
     SecBuffer       Buffers[4];
     //
     SecPkgContext_StreamSizes *pStreamSizes;
+    char *data;
+
+    if (ctx->send_pending == 0) return 0;
 
     ctx->err_no = 0;
 
     pStreamSizes = &ctx->stream_sizes;
-    // get max decryption buffer size
-    if (pStreamSizes->cbMaximumMessage == 0) {
-        Status = g_pSSPI->QueryContextAttributes(&ctx->hContext, SECPKG_ATTR_STREAM_SIZES, pStreamSizes);
-        if (Status != SEC_E_OK) {
-            logprintf(LOG_NOTQUIET, "error reading SECPKG_ATTR_STREAM_SIZES\n");
-            return Status;
-        }
-    }
-
-    n = pStreamSizes->cbHeader + pStreamSizes->cbMaximumMessage + pStreamSizes->cbTrailer;
+    data = ctx->send_buff.data;
 
-    if (!ez_buff_space(&SendBuff, n)) return 0;
-
-    InitSecBuffer(&Buffers[0], pStreamSizes->cbHeader, SendBuff.data, SECBUFFER_STREAM_HEADER);
-    InitSecBuffer(&Buffers[1], len, SendBuff.data + pStreamSizes->cbHeader, SECBUFFER_DATA);
-    InitSecBuffer(&Buffers[2], pStreamSizes->cbTrailer, SendBuff.data + pStreamSizes->cbHeader + len, SECBUFFER_STREAM_TRAILER);
+    InitSecBuffer(&Buffers[0], pStreamSizes->cbHeader, data, SECBUFFER_STREAM_HEADER);
+    InitSecBuffer(&Buffers[1], ctx->send_pending, data + pStreamSizes->cbHeader, SECBUFFER_DATA);
+    InitSecBuffer(&Buffers[2], pStreamSizes->cbTrailer, data + pStreamSizes->cbHeader + ctx->send_pending, SECBUFFER_STREAM_TRAILER);
     InitSecBuffer(&Buffers[3], 0, NULL, SECBUFFER_EMPTY);
     InitSecBufferDesc(&Message, 4, Buffers);
 
-    memcpy(Buffers[1].pvBuffer, buf, len);
+    ctx->send_pending = 0;
 
     Status = g_pSSPI->EncryptMessage(&ctx->hContext, 0, &Message, 0);
     if (FAILED(Status)) {
         logprintf(LOG_NOTQUIET, "error: EncryptMessage: %#08X\n", Status);
-        n = 0;
-        goto CLEANUP;
+        ctx->err_no = EIO;
+        return -1;
     }
 
     n = Buffers[0].cbBuffer + Buffers[1].cbBuffer + Buffers[2].cbBuffer;
     DEBUGP(("WinTLS: encrypted data len: %d\n", n));
 
-    n = send(ctx->socket, SendBuff.data, n, 0);
-    ctx->err_no = errno;
-    DEBUGP(("WinTLS: sent encrypted data len: %d\n", n));
-    if (n == SOCKET_ERROR || n == 0) {
-        logprintf(LOG_NOTQUIET, "error send encrypted data: %d\n", WSAGetLastError());
+    // the header, data and trailer are contiguous
+    for (sent = 0; sent < n; sent += ret) {
+        ret = send(ctx->socket, data + sent, n - sent, 0);
+        ctx->err_no = errno;
+        if (ret == SOCKET_ERROR || ret == 0) {
+            logprintf(LOG_NOTQUIET, "error send encrypted data: %d\n", WSAGetLastError());
+            return -1;
+        }
     }
-    else {
-        ctx->can_recv = true;
+    DEBUGP(("WinTLS: sent encrypted data len: %d\n", n));
+    ctx->can_recv = true;
+
+    return 0;
+}
+
+/* Gather LEN bytes of application data into the send buffer, sending
+   a record each time it fills up.  What is left over goes out with the
+   next write, or at the latest before anything is read from the
+   connection, so a request's headers and body share records.  */
+static int schannel_send(WINTLS_TRANSPORT_CONTEXT *ctx, char *buf, int len) {
+    int n, done;
+    SecPkgContext_StreamSizes *pStreamSizes;
+
+    pStreamSizes = &ctx->stream_sizes;
+
+    for (done = 0; done < len; done += n) {
+        n = pStreamSizes->cbMaximumMessage - ctx->send_pending;
+        if (n > len - done) n = len - done;
+        memcpy(ctx->send_buff.data + pStreamSizes->cbHeader + ctx->send_pending, buf + done, n);
+        ctx->send_pending += n;
+        if (ctx->send_pending == (int) pStreamSizes->cbMaximumMessage
+            && schannel_flush(ctx) < 0) {
+            return -1;
+        }
     }
 
-CLEANUP:
-    ez_buff_free(&SendBuff);
-    return n;
+    return len;
 }
 
 static int schannel_write(WINTLS_TRANSPORT_CONTEXT *ctx, char *buf, int len) {
     return schannel_send(ctx, buf, len);
 }
 
-static SECURITY_STATUS decrypt_data(WINTLS_TRANSPORT_CONTEXT *ctx) {
+/* The receive buffer holds this many records of maximal size, so that
+   one recv() can usually bring in several of them.  */
+#define SCHANNEL_RECV_RECORDS   4
+
+/* Allocate the receive and send buffers at their final size after the
+   handshake.  Records are decrypted in place in the former, and read
+   straight out of it; the latter holds a single record.  */
+static bool setup_buffers(WINTLS_TRANSPORT_CONTEXT *ctx) {
+    SecPkgContext_StreamSizes *sizes = &ctx->stream_sizes;
+    int size;
+
+    if (query_stream_sizes(ctx) != SEC_E_OK) return false;
+
+    size = sizes->cbHeader + sizes->cbMaximumMessage + sizes->cbTrailer;
+    if (!ez_buff_space(&ctx->send_buff, size)) return false;
+
+    size *= SCHANNEL_RECV_RECORDS;
+    if (ctx->rcv_buff.size < size) {
+        return ez_buff_space(&ctx->rcv_buff, size - ctx->rcv_buff.used);
+    }
+    return true;
+}
+
+/* Move the undecrypted tail of rcv_buff to its start, making room for
+   recv().  Only done once all decrypted data has been read.  */
+static void compact_recv_buffer(WINTLS_TRANSPORT_CONTEXT *ctx) {
+    EZ_BUFF *rcv_buff = &ctx->rcv_buff;
+
+    if (ctx->enc_start > 0) {
+        rcv_buff->used -= ctx->enc_start;
+        memmove(rcv_buff->data, rcv_buff->data + ctx->enc_start, rcv_buff->used);
+        ctx->enc_start = 0;
+    }
+}
+
+/* Whether rcv_buff holds a whole record that hasn't been decrypted.
+   `5 bytes Tls header` + `message`
+   https://en.wikipedia.org/wiki/Transport_Layer_Security#TLS_record  */
+static bool have_whole_record(const WINTLS_TRANSPORT_CONTEXT *ctx) {
+    const unsigned char *p = (const unsigned char *) ctx->rcv_buff.data + ctx->enc_start;
+    int avail = ctx->rcv_buff.used - ctx->enc_start;
+
+    return avail >= 5 && avail >= 5 + (p[3] << 8 | p[4]);
+}
+
+/* Decrypt the record at enc_start in place, pointing ctx->plain at
+   its data.  */
+static SECURITY_STATUS decrypt_record(WINTLS_TRANSPORT_CONTEXT *ctx) {
     SECURITY_STATUS Status;
     EZ_BUFF *rcv_buff;
-    EZ_BUFF *dec_buff;
-    int i, dec_n;
+    int i;
     SecBufferDesc   Message;
     SecBuffer       Buffers[4];
     SecBuffer       *pDataBuffer;
     SecBuffer       *pExtraBuffer;
     //
     rcv_buff = &ctx->rcv_buff;
-    dec_buff = &ctx->dec_buff;
-
-    do {
-        InitSecBuffer(&Buffers[0], rcv_buff->used, rcv_buff->data, SECBUFFER_DATA);
-        InitSecBuffer(&Buffers[1], 0, NULL, SECBUFFER_EMPTY);
-        InitSecBuffer(&Buffers[2], 0, NULL, SECBUFFER_EMPTY);
-        InitSecBuffer(&Buffers[3], 0, NULL, SECBUFFER_EMPTY);
-        InitSecBufferDesc(&Message, 4, Buffers);
-        //
-        DEBUGP(("WinTLS: rcv_buff total/used/left %d/%d/%d\n", rcv_buff->size, rcv_buff->used, rcv_buff->size - rcv_buff->used));
-        DEBUGP(("WinTLS: dec_buff total/used/left %d/%d/%d\n", dec_buff->size, dec_buff->used, dec_buff->size - dec_buff->used));
-        //
-        Status = g_pSSPI->DecryptMessage(&ctx->hContext, &Message, 0, NULL);
-        //
-        DEBUGP(("WinTLS: Status %#08X\n", Status));
-        //
-        if (Status != SEC_E_OK && Status != SEC_I_RENEGOTIATE && Status != SEC_I_CONTEXT_EXPIRED) {
-            break;
-        }
-        //
-        // SEC_E_OK or SEC_I_RENEGOTIATE or SEC_I_CONTEXT_EXPIRED
-        pDataBuffer  = NULL;
-        pExtraBuffer = NULL;
-        for (i = 1; i < 4; i++) {
-            if (pDataBuffer == NULL && Buffers[i].BufferType == SECBUFFER_DATA) {
-                pDataBuffer = &Buffers[i];
-            }
-            else if (pExtraBuffer == NULL && Buffers[i].BufferType == SECBUFFER_EXTRA) {
-                pExtraBuffer = &Buffers[i];
-            }
-        }
-        if (pDataBuffer && pDataBuffer->cbBuffer > 0) {
-            if (!ez_buff_space(dec_buff, pDataBuffer->cbBuffer + SCHANNEL_BUFFER_FREE_SIZE)) {
-                break;
-            }
-            memcpy(dec_buff->data + dec_buff->used, pDataBuffer->pvBuffer, pDataBuffer->cbBuffer);
-            dec_buff->used += pDataBuffer->cbBuffer;
-            dec_n = pDataBuffer->cbBuffer;
-        }
-        else {
-            dec_n = 0;
-            ctx->can_recv = false; // <--end-- ???
-        }
-        if (pExtraBuffer) {
-            memmove(rcv_buff->data, pExtraBuffer->pvBuffer, pExtraBuffer->cbBuffer);
-            rcv_buff->used = pExtraBuffer->cbBuffer;
-            //
-            // no need to FreeContextBuffer? SDK example does not.
-            // The encrypted message is decrypted in place, overwriting the original contents of its buffer.
-            // https://github.com/microsoft/referencesource/blob/master/System/net/System/Net/_SecureChannel.cs
+
+    InitSecBuffer(&Buffers[0], rcv_buff->used - ctx->enc_start, rcv_buff->data + ctx->enc_start, SECBUFFER_DATA);
+    InitSecBuffer(&Buffers[1], 0, NULL, SECBUFFER_EMPTY);
+    InitSecBuffer(&Buffers[2], 0, NULL, SECBUFFER_EMPTY);
+    InitSecBuffer(&Buffers[3], 0, NULL, SECBUFFER_EMPTY);
+    InitSecBufferDesc(&Message, 4, Buffers);
+    //
+    DEBUGP(("WinTLS: rcv_buff total/used/encrypted %d/%d/%d\n", rcv_buff->size, rcv_buff->used, rcv_buff->used - ctx->enc_start));
+    //
+    Status = g_pSSPI->DecryptMessage(&ctx->hContext, &Message, 0, NULL);
+    //
+    DEBUGP(("WinTLS: Status %#08X\n", Status));
+    //
+    if (Status != SEC_E_OK && Status != SEC_I_RENEGOTIATE && Status != SEC_I_CONTEXT_EXPIRED) {
+        return Status;
+    }
+    //
+    // SEC_E_OK or SEC_I_RENEGOTIATE or SEC_I_CONTEXT_EXPIRED
+    pDataBuffer  = NULL;
+    pExtraBuffer = NULL;
+    for (i = 1; i < 4; i++) {
+        if (pDataBuffer == NULL && Buffers[i].BufferType == SECBUFFER_DATA) {
+            pDataBuffer = &Buffers[i];
         }
-        else {
-            /* End with no extra-data or exactly a block recieved? Hard to say.
-                `5 bytes Tls header` + `message`
-                https://en.wikipedia.org/wiki/Transport_Layer_Security#TLS_record
-            */
-            rcv_buff->used = 0;
+        else if (pExtraBuffer == NULL && Buffers[i].BufferType == SECBUFFER_EXTRA) {
+            pExtraBuffer = &Buffers[i];
         }
-        //
-        DEBUGP(("WinTLS: Decrypted %d\n", dec_n));
-        DEBUGP(("WinTLS: rcv_buff total/used/left %d/%d/%d\n", rcv_buff->size, rcv_buff->used, rcv_buff->size - rcv_buff->used));
-        DEBUGP(("WinTLS: dec_buff total/used/left %d/%d/%d\n", dec_buff->size, dec_buff->used, dec_buff->size - dec_buff->used));
-    } while (Status == SEC_E_OK && rcv_buff->used > 0);
-
+    }
+    // The encrypted message is decrypted in place, overwriting the original contents of its buffer.
+    if (pDataBuffer && pDataBuffer->cbBuffer > 0) {
+        ctx->plain = pDataBuffer->pvBuffer;
+        ctx->plain_len = pDataBuffer->cbBuffer;
+    }
+    // what follows the record stays where it is
+    ctx->enc_start = rcv_buff->used - (pExtraBuffer ? (int) pExtraBuffer->cbBuffer : 0);
+    //
+    DEBUGP(("WinTLS: Decrypted %d\n", ctx->plain_len));
     return Status;
 }
 
-/* decrypt enough data to be read/peeked
-    Block/Stream cipher, will be decrypted in place.
-*/
-static int schannel_recv(WINTLS_TRANSPORT_CONTEXT *ctx, int len) {
+/* Make decrypted data available in ctx->plain, receiving more records
+   as needed.  Returns the amount available, 0 at the end of the
+   stream and a negative value on error.  */
+static int schannel_recv(WINTLS_TRANSPORT_CONTEXT *ctx) {
     int n;
     EZ_BUFF *rcv_buff;
-    EZ_BUFF *dec_buff;
     SECURITY_STATUS Status;
     //
     rcv_buff = &ctx->rcv_buff;
-    dec_buff = &ctx->dec_buff;
 
     ctx->err_no = 0;
 
-    do {
+    for (;;) {
+        if (rcv_buff->used > ctx->enc_start) {
+            Status = decrypt_record(ctx);
+            //
+            if (ctx->plain_len > 0) return ctx->plain_len;  // <-- got decoded data that can be used
+            //
+            if (Status == SEC_I_CONTEXT_EXPIRED) {
+                ctx->can_recv = false;
+                return 0;
+            }
+            //
+            // The server requested renegotiation
+            if (Status == SEC_I_RENEGOTIATE) {
+                compact_recv_buffer(ctx);
+                ctx->stage = HSK_ONGOING;
+                Status = PerformHandshake(ctx);
+                ctx->enc_start = 0;
+                if (Status != SEC_E_OK) {
+                    logprintf(LOG_NOTQUIET, "WinTLS: renegotiation failed %#08X\n", Status);
+                    ctx->can_recv = false;
+                    return -2;
+                }
+                continue;
+            }
+            //
+            if (Status == SEC_E_OK) continue;   // a record without data
+            //
+            if (Status != SEC_E_INCOMPLETE_MESSAGE) {
+                logprintf(LOG_NOTQUIET, "WinTLS: DecryptMessage failed: %#08X\n", Status);
+                ctx->err_no = EIO;
+                ctx->can_recv = false;
+                return -1;
+            }
+        }
         //
         if (ctx->can_recv == false) {
             DEBUGP(("WinTLS: socket should not be read at the moment!\n"));
-            break;
+            return 0;
         }
         //
         // read enough data to decrypt
+        compact_recv_buffer(ctx);
         DEBUGP(("WinTLS: Start recv() ...\n"));
+        if (!wintls_wait_readable(ctx)) return -1;
         n = ez_socket_recv(ctx->socket, rcv_buff, 0);
         ctx->err_no = errno;
-        if (n <= 0 || rcv_buff->used <= 0) {
+        if (n <= 0) {
             ctx->can_recv = false;
             return n;
         }
-        //
-        Status = decrypt_data(ctx);
-        //
-        if (Status == SEC_E_INCOMPLETE_MESSAGE) continue;
-        //
-        if (Status == SEC_E_DECRYPT_FAILURE && dec_buff->used > 0) break;
-        //
-        if (Status == SEC_I_CONTEXT_EXPIRED) {
-            ctx->can_recv = false;
-            break;
-        }
-        //
-        if (Status == SEC_E_OK) break;  // <-- got enough decoded data that can be used
-        //
-        // The server requested renegotiation
-        if (Status == SEC_I_RENEGOTIATE) {
-            ctx->stage = HSK_ONGOING;
-            Status = PerformHandshake(ctx);
-            if (Status != SEC_E_OK) {
-                logprintf(LOG_NOTQUIET, "WinTLS: renegotiation failed %#08X\n", Status);
-                ctx->can_recv = false;
-                return -2;
-            }
-        }
-    } while (dec_buff->used < len && rcv_buff->used > 0);
-
-    return dec_buff->used;
+    }
 }
 
 static int schannel_read_peek(WINTLS_TRANSPORT_CONTEXT *ctx, char *buf, int len, int flags) {
-    EZ_BUFF *dec_buff;
     int n;
 
-    DEBUGP(("WinTLS: try to %s len: %d, dec_buff->used: %d\n", flags & MSG_PEEK ? "peek" : "read", len, ctx->dec_buff.used));
+    DEBUGP(("WinTLS: try to %s len: %d, plain_len: %d\n", flags & MSG_PEEK ? "peek" : "read", len, ctx->plain_len));
 
-    dec_buff = &ctx->dec_buff;
-    if (dec_buff->used <= 0) {
-        n = schannel_recv(ctx, len);
+    if (ctx->plain_len <= 0) {
+        n = schannel_recv(ctx);
         if (n <= 0) return n;
     }
 
     // read/peek some min len accessable decrypted data
-    len = len < dec_buff->used ? len : dec_buff->used;
+    len = len < ctx->plain_len ? len : ctx->plain_len;
     if (len > 0) {
-        memcpy(buf, dec_buff->data, len);
+        memcpy(buf, ctx->plain, len);
         if (!(flags & MSG_PEEK)) {
-            dec_buff->used -= len;
-            memmove(dec_buff->data, dec_buff->data + len, dec_buff->used);
+            ctx->plain += len;
+            ctx->plain_len -= len;
         }
         //
-        DEBUGP(("WinTLS: has %s len: %d, dec_buff->used: %d\n", flags & MSG_PEEK ? "peek" : "read", len, dec_buff->used));
+        DEBUGP(("WinTLS: has %s len: %d, plain_len: %d\n", flags & MSG_PEEK ? "peek" : "read", len, ctx->plain_len));
     }
 
     return len;
@@ -1254,10 +1358,12 @@ static int wintls_poll(int fd, double timeout, int wait_for, void *arg) {
     int ret;
     WINTLS_TRANSPORT_CONTEXT *ctx = arg;
 
+    if ((wait_for & WAIT_FOR_READ) && schannel_flush(ctx) < 0) return -1;
+
     ctx->err_no = 0;
 
     // readable bytes buffered
-    if (ctx->dec_buff.used > 0) return 1;
+    if (ctx->plain_len > 0 || have_whole_record(ctx)) return 1;
     // otherwise
     if (timeout == -1) timeout = opt.read_timeout;
     ret = select_fd(fd, timeout, wait_for);
@@ -1272,6 +1378,32 @@ static int wintls_peek(int fd, char *buf, int bufsize, void *arg, double timeout
     return wintls_read_peek(fd, buf, bufsize, arg, timeout, schannel_peek);
 }
 
+/* A timeout that has run out before the first wait for the socket, so
+   that schannel_recv only takes what has already arrived.  */
+#define WINTLS_NO_WAIT  1e-9
+
+static int wintls_read_nb(int fd _GL_UNUSED, char *buf, int bufsize, void *arg, int *wait_for) {
+    WINTLS_TRANSPORT_CONTEXT *ctx = arg;
+    int ret;
+
+    if (schannel_flush(ctx) < 0) return -1;
+
+    ctx->err_no = 0;
+    wintls_start_timer(ctx, WINTLS_NO_WAIT);
+    ret = schannel_read(ctx, buf, bufsize);
+    ctx->timeout = 0;
+    if (ret < 0 && ctx->err_no == ETIMEDOUT) {
+        *wait_for = WAIT_FOR_READ;
+        return FD_WOULDBLOCK;
+    }
+    return ret;
+}
+
+static bool wintls_pending(int fd _GL_UNUSED, void *arg) {
+    WINTLS_TRANSPORT_CONTEXT *ctx = arg;
+    return ctx->plain_len > 0 || have_whole_record(ctx);
+}
+
 static const char* wintls_errstr(int fd _GL_UNUSED, void *arg) {
     WINTLS_TRANSPORT_CONTEXT *ctx = arg;
     return strerror(ctx->err_no);
@@ -1280,13 +1412,13 @@ static const char* wintls_errstr(int fd _GL_UNUSED, void *arg) {
 static void wintls_close(int fd, void *arg) {
     WINTLS_TRANSPORT_CONTEXT *ctx = arg;
 
+    schannel_flush(ctx);
     DisconnectFromServer(ctx);
-    g_pSSPI->FreeCredentialsHandle(&ctx->hCreds);
     g_pSSPI->DeleteSecurityContext(&ctx->hContext);
     ez_buff_free(&ctx->rcv_buff);
     ctx->rcv_buff.used = 0;
-    ez_buff_free(&ctx->dec_buff);
-    ctx->dec_buff.used = 0;
+    ez_buff_free(&ctx->send_buff);
+    if (ctx->timer) ptimer_destroy(ctx->timer);
     free(ctx);
     closesocket(fd);
 }
@@ -1295,10 +1427,76 @@ static void wintls_close(int fd, void *arg) {
    methods provided by this file. */
 static struct transport_implementation wintls_transport = {
     wintls_read, wintls_write, wintls_poll,
-    wintls_peek, wintls_errstr, wintls_close
+    wintls_peek, wintls_errstr, wintls_close,
+    wintls_read_nb, NULL, wintls_pending
 };
 
 
+/* Schannel keeps a cache of the sessions negotiated with a credentials
+   handle, looked up by the target name passed to
+   InitializeSecurityContext.  Creating new credentials for each
+   connection, as was done before, rules out resuming any session, so
+   keep one credentials handle per host:port for the whole run and let
+   Schannel resume sessions on it.  */
+static struct hash_table *session_cache;
+
+/* Chain engine building the server certificate chains.  It is created
+   once, so that the issuer certificates and revocation information it
+   caches serve every connection of the run.  */
+static HCERTCHAINENGINE chain_engine;
+
+static PCredHandle session_credentials(int fd, const char *hostname) {
+    struct sockaddr_storage ss;
+    struct sockaddr *sa = (struct sockaddr *) &ss;
+    socklen_t addrlen = sizeof(ss);
+    int port = 0;
+    char *key;
+    PCredHandle pCreds;
+
+    if (getpeername(fd, sa, &addrlen) == 0) {
+        if (sa->sa_family == AF_INET) {
+            port = ntohs(((struct sockaddr_in *) sa)->sin_port);
+        }
+#ifdef ENABLE_IPV6
+        else if (sa->sa_family == AF_INET6) {
+            port = ntohs(((struct sockaddr_in6 *) sa)->sin6_port);
+        }
+#endif
+    }
+    key = aprintf("%s:%d", hostname, port);
+
+    if (session_cache == NULL) {
+        session_cache = make_nocase_string_hash_table(0);
+    }
+    pCreds = hash_table_get(session_cache, key);
+    if (pCreds) {
+        DEBUGP(("WinTLS: reusing credentials for %s\n", key));
+        xfree(key);
+        return pCreds;
+    }
+
+    pCreds = xnew(CredHandle);
+    if (CreateCredentials(pCreds) != SEC_E_OK) {
+        xfree(pCreds);
+        xfree(key);
+        return NULL;
+    }
+    DEBUGP(("WinTLS: Credentials created for %s.\n", key));
+    hash_table_put(session_cache, key, pCreds);
+
+    return pCreds;
+}
+
+/* Log whether the handshake just done was an abbreviated one.  */
+static void log_session_reuse(WINTLS_TRANSPORT_CONTEXT *ctx) {
+    SecPkgContext_SessionInfo info = {0};
+
+    if (g_pSSPI->QueryContextAttributes(&ctx->hContext, SECPKG_ATTR_SESSION_INFO, &info) == SEC_E_OK) {
+        DEBUGP(("WinTLS: session %s\n", info.dwFlags & SSL_SESSION_RECONNECT ? "resumed" : "negotiated"));
+    }
+}
+
+
 /* Part 3: Public interfaces */
 
 bool ssl_init(void) {
@@ -1313,12 +1511,34 @@ bool ssl_init(void) {
     return true;
 }
 
+void ssl_cleanup(void) {
+    hash_table_iterator iter;
+
+    if (chain_engine != NULL) {
+        CertFreeCertificateChainEngine(chain_engine);
+        chain_engine = NULL;
+    }
+
+    if (session_cache == NULL) return;
+
+    for (hash_table_iterate(session_cache, &iter); hash_table_iter_next(&iter); ) {
+        g_pSSPI->FreeCredentialsHandle(iter.value);
+        xfree(iter.key);
+        xfree(iter.value);
+    }
+    hash_table_destroy(session_cache);
+    session_cache = NULL;
+}
+
 /* Perform the SSL/TLS handshake and wrap the connection handle reader and writer
     connection-oriented sockets (type SOCK_STREAM)
 */
-bool ssl_connect_wget(int fd /*socket*/, const char *hostname, int *continue_session) {
+bool ssl_connect_wget(int fd /*socket*/, const char *hostname, int *continue_session, bool *h2) {
     WINTLS_TRANSPORT_CONTEXT *wintls_ctx;
 
+    // HTTP/2 is offered if h2 is non-NULL, *h2 tells whether the server chose it
+    if (h2) *h2 = false;
+
     wintls_ctx = calloc(1, sizeof(WINTLS_TRANSPORT_CONTEXT));
     if (wintls_ctx == NULL) {
         logprintf(LOG_NOTQUIET, "WinTLS: calloc failed!\n");
@@ -1326,9 +1546,19 @@ bool ssl_connect_wget(int fd /*socket*/, const char *hostname, int *continue_ses
     }
     DEBUGP(("WinTLS: socket %d, wintls_ctx @ %#08X\n", fd, wintls_ctx));
 
-    // Obtain Schannel credentials
-    if (CreateCredentials(&wintls_ctx->hCreds) != SEC_E_OK) return false;
-    DEBUGP(("WinTLS: Credentials created.\n"));
+    // Obtain Schannel credentials, sharing those of the connection
+    // whose session should be continued (FTPS data connections)
+    if (continue_session) {
+        WINTLS_TRANSPORT_CONTEXT *prev = fd_transport_context(*continue_session);
+        if (prev) wintls_ctx->pCreds = prev->pCreds;
+    }
+    if (wintls_ctx->pCreds == NULL) {
+        wintls_ctx->pCreds = session_credentials(fd, hostname);
+    }
+    if (wintls_ctx->pCreds == NULL) {
+        free(wintls_ctx);
+        return false;
+    }
 
     // Create an Schannel security context by handshake
     wintls_ctx->stage = HSK_CLIENT_HELLO;
@@ -1336,15 +1566,37 @@ bool ssl_connect_wget(int fd /*socket*/, const char *hostname, int *continue_ses
     wintls_ctx->socket = fd;
     // store for renegotiation
     wintls_ctx->hostname = (char *)hostname;
+    wintls_ctx->offer_h2 = h2 != NULL;
     if (!perform_handshake_with_timeout(wintls_ctx, opt.read_timeout)) {
-        g_pSSPI->FreeCredentialsHandle(&wintls_ctx->hCreds);
+        if (wintls_ctx->timer) ptimer_destroy(wintls_ctx->timer);
         return false;
     }
     DEBUGP(("WinTLS: Handshake succeeded.\n"));
+    log_session_reuse(wintls_ctx);
+
+#ifdef SECBUFFER_APPLICATION_PROTOCOLS
+    if (h2) {
+        SecPkgContext_ApplicationProtocol alpn_result;
+        if (g_pSSPI->QueryContextAttributes(&wintls_ctx->hContext, SECPKG_ATTR_APPLICATION_PROTOCOL, &alpn_result) == SEC_E_OK
+            && alpn_result.ProtoNegoStatus == SecApplicationProtocolNegotiationStatus_Success) {
+            *h2 = alpn_result.ProtocolIdSize == 2 && memcmp(alpn_result.ProtocolId, "h2", 2) == 0;
+        }
+        DEBUGP(("WinTLS: ALPN: %s\n", *h2 ? "h2" : "http/1.1"));
+    }
+#endif
 
-    // verified or `--no-check-certificate`
+    // the certificate is left to ssl_check_certificate()
     wintls_ctx->stage = HSK_VERIFIED;
 
+    if (!setup_buffers(wintls_ctx)) {
+        g_pSSPI->DeleteSecurityContext(&wintls_ctx->hContext);
+        if (wintls_ctx->timer) ptimer_destroy(wintls_ctx->timer);
+        ez_buff_free(&wintls_ctx->rcv_buff);
+        ez_buff_free(&wintls_ctx->send_buff);
+        free(wintls_ctx);
+        return false;
+    }
+
     /* connect.h: transport_implementation */
     fd_register_transport (fd, &wintls_transport, wintls_ctx);
     DEBUGP(("WinTLS: IO layer initialized.\n"));
@@ -1352,7 +1604,112 @@ bool ssl_connect_wget(int fd /*socket*/, const char *hostname, int *continue_ses
     return true;
 }
 
-// done by: SCH_CRED_AUTO_CRED_VALIDATION | SCH_CRED_REVOCATION_CHECK_CHAIN
+static HCERTCHAINENGINE get_chain_engine(void) {
+    if (chain_engine == NULL) {
+        CERT_CHAIN_ENGINE_CONFIG config;
+
+        memset(&config, 0, sizeof(config));
+        config.cbSize = sizeof(config);
+        config.dwFlags = CERT_CHAIN_CACHE_END_CERT;
+        if (!CertCreateCertificateChainEngine(&config, &chain_engine)) {
+            DEBUGP(("WinTLS: CertCreateCertificateChainEngine failed: %#08X\n", GetLastError()));
+            chain_engine = NULL;    // fall back on the default engine
+        }
+    }
+    return chain_engine;
+}
+
+/* Build and verify the chain of CERT as a server certificate of HOST,
+   checking revocation as Schannel would. Returns 0 or the error. */
+static DWORD verify_server_chain(PCCERT_CONTEXT cert, const char *host) {
+    static LPSTR usage[] = { szOID_PKIX_KP_SERVER_AUTH, szOID_SERVER_GATED_CRYPTO, szOID_SGC_NETSCAPE };
+    CERT_CHAIN_PARA chain_para;
+    PCCERT_CHAIN_CONTEXT chain = NULL;
+    HTTPSPolicyCallbackData https_policy;
+    CERT_CHAIN_POLICY_PARA policy_para;
+    CERT_CHAIN_POLICY_STATUS policy_status;
+    wchar_t *whost;
+    int len;
+    DWORD err;
+
+    memset(&chain_para, 0, sizeof(chain_para));
+    chain_para.cbSize = sizeof(chain_para);
+    chain_para.RequestedUsage.dwType = USAGE_MATCH_TYPE_OR;
+    chain_para.RequestedUsage.Usage.cUsageIdentifier = countof(usage);
+    chain_para.RequestedUsage.Usage.rgpszUsageIdentifier = usage;
+
+    if (!CertGetCertificateChain(get_chain_engine(), cert, NULL, cert->hCertStore, &chain_para,
+                                 CERT_CHAIN_REVOCATION_CHECK_CHAIN_EXCLUDE_ROOT, NULL, &chain)) {
+        return GetLastError();
+    }
+
+    len = MultiByteToWideChar(CP_UTF8, 0, host, -1, NULL, 0);
+    whost = xmalloc(len * sizeof(wchar_t));
+    MultiByteToWideChar(CP_UTF8, 0, host, -1, whost, len);
+
+    memset(&https_policy, 0, sizeof(https_policy));
+    https_policy.cbStruct = sizeof(https_policy);
+    https_policy.dwAuthType = AUTHTYPE_SERVER;
+    https_policy.pwszServerName = whost;
+
+    memset(&policy_para, 0, sizeof(policy_para));
+    policy_para.cbSize = sizeof(policy_para);
+    // as SCH_CRED_IGNORE_REVOCATION_OFFLINE did
+    policy_para.dwFlags = CERT_CHAIN_POLICY_IGNORE_ALL_REV_UNKNOWN_FLAGS;
+    policy_para.pvExtraPolicyPara = &https_policy;
+
+    memset(&policy_status, 0, sizeof(policy_status));
+    policy_status.cbSize = sizeof(policy_status);
+
+    if (CertVerifyCertificateChainPolicy(CERT_CHAIN_POLICY_SSL, chain, &policy_para, &policy_status)) {
+        err = policy_status.dwError;
+    }
+    else {
+        err = GetLastError();
+    }
+
+    xfree(whost);
+    CertFreeCertificateChain(chain);
+    return err;
+}
+
+/* Verify the certificate presented on FD by HOST, reusing the result
+   of a recent verification of the same certificate for the same host.
+   As with the other backends, problems are only warned about under
+   `--no-check-certificate'. */
 bool ssl_check_certificate(int fd, const char *host) {
+    WINTLS_TRANSPORT_CONTEXT *ctx = fd_transport_context(fd);
+    PCCERT_CONTEXT cert = NULL;
+    const char *severity = opt.check_cert ? _("ERROR") : _("WARNING");
+    long result;
+
+    if (opt.check_cert == CHECK_CERT_QUIET) return true;
+
+    if (g_pSSPI->QueryContextAttributes(&ctx->hContext, SECPKG_ATTR_REMOTE_CERT_CONTEXT, &cert) != SEC_E_OK
+        || cert == NULL) {
+        logprintf(LOG_NOTQUIET, _("%s: No certificate presented by %s.\n"),
+                  severity, quotearg_style(escape_quoting_style, host));
+        return opt.check_cert != CHECK_CERT_ON;
+    }
+
+    if (cert_verify_cache_get(host, cert->pbCertEncoded, cert->cbCertEncoded, &result)) {
+        DEBUGP(("WinTLS: reusing the verification of %s's certificate\n", host));
+    }
+    else {
+        result = verify_server_chain(cert, host);
+        cert_verify_cache_put(host, cert->pbCertEncoded, cert->cbCertEncoded, result);
+    }
+    CertFreeCertificateContext(cert);
+
+    if (result != 0) {
+        logprintf(LOG_NOTQUIET, _("%s: cannot verify %s's certificate: %s\n"),
+                  severity, quotearg_style(escape_quoting_style, host),
+                  sspi_strerror((SECURITY_STATUS) result));
+        if (opt.check_cert == CHECK_CERT_ON) {
+            logprintf(LOG_NOTQUIET, _("To connect to %s insecurely, use `--no-check-certificate'.\n"),
+                      quotearg_style(escape_quoting_style, host));
+            return false;
+        }
+    }
     return true;
 }
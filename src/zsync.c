@@ -0,0 +1,746 @@
+/* Updating files from zsync control files.
+   Copyright (C) 2023 Free Software Foundation,
+   Inc.
+
+This file is part of GNU Wget.
+
+GNU Wget is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+
+GNU Wget is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Wget.  If not, see <http://www.gnu.org/licenses/>.
+
+Additional permission under GNU GPL version 3 section 7
+
+If you modify this program, or any covered work, by linking or
+combining it with the OpenSSL project's OpenSSL library (or a
+modified version of that library), containing parts covered by the
+terms of the OpenSSL or SSLeay licenses, the Free Software Foundation
+grants you additional permission to convey the resulting work.
+Corresponding Source for a non-source form of such a combination
+shall include the source code for the parts of OpenSSL used as well
+as that of the covered work.  */
+
+#include "wget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "zsync.h"
+#include "utils.h"
+#include "url.h"
+#include "retr.h"
+#include "http.h"
+#ifdef HAVE_WINHASHES
+# include "win-hashes.h"
+#else
+# include "md4.h"
+# include "sha1.h"
+#endif
+#include "c-strcase.h"
+
+#ifdef TESTING
+#include "../tests/unit-tests.h"
+#endif
+
+/* A zsync control file, as made by zsyncmake, describes a file as a
+   sequence of blocks of a fixed size, each with a weak checksum that
+   can be rolled along a file one byte at a time and a strong one, a
+   truncated MD4.  Finding the blocks in the copy of the file we
+   already have, wherever they moved to, leaves only the blocks that
+   changed to be fetched, with Range requests for the file itself.
+
+   The rolling checksum is that of rsync: for the N bytes c[0]..c[N-1],
+   A is the sum of the bytes and B the sum of (N-i)*c[i], both modulo
+   2^16.  A block that ends the file short is padded with zeros.  */
+
+struct zsync_block {
+  unsigned short a, b;          /* weak checksum, masked */
+  unsigned char sum[MD4_DIGEST_SIZE]; /* first checksum_bytes of MD4 */
+  int next;                     /* next block in the same bucket */
+};
+
+struct zsync_control {
+  wgint length;                 /* size of the file */
+  int blocksize;                /* a power of 2 */
+  int blockshift;               /* its logarithm */
+  int seq_matches;              /* blocks that must match in a row */
+  int rsum_bytes;               /* bytes of weak checksum kept */
+  int checksum_bytes;           /* bytes of MD4 kept */
+  unsigned short a_mask, b_mask; /* what rsum_bytes keeps of A and B */
+  char sha1[2 * SHA1_DIGEST_SIZE + 1]; /* of the whole file */
+  int nblocks;
+  struct zsync_block *blocks;
+  int *buckets;                 /* first block of each weak checksum
+                                   bucket, or -1 */
+  int bucket_bits;
+};
+
+/* How much of the local file is read at a time.  */
+#define ZSYNC_READ_SIZE 65536
+
+static void
+zsync_rsum (const unsigned char *data, int len,
+            unsigned short *a_ptr, unsigned short *b_ptr)
+{
+  unsigned short a = 0, b = 0;
+
+  while (len)
+    {
+      a += *data;
+      b += len * *data;
+      data++;
+      len--;
+    }
+  *a_ptr = a;
+  *b_ptr = b;
+}
+
+/* Update the checksum of a window of 2^SHIFT bytes as it moves past
+   byte OLD and takes in byte NEW.  */
+#define ZSYNC_ROLL(a, b, old, new, shift) do { \
+  (a) += (unsigned char) (new) - (unsigned char) (old); \
+  (b) += (a) - ((unsigned char) (old) << (shift)); \
+} while (0)
+
+static int
+zsync_bucket (const struct zsync_control *zc, unsigned short a,
+              unsigned short b)
+{
+  uint32_t key = ((uint32_t) (a & zc->a_mask) << 16) | (b & zc->b_mask);
+  return (key * 2654435761u) >> (32 - zc->bucket_bits);
+}
+
+static void
+zsync_control_free (struct zsync_control *zc)
+{
+  xfree (zc->blocks);
+  xfree (zc->buckets);
+}
+
+/* Parse the zsync control file in DATA, SIZE bytes long, into ZC.
+   Returns false if it is not one, or one we cannot use.  */
+
+static bool
+zsync_parse (const char *data, size_t size, struct zsync_control *zc)
+{
+  const char *p = data, *end = data + size;
+  bool have_version = false;
+  int i, entry;
+
+  xzero (*zc);
+  zc->length = -1;
+  zc->seq_matches = 1;
+  zc->rsum_bytes = 4;
+  zc->checksum_bytes = MD4_DIGEST_SIZE;
+
+  /* The headers, up to an empty line.  */
+  for (;;)
+    {
+      const char *eol = memchr (p, '\n', end - p), *colon, *val;
+      char value[64];
+      size_t len;
+
+      if (!eol)
+        return false;
+      if (eol == p)
+        {
+          p = eol + 1;
+          break;
+        }
+      colon = memchr (p, ':', eol - p);
+      if (!colon)
+        return false;
+      for (val = colon + 1; val < eol && c_isspace (*val); val++)
+        ;
+      len = eol - val;
+      while (len && c_isspace (val[len - 1]))
+        len--;
+      if (len >= sizeof (value))
+        len = sizeof (value) - 1;
+      memcpy (value, val, len);
+      value[len] = '\0';
+
+#define HEADER_IS(name) \
+  ((size_t) (colon - p) == sizeof (name) - 1 \
+   && !c_strncasecmp (p, name, sizeof (name) - 1))
+      if (HEADER_IS ("zsync"))
+        have_version = true;
+      else if (HEADER_IS ("Blocksize"))
+        zc->blocksize = atoi (value);
+      else if (HEADER_IS ("Length"))
+        zc->length = str_to_wgint (value, NULL, 10);
+      else if (HEADER_IS ("Hash-Lengths"))
+        {
+          if (sscanf (value, "%d,%d,%d", &zc->seq_matches, &zc->rsum_bytes,
+                      &zc->checksum_bytes) != 3)
+            return false;
+        }
+      else if (HEADER_IS ("SHA-1"))
+        {
+          if (len != 2 * SHA1_DIGEST_SIZE)
+            return false;
+          memcpy (zc->sha1, value, len + 1);
+        }
+#undef HEADER_IS
+      p = eol + 1;
+    }
+
+  if (!have_version || !*zc->sha1 || zc->length < 0
+      || zc->blocksize < 16 || zc->blocksize > (1 << 24)
+      || (zc->blocksize & (zc->blocksize - 1))
+      || zc->seq_matches < 1 || zc->seq_matches > 2
+      || zc->rsum_bytes < 1 || zc->rsum_bytes > 4
+      || zc->checksum_bytes < 3 || zc->checksum_bytes > MD4_DIGEST_SIZE)
+    return false;
+  for (zc->blockshift = 0; (1 << zc->blockshift) < zc->blocksize;
+       zc->blockshift++)
+    ;
+  if ((zc->length + zc->blocksize - 1) / zc->blocksize > INT_MAX / 2)
+    return false;
+  zc->nblocks = (zc->length + zc->blocksize - 1) / zc->blocksize;
+  entry = zc->rsum_bytes + zc->checksum_bytes;
+  if ((size_t) (end - p) < (size_t) zc->nblocks * entry)
+    return false;
+
+  zc->a_mask = zc->rsum_bytes < 3 ? 0 : zc->rsum_bytes == 3 ? 0xff : 0xffff;
+  zc->b_mask = zc->rsum_bytes < 2 ? 0xff : 0xffff;
+  for (zc->bucket_bits = 4; (1 << zc->bucket_bits) < zc->nblocks;
+       zc->bucket_bits++)
+    ;
+  zc->buckets = xmalloc ((1 << zc->bucket_bits) * sizeof (int));
+  for (i = 0; i < (1 << zc->bucket_bits); i++)
+    zc->buckets[i] = -1;
+
+  /* The checksums of each block: the last RSUM_BYTES of A and B, both
+     big-endian, and the first CHECKSUM_BYTES of the MD4.  */
+  zc->blocks = xcalloc (zc->nblocks, sizeof (struct zsync_block));
+  for (i = 0; i < zc->nblocks; i++, p += entry)
+    {
+      struct zsync_block *blk = &zc->blocks[i];
+      unsigned char rsum[4] = { 0, 0, 0, 0 };
+
+      memcpy (rsum + 4 - zc->rsum_bytes, p, zc->rsum_bytes);
+      blk->a = ((rsum[0] << 8) | rsum[1]) & zc->a_mask;
+      blk->b = ((rsum[2] << 8) | rsum[3]) & zc->b_mask;
+      memcpy (blk->sum, p + zc->rsum_bytes, zc->checksum_bytes);
+    }
+  /* Chained last block first, so that each bucket lists its blocks in
+     the order of the file.  */
+  for (i = zc->nblocks - 1; i >= 0; i--)
+    {
+      int bucket = zsync_bucket (zc, zc->blocks[i].a, zc->blocks[i].b);
+      zc->blocks[i].next = zc->buckets[bucket];
+      zc->buckets[bucket] = i;
+    }
+  return true;
+}
+
+/* Whether the BLOCKSIZE bytes at DATA have the strong checksum of
+   block I.  */
+
+static bool
+zsync_block_check (const struct zsync_control *zc, int i,
+                   const unsigned char *data)
+{
+  char digest[MD4_DIGEST_SIZE];
+
+  md4_buffer ((const char *) data, zc->blocksize, digest);
+  return !memcmp (digest, zc->blocks[i].sum, zc->checksum_bytes);
+}
+
+/* Write DATA, found to hold block I, to OUT, unless it is already
+   there.  *FOUND counts the bytes written.  */
+
+static bool
+zsync_place (const struct zsync_control *zc, FILE *out, bool *have, int i,
+             const unsigned char *data, wgint *found)
+{
+  wgint pos = (wgint) i * zc->blocksize;
+  wgint size = MIN (zc->blocksize, zc->length - pos);
+
+  if (have[i])
+    return true;
+  if (!write_file_at (out, (const char *) data, size, pos))
+    return false;
+  have[i] = true;
+  *found += size;
+  return true;
+}
+
+/* Find the blocks described by ZC in SEED, the old copy of the file,
+   and write them to OUT at their place in the new one.  HAVE, one
+   flag per block, is set for the blocks found.  Returns the number of
+   bytes written, or -1 if writing failed.  */
+
+static wgint
+zsync_match (const struct zsync_control *zc, FILE *seed, FILE *out,
+             bool *have)
+{
+  int bs = zc->blocksize;
+  int need = zc->seq_matches * bs;
+  int cap = 2 * need + ZSYNC_READ_SIZE + 1;
+  unsigned char *buf = xmalloc (cap);
+  int p = 0, len = 0, next = -1;
+  bool eof = false, valid = false;
+  unsigned short a0 = 0, b0 = 0, a1 = 0, b1 = 0;
+  wgint base = 0, seed_size = 0, found = 0;
+
+  for (;;)
+    {
+      int i, j, step = 0;
+
+      if (p + need + 1 > len && !eof)
+        {
+          int want, n;
+
+          /* Keep the current window and read more after it.  When the
+             file ends, pad it with zeros, as zsyncmake pads the last
+             block.  */
+          memmove (buf, buf + p, len - p);
+          base += p;
+          len -= p;
+          p = 0;
+          want = cap - need - len;
+          n = fread (buf + len, 1, want, seed);
+          len += n;
+          seed_size += n;
+          if (n < want)
+            {
+              memset (buf + len, 0, need);
+              len += need;
+              eof = true;
+            }
+          continue;
+        }
+      if (p + need > len || base + p >= seed_size)
+        break;
+
+      if (!valid)
+        {
+          zsync_rsum (buf + p, bs, &a0, &b0);
+          if (zc->seq_matches > 1)
+            zsync_rsum (buf + p + bs, bs, &a1, &b1);
+          valid = true;
+        }
+
+      /* Following a match, the next block is likely to come next, and
+         needs no other to confirm it.  */
+      if (next >= 0 && next < zc->nblocks
+          && zc->blocks[next].a == (a0 & zc->a_mask)
+          && zc->blocks[next].b == (b0 & zc->b_mask)
+          && (have[next] || zsync_block_check (zc, next, buf + p)))
+        {
+          if (!zsync_place (zc, out, have, next, buf + p, &found))
+            {
+              xfree (buf);
+              return -1;
+            }
+          next++;
+          p += bs;
+          valid = false;
+          continue;
+        }
+      next = -1;
+
+      for (i = zc->buckets[zsync_bucket (zc, a0, b0)]; i >= 0;
+           i = zc->blocks[i].next)
+        {
+          const struct zsync_block *blk = &zc->blocks[i];
+          bool pair = zc->seq_matches > 1 && i + 1 < zc->nblocks;
+
+          if (have[i] || blk->a != (a0 & zc->a_mask)
+              || blk->b != (b0 & zc->b_mask))
+            continue;
+          /* With seq_matches 2, the checksums are too short to tell
+             one block on its own; the next block must follow it.  */
+          if (pair && (blk[1].a != (a1 & zc->a_mask)
+                       || blk[1].b != (b1 & zc->b_mask)))
+            continue;
+          if (!zsync_block_check (zc, i, buf + p)
+              || (pair && !zsync_block_check (zc, i + 1, buf + p + bs)))
+            continue;
+
+          /* Other blocks of the same contents are placed at once.  */
+          if (!zsync_place (zc, out, have, i, buf + p, &found)
+              || (pair && !zsync_place (zc, out, have, i + 1, buf + p + bs,
+                                        &found)))
+            found = -1;
+          for (j = blk->next; j >= 0 && found >= 0; j = zc->blocks[j].next)
+            if (zc->blocks[j].a == blk->a && zc->blocks[j].b == blk->b
+                && !memcmp (zc->blocks[j].sum, blk->sum, zc->checksum_bytes)
+                && !zsync_place (zc, out, have, j, buf + p, &found))
+              found = -1;
+          if (found < 0)
+            {
+              xfree (buf);
+              return -1;
+            }
+          step = pair ? 2 * bs : bs;
+          next = pair ? i + 2 : i + 1;
+          break;
+        }
+
+      if (step)
+        {
+          /* Skip the blocks found rather than look for others in
+             them.  */
+          p += step;
+          valid = false;
+          continue;
+        }
+      if (p + need + 1 > len)
+        break;
+      ZSYNC_ROLL (a0, b0, buf[p], buf[p + bs], zc->blockshift);
+      if (zc->seq_matches > 1)
+        ZSYNC_ROLL (a1, b1, buf[p + bs], buf[p + 2 * bs], zc->blockshift);
+      p++;
+    }
+
+  xfree (buf);
+  return found;
+}
+
+/* Verifier for http_get_pieces, whose pieces are the blocks of the
+   control file ARG: check block PIECE.  */
+
+static bool
+zsync_verify_piece (int piece, const char *data, wgint size, void *arg)
+{
+  const struct zsync_control *zc = arg;
+  unsigned char *block = xmalloc (zc->blocksize);
+  bool ok;
+
+  memcpy (block, data, size);
+  memset (block + size, 0, zc->blocksize - size);
+  ok = zsync_block_check (zc, piece, block);
+  xfree (block);
+  return ok;
+}
+
+/* Retrieve the control file of U, if it has one, and parse it into
+   ZC.  */
+
+static bool
+zsync_get_control (const struct url *u, struct zsync_control *zc)
+{
+  char *zsync_url, *file = NULL;
+  struct url *zu;
+  struct file_memory *fm;
+  bool saved_zsync = opt.zsync, ok = false;
+  uerr_t err;
+
+  /* A control file belongs to the file, not to a query.  */
+  if (u->query || u->params)
+    return false;
+
+  zsync_url = aprintf ("%s.zsync", u->url);
+  zu = url_new_init ();
+  zu->ori_url = zsync_url;
+  zu->ori_enc = xstrdup (u->ori_enc);
+  if (url_parse (zu, true, true))
+    {
+      url_free (zu);
+      return false;
+    }
+
+  logprintf (LOG_VERBOSE, _("Looking for %s; please ignore errors.\n"),
+             quote (zu->url));
+  opt.zsync = false;
+  err = retrieve_url (zu, &file, NULL, NULL, NULL, false, false);
+  opt.zsync = saved_zsync;
+  url_free (zu);
+
+  if (err == RETROK && file && (fm = wget_read_file (file)) != NULL)
+    {
+      ok = zsync_parse (fm->content, fm->length, zc);
+      if (!ok)
+        logprintf (LOG_NOTQUIET, _("%s is not a zsync control file.\n"),
+                   quote (file));
+      wget_read_file_free (fm);
+    }
+  if (file && (opt.delete_after || !acceptable (file)))
+    unlink (file);
+  xfree (file);
+  return ok;
+}
+
+/* Bring FILE up to date with U from U's zsync control file, starting
+   from SEED, the copy of the file we have, and fetching only the
+   blocks it lacks.  CONTLEN is the size the server gave for U, or -1.
+   *FETCHED is set to the number of bytes fetched.
+
+   Returns true if FILE now holds the file the server has.  Otherwise
+   FILE is left as it was, for the whole file to be retrieved.  */
+
+bool
+zsync_retrieve (struct url *u, const char *file, const char *seed,
+                wgint contlen, wgint *fetched)
+{
+  struct zsync_control zc;
+  FILE *seed_fp = NULL, *out = NULL;
+  char *tmp = NULL;
+  bool *have = NULL, ok = false;
+  char digest[SHA1_DIGEST_SIZE];
+  char digest_txt[2 * SHA1_DIGEST_SIZE + 1];
+  wgint found;
+
+  *fetched = 0;
+  if (url_uses_proxy (u) || !zsync_get_control (u, &zc))
+    return false;
+  if (contlen >= 0 && contlen != zc.length)
+    {
+      logputs (LOG_VERBOSE, _("The zsync control file is out of date; "
+                              "retrieving the whole file.\n"));
+      goto out;
+    }
+
+  seed_fp = fopen (seed, "rb");
+  tmp = aprintf ("%s.tmp", file);
+  if (seed_fp)
+    out = fopen (tmp, "w+b");
+  if (!out)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", seed_fp ? tmp : seed,
+                 strerror (errno));
+      goto out;
+    }
+
+  have = xcalloc (zc.nblocks, sizeof (bool));
+  found = zsync_match (&zc, seed_fp, out, have);
+  fclose (seed_fp);
+  seed_fp = NULL;
+  if (found < 0)
+    {
+      logprintf (LOG_NOTQUIET, "%s: %s\n", tmp, strerror (errno));
+      goto out;
+    }
+  logprintf (LOG_VERBOSE, _("%s of %s bytes are already in %s.\n"),
+             number_to_static_string (found),
+             number_to_static_string (zc.length), quote (seed));
+
+  /* The blocks that are missing are fetched as the pieces of
+     http_get_pieces, each with a Range request of its own, over as
+     many connections as --segments allows.  */
+  *fetched = zc.length - found;
+  if (*fetched)
+    {
+      struct url *urls[1];
+
+      urls[0] = u;
+      if (http_get_pieces (urls, 1, out, file, zc.length, zc.blocksize,
+                           have, zsync_verify_piece, &zc) != RETROK)
+        goto out;
+    }
+  else
+    presize_file (out, zc.length, false);
+
+  rewind (out);
+  if (sha1_stream (out, digest) != 0)
+    goto out;
+  wg_hex_to_string (digest_txt, digest, SHA1_DIGEST_SIZE);
+  if (c_strcasecmp (digest_txt, zc.sha1))
+    {
+      logprintf (LOG_NOTQUIET, _("The file put together does not match the "
+                                 "SHA-1 of the zsync control file; "
+                                 "retrieving the whole file.\n"));
+      goto out;
+    }
+  if (fclose (out) != 0)
+    {
+      out = NULL;
+      logprintf (LOG_NOTQUIET, "%s: %s\n", tmp, strerror (errno));
+      goto out;
+    }
+  out = NULL;
+  if (rename (tmp, file) != 0)
+    {
+      logprintf (LOG_NOTQUIET, _("Cannot rename %s to %s: %s\n"),
+                 quote_n (0, tmp), quote_n (1, file), strerror (errno));
+      goto out;
+    }
+  logprintf (LOG_VERBOSE, _("%s updated, %s of %s bytes fetched.\n"),
+             quote (file), number_to_static_string (*fetched),
+             number_to_static_string (zc.length));
+  ok = true;
+
+ out:
+  if (seed_fp)
+    fclose (seed_fp);
+  if (out)
+    fclose (out);
+  if (!ok && tmp)
+    unlink (tmp);
+  xfree (tmp);
+  xfree (have);
+  zsync_control_free (&zc);
+  return ok;
+}
+
+#ifdef TESTING
+
+/* Make a control file for the SIZE bytes of DATA, as zsyncmake would,
+   in *CONTROL.  Returns its size.  */
+
+static size_t
+make_control (const unsigned char *data, size_t size, int blocksize,
+              int seq_matches, int rsum_bytes, int checksum_bytes,
+              char **control)
+{
+  char digest[SHA1_DIGEST_SIZE], hex[2 * SHA1_DIGEST_SIZE + 1];
+  int nblocks = (size + blocksize - 1) / blocksize, i;
+  int entry = rsum_bytes + checksum_bytes;
+  unsigned char *block = xmalloc (blocksize);
+  char *head, *buf;
+  size_t head_len;
+
+  sha1_buffer ((const char *) data, size, digest);
+  wg_hex_to_string (hex, digest, SHA1_DIGEST_SIZE);
+  head = aprintf ("zsync: 0.6.2\nFilename: test\nBlocksize: %d\n"
+                  "Length: %lu\nHash-Lengths: %d,%d,%d\nURL: test\n"
+                  "SHA-1: %s\n\n", blocksize, (unsigned long) size,
+                  seq_matches, rsum_bytes, checksum_bytes, hex);
+  head_len = strlen (head);
+  buf = xmalloc (head_len + (size_t) nblocks * entry);
+  memcpy (buf, head, head_len);
+  for (i = 0; i < nblocks; i++)
+    {
+      size_t len = MIN ((size_t) blocksize, size - (size_t) i * blocksize);
+      unsigned char rsum[4];
+      char sum[MD4_DIGEST_SIZE];
+      unsigned short a, b;
+
+      memcpy (block, data + (size_t) i * blocksize, len);
+      memset (block + len, 0, blocksize - len);
+      zsync_rsum (block, blocksize, &a, &b);
+      rsum[0] = a >> 8, rsum[1] = a & 0xff, rsum[2] = b >> 8, rsum[3] = b & 0xff;
+      md4_buffer ((const char *) block, blocksize, sum);
+      memcpy (buf + head_len + i * entry, rsum + 4 - rsum_bytes, rsum_bytes);
+      memcpy (buf + head_len + i * entry + rsum_bytes, sum, checksum_bytes);
+    }
+  xfree (block);
+  xfree (head);
+  *control = buf;
+  return head_len + (size_t) nblocks * entry;
+}
+
+const char *
+test_zsync_parse (void)
+{
+  unsigned char data[1000];
+  struct zsync_control zc;
+  char *control;
+  size_t size;
+  int i;
+
+  for (i = 0; i < (int) sizeof (data); i++)
+    data[i] = i * 7;
+  size = make_control (data, sizeof (data), 256, 2, 3, 5, &control);
+  mu_assert ("zsync_parse: valid", zsync_parse (control, size, &zc));
+  mu_assert ("zsync_parse: length", zc.length == 1000);
+  mu_assert ("zsync_parse: blocks", zc.nblocks == 4 && zc.blockshift == 8);
+  mu_assert ("zsync_parse: hash lengths",
+             zc.seq_matches == 2 && zc.rsum_bytes == 3
+             && zc.checksum_bytes == 5 && zc.a_mask == 0xff);
+  zsync_control_free (&zc);
+
+  mu_assert ("zsync_parse: truncated",
+             !zsync_parse (control, size - 1, &zc));
+  control[strlen ("zsync: 0.6.2\nFilename: test\nBlocksize: ")] = '3';
+  mu_assert ("zsync_parse: block size not a power of 2",
+             !zsync_parse (control, size, &zc));
+  xfree (control);
+
+  mu_assert ("zsync_parse: not a control file",
+             !zsync_parse ("<html>\n\n", 8, &zc));
+  return NULL;
+}
+
+const char *
+test_zsync_match (void)
+{
+  static const int hash_lengths[][3] = { { 1, 4, 16 }, { 2, 2, 3 } };
+  enum { SIZE = 50000, BS = 512 };
+  unsigned char *old = xmalloc (SIZE), *new = xmalloc (SIZE + 100);
+  unsigned char *got = xmalloc (SIZE + 100);
+  int k, i;
+
+  /* NEW is OLD with bytes inserted at 10000, a block's worth changed at
+     30000 and its end cut, so that the blocks after the insertion have
+     moved by an amount that is not a multiple of the block size.  */
+  srand (1);
+  for (i = 0; i < SIZE; i++)
+    old[i] = rand ();
+  memcpy (new, old, 10000);
+  memset (new + 10000, 'x', 77);
+  memcpy (new + 10077, old + 10000, SIZE - 10000 - 1000);
+  memset (new + 30000, 'y', BS);
+
+  for (k = 0; k < (int) countof (hash_lengths); k++)
+    {
+      size_t new_size = SIZE + 77 - 1000, control_size;
+      struct zsync_control zc;
+      FILE *seed = tmpfile (), *out = tmpfile ();
+      bool *have;
+      char *control;
+      int missing = 0;
+      wgint found, placed = 0;
+
+      mu_assert ("tmpfile", seed && out);
+      fwrite (old, 1, SIZE, seed);
+      rewind (seed);
+      control_size = make_control (new, new_size, BS, hash_lengths[k][0],
+                                   hash_lengths[k][1], hash_lengths[k][2],
+                                   &control);
+      mu_assert ("zsync_match: control", zsync_parse (control, control_size,
+                                                      &zc));
+      have = xcalloc (zc.nblocks, sizeof (bool));
+      found = zsync_match (&zc, seed, out, have);
+      mu_assert ("zsync_match: found", found > 0);
+
+      /* Only the blocks with the insertion and the change are missing,
+         and those found are right.  */
+      memset (got, 0, new_size);
+      fflush (out);
+      rewind (out);
+      mu_assert ("zsync_match: read back",
+                 fread (got, 1, new_size, out) <= new_size);
+      for (i = 0; i < zc.nblocks; i++)
+        {
+          size_t pos = (size_t) i * BS, len = MIN (BS, new_size - pos);
+          if (!have[i])
+            missing++;
+          else
+            {
+              mu_assert ("zsync_match: block contents",
+                         !memcmp (got + pos, new + pos, len));
+              placed += len;
+            }
+        }
+      mu_assert ("zsync_match: missing blocks", missing == 4);
+      mu_assert ("zsync_match: byte count", found == placed);
+
+      xfree (have);
+      xfree (control);
+      zsync_control_free (&zc);
+      fclose (seed);
+      fclose (out);
+    }
+
+  xfree (old);
+  xfree (new);
+  xfree (got);
+  return NULL;
+}
+
+#endif /* TESTING */
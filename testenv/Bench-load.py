@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import time
+from misc.synthetic_site import SyntheticSite
+from server.http.load_server import LoadHTTPd, LoadHTTPSd
+
+"""
+    Load benchmark of Wget. A synthetic site of the requested shape is
+    served by the test suite's HTTP server and Wget is run against it in a
+    few typical ways. For each of them, the wall time, the number of
+    requests the server answered and their rate, the CPU time, the peak RSS
+    and, when strace is available, the number of system calls of the best
+    of several rounds are reported.
+
+    Run it from the testenv directory, for instance with
+        ./Bench-load.py --pages 500 --latency 2 recursive convert
+    or through 'make bench-load' with BENCH_LOAD_ARGS.
+"""
+
+SCENARIOS = {
+    # name: (description, Wget options; {url} is the URL of the home page)
+    "recursive": ("wget -r", ["-r", "-l", "inf", "{url}"]),
+    "input": ("wget -i", ["-i", "urls.txt"]),
+    "warc": ("wget -r --warc-file", ["-r", "-l", "inf",
+                                     "--warc-file=site", "{url}"]),
+    "convert": ("wget -r -k", ["-r", "-l", "inf", "-k", "{url}"]),
+}
+
+TEST_DIR = "Bench-load-test"
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description="Measure Wget against a synthetic site.")
+    parser.add_argument("scenarios", nargs="*", metavar="SCENARIO",
+                        help="among %s (default: all)" %
+                        ", ".join(sorted(SCENARIOS)))
+    parser.add_argument("--pages", type=int, default=200,
+                        help="number of HTML pages (default: %(default)s)")
+    parser.add_argument("--fanout", type=int, default=5,
+                        help="links to other pages on each page "
+                        "(default: %(default)s)")
+    parser.add_argument("--assets", type=int, default=2,
+                        help="assets each page refers to "
+                        "(default: %(default)s)")
+    parser.add_argument("--asset-size", type=int, default=16384,
+                        help="size of each asset in bytes "
+                        "(default: %(default)s)")
+    parser.add_argument("--latency", type=float, default=0,
+                        help="milliseconds the server waits before each "
+                        "response (default: %(default)s)")
+    parser.add_argument("--no-keep-alive", action="store_true",
+                        help="close the connection after each response")
+    parser.add_argument("--https", action="store_true",
+                        help="serve the site over HTTPS")
+    parser.add_argument("--rounds", type=int, default=3,
+                        help="runs of each scenario, the fastest of which "
+                        "is reported (default: %(default)s)")
+    parser.add_argument("--strace", action="store_true",
+                        help="count the system calls in one more run, "
+                        "under strace -c")
+    args = parser.parse_args()
+    for name in args.scenarios:
+        if name not in SCENARIOS:
+            parser.error("unknown scenario %s" % name)
+    args.scenarios = args.scenarios or ["recursive", "input",
+                                        "warc", "convert"]
+    return args
+
+
+def wget_path():
+    if os.getenv("WGET_PATH"):
+        return os.path.abspath(os.getenv("WGET_PATH"))
+    return os.path.abspath(os.path.join(os.path.dirname(sys.argv[0]),
+                                        "..", "src", "wget"))
+
+
+def high_water_mark(pid):
+    """ Return the peak RSS of process PID so far in KiB, None if it can't
+    be read. """
+    try:
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except (OSError, ValueError):
+        pass
+    return None
+
+
+def run_wget(cmd, strace_out=None):
+    """ Run CMD in a new empty directory and return its exit code, the
+    wall time it took, its resource usage and its peak RSS. """
+    if os.path.exists("run"):
+        shutil.rmtree("run")
+    os.mkdir("run")
+    shutil.copy("urls.txt", "run")
+    if strace_out:
+        cmd = ["strace", "-f", "-c", "-o", strace_out] + cmd
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, cwd="run",
+                            env={"HOME": os.getcwd(),
+                                 "PATH": os.environ["PATH"]})
+    # The ru_maxrss of a process started from this one is at least the
+    # RSS this one had then, so the peak is sampled from /proc while it
+    # runs where that is available.
+    peak = None
+    while True:
+        pid, status, rusage = os.wait4(proc.pid, os.WNOHANG)
+        if pid:
+            break
+        hwm = high_water_mark(proc.pid)
+        if hwm is not None:
+            peak = max(peak or 0, hwm)
+        time.sleep(0.002)
+    wall = time.monotonic() - start
+    # Keep Popen from waiting for the process once more.
+    proc.returncode = status >> 8 if os.WIFEXITED(status) else -1
+    return proc.returncode, wall, rusage, peak or rusage.ru_maxrss
+
+
+def count_syscalls(strace_out):
+    """ Return the total of the summary strace -c wrote to STRACE_OUT. """
+    with open(strace_out) as f:
+        for line in f:
+            fields = line.split()
+            if fields and fields[-1] == "total":
+                return int(fields[3])
+    return None
+
+
+def bench(args, server, scenario, url):
+    cmd = [wget_path(), "--no-config", "-q", "-e", "robots=off"]
+    if args.https:
+        cmd.append("--ca-certificate=" + CAFILE)
+    cmd += [o.format(url=url) for o in SCENARIOS[scenario][1]]
+
+    best = None
+    for _ in range(max(args.rounds, 1)):
+        before = server.requests_served()
+        ret, wall, rusage, peak = run_wget(cmd)
+        if ret != 0:
+            print("%s: Wget exited with %d" % (scenario, ret),
+                  file=sys.stderr)
+            return None
+        result = {"wall": wall,
+                  "requests": server.requests_served() - before,
+                  "user": rusage.ru_utime,
+                  "sys": rusage.ru_stime,
+                  "maxrss": peak}
+        if best is None or wall < best["wall"]:
+            best = result
+
+    best["syscalls"] = None
+    if args.strace and shutil.which("strace"):
+        strace_out = os.path.abspath("strace.out")
+        run_wget(cmd, strace_out)
+        best["syscalls"] = count_syscalls(strace_out)
+    return best
+
+
+def main():
+    global CAFILE
+    args = parse_args()
+    CAFILE = os.path.abspath(os.path.join(os.getenv("srcdir", "."),
+                                          "certs", "ca-cert.pem"))
+    if args.strace and not shutil.which("strace"):
+        print("strace not found, not counting the system calls",
+              file=sys.stderr)
+
+    if os.path.exists(TEST_DIR):
+        shutil.rmtree(TEST_DIR)
+    os.mkdir(TEST_DIR)
+    os.chdir(TEST_DIR)
+
+    load_conf = {"latency": args.latency / 1000,
+                 "keep_alive": not args.no_keep_alive}
+    server = (LoadHTTPSd if args.https else LoadHTTPd)(load_conf=load_conf)
+    server.start()
+    port = server.server_address[1]
+    scheme = "https" if args.https else "http"
+    base = "%s://localhost:%d/" % (scheme, port)
+
+    site = SyntheticSite(args.pages, args.fanout, args.assets,
+                         args.asset_size)
+    files = site.files(base)
+    server.server_conf({f.name: f.content for f in files},
+                       {f.name: {} for f in files})
+    with open("urls.txt", "w") as f:
+        for name in site.urls():
+            f.write(base + name + "\n")
+
+    print("%d pages, fan-out %d, %d assets of %d bytes, %g ms latency, "
+          "keep-alive %s, %s"
+          % (site.pages, site.fanout, site.assets, site.asset_size,
+             args.latency, "off" if args.no_keep_alive else "on",
+             scheme.upper()))
+    print("%-24s %9s %8s %9s %8s %8s %10s %9s"
+          % ("scenario", "wall s", "requests", "req/s",
+             "user s", "sys s", "maxrss KiB", "syscalls"))
+
+    failed = False
+    try:
+        for scenario in args.scenarios:
+            result = bench(args, server, scenario, base + "index.html")
+            if result is None:
+                failed = True
+                continue
+            syscalls = result["syscalls"]
+            print("%-24s %9.3f %8d %9.1f %8.3f %8.3f %10d %9s"
+                  % (SCENARIOS[scenario][0], result["wall"],
+                     result["requests"],
+                     result["requests"] / result["wall"],
+                     result["user"], result["sys"], result["maxrss"],
+                     "-" if syscalls is None else syscalls))
+    finally:
+        server.server_inst.shutdown()
+        os.chdir("..")
+        if not os.getenv("NO_CLEANUP"):
+            shutil.rmtree(TEST_DIR)
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
+
+# vim: set ts=4 sts=4 sw=4 tw=79 et :
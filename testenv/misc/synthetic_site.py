@@ -0,0 +1,78 @@
+from misc.wget_file import WgetFile
+
+
+class SyntheticSite:
+
+    """ SyntheticSite builds the files of a site of a given shape for the
+    load benchmark: PAGES HTML pages, each linking to FANOUT other pages
+    and referring to ASSETS assets of ASSET_SIZE bytes.
+
+    The pages form a tree rooted at index.html, page i linking to the pages
+    i * FANOUT + 1 to i * FANOUT + FANOUT, so that all of them are reached
+    by a recursive retrieval, and each links back to index.html and to its
+    parent so that the link conversion and the duplicate checks have some
+    work to do.  Half the links are absolute and half relative.  Half the
+    assets are images and half style sheets, named after their page. """
+
+    def __init__(self, pages=200, fanout=5, assets=2, asset_size=16384):
+        self.pages = max(pages, 1)
+        self.fanout = fanout
+        self.assets = assets
+        self.asset_size = asset_size
+
+    @staticmethod
+    def page_name(i):
+        return "index.html" if i == 0 else "dir%d/page%d.html" % (i % 10, i)
+
+    @staticmethod
+    def asset_name(i, j):
+        ext = "png" if j % 2 == 0 else "css"
+        return "assets/p%d-a%d.%s" % (i, j, ext)
+
+    def page_links(self, i):
+        links = [self.fanout * i + k
+                 for k in range(1, self.fanout + 1)
+                 if self.fanout * i + k < self.pages]
+        if i:
+            links += [0, (i - 1) // self.fanout if self.fanout else 0]
+        return links
+
+    def page_content(self, i):
+        out = ["<html>\n<head>\n  <title>Page %d</title>\n" % i]
+        for j in range(1, self.assets, 2):
+            out.append('  <link rel="stylesheet" href="/%s">\n'
+                       % self.asset_name(i, j))
+        out.append("</head>\n<body>\n")
+        for n, link in enumerate(self.page_links(i)):
+            if n % 2:
+                href = "{{base}}" + self.page_name(link)
+            else:
+                href = "/" + self.page_name(link)
+            out.append('  <p>Go to <a href="%s">page %d</a>.</p>\n'
+                       % (href, link))
+        for j in range(0, self.assets, 2):
+            out.append('  <img src="/%s" alt="asset %d">\n'
+                       % (self.asset_name(i, j), j))
+        out.append("</body>\n</html>\n")
+        return "".join(out)
+
+    def files(self, base):
+        """ Return the list of WgetFile of the site, its absolute links
+        starting with BASE, such as "http://localhost:8080/". """
+        asset = "x" * self.asset_size
+        files = []
+        for i in range(self.pages):
+            content = self.page_content(i).replace("{{base}}", base)
+            files.append(WgetFile(self.page_name(i), content))
+            for j in range(self.assets):
+                files.append(WgetFile(self.asset_name(i, j), asset))
+        return files
+
+    def urls(self):
+        """ Return the paths of all the files of the site. """
+        return [name
+                for i in range(self.pages)
+                for name in [self.page_name(i)] +
+                            [self.asset_name(i, j) for j in range(self.assets)]]
+
+# vim: set ts=4 sts=4 sw=4 tw=79 et :
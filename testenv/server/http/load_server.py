@@ -0,0 +1,49 @@
+from server.http.http_server import HTTPd, HTTPSd, _Handler
+import time
+
+
+class _LoadHandler(_Handler):
+    """ Handler of the load benchmark. It serves the files like the handler
+    of the functional tests, but waits for the configured latency before
+    answering each request and may refuse to keep the connection alive.
+    The load_conf dict of the server carries the two settings under the
+    "latency" (in seconds) and "keep_alive" keys. """
+
+    # The headers and the body are written separately, the delayed ACK of
+    # the second write would otherwise be most of the time measured.
+    disable_nagle_algorithm = True
+
+    def send_head(self, method):
+        latency = self.server.load_conf.get("latency", 0)
+        if latency:
+            time.sleep(latency)
+        return super(_LoadHandler, self).send_head(method)
+
+    def finish_headers(self):
+        if not self.server.load_conf.get("keep_alive", True):
+            # send_header() notices the header and closes the connection
+            # once the response is written.
+            self.add_header("Connection", "close")
+        super(_LoadHandler, self).finish_headers()
+
+    def log_message(self, format, *args):
+        # One line per request would be most of what the benchmark
+        # measures on a fast machine.
+        pass
+
+
+class LoadHTTPd(HTTPd):
+    handler = _LoadHandler
+
+    def __init__(self, addr=None, load_conf=None):
+        super(LoadHTTPd, self).__init__(addr)
+        self.server_inst.load_conf = load_conf or {}
+
+    def requests_served(self):
+        return len(self.server_inst.get_req_headers())
+
+
+class LoadHTTPSd(LoadHTTPd):
+    server_class = HTTPSd.server_class
+
+# vim: set ts=4 sts=4 sw=4 tw=79 et :
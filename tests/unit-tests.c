@@ -50,22 +50,80 @@ all_tests(void)
   mu_run_test (test_has_key);
 #endif
   mu_run_test (test_parse_content_disposition);
+  mu_run_test (test_resp_header_locate);
+#ifdef ENABLE_DIGEST
+  mu_run_test (test_digest_answered_ahead);
+#endif
+  mu_run_test (test_drain_limit);
+  mu_run_test (test_host_budget);
+  mu_run_test (test_retry_after);
+  mu_run_test (test_parse_cache_freshness);
   mu_run_test (test_parse_range_header);
   mu_run_test (test_subdir_p);
   mu_run_test (test_dir_matches_p);
+  mu_run_test (test_in_acclist);
+#ifdef UNIQ_SEP
+  mu_run_test (test_unique_name);
+#endif
+  mu_run_test (test_write_file_at);
+#ifdef HAVE_SSL
+  mu_run_test (test_cert_verify_cache);
+#endif
   mu_run_test (test_commands_sorted);
   mu_run_test (test_cmd_spec_restrict_file_names);
   mu_run_test (test_path_simplify);
   mu_run_test (test_append_url_pathel);
   mu_run_test (test_are_urls_equal);
+  mu_run_test (test_url_set);
+#ifdef ENABLE_MEMACCT
+  mu_run_test (test_memacct_blocks);
+#endif
+  mu_run_test (test_metrics_record);
+  mu_run_test (test_register_download);
+  mu_run_test (test_throttle_bucket);
+  mu_run_test (test_url_queue);
+  mu_run_test (test_url_queue_order);
+  mu_run_test (test_css_urls);
+#ifdef ENABLE_IRI
+  mu_run_test (test_transcode);
+  mu_run_test (test_idn_encode);
+#endif
+  mu_run_test (test_url_parse_parts);
+  mu_run_test (test_url_file_name);
+  mu_run_test (test_mkalldirs);
+  mu_run_test (test_url_intern_host);
+  mu_run_test (test_url_merge_base_length);
+  mu_run_test (test_url_escapes);
+  mu_run_test (test_cookie_header);
+  mu_run_test (test_cookie_jar_index);
   mu_run_test (test_is_robots_txt_url);
+  mu_run_test (test_res_match_path);
+  mu_run_test (test_res_crawl_delay);
 #ifdef HAVE_HSTS
   mu_run_test (test_hsts_new_entry);
   mu_run_test (test_hsts_url_rewrite_superdomain);
   mu_run_test (test_hsts_url_rewrite_congruent);
   mu_run_test (test_hsts_read_database);
+  mu_run_test (test_hsts_append_database);
+#endif
+#ifdef HAVE_HTTP3
+  mu_run_test (test_altsvc_parse);
 #endif
   mu_run_test (test_parse_netrc);
+  mu_run_test (test_dns_cache_read);
+  mu_run_test (test_sufmatch);
+  mu_run_test (test_validators_read);
+  mu_run_test (test_http_cache_entry_parse);
+  mu_run_test (test_cluster_parse_node);
+#ifndef WINDOWS
+  mu_run_test (test_fd_read_hunk);
+#endif
+  mu_run_test (test_dechunk);
+  mu_run_test (test_moved_permanently);
+  mu_run_test (test_retry_backoff);
+  mu_run_test (test_status_hosts);
+  mu_run_test (test_zsync_parse);
+  mu_run_test (test_zsync_match);
 
   return NULL;
 }
@@ -48,20 +48,72 @@ const char *test_has_key (void);
 const char *test_find_key_value (void);
 const char *test_find_key_values (void);
 const char *test_parse_content_disposition(void);
+const char *test_resp_header_locate(void);
+#ifdef ENABLE_DIGEST
+const char *test_digest_answered_ahead(void);
+#endif
+const char *test_drain_limit(void);
+const char *test_host_budget(void);
+const char *test_retry_after(void);
+const char *test_parse_cache_freshness(void);
 const char *test_parse_range_header(void);
 const char *test_commands_sorted(void);
 const char *test_cmd_spec_restrict_file_names(void);
+const char *test_cookie_header(void);
+const char *test_cookie_jar_index(void);
 const char *test_is_robots_txt_url(void);
+const char *test_res_match_path(void);
+const char *test_res_crawl_delay(void);
 const char *test_path_simplify (void);
 const char *test_append_url_pathel(void);
 const char *test_are_urls_equal(void);
+const char *test_url_set(void);
+#ifdef ENABLE_MEMACCT
+const char *test_memacct_blocks(void);
+#endif
+const char *test_metrics_record(void);
+const char *test_register_download(void);
+const char *test_throttle_bucket(void);
+const char *test_url_queue(void);
+const char *test_url_queue_order(void);
+const char *test_css_urls(void);
+const char *test_transcode(void);
+const char *test_idn_encode(void);
+const char *test_url_parse_parts(void);
+const char *test_url_file_name(void);
+const char *test_mkalldirs(void);
+const char *test_url_intern_host(void);
+const char *test_url_merge_base_length(void);
+const char *test_url_escapes(void);
 const char *test_subdir_p(void);
 const char *test_dir_matches_p(void);
+const char *test_in_acclist(void);
+const char *test_unique_name(void);
+const char *test_write_file_at(void);
+#ifdef HAVE_SSL
+const char *test_cert_verify_cache(void);
+#endif
 const char *test_hsts_new_entry(void);
 const char *test_hsts_url_rewrite_superdomain(void);
 const char *test_hsts_url_rewrite_congruent(void);
 const char *test_hsts_read_database(void);
+const char *test_hsts_append_database(void);
+#ifdef HAVE_HTTP3
+const char *test_altsvc_parse(void);
+#endif
 const char *test_parse_netrc(void);
+const char *test_dns_cache_read(void);
+const char *test_sufmatch(void);
+const char *test_validators_read(void);
+const char *test_http_cache_entry_parse(void);
+const char *test_cluster_parse_node(void);
+const char *test_fd_read_hunk(void);
+const char *test_dechunk(void);
+const char *test_moved_permanently(void);
+const char *test_retry_backoff(void);
+const char *test_status_hosts(void);
+const char *test_zsync_parse(void);
+const char *test_zsync_match(void);
 
 #endif /* TEST_H */
 